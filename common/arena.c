@@ -0,0 +1,84 @@
+#include "common.h"
+
+#include "arena.h"
+
+#define DEFAULT_CHUNK_SIZE (16 << 10)
+#define ARENA_ALIGN 8
+
+struct SeafArena {
+    GSList *chunks;
+    char *ptr;
+    gsize left;
+    gsize chunk_size;
+};
+
+SeafArena *
+seaf_arena_new (gsize chunk_size)
+{
+    SeafArena *arena = g_new0 (SeafArena, 1);
+
+    arena->chunk_size = chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE;
+    return arena;
+}
+
+void
+seaf_arena_free (SeafArena *arena)
+{
+    if (!arena)
+        return;
+    g_slist_free_full (arena->chunks, g_free);
+    g_free (arena);
+}
+
+gpointer
+seaf_arena_alloc (SeafArena *arena, gsize size)
+{
+    char *chunk;
+    gpointer ret;
+
+    size = (size + ARENA_ALIGN - 1) & ~((gsize)ARENA_ALIGN - 1);
+
+    if (size > arena->left) {
+        /* Large objects get a chunk of their own, so the rest of the
+         * current chunk isn't wasted.
+         */
+        if (size > arena->chunk_size / 4) {
+            chunk = g_malloc (size);
+            arena->chunks = g_slist_prepend (arena->chunks, chunk);
+            return chunk;
+        }
+        chunk = g_malloc (arena->chunk_size);
+        arena->chunks = g_slist_prepend (arena->chunks, chunk);
+        arena->ptr = chunk;
+        arena->left = arena->chunk_size;
+    }
+
+    ret = arena->ptr;
+    arena->ptr += size;
+    arena->left -= size;
+    return ret;
+}
+
+char *
+seaf_arena_strdup (SeafArena *arena, const char *str)
+{
+    gsize len;
+    char *ret;
+
+    if (!str)
+        return NULL;
+
+    len = strlen (str) + 1;
+    ret = seaf_arena_alloc (arena, len);
+    memcpy (ret, str, len);
+    return ret;
+}
+
+SeafDirent *
+seaf_arena_dirent_view (SeafArena *arena, const SeafDirent *dent)
+{
+    SeafDirent *view = seaf_arena_alloc (arena, sizeof(SeafDirent));
+
+    memcpy (view, dent, sizeof(SeafDirent));
+    return view;
+}
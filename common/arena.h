@@ -0,0 +1,37 @@
+#ifndef SEAF_ARENA_H
+#define SEAF_ARENA_H
+
+#include "fs-mgr.h"
+
+/*
+ * A bump allocator for objects that live as long as one traversal,
+ * such as the dirents of a merged dir. Memory is only returned
+ * all at once by seaf_arena_free(). An arena is not thread-safe,
+ * each thread of a traversal uses its own.
+ */
+
+typedef struct SeafArena SeafArena;
+
+/* @chunk_size 0 uses the default size. No memory is allocated
+ * before the first allocation.
+ */
+SeafArena *
+seaf_arena_new (gsize chunk_size);
+
+void
+seaf_arena_free (SeafArena *arena);
+
+gpointer
+seaf_arena_alloc (SeafArena *arena, gsize size);
+
+char *
+seaf_arena_strdup (SeafArena *arena, const char *str);
+
+/* A copy of @dent in the arena, that borrows name and modifier from
+ * @dent. It must not be passed to seaf_dirent_free() and is valid
+ * as long as the arena and @dent.
+ */
+SeafDirent *
+seaf_arena_dirent_view (SeafArena *arena, const SeafDirent *dent);
+
+#endif
@@ -0,0 +1,273 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "log.h"
+#include "bg-throttle.h"
+
+/* Operations may run ahead of the limits by this much. */
+#define BURST_USEC (G_USEC_PER_SEC / 10)
+
+/* Back off while the recent latency is this many times the average. */
+#define BUSY_FACTOR 3
+#define MIN_BACKOFF_USEC 1000
+#define MAX_BACKOFF_USEC G_USEC_PER_SEC
+
+enum {
+    LIMIT_OBJECTS,
+    LIMIT_BYTES,
+    LIMIT_DELETES,
+    N_LIMITS,
+};
+
+struct BgThrottle {
+    pthread_mutex_t lock;
+
+    /* Operations per second, 0 for no limit. */
+    double rate[N_LIMITS];
+    /* When the operations charged so far are paid off. */
+    gint64 paid_until[N_LIMITS];
+
+    gboolean adaptive;
+    /* Moving averages of the latency over the last few and the last
+     * thousands of operations, in microseconds. */
+    double recent_latency;
+    double avg_latency;
+    gint64 backoff;
+
+    int io_prio;                /* -1 to leave it */
+    int nice;
+};
+
+static BgThrottle *global_throttle;
+static GPrivate thread_throttle;
+/* The io priority of the thread before attaching, plus 1. */
+static GPrivate saved_io_prio;
+
+#ifdef __linux__
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#endif
+
+static int
+parse_io_class (const char *io_class)
+{
+#ifdef __linux__
+    if (g_strcmp0 (io_class, "idle") == 0)
+        return IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0);
+    if (g_strcmp0 (io_class, "low") == 0)
+        return IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 7);
+    if (g_strcmp0 (io_class, "normal") == 0)
+        return IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 4);
+#endif
+    return -1;
+}
+
+/* Linux sets io priorities and nice values per thread. */
+static int
+set_io_prio (int prio)
+{
+#ifdef __linux__
+    return syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+#else
+    return -1;
+#endif
+}
+
+static int
+get_io_prio ()
+{
+#ifdef __linux__
+    return syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+#else
+    return -1;
+#endif
+}
+
+BgThrottle *
+bg_throttle_new (GKeyFile *config, const char *group)
+{
+    BgThrottle *throttle;
+    char *io_class;
+    int objects, mb, deletes;
+
+    objects = g_key_file_get_integer (config, group, "max_objects_per_sec", NULL);
+    mb = g_key_file_get_integer (config, group, "max_mb_per_sec", NULL);
+    deletes = g_key_file_get_integer (config, group, "max_deletes_per_sec", NULL);
+
+    throttle = g_new0 (BgThrottle, 1);
+    pthread_mutex_init (&throttle->lock, NULL);
+    throttle->rate[LIMIT_OBJECTS] = MAX (objects, 0);
+    throttle->rate[LIMIT_BYTES] = (double)MAX (mb, 0) * (1 << 20);
+    throttle->rate[LIMIT_DELETES] = MAX (deletes, 0);
+    throttle->adaptive = g_key_file_get_boolean (config, group,
+                                                 "adaptive_backoff", NULL);
+    throttle->nice = g_key_file_get_integer (config, group, "nice", NULL);
+
+    io_class = g_key_file_get_string (config, group, "io_priority", NULL);
+    throttle->io_prio = parse_io_class (io_class);
+    if (io_class && throttle->io_prio < 0)
+        seaf_warning ("Unknown io_priority %s in [%s].\n", io_class, group);
+    g_free (io_class);
+
+    if (objects <= 0 && mb <= 0 && deletes <= 0 && !throttle->adaptive &&
+        throttle->io_prio < 0 && throttle->nice == 0) {
+        bg_throttle_free (throttle);
+        return NULL;
+    }
+
+    seaf_message ("Background jobs of [%s] are limited to %d objects, %d MB "
+                  "and %d deletes per second (0 for no limit)%s.\n",
+                  group, objects, mb, deletes,
+                  throttle->adaptive ? ", with adaptive backoff" : "");
+
+    return throttle;
+}
+
+void
+bg_throttle_free (BgThrottle *throttle)
+{
+    if (!throttle)
+        return;
+    pthread_mutex_destroy (&throttle->lock);
+    g_free (throttle);
+}
+
+void
+bg_throttle_set_global (BgThrottle *throttle)
+{
+    global_throttle = throttle;
+}
+
+void
+bg_throttle_attach (BgThrottle *throttle)
+{
+    g_private_set (&thread_throttle, throttle);
+    if (!throttle || throttle->io_prio < 0)
+        return;
+
+    g_private_set (&saved_io_prio, GINT_TO_POINTER (get_io_prio () + 1));
+    set_io_prio (throttle->io_prio);
+}
+
+void
+bg_throttle_detach ()
+{
+    int saved = GPOINTER_TO_INT (g_private_get (&saved_io_prio)) - 1;
+
+    g_private_set (&thread_throttle, NULL);
+    if (saved >= 0) {
+        set_io_prio (saved);
+        g_private_set (&saved_io_prio, NULL);
+    }
+}
+
+void
+bg_set_priority (const char *io_class, int nice)
+{
+    int prio = parse_io_class (io_class);
+
+    if (prio >= 0 && set_io_prio (prio) < 0)
+        seaf_warning ("Failed to set io priority: %s.\n", strerror(errno));
+#ifdef __linux__
+    if (nice != 0 && setpriority (PRIO_PROCESS, 0, nice) < 0)
+        seaf_warning ("Failed to set nice value: %s.\n", strerror(errno));
+#endif
+}
+
+void
+bg_throttle_apply_priority (BgThrottle *throttle)
+{
+    if (!throttle)
+        return;
+
+    if (throttle->io_prio >= 0 && set_io_prio (throttle->io_prio) < 0)
+        seaf_warning ("Failed to set io priority: %s.\n", strerror(errno));
+#ifdef __linux__
+    if (throttle->nice != 0 && setpriority (PRIO_PROCESS, 0, throttle->nice) < 0)
+        seaf_warning ("Failed to set nice value: %s.\n", strerror(errno));
+#endif
+}
+
+static BgThrottle *
+current_throttle ()
+{
+    BgThrottle *throttle = g_private_get (&thread_throttle);
+
+    return throttle ? throttle : global_throttle;
+}
+
+gint64
+bg_throttle_begin ()
+{
+    if (!current_throttle ())
+        return 0;
+    return g_get_monotonic_time ();
+}
+
+/* Must be called with the lock held. */
+static void
+update_backoff (BgThrottle *throttle, double latency)
+{
+    if (throttle->avg_latency == 0) {
+        throttle->avg_latency = latency;
+        throttle->recent_latency = latency;
+        return;
+    }
+    throttle->recent_latency = 0.9 * throttle->recent_latency + 0.1 * latency;
+    throttle->avg_latency = 0.999 * throttle->avg_latency + 0.001 * latency;
+
+    if (throttle->recent_latency > BUSY_FACTOR * throttle->avg_latency)
+        throttle->backoff = CLAMP (throttle->backoff * 2,
+                                   MIN_BACKOFF_USEC, MAX_BACKOFF_USEC);
+    else
+        throttle->backoff /= 2;
+}
+
+void
+bg_throttle_charge (gint64 start, int objects, gint64 bytes, int deletes)
+{
+    BgThrottle *throttle;
+    double amount[N_LIMITS];
+    gint64 now, wait = 0, t;
+    int i;
+
+    if (start == 0)
+        return;
+    throttle = current_throttle ();
+    if (!throttle)
+        return;
+
+    amount[LIMIT_OBJECTS] = objects;
+    amount[LIMIT_BYTES] = bytes;
+    amount[LIMIT_DELETES] = deletes;
+
+    now = g_get_monotonic_time ();
+
+    pthread_mutex_lock (&throttle->lock);
+    for (i = 0; i < N_LIMITS; ++i) {
+        if (throttle->rate[i] <= 0 || amount[i] <= 0)
+            continue;
+        t = MAX (throttle->paid_until[i], now) +
+            (gint64)(amount[i] * G_USEC_PER_SEC / throttle->rate[i]);
+        throttle->paid_until[i] = t;
+        wait = MAX (wait, t - now - BURST_USEC);
+    }
+    if (throttle->adaptive) {
+        update_backoff (throttle, (double)(now - start));
+        wait += throttle->backoff;
+    }
+    pthread_mutex_unlock (&throttle->lock);
+
+    if (wait > 0)
+        g_usleep (wait);
+}
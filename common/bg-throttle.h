@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BG_THROTTLE_H
+#define BG_THROTTLE_H
+
+#include <glib.h>
+
+/*
+ * Rate limits for background jobs that scan or clean the storage: GC, fsck
+ * and repo size computation. The object store and the block manager charge
+ * their reads and deletes to the throttle of the calling thread, or to the
+ * process-wide one, and sleep when a limit is exceeded. Threads without a
+ * throttle aren't affected.
+ *
+ * Limits are read from a group of seafile.conf, e.g. [gc]:
+ *
+ *   max_objects_per_sec = 2000  # fs objects and commits read
+ *   max_mb_per_sec = 50         # block data read
+ *   max_deletes_per_sec = 500   # blocks and objects removed
+ *   adaptive_backoff = true     # slow down when the storage gets slower
+ *   io_priority = idle          # idle, low or normal
+ *   nice = 19                   # standalone tools only
+ *
+ * With adaptive_backoff, the latency of the charged operations is compared
+ * to its long-term average. While it's several times higher, the storage is
+ * taken to be busy serving users, and the job backs off further on every
+ * operation until the latency drops.
+ */
+
+typedef struct BgThrottle BgThrottle;
+
+/* Returns NULL if nothing is configured in @group. */
+BgThrottle *
+bg_throttle_new (GKeyFile *config, const char *group);
+
+void
+bg_throttle_free (BgThrottle *throttle);
+
+/* Charge the storage operations of all threads to @throttle. */
+void
+bg_throttle_set_global (BgThrottle *throttle);
+
+/*
+ * Charge the storage operations of the calling thread to @throttle, and
+ * switch the thread to its io priority, until bg_throttle_detach().
+ * @throttle can be NULL.
+ */
+void
+bg_throttle_attach (BgThrottle *throttle);
+
+void
+bg_throttle_detach ();
+
+/*
+ * Sets the io priority and nice value configured in @throttle for the
+ * calling thread and the threads it creates later.
+ */
+void
+bg_throttle_apply_priority (BgThrottle *throttle);
+
+/*
+ * @io_class is "idle", "low" or "normal", NULL leaves it. A @nice of 0
+ * leaves it.
+ */
+void
+bg_set_priority (const char *io_class, int nice);
+
+/* Returns the start time to pass to bg_throttle_charge(), 0 if the caller
+ * is not throttled. */
+gint64
+bg_throttle_begin ();
+
+/*
+ * Charges operations started at @start. Sleeps if the throttle of the
+ * caller is over a limit. Does nothing if @start is 0.
+ */
+void
+bg_throttle_charge (gint64 start, int objects, gint64 bytes, int deletes);
+
+#endif
@@ -0,0 +1,747 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Read-through block cache on a fast local directory (e.g. an SSD) in front
+ * of another block backend.
+ *
+ * Blocks are content-addressed, so a cached copy never becomes stale. Reads
+ * are served from the cache directory when the block is there. On a miss the
+ * block is read from the underlying backend, and a worker thread copies it
+ * into the cache in the background. Writes go to the underlying backend only;
+ * removing a block removes it from both. When the cache grows over its size
+ * limit, the least recently used blocks are deleted.
+ *
+ * The cache directory may be shared with the Go fileserver. Each process
+ * keeps its own LRU index, built by scanning the directory at startup and
+ * updated on hits, so blocks added by the other process are picked up too.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "block-backend.h"
+
+#define DEFAULT_CACHE_SIZE (10LL << 30)
+#define DEFAULT_FILL_THREADS 2
+#define CACHE_TMP_DIR "tmp"
+
+struct _BHandle {
+    BHandle *base_handle;   /* handle of the underlying backend on a miss */
+    int      fd;            /* fd of the cached block on a hit */
+    int      rw_type;
+    char     block_id[41];
+};
+
+typedef struct CacheEntry {
+    char    *key;           /* store_id/block_id */
+    gint64   size;
+    GList    link;
+} CacheEntry;
+
+typedef struct FillTask {
+    char    *store_id;
+    int      version;
+    char     block_id[41];
+} FillTask;
+
+typedef struct {
+    BlockBackend   *base;
+    char           *cache_dir;
+    char           *tmp_dir;
+    gint64          max_bytes;
+
+    pthread_mutex_t lock;
+    GHashTable     *entries;    /* key -> CacheEntry */
+    GQueue          lru;        /* most recently used at head */
+    gint64          bytes;
+    /* keys of blocks being copied to the cache -> FILL_* */
+    GHashTable     *filling;
+
+    GThreadPool    *fill_pool;
+} CachePriv;
+
+/* A block removed while it's being copied is not put into the cache. */
+#define FILL_RUNNING GINT_TO_POINTER(1)
+#define FILL_CANCELLED GINT_TO_POINTER(2)
+
+static void
+get_cache_path (CachePriv *priv, const char *store_id,
+                const char *block_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%s/%.2s/%s",
+              priv->cache_dir, store_id, block_id, block_id + 2);
+}
+
+static char *
+make_key (const char *store_id, const char *block_id)
+{
+    return g_strdup_printf ("%s/%s", store_id, block_id);
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+    g_free (entry->key);
+    g_free (entry);
+}
+
+/* Must be called with the lock held. */
+static void
+remove_entry (CachePriv *priv, CacheEntry *entry)
+{
+    g_hash_table_remove (priv->entries, entry->key);
+    g_queue_unlink (&priv->lru, &entry->link);
+    priv->bytes -= entry->size;
+    cache_entry_free (entry);
+}
+
+/* Must be called with the lock held. */
+static void
+evict_blocks (CachePriv *priv)
+{
+    GList *tail;
+    CacheEntry *entry;
+    char path[SEAF_PATH_MAX];
+
+    while (priv->bytes > priv->max_bytes &&
+           (tail = g_queue_peek_tail_link (&priv->lru)) != NULL) {
+        entry = tail->data;
+        snprintf (path, SEAF_PATH_MAX, "%s/%.36s/%.2s/%s", priv->cache_dir,
+                  entry->key, entry->key + 37, entry->key + 39);
+        g_unlink (path);
+        remove_entry (priv, entry);
+    }
+}
+
+/*
+ * Record a block in the LRU index, or mark it as recently used if it's
+ * already there.
+ */
+static void
+touch_entry (CachePriv *priv, const char *store_id,
+             const char *block_id, gint64 size)
+{
+    CacheEntry *entry;
+    char *key = make_key (store_id, block_id);
+
+    pthread_mutex_lock (&priv->lock);
+
+    entry = g_hash_table_lookup (priv->entries, key);
+    if (entry) {
+        g_queue_unlink (&priv->lru, &entry->link);
+        g_queue_push_head_link (&priv->lru, &entry->link);
+        g_free (key);
+    } else {
+        entry = g_new0 (CacheEntry, 1);
+        entry->key = key;
+        entry->size = size;
+        entry->link.data = entry;
+        g_hash_table_insert (priv->entries, entry->key, entry);
+        g_queue_push_head_link (&priv->lru, &entry->link);
+        priv->bytes += size;
+        evict_blocks (priv);
+    }
+
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static void
+drop_cached_block (CachePriv *priv, const char *store_id, const char *block_id)
+{
+    char path[SEAF_PATH_MAX];
+    CacheEntry *entry;
+    char *key = make_key (store_id, block_id);
+
+    get_cache_path (priv, store_id, block_id, path);
+
+    pthread_mutex_lock (&priv->lock);
+    entry = g_hash_table_lookup (priv->entries, key);
+    if (entry)
+        remove_entry (priv, entry);
+    g_unlink (path);
+    if (g_hash_table_lookup (priv->filling, key))
+        g_hash_table_replace (priv->filling, g_strdup (key), FILL_CANCELLED);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (key);
+}
+
+static int
+copy_to_cache (CachePriv *priv, FillTask *task, const char *key,
+               const char *path, gint64 *size)
+{
+    BlockBackend *base = priv->base;
+    BHandle *handle;
+    char *tmp_path = NULL;
+    char *dir = NULL;
+    char buf[64 * 1024];
+    int fd = -1;
+    int n;
+    int ret = 0;
+
+    handle = base->open_block (base, task->store_id, task->version,
+                               task->block_id, BLOCK_READ);
+    if (!handle)
+        return -1;
+
+    tmp_path = g_strdup_printf ("%s/%s.XXXXXX", priv->tmp_dir, task->block_id);
+    fd = g_mkstemp (tmp_path);
+    if (fd < 0) {
+        seaf_warning ("[block cache] Failed to create tmp file %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    *size = 0;
+    while ((n = base->read_block (base, handle, buf, sizeof(buf))) > 0) {
+        if (writen (fd, buf, n) != n) {
+            seaf_warning ("[block cache] Failed to write %s: %s.\n",
+                          tmp_path, strerror(errno));
+            ret = -1;
+            goto out;
+        }
+        *size += n;
+    }
+    if (n < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (close (fd) < 0) {
+        fd = -1;
+        ret = -1;
+        goto out;
+    }
+    fd = -1;
+
+    dir = g_path_get_dirname (path);
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        seaf_warning ("[block cache] Failed to create %s: %s.\n",
+                      dir, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    /* Checked under the lock, so that a removal can't run in between. */
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->filling, key) == FILL_CANCELLED) {
+        ret = -1;
+    } else if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[block cache] Failed to move block to %s: %s.\n",
+                      path, strerror(errno));
+        ret = -1;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+out:
+    if (fd >= 0)
+        close (fd);
+    if (ret < 0 && tmp_path)
+        g_unlink (tmp_path);
+    g_free (tmp_path);
+    g_free (dir);
+    base->close_block (base, handle);
+    base->block_handle_free (base, handle);
+    return ret;
+}
+
+static void
+fill_block (gpointer data, gpointer user_data)
+{
+    FillTask *task = data;
+    CachePriv *priv = user_data;
+    char path[SEAF_PATH_MAX];
+    char *key = make_key (task->store_id, task->block_id);
+    gint64 size;
+
+    get_cache_path (priv, task->store_id, task->block_id, path);
+
+    if (g_access (path, F_OK) != 0 &&
+        copy_to_cache (priv, task, key, path, &size) == 0)
+        touch_entry (priv, task->store_id, task->block_id, size);
+
+    pthread_mutex_lock (&priv->lock);
+    g_hash_table_remove (priv->filling, key);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (key);
+    g_free (task->store_id);
+    g_free (task);
+}
+
+static void
+schedule_fill (CachePriv *priv, const char *store_id,
+               int version, const char *block_id)
+{
+    FillTask *task;
+    char *key = make_key (store_id, block_id);
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->filling, key)) {
+        pthread_mutex_unlock (&priv->lock);
+        g_free (key);
+        return;
+    }
+    g_hash_table_insert (priv->filling, key, FILL_RUNNING);
+    pthread_mutex_unlock (&priv->lock);
+
+    task = g_new0 (FillTask, 1);
+    task->store_id = g_strdup (store_id);
+    task->version = version;
+    memcpy (task->block_id, block_id, 41);
+    g_thread_pool_push (priv->fill_pool, task, NULL);
+}
+
+static BHandle *
+block_backend_cache_open_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id,
+                                int rw_type)
+{
+    CachePriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    BHandle *handle;
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    int fd;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->fd = -1;
+    handle->rw_type = rw_type;
+    memcpy (handle->block_id, block_id, 41);
+
+    if (rw_type == BLOCK_READ) {
+        get_cache_path (priv, store_id, block_id, path);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd >= 0 && seaf_fstat (fd, &st) == 0) {
+            handle->fd = fd;
+            touch_entry (priv, store_id, block_id, st.st_size);
+            return handle;
+        }
+        if (fd >= 0)
+            close (fd);
+    }
+
+    handle->base_handle = base->open_block (base, store_id, version,
+                                            block_id, rw_type);
+    if (!handle->base_handle) {
+        g_free (handle);
+        return NULL;
+    }
+
+    if (rw_type == BLOCK_READ)
+        schedule_fill (priv, store_id, version, block_id);
+
+    return handle;
+}
+
+static int
+block_backend_cache_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int ret;
+
+    if (handle->base_handle)
+        return priv->base->read_block (priv->base, handle->base_handle, buf, len);
+
+    ret = readn (handle->fd, buf, len);
+    if (ret < 0)
+        seaf_warning ("[block cache] Failed to read cached block: %s.\n",
+                      strerror (errno));
+    return ret;
+}
+
+static int
+block_backend_cache_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->write_block (priv->base, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_cache_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->commit_block (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_cache_close_block (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->base_handle)
+        return priv->base->close_block (priv->base, handle->base_handle);
+
+    return close (handle->fd);
+}
+
+static void
+block_backend_cache_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->base_handle)
+        priv->base->block_handle_free (priv->base, handle->base_handle);
+    g_free (handle);
+}
+
+static int
+block_backend_cache_block_exists (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    char path[SEAF_PATH_MAX];
+
+    get_cache_path (priv, store_id, block_id, path);
+    if (g_access (path, F_OK) == 0)
+        return TRUE;
+
+    return priv->base->exists (priv->base, store_id, version, block_id);
+}
+
+static void
+block_backend_cache_blocks_exist (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *results)
+{
+    CachePriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    int i;
+
+    /* Don't bother checking the cache. Blocks are only cached after reading,
+     * while existence checks are mostly for blocks to be uploaded.
+     */
+    if (base->exists_many) {
+        base->exists_many (base, store_id, version, block_ids, n_blocks, results);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+        results[i] = base->exists (base, store_id, version, block_ids[i]);
+}
+
+static int
+block_backend_cache_remove_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    int ret;
+
+    drop_cached_block (priv, store_id, block_id);
+    ret = priv->base->remove_block (priv->base, store_id, version, block_id);
+    /* A fill that opened the base block before it was removed may have
+     * cached it again by now, or is cancelled. Later fills find no block.
+     */
+    drop_cached_block (priv, store_id, block_id);
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_cache_stat_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    BMetadata *block_md;
+
+    get_cache_path (priv, store_id, block_id, path);
+    if (seaf_stat (path, &st) < 0)
+        return priv->base->stat_block (priv->base, store_id, version, block_id);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t) st.st_size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_cache_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    SeafStat st;
+    BMetadata *block_md;
+
+    if (handle->base_handle)
+        return priv->base->stat_block_by_handle (priv->base, handle->base_handle);
+
+    if (seaf_fstat (handle->fd, &st) < 0) {
+        seaf_warning ("[block cache] Failed to stat cached block: %s.\n",
+                      strerror (errno));
+        return NULL;
+    }
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = (uint32_t) st.st_size;
+
+    return block_md;
+}
+
+static int
+block_backend_cache_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->rw_type != BLOCK_READ)
+        return -1;
+
+    if (!handle->base_handle)
+        return handle->fd;
+
+    if (!priv->base->get_fd)
+        return -1;
+    return priv->base->get_fd (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_cache_foreach_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block (priv->base, store_id, version,
+                                      process, user_data);
+}
+
+static int
+block_backend_cache_foreach_block_parallel (BlockBackend *bend,
+                                            const char *store_id,
+                                            int version,
+                                            int max_threads,
+                                            SeafBlockFunc process,
+                                            void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block_parallel (priv->base, store_id, version,
+                                               max_threads, process, user_data);
+}
+
+static int
+block_backend_cache_touch_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->touch (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_cache_copy (BlockBackend *bend,
+                          const char *src_store_id,
+                          int src_version,
+                          const char *dst_store_id,
+                          int dst_version,
+                          const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->base->copy (priv->base, src_store_id, src_version,
+                             dst_store_id, dst_version, block_id);
+}
+
+static void
+remove_dir_recursive (const char *path)
+{
+    GDir *dir;
+    const char *dname;
+    char *sub;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            sub = g_build_filename (path, dname, NULL);
+            if (g_file_test (sub, G_FILE_TEST_IS_DIR))
+                remove_dir_recursive (sub);
+            else
+                g_unlink (sub);
+            g_free (sub);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (path);
+}
+
+static int
+block_backend_cache_remove_store (BlockBackend *bend, const char *store_id)
+{
+    CachePriv *priv = bend->be_priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *remove = NULL, *ptr;
+    char *dir;
+    int len = strlen (store_id);
+
+    pthread_mutex_lock (&priv->lock);
+    g_hash_table_iter_init (&iter, priv->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (strncmp (key, store_id, len) == 0 && ((char *)key)[len] == '/')
+            remove = g_list_prepend (remove, value);
+    }
+    for (ptr = remove; ptr; ptr = ptr->next)
+        remove_entry (priv, ptr->data);
+    pthread_mutex_unlock (&priv->lock);
+    g_list_free (remove);
+
+    dir = g_build_filename (priv->cache_dir, store_id, NULL);
+    remove_dir_recursive (dir);
+    g_free (dir);
+
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+/* Index the blocks already in the cache dir, e.g. after a restart. */
+static void *
+scan_cache_dir (void *vdata)
+{
+    CachePriv *priv = vdata;
+    GDir *dir1, *dir2, *dir3;
+    const char *store_id, *dname2, *dname3;
+    char *path1, *path2, *path3;
+    char block_id[41];
+    SeafStat st;
+
+    dir1 = g_dir_open (priv->cache_dir, 0, NULL);
+    if (!dir1)
+        return NULL;
+
+    while ((store_id = g_dir_read_name (dir1)) != NULL) {
+        if (!is_uuid_valid (store_id))
+            continue;
+        path1 = g_build_filename (priv->cache_dir, store_id, NULL);
+        dir2 = g_dir_open (path1, 0, NULL);
+        while (dir2 && (dname2 = g_dir_read_name (dir2)) != NULL) {
+            path2 = g_build_filename (path1, dname2, NULL);
+            dir3 = g_dir_open (path2, 0, NULL);
+            while (dir3 && (dname3 = g_dir_read_name (dir3)) != NULL) {
+                snprintf (block_id, sizeof(block_id), "%s%s", dname2, dname3);
+                path3 = g_build_filename (path2, dname3, NULL);
+                if (is_object_id_valid (block_id) && seaf_stat (path3, &st) == 0)
+                    touch_entry (priv, store_id, block_id, st.st_size);
+                g_free (path3);
+            }
+            if (dir3)
+                g_dir_close (dir3);
+            g_free (path2);
+        }
+        if (dir2)
+            g_dir_close (dir2);
+        g_free (path1);
+    }
+    g_dir_close (dir1);
+
+    seaf_message ("[block cache] %u blocks, %"G_GINT64_FORMAT" bytes in %s.\n",
+                  g_hash_table_size (priv->entries), priv->bytes, priv->cache_dir);
+    return NULL;
+}
+
+/*
+ * Wrap @base with a block cache in @cache_dir, which holds at most
+ * @max_bytes of blocks. Returns @base if the cache can't be set up.
+ */
+BlockBackend *
+block_backend_cache_new (BlockBackend *base, const char *cache_dir,
+                         gint64 max_bytes, int fill_threads)
+{
+    BlockBackend *bend;
+    CachePriv *priv;
+    pthread_t tid;
+
+    priv = g_new0 (CachePriv, 1);
+    priv->base = base;
+    priv->cache_dir = g_strdup (cache_dir);
+    priv->tmp_dir = g_build_filename (cache_dir, CACHE_TMP_DIR, NULL);
+    priv->max_bytes = max_bytes > 0 ? max_bytes : DEFAULT_CACHE_SIZE;
+
+    if (g_mkdir_with_parents (priv->tmp_dir, 0777) < 0) {
+        seaf_warning ("[block cache] Cache dir %s does not exist and"
+                      " is unable to create\n", priv->tmp_dir);
+        goto onerror;
+    }
+
+    priv->fill_pool = g_thread_pool_new (fill_block, priv,
+                                         fill_threads > 0 ? fill_threads : DEFAULT_FILL_THREADS,
+                                         FALSE, NULL);
+    if (!priv->fill_pool) {
+        seaf_warning ("[block cache] Failed to create thread pool.\n");
+        goto onerror;
+    }
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&priv->lru);
+    priv->filling = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    if (pthread_create (&tid, NULL, scan_cache_dir, priv) == 0)
+        pthread_detach (tid);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_cache_open_block;
+    bend->read_block = block_backend_cache_read_block;
+    bend->write_block = block_backend_cache_write_block;
+    bend->commit_block = block_backend_cache_commit_block;
+    bend->close_block = block_backend_cache_close_block;
+    bend->exists = block_backend_cache_block_exists;
+    bend->exists_many = block_backend_cache_blocks_exist;
+    bend->remove_block = block_backend_cache_remove_block;
+    bend->stat_block = block_backend_cache_stat_block;
+    bend->stat_block_by_handle = block_backend_cache_stat_block_by_handle;
+    if (base->touch)
+        bend->touch = block_backend_cache_touch_block;
+    bend->get_fd = block_backend_cache_get_fd;
+    bend->block_handle_free = block_backend_cache_block_handle_free;
+    bend->foreach_block = block_backend_cache_foreach_block;
+    if (base->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_cache_foreach_block_parallel;
+    bend->remove_store = block_backend_cache_remove_store;
+    bend->copy = block_backend_cache_copy;
+
+    seaf_message ("[block cache] Caching blocks in %s, up to %"G_GINT64_FORMAT" bytes.\n",
+                  priv->cache_dir, priv->max_bytes);
+
+    return bend;
+
+onerror:
+    g_free (priv->cache_dir);
+    g_free (priv->tmp_dir);
+    g_free (priv);
+    return base;
+}
@@ -0,0 +1,505 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Transparent compression of blocks stored by another block backend.
+ *
+ * A compressed block is stored with a 16-byte header:
+ *
+ *   magic (8 bytes) | codec (1) | reserved (3) | size (4, big endian)
+ *
+ * followed by the encoded contents. size is the length of the original
+ * contents. Block ids are still the sha1 of the original contents.
+ *
+ * Blocks that don't shrink by at least 10% are stored as they are, so
+ * reading a block checks for the header. An original block that happens to
+ * begin with the magic is stored with the header and CODEC_NONE, so it
+ * can't be mistaken for an encoded one.
+ *
+ * The same format is implemented by fileserver/objstore/backend_compress.go.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include "block-backend.h"
+
+#define BLOCK_HEADER_SIZE 16
+#define BLOCK_MAGIC "\x89SFBLK\r\n"
+#define BLOCK_MAGIC_LEN 8
+
+enum {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+};
+
+struct _BHandle {
+    BHandle    *base_handle;
+    int         rw_type;
+    /* Contents to be written, or the decoded contents of an encoded block. */
+    GByteArray *buf;
+    guint       pos;
+    gboolean    encoded;
+    /* Beginning of an unencoded block, read to look for the header. */
+    guint8      prefix[BLOCK_HEADER_SIZE];
+    int         prefix_len;
+    int         prefix_pos;
+};
+
+typedef struct {
+    BlockBackend   *base;
+    int             codec;
+} CompressPriv;
+
+static gboolean
+parse_header (const guint8 *hdr, int len, int *codec, guint32 *size)
+{
+    if (len < BLOCK_HEADER_SIZE || memcmp (hdr, BLOCK_MAGIC, BLOCK_MAGIC_LEN) != 0)
+        return FALSE;
+
+    *codec = hdr[8];
+    *size = ((guint32)hdr[12] << 24) | ((guint32)hdr[13] << 16) |
+        ((guint32)hdr[14] << 8) | (guint32)hdr[15];
+    return TRUE;
+}
+
+static void
+fill_header (guint8 *hdr, int codec, guint32 size)
+{
+    memset (hdr, 0, BLOCK_HEADER_SIZE);
+    memcpy (hdr, BLOCK_MAGIC, BLOCK_MAGIC_LEN);
+    hdr[8] = (guint8)codec;
+    hdr[12] = (size >> 24) & 0xff;
+    hdr[13] = (size >> 16) & 0xff;
+    hdr[14] = (size >> 8) & 0xff;
+    hdr[15] = size & 0xff;
+}
+
+/* Read the rest of an encoded block and decode it into handle->buf. */
+static int
+decode_block (BlockBackend *base, BHandle *handle, int codec, guint32 size)
+{
+    GByteArray *data = g_byte_array_new ();
+    guint8 chunk[65536];
+    guint8 *out = NULL;
+    int n, outlen = 0;
+
+    while ((n = base->read_block (base, handle->base_handle, chunk, sizeof(chunk))) > 0)
+        g_byte_array_append (data, chunk, n);
+    if (n < 0) {
+        g_byte_array_free (data, TRUE);
+        return -1;
+    }
+
+    if (codec == CODEC_NONE) {
+        handle->buf = data;
+    } else if (codec == CODEC_ZLIB) {
+        if (size > 0 && seaf_decompress (data->data, data->len, &out, &outlen) < 0) {
+            seaf_warning ("[block compress] Failed to decompress block.\n");
+            g_byte_array_free (data, TRUE);
+            return -1;
+        }
+        g_byte_array_free (data, TRUE);
+        handle->buf = g_byte_array_sized_new (outlen);
+        g_byte_array_append (handle->buf, out, outlen);
+        g_free (out);
+    } else {
+        seaf_warning ("[block compress] Unknown block codec %d.\n", codec);
+        g_byte_array_free (data, TRUE);
+        return -1;
+    }
+
+    if (handle->buf->len != size) {
+        seaf_warning ("[block compress] Block size is %u, expected %u.\n",
+                      handle->buf->len, size);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+handle_free (BlockBackend *base, BHandle *handle)
+{
+    if (handle->base_handle)
+        base->block_handle_free (base, handle->base_handle);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle);
+}
+
+static BHandle *
+block_backend_compress_open_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id,
+                                   int rw_type)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    BHandle *handle;
+    int codec, n;
+    guint32 size;
+
+    handle = g_new0 (BHandle, 1);
+    handle->rw_type = rw_type;
+    handle->base_handle = base->open_block (base, store_id, version,
+                                            block_id, rw_type);
+    if (!handle->base_handle) {
+        g_free (handle);
+        return NULL;
+    }
+
+    if (rw_type == BLOCK_WRITE) {
+        handle->buf = g_byte_array_new ();
+        return handle;
+    }
+
+    n = base->read_block (base, handle->base_handle,
+                          handle->prefix, BLOCK_HEADER_SIZE);
+    if (n < 0)
+        goto onerror;
+
+    if (!parse_header (handle->prefix, n, &codec, &size)) {
+        handle->prefix_len = n;
+        return handle;
+    }
+
+    handle->encoded = TRUE;
+    if (decode_block (base, handle, codec, size) < 0) {
+        seaf_warning ("[block compress] Failed to read block %s:%s.\n",
+                      store_id, block_id);
+        goto onerror;
+    }
+    return handle;
+
+onerror:
+    base->close_block (base, handle->base_handle);
+    handle_free (base, handle);
+    return NULL;
+}
+
+static int
+block_backend_compress_read_block (BlockBackend *bend,
+                                   BHandle *handle,
+                                   void *buf, int len)
+{
+    CompressPriv *priv = bend->be_priv;
+    int n = 0, ret;
+
+    if (handle->encoded) {
+        n = MIN (len, (int)(handle->buf->len - handle->pos));
+        memcpy (buf, handle->buf->data + handle->pos, n);
+        handle->pos += n;
+        return n;
+    }
+
+    if (handle->prefix_pos < handle->prefix_len) {
+        n = MIN (len, handle->prefix_len - handle->prefix_pos);
+        memcpy (buf, handle->prefix + handle->prefix_pos, n);
+        handle->prefix_pos += n;
+        if (n == len)
+            return n;
+    }
+
+    ret = priv->base->read_block (priv->base, handle->base_handle,
+                                  (char *)buf + n, len - n);
+    if (ret < 0)
+        return ret;
+    return n + ret;
+}
+
+static int
+block_backend_compress_write_block (BlockBackend *bend,
+                                    BHandle *handle,
+                                    const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_compress_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    GByteArray *data = handle->buf;
+    guint8 hdr[BLOCK_HEADER_SIZE];
+    guint8 *out = NULL;
+    int outlen = 0, codec = -1;
+
+    if (priv->codec == CODEC_ZLIB && data->len > 0 &&
+        seaf_compress (data->data, data->len, &out, &outlen) == 0 &&
+        (gint64)outlen + BLOCK_HEADER_SIZE < (gint64)data->len * 9 / 10) {
+        codec = CODEC_ZLIB;
+    } else if (data->len >= BLOCK_MAGIC_LEN &&
+               memcmp (data->data, BLOCK_MAGIC, BLOCK_MAGIC_LEN) == 0) {
+        codec = CODEC_NONE;
+    }
+
+    if (codec >= 0) {
+        fill_header (hdr, codec, data->len);
+        if (base->write_block (base, handle->base_handle, hdr, sizeof(hdr)) < 0)
+            goto onerror;
+    }
+
+    if (codec == CODEC_ZLIB) {
+        if (base->write_block (base, handle->base_handle, out, outlen) < 0)
+            goto onerror;
+    } else if (data->len > 0 &&
+               base->write_block (base, handle->base_handle,
+                                  data->data, data->len) < 0) {
+        goto onerror;
+    }
+
+    g_free (out);
+    return base->commit_block (base, handle->base_handle);
+
+onerror:
+    g_free (out);
+    return -1;
+}
+
+static int
+block_backend_compress_close_block (BlockBackend *bend, BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->close_block (priv->base, handle->base_handle);
+}
+
+static void
+block_backend_compress_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    handle_free (priv->base, handle);
+}
+
+static int
+block_backend_compress_block_exists (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->exists (priv->base, store_id, version, block_id);
+}
+
+static void
+block_backend_compress_blocks_exist (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char **block_ids,
+                                     int n_blocks,
+                                     gboolean *results)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    int i;
+
+    if (base->exists_many) {
+        base->exists_many (base, store_id, version, block_ids, n_blocks, results);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+        results[i] = base->exists (base, store_id, version, block_ids[i]);
+}
+
+static int
+block_backend_compress_remove_block (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->remove_block (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_compress_remove_blocks (BlockBackend *bend,
+                                      const char *store_id,
+                                      int version,
+                                      const char **block_ids,
+                                      int n_blocks)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->remove_blocks (priv->base, store_id, version,
+                                      block_ids, n_blocks);
+}
+
+static BMetadata *
+block_backend_compress_stat_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    BHandle *base_handle;
+    BMetadata *block_md;
+    guint8 hdr[BLOCK_HEADER_SIZE];
+    int codec, n;
+    guint32 size;
+
+    base_handle = base->open_block (base, store_id, version, block_id, BLOCK_READ);
+    if (!base_handle)
+        return NULL;
+    n = base->read_block (base, base_handle, hdr, sizeof(hdr));
+    /* For the write time, which GC needs. */
+    block_md = base->stat_block_by_handle (base, base_handle);
+    base->close_block (base, base_handle);
+    base->block_handle_free (base, base_handle);
+
+    if (!parse_header (hdr, n, &codec, &size))
+        return block_md;
+
+    if (!block_md) {
+        block_md = g_new0 (BMetadata, 1);
+        memcpy (block_md->id, block_id, 40);
+    }
+    block_md->size = size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_compress_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    block_md = priv->base->stat_block_by_handle (priv->base, handle->base_handle);
+    if (block_md && handle->encoded)
+        block_md->size = handle->buf->len;
+
+    return block_md;
+}
+
+/* Only unencoded blocks can be sent from their files. */
+static int
+block_backend_compress_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    if (handle->rw_type != BLOCK_READ || handle->encoded || !priv->base->get_fd)
+        return -1;
+    return priv->base->get_fd (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_compress_foreach_block (BlockBackend *bend,
+                                      const char *store_id,
+                                      int version,
+                                      SeafBlockFunc process,
+                                      void *user_data)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block (priv->base, store_id, version,
+                                      process, user_data);
+}
+
+static int
+block_backend_compress_foreach_block_parallel (BlockBackend *bend,
+                                               const char *store_id,
+                                               int version,
+                                               int max_threads,
+                                               SeafBlockFunc process,
+                                               void *user_data)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block_parallel (priv->base, store_id, version,
+                                               max_threads, process, user_data);
+}
+
+static int
+block_backend_compress_touch_block (BlockBackend *bend,
+                                    const char *store_id,
+                                    int version,
+                                    const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->touch (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_compress_copy (BlockBackend *bend,
+                             const char *src_store_id,
+                             int src_version,
+                             const char *dst_store_id,
+                             int dst_version,
+                             const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->copy (priv->base, src_store_id, src_version,
+                             dst_store_id, dst_version, block_id);
+}
+
+static int
+block_backend_compress_remove_store (BlockBackend *bend, const char *store_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+/*
+ * Wrap @base to compress new blocks with @codec ("zlib" or "none").
+ * Blocks compressed earlier are decoded with either codec.
+ * Returns @base if @codec is unknown.
+ */
+BlockBackend *
+block_backend_compress_new (BlockBackend *base, const char *codec)
+{
+    BlockBackend *bend;
+    CompressPriv *priv;
+
+    priv = g_new0 (CompressPriv, 1);
+    priv->base = base;
+    if (g_strcmp0 (codec, "zlib") == 0)
+        priv->codec = CODEC_ZLIB;
+    else if (g_strcmp0 (codec, "none") == 0)
+        priv->codec = CODEC_NONE;
+    else {
+        seaf_warning ("[block compress] Unknown compression %s.\n", codec);
+        g_free (priv);
+        return base;
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_compress_open_block;
+    bend->read_block = block_backend_compress_read_block;
+    bend->write_block = block_backend_compress_write_block;
+    bend->commit_block = block_backend_compress_commit_block;
+    bend->close_block = block_backend_compress_close_block;
+    bend->exists = block_backend_compress_block_exists;
+    bend->exists_many = block_backend_compress_blocks_exist;
+    bend->remove_block = block_backend_compress_remove_block;
+    if (base->remove_blocks)
+        bend->remove_blocks = block_backend_compress_remove_blocks;
+    bend->stat_block = block_backend_compress_stat_block;
+    bend->stat_block_by_handle = block_backend_compress_stat_block_by_handle;
+    if (base->touch)
+        bend->touch = block_backend_compress_touch_block;
+    bend->get_fd = block_backend_compress_get_fd;
+    bend->block_handle_free = block_backend_compress_block_handle_free;
+    bend->foreach_block = block_backend_compress_foreach_block;
+    if (base->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_compress_foreach_block_parallel;
+    bend->remove_store = block_backend_compress_remove_store;
+    bend->copy = block_backend_compress_copy;
+
+    return bend;
+}
@@ -0,0 +1,537 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * In-memory existence filter in front of another block backend.
+ *
+ * Most blocks checked before an upload are new, so most checks are misses.
+ * For each store a counting bloom filter of its blocks is built in the
+ * background, the first time blocks of the store are checked, and kept up
+ * to date on commit and removal. A block that isn't in the filter is
+ * reported missing without probing the storage. Blocks in the filter are
+ * still checked against the underlying backend.
+ *
+ * Blocks written by other processes (e.g. the Go fileserver) are not in the
+ * filter, so they may be reported missing. That's why only the batched
+ * check (exists_many) uses the filter. It decides which blocks a client has
+ * to upload and which indexed blocks have to be written, where a wrong
+ * answer only costs a redundant upload or write. Single block checks always
+ * go to the underlying backend.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+#include "bloom-filter.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include <pthread.h>
+
+#include "block-backend.h"
+
+/* 10 bits per block with 4 hash functions gives about 1% false positives. */
+#define FILTER_BITS_PER_BLOCK 10
+#define FILTER_HASHES 4
+#define FILTER_MIN_CAPACITY 65536
+
+struct _BHandle {
+    BHandle *base_handle;
+    char    *store_id;
+    char     block_id[41];
+};
+
+enum {
+    FILTER_BUILDING,
+    FILTER_READY,
+};
+
+typedef struct StoreFilter {
+    int          state;
+    Bloom       *bloom;
+    gint64       n_blocks;
+    gint64       capacity;
+    /* Blocks committed while the filter is being built. */
+    GPtrArray   *pending;
+    /* Set if a block is removed while the filter is being built. */
+    gboolean     invalid;
+} StoreFilter;
+
+typedef struct {
+    BlockBackend   *base;
+
+    pthread_mutex_t lock;
+    GHashTable     *filters;    /* store_id -> StoreFilter */
+
+    GThreadPool    *build_pool;
+} FilterPriv;
+
+typedef struct BuildTask {
+    char    *store_id;
+    int      version;
+} BuildTask;
+
+static void
+store_filter_free (StoreFilter *filter)
+{
+    if (filter->bloom)
+        bloom_destroy (filter->bloom);
+    if (filter->pending)
+        g_ptr_array_free (filter->pending, TRUE);
+    g_free (filter);
+}
+
+static gboolean
+count_block (const char *store_id, int version,
+             const char *block_id, void *user_data)
+{
+    gint64 *count = user_data;
+
+    ++(*count);
+    return TRUE;
+}
+
+static gboolean
+add_block (const char *store_id, int version,
+           const char *block_id, void *user_data)
+{
+    bloom_add ((Bloom *)user_data, block_id);
+    return TRUE;
+}
+
+static void
+build_filter (gpointer data, gpointer user_data)
+{
+    BuildTask *task = data;
+    FilterPriv *priv = user_data;
+    BlockBackend *base = priv->base;
+    StoreFilter *filter;
+    Bloom *bloom = NULL;
+    gint64 count = 0, capacity;
+    guint i;
+
+    if (base->foreach_block (base, task->store_id, task->version,
+                             count_block, &count) < 0)
+        goto out;
+
+    /* Leave room for the store to double before a rebuild. */
+    capacity = MAX (count * 2, FILTER_MIN_CAPACITY);
+    bloom = bloom_create (capacity * FILTER_BITS_PER_BLOCK, FILTER_HASHES, 1);
+    if (!bloom) {
+        seaf_warning ("[block filter] Failed to create filter for %s.\n",
+                      task->store_id);
+        goto out;
+    }
+
+    if (base->foreach_block (base, task->store_id, task->version,
+                             add_block, bloom) < 0)
+        goto out;
+
+    pthread_mutex_lock (&priv->lock);
+    filter = g_hash_table_lookup (priv->filters, task->store_id);
+    if (filter && filter->state == FILTER_BUILDING && !filter->invalid) {
+        for (i = 0; i < filter->pending->len; ++i)
+            bloom_add (bloom, g_ptr_array_index (filter->pending, i));
+        filter->n_blocks = count + filter->pending->len;
+        g_ptr_array_free (filter->pending, TRUE);
+        filter->pending = NULL;
+        filter->bloom = bloom;
+        filter->capacity = capacity;
+        filter->state = FILTER_READY;
+        bloom = NULL;
+        seaf_debug ("[block filter] Built filter for %s with %"G_GINT64_FORMAT" blocks.\n",
+                    task->store_id, filter->n_blocks);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+out:
+    if (bloom)
+        bloom_destroy (bloom);
+
+    /* On failure, or if the store changed meanwhile, let the next check
+     * start over.
+     */
+    pthread_mutex_lock (&priv->lock);
+    filter = g_hash_table_lookup (priv->filters, task->store_id);
+    if (filter && filter->state == FILTER_BUILDING)
+        g_hash_table_remove (priv->filters, task->store_id);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (task->store_id);
+    g_free (task);
+}
+
+/* Must be called with the lock held. */
+static void
+filter_add_block (FilterPriv *priv, const char *store_id, const char *block_id)
+{
+    StoreFilter *filter;
+
+    filter = g_hash_table_lookup (priv->filters, store_id);
+    if (!filter)
+        return;
+
+    if (filter->state == FILTER_BUILDING) {
+        g_ptr_array_add (filter->pending, g_strdup (block_id));
+        return;
+    }
+
+    bloom_add (filter->bloom, block_id);
+    /* Too many false positives, build a larger one on the next check. */
+    if (++filter->n_blocks > filter->capacity)
+        g_hash_table_remove (priv->filters, store_id);
+}
+
+/* Must be called with the lock held. */
+static void
+filter_remove_block (FilterPriv *priv, const char *store_id, const char *block_id)
+{
+    StoreFilter *filter;
+
+    filter = g_hash_table_lookup (priv->filters, store_id);
+    if (!filter)
+        return;
+
+    if (filter->state == FILTER_BUILDING) {
+        filter->invalid = TRUE;
+        return;
+    }
+
+    bloom_remove (filter->bloom, block_id);
+    --filter->n_blocks;
+}
+
+static BHandle *
+block_backend_filter_open_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 int rw_type)
+{
+    FilterPriv *priv = bend->be_priv;
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->base_handle = priv->base->open_block (priv->base, store_id, version,
+                                                  block_id, rw_type);
+    if (!handle->base_handle) {
+        g_free (handle);
+        return NULL;
+    }
+    handle->store_id = g_strdup (store_id);
+    memcpy (handle->block_id, block_id, 41);
+
+    return handle;
+}
+
+static int
+block_backend_filter_read_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 void *buf, int len)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->read_block (priv->base, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_filter_write_block (BlockBackend *bend,
+                                  BHandle *handle,
+                                  const void *buf, int len)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->write_block (priv->base, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_filter_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    FilterPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->commit_block (priv->base, handle->base_handle);
+    if (ret == 0) {
+        pthread_mutex_lock (&priv->lock);
+        filter_add_block (priv, handle->store_id, handle->block_id);
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+    return ret;
+}
+
+static int
+block_backend_filter_close_block (BlockBackend *bend, BHandle *handle)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->close_block (priv->base, handle->base_handle);
+}
+
+static void
+block_backend_filter_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    priv->base->block_handle_free (priv->base, handle->base_handle);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_filter_block_exists (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->exists (priv->base, store_id, version, block_id);
+}
+
+static void
+block_backend_filter_blocks_exist (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char **block_ids,
+                                   int n_blocks,
+                                   gboolean *results)
+{
+    FilterPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    StoreFilter *filter;
+    BuildTask *task;
+    const char **maybe_ids = NULL;
+    gboolean *maybe_results;
+    int *maybe_index;
+    int i, n_maybe = 0;
+
+    pthread_mutex_lock (&priv->lock);
+    filter = g_hash_table_lookup (priv->filters, store_id);
+    if (!filter) {
+        filter = g_new0 (StoreFilter, 1);
+        filter->state = FILTER_BUILDING;
+        filter->pending = g_ptr_array_new_with_free_func (g_free);
+        g_hash_table_insert (priv->filters, g_strdup (store_id), filter);
+
+        task = g_new0 (BuildTask, 1);
+        task->store_id = g_strdup (store_id);
+        task->version = version;
+        g_thread_pool_push (priv->build_pool, task, NULL);
+    }
+    if (filter->state == FILTER_READY) {
+        maybe_ids = g_new (const char *, n_blocks);
+        maybe_index = g_new (int, n_blocks);
+        for (i = 0; i < n_blocks; ++i) {
+            results[i] = FALSE;
+            if (bloom_test (filter->bloom, block_ids[i])) {
+                maybe_ids[n_maybe] = block_ids[i];
+                maybe_index[n_maybe] = i;
+                ++n_maybe;
+            }
+        }
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (!maybe_ids) {
+        maybe_ids = block_ids;
+        n_maybe = n_blocks;
+        maybe_results = results;
+    } else {
+        maybe_results = g_new (gboolean, MAX (n_maybe, 1));
+    }
+
+    if (base->exists_many && n_maybe > 0)
+        base->exists_many (base, store_id, version, maybe_ids, n_maybe, maybe_results);
+    else {
+        for (i = 0; i < n_maybe; ++i)
+            maybe_results[i] = base->exists (base, store_id, version, maybe_ids[i]);
+    }
+
+    if (maybe_results != results) {
+        for (i = 0; i < n_maybe; ++i)
+            results[maybe_index[i]] = maybe_results[i];
+        g_free (maybe_ids);
+        g_free (maybe_index);
+        g_free (maybe_results);
+    }
+}
+
+static int
+block_backend_filter_remove_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id)
+{
+    FilterPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->remove_block (priv->base, store_id, version, block_id);
+    if (ret == 0) {
+        pthread_mutex_lock (&priv->lock);
+        filter_remove_block (priv, store_id, block_id);
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_filter_stat_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->stat_block (priv->base, store_id, version, block_id);
+}
+
+static BMetadata *
+block_backend_filter_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->stat_block_by_handle (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_filter_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    if (!priv->base->get_fd)
+        return -1;
+    return priv->base->get_fd (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_filter_foreach_block (BlockBackend *bend,
+                                    const char *store_id,
+                                    int version,
+                                    SeafBlockFunc process,
+                                    void *user_data)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block (priv->base, store_id, version,
+                                      process, user_data);
+}
+
+static int
+block_backend_filter_foreach_block_parallel (BlockBackend *bend,
+                                             const char *store_id,
+                                             int version,
+                                             int max_threads,
+                                             SeafBlockFunc process,
+                                             void *user_data)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block_parallel (priv->base, store_id, version,
+                                               max_threads, process, user_data);
+}
+
+static int
+block_backend_filter_touch_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    FilterPriv *priv = bend->be_priv;
+
+    return priv->base->touch (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_filter_copy (BlockBackend *bend,
+                           const char *src_store_id,
+                           int src_version,
+                           const char *dst_store_id,
+                           int dst_version,
+                           const char *block_id)
+{
+    FilterPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->copy (priv->base, src_store_id, src_version,
+                            dst_store_id, dst_version, block_id);
+    if (ret == 0) {
+        pthread_mutex_lock (&priv->lock);
+        filter_add_block (priv, dst_store_id, block_id);
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+    return ret;
+}
+
+static int
+block_backend_filter_remove_store (BlockBackend *bend, const char *store_id)
+{
+    FilterPriv *priv = bend->be_priv;
+    StoreFilter *filter;
+
+    pthread_mutex_lock (&priv->lock);
+    filter = g_hash_table_lookup (priv->filters, store_id);
+    if (filter && filter->state == FILTER_BUILDING)
+        filter->invalid = TRUE;
+    else if (filter)
+        g_hash_table_remove (priv->filters, store_id);
+    pthread_mutex_unlock (&priv->lock);
+
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+/*
+ * Wrap @base with per-store existence filters.
+ * Returns @base if the filters can't be set up.
+ */
+BlockBackend *
+block_backend_filter_new (BlockBackend *base)
+{
+    BlockBackend *bend;
+    FilterPriv *priv;
+
+    priv = g_new0 (FilterPriv, 1);
+    priv->base = base;
+
+    priv->build_pool = g_thread_pool_new (build_filter, priv, 1, FALSE, NULL);
+    if (!priv->build_pool) {
+        seaf_warning ("[block filter] Failed to create thread pool.\n");
+        g_free (priv);
+        return base;
+    }
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->filters = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free,
+                                           (GDestroyNotify)store_filter_free);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_filter_open_block;
+    bend->read_block = block_backend_filter_read_block;
+    bend->write_block = block_backend_filter_write_block;
+    bend->commit_block = block_backend_filter_commit_block;
+    bend->close_block = block_backend_filter_close_block;
+    bend->exists = block_backend_filter_block_exists;
+    bend->exists_many = block_backend_filter_blocks_exist;
+    bend->remove_block = block_backend_filter_remove_block;
+    bend->stat_block = block_backend_filter_stat_block;
+    bend->stat_block_by_handle = block_backend_filter_stat_block_by_handle;
+    if (base->touch)
+        bend->touch = block_backend_filter_touch_block;
+    bend->get_fd = block_backend_filter_get_fd;
+    bend->block_handle_free = block_backend_filter_block_handle_free;
+    bend->foreach_block = block_backend_filter_foreach_block;
+    if (base->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_filter_foreach_block_parallel;
+    bend->remove_store = block_backend_filter_remove_store;
+    bend->copy = block_backend_filter_copy;
+
+    return bend;
+}
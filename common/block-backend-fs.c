@@ -4,6 +4,11 @@
 #define _WIN32_WINNT 0x500
 #endif
 
+/* For copy_file_range(). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 
 #include "utils.h"
@@ -14,9 +19,20 @@
 #include <fcntl.h>
 #include <dirent.h>
 
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "block-backend.h"
+#include "block-uring.h"
 #include "obj-store.h"
 
+/* Blocks read through io_uring are read in chunks of this size, all
+ * submitted at once. Larger blocks are read with plain syscalls.
+ */
+#define URING_READ_CHUNK (256 * 1024)
+#define URING_MAX_PREFETCH (64 << 20)
 
 struct _BHandle {
     char    *store_id;
@@ -25,6 +41,14 @@ struct _BHandle {
     int     fd;
     int     rw_type;
     char    *tmp_file;
+    /* Read handles with io_uring. The block is read into rbuf. */
+    BlockURingReads *reads;
+    char    *rbuf;
+    gint64  roff;
+    gboolean sync_reads;
+    /* Write handles with io_uring. Written data is kept in wbuf until the
+     * block is committed. */
+    GByteArray *wbuf;
 };
 
 typedef struct {
@@ -32,6 +56,9 @@ typedef struct {
     int            block_dir_len;
     char          *tmp_dir;
     int            tmp_dir_len;
+    char          *pool_dir;    /* NULL if the shared pool is disabled */
+    BlockURing    *ring;        /* NULL if io_uring is not used */
+    gboolean       sync_blocks;
 } FsPriv;
 
 static char *
@@ -46,6 +73,12 @@ open_tmp_file (BlockBackend *bend,
                const char *basename,
                char **path);
 
+static void
+pool_add_block (BlockBackend *bend, const char *block_id, const char *path);
+
+static void
+pool_release_block (BlockBackend *bend, const char *block_id);
+
 static BHandle *
 block_backend_fs_open_block (BlockBackend *bend,
                              const char *store_id,
@@ -53,6 +86,7 @@ block_backend_fs_open_block (BlockBackend *bend,
                              const char *block_id,
                              int rw_type)
 {
+    FsPriv *priv = bend->be_priv;
     BHandle *handle;
     int fd = -1;
     char *tmp_file;
@@ -85,6 +119,8 @@ block_backend_fs_open_block (BlockBackend *bend,
     handle->rw_type = rw_type;
     if (rw_type == BLOCK_WRITE)
         handle->tmp_file = tmp_file;
+    if (rw_type == BLOCK_WRITE && priv->ring)
+        handle->wbuf = g_byte_array_new ();
     if (store_id)
         handle->store_id = g_strdup(store_id);
     handle->version = version;
@@ -92,14 +128,52 @@ block_backend_fs_open_block (BlockBackend *bend,
     return handle;
 }
 
+/* The whole block is read in one batch at the first read, so the later
+ * reads mostly copy from memory.
+ */
+static int
+read_block_uring (FsPriv *priv, BHandle *handle, void *buf, int len)
+{
+    SeafStat st;
+    gint64 avail;
+    int n;
+
+    if (!handle->reads) {
+        if (seaf_fstat (handle->fd, &st) < 0)
+            return -1;
+        if (st.st_size > URING_MAX_PREFETCH) {
+            handle->sync_reads = TRUE;
+            return readn (handle->fd, buf, len);
+        }
+        handle->rbuf = g_malloc (st.st_size + 1);
+        handle->reads = block_uring_read_async (priv->ring, handle->fd,
+                                                handle->rbuf, st.st_size,
+                                                URING_READ_CHUNK);
+    }
+
+    avail = block_uring_reads_wait (handle->reads, handle->roff + len);
+    if (avail < 0)
+        return -1;
+
+    n = (int) MIN ((gint64)len, avail - handle->roff);
+    memcpy (buf, handle->rbuf + handle->roff, n);
+    handle->roff += n;
+
+    return n;
+}
+
 static int
 block_backend_fs_read_block (BlockBackend *bend,
                              BHandle *handle,
                              void *buf, int len)
 {
+    FsPriv *priv = bend->be_priv;
     int ret;
 
-    ret = readn (handle->fd, buf, len);
+    if (priv->ring && !handle->sync_reads)
+        ret = read_block_uring (priv, handle, buf, len);
+    else
+        ret = readn (handle->fd, buf, len);
     if (ret < 0)
         seaf_warning ("Failed to read block %s:%s: %s.\n",
                       handle->store_id, handle->block_id, strerror (errno));
@@ -114,6 +188,11 @@ block_backend_fs_write_block (BlockBackend *bend,
 {
     int ret;
 
+    if (handle->wbuf) {
+        g_byte_array_append (handle->wbuf, buf, len);
+        return len;
+    }
+
     ret = writen (handle->fd, buf, len);
     if (ret < 0)
         seaf_warning ("Failed to write block %s:%s: %s.\n",
@@ -126,9 +205,24 @@ static int
 block_backend_fs_close_block (BlockBackend *bend,
                                 BHandle *handle)
 {
+    FsPriv *priv = bend->be_priv;
     int ret;
 
+    /* Buffered writes still need the fd, it's closed when committing. */
+    if (handle->wbuf || handle->fd < 0)
+        return 0;
+
+    if (handle->rw_type == BLOCK_WRITE && priv->sync_blocks &&
+        fsync (handle->fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[block bend] Failed to fsync block %s:%s: %s.\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        close (handle->fd);
+        handle->fd = -1;
+        return -1;
+    }
+
     ret = close (handle->fd);
+    handle->fd = -1;
 
     return ret;
 }
@@ -142,6 +236,14 @@ block_backend_fs_block_handle_free (BlockBackend *bend,
         g_unlink (handle->tmp_file);
         g_free (handle->tmp_file);
     }
+    if (handle->reads)
+        block_uring_reads_free (handle->reads);
+    g_free (handle->rbuf);
+    if (handle->wbuf) {
+        if (handle->fd >= 0)
+            close (handle->fd);
+        g_byte_array_free (handle->wbuf, TRUE);
+    }
     g_free (handle->store_id);
     g_free (handle);
 }
@@ -168,10 +270,26 @@ create_parent_path (const char *path)
     return 0;
 }
 
+/* The write, fsync and rename are submitted as one chain. */
+static int
+commit_block_uring (FsPriv *priv, BHandle *handle, const char *path)
+{
+    int ret;
+
+    ret = block_uring_commit (priv->ring, handle->fd,
+                              handle->wbuf->data, handle->wbuf->len,
+                              priv->sync_blocks, handle->tmp_file, path);
+    close (handle->fd);
+    handle->fd = -1;
+
+    return ret;
+}
+
 static int
 block_backend_fs_commit_block (BlockBackend *bend,
                                BHandle *handle)
 {
+    FsPriv *priv = bend->be_priv;
     char path[SEAF_PATH_MAX];
 
     g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
@@ -184,12 +302,28 @@ block_backend_fs_commit_block (BlockBackend *bend,
         return -1;
     }
 
-    if (g_rename (handle->tmp_file, path) < 0) {
-        seaf_warning ("[block bend] failed to commit block %s:%s: %s\n",
-                      handle->store_id, handle->block_id, strerror(errno));
-        return -1;
+    if (handle->wbuf) {
+        if (commit_block_uring (priv, handle, path) < 0) {
+            seaf_warning ("[block bend] failed to commit block %s:%s: %s\n",
+                          handle->store_id, handle->block_id, strerror(errno));
+            return -1;
+        }
+    } else {
+        if (priv->sync_blocks && handle->fd >= 0 &&
+            fsync (handle->fd) < 0 && errno != EINVAL) {
+            seaf_warning ("[block bend] Failed to fsync block %s:%s: %s.\n",
+                          handle->store_id, handle->block_id, strerror(errno));
+            return -1;
+        }
+        if (g_rename (handle->tmp_file, path) < 0) {
+            seaf_warning ("[block bend] failed to commit block %s:%s: %s\n",
+                          handle->store_id, handle->block_id, strerror(errno));
+            return -1;
+        }
     }
 
+    pool_add_block (bend, handle->block_id, path);
+
     return 0;
 }
     
@@ -208,6 +342,43 @@ block_backend_fs_block_exists (BlockBackend *bend,
         return FALSE;
 }
 
+#define EXISTS_MANY_MAX_THREADS 16
+
+typedef struct ExistsManyData {
+    BlockBackend *bend;
+    const char *store_id;
+    int version;
+    const char **block_ids;
+} ExistsManyData;
+
+static gboolean
+check_block_exists (int i, void *vdata)
+{
+    ExistsManyData *data = vdata;
+
+    return block_backend_fs_block_exists (data->bend, data->store_id,
+                                          data->version, data->block_ids[i]);
+}
+
+static void
+block_backend_fs_blocks_exist (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char **block_ids,
+                               int n_blocks,
+                               gboolean *results)
+{
+    ExistsManyData data;
+
+    data.bend = bend;
+    data.store_id = store_id;
+    data.version = version;
+    data.block_ids = block_ids;
+
+    run_parallel_checks (n_blocks, EXISTS_MANY_MAX_THREADS,
+                         check_block_exists, &data, results);
+}
+
 static int
 block_backend_fs_remove_block (BlockBackend *bend,
                                const char *store_id,
@@ -215,10 +386,59 @@ block_backend_fs_remove_block (BlockBackend *bend,
                                const char *block_id)
 {
     char path[SEAF_PATH_MAX];
+    int ret;
 
     get_block_path (bend, block_id, path, store_id, version);
 
-    return g_unlink (path);
+    ret = g_unlink (path);
+    if (ret == 0)
+        pool_release_block (bend, block_id);
+    return ret;
+}
+
+typedef struct RemoveManyData {
+    BlockBackend *bend;
+    const char *store_id;
+    int version;
+    const char **block_ids;
+} RemoveManyData;
+
+static gboolean
+remove_one_block (int i, void *vdata)
+{
+    RemoveManyData *data = vdata;
+
+    return block_backend_fs_remove_block (data->bend, data->store_id,
+                                          data->version, data->block_ids[i]) == 0;
+}
+
+/* Unlinks are as slow as stat() calls on network file systems. */
+static int
+block_backend_fs_remove_blocks (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char **block_ids,
+                                int n_blocks)
+{
+    RemoveManyData data;
+    gboolean *results;
+    int i, ret = 0;
+
+    data.bend = bend;
+    data.store_id = store_id;
+    data.version = version;
+    data.block_ids = block_ids;
+
+    results = g_new (gboolean, n_blocks);
+    run_parallel_checks (n_blocks, EXISTS_MANY_MAX_THREADS,
+                         remove_one_block, &data, results);
+    for (i = 0; i < n_blocks; ++i) {
+        if (!results[i])
+            ret = -1;
+    }
+    g_free (results);
+
+    return ret;
 }
 
 static BMetadata *
@@ -240,6 +460,7 @@ block_backend_fs_stat_block (BlockBackend *bend,
     block_md = g_new0(BMetadata, 1);
     memcpy (block_md->id, block_id, 40);
     block_md->size = (uint32_t) st.st_size;
+    block_md->ctime = (int64_t) st.st_mtime;
 
     return block_md;
 }
@@ -259,10 +480,43 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     block_md = g_new0(BMetadata, 1);
     memcpy (block_md->id, handle->block_id, 40);
     block_md->size = (uint32_t) st.st_size;
+    if (handle->wbuf)
+        block_md->size = handle->wbuf->len;
+    block_md->ctime = (int64_t) st.st_mtime;
 
     return block_md;
 }
 
+/* The mtime is the write time of a block, which online GC checks before
+ * removing it. Blocks that are reused rather than written, or replaced by
+ * a link to an older inode, are given a fresh one.
+ */
+static int
+touch_block_file (const char *path)
+{
+    return utime (path, NULL);
+}
+
+static int
+block_backend_fs_touch_block (BlockBackend *bend,
+                              const char *store_id,
+                              int version,
+                              const char *block_id)
+{
+    char path[SEAF_PATH_MAX];
+
+    get_block_path (bend, block_id, path, store_id, version);
+    return touch_block_file (path);
+}
+
+static int
+block_backend_fs_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    if (handle->rw_type != BLOCK_READ)
+        return -1;
+    return handle->fd;
+}
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 const char *store_id,
@@ -322,6 +576,206 @@ out:
     return ret;
 }
 
+typedef struct ForeachParallelData {
+    const char *store_id;
+    int version;
+    const char *block_dir;
+    GPtrArray *dnames;
+    SeafBlockFunc process;
+    void *user_data;
+    volatile gint stop;
+} ForeachParallelData;
+
+/* Lists one of the fan-out directories of a store. */
+static gboolean
+foreach_block_in_dir (int i, void *vdata)
+{
+    ForeachParallelData *data = vdata;
+    const char *dname1 = g_ptr_array_index (data->dnames, i);
+    const char *dname2;
+    char block_id[128];
+    char *path;
+    GDir *dir;
+
+    if (g_atomic_int_get (&data->stop))
+        return TRUE;
+
+    path = g_build_filename (data->block_dir, dname1, NULL);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        seaf_warning ("Failed to open block dir %s.\n", path);
+        g_free (path);
+        return FALSE;
+    }
+
+    while ((dname2 = g_dir_read_name(dir)) != NULL) {
+        if (g_atomic_int_get (&data->stop))
+            break;
+        snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
+        if (!data->process (data->store_id, data->version, block_id,
+                            data->user_data)) {
+            g_atomic_int_set (&data->stop, 1);
+            break;
+        }
+    }
+
+    g_dir_close (dir);
+    g_free (path);
+    return TRUE;
+}
+
+static int
+block_backend_fs_foreach_block_parallel (BlockBackend *bend,
+                                         const char *store_id,
+                                         int version,
+                                         int max_threads,
+                                         SeafBlockFunc process,
+                                         void *user_data)
+{
+    FsPriv *priv = bend->be_priv;
+    char *block_dir = NULL;
+    GDir *dir1;
+    const char *dname1;
+    ForeachParallelData data;
+    gboolean *results;
+
+#if defined MIGRATION
+    if (version > 0)
+        block_dir = g_build_filename (priv->block_dir, store_id, NULL);
+#else
+    block_dir = g_build_filename (priv->block_dir, store_id, NULL);
+#endif
+
+    dir1 = g_dir_open (block_dir, 0, NULL);
+    if (!dir1) {
+        g_free (block_dir);
+        return 0;
+    }
+
+    memset (&data, 0, sizeof(data));
+    data.store_id = store_id;
+    data.version = version;
+    data.block_dir = block_dir;
+    data.dnames = g_ptr_array_new_with_free_func (g_free);
+    data.process = process;
+    data.user_data = user_data;
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL)
+        g_ptr_array_add (data.dnames, g_strdup(dname1));
+    g_dir_close (dir1);
+
+    results = g_new (gboolean, data.dnames->len);
+    run_parallel_jobs (data.dnames->len, max_threads,
+                       foreach_block_in_dir, &data, results);
+
+    g_free (results);
+    g_ptr_array_free (data.dnames, TRUE);
+    g_free (block_dir);
+
+    return 0;
+}
+
+#ifndef WIN32
+
+#define COPY_BUF_SIZE (64 * 1024)
+#define COPY_RANGE_SIZE (1 << 30)
+
+/*
+ * Copy the data of @src_fd to @dst_fd. The data is shared if the filesystem
+ * supports reflinks, and copied in the kernel if possible.
+ */
+static int
+copy_block_data (int src_fd, int dst_fd)
+{
+    char *buf;
+    ssize_t n;
+    int ret = 0;
+
+#ifdef FICLONE
+    if (ioctl (dst_fd, FICLONE, src_fd) == 0)
+        return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ((n = copy_file_range (src_fd, NULL, dst_fd, NULL,
+                                 COPY_RANGE_SIZE, 0)) > 0)
+        ;
+    if (n == 0)
+        return 0;
+    /* Not supported between these files, start over with plain copies. */
+    if (lseek (src_fd, 0, SEEK_SET) < 0 || lseek (dst_fd, 0, SEEK_SET) < 0 ||
+        ftruncate (dst_fd, 0) < 0)
+        return -1;
+#endif
+
+    buf = g_malloc (COPY_BUF_SIZE);
+    while ((n = readn (src_fd, buf, COPY_BUF_SIZE)) > 0) {
+        if (writen (dst_fd, buf, n) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (n < 0)
+        ret = -1;
+    g_free (buf);
+
+    return ret;
+}
+
+static int
+copy_block_file (BlockBackend *bend, const char *block_id,
+                 const char *src_path, const char *dst_path)
+{
+    char *tmp_file = NULL;
+    int src_fd, dst_fd = -1;
+    int ret = -1;
+
+    src_fd = g_open (src_path, O_RDONLY | O_BINARY, 0);
+    if (src_fd < 0) {
+        seaf_warning ("Failed to open block %s: %s.\n", src_path, strerror(errno));
+        return -1;
+    }
+
+    dst_fd = open_tmp_file (bend, block_id, &tmp_file);
+    if (dst_fd < 0) {
+        seaf_warning ("Failed to open tmp file for block %s: %s.\n",
+                      block_id, strerror(errno));
+        goto out;
+    }
+
+    if (copy_block_data (src_fd, dst_fd) < 0) {
+        seaf_warning ("Failed to copy %s to %s: %s.\n",
+                      src_path, tmp_file, strerror(errno));
+        goto out;
+    }
+
+    if (close (dst_fd) < 0) {
+        dst_fd = -1;
+        goto out;
+    }
+    dst_fd = -1;
+
+    if (g_rename (tmp_file, dst_path) < 0) {
+        seaf_warning ("Failed to rename %s to %s: %s.\n",
+                      tmp_file, dst_path, strerror(errno));
+        goto out;
+    }
+    ret = 0;
+
+out:
+    close (src_fd);
+    if (dst_fd >= 0)
+        close (dst_fd);
+    if (tmp_file) {
+        if (ret < 0)
+            g_unlink (tmp_file);
+        g_free (tmp_file);
+    }
+    return ret;
+}
+
+#endif
+
 static int
 block_backend_fs_copy (BlockBackend *bend,
                        const char *src_store_id,
@@ -336,7 +790,7 @@ block_backend_fs_copy (BlockBackend *bend,
     get_block_path (bend, block_id, src_path, src_store_id, src_version);
     get_block_path (bend, block_id, dst_path, dst_store_id, dst_version);
 
-    if (g_file_test (dst_path, G_FILE_TEST_EXISTS))
+    if (touch_block_file (dst_path) == 0)
         return 0;
 
     if (create_parent_path (dst_path) < 0) {
@@ -351,15 +805,29 @@ block_backend_fs_copy (BlockBackend *bend,
                       src_path, dst_path, GetLastError());
         return -1;
     }
+    touch_block_file (dst_path);
     return 0;
 #else
-    int ret = link (src_path, dst_path);
-    if (ret < 0 && errno != EEXIST) {
-        seaf_warning ("Failed to link %s to %s: %s.\n",
-                      src_path, dst_path, strerror(errno));
-        return -1;
+    if (link (src_path, dst_path) == 0) {
+        /* Blocks written before the pool was enabled join it when copied. */
+        pool_add_block (bend, block_id, dst_path);
+        touch_block_file (dst_path);
+        return 0;
     }
-    return ret;
+    if (errno == EEXIST) {
+        touch_block_file (dst_path);
+        return 0;
+    }
+
+    /* The stores are on different filesystems, the block has too many links,
+     * or the filesystem doesn't support hard links.
+     */
+    if (errno == EXDEV || errno == EMLINK || errno == EPERM || errno == ENOTSUP)
+        return copy_block_file (bend, block_id, src_path, dst_path);
+
+    seaf_warning ("Failed to link %s to %s: %s.\n",
+                  src_path, dst_path, strerror(errno));
+    return -1;
 #endif
 }
 
@@ -371,6 +839,7 @@ block_backend_fs_remove_store (BlockBackend *bend, const char *store_id)
     GDir *dir1, *dir2;
     const char *dname1, *dname2;
     char *path1, *path2;
+    char block_id[41];
 
     block_dir = g_build_filename (priv->block_dir, store_id, NULL);
 
@@ -394,7 +863,10 @@ block_backend_fs_remove_store (BlockBackend *bend, const char *store_id)
 
         while ((dname2 = g_dir_read_name(dir2)) != NULL) {
             path2 = g_build_filename (path1, dname2, NULL);
-            g_unlink (path2);
+            if (g_unlink (path2) == 0 && strlen(dname1) + strlen(dname2) == 40) {
+                snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
+                pool_release_block (bend, block_id);
+            }
             g_free (path2);
         }
         g_dir_close (dir2);
@@ -456,6 +928,145 @@ open_tmp_file (BlockBackend *bend,
     return fd;
 }
 
+/*
+ * Shared block pool.
+ *
+ * With the pool enabled, blocks of all stores with the same content share
+ * one file. Stores keep their own layout, and a block of a store is a hard
+ * link to the pooled file in <seafile_dir>/storage/block-pool. The link count
+ * of a pooled file is the number of references to it plus one, so removing
+ * a block from a store drops its reference without affecting other stores,
+ * and the pooled file goes away with its last reference. Losing a race only
+ * costs a missed chance to share a block, never a block.
+ */
+
+#define POOL_DIR "block-pool"
+
+#ifndef WIN32
+
+static void
+get_pool_path (FsPriv *priv, const char *block_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%.2s/%s",
+              priv->pool_dir, block_id, block_id + 2);
+}
+
+static void
+pool_add_block (BlockBackend *bend, const char *block_id, const char *path)
+{
+    FsPriv *priv = bend->be_priv;
+    char pool_path[SEAF_PATH_MAX];
+    char *tmp_path;
+    SeafStat st, pool_st;
+    int i;
+
+    if (!priv->pool_dir)
+        return;
+
+    get_pool_path (priv, block_id, pool_path);
+    if (create_parent_path (pool_path) < 0)
+        return;
+
+    for (i = 0; i < 2; i++) {
+        if (link (path, pool_path) == 0 || errno != EEXIST)
+            return;
+
+        /* Already pooled, replace our copy with a link to the pooled one. */
+        if (seaf_stat (path, &st) < 0 || seaf_stat (pool_path, &pool_st) < 0)
+            continue;
+        if (st.st_ino == pool_st.st_ino && st.st_dev == pool_st.st_dev)
+            return;
+
+        tmp_path = g_strdup_printf ("%s/%s.%u", priv->tmp_dir,
+                                    block_id, g_random_int());
+        if (link (pool_path, tmp_path) == 0) {
+            if (g_rename (tmp_path, path) < 0)
+                seaf_warning ("Failed to replace block %s with pooled copy: %s.\n",
+                              path, strerror(errno));
+            else
+                /* The pooled inode keeps the time it was first written. */
+                touch_block_file (path);
+            g_unlink (tmp_path);
+            g_free (tmp_path);
+            return;
+        }
+        g_free (tmp_path);
+        /* The pooled copy may have just been released, try to add ours. */
+        if (errno != ENOENT)
+            return;
+    }
+}
+
+static void
+pool_release_block (BlockBackend *bend, const char *block_id)
+{
+    FsPriv *priv = bend->be_priv;
+    char pool_path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    if (!priv->pool_dir)
+        return;
+
+    get_pool_path (priv, block_id, pool_path);
+    if (seaf_stat (pool_path, &st) == 0 && st.st_nlink == 1)
+        g_unlink (pool_path);
+}
+
+int
+block_backend_fs_enable_pool (BlockBackend *bend, const char *seaf_dir)
+{
+    FsPriv *priv = bend->be_priv;
+    char *pool_dir = g_build_filename (seaf_dir, "storage", POOL_DIR, NULL);
+
+    if (g_mkdir_with_parents (pool_dir, 0777) < 0) {
+        seaf_warning ("Failed to create block pool dir %s.\n", pool_dir);
+        g_free (pool_dir);
+        return -1;
+    }
+
+    priv->pool_dir = pool_dir;
+    return 0;
+}
+
+#else
+
+static void
+pool_add_block (BlockBackend *bend, const char *block_id, const char *path)
+{
+}
+
+static void
+pool_release_block (BlockBackend *bend, const char *block_id)
+{
+}
+
+int
+block_backend_fs_enable_pool (BlockBackend *bend, const char *seaf_dir)
+{
+    seaf_warning ("Shared block pool is not supported on Windows.\n");
+    return -1;
+}
+
+#endif
+
+int
+block_backend_fs_enable_io_uring (BlockBackend *bend, int queue_depth,
+                                  int max_buffers)
+{
+    FsPriv *priv = bend->be_priv;
+
+    priv->ring = block_uring_init (queue_depth, max_buffers);
+    return priv->ring ? 0 : -1;
+}
+
+void
+block_backend_fs_set_sync (BlockBackend *bend, gboolean sync_blocks)
+{
+    FsPriv *priv = bend->be_priv;
+
+    priv->sync_blocks = sync_blocks;
+}
+
 BlockBackend *
 block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
 {
@@ -490,11 +1101,16 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->commit_block = block_backend_fs_commit_block;
     bend->close_block = block_backend_fs_close_block;
     bend->exists = block_backend_fs_block_exists;
+    bend->exists_many = block_backend_fs_blocks_exist;
     bend->remove_block = block_backend_fs_remove_block;
+    bend->remove_blocks = block_backend_fs_remove_blocks;
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
+    bend->touch = block_backend_fs_touch_block;
+    bend->get_fd = block_backend_fs_get_fd;
     bend->block_handle_free = block_backend_fs_block_handle_free;
     bend->foreach_block = block_backend_fs_foreach_block;
+    bend->foreach_block_parallel = block_backend_fs_foreach_block_parallel;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
 
@@ -0,0 +1,754 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block metadata index in front of another block backend.
+ *
+ * Quota checks, block maps, range downloads and FUSE stat blocks just to
+ * learn their size. On remote storage each stat is a round trip, and the
+ * compression backend has to read the block header. This backend keeps the
+ * size, write time and a reference hint of each block in a local log per
+ * store:
+ *
+ *   <seaf_dir>/storage/block-meta/<store_id>
+ *
+ * A record is appended when a block is committed or copied to the store,
+ * and a tombstone when it's removed. Blocks that aren't in the log (written
+ * by the Go fileserver, or before the index was enabled) are stat'ed on the
+ * underlying backend once and recorded.
+ *
+ * As in the pack object backend, appends from several processes are
+ * serialized by an flock on the log. Each process replays the records others
+ * appended before it answers from memory, so blocks removed by GC are not
+ * reported by seaf-server. The log is rewritten once most of its records
+ * are dead.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "block-backend.h"
+
+#define META_DIR "block-meta"
+
+/* Rewrite the log when it has more dead records than live ones. */
+#define COMPACT_MIN_DEAD 4096
+
+typedef struct BlockMetaRecord {
+    unsigned char   block_id[20];
+    guint32         size;
+    guint32         ctime;
+    /* 0 for removed blocks. */
+    guint32         refs;
+    guint32         reserved;
+} __attribute__((__packed__)) BlockMetaRecord;
+
+typedef struct MetaEntry {
+    guint32 size;
+    guint32 ctime;
+    guint32 refs;
+} MetaEntry;
+
+typedef struct MetaStore {
+    char           *path;
+    pthread_mutex_t lock;
+
+    int             fd;
+    ino_t           ino;
+    /* Bytes of the log already replayed. */
+    gint64          pos;
+
+    GHashTable     *entries;    /* raw block id -> MetaEntry */
+    gint64          n_records;
+} MetaStore;
+
+typedef struct {
+    BlockBackend   *base;
+    char           *meta_dir;
+
+    pthread_mutex_t lock;
+    GHashTable     *stores;     /* store_id -> MetaStore */
+} MetaPriv;
+
+struct _BHandle {
+    BHandle *base_handle;
+    char    *store_id;
+    char     block_id[41];
+    int      rw_type;
+    guint32  size;              /* bytes written */
+};
+
+static MetaStore *
+meta_store_new (MetaPriv *priv, const char *store_id)
+{
+    MetaStore *store = g_new0 (MetaStore, 1);
+
+    store->path = g_build_filename (priv->meta_dir, store_id, NULL);
+    pthread_mutex_init (&store->lock, NULL);
+    store->fd = -1;
+    store->entries = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                            g_free, g_free);
+    return store;
+}
+
+static void
+meta_store_reset (MetaStore *store)
+{
+    if (store->fd >= 0)
+        close (store->fd);
+    store->fd = -1;
+    store->ino = 0;
+    store->pos = 0;
+    g_hash_table_remove_all (store->entries);
+    store->n_records = 0;
+}
+
+static void
+meta_store_free (MetaStore *store)
+{
+    meta_store_reset (store);
+    g_hash_table_destroy (store->entries);
+    pthread_mutex_destroy (&store->lock);
+    g_free (store->path);
+    g_free (store);
+}
+
+static MetaStore *
+get_store (MetaPriv *priv, const char *store_id)
+{
+    MetaStore *store;
+
+    pthread_mutex_lock (&priv->lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (!store) {
+        store = meta_store_new (priv, store_id);
+        g_hash_table_insert (priv->stores, g_strdup(store_id), store);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return store;
+}
+
+/*
+ * Open the log if it's not opened yet. If it was rewritten by another
+ * process, drop the in-memory index and start over.
+ * Returns -1 on error, 0 if the log doesn't exist and @create is FALSE.
+ */
+static int
+open_log (MetaStore *store, gboolean create)
+{
+    SeafStat st;
+    int fd;
+
+    if (store->fd >= 0) {
+        if (seaf_stat (store->path, &st) == 0 && st.st_ino == store->ino)
+            return 1;
+        meta_store_reset (store);
+    }
+
+    fd = g_open (store->path, O_RDWR | O_BINARY | (create ? O_CREAT : 0), 0666);
+    if (fd < 0) {
+        if (errno == ENOENT && !create)
+            return 0;
+        seaf_warning ("[block meta] Failed to open %s: %s.\n",
+                      store->path, strerror(errno));
+        return -1;
+    }
+
+    if (seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[block meta] Failed to stat %s: %s.\n",
+                      store->path, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    store->fd = fd;
+    store->ino = st.st_ino;
+    return 1;
+}
+
+/* Take the exclusive lock on the current log for appending. */
+static int
+lock_log (MetaStore *store)
+{
+    SeafStat st;
+
+    while (1) {
+        if (open_log (store, TRUE) < 0)
+            return -1;
+
+        if (flock (store->fd, LOCK_EX) < 0) {
+            seaf_warning ("[block meta] Failed to lock %s: %s.\n",
+                          store->path, strerror(errno));
+            return -1;
+        }
+
+        if (seaf_stat (store->path, &st) == 0 && st.st_ino == store->ino)
+            return 0;
+
+        flock (store->fd, LOCK_UN);
+        meta_store_reset (store);
+    }
+}
+
+static void
+unlock_log (MetaStore *store)
+{
+    if (store->fd >= 0)
+        flock (store->fd, LOCK_UN);
+}
+
+static void
+apply_record (MetaStore *store, const BlockMetaRecord *rec)
+{
+    MetaEntry *entry;
+
+    ++store->n_records;
+
+    if (rec->refs == 0) {
+        g_hash_table_remove (store->entries, rec->block_id);
+        return;
+    }
+
+    entry = g_hash_table_lookup (store->entries, rec->block_id);
+    if (!entry) {
+        entry = g_new0 (MetaEntry, 1);
+        g_hash_table_insert (store->entries, g_memdup (rec->block_id, 20), entry);
+    }
+    entry->size = ntohl (rec->size);
+    entry->ctime = ntohl (rec->ctime);
+    entry->refs = ntohl (rec->refs);
+}
+
+#define LOG_READ_BATCH 4096
+
+/*
+ * Replay records appended since last time.
+ * @locked is TRUE if the caller already holds the exclusive lock.
+ */
+static int
+sync_log (MetaStore *store, gboolean locked)
+{
+    SeafStat st;
+    BlockMetaRecord *recs;
+    gint64 end;
+    ssize_t n;
+    int i, n_recs;
+    int ret = 0;
+
+    if (!locked) {
+        int rc = open_log (store, FALSE);
+        if (rc <= 0)
+            return rc;
+        if (flock (store->fd, LOCK_SH) < 0)
+            return -1;
+    }
+
+    if (seaf_fstat (store->fd, &st) < 0) {
+        ret = -1;
+        goto out;
+    }
+    /* Ignore a partial record left by a crashed writer. */
+    end = st.st_size - st.st_size % sizeof(BlockMetaRecord);
+    if (end <= store->pos)
+        goto out;
+
+    recs = g_new (BlockMetaRecord, LOG_READ_BATCH);
+    while (store->pos < end) {
+        n_recs = MIN (LOG_READ_BATCH,
+                      (end - store->pos) / sizeof(BlockMetaRecord));
+        n = pread (store->fd, recs, n_recs * sizeof(BlockMetaRecord),
+                   store->pos);
+        if (n < 0) {
+            seaf_warning ("[block meta] Failed to read %s: %s.\n",
+                          store->path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        n_recs = n / sizeof(BlockMetaRecord);
+        if (n_recs == 0)
+            break;
+        for (i = 0; i < n_recs; ++i)
+            apply_record (store, &recs[i]);
+        store->pos += n_recs * sizeof(BlockMetaRecord);
+    }
+    g_free (recs);
+
+out:
+    if (!locked)
+        flock (store->fd, LOCK_UN);
+    return ret;
+}
+
+/*
+ * Write the live entries to a new log and rename it over the old one.
+ * Must be called with the exclusive lock held. Other processes notice the
+ * new inode and reload.
+ */
+static void
+compact_log (MetaStore *store)
+{
+    char tmp_path[SEAF_PATH_MAX];
+    GHashTableIter iter;
+    gpointer key, value;
+    BlockMetaRecord rec;
+    MetaEntry *entry;
+    int fd;
+
+    snprintf (tmp_path, SEAF_PATH_MAX, "%s.compact", store->path);
+    fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[block meta] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        return;
+    }
+
+    memset (&rec, 0, sizeof(rec));
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+        memcpy (rec.block_id, key, 20);
+        rec.size = htonl (entry->size);
+        rec.ctime = htonl (entry->ctime);
+        rec.refs = htonl (entry->refs);
+        if (writen (fd, &rec, sizeof(rec)) != sizeof(rec)) {
+            seaf_warning ("[block meta] Failed to write %s: %s.\n",
+                          tmp_path, strerror(errno));
+            close (fd);
+            g_unlink (tmp_path);
+            return;
+        }
+    }
+    close (fd);
+
+    if (g_rename (tmp_path, store->path) < 0) {
+        seaf_warning ("[block meta] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+    }
+}
+
+/*
+ * Record a block written at @ctime, or remove it if @size is negative.
+ * Blocks are content-addressed, so a block already in the index keeps its
+ * size and gets another reference. Its write time moves to @ctime, as GC
+ * has to treat a block written again as a recent one.
+ */
+static void
+update_index (MetaPriv *priv, const char *store_id, const char *block_id,
+              gint64 size, gint64 ctime)
+{
+    MetaStore *store = get_store (priv, store_id);
+    BlockMetaRecord rec;
+    MetaEntry *entry;
+    SeafStat st;
+    gint64 end;
+    gboolean compact = FALSE;
+
+    memset (&rec, 0, sizeof(rec));
+    hex_to_rawdata (block_id, rec.block_id, 20);
+
+    pthread_mutex_lock (&store->lock);
+
+    if (size < 0 && open_log (store, FALSE) <= 0)
+        goto out;
+
+    if (lock_log (store) < 0)
+        goto out;
+    if (sync_log (store, TRUE) < 0)
+        goto unlock;
+
+    entry = g_hash_table_lookup (store->entries, rec.block_id);
+    if (size < 0) {
+        if (!entry)
+            goto unlock;
+    } else if (entry) {
+        rec.size = htonl (entry->size);
+        rec.ctime = htonl (MAX (entry->ctime, (guint32)ctime));
+        rec.refs = htonl (entry->refs + 1);
+    } else {
+        rec.size = htonl ((guint32)size);
+        rec.ctime = htonl ((guint32)ctime);
+        rec.refs = htonl (1);
+    }
+
+    if (seaf_fstat (store->fd, &st) < 0)
+        goto unlock;
+    end = st.st_size - st.st_size % sizeof(rec);
+    if (pwrite (store->fd, &rec, sizeof(rec), end) != sizeof(rec)) {
+        seaf_warning ("[block meta] Failed to write %s: %s.\n",
+                      store->path, strerror(errno));
+        goto unlock;
+    }
+    apply_record (store, &rec);
+    store->pos = end + sizeof(rec);
+
+    if (store->n_records - g_hash_table_size (store->entries) >
+        MAX (g_hash_table_size (store->entries), COMPACT_MIN_DEAD)) {
+        compact_log (store);
+        compact = TRUE;
+    }
+
+unlock:
+    unlock_log (store);
+    /* Reload from the new log. */
+    if (compact)
+        meta_store_reset (store);
+out:
+    pthread_mutex_unlock (&store->lock);
+}
+
+static gboolean
+lookup_index (MetaPriv *priv, const char *store_id, const char *block_id,
+              BMetadata *md)
+{
+    MetaStore *store = get_store (priv, store_id);
+    unsigned char raw_id[20];
+    MetaEntry *entry;
+    gboolean ret = FALSE;
+
+    hex_to_rawdata (block_id, raw_id, 20);
+
+    pthread_mutex_lock (&store->lock);
+    /* Catch up with blocks removed by other processes. */
+    if (sync_log (store, FALSE) < 0)
+        goto out;
+    entry = g_hash_table_lookup (store->entries, raw_id);
+    if (entry) {
+        memcpy (md->id, block_id, 41);
+        md->size = entry->size;
+        md->ctime = entry->ctime;
+        md->refs = entry->refs;
+        ret = TRUE;
+    }
+out:
+    pthread_mutex_unlock (&store->lock);
+    return ret;
+}
+
+static BHandle *
+block_backend_meta_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    MetaPriv *priv = bend->be_priv;
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->base_handle = priv->base->open_block (priv->base, store_id, version,
+                                                  block_id, rw_type);
+    if (!handle->base_handle) {
+        g_free (handle);
+        return NULL;
+    }
+    handle->store_id = g_strdup (store_id);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+
+    return handle;
+}
+
+static int
+block_backend_meta_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    return priv->base->read_block (priv->base, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_meta_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    MetaPriv *priv = bend->be_priv;
+    int n;
+
+    n = priv->base->write_block (priv->base, handle->base_handle, buf, len);
+    if (n > 0)
+        handle->size += n;
+    return n;
+}
+
+static int
+block_backend_meta_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    MetaPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->commit_block (priv->base, handle->base_handle);
+    if (ret == 0)
+        update_index (priv, handle->store_id, handle->block_id,
+                      handle->size, (gint64)time(NULL));
+
+    return ret;
+}
+
+static int
+block_backend_meta_close_block (BlockBackend *bend, BHandle *handle)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    return priv->base->close_block (priv->base, handle->base_handle);
+}
+
+static void
+block_backend_meta_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    priv->base->block_handle_free (priv->base, handle->base_handle);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_meta_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    return priv->base->exists (priv->base, store_id, version, block_id);
+}
+
+static void
+block_backend_meta_blocks_exist (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *results)
+{
+    MetaPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    int i;
+
+    if (base->exists_many) {
+        base->exists_many (base, store_id, version, block_ids, n_blocks, results);
+        return;
+    }
+    for (i = 0; i < n_blocks; ++i)
+        results[i] = base->exists (base, store_id, version, block_ids[i]);
+}
+
+static int
+block_backend_meta_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    MetaPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->remove_block (priv->base, store_id, version, block_id);
+    if (ret == 0)
+        update_index (priv, store_id, block_id, -1, 0);
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_meta_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    MetaPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    block_md = g_new0 (BMetadata, 1);
+    if (lookup_index (priv, store_id, block_id, block_md))
+        return block_md;
+    g_free (block_md);
+
+    block_md = priv->base->stat_block (priv->base, store_id, version, block_id);
+    if (block_md)
+        update_index (priv, store_id, block_id,
+                      block_md->size, block_md->ctime);
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_meta_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    MetaPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (handle->rw_type == BLOCK_READ) {
+        block_md = g_new0 (BMetadata, 1);
+        if (lookup_index (priv, handle->store_id, handle->block_id, block_md))
+            return block_md;
+        g_free (block_md);
+    }
+
+    return priv->base->stat_block_by_handle (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_meta_touch_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    MetaPriv *priv = bend->be_priv;
+    BlockBackend *base = priv->base;
+    BMetadata md;
+
+    if (base->touch && base->touch (base, store_id, version, block_id) < 0)
+        return -1;
+    /* Blocks not in the index yet take the time from the base backend. */
+    if (lookup_index (priv, store_id, block_id, &md))
+        update_index (priv, store_id, block_id, md.size, (gint64)time(NULL));
+
+    return 0;
+}
+
+static int
+block_backend_meta_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    if (!priv->base->get_fd)
+        return -1;
+    return priv->base->get_fd (priv->base, handle->base_handle);
+}
+
+static int
+block_backend_meta_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block (priv->base, store_id, version,
+                                      process, user_data);
+}
+
+static int
+block_backend_meta_foreach_block_parallel (BlockBackend *bend,
+                                           const char *store_id,
+                                           int version,
+                                           int max_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data)
+{
+    MetaPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block_parallel (priv->base, store_id, version,
+                                               max_threads, process, user_data);
+}
+
+static int
+block_backend_meta_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    MetaPriv *priv = bend->be_priv;
+    BMetadata md;
+    int ret;
+
+    ret = priv->base->copy (priv->base, src_store_id, src_version,
+                            dst_store_id, dst_version, block_id);
+    if (ret == 0 && lookup_index (priv, src_store_id, block_id, &md))
+        update_index (priv, dst_store_id, block_id,
+                      md.size, (gint64)time(NULL));
+
+    return ret;
+}
+
+static int
+block_backend_meta_remove_store (BlockBackend *bend, const char *store_id)
+{
+    MetaPriv *priv = bend->be_priv;
+    MetaStore *store = get_store (priv, store_id);
+    int ret;
+
+    ret = priv->base->remove_store (priv->base, store_id);
+
+    pthread_mutex_lock (&store->lock);
+    if (lock_log (store) == 0) {
+        g_unlink (store->path);
+        unlock_log (store);
+    }
+    meta_store_reset (store);
+    pthread_mutex_unlock (&store->lock);
+
+    return ret;
+}
+
+/*
+ * Wrap @base with a block metadata index kept under @seaf_dir.
+ * Returns @base if the index can't be set up.
+ */
+BlockBackend *
+block_backend_meta_new (BlockBackend *base, const char *seaf_dir)
+{
+    BlockBackend *bend;
+    MetaPriv *priv;
+    char *meta_dir;
+
+    meta_dir = g_build_filename (seaf_dir, "storage", META_DIR, NULL);
+    if (g_mkdir_with_parents (meta_dir, 0777) < 0) {
+        seaf_warning ("[block meta] Failed to create dir %s: %s.\n",
+                      meta_dir, strerror(errno));
+        g_free (meta_dir);
+        return base;
+    }
+
+    priv = g_new0 (MetaPriv, 1);
+    priv->base = base;
+    priv->meta_dir = meta_dir;
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)meta_store_free);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_meta_open_block;
+    bend->read_block = block_backend_meta_read_block;
+    bend->write_block = block_backend_meta_write_block;
+    bend->commit_block = block_backend_meta_commit_block;
+    bend->close_block = block_backend_meta_close_block;
+    bend->exists = block_backend_meta_block_exists;
+    bend->exists_many = block_backend_meta_blocks_exist;
+    bend->remove_block = block_backend_meta_remove_block;
+    bend->stat_block = block_backend_meta_stat_block;
+    bend->stat_block_by_handle = block_backend_meta_stat_block_by_handle;
+    bend->touch = block_backend_meta_touch_block;
+    bend->get_fd = block_backend_meta_get_fd;
+    bend->block_handle_free = block_backend_meta_block_handle_free;
+    bend->foreach_block = block_backend_meta_foreach_block;
+    if (base->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_meta_foreach_block_parallel;
+    bend->remove_store = block_backend_meta_remove_store;
+    bend->copy = block_backend_meta_copy;
+
+    return bend;
+}
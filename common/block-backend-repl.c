@@ -0,0 +1,362 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Asynchronous replication of blocks to a secondary block backend.
+ *
+ * Committed and copied blocks are appended to the replication log, and
+ * copied to the secondary by its shipper thread, see repl-log.h. Blocks
+ * that can't be opened on the primary are read from the secondary.
+ * Removals are not replicated; the secondary only grows until it's
+ * collected by running GC against it.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+#include "log.h"
+
+#include "block-backend.h"
+#include "repl-log.h"
+
+#define SHIP_BUF_SIZE (64 * 1024)
+
+typedef struct {
+    BlockBackend   *base;
+    BlockBackend   *secondary;
+    ReplLog        *log;
+} ReplPriv;
+
+struct _BHandle {
+    BHandle      *base_handle;
+    /* The backend base_handle belongs to. */
+    BlockBackend *owner;
+    char         *store_id;
+    int           version;
+    char          block_id[41];
+    int           rw_type;
+};
+
+static int
+ship_block (const char *store_id, int version, const char *block_id,
+            void *vdata)
+{
+    ReplPriv *priv = vdata;
+    BlockBackend *base = priv->base;
+    BlockBackend *secondary = priv->secondary;
+    BHandle *src, *dst = NULL;
+    char *buf = NULL;
+    int n;
+    int ret = -1;
+
+    if (secondary->exists (secondary, store_id, version, block_id))
+        return 0;
+
+    src = base->open_block (base, store_id, version, block_id, BLOCK_READ);
+    if (!src) {
+        /* Removed since it was logged. */
+        return base->exists (base, store_id, version, block_id) ? -1 : 0;
+    }
+
+    dst = secondary->open_block (secondary, store_id, version, block_id, BLOCK_WRITE);
+    if (!dst)
+        goto out;
+
+    buf = g_malloc (SHIP_BUF_SIZE);
+    while ((n = base->read_block (base, src, buf, SHIP_BUF_SIZE)) > 0) {
+        if (secondary->write_block (secondary, dst, buf, n) != n)
+            goto out;
+    }
+    if (n < 0)
+        goto out;
+
+    if (secondary->close_block (secondary, dst) < 0 ||
+        secondary->commit_block (secondary, dst) < 0)
+        goto out;
+    ret = 0;
+
+out:
+    if (ret < 0)
+        seaf_warning ("[block repl] Failed to replicate block %s:%s.\n",
+                      store_id, block_id);
+    g_free (buf);
+    if (dst)
+        secondary->block_handle_free (secondary, dst);
+    base->close_block (base, src);
+    base->block_handle_free (base, src);
+    return ret;
+}
+
+static BHandle *
+block_backend_repl_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    ReplPriv *priv = bend->be_priv;
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->owner = priv->base;
+    handle->base_handle = priv->base->open_block (priv->base, store_id, version,
+                                                  block_id, rw_type);
+    if (!handle->base_handle && rw_type == BLOCK_READ) {
+        handle->owner = priv->secondary;
+        handle->base_handle = priv->secondary->open_block (priv->secondary, store_id,
+                                                           version, block_id, rw_type);
+        if (handle->base_handle)
+            seaf_message ("[block repl] Reading block %s:%s from the secondary.\n",
+                          store_id, block_id);
+    }
+    if (!handle->base_handle) {
+        g_free (handle);
+        return NULL;
+    }
+
+    handle->store_id = g_strdup (store_id);
+    handle->version = version;
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+
+    return handle;
+}
+
+static int
+block_backend_repl_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    return handle->owner->read_block (handle->owner, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_repl_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    return handle->owner->write_block (handle->owner, handle->base_handle, buf, len);
+}
+
+static int
+block_backend_repl_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    ReplPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->commit_block (priv->base, handle->base_handle);
+    if (ret == 0)
+        repl_log_append (priv->log, handle->store_id, handle->version,
+                         handle->block_id);
+
+    return ret;
+}
+
+static int
+block_backend_repl_close_block (BlockBackend *bend, BHandle *handle)
+{
+    return handle->owner->close_block (handle->owner, handle->base_handle);
+}
+
+static void
+block_backend_repl_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    handle->owner->block_handle_free (handle->owner, handle->base_handle);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_repl_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->exists (priv->base, store_id, version, block_id);
+}
+
+static void
+block_backend_repl_blocks_exist (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *results)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    priv->base->exists_many (priv->base, store_id, version,
+                             block_ids, n_blocks, results);
+}
+
+static int
+block_backend_repl_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->remove_block (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_repl_remove_blocks (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->remove_blocks (priv->base, store_id, version,
+                                      block_ids, n_blocks);
+}
+
+static BMetadata *
+block_backend_repl_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    ReplPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    block_md = priv->base->stat_block (priv->base, store_id, version, block_id);
+    if (!block_md)
+        block_md = priv->secondary->stat_block (priv->secondary, store_id,
+                                                version, block_id);
+    return block_md;
+}
+
+static BMetadata *
+block_backend_repl_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    return handle->owner->stat_block_by_handle (handle->owner, handle->base_handle);
+}
+
+static int
+block_backend_repl_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    if (!handle->owner->get_fd)
+        return -1;
+    return handle->owner->get_fd (handle->owner, handle->base_handle);
+}
+
+static int
+block_backend_repl_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block (priv->base, store_id, version,
+                                      process, user_data);
+}
+
+static int
+block_backend_repl_foreach_block_parallel (BlockBackend *bend,
+                                           const char *store_id,
+                                           int version,
+                                           int max_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->foreach_block_parallel (priv->base, store_id, version,
+                                               max_threads, process, user_data);
+}
+
+static int
+block_backend_repl_touch_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->touch (priv->base, store_id, version, block_id);
+}
+
+static int
+block_backend_repl_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    ReplPriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->base->copy (priv->base, src_store_id, src_version,
+                            dst_store_id, dst_version, block_id);
+    if (ret == 0)
+        repl_log_append (priv->log, dst_store_id, dst_version, block_id);
+
+    return ret;
+}
+
+static int
+block_backend_repl_remove_store (BlockBackend *bend, const char *store_id)
+{
+    ReplPriv *priv = bend->be_priv;
+
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+/*
+ * Replicate the blocks written to @base to @secondary, via the log kept
+ * under @seaf_dir. Returns @base if the log can't be set up.
+ */
+BlockBackend *
+block_backend_repl_new (BlockBackend *base, BlockBackend *secondary,
+                        const char *seaf_dir, GKeyFile *config)
+{
+    BlockBackend *bend;
+    ReplPriv *priv;
+
+    priv = g_new0 (ReplPriv, 1);
+    priv->base = base;
+    priv->secondary = secondary;
+    priv->log = repl_log_new (seaf_dir, "blocks", config, ship_block, priv);
+    if (!priv->log) {
+        g_free (priv);
+        return base;
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_repl_open_block;
+    bend->read_block = block_backend_repl_read_block;
+    bend->write_block = block_backend_repl_write_block;
+    bend->commit_block = block_backend_repl_commit_block;
+    bend->close_block = block_backend_repl_close_block;
+    bend->exists = block_backend_repl_block_exists;
+    if (base->exists_many)
+        bend->exists_many = block_backend_repl_blocks_exist;
+    bend->remove_block = block_backend_repl_remove_block;
+    if (base->remove_blocks)
+        bend->remove_blocks = block_backend_repl_remove_blocks;
+    bend->stat_block = block_backend_repl_stat_block;
+    bend->stat_block_by_handle = block_backend_repl_stat_block_by_handle;
+    if (base->touch)
+        bend->touch = block_backend_repl_touch_block;
+    bend->get_fd = block_backend_repl_get_fd;
+    bend->block_handle_free = block_backend_repl_block_handle_free;
+    bend->foreach_block = block_backend_repl_foreach_block;
+    if (base->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_repl_foreach_block_parallel;
+    bend->remove_store = block_backend_repl_remove_store;
+    bend->copy = block_backend_repl_copy;
+
+    return bend;
+}
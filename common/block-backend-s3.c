@@ -0,0 +1,423 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_S3
+
+#include "utils.h"
+#include "log.h"
+
+#include "block-backend.h"
+#include "s3-client.h"
+
+/*
+ * Blocks are stored as objects named <store_id>/<block_id>. A block is
+ * read into memory when opened, and written in one PUT when committed.
+ */
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+    char    *data;              /* read handles */
+    int     len;
+    int     off;
+    GByteArray *buf;            /* write handles */
+};
+
+typedef struct {
+    S3Client *client;
+} S3Priv;
+
+static char *
+block_key (const char *store_id, const char *block_id)
+{
+    return g_strdup_printf ("%s/%s", store_id, block_id);
+}
+
+static BHandle *
+block_backend_s3_open_block (BlockBackend *bend,
+                             const char *store_id,
+                             int version,
+                             const char *block_id,
+                             int rw_type)
+{
+    S3Priv *priv = bend->be_priv;
+    BHandle *handle;
+    char *key;
+    gboolean not_found;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    handle->store_id = g_strdup (store_id);
+    handle->version = version;
+
+    if (rw_type == BLOCK_READ) {
+        key = block_key (store_id, block_id);
+        if (s3_client_get (priv->client, key, (void **)&handle->data,
+                           &handle->len, &not_found) < 0) {
+            if (!not_found)
+                seaf_warning ("[block bend] failed to read block %s:%s.\n",
+                              store_id, block_id);
+            g_free (key);
+            g_free (handle->store_id);
+            g_free (handle);
+            return NULL;
+        }
+        g_free (key);
+    } else {
+        handle->buf = g_byte_array_new ();
+    }
+
+    return handle;
+}
+
+static int
+block_backend_s3_read_block (BlockBackend *bend,
+                             BHandle *handle,
+                             void *buf, int len)
+{
+    int n = MIN (len, handle->len - handle->off);
+
+    memcpy (buf, handle->data + handle->off, n);
+    handle->off += n;
+    return n;
+}
+
+static int
+block_backend_s3_write_block (BlockBackend *bend,
+                              BHandle *handle,
+                              const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_s3_close_block (BlockBackend *bend, BHandle *handle)
+{
+    return 0;
+}
+
+static void
+block_backend_s3_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    g_free (handle->data);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_s3_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    S3Priv *priv = bend->be_priv;
+    char *key;
+    int ret;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    key = block_key (handle->store_id, handle->block_id);
+    ret = s3_client_put (priv->client, key, handle->buf->data, handle->buf->len);
+    if (ret < 0)
+        seaf_warning ("[block bend] failed to commit block %s:%s.\n",
+                      handle->store_id, handle->block_id);
+    g_free (key);
+
+    return ret;
+}
+
+static gboolean
+block_backend_s3_block_exists (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    char *key = block_key (store_id, block_id);
+    int ret;
+
+    ret = s3_client_head (priv->client, key, NULL, NULL);
+    g_free (key);
+
+    return ret == 1;
+}
+
+static void
+block_backend_s3_blocks_exist (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char **block_ids,
+                               int n_blocks,
+                               gboolean *results)
+{
+    S3Priv *priv = bend->be_priv;
+    char **keys = g_new (char *, n_blocks);
+    int i;
+
+    for (i = 0; i < n_blocks; ++i)
+        keys[i] = block_key (store_id, block_ids[i]);
+
+    s3_client_head_many (priv->client, (const char **)keys, n_blocks, results);
+
+    for (i = 0; i < n_blocks; ++i)
+        g_free (keys[i]);
+    g_free (keys);
+}
+
+static int
+block_backend_s3_remove_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    char *key = block_key (store_id, block_id);
+    int ret;
+
+    ret = s3_client_delete (priv->client, key);
+    g_free (key);
+
+    return ret;
+}
+
+static int
+block_backend_s3_remove_blocks (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char **block_ids,
+                                int n_blocks)
+{
+    S3Priv *priv = bend->be_priv;
+    char **keys = g_new (char *, n_blocks);
+    int i, ret;
+
+    for (i = 0; i < n_blocks; ++i)
+        keys[i] = block_key (store_id, block_ids[i]);
+
+    ret = s3_client_delete_many (priv->client, (const char **)keys, n_blocks);
+
+    for (i = 0; i < n_blocks; ++i)
+        g_free (keys[i]);
+    g_free (keys);
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_s3_stat_block (BlockBackend *bend,
+                             const char *store_id,
+                             int version,
+                             const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    char *key = block_key (store_id, block_id);
+    gint64 size, mtime;
+    BMetadata *block_md;
+
+    if (s3_client_head (priv->client, key, &size, &mtime) != 1) {
+        g_free (key);
+        return NULL;
+    }
+    g_free (key);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t) size;
+    block_md->ctime = (int64_t) mtime;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_s3_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    BMetadata *block_md;
+
+    block_md = block_backend_s3_stat_block (bend, handle->store_id,
+                                            handle->version, handle->block_id);
+    if (block_md && handle->rw_type == BLOCK_READ)
+        block_md->size = (uint32_t) handle->len;
+
+    return block_md;
+}
+
+typedef struct ForeachData {
+    const char *store_id;
+    int version;
+    SeafBlockFunc process;
+    void *user_data;
+    volatile gint stop;
+} ForeachData;
+
+static gboolean
+foreach_key (const char *key, gint64 size, void *vdata)
+{
+    ForeachData *data = vdata;
+    const char *block_id = strrchr (key, '/');
+
+    if (g_atomic_int_get (&data->stop))
+        return FALSE;
+    if (!block_id || strlen(block_id + 1) != 40)
+        return TRUE;
+
+    if (!data->process (data->store_id, data->version, block_id + 1,
+                        data->user_data)) {
+        g_atomic_int_set (&data->stop, 1);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int
+block_backend_s3_foreach_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                SeafBlockFunc process,
+                                void *user_data)
+{
+    S3Priv *priv = bend->be_priv;
+    ForeachData data;
+    char *prefix;
+    int ret;
+
+    memset (&data, 0, sizeof(data));
+    data.store_id = store_id;
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+
+    prefix = g_strdup_printf ("%s/", store_id);
+    ret = s3_client_list (priv->client, prefix, foreach_key, &data);
+    g_free (prefix);
+
+    return ret;
+}
+
+typedef struct ForeachParallelData {
+    S3Client *client;
+    ForeachData data;
+    volatile gint failed;
+} ForeachParallelData;
+
+/* Lists the blocks whose ids start with the 2 hex digits of @i. */
+static gboolean
+foreach_block_with_prefix (int i, void *vdata)
+{
+    ForeachParallelData *pdata = vdata;
+    char *prefix;
+
+    if (g_atomic_int_get (&pdata->data.stop))
+        return TRUE;
+
+    prefix = g_strdup_printf ("%s/%02x", pdata->data.store_id, i);
+    if (s3_client_list (pdata->client, prefix, foreach_key, &pdata->data) < 0)
+        g_atomic_int_set (&pdata->failed, 1);
+    g_free (prefix);
+
+    return TRUE;
+}
+
+/* Listings of disjoint prefixes run in parallel. */
+static int
+block_backend_s3_foreach_block_parallel (BlockBackend *bend,
+                                         const char *store_id,
+                                         int version,
+                                         int max_threads,
+                                         SeafBlockFunc process,
+                                         void *user_data)
+{
+    S3Priv *priv = bend->be_priv;
+    ForeachParallelData pdata;
+    gboolean results[256];
+
+    memset (&pdata, 0, sizeof(pdata));
+    pdata.client = priv->client;
+    pdata.data.store_id = store_id;
+    pdata.data.version = version;
+    pdata.data.process = process;
+    pdata.data.user_data = user_data;
+
+    run_parallel_jobs (256, MIN (max_threads, s3_client_max_in_flight (priv->client)),
+                       foreach_block_with_prefix, &pdata, results);
+
+    return pdata.failed ? -1 : 0;
+}
+
+static int
+block_backend_s3_copy (BlockBackend *bend,
+                       const char *src_store_id,
+                       int src_version,
+                       const char *dst_store_id,
+                       int dst_version,
+                       const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    char *src_key = block_key (src_store_id, block_id);
+    char *dst_key = block_key (dst_store_id, block_id);
+    int ret;
+
+    ret = s3_client_copy (priv->client, src_key, dst_key);
+    g_free (src_key);
+    g_free (dst_key);
+
+    return ret;
+}
+
+static int
+block_backend_s3_remove_store (BlockBackend *bend, const char *store_id)
+{
+    S3Priv *priv = bend->be_priv;
+    char *prefix = g_strdup_printf ("%s/", store_id);
+    int ret;
+
+    ret = s3_client_delete_prefix (priv->client, prefix);
+    g_free (prefix);
+
+    return ret;
+}
+
+BlockBackend *
+block_backend_s3_new (GKeyFile *config, const char *group)
+{
+    BlockBackend *bend;
+    S3Priv *priv;
+    S3Client *client;
+
+    client = s3_client_new (config, group);
+    if (!client)
+        return NULL;
+
+    bend = g_new0 (BlockBackend, 1);
+    priv = g_new0 (S3Priv, 1);
+    priv->client = client;
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_s3_open_block;
+    bend->read_block = block_backend_s3_read_block;
+    bend->write_block = block_backend_s3_write_block;
+    bend->commit_block = block_backend_s3_commit_block;
+    bend->close_block = block_backend_s3_close_block;
+    bend->exists = block_backend_s3_block_exists;
+    bend->exists_many = block_backend_s3_blocks_exist;
+    bend->remove_block = block_backend_s3_remove_block;
+    bend->remove_blocks = block_backend_s3_remove_blocks;
+    bend->stat_block = block_backend_s3_stat_block;
+    bend->stat_block_by_handle = block_backend_s3_stat_block_by_handle;
+    bend->block_handle_free = block_backend_s3_block_handle_free;
+    bend->foreach_block = block_backend_s3_foreach_block;
+    bend->foreach_block_parallel = block_backend_s3_foreach_block_parallel;
+    bend->remove_store = block_backend_s3_remove_store;
+    bend->copy = block_backend_s3_copy;
+
+    return bend;
+}
+
+#endif  /* HAVE_S3 */
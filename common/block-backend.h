@@ -25,16 +25,44 @@ struct BlockBackend {
                         const char *store_id, int version,
                         const char *block_id);
 
+    /* Optional. Check existence of many blocks at once. The result for
+     * block_ids[i] is stored in results[i].
+     */
+    void     (*exists_many) (BlockBackend *bend,
+                             const char *store_id, int version,
+                             const char **block_ids, int n_blocks,
+                             gboolean *results);
+
     int      (*remove_block) (BlockBackend *bend,
                               const char *store_id, int version,
                               const char *block_id);
 
+    /* Remove many blocks at once. Returns -1 if any of them could not be
+     * removed. Optional.
+     */
+    int      (*remove_blocks) (BlockBackend *bend,
+                               const char *store_id, int version,
+                               const char **block_ids, int n_blocks);
+
     BMetadata* (*stat_block) (BlockBackend *bend,
                               const char *store_id, int version,
                               const char *block_id);
     
     BMetadata* (*stat_block_by_handle) (BlockBackend *bend, BHandle *handle);
 
+    /* Optional. Sets the write time of an existing block to now. Returns
+     * -1 if the block doesn't exist.
+     */
+    int      (*touch) (BlockBackend *bend,
+                       const char *store_id, int version,
+                       const char *block_id);
+
+    /* Optional. Returns the file descriptor of a block opened for reading,
+     * or -1 if the backend doesn't keep blocks in local files.
+     * The fd is still owned by the handle.
+     */
+    int      (*get_fd) (BlockBackend *bend, BHandle *handle);
+
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
     int      (*foreach_block) (BlockBackend *bend,
@@ -43,6 +71,17 @@ struct BlockBackend {
                                SeafBlockFunc process,
                                void *user_data);
 
+    /* Like foreach_block, but lists the store on up to @max_threads
+     * threads. @process may be called from several threads at once, and
+     * returning FALSE from any of them stops the others. Optional.
+     */
+    int      (*foreach_block_parallel) (BlockBackend *bend,
+                                        const char *store_id,
+                                        int version,
+                                        int max_threads,
+                                        SeafBlockFunc process,
+                                        void *user_data);
+
     int         (*copy) (BlockBackend *bend,
                          const char *src_store_id,
                          int src_version,
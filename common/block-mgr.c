@@ -18,29 +18,247 @@
 #include <glib/gstdio.h>
 
 #include "block-backend.h"
+#include "bg-throttle.h"
+#include "access-stats.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
+#define DEFAULT_IO_URING_QUEUE_DEPTH 256
+/* Slots for the buffers that stay registered with the ring. */
+#define IO_URING_MAX_BUFFERS 1024
+
 
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+extern int
+block_backend_fs_enable_pool (BlockBackend *bend, const char *seaf_dir);
+
+extern int
+block_backend_fs_enable_io_uring (BlockBackend *bend, int queue_depth,
+                                  int max_buffers);
+
+extern void
+block_backend_fs_set_sync (BlockBackend *bend, gboolean sync_blocks);
+
+#ifdef HAVE_S3
+extern BlockBackend *
+block_backend_s3_new (GKeyFile *config, const char *group);
+#endif
+
+extern BlockBackend *
+block_backend_cache_new (BlockBackend *base, const char *cache_dir,
+                         gint64 max_bytes, int fill_threads);
+
+extern BlockBackend *
+block_backend_compress_new (BlockBackend *base, const char *codec);
+
+extern BlockBackend *
+block_backend_filter_new (BlockBackend *base);
+
+BlockBackend *
+block_backend_meta_new (BlockBackend *base, const char *seaf_dir);
+
+extern BlockBackend *
+block_backend_repl_new (BlockBackend *base, BlockBackend *secondary,
+                        const char *seaf_dir, GKeyFile *config);
+
+/*
+ * An optional read cache on a faster local disk can be put in front of
+ * the block storage:
+ *
+ * [block_backend]
+ * cache_dir = /ssd/seafile-block-cache
+ * cache_size = 102400     # in MB
+ * cache_fill_threads = 2
+ */
+static BlockBackend *
+load_block_cache (struct _SeafileSession *seaf, BlockBackend *base)
+{
+    char *cache_dir;
+    gint64 cache_size;
+    int fill_threads;
+    BlockBackend *bend;
+
+    cache_dir = g_key_file_get_string (seaf->config, "block_backend",
+                                       "cache_dir", NULL);
+    if (!cache_dir)
+        return base;
+
+    cache_size = g_key_file_get_int64 (seaf->config, "block_backend",
+                                       "cache_size", NULL);
+    fill_threads = g_key_file_get_integer (seaf->config, "block_backend",
+                                           "cache_fill_threads", NULL);
+
+    bend = block_backend_cache_new (base, cache_dir, cache_size << 20, fill_threads);
+
+    g_free (cache_dir);
+    return bend;
+}
+
+
+/*
+ * Blocks are kept in local files by default. With
+ *
+ * [block_backend]
+ * name = s3
+ *
+ * they are stored in an S3 compatible bucket instead, see s3-client.h.
+ */
+static BlockBackend *
+load_base_backend (struct _SeafileSession *seaf, const char *group,
+                   const char *seaf_dir, const char *tmp_dir,
+                   gboolean *is_fs)
+{
+    BlockBackend *bend = NULL;
+    char *name;
+
+    name = g_key_file_get_string (seaf->config, group, "name", NULL);
+    *is_fs = (!name || strcmp (name, "filesystem") == 0);
+
+    if (*is_fs) {
+        bend = block_backend_fs_new (seaf_dir, tmp_dir);
+    } else if (strcmp (name, "s3") == 0) {
+#ifdef HAVE_S3
+        bend = block_backend_s3_new (seaf->config, group);
+#else
+        seaf_warning ("[Block mgr] Built without S3 support.\n");
+#endif
+    } else {
+        seaf_warning ("[Block mgr] Unknown block backend %s.\n", name);
+    }
+
+    g_free (name);
+    return bend;
+}
+
+/*
+ * New blocks are replicated to a secondary backend, configured like the
+ * primary one, with
+ *
+ * [block_backend_replica]
+ * name = filesystem
+ * path = /mnt/dr/seafile-data
+ *
+ * See repl-log.h for the settings of the shipper.
+ */
+static BlockBackend *
+load_replication (struct _SeafileSession *seaf, const char *seaf_dir,
+                  BlockBackend *base)
+{
+    BlockBackend *secondary = NULL;
+    char *name, *path, *tmp_dir;
+    gboolean is_fs;
+
+    if (!g_key_file_has_group (seaf->config, "block_backend_replica"))
+        return base;
+
+    name = g_key_file_get_string (seaf->config, "block_backend_replica",
+                                  "name", NULL);
+    path = g_key_file_get_string (seaf->config, "block_backend_replica",
+                                  "path", NULL);
+    if ((!name || strcmp (name, "filesystem") == 0) && !path) {
+        seaf_warning ("[Block mgr] path is not set for the block replica.\n");
+    } else {
+        tmp_dir = path ? g_build_filename (path, "tmpfiles", NULL) : NULL;
+        secondary = load_base_backend (seaf, "block_backend_replica",
+                                       path, tmp_dir, &is_fs);
+        g_free (tmp_dir);
+    }
+    g_free (name);
+    g_free (path);
+
+    if (!secondary) {
+        seaf_warning ("[Block mgr] Failed to load the block replica, "
+                      "blocks are not replicated.\n");
+        return base;
+    }
+
+    return block_backend_repl_new (base, secondary, seaf_dir, seaf->config);
+}
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+    char *compression;
+    gboolean is_fs;
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
 
-    mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    mgr->backend = load_base_backend (seaf, "block_backend", seaf_dir,
+                                      seaf->tmp_file_dir, &is_fs);
     if (!mgr->backend) {
         seaf_warning ("[Block mgr] Failed to load backend.\n");
         goto onerror;
     }
 
+    /* shared_pool = true makes blocks with the same content in different
+     * stores share one file.
+     */
+    if (is_fs && g_key_file_get_boolean (seaf->config, "block_backend",
+                                "shared_pool", NULL) &&
+        block_backend_fs_enable_pool (mgr->backend, seaf_dir) < 0) {
+        seaf_warning ("[Block mgr] Failed to enable shared block pool.\n");
+        goto onerror;
+    }
+
+    /* sync_blocks = true fsyncs the contents of new blocks before they are
+     * renamed into place.
+     */
+    if (is_fs)
+        block_backend_fs_set_sync (mgr->backend,
+                                   g_key_file_get_boolean (seaf->config, "block_backend",
+                                                           "sync_blocks", NULL));
+
+    /* io_uring = true submits the reads and commits of blocks to an
+     * io_uring, so that threads don't block on each request. Blocks are
+     * then read in parallel chunks, and written, fsynced and renamed in
+     * one chain. io_uring_queue_depth sets the size of the ring.
+     */
+    if (is_fs && g_key_file_get_boolean (seaf->config, "block_backend",
+                                         "io_uring", NULL)) {
+        int depth = g_key_file_get_integer (seaf->config, "block_backend",
+                                            "io_uring_queue_depth", NULL);
+        if (depth <= 0)
+            depth = DEFAULT_IO_URING_QUEUE_DEPTH;
+        if (block_backend_fs_enable_io_uring (mgr->backend, depth,
+                                              IO_URING_MAX_BUFFERS) < 0)
+            seaf_warning ("[Block mgr] io_uring is not available, "
+                          "using blocking block I/O.\n");
+    }
+
+    mgr->backend = load_replication (seaf, seaf_dir, mgr->backend);
+    mgr->backend = load_block_cache (seaf, mgr->backend);
+
+    /* compression = zlib compresses new blocks. Set it to "none" instead of
+     * removing it to stop compressing, since compressed blocks still have to
+     * be decoded.
+     */
+    compression = g_key_file_get_string (seaf->config, "block_backend",
+                                         "compression", NULL);
+    if (compression) {
+        mgr->backend = block_backend_compress_new (mgr->backend, compression);
+        g_free (compression);
+    }
+
+    /* metadata_index = true keeps the size and write time of blocks in a
+     * local log, so that stat'ing a block doesn't reach the storage.
+     */
+    if (g_key_file_get_boolean (seaf->config, "block_backend",
+                                "metadata_index", NULL)) {
+        BlockBackend *bend = block_backend_meta_new (mgr->backend, seaf_dir);
+        mgr->metadata_index = (bend != mgr->backend);
+        mgr->backend = bend;
+    }
+
+    /* Answer most "missing" results of batched checks from memory. */
+    if (g_key_file_get_boolean (seaf->config, "block_backend",
+                                "existence_filter", NULL))
+        mgr->backend = block_backend_filter_new (mgr->backend);
+
     return mgr;
 
 onerror:
@@ -67,6 +285,11 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
         !block_id || !is_object_id_valid(block_id))
         return NULL;
 
+    if (rw_type == BLOCK_READ) {
+        seaf_access_stats_record (ACCESS_CLASS_BLOCK, block_id);
+        seaf_access_stats_record (ACCESS_CLASS_REPO, store_id);
+    }
+
     return mgr->backend->open_block (mgr->backend,
                                      store_id, version,
                                      block_id, rw_type);
@@ -77,7 +300,13 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len)
 {
-    return mgr->backend->read_block (mgr->backend, handle, buf, len);
+    gint64 start = bg_throttle_begin ();
+    int n;
+
+    n = mgr->backend->read_block (mgr->backend, handle, buf, len);
+    bg_throttle_charge (start, 0, MAX (n, 0), 0);
+
+    return n;
 }
 
 int
@@ -121,17 +350,99 @@ gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
     return mgr->backend->exists (mgr->backend, store_id, version, block_id);
 }
 
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *results)
+{
+    BlockBackend *bend = mgr->backend;
+    int i;
+
+    if (!store_id || !is_uuid_valid(store_id)) {
+        memset (results, 0, n_blocks * sizeof(gboolean));
+        return;
+    }
+
+    if (bend->exists_many) {
+        bend->exists_many (bend, store_id, version, block_ids, n_blocks, results);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+        results[i] = bend->exists (bend, store_id, version, block_ids[i]);
+}
+
+int
+seaf_block_manager_touch_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    BlockBackend *bend = mgr->backend;
+
+    if (!store_id || !is_uuid_valid(store_id))
+        return -1;
+
+    if (!bend->touch)
+        return 0;
+    return bend->touch (bend, store_id, version, block_id);
+}
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
                                  int version,
                                  const char *block_id)
 {
+    gint64 start;
+    int ret;
+
     if (!store_id || !is_uuid_valid(store_id) ||
         !block_id || !is_object_id_valid(block_id))
         return -1;
 
-    return mgr->backend->remove_block (mgr->backend, store_id, version, block_id);
+    start = bg_throttle_begin ();
+    ret = mgr->backend->remove_block (mgr->backend, store_id, version, block_id);
+    bg_throttle_charge (start, 0, 0, 1);
+
+    return ret;
+}
+
+int
+seaf_block_manager_remove_blocks (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks)
+{
+    BlockBackend *bend = mgr->backend;
+    gint64 start;
+    int i, ret = 0;
+
+    if (!store_id || !is_uuid_valid(store_id))
+        return -1;
+    for (i = 0; i < n_blocks; ++i) {
+        if (!block_ids[i] || !is_object_id_valid(block_ids[i]))
+            return -1;
+    }
+
+    if (!bend->remove_blocks) {
+        for (i = 0; i < n_blocks; ++i) {
+            if (seaf_block_manager_remove_block (mgr, store_id, version,
+                                                 block_ids[i]) < 0)
+                ret = -1;
+        }
+        return ret;
+    }
+
+    start = bg_throttle_begin ();
+    ret = bend->remove_blocks (bend, store_id, version, block_ids, n_blocks);
+    bg_throttle_charge (start, 0, 0, n_blocks);
+
+    return ret;
 }
 
 BlockMetadata *
@@ -154,6 +465,21 @@ seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
     return mgr->backend->stat_block_by_handle (mgr->backend, handle);
 }
 
+int
+seaf_block_manager_dup_block_fd (SeafBlockManager *mgr, BlockHandle *handle)
+{
+    int fd;
+
+    if (!mgr->backend->get_fd)
+        return -1;
+
+    fd = mgr->backend->get_fd (mgr->backend, handle);
+    if (fd < 0)
+        return -1;
+
+    return dup (fd);
+}
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   const char *store_id,
@@ -166,6 +492,24 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                         process, user_data);
 }
 
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           const char *store_id,
+                                           int version,
+                                           int max_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data)
+{
+    BlockBackend *bend = mgr->backend;
+
+    if (max_threads <= 1 || !bend->foreach_block_parallel)
+        return bend->foreach_block (bend, store_id, version,
+                                    process, user_data);
+
+    return bend->foreach_block_parallel (bend, store_id, version, max_threads,
+                                         process, user_data);
+}
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -176,7 +520,9 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
 {
     if (strcmp (block_id, EMPTY_SHA1) == 0)
         return 0;
-    if (seaf_block_manager_block_exists (mgr, dst_store_id, dst_version, block_id)) {
+    /* The block is reused, see seaf_block_manager_touch_block(). */
+    if (seaf_block_manager_block_exists (mgr, dst_store_id, dst_version, block_id) &&
+        seaf_block_manager_touch_block (mgr, dst_store_id, dst_version, block_id) == 0) {
         return 0;
     }
 
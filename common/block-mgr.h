@@ -17,6 +17,9 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* Set if stat'ing blocks is answered by the local metadata index. */
+    gboolean metadata_index;
 };
 
 
@@ -103,12 +106,41 @@ seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id);
 
+/* Check existence of many blocks at once. @block_ids must be valid ids. */
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *results);
+
+/*
+ * Sets the write time of an existing block to now. A block that is reused
+ * instead of being written again is touched, so that an online GC keeps it
+ * as a recent block. Returns 0 if the backend keeps no write time, -1 if
+ * the block doesn't exist.
+ */
+int
+seaf_block_manager_touch_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                const char *block_id);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
                                  int version,
                                  const char *block_id);
 
+/* Returns -1 if any of the blocks could not be removed. */
+int
+seaf_block_manager_remove_blocks (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks);
+
 BlockMetadata *
 seaf_block_manager_stat_block (SeafBlockManager *mgr,
                                const char *store_id,
@@ -119,6 +151,13 @@ BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle);
 
+/* Returns a duplicate of the fd of a block opened for reading, which the
+ * caller must close. Returns -1 if the backend doesn't store blocks as
+ * local files.
+ */
+int
+seaf_block_manager_dup_block_fd (SeafBlockManager *mgr, BlockHandle *handle);
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   const char *store_id,
@@ -126,6 +165,18 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
                                   void *user_data);
 
+/*
+ * List the blocks of a store on up to @max_threads threads, if the backend
+ * supports it. @process must be safe to call from several threads at once.
+ */
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           const char *store_id,
+                                           int version,
+                                           int max_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data);
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -0,0 +1,614 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+#include "block-uring.h"
+
+#ifdef HAVE_LIBURING
+
+typedef struct URingBatch URingBatch;
+
+typedef struct URingOp {
+    URingBatch *batch;
+    gboolean done;
+    int res;
+} URingOp;
+
+/* Requests submitted together, waited for by the submitting thread. */
+struct URingBatch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int n_ops;
+    URingOp *ops;
+};
+
+typedef struct RegisteredBuf {
+    char *base;
+    size_t len;
+} RegisteredBuf;
+
+struct BlockURing {
+    struct io_uring ring;
+    gboolean can_rename;
+
+    /* Protects the submission queue, in_flight and the buffer table. */
+    pthread_mutex_t lock;
+    pthread_cond_t space_available;
+    int in_flight;
+    /* The size of the completion queue. */
+    int max_in_flight;
+
+    RegisteredBuf *bufs;
+    int n_bufs;
+    int max_bufs;
+};
+
+struct BlockURingReads {
+    BlockURing *ring;
+    int fd;
+    char *buf;
+    gint64 len;
+    gint64 offset;
+    int chunk_size;
+    URingBatch *batch;
+    /* The reads before this one are finished and checked. */
+    int n_checked;
+    gint64 avail;
+    gboolean eof;
+};
+
+typedef void (*PrepFunc) (BlockURing *ring, struct io_uring_sqe *sqe,
+                          int i, void *data);
+
+static BlockURing *the_ring;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static URingBatch *
+batch_new (int n_ops)
+{
+    URingBatch *batch = g_new0 (URingBatch, 1);
+    int i;
+
+    pthread_mutex_init (&batch->lock, NULL);
+    pthread_cond_init (&batch->done, NULL);
+    batch->n_ops = n_ops;
+    batch->ops = g_new0 (URingOp, n_ops);
+    for (i = 0; i < n_ops; ++i)
+        batch->ops[i].batch = batch;
+
+    return batch;
+}
+
+static int
+batch_wait (URingBatch *batch, int i)
+{
+    int res;
+
+    pthread_mutex_lock (&batch->lock);
+    while (!batch->ops[i].done)
+        pthread_cond_wait (&batch->done, &batch->lock);
+    res = batch->ops[i].res;
+    pthread_mutex_unlock (&batch->lock);
+
+    return res;
+}
+
+static void
+batch_free (URingBatch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->n_ops; ++i)
+        batch_wait (batch, i);
+
+    pthread_mutex_destroy (&batch->lock);
+    pthread_cond_destroy (&batch->done);
+    g_free (batch->ops);
+    g_free (batch);
+}
+
+static void *
+reap_completions (void *vdata)
+{
+    BlockURing *ring = vdata;
+    struct io_uring_cqe *cqe;
+    URingOp *op;
+    int ret, res;
+
+    while (1) {
+        ret = io_uring_wait_cqe (&ring->ring, &cqe);
+        if (ret < 0) {
+            if (ret != -EINTR && ret != -EAGAIN) {
+                seaf_warning ("[io_uring] Failed to wait for completions: %s.\n",
+                              strerror(-ret));
+                g_usleep (1000);
+            }
+            continue;
+        }
+        op = io_uring_cqe_get_data (cqe);
+        res = cqe->res;
+        io_uring_cqe_seen (&ring->ring, cqe);
+
+        /* The waiter may free the batch as soon as the lock is released. */
+        pthread_mutex_lock (&op->batch->lock);
+        op->res = res;
+        op->done = TRUE;
+        pthread_cond_broadcast (&op->batch->done);
+        pthread_mutex_unlock (&op->batch->lock);
+
+        pthread_mutex_lock (&ring->lock);
+        --ring->in_flight;
+        pthread_cond_broadcast (&ring->space_available);
+        pthread_mutex_unlock (&ring->lock);
+    }
+
+    return NULL;
+}
+
+/* Called with the ring locked. */
+static void
+submit_queued (BlockURing *ring)
+{
+    int ret;
+
+    while ((ret = io_uring_submit (&ring->ring)) < 0) {
+        if (ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            seaf_warning ("[io_uring] Failed to submit requests: %s.\n",
+                          strerror(-ret));
+        }
+        g_usleep (100);
+    }
+}
+
+/*
+ * Queues the requests of @batch, prepared by @prep, and submits them.
+ * Linked requests are queued without a submission in between, so that
+ * the chain isn't split.
+ */
+static void
+submit_batch (BlockURing *ring, URingBatch *batch, gboolean linked,
+              PrepFunc prep, void *data)
+{
+    struct io_uring_sqe *sqe;
+    int n = batch->n_ops;
+    int i;
+
+    pthread_mutex_lock (&ring->lock);
+
+    while (ring->in_flight > 0 && ring->in_flight + n > ring->max_in_flight)
+        pthread_cond_wait (&ring->space_available, &ring->lock);
+    ring->in_flight += n;
+
+    if (linked && io_uring_sq_space_left (&ring->ring) < (unsigned)n)
+        submit_queued (ring);
+
+    for (i = 0; i < n; ++i) {
+        while (!(sqe = io_uring_get_sqe (&ring->ring)))
+            submit_queued (ring);
+        prep (ring, sqe, i, data);
+        io_uring_sqe_set_data (sqe, &batch->ops[i]);
+    }
+    submit_queued (ring);
+
+    pthread_mutex_unlock (&ring->lock);
+}
+
+BlockURing *
+block_uring_init (int queue_depth, int max_buffers)
+{
+    BlockURing *ring = NULL;
+    struct io_uring_probe *probe;
+    pthread_t tid;
+    int ret;
+
+    pthread_mutex_lock (&init_lock);
+
+    if (the_ring) {
+        ring = the_ring;
+        goto out;
+    }
+
+    ring = g_new0 (BlockURing, 1);
+    ret = io_uring_queue_init (queue_depth, &ring->ring, 0);
+    if (ret < 0) {
+        seaf_warning ("[io_uring] Failed to set up ring: %s.\n", strerror(-ret));
+        g_free (ring);
+        ring = NULL;
+        goto out;
+    }
+
+    probe = io_uring_get_probe_ring (&ring->ring);
+    if (!probe ||
+        !io_uring_opcode_supported (probe, IORING_OP_READ) ||
+        !io_uring_opcode_supported (probe, IORING_OP_WRITE)) {
+        seaf_warning ("[io_uring] The kernel doesn't support io_uring reads and writes.\n");
+        if (probe)
+            io_uring_free_probe (probe);
+        io_uring_queue_exit (&ring->ring);
+        g_free (ring);
+        ring = NULL;
+        goto out;
+    }
+    ring->can_rename = io_uring_opcode_supported (probe, IORING_OP_RENAMEAT);
+    io_uring_free_probe (probe);
+
+    pthread_mutex_init (&ring->lock, NULL);
+    pthread_cond_init (&ring->space_available, NULL);
+    ring->max_in_flight = queue_depth * 2;
+
+    if (max_buffers > 0) {
+        ret = io_uring_register_buffers_sparse (&ring->ring, max_buffers);
+        if (ret < 0) {
+            seaf_message ("[io_uring] Registered buffers are not supported: %s.\n",
+                          strerror(-ret));
+        } else {
+            ring->bufs = g_new0 (RegisteredBuf, max_buffers);
+            ring->max_bufs = max_buffers;
+        }
+    }
+
+    ret = pthread_create (&tid, NULL, reap_completions, ring);
+    if (ret != 0) {
+        seaf_warning ("[io_uring] Failed to start completion thread: %s.\n",
+                      strerror(ret));
+        io_uring_queue_exit (&ring->ring);
+        g_free (ring->bufs);
+        g_free (ring);
+        ring = NULL;
+        goto out;
+    }
+    pthread_detach (tid);
+
+    seaf_message ("[io_uring] Block I/O uses io_uring with queue depth %d.\n",
+                  queue_depth);
+    g_atomic_pointer_set (&the_ring, ring);
+
+out:
+    pthread_mutex_unlock (&init_lock);
+    return ring;
+}
+
+BlockURing *
+block_uring_get ()
+{
+    return g_atomic_pointer_get (&the_ring);
+}
+
+int
+block_uring_register_buffer (BlockURing *ring, void *buf, size_t len)
+{
+    struct iovec iov;
+    __u64 tag = 0;
+    int idx = -1;
+    int ret;
+
+    pthread_mutex_lock (&ring->lock);
+
+    if (ring->n_bufs >= ring->max_bufs)
+        goto out;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    ret = io_uring_register_buffers_update_tag (&ring->ring, ring->n_bufs,
+                                                &iov, &tag, 1);
+    if (ret < 0) {
+        seaf_warning ("[io_uring] Failed to register buffer: %s.\n", strerror(-ret));
+        goto out;
+    }
+
+    idx = ring->n_bufs++;
+    ring->bufs[idx].base = buf;
+    ring->bufs[idx].len = len;
+
+out:
+    pthread_mutex_unlock (&ring->lock);
+    return idx;
+}
+
+/* Called with the ring locked. */
+static int
+find_registered_buf (BlockURing *ring, const char *buf, size_t len)
+{
+    int i;
+
+    for (i = 0; i < ring->n_bufs; ++i) {
+        if (buf >= ring->bufs[i].base &&
+            buf + len <= ring->bufs[i].base + ring->bufs[i].len)
+            return i;
+    }
+    return -1;
+}
+
+static void
+prep_read (BlockURing *ring, struct io_uring_sqe *sqe, int i, void *vdata)
+{
+    BlockURingReads *reads = vdata;
+    gint64 off = (gint64)i * reads->chunk_size;
+    unsigned len = (unsigned) MIN (reads->chunk_size, reads->len - off);
+    char *buf = reads->buf + off;
+    int idx = find_registered_buf (ring, buf, len);
+
+    if (idx >= 0)
+        io_uring_prep_read_fixed (sqe, reads->fd, buf, len,
+                                  reads->offset + off, idx);
+    else
+        io_uring_prep_read (sqe, reads->fd, buf, len, reads->offset + off);
+}
+
+static BlockURingReads *
+read_async_at (BlockURing *ring, int fd, void *buf,
+               gint64 len, gint64 offset, int chunk_size)
+{
+    BlockURingReads *reads = g_new0 (BlockURingReads, 1);
+    gint64 n_ops;
+
+    if (chunk_size <= 0)
+        chunk_size = 1;
+    /* Use larger reads rather than wait for room in the ring. */
+    if ((len + chunk_size - 1) / chunk_size > ring->max_in_flight)
+        chunk_size = (int)((len + ring->max_in_flight - 1) / ring->max_in_flight);
+    n_ops = (len + chunk_size - 1) / chunk_size;
+
+    reads->ring = ring;
+    reads->fd = fd;
+    reads->buf = buf;
+    reads->len = len;
+    reads->offset = offset;
+    reads->chunk_size = chunk_size;
+    reads->batch = batch_new ((int)n_ops);
+    reads->eof = (n_ops == 0);
+
+    if (n_ops > 0)
+        submit_batch (ring, reads->batch, FALSE, prep_read, reads);
+
+    return reads;
+}
+
+BlockURingReads *
+block_uring_read_async (BlockURing *ring, int fd, void *buf,
+                        gint64 len, int chunk_size)
+{
+    return read_async_at (ring, fd, buf, len, 0, chunk_size);
+}
+
+static gssize
+pread_full (int fd, char *buf, size_t len, gint64 offset)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread (fd, buf + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static gssize
+pwrite_full (int fd, const char *buf, size_t len, gint64 offset)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pwrite (fd, buf + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+gint64
+block_uring_reads_wait (BlockURingReads *reads, gint64 end)
+{
+    gint64 off, expected;
+    gssize n;
+    int i, res;
+
+    end = MIN (end, reads->len);
+    while (!reads->eof && reads->avail < end) {
+        i = reads->n_checked;
+        res = batch_wait (reads->batch, i);
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+
+        off = (gint64)i * reads->chunk_size;
+        expected = MIN (reads->chunk_size, reads->len - off);
+        /* Finish short reads with plain syscalls. */
+        if (res < expected) {
+            n = pread_full (reads->fd, reads->buf + off + res, expected - res,
+                            reads->offset + off + res);
+            if (n < 0)
+                return -1;
+            res += n;
+            if (res < expected)
+                reads->eof = TRUE;
+        }
+
+        reads->avail = off + res;
+        ++reads->n_checked;
+    }
+
+    return reads->avail;
+}
+
+void
+block_uring_reads_free (BlockURingReads *reads)
+{
+    batch_free (reads->batch);
+    g_free (reads);
+}
+
+gssize
+block_uring_read (BlockURing *ring, int fd, void *buf, size_t len, gint64 offset)
+{
+    BlockURingReads *reads;
+    gint64 n;
+
+    reads = read_async_at (ring, fd, buf, len, offset, (int) MIN (len, G_MAXINT));
+    n = block_uring_reads_wait (reads, len);
+    block_uring_reads_free (reads);
+
+    return n;
+}
+
+typedef struct CommitData {
+    int fd;
+    const void *buf;
+    size_t len;
+    gboolean need_sync;
+    const char *tmp_path;
+    const char *path;
+    int n_ops;
+} CommitData;
+
+static void
+prep_commit (BlockURing *ring, struct io_uring_sqe *sqe, int i, void *vdata)
+{
+    CommitData *data = vdata;
+
+    if (i == 0)
+        io_uring_prep_write (sqe, data->fd, data->buf, data->len, 0);
+    else if (i == 1 && data->need_sync)
+        io_uring_prep_fsync (sqe, data->fd, 0);
+    else
+        io_uring_prep_renameat (sqe, AT_FDCWD, data->tmp_path,
+                                AT_FDCWD, data->path, 0);
+
+    if (i < data->n_ops - 1)
+        io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+}
+
+int
+block_uring_commit (BlockURing *ring, int fd, const void *buf, size_t len,
+                    gboolean need_sync, const char *tmp_path, const char *path)
+{
+    CommitData data;
+    URingBatch *batch;
+    int i = 0, res, ret = -1;
+
+    memset (&data, 0, sizeof(data));
+    data.fd = fd;
+    data.buf = buf;
+    data.len = len;
+    data.need_sync = need_sync;
+    data.tmp_path = tmp_path;
+    data.path = path;
+    data.n_ops = 1 + (need_sync ? 1 : 0) + (ring->can_rename ? 1 : 0);
+
+    batch = batch_new (data.n_ops);
+    submit_batch (ring, batch, TRUE, prep_commit, &data);
+
+    /* A failed or short request cancels the rest of the chain, which is
+     * then finished with plain syscalls.
+     */
+    res = batch_wait (batch, i++);
+    if (res < 0) {
+        errno = -res;
+        goto out;
+    }
+    if ((size_t)res < len &&
+        pwrite_full (fd, (const char *)buf + res, len - res, res) < 0)
+        goto out;
+
+    if (need_sync) {
+        res = batch_wait (batch, i++);
+        if (res == -ECANCELED)
+            res = (fsync (fd) < 0) ? -errno : 0;
+        /* Some file systems don't support fsync. */
+        if (res < 0 && res != -EINVAL) {
+            errno = -res;
+            goto out;
+        }
+    }
+
+    res = ring->can_rename ? batch_wait (batch, i++) : -ECANCELED;
+    if (res == -ECANCELED)
+        res = (g_rename (tmp_path, path) < 0) ? -errno : 0;
+    if (res < 0) {
+        errno = -res;
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    batch_free (batch);
+    return ret;
+}
+
+#else  /* HAVE_LIBURING */
+
+BlockURing *
+block_uring_init (int queue_depth, int max_buffers)
+{
+    seaf_warning ("[io_uring] Built without io_uring support.\n");
+    return NULL;
+}
+
+BlockURing *
+block_uring_get ()
+{
+    return NULL;
+}
+
+int
+block_uring_register_buffer (BlockURing *ring, void *buf, size_t len)
+{
+    return -1;
+}
+
+gssize
+block_uring_read (BlockURing *ring, int fd, void *buf, size_t len, gint64 offset)
+{
+    return -1;
+}
+
+BlockURingReads *
+block_uring_read_async (BlockURing *ring, int fd, void *buf,
+                        gint64 len, int chunk_size)
+{
+    return NULL;
+}
+
+gint64
+block_uring_reads_wait (BlockURingReads *reads, gint64 end)
+{
+    return -1;
+}
+
+void
+block_uring_reads_free (BlockURingReads *reads)
+{
+}
+
+int
+block_uring_commit (BlockURing *ring, int fd, const void *buf, size_t len,
+                    gboolean need_sync, const char *tmp_path, const char *path)
+{
+    return -1;
+}
+
+#endif  /* HAVE_LIBURING */
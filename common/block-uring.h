@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_URING_H
+#define BLOCK_URING_H
+
+#include <glib.h>
+
+/*
+ * An io_uring shared by all threads of the process, used by the fs block
+ * backend. Any thread can have many reads or writes in flight, without
+ * blocking in a syscall for each of them. Submissions are serialized by a
+ * lock, and a single thread reaps the completions and wakes the waiters.
+ *
+ * Only available when built with liburing (HAVE_LIBURING).
+ */
+
+typedef struct BlockURing BlockURing;
+
+/*
+ * Sets up the ring with @queue_depth entries and room for @max_buffers
+ * registered buffers. Returns the existing ring if it's already set up,
+ * or NULL if io_uring is not supported by the build or the kernel.
+ */
+BlockURing *
+block_uring_init (int queue_depth, int max_buffers);
+
+/* Returns NULL if the ring is not set up. */
+BlockURing *
+block_uring_get ();
+
+/*
+ * Registers a buffer that stays allocated until the process exits. Reads
+ * into it don't have to map its pages for each request. Returns -1 if the
+ * buffer table is full or not supported.
+ */
+int
+block_uring_register_buffer (BlockURing *ring, void *buf, size_t len);
+
+/*
+ * Reads @len bytes at @offset into @buf. Returns the number of bytes read,
+ * which is less than @len only at the end of the file, or -1 on error.
+ */
+gssize
+block_uring_read (BlockURing *ring, int fd, void *buf, size_t len, gint64 offset);
+
+typedef struct BlockURingReads BlockURingReads;
+
+/*
+ * Submits reads of the first @len bytes of @fd into @buf in one batch,
+ * @chunk_size bytes per read. @buf must stay valid until the reads are
+ * freed.
+ */
+BlockURingReads *
+block_uring_read_async (BlockURing *ring, int fd, void *buf,
+                        gint64 len, int chunk_size);
+
+/*
+ * Waits until the data before @end is read. Returns the number of bytes
+ * read from the beginning of @buf, which is less than @end only at the end
+ * of the file, or -1 on error.
+ */
+gint64
+block_uring_reads_wait (BlockURingReads *reads, gint64 end);
+
+/* Waits for the reads still in flight. */
+void
+block_uring_reads_free (BlockURingReads *reads);
+
+/*
+ * Writes @buf to the beginning of @fd, fsyncs it if @need_sync and then
+ * renames @tmp_path to @path, as one chain of linked requests.
+ */
+int
+block_uring_commit (BlockURing *ring, int fd, const void *buf, size_t len,
+                    gboolean need_sync, const char *tmp_path, const char *path);
+
+#endif
@@ -9,6 +9,12 @@ typedef struct _BMetadata BMetadata;
 struct _BMetadata {
     char        id[41];
     uint32_t    size;
+    /* Only known to some backends, 0 otherwise. ctime is when the block
+     * was written. refs is how many times it was written to or copied into
+     * the store, which is a hint and not a reference count.
+     */
+    uint32_t    refs;
+    int64_t     ctime;
 };
 
 /* Opaque block handle.
@@ -84,6 +84,23 @@ struct _SeafBranchManagerPriv {
 
 static int open_db (SeafBranchManager *mgr);
 
+#ifdef SEAFILE_SERVER
+/* The fileserver caches the heads of master branches, and the repo manager
+ * the repos. */
+static void
+update_head_commit_cache (const char *repo_id, const char *name,
+                          const char *old_commit_id, const char *new_commit_id)
+{
+#ifdef FULL_FEATURE
+    if (strcmp (name, "master") != 0)
+        return;
+    seaf_http_server_update_head_commit (seaf->http_server, repo_id,
+                                         old_commit_id, new_commit_id);
+    seaf_repo_manager_notify_repo_change (seaf->repo_mgr, repo_id);
+#endif
+}
+#endif
+
 SeafBranchManager *
 seaf_branch_manager_new (struct _SeafileSession *seaf)
 {
@@ -231,6 +248,7 @@ seaf_branch_manager_add_branch (SeafBranchManager *mgr, SeafBranch *branch)
         if (rc < 0)
             return -1;
     }
+    update_head_commit_cache (branch->repo_id, branch->name, NULL, NULL);
     return 0;
 #endif
 }
@@ -260,6 +278,7 @@ seaf_branch_manager_del_branch (SeafBranchManager *mgr,
                                       2, "string", name, "string", repo_id);
     if (rc < 0)
         return -1;
+    update_head_commit_cache (repo_id, name, NULL, NULL);
     return 0;
 #endif
 }
@@ -292,6 +311,7 @@ seaf_branch_manager_update_branch (SeafBranchManager *mgr, SeafBranch *branch)
                                       "string", branch->repo_id);
     if (rc < 0)
         return -1;
+    update_head_commit_cache (branch->repo_id, branch->name, NULL, NULL);
     return 0;
 #endif
 }
@@ -327,6 +347,9 @@ publish_repo_update_event (const char *repo_id, const char *commit_id)
  on_branch_updated (SeafBranchManager *mgr, SeafBranch *branch)
  {
      seaf_repo_manager_update_repo_info (seaf->repo_mgr, branch->repo_id, branch->commit_id);
+
+     /* Virtual repos are synced too. */
+     seaf_http_server_notify_repo_update (seaf->http_server, branch->repo_id);
  
      if (seaf_repo_manager_is_virtual_repo (seaf->repo_mgr, branch->repo_id))
          return;
@@ -371,6 +394,8 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
     if (strcmp (old_commit_id, commit_id) != 0) {
         seaf_db_rollback (trans);
         seaf_db_trans_close (trans);
+        /* The head was moved elsewhere, don't retry on a cached one. */
+        update_head_commit_cache (branch->repo_id, branch->name, NULL, NULL);
         return -1;
     }
 
@@ -392,6 +417,9 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
 
     seaf_db_trans_close (trans);
 
+    update_head_commit_cache (branch->repo_id, branch->name,
+                              old_commit_id, branch->commit_id);
+
     on_branch_updated (mgr, branch);
 
     return 0;
@@ -0,0 +1,230 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Compares the chunking speed and chunk size distribution of the Rabin and
+ * gear hash chunkers on random data. Chunks are not hashed or written.
+ *
+ *   cdc-bench [-s size_mb] [-m min_kb] [-a avg_kb] [-M max_kb] [-f file]
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+
+#include "cdc.h"
+#include "gear-hash.h"
+
+#define HISTOGRAM_BUCKETS 10
+
+typedef struct ChunkStats {
+    GArray *lens;
+} ChunkStats;
+
+static ChunkStats stats;
+
+static int
+record_chunk (const char *repo_id,
+              int version,
+              CDCDescriptor *chunk_descr,
+              struct SeafileCrypt *crypt,
+              uint8_t *checksum,
+              gboolean write_data)
+{
+    memset (checksum, 0, CHECKSUM_LENGTH);
+    g_array_append_val (stats.lens, chunk_descr->len);
+    return 0;
+}
+
+static int
+create_test_file (const char *path, gint64 size)
+{
+    char buf[64 * 1024];
+    guint64 state = 1;
+    gint64 left = size;
+    int fd, i, n;
+
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        fprintf (stderr, "Failed to create %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (left > 0) {
+        for (i = 0; i < sizeof(buf); ++i) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            buf[i] = (char)(state >> 56);
+        }
+        n = (left < sizeof(buf)) ? left : sizeof(buf);
+        if (writen (fd, buf, n) != n) {
+            fprintf (stderr, "Failed to write %s: %s.\n", path, strerror(errno));
+            close (fd);
+            return -1;
+        }
+        left -= n;
+    }
+
+    close (fd);
+    return 0;
+}
+
+static void
+print_stats (const char *name, double seconds, gint64 file_size,
+             guint32 min_sz, guint32 max_sz)
+{
+    int hist[HISTOGRAM_BUCKETS] = { 0 };
+    guint32 len, shortest = G_MAXUINT32, longest = 0;
+    double mean, var = 0;
+    guint i;
+    int b;
+
+    if (stats.lens->len == 0)
+        return;
+
+    mean = (double)file_size / stats.lens->len;
+    for (i = 0; i < stats.lens->len; ++i) {
+        len = g_array_index (stats.lens, guint32, i);
+        shortest = MIN (shortest, len);
+        longest = MAX (longest, len);
+        var += (len - mean) * (len - mean);
+        if (len <= min_sz)
+            b = 0;
+        else
+            b = (int)((double)(len - min_sz) * HISTOGRAM_BUCKETS / (max_sz - min_sz + 1));
+        hist[MIN (b, HISTOGRAM_BUCKETS - 1)]++;
+    }
+
+    printf ("%-12s %8.1f MB/s  %u chunks  min %u  avg %.0f  max %u  stddev %.0f\n",
+            name, file_size / 1048576.0 / seconds, stats.lens->len,
+            shortest, mean, longest, sqrt (var / stats.lens->len));
+    printf ("%-12s", "");
+    for (b = 0; b < HISTOGRAM_BUCKETS; ++b)
+        printf (" %5.1f%%", 100.0 * hist[b] / stats.lens->len);
+    printf ("\n");
+}
+
+static int
+run (const char *name, const char *path, CDCAlgorithm algorithm,
+     guint32 min_sz, guint32 avg_sz, guint32 max_sz)
+{
+    CDCFileDescriptor cdc;
+    GTimer *timer;
+    double seconds;
+
+    memset (&cdc, 0, sizeof(cdc));
+    cdc.block_min_sz = min_sz;
+    cdc.block_sz = avg_sz;
+    cdc.block_max_sz = max_sz;
+    cdc.write_block = record_chunk;
+    cdc.algorithm = algorithm;
+
+    g_array_set_size (stats.lens, 0);
+
+    timer = g_timer_new ();
+    if (filename_chunk_cdc (path, &cdc, NULL, FALSE, NULL) < 0) {
+        fprintf (stderr, "Failed to chunk %s with %s.\n", path, name);
+        g_timer_destroy (timer);
+        return -1;
+    }
+    seconds = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    print_stats (name, seconds, cdc.file_size, min_sz, max_sz);
+    free (cdc.blk_sha1s);
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    gint64 size_mb = 512;
+    guint32 min_kb = 6 * 1024, avg_kb = 8 * 1024, max_kb = 10 * 1024;
+    const char *path = NULL;
+    char *tmp_path = NULL;
+    int impl;
+    int c;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "s:m:a:M:f:")) != -1) {
+        switch (c) {
+        case 's':
+            size_mb = atoll (optarg);
+            break;
+        case 'm':
+            min_kb = atoi (optarg);
+            break;
+        case 'a':
+            avg_kb = atoi (optarg);
+            break;
+        case 'M':
+            max_kb = atoi (optarg);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            fprintf (stderr, "usage: %s [-s size_mb] [-m min_kb] [-a avg_kb] "
+                     "[-M max_kb] [-f file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* The Rabin chunker needs a power of 2 as average block size. */
+    if (size_mb <= 0 || min_kb == 0 || min_kb >= max_kb ||
+        (avg_kb & (avg_kb - 1)) != 0) {
+        fprintf (stderr, "Bad sizes.\n");
+        return 1;
+    }
+
+    cdc_init ();
+    stats.lens = g_array_new (FALSE, FALSE, sizeof(guint32));
+
+    if (!path) {
+        tmp_path = g_strdup ("/tmp/cdc-bench-XXXXXX");
+        c = g_mkstemp (tmp_path);
+        if (c < 0) {
+            fprintf (stderr, "Failed to create temp file.\n");
+            return 1;
+        }
+        close (c);
+        if (create_test_file (tmp_path, size_mb << 20) < 0) {
+            ret = 1;
+            goto out;
+        }
+        path = tmp_path;
+    }
+
+    printf ("min %u KB, avg %u KB, max %u KB, histogram buckets of (max - min) / %d\n",
+            min_kb, avg_kb, max_kb, HISTOGRAM_BUCKETS);
+
+    if (run ("rabin", path, CDC_ALGORITHM_RABIN,
+             min_kb << 10, avg_kb << 10, max_kb << 10) < 0)
+        ret = 1;
+
+    for (impl = GEAR_SCAN_SCALAR; impl <= GEAR_SCAN_AVX2; ++impl) {
+        char name[32];
+
+        if (gear_set_scan_impl (impl) < 0)
+            continue;
+        snprintf (name, sizeof(name), "gear-%s", gear_scan_impl_name (impl));
+        if (run (name, path, CDC_ALGORITHM_GEAR,
+                 min_kb << 10, avg_kb << 10, max_kb << 10) < 0)
+            ret = 1;
+    }
+
+out:
+    if (tmp_path) {
+        g_unlink (tmp_path);
+        g_free (tmp_path);
+    }
+    g_array_free (stats.lens, TRUE);
+    return ret;
+}
@@ -18,6 +18,7 @@
 #include "cdc.h"
 #include "../seafile-crypt.h"
 
+#include "gear-hash.h"
 #include "rabin-checksum.h"
 #define finger rabin_checksum
 #define rolling_finger rabin_rolling_checksum
@@ -86,6 +87,7 @@ do {                                                         \
     int _block_sz = (block_sz);                              \
     chunk_descr.len = _block_sz;                             \
     chunk_descr.offset = offset;                             \
+    chunk_descr.existed = FALSE;                             \
     ret = file_descr->write_block (file_descr->repo_id,      \
                                    file_descr->version,      \
                                    &chunk_descr,             \
@@ -96,6 +98,8 @@ do {                                                         \
         g_warning ("CDC: failed to write chunk.\n");         \
         return -1;                                           \
     }                                                        \
+    if (chunk_descr.existed)                                 \
+        file_descr->dedup_size += _block_sz;                 \
     memcpy (file_descr->blk_sha1s +                          \
             file_descr->block_nr * CHECKSUM_LENGTH,          \
             chunk_descr.checksum, CHECKSUM_LENGTH);          \
@@ -108,6 +112,120 @@ do {                                                         \
     cur = 0;                                                 \
 }while(0);
 
+static int
+write_gear_chunk (CDCFileDescriptor *file_descr,
+                  CDCDescriptor *chunk_descr,
+                  SeafileCrypt *crypt,
+                  gboolean write_data,
+                  SHA_CTX *file_ctx)
+{
+    if (file_descr->block_nr == file_descr->max_block_nr) {
+        seaf_warning ("Block id array is not large enough, bail out.\n");
+        return -1;
+    }
+
+    chunk_descr->existed = FALSE;
+    if (file_descr->write_block (file_descr->repo_id,
+                                 file_descr->version,
+                                 chunk_descr, crypt,
+                                 chunk_descr->checksum,
+                                 write_data) < 0) {
+        g_warning ("CDC: failed to write chunk.\n");
+        return -1;
+    }
+    if (chunk_descr->existed)
+        file_descr->dedup_size += chunk_descr->len;
+    memcpy (file_descr->blk_sha1s +
+            file_descr->block_nr * CHECKSUM_LENGTH,
+            chunk_descr->checksum, CHECKSUM_LENGTH);
+    SHA1_Update (file_ctx, chunk_descr->checksum, 20);
+    file_descr->block_nr++;
+
+    return 0;
+}
+
+/* The gear scan works on large regions, so data is read block_max_sz at a
+ * time into a buffer twice that size. The unscanned rest is only moved to
+ * the front of the buffer when less than block_max_sz is left.
+ */
+static int
+file_chunk_gear (int fd_src,
+                 CDCFileDescriptor *file_descr,
+                 SeafileCrypt *crypt,
+                 gboolean write_data,
+                 gint64 *indexed,
+                 uint64_t expected_size)
+{
+    char *buf;
+    size_t buf_sz, max_sz = file_descr->block_max_sz;
+    size_t head = 0, tail = 0;
+    gboolean eof = FALSE;
+    SHA_CTX file_ctx;
+    CDCDescriptor chunk_descr;
+    uint64_t offset = 0;
+    ssize_t n;
+    uint32_t cut;
+    int ret = -1;
+
+    SHA1_Init (&file_ctx);
+
+    buf_sz = 2 * max_sz;
+    buf = malloc (buf_sz);
+    if (!buf)
+        return -1;
+
+    while (1) {
+        if (!eof && tail - head < max_sz) {
+            memmove (buf, buf + head, tail - head);
+            tail -= head;
+            head = 0;
+
+            n = readn (fd_src, buf + tail, buf_sz - tail);
+            if (n < 0) {
+                seaf_warning ("CDC: failed to read: %s.\n", strerror(errno));
+                goto out;
+            }
+            if (n < buf_sz - tail)
+                eof = TRUE;
+            tail += n;
+            file_descr->file_size += n;
+
+            if (file_descr->file_size > expected_size) {
+                seaf_warning ("File size changed while chunking.\n");
+                goto out;
+            }
+        }
+
+        if (head == tail)
+            break;
+
+        /* At the end of file, there may be no cut point in the rest. */
+        cut = gear_find_boundary ((const uint8_t *)buf + head, tail - head,
+                                  file_descr->block_min_sz,
+                                  file_descr->block_sz,
+                                  file_descr->block_max_sz);
+
+        chunk_descr.block_buf = buf + head;
+        chunk_descr.len = cut;
+        chunk_descr.offset = offset;
+        if (write_gear_chunk (file_descr, &chunk_descr, crypt,
+                              write_data, &file_ctx) < 0)
+            goto out;
+
+        head += cut;
+        offset += cut;
+        if (indexed)
+            *indexed += cut;
+    }
+
+    SHA1_Final (file_descr->file_sum, &file_ctx);
+    ret = 0;
+
+out:
+    free (buf);
+    return ret;
+}
+
 /* content-defined chunking */
 int file_chunk_cdc(int fd_src,
                    CDCFileDescriptor *file_descr,
@@ -129,6 +247,10 @@ int file_chunk_cdc(int fd_src,
     uint64_t expected_size = sb.st_size;
 
     init_cdc_file_descriptor (fd_src, expected_size, file_descr);
+    if (file_descr->algorithm == CDC_ALGORITHM_GEAR)
+        return file_chunk_gear (fd_src, file_descr, crypt, write_data,
+                                indexed, expected_size);
+
     uint32_t block_min_sz = file_descr->block_min_sz;
     uint32_t block_mask = file_descr->block_sz - 1;
 
@@ -248,4 +370,5 @@ int filename_chunk_cdc(const char *filename,
 void cdc_init ()
 {
     rabin_init (BLOCK_WIN_SZ);
+    gear_init ();
 }
@@ -31,6 +31,12 @@ typedef int (*WriteblockFunc)(const char *repo_id,
                               uint8_t *checksum,
                               gboolean write_data);
 
+typedef enum {
+    CDC_ALGORITHM_RABIN = 0,
+    /* FastCDC-style gear hash with normalized chunking. */
+    CDC_ALGORITHM_GEAR,
+} CDCAlgorithm;
+
 /* define chunk file header and block entry */
 typedef struct _CDCFileDescriptor {
     uint32_t block_min_sz;
@@ -47,6 +53,12 @@ typedef struct _CDCFileDescriptor {
 
     char repo_id[37];
     int version;
+
+    /* Chunks are found with Rabin fingerprints by default. */
+    int algorithm;
+
+    /* Bytes of the file in blocks that were already stored. */
+    uint64_t dedup_size;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -55,6 +67,8 @@ typedef struct _CDCDescriptor {
     uint8_t  checksum[CHECKSUM_LENGTH];
     char    *block_buf;
     int result;
+    /* Set by write_block when the block was already stored. */
+    gboolean existed;
 } CDCDescriptor;
 
 int file_chunk_cdc(int fd_src,
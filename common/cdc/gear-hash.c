@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Gear hash chunking, as in FastCDC.
+ *
+ * The hash after byte i is h(i) = (h(i-1) << 1) + G[buf[i]]. Since older
+ * bytes are shifted out, h(i) only depends on the last GEAR_WINDOW bytes:
+ *
+ *     h(i) = sum of G[buf[i-j]] << j, for j = 0 .. GEAR_WINDOW-1
+ *
+ * So a region can be split into several lanes that are hashed independently,
+ * each one starting GEAR_WINDOW bytes early, and still find the same cut
+ * points as a single sequential scan.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#endif
+
+#include "gear-hash.h"
+
+/* The gear table decides where files are cut, so it must never change. */
+#define GEAR_SEED 0x5eaf11e0cdc00001ULL
+
+#define GEAR_LANES 4
+#define GEAR_LANE_SPAN 4096
+
+/* Normalized chunking uses masks with 2 more/fewer bits than the average. */
+#define NORMALIZATION_LEVEL 2
+
+typedef size_t (*GearScanFunc) (const uint8_t *buf, size_t start, size_t end,
+                                uint64_t mask);
+
+static uint64_t gear_table[256];
+
+static GearScanFunc scan_func;
+static GearScanImpl scan_impl;
+
+/* Returns the first i in [start, end) where h(i) & mask is 0, or end.
+ * start must be at least GEAR_WINDOW.
+ */
+static size_t
+scan_scalar (const uint8_t *buf, size_t start, size_t end, uint64_t mask)
+{
+    uint64_t h = 0;
+    size_t i;
+
+    for (i = start - GEAR_WINDOW; i < start; ++i)
+        h = (h << 1) + gear_table[buf[i]];
+
+    for (; i < end; ++i) {
+        h = (h << 1) + gear_table[buf[i]];
+        if (!(h & mask))
+            return i;
+    }
+
+    return end;
+}
+
+/* Hashing one lane is a chain of dependent adds. Interleaving several lanes
+ * lets the CPU work on them in parallel.
+ */
+static size_t
+scan_lanes (const uint8_t *buf, size_t start, size_t end, uint64_t mask)
+{
+    while (end - start >= GEAR_LANES * GEAR_LANE_SPAN) {
+        const uint8_t *p0 = buf + start;
+        const uint8_t *p1 = p0 + GEAR_LANE_SPAN;
+        const uint8_t *p2 = p1 + GEAR_LANE_SPAN;
+        const uint8_t *p3 = p2 + GEAR_LANE_SPAN;
+        uint64_t h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+        long hit[GEAR_LANES] = { -1, -1, -1, -1 };
+        long t;
+        int k;
+
+        for (t = -GEAR_WINDOW; t < 0; ++t) {
+            h0 = (h0 << 1) + gear_table[p0[t]];
+            h1 = (h1 << 1) + gear_table[p1[t]];
+            h2 = (h2 << 1) + gear_table[p2[t]];
+            h3 = (h3 << 1) + gear_table[p3[t]];
+        }
+
+        for (t = 0; t < GEAR_LANE_SPAN; ++t) {
+            h0 = (h0 << 1) + gear_table[p0[t]];
+            h1 = (h1 << 1) + gear_table[p1[t]];
+            h2 = (h2 << 1) + gear_table[p2[t]];
+            h3 = (h3 << 1) + gear_table[p3[t]];
+
+            /* Cut points are rare, so test all lanes with one branch. */
+            if (((h0 & mask) == 0) | ((h1 & mask) == 0) |
+                ((h2 & mask) == 0) | ((h3 & mask) == 0)) {
+                /* Nothing in the other lanes comes before lane 0. */
+                if (!(h0 & mask))
+                    return start + t;
+                if (!(h1 & mask) && hit[1] < 0)
+                    hit[1] = t;
+                if (!(h2 & mask) && hit[2] < 0)
+                    hit[2] = t;
+                if (!(h3 & mask) && hit[3] < 0)
+                    hit[3] = t;
+            }
+        }
+
+        for (k = 1; k < GEAR_LANES; ++k) {
+            if (hit[k] >= 0)
+                return start + (size_t)k * GEAR_LANE_SPAN + hit[k];
+        }
+        start += GEAR_LANES * GEAR_LANE_SPAN;
+    }
+
+    return scan_scalar (buf, start, end, mask);
+}
+
+#ifdef HAVE_AVX2_SCAN
+
+#define AVX2_LANES 8
+
+/* Like scan_lanes(), with 8 lanes in two vectors. The table lookups are
+ * gathers, two independent ones hide some of their latency.
+ */
+__attribute__((target("avx2")))
+static size_t
+scan_avx2 (const uint8_t *buf, size_t start, size_t end, uint64_t mask)
+{
+    const long long *table = (const long long *)gear_table;
+    __m256i vmask = _mm256_set1_epi64x ((long long)mask);
+    __m256i zero = _mm256_setzero_si256 ();
+
+    while (end - start >= AVX2_LANES * GEAR_LANE_SPAN) {
+        const uint8_t *p = buf + start;
+        __m256i lo = zero, hi = zero;
+        long hit[AVX2_LANES];
+        long t;
+        int k, bits;
+
+        for (k = 0; k < AVX2_LANES; ++k)
+            hit[k] = -1;
+
+#define GEAR_AVX2_STEP(t)                                                   \
+        do {                                                                \
+            __m128i idx_lo = _mm_set_epi32 (p[3*GEAR_LANE_SPAN + (t)],      \
+                                            p[2*GEAR_LANE_SPAN + (t)],      \
+                                            p[GEAR_LANE_SPAN + (t)],        \
+                                            p[(t)]);                        \
+            __m128i idx_hi = _mm_set_epi32 (p[7*GEAR_LANE_SPAN + (t)],      \
+                                            p[6*GEAR_LANE_SPAN + (t)],      \
+                                            p[5*GEAR_LANE_SPAN + (t)],      \
+                                            p[4*GEAR_LANE_SPAN + (t)]);     \
+            lo = _mm256_add_epi64 (_mm256_slli_epi64 (lo, 1),               \
+                                   _mm256_i32gather_epi64 (table, idx_lo, 8)); \
+            hi = _mm256_add_epi64 (_mm256_slli_epi64 (hi, 1),               \
+                                   _mm256_i32gather_epi64 (table, idx_hi, 8)); \
+        } while (0)
+
+        for (t = -GEAR_WINDOW; t < 0; ++t)
+            GEAR_AVX2_STEP (t);
+
+        for (t = 0; t < GEAR_LANE_SPAN; ++t) {
+            GEAR_AVX2_STEP (t);
+
+            bits = _mm256_movemask_pd (_mm256_castsi256_pd (
+                       _mm256_cmpeq_epi64 (_mm256_and_si256 (lo, vmask), zero)));
+            bits |= _mm256_movemask_pd (_mm256_castsi256_pd (
+                        _mm256_cmpeq_epi64 (_mm256_and_si256 (hi, vmask), zero))) << 4;
+            if (bits) {
+                /* Nothing in the other lanes comes before lane 0. */
+                if (bits & 1)
+                    return start + t;
+                for (k = 1; k < AVX2_LANES; ++k) {
+                    if ((bits & (1 << k)) && hit[k] < 0)
+                        hit[k] = t;
+                }
+            }
+        }
+
+#undef GEAR_AVX2_STEP
+
+        for (k = 1; k < AVX2_LANES; ++k) {
+            if (hit[k] >= 0)
+                return start + (size_t)k * GEAR_LANE_SPAN + hit[k];
+        }
+        start += AVX2_LANES * GEAR_LANE_SPAN;
+    }
+
+    return scan_lanes (buf, start, end, mask);
+}
+
+#endif  /* HAVE_AVX2_SCAN */
+
+static uint64_t
+splitmix64 (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void
+gear_init (void)
+{
+    uint64_t state = GEAR_SEED;
+    int i;
+
+    for (i = 0; i < 256; ++i)
+        gear_table[i] = splitmix64 (&state);
+
+    /* The AVX2 scan is bound by gathers and measured slower than 4 scalar
+     * lanes on the CPUs we tried, so it's only used if asked for.
+     */
+    gear_set_scan_impl (GEAR_SCAN_LANES);
+}
+
+GearScanImpl
+gear_get_scan_impl (void)
+{
+    return scan_impl;
+}
+
+int
+gear_set_scan_impl (GearScanImpl impl)
+{
+    switch (impl) {
+    case GEAR_SCAN_SCALAR:
+        scan_func = scan_scalar;
+        break;
+    case GEAR_SCAN_LANES:
+        scan_func = scan_lanes;
+        break;
+    case GEAR_SCAN_AVX2:
+#ifdef HAVE_AVX2_SCAN
+        if (!__builtin_cpu_supports ("avx2"))
+            return -1;
+        scan_func = scan_avx2;
+        break;
+#else
+        return -1;
+#endif
+    default:
+        return -1;
+    }
+
+    scan_impl = impl;
+    return 0;
+}
+
+const char *
+gear_scan_impl_name (GearScanImpl impl)
+{
+    switch (impl) {
+    case GEAR_SCAN_SCALAR:
+        return "scalar";
+    case GEAR_SCAN_LANES:
+        return "lanes";
+    case GEAR_SCAN_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+/* A mask with the n highest bits set. The high bits of a gear hash depend
+ * on all the bytes in the window.
+ */
+static uint64_t
+high_bits_mask (int n)
+{
+    if (n <= 0)
+        return 0;
+    if (n >= 64)
+        return ~0ULL;
+    return ~0ULL << (64 - n);
+}
+
+uint32_t
+gear_find_boundary (const uint8_t *buf, uint32_t len,
+                    uint32_t min_sz, uint32_t avg_sz, uint32_t max_sz)
+{
+    uint32_t normal_sz;
+    int bits = 0;
+    size_t i;
+
+    if (min_sz < GEAR_WINDOW)
+        min_sz = GEAR_WINDOW;
+    if (len > max_sz)
+        len = max_sz;
+    if (len <= min_sz)
+        return len;
+
+    while ((2ULL << bits) <= avg_sz)
+        ++bits;
+
+    normal_sz = (avg_sz < len) ? avg_sz : len;
+    if (normal_sz > min_sz) {
+        i = scan_func (buf, min_sz, normal_sz,
+                       high_bits_mask (bits + NORMALIZATION_LEVEL));
+        if (i < normal_sz)
+            return (uint32_t)i + 1;
+    } else {
+        normal_sz = min_sz;
+    }
+
+    i = scan_func (buf, normal_sz, len,
+                   high_bits_mask (bits - NORMALIZATION_LEVEL));
+    if (i < len)
+        return (uint32_t)i + 1;
+
+    return len;
+}
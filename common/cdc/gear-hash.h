@@ -0,0 +1,32 @@
+#ifndef _GEAR_HASH_H
+#define _GEAR_HASH_H
+
+#include <stdint.h>
+
+/* Number of bytes a gear hash depends on. */
+#define GEAR_WINDOW 64
+
+typedef enum {
+    GEAR_SCAN_SCALAR,
+    GEAR_SCAN_LANES,
+    GEAR_SCAN_AVX2,
+} GearScanImpl;
+
+void gear_init (void);
+
+/* Returns the length of the first chunk in @buf, using normalized chunking:
+ * a cut point is harder to hit before @avg_sz and easier after it.
+ * Returns @len if there's no cut point before min(@len, @max_sz), so the
+ * caller should pass at least @max_sz bytes unless it's at the end of file.
+ */
+uint32_t gear_find_boundary (const uint8_t *buf, uint32_t len,
+                             uint32_t min_sz, uint32_t avg_sz, uint32_t max_sz);
+
+/* All implementations find the same boundaries. These are for benchmarks. */
+GearScanImpl gear_get_scan_impl (void);
+
+int gear_set_scan_impl (GearScanImpl impl);
+
+const char *gear_scan_impl_name (GearScanImpl impl);
+
+#endif
@@ -0,0 +1,511 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "cluster-cache.h"
+
+#define CLUSTER_CACHE_GROUP "cluster_cache"
+#define DEFAULT_TTL 86400               /* 1 day */
+#define DEFAULT_TIMEOUT_MS 100
+#define MAX_IDLE_CONNS 16
+/* Entries larger than this aren't stored, memcached refuses them. */
+#define MAX_VALUE_SIZE (1 << 20)
+/* Memcached takes longer expire times as a unix time. */
+#define MEMCACHED_MAX_TTL (30 * 86400)
+#define RETRY_INTERVAL 5
+#define CONN_BUF_SIZE 4096
+
+enum {
+    BACKEND_REDIS,
+    BACKEND_MEMCACHED,
+};
+
+typedef struct CacheConn {
+    int   fd;
+    char  buf[CONN_BUF_SIZE];
+    int   start;
+    int   end;
+} CacheConn;
+
+struct ClusterCache {
+    int    backend;
+    char  *host;
+    char  *port;
+    int    ttl;
+    int    timeout_ms;
+
+    pthread_mutex_t lock;
+    GQueue idle_conns;
+    gint64 down_until;
+};
+
+ClusterCache *
+cluster_cache_new (GKeyFile *config)
+{
+    ClusterCache *cache;
+    char *backend, *host, *colon;
+    int backend_type;
+    GError *error = NULL;
+    int n;
+
+    backend = g_key_file_get_string (config, CLUSTER_CACHE_GROUP, "backend", NULL);
+    if (!backend)
+        return NULL;
+
+    if (strcmp (backend, "redis") == 0)
+        backend_type = BACKEND_REDIS;
+    else if (strcmp (backend, "memcached") == 0)
+        backend_type = BACKEND_MEMCACHED;
+    else {
+        seaf_warning ("Unknown cluster cache backend %s.\n", backend);
+        g_free (backend);
+        return NULL;
+    }
+    g_free (backend);
+
+    host = g_key_file_get_string (config, CLUSTER_CACHE_GROUP, "host", NULL);
+    if (!host) {
+        seaf_warning ("No host set for the cluster cache.\n");
+        return NULL;
+    }
+
+    cache = g_new0 (ClusterCache, 1);
+    cache->backend = backend_type;
+
+    colon = strrchr (host, ':');
+    if (colon) {
+        cache->host = g_strndup (host, colon - host);
+        cache->port = g_strdup (colon + 1);
+    } else {
+        cache->host = g_strdup (host);
+        cache->port = g_strdup (backend_type == BACKEND_REDIS ? "6379" : "11211");
+    }
+    g_free (host);
+
+    n = g_key_file_get_integer (config, CLUSTER_CACHE_GROUP, "ttl", &error);
+    if (error) {
+        n = DEFAULT_TTL;
+        g_clear_error (&error);
+    }
+    cache->ttl = n > 0 ? n : DEFAULT_TTL;
+    if (backend_type == BACKEND_MEMCACHED && cache->ttl > MEMCACHED_MAX_TTL)
+        cache->ttl = MEMCACHED_MAX_TTL;
+
+    n = g_key_file_get_integer (config, CLUSTER_CACHE_GROUP, "timeout", &error);
+    if (error) {
+        n = DEFAULT_TIMEOUT_MS;
+        g_clear_error (&error);
+    }
+    cache->timeout_ms = n > 0 ? n : DEFAULT_TIMEOUT_MS;
+
+    pthread_mutex_init (&cache->lock, NULL);
+    g_queue_init (&cache->idle_conns);
+
+    return cache;
+}
+
+static void
+close_conn (CacheConn *conn)
+{
+    close (conn->fd);
+    g_free (conn);
+}
+
+void
+cluster_cache_free (ClusterCache *cache)
+{
+    CacheConn *conn;
+
+    if (!cache)
+        return;
+
+    while ((conn = g_queue_pop_head (&cache->idle_conns)) != NULL)
+        close_conn (conn);
+    pthread_mutex_destroy (&cache->lock);
+    g_free (cache->host);
+    g_free (cache->port);
+    g_free (cache);
+}
+
+static CacheConn *
+open_conn (ClusterCache *cache)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct timeval tv;
+    int fd = -1, on = 1;
+    CacheConn *conn;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (cache->host, cache->port, &hints, &res) != 0)
+        return NULL;
+
+    tv.tv_sec = cache->timeout_ms / 1000;
+    tv.tv_usec = (cache->timeout_ms % 1000) * 1000;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        /* On Linux the send timeout also bounds connect(). */
+        setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (res);
+
+    if (fd < 0)
+        return NULL;
+
+    conn = g_new0 (CacheConn, 1);
+    conn->fd = fd;
+    return conn;
+}
+
+static CacheConn *
+get_conn (ClusterCache *cache)
+{
+    CacheConn *conn;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&cache->lock);
+    if (now < cache->down_until) {
+        pthread_mutex_unlock (&cache->lock);
+        return NULL;
+    }
+    conn = g_queue_pop_head (&cache->idle_conns);
+    pthread_mutex_unlock (&cache->lock);
+
+    if (conn)
+        return conn;
+
+    conn = open_conn (cache);
+    if (!conn) {
+        seaf_warning ("Failed to connect to cluster cache %s:%s.\n",
+                      cache->host, cache->port);
+        pthread_mutex_lock (&cache->lock);
+        cache->down_until = now + RETRY_INTERVAL;
+        pthread_mutex_unlock (&cache->lock);
+    }
+    return conn;
+}
+
+static void
+put_conn (ClusterCache *cache, CacheConn *conn, gboolean failed)
+{
+    if (failed) {
+        close_conn (conn);
+        return;
+    }
+
+    pthread_mutex_lock (&cache->lock);
+    if (cache->idle_conns.length < MAX_IDLE_CONNS) {
+        g_queue_push_head (&cache->idle_conns, conn);
+        conn = NULL;
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    if (conn)
+        close_conn (conn);
+}
+
+static int
+conn_fill (CacheConn *conn)
+{
+    ssize_t n;
+
+    if (conn->start > 0) {
+        memmove (conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    if (conn->end == CONN_BUF_SIZE)
+        return -1;
+
+    n = recv (conn->fd, conn->buf + conn->end, CONN_BUF_SIZE - conn->end, 0);
+    if (n <= 0)
+        return -1;
+    conn->end += n;
+    return 0;
+}
+
+/* Reads a line without its "\r\n" into @line. */
+static int
+conn_read_line (CacheConn *conn, GString *line)
+{
+    char *p;
+
+    while (1) {
+        p = memchr (conn->buf + conn->start, '\n', conn->end - conn->start);
+        if (p)
+            break;
+        if (conn_fill (conn) < 0)
+            return -1;
+    }
+
+    g_string_truncate (line, 0);
+    g_string_append_len (line, conn->buf + conn->start,
+                         p - (conn->buf + conn->start));
+    if (line->len > 0 && line->str[line->len - 1] == '\r')
+        g_string_truncate (line, line->len - 1);
+    conn->start = p + 1 - conn->buf;
+    return 0;
+}
+
+static int
+conn_read_n (CacheConn *conn, char *out, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (conn->start == conn->end && conn_fill (conn) < 0)
+            return -1;
+        n = MIN (conn->end - conn->start, len);
+        memcpy (out, conn->buf + conn->start, n);
+        conn->start += n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+conn_send (CacheConn *conn, GString *req)
+{
+    gsize sent = 0;
+    ssize_t n;
+
+    while (sent < req->len) {
+        n = send (conn->fd, req->str + sent, req->len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static void
+redis_append_arg (GString *req, const char *arg, int len)
+{
+    g_string_append_printf (req, "$%d\r\n", len);
+    g_string_append_len (req, arg, len);
+    g_string_append (req, "\r\n");
+}
+
+static GString *
+build_get_request (ClusterCache *cache, const char *key)
+{
+    GString *req = g_string_new (NULL);
+
+    if (cache->backend == BACKEND_REDIS) {
+        g_string_append (req, "*2\r\n");
+        redis_append_arg (req, "GET", 3);
+        redis_append_arg (req, key, strlen(key));
+    } else {
+        g_string_append_printf (req, "get %s\r\n", key);
+    }
+    return req;
+}
+
+static GString *
+build_set_request (ClusterCache *cache, const char *key,
+                   const void *value, int len)
+{
+    GString *req = g_string_new (NULL);
+    char ttl[32];
+
+    snprintf (ttl, sizeof(ttl), "%d", cache->ttl);
+
+    if (cache->backend == BACKEND_REDIS) {
+        g_string_append (req, "*5\r\n");
+        redis_append_arg (req, "SET", 3);
+        redis_append_arg (req, key, strlen(key));
+        redis_append_arg (req, value, len);
+        redis_append_arg (req, "EX", 2);
+        redis_append_arg (req, ttl, strlen(ttl));
+    } else {
+        g_string_append_printf (req, "set %s 0 %s %d\r\n", key, ttl, len);
+        g_string_append_len (req, value, len);
+        g_string_append (req, "\r\n");
+    }
+    return req;
+}
+
+static GString *
+build_delete_request (ClusterCache *cache, const char *key)
+{
+    GString *req = g_string_new (NULL);
+
+    if (cache->backend == BACKEND_REDIS) {
+        g_string_append (req, "*2\r\n");
+        redis_append_arg (req, "DEL", 3);
+        redis_append_arg (req, key, strlen(key));
+    } else {
+        g_string_append_printf (req, "delete %s\r\n", key);
+    }
+    return req;
+}
+
+/* Returns 1 on a hit, 0 on a miss and -1 on errors. */
+static int
+read_get_reply (ClusterCache *cache, CacheConn *conn, GString *line,
+                void **value, int *len)
+{
+    char *data;
+    int n;
+
+    if (conn_read_line (conn, line) < 0)
+        return -1;
+
+    if (cache->backend == BACKEND_REDIS) {
+        if (line->str[0] != '$')
+            return -1;
+        n = atoi (line->str + 1);
+        if (n < 0)
+            return 0;
+    } else {
+        char *p;
+
+        if (strcmp (line->str, "END") == 0)
+            return 0;
+        if (strncmp (line->str, "VALUE ", 6) != 0)
+            return -1;
+        /* VALUE <key> <flags> <bytes> */
+        p = strrchr (line->str, ' ');
+        n = atoi (p + 1);
+        if (n < 0)
+            return -1;
+    }
+
+    if (n > MAX_VALUE_SIZE)
+        return -1;
+
+    /* The value is followed by "\r\n". */
+    data = g_malloc (n + 2);
+    if (conn_read_n (conn, data, n + 2) < 0 ||
+        data[n] != '\r' || data[n + 1] != '\n') {
+        g_free (data);
+        return -1;
+    }
+    data[n] = '\0';
+
+    if (cache->backend == BACKEND_MEMCACHED) {
+        if (conn_read_line (conn, line) < 0 || strcmp (line->str, "END") != 0) {
+            g_free (data);
+            return -1;
+        }
+    }
+
+    *value = data;
+    *len = n;
+    return 1;
+}
+
+static int
+read_status_reply (ClusterCache *cache, CacheConn *conn, GString *line)
+{
+    if (conn_read_line (conn, line) < 0)
+        return -1;
+
+    if (cache->backend == BACKEND_REDIS)
+        return (line->str[0] == '+' || line->str[0] == ':') ? 0 : -1;
+
+    if (strcmp (line->str, "STORED") == 0 ||
+        strcmp (line->str, "DELETED") == 0 ||
+        strcmp (line->str, "NOT_FOUND") == 0)
+        return 0;
+    /* E.g. SERVER_ERROR for too large values, the connection is usable. */
+    if (strncmp (line->str, "SERVER_ERROR", 12) == 0)
+        return 1;
+    return -1;
+}
+
+int
+cluster_cache_get (ClusterCache *cache, const char *key,
+                   void **value, int *len)
+{
+    CacheConn *conn;
+    GString *req, *line;
+    int ret;
+
+    conn = get_conn (cache);
+    if (!conn)
+        return -1;
+
+    req = build_get_request (cache, key);
+    line = g_string_new (NULL);
+
+    if (conn_send (conn, req) < 0)
+        ret = -1;
+    else
+        ret = read_get_reply (cache, conn, line, value, len);
+    put_conn (cache, conn, ret < 0);
+
+    g_string_free (req, TRUE);
+    g_string_free (line, TRUE);
+    return ret > 0 ? 0 : -1;
+}
+
+static int
+send_status_request (ClusterCache *cache, GString *req)
+{
+    CacheConn *conn;
+    GString *line;
+    int ret;
+
+    conn = get_conn (cache);
+    if (!conn)
+        return -1;
+
+    line = g_string_new (NULL);
+    if (conn_send (conn, req) < 0)
+        ret = -1;
+    else
+        ret = read_status_reply (cache, conn, line);
+    put_conn (cache, conn, ret < 0);
+
+    g_string_free (line, TRUE);
+    return ret == 0 ? 0 : -1;
+}
+
+int
+cluster_cache_set (ClusterCache *cache, const char *key,
+                   const void *value, int len)
+{
+    GString *req;
+    int ret;
+
+    if (len > MAX_VALUE_SIZE)
+        return -1;
+
+    req = build_set_request (cache, key, value, len);
+    ret = send_status_request (cache, req);
+    g_string_free (req, TRUE);
+    return ret;
+}
+
+int
+cluster_cache_delete (ClusterCache *cache, const char *key)
+{
+    GString *req;
+    int ret;
+
+    req = build_delete_request (cache, key);
+    ret = send_status_request (cache, req);
+    g_string_free (req, TRUE);
+    return ret;
+}
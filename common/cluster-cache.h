@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Client of a cache shared by the nodes of a cluster, a memcached or a
+ * Redis server, set up in seafile.conf:
+ *
+ * [cluster_cache]
+ * backend = redis         (or memcached)
+ * host = 127.0.0.1:6379
+ * ttl = 86400             (seconds entries are kept)
+ * timeout = 100           (ms to wait for the server)
+ *
+ * It only holds data that doesn't change under a key, and the Go
+ * fileserver uses the same keys:
+ *
+ *   seaf:<obj_type>:<repo_id>:<obj_id>   commit and fs objects as stored
+ *   seaf:storeid:<repo_id>               store id of a (virtual) repo
+ *
+ * Errors are treated as misses. After the server fails to answer, the
+ * cache is bypassed for a few seconds.
+ */
+
+typedef struct ClusterCache ClusterCache;
+
+/* Returns NULL if no cluster cache is configured. */
+ClusterCache *
+cluster_cache_new (GKeyFile *config);
+
+void
+cluster_cache_free (ClusterCache *cache);
+
+/* Returns 0 and the value in @value, to be freed with g_free, on a hit. */
+int
+cluster_cache_get (ClusterCache *cache, const char *key,
+                   void **value, int *len);
+
+int
+cluster_cache_set (ClusterCache *cache, const char *key,
+                   const void *value, int len);
+
+int
+cluster_cache_delete (ClusterCache *cache, const char *key);
+
+#endif
@@ -6,6 +6,7 @@
 
 #include <jansson.h>
 #include <openssl/sha.h>
+#include <fcntl.h>
 
 #include "utils.h"
 #include "db.h"
@@ -14,11 +15,22 @@
 #include "seafile-session.h"
 #include "commit-mgr.h"
 #include "seaf-utils.h"
+#include "lru-cache.h"
+#include "json-scanner.h"
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+#define DEFAULT_COMMIT_CACHE_SIZE_MB 16
+#define DEFAULT_COMMIT_CACHE_SHARDS 16
+
+/*
+ * Commits are immutable once written, so loaded commits are kept in an LRU
+ * keyed by repo and commit id, and never need invalidating except when a
+ * commit is deleted. Callers may modify and unref what they get, so the
+ * cache only ever hands out copies, each with its own ref count.
+ */
 struct _SeafCommitManagerPriv {
-    int dummy;
+    LRUCache *commit_cache;
 };
 
 static SeafCommit *
@@ -37,6 +49,9 @@ static json_t *
 commit_to_json_object (SeafCommit *commit);
 static SeafCommit *
 commit_from_json_object (const char *id, json_t *object);
+static int
+commit_from_json_data (const char *commit_id, const char *data, gsize len,
+                       SeafCommit **commit);
 
 static void compute_commit_id (SeafCommit* commit)
 {
@@ -130,6 +145,9 @@ seaf_commit_from_data (const char *id, char *data, gsize len)
     SeafCommit *commit;
     json_error_t jerror;
 
+    if (commit_from_json_data (id, data, len, &commit) == 0)
+        return commit;
+
     object = json_loadb (data, len, 0, &jerror);
     if (!object) {
         /* Perhaps the commit object contains invalid UTF-8 character. */
@@ -189,12 +207,341 @@ seaf_commit_unref (SeafCommit *commit)
         seaf_commit_free (commit);
 }
 
+static SeafCommit *
+seaf_commit_dup (const SeafCommit *commit)
+{
+    SeafCommit *copy = g_memdup (commit, sizeof(SeafCommit));
+
+    copy->ref = 1;
+    copy->desc = g_strdup (commit->desc);
+    copy->creator_name = g_strdup (commit->creator_name);
+    copy->parent_id = g_strdup (commit->parent_id);
+    copy->second_parent_id = g_strdup (commit->second_parent_id);
+    copy->repo_name = g_strdup (commit->repo_name);
+    copy->repo_desc = g_strdup (commit->repo_desc);
+    copy->repo_category = g_strdup (commit->repo_category);
+    copy->device_name = g_strdup (commit->device_name);
+    copy->client_version = g_strdup (commit->client_version);
+    copy->magic = g_strdup (commit->magic);
+    copy->random_key = g_strdup (commit->random_key);
+    copy->salt = g_strdup (commit->salt);
+
+    return copy;
+}
+
+static gpointer
+commit_cache_copy (gconstpointer value)
+{
+    return seaf_commit_dup (value);
+}
+
+static void
+commit_cache_value_free (gpointer value)
+{
+    seaf_commit_free (value);
+}
+
+/* Rough estimation of the memory used by a decoded commit. */
+static gint64
+commit_mem_size (const SeafCommit *commit)
+{
+    gint64 size = sizeof(SeafCommit) + 128;
+
+    if (commit->desc)
+        size += strlen (commit->desc) + 1;
+    if (commit->repo_name)
+        size += strlen (commit->repo_name) + 1;
+    if (commit->repo_desc)
+        size += strlen (commit->repo_desc) + 1;
+
+    /* Ids, names and keys of fixed or short length. */
+    return size + 10 * 48;
+}
+
+static void
+make_commit_cache_key (char *key, const char *repo_id, const char *commit_id)
+{
+    snprintf (key, 80, "%.36s/%.40s", repo_id, commit_id);
+}
+
+static void
+add_commit_to_cache (SeafCommitManager *mgr, const char *repo_id,
+                     SeafCommit *commit)
+{
+    char key[80];
+
+    if (!mgr->priv->commit_cache)
+        return;
+
+    make_commit_cache_key (key, repo_id, commit->commit_id);
+    lru_cache_insert (mgr->priv->commit_cache, key,
+                      seaf_commit_dup (commit), commit_mem_size (commit));
+}
+
+static LRUCache *
+create_commit_cache (SeafileSession *seaf)
+{
+    GError *error = NULL;
+    int size_mb;
+    int n_shards;
+
+    size_mb = g_key_file_get_integer (seaf->config,
+                                      "commit_cache", "max_size",
+                                      &error);
+    if (error) {
+        size_mb = DEFAULT_COMMIT_CACHE_SIZE_MB;
+        g_clear_error (&error);
+    }
+    if (size_mb <= 0) {
+        seaf_message ("commit cache is disabled.\n");
+        return NULL;
+    }
+
+    n_shards = g_key_file_get_integer (seaf->config,
+                                       "commit_cache", "shards",
+                                       &error);
+    if (error || n_shards <= 0) {
+        n_shards = DEFAULT_COMMIT_CACHE_SHARDS;
+        g_clear_error (&error);
+    }
+
+    return lru_cache_new ((gint64)size_mb << 20, n_shards,
+                          commit_cache_value_free);
+}
+
+/*
+ * The commit graph of a repo is kept in <seafile_dir>/commit-graph/<repo_id>,
+ * an append-only file of fixed-width records holding the ids, parents and
+ * ctime of commits. Records are appended when commits are added, and when
+ * a traversal had to load a commit without a record, so graphs of older
+ * repos fill up as they are traversed. Since commits never change, any
+ * subset of records is valid, and a traversal falls back to loading the
+ * commits it finds no record for. Records are appended with single writes
+ * in O_APPEND mode; a record cut short by a crash ends the usable part of
+ * the file.
+ */
+
+#define COMMIT_GRAPH_DIR "commit-graph"
+#define COMMIT_GRAPH_MAGIC "SCG1"
+
+#define GRAPH_HAS_PARENT 0x1
+#define GRAPH_HAS_SECOND_PARENT 0x2
+
+typedef struct CommitGraphRecord {
+    char magic[4];
+    guint32 flags;
+    gint64 ctime;
+    unsigned char commit_id[20];
+    unsigned char parent_id[20];
+    unsigned char second_parent_id[20];
+    unsigned char root_id[20];
+} CommitGraphRecord;
+
+typedef struct CommitGraph {
+    char *path;
+    char *data;
+    GHashTable *nodes;          /* raw commit id -> CommitGraphRecord */
+    GList *added;               /* records appended by this traversal */
+} CommitGraph;
+
+static guint
+raw_id_hash (gconstpointer key)
+{
+    guint h;
+
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+raw_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static char *
+commit_graph_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, COMMIT_GRAPH_DIR, repo_id, NULL);
+}
+
+static int
+commit_to_graph_record (SeafCommit *commit, CommitGraphRecord *rec)
+{
+    memset (rec, 0, sizeof(*rec));
+    memcpy (rec->magic, COMMIT_GRAPH_MAGIC, 4);
+    rec->ctime = commit->ctime;
+
+    if (hex_to_rawdata (commit->commit_id, rec->commit_id, 20) < 0 ||
+        hex_to_rawdata (commit->root_id, rec->root_id, 20) < 0)
+        return -1;
+    if (commit->parent_id) {
+        if (hex_to_rawdata (commit->parent_id, rec->parent_id, 20) < 0)
+            return -1;
+        rec->flags |= GRAPH_HAS_PARENT;
+    }
+    if (commit->second_parent_id) {
+        if (hex_to_rawdata (commit->second_parent_id, rec->second_parent_id, 20) < 0)
+            return -1;
+        rec->flags |= GRAPH_HAS_SECOND_PARENT;
+    }
+
+    return 0;
+}
+
+/* The commit has only the fields recorded in the graph. */
+static SeafCommit *
+commit_from_graph_record (const CommitGraphRecord *rec,
+                          const char *repo_id, int version)
+{
+    SeafCommit *commit = g_new0 (SeafCommit, 1);
+
+    commit->ref = 1;
+    rawdata_to_hex (rec->commit_id, commit->commit_id, 20);
+    memcpy (commit->repo_id, repo_id, 36);
+    rawdata_to_hex (rec->root_id, commit->root_id, 20);
+    commit->ctime = rec->ctime;
+    if (rec->flags & GRAPH_HAS_PARENT) {
+        commit->parent_id = g_malloc (41);
+        rawdata_to_hex (rec->parent_id, commit->parent_id, 20);
+    }
+    if (rec->flags & GRAPH_HAS_SECOND_PARENT) {
+        commit->second_parent_id = g_malloc (41);
+        rawdata_to_hex (rec->second_parent_id, commit->second_parent_id, 20);
+    }
+    commit->version = version;
+
+    return commit;
+}
+
+static void
+append_graph_record (const char *path, const CommitGraphRecord *rec)
+{
+    char *dir;
+    int fd;
+
+    fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        dir = g_path_get_dirname (path);
+        checkdir_with_mkdir (dir);
+        g_free (dir);
+        fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+    }
+    if (fd < 0) {
+        seaf_warning ("Failed to open commit graph %s: %s.\n",
+                      path, strerror(errno));
+        return;
+    }
+
+    if (write (fd, rec, sizeof(*rec)) != sizeof(*rec))
+        seaf_warning ("Failed to append to commit graph %s: %s.\n",
+                      path, strerror(errno));
+    close (fd);
+}
+
+static void
+add_commit_to_graph (const char *repo_id, SeafCommit *commit)
+{
+    CommitGraphRecord rec;
+    char *path;
+
+    if (commit_to_graph_record (commit, &rec) < 0)
+        return;
+
+    path = commit_graph_path (repo_id);
+    append_graph_record (path, &rec);
+    g_free (path);
+}
+
+static CommitGraph *
+commit_graph_load (const char *repo_id)
+{
+    CommitGraph *graph = g_new0 (CommitGraph, 1);
+    gsize len = 0;
+    CommitGraphRecord *rec;
+    gsize i;
+
+    graph->path = commit_graph_path (repo_id);
+    graph->nodes = g_hash_table_new (raw_id_hash, raw_id_equal);
+
+    if (!g_file_get_contents (graph->path, &graph->data, &len, NULL))
+        return graph;
+
+    /* The data returned by g_file_get_contents is suitably aligned. */
+    for (i = 0; i + sizeof(CommitGraphRecord) <= len; i += sizeof(CommitGraphRecord)) {
+        rec = (CommitGraphRecord *)(graph->data + i);
+        if (memcmp (rec->magic, COMMIT_GRAPH_MAGIC, 4) != 0) {
+            seaf_warning ("Commit graph %s is damaged at offset %"G_GSIZE_FORMAT", "
+                          "ignore the rest of it.\n", graph->path, i);
+            break;
+        }
+        g_hash_table_insert (graph->nodes, rec->commit_id, rec);
+    }
+
+    return graph;
+}
+
+static void
+commit_graph_free (CommitGraph *graph)
+{
+    if (!graph)
+        return;
+
+    g_hash_table_destroy (graph->nodes);
+    g_list_free_full (graph->added, g_free);
+    g_free (graph->data);
+    g_free (graph->path);
+    g_free (graph);
+}
+
+static void
+commit_graph_add (CommitGraph *graph, SeafCommit *commit)
+{
+    CommitGraphRecord *rec = g_new (CommitGraphRecord, 1);
+
+    if (commit_to_graph_record (commit, rec) < 0) {
+        g_free (rec);
+        return;
+    }
+
+    append_graph_record (graph->path, rec);
+    graph->added = g_list_prepend (graph->added, rec);
+    g_hash_table_insert (graph->nodes, rec->commit_id, rec);
+}
+
+/*
+ * Get a commit for traversal. With a graph, commits are built from its
+ * records, and commits that have to be loaded are added to it.
+ */
+static SeafCommit *
+get_traverse_commit (CommitGraph *graph, const char *repo_id, int version,
+                     const char *id)
+{
+    unsigned char raw[20];
+    CommitGraphRecord *rec;
+    SeafCommit *commit;
+
+    if (graph && hex_to_rawdata (id, raw, 20) == 0) {
+        rec = g_hash_table_lookup (graph->nodes, raw);
+        if (rec)
+            return commit_from_graph_record (rec, repo_id, version);
+    }
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             repo_id, version, id);
+    if (commit && graph)
+        commit_graph_add (graph, commit);
+
+    return commit;
+}
+
 SeafCommitManager*
 seaf_commit_manager_new (SeafileSession *seaf)
 {
     SeafCommitManager *mgr = g_new0 (SeafCommitManager, 1);
 
     mgr->priv = g_new0 (SeafCommitManagerPriv, 1);
+    mgr->priv->commit_cache = create_commit_cache (seaf);
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
@@ -211,34 +558,18 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
-    seaf_commit_ref (commit);
-}
-
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
-}
-#endif
-
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
                                 SeafCommit *commit)
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
-    
+
+    add_commit_to_cache (mgr, commit->repo_id, commit);
+    add_commit_to_graph (commit->repo_id, commit);
+
     return 0;
 }
 
@@ -250,20 +581,11 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    if (mgr->priv->commit_cache) {
+        char key[80];
+        make_commit_cache_key (key, repo_id, id);
+        lru_cache_remove (mgr->priv->commit_cache, key);
+    }
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -275,20 +597,21 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
                                 const char *id)
 {
     SeafCommit *commit;
-
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
-        return commit;
+    char key[80];
+
+    if (mgr->priv->commit_cache) {
+        make_commit_cache_key (key, repo_id, id);
+        commit = lru_cache_lookup (mgr->priv->commit_cache, key,
+                                   commit_cache_copy);
+        if (commit)
+            return commit;
     }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    add_commit_to_cache (mgr, repo_id, commit);
 
     return commit;
 }
@@ -325,7 +648,8 @@ compare_commit_by_time (gconstpointer a, gconstpointer b, gpointer unused)
 inline static int
 insert_parent_commit (GList **list, GHashTable *hash,
                       const char *repo_id, int version,
-                      const char *parent_id, gboolean allow_truncate)
+                      const char *parent_id, gboolean allow_truncate,
+                      CommitGraph *graph)
 {
     SeafCommit *p;
     char *key;
@@ -333,9 +657,7 @@ insert_parent_commit (GList **list, GHashTable *hash,
     if (g_hash_table_lookup (hash, parent_id) != NULL)
         return 0;
 
-    p = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                        repo_id, version,
-                                        parent_id);
+    p = get_traverse_commit (graph, repo_id, version, parent_id);
     if (!p) {
         if (allow_truncate)
             return 0;
@@ -353,16 +675,17 @@ insert_parent_commit (GList **list, GHashTable *hash,
     return 0;
 }
 
-gboolean
-seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
-                                                     const char *repo_id,
-                                                     int version,
-                                                     const char *head,
-                                                     CommitTraverseFunc func,
-                                                     int limit,
-                                                     void *data,
-                                                     char **next_start_commit,
-                                                     gboolean skip_errors)
+static gboolean
+traverse_commit_tree_with_limit_common (SeafCommitManager *mgr,
+                                        const char *repo_id,
+                                        int version,
+                                        const char *head,
+                                        CommitTraverseFunc func,
+                                        int limit,
+                                        void *data,
+                                        char **next_start_commit,
+                                        gboolean skip_errors,
+                                        CommitGraph *graph)
 {
     SeafCommit *commit;
     GList *list = NULL;
@@ -372,7 +695,7 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
     /* A hash table for recording id of traversed commits. */
     commit_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    commit = seaf_commit_manager_get_commit (mgr, repo_id, version, head);
+    commit = get_traverse_commit (graph, repo_id, version, head);
     if (!commit) {
         seaf_warning ("Failed to find commit %s.\n", head);
         g_hash_table_destroy (commit_hash);
@@ -410,7 +733,7 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
 
         if (commit->parent_id) {
             if (insert_parent_commit (&list, commit_hash, repo_id, version,
-                                      commit->parent_id, FALSE) < 0) {
+                                      commit->parent_id, FALSE, graph) < 0) {
                 if (!skip_errors) {
                     seaf_commit_unref (commit);
                     ret = FALSE;
@@ -420,7 +743,7 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
         }
         if (commit->second_parent_id) {
             if (insert_parent_commit (&list, commit_hash, repo_id, version,
-                                      commit->second_parent_id, FALSE) < 0) {
+                                      commit->second_parent_id, FALSE, graph) < 0) {
                 if (!skip_errors) {
                     seaf_commit_unref (commit);
                     ret = FALSE;
@@ -469,14 +792,15 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
                              CommitTraverseFunc func,
                              void *data,
                              gboolean skip_errors,
-                             gboolean allow_truncate)
+                             gboolean allow_truncate,
+                             CommitGraph *graph)
 {
     SeafCommit *commit;
     GList *list = NULL;
     GHashTable *commit_hash;
     gboolean ret = TRUE;
 
-    commit = seaf_commit_manager_get_commit (mgr, repo_id, version, head);
+    commit = get_traverse_commit (graph, repo_id, version, head);
     if (!commit) {
         seaf_warning ("Failed to find commit %s.\n", head);
         // For head commit damaged, directly return FALSE
@@ -519,7 +843,8 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
 
         if (commit->parent_id) {
             if (insert_parent_commit (&list, commit_hash, repo_id, version,
-                                      commit->parent_id, allow_truncate) < 0) {
+                                      commit->parent_id, allow_truncate,
+                                      graph) < 0) {
                 seaf_warning("[comit-mgr] insert parent commit failed\n");
 
                 /* If skip errors, try insert second parent. */
@@ -532,7 +857,8 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
         }
         if (commit->second_parent_id) {
             if (insert_parent_commit (&list, commit_hash, repo_id, version,
-                                      commit->second_parent_id, allow_truncate) < 0) {
+                                      commit->second_parent_id, allow_truncate,
+                                      graph) < 0) {
                 seaf_warning("[comit-mgr]insert second parent commit failed\n");
 
                 if (!skip_errors) {
@@ -555,6 +881,45 @@ out:
     return ret;
 }
 
+gboolean
+seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
+                                                     const char *repo_id,
+                                                     int version,
+                                                     const char *head,
+                                                     CommitTraverseFunc func,
+                                                     int limit,
+                                                     void *data,
+                                                     char **next_start_commit,
+                                                     gboolean skip_errors)
+{
+    return traverse_commit_tree_with_limit_common (mgr, repo_id, version, head,
+                                                   func, limit, data,
+                                                   next_start_commit,
+                                                   skip_errors, NULL);
+}
+
+gboolean
+seaf_commit_manager_traverse_commit_graph_with_limit (SeafCommitManager *mgr,
+                                                      const char *repo_id,
+                                                      int version,
+                                                      const char *head,
+                                                      CommitTraverseFunc func,
+                                                      int limit,
+                                                      void *data,
+                                                      char **next_start_commit,
+                                                      gboolean skip_errors)
+{
+    CommitGraph *graph = commit_graph_load (repo_id);
+    gboolean ret;
+
+    ret = traverse_commit_tree_with_limit_common (mgr, repo_id, version, head,
+                                                  func, limit, data,
+                                                  next_start_commit,
+                                                  skip_errors, graph);
+    commit_graph_free (graph);
+    return ret;
+}
+
 gboolean
 seaf_commit_manager_traverse_commit_tree (SeafCommitManager *mgr,
                                           const char *repo_id,
@@ -565,7 +930,25 @@ seaf_commit_manager_traverse_commit_tree (SeafCommitManager *mgr,
                                           gboolean skip_errors)
 {
     return traverse_commit_tree_common (mgr, repo_id, version, head,
-                                        func, data, skip_errors, FALSE);
+                                        func, data, skip_errors, FALSE, NULL);
+}
+
+gboolean
+seaf_commit_manager_traverse_commit_graph (SeafCommitManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *head,
+                                           CommitTraverseFunc func,
+                                           void *data,
+                                           gboolean skip_errors)
+{
+    CommitGraph *graph = commit_graph_load (repo_id);
+    gboolean ret;
+
+    ret = traverse_commit_tree_common (mgr, repo_id, version, head,
+                                       func, data, skip_errors, FALSE, graph);
+    commit_graph_free (graph);
+    return ret;
 }
 
 gboolean
@@ -578,7 +961,7 @@ seaf_commit_manager_traverse_commit_tree_truncated (SeafCommitManager *mgr,
                                                     gboolean skip_errors)
 {
     return traverse_commit_tree_common (mgr, repo_id, version, head,
-                                        func, data, skip_errors, TRUE);
+                                        func, data, skip_errors, TRUE, NULL);
 }
 
 gboolean
@@ -587,12 +970,6 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
-
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
@@ -654,82 +1031,80 @@ commit_to_json_object (SeafCommit *commit)
     return object;
 }
 
-static SeafCommit *
-commit_from_json_object (const char *commit_id, json_t *object)
-{
-    SeafCommit *commit = NULL;
+/* The members of a commit object. Strings are NULL if missing or null,
+ * integers 0 if missing.
+ */
+typedef struct CommitFields {
     const char *root_id;
     const char *repo_id;
-    const char *creator_name = NULL;
+    const char *creator_name;
     const char *creator;
     const char *desc;
     gint64 ctime;
-    const char *parent_id, *second_parent_id;
+    const char *parent_id;
+    const char *second_parent_id;
     const char *repo_name;
     const char *repo_desc;
     const char *repo_category;
     const char *device_name;
     const char *client_version;
-    const char *encrypted = NULL;
+    const char *encrypted;
+    gboolean has_enc_version;
+    gint64 enc_version;
+    const char *magic;
+    const char *random_key;
+    const char *salt;
+    gint64 no_local_history;
+    gint64 version;
+    gint64 new_merge;
+    gint64 conflict;
+    gint64 repaired;
+} CommitFields;
+
+static SeafCommit *
+commit_from_fields (const char *commit_id, CommitFields *fields)
+{
+    SeafCommit *commit = NULL;
+    const char *root_id = fields->root_id;
+    const char *repo_id = fields->repo_id;
+    const char *creator_name = fields->creator_name;
+    const char *creator = fields->creator;
+    const char *desc = fields->desc;
+    gint64 ctime = (guint64) fields->ctime;
+    const char *parent_id = fields->parent_id;
+    const char *second_parent_id = fields->second_parent_id;
+    const char *repo_name = fields->repo_name;
+    const char *repo_desc = fields->repo_desc;
+    const char *repo_category = fields->repo_category;
+    const char *device_name = fields->device_name;
+    const char *client_version = fields->client_version;
+    const char *encrypted = fields->encrypted;
     int enc_version = 0;
     const char *magic = NULL;
     const char *random_key = NULL;
     const char *salt = NULL;
-    int no_local_history = 0;
-    int version = 0;
-    int conflict = 0, new_merge = 0;
-    int repaired = 0;
+    int no_local_history = fields->no_local_history;
+    int version = fields->version;
+    int conflict = fields->conflict, new_merge = fields->new_merge;
+    int repaired = fields->repaired;
 
-    root_id = json_object_get_string_member (object, "root_id");
-    repo_id = json_object_get_string_member (object, "repo_id");
-    if (json_object_has_member (object, "creator_name"))
-        creator_name = json_object_get_string_or_null_member (object, "creator_name");
-    creator = json_object_get_string_member (object, "creator");
-    desc = json_object_get_string_member (object, "description");
     if (!desc)
         desc = "";
-    ctime = (guint64) json_object_get_int_member (object, "ctime");
-    parent_id = json_object_get_string_or_null_member (object, "parent_id");
-    second_parent_id = json_object_get_string_or_null_member (object, "second_parent_id");
-
-    repo_name = json_object_get_string_member (object, "repo_name");
     if (!repo_name)
         repo_name = "";
-    repo_desc = json_object_get_string_member (object, "repo_desc");
     if (!repo_desc)
         repo_desc = "";
-    repo_category = json_object_get_string_or_null_member (object, "repo_category");
-    device_name = json_object_get_string_or_null_member (object, "device_name");
-    client_version = json_object_get_string_or_null_member (object, "client_version");
-
-    if (json_object_has_member (object, "encrypted"))
-        encrypted = json_object_get_string_or_null_member (object, "encrypted");
 
     if (encrypted && strcmp(encrypted, "true") == 0
-        && json_object_has_member (object, "enc_version")) {
-        enc_version = json_object_get_int_member (object, "enc_version");
-        magic = json_object_get_string_member (object, "magic");
+        && fields->has_enc_version) {
+        enc_version = fields->enc_version;
+        magic = fields->magic;
     }
 
     if (enc_version >= 2)
-        random_key = json_object_get_string_member (object, "key");
+        random_key = fields->random_key;
     if (enc_version >= 3)
-        salt = json_object_get_string_member (object, "salt");
-
-    if (json_object_has_member (object, "no_local_history"))
-        no_local_history = json_object_get_int_member (object, "no_local_history");
-
-    if (json_object_has_member (object, "version"))
-        version = json_object_get_int_member (object, "version");
-    if (json_object_has_member (object, "new_merge"))
-        new_merge = json_object_get_int_member (object, "new_merge");
-
-    if (json_object_has_member (object, "conflict"))
-        conflict = json_object_get_int_member (object, "conflict");
-
-    if (json_object_has_member (object, "repaired"))
-        repaired = json_object_get_int_member (object, "repaired");
-
+        salt = fields->salt;
 
     /* sanity check for incoming values. */
     if (!repo_id || !is_uuid_valid(repo_id)  ||
@@ -814,6 +1189,166 @@ commit_from_json_object (const char *commit_id, json_t *object)
     return commit;
 }
 
+static SeafCommit *
+commit_from_json_object (const char *commit_id, json_t *object)
+{
+    CommitFields fields;
+
+    memset (&fields, 0, sizeof(fields));
+    fields.root_id = json_object_get_string_member (object, "root_id");
+    fields.repo_id = json_object_get_string_member (object, "repo_id");
+    if (json_object_has_member (object, "creator_name"))
+        fields.creator_name = json_object_get_string_or_null_member (object, "creator_name");
+    fields.creator = json_object_get_string_member (object, "creator");
+    fields.desc = json_object_get_string_member (object, "description");
+    fields.ctime = json_object_get_int_member (object, "ctime");
+    fields.parent_id = json_object_get_string_or_null_member (object, "parent_id");
+    fields.second_parent_id = json_object_get_string_or_null_member (object, "second_parent_id");
+
+    fields.repo_name = json_object_get_string_member (object, "repo_name");
+    fields.repo_desc = json_object_get_string_member (object, "repo_desc");
+    fields.repo_category = json_object_get_string_or_null_member (object, "repo_category");
+    fields.device_name = json_object_get_string_or_null_member (object, "device_name");
+    fields.client_version = json_object_get_string_or_null_member (object, "client_version");
+
+    if (json_object_has_member (object, "encrypted"))
+        fields.encrypted = json_object_get_string_or_null_member (object, "encrypted");
+    fields.has_enc_version = json_object_has_member (object, "enc_version");
+    fields.enc_version = json_object_get_int_member (object, "enc_version");
+    fields.magic = json_object_get_string_member (object, "magic");
+    fields.random_key = json_object_get_string_member (object, "key");
+    fields.salt = json_object_get_string_member (object, "salt");
+
+    fields.no_local_history = json_object_get_int_member (object, "no_local_history");
+    fields.version = json_object_get_int_member (object, "version");
+    fields.new_merge = json_object_get_int_member (object, "new_merge");
+    fields.conflict = json_object_get_int_member (object, "conflict");
+    fields.repaired = json_object_get_int_member (object, "repaired");
+
+    return commit_from_fields (commit_id, &fields);
+}
+
+/*
+ * Commit parsing is hot in GC and diffs, so commits are first decoded by a
+ * scanner straight into CommitFields, without building a jansson tree.
+ * Returns -1 if the data should be parsed by jansson instead, e.g. if it
+ * is not valid JSON or has values of unexpected types. Otherwise *commit is
+ * what commit_from_json_object() would return for the data.
+ */
+
+static int
+read_commit_string (JsonScanner *scanner, GPtrArray *strings,
+                    const char **value)
+{
+    char *str;
+
+    if (json_scanner_read_null (scanner)) {
+        *value = NULL;
+        return 0;
+    }
+    if (json_scanner_read_string (scanner) < 0)
+        return -1;
+    str = g_strndup (scanner->buf->str, scanner->buf->len);
+    g_ptr_array_add (strings, str);
+    *value = str;
+    return 0;
+}
+
+static int
+commit_from_json_data (const char *commit_id, const char *data, gsize len,
+                       SeafCommit **commit)
+{
+    JsonScanner scanner;
+    GPtrArray *strings;
+    CommitFields fields;
+    const char **str_field;
+    gint64 *int_field;
+    const char *key;
+    int ret = -1, n;
+
+    json_scanner_init (&scanner, data, len);
+    /* Owns the decoded strings, including those of repeated members. */
+    strings = g_ptr_array_new_with_free_func (g_free);
+    memset (&fields, 0, sizeof(fields));
+
+    if (json_scanner_enter_object (&scanner) < 0)
+        goto out;
+
+    while ((n = json_scanner_next_member (&scanner)) > 0) {
+        key = scanner.buf->str;
+        str_field = NULL;
+        int_field = NULL;
+
+        if (strcmp (key, "root_id") == 0)
+            str_field = &fields.root_id;
+        else if (strcmp (key, "repo_id") == 0)
+            str_field = &fields.repo_id;
+        else if (strcmp (key, "creator_name") == 0)
+            str_field = &fields.creator_name;
+        else if (strcmp (key, "creator") == 0)
+            str_field = &fields.creator;
+        else if (strcmp (key, "description") == 0)
+            str_field = &fields.desc;
+        else if (strcmp (key, "ctime") == 0)
+            int_field = &fields.ctime;
+        else if (strcmp (key, "parent_id") == 0)
+            str_field = &fields.parent_id;
+        else if (strcmp (key, "second_parent_id") == 0)
+            str_field = &fields.second_parent_id;
+        else if (strcmp (key, "repo_name") == 0)
+            str_field = &fields.repo_name;
+        else if (strcmp (key, "repo_desc") == 0)
+            str_field = &fields.repo_desc;
+        else if (strcmp (key, "repo_category") == 0)
+            str_field = &fields.repo_category;
+        else if (strcmp (key, "device_name") == 0)
+            str_field = &fields.device_name;
+        else if (strcmp (key, "client_version") == 0)
+            str_field = &fields.client_version;
+        else if (strcmp (key, "encrypted") == 0)
+            str_field = &fields.encrypted;
+        else if (strcmp (key, "enc_version") == 0) {
+            int_field = &fields.enc_version;
+            fields.has_enc_version = TRUE;
+        } else if (strcmp (key, "magic") == 0)
+            str_field = &fields.magic;
+        else if (strcmp (key, "key") == 0)
+            str_field = &fields.random_key;
+        else if (strcmp (key, "salt") == 0)
+            str_field = &fields.salt;
+        else if (strcmp (key, "no_local_history") == 0)
+            int_field = &fields.no_local_history;
+        else if (strcmp (key, "version") == 0)
+            int_field = &fields.version;
+        else if (strcmp (key, "new_merge") == 0)
+            int_field = &fields.new_merge;
+        else if (strcmp (key, "conflict") == 0)
+            int_field = &fields.conflict;
+        else if (strcmp (key, "repaired") == 0)
+            int_field = &fields.repaired;
+
+        if (str_field) {
+            if (read_commit_string (&scanner, strings, str_field) < 0)
+                goto out;
+        } else if (int_field) {
+            if (json_scanner_read_int (&scanner, int_field) < 0)
+                goto out;
+        } else if (json_scanner_skip_value (&scanner) < 0) {
+            goto out;
+        }
+    }
+    if (n < 0 || json_scanner_finish (&scanner) < 0)
+        goto out;
+
+    *commit = commit_from_fields (commit_id, &fields);
+    ret = 0;
+
+out:
+    g_ptr_array_free (strings, TRUE);
+    json_scanner_destroy (&scanner);
+    return ret;
+}
+
 static SeafCommit *
 load_commit (SeafCommitManager *mgr,
              const char *repo_id,
@@ -833,6 +1368,9 @@ load_commit (SeafCommitManager *mgr,
                                  commit_id, (void **)&data, &len) < 0)
         return NULL;
 
+    if (commit_from_json_data (commit_id, data, len, &commit) == 0)
+        goto out;
+
     object = json_loadb (data, len, 0, &jerror);
     if (!object) {
         /* Perhaps the commit object contains invalid UTF-8 character. */
@@ -852,10 +1390,10 @@ load_commit (SeafCommitManager *mgr,
     }
 
     commit = commit_from_json_object (commit_id, object);
-    if (commit)
-        commit->manager = mgr;
 
 out:
+    if (commit)
+        commit->manager = mgr;
     if (object) json_decref (object);
     g_free (data);
 
@@ -919,5 +1457,11 @@ int
 seaf_commit_manager_remove_store (SeafCommitManager *mgr,
                                   const char *store_id)
 {
+    char *path = commit_graph_path (store_id);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) && seaf_util_unlink (path) < 0)
+        seaf_warning ("Failed to remove commit graph %s.\n", path);
+    g_free (path);
+
     return seaf_obj_store_remove_store (mgr->obj_store, store_id);
 }
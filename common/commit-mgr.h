@@ -184,6 +184,32 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
                                                      char **next_start_commit,
                                                      gboolean skip_errors);
 
+/*
+ * Like the traversals above, but parents and ctimes are read from the commit
+ * graph of the repo, instead of loading every commit. The commits passed to
+ * @func only have commit_id, repo_id, root_id, ctime, parent_id,
+ * second_parent_id and version set. Use them when @func needs nothing else.
+ */
+gboolean
+seaf_commit_manager_traverse_commit_graph (SeafCommitManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *head,
+                                           CommitTraverseFunc func,
+                                           void *data,
+                                           gboolean skip_errors);
+
+gboolean
+seaf_commit_manager_traverse_commit_graph_with_limit (SeafCommitManager *mgr,
+                                                      const char *repo_id,
+                                                      int version,
+                                                      const char *head,
+                                                      CommitTraverseFunc func,
+                                                      int limit,
+                                                      void *data,
+                                                      char **next_start_commit,
+                                                      gboolean skip_errors);
+
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    const char *repo_id,
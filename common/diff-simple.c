@@ -3,6 +3,8 @@
 #include "utils.h"
 #include "log.h"
 
+#include <pthread.h>
+
 DiffEntry *
 diff_entry_new (char type, char status, unsigned char *sha1, const char *name)
 {
@@ -94,6 +96,12 @@ static int
 diff_trees_recursive (int n, SeafDir *trees[],
                       const char *basedir, DiffOptions *opt);
 
+static gboolean
+spawn_diff_task (int n, SeafDir *trees[], char *basedir, DiffOptions *opt);
+
+static gboolean
+diff_task_failed (DiffOptions *opt);
+
 static int
 diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
 {
@@ -114,6 +122,9 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     if (n_dirs == 0)
         return 0;
 
+    if (opt->task && diff_task_failed (opt))
+        return -1;
+
     gboolean recurse = TRUE;
     ret = opt->dir_cb (n, basedir, dirs, opt->data, &recurse);
     if (ret < 0)
@@ -143,6 +154,10 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
 
     char *new_basedir = g_strconcat (basedir, dirname, "/", NULL);
 
+    /* The new task owns sub_dirs and new_basedir. */
+    if (opt->task && spawn_diff_task (n, sub_dirs, new_basedir, opt))
+        return 0;
+
     ret = diff_trees_recursive (n, sub_dirs, new_basedir, opt);
 
     g_free (new_basedir);
@@ -257,6 +272,206 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
     return ret;
 }
 
+/*
+ * Parallel diff.
+ *
+ * A task diffs a sub tree. When it finds a differing sub-directory while the
+ * pool has few queued tasks, it hands the sub-directory to a new task instead
+ * of recursing into it, and carries on with a fresh data. So the output of a
+ * task is a sequence of pieces, each either a data or a sub task, in the
+ * order diff_trees() would have visited them. Merging the pieces depth first
+ * gives the same output as diff_trees(), however the tasks were scheduled.
+ */
+
+typedef struct DiffTask DiffTask;
+
+typedef struct ParallelDiff {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;                /* spawned tasks not finished yet */
+    int failed;
+    int max_threads;
+} ParallelDiff;
+
+typedef struct DiffPiece {
+    void *data;
+    DiffTask *child;
+} DiffPiece;
+
+struct DiffTask {
+    ParallelDiff *pd;
+    int n;
+    SeafDir *trees[3];
+    char *basedir;
+    DiffOptions opt;
+    GQueue pieces;
+};
+
+static GThreadPool *diff_pool;
+static pthread_mutex_t diff_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+diff_task_add_data (DiffTask *task)
+{
+    DiffPiece *piece = g_new0 (DiffPiece, 1);
+
+    piece->data = task->opt.new_data ();
+    task->opt.data = piece->data;
+    g_queue_push_tail (&task->pieces, piece);
+}
+
+static DiffTask *
+diff_task_new (ParallelDiff *pd, DiffOptions *opt, int n)
+{
+    DiffTask *task = g_new0 (DiffTask, 1);
+
+    task->pd = pd;
+    task->n = n;
+    task->opt = *opt;
+    task->opt.task = task;
+    g_queue_init (&task->pieces);
+    diff_task_add_data (task);
+
+    return task;
+}
+
+static gboolean
+diff_task_failed (DiffOptions *opt)
+{
+    return g_atomic_int_get (&opt->task->pd->failed) != 0;
+}
+
+static void
+diff_task_run (gpointer vtask, gpointer unused)
+{
+    DiffTask *task = vtask;
+    ParallelDiff *pd = task->pd;
+    int i;
+
+    if (!g_atomic_int_get (&pd->failed) &&
+        diff_trees_recursive (task->n, task->trees,
+                              task->basedir, &task->opt) < 0)
+        g_atomic_int_set (&pd->failed, 1);
+
+    for (i = 0; i < task->n; ++i)
+        seaf_dir_free (task->trees[i]);
+    g_free (task->basedir);
+
+    pthread_mutex_lock (&pd->lock);
+    if (--pd->pending == 0)
+        pthread_cond_signal (&pd->cond);
+    pthread_mutex_unlock (&pd->lock);
+}
+
+static gboolean
+spawn_diff_task (int n, SeafDir *trees[], char *basedir, DiffOptions *opt)
+{
+    DiffTask *task = opt->task, *child;
+    ParallelDiff *pd = task->pd;
+    DiffPiece *piece;
+    GError *error = NULL;
+
+    /* Only hand out work when a thread is likely to be idle. */
+    if (g_thread_pool_unprocessed (diff_pool) >= (guint)pd->max_threads)
+        return FALSE;
+
+    child = diff_task_new (pd, opt, n);
+    memcpy (child->trees, trees, sizeof(trees[0])*n);
+    child->basedir = basedir;
+
+    piece = g_new0 (DiffPiece, 1);
+    piece->child = child;
+    g_queue_push_tail (&task->pieces, piece);
+
+    /* What this task finds next comes after the sub tree. */
+    diff_task_add_data (task);
+
+    pthread_mutex_lock (&pd->lock);
+    ++pd->pending;
+    pthread_mutex_unlock (&pd->lock);
+
+    g_thread_pool_push (diff_pool, child, &error);
+    if (error) {
+        seaf_warning ("Failed to start diff thread: %s.\n", error->message);
+        g_clear_error (&error);
+    }
+
+    return TRUE;
+}
+
+static void
+merge_diff_task (DiffTask *task, DiffOptions *opt)
+{
+    DiffPiece *piece;
+
+    while ((piece = g_queue_pop_head (&task->pieces)) != NULL) {
+        if (piece->child)
+            merge_diff_task (piece->child, opt);
+        else
+            opt->merge_data (opt->data, piece->data);
+        g_free (piece);
+    }
+    g_free (task);
+}
+
+static GThreadPool *
+get_diff_pool (int max_threads)
+{
+    GError *error = NULL;
+
+    pthread_mutex_lock (&diff_pool_lock);
+    if (!diff_pool) {
+        diff_pool = g_thread_pool_new (diff_task_run, NULL, max_threads,
+                                       FALSE, &error);
+        if (!diff_pool) {
+            seaf_warning ("Failed to create diff thread pool: %s.\n",
+                          error->message);
+            g_clear_error (&error);
+        }
+    }
+    pthread_mutex_unlock (&diff_pool_lock);
+
+    return diff_pool;
+}
+
+int
+diff_trees_parallel (int n, const char *roots[], DiffOptions *opt,
+                     int max_threads)
+{
+    ParallelDiff pd;
+    DiffTask *root;
+    int ret;
+
+    if (max_threads <= 1 || !get_diff_pool (max_threads))
+        return diff_trees (n, roots, opt);
+
+    memset (&pd, 0, sizeof(pd));
+    pthread_mutex_init (&pd.lock, NULL);
+    pthread_cond_init (&pd.cond, NULL);
+    pd.max_threads = max_threads;
+
+    /* The calling thread diffs the root task. */
+    root = diff_task_new (&pd, opt, n);
+    ret = diff_trees (n, roots, &root->opt);
+    if (ret < 0)
+        g_atomic_int_set (&pd.failed, 1);
+
+    pthread_mutex_lock (&pd.lock);
+    while (pd.pending > 0)
+        pthread_cond_wait (&pd.cond, &pd.lock);
+    pthread_mutex_unlock (&pd.lock);
+
+    if (pd.failed)
+        ret = -1;
+
+    merge_diff_task (root, opt);
+
+    pthread_mutex_destroy (&pd.lock);
+    pthread_cond_destroy (&pd.cond);
+
+    return ret;
+}
+
 typedef struct DiffData {
     GList **results;
     gboolean fold_dir_diff;
@@ -332,9 +547,9 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
     return 0;
 }
 
-int
-diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
-              gboolean fold_dir_diff)
+static int
+do_diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
+                 gboolean fold_dir_diff, gboolean resolve_renames)
 {
     SeafRepo *repo = NULL;
     DiffOptions opt;
@@ -370,11 +585,26 @@ diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
     roots[1] = commit2->root_id;
 
     diff_trees (2, roots, &opt);
-    diff_resolve_renames (results);
+    if (resolve_renames)
+        diff_resolve_renames (results);
 
     return 0;
 }
 
+int
+diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
+              gboolean fold_dir_diff)
+{
+    return do_diff_commits (commit1, commit2, results, fold_dir_diff, TRUE);
+}
+
+int
+diff_commits_no_renames (SeafCommit *commit1, SeafCommit *commit2,
+                         GList **results, gboolean fold_dir_diff)
+{
+    return do_diff_commits (commit1, commit2, results, fold_dir_diff, FALSE);
+}
+
 int
 diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
@@ -398,7 +628,8 @@ diff_commit_roots (const char *store_id, int version,
     roots[0] = root1;
     roots[1] = root2;
 
-    diff_trees (2, roots, &opt);
+    if (diff_trees (2, roots, &opt) < 0)
+        return -1;
     diff_resolve_renames (results);
 
     return 0;
@@ -566,18 +797,29 @@ diff_merge_roots (const char *store_id, int version,
 /* This function only resolve "strict" rename, i.e. two files must be
  * exactly the same.
  * Don't detect rename of empty files and empty dirs.
+ *
+ * The entries are moved to an array, deleted entries are hashed by content
+ * in the same pass, and each added entry is looked up once. Renames go in
+ * front of the list, in the order of the added entries, the other entries
+ * keep their order.
  */
 void
 diff_resolve_renames (GList **diff_entries)
 {
     GHashTable *deleted_files = NULL, *deleted_dirs = NULL;
-    GList *p;
-    GList *added = NULL;
-    DiffEntry *de;
+    GPtrArray *entries;
+    GList *p, *renamed = NULL, *rest = NULL;
+    DiffEntry *de, *de_del, *de_rename;
     unsigned char empty_sha1[20];
     unsigned int deleted_empty_count = 0, deleted_empty_dir_count = 0;
     unsigned int added_empty_count = 0, added_empty_dir_count = 0;
+    int empty_file_idx = -1, empty_dir_idx = -1;
     gboolean check_empty_dir, check_empty_file;
+    gpointer value;
+    int i, del_idx, rename_status;
+
+    if (!*diff_entries)
+        return;
 
     memset (empty_sha1, 0, 20);
 
@@ -585,133 +827,133 @@ diff_resolve_renames (GList **diff_entries)
     deleted_dirs = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
     deleted_files = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
 
-    /* Count deleted and added entries of which content is empty. */
-    for (p = *diff_entries; p != NULL; p = p->next) {
+    /* Collect the entries and hash the "deleted" ones. Entries of which
+     * content is empty are only counted, as they can only be renamed if
+     * there is one deleted and one added.
+     */
+    entries = g_ptr_array_new ();
+    for (p = *diff_entries, i = 0; p != NULL; p = p->next, ++i) {
         de = p->data;
+        g_ptr_array_add (entries, de);
+
         if (memcmp (de->sha1, empty_sha1, 20) == 0) {
-            if (de->status == DIFF_STATUS_DELETED)
+            if (de->status == DIFF_STATUS_DELETED) {
                 deleted_empty_count++;
-            if (de->status == DIFF_STATUS_DIR_DELETED)
+                empty_file_idx = i;
+            }
+            if (de->status == DIFF_STATUS_DIR_DELETED) {
                 deleted_empty_dir_count++;
+                empty_dir_idx = i;
+            }
             if (de->status == DIFF_STATUS_ADDED)
                 added_empty_count++;
             if (de->status == DIFF_STATUS_DIR_ADDED)
                 added_empty_dir_count++;
+            continue;
         }
+
+        /* Values are index + 1, so that 0 means not found. */
+        if (de->status == DIFF_STATUS_DELETED)
+            g_hash_table_insert (deleted_files, de->sha1, GINT_TO_POINTER(i + 1));
+        else if (de->status == DIFF_STATUS_DIR_DELETED)
+            g_hash_table_insert (deleted_dirs, de->sha1, GINT_TO_POINTER(i + 1));
     }
+    g_list_free (*diff_entries);
 
     check_empty_dir = (deleted_empty_dir_count == 1 && added_empty_dir_count == 1);
     check_empty_file = (deleted_empty_count == 1 && added_empty_count == 1);
+    if (check_empty_file)
+        g_hash_table_insert (deleted_files, empty_sha1,
+                             GINT_TO_POINTER(empty_file_idx + 1));
+    if (check_empty_dir)
+        g_hash_table_insert (deleted_dirs, empty_sha1,
+                             GINT_TO_POINTER(empty_dir_idx + 1));
 
-    /* Collect all "deleted" entries. */
-    for (p = *diff_entries; p != NULL; p = p->next) {
-        de = p->data;
-        if (de->status == DIFF_STATUS_DELETED) {
-            if (memcmp (de->sha1, empty_sha1, 20) == 0 &&
-                check_empty_file == FALSE)
-                continue;
-
-            g_hash_table_insert (deleted_files, de->sha1, p);
-        }
-
-        if (de->status == DIFF_STATUS_DIR_DELETED) {
-            if (memcmp (de->sha1, empty_sha1, 20) == 0 &&
-                check_empty_dir == FALSE)
-                continue;
-
-            g_hash_table_insert (deleted_dirs, de->sha1, p);
-        }
-    }
-
-    /* Collect all "added" entries into a separate list. */
-    for (p = *diff_entries; p != NULL; p = p->next) {
-        de = p->data;
+    /* For each "added" entry, if we find a "deleted" entry with
+     * the same content, we find a rename pair. Going backwards, a deleted
+     * entry pairs with the last of several added copies.
+     */
+    for (i = entries->len - 1; i >= 0; --i) {
+        de = g_ptr_array_index (entries, i);
+        /* Deleted entries already paired are cleared. */
+        if (!de)
+            continue;
         if (de->status == DIFF_STATUS_ADDED) {
-            if (memcmp (de->sha1, empty_sha1, 20) == 0 &&
-                check_empty_file == 0)
-                continue;
-
-            added = g_list_prepend (added, p);
-        }
-
-        if (de->status == DIFF_STATUS_DIR_ADDED) {
-            if (memcmp (de->sha1, empty_sha1, 20) == 0 &&
-                check_empty_dir == 0)
-                continue;
-
-            added = g_list_prepend (added, p);
+            value = g_hash_table_lookup (deleted_files, de->sha1);
+            rename_status = DIFF_STATUS_RENAMED;
+        } else if (de->status == DIFF_STATUS_DIR_ADDED) {
+            value = g_hash_table_lookup (deleted_dirs, de->sha1);
+            rename_status = DIFF_STATUS_DIR_RENAMED;
+        } else {
+            continue;
         }
-    }
+        if (!value)
+            continue;
 
-    /* For each "added" entry, if we find a "deleted" entry with
-     * the same content, we find a rename pair.
-     */
-    p = added;
-    while (p != NULL) {
-        GList *p_add, *p_del;
-        DiffEntry *de_add, *de_del, *de_rename;
-        int rename_status;
+        del_idx = GPOINTER_TO_INT(value) - 1;
+        de_del = g_ptr_array_index (entries, del_idx);
 
-        p_add = p->data;
-        de_add = p_add->data;
+        de_rename = diff_entry_new (de_del->type, rename_status,
+                                    de_del->sha1, de_del->name);
+        de_rename->new_name = g_strdup(de->name);
+        renamed = g_list_prepend (renamed, de_rename);
 
-        if (de_add->status == DIFF_STATUS_ADDED)
-            p_del = g_hash_table_lookup (deleted_files, de_add->sha1);
+        if (de_del->status == DIFF_STATUS_DIR_DELETED)
+            g_hash_table_remove (deleted_dirs, de->sha1);
         else
-            p_del = g_hash_table_lookup (deleted_dirs, de_add->sha1);
-
-        if (p_del) {
-            de_del = p_del->data;
-
-            if (de_add->status == DIFF_STATUS_DIR_ADDED)
-                rename_status = DIFF_STATUS_DIR_RENAMED;
-            else
-                rename_status = DIFF_STATUS_RENAMED;
-
-            de_rename = diff_entry_new (de_del->type, rename_status, 
-                                        de_del->sha1, de_del->name);
-            de_rename->new_name = g_strdup(de_add->name);
-
-            *diff_entries = g_list_delete_link (*diff_entries, p_add);
-            *diff_entries = g_list_delete_link (*diff_entries, p_del);
-            *diff_entries = g_list_prepend (*diff_entries, de_rename);
+            g_hash_table_remove (deleted_files, de->sha1);
 
-            if (de_del->status == DIFF_STATUS_DIR_DELETED)
-                g_hash_table_remove (deleted_dirs, de_add->sha1);
-            else
-                g_hash_table_remove (deleted_files, de_add->sha1);
-
-            diff_entry_free (de_add);
-            diff_entry_free (de_del);
-        }
+        diff_entry_free (de);
+        diff_entry_free (de_del);
+        entries->pdata[i] = NULL;
+        entries->pdata[del_idx] = NULL;
+    }
 
-        p = g_list_delete_link (p, p);
+    for (i = entries->len - 1; i >= 0; --i) {
+        de = g_ptr_array_index (entries, i);
+        if (de)
+            rest = g_list_prepend (rest, de);
     }
+    *diff_entries = g_list_concat (renamed, rest);
 
+    g_ptr_array_free (entries, TRUE);
     g_hash_table_destroy (deleted_dirs);
     g_hash_table_destroy (deleted_files);
 }
 
+static gint
+compare_entry_names (gconstpointer a, gconstpointer b)
+{
+    const DiffEntry *dea = *(DiffEntry **)a, *deb = *(DiffEntry **)b;
+
+    return strcmp (dea->name, deb->name);
+}
+
+/* Whether an entry of the sorted @files has @dir_name as a proper prefix. */
 static gboolean
-is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
+has_entry_under (GPtrArray *files, const char *dir_name)
 {
-    int dir_len;
+    int lo = 0, hi = files->len, mid;
+    size_t dir_len = strlen (dir_name);
+    DiffEntry *de;
 
-    if (de_dir->status == DIFF_STATUS_DIR_ADDED &&
-        de_file->status == DIFF_STATUS_DELETED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
-            return TRUE;
+    /* Find the first name not less than dir_name. Names with dir_name as
+     * prefix sort right after it.
+     */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        de = g_ptr_array_index (files, mid);
+        if (strcmp (de->name, dir_name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    if (de_dir->status == DIFF_STATUS_DIR_DELETED &&
-        de_file->status == DIFF_STATUS_ADDED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
+    for (; lo < files->len; ++lo) {
+        de = g_ptr_array_index (files, lo);
+        if (strncmp (de->name, dir_name, dir_len) != 0)
+            return FALSE;
+        if (strlen (de->name) > dir_len)
             return TRUE;
     }
 
@@ -723,33 +965,49 @@ is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
  * Similarly, an empty dir entry may be deleted by adding some file in it.
  * In both cases, we don't want to include the empty dir entry in the
  * diff results.
+ *
+ * The added and deleted files are sorted by name, so each dir entry is
+ * checked with a binary search.
  */
 void
 diff_resolve_empty_dirs (GList **diff_entries)
 {
-    GList *empty_dirs = NULL;
-    GList *p, *dir, *file;
-    DiffEntry *de, *de_dir, *de_file;
+    GPtrArray *added_files, *deleted_files;
+    GList *p, *next;
+    DiffEntry *de;
+    gboolean redundant;
+
+    added_files = g_ptr_array_new ();
+    deleted_files = g_ptr_array_new ();
 
     for (p = *diff_entries; p != NULL; p = p->next) {
         de = p->data;
-        if (de->status == DIFF_STATUS_DIR_ADDED ||
-            de->status == DIFF_STATUS_DIR_DELETED)
-            empty_dirs = g_list_prepend (empty_dirs, p);
+        if (de->status == DIFF_STATUS_ADDED)
+            g_ptr_array_add (added_files, de);
+        else if (de->status == DIFF_STATUS_DELETED)
+            g_ptr_array_add (deleted_files, de);
     }
+    g_ptr_array_sort (added_files, compare_entry_names);
+    g_ptr_array_sort (deleted_files, compare_entry_names);
 
-    for (dir = empty_dirs; dir != NULL; dir = dir->next) {
-        de_dir = ((GList *)dir->data)->data;
-        for (file = *diff_entries; file != NULL; file = file->next) {
-            de_file = file->data;
-            if (is_redundant_empty_dir (de_dir, de_file)) {
-                *diff_entries = g_list_delete_link (*diff_entries, dir->data);
-                break;
-            }
+    for (p = *diff_entries; p != NULL; p = next) {
+        next = p->next;
+        de = p->data;
+        if (de->status == DIFF_STATUS_DIR_ADDED)
+            redundant = has_entry_under (deleted_files, de->name);
+        else if (de->status == DIFF_STATUS_DIR_DELETED)
+            redundant = has_entry_under (added_files, de->name);
+        else
+            redundant = FALSE;
+
+        if (redundant) {
+            *diff_entries = g_list_delete_link (*diff_entries, p);
+            diff_entry_free (de);
         }
     }
 
-    g_list_free (empty_dirs);
+    g_ptr_array_free (added_files, TRUE);
+    g_ptr_array_free (deleted_files, TRUE);
 }
 
 int diff_unmerged_state(int mask)
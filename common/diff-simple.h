@@ -60,6 +60,13 @@ int
 diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
               gboolean fold_dir_diff);
 
+/* Like diff_commits(), but renamed files are reported as deleted and
+ * added. For callers that only sum up the added and deleted files.
+ */
+int
+diff_commits_no_renames (SeafCommit *commit1, SeafCommit *commit2,
+                         GList **results, gboolean fold_dir_diff);
+
 int
 diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
@@ -106,9 +113,29 @@ typedef struct DiffOptions {
     DiffFileCB file_cb;
     DiffDirCB dir_cb;
     void *data;
+
+    /* Only used by diff_trees_parallel(). */
+    void *(*new_data) (void);
+    void (*merge_data) (void *data, void *part);
+    struct DiffTask *task;
 } DiffOptions;
 
 int
 diff_trees (int n, const char *roots[], DiffOptions *opt);
 
+/*
+ * Like diff_trees(), but differing sub-directories are also diffed by a pool
+ * of @max_threads threads, shared by all parallel diffs and created by the
+ * first call. The callbacks must only touch their @data argument.
+ *
+ * Each part of the diff is collected into its own data returned by
+ * @opt->new_data. When all threads are done, the parts are handed to
+ * @opt->merge_data in the order diff_trees() would have produced them, so
+ * the merged @opt->data is the same as with diff_trees(). The parts are
+ * merged even if the diff fails.
+ */
+int
+diff_trees_parallel (int n, const char *roots[], DiffOptions *opt,
+                     int max_threads);
+
 #endif
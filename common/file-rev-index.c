@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <fcntl.h>
+
+#include "seafile-session.h"
+#include "utils.h"
+#include "file-rev-index.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * The index of a repo is kept in <seafile_dir>/file-rev-index/<repo_id>, an
+ * append-only file of variable-length records. A record holds a commit id
+ * and the sorted 64-bit hashes of the paths the commit changed. A path
+ * counts as changed if its hash or the hash of one of its parent dirs is in
+ * the record, so hash collisions only cost a tree walk. Commits changing
+ * more than MAX_INDEXED_PATHS paths are recorded as changing everything.
+ * As with the commit graph, a record cut short by a crash ends the usable
+ * part of the file, and commits without a record are resolved in their
+ * trees and added later.
+ */
+
+#define FILE_REV_INDEX_DIR "file-rev-index"
+#define FILE_REV_INDEX_MAGIC "SFRI"
+
+#define MAX_INDEXED_PATHS 10000
+
+#define REC_ALL_CHANGED 0x1
+
+typedef struct RecordHeader {
+    char magic[4];
+    guint32 n_hashes;
+    guint32 flags;
+    unsigned char commit_id[20];
+} RecordHeader;
+
+typedef struct IndexEntry {
+    unsigned char commit_id[20];
+    guint32 flags;
+    guint32 n_hashes;
+    guint64 *hashes;
+} IndexEntry;
+
+struct FileRevIndex {
+    GHashTable *entries;        /* raw commit id -> IndexEntry */
+};
+
+static guint
+raw_id_hash (gconstpointer key)
+{
+    guint h;
+
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+raw_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static void
+index_entry_free (gpointer p)
+{
+    IndexEntry *entry = p;
+
+    g_free (entry->hashes);
+    g_free (entry);
+}
+
+static char *
+file_rev_index_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, FILE_REV_INDEX_DIR, repo_id, NULL);
+}
+
+/* FNV-1a */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static guint64
+hash_path (const char *path)
+{
+    guint64 h = FNV_OFFSET;
+    const char *end;
+
+    while (*path == '/')
+        ++path;
+    end = path + strlen (path);
+    while (end > path && end[-1] == '/')
+        --end;
+
+    for (; path < end; ++path) {
+        h ^= (unsigned char)*path;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static int
+cmp_hash (const void *a, const void *b)
+{
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static gboolean
+entry_has_hash (IndexEntry *entry, guint64 h)
+{
+    return bsearch (&h, entry->hashes, entry->n_hashes,
+                    sizeof(guint64), cmp_hash) != NULL;
+}
+
+FileRevIndex *
+file_rev_index_load (const char *repo_id)
+{
+    FileRevIndex *index = g_new0 (FileRevIndex, 1);
+    char *path = file_rev_index_path (repo_id);
+    char *contents = NULL;
+    gsize len = 0, off = 0, size;
+    RecordHeader hdr;
+    IndexEntry *entry;
+
+    index->entries = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                            NULL, index_entry_free);
+
+    if (!g_file_get_contents (path, &contents, &len, NULL))
+        goto out;
+
+    while (off + sizeof(hdr) <= len) {
+        memcpy (&hdr, contents + off, sizeof(hdr));
+        if (memcmp (hdr.magic, FILE_REV_INDEX_MAGIC, 4) != 0) {
+            seaf_warning ("File revision index %s is damaged at offset %"G_GSIZE_FORMAT", "
+                          "ignore the rest of it.\n", path, off);
+            break;
+        }
+        size = sizeof(hdr) + (gsize)hdr.n_hashes * sizeof(guint64);
+        if (off + size > len)
+            break;
+
+        entry = g_new0 (IndexEntry, 1);
+        memcpy (entry->commit_id, hdr.commit_id, 20);
+        entry->flags = hdr.flags;
+        entry->n_hashes = hdr.n_hashes;
+        entry->hashes = g_new (guint64, hdr.n_hashes);
+        memcpy (entry->hashes, contents + off + sizeof(hdr),
+                hdr.n_hashes * sizeof(guint64));
+        g_hash_table_replace (index->entries, entry->commit_id, entry);
+
+        off += size;
+    }
+
+out:
+    g_free (contents);
+    g_free (path);
+    return index;
+}
+
+void
+file_rev_index_free (FileRevIndex *index)
+{
+    if (!index)
+        return;
+
+    g_hash_table_destroy (index->entries);
+    g_free (index);
+}
+
+int
+file_rev_index_touches (FileRevIndex *index,
+                        const char *commit_id,
+                        const char *path)
+{
+    unsigned char raw[20];
+    IndexEntry *entry;
+    guint64 h = FNV_OFFSET;
+
+    if (hex_to_rawdata (commit_id, raw, 20) < 0)
+        return -1;
+    entry = g_hash_table_lookup (index->entries, raw);
+    if (!entry)
+        return -1;
+    if (entry->flags & REC_ALL_CHANGED)
+        return 1;
+
+    /* Check the path and all its parent dirs, hashing the path only once. */
+    while (*path == '/')
+        ++path;
+    for (; *path; ++path) {
+        if (*path == '/') {
+            if (path[1] == '\0')
+                break;
+            if (entry_has_hash (entry, h))
+                return 1;
+        }
+        h ^= (unsigned char)*path;
+        h *= FNV_PRIME;
+    }
+
+    return entry_has_hash (entry, h) ? 1 : 0;
+}
+
+static void
+append_record (const char *repo_id, IndexEntry *entry)
+{
+    char *path = file_rev_index_path (repo_id);
+    char *dir;
+    RecordHeader hdr;
+    GString *buf;
+    int fd;
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, FILE_REV_INDEX_MAGIC, 4);
+    hdr.n_hashes = entry->n_hashes;
+    hdr.flags = entry->flags;
+    memcpy (hdr.commit_id, entry->commit_id, 20);
+
+    buf = g_string_sized_new (sizeof(hdr) + entry->n_hashes * sizeof(guint64));
+    g_string_append_len (buf, (const char *)&hdr, sizeof(hdr));
+    g_string_append_len (buf, (const char *)entry->hashes,
+                         entry->n_hashes * sizeof(guint64));
+
+    fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        dir = g_path_get_dirname (path);
+        checkdir_with_mkdir (dir);
+        g_free (dir);
+        fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+    }
+    if (fd < 0) {
+        seaf_warning ("Failed to open file revision index %s: %s.\n",
+                      path, strerror(errno));
+        goto out;
+    }
+
+    /* One write per record, so concurrent appends don't interleave. */
+    if (write (fd, buf->str, buf->len) != (ssize_t)buf->len)
+        seaf_warning ("Failed to append to file revision index %s: %s.\n",
+                      path, strerror(errno));
+    close (fd);
+
+out:
+    g_string_free (buf, TRUE);
+    g_free (path);
+}
+
+void
+file_rev_index_add (FileRevIndex *index,
+                    const char *repo_id,
+                    const char *commit_id,
+                    GList *paths)
+{
+    IndexEntry *entry;
+    guint n_paths = g_list_length (paths);
+    GList *ptr;
+    guint32 i, n;
+
+    entry = g_new0 (IndexEntry, 1);
+    if (hex_to_rawdata (commit_id, entry->commit_id, 20) < 0) {
+        g_free (entry);
+        return;
+    }
+    if (index && g_hash_table_lookup (index->entries, entry->commit_id)) {
+        g_free (entry);
+        return;
+    }
+
+    if (n_paths > MAX_INDEXED_PATHS) {
+        entry->flags = REC_ALL_CHANGED;
+    } else {
+        entry->hashes = g_new (guint64, n_paths);
+        for (ptr = paths; ptr; ptr = ptr->next)
+            entry->hashes[entry->n_hashes++] = hash_path (ptr->data);
+        qsort (entry->hashes, entry->n_hashes, sizeof(guint64), cmp_hash);
+
+        /* Drop duplicates, a renamed dir may be listed with its files. */
+        for (i = 0, n = 0; i < entry->n_hashes; i++) {
+            if (n == 0 || entry->hashes[n - 1] != entry->hashes[i])
+                entry->hashes[n++] = entry->hashes[i];
+        }
+        entry->n_hashes = n;
+    }
+
+    append_record (repo_id, entry);
+
+    if (index)
+        g_hash_table_replace (index->entries, entry->commit_id, entry);
+    else
+        index_entry_free (entry);
+}
+
+void
+file_rev_index_remove (const char *repo_id)
+{
+    char *path = file_rev_index_path (repo_id);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) && seaf_util_unlink (path) < 0)
+        seaf_warning ("Failed to remove file revision index %s.\n", path);
+    g_free (path);
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef FILE_REV_INDEX_H
+#define FILE_REV_INDEX_H
+
+#include <glib.h>
+
+/*
+ * For each indexed commit of a repo, the set of paths it changed relative
+ * to its first parent. File history uses it to skip the commits that didn't
+ * touch a file, without resolving the file in their trees.
+ */
+
+typedef struct FileRevIndex FileRevIndex;
+
+FileRevIndex *
+file_rev_index_load (const char *repo_id);
+
+void
+file_rev_index_free (FileRevIndex *index);
+
+/*
+ * Returns 0 if @commit_id didn't change @path, 1 if it did (or may have),
+ * and -1 if the commit is not in the index.
+ */
+int
+file_rev_index_touches (FileRevIndex *index,
+                        const char *commit_id,
+                        const char *path);
+
+/*
+ * Record the changed @paths of @commit_id, a list of paths of files and
+ * dirs relative to the repo root. Dirs added, deleted or renamed as a whole
+ * may be given instead of the files under them.
+ * With @index NULL, the record is only appended to the index file of @repo_id.
+ */
+void
+file_rev_index_add (FileRevIndex *index,
+                    const char *repo_id,
+                    const char *commit_id,
+                    GList *paths);
+
+void
+file_rev_index_remove (const char *repo_id);
+
+#endif
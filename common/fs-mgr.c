@@ -22,7 +22,11 @@ char *strcasestr (const char *haystack, const char *needle);
 #include "seafile-error.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
+#include "block-uring.h"
 #include "utils.h"
+#include "id-set.h"
+#include "json-scanner.h"
+#include "access-stats.h"
 #include "seaf-utils.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
@@ -37,9 +41,44 @@ char *strcasestr (const char *haystack, const char *needle);
 
 #define SEAF_TMP_EXT "~"
 
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+#include <pthread.h>
+#include "diff-simple.h"
+
+typedef struct IndexExecutor IndexExecutor;
+#endif
+
+#define DEFAULT_OBJ_CACHE_SIZE_MB 64
+#define DEFAULT_OBJ_CACHE_SHARDS 16
+
+#define BLOCK_OFFSET_CACHE_SIZE (16 << 20)
+#define COUNT_INFO_CACHE_SIZE (8 << 20)
+#define DIR_LISTING_CACHE_SIZE (32 << 20)
+/* Smaller dirs are sorted on every listing, it's cheap enough. */
+#define DIR_LISTING_CACHE_MIN_ENTRIES 256
+
 struct _SeafFSManagerPriv {
     /* GHashTable      *seafile_cache; */
     GHashTable      *bl_cache;
+    /* "store_id/obj_id" -> decoded SeafDir or Seafile.
+     * NULL if the cache is disabled.
+     */
+    LRUCache        *obj_cache;
+    /* "store_id/file_id" -> BlockOffsets of the file. */
+    LRUCache        *block_offset_cache;
+    /* "store_id/dir_id" -> DirCountInfo of the dir. */
+    LRUCache        *count_info_cache;
+    /* "store_id/dir_id" -> DirListing of a large dir. */
+    LRUCache        *dir_listing_cache;
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+    /* Created on first use, once the http server config is loaded. */
+    IndexExecutor   *indexer;
+    pthread_mutex_t  indexer_lock;
+    /* repo_id -> SearchIndex */
+    GHashTable      *search_indexes;
+    int              max_search_indexes;
+    pthread_mutex_t  search_index_lock;
+#endif
 };
 
 typedef struct SeafileOndisk {
@@ -70,6 +109,48 @@ write_seafile (SeafFSManager *fs_mgr,
                unsigned char *obj_sha1);
 #endif  /* SEAFILE_SERVER */
 
+static void
+fs_object_cache_value_free (gpointer value);
+
+static void
+dir_listing_free (gpointer value);
+
+static LRUCache *
+create_obj_cache (SeafileSession *seaf)
+{
+    GError *error = NULL;
+    int size_mb;
+    int n_shards;
+
+    size_mb = g_key_file_get_integer (seaf->config,
+                                      "fs_object_cache", "max_size",
+                                      &error);
+    if (error) {
+        size_mb = DEFAULT_OBJ_CACHE_SIZE_MB;
+        g_clear_error (&error);
+    }
+    if (size_mb <= 0) {
+        seaf_message ("fs object cache is disabled.\n");
+        return NULL;
+    }
+
+    n_shards = g_key_file_get_integer (seaf->config,
+                                       "fs_object_cache", "shards",
+                                       &error);
+    if (error || n_shards <= 0) {
+        n_shards = DEFAULT_OBJ_CACHE_SHARDS;
+        g_clear_error (&error);
+    }
+
+    return lru_cache_new ((gint64)size_mb << 20, n_shards,
+                          fs_object_cache_value_free);
+}
+
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+static void
+init_search_indexes (SeafileSession *seaf, SeafFSManagerPriv *priv);
+#endif
+
 SeafFSManager *
 seaf_fs_manager_new (SeafileSession *seaf,
                      const char *seaf_dir)
@@ -84,7 +165,24 @@ seaf_fs_manager_new (SeafileSession *seaf,
         return NULL;
     }
 
+    /* Without it block maps are built on every request. */
+    mgr->block_map_store = seaf_obj_store_new (seaf, "blockmaps");
+
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
+    mgr->priv->obj_cache = create_obj_cache (seaf);
+    mgr->priv->block_offset_cache = lru_cache_new (BLOCK_OFFSET_CACHE_SIZE,
+                                                   DEFAULT_OBJ_CACHE_SHARDS,
+                                                   g_free);
+    mgr->priv->count_info_cache = lru_cache_new (COUNT_INFO_CACHE_SIZE,
+                                                 DEFAULT_OBJ_CACHE_SHARDS,
+                                                 g_free);
+    mgr->priv->dir_listing_cache = lru_cache_new (DIR_LISTING_CACHE_SIZE,
+                                                  DEFAULT_OBJ_CACHE_SHARDS,
+                                                  dir_listing_free);
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+    pthread_mutex_init (&mgr->priv->indexer_lock, NULL);
+    init_search_indexes (seaf, mgr->priv);
+#endif
 
     return mgr;
 }
@@ -502,22 +600,31 @@ calculate_chunk_size (uint64_t total_size)
     return 1 * MiB;
 }
 
+/* Returns 1 if the block already exists and nothing is written. */
 static int
 do_write_chunk (const char *repo_id, int version,
                 uint8_t *checksum, const char *buf, int len)
 {
     SeafBlockManager *blk_mgr = seaf->block_mgr;
     char chksum_str[41];
+    const char *block_id = chksum_str;
+    gboolean exists = FALSE;
     BlockHandle *handle;
     int n;
 
     rawdata_to_hex (checksum, chksum_str, 20);
 
-    /* Don't write if the block already exists. */
-    if (seaf_block_manager_block_exists (seaf->block_mgr,
-                                         repo_id, version,
-                                         chksum_str))
-        return 0;
+    /* Don't write if the block already exists. The batched check consults
+     * the existence filter, if enabled, so most new blocks are written
+     * without probing the storage. A block the filter doesn't know about is
+     * rewritten with the same content, which is harmless. A reused block is
+     * touched, so that an online GC doesn't take it for an old dead one.
+     */
+    seaf_block_manager_blocks_exist (blk_mgr, repo_id, version,
+                                     &block_id, 1, &exists);
+    if (exists &&
+        seaf_block_manager_touch_block (blk_mgr, repo_id, version, block_id) == 0)
+        return 1;
 
     handle = seaf_block_manager_open_block (blk_mgr,
                                             repo_id, version,
@@ -563,8 +670,12 @@ seafile_write_chunk (const char *repo_id,
     SHA_CTX ctx;
     int ret = 0;
 
+    chunk->existed = FALSE;
+
     /* Encrypt before write to disk if needed, and we don't encrypt
-     * empty files. */
+     * empty files. The id of an encrypted block is the hash of the
+     * encrypted data, so it can't be looked up before encrypting.
+     */
     if (crypt != NULL && chunk->len) {
         char *encrypted_buf = NULL;         /* encrypted output */
         int enc_len = -1;                /* encrypted length */
@@ -596,6 +707,11 @@ seafile_write_chunk (const char *repo_id,
             ret = do_write_chunk (repo_id, version, checksum, chunk->block_buf, chunk->len);
     }
 
+    if (ret > 0) {
+        chunk->existed = TRUE;
+        ret = 0;
+    }
+
     return ret;
 }
 
@@ -609,64 +725,179 @@ create_cdc_for_empty_file (CDCFileDescriptor *cdc)
 
 #define FIXED_BLOCK_SIZE (1<<20)
 
-typedef struct ChunkingData {
+#define INDEX_BUFFER_ALIGNMENT 4096
+/* While a worker hashes one buffer, the reader can fill the next one. */
+#define INDEX_BUFFERS_PER_THREAD 2
+
+/* Shared by all fixed-block indexing jobs. The thread indexing a file reads
+ * it sequentially into pooled buffers, and the workers hash, encrypt and
+ * write the chunks. The number of buffers is bounded, so a reader waits when
+ * the workers fall behind.
+ */
+struct IndexExecutor {
+    GThreadPool     *workers;
+    gint64           buf_size;
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   buf_available;
+    char           **free_bufs;
+    int              n_free;
+    int              n_bufs;
+    int              max_bufs;
+};
+
+typedef struct ChunkingJob {
     const char *repo_id;
     int version;
-    const char *file_path;
     SeafileCrypt *crypt;
+    gint64 block_size;
     guint8 *blk_sha1s;
     GAsyncQueue *finished_tasks;
-} ChunkingData;
+    gint failed;
+} ChunkingJob;
+
+typedef struct ChunkingTask {
+    CDCDescriptor chunk;
+    ChunkingJob *job;
+} ChunkingTask;
+
+static char *
+index_executor_get_buffer (IndexExecutor *ex)
+{
+    BlockURing *ring;
+    char *buf = NULL;
+    gboolean alloc = FALSE;
+
+    pthread_mutex_lock (&ex->lock);
+    while (ex->n_free == 0 && ex->n_bufs >= ex->max_bufs)
+        pthread_cond_wait (&ex->buf_available, &ex->lock);
+    if (ex->n_free > 0) {
+        buf = ex->free_bufs[--ex->n_free];
+    } else {
+        ++ex->n_bufs;
+        alloc = TRUE;
+    }
+    pthread_mutex_unlock (&ex->lock);
+
+    if (alloc && posix_memalign ((void **)&buf, INDEX_BUFFER_ALIGNMENT,
+                                 ex->buf_size) != 0) {
+        seaf_warning ("Failed to allocate chunk buffer.\n");
+        pthread_mutex_lock (&ex->lock);
+        --ex->n_bufs;
+        pthread_cond_signal (&ex->buf_available);
+        pthread_mutex_unlock (&ex->lock);
+        return NULL;
+    }
+
+    /* Buffers are never freed, so they can stay registered with the ring
+     * that reads file data into them.
+     */
+    if (alloc && (ring = block_uring_get ()) != NULL)
+        block_uring_register_buffer (ring, buf, ex->buf_size);
+
+    return buf;
+}
+
+static void
+index_executor_put_buffer (IndexExecutor *ex, char *buf)
+{
+    pthread_mutex_lock (&ex->lock);
+    ex->free_bufs[ex->n_free++] = buf;
+    pthread_cond_signal (&ex->buf_available);
+    pthread_mutex_unlock (&ex->lock);
+}
 
 static void
 chunking_worker (gpointer vdata, gpointer user_data)
 {
-    ChunkingData *data = user_data;
-    CDCDescriptor *chunk = vdata;
-    int fd = -1;
-    ssize_t n;
+    IndexExecutor *ex = user_data;
+    ChunkingTask *task = vdata;
+    ChunkingJob *job = task->job;
+    CDCDescriptor *chunk = &task->chunk;
     int idx;
 
-    chunk->block_buf = g_new0 (char, chunk->len);
-    if (!chunk->block_buf) {
-        seaf_warning ("Failed to allow chunk buffer\n");
+    /* Don't bother with the rest of a file once a chunk has failed. */
+    if (g_atomic_int_get (&job->failed)) {
+        chunk->result = -1;
         goto out;
     }
 
-    fd = seaf_util_open (data->file_path, O_RDONLY | O_BINARY);
-    if (fd < 0) {
-        seaf_warning ("Failed to open %s: %s\n", data->file_path, strerror(errno));
-        chunk->result = -1;
+    chunk->result = seafile_write_chunk (job->repo_id, job->version,
+                                         chunk, job->crypt,
+                                         chunk->checksum, 1);
+    if (chunk->result < 0) {
+        g_atomic_int_set (&job->failed, 1);
         goto out;
     }
 
-    if (seaf_util_lseek (fd, chunk->offset, SEEK_SET) == (gint64)-1) {
-        seaf_warning ("Failed to lseek %s: %s\n", data->file_path, strerror(errno));
-        chunk->result = -1;
-        goto out;
+    /* Streamed files collect the checksums from the tasks when finishing. */
+    if (job->blk_sha1s) {
+        idx = chunk->offset / job->block_size;
+        memcpy (job->blk_sha1s + idx * CHECKSUM_LENGTH, chunk->checksum, CHECKSUM_LENGTH);
     }
 
-    n = readn (fd, chunk->block_buf, chunk->len);
-    if (n < 0) {
-        seaf_warning ("Failed to read chunk from %s: %s\n",
-                      data->file_path, strerror(errno));
-        chunk->result = -1;
-        goto out;
+out:
+    index_executor_put_buffer (ex, chunk->block_buf);
+    chunk->block_buf = NULL;
+    g_async_queue_push (job->finished_tasks, task);
+}
+
+static IndexExecutor *
+index_executor_new ()
+{
+    IndexExecutor *ex = g_new0 (IndexExecutor, 1);
+    int n_threads = seaf->http_server->max_indexing_threads;
+    GError *error = NULL;
+
+    ex->buf_size = seaf->http_server->fixed_block_size;
+    ex->max_bufs = n_threads * INDEX_BUFFERS_PER_THREAD;
+    ex->free_bufs = g_new0 (char *, ex->max_bufs);
+    pthread_mutex_init (&ex->lock, NULL);
+    pthread_cond_init (&ex->buf_available, NULL);
+
+    ex->workers = g_thread_pool_new (chunking_worker, ex,
+                                     n_threads, TRUE, &error);
+    if (!ex->workers) {
+        seaf_warning ("Failed to create indexing threads: %s.\n",
+                      error ? error->message : "");
+        g_clear_error (&error);
+        pthread_mutex_destroy (&ex->lock);
+        pthread_cond_destroy (&ex->buf_available);
+        g_free (ex->free_bufs);
+        g_free (ex);
+        return NULL;
     }
 
-    chunk->result = seafile_write_chunk (data->repo_id, data->version,
-                                         chunk, data->crypt,
-                                         chunk->checksum, 1);
-    if (chunk->result < 0)
-        goto out;
+    return ex;
+}
 
-    idx = chunk->offset / seaf->http_server->fixed_block_size;
-    memcpy (data->blk_sha1s + idx * CHECKSUM_LENGTH, chunk->checksum, CHECKSUM_LENGTH);
+static IndexExecutor *
+get_index_executor ()
+{
+    SeafFSManagerPriv *priv = seaf->fs_mgr->priv;
+    IndexExecutor *ex;
 
-out:
-    g_free (chunk->block_buf);
-    close (fd);
-    g_async_queue_push (data->finished_tasks, chunk);
+    pthread_mutex_lock (&priv->indexer_lock);
+    if (!priv->indexer)
+        priv->indexer = index_executor_new ();
+    ex = priv->indexer;
+    pthread_mutex_unlock (&priv->indexer_lock);
+
+    return ex;
+}
+
+int
+seaf_fs_manager_get_indexing_queue_len (SeafFSManager *mgr)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    int len = 0;
+
+    pthread_mutex_lock (&priv->indexer_lock);
+    if (priv->indexer)
+        len = g_thread_pool_unprocessed (priv->indexer->workers);
+    pthread_mutex_unlock (&priv->indexer_lock);
+
+    return len;
 }
 
 static int
@@ -679,90 +910,314 @@ split_file_to_block (const char *repo_id,
                      gboolean write_data,
                      gint64 *indexed)
 {
+    IndexExecutor *ex;
     int n_blocks;
     uint8_t *block_sha1s = NULL;
-    GThreadPool *tpool = NULL;
-    GAsyncQueue *finished_tasks = NULL;
-    GList *pending_tasks = NULL;
-    int n_pending = 0;
-    CDCDescriptor *chunk;
+    ChunkingTask *tasks = NULL;
+    ChunkingTask *task;
+    ChunkingJob job;
+    BlockURing *ring = block_uring_get ();
+    int fd = -1;
+    int n_pushed = 0;
+    int i;
+    ssize_t n;
     int ret = 0;
 
-    n_blocks = (file_size + seaf->http_server->fixed_block_size - 1) / seaf->http_server->fixed_block_size;
-    block_sha1s = g_new0 (uint8_t, n_blocks * CHECKSUM_LENGTH);
-    if (!block_sha1s) {
-        seaf_warning ("Failed to allocate block_sha1s.\n");
-        ret = -1;
-        goto out;
-    }
-
-    finished_tasks = g_async_queue_new ();
+    ex = get_index_executor ();
+    if (!ex)
+        return -1;
 
-    ChunkingData data;
-    memset (&data, 0, sizeof(data));
-    data.repo_id = repo_id;
-    data.version = version;
-    data.file_path = file_path;
-    data.crypt = crypt;
-    data.blk_sha1s = block_sha1s;
-    data.finished_tasks = finished_tasks;
+    n_blocks = (file_size + ex->buf_size - 1) / ex->buf_size;
+    block_sha1s = g_new0 (uint8_t, n_blocks * CHECKSUM_LENGTH);
+    tasks = g_new0 (ChunkingTask, n_blocks);
 
-    tpool = g_thread_pool_new (chunking_worker, &data,
-                               seaf->http_server->max_indexing_threads, FALSE, NULL);
-    if (!tpool) {
-        seaf_warning ("Failed to allocate thread pool\n");
+    fd = seaf_util_open (file_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s\n", file_path, strerror(errno));
         ret = -1;
         goto out;
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-    guint64 offset = 0;
-    guint64 len;
-    guint64 left = (guint64)file_size;
-    while (left > 0) {
-        len = ((left >= seaf->http_server->fixed_block_size) ? seaf->http_server->fixed_block_size : left);
+    memset (&job, 0, sizeof(job));
+    job.repo_id = repo_id;
+    job.version = version;
+    job.crypt = crypt;
+    job.block_size = ex->buf_size;
+    job.blk_sha1s = block_sha1s;
+    job.finished_tasks = g_async_queue_new ();
 
-        chunk = g_new0 (CDCDescriptor, 1);
-        chunk->offset = offset;
-        chunk->len = (guint32)len;
+    for (i = 0; i < n_blocks; ++i) {
+        if (g_atomic_int_get (&job.failed))
+            break;
 
-        g_thread_pool_push (tpool, chunk, NULL);
-        pending_tasks = g_list_prepend (pending_tasks, chunk);
-        n_pending++;
+        task = &tasks[i];
+        task->job = &job;
+        task->chunk.offset = (guint64)i * ex->buf_size;
+        task->chunk.len = (guint32)MIN (ex->buf_size,
+                                        file_size - (gint64)task->chunk.offset);
 
-        left -= len;
-        offset += len;
-    }
+        task->chunk.block_buf = index_executor_get_buffer (ex);
+        if (!task->chunk.block_buf) {
+            ret = -1;
+            break;
+        }
 
-    while ((chunk = g_async_queue_pop (finished_tasks)) != NULL) {
-        if (chunk->result < 0) {
+        if (ring)
+            n = block_uring_read (ring, fd, task->chunk.block_buf,
+                                  task->chunk.len, task->chunk.offset);
+        else
+            n = readn (fd, task->chunk.block_buf, task->chunk.len);
+        if (n != (ssize_t)task->chunk.len) {
+            seaf_warning ("Failed to read chunk from %s: %s\n",
+                          file_path, n < 0 ? strerror(errno) : "file is truncated");
+            index_executor_put_buffer (ex, task->chunk.block_buf);
             ret = -1;
-            goto out;
+            break;
         }
-        if (indexed)
-            *indexed += seaf->http_server->fixed_block_size;
 
-        if ((--n_pending) <= 0) {
+        g_thread_pool_push (ex->workers, task, NULL);
+        ++n_pushed;
+    }
+
+    /* Wait for all the pushed chunks, since they refer to job and tasks. */
+    for (i = 0; i < n_pushed; ++i) {
+        task = g_async_queue_pop (job.finished_tasks);
+        if (task->chunk.result < 0)
+            ret = -1;
+        else {
+            if (task->chunk.existed)
+                cdc->dedup_size += task->chunk.len;
             if (indexed)
-                *indexed = (guint64)file_size;
-            break;
+                *indexed += task->chunk.len;
         }
     }
+    g_async_queue_unref (job.finished_tasks);
 
-    cdc->block_nr = n_blocks;
-    cdc->blk_sha1s = block_sha1s;
+    if (ret == 0) {
+        cdc->block_nr = n_blocks;
+        cdc->blk_sha1s = block_sha1s;
+    }
 
 out:
-    if (tpool)
-        g_thread_pool_free (tpool, TRUE, TRUE);
-    if (finished_tasks)
-        g_async_queue_unref (finished_tasks);
-    g_list_free_full (pending_tasks, g_free);
+    if (fd >= 0)
+        close (fd);
+    g_free (tasks);
     if (ret < 0)
         g_free (block_sha1s);
 
     return ret;
 }
 
+struct SeafBlockStream {
+    SeafFSManager *mgr;
+    IndexExecutor *ex;
+    char repo_id[37];
+    ChunkingJob job;
+    /* The block being filled, not pushed to the workers yet. */
+    ChunkingTask *cur;
+    /* Pushed blocks, in file order. */
+    GPtrArray *tasks;
+    guint n_finished;
+    gint64 size;
+};
+
+SeafBlockStream *
+seaf_block_stream_new (SeafFSManager *mgr,
+                       const char *repo_id,
+                       int version,
+                       SeafileCrypt *crypt)
+{
+    SeafBlockStream *stream;
+    IndexExecutor *ex;
+
+    ex = get_index_executor ();
+    if (!ex)
+        return NULL;
+
+    stream = g_new0 (SeafBlockStream, 1);
+    stream->mgr = mgr;
+    stream->ex = ex;
+    memcpy (stream->repo_id, repo_id, 36);
+    stream->job.repo_id = stream->repo_id;
+    stream->job.version = version;
+    stream->job.crypt = crypt;
+    stream->job.block_size = ex->buf_size;
+    stream->job.finished_tasks = g_async_queue_new ();
+    stream->tasks = g_ptr_array_new ();
+
+    return stream;
+}
+
+static void
+push_stream_block (SeafBlockStream *stream)
+{
+    g_ptr_array_add (stream->tasks, stream->cur);
+    g_thread_pool_push (stream->ex->workers, stream->cur, NULL);
+    stream->cur = NULL;
+}
+
+int
+seaf_block_stream_write (SeafBlockStream *stream, const char *data, size_t len)
+{
+    ChunkingTask *task;
+    size_t n;
+
+    while (len > 0) {
+        if (g_atomic_int_get (&stream->job.failed))
+            return -1;
+
+        if (!stream->cur) {
+            task = g_new0 (ChunkingTask, 1);
+            task->job = &stream->job;
+            task->chunk.offset = stream->size;
+            task->chunk.block_buf = index_executor_get_buffer (stream->ex);
+            if (!task->chunk.block_buf) {
+                g_free (task);
+                return -1;
+            }
+            stream->cur = task;
+        }
+        task = stream->cur;
+
+        n = MIN (len, (size_t)(stream->ex->buf_size - task->chunk.len));
+        memcpy (task->chunk.block_buf + task->chunk.len, data, n);
+        task->chunk.len += n;
+        stream->size += n;
+        data += n;
+        len -= n;
+
+        if (task->chunk.len == stream->ex->buf_size)
+            push_stream_block (stream);
+    }
+
+    return 0;
+}
+
+/* Returns -1 if any block failed. */
+static int
+wait_for_stream_blocks (SeafBlockStream *stream)
+{
+    ChunkingTask *task;
+    int ret = 0;
+
+    while (stream->n_finished < stream->tasks->len) {
+        task = g_async_queue_pop (stream->job.finished_tasks);
+        if (task->chunk.result < 0)
+            ret = -1;
+        ++stream->n_finished;
+    }
+
+    if (g_atomic_int_get (&stream->job.failed))
+        ret = -1;
+
+    return ret;
+}
+
+int
+seaf_block_stream_finish (SeafBlockStream *stream,
+                          unsigned char sha1[],
+                          gint64 *size)
+{
+    CDCFileDescriptor cdc;
+    ChunkingTask *task;
+    guint i;
+    int ret = 0;
+
+    if (stream->cur)
+        push_stream_block (stream);
+
+    if (wait_for_stream_blocks (stream) < 0) {
+        seaf_warning ("Failed to write blocks of streamed file in repo %.8s.\n",
+                      stream->repo_id);
+        return -1;
+    }
+
+    *size = stream->size;
+    if (stream->size == 0) {
+        memset (sha1, 0, 20);
+        return 0;
+    }
+
+    memset (&cdc, 0, sizeof(cdc));
+    memcpy (cdc.repo_id, stream->repo_id, 36);
+    cdc.version = stream->job.version;
+    cdc.file_size = stream->size;
+    cdc.block_nr = stream->tasks->len;
+    cdc.blk_sha1s = g_new (uint8_t, cdc.block_nr * CHECKSUM_LENGTH);
+    for (i = 0; i < stream->tasks->len; ++i) {
+        task = g_ptr_array_index (stream->tasks, i);
+        memcpy (cdc.blk_sha1s + i * CHECKSUM_LENGTH,
+                task->chunk.checksum, CHECKSUM_LENGTH);
+    }
+
+    if (write_seafile (stream->mgr, stream->repo_id, stream->job.version,
+                       &cdc, sha1) < 0) {
+        seaf_warning ("Failed to write seafile for streamed file in repo %.8s.\n",
+                      stream->repo_id);
+        ret = -1;
+    }
+
+    g_free (cdc.blk_sha1s);
+    return ret;
+}
+
+int
+seaf_block_stream_finish_blocks (SeafBlockStream *stream,
+                                 GList **block_ids,
+                                 gint64 *size)
+{
+    ChunkingTask *task;
+    char hex[41];
+    GList *ids = NULL;
+    int i;
+
+    *block_ids = NULL;
+
+    if (stream->cur)
+        push_stream_block (stream);
+
+    if (wait_for_stream_blocks (stream) < 0) {
+        seaf_warning ("Failed to write blocks of streamed file in repo %.8s.\n",
+                      stream->repo_id);
+        return -1;
+    }
+
+    for (i = (int)stream->tasks->len - 1; i >= 0; --i) {
+        task = g_ptr_array_index (stream->tasks, i);
+        rawdata_to_hex (task->chunk.checksum, hex, 20);
+        ids = g_list_prepend (ids, g_strdup (hex));
+    }
+
+    *block_ids = ids;
+    *size = stream->size;
+    return 0;
+}
+
+void
+seaf_block_stream_free (SeafBlockStream *stream)
+{
+    guint i;
+
+    if (!stream)
+        return;
+
+    if (stream->cur) {
+        index_executor_put_buffer (stream->ex, stream->cur->chunk.block_buf);
+        g_free (stream->cur);
+    }
+
+    /* The workers refer to the job and tasks. */
+    wait_for_stream_blocks (stream);
+    for (i = 0; i < stream->tasks->len; ++i)
+        g_free (g_ptr_array_index (stream->tasks, i));
+    g_ptr_array_free (stream->tasks, TRUE);
+    g_async_queue_unref (stream->job.finished_tasks);
+    g_free (stream);
+}
+
 #endif  /* SEAFILE_SERVER */
 
 #define CDC_AVERAGE_BLOCK_SIZE (1 << 23) /* 8MB */
@@ -779,7 +1234,8 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               SeafileCrypt *crypt,
                               gboolean write_data,
                               gboolean use_cdc,
-                              gint64 *indexed)
+                              gint64 *indexed,
+                              gint64 *deduped)
 {
     SeafStat sb;
     CDCFileDescriptor cdc;
@@ -805,6 +1261,8 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
             cdc.write_block = seafile_write_chunk;
             memcpy (cdc.repo_id, repo_id, 36);
             cdc.version = version;
+            if (version >= REPO_VERSION_GEAR_CDC)
+                cdc.algorithm = CDC_ALGORITHM_GEAR;
             if (filename_chunk_cdc (file_path, &cdc, crypt, write_data, indexed) < 0) {
                 seaf_warning ("Failed to chunk file with CDC.\n");
                 return -1;
@@ -825,6 +1283,8 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         cdc.write_block = seafile_write_chunk;
         memcpy (cdc.repo_id, repo_id, 36);
         cdc.version = version;
+        if (version >= REPO_VERSION_GEAR_CDC)
+            cdc.algorithm = CDC_ALGORITHM_GEAR;
         if (filename_chunk_cdc (file_path, &cdc, crypt, write_data, indexed) < 0) {
             seaf_warning ("Failed to chunk file with CDC.\n");
             return -1;
@@ -839,6 +1299,8 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
     }
 
     *size = (gint64)sb.st_size;
+    if (deduped)
+        *deduped += (gint64)cdc.dedup_size;
 
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
@@ -929,8 +1391,11 @@ check_existed_file_blocks (CDCFileDescriptor *cdc, GList *blockids)
         char *blk_id = q->data;
         unsigned char sha1[20];
 
+        /* The blocks are reused, see do_write_chunk(). */
         if (!seaf_block_manager_block_exists (
-                seaf->block_mgr, cdc->repo_id, cdc->version, blk_id)) {
+                seaf->block_mgr, cdc->repo_id, cdc->version, blk_id) ||
+            seaf_block_manager_touch_block (
+                seaf->block_mgr, cdc->repo_id, cdc->version, blk_id) < 0) {
             ret = -1;
             goto out;
         }
@@ -1090,17 +1555,33 @@ seafile_ref (Seafile *seafile)
     ++seafile->ref_count;
 }
 
-static void
-seafile_free (Seafile *seafile)
+/* The block ids of a file are kept in one allocation, the array of
+ * pointers followed by the hex ids, freed with a single g_free().
+ */
+static char **
+alloc_block_ids (int n_blocks)
 {
+    char **ids;
+    char *hex;
     int i;
 
-    if (seafile->blk_sha1s) {
-        for (i = 0; i < seafile->n_blocks; ++i)
-            g_free (seafile->blk_sha1s[i]);
-        g_free (seafile->blk_sha1s);
+    if (n_blocks <= 0)
+        return NULL;
+
+    ids = g_malloc (n_blocks * (sizeof(char *) + 41));
+    hex = (char *)(ids + n_blocks);
+    for (i = 0; i < n_blocks; ++i) {
+        ids[i] = hex + i * 41;
+        ids[i][0] = '\0';
     }
 
+    return ids;
+}
+
+static void
+seafile_free (Seafile *seafile)
+{
+    g_free (seafile->blk_sha1s);
     g_free (seafile);
 }
 
@@ -1146,13 +1627,11 @@ seafile_from_v0_data (const char *id, const void *data, int len)
     seafile->file_size = ntoh64 (ondisk->file_size);
     seafile->n_blocks = n_blocks;
 
-    seafile->blk_sha1s = g_new0 (char*, seafile->n_blocks);
+    seafile->blk_sha1s = alloc_block_ids (seafile->n_blocks);
     const unsigned char *blk_sha1_ptr = ondisk->block_ids;
     int i;
     for (i = 0; i < seafile->n_blocks; ++i) {
-        char *blk_sha1 = g_new0 (char, 41);
-        seafile->blk_sha1s[i] = blk_sha1;
-        rawdata_to_hex (blk_sha1_ptr, blk_sha1, 20);
+        rawdata_to_hex (blk_sha1_ptr, seafile->blk_sha1s[i], 20);
         blk_sha1_ptr += 20;
     }
 
@@ -1199,7 +1678,7 @@ seafile_from_json_object (const char *id, json_t *object)
     seafile->version = version;
     seafile->file_size = file_size;
     seafile->n_blocks = json_array_size (block_id_array);
-    seafile->blk_sha1s = g_new0 (char *, seafile->n_blocks);
+    seafile->blk_sha1s = alloc_block_ids (seafile->n_blocks);
 
     int i;
     json_t *block_id_obj;
@@ -1211,11 +1690,89 @@ seafile_from_json_object (const char *id, json_t *object)
             seafile_free (seafile);
             return NULL;
         }
-        seafile->blk_sha1s[i] = g_strdup(block_id);
+        memcpy (seafile->blk_sha1s[i], block_id, 41);
+    }
+
+    seafile->ref_count = 1;
+
+    return seafile;
+}
+
+/*
+ * fs objects are first decoded by a scanner straight into the structs,
+ * without building a jansson tree. The fast paths return NULL for any data
+ * they don't fully understand, including invalid objects, which are then
+ * parsed by jansson to get the same result and warnings as before.
+ */
+
+static Seafile *
+seafile_from_json_fast (const char *id, const char *data, int len)
+{
+    JsonScanner scanner;
+    GString *ids = NULL;
+    gint64 type = 0, version = 0, file_size = 0;
+    Seafile *seafile = NULL;
+    const char *key;
+    int n, i, n_blocks;
+
+    json_scanner_init (&scanner, data, len);
+
+    if (json_scanner_enter_object (&scanner) < 0)
+        goto out;
+
+    while ((n = json_scanner_next_member (&scanner)) > 0) {
+        key = scanner.buf->str;
+        if (strcmp (key, "type") == 0) {
+            if (json_scanner_read_int (&scanner, &type) < 0)
+                goto out;
+        } else if (strcmp (key, "version") == 0) {
+            if (json_scanner_read_int (&scanner, &version) < 0)
+                goto out;
+        } else if (strcmp (key, "size") == 0) {
+            if (json_scanner_read_int (&scanner, &file_size) < 0)
+                goto out;
+        } else if (strcmp (key, "block_ids") == 0) {
+            /* 41 bytes for each id. */
+            if (ids)
+                g_string_truncate (ids, 0);
+            else
+                ids = g_string_sized_new (41 * 64);
+            if (json_scanner_enter_array (&scanner) < 0)
+                goto out;
+            while ((n = json_scanner_next_element (&scanner)) > 0) {
+                if (json_scanner_read_string (&scanner) < 0 ||
+                    !is_object_id_valid (scanner.buf->str))
+                    goto out;
+                g_string_append_len (ids, scanner.buf->str, 41);
+            }
+            if (n < 0)
+                goto out;
+        } else if (json_scanner_skip_value (&scanner) < 0) {
+            goto out;
+        }
     }
+    if (n < 0 || json_scanner_finish (&scanner) < 0)
+        goto out;
+
+    if (type != SEAF_METADATA_TYPE_FILE || (int)version < 1 || !ids)
+        goto out;
 
+    n_blocks = ids->len / 41;
+    seafile = g_new0 (Seafile, 1);
+    seafile->object.type = SEAF_METADATA_TYPE_FILE;
+    memcpy (seafile->file_id, id, 40);
+    seafile->version = (int)version;
+    seafile->file_size = (guint64)file_size;
+    seafile->n_blocks = n_blocks;
+    seafile->blk_sha1s = alloc_block_ids (n_blocks);
+    for (i = 0; i < n_blocks; ++i)
+        memcpy (seafile->blk_sha1s[i], ids->str + i * 41, 41);
     seafile->ref_count = 1;
 
+out:
+    if (ids)
+        g_string_free (ids, TRUE);
+    json_scanner_destroy (&scanner);
     return seafile;
 }
 
@@ -1233,6 +1790,12 @@ seafile_from_json (const char *id, void *data, int len)
         return NULL;
     }
 
+    seafile = seafile_from_json_fast (id, (const char *)decompressed, outlen);
+    if (seafile) {
+        g_free (decompressed);
+        return seafile;
+    }
+
     object = json_loadb ((const char *)decompressed, outlen, 0, &error);
     g_free (decompressed);
     if (!object) {
@@ -1258,30 +1821,231 @@ seafile_from_data (const char *id, void *data, int len, gboolean is_json)
         return seafile_from_v0_data (id, data, len);
 }
 
-Seafile *
-seaf_fs_manager_get_seafile (SeafFSManager *mgr,
-                             const char *repo_id,
-                             int version,
-                             const char *file_id)
+/* fs object cache */
+
+static Seafile *
+seafile_dup (const Seafile *file)
 {
-    void *data;
-    int len;
-    Seafile *seafile;
+    Seafile *copy;
+    int i;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
+    copy = g_memdup (file, sizeof(Seafile));
+    copy->blk_sha1s = alloc_block_ids (file->n_blocks);
+    for (i = 0; i < file->n_blocks; ++i)
+        memcpy (copy->blk_sha1s[i], file->blk_sha1s[i], 41);
+    copy->ref_count = 1;
 
-    if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
-        seafile = g_new0 (Seafile, 1);
-        memset (seafile->file_id, '0', 40);
-        seafile->ref_count = 1;
+    return copy;
+}
+
+static GList *
+dup_dir_segments (GList *segments);
+
+static void
+free_dir_segments (GList *segments);
+
+static SeafDir *
+seaf_dir_dup (const SeafDir *dir)
+{
+    SeafDir *copy;
+    GList *ptr;
+
+    copy = g_new0 (SeafDir, 1);
+    copy->object.type = dir->object.type;
+    copy->version = dir->version;
+    memcpy (copy->dir_id, dir->dir_id, 41);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        copy->entries = g_list_prepend (copy->entries,
+                                        seaf_dirent_dup (ptr->data));
+    copy->entries = g_list_reverse (copy->entries);
+    copy->segments = dup_dir_segments (dir->segments);
+
+    return copy;
+}
+
+static gpointer
+fs_object_cache_copy (gconstpointer value)
+{
+    const SeafFSObject *obj = value;
+
+    if (obj->type == SEAF_METADATA_TYPE_FILE)
+        return seafile_dup ((const Seafile *)obj);
+    return seaf_dir_dup ((const SeafDir *)obj);
+}
+
+static void
+fs_object_cache_value_free (gpointer value)
+{
+    SeafFSObject *obj = value;
+
+    if (obj->type == SEAF_METADATA_TYPE_FILE)
+        seafile_free ((Seafile *)obj);
+    else
+        seaf_dir_free ((SeafDir *)obj);
+}
+
+/* Rough estimation of the memory used by a decoded object. */
+static gint64
+fs_object_mem_size (SeafFSObject *obj)
+{
+    gint64 size;
+    GList *ptr;
+    SeafDirent *dent;
+
+    if (obj->type == SEAF_METADATA_TYPE_FILE) {
+        Seafile *file = (Seafile *)obj;
+        size = sizeof(Seafile) + (gint64)file->n_blocks * (sizeof(char *) + 41);
+    } else {
+        SeafDir *dir = (SeafDir *)obj;
+        size = sizeof(SeafDir);
+        for (ptr = dir->entries; ptr; ptr = ptr->next) {
+            dent = ptr->data;
+            size += sizeof(GList) + sizeof(SeafDirent) + dent->name_len + 1;
+            if (dent->modifier)
+                size += strlen(dent->modifier) + 1;
+        }
+        size += (gint64)dir->n_entries * sizeof(SeafDirent *);
+        size += (gint64)g_list_length (dir->segments) * (sizeof(GList) + 128);
+    }
+
+    /* Account for the key and cache bookkeeping. */
+    return size + 128;
+}
+
+static void
+make_obj_cache_key (char *key, const char *store_id, const char *obj_id)
+{
+    snprintf (key, 80, "%.36s/%.40s", store_id, obj_id);
+}
+
+static SeafFSObject *
+lookup_obj_cache (SeafFSManager *mgr, const char *store_id, const char *obj_id)
+{
+    char key[80];
+
+    if (!mgr->priv->obj_cache)
+        return NULL;
+
+    make_obj_cache_key (key, store_id, obj_id);
+    return lru_cache_lookup (mgr->priv->obj_cache, key, fs_object_cache_copy);
+}
+
+static int
+compare_dirent_names (const void *a, const void *b)
+{
+    const SeafDirent *denta = *(SeafDirent * const *)a;
+    const SeafDirent *dentb = *(SeafDirent * const *)b;
+
+    return strcmp (denta->name, dentb->name);
+}
+
+static void
+build_sorted_entries (SeafDir *dir)
+{
+    GList *ptr;
+    int i = 0;
+
+    dir->n_entries = g_list_length (dir->entries);
+    if (dir->n_entries == 0)
+        return;
+
+    dir->sorted_entries = g_new (SeafDirent *, dir->n_entries);
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        dir->sorted_entries[i++] = ptr->data;
+    qsort (dir->sorted_entries, dir->n_entries, sizeof(SeafDirent *),
+           compare_dirent_names);
+}
+
+static void
+add_to_obj_cache (SeafFSManager *mgr, const char *store_id, const char *obj_id,
+                  SeafFSObject *obj)
+{
+    char key[80];
+    SeafFSObject *copy;
+
+    if (!mgr->priv->obj_cache)
+        return;
+
+    copy = fs_object_cache_copy (obj);
+    if (copy->type == SEAF_METADATA_TYPE_DIR)
+        build_sorted_entries ((SeafDir *)copy);
+
+    make_obj_cache_key (key, store_id, obj_id);
+    lru_cache_insert (mgr->priv->obj_cache, key,
+                      copy, fs_object_mem_size (copy));
+}
+
+typedef struct {
+    const char *name;
+    gboolean found_dir;
+} DirentLookup;
+
+/* Called with the cache shard locked. Returns a copy of the dirent, or
+ * NULL if the name is not in the cached dir. found_dir is only set if the
+ * cached object is a dir.
+ */
+static gpointer
+lookup_cached_dirent (gconstpointer value, gpointer user_data)
+{
+    const SeafFSObject *obj = value;
+    const SeafDir *dir = value;
+    DirentLookup *lookup = user_data;
+    SeafDirent key, *pkey = &key, **found;
+
+    if (obj->type != SEAF_METADATA_TYPE_DIR)
+        return NULL;
+    lookup->found_dir = TRUE;
+
+    if (dir->n_entries == 0)
+        return NULL;
+
+    key.name = (char *)lookup->name;
+    found = bsearch (&pkey, dir->sorted_entries, dir->n_entries,
+                     sizeof(SeafDirent *), compare_dirent_names);
+    if (!found)
+        return NULL;
+    return seaf_dirent_dup (*found);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, LRUCacheStats *stats)
+{
+    if (!mgr->priv->obj_cache) {
+        memset (stats, 0, sizeof(LRUCacheStats));
+        return;
+    }
+    lru_cache_get_stats (mgr->priv->obj_cache, stats);
+}
+
+Seafile *
+seaf_fs_manager_get_seafile (SeafFSManager *mgr,
+                             const char *repo_id,
+                             int version,
+                             const char *file_id)
+{
+    void *data;
+    int len;
+    Seafile *seafile;
+
+#if 0
+    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
+    if (seafile) {
+        seafile_ref (seafile);
         return seafile;
     }
+#endif
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
+        seafile = g_new0 (Seafile, 1);
+        memset (seafile->file_id, '0', 40);
+        seafile->ref_count = 1;
+        return seafile;
+    }
+
+    seafile = (Seafile *)lookup_obj_cache (mgr, repo_id, file_id);
+    if (seafile)
+        return seafile;
 
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  file_id, &data, &len) < 0) {
@@ -1292,6 +2056,9 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     seafile = seafile_from_data (file_id, data, len, (version > 0));
     g_free (data);
 
+    if (seafile)
+        add_to_obj_cache (mgr, repo_id, file_id, (SeafFSObject *)seafile);
+
 #if 0
     /*
      * Add to cache. Also increase ref count.
@@ -1471,6 +2238,8 @@ seaf_dir_free (SeafDir *dir)
 
     g_list_free (dir->entries);
     g_free (dir->ondisk);
+    g_free (dir->sorted_entries);
+    free_dir_segments (dir->segments);
     g_free(dir);
 }
 
@@ -1694,6 +2463,135 @@ seaf_dir_from_json_object (const char *dir_id, json_t *object)
     return dir;
 }
 
+static SeafDirent *
+parse_dirent_fast (JsonScanner *scanner)
+{
+    SeafDirent *dent = g_new0 (SeafDirent, 1);
+    gboolean has_id = FALSE;
+    gint64 mode = 0, size = 0;
+    const char *key;
+    int n;
+
+    if (json_scanner_enter_object (scanner) < 0)
+        goto bad;
+
+    while ((n = json_scanner_next_member (scanner)) > 0) {
+        key = scanner->buf->str;
+        if (strcmp (key, "mode") == 0) {
+            if (json_scanner_read_int (scanner, &mode) < 0)
+                goto bad;
+        } else if (strcmp (key, "id") == 0) {
+            if (json_scanner_read_string (scanner) < 0 ||
+                !is_object_id_valid (scanner->buf->str))
+                goto bad;
+            memcpy (dent->id, scanner->buf->str, 40);
+            has_id = TRUE;
+        } else if (strcmp (key, "name") == 0) {
+            if (json_scanner_read_string (scanner) < 0)
+                goto bad;
+            g_free (dent->name);
+            dent->name = g_strndup (scanner->buf->str, scanner->buf->len);
+            dent->name_len = scanner->buf->len;
+        } else if (strcmp (key, "mtime") == 0) {
+            if (json_scanner_read_int (scanner, &dent->mtime) < 0)
+                goto bad;
+        } else if (strcmp (key, "modifier") == 0) {
+            if (json_scanner_read_string (scanner) < 0)
+                goto bad;
+            g_free (dent->modifier);
+            dent->modifier = g_strndup (scanner->buf->str, scanner->buf->len);
+        } else if (strcmp (key, "size") == 0) {
+            if (json_scanner_read_int (scanner, &size) < 0)
+                goto bad;
+        } else if (json_scanner_skip_value (scanner) < 0) {
+            goto bad;
+        }
+    }
+    if (n < 0 || !has_id || !dent->name)
+        goto bad;
+
+    dent->mode = (guint32)mode;
+    if (S_ISREG(dent->mode)) {
+        if (!dent->modifier)
+            goto bad;
+        dent->size = size;
+    } else {
+        g_free (dent->modifier);
+        dent->modifier = NULL;
+    }
+
+    return dent;
+
+bad:
+    seaf_dirent_free (dent);
+    return NULL;
+}
+
+static SeafDir *
+seaf_dir_from_json_fast (const char *dir_id, const char *data, int len)
+{
+    JsonScanner scanner;
+    GList *entries = NULL, *ptr;
+    gboolean has_dirents = FALSE;
+    gint64 type = 0, version = 0;
+    SeafDirent *dent;
+    SeafDir *dir = NULL;
+    const char *key;
+    int n;
+
+    json_scanner_init (&scanner, data, len);
+
+    if (json_scanner_enter_object (&scanner) < 0)
+        goto out;
+
+    while ((n = json_scanner_next_member (&scanner)) > 0) {
+        key = scanner.buf->str;
+        if (strcmp (key, "type") == 0) {
+            if (json_scanner_read_int (&scanner, &type) < 0)
+                goto out;
+        } else if (strcmp (key, "version") == 0) {
+            if (json_scanner_read_int (&scanner, &version) < 0)
+                goto out;
+        } else if (strcmp (key, "dirents") == 0) {
+            g_list_free_full (entries, (GDestroyNotify)seaf_dirent_free);
+            entries = NULL;
+            if (json_scanner_enter_array (&scanner) < 0)
+                goto out;
+            while ((n = json_scanner_next_element (&scanner)) > 0) {
+                dent = parse_dirent_fast (&scanner);
+                if (!dent)
+                    goto out;
+                entries = g_list_prepend (entries, dent);
+            }
+            if (n < 0)
+                goto out;
+            has_dirents = TRUE;
+        } else if (json_scanner_skip_value (&scanner) < 0) {
+            goto out;
+        }
+    }
+    if (n < 0 || json_scanner_finish (&scanner) < 0)
+        goto out;
+
+    if (type != SEAF_METADATA_TYPE_DIR || (int)version < 1 || !has_dirents)
+        goto out;
+
+    dir = g_new0 (SeafDir, 1);
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->version = (int)version;
+    /* The version may come after the dirents. */
+    for (ptr = entries; ptr; ptr = ptr->next)
+        ((SeafDirent *)ptr->data)->version = dir->version;
+    dir->entries = g_list_reverse (entries);
+    entries = NULL;
+
+out:
+    g_list_free_full (entries, (GDestroyNotify)seaf_dirent_free);
+    json_scanner_destroy (&scanner);
+    return dir;
+}
+
 static SeafDir *
 seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
 {
@@ -1708,6 +2606,12 @@ seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
         return NULL;
     }
 
+    dir = seaf_dir_from_json_fast (dir_id, (const char *)decompressed, outlen);
+    if (dir) {
+        g_free (decompressed);
+        return dir;
+    }
+
     object = json_loadb ((const char *)decompressed, outlen, 0, &error);
     g_free (decompressed);
     if (!object) {
@@ -1724,11 +2628,242 @@ seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
     return dir;
 }
 
+/*
+ * Binary dir format, written for dir version 2 and later:
+ *
+ *   magic (4 bytes) | uvarint n_entries | n_entries * offset (4 bytes, BE)
+ *   | entries
+ *
+ * Each offset is the position of an entry relative to the first entry. An
+ * entry is
+ *
+ *   uvarint mode | raw id (20 bytes) | uvarint name_len | name
+ *   | varint mtime [| varint size | uvarint modifier_len | modifier]
+ *
+ * where size and modifier are only present for files. Varints use the
+ * encoding of Go's encoding/binary, signed ones are zigzag encoded.
+ * Entries are sorted by name in descending order, like in JSON dirs, so the
+ * offsets allow binary search without decoding the whole object.
+ * The dir id is the sha1 of the data. Dir objects are not compressed.
+ */
+
+#define DIR_V2_MAGIC "SFD\x02"
+#define DIR_V2_MAGIC_LEN 4
+
+static gboolean
+is_dir_v2_data (const uint8_t *data, int len)
+{
+    return (len >= DIR_V2_MAGIC_LEN &&
+            memcmp (data, DIR_V2_MAGIC, DIR_V2_MAGIC_LEN) == 0);
+}
+
+/*
+ * Segmented dir format, written for dir version 3 and later when a dir has
+ * more than DIR_SEGMENT_MAX_ENTRIES entries:
+ *
+ *   magic (4 bytes) | uvarint n_segments
+ *   | n_segments * (raw id (20 bytes) | uvarint n_entries
+ *                   | uvarint name_len | name)
+ *
+ * The entries, sorted as in the binary format, are split into segments,
+ * each stored as a binary dir object of its own. name is the first, i.e.
+ * the largest, name of a segment. A segment ends after an entry whose name
+ * hashes to a cut point, so the boundaries only depend on the names around
+ * them: adding or removing an entry rewrites one segment and the index,
+ * and the other segments are already in the store.
+ */
+
+#define DIR_V3_MAGIC "SFD\x03"
+
+#define DIR_SEGMENT_MIN_ENTRIES 64
+#define DIR_SEGMENT_MAX_ENTRIES 4096
+/* Segments are 1024 entries long on average. */
+#define DIR_SEGMENT_CUT_MASK 0x3ff
+
+typedef struct SeafDirSegment {
+    char     id[41];
+    guint32  n_entries;
+    char    *name;
+
+    void    *ondisk;
+    int      ondisk_size;
+} SeafDirSegment;
+
+static gboolean
+is_dir_v3_data (const uint8_t *data, int len)
+{
+    return (len >= DIR_V2_MAGIC_LEN &&
+            memcmp (data, DIR_V3_MAGIC, DIR_V2_MAGIC_LEN) == 0);
+}
+
+static void
+free_dir_segments (GList *segments)
+{
+    GList *ptr;
+    SeafDirSegment *seg;
+
+    for (ptr = segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        g_free (seg->name);
+        g_free (seg->ondisk);
+        g_free (seg);
+    }
+    g_list_free (segments);
+}
+
+static GList *
+dup_dir_segments (GList *segments)
+{
+    GList *copy = NULL, *ptr;
+    SeafDirSegment *seg, *seg_copy;
+
+    for (ptr = segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        seg_copy = g_new0 (SeafDirSegment, 1);
+        memcpy (seg_copy->id, seg->id, 41);
+        seg_copy->n_entries = seg->n_entries;
+        seg_copy->name = g_strdup (seg->name);
+        copy = g_list_prepend (copy, seg_copy);
+    }
+
+    return g_list_reverse (copy);
+}
+
+static int
+get_uvarint (const uint8_t **ptr, const uint8_t *end, guint64 *value)
+{
+    const uint8_t *p = *ptr;
+    guint64 v = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        v |= (guint64)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *ptr = p;
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static int
+get_varint (const uint8_t **ptr, const uint8_t *end, gint64 *value)
+{
+    guint64 ux;
+
+    if (get_uvarint (ptr, end, &ux) < 0)
+        return -1;
+    *value = (gint64)(ux >> 1);
+    if (ux & 1)
+        *value = ~*value;
+    return 0;
+}
+
+static int
+get_bytes (const uint8_t **ptr, const uint8_t *end, char **str, guint32 *str_len)
+{
+    guint64 len;
+
+    if (get_uvarint (ptr, end, &len) < 0 || len > (guint64)(end - *ptr))
+        return -1;
+    *str = g_strndup ((const char *)*ptr, len);
+    if (str_len)
+        *str_len = (guint32)len;
+    *ptr += len;
+    return 0;
+}
+
+static SeafDirent *
+parse_dirent_v2 (const uint8_t *ptr, const uint8_t *end, int version)
+{
+    SeafDirent *dent;
+    guint64 mode;
+
+    if (get_uvarint (&ptr, end, &mode) < 0 || end - ptr < 20)
+        return NULL;
+
+    dent = g_new0 (SeafDirent, 1);
+    dent->version = version;
+    dent->mode = (guint32)mode;
+    rawdata_to_hex (ptr, dent->id, 20);
+    ptr += 20;
+
+    if (get_bytes (&ptr, end, &dent->name, &dent->name_len) < 0 ||
+        get_varint (&ptr, end, &dent->mtime) < 0)
+        goto bad;
+
+    if (S_ISREG(dent->mode)) {
+        if (get_varint (&ptr, end, &dent->size) < 0 ||
+            get_bytes (&ptr, end, &dent->modifier, NULL) < 0)
+            goto bad;
+    }
+
+    return dent;
+
+bad:
+    seaf_dirent_free (dent);
+    return NULL;
+}
+
+static SeafDir *
+seaf_dir_from_v2_data (const char *dir_id, const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + DIR_V2_MAGIC_LEN, *end = data + len;
+    const uint8_t *offsets, *entries;
+    guint64 n_entries, i;
+    guint32 offset;
+    SeafDirent *dent;
+    SeafDir *dir;
+
+    if (get_uvarint (&ptr, end, &n_entries) < 0 ||
+        n_entries > (guint64)(end - ptr) / 4) {
+        seaf_warning ("Bad data format for dir object %s.\n", dir_id);
+        return NULL;
+    }
+    offsets = ptr;
+    entries = ptr + n_entries * 4;
+
+    dir = g_new0 (SeafDir, 1);
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    dir->version = DIR_OBJ_VERSION_BINARY;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->dir_id[40] = '\0';
+
+    for (i = 0; i < n_entries; ++i) {
+        offset = get32bit (&offsets);
+        if (offset >= (guint64)(end - entries)) {
+            seaf_warning ("Bad data format for dir object %s.\n", dir_id);
+            goto bad;
+        }
+        dent = parse_dirent_v2 (entries + offset, end, dir->version);
+        if (!dent) {
+            seaf_warning ("Bad dirent in dir object %s.\n", dir_id);
+            goto bad;
+        }
+        dir->entries = g_list_prepend (dir->entries, dent);
+    }
+    dir->entries = g_list_reverse (dir->entries);
+
+    return dir;
+
+bad:
+    seaf_dir_free (dir);
+    return NULL;
+}
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_dir_v2_data (data, len))
+        return seaf_dir_from_v2_data (dir_id, data, len);
+    else if (is_json && is_dir_v3_data (data, len)) {
+        /* The segments are in the store, see seaf_fs_manager_get_seafdir(). */
+        seaf_warning ("Dir object %s is segmented.\n", dir_id);
+        return NULL;
+    } else if (is_json)
         return seaf_dir_from_json (dir_id, data, len);
     else
         return seaf_dir_from_v0_data (dir_id, data, len);
@@ -1825,9 +2960,235 @@ seaf_dir_to_json (SeafDir *dir, int *len)
     return data;
 }
 
+static void
+put_uvarint (GByteArray *buf, guint64 value)
+{
+    guint8 b;
+
+    while (value >= 0x80) {
+        b = (guint8)(value | 0x80);
+        g_byte_array_append (buf, &b, 1);
+        value >>= 7;
+    }
+    b = (guint8)value;
+    g_byte_array_append (buf, &b, 1);
+}
+
+static void
+put_varint (GByteArray *buf, gint64 value)
+{
+    guint64 ux = (guint64)value << 1;
+
+    if (value < 0)
+        ux = ~ux;
+    put_uvarint (buf, ux);
+}
+
+static void
+put_bytes (GByteArray *buf, const char *str, guint32 len)
+{
+    put_uvarint (buf, len);
+    g_byte_array_append (buf, (const guint8 *)str, len);
+}
+
+static gint
+compare_dirent_ptrs (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *denta = *(SeafDirent **)a, *dentb = *(SeafDirent **)b;
+
+    return strcmp (dentb->name, denta->name);
+}
+
+static GPtrArray *
+sorted_dirents (SeafDir *dir)
+{
+    GPtrArray *dents = g_ptr_array_new ();
+    GList *ptr;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        g_ptr_array_add (dents, ptr->data);
+    g_ptr_array_sort (dents, compare_dirent_ptrs);
+
+    return dents;
+}
+
+/* Encode @n_dents sorted dirents in the binary format, setting @id to the
+ * id of the data.
+ */
+static void *
+dirents_to_v2_data (SeafDirent **dents, guint n_dents, char *id, int *len)
+{
+    GByteArray *entries = g_byte_array_new ();
+    GByteArray *buf = g_byte_array_new ();
+    guint32 *offsets;
+    SeafDirent *dent;
+    unsigned char sha1[20];
+    guint i;
+
+    offsets = g_new (guint32, n_dents);
+    for (i = 0; i < n_dents; ++i) {
+        dent = dents[i];
+        offsets[i] = htonl (entries->len);
+
+        put_uvarint (entries, dent->mode);
+        hex_to_rawdata (dent->id, sha1, 20);
+        g_byte_array_append (entries, sha1, 20);
+        put_bytes (entries, dent->name, dent->name_len);
+        put_varint (entries, dent->mtime);
+        if (S_ISREG(dent->mode)) {
+            put_varint (entries, dent->size);
+            put_bytes (entries, dent->modifier ? dent->modifier : "",
+                       dent->modifier ? strlen(dent->modifier) : 0);
+        }
+    }
+
+    g_byte_array_append (buf, (const guint8 *)DIR_V2_MAGIC, DIR_V2_MAGIC_LEN);
+    put_uvarint (buf, n_dents);
+    g_byte_array_append (buf, (const guint8 *)offsets, n_dents * 4);
+    g_byte_array_append (buf, entries->data, entries->len);
+
+    calculate_sha1 (sha1, (const char *)buf->data, buf->len);
+    rawdata_to_hex (sha1, id, 20);
+
+    g_free (offsets);
+    g_byte_array_free (entries, TRUE);
+
+    *len = buf->len;
+    return g_byte_array_free (buf, FALSE);
+}
+
+static void *
+seaf_dir_to_v2_data (SeafDir *dir, int *len)
+{
+    GPtrArray *dents = sorted_dirents (dir);
+    void *data;
+
+    data = dirents_to_v2_data ((SeafDirent **)dents->pdata, dents->len,
+                               dir->dir_id, len);
+    g_ptr_array_free (dents, TRUE);
+    return data;
+}
+
+/* FNV-1a */
+static guint32
+dirent_name_hash (const SeafDirent *dent)
+{
+    guint32 hash = 2166136261U;
+    guint32 i;
+
+    for (i = 0; i < dent->name_len; ++i) {
+        hash ^= (guint8)dent->name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static gboolean
+is_segment_end (const SeafDirent *dent, guint n_entries)
+{
+    if (n_entries >= DIR_SEGMENT_MAX_ENTRIES)
+        return TRUE;
+    return (n_entries >= DIR_SEGMENT_MIN_ENTRIES &&
+            (dirent_name_hash (dent) & DIR_SEGMENT_CUT_MASK) == 0);
+}
+
+/* Returns the data of the index, and sets dir->segments to the segments
+ * to be saved along with it.
+ */
+static void *
+seaf_dir_to_segmented_data (SeafDir *dir, int *len)
+{
+    GPtrArray *dents;
+    GByteArray *buf;
+    SeafDirSegment *seg;
+    SeafDirent *first;
+    unsigned char sha1[20];
+    guint i, start = 0;
+    GList *ptr;
+
+    if (g_list_length (dir->entries) <= DIR_SEGMENT_MAX_ENTRIES)
+        return seaf_dir_to_v2_data (dir, len);
+
+    free_dir_segments (dir->segments);
+    dir->segments = NULL;
+
+    dents = sorted_dirents (dir);
+    for (i = 0; i < dents->len; ++i) {
+        if (i + 1 < dents->len &&
+            !is_segment_end (g_ptr_array_index (dents, i), i + 1 - start))
+            continue;
+
+        first = g_ptr_array_index (dents, start);
+        seg = g_new0 (SeafDirSegment, 1);
+        seg->n_entries = i + 1 - start;
+        seg->name = g_strdup (first->name);
+        seg->ondisk = dirents_to_v2_data ((SeafDirent **)dents->pdata + start,
+                                          seg->n_entries, seg->id,
+                                          &seg->ondisk_size);
+        dir->segments = g_list_prepend (dir->segments, seg);
+        start = i + 1;
+    }
+    dir->segments = g_list_reverse (dir->segments);
+    g_ptr_array_free (dents, TRUE);
+
+    buf = g_byte_array_new ();
+    g_byte_array_append (buf, (const guint8 *)DIR_V3_MAGIC, DIR_V2_MAGIC_LEN);
+    put_uvarint (buf, g_list_length (dir->segments));
+    for (ptr = dir->segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        hex_to_rawdata (seg->id, sha1, 20);
+        g_byte_array_append (buf, sha1, 20);
+        put_uvarint (buf, seg->n_entries);
+        put_bytes (buf, seg->name, strlen(seg->name));
+    }
+
+    calculate_sha1 (sha1, (const char *)buf->data, buf->len);
+    rawdata_to_hex (sha1, dir->dir_id, 20);
+
+    *len = buf->len;
+    return g_byte_array_free (buf, FALSE);
+}
+
+static GList *
+parse_dir_segments (const char *dir_id, const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + DIR_V2_MAGIC_LEN, *end = data + len;
+    GList *segments = NULL;
+    SeafDirSegment *seg;
+    guint64 n_segments, n_entries, i;
+
+    if (get_uvarint (&ptr, end, &n_segments) < 0 || n_segments == 0)
+        goto bad;
+
+    for (i = 0; i < n_segments; ++i) {
+        if (end - ptr < 20)
+            goto bad;
+        seg = g_new0 (SeafDirSegment, 1);
+        segments = g_list_prepend (segments, seg);
+        rawdata_to_hex (ptr, seg->id, 20);
+        ptr += 20;
+        if (get_uvarint (&ptr, end, &n_entries) < 0 ||
+            get_bytes (&ptr, end, &seg->name, NULL) < 0)
+            goto bad;
+        seg->n_entries = (guint32)n_entries;
+    }
+
+    return g_list_reverse (segments);
+
+bad:
+    seaf_warning ("Bad data format for dir object %s.\n", dir_id);
+    free_dir_segments (segments);
+    return NULL;
+}
+
 void *
 seaf_dir_to_data (SeafDir *dir, int *len)
 {
+    if (dir->version >= DIR_OBJ_VERSION_SEGMENTED)
+        return seaf_dir_to_segmented_data (dir, len);
+    if (dir->version >= DIR_OBJ_VERSION_BINARY)
+        return seaf_dir_to_v2_data (dir, len);
+
     if (dir->version > 0) {
         guint8 *data;
         int orig_len;
@@ -1849,26 +3210,116 @@ seaf_dir_to_data (SeafDir *dir, int *len)
         return seaf_dir_to_v0_data (dir, len);
 }
 
-int
-seaf_dir_save (SeafFSManager *fs_mgr,
-               const char *repo_id,
-               int version,
-               SeafDir *dir)
+int
+seaf_dir_save (SeafFSManager *fs_mgr,
+               const char *repo_id,
+               int version,
+               SeafDir *dir)
+{
+    int ret = 0;
+    GList *ptr;
+    SeafDirSegment *seg;
+
+    /* Don't need to save empty dir on disk. */
+    if (memcmp (dir->dir_id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    if (seaf_obj_store_obj_exists (fs_mgr->obj_store, repo_id, version, dir->dir_id))
+        return 0;
+
+    /* Segments go first, so that no index refers to missing segments. */
+    for (ptr = dir->segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        if (!seg->ondisk ||
+            seaf_obj_store_obj_exists (fs_mgr->obj_store, repo_id, version, seg->id))
+            continue;
+        if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, seg->id,
+                                      seg->ondisk, seg->ondisk_size, FALSE) < 0)
+            return -1;
+    }
+
+    if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, dir->dir_id,
+                                  dir->ondisk, dir->ondisk_size, FALSE) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+static SeafDir *
+load_segmented_dir (SeafFSManager *mgr,
+                    const char *repo_id,
+                    int version,
+                    const char *dir_id,
+                    const uint8_t *data,
+                    int len)
+{
+    SeafDir *dir, *part;
+    SeafDirSegment *seg;
+    GList *ptr, *p;
+    void *seg_data;
+    int seg_len;
+
+    dir = g_new0 (SeafDir, 1);
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    dir->version = DIR_OBJ_VERSION_SEGMENTED;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->dir_id[40] = '\0';
+
+    dir->segments = parse_dir_segments (dir_id, data, len);
+    if (!dir->segments)
+        goto bad;
+
+    for (ptr = dir->segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
+                                     seg->id, &seg_data, &seg_len) < 0) {
+            seaf_warning ("[fs mgr] Failed to read segment %s of dir %s.\n",
+                          seg->id, dir_id);
+            goto bad;
+        }
+        part = NULL;
+        if (is_dir_v2_data (seg_data, seg_len))
+            part = seaf_dir_from_v2_data (seg->id, seg_data, seg_len);
+        g_free (seg_data);
+        if (!part) {
+            seaf_warning ("Bad segment %s of dir %s.\n", seg->id, dir_id);
+            goto bad;
+        }
+
+        for (p = part->entries; p; p = p->next)
+            dir->entries = g_list_prepend (dir->entries, p->data);
+        g_list_free (part->entries);
+        part->entries = NULL;
+        seaf_dir_free (part);
+    }
+    dir->entries = g_list_reverse (dir->entries);
+
+    return dir;
+
+bad:
+    seaf_dir_free (dir);
+    return NULL;
+}
+
+static SeafDir *
+seafdir_from_store_data (SeafFSManager *mgr,
+                         const char *repo_id,
+                         int version,
+                         const char *dir_id,
+                         uint8_t *data,
+                         int len)
 {
-    int ret = 0;
-
-    /* Don't need to save empty dir on disk. */
-    if (memcmp (dir->dir_id, EMPTY_SHA1, 40) == 0)
-        return 0;
+    SeafDir *dir;
 
-    if (seaf_obj_store_obj_exists (fs_mgr->obj_store, repo_id, version, dir->dir_id))
-        return 0;
+    if (version > 0 && is_dir_v3_data (data, len))
+        dir = load_segmented_dir (mgr, repo_id, version, dir_id, data, len);
+    else
+        dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
 
-    if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, dir->dir_id,
-                                  dir->ondisk, dir->ondisk_size, FALSE) < 0)
-        ret = -1;
+    if (dir)
+        add_to_obj_cache (mgr, repo_id, dir_id, (SeafFSObject *)dir);
 
-    return ret;
+    return dir;
 }
 
 SeafDir *
@@ -1881,8 +3332,6 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         dir->version = version;
@@ -1890,13 +3339,21 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
         return dir;
     }
 
+    /* Counted before the cache, to see what a cache would get. */
+    seaf_access_stats_record (ACCESS_CLASS_DIR, dir_id);
+    seaf_access_stats_record (ACCESS_CLASS_REPO, repo_id);
+
+    dir = (SeafDir *)lookup_obj_cache (mgr, repo_id, dir_id);
+    if (dir)
+        return dir;
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
         return NULL;
     }
 
-    dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
+    dir = seafdir_from_store_data (mgr, repo_id, version, dir_id, data, len);
     g_free (data);
 
     return dir;
@@ -2023,7 +3480,9 @@ int
 seaf_metadata_type_from_data (const char *obj_id,
                               uint8_t *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_json && (is_dir_v2_data (data, len) || is_dir_v3_data (data, len)))
+        return SEAF_METADATA_TYPE_DIR;
+    else if (is_json)
         return parse_metadata_type_json (obj_id, data, len);
     else
         return parse_metadata_type_v0 (data, len);
@@ -2054,6 +3513,9 @@ fs_object_from_json (const char *obj_id, uint8_t *data, int len)
     int type;
     SeafFSObject *fs_obj;
 
+    if (is_dir_v2_data (data, len) || is_dir_v3_data (data, len))
+        return (SeafFSObject *)seaf_dir_from_data (obj_id, data, len, TRUE);
+
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return NULL;
@@ -2114,8 +3576,8 @@ block_list_new ()
 {
     BlockList *bl = g_new0 (BlockList, 1);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    bl->block_ids = g_ptr_array_new_with_free_func (g_free);
+    bl->block_set = id_set_new (0);
+    bl->block_ids = g_byte_array_new ();
 
     return bl;
 }
@@ -2123,42 +3585,51 @@ block_list_new ()
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
-    g_ptr_array_free (bl->block_ids, TRUE);
+    id_set_free (bl->block_set);
+    g_byte_array_free (bl->block_ids, TRUE);
     g_free (bl);
 }
 
+static void
+block_list_insert_raw (BlockList *bl, const unsigned char *raw)
+{
+    if (id_set_add_raw (bl->block_set, raw) == 0)
+        return;
+
+    g_byte_array_append (bl->block_ids, raw, ID_SET_RAW_LEN);
+    ++bl->n_blocks;
+}
+
 void
 block_list_insert (BlockList *bl, const char *block_id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
+    unsigned char raw[ID_SET_RAW_LEN];
+
+    if (hex_to_rawdata (block_id, raw, ID_SET_RAW_LEN) < 0)
         return;
+    block_list_insert_raw (bl, raw);
+}
 
-    char *key = g_strdup(block_id);
-    g_hash_table_replace (bl->block_hash, key, key);
-    g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-    ++bl->n_blocks;
+void
+block_list_get (BlockList *bl, uint32_t i, char *block_id)
+{
+    rawdata_to_hex (bl->block_ids->data + i * ID_SET_RAW_LEN,
+                    block_id, ID_SET_RAW_LEN);
 }
 
 BlockList *
 block_list_difference (BlockList *bl1, BlockList *bl2)
 {
     BlockList *bl;
-    int i;
-    char *block_id;
-    char *key;
+    uint32_t i;
+    const unsigned char *raw;
 
     bl = block_list_new ();
 
-    for (i = 0; i < bl1->block_ids->len; ++i) {
-        block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_replace (bl->block_hash, key, key);
-            g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-            ++bl->n_blocks;
-        }
+    for (i = 0; i < bl1->n_blocks; ++i) {
+        raw = bl1->block_ids->data + i * ID_SET_RAW_LEN;
+        if (!id_set_contains_raw (bl2->block_set, raw))
+            block_list_insert_raw (bl, raw);
     }
 
     return bl;
@@ -2214,6 +3685,16 @@ traverse_dir (SeafFSManager *mgr,
             return 0;
         return -1;
     }
+    /* Segments are stored as dir objects. */
+    for (p = dir->segments; p; p = p->next) {
+        SeafDirSegment *seg = p->data;
+        if (!callback (mgr, repo_id, version,
+                       seg->id, SEAF_METADATA_TYPE_DIR, user_data, &stop) &&
+            !skip_errors) {
+            seaf_dir_free (dir);
+            return -1;
+        }
+    }
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = (SeafDirent *)p->data;
 
@@ -2385,13 +3866,245 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
+void
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **ids,
+                               int n_ids,
+                               gboolean *results)
+{
+    int i;
+
+    seaf_obj_store_objs_exist (mgr->obj_store, repo_id, version,
+                               ids, n_ids, results);
+
+    /* Empty file and dir always exists. */
+    for (i = 0; i < n_ids; ++i) {
+        if (memcmp (ids[i], EMPTY_SHA1, 40) == 0)
+            results[i] = TRUE;
+    }
+}
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
                                int version,
                                const char *id)
 {
+    char key[80];
+
+    if (mgr->priv->obj_cache) {
+        make_obj_cache_key (key, repo_id, id);
+        lru_cache_remove (mgr->priv->obj_cache, key);
+    }
+
     seaf_obj_store_delete_obj (mgr->obj_store, repo_id, version, id);
+    if (mgr->block_map_store)
+        seaf_obj_store_delete_obj (mgr->block_map_store, repo_id, version, id);
+}
+
+static gboolean
+block_map_is_valid (const char *data, int len, Seafile *file)
+{
+    json_t *array;
+    json_error_t jerror;
+    gboolean ret = FALSE;
+    size_t i;
+
+    array = json_loadb (data, len, 0, &jerror);
+    if (!array)
+        return FALSE;
+
+    if (!json_is_array (array) || json_array_size (array) != file->n_blocks)
+        goto out;
+    for (i = 0; i < json_array_size (array); ++i) {
+        if (!json_is_integer (json_array_get (array, i)))
+            goto out;
+    }
+    ret = TRUE;
+
+out:
+    json_decref (array);
+    return ret;
+}
+
+static char *
+build_block_map (const char *repo_id, int version, Seafile *file)
+{
+    BlockMetadata *blk_meta;
+    json_t *array;
+    char *data = NULL;
+    char *ret;
+    int i;
+
+    array = json_array ();
+    for (i = 0; i < file->n_blocks; ++i) {
+        blk_meta = seaf_block_manager_stat_block (seaf->block_mgr, repo_id,
+                                                  version, file->blk_sha1s[i]);
+        if (!blk_meta) {
+            seaf_warning ("Failed to find block %s/%s\n",
+                          repo_id, file->blk_sha1s[i]);
+            json_decref (array);
+            return NULL;
+        }
+        json_array_append_new (array, json_integer (blk_meta->size));
+        g_free (blk_meta);
+    }
+
+    data = json_dumps (array, JSON_COMPACT);
+    json_decref (array);
+    if (!data)
+        return NULL;
+
+    ret = g_strdup (data);
+    free (data);
+    return ret;
+}
+
+char *
+seaf_fs_manager_get_block_map (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               Seafile *file)
+{
+    void *data = NULL;
+    int len;
+    char *map;
+
+    if (file->n_blocks == 0)
+        return g_strdup ("[]");
+
+    if (mgr->block_map_store &&
+        seaf_obj_store_read_obj (mgr->block_map_store, repo_id, version,
+                                 file->file_id, &data, &len) == 0) {
+        if (block_map_is_valid (data, len, file)) {
+            map = g_strndup (data, len);
+            g_free (data);
+            return map;
+        }
+        seaf_warning ("Invalid block map of file %s/%s, rebuild it.\n",
+                      repo_id, file->file_id);
+        g_free (data);
+    }
+
+    map = build_block_map (repo_id, version, file);
+    if (map && mgr->block_map_store &&
+        seaf_obj_store_write_obj (mgr->block_map_store, repo_id, version,
+                                  file->file_id, map, strlen (map), FALSE) < 0)
+        seaf_warning ("Failed to save block map of file %s/%s.\n",
+                      repo_id, file->file_id);
+
+    return map;
+}
+
+/* offsets[i] is where block i starts, offsets[n_blocks] is the file size. */
+typedef struct BlockOffsets {
+    int    n_blocks;
+    gint64 offsets[0];
+} BlockOffsets;
+
+static BlockOffsets *
+build_block_offsets (SeafFSManager *mgr, const char *repo_id, int version,
+                     Seafile *file)
+{
+    BlockOffsets *bo = NULL;
+    char *map;
+    json_t *array = NULL;
+    json_error_t jerror;
+    int i;
+
+    map = seaf_fs_manager_get_block_map (mgr, repo_id, version, file);
+    if (!map)
+        return NULL;
+
+    array = json_loads (map, 0, &jerror);
+    if (!array || json_array_size (array) != file->n_blocks)
+        goto out;
+
+    bo = g_malloc (sizeof(BlockOffsets) + sizeof(gint64) * (file->n_blocks + 1));
+    bo->n_blocks = file->n_blocks;
+    bo->offsets[0] = 0;
+    for (i = 0; i < file->n_blocks; ++i)
+        bo->offsets[i + 1] = bo->offsets[i] +
+            json_integer_value (json_array_get (array, i));
+
+out:
+    if (array)
+        json_decref (array);
+    g_free (map);
+    return bo;
+}
+
+typedef struct FindBlockData {
+    guint64 offset;
+    int     blk_idx;
+    guint64 blk_start;
+} FindBlockData;
+
+/* Binary-search the last block that starts at or before the offset. */
+static gpointer
+find_block_in_offsets (gconstpointer value, gpointer user_data)
+{
+    const BlockOffsets *bo = value;
+    FindBlockData *data = user_data;
+    int lo = 0, hi = bo->n_blocks, mid;
+
+    if (data->offset >= (guint64)bo->offsets[bo->n_blocks]) {
+        data->blk_idx = bo->n_blocks;
+        return data;
+    }
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if ((guint64)bo->offsets[mid] <= data->offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    data->blk_idx = lo;
+    data->blk_start = bo->offsets[lo];
+    return data;
+}
+
+int
+seaf_fs_manager_find_block (SeafFSManager *mgr,
+                            const char *repo_id,
+                            int version,
+                            Seafile *file,
+                            guint64 offset,
+                            int *blk_idx,
+                            guint64 *blk_start)
+{
+    FindBlockData data;
+    BlockOffsets *bo;
+    char key[80];
+
+    data.offset = offset;
+    data.blk_idx = 0;
+    data.blk_start = 0;
+
+    if (file->n_blocks == 0) {
+        *blk_idx = 0;
+        return 0;
+    }
+
+    make_obj_cache_key (key, repo_id, file->file_id);
+    if (!lru_cache_lookup_full (mgr->priv->block_offset_cache, key,
+                                find_block_in_offsets, &data)) {
+        bo = build_block_offsets (mgr, repo_id, version, file);
+        if (!bo)
+            return -1;
+        find_block_in_offsets (bo, &data);
+        lru_cache_insert (mgr->priv->block_offset_cache, key, bo,
+                          sizeof(BlockOffsets) +
+                          sizeof(gint64) * (bo->n_blocks + 1) + strlen (key));
+    }
+
+    *blk_idx = data.blk_idx;
+    *blk_start = data.blk_start;
+    return 0;
 }
 
 gint64
@@ -2502,108 +4215,406 @@ count_dir_files (SeafFSManager *mgr, const char *repo_id, int version, const cha
     return count;
 }
 
+/*
+ * Counts of everything below a dir. A dir object never changes, so the
+ * counts are cached by dir id, and counting a new version of a tree only
+ * descends into the dirs that changed.
+ */
+typedef struct DirCountInfo {
+    gint64 dir_count;
+    gint64 file_count;
+    gint64 size;
+} DirCountInfo;
+
+static gpointer
+copy_count_info (gconstpointer value, gpointer user_data)
+{
+    memcpy (user_data, value, sizeof(DirCountInfo));
+    return user_data;
+}
+
 static int
 get_file_count_info (SeafFSManager *mgr,
                      const char *repo_id,
                      int version,
                      const char *id,
-                     gint64 *dir_count,
-                     gint64 *file_count,
-                     gint64 *size)
+                     DirCountInfo *info)
 {
+    char key[80];
     SeafDir *dir;
     SeafDirent *seaf_dent;
+    DirCountInfo sub_info;
     GList *p;
-    int ret = 0;
+
+    make_obj_cache_key (key, repo_id, id);
+    if (lru_cache_lookup_full (mgr->priv->count_info_cache, key,
+                               copy_count_info, info))
+        return 0;
 
     dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, id);
     if (!dir)
         return -1;
 
+    memset (info, 0, sizeof(DirCountInfo));
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = (SeafDirent *)p->data;
 
         if (S_ISREG(seaf_dent->mode)) {
-            (*file_count)++;
+            info->file_count++;
             if (version > 0)
-                (*size) += seaf_dent->size;
+                info->size += seaf_dent->size;
         } else if (S_ISDIR(seaf_dent->mode)) {
-            (*dir_count)++;
-            ret = get_file_count_info (mgr, repo_id, version, seaf_dent->id,
-                                       dir_count, file_count, size);
+            if (get_file_count_info (mgr, repo_id, version, seaf_dent->id,
+                                     &sub_info) < 0) {
+                seaf_dir_free (dir);
+                return -1;
+            }
+            info->dir_count += sub_info.dir_count + 1;
+            info->file_count += sub_info.file_count;
+            info->size += sub_info.size;
+        }
+    }
+    seaf_dir_free (dir);
+
+    lru_cache_insert (mgr->priv->count_info_cache, key,
+                      g_memdup (info, sizeof(DirCountInfo)),
+                      sizeof(DirCountInfo) + strlen (key));
+
+    return 0;
+}
+
+/*
+ * Directories are always before files. Otherwise compare the names.
+ */
+static gint
+compare_listing_order (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *dent_a = a, *dent_b = b;
+
+    if (S_ISDIR(dent_a->mode) && S_ISREG(dent_b->mode))
+        return -1;
+
+    if (S_ISREG(dent_a->mode) && S_ISDIR(dent_b->mode))
+        return 1;
+
+    return strcasecmp (dent_a->name, dent_b->name);
+}
+
+/* Entries of a dir in listing order. Dir objects never change, so a cached
+ * listing never gets stale.
+ */
+typedef struct DirListing {
+    SeafDirent **entries;
+    int          n_entries;
+} DirListing;
+
+static void
+dir_listing_free (gpointer value)
+{
+    DirListing *listing = value;
+    int i;
+
+    for (i = 0; i < listing->n_entries; ++i)
+        seaf_dirent_free (listing->entries[i]);
+    g_free (listing->entries);
+    g_free (listing);
+}
+
+static gint64
+dir_listing_mem_size (DirListing *listing)
+{
+    gint64 size = sizeof(DirListing) + 128;
+    SeafDirent *dent;
+    int i;
+
+    for (i = 0; i < listing->n_entries; ++i) {
+        dent = listing->entries[i];
+        size += sizeof(SeafDirent *) + sizeof(SeafDirent) + dent->name_len + 1;
+        if (dent->modifier)
+            size += strlen(dent->modifier) + 1;
+    }
+
+    return size;
+}
+
+typedef struct {
+    int offset;
+    int limit;
+    GList *entries;
+} ListingPage;
+
+/* Called with the cache shard locked, so only the page is copied. */
+static gpointer
+copy_listing_page (gconstpointer value, gpointer user_data)
+{
+    const DirListing *listing = value;
+    ListingPage *page = user_data;
+    int i, end;
+
+    end = listing->n_entries;
+    if (page->limit > 0 && page->offset + page->limit < end)
+        end = page->offset + page->limit;
+
+    for (i = page->offset; i < end; ++i)
+        page->entries = g_list_prepend (page->entries,
+                                        seaf_dirent_dup (listing->entries[i]));
+    page->entries = g_list_reverse (page->entries);
+
+    return page;
+}
+
+int
+seaf_fs_manager_list_dir_page (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *dir_id,
+                               int offset,
+                               int limit,
+                               GList **entries)
+{
+    char key[80];
+    ListingPage page;
+    SeafDir *dir;
+    DirListing *listing;
+    GList *ptr;
+    int i = 0;
+
+    if (offset < 0)
+        offset = 0;
+    page.offset = offset;
+    page.limit = limit;
+    page.entries = NULL;
+
+    make_obj_cache_key (key, repo_id, dir_id);
+    if (lru_cache_lookup_full (mgr->priv->dir_listing_cache, key,
+                               copy_listing_page, &page)) {
+        *entries = page.entries;
+        return 0;
+    }
+
+    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+    if (!dir)
+        return -1;
+
+    dir->entries = g_list_sort (dir->entries, compare_listing_order);
+
+    listing = g_new0 (DirListing, 1);
+    listing->n_entries = g_list_length (dir->entries);
+    listing->entries = g_new (SeafDirent *, listing->n_entries);
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        listing->entries[i++] = ptr->data;
+    /* The listing owns the entries now. */
+    g_list_free (dir->entries);
+    dir->entries = NULL;
+    seaf_dir_free (dir);
+
+    copy_listing_page (listing, &page);
+    *entries = page.entries;
+
+    if (listing->n_entries >= DIR_LISTING_CACHE_MIN_ENTRIES)
+        lru_cache_insert (mgr->priv->dir_listing_cache, key,
+                          listing, dir_listing_mem_size (listing));
+    else
+        dir_listing_free (listing);
+
+    return 0;
+}
+
+int
+seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
+                                const char *repo_id,
+                                int version,
+                                const char *root_id)
+{
+     if (strcmp (root_id, EMPTY_SHA1) == 0)
+        return 0;
+     return count_dir_files (mgr, repo_id, version, root_id);
+}
+
+static SeafDirent *
+get_dirent_in_segments (SeafFSManager *mgr,
+                        const char *repo_id,
+                        int version,
+                        const char *dir_id,
+                        const uint8_t *data,
+                        int len,
+                        const char *name,
+                        gboolean *missing);
+
+/* Look up @name in dir @dir_id. Cached dirs are searched by name, otherwise
+ * the dir is loaded (and cached) and searched linearly. Of segmented dirs
+ * only one segment is loaded.
+ * @missing is set if the dir object can't be read.
+ */
+static SeafDirent *
+get_dirent_in_dir (SeafFSManager *mgr,
+                   const char *repo_id,
+                   int version,
+                   const char *dir_id,
+                   const char *name,
+                   gboolean *missing)
+{
+    char key[80];
+    DirentLookup lookup;
+    SeafDirent *dent = NULL;
+    SeafDir *dir;
+    GList *ptr;
+    void *data;
+    int len;
+
+    *missing = FALSE;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return NULL;
+
+    if (mgr->priv->obj_cache) {
+        lookup.name = name;
+        lookup.found_dir = FALSE;
+        make_obj_cache_key (key, repo_id, dir_id);
+        dent = lru_cache_lookup_full (mgr->priv->obj_cache, key,
+                                      lookup_cached_dirent, &lookup);
+        if (lookup.found_dir)
+            return dent;
+    }
+
+    if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
+                                 dir_id, &data, &len) < 0) {
+        seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
+        *missing = TRUE;
+        return NULL;
+    }
+
+    /* Only the segment that can hold the name is loaded. */
+    if (version > 0 && is_dir_v3_data (data, len)) {
+        dent = get_dirent_in_segments (mgr, repo_id, version, dir_id,
+                                       data, len, name, missing);
+        g_free (data);
+        return dent;
+    }
+
+    dir = seafdir_from_store_data (mgr, repo_id, version, dir_id, data, len);
+    g_free (data);
+    if (!dir) {
+        *missing = TRUE;
+        return NULL;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        SeafDirent *d = ptr->data;
+        if (strcmp (d->name, name) == 0) {
+            dent = seaf_dirent_dup (d);
+            break;
         }
     }
-    seaf_dir_free (dir);
 
-    return ret;
+    seaf_dir_free (dir);
+    return dent;
 }
 
-int
-seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
-                                const char *repo_id,
-                                int version,
-                                const char *root_id)
+/* Segments are sorted by name in descending order, so @name can only be in
+ * the last segment whose first name is not smaller.
+ */
+static SeafDirent *
+get_dirent_in_segments (SeafFSManager *mgr,
+                        const char *repo_id,
+                        int version,
+                        const char *dir_id,
+                        const uint8_t *data,
+                        int len,
+                        const char *name,
+                        gboolean *missing)
 {
-     if (strcmp (root_id, EMPTY_SHA1) == 0)
-        return 0;
-     return count_dir_files (mgr, repo_id, version, root_id);
+    GList *segments, *ptr;
+    SeafDirSegment *seg, *found = NULL;
+    SeafDirent *dent = NULL;
+
+    segments = parse_dir_segments (dir_id, data, len);
+    if (!segments) {
+        *missing = TRUE;
+        return NULL;
+    }
+
+    for (ptr = segments; ptr; ptr = ptr->next) {
+        seg = ptr->data;
+        if (strcmp (seg->name, name) < 0)
+            break;
+        found = seg;
+    }
+
+    if (found)
+        dent = get_dirent_in_dir (mgr, repo_id, version, found->id,
+                                  name, missing);
+
+    free_dir_segments (segments);
+    return dent;
 }
 
-SeafDir *
-seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
-                                     const char *repo_id,
-                                     int version,
-                                     const char *root_id,
-                                     const char *path,
-                                     GError **error)
+/* Returns the id of the dir at @path, walking down from @root_id. */
+static char *
+dir_path_to_id (SeafFSManager *mgr,
+                const char *repo_id,
+                int version,
+                const char *root_id,
+                const char *path,
+                GError **error)
 {
-    SeafDir *dir;
-    SeafDirent *dent;
-    const char *dir_id = root_id;
+    char *dir_id = g_strdup (root_id);
+    char *tmp_path = g_strdup (path);
     char *name, *saveptr;
-    char *tmp_path = g_strdup(path);
-
-    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-    if (!dir) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
-        g_free (tmp_path);
-        return NULL;
-    }
+    SeafDirent *dent;
+    gboolean missing;
 
     name = strtok_r (tmp_path, "/", &saveptr);
     while (name != NULL) {
-        GList *l;
-        for (l = dir->entries; l != NULL; l = l->next) {
-            dent = l->data;
-
-            if (strcmp(dent->name, name) == 0 && S_ISDIR(dent->mode)) {
-                dir_id = dent->id;
-                break;
-            }
+        dent = get_dirent_in_dir (mgr, repo_id, version, dir_id, name, &missing);
+        if (missing) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                         "directory is missing");
+            g_free (dir_id);
+            dir_id = NULL;
+            break;
         }
 
-        if (!l) {
+        if (!dent || !S_ISDIR(dent->mode)) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
                          "Path does not exists %s", path);
-            seaf_dir_free (dir);
-            dir = NULL;
+            seaf_dirent_free (dent);
+            g_free (dir_id);
+            dir_id = NULL;
             break;
         }
 
-        SeafDir *prev = dir;
-        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-        seaf_dir_free (prev);
-
-        if (!dir) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
-                         "directory is missing");
-            break;
-        }
+        g_free (dir_id);
+        dir_id = g_strdup (dent->id);
+        seaf_dirent_free (dent);
 
         name = strtok_r (NULL, "/", &saveptr);
     }
 
     g_free (tmp_path);
+    return dir_id;
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
+                                     const char *repo_id,
+                                     int version,
+                                     const char *root_id,
+                                     const char *path,
+                                     GError **error)
+{
+    SeafDir *dir;
+    char *dir_id;
+
+    dir_id = dir_path_to_id (mgr, repo_id, version, root_id, path, error);
+    if (!dir_id)
+        return NULL;
+
+    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+    if (!dir)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
+
+    g_free (dir_id);
     return dir;
 }
 
@@ -2619,9 +4630,9 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
     char *copy = g_strdup (path);
     int off = strlen(copy) - 1;
     char *slash, *name;
-    SeafDir *base_dir = NULL;
-    SeafDirent *dent;
-    GList *p;
+    char *dir_id = NULL;
+    SeafDirent *dent = NULL;
+    gboolean missing;
     char *obj_id = NULL;
 
     while (off >= 0 && copy[off] == '/')
@@ -2638,57 +4649,49 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
 
     slash = strrchr (copy, '/');
     if (!slash) {
-        base_dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, root_id);
-        if (!base_dir) {
-            seaf_warning ("Failed to find root dir %s.\n", root_id);
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
-            goto out;
-        }
+        dir_id = g_strdup (root_id);
         name = copy;
     } else {
         *slash = 0;
         name = slash + 1;
         GError *tmp_error = NULL;
-        base_dir = seaf_fs_manager_get_seafdir_by_path (mgr,
-                                                        repo_id,
-                                                        version,
-                                                        root_id,
-                                                        copy,
-                                                        &tmp_error);
-        if (tmp_error &&
-            !g_error_matches(tmp_error,
-                             SEAFILE_DOMAIN,
-                             SEAF_ERR_PATH_NO_EXIST)) {
-            seaf_warning ("Failed to get dir for %s.\n", copy);
+        dir_id = dir_path_to_id (mgr, repo_id, version, root_id, copy, &tmp_error);
+        if (!dir_id) {
+            /* The path doesn't exist in this commit if the error is
+             * SEAF_ERR_PATH_NO_EXIST.
+             */
+            if (!g_error_matches(tmp_error,
+                                 SEAFILE_DOMAIN,
+                                 SEAF_ERR_PATH_NO_EXIST))
+                seaf_warning ("Failed to get dir for %s.\n", copy);
             g_propagate_error (error, tmp_error);
             goto out;
         }
+    }
 
-        /* The path doesn't exist in this commit. */
-        if (!base_dir) {
-            g_propagate_error (error, tmp_error);
-            goto out;
+    dent = get_dirent_in_dir (mgr, repo_id, version, dir_id, name, &missing);
+    if (missing) {
+        if (!slash) {
+            seaf_warning ("Failed to find root dir %s.\n", root_id);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
+        } else {
+            seaf_warning ("Failed to get dir for %s.\n", copy);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                         "directory is missing");
         }
+        goto out;
     }
 
-    for (p = base_dir->entries; p != NULL; p = p->next) {
-        dent = p->data;
-
-        if (!is_object_id_valid (dent->id))
-            continue;
-
-        if (strcmp (dent->name, name) == 0) {
-            obj_id = g_strdup (dent->id);
-            if (mode) {
-                *mode = dent->mode;
-            }
-            break;
+    if (dent && is_object_id_valid (dent->id)) {
+        obj_id = g_strdup (dent->id);
+        if (mode) {
+            *mode = dent->mode;
         }
     }
 
 out:
-    if (base_dir)
-        seaf_dir_free (base_dir);
+    seaf_dirent_free (dent);
+    g_free (dir_id);
     g_free (copy);
     return obj_id;
 }
@@ -2752,38 +4755,30 @@ seaf_fs_manager_get_dirent_by_path (SeafFSManager *mgr,
                                     GError **error)
 {
     SeafDirent *dent = NULL;
-    SeafDir *dir = NULL;
+    char *dir_id = NULL;
     char *parent_dir = NULL;
     char *file_name = NULL;
+    gboolean missing;
 
     parent_dir  = g_path_get_dirname(path);
     file_name = g_path_get_basename(path);
 
-    if (strcmp (parent_dir, ".") == 0) {
-        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, root_id);
-        if (!dir) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
-        }
-    } else
-        dir = seaf_fs_manager_get_seafdir_by_path (mgr, repo_id, version,
-                                                   root_id, parent_dir, error);
+    if (strcmp (parent_dir, ".") == 0)
+        dir_id = g_strdup (root_id);
+    else
+        dir_id = dir_path_to_id (mgr, repo_id, version,
+                                 root_id, parent_dir, error);
 
-    if (!dir) {
+    if (!dir_id) {
         goto out;
     }
 
-    GList *p;
-    for (p = dir->entries; p; p = p->next) {
-        SeafDirent *d = p->data;
-        if (strcmp (d->name, file_name) == 0) {
-            dent = seaf_dirent_dup(d);
-            break;
-        }
-    }
+    dent = get_dirent_in_dir (mgr, repo_id, version, dir_id, file_name, &missing);
+    if (missing)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
 
 out:
-    if (dir)
-        seaf_dir_free (dir);
+    g_free (dir_id);
     g_free (parent_dir);
     g_free (file_name);
 
@@ -2873,6 +4868,12 @@ verify_fs_object_json (const char *obj_id, uint8_t *data, int len)
     unsigned char sha1[20];
     char hex[41];
 
+    if (is_dir_v2_data (data, len) || is_dir_v3_data (data, len)) {
+        calculate_sha1 (sha1, (const char *)data, len);
+        rawdata_to_hex (sha1, hex, 20);
+        return (strcmp(hex, obj_id) == 0);
+    }
+
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return FALSE;
@@ -3061,6 +5062,10 @@ dir_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= REPO_VERSION_SEGMENTED_DIR)
+        return DIR_OBJ_VERSION_SEGMENTED;
+    else if (repo_version >= REPO_VERSION_BINARY_DIR)
+        return DIR_OBJ_VERSION_BINARY;
     else
         return CURRENT_DIR_OBJ_VERSION;
 }
@@ -3078,6 +5083,8 @@ int
 seaf_fs_manager_remove_store (SeafFSManager *mgr,
                               const char *store_id)
 {
+    if (mgr->block_map_store)
+        seaf_obj_store_remove_store (mgr->block_map_store, store_id);
     return seaf_obj_store_remove_store (mgr->obj_store, store_id);
 }
 
@@ -3090,7 +5097,7 @@ seaf_fs_manager_get_file_count_info_by_path (SeafFSManager *mgr,
                                              GError **error)
 {
     char *dir_id = NULL;
-    gint64 file_count = 0, dir_count = 0, size = 0;
+    DirCountInfo count_info;
     SeafileFileCountInfo *info = NULL;
 
     dir_id = seaf_fs_manager_get_seafdir_id_by_path (mgr,
@@ -3104,16 +5111,15 @@ seaf_fs_manager_get_file_count_info_by_path (SeafFSManager *mgr,
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad path");
         goto out;
     }
-    if (get_file_count_info (mgr, repo_id, version,
-                             dir_id, &dir_count, &file_count, &size) < 0) {
+    if (get_file_count_info (mgr, repo_id, version, dir_id, &count_info) < 0) {
         seaf_warning ("Failed to get count info from path %s in repo %.10s.\n",
                       path, repo_id);
         goto out;
     }
     info = g_object_new (SEAFILE_TYPE_FILE_COUNT_INFO,
-                         "file_count", file_count,
-                         "dir_count", dir_count,
-                         "size", size, NULL);
+                         "file_count", count_info.file_count,
+                         "dir_count", count_info.dir_count,
+                         "size", count_info.size, NULL);
 out:
     g_free (dir_id);
 
@@ -3173,6 +5179,336 @@ search_files_recursive (SeafFSManager *mgr,
     return ret;
 }
 
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+
+/*
+ * Walking the head tree for every search loads each dir of the repo. The
+ * names of a searched repo are instead kept in memory, along with the root
+ * they were indexed from. Before a search the index is brought up to the
+ * head by diffing the two roots, which only loads the dirs that changed,
+ * and the search matches the lowercase names in memory.
+ *
+ * At most max_search_indexes repos are indexed, the least recently
+ * searched is dropped first.
+ */
+
+#define DEFAULT_MAX_SEARCH_INDEXES 100
+
+typedef struct SearchIndexEntry {
+    char *path;
+    /* Lowercase name, for case insensitive matching. */
+    char *lname;
+    gint64 size;
+    gint64 mtime;
+    gboolean is_dir;
+} SearchIndexEntry;
+
+typedef struct SearchIndex {
+    char repo_id[37];
+    /* Root the entries are indexed from. Empty if nothing is indexed. */
+    char root_id[41];
+    /* path -> SearchIndexEntry */
+    GHashTable *entries;
+    gint64 last_used;
+    int ref;
+    pthread_mutex_t lock;
+} SearchIndex;
+
+static void
+search_index_entry_free (SearchIndexEntry *entry)
+{
+    g_free (entry->path);
+    g_free (entry->lname);
+    g_free (entry);
+}
+
+static SearchIndex *
+search_index_new (const char *repo_id)
+{
+    SearchIndex *index = g_new0 (SearchIndex, 1);
+
+    memcpy (index->repo_id, repo_id, 36);
+    index->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            NULL,
+                                            (GDestroyNotify)search_index_entry_free);
+    index->ref = 1;
+    pthread_mutex_init (&index->lock, NULL);
+
+    return index;
+}
+
+static void
+search_index_unref (SeafFSManagerPriv *priv, SearchIndex *index)
+{
+    gboolean free_index;
+
+    pthread_mutex_lock (&priv->search_index_lock);
+    free_index = (--index->ref == 0);
+    pthread_mutex_unlock (&priv->search_index_lock);
+
+    if (!free_index)
+        return;
+
+    g_hash_table_destroy (index->entries);
+    pthread_mutex_destroy (&index->lock);
+    g_free (index);
+}
+
+static void
+init_search_indexes (SeafileSession *seaf, SeafFSManagerPriv *priv)
+{
+    GError *error = NULL;
+    int max_indexes;
+
+    max_indexes = g_key_file_get_integer (seaf->config,
+                                          "general", "max_search_indexes",
+                                          &error);
+    if (error) {
+        max_indexes = DEFAULT_MAX_SEARCH_INDEXES;
+        g_clear_error (&error);
+    }
+
+    priv->max_search_indexes = max_indexes;
+    priv->search_indexes = g_hash_table_new (g_str_hash, g_str_equal);
+    pthread_mutex_init (&priv->search_index_lock, NULL);
+}
+
+/* Returns a reference to the index of repo_id, or NULL if indexing is
+ * disabled.
+ */
+static SearchIndex *
+get_search_index (SeafFSManagerPriv *priv, const char *repo_id)
+{
+    SearchIndex *index, *ptr, *oldest;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (priv->max_search_indexes <= 0)
+        return NULL;
+
+    pthread_mutex_lock (&priv->search_index_lock);
+
+    index = g_hash_table_lookup (priv->search_indexes, repo_id);
+    if (!index) {
+        if (g_hash_table_size (priv->search_indexes) >= priv->max_search_indexes) {
+            oldest = NULL;
+            g_hash_table_iter_init (&iter, priv->search_indexes);
+            while (g_hash_table_iter_next (&iter, &key, &value)) {
+                ptr = value;
+                if (!oldest || ptr->last_used < oldest->last_used)
+                    oldest = ptr;
+            }
+            g_hash_table_remove (priv->search_indexes, oldest->repo_id);
+            if (--oldest->ref == 0) {
+                g_hash_table_destroy (oldest->entries);
+                pthread_mutex_destroy (&oldest->lock);
+                g_free (oldest);
+            }
+        }
+        index = search_index_new (repo_id);
+        g_hash_table_insert (priv->search_indexes, index->repo_id, index);
+    }
+    ++index->ref;
+    index->last_used = g_get_monotonic_time ();
+
+    pthread_mutex_unlock (&priv->search_index_lock);
+
+    return index;
+}
+
+static void
+add_search_index_entry (SearchIndex *index, const char *basedir,
+                        SeafDirent *dent)
+{
+    SearchIndexEntry *entry = g_new0 (SearchIndexEntry, 1);
+
+    entry->path = g_strconcat ("/", basedir, dent->name, NULL);
+    entry->lname = g_ascii_strdown (dent->name, -1);
+    entry->size = dent->size;
+    entry->mtime = dent->mtime;
+    entry->is_dir = S_ISDIR(dent->mode);
+
+    g_hash_table_replace (index->entries, entry->path, entry);
+}
+
+static gboolean
+is_under_dir (gpointer key, gpointer value, gpointer user_data)
+{
+    const char *path = key;
+    const char *dir_prefix = user_data;
+
+    return g_str_has_prefix (path, dir_prefix);
+}
+
+static void
+remove_search_index_entry (SearchIndex *index, const char *basedir,
+                           SeafDirent *dent)
+{
+    char *path = g_strconcat ("/", basedir, dent->name, NULL);
+    SearchIndexEntry *entry;
+    char *dir_prefix;
+
+    entry = g_hash_table_lookup (index->entries, path);
+    /* A dir replaced by a file has already been re-added as the file. */
+    if (entry && entry->is_dir == S_ISDIR(dent->mode))
+        g_hash_table_remove (index->entries, path);
+
+    if (S_ISDIR(dent->mode)) {
+        dir_prefix = g_strconcat (path, "/", NULL);
+        g_hash_table_foreach_remove (index->entries, is_under_dir, dir_prefix);
+        g_free (dir_prefix);
+    }
+
+    g_free (path);
+}
+
+static int
+index_diff_files (int n, const char *basedir, SeafDirent *files[], void *data)
+{
+    SearchIndex *index = data;
+
+    if (files[1])
+        add_search_index_entry (index, basedir, files[1]);
+    else
+        remove_search_index_entry (index, basedir, files[0]);
+
+    return 0;
+}
+
+static int
+index_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *data,
+                 gboolean *recurse)
+{
+    SearchIndex *index = data;
+
+    if (!dirs[1]) {
+        remove_search_index_entry (index, basedir, dirs[0]);
+        *recurse = FALSE;
+        return 0;
+    }
+
+    add_search_index_entry (index, basedir, dirs[1]);
+    /* Only the mtime changed. */
+    if (dirs[0] && strcmp (dirs[0]->id, dirs[1]->id) == 0)
+        *recurse = FALSE;
+
+    return 0;
+}
+
+/* Called with the index locked. */
+static int
+update_search_index (SearchIndex *index, const char *store_id, int version,
+                     const char *root_id)
+{
+    DiffOptions opt;
+    const char *roots[2];
+
+    if (strcmp (index->root_id, root_id) == 0)
+        return 0;
+
+    memset (&opt, 0, sizeof(opt));
+    memcpy (opt.store_id, store_id, 36);
+    opt.version = version;
+    opt.file_cb = index_diff_files;
+    opt.dir_cb = index_diff_dirs;
+    opt.data = index;
+
+    roots[0] = index->root_id[0] ? index->root_id : EMPTY_SHA1;
+    roots[1] = root_id;
+
+    if (diff_trees (2, roots, &opt) < 0) {
+        seaf_warning ("Failed to update search index of repo %.10s.\n",
+                      index->repo_id);
+        g_hash_table_remove_all (index->entries);
+        index->root_id[0] = '\0';
+        return -1;
+    }
+
+    memcpy (index->root_id, root_id, 40);
+    return 0;
+}
+
+static gint
+compare_search_result_desc (gconstpointer a, gconstpointer b)
+{
+    const SearchResult *sr_a = a, *sr_b = b;
+
+    return strcmp (sr_b->path, sr_a->path);
+}
+
+static GList *
+search_index_query (SearchIndex *index, const char *str)
+{
+    GList *file_list = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+    SearchIndexEntry *entry;
+    SearchResult *sr;
+    char *lstr = g_ascii_strdown (str, -1);
+
+    g_hash_table_iter_init (&iter, index->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+        if (strstr (entry->lname, lstr) == NULL)
+            continue;
+
+        sr = g_new0 (SearchResult, 1);
+        sr->path = g_strdup (entry->path);
+        sr->size = entry->size;
+        sr->mtime = entry->mtime;
+        sr->is_dir = entry->is_dir;
+        file_list = g_list_prepend (file_list, sr);
+    }
+    g_free (lstr);
+
+    /* Callers reverse the list, which then is sorted by path. */
+    return g_list_sort (file_list, compare_search_result_desc);
+}
+
+int
+seaf_fs_manager_rebuild_search_index (SeafFSManager *mgr,
+                                      const char *repo_id)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head = NULL;
+    SearchIndex *index = NULL;
+    int ret = -1;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to find repo %s\n", repo_id);
+        goto out;
+    }
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr, repo->id, repo->version,
+                                           repo->head->commit_id);
+    if (!head) {
+        seaf_warning ("Failed to find commit %s\n", repo->head->commit_id);
+        goto out;
+    }
+
+    index = get_search_index (mgr->priv, repo_id);
+    if (!index) {
+        ret = 0;
+        goto out;
+    }
+
+    pthread_mutex_lock (&index->lock);
+    g_hash_table_remove_all (index->entries);
+    index->root_id[0] = '\0';
+    ret = update_search_index (index, repo->store_id, repo->version, head->root_id);
+    pthread_mutex_unlock (&index->lock);
+
+out:
+    if (index)
+        search_index_unref (mgr->priv, index);
+    seaf_repo_unref (repo);
+    seaf_commit_unref (head);
+    return ret;
+}
+
+#endif  /* SEAFILE_SERVER && FULL_FEATURE */
+
 GList *
 seaf_fs_manager_search_files (SeafFSManager *mgr,
                               const char *repo_id,
@@ -3193,6 +5529,22 @@ seaf_fs_manager_search_files (SeafFSManager *mgr,
         goto out;
     }
 
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+    SearchIndex *index = get_search_index (mgr->priv, repo->id);
+    if (index) {
+        int rc;
+
+        pthread_mutex_lock (&index->lock);
+        rc = update_search_index (index, repo->store_id, repo->version, head->root_id);
+        if (rc == 0)
+            file_list = search_index_query (index, str);
+        pthread_mutex_unlock (&index->lock);
+        search_index_unref (mgr->priv, index);
+        if (rc == 0)
+            goto out;
+    }
+#endif
+
     search_files_recursive (mgr, repo->store_id, "", head->root_id,
                             str, repo->version, &file_list);
 
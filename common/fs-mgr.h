@@ -11,8 +11,17 @@
 
 #include "cdc/cdc.h"
 #include "../common/seafile-crypt.h"
+#include "lru-cache.h"
 
 #define CURRENT_DIR_OBJ_VERSION 1
+/* Dirs of repos with version 2 or later are stored in the binary format. */
+#define DIR_OBJ_VERSION_BINARY 2
+#define REPO_VERSION_BINARY_DIR 2
+/* Files of repos with version 2 or later are chunked with gear hash (FastCDC). */
+#define REPO_VERSION_GEAR_CDC 2
+/* Large dirs of repos with version 3 or later are split into segments. */
+#define DIR_OBJ_VERSION_SEGMENTED 3
+#define REPO_VERSION_SEGMENTED_DIR 3
 #define CURRENT_SEAFILE_OBJ_VERSION 1
 
 typedef struct _SeafFSManager SeafFSManager;
@@ -86,6 +95,18 @@ struct _SeafDir {
     /* data in on-disk format. */
     void  *ondisk;
     int    ondisk_size;
+
+    /* Entries sorted by name in ascending order. Only built for the copies
+     * kept in the fs object cache, to look up names by binary search.
+     */
+    SeafDirent **sorted_entries;
+    int          n_entries;
+
+    /* For dirs in the segmented format, the segments they are split into,
+     * in on-disk order. Data of the segments is only kept for dirs built
+     * in memory, until they are saved.
+     */
+    GList *segments;
 };
 
 SeafDir *
@@ -130,10 +151,11 @@ seaf_fs_object_from_data (const char *obj_id,
 void
 seaf_fs_object_free (SeafFSObject *obj);
 
+struct IdSet;
+
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
-    GPtrArray   *block_ids;
+    struct IdSet *block_set;
+    GByteArray  *block_ids;     /* raw 20-byte ids, in insertion order */
     uint32_t     n_blocks;
     uint32_t     n_valid_blocks;
 } BlockList;
@@ -147,6 +169,10 @@ block_list_free (BlockList *bl);
 void
 block_list_insert (BlockList *bl, const char *block_id);
 
+/* Copy the hex id of the @i-th block to @block_id, of 41 bytes. */
+void
+block_list_get (BlockList *bl, uint32_t i, char *block_id);
+
 /* Return a blocklist containing block ids which are in @bl1 but
  * not in @bl2.
  */
@@ -162,6 +188,9 @@ struct _SeafFSManager {
 
     struct SeafObjStore *obj_store;
 
+    /* Block sizes of file objects, keyed by file id. */
+    struct SeafObjStore *block_map_store;
+
     SeafFSManagerPriv *priv;
 };
 
@@ -172,6 +201,10 @@ seaf_fs_manager_new (struct _SeafileSession *seaf,
 int
 seaf_fs_manager_init (SeafFSManager *mgr);
 
+/* Hit/miss counters and memory usage of the decoded fs object cache. */
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, LRUCacheStats *stats);
+
 #ifndef SEAFILE_SERVER
 
 int 
@@ -228,7 +261,55 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               SeafileCrypt *crypt,
                               gboolean write_data,
                               gboolean use_cdc,
-                              gint64 *indexed);
+                              gint64 *indexed,
+                              gint64 *deduped);
+
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+
+/*
+ * Builds a file from data that arrives piece by piece, without a temp file.
+ * The data is cut into fixed size blocks, which are hashed, encrypted with
+ * @crypt and written by the indexing threads as soon as they are full.
+ * seaf_block_stream_write() may wait for the indexing threads when they fall
+ * behind. @crypt must stay valid until the stream is freed.
+ */
+typedef struct SeafBlockStream SeafBlockStream;
+
+SeafBlockStream *
+seaf_block_stream_new (SeafFSManager *mgr,
+                       const char *repo_id,
+                       int version,
+                       SeafileCrypt *crypt);
+
+int
+seaf_block_stream_write (SeafBlockStream *stream, const char *data, size_t len);
+
+/* Writes the last block and the seafile object. Like
+ * seaf_fs_manager_index_blocks(), the id of an empty file is all zeros.
+ */
+int
+seaf_block_stream_finish (SeafBlockStream *stream,
+                          unsigned char sha1[],
+                          gint64 *size);
+
+/* Like seaf_block_stream_finish(), for data that is only a part of a file:
+ * writes the last block but no seafile object, and returns the ids of the
+ * blocks in @block_ids.
+ */
+int
+seaf_block_stream_finish_blocks (SeafBlockStream *stream,
+                                 GList **block_ids,
+                                 gint64 *size);
+
+/* Waits for the blocks that are still being written. */
+void
+seaf_block_stream_free (SeafBlockStream *stream);
+
+/* Blocks waiting for an indexing thread. */
+int
+seaf_fs_manager_get_indexing_queue_len (SeafFSManager *mgr);
+
+#endif
 
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr,
@@ -257,6 +338,21 @@ seaf_fs_manager_get_seafdir_sorted_by_path (SeafFSManager *mgr,
                                             const char *root_id,
                                             const char *path);
 
+/* Get the entries [@offset, @offset + @limit) of a dir in listing order,
+ * i.e. sub-dirs before files and names compared case-insensitively.
+ * If @limit <= 0, all entries from @offset are returned.
+ * The listing of large dirs is cached, so after the first call a page only
+ * costs its own size. Free the returned entries with seaf_dirent_free().
+ */
+int
+seaf_fs_manager_list_dir_page (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *dir_id,
+                               int offset,
+                               int limit,
+                               GList **entries);
+
 int
 seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *repo_id,
@@ -305,12 +401,48 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
                                int version,
                                const char *id);
 
+/* Check existence of many fs objects at once. @ids must be valid object ids. */
+void
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **ids,
+                               int n_ids,
+                               gboolean *results);
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
                                int version,
                                const char *id);
 
+/*
+ * Returns the sizes of the blocks of @file as a JSON array.
+ * The map is kept in the block map store. It's built from the block
+ * metadata on first use, since a file id always maps to the same blocks.
+ * Returns NULL if a block is missing.
+ */
+char *
+seaf_fs_manager_get_block_map (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               Seafile *file);
+
+/*
+ * Finds the block of @file that holds byte @offset, via a cached table of
+ * block offsets built from the block map. Sets @blk_idx to the index of the
+ * block and @blk_start to its offset in the file. @blk_idx is set to the
+ * number of blocks if @offset is beyond the end of the file.
+ */
+int
+seaf_fs_manager_find_block (SeafFSManager *mgr,
+                            const char *repo_id,
+                            int version,
+                            Seafile *file,
+                            guint64 offset,
+                            int *blk_idx,
+                            guint64 *blk_start);
+
 gint64
 seaf_fs_manager_get_file_size (SeafFSManager *mgr,
                                const char *repo_id,
@@ -441,4 +573,13 @@ seaf_fs_manager_search_files (SeafFSManager *mgr,
                               const char *repo_id,
                               const char *str);
 
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+/* Drops the in-memory search index of the repo and builds it again from the
+ * head commit.
+ */
+int
+seaf_fs_manager_rebuild_search_index (SeafFSManager *mgr,
+                                      const char *repo_id);
+#endif
+
 #endif
@@ -11,13 +11,28 @@
 #include "utils.h"
 #include "log.h"
 
+#ifdef FULL_FEATURE
+#include "mq-mgr.h"
+#endif
+
+#include <pthread.h>
+
 #define DEFAULT_MAX_CONNECTIONS 100
 
 struct _CcnetGroupManagerPriv {
     CcnetDB	*db;
     const char *table_name;
+
+    /* user -> GroupClosure */
+    GHashTable *closures;
+    pthread_mutex_t closure_lock;
+    /* Bumped by each invalidation. */
+    guint64 closure_gen;
 };
 
+typedef struct GroupClosure GroupClosure;
+static void group_closure_free (GroupClosure *closure);
+
 static int open_db (CcnetGroupManager *manager);
 static int check_db_table (CcnetGroupManager *manager, CcnetDB *db);
 
@@ -27,6 +42,9 @@ CcnetGroupManager* ccnet_group_manager_new (SeafileSession *session)
 
     manager->session = session;
     manager->priv = g_new0 (CcnetGroupManagerPriv, 1);
+    manager->priv->closures = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                     (GDestroyNotify)group_closure_free);
+    pthread_mutex_init (&manager->priv->closure_lock, NULL);
 
     return manager;
 }
@@ -96,6 +114,14 @@ open_db (CcnetGroupManager *manager)
         return -1;
     
     manager->priv->db = db;
+    return 0;
+}
+
+int
+ccnet_group_manager_create_tables (CcnetGroupManager *manager)
+{
+    CcnetDB *db = manager->priv->db;
+
     if ((manager->session->ccnet_create_tables || seaf_db_type(db) == SEAF_DB_TYPE_PGSQL)
         && check_db_table (manager, db) < 0) {
         ccnet_warning ("Failed to create group db tables.\n");
@@ -329,6 +355,7 @@ create_group_common (CcnetGroupManager *mgr,
 
     seaf_db_commit (trans);
     seaf_db_trans_close (trans);
+    ccnet_group_manager_invalidate_user_groups (mgr, user_name_l);
     g_string_free (sql, TRUE);
     g_free (user_name_l);
     return group_id;
@@ -502,6 +529,13 @@ int ccnet_group_manager_remove_group (CcnetGroupManager *mgr,
     seaf_db_statement_query (db, sql->str, 1, "int", group_id);
 
     g_string_free (sql, TRUE);
+
+    ccnet_group_manager_invalidate_user_groups (mgr, NULL);
+
+#ifdef FULL_FEATURE
+    /* Members of the group and its sub-groups are gone. */
+    seaf_repo_manager_notify_perm_change (seaf->repo_mgr, NULL, NULL);
+#endif
     
     return 0;
 }
@@ -547,6 +581,7 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
     int rc = seaf_db_statement_query (db, "INSERT INTO GroupUser (group_id, user_name, is_staff) VALUES (?, ?, ?)",
                                        3, "int", group_id, "string", member_name_l,
                                        "int", 0);
+    ccnet_group_manager_invalidate_user_groups (mgr, member_name_l);
     g_free (member_name_l);
     if (rc < 0) {
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to add member to group");
@@ -556,6 +591,68 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
     return 0;
 }
 
+static gboolean
+collect_member_names (CcnetDBRow *row, void *data)
+{
+    GHashTable *members = data;
+    char *user_name = g_strdup (seaf_db_row_get_column_text (row, 0));
+
+    g_hash_table_replace (members, user_name, user_name);
+
+    return TRUE;
+}
+
+int ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                     int group_id,
+                                     const char *user_name,
+                                     GList *member_names,
+                                     GError **error)
+{
+    CcnetDB *db = mgr->priv->db;
+    GHashTable *members;
+    SeafDBBatch *batch;
+    GList *ptr;
+    int rc;
+
+    /* check whether group exists */
+    if (!check_group_exists (mgr, db, group_id)) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
+        return -1;
+    }
+
+    members = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    rc = seaf_db_statement_foreach_row (db,
+                                        "SELECT user_name FROM GroupUser WHERE group_id = ?",
+                                        collect_member_names, members,
+                                        1, "int", group_id);
+    if (rc < 0) {
+        g_hash_table_destroy (members);
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add members to group");
+        return -1;
+    }
+
+    batch = seaf_db_batch_new (db, "INSERT INTO GroupUser (group_id, user_name, is_staff)", 3);
+    for (ptr = member_names; ptr; ptr = ptr->next) {
+        char *member_name_l = g_ascii_strdown ((char *)ptr->data, -1);
+        if (g_hash_table_lookup (members, member_name_l)) {
+            g_free (member_name_l);
+            continue;
+        }
+        seaf_db_batch_add_row (batch, "int", group_id, "string", member_name_l,
+                               "int", 0);
+        g_hash_table_insert (members, member_name_l, member_name_l);
+    }
+    rc = seaf_db_batch_finish (batch);
+    g_hash_table_destroy (members);
+    ccnet_group_manager_invalidate_user_groups (mgr, NULL);
+    if (rc < 0) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add members to group");
+        return -1;
+    }
+
+    return 0;
+}
+
 int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name,
@@ -579,6 +676,11 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
 
     sql = "DELETE FROM GroupUser WHERE group_id=? AND user_name=?";
     seaf_db_statement_query (db, sql, 2, "int", group_id, "string", member_name);
+    ccnet_group_manager_invalidate_user_groups (mgr, member_name);
+
+#ifdef FULL_FEATURE
+    seaf_repo_manager_notify_perm_change (seaf->repo_mgr, NULL, member_name);
+#endif
 
     return 0;
 }
@@ -653,6 +755,11 @@ int ccnet_group_manager_quit_group (CcnetGroupManager *mgr,
                               "DELETE FROM GroupUser WHERE group_id=? "
                               "AND user_name=?",
                               2, "int", group_id, "string", user_name);
+    ccnet_group_manager_invalidate_user_groups (mgr, user_name);
+
+#ifdef FULL_FEATURE
+    seaf_repo_manager_notify_perm_change (seaf->repo_mgr, NULL, user_name);
+#endif
 
     return 0;
 }
@@ -849,6 +956,166 @@ out:
     return ret;
 }
 
+/*
+ * Group closures.
+ *
+ * Permission checks and repo listings need the groups of a user and all
+ * their ancestor departments. The ids are read with one query joining
+ * GroupStructure, and cached per user for GROUP_CLOSURE_EXPIRE seconds.
+ * Membership and structure changes made through this manager drop the
+ * cached closures of the affected users at once; changes made on other
+ * nodes of a cluster are seen after the expire time.
+ */
+
+#define GROUP_CLOSURE_EXPIRE 300
+#define MAX_CACHED_CLOSURES 100000
+
+struct GroupClosure {
+    /* Group ids in descending order. */
+    GList *group_ids;
+    gint64 expire_time;
+};
+
+static void
+group_closure_free (GroupClosure *closure)
+{
+    g_list_free (closure->group_ids);
+    g_free (closure);
+}
+
+static gboolean
+collect_group_closure_cb (CcnetDBRow *row, void *data)
+{
+    GHashTable *ids = data;
+    int group_id = seaf_db_row_get_column_int (row, 0);
+    const char *path = seaf_db_row_get_column_text (row, 1);
+    char **tokens, **ptr;
+    int id;
+
+    g_hash_table_insert (ids, GINT_TO_POINTER(group_id), GINT_TO_POINTER(group_id));
+    if (!path)
+        return TRUE;
+
+    /* The path lists the ancestors of the group and the group itself. */
+    tokens = g_strsplit (path, ",", -1);
+    for (ptr = tokens; *ptr; ++ptr) {
+        id = atoi (g_strstrip (*ptr));
+        if (id > 0)
+            g_hash_table_insert (ids, GINT_TO_POINTER(id), GINT_TO_POINTER(id));
+    }
+    g_strfreev (tokens);
+
+    return TRUE;
+}
+
+static gint
+group_id_comp_func (gconstpointer a, gconstpointer b)
+{
+    int id_1 = GPOINTER_TO_INT(a), id_2 = GPOINTER_TO_INT(b);
+
+    if (id_1 == id_2)
+        return 0;
+    return id_1 > id_2 ? -1 : 1;
+}
+
+static int
+load_group_closure (CcnetGroupManager *mgr, const char *user_name, GList **group_ids)
+{
+    CcnetDB *db = mgr->priv->db;
+    GHashTable *ids;
+    char *sql;
+    int rc;
+
+    if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL)
+        sql = g_strdup_printf ("SELECT u.group_id, s.path FROM GroupUser u "
+                               "INNER JOIN \"%s\" g ON u.group_id = g.group_id "
+                               "LEFT JOIN GroupStructure s ON u.group_id = s.group_id "
+                               "WHERE u.user_name = ?", mgr->priv->table_name);
+    else
+        sql = g_strdup_printf ("SELECT u.group_id, s.path FROM GroupUser u "
+                               "INNER JOIN `%s` g ON u.group_id = g.group_id "
+                               "LEFT JOIN GroupStructure s ON u.group_id = s.group_id "
+                               "WHERE u.user_name = ?", mgr->priv->table_name);
+
+    ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+    rc = seaf_db_statement_foreach_row (db, sql, collect_group_closure_cb, ids,
+                                        1, "string", user_name);
+    g_free (sql);
+    if (rc < 0) {
+        g_hash_table_destroy (ids);
+        return -1;
+    }
+
+    *group_ids = g_list_sort (g_hash_table_get_keys (ids), group_id_comp_func);
+    g_hash_table_destroy (ids);
+    return 0;
+}
+
+GList *
+ccnet_group_manager_get_group_ids_by_user (CcnetGroupManager *mgr,
+                                           const char *user_name,
+                                           GError **error)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GroupClosure *closure;
+    GList *group_ids = NULL;
+    gint64 now = (gint64)time(NULL);
+    guint64 gen;
+
+    pthread_mutex_lock (&priv->closure_lock);
+    closure = g_hash_table_lookup (priv->closures, user_name);
+    if (closure && closure->expire_time > now) {
+        group_ids = g_list_copy (closure->group_ids);
+        pthread_mutex_unlock (&priv->closure_lock);
+        return group_ids;
+    }
+    gen = priv->closure_gen;
+    pthread_mutex_unlock (&priv->closure_lock);
+
+    if (load_group_closure (mgr, user_name, &group_ids) < 0) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to get groups of user");
+        return NULL;
+    }
+
+    pthread_mutex_lock (&priv->closure_lock);
+    /* Don't cache a closure read before an invalidation. */
+    if (gen == priv->closure_gen) {
+        if (g_hash_table_size (priv->closures) >= MAX_CACHED_CLOSURES)
+            g_hash_table_remove_all (priv->closures);
+        closure = g_new0 (GroupClosure, 1);
+        closure->group_ids = g_list_copy (group_ids);
+        closure->expire_time = now + GROUP_CLOSURE_EXPIRE;
+        g_hash_table_replace (priv->closures, g_strdup (user_name), closure);
+    }
+    pthread_mutex_unlock (&priv->closure_lock);
+
+    return group_ids;
+}
+
+void
+ccnet_group_manager_invalidate_user_groups (CcnetGroupManager *mgr,
+                                            const char *user_name)
+{
+    CcnetGroupManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->closure_lock);
+    ++priv->closure_gen;
+    if (user_name)
+        g_hash_table_remove (priv->closures, user_name);
+    else
+        g_hash_table_remove_all (priv->closures);
+    pthread_mutex_unlock (&priv->closure_lock);
+
+#ifdef FULL_FEATURE
+    /* The Go file server keeps its own closures. */
+    if (seaf->go_fileserver) {
+        char *buf = g_strdup_printf ("group-change\t%s", user_name ? user_name : "");
+        seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_PERM, buf);
+        g_free (buf);
+    }
+#endif
+}
+
 static gboolean
 get_ccnetgroup_cb (CcnetDBRow *row, void *data)
 {
@@ -1088,6 +1355,11 @@ ccnet_group_manager_remove_group_user (CcnetGroupManager *mgr,
                               "DELETE FROM GroupUser "
                               "WHERE user_name = ?",
                               1, "string", user);
+    ccnet_group_manager_invalidate_user_groups (mgr, user);
+
+#ifdef FULL_FEATURE
+    seaf_repo_manager_notify_perm_change (seaf->repo_mgr, NULL, user);
+#endif
 
     return 0;
 }
@@ -1482,6 +1754,8 @@ ccnet_group_manager_update_group_user (CcnetGroupManager *mgr,
                                   "UPDATE GroupUser SET user_name=? "
                                   "WHERE user_name = ?",
                                   2, "string", new_email, "string", old_email);
+    ccnet_group_manager_invalidate_user_groups (mgr, old_email);
+    ccnet_group_manager_invalidate_user_groups (mgr, new_email);
     if (rc < 0){
         return -1;
     }
@@ -21,6 +21,10 @@ CcnetGroupManager* ccnet_group_manager_new (SeafileSession *session);
 int
 ccnet_group_manager_prepare (CcnetGroupManager *manager);
 
+/* Creates missing tables if configured to, after prepare. */
+int
+ccnet_group_manager_create_tables (CcnetGroupManager *manager);
+
 void ccnet_group_manager_start (CcnetGroupManager *manager);
 
 int ccnet_group_manager_create_group (CcnetGroupManager *mgr,
@@ -47,6 +51,13 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
                                     const char *member_name,
                                     GError **error);
 
+/* Add the users of @member_names that are not members yet. */
+int ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                     int group_id,
+                                     const char *user_name,
+                                     GList *member_names,
+                                     GError **error);
+
 int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name,
@@ -79,6 +90,20 @@ ccnet_group_manager_get_groups_by_user (CcnetGroupManager *mgr,
                                         gboolean return_ancestors,
                                         GError **error);
 
+/*
+ * The ids of the groups of @user_name and their ancestors, in descending
+ * order, as GINT_TO_POINTER values. Cached per user; free with g_list_free().
+ */
+GList *
+ccnet_group_manager_get_group_ids_by_user (CcnetGroupManager *mgr,
+                                           const char *user_name,
+                                           GError **error);
+
+/* Drop the cached groups of @user_name, or of all users if it's NULL. */
+void
+ccnet_group_manager_invalidate_user_groups (CcnetGroupManager *mgr,
+                                            const char *user_name);
+
 CcnetGroup *
 ccnet_group_manager_get_group (CcnetGroupManager *mgr, int group_id,
                                GError **error);
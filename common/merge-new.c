@@ -1,15 +1,27 @@
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "merge-new.h"
 #include "vc-common.h"
+#include "arena.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_MERGE
 #include "log.h"
 
+/* Threads merging sub-directories besides the callers of seaf_merge_trees().
+ * A merge that finds no free thread goes on in the calling thread, so
+ * nested merges never wait for each other.
+ */
+#define MAX_MERGE_THREADS 4
+
+static gint n_merge_threads = 0;
+
 static int
 merge_trees_recursive (const char *store_id, int version,
                        int n, SeafDir *trees[],
                        const char *basedir,
-                       MergeOptions *opt);
+                       MergeOptions *opt,
+                       char *merged_root);
 
 static char *
 merge_conflict_filename (const char *store_id, int version,
@@ -40,7 +52,7 @@ merge_conflict_filename (const char *store_id, int version,
             goto out;
         }
         modifier = g_strdup(commit->creator_name);
-        mtime = (gint64)time(NULL);
+        mtime = opt->merge_time;
         seaf_commit_unref (commit);
     }
 
@@ -72,13 +84,16 @@ merge_conflict_dirname (const char *store_id, int version,
     modifier = g_strdup(commit->creator_name);
     seaf_commit_unref (commit);
 
-    conflict_name = gen_conflict_path (dirname, modifier, (gint64)time(NULL));
+    conflict_name = gen_conflict_path (dirname, modifier, opt->merge_time);
 
 out:
     g_free (modifier);
     return conflict_name;
 }
 
+/* The dirents added to dents_out are borrowed from the merged trees,
+ * or allocated in the arena of the tree they are added to.
+ */
 static int
 merge_entries (const char *store_id, int version,
                int n, SeafDirent *dents[],
@@ -116,17 +131,17 @@ merge_entries (const char *store_id, int version,
         if (strcmp (head->id, remote->id) == 0) {
             seaf_debug ("%s%s: files match\n", basedir, head->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+            *dents_out = g_list_prepend (*dents_out, head);
         } else if (base && strcmp (base->id, head->id) == 0) {
             seaf_debug ("%s%s: unchanged in head, changed in remote\n",
                         basedir, head->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+            *dents_out = g_list_prepend (*dents_out, remote);
         } else if (base && strcmp (base->id, remote->id) == 0) {
             seaf_debug ("%s%s: unchanged in remote, changed in head\n",
                         basedir, head->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+            *dents_out = g_list_prepend (*dents_out, head);
         } else {
             /* File content conflict. */
 
@@ -146,10 +161,10 @@ merge_entries (const char *store_id, int version,
             remote->name = conflict_name;
             remote->name_len = strlen (remote->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+            *dents_out = g_list_prepend (*dents_out, head);
+            *dents_out = g_list_prepend (*dents_out, remote);
 
-            opt->conflict = TRUE;
+            g_atomic_int_set (&opt->conflict, TRUE);
         }
     } else if (base && !head && remote) {
         if (strcmp (base->id, remote->id) != 0) {
@@ -173,9 +188,9 @@ merge_entries (const char *store_id, int version,
                 remote->name = conflict_name;
                 remote->name_len = strlen (remote->name);
 
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+                *dents_out = g_list_prepend (*dents_out, remote);
 
-                opt->conflict = TRUE;
+                g_atomic_int_set (&opt->conflict, TRUE);
             } else {
                 /* Deleted in head and changed in remote. */
 
@@ -183,7 +198,7 @@ merge_entries (const char *store_id, int version,
                             basedir, remote->name);
 
                 /* Keep version of remote. */
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+                *dents_out = g_list_prepend (*dents_out, remote);
             }
         } else {
             /* If base and remote match, the file should not be added to
@@ -215,9 +230,9 @@ merge_entries (const char *store_id, int version,
                 dents[2]->name = conflict_name;
                 dents[2]->name_len = strlen (dents[2]->name);
 
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+                *dents_out = g_list_prepend (*dents_out, head);
 
-                opt->conflict = TRUE;
+                g_atomic_int_set (&opt->conflict, TRUE);
             } else {
                 /* Deleted in remote and changed in head. */
 
@@ -225,7 +240,7 @@ merge_entries (const char *store_id, int version,
                             basedir, head->name);
 
                 /* Keep version of remote. */
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+                *dents_out = g_list_prepend (*dents_out, head);
             }
         } else {
             /* If base and head match, the file should not be added to
@@ -239,7 +254,7 @@ merge_entries (const char *store_id, int version,
             /* Added in remote. */
             seaf_debug ("%s%s: added in remote\n", basedir, remote->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+            *dents_out = g_list_prepend (*dents_out, remote);
         } else if (dents[0] != NULL && strcmp(dents[0]->id, dents[1]->id) == 0) {
             /* Contents in the dir is not changed.
              * The dir will be deleted in merge_directories().
@@ -247,7 +262,7 @@ merge_entries (const char *store_id, int version,
             seaf_debug ("%s%s: dir in head will be replaced by file in remote\n",
                         basedir, remote->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+            *dents_out = g_list_prepend (*dents_out, remote);
         } else {
             /* D/F conflict:
              * Contents of the dir is changed in head, while
@@ -270,16 +285,16 @@ merge_entries (const char *store_id, int version,
             remote->name = conflict_name;
             remote->name_len = strlen (remote->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
+            *dents_out = g_list_prepend (*dents_out, remote);
 
-            opt->conflict = TRUE;
+            g_atomic_int_set (&opt->conflict, TRUE);
         }
     } else if (!base && head && !remote) {
         if (!dents[2]) {
             /* Added in remote. */
             seaf_debug ("%s%s: added in head\n", basedir, head->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+            *dents_out = g_list_prepend (*dents_out, head);
         } else if (dents[0] != NULL && strcmp(dents[0]->id, dents[2]->id) == 0) {
             /* Contents in the dir is not changed.
              * The dir will be deleted in merge_directories().
@@ -287,7 +302,7 @@ merge_entries (const char *store_id, int version,
             seaf_debug ("%s%s: dir in remote will be replaced by file in head\n",
                         basedir, head->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+            *dents_out = g_list_prepend (*dents_out, head);
         } else {
             /* D/F conflict:
              * Contents of the dir is changed in remote, while
@@ -309,9 +324,9 @@ merge_entries (const char *store_id, int version,
             dents[2]->name = conflict_name;
             dents[2]->name_len = strlen (dents[2]->name);
 
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
+            *dents_out = g_list_prepend (*dents_out, head);
 
-            opt->conflict = TRUE;
+            g_atomic_int_set (&opt->conflict, TRUE);
         }
     } else if (base && !head && !remote) {
         /* Don't need to add anything to dents_out. */
@@ -326,12 +341,14 @@ merge_directories (const char *store_id, int version,
                    int n, SeafDirent *dents[],
                    const char *basedir,
                    GList **dents_out,
+                   SeafArena *arena,
                    MergeOptions *opt)
 {
     SeafDir *dir;
     SeafDir *sub_dirs[3];
     char *dirname = NULL;
     char *new_basedir;
+    char merged_root[41];
     int ret = 0;
     int dir_mask = 0, i;
     SeafDirent *merged_dent;
@@ -354,7 +371,7 @@ merge_directories (const char *store_id, int version,
         case 2:
             /* only head is dir, add to result directly, no need to merge. */
             seaf_debug ("%s%s: only head is dir\n", basedir, dents[1]->name);
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(dents[1]));
+            *dents_out = g_list_prepend (*dents_out, dents[1]);
             return 0;
         case 3:
             if (strcmp (dents[0]->id, dents[1]->id) == 0) {
@@ -368,7 +385,7 @@ merge_directories (const char *store_id, int version,
         case 4:
             /* only remote is dir, add to result directly, no need to merge. */
             seaf_debug ("%s%s: only remote is dir\n", basedir, dents[2]->name);
-            *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(dents[2]));
+            *dents_out = g_list_prepend (*dents_out, dents[2]);
             return 0;
         case 5:
             if (strcmp (dents[0]->id, dents[2]->id) == 0) {
@@ -385,17 +402,17 @@ merge_directories (const char *store_id, int version,
                 /* Head and remote match. */
                 seaf_debug ("%s%s: dir is the same in head and remote\n",
                             basedir, dents[1]->name);
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(dents[1]));
+                *dents_out = g_list_prepend (*dents_out, dents[1]);
                 return 0;
             } else if (dents[0] && strcmp(dents[0]->id, dents[1]->id) == 0) {
                 seaf_debug ("%s%s: dir changed in remote but unchanged in head\n",
                             basedir, dents[1]->name);
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(dents[2]));
+                *dents_out = g_list_prepend (*dents_out, dents[2]);
                 return 0;
             } else if (dents[0] && strcmp(dents[0]->id, dents[2]->id) == 0) {
                 seaf_debug ("%s%s: dir changed in head but unchanged in remote\n",
                             basedir, dents[1]->name);
-                *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(dents[1]));
+                *dents_out = g_list_prepend (*dents_out, dents[1]);
                 return 0;
             }
 
@@ -418,7 +435,7 @@ merge_directories (const char *store_id, int version,
                 ret = -1;
                 goto free_sub_dirs;
             }
-            opt->visit_dirs++;
+            g_atomic_int_inc (&opt->visit_dirs);
             sub_dirs[i] = dir;
 
             dirname = dents[i]->name;
@@ -427,18 +444,19 @@ merge_directories (const char *store_id, int version,
 
     new_basedir = g_strconcat (basedir, dirname, "/", NULL);
 
-    ret = merge_trees_recursive (store_id, version, n, sub_dirs, new_basedir, opt);
+    ret = merge_trees_recursive (store_id, version, n, sub_dirs, new_basedir,
+                                 opt, merged_root);
 
     g_free (new_basedir);
 
-    if (n == 3 && opt->do_merge) {
+    if (ret == 0 && n == 3 && opt->do_merge) {
         if (dir_mask == 3 || dir_mask == 6 || dir_mask == 7) {
-            merged_dent = seaf_dirent_dup (dents[1]);
-            memcpy (merged_dent->id, opt->merged_tree_root, 40);
+            merged_dent = seaf_arena_dirent_view (arena, dents[1]);
+            memcpy (merged_dent->id, merged_root, 40);
             *dents_out = g_list_prepend (*dents_out, merged_dent);
         } else if (dir_mask == 5) {
-            merged_dent = seaf_dirent_dup (dents[2]);
-            memcpy (merged_dent->id, opt->merged_tree_root, 40);
+            merged_dent = seaf_arena_dirent_view (arena, dents[2]);
+            memcpy (merged_dent->id, merged_root, 40);
             *dents_out = g_list_prepend (*dents_out, merged_dent);
         }
     }
@@ -450,6 +468,125 @@ free_sub_dirs:
     return ret;
 }
 
+/* Whether the dirs in dents are changed in both head and remote, so
+ * merge_directories() has to merge them entry by entry.
+ */
+static gboolean
+dirs_changed_in_both (SeafDirent *dents[])
+{
+    int dir_mask = 0, i;
+
+    for (i = 0; i < 3; ++i) {
+        if (dents[i] && S_ISDIR(dents[i]->mode))
+            dir_mask |= 1 << i;
+    }
+
+    switch (dir_mask) {
+    case 3:
+        return strcmp (dents[0]->id, dents[1]->id) != 0;
+    case 5:
+        return strcmp (dents[0]->id, dents[2]->id) != 0;
+    case 6:
+    case 7:
+        if (strcmp (dents[1]->id, dents[2]->id) == 0)
+            return FALSE;
+        if (dents[0] && (strcmp (dents[0]->id, dents[1]->id) == 0 ||
+                         strcmp (dents[0]->id, dents[2]->id) == 0))
+            return FALSE;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+typedef struct MergeDirJob {
+    const char *store_id;
+    int version;
+    SeafDirent *dents[3];
+    const char *basedir;
+    MergeOptions *opt;
+
+    GList *dents_out;
+    SeafArena *arena;           /* for dents_out of threaded jobs */
+    int ret;
+    gboolean threaded;
+    pthread_t thread;
+} MergeDirJob;
+
+static void *
+merge_dir_job_thread (void *vjob)
+{
+    MergeDirJob *job = vjob;
+
+    job->ret = merge_directories (job->store_id, job->version, 3, job->dents,
+                                  job->basedir, &job->dents_out, job->arena,
+                                  job->opt);
+    g_atomic_int_add (&n_merge_threads, -1);
+    return NULL;
+}
+
+/* The dents of the job must stay valid until finish_merge_dir_jobs(). */
+static MergeDirJob *
+start_merge_dir_job (const char *store_id, int version,
+                     SeafDirent *dents[],
+                     const char *basedir,
+                     SeafArena *arena,
+                     MergeOptions *opt)
+{
+    MergeDirJob *job = g_new0 (MergeDirJob, 1);
+
+    job->store_id = store_id;
+    job->version = version;
+    memcpy (job->dents, dents, sizeof(job->dents));
+    job->basedir = basedir;
+    job->opt = opt;
+
+    if (g_atomic_int_add (&n_merge_threads, 1) < MAX_MERGE_THREADS) {
+        job->arena = seaf_arena_new (0);
+        if (pthread_create (&job->thread, NULL, merge_dir_job_thread, job) == 0) {
+            job->threaded = TRUE;
+            return job;
+        }
+        seaf_arena_free (job->arena);
+        job->arena = NULL;
+    }
+    g_atomic_int_add (&n_merge_threads, -1);
+
+    job->ret = merge_directories (store_id, version, 3, job->dents,
+                                  basedir, &job->dents_out, arena, opt);
+    return job;
+}
+
+/* Wait for all jobs and move their results to dents_out, in @arena. */
+static int
+finish_merge_dir_jobs (GList *jobs, GList **dents_out, SeafArena *arena)
+{
+    GList *ptr, *p;
+    MergeDirJob *job;
+    int ret = 0;
+
+    for (ptr = jobs; ptr; ptr = ptr->next) {
+        job = ptr->data;
+        if (job->threaded)
+            pthread_join (job->thread, NULL);
+        if (job->ret < 0)
+            ret = -1;
+        if (job->arena) {
+            for (p = job->dents_out; p; p = p->next)
+                *dents_out = g_list_prepend (*dents_out,
+                                             seaf_arena_dirent_view (arena, p->data));
+            g_list_free (job->dents_out);
+            seaf_arena_free (job->arena);
+        } else {
+            *dents_out = g_list_concat (job->dents_out, *dents_out);
+        }
+        g_free (job);
+    }
+    g_list_free (jobs);
+
+    return ret;
+}
+
 static gint
 compare_dirents (gconstpointer a, gconstpointer b)
 {
@@ -462,7 +599,8 @@ static int
 merge_trees_recursive (const char *store_id, int version,
                        int n, SeafDir *trees[],
                        const char *basedir,
-                       MergeOptions *opt)
+                       MergeOptions *opt,
+                       char *merged_root)
 {
     GList *ptrs[3];
     SeafDirent *dents[3];
@@ -473,6 +611,12 @@ merge_trees_recursive (const char *store_id, int version,
     int ret = 0;
     SeafDir *merged_tree;
     GList *merged_dents = NULL;
+    /* Sub-directories changed in both head and remote are merged
+     * concurrently. Callbacks of 2-way merges run in the calling thread.
+     */
+    gboolean parallel = (n == 3 && opt->do_merge);
+    GList *jobs = NULL;
+    SeafArena *arena = seaf_arena_new (0);
 
     for (i = 0; i < n; ++i) {
         if (trees[i])
@@ -525,37 +669,60 @@ merge_trees_recursive (const char *store_id, int version,
             ret = merge_entries (store_id, version,
                                  n, dents, basedir, &merged_dents, opt);
             if (ret < 0)
-                return ret;
+                goto out;
         }
 
         /* Recurse into sub level. */
         if (n_dirs > 0) {
+            if (parallel && dirs_changed_in_both (dents)) {
+                jobs = g_list_prepend (jobs,
+                                       start_merge_dir_job (store_id, version,
+                                                            dents, basedir,
+                                                            arena, opt));
+                continue;
+            }
             ret = merge_directories (store_id, version,
-                                     n, dents, basedir, &merged_dents, opt);
+                                     n, dents, basedir, &merged_dents,
+                                     arena, opt);
             if (ret < 0)
-                return ret;
+                goto out;
         }
     }
 
+out:
+    if (finish_merge_dir_jobs (jobs, &merged_dents, arena) < 0)
+        ret = -1;
+    if (ret < 0) {
+        g_list_free (merged_dents);
+        seaf_arena_free (arena);
+        return ret;
+    }
+
     if (n == 3 && opt->do_merge) {
         merged_dents = g_list_sort (merged_dents, compare_dirents);
         merged_tree = seaf_dir_new (NULL, merged_dents,
                                     dir_version_from_repo_version(version));
 
-        memcpy (opt->merged_tree_root, merged_tree->dir_id, 40);
+        memcpy (merged_root, merged_tree->dir_id, 40);
+        merged_root[40] = '\0';
 
-        if ((trees[1] && strcmp (trees[1]->dir_id, merged_tree->dir_id) == 0) ||
-            (trees[2] && strcmp (trees[2]->dir_id, merged_tree->dir_id) == 0)) {
-            seaf_dir_free (merged_tree);
-        } else {
+        if (!(trees[1] && strcmp (trees[1]->dir_id, merged_tree->dir_id) == 0) &&
+            !(trees[2] && strcmp (trees[2]->dir_id, merged_tree->dir_id) == 0)) {
             ret = seaf_dir_save (seaf->fs_mgr, store_id, version, merged_tree);
-            seaf_dir_free (merged_tree);
             if (ret < 0) {
                 seaf_warning ("Failed to save merged tree %s:%s.\n", store_id, basedir);
             }
         }
+
+        /* The entries are borrowed, only the list belongs to the tree. */
+        g_list_free (merged_tree->entries);
+        merged_tree->entries = NULL;
+        seaf_dir_free (merged_tree);
+    } else {
+        g_list_free (merged_dents);
     }
 
+    seaf_arena_free (arena);
     return ret;
 }
 
@@ -568,6 +735,22 @@ seaf_merge_trees (const char *store_id, int version,
 
     g_return_val_if_fail (n == 2 || n == 3, -1);
 
+    opt->merge_time = (gint64)time(NULL);
+
+    /* Trees changed on one side only, no dir has to be loaded. */
+    if (n == 3 && opt->do_merge) {
+        if (strcmp (roots[1], roots[2]) == 0 || strcmp (roots[0], roots[2]) == 0) {
+            memcpy (opt->merged_tree_root, roots[1], 40);
+            opt->merged_tree_root[40] = '\0';
+            return 0;
+        }
+        if (strcmp (roots[0], roots[1]) == 0) {
+            memcpy (opt->merged_tree_root, roots[2], 40);
+            opt->merged_tree_root[40] = '\0';
+            return 0;
+        }
+    }
+
     trees = g_new0 (SeafDir *, n);
     for (i = 0; i < n; ++i) {
         root = seaf_fs_manager_get_seafdir (seaf->fs_mgr, store_id, version, roots[i]);
@@ -579,7 +762,8 @@ seaf_merge_trees (const char *store_id, int version,
         trees[i] = root;
     }
 
-    ret = merge_trees_recursive (store_id, version, n, trees, "", opt);
+    ret = merge_trees_recursive (store_id, version, n, trees, "", opt,
+                                 opt->merged_tree_root);
 
     for (i = 0; i < n; ++i)
         seaf_dir_free (trees[i]);
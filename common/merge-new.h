@@ -25,6 +25,9 @@ typedef struct MergeOptions {
     char                merged_tree_root[41]; /* merge result */
     int                 visit_dirs;
     gboolean            conflict;
+    /* set by seaf_merge_trees, used in conflict names not taken from
+     * a file's mtime. */
+    gint64              merge_time;
 } MergeOptions;
 
 int
@@ -1,70 +1,215 @@
 #include "common.h"
+
+#include <pthread.h>
+
 #include "log.h"
 #include "utils.h"
 #include "mq-mgr.h"
 
+/*
+ * Each channel keeps its events in a ring buffer of max_events, so that a
+ * stalled consumer can't make the server grow without limit. Events are
+ * stored as strings and turned into json only when they're popped.
+ */
+
+/* Most events returned by one seaf_mq_manager_pop_events() call. */
+#define MAX_POP_EVENTS 1000
+
+typedef struct MqEvent {
+    char *content;
+    gint64 ctime;
+} MqEvent;
+
+typedef struct MqChannel {
+    char *name;
+    pthread_mutex_t lock;
+    MqEvent *events;
+    /* Index of the oldest event. */
+    int head;
+    int len;
+    guint64 n_published;
+    guint64 n_dropped;
+} MqChannel;
+
 typedef struct SeafMqManagerPriv {
-    // chan <-> async_queue
+    /* Protects chans. Channels are never removed. */
+    pthread_mutex_t lock;
+    // chan <-> MqChannel
     GHashTable *chans;
+    int max_events;
+    SeafMqDropPolicy policy;
 } SeafMqManagerPriv;
 
 SeafMqManager *
-seaf_mq_manager_new ()
+seaf_mq_manager_new (int max_events, SeafMqDropPolicy policy)
 {
     SeafMqManager *mgr = g_new0 (SeafMqManager, 1);
     mgr->priv = g_new0 (SeafMqManagerPriv, 1);
-    mgr->priv->chans = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              (GDestroyNotify)g_free,
-                                              (GDestroyNotify)g_async_queue_unref);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->chans = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->max_events = max_events > 0 ? max_events : SEAF_MQ_DEFAULT_MAX_EVENTS;
+    mgr->priv->policy = policy;
 
     return mgr;
 }
 
-static GAsyncQueue *
-seaf_mq_manager_channel_new (SeafMqManager *mgr, const char *channel)
+static MqChannel *
+get_channel (SeafMqManager *mgr, const char *name, gboolean create)
 {
-    GAsyncQueue *async_queue = NULL;
-    async_queue = g_async_queue_new_full ((GDestroyNotify)json_decref);
+    SeafMqManagerPriv *priv = mgr->priv;
+    MqChannel *chan;
 
-    g_hash_table_replace (mgr->priv->chans, g_strdup (channel), async_queue);
+    pthread_mutex_lock (&priv->lock);
+    chan = g_hash_table_lookup (priv->chans, name);
+    if (!chan && create) {
+        chan = g_new0 (MqChannel, 1);
+        chan->name = g_strdup (name);
+        pthread_mutex_init (&chan->lock, NULL);
+        chan->events = g_new0 (MqEvent, priv->max_events);
+        g_hash_table_insert (priv->chans, chan->name, chan);
+    }
+    pthread_mutex_unlock (&priv->lock);
 
-    return async_queue;
+    return chan;
 }
 
 int
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *channel, const char *content)
 {
-    int ret = 0;
+    SeafMqManagerPriv *priv = mgr->priv;
+    MqChannel *chan;
+    MqEvent *event;
+    char *dropped = NULL;
+    guint64 n_dropped = 0;
 
     if (!channel || !content) {
         seaf_warning ("type and content should not be NULL.\n");
         return -1;
     }
 
-    GAsyncQueue *async_queue = g_hash_table_lookup (mgr->priv->chans, channel);
-    if (!async_queue) {
-        async_queue = seaf_mq_manager_channel_new(mgr, channel);
-    }
+    chan = get_channel (mgr, channel, TRUE);
 
-    if (!async_queue) {
-        seaf_warning("%s channel creation failed.\n", channel);
-        return -1;
+    pthread_mutex_lock (&chan->lock);
+    chan->n_published++;
+    if (chan->len == priv->max_events) {
+        n_dropped = ++chan->n_dropped;
+        if (priv->policy == SEAF_MQ_DROP_NEWEST) {
+            pthread_mutex_unlock (&chan->lock);
+            goto out;
+        }
+        /* The slot of the oldest event is reused for the new one. */
+        event = &chan->events[chan->head];
+        dropped = event->content;
+        chan->head = (chan->head + 1) % priv->max_events;
+        chan->len--;
     }
+    event = &chan->events[(chan->head + chan->len) % priv->max_events];
+    event->content = g_strdup (content);
+    event->ctime = (gint64)time(NULL);
+    chan->len++;
+    pthread_mutex_unlock (&chan->lock);
 
-    json_t *msg = json_object();
-    json_object_set_new (msg, "content", json_string(content));
-    json_object_set_new (msg, "ctime", json_integer(time(NULL)));
-    g_async_queue_push (async_queue, msg);
+    g_free (dropped);
 
-    return ret;
+out:
+    /* Logged on the 1st, 2nd, 4th, ... drop. */
+    if (n_dropped && (n_dropped & (n_dropped - 1)) == 0)
+        seaf_warning ("Channel %s is full, %"G_GUINT64_FORMAT" events dropped.\n",
+                      channel, n_dropped);
+    return 0;
+}
+
+/* Called with the channel lock held. */
+static json_t *
+take_event (SeafMqManagerPriv *priv, MqChannel *chan)
+{
+    MqEvent *event = &chan->events[chan->head];
+    json_t *msg;
+
+    msg = json_object ();
+    json_object_set_new (msg, "content", json_string (event->content));
+    json_object_set_new (msg, "ctime", json_integer (event->ctime));
+
+    g_free (event->content);
+    event->content = NULL;
+    chan->head = (chan->head + 1) % priv->max_events;
+    chan->len--;
+
+    return msg;
 }
 
 json_t *
 seaf_mq_manager_pop_event (SeafMqManager *mgr, const char *channel)
 {
-    GAsyncQueue *async_queue = g_hash_table_lookup (mgr->priv->chans, channel);
-    if (!async_queue)
+    MqChannel *chan = get_channel (mgr, channel, FALSE);
+    json_t *msg = NULL;
+
+    if (!chan)
         return NULL;
 
-    return g_async_queue_try_pop (async_queue);
+    pthread_mutex_lock (&chan->lock);
+    if (chan->len > 0)
+        msg = take_event (mgr->priv, chan);
+    pthread_mutex_unlock (&chan->lock);
+
+    return msg;
+}
+
+json_t *
+seaf_mq_manager_pop_events (SeafMqManager *mgr, const char *channel,
+                            int max_events)
+{
+    MqChannel *chan = get_channel (mgr, channel, FALSE);
+    json_t *array = json_array ();
+    int i;
+
+    if (!chan)
+        return array;
+
+    if (max_events <= 0 || max_events > MAX_POP_EVENTS)
+        max_events = MAX_POP_EVENTS;
+
+    pthread_mutex_lock (&chan->lock);
+    for (i = 0; i < max_events && chan->len > 0; ++i)
+        json_array_append_new (array, take_event (mgr->priv, chan));
+    pthread_mutex_unlock (&chan->lock);
+
+    return array;
+}
+
+GList *
+seaf_mq_manager_get_stats (SeafMqManager *mgr)
+{
+    SeafMqManagerPriv *priv = mgr->priv;
+    GHashTableIter iter;
+    gpointer value;
+    MqChannel *chan;
+    SeafMqChannelStats *stats;
+    GList *ret = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    g_hash_table_iter_init (&iter, priv->chans);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        chan = value;
+        stats = g_new0 (SeafMqChannelStats, 1);
+        stats->channel = g_strdup (chan->name);
+        pthread_mutex_lock (&chan->lock);
+        stats->queued = chan->len;
+        stats->n_published = chan->n_published;
+        stats->n_dropped = chan->n_dropped;
+        pthread_mutex_unlock (&chan->lock);
+        ret = g_list_prepend (ret, stats);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
+}
+
+void
+seaf_mq_channel_stats_free (SeafMqChannelStats *stats)
+{
+    if (!stats)
+        return;
+    g_free (stats->channel);
+    g_free (stats);
 }
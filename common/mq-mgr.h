@@ -5,6 +5,17 @@
 
 #define SEAFILE_SERVER_CHANNEL_EVENT "seaf_server.event"
 #define SEAFILE_SERVER_CHANNEL_STATS "seaf_server.stats"
+/* Permission changes, consumed by the Go file server. */
+#define SEAFILE_SERVER_CHANNEL_PERM "seaf_server.perm"
+
+/* Events a channel keeps until they're popped. */
+#define SEAF_MQ_DEFAULT_MAX_EVENTS 100000
+
+/* Which event is dropped when an event is published to a full channel. */
+typedef enum SeafMqDropPolicy {
+    SEAF_MQ_DROP_OLDEST = 0,
+    SEAF_MQ_DROP_NEWEST,
+} SeafMqDropPolicy;
 
 struct SeafMqManagerPriv;
 
@@ -13,12 +24,34 @@ typedef struct SeafMqManager {
 } SeafMqManager;
 
 SeafMqManager *
-seaf_mq_manager_new ();
+seaf_mq_manager_new (int max_events, SeafMqDropPolicy policy);
 
 int
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *channel, const char *content);
 
+/* Returns the oldest event, {"content": ..., "ctime": ...}, or NULL. */
 json_t *
 seaf_mq_manager_pop_event (SeafMqManager *mgr, const char *channel);
 
+/* Returns a json array of up to @max_events of the oldest events. */
+json_t *
+seaf_mq_manager_pop_events (SeafMqManager *mgr, const char *channel,
+                            int max_events);
+
+typedef struct SeafMqChannelStats {
+    char *channel;
+    int queued;
+    guint64 n_published;
+    guint64 n_dropped;
+} SeafMqChannelStats;
+
+/* Returns a list of SeafMqChannelStats, free with
+ * g_list_free_full (list, (GDestroyNotify)seaf_mq_channel_stats_free).
+ */
+GList *
+seaf_mq_manager_get_stats (SeafMqManager *mgr);
+
+void
+seaf_mq_channel_stats_free (SeafMqChannelStats *stats);
+
 #endif
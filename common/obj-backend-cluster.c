@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Commit and fs objects looked up in the cluster cache before the
+ * underlying backend. Objects are named by their content, so a cached copy
+ * never becomes stale. Objects read from the backend or written are added
+ * to the cache, for the other nodes to find them there.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+#include "log.h"
+
+#include "obj-backend.h"
+#include "cluster-cache.h"
+
+typedef struct ClusterPriv {
+    ObjBackend   *base;
+    ClusterCache *cache;
+    char         *obj_type;
+} ClusterPriv;
+
+static char *
+make_key (ClusterPriv *priv, const char *repo_id, const char *obj_id)
+{
+    return g_strdup_printf ("seaf:%s:%s:%s", priv->obj_type, repo_id, obj_id);
+}
+
+static int
+obj_backend_cluster_read (ObjBackend *bend,
+                          const char *repo_id,
+                          int version,
+                          const char *obj_id,
+                          void **data,
+                          int *len)
+{
+    ClusterPriv *priv = bend->priv;
+    char *key = make_key (priv, repo_id, obj_id);
+    int ret;
+
+    if (cluster_cache_get (priv->cache, key, data, len) == 0) {
+        g_free (key);
+        return 0;
+    }
+
+    ret = priv->base->read (priv->base, repo_id, version, obj_id, data, len);
+    if (ret == 0)
+        cluster_cache_set (priv->cache, key, *data, *len);
+
+    g_free (key);
+    return ret;
+}
+
+static int
+obj_backend_cluster_write (ObjBackend *bend,
+                           const char *repo_id,
+                           int version,
+                           const char *obj_id,
+                           void *data,
+                           int len,
+                           gboolean need_sync)
+{
+    ClusterPriv *priv = bend->priv;
+    char *key;
+    int ret;
+
+    ret = priv->base->write (priv->base, repo_id, version, obj_id,
+                             data, len, need_sync);
+    if (ret == 0) {
+        key = make_key (priv, repo_id, obj_id);
+        cluster_cache_set (priv->cache, key, data, len);
+        g_free (key);
+    }
+    return ret;
+}
+
+static gboolean
+obj_backend_cluster_exists (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            const char *obj_id)
+{
+    ClusterPriv *priv = bend->priv;
+
+    return priv->base->exists (priv->base, repo_id, version, obj_id);
+}
+
+static void
+obj_backend_cluster_exists_many (ObjBackend *bend,
+                                 const char *repo_id,
+                                 int version,
+                                 const char **obj_ids,
+                                 int n_objs,
+                                 gboolean *results)
+{
+    ClusterPriv *priv = bend->priv;
+    int i;
+
+    if (priv->base->exists_many) {
+        priv->base->exists_many (priv->base, repo_id, version,
+                                 obj_ids, n_objs, results);
+        return;
+    }
+    for (i = 0; i < n_objs; ++i)
+        results[i] = priv->base->exists (priv->base, repo_id, version, obj_ids[i]);
+}
+
+static void
+obj_backend_cluster_delete (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            const char *obj_id)
+{
+    ClusterPriv *priv = bend->priv;
+    char *key = make_key (priv, repo_id, obj_id);
+
+    priv->base->delete (priv->base, repo_id, version, obj_id);
+    cluster_cache_delete (priv->cache, key);
+
+    g_free (key);
+}
+
+static int
+obj_backend_cluster_foreach_obj (ObjBackend *bend,
+                                 const char *repo_id,
+                                 int version,
+                                 SeafObjFunc process,
+                                 void *user_data)
+{
+    ClusterPriv *priv = bend->priv;
+
+    return priv->base->foreach_obj (priv->base, repo_id, version,
+                                    process, user_data);
+}
+
+static int
+obj_backend_cluster_foreach_obj_parallel (ObjBackend *bend,
+                                          const char *repo_id,
+                                          int version,
+                                          int max_threads,
+                                          SeafObjFunc process,
+                                          void *user_data)
+{
+    ClusterPriv *priv = bend->priv;
+
+    return priv->base->foreach_obj_parallel (priv->base, repo_id, version,
+                                             max_threads, process, user_data);
+}
+
+static int
+obj_backend_cluster_copy (ObjBackend *bend,
+                          const char *src_repo_id,
+                          int src_version,
+                          const char *dst_repo_id,
+                          int dst_version,
+                          const char *obj_id)
+{
+    ClusterPriv *priv = bend->priv;
+
+    return priv->base->copy (priv->base, src_repo_id, src_version,
+                             dst_repo_id, dst_version, obj_id);
+}
+
+static int
+obj_backend_cluster_remove_store (ObjBackend *bend, const char *store_id)
+{
+    ClusterPriv *priv = bend->priv;
+
+    /* Entries of the removed store expire with their ttl. */
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+static int
+obj_backend_cluster_compact (ObjBackend *bend, const char *store_id)
+{
+    ClusterPriv *priv = bend->priv;
+
+    return priv->base->compact (priv->base, store_id);
+}
+
+ObjBackend *
+obj_backend_cluster_new (ObjBackend *base, ClusterCache *cache,
+                         const char *obj_type)
+{
+    ObjBackend *bend;
+    ClusterPriv *priv;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (ClusterPriv, 1);
+    bend->priv = priv;
+
+    priv->base = base;
+    priv->cache = cache;
+    priv->obj_type = g_strdup (obj_type);
+
+    bend->read = obj_backend_cluster_read;
+    bend->write = obj_backend_cluster_write;
+    bend->exists = obj_backend_cluster_exists;
+    bend->exists_many = obj_backend_cluster_exists_many;
+    bend->delete = obj_backend_cluster_delete;
+    bend->foreach_obj = obj_backend_cluster_foreach_obj;
+    if (base->foreach_obj_parallel)
+        bend->foreach_obj_parallel = obj_backend_cluster_foreach_obj_parallel;
+    bend->copy = obj_backend_cluster_copy;
+    bend->remove_store = obj_backend_cluster_remove_store;
+    if (base->compact)
+        bend->compact = obj_backend_cluster_compact;
+
+    return bend;
+}
@@ -12,6 +12,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+int syncfs (int fd);
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #include <io.h>
@@ -20,9 +25,16 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
+#ifdef __linux__
+typedef struct GroupCommit GroupCommit;
+#endif
+
 typedef struct FsPriv {
     char *obj_dir;
     int   dir_len;
+#ifdef __linux__
+    GroupCommit *group_commit;
+#endif
 } FsPriv;
 
 static void
@@ -214,11 +226,224 @@ out:
 #endif
 }
 
+#ifdef __linux__
+
+/*
+ * Group commit of synced writes.
+ *
+ * Instead of fsyncing each object file and its parent dir, writers leave
+ * the unsynced tmp file and queue the rename. A flusher thread takes all
+ * queued requests at once, flushes their contents with one syncfs(),
+ * renames them and fsyncs each affected dir once. Writers return after
+ * their batch is durable, so the guarantee is the same as for a single
+ * synced write.
+ */
+
+typedef struct SyncRequest {
+    const char *tmp_path;
+    const char *obj_path;
+    int ret;
+    gboolean done;
+} SyncRequest;
+
+struct GroupCommit {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t flushed;
+    GPtrArray *pending;
+    int fs_fd;
+    int delay_ms;
+};
+
 static int
-save_obj_contents (const char *path, const void *data, int len, gboolean need_sync)
+fsync_dir (const char *dir)
+{
+    int dir_fd, ret = 0;
+
+    dir_fd = open (dir, O_RDONLY);
+    if (dir_fd < 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", dir, strerror(errno));
+        return 0;
+    }
+
+    /* Some file systems don't support fsyncing a directory. */
+    if (fsync (dir_fd) < 0 && errno != EINVAL) {
+        seaf_warning ("Failed to fsync dir %s: %s.\n", dir, strerror(errno));
+        ret = -1;
+    }
+
+    close (dir_fd);
+    return ret;
+}
+
+static void
+flush_batch (GroupCommit *gc, GPtrArray *batch)
+{
+    GHashTable *dirs;
+    GHashTableIter iter;
+    gpointer key, value;
+    SyncRequest *req;
+    char *dir;
+    guint i;
+    int ret = 0;
+
+    if (syncfs (gc->fs_fd) < 0) {
+        seaf_warning ("[obj backend] Failed to syncfs: %s.\n", strerror(errno));
+        ret = -1;
+    }
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < batch->len; ++i) {
+        req = g_ptr_array_index (batch, i);
+        if (ret < 0) {
+            g_unlink (req->tmp_path);
+            req->ret = -1;
+            continue;
+        }
+        if (rename (req->tmp_path, req->obj_path) < 0) {
+            seaf_warning ("Failed to rename from %s to %s: %s.\n",
+                          req->tmp_path, req->obj_path, strerror(errno));
+            g_unlink (req->tmp_path);
+            req->ret = -1;
+            continue;
+        }
+        dir = g_path_get_dirname (req->obj_path);
+        if (g_hash_table_lookup (dirs, dir))
+            g_free (dir);
+        else
+            g_hash_table_insert (dirs, dir, dir);
+    }
+
+    g_hash_table_iter_init (&iter, dirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (fsync_dir ((const char *)key) < 0) {
+            dir = key;
+            for (i = 0; i < batch->len; ++i) {
+                req = g_ptr_array_index (batch, i);
+                if (req->ret == 0 &&
+                    strncmp (req->obj_path, dir, strlen(dir)) == 0 &&
+                    req->obj_path[strlen(dir)] == '/')
+                    req->ret = -1;
+            }
+        }
+    }
+
+    g_hash_table_destroy (dirs);
+}
+
+static void *
+group_commit_flusher (void *vdata)
+{
+    GroupCommit *gc = vdata;
+    GPtrArray *batch;
+    SyncRequest *req;
+    guint i;
+
+    while (1) {
+        pthread_mutex_lock (&gc->lock);
+        while (gc->pending->len == 0)
+            pthread_cond_wait (&gc->queued, &gc->lock);
+        pthread_mutex_unlock (&gc->lock);
+
+        /* Give concurrent writers a chance to join this batch. */
+        if (gc->delay_ms > 0)
+            g_usleep (gc->delay_ms * 1000);
+
+        pthread_mutex_lock (&gc->lock);
+        batch = gc->pending;
+        gc->pending = g_ptr_array_new ();
+        pthread_mutex_unlock (&gc->lock);
+
+        flush_batch (gc, batch);
+
+        pthread_mutex_lock (&gc->lock);
+        for (i = 0; i < batch->len; ++i) {
+            req = g_ptr_array_index (batch, i);
+            req->done = TRUE;
+        }
+        pthread_cond_broadcast (&gc->flushed);
+        pthread_mutex_unlock (&gc->lock);
+
+        g_ptr_array_free (batch, TRUE);
+    }
+
+    return NULL;
+}
+
+static GroupCommit *
+group_commit_new (const char *obj_dir, int delay_ms)
+{
+    GroupCommit *gc;
+    pthread_t tid;
+    pthread_attr_t attr;
+    int fd;
+
+    fd = open (obj_dir, O_RDONLY);
+    if (fd < 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", obj_dir, strerror(errno));
+        return NULL;
+    }
+
+    gc = g_new0 (GroupCommit, 1);
+    pthread_mutex_init (&gc->lock, NULL);
+    pthread_cond_init (&gc->queued, NULL);
+    pthread_cond_init (&gc->flushed, NULL);
+    gc->pending = g_ptr_array_new ();
+    gc->fs_fd = fd;
+    gc->delay_ms = delay_ms;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create (&tid, &attr, group_commit_flusher, gc) != 0) {
+        seaf_warning ("Failed to start group commit thread.\n");
+        pthread_attr_destroy (&attr);
+        g_ptr_array_free (gc->pending, TRUE);
+        close (fd);
+        g_free (gc);
+        return NULL;
+    }
+    pthread_attr_destroy (&attr);
+
+    return gc;
+}
+
+/*
+ * Queue the rename from @tmp_path to @obj_path and wait until it's durable.
+ */
+static int
+group_commit_wait (GroupCommit *gc, const char *tmp_path, const char *obj_path)
+{
+    SyncRequest req;
+
+    req.tmp_path = tmp_path;
+    req.obj_path = obj_path;
+    req.ret = 0;
+    req.done = FALSE;
+
+    pthread_mutex_lock (&gc->lock);
+    g_ptr_array_add (gc->pending, &req);
+    pthread_cond_signal (&gc->queued);
+    while (!req.done)
+        pthread_cond_wait (&gc->flushed, &gc->lock);
+    pthread_mutex_unlock (&gc->lock);
+
+    return req.ret;
+}
+
+#endif  /* __linux__ */
+
+static int
+save_obj_contents (FsPriv *priv, const char *path, const void *data, int len,
+                   gboolean need_sync)
 {
     char tmp_path[SEAF_PATH_MAX];
     int fd;
+    gboolean group_commit = FALSE;
+
+#ifdef __linux__
+    group_commit = need_sync && priv->group_commit != NULL;
+#endif
 
     snprintf (tmp_path, SEAF_PATH_MAX, "%s.XXXXXX", path);
     fd = g_mkstemp (tmp_path);
@@ -234,7 +459,7 @@ save_obj_contents (const char *path, const void *data, int len, gboolean need_sy
         return -1;
     }
 
-    if (need_sync && fsync_obj_contents (fd) < 0)
+    if (need_sync && !group_commit && fsync_obj_contents (fd) < 0)
         return -1;
 
     /* Close may return error, especially in NFS. */
@@ -244,6 +469,11 @@ save_obj_contents (const char *path, const void *data, int len, gboolean need_sy
         return -1;
     }
 
+#ifdef __linux__
+    if (group_commit)
+        return group_commit_wait (priv->group_commit, tmp_path, path);
+#endif
+
     if (need_sync) {
         if (rename_and_sync (tmp_path, path) < 0)
             return -1;
@@ -304,7 +534,7 @@ obj_backend_fs_write (ObjBackend *bend,
         return -1;
     }
 
-    if (save_obj_contents (path, data, len, need_sync) < 0) {
+    if (save_obj_contents (bend->priv, path, data, len, need_sync) < 0) {
         seaf_warning ("[obj backend] Failed to write obj %s:%s.\n",
                       repo_id, obj_id);
         return -1;
@@ -335,6 +565,43 @@ obj_backend_fs_exists (ObjBackend *bend,
     return FALSE;
 }
 
+#define EXISTS_MANY_MAX_THREADS 16
+
+typedef struct ExistsManyData {
+    ObjBackend *bend;
+    const char *repo_id;
+    int version;
+    const char **obj_ids;
+} ExistsManyData;
+
+static gboolean
+check_obj_exists (int i, void *vdata)
+{
+    ExistsManyData *data = vdata;
+
+    return obj_backend_fs_exists (data->bend, data->repo_id, data->version,
+                                  data->obj_ids[i]);
+}
+
+static void
+obj_backend_fs_exists_many (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            const char **obj_ids,
+                            int n_objs,
+                            gboolean *results)
+{
+    ExistsManyData data;
+
+    data.bend = bend;
+    data.repo_id = repo_id;
+    data.version = version;
+    data.obj_ids = obj_ids;
+
+    run_parallel_checks (n_objs, EXISTS_MANY_MAX_THREADS,
+                         check_obj_exists, &data, results);
+}
+
 static void
 obj_backend_fs_delete (ObjBackend *bend,
                        const char *repo_id,
@@ -406,6 +673,105 @@ out:
     return ret;
 }
 
+typedef struct ForeachParallelData {
+    const char *repo_id;
+    int version;
+    const char *obj_dir;
+    GPtrArray *dnames;
+    SeafObjFunc process;
+    void *user_data;
+    volatile gint stop;
+} ForeachParallelData;
+
+/* Lists one of the fan-out directories of a store. */
+static gboolean
+foreach_obj_in_dir (int i, void *vdata)
+{
+    ForeachParallelData *data = vdata;
+    const char *dname1 = g_ptr_array_index (data->dnames, i);
+    const char *dname2;
+    char obj_id[128];
+    char *path;
+    GDir *dir;
+
+    if (g_atomic_int_get (&data->stop))
+        return TRUE;
+
+    path = g_build_filename (data->obj_dir, dname1, NULL);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        seaf_warning ("Failed to open object dir %s.\n", path);
+        g_free (path);
+        return FALSE;
+    }
+
+    while ((dname2 = g_dir_read_name(dir)) != NULL) {
+        if (g_atomic_int_get (&data->stop))
+            break;
+        snprintf (obj_id, sizeof(obj_id), "%s%s", dname1, dname2);
+        if (!data->process (data->repo_id, data->version, obj_id,
+                            data->user_data)) {
+            g_atomic_int_set (&data->stop, 1);
+            break;
+        }
+    }
+
+    g_dir_close (dir);
+    g_free (path);
+    return TRUE;
+}
+
+static int
+obj_backend_fs_foreach_obj_parallel (ObjBackend *bend,
+                                     const char *repo_id,
+                                     int version,
+                                     int max_threads,
+                                     SeafObjFunc process,
+                                     void *user_data)
+{
+    FsPriv *priv = bend->priv;
+    char *obj_dir = NULL;
+    GDir *dir1;
+    const char *dname1;
+    ForeachParallelData data;
+    gboolean *results;
+
+#if defined MIGRATION || defined SEAFILE_CLIENT
+    if (version > 0)
+        obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+#else
+    obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+#endif
+
+    dir1 = g_dir_open (obj_dir, 0, NULL);
+    if (!dir1) {
+        g_free (obj_dir);
+        return 0;
+    }
+
+    memset (&data, 0, sizeof(data));
+    data.repo_id = repo_id;
+    data.version = version;
+    data.obj_dir = obj_dir;
+    data.dnames = g_ptr_array_new_with_free_func (g_free);
+    data.process = process;
+    data.user_data = user_data;
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL)
+        g_ptr_array_add (data.dnames, g_strdup(dname1));
+    g_dir_close (dir1);
+
+    results = g_new (gboolean, data.dnames->len);
+    run_parallel_jobs (data.dnames->len, max_threads,
+                       foreach_obj_in_dir, &data, results);
+
+    g_free (results);
+    g_ptr_array_free (data.dnames, TRUE);
+    g_free (obj_dir);
+
+    return 0;
+}
+
 static int
 obj_backend_fs_copy (ObjBackend *bend,
                      const char *src_repo_id,
@@ -495,7 +861,8 @@ obj_backend_fs_remove_store (ObjBackend *bend, const char *store_id)
 }
 
 ObjBackend *
-obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
+obj_backend_fs_new (const char *seaf_dir, const char *obj_type,
+                    GKeyFile *config, const char *group)
 {
     ObjBackend *bend;
     FsPriv *priv;
@@ -513,11 +880,23 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
         goto onerror;
     }
 
+#ifdef __linux__
+    if (g_key_file_get_boolean (config, group, "group_commit", NULL)) {
+        int delay_ms = g_key_file_get_integer (config, group,
+                                               "group_commit_delay", NULL);
+        priv->group_commit = group_commit_new (priv->obj_dir, MAX(delay_ms, 0));
+        if (!priv->group_commit)
+            goto onerror;
+    }
+#endif
+
     bend->read = obj_backend_fs_read;
     bend->write = obj_backend_fs_write;
     bend->exists = obj_backend_fs_exists;
+    bend->exists_many = obj_backend_fs_exists_many;
     bend->delete = obj_backend_fs_delete;
     bend->foreach_obj = obj_backend_fs_foreach_obj;
+    bend->foreach_obj_parallel = obj_backend_fs_foreach_obj_parallel;
     bend->copy = obj_backend_fs_copy;
     bend->remove_store = obj_backend_fs_remove_store;
 
@@ -0,0 +1,1013 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that appends small objects to large pack files.
+ *
+ * Layout for each store:
+ *
+ *   <seaf_dir>/storage/<obj_type>-packs/<store_id>/
+ *       index                pack index log
+ *       00000001.pack        pack files
+ *       ...
+ *
+ * A pack file is a sequence of records, each made of a PackObjHeader followed
+ * by the object contents. The index is an append-only log of fixed size
+ * PackIndexRecords mapping an object id to (pack, offset, len). Deleting an
+ * object appends a tombstone record. Replaying the log gives the in-memory
+ * index of a store.
+ *
+ * Several processes (seaf-server, seafserv-gc, seaf-fsck) may access the same
+ * store. Appends to packs and to the index are serialized by an exclusive
+ * flock on the index file. Each process remembers how much of the index it
+ * has replayed and catches up before it reports a miss or writes an object.
+ * Compaction rewrites live objects into new packs and atomically replaces the
+ * index; other processes notice the new inode and reload.
+ */
+
+#include "common.h"
+#include "utils.h"
+#include "obj-backend.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define PACK_OBJ_MAGIC 0x5346504b   /* "SFPK" */
+#define INDEX_FILE_NAME "index"
+
+#define DEFAULT_MAX_PACK_SIZE (64 << 20)
+
+/* Only compact a store when at least this percent of the pack data is dead. */
+#define DEFAULT_COMPACT_THRESHOLD 20
+
+typedef struct PackObjHeader {
+    guint32         magic;
+    unsigned char   obj_id[20];
+    guint32         len;
+} __attribute__((__packed__)) PackObjHeader;
+
+#define INDEX_RECORD_DELETED 1
+
+typedef struct PackIndexRecord {
+    unsigned char   obj_id[20];
+    guint32         pack_id;
+    guint64         offset;     /* offset of the object contents in the pack */
+    guint32         len;
+    guint32         flags;
+} __attribute__((__packed__)) PackIndexRecord;
+
+typedef struct PackEntry {
+    guint32 pack_id;
+    guint64 offset;
+    guint32 len;
+} PackEntry;
+
+typedef struct PackStore {
+    char           *dir;
+    pthread_mutex_t lock;
+
+    int             index_fd;
+    ino_t           index_ino;
+    /* Bytes of the index log already replayed. */
+    gint64          index_pos;
+
+    GHashTable     *entries;    /* raw obj id -> PackEntry */
+    guint32         cur_pack;
+    gint64          live_bytes;
+    gint64          dead_bytes;
+} PackStore;
+
+typedef struct PackPriv {
+    char           *pack_dir;
+    gint64          max_pack_size;
+    int             compact_threshold;
+
+    pthread_mutex_t lock;
+    GHashTable     *stores;     /* store_id -> PackStore */
+} PackPriv;
+
+static PackStore *
+pack_store_new (PackPriv *priv, const char *store_id)
+{
+    PackStore *store = g_new0 (PackStore, 1);
+
+    store->dir = g_build_filename (priv->pack_dir, store_id, NULL);
+    pthread_mutex_init (&store->lock, NULL);
+    store->index_fd = -1;
+    store->entries = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                            g_free, g_free);
+    return store;
+}
+
+static void
+pack_store_reset (PackStore *store)
+{
+    if (store->index_fd >= 0)
+        close (store->index_fd);
+    store->index_fd = -1;
+    store->index_ino = 0;
+    store->index_pos = 0;
+    g_hash_table_remove_all (store->entries);
+    store->cur_pack = 0;
+    store->live_bytes = 0;
+    store->dead_bytes = 0;
+}
+
+static void
+pack_store_free (PackStore *store)
+{
+    pack_store_reset (store);
+    g_hash_table_destroy (store->entries);
+    pthread_mutex_destroy (&store->lock);
+    g_free (store->dir);
+    g_free (store);
+}
+
+static PackStore *
+get_store (PackPriv *priv, const char *store_id)
+{
+    PackStore *store;
+
+    pthread_mutex_lock (&priv->lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (!store) {
+        store = pack_store_new (priv, store_id);
+        g_hash_table_insert (priv->stores, g_strdup(store_id), store);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return store;
+}
+
+static void
+index_path (PackStore *store, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%s", store->dir, INDEX_FILE_NAME);
+}
+
+static void
+pack_path (PackStore *store, guint32 pack_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%08x.pack", store->dir, pack_id);
+}
+
+/*
+ * Open the index file if it's not opened yet. If the index was replaced by
+ * compaction in another process, drop the in-memory index and start over.
+ * Returns -1 on error, 0 if the index doesn't exist and @create is FALSE.
+ */
+static int
+open_index (PackStore *store, gboolean create)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    int fd;
+
+    index_path (store, path);
+
+    if (store->index_fd >= 0) {
+        if (seaf_stat (path, &st) == 0 && st.st_ino == store->index_ino)
+            return 1;
+        pack_store_reset (store);
+    }
+
+    if (create && g_mkdir_with_parents (store->dir, 0777) < 0) {
+        seaf_warning ("[pack backend] Failed to create dir %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+
+    fd = g_open (path, O_RDWR | O_BINARY | (create ? O_CREAT : 0), 0666);
+    if (fd < 0) {
+        if (errno == ENOENT && !create)
+            return 0;
+        seaf_warning ("[pack backend] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        return -1;
+    }
+
+    if (seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[pack backend] Failed to stat %s: %s.\n",
+                      path, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    store->index_fd = fd;
+    store->index_ino = st.st_ino;
+    return 1;
+}
+
+/*
+ * Take the exclusive lock for appending to the store. Since compaction
+ * replaces the index file, re-check after locking that we hold the lock
+ * on the current index.
+ */
+static int
+lock_index (PackStore *store)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    index_path (store, path);
+
+    while (1) {
+        if (open_index (store, TRUE) < 0)
+            return -1;
+
+        if (flock (store->index_fd, LOCK_EX) < 0) {
+            seaf_warning ("[pack backend] Failed to lock %s: %s.\n",
+                          path, strerror(errno));
+            return -1;
+        }
+
+        if (seaf_stat (path, &st) == 0 && st.st_ino == store->index_ino)
+            return 0;
+
+        flock (store->index_fd, LOCK_UN);
+        pack_store_reset (store);
+    }
+}
+
+static void
+unlock_index (PackStore *store)
+{
+    if (store->index_fd >= 0)
+        flock (store->index_fd, LOCK_UN);
+}
+
+static void
+apply_index_record (PackStore *store, const PackIndexRecord *rec)
+{
+    PackEntry *entry;
+    guint32 pack_id = ntohl (rec->pack_id);
+    guint32 len = ntohl (rec->len);
+
+    entry = g_hash_table_lookup (store->entries, rec->obj_id);
+
+    if (ntohl (rec->flags) & INDEX_RECORD_DELETED) {
+        if (entry) {
+            store->live_bytes -= entry->len;
+            store->dead_bytes += entry->len;
+            g_hash_table_remove (store->entries, rec->obj_id);
+        }
+        return;
+    }
+
+    if (entry) {
+        store->live_bytes -= entry->len;
+        store->dead_bytes += entry->len;
+    } else {
+        entry = g_new0 (PackEntry, 1);
+        g_hash_table_insert (store->entries, g_memdup (rec->obj_id, 20), entry);
+    }
+    entry->pack_id = pack_id;
+    entry->offset = ntoh64 (rec->offset);
+    entry->len = len;
+    store->live_bytes += len;
+
+    if (pack_id > store->cur_pack)
+        store->cur_pack = pack_id;
+}
+
+#define INDEX_READ_BATCH 4096
+
+/*
+ * Replay index records appended since last time.
+ * @locked is TRUE if the caller already holds the exclusive index lock.
+ */
+static int
+sync_index (PackStore *store, gboolean locked)
+{
+    SeafStat st;
+    PackIndexRecord *recs;
+    gint64 end;
+    ssize_t n;
+    int i, n_recs;
+    int ret = 0;
+
+    if (!locked) {
+        int rc = open_index (store, FALSE);
+        if (rc <= 0)
+            return rc;
+        if (flock (store->index_fd, LOCK_SH) < 0)
+            return -1;
+    }
+
+    if (seaf_fstat (store->index_fd, &st) < 0) {
+        ret = -1;
+        goto out;
+    }
+    /* Ignore a partial record left by a crashed writer. */
+    end = st.st_size - st.st_size % sizeof(PackIndexRecord);
+    if (end <= store->index_pos)
+        goto out;
+
+    recs = g_new (PackIndexRecord, INDEX_READ_BATCH);
+    while (store->index_pos < end) {
+        n_recs = MIN (INDEX_READ_BATCH,
+                      (end - store->index_pos) / sizeof(PackIndexRecord));
+        n = pread (store->index_fd, recs, n_recs * sizeof(PackIndexRecord),
+                   store->index_pos);
+        if (n < 0) {
+            seaf_warning ("[pack backend] Failed to read index in %s: %s.\n",
+                          store->dir, strerror(errno));
+            ret = -1;
+            break;
+        }
+        n_recs = n / sizeof(PackIndexRecord);
+        if (n_recs == 0)
+            break;
+        for (i = 0; i < n_recs; ++i)
+            apply_index_record (store, &recs[i]);
+        store->index_pos += n_recs * sizeof(PackIndexRecord);
+    }
+    g_free (recs);
+
+out:
+    if (!locked)
+        flock (store->index_fd, LOCK_UN);
+    return ret;
+}
+
+static int
+sync_fd (int fd)
+{
+    if (fsync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[pack backend] Failed to fsync: %s.\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Must be called with the index lock held. */
+static int
+append_index_record (PackStore *store, PackIndexRecord *rec, gboolean need_sync)
+{
+    SeafStat st;
+    gint64 end;
+
+    if (seaf_fstat (store->index_fd, &st) < 0)
+        return -1;
+
+    end = st.st_size - st.st_size % sizeof(PackIndexRecord);
+    if (end != st.st_size && ftruncate (store->index_fd, end) < 0) {
+        seaf_warning ("[pack backend] Failed to truncate index in %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+
+    if (pwrite (store->index_fd, rec, sizeof(*rec), end) != sizeof(*rec)) {
+        seaf_warning ("[pack backend] Failed to write index in %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+
+    if (need_sync && sync_fd (store->index_fd) < 0)
+        return -1;
+
+    /* Everything before @end is already replayed by sync_index(). */
+    apply_index_record (store, rec);
+    store->index_pos = end + sizeof(*rec);
+
+    return 0;
+}
+
+/*
+ * Append an object to the current pack, starting a new pack if it's full.
+ * Must be called with the index lock held.
+ */
+static int
+append_to_pack (PackPriv *priv, PackStore *store, guint32 *pack_id,
+                const unsigned char *sha1, const void *data, int len,
+                gboolean need_sync, guint64 *offset)
+{
+    char path[SEAF_PATH_MAX];
+    PackObjHeader hdr;
+    gint64 size;
+    int fd;
+    int ret = 0;
+
+    if (*pack_id == 0)
+        *pack_id = 1;
+
+    pack_path (store, *pack_id, path);
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack backend] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        return -1;
+    }
+
+    size = seaf_util_lseek (fd, 0, SEEK_END);
+    if (size > 0 && size + len > priv->max_pack_size) {
+        close (fd);
+        ++(*pack_id);
+        pack_path (store, *pack_id, path);
+        fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0666);
+        if (fd < 0) {
+            seaf_warning ("[pack backend] Failed to open %s: %s.\n",
+                          path, strerror(errno));
+            return -1;
+        }
+        size = seaf_util_lseek (fd, 0, SEEK_END);
+    }
+    if (size < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    hdr.magic = htonl (PACK_OBJ_MAGIC);
+    memcpy (hdr.obj_id, sha1, 20);
+    hdr.len = htonl ((guint32)len);
+
+    if (pwrite (fd, &hdr, sizeof(hdr), size) != sizeof(hdr) ||
+        pwrite (fd, data, len, size + sizeof(hdr)) != len) {
+        seaf_warning ("[pack backend] Failed to write to %s: %s.\n",
+                      path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (need_sync && sync_fd (fd) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    *offset = size + sizeof(hdr);
+
+out:
+    /* Close may return error, especially in NFS. */
+    if (close (fd) < 0) {
+        seaf_warning ("[pack backend] Failed to close %s: %s.\n",
+                      path, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Look up an object. Catch up with the index log on a miss, since the
+ * object may have been written by another process.
+ */
+static gboolean
+lookup_entry (PackStore *store, const unsigned char *sha1, PackEntry *ret)
+{
+    PackEntry *entry;
+
+    entry = g_hash_table_lookup (store->entries, sha1);
+    if (!entry) {
+        sync_index (store, FALSE);
+        entry = g_hash_table_lookup (store->entries, sha1);
+    }
+    if (!entry)
+        return FALSE;
+
+    *ret = *entry;
+    return TRUE;
+}
+
+static int
+read_pack_entry (PackStore *store, const char *obj_id, PackEntry *entry,
+                 void **data, int *len)
+{
+    char path[SEAF_PATH_MAX];
+    char *buf;
+    int fd;
+
+    pack_path (store, entry->pack_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        return -1;
+
+    buf = g_malloc (entry->len ? entry->len : 1);
+    if (pread (fd, buf, entry->len, entry->offset) != entry->len) {
+        seaf_warning ("[pack backend] Failed to read object %s from %s.\n",
+                      obj_id, path);
+        g_free (buf);
+        close (fd);
+        return -1;
+    }
+    close (fd);
+
+    *data = buf;
+    *len = (int)entry->len;
+    return 0;
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackStore *store = get_store (bend->priv, repo_id);
+    unsigned char sha1[20];
+    PackEntry entry;
+    int ret = -1;
+
+    hex_to_sha1 (obj_id, sha1);
+
+    pthread_mutex_lock (&store->lock);
+
+    if (!lookup_entry (store, sha1, &entry)) {
+        seaf_debug ("[pack backend] Object %s:%s not found.\n", repo_id, obj_id);
+        goto out;
+    }
+
+    ret = read_pack_entry (store, obj_id, &entry, data, len);
+    if (ret < 0 && errno == ENOENT) {
+        /* The pack was removed by compaction in another process. */
+        pack_store_reset (store);
+        if (lookup_entry (store, sha1, &entry))
+            ret = read_pack_entry (store, obj_id, &entry, data, len);
+    }
+
+out:
+    pthread_mutex_unlock (&store->lock);
+    return ret;
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    PackPriv *priv = bend->priv;
+    PackStore *store = get_store (priv, repo_id);
+    unsigned char sha1[20];
+    PackIndexRecord rec;
+    guint32 pack_id;
+    guint64 offset;
+    int ret = 0;
+
+    hex_to_sha1 (obj_id, sha1);
+
+    pthread_mutex_lock (&store->lock);
+
+    if (lock_index (store) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (sync_index (store, TRUE) < 0) {
+        ret = -1;
+        goto unlock;
+    }
+
+    /* Objects are content-addressed. Don't store duplicates. */
+    if (g_hash_table_lookup (store->entries, sha1))
+        goto unlock;
+
+    pack_id = store->cur_pack;
+    if (append_to_pack (priv, store, &pack_id, sha1, data, len,
+                        need_sync, &offset) < 0) {
+        ret = -1;
+        goto unlock;
+    }
+
+    memcpy (rec.obj_id, sha1, 20);
+    rec.pack_id = htonl (pack_id);
+    rec.offset = hton64 (offset);
+    rec.len = htonl ((guint32)len);
+    rec.flags = 0;
+
+    ret = append_index_record (store, &rec, need_sync);
+
+unlock:
+    unlock_index (store);
+out:
+    pthread_mutex_unlock (&store->lock);
+    if (ret < 0)
+        seaf_warning ("[pack backend] Failed to write obj %s:%s.\n",
+                      repo_id, obj_id);
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackStore *store = get_store (bend->priv, repo_id);
+    unsigned char sha1[20];
+    PackEntry entry;
+    gboolean ret;
+
+    hex_to_sha1 (obj_id, sha1);
+
+    pthread_mutex_lock (&store->lock);
+    ret = lookup_entry (store, sha1, &entry);
+    pthread_mutex_unlock (&store->lock);
+
+    return ret;
+}
+
+static void
+obj_backend_pack_exists_many (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              const char **obj_ids,
+                              int n_objs,
+                              gboolean *results)
+{
+    PackStore *store = get_store (bend->priv, repo_id);
+    unsigned char sha1[20];
+    gboolean synced = FALSE;
+    int i;
+
+    pthread_mutex_lock (&store->lock);
+
+    for (i = 0; i < n_objs; ++i) {
+        hex_to_sha1 (obj_ids[i], sha1);
+        results[i] = (g_hash_table_lookup (store->entries, sha1) != NULL);
+        /* Catch up with the index once for the whole batch. */
+        if (!results[i] && !synced) {
+            sync_index (store, FALSE);
+            synced = TRUE;
+            results[i] = (g_hash_table_lookup (store->entries, sha1) != NULL);
+        }
+    }
+
+    pthread_mutex_unlock (&store->lock);
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackStore *store = get_store (bend->priv, repo_id);
+    unsigned char sha1[20];
+    PackIndexRecord rec;
+
+    hex_to_sha1 (obj_id, sha1);
+
+    pthread_mutex_lock (&store->lock);
+
+    if (lock_index (store) < 0)
+        goto out;
+
+    if (sync_index (store, TRUE) < 0 ||
+        !g_hash_table_lookup (store->entries, sha1))
+        goto unlock;
+
+    memset (&rec, 0, sizeof(rec));
+    memcpy (rec.obj_id, sha1, 20);
+    rec.flags = htonl (INDEX_RECORD_DELETED);
+
+    append_index_record (store, &rec, FALSE);
+
+unlock:
+    unlock_index (store);
+out:
+    pthread_mutex_unlock (&store->lock);
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    PackStore *store = get_store (bend->priv, repo_id);
+    GHashTableIter iter;
+    gpointer key, value;
+    char *obj_ids, *pos;
+    guint n_objs, i;
+    int ret = 0;
+
+    pthread_mutex_lock (&store->lock);
+
+    if (sync_index (store, FALSE) < 0) {
+        pthread_mutex_unlock (&store->lock);
+        return -1;
+    }
+
+    /* Don't call @process with the store locked, it may access the store. */
+    n_objs = g_hash_table_size (store->entries);
+    obj_ids = g_malloc (n_objs * 41 + 1);
+    pos = obj_ids;
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        rawdata_to_hex (key, pos, 20);
+        pos += 41;
+    }
+
+    pthread_mutex_unlock (&store->lock);
+
+    for (i = 0, pos = obj_ids; i < n_objs; ++i, pos += 41) {
+        if (!process (repo_id, version, pos, user_data))
+            break;
+    }
+
+    g_free (obj_ids);
+    return ret;
+}
+
+static int
+obj_backend_pack_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (obj_backend_pack_exists (bend, dst_repo_id, dst_version, obj_id))
+        return 0;
+
+    if (obj_backend_pack_read (bend, src_repo_id, src_version,
+                               obj_id, &data, &len) < 0) {
+        seaf_warning ("[pack backend] Failed to read obj %s:%s for copy.\n",
+                      src_repo_id, obj_id);
+        return -1;
+    }
+
+    ret = obj_backend_pack_write (bend, dst_repo_id, dst_version,
+                                  obj_id, data, len, FALSE);
+    g_free (data);
+
+    return ret;
+}
+
+static void
+remove_store_files (const char *dir)
+{
+    GDir *d;
+    const char *dname;
+    char *path;
+
+    d = g_dir_open (dir, 0, NULL);
+    if (!d)
+        return;
+
+    while ((dname = g_dir_read_name (d)) != NULL) {
+        path = g_build_filename (dir, dname, NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+
+    g_dir_close (d);
+}
+
+static int
+obj_backend_pack_remove_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    PackStore *store = NULL;
+    gpointer key = NULL;
+    char *dir;
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup_extended (priv->stores, store_id,
+                                      &key, (gpointer *)&store)) {
+        g_hash_table_steal (priv->stores, store_id);
+        g_free (key);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (store) {
+        /* Wait for operations in progress on this store. */
+        pthread_mutex_lock (&store->lock);
+        pthread_mutex_unlock (&store->lock);
+        pack_store_free (store);
+    }
+
+    dir = g_build_filename (priv->pack_dir, store_id, NULL);
+    remove_store_files (dir);
+    g_rmdir (dir);
+    g_free (dir);
+
+    return 0;
+}
+
+typedef struct CompactEntry {
+    unsigned char sha1[20];
+    PackEntry     entry;
+} CompactEntry;
+
+static int
+compare_compact_entries (const void *a, const void *b)
+{
+    const PackEntry *ea = &((const CompactEntry *)a)->entry;
+    const PackEntry *eb = &((const CompactEntry *)b)->entry;
+
+    if (ea->pack_id != eb->pack_id)
+        return ea->pack_id < eb->pack_id ? -1 : 1;
+    if (ea->offset != eb->offset)
+        return ea->offset < eb->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Must be called with the index lock held. Live objects are copied to new
+ * packs in their original order; the new index is written to a temp file and
+ * renamed over the old one before the old packs are removed.
+ */
+static int
+compact_store (PackPriv *priv, PackStore *store)
+{
+    char path[SEAF_PATH_MAX];
+    char tmp_path[SEAF_PATH_MAX];
+    CompactEntry *live;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint n_live, i;
+    guint32 old_pack, pack_id;
+    guint64 offset;
+    PackIndexRecord rec;
+    void *data;
+    int len;
+    int tmp_fd = -1;
+    int ret = 0;
+
+    n_live = g_hash_table_size (store->entries);
+    live = g_new (CompactEntry, n_live ? n_live : 1);
+    i = 0;
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        memcpy (live[i].sha1, key, 20);
+        live[i].entry = *(PackEntry *)value;
+        ++i;
+    }
+    qsort (live, n_live, sizeof(CompactEntry), compare_compact_entries);
+
+    index_path (store, path);
+    snprintf (tmp_path, SEAF_PATH_MAX, "%s.compact", path);
+    tmp_fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (tmp_fd < 0) {
+        seaf_warning ("[pack backend] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    old_pack = store->cur_pack;
+    pack_id = old_pack + 1;
+
+    for (i = 0; i < n_live; ++i) {
+        char obj_id[41];
+
+        rawdata_to_hex (live[i].sha1, obj_id, 20);
+        if (read_pack_entry (store, obj_id, &live[i].entry, &data, &len) < 0) {
+            ret = -1;
+            goto out;
+        }
+        ret = append_to_pack (priv, store, &pack_id, live[i].sha1,
+                              data, len, TRUE, &offset);
+        g_free (data);
+        if (ret < 0)
+            goto out;
+
+        memcpy (rec.obj_id, live[i].sha1, 20);
+        rec.pack_id = htonl (pack_id);
+        rec.offset = hton64 (offset);
+        rec.len = htonl ((guint32)len);
+        rec.flags = 0;
+        if (writen (tmp_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+            seaf_warning ("[pack backend] Failed to write %s: %s.\n",
+                          tmp_path, strerror(errno));
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (sync_fd (tmp_fd) < 0) {
+        ret = -1;
+        goto out;
+    }
+    close (tmp_fd);
+    tmp_fd = -1;
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[pack backend] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    /* Old packs are no longer referenced by the new index. */
+    for (i = 1; i <= old_pack; ++i) {
+        pack_path (store, i, tmp_path);
+        g_unlink (tmp_path);
+    }
+
+out:
+    if (tmp_fd >= 0) {
+        close (tmp_fd);
+        g_unlink (tmp_path);
+    }
+    g_free (live);
+    return ret;
+}
+
+static int
+obj_backend_pack_compact (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    PackStore *store = get_store (priv, store_id);
+    gint64 total;
+    int ret = 0;
+
+    pthread_mutex_lock (&store->lock);
+
+    if (open_index (store, FALSE) <= 0)
+        goto out;
+
+    if (lock_index (store) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (sync_index (store, TRUE) < 0) {
+        ret = -1;
+        goto unlock;
+    }
+
+    total = store->live_bytes + store->dead_bytes;
+    if (total == 0 || store->dead_bytes * 100 < total * priv->compact_threshold)
+        goto unlock;
+
+    seaf_message ("Compacting object packs in %s, %"G_GINT64_FORMAT
+                  " of %"G_GINT64_FORMAT" bytes are garbage.\n",
+                  store->dir, store->dead_bytes, total);
+
+    ret = compact_store (priv, store);
+
+unlock:
+    unlock_index (store);
+    /* Reload from the new index. */
+    pack_store_reset (store);
+out:
+    pthread_mutex_unlock (&store->lock);
+    return ret;
+}
+
+ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type,
+                      GKeyFile *config, const char *group)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+    int max_pack_size_mb, threshold;
+
+    bend = g_new0(ObjBackend, 1);
+    priv = g_new0(PackPriv, 1);
+    bend->priv = priv;
+
+    priv->pack_dir = g_strdup_printf ("%s/storage/%s-packs", seaf_dir, obj_type);
+    if (g_mkdir_with_parents (priv->pack_dir, 0777) < 0) {
+        seaf_warning ("[Obj Backend] Objects dir %s does not exist and"
+                      " is unable to create\n", priv->pack_dir);
+        g_free (priv->pack_dir);
+        g_free (priv);
+        g_free (bend);
+        return NULL;
+    }
+
+    priv->max_pack_size = DEFAULT_MAX_PACK_SIZE;
+    max_pack_size_mb = g_key_file_get_integer (config, group, "max_pack_size", NULL);
+    if (max_pack_size_mb > 0)
+        priv->max_pack_size = (gint64)max_pack_size_mb << 20;
+
+    priv->compact_threshold = DEFAULT_COMPACT_THRESHOLD;
+    threshold = g_key_file_get_integer (config, group, "compact_threshold", NULL);
+    if (threshold > 0 && threshold <= 100)
+        priv->compact_threshold = threshold;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)pack_store_free);
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->exists_many = obj_backend_pack_exists_many;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+    bend->copy = obj_backend_pack_copy;
+    bend->remove_store = obj_backend_pack_remove_store;
+    bend->compact = obj_backend_pack_compact;
+
+    return bend;
+}
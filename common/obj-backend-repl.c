@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Asynchronous replication of commit and fs objects to a secondary object
+ * backend. Written and copied objects are appended to the replication log
+ * of their type and copied by its shipper thread, see repl-log.h. Objects
+ * that can't be read from the primary are read from the secondary.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+#include "log.h"
+
+#include "obj-backend.h"
+#include "repl-log.h"
+
+typedef struct ReplPriv {
+    ObjBackend   *base;
+    ObjBackend   *secondary;
+    ReplLog      *log;
+} ReplPriv;
+
+static int
+ship_obj (const char *repo_id, int version, const char *obj_id, void *vdata)
+{
+    ReplPriv *priv = vdata;
+    ObjBackend *base = priv->base;
+    ObjBackend *secondary = priv->secondary;
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (secondary->exists (secondary, repo_id, version, obj_id))
+        return 0;
+
+    if (base->read (base, repo_id, version, obj_id, &data, &len) < 0) {
+        /* Removed since it was logged. */
+        return base->exists (base, repo_id, version, obj_id) ? -1 : 0;
+    }
+
+    ret = secondary->write (secondary, repo_id, version, obj_id, data, len, TRUE);
+    if (ret < 0)
+        seaf_warning ("[obj repl] Failed to replicate object %s:%s.\n",
+                      repo_id, obj_id);
+
+    g_free (data);
+    return ret;
+}
+
+static int
+obj_backend_repl_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    ReplPriv *priv = bend->priv;
+    int ret;
+
+    ret = priv->base->read (priv->base, repo_id, version, obj_id, data, len);
+    if (ret < 0) {
+        ret = priv->secondary->read (priv->secondary, repo_id, version,
+                                     obj_id, data, len);
+        if (ret == 0)
+            seaf_message ("[obj repl] Read object %s:%s from the secondary.\n",
+                          repo_id, obj_id);
+    }
+
+    return ret;
+}
+
+static int
+obj_backend_repl_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    ReplPriv *priv = bend->priv;
+    int ret;
+
+    ret = priv->base->write (priv->base, repo_id, version, obj_id,
+                             data, len, need_sync);
+    if (ret == 0)
+        repl_log_append (priv->log, repo_id, version, obj_id);
+
+    return ret;
+}
+
+static gboolean
+obj_backend_repl_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    ReplPriv *priv = bend->priv;
+
+    return priv->base->exists (priv->base, repo_id, version, obj_id);
+}
+
+static void
+obj_backend_repl_exists_many (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              const char **obj_ids,
+                              int n_objs,
+                              gboolean *results)
+{
+    ReplPriv *priv = bend->priv;
+
+    priv->base->exists_many (priv->base, repo_id, version,
+                             obj_ids, n_objs, results);
+}
+
+static void
+obj_backend_repl_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    ReplPriv *priv = bend->priv;
+
+    priv->base->delete (priv->base, repo_id, version, obj_id);
+}
+
+static int
+obj_backend_repl_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    ReplPriv *priv = bend->priv;
+
+    return priv->base->foreach_obj (priv->base, repo_id, version,
+                                    process, user_data);
+}
+
+static int
+obj_backend_repl_foreach_obj_parallel (ObjBackend *bend,
+                                       const char *repo_id,
+                                       int version,
+                                       int max_threads,
+                                       SeafObjFunc process,
+                                       void *user_data)
+{
+    ReplPriv *priv = bend->priv;
+
+    return priv->base->foreach_obj_parallel (priv->base, repo_id, version,
+                                             max_threads, process, user_data);
+}
+
+static int
+obj_backend_repl_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    ReplPriv *priv = bend->priv;
+    int ret;
+
+    ret = priv->base->copy (priv->base, src_repo_id, src_version,
+                            dst_repo_id, dst_version, obj_id);
+    if (ret == 0)
+        repl_log_append (priv->log, dst_repo_id, dst_version, obj_id);
+
+    return ret;
+}
+
+static int
+obj_backend_repl_remove_store (ObjBackend *bend, const char *store_id)
+{
+    ReplPriv *priv = bend->priv;
+
+    return priv->base->remove_store (priv->base, store_id);
+}
+
+static int
+obj_backend_repl_compact (ObjBackend *bend, const char *store_id)
+{
+    ReplPriv *priv = bend->priv;
+
+    return priv->base->compact (priv->base, store_id);
+}
+
+/*
+ * Replicate the objects written to @base to @secondary, via the log named
+ * @obj_type under @seaf_dir. Returns @base if the log can't be set up.
+ */
+ObjBackend *
+obj_backend_repl_new (ObjBackend *base, ObjBackend *secondary,
+                      const char *obj_type, const char *seaf_dir,
+                      GKeyFile *config)
+{
+    ObjBackend *bend;
+    ReplPriv *priv;
+
+    priv = g_new0 (ReplPriv, 1);
+    priv->base = base;
+    priv->secondary = secondary;
+    priv->log = repl_log_new (seaf_dir, obj_type, config, ship_obj, priv);
+    if (!priv->log) {
+        g_free (priv);
+        return base;
+    }
+
+    bend = g_new0 (ObjBackend, 1);
+    bend->priv = priv;
+
+    bend->read = obj_backend_repl_read;
+    bend->write = obj_backend_repl_write;
+    bend->exists = obj_backend_repl_exists;
+    if (base->exists_many)
+        bend->exists_many = obj_backend_repl_exists_many;
+    bend->delete = obj_backend_repl_delete;
+    bend->foreach_obj = obj_backend_repl_foreach_obj;
+    if (base->foreach_obj_parallel)
+        bend->foreach_obj_parallel = obj_backend_repl_foreach_obj_parallel;
+    bend->copy = obj_backend_repl_copy;
+    bend->remove_store = obj_backend_repl_remove_store;
+    if (base->compact)
+        bend->compact = obj_backend_repl_compact;
+
+    return bend;
+}
@@ -0,0 +1,281 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_S3
+
+#include "utils.h"
+#include "log.h"
+
+#include "obj-backend.h"
+#include "s3-client.h"
+
+/* Objects are stored as objects named <repo_id>/<obj_id> in the bucket of
+ * their type. */
+
+typedef struct S3Priv {
+    S3Client *client;
+} S3Priv;
+
+static char *
+obj_key (const char *repo_id, const char *obj_id)
+{
+    return g_strdup_printf ("%s/%s", repo_id, obj_id);
+}
+
+static int
+obj_backend_s3_read (ObjBackend *bend,
+                     const char *repo_id,
+                     int version,
+                     const char *obj_id,
+                     void **data,
+                     int *len)
+{
+    S3Priv *priv = bend->priv;
+    char *key = obj_key (repo_id, obj_id);
+    gboolean not_found;
+    int ret;
+
+    ret = s3_client_get (priv->client, key, data, len, &not_found);
+    if (ret < 0 && not_found)
+        seaf_debug ("[obj backend] Object %s doesn't exist.\n", key);
+    g_free (key);
+
+    return ret;
+}
+
+static int
+obj_backend_s3_write (ObjBackend *bend,
+                      const char *repo_id,
+                      int version,
+                      const char *obj_id,
+                      void *data,
+                      int len,
+                      gboolean need_sync)
+{
+    S3Priv *priv = bend->priv;
+    char *key = obj_key (repo_id, obj_id);
+    int ret;
+
+    /* Objects are durable once the PUT returns. */
+    ret = s3_client_put (priv->client, key, data, len);
+    g_free (key);
+
+    return ret;
+}
+
+static gboolean
+obj_backend_s3_exists (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    char *key = obj_key (repo_id, obj_id);
+    int ret;
+
+    ret = s3_client_head (priv->client, key, NULL, NULL);
+    g_free (key);
+
+    return ret == 1;
+}
+
+static void
+obj_backend_s3_exists_many (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            const char **obj_ids,
+                            int n_objs,
+                            gboolean *results)
+{
+    S3Priv *priv = bend->priv;
+    char **keys = g_new (char *, n_objs);
+    int i;
+
+    for (i = 0; i < n_objs; ++i)
+        keys[i] = obj_key (repo_id, obj_ids[i]);
+
+    s3_client_head_many (priv->client, (const char **)keys, n_objs, results);
+
+    for (i = 0; i < n_objs; ++i)
+        g_free (keys[i]);
+    g_free (keys);
+}
+
+static void
+obj_backend_s3_delete (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    char *key = obj_key (repo_id, obj_id);
+
+    s3_client_delete (priv->client, key);
+    g_free (key);
+}
+
+typedef struct ForeachData {
+    const char *repo_id;
+    int version;
+    SeafObjFunc process;
+    void *user_data;
+    volatile gint stop;
+} ForeachData;
+
+static gboolean
+foreach_key (const char *key, gint64 size, void *vdata)
+{
+    ForeachData *data = vdata;
+    const char *obj_id = strrchr (key, '/');
+
+    if (g_atomic_int_get (&data->stop))
+        return FALSE;
+    if (!obj_id || strlen(obj_id + 1) != 40)
+        return TRUE;
+
+    if (!data->process (data->repo_id, data->version, obj_id + 1,
+                        data->user_data)) {
+        g_atomic_int_set (&data->stop, 1);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int
+obj_backend_s3_foreach_obj (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            SeafObjFunc process,
+                            void *user_data)
+{
+    S3Priv *priv = bend->priv;
+    ForeachData data;
+    char *prefix;
+    int ret;
+
+    memset (&data, 0, sizeof(data));
+    data.repo_id = repo_id;
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+
+    prefix = g_strdup_printf ("%s/", repo_id);
+    ret = s3_client_list (priv->client, prefix, foreach_key, &data);
+    g_free (prefix);
+
+    return ret;
+}
+
+typedef struct ForeachParallelData {
+    S3Client *client;
+    ForeachData data;
+    volatile gint failed;
+} ForeachParallelData;
+
+/* Lists the objects whose ids start with the 2 hex digits of @i. */
+static gboolean
+foreach_obj_with_prefix (int i, void *vdata)
+{
+    ForeachParallelData *pdata = vdata;
+    char *prefix;
+
+    if (g_atomic_int_get (&pdata->data.stop))
+        return TRUE;
+
+    prefix = g_strdup_printf ("%s/%02x", pdata->data.repo_id, i);
+    if (s3_client_list (pdata->client, prefix, foreach_key, &pdata->data) < 0)
+        g_atomic_int_set (&pdata->failed, 1);
+    g_free (prefix);
+
+    return TRUE;
+}
+
+static int
+obj_backend_s3_foreach_obj_parallel (ObjBackend *bend,
+                                     const char *repo_id,
+                                     int version,
+                                     int max_threads,
+                                     SeafObjFunc process,
+                                     void *user_data)
+{
+    S3Priv *priv = bend->priv;
+    ForeachParallelData pdata;
+    gboolean results[256];
+
+    memset (&pdata, 0, sizeof(pdata));
+    pdata.client = priv->client;
+    pdata.data.repo_id = repo_id;
+    pdata.data.version = version;
+    pdata.data.process = process;
+    pdata.data.user_data = user_data;
+
+    run_parallel_jobs (256, MIN (max_threads, s3_client_max_in_flight (priv->client)),
+                       foreach_obj_with_prefix, &pdata, results);
+
+    return pdata.failed ? -1 : 0;
+}
+
+static int
+obj_backend_s3_copy (ObjBackend *bend,
+                     const char *src_repo_id,
+                     int src_version,
+                     const char *dst_repo_id,
+                     int dst_version,
+                     const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    char *src_key = obj_key (src_repo_id, obj_id);
+    char *dst_key = obj_key (dst_repo_id, obj_id);
+    int ret;
+
+    ret = s3_client_copy (priv->client, src_key, dst_key);
+    g_free (src_key);
+    g_free (dst_key);
+
+    return ret;
+}
+
+static int
+obj_backend_s3_remove_store (ObjBackend *bend, const char *store_id)
+{
+    S3Priv *priv = bend->priv;
+    char *prefix = g_strdup_printf ("%s/", store_id);
+    int ret;
+
+    ret = s3_client_delete_prefix (priv->client, prefix);
+    g_free (prefix);
+
+    return ret;
+}
+
+ObjBackend *
+obj_backend_s3_new (GKeyFile *config, const char *group)
+{
+    ObjBackend *bend;
+    S3Priv *priv;
+    S3Client *client;
+
+    client = s3_client_new (config, group);
+    if (!client)
+        return NULL;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (S3Priv, 1);
+    priv->client = client;
+    bend->priv = priv;
+
+    bend->read = obj_backend_s3_read;
+    bend->write = obj_backend_s3_write;
+    bend->exists = obj_backend_s3_exists;
+    bend->exists_many = obj_backend_s3_exists_many;
+    bend->delete = obj_backend_s3_delete;
+    bend->foreach_obj = obj_backend_s3_foreach_obj;
+    bend->foreach_obj_parallel = obj_backend_s3_foreach_obj_parallel;
+    bend->copy = obj_backend_s3_copy;
+    bend->remove_store = obj_backend_s3_remove_store;
+
+    return bend;
+}
+
+#endif  /* HAVE_S3 */
@@ -27,6 +27,16 @@ struct ObjBackend {
                            int version,
                            const char *obj_id);
 
+    /* Check the existence of many objects at once. The result for
+     * obj_ids[i] is stored in results[i]. Optional.
+     */
+    void        (*exists_many) (ObjBackend *bend,
+                                const char *repo_id,
+                                int version,
+                                const char **obj_ids,
+                                int n_objs,
+                                gboolean *results);
+
     void        (*delete) (ObjBackend *bend,
                            const char *repo_id,
                            int version,
@@ -38,6 +48,17 @@ struct ObjBackend {
                                 SeafObjFunc process,
                                 void *user_data);
 
+    /* Like foreach_obj, but lists the store on up to @max_threads threads.
+     * @process may be called from several threads at once, and returning
+     * FALSE from any of them stops the others. Optional.
+     */
+    int         (*foreach_obj_parallel) (ObjBackend *bend,
+                                         const char *repo_id,
+                                         int version,
+                                         int max_threads,
+                                         SeafObjFunc process,
+                                         void *user_data);
+
     int         (*copy) (ObjBackend *bend,
                          const char *src_repo_id,
                          int src_version,
@@ -48,6 +69,10 @@ struct ObjBackend {
     int        (*remove_store) (ObjBackend *bend,
                                 const char *store_id);
 
+    /* Reclaim space used by deleted objects. Optional. */
+    int        (*compact) (ObjBackend *bend,
+                           const char *store_id);
+
     void *priv;
 };
 
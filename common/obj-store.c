@@ -8,6 +8,8 @@
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "cluster-cache.h"
+#include "bg-throttle.h"
 
 struct SeafObjStore {
     ObjBackend   *bend;
@@ -15,7 +17,132 @@ struct SeafObjStore {
 typedef struct SeafObjStore SeafObjStore;
 
 extern ObjBackend *
-obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
+obj_backend_fs_new (const char *seaf_dir, const char *obj_type,
+                    GKeyFile *config, const char *group);
+
+extern ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type,
+                      GKeyFile *config, const char *group);
+
+#ifdef HAVE_S3
+extern ObjBackend *
+obj_backend_s3_new (GKeyFile *config, const char *group);
+#endif
+
+extern ObjBackend *
+obj_backend_cluster_new (ObjBackend *base, ClusterCache *cache,
+                         const char *obj_type);
+
+extern ObjBackend *
+obj_backend_repl_new (ObjBackend *base, ObjBackend *secondary,
+                      const char *obj_type, const char *seaf_dir,
+                      GKeyFile *config);
+
+/*
+ * The backend for each object type is chosen in seafile.conf, e.g.
+ *
+ * [fs_object_backend]
+ * name = pack
+ *
+ * [commit_object_backend]
+ * name = pack
+ *
+ * The default is the "fs" backend, which stores one file per object.
+ * "s3" stores them in an S3 compatible bucket, see s3-client.h.
+ * Setting "group_commit = true" for it batches the fsyncs of synced writes;
+ * "group_commit_delay" (in ms) makes each batch wait for more writers.
+ *
+ * With a [cluster_cache] section, objects are looked up in the cache shared
+ * by the nodes of a cluster before the backend, see cluster-cache.h.
+ *
+ * New objects are replicated to a secondary backend if there is a
+ * [<type>_object_backend_replica] section, configured like the primary one
+ * with "path" as the data dir for "fs" and "pack", see repl-log.h.
+ */
+static ObjBackend *
+load_base_backend (SeafileSession *seaf, const char *obj_type,
+                   const char *group, const char *seaf_dir)
+{
+    ObjBackend *bend;
+    char *name;
+
+    name = g_key_file_get_string (seaf->config, group, "name", NULL);
+
+    if (!name || strcmp (name, "fs") == 0 || strcmp (name, "filesystem") == 0)
+        bend = obj_backend_fs_new (seaf_dir, obj_type, seaf->config, group);
+    else if (strcmp (name, "pack") == 0)
+        bend = obj_backend_pack_new (seaf_dir, obj_type, seaf->config, group);
+#ifdef HAVE_S3
+    else if (strcmp (name, "s3") == 0)
+        bend = obj_backend_s3_new (seaf->config, group);
+#endif
+    else {
+        seaf_warning ("[Object store] Unknown backend %s for %s objects.\n",
+                      name, obj_type);
+        bend = NULL;
+    }
+
+    g_free (name);
+    return bend;
+}
+
+static ObjBackend *
+load_replication (SeafileSession *seaf, const char *obj_type,
+                  const char *group, ObjBackend *base)
+{
+    ObjBackend *secondary = NULL;
+    char *replica_group, *name, *path;
+
+    replica_group = g_strdup_printf ("%s_replica", group);
+    if (!g_key_file_has_group (seaf->config, replica_group)) {
+        g_free (replica_group);
+        return base;
+    }
+
+    name = g_key_file_get_string (seaf->config, replica_group, "name", NULL);
+    path = g_key_file_get_string (seaf->config, replica_group, "path", NULL);
+    if ((!name || g_strcmp0 (name, "s3") != 0) && !path)
+        seaf_warning ("[Object store] path is not set for the %s object replica.\n",
+                      obj_type);
+    else
+        secondary = load_base_backend (seaf, obj_type, replica_group, path);
+
+    g_free (name);
+    g_free (path);
+    g_free (replica_group);
+
+    if (!secondary) {
+        seaf_warning ("[Object store] Failed to load the %s object replica, "
+                      "objects are not replicated.\n", obj_type);
+        return base;
+    }
+
+    return obj_backend_repl_new (base, secondary, obj_type,
+                                 seaf->seaf_dir, seaf->config);
+}
+
+static ObjBackend *
+load_obj_backend (SeafileSession *seaf, const char *obj_type)
+{
+    ObjBackend *bend;
+    char *group;
+
+    group = g_strdup_printf ("%s_object_backend",
+                             strcmp (obj_type, "commits") == 0 ? "commit" : obj_type);
+
+    bend = load_base_backend (seaf, obj_type, group, seaf->seaf_dir);
+    if (bend)
+        bend = load_replication (seaf, obj_type, group, bend);
+
+    if (bend) {
+        ClusterCache *cache = cluster_cache_new (seaf->config);
+        if (cache)
+            bend = obj_backend_cluster_new (bend, cache, obj_type);
+    }
+
+    g_free (group);
+    return bend;
+}
 
 struct SeafObjStore *
 seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
@@ -25,7 +152,7 @@ seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
     if (!store)
         return NULL;
 
-    store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    store->bend = load_obj_backend (seaf, obj_type);
     if (!store->bend) {
         seaf_warning ("[Object store] Failed to load backend.\n");
         g_free (store);
@@ -50,12 +177,18 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->read (bend, repo_id, version, obj_id, data, len);
+    start = bg_throttle_begin ();
+    ret = bend->read (bend, repo_id, version, obj_id, data, len);
+    bg_throttle_charge (start, 1, 0, 0);
+
+    return ret;
 }
 
 int
@@ -91,6 +224,31 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
     return bend->exists (bend, repo_id, version, obj_id);
 }
 
+void
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           int n_objs,
+                           gboolean *results)
+{
+    ObjBackend *bend = obj_store->bend;
+    int i;
+
+    if (!repo_id || !is_uuid_valid(repo_id)) {
+        memset (results, 0, n_objs * sizeof(gboolean));
+        return;
+    }
+
+    if (bend->exists_many) {
+        bend->exists_many (bend, repo_id, version, obj_ids, n_objs, results);
+        return;
+    }
+
+    for (i = 0; i < n_objs; ++i)
+        results[i] = bend->exists (bend, repo_id, version, obj_ids[i]);
+}
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -98,12 +256,15 @@ seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return;
 
-    return bend->delete (bend, repo_id, version, obj_id);
+    start = bg_throttle_begin ();
+    bend->delete (bend, repo_id, version, obj_id);
+    bg_throttle_charge (start, 0, 0, 1);
 }
 
 int
@@ -118,6 +279,23 @@ seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
     return bend->foreach_obj (bend, repo_id, version, process, user_data);
 }
 
+int
+seaf_obj_store_foreach_obj_parallel (struct SeafObjStore *obj_store,
+                                     const char *repo_id,
+                                     int version,
+                                     int max_threads,
+                                     SeafObjFunc process,
+                                     void *user_data)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (max_threads <= 1 || !bend->foreach_obj_parallel)
+        return bend->foreach_obj (bend, repo_id, version, process, user_data);
+
+    return bend->foreach_obj_parallel (bend, repo_id, version, max_threads,
+                                       process, user_data);
+}
+
 int
 seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          const char *src_repo_id,
@@ -142,3 +320,15 @@ seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
 
     return bend->remove_store (bend, store_id);
 }
+
+int
+seaf_obj_store_compact_store (struct SeafObjStore *obj_store,
+                              const char *store_id)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->compact)
+        return 0;
+
+    return bend->compact (bend, store_id);
+}
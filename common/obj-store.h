@@ -38,6 +38,15 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            int version,
                            const char *obj_id);
 
+/* Check existence of @n_objs valid object ids at once. */
+void
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           int n_objs,
+                           gboolean *results);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -56,6 +65,18 @@ seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
                             SeafObjFunc process,
                             void *user_data);
 
+/*
+ * List the objects of a store on up to @max_threads threads, if the backend
+ * supports it. @process must be safe to call from several threads at once.
+ */
+int
+seaf_obj_store_foreach_obj_parallel (struct SeafObjStore *obj_store,
+                                     const char *repo_id,
+                                     int version,
+                                     int max_threads,
+                                     SeafObjFunc process,
+                                     void *user_data);
+
 int
 seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          const char *src_store_id,
@@ -68,4 +89,9 @@ int
 seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
                              const char *store_id);
 
+/* Reclaim space taken by deleted objects, if the backend supports it. */
+int
+seaf_obj_store_compact_store (struct SeafObjStore *obj_store,
+                              const char *store_id);
+
 #endif
@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include "object-list.h"
+#include "utils.h"
 
 
 ObjectList *
@@ -10,8 +11,8 @@ object_list_new ()
 {
     ObjectList *ol = g_new0 (ObjectList, 1);
 
-    ol->obj_hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-    ol->obj_ids = g_ptr_array_new_with_free_func (g_free);
+    ol->obj_set = id_set_new (0);
+    ol->obj_ids = g_byte_array_new ();
 
     return ol;
 }
@@ -19,12 +20,12 @@ object_list_new ()
 void
 object_list_free (ObjectList *ol)
 {
-    if (ol->obj_hash)
-        g_hash_table_destroy (ol->obj_hash);
-    g_ptr_array_free (ol->obj_ids, TRUE);
+    id_set_free (ol->obj_set);
+    g_byte_array_free (ol->obj_ids, TRUE);
     g_free (ol);
 }
 
+/* The serialized list keeps the hex ids, each with its terminating 0. */
 void
 object_list_serialize (ObjectList *ol, uint8_t **buffer, uint32_t *len)
 {
@@ -35,7 +36,8 @@ object_list_serialize (ObjectList *ol, uint8_t **buffer, uint32_t *len)
 
     buf = g_new (uint8_t, 41 * ollen);
     for (i = 0; i < ollen; ++i) {
-        memcpy (&buf[offset], g_ptr_array_index(ol->obj_ids, i), 41);
+        rawdata_to_hex (ol->obj_ids->data + i * ID_SET_RAW_LEN,
+                        (char *)&buf[offset], ID_SET_RAW_LEN);
         offset += 41;
     }
 
@@ -46,10 +48,14 @@ object_list_serialize (ObjectList *ol, uint8_t **buffer, uint32_t *len)
 gboolean
 object_list_insert (ObjectList *ol, const char *object_id)
 {
-    if (g_hash_table_lookup (ol->obj_hash, object_id))
+    unsigned char raw[ID_SET_RAW_LEN];
+
+    if (strlen (object_id) != ID_SET_RAW_LEN * 2 ||
+        hex_to_rawdata (object_id, raw, ID_SET_RAW_LEN) < 0)
+        return FALSE;
+
+    if (id_set_add_raw (ol->obj_set, raw) == 0)
         return FALSE;
-    char *id = g_strdup(object_id);
-    g_hash_table_replace (ol->obj_hash, id, id);
-    g_ptr_array_add (ol->obj_ids, id);
+    g_byte_array_append (ol->obj_ids, raw, ID_SET_RAW_LEN);
     return TRUE;
 }
@@ -5,9 +5,11 @@
 
 #include <glib.h>
 
+#include "id-set.h"
+
 typedef struct {
-    GHashTable  *obj_hash;
-    GPtrArray   *obj_ids;
+    IdSet       *obj_set;
+    GByteArray  *obj_ids;       /* raw 20-byte ids, in insertion order */
 } ObjectList;
 
 
@@ -22,7 +24,8 @@ object_list_serialize (ObjectList *ol, uint8_t **buffer, uint32_t *len);
 
 /**
  * Add object to ObjectList.
- * Return FALSE if it is already in the list, TRUE otherwise. 
+ * Return FALSE if it is already in the list or isn't a valid id,
+ * TRUE otherwise.
  */
 gboolean
 object_list_insert (ObjectList *ol, const char *object_id);
@@ -30,13 +33,13 @@ object_list_insert (ObjectList *ol, const char *object_id);
 inline static gboolean
 object_list_exists (ObjectList *ol, const char *object_id)
 {
-    return (g_hash_table_lookup(ol->obj_hash, object_id) != NULL);
+    return id_set_contains (ol->obj_set, object_id);
 }
 
 inline static int
 object_list_length (ObjectList *ol)
 {
-    return ol->obj_ids->len;
+    return ol->obj_ids->len / ID_SET_RAW_LEN;
 }
 
 #endif
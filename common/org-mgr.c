@@ -6,6 +6,7 @@
 #include "seaf-db.h"
 #include "org-mgr.h"
 #include "seaf-utils.h"
+#include "row-count.h"
 
 #include "utils.h"
 #include "log.h"
@@ -15,8 +16,11 @@
 struct _CcnetOrgManagerPriv
 {
     CcnetDB	*db;
+    RowCounts *row_counts;
 };
 
+#define ORG_COUNT_NAME "orgs"
+
 static int open_db (CcnetOrgManager *manager);
 static int check_db_table (CcnetDB *db);
 
@@ -86,11 +90,25 @@ open_db (CcnetOrgManager *manager)
         return -1;
     
     manager->priv->db = db;
-    if ((manager->session->create_tables || seaf_db_type(db) == SEAF_DB_TYPE_PGSQL)
-         && check_db_table (db) < 0) {
+    manager->priv->row_counts = row_counts_new (db);
+    return 0;
+}
+
+int
+ccnet_org_manager_create_tables (CcnetOrgManager *manager)
+{
+    CcnetDB *db = manager->priv->db;
+    gboolean create = (manager->session->create_tables ||
+                       seaf_db_type(db) == SEAF_DB_TYPE_PGSQL);
+
+    if (create && check_db_table (db) < 0) {
         ccnet_warning ("Failed to create org db tables.\n");
         return -1;
     }
+    if (row_counts_init (manager->priv->row_counts, create) < 0) {
+        ccnet_warning ("Failed to create org count table.\n");
+        return -1;
+    }
 
     return 0;
 }
@@ -208,6 +226,71 @@ static int check_db_table (CcnetDB *db)
     return 0;
 }
 
+static int
+insert_org_row (CcnetOrgManager *mgr, const char *org_name,
+                const char *url_prefix, const char *creator, gint64 ctime)
+{
+    CcnetDBTrans *trans;
+    int rc;
+
+    trans = seaf_db_begin_transaction (mgr->priv->db);
+    if (!trans)
+        return -1;
+
+    rc = seaf_db_trans_query (trans,
+                              "INSERT INTO Organization(org_name, url_prefix,"
+                              " creator, ctime) VALUES (?, ?, ?, ?)",
+                              4, "string", org_name, "string", url_prefix,
+                              "string", creator, "int64", ctime);
+    if (rc < 0) {
+        seaf_db_rollback (trans);
+    } else {
+        row_counts_trans_add (mgr->priv->row_counts, trans, ORG_COUNT_NAME, 1);
+        rc = seaf_db_commit (trans);
+    }
+    seaf_db_trans_close (trans);
+
+    return rc;
+}
+
+static int
+delete_org_row (CcnetOrgManager *mgr, int org_id)
+{
+    CcnetDB *db = mgr->priv->db;
+    CcnetDBTrans *trans;
+    char *sql;
+    gboolean db_err = FALSE;
+    gboolean exists;
+    int rc = -1;
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
+    sql = g_strdup_printf ("SELECT 1 FROM Organization WHERE org_id = ?%s",
+                           row_counts_lock_clause (db));
+    exists = seaf_db_trans_check_for_existence (trans, sql, &db_err,
+                                                1, "int", org_id);
+    g_free (sql);
+    if (db_err)
+        goto rollback;
+
+    if (seaf_db_trans_query (trans, "DELETE FROM Organization WHERE org_id = ?",
+                             1, "int", org_id) < 0)
+        goto rollback;
+    if (exists)
+        row_counts_trans_add (mgr->priv->row_counts, trans, ORG_COUNT_NAME, -1);
+
+    rc = seaf_db_commit (trans);
+    seaf_db_trans_close (trans);
+    return rc;
+
+rollback:
+    seaf_db_rollback (trans);
+    seaf_db_trans_close (trans);
+    return -1;
+}
+
 int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
                                   const char *org_name,
                                   const char *url_prefix,
@@ -218,11 +301,7 @@ int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
     gint64 now = get_current_time();
     int rc;
 
-    rc = seaf_db_statement_query (db,
-                                   "INSERT INTO Organization(org_name, url_prefix,"
-                                   " creator, ctime) VALUES (?, ?, ?, ?)",
-                                   4, "string", org_name, "string", url_prefix,
-                                   "string", creator, "int64", now);
+    rc = insert_org_row (mgr, org_name, url_prefix, creator, now);
     
     if (rc < 0) {
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to create organization");
@@ -240,8 +319,7 @@ int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
     rc = seaf_db_statement_query (db, "INSERT INTO OrgUser (org_id, email, is_staff) values (?, ?, ?)",
                                    3, "int", org_id, "string", creator, "int", 1);
     if (rc < 0) {
-        seaf_db_statement_query (db, "DELETE FROM Organization WHERE org_id=?",
-                                  1, "int", org_id);
+        delete_org_row (mgr, org_id);
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to create organization");
         return -1;
     }
@@ -256,8 +334,7 @@ ccnet_org_manager_remove_org (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
 
-    seaf_db_statement_query (db, "DELETE FROM Organization WHERE org_id = ?",
-                              1, "int", org_id);
+    delete_org_row (mgr, org_id);
 
     seaf_db_statement_query (db, "DELETE FROM OrgUser WHERE org_id = ?",
                               1, "int", org_id);
@@ -327,18 +404,21 @@ ccnet_org_manager_get_all_orgs (CcnetOrgManager *mgr,
 int
 ccnet_org_manager_count_orgs (CcnetOrgManager *mgr)
 {
-    CcnetDB *db = mgr->priv->db;
-    char *sql;
     gint64 ret;
 
-    sql = "SELECT count(*) FROM Organization";
-
-    ret = seaf_db_get_int64 (db, sql);
+    ret = row_counts_get (mgr->priv->row_counts, ORG_COUNT_NAME,
+                          "SELECT count(*) FROM Organization");
     if (ret < 0)
         return -1;
     return ret;
 }
 
+int
+ccnet_org_manager_reset_counts (CcnetOrgManager *mgr)
+{
+    return row_counts_reset (mgr->priv->row_counts);
+}
+
 static gboolean
 get_org_cb (CcnetDBRow *row, void *data)
 {
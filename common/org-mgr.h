@@ -19,6 +19,10 @@ CcnetOrgManager* ccnet_org_manager_new (SeafileSession *session);
 int
 ccnet_org_manager_prepare (CcnetOrgManager *manager);
 
+/* Creates missing tables if configured to, after prepare. */
+int
+ccnet_org_manager_create_tables (CcnetOrgManager *manager);
+
 void
 ccnet_org_manager_start (CcnetOrgManager *manager);
 
@@ -42,6 +46,10 @@ ccnet_org_manager_get_all_orgs (CcnetOrgManager *mgr,
 int
 ccnet_org_manager_count_orgs (CcnetOrgManager *mgr);
 
+/* Drops the stored org count, to be counted again from the table. */
+int
+ccnet_org_manager_reset_counts (CcnetOrgManager *mgr);
+
 CcnetOrganization *
 ccnet_org_manager_get_org_by_url_prefix (CcnetOrgManager *mgr,
                                          const char *url_prefix,
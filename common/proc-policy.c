@@ -0,0 +1,234 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "log.h"
+#include "bg-throttle.h"
+#include "proc-policy.h"
+
+#define RESOURCES_GROUP "resources"
+#define MAX_WEIGHT 10000
+
+/* cgroup of the process managing the others, see move_self_to_leaf(). */
+#define MANAGER_CGROUP "controller"
+
+struct default_weight {
+    const char *name;
+    int weight;
+};
+
+/* The cgroup default is 100. */
+static const struct default_weight default_weights[] = {
+    { "seaf-server", 200 },
+    { "fileserver", 200 },
+    { "seafdav", 100 },
+    { "seafevents", 50 },
+    { "gc", 20 },
+    { "fsck", 20 },
+    { NULL, 0 },
+};
+
+static int
+get_default_weight (const char *name)
+{
+    int i;
+
+    for (i = 0; default_weights[i].name; i++) {
+        if (strcmp (default_weights[i].name, name) == 0)
+            return default_weights[i].weight;
+    }
+    return 0;
+}
+
+static int
+get_weight (GKeyFile *config, const char *group, const char *key, int def)
+{
+    GError *error = NULL;
+    int weight;
+
+    weight = g_key_file_get_integer (config, group, key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return def;
+    }
+    if (weight < 1 || weight > MAX_WEIGHT) {
+        seaf_warning ("Invalid %s %d in [%s], ignored.\n", key, weight, group);
+        return def;
+    }
+    return weight;
+}
+
+ProcPolicy *
+proc_policy_load (GKeyFile *config, const char *name)
+{
+    ProcPolicy *policy;
+    char *group, *root;
+    int def;
+
+    group = g_strdup_printf (RESOURCES_GROUP ".%s", name);
+    root = g_key_file_get_string (config, RESOURCES_GROUP, "cgroup_root", NULL);
+    if (root)
+        g_strstrip (root);
+    if (root && *root == '\0') {
+        g_free (root);
+        root = NULL;
+    }
+
+    if (!root && !g_key_file_has_group (config, group)) {
+        g_free (group);
+        return NULL;
+    }
+
+    policy = g_new0 (ProcPolicy, 1);
+    policy->name = g_strdup (name);
+    policy->io_class = g_key_file_get_string (config, group, "io_priority", NULL);
+
+    if (root) {
+        policy->cgroup = g_build_filename (root, name, NULL);
+        def = get_default_weight (name);
+        policy->cpu_weight = get_weight (config, group, "cpu_weight", def);
+        policy->io_weight = get_weight (config, group, "io_weight", def);
+        policy->cpus = g_key_file_get_string (config, group, "cpus", NULL);
+    } else if (g_key_file_has_key (config, group, "cpu_weight", NULL) ||
+               g_key_file_has_key (config, group, "io_weight", NULL) ||
+               g_key_file_has_key (config, group, "cpus", NULL)) {
+        seaf_warning ("[%s] sets cgroup limits but no cgroup_root is set in "
+                      "[" RESOURCES_GROUP "], they are ignored.\n", group);
+    }
+
+    g_free (root);
+    g_free (group);
+    return policy;
+}
+
+void
+proc_policy_free (ProcPolicy *policy)
+{
+    if (!policy)
+        return;
+
+    g_free (policy->name);
+    g_free (policy->cgroup);
+    g_free (policy->cpus);
+    g_free (policy->io_class);
+    g_free (policy);
+}
+
+static int
+write_cgroup_file (const char *dir, const char *file, const char *value)
+{
+    char *path = g_build_filename (dir, file, NULL);
+    int fd, ret = 0;
+    size_t len = strlen (value);
+
+    fd = open (path, O_WRONLY);
+    if (fd < 0 || write (fd, value, len) != (ssize_t)len) {
+        seaf_warning ("Failed to write %s to %s: %s.\n",
+                      value, path, strerror(errno));
+        ret = -1;
+    }
+    if (fd >= 0)
+        close (fd);
+
+    g_free (path);
+    return ret;
+}
+
+/*
+ * Only cgroups without processes of their own can pass controllers to their
+ * children. If the manager runs in the root, it moves to a leaf beside the
+ * managed processes.
+ */
+static int
+move_self_to_leaf (const char *root)
+{
+    char *procs, *content = NULL, *leaf = NULL;
+    char pid[32];
+    int ret = 0;
+
+    procs = g_build_filename (root, "cgroup.procs", NULL);
+    if (!g_file_get_contents (procs, &content, NULL, NULL))
+        goto out;
+    g_strstrip (content);
+    if (*content == '\0')
+        goto out;
+
+    leaf = g_build_filename (root, MANAGER_CGROUP, NULL);
+    if (g_mkdir (leaf, 0755) < 0 && errno != EEXIST) {
+        seaf_warning ("Failed to create cgroup %s: %s.\n", leaf, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    snprintf (pid, sizeof(pid), "%d", (int)getpid());
+    ret = write_cgroup_file (leaf, "cgroup.procs", pid);
+
+out:
+    g_free (procs);
+    g_free (content);
+    g_free (leaf);
+    return ret;
+}
+
+int
+proc_policy_setup (ProcPolicy *policy)
+{
+    char *root;
+    char value[32];
+    int ret = 0;
+
+    if (!policy || !policy->cgroup)
+        return 0;
+
+    root = g_path_get_dirname (policy->cgroup);
+
+    if (g_mkdir (policy->cgroup, 0755) < 0 && errno != EEXIST) {
+        seaf_warning ("Failed to create cgroup %s: %s.\n",
+                      policy->cgroup, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    move_self_to_leaf (root);
+
+    /* Controllers the parent doesn't have can't be enabled; the limits of
+     * the missing ones fail below and are logged. */
+    write_cgroup_file (root, "cgroup.subtree_control", "+cpu");
+    write_cgroup_file (root, "cgroup.subtree_control", "+io");
+    if (policy->cpus)
+        write_cgroup_file (root, "cgroup.subtree_control", "+cpuset");
+
+    if (policy->cpu_weight > 0) {
+        snprintf (value, sizeof(value), "%d", policy->cpu_weight);
+        write_cgroup_file (policy->cgroup, "cpu.weight", value);
+    }
+    if (policy->io_weight > 0) {
+        snprintf (value, sizeof(value), "default %d", policy->io_weight);
+        write_cgroup_file (policy->cgroup, "io.weight", value);
+    }
+    if (policy->cpus)
+        write_cgroup_file (policy->cgroup, "cpuset.cpus", policy->cpus);
+
+out:
+    if (ret < 0) {
+        g_free (policy->cgroup);
+        policy->cgroup = NULL;
+    }
+    g_free (root);
+    return ret;
+}
+
+void
+proc_policy_enter (ProcPolicy *policy)
+{
+    if (!policy)
+        return;
+
+    /* "0" is the writing process. */
+    if (policy->cgroup)
+        write_cgroup_file (policy->cgroup, "cgroup.procs", "0");
+    if (policy->io_class)
+        bg_set_priority (policy->io_class, 0);
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef PROC_POLICY_H
+#define PROC_POLICY_H
+
+#include <glib.h>
+
+/*
+ * CPU and IO isolation of the server processes. seafile-controller applies
+ * the policy of each process it starts, and seafserv-gc and seaf-fsck apply
+ * their own. Policies are read from seafile.conf:
+ *
+ *   [resources]
+ *   cgroup_root = /sys/fs/cgroup/seafile
+ *
+ *   [resources.fileserver]
+ *   cpu_weight = 400        # cpu.weight, 1 to 10000
+ *   io_weight = 400         # io.weight, 1 to 10000
+ *   cpus = 0-5              # cpuset.cpus
+ *   io_priority = normal    # idle, low or normal, as in bg-throttle.h
+ *
+ * The processes are named seaf-server, fileserver, seafdav, seafevents, gc
+ * and fsck. With a cgroup_root, each process runs in a cgroup of its name
+ * under it; the root must be a cgroup v2 directory writable by the user
+ * running seafile, e.g. one delegated by systemd. Processes without
+ * explicit weights get defaults that give the serving processes twice the
+ * default share, and GC and fsck a fifth of it, so that user traffic keeps
+ * its headroom during maintenance.
+ */
+
+typedef struct ProcPolicy {
+    char *name;
+    /* NULL when cgroups aren't used. */
+    char *cgroup;
+    /* 0 to leave them. */
+    int cpu_weight;
+    int io_weight;
+    char *cpus;
+    char *io_class;
+} ProcPolicy;
+
+/* Returns NULL if nothing is configured for @name. */
+ProcPolicy *
+proc_policy_load (GKeyFile *config, const char *name);
+
+void
+proc_policy_free (ProcPolicy *policy);
+
+/*
+ * Creates the cgroup of @policy and sets its limits. Called from the
+ * process managing it. On errors the cgroup isn't used.
+ */
+int
+proc_policy_setup (ProcPolicy *policy);
+
+/*
+ * Moves the calling process into the cgroup of @policy and sets its io
+ * priority. Called in the process itself, e.g. after fork(). @policy can be
+ * NULL.
+ */
+void
+proc_policy_enter (ProcPolicy *policy);
+
+#endif
@@ -0,0 +1,472 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "repl-log.h"
+
+#define REPL_DIR "replication"
+
+#define DEFAULT_INTERVAL 1
+#define DEFAULT_BATCH_SIZE 1024
+#define DEFAULT_THREADS 8
+#define DEFAULT_MAX_LAG 300
+
+/* Start a new log once this much of the old one is shipped. */
+#define ROTATE_SIZE (16 << 20)
+/* Wait at least this long before retrying a failed batch. */
+#define MAX_RETRY_DELAY 60
+
+/* The same layout is written by the Go fileserver. */
+typedef struct ReplRecord {
+    guint32         ctime;
+    guint32         version;
+    char            store_id[36];
+    char            obj_id[40];
+} __attribute__((__packed__)) ReplRecord;
+
+struct ReplLog {
+    char           *name;
+    char           *path;
+    char           *pos_path;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  appended;
+    int             fd;
+    ino_t           ino;
+    /* Appended by this process since the shipper last woke up. */
+    int             n_appended;
+
+    int             interval;
+    int             batch_size;
+    int             threads;
+    int             max_lag;
+    gboolean        sync_log;
+
+    ReplShipFunc    ship;
+    void           *user_data;
+
+    /* Shipper state. */
+    int             pos_fd;
+    gint64          pos;
+    gint64          last_lag_warning;
+};
+
+static int
+get_int_setting (GKeyFile *config, const char *key, int default_value)
+{
+    GError *error = NULL;
+    int value;
+
+    value = g_key_file_get_integer (config, "replication", key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return default_value;
+    }
+    return value > 0 ? value : default_value;
+}
+
+/* Opens the current log, reopening it if the shipper started a new one. */
+static int
+open_log (ReplLog *log)
+{
+    SeafStat st;
+    int fd;
+
+    if (log->fd >= 0) {
+        if (seaf_stat (log->path, &st) == 0 && st.st_ino == log->ino)
+            return 0;
+        close (log->fd);
+        log->fd = -1;
+    }
+
+    fd = g_open (log->path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[repl] Failed to open %s: %s.\n", log->path, strerror(errno));
+        return -1;
+    }
+    if (seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("[repl] Failed to stat %s: %s.\n", log->path, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    log->fd = fd;
+    log->ino = st.st_ino;
+    return 0;
+}
+
+/* Takes the exclusive lock on the current log. Called with log->lock held. */
+static int
+lock_log (ReplLog *log)
+{
+    SeafStat st;
+
+    while (1) {
+        if (open_log (log) < 0)
+            return -1;
+
+        if (flock (log->fd, LOCK_EX) < 0) {
+            seaf_warning ("[repl] Failed to lock %s: %s.\n", log->path, strerror(errno));
+            return -1;
+        }
+
+        if (seaf_stat (log->path, &st) == 0 && st.st_ino == log->ino)
+            return 0;
+
+        flock (log->fd, LOCK_UN);
+        close (log->fd);
+        log->fd = -1;
+    }
+}
+
+static void
+unlock_log (ReplLog *log)
+{
+    if (log->fd >= 0)
+        flock (log->fd, LOCK_UN);
+}
+
+int
+repl_log_append (ReplLog *log, const char *store_id, int version,
+                 const char *obj_id)
+{
+    ReplRecord rec;
+    SeafStat st;
+    gint64 end;
+    int ret = -1;
+
+    if (strlen (store_id) != 36 || strlen (obj_id) != 40)
+        return -1;
+
+    memset (&rec, 0, sizeof(rec));
+    rec.ctime = htonl ((guint32)time(NULL));
+    rec.version = htonl ((guint32)version);
+    memcpy (rec.store_id, store_id, 36);
+    memcpy (rec.obj_id, obj_id, 40);
+
+    pthread_mutex_lock (&log->lock);
+
+    if (lock_log (log) < 0)
+        goto out;
+
+    if (seaf_fstat (log->fd, &st) < 0) {
+        seaf_warning ("[repl] Failed to stat %s: %s.\n", log->path, strerror(errno));
+        goto unlock;
+    }
+    /* Overwrite a partial record left by a crashed writer. */
+    end = st.st_size - st.st_size % sizeof(ReplRecord);
+    if (pwrite (log->fd, &rec, sizeof(rec), end) != sizeof(rec)) {
+        seaf_warning ("[repl] Failed to append to %s: %s.\n", log->path, strerror(errno));
+        goto unlock;
+    }
+    if (log->sync_log && fdatasync (log->fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[repl] Failed to fsync %s: %s.\n", log->path, strerror(errno));
+        goto unlock;
+    }
+    ret = 0;
+
+    if (++log->n_appended >= log->batch_size)
+        pthread_cond_signal (&log->appended);
+
+unlock:
+    unlock_log (log);
+out:
+    pthread_mutex_unlock (&log->lock);
+    if (ret < 0)
+        seaf_warning ("[repl] Object %s:%s won't be replicated.\n", store_id, obj_id);
+    return ret;
+}
+
+static int
+save_pos (ReplLog *log)
+{
+    guint64 pos = GUINT64_TO_BE ((guint64)log->pos);
+
+    if (pwrite (log->pos_fd, &pos, sizeof(pos), 0) != sizeof(pos) ||
+        (fdatasync (log->pos_fd) < 0 && errno != EINVAL)) {
+        seaf_warning ("[repl] Failed to save %s: %s.\n", log->pos_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Becomes the shipper of the log, unless another process is. */
+static gboolean
+take_shipping (ReplLog *log)
+{
+    guint64 pos = 0;
+    int fd;
+
+    if (log->pos_fd >= 0)
+        return TRUE;
+
+    fd = g_open (log->pos_path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[repl] Failed to open %s: %s.\n", log->pos_path, strerror(errno));
+        return FALSE;
+    }
+    if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        close (fd);
+        return FALSE;
+    }
+
+    if (pread (fd, &pos, sizeof(pos), 0) == sizeof(pos))
+        log->pos = (gint64)GUINT64_FROM_BE (pos);
+    else
+        log->pos = 0;
+    log->pos_fd = fd;
+
+    seaf_message ("[repl] Shipping %s objects from offset %"G_GINT64_FORMAT".\n",
+                  log->name, log->pos);
+    return TRUE;
+}
+
+/*
+ * Replaces the log with an empty one once everything in it is shipped and
+ * it's grown large. Called with the log locked. Returns TRUE if the log is
+ * replaced.
+ */
+static gboolean
+maybe_rotate_log (ReplLog *log, gint64 end)
+{
+    char tmp_path[SEAF_PATH_MAX];
+    int fd;
+
+    if (end != log->pos || end < ROTATE_SIZE)
+        return FALSE;
+
+    snprintf (tmp_path, SEAF_PATH_MAX, "%s.new", log->path);
+    fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[repl] Failed to create %s: %s.\n", tmp_path, strerror(errno));
+        return FALSE;
+    }
+    close (fd);
+
+    if (g_rename (tmp_path, log->path) < 0) {
+        seaf_warning ("[repl] Failed to rotate %s: %s.\n", log->path, strerror(errno));
+        g_unlink (tmp_path);
+        return FALSE;
+    }
+
+    /* If we crash before saving, the offset is past the end of the new log
+     * and is reset on restart.
+     */
+    log->pos = 0;
+    save_pos (log);
+    return TRUE;
+}
+
+typedef struct ShipData {
+    ReplLog *log;
+    ReplRecord *recs;
+} ShipData;
+
+static gboolean
+ship_one (int i, void *vdata)
+{
+    ShipData *data = vdata;
+    ReplRecord *rec = &data->recs[i];
+    char store_id[37], obj_id[41];
+
+    memcpy (store_id, rec->store_id, 36);
+    store_id[36] = 0;
+    memcpy (obj_id, rec->obj_id, 40);
+    obj_id[40] = 0;
+
+    return data->log->ship (store_id, (int)ntohl (rec->version), obj_id,
+                            data->log->user_data) == 0;
+}
+
+static void
+check_lag (ReplLog *log, const ReplRecord *oldest)
+{
+    gint64 now = (gint64)time(NULL);
+    gint64 lag = now - (gint64)ntohl (oldest->ctime);
+
+    if (lag <= log->max_lag || now - log->last_lag_warning < log->max_lag)
+        return;
+
+    log->last_lag_warning = now;
+    seaf_warning ("[repl] Replication of %s objects is %"G_GINT64_FORMAT
+                  "s behind.\n", log->name, lag);
+}
+
+/*
+ * Ships the next batch of records. Returns the number of records shipped,
+ * or -1 if some of them failed and the batch should be retried.
+ */
+static int
+ship_batch (ReplLog *log)
+{
+    SeafStat st;
+    ReplRecord *recs = NULL;
+    ShipData data;
+    gboolean *results = NULL;
+    gint64 end;
+    ssize_t n;
+    int n_recs, i;
+    int ret = -1;
+
+    pthread_mutex_lock (&log->lock);
+    if (lock_log (log) < 0) {
+        pthread_mutex_unlock (&log->lock);
+        return -1;
+    }
+    if (seaf_fstat (log->fd, &st) < 0) {
+        unlock_log (log);
+        pthread_mutex_unlock (&log->lock);
+        return -1;
+    }
+    end = st.st_size - st.st_size % sizeof(ReplRecord);
+    if (log->pos > end) {
+        log->pos = 0;
+        save_pos (log);
+    }
+    if (maybe_rotate_log (log, end))
+        end = 0;
+    unlock_log (log);
+
+    if (log->pos >= end) {
+        pthread_mutex_unlock (&log->lock);
+        return 0;
+    }
+
+    /* Records are never changed once appended, so other processes may go
+     * on appending while we read.
+     */
+    n_recs = (int) MIN ((gint64)log->batch_size,
+                        (end - log->pos) / (gint64)sizeof(ReplRecord));
+    recs = g_new (ReplRecord, n_recs);
+    n = pread (log->fd, recs, n_recs * sizeof(ReplRecord), log->pos);
+    pthread_mutex_unlock (&log->lock);
+    if (n < 0) {
+        seaf_warning ("[repl] Failed to read %s: %s.\n", log->path, strerror(errno));
+        goto out;
+    }
+    n_recs = n / sizeof(ReplRecord);
+    if (n_recs == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    check_lag (log, &recs[0]);
+
+    data.log = log;
+    data.recs = recs;
+    results = g_new0 (gboolean, n_recs);
+    run_parallel_jobs (n_recs, log->threads, ship_one, &data, results);
+
+    for (i = 0; i < n_recs; ++i) {
+        if (!results[i])
+            goto out;
+    }
+
+    log->pos += n_recs * sizeof(ReplRecord);
+    if (save_pos (log) < 0)
+        goto out;
+    ret = n_recs;
+
+out:
+    g_free (recs);
+    g_free (results);
+    return ret;
+}
+
+static void *
+ship_thread (void *vlog)
+{
+    ReplLog *log = vlog;
+    struct timespec deadline;
+    int delay = log->interval;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock (&log->lock);
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += delay;
+        while (log->n_appended < log->batch_size) {
+            if (pthread_cond_timedwait (&log->appended, &log->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        log->n_appended = 0;
+        pthread_mutex_unlock (&log->lock);
+
+        if (!take_shipping (log))
+            continue;
+
+        while ((ret = ship_batch (log)) > 0)
+            ;
+
+        /* Back off while the secondary is unreachable. */
+        if (ret < 0)
+            delay = MIN (delay * 2, MAX_RETRY_DELAY);
+        else
+            delay = log->interval;
+    }
+
+    return NULL;
+}
+
+ReplLog *
+repl_log_new (const char *seaf_dir, const char *name, GKeyFile *config,
+              ReplShipFunc ship, void *user_data)
+{
+    ReplLog *log;
+    char *dir;
+    pthread_t tid;
+    int rc;
+
+    dir = g_build_filename (seaf_dir, "storage", REPL_DIR, NULL);
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        seaf_warning ("[repl] Failed to create %s.\n", dir);
+        g_free (dir);
+        return NULL;
+    }
+
+    log = g_new0 (ReplLog, 1);
+    log->name = g_strdup (name);
+    log->path = g_strdup_printf ("%s/%s.log", dir, name);
+    log->pos_path = g_strdup_printf ("%s/%s.pos", dir, name);
+    g_free (dir);
+
+    pthread_mutex_init (&log->lock, NULL);
+    pthread_cond_init (&log->appended, NULL);
+    log->fd = -1;
+    log->pos_fd = -1;
+
+    log->interval = get_int_setting (config, "interval", DEFAULT_INTERVAL);
+    log->batch_size = get_int_setting (config, "batch_size", DEFAULT_BATCH_SIZE);
+    log->threads = get_int_setting (config, "threads", DEFAULT_THREADS);
+    log->max_lag = get_int_setting (config, "max_lag", DEFAULT_MAX_LAG);
+    log->sync_log = g_key_file_get_boolean (config, "replication", "sync_log", NULL);
+
+    log->ship = ship;
+    log->user_data = user_data;
+
+    rc = pthread_create (&tid, NULL, ship_thread, log);
+    if (rc != 0) {
+        seaf_warning ("[repl] Failed to start shipper for %s: %s.\n",
+                      name, strerror(rc));
+        pthread_mutex_destroy (&log->lock);
+        pthread_cond_destroy (&log->appended);
+        g_free (log->name);
+        g_free (log->path);
+        g_free (log->pos_path);
+        g_free (log);
+        return NULL;
+    }
+    pthread_detach (tid);
+
+    return log;
+}
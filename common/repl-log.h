@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPL_LOG_H
+#define REPL_LOG_H
+
+#include <glib.h>
+
+/*
+ * Replication log of new blocks or objects of one type, kept in
+ *
+ *   <seaf_dir>/storage/replication/<name>.log
+ *
+ * Writers append the id of each new object. A shipper thread copies the
+ * logged objects to the secondary storage in batches, and records how far
+ * it got in <name>.pos. Only one process ships a log at a time, the one
+ * holding the lock on <name>.pos; the others just append. The Go fileserver
+ * appends to the same logs.
+ *
+ * Settings are read from the [replication] group of seafile.conf:
+ *
+ *   interval = 1       # seconds between rounds when few objects are new
+ *   batch_size = 1024  # objects shipped per round
+ *   threads = 8        # objects copied in parallel
+ *   max_lag = 300      # warn when the oldest pending object is older
+ *   sync_log = false   # fsync each append
+ */
+
+typedef struct ReplLog ReplLog;
+
+/*
+ * Copies one object to the secondary. Returns 0 if it's copied, or has
+ * been removed from the primary since, and -1 to retry later.
+ */
+typedef int (*ReplShipFunc) (const char *store_id, int version,
+                             const char *obj_id, void *user_data);
+
+/* Opens the log and starts its shipper thread. */
+ReplLog *
+repl_log_new (const char *seaf_dir, const char *name, GKeyFile *config,
+              ReplShipFunc ship, void *user_data);
+
+int
+repl_log_append (ReplLog *log, const char *store_id, int version,
+                 const char *obj_id);
+
+#endif
@@ -0,0 +1,115 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "row-count.h"
+#include "log.h"
+
+struct RowCounts {
+    SeafDB *db;
+    gboolean enabled;
+};
+
+RowCounts *
+row_counts_new (SeafDB *db)
+{
+    RowCounts *counts = g_new0 (RowCounts, 1);
+
+    counts->db = db;
+    return counts;
+}
+
+int
+row_counts_init (RowCounts *counts, gboolean create_table)
+{
+    SeafDB *db = counts->db;
+    const char *sql;
+    gboolean db_err = FALSE;
+
+    if (create_table) {
+        if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL)
+            sql = "CREATE TABLE IF NOT EXISTS RowCount ("
+                "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+                "name VARCHAR(64) NOT NULL, num BIGINT NOT NULL, "
+                "UNIQUE INDEX (name)) ENGINE=INNODB";
+        else
+            sql = "CREATE TABLE IF NOT EXISTS RowCount ("
+                "name VARCHAR(64) NOT NULL PRIMARY KEY, num BIGINT NOT NULL)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    seaf_db_check_for_existence (db, "SELECT 1 FROM RowCount LIMIT 1", &db_err);
+    if (db_err) {
+        seaf_message ("No RowCount table, aggregates are counted by queries.\n");
+        return 0;
+    }
+
+    counts->enabled = TRUE;
+    return 0;
+}
+
+static gboolean
+get_num_cb (SeafDBRow *row, void *data)
+{
+    gint64 *num = data;
+
+    *num = seaf_db_row_get_column_int64 (row, 0);
+    return FALSE;
+}
+
+gint64
+row_counts_get (RowCounts *counts, const char *name, const char *count_sql)
+{
+    gint64 num = -1;
+    int rc;
+
+    if (counts->enabled) {
+        rc = seaf_db_statement_foreach_row (counts->db,
+                                            "SELECT num FROM RowCount WHERE name = ?",
+                                            get_num_cb, &num, 1, "string", name);
+        if (rc > 0)
+            return num;
+    }
+
+    num = seaf_db_get_int64 (counts->db, count_sql);
+    if (num < 0 || !counts->enabled)
+        return num;
+
+    /* Fails harmlessly if another thread stored the count first. */
+    if (seaf_db_statement_query (counts->db,
+                                 "INSERT INTO RowCount (name, num) VALUES (?, ?)",
+                                 2, "string", name, "int64", num) < 0)
+        seaf_debug ("Failed to save row count %s.\n", name);
+
+    return num;
+}
+
+void
+row_counts_trans_add (RowCounts *counts, SeafDBTrans *trans,
+                      const char *name, gint64 delta)
+{
+    if (!counts->enabled || delta == 0)
+        return;
+
+    /* A count that isn't stored is computed when it's read. */
+    if (seaf_db_trans_query (trans,
+                             "UPDATE RowCount SET num = num + ? WHERE name = ?",
+                             2, "int64", delta, "string", name) < 0)
+        seaf_warning ("Failed to update row count %s.\n", name);
+}
+
+int
+row_counts_reset (RowCounts *counts)
+{
+    if (!counts->enabled)
+        return 0;
+
+    return seaf_db_query (counts->db, "DELETE FROM RowCount");
+}
+
+const char *
+row_counts_lock_clause (SeafDB *db)
+{
+    return seaf_db_type (db) == SEAF_DB_TYPE_SQLITE ? "" : " FOR UPDATE";
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ROW_COUNT_H
+#define ROW_COUNT_H
+
+#include "seaf-db.h"
+
+/*
+ * Row counts kept in the RowCount table, so that aggregates read often,
+ * like the number of active users checked against the license on every
+ * new user, take a primary key lookup instead of a COUNT(*) over a large
+ * table.
+ *
+ * Each count has a name and the query that computes it. Writers change a
+ * count in the transaction that adds or removes its rows. A count that
+ * isn't stored yet is computed with its query when it is first read. Rows
+ * changed behind the server's back, e.g. by SQL or by another program,
+ * make the counts drift until row_counts_reset() drops them, and they are
+ * computed again.
+ *
+ * Until the table is known to exist, counts are computed by their queries
+ * and writers don't update them.
+ */
+
+typedef struct RowCounts RowCounts;
+
+RowCounts *
+row_counts_new (SeafDB *db);
+
+/*
+ * Creates the table if @create_table, and starts using it if it exists.
+ * Called after the other tables of @db are created.
+ */
+int
+row_counts_init (RowCounts *counts, gboolean create_table);
+
+/* Returns -1 on errors. */
+gint64
+row_counts_get (RowCounts *counts, const char *name, const char *count_sql);
+
+/* Changes are lost if @trans is rolled back, like the rows they count. */
+void
+row_counts_trans_add (RowCounts *counts, SeafDBTrans *trans,
+                      const char *name, gint64 delta);
+
+/* Drops the stored counts, to be computed again. */
+int
+row_counts_reset (RowCounts *counts);
+
+/*
+ * Returns " FOR UPDATE" where the database supports it, to lock the rows
+ * read in a transaction before the counts of their changes are known.
+ */
+const char *
+row_counts_lock_clause (SeafDB *db);
+
+#endif
@@ -14,9 +14,12 @@
 #include "seafile-error.h"
 #include "seafile-rpc.h"
 #include "mq-mgr.h"
+#include "lock-stats.h"
+#include "access-stats.h"
 
 #ifdef SEAFILE_SERVER
 #include "web-accesstoken-mgr.h"
+#include "cache-version.h"
 #endif
 
 #ifndef SEAFILE_SERVER
@@ -248,6 +251,17 @@ seafile_publish_event(const char *channel, const char *content, GError **error)
 
     ret = seaf_mq_manager_publish_event (seaf->mq_mgr, channel, content);
 
+#ifdef SEAFILE_SERVER
+    /* Head updates of the Go file server. */
+    if (g_strcmp0 (channel, SEAFILE_SERVER_CHANNEL_EVENT) == 0 &&
+        g_str_has_prefix (content, "repo-update\t")) {
+        char **parts = g_strsplit (content, "\t", 3);
+        if (parts[1])
+            seaf_repo_manager_invalidate_repo_cache (seaf->repo_mgr, parts[1]);
+        g_strfreev (parts);
+    }
+#endif
+
     return ret;
 }
 
@@ -260,6 +274,16 @@ seafile_pop_event(const char *channel, GError **error)
     }
     return seaf_mq_manager_pop_event (seaf->mq_mgr, channel);
 }
+
+json_t *
+seafile_pop_events (const char *channel, int max_events, GError **error)
+{
+    if (!channel) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+    return seaf_mq_manager_pop_events (seaf->mq_mgr, channel, max_events);
+}
 #endif
 
 GList*
@@ -320,11 +344,17 @@ SeafileCommit *
 convert_to_seafile_commit (SeafCommit *c)
 {
     SeafileCommit *commit = seafile_commit_new ();
+#ifdef SEAFILE_SERVER
+    char *desc = commit_desc_get (seaf->desc_sched, c);
+#else
+    char *desc = g_strdup (c->desc);
+#endif
+
     g_object_set (commit,
                   "id", c->commit_id,
                   "creator_name", c->creator_name,
                   "creator", c->creator_id,
-                  "desc", c->desc,
+                  "desc", desc,
                   "ctime", c->ctime,
                   "repo_id", c->repo_id,
                   "root_id", c->root_id,
@@ -336,6 +366,7 @@ convert_to_seafile_commit (SeafCommit *c)
                   "device_name", c->device_name,
                   "client_version", c->client_version,
                   NULL);
+    g_free (desc);
     return commit;
 }
 
@@ -1166,6 +1197,142 @@ seafile_get_repo_owner (const char *repo_id, GError **error)
     return owner;
 }
 
+/* Parses a json array of repo ids. Returns FALSE if any of them is invalid. */
+static gboolean
+parse_repo_ids (const char *repo_ids_json, GList **repo_ids, GError **error)
+{
+    json_t *array;
+    json_error_t jerror;
+    const char *repo_id;
+    size_t i;
+
+    *repo_ids = NULL;
+
+    if (!repo_ids_json) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return FALSE;
+    }
+
+    array = json_loadb (repo_ids_json, strlen(repo_ids_json), 0, &jerror);
+    if (!array || !json_is_array (array)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id list");
+        if (array)
+            json_decref (array);
+        return FALSE;
+    }
+
+    for (i = 0; i < json_array_size (array); ++i) {
+        repo_id = json_string_value (json_array_get (array, i));
+        if (!repo_id || !is_uuid_valid (repo_id)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+            string_list_free (*repo_ids);
+            *repo_ids = NULL;
+            json_decref (array);
+            return FALSE;
+        }
+        *repo_ids = g_list_prepend (*repo_ids, g_strdup (repo_id));
+    }
+    *repo_ids = g_list_reverse (*repo_ids);
+
+    json_decref (array);
+    return TRUE;
+}
+
+GList *
+seafile_get_repos_by_ids (const char *repo_ids_json, GError **error)
+{
+    GList *repo_ids, *repos, *ret;
+
+    if (!parse_repo_ids (repo_ids_json, &repo_ids, error))
+        return NULL;
+
+    repos = seaf_repo_manager_get_repos_by_ids (seaf->repo_mgr, repo_ids);
+    ret = convert_repo_list (repos);
+
+    g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
+    string_list_free (repo_ids);
+
+    return ret;
+}
+
+json_t *
+seafile_get_repo_owners (const char *repo_ids_json, GError **error)
+{
+    GList *repo_ids;
+    GHashTable *owners;
+    GHashTableIter iter;
+    gpointer key, value;
+    json_t *ret;
+
+    if (!parse_repo_ids (repo_ids_json, &repo_ids, error))
+        return NULL;
+
+    owners = seaf_repo_manager_get_repo_owners (seaf->repo_mgr, repo_ids);
+    string_list_free (repo_ids);
+    if (!owners) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Internal server error");
+        return NULL;
+    }
+
+    ret = json_object ();
+    g_hash_table_iter_init (&iter, owners);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        json_object_set_new (ret, key, json_string (value));
+    g_hash_table_destroy (owners);
+
+    return ret;
+}
+
+json_t *
+seafile_get_repo_sizes (const char *repo_ids_json, GError **error)
+{
+    GList *repo_ids, *repos, *ptr;
+    gboolean db_err = FALSE;
+    SeafRepo *repo;
+    json_t *ret, *obj;
+
+    if (!parse_repo_ids (repo_ids_json, &repo_ids, error))
+        return NULL;
+
+    repos = seaf_repo_manager_get_repo_sizes (seaf->repo_mgr, repo_ids, &db_err);
+    string_list_free (repo_ids);
+    if (db_err) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Internal server error");
+        return NULL;
+    }
+
+    ret = json_object ();
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        obj = json_object ();
+        json_object_set_new (obj, "size", json_integer (repo->size));
+        json_object_set_new (obj, "file_count", json_integer (repo->file_count));
+        json_object_set_new (ret, repo->id, obj);
+    }
+    g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
+
+    return ret;
+}
+
+GList *
+seafile_get_repo_head_commits (const char *repo_ids_json, GError **error)
+{
+    GList *repo_ids, *commits, *ptr;
+    GList *ret = NULL;
+
+    if (!parse_repo_ids (repo_ids_json, &repo_ids, error))
+        return NULL;
+
+    commits = seaf_repo_manager_get_head_commits (seaf->repo_mgr, repo_ids);
+    string_list_free (repo_ids);
+
+    for (ptr = commits; ptr; ptr = ptr->next)
+        ret = g_list_prepend (ret, convert_to_seafile_commit (ptr->data));
+    g_list_free_full (commits, (GDestroyNotify)seaf_commit_unref);
+
+    return ret;
+}
+
 GList *
 seafile_get_orphan_repo_list(GError **error)
 {
@@ -1443,6 +1610,143 @@ seafile_cancel_zip_task (const char *token, GError **error)
                                              token);
 }
 
+char *
+seafile_get_zip_task_stats (GError **error)
+{
+    return zip_download_mgr_get_stats (seaf->zip_download_mgr);
+}
+
+char *
+seafile_get_db_query_stats (GError **error)
+{
+    GList *stats, *ptr;
+    SeafDBQueryStats *st;
+    json_t *array, *obj;
+    char *json_data, *ret;
+
+    stats = seaf_db_get_query_stats ();
+
+    array = json_array ();
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        obj = json_object ();
+        json_object_set_string_member (obj, "sql", st->sql);
+        json_object_set_int_member (obj, "count", st->count);
+        json_object_set_int_member (obj, "errors", st->errors);
+        json_object_set_int_member (obj, "total_time_ms", st->total_time / 1000);
+        json_object_set_int_member (obj, "max_time_ms", st->max_time / 1000);
+        json_array_append_new (array, obj);
+    }
+    seaf_db_query_stats_free (stats);
+
+    json_data = json_dumps (array, JSON_COMPACT);
+    ret = g_strdup (json_data);
+
+    free (json_data);
+    json_decref (array);
+    return ret;
+}
+
+char *
+seafile_get_lock_stats (GError **error)
+{
+    GList *stats, *ptr;
+    SeafLockStats *st;
+    json_t *array, *obj;
+    char *json_data, *ret;
+
+    stats = seaf_lock_get_stats ();
+
+    array = json_array ();
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        obj = json_object ();
+        json_object_set_string_member (obj, "name", st->name);
+        json_object_set_int_member (obj, "acquisitions", st->acquisitions);
+        json_object_set_int_member (obj, "contentions", st->contentions);
+        json_object_set_int_member (obj, "wait_time_us", st->wait_time);
+        json_object_set_int_member (obj, "max_wait_us", st->max_wait);
+        json_object_set_int_member (obj, "max_hold_us", st->max_hold);
+        json_array_append_new (array, obj);
+    }
+    seaf_lock_stats_free (stats);
+
+    json_data = json_dumps (array, JSON_COMPACT);
+    ret = g_strdup (json_data);
+
+    free (json_data);
+    json_decref (array);
+    return ret;
+}
+
+char *
+seafile_get_access_stats (GError **error)
+{
+    SeafAccessStats stats;
+    AccessHitter *hitter;
+    GList *ptr;
+    json_t *object, *classes, *cls_obj, *top, *reuse, *obj;
+    char *json_data, *ret;
+    int cls, i;
+
+    object = json_object ();
+    json_object_set_int_member (object, "sample_rate", seaf_access_stats_sample_rate ());
+    classes = json_array ();
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls) {
+        seaf_access_stats_get (cls, &stats);
+
+        cls_obj = json_object ();
+        json_object_set_string_member (cls_obj, "class", seaf_access_class_name (cls));
+        json_object_set_int_member (cls_obj, "sampled_reads", stats.sampled);
+        json_object_set_int_member (cls_obj, "followed_reads", stats.followed);
+        json_object_set_int_member (cls_obj, "cold_reads", stats.cold);
+
+        top = json_array ();
+        for (ptr = stats.top; ptr; ptr = ptr->next) {
+            hitter = ptr->data;
+            obj = json_object ();
+            json_object_set_string_member (obj, "id", hitter->id);
+            json_object_set_int_member (obj, "reads", hitter->count);
+            json_array_append_new (top, obj);
+        }
+        json_object_set_new (cls_obj, "top", top);
+
+        /* Reads by reuse distance, "below" is 0 for the last bucket. */
+        reuse = json_array ();
+        for (i = 0; i < ACCESS_N_REUSE_BUCKETS; ++i) {
+            obj = json_object ();
+            json_object_set_int_member (obj, "below",
+                                        i < ACCESS_N_REUSE_BUCKETS - 1 ? ((gint64)1) << i : 0);
+            json_object_set_int_member (obj, "reads", stats.reuse[i]);
+            json_array_append_new (reuse, obj);
+        }
+        json_object_set_new (cls_obj, "reuse_distance", reuse);
+
+        json_array_append_new (classes, cls_obj);
+        seaf_access_stats_clear (&stats);
+    }
+    json_object_set_new (object, "classes", classes);
+
+    json_data = json_dumps (object, JSON_COMPACT);
+    ret = g_strdup (json_data);
+
+    free (json_data);
+    json_decref (object);
+    return ret;
+}
+
+char *
+seafile_get_cache_versions (GError **error)
+{
+    return seaf_cache_versions_to_json ();
+}
+
+char *
+seafile_get_repo_reclaim_progress (GError **error)
+{
+    return seaf_repo_manager_get_reclaim_progress (seaf->repo_mgr);
+}
+
 int
 seafile_add_share (const char *repo_id, const char *from_email,
                    const char *to_email, const char *permission, GError **error)
@@ -1478,6 +1782,80 @@ seafile_add_share (const char *repo_id, const char *from_email,
     return ret;
 }
 
+/* Parse a json array of strings like '["a@x.com", "b@x.com"]'. */
+static GList *
+parse_json_string_list (const char *json_str, gboolean *bad_args)
+{
+    json_t *array, *value;
+    json_error_t err;
+    size_t index;
+    GList *ret = NULL;
+
+    *bad_args = FALSE;
+    array = json_loadb (json_str, strlen(json_str), 0, &err);
+    if (!array || !json_is_array (array)) {
+        *bad_args = TRUE;
+        goto out;
+    }
+
+    for (index = 0; index < json_array_size (array); index++) {
+        value = json_array_get (array, index);
+        const char *str = json_string_value (value);
+        if (!str || *str == '\0') {
+            *bad_args = TRUE;
+            string_list_free (ret);
+            ret = NULL;
+            goto out;
+        }
+        ret = g_list_prepend (ret, g_strdup (str));
+    }
+    ret = g_list_reverse (ret);
+
+out:
+    if (array)
+        json_decref (array);
+    return ret;
+}
+
+int
+seafile_add_shares (const char *repo_id, const char *from_email,
+                    const char *to_emails, const char *permission, GError **error)
+{
+    GList *emails;
+    gboolean bad_args;
+    int ret;
+
+    if (!repo_id || !from_email || !to_emails || !permission) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Missing args");
+        return -1;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid repo_id parameter");
+        return -1;
+    }
+
+    if (!is_permission_valid (permission)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid permission parameter");
+        return -1;
+    }
+
+    emails = parse_json_string_list (to_emails, &bad_args);
+    if (bad_args) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid to_emails parameter");
+        return -1;
+    }
+
+    ret = seaf_share_manager_add_shares (seaf->share_mgr, repo_id, from_email,
+                                         emails, permission);
+    string_list_free (emails);
+
+    return ret;
+}
+
 GList *
 seafile_list_share_repos (const char *email, const char *type,
                           int start, int limit, GError **error)
@@ -1766,6 +2144,62 @@ seafile_group_share_repo (const char *repo_id, int group_id,
     return ret;
 }
 
+int
+seafile_group_share_repo_to_groups (const char *repo_id, const char *group_ids,
+                                    const char *user_name, const char *permission,
+                                    GError **error)
+{
+    SeafRepoManager *mgr = seaf->repo_mgr;
+    json_t *array = NULL, *value;
+    json_error_t err;
+    size_t index;
+    GList *ids = NULL;
+    int ret = -1;
+
+    if (!group_ids || !user_name || !repo_id || !permission) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Bad input argument");
+        return -1;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    if (!is_permission_valid (permission)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid permission parameter");
+        return -1;
+    }
+
+    array = json_loadb (group_ids, strlen(group_ids), 0, &err);
+    if (!array || !json_is_array (array)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad args.");
+        goto out;
+    }
+
+    for (index = 0; index < json_array_size (array); index++) {
+        value = json_array_get (array, index);
+        int group_id = json_integer_value (value);
+        if (group_id <= 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad args.");
+            goto out;
+        }
+        ids = g_list_prepend (ids, GINT_TO_POINTER(group_id));
+    }
+    ids = g_list_reverse (ids);
+
+    ret = seaf_repo_manager_add_group_repos (mgr, repo_id, ids, user_name,
+                                             permission, error);
+
+out:
+    if (array)
+        json_decref (array);
+    g_list_free (ids);
+    return ret;
+}
+
 int
 seafile_group_unshare_repo (const char *repo_id, int group_id,
                             const char *user_name, GError **error)
@@ -2514,6 +2948,7 @@ seafile_post_multi_files (const char *repo_id,
                                         paths_json,
                                         user,
                                         replace_existed,
+                                        FALSE,
                                         &ret_json,
                                         NULL,
                                         error);
@@ -3002,6 +3437,26 @@ out:
     return ret;
 }
 
+char *
+seafile_apply_batch_ops (const char *repo_id,
+                         const char *ops_json,
+                         const char *user,
+                         GError **error)
+{
+    if (!repo_id || !ops_json || !user) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    return seaf_repo_manager_apply_batch_ops (seaf->repo_mgr, repo_id,
+                                              ops_json, user, error);
+}
+
 int
 seafile_is_valid_filename (const char *repo_id,
                            const char *filename,
@@ -3329,29 +3784,12 @@ seafile_list_file_blocks (const char *repo_id,
     return g_string_free (buf, FALSE);
 }
 
-/*
- * Directories are always before files. Otherwise compare the names.
- */
-static gint
-comp_dirent_func (gconstpointer a, gconstpointer b)
-{
-    const SeafDirent *dent_a = a, *dent_b = b;
-
-    if (S_ISDIR(dent_a->mode) && S_ISREG(dent_b->mode))
-        return -1;
-
-    if (S_ISREG(dent_a->mode) && S_ISDIR(dent_b->mode))
-        return 1;
-
-    return strcasecmp (dent_a->name, dent_b->name);
-}
-
 GList *
 seafile_list_dir (const char *repo_id,
                   const char *dir_id, int offset, int limit, GError **error)
 {
     SeafRepo *repo;
-    SeafDir *dir;
+    GList *entries = NULL;
     SeafDirent *dent;
     SeafileDirent *d;
     GList *res = NULL;
@@ -3373,31 +3811,15 @@ seafile_list_dir (const char *repo_id,
         return NULL;
     }
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                       repo->store_id, repo->version, dir_id);
-    if (!dir) {
+    if (seaf_fs_manager_list_dir_page (seaf->fs_mgr,
+                                       repo->store_id, repo->version, dir_id,
+                                       offset, limit, &entries) < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
         seaf_repo_unref (repo);
         return NULL;
     }
 
-    dir->entries = g_list_sort (dir->entries, comp_dirent_func);
-
-    if (offset < 0) {
-        offset = 0;
-    }
-
-    int index = 0;
-    for (p = dir->entries; p != NULL; p = p->next, index++) {
-        if (index < offset) {
-            continue;
-        }
-
-        if (limit > 0) {
-            if (index >= offset + limit)
-                break;
-        }
-
+    for (p = entries; p != NULL; p = p->next) {
         dent = p->data;
 
         if (!is_object_id_valid (dent->id))
@@ -3415,7 +3837,7 @@ seafile_list_dir (const char *repo_id,
         res = g_list_prepend (res, d);
     }
 
-    seaf_dir_free (dir);
+    g_list_free_full (entries, (GDestroyNotify)seaf_dirent_free);
     seaf_repo_unref (repo);
     res = g_list_reverse (res);
     return res;
@@ -3970,6 +4392,35 @@ seafile_create_virtual_repo (const char *origin_repo_id,
     return repo_id;
 }
 
+char *
+seafile_fork_repo (const char *src_repo_id,
+                   const char *commit_id,
+                   const char *repo_name,
+                   const char *owner,
+                   const char *passwd,
+                   GError **error)
+{
+    if (!src_repo_id || !repo_name || !owner) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    if (!is_uuid_valid (src_repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    if (commit_id && commit_id[0] == '\0')
+        commit_id = NULL;
+    if (commit_id && !is_object_id_valid (commit_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid commit id");
+        return NULL;
+    }
+
+    return seaf_repo_manager_fork_repo (seaf->repo_mgr, src_repo_id, commit_id,
+                                        repo_name, owner, passwd, error);
+}
+
 GList *
 seafile_get_virtual_repos_by_owner (const char *owner, GError **error)
 {
@@ -4060,6 +4511,12 @@ seafile_get_system_default_repo_id (GError **error)
     return get_system_default_repo_id(seaf);
 }
 
+int
+seafile_is_server_ready (GError **error)
+{
+    return seafile_session_is_ready (seaf) ? 1 : 0;
+}
+
 static int
 update_valid_since_time (SeafRepo *repo, gint64 new_time)
 {
@@ -4539,6 +4996,23 @@ seafile_search_files (const char *repo_id, const char *str, GError **error)
     return g_list_reverse (ret);
 }
 
+int
+seafile_rebuild_search_index (const char *repo_id, GError **error)
+{
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    if (seaf_fs_manager_rebuild_search_index (seaf->fs_mgr, repo_id) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to rebuild search index");
+        return -1;
+    }
+
+    return 0;
+}
+
 /*RPC functions merged from ccnet-server*/
 int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
@@ -4589,6 +5063,11 @@ ccnet_rpc_validate_emailuser (const char *email, const char *passwd, GError **er
         return -1;
 
     ret = ccnet_user_manager_validate_emailuser (user_mgr, email, passwd);
+    if (ret == -2) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Too many logins in progress, please try again later");
+        return -1;
+    }
 
     return ret;
 }
@@ -4754,6 +5233,19 @@ ccnet_rpc_count_inactive_emailusers (const char *source, GError **error)
    return ccnet_user_manager_count_inactive_emailusers (user_mgr, source);
 }
 
+int
+ccnet_rpc_reconcile_row_counts (GError **error)
+{
+    if (ccnet_user_manager_reset_counts (seaf->user_mgr) < 0 ||
+        ccnet_org_manager_reset_counts (seaf->org_mgr) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
+                     "Failed to reset row counts");
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 ccnet_rpc_update_emailuser (const char *source, int id, const char* passwd,
                             int is_staff, int is_active,
@@ -4879,6 +5371,34 @@ ccnet_rpc_group_add_member (int group_id, const char *user_name,
     return ret;
 }
 
+int
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *member_names, GError **error)
+{
+    CcnetGroupManager *group_mgr = seaf->group_mgr;
+    GList *members;
+    gboolean bad_args;
+    int ret;
+
+    if (group_id <= 0 || !user_name || !member_names) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Group id and user name and member names can not be NULL");
+        return -1;
+    }
+
+    members = parse_json_string_list (member_names, &bad_args);
+    if (bad_args) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad args.");
+        return -1;
+    }
+
+    ret = ccnet_group_manager_add_members (group_mgr, group_id, user_name, members,
+                                           error);
+    string_list_free (members);
+
+    return ret;
+}
+
 int
 ccnet_rpc_group_remove_member (int group_id, const char *user_name,
                                const char *member_name, GError **error)
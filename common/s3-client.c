@@ -0,0 +1,939 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_S3
+
+#include <pthread.h>
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "utils.h"
+#include "log.h"
+#include "s3-client.h"
+
+#define DEFAULT_HOST "s3.amazonaws.com"
+#define DEFAULT_REGION "us-east-1"
+#define DEFAULT_MAX_IN_FLIGHT 32
+#define DEFAULT_RANGE_SIZE_MB 1
+
+/* Requests failing with a network error or a 5xx status are retried. */
+#define MAX_ATTEMPTS 3
+#define RETRY_DELAY_USEC (100 * 1000)
+
+/* Limit of a multi-object delete request. */
+#define DELETE_BATCH_SIZE 1000
+
+struct S3Client {
+    char *bucket;
+    char *key_id;
+    char *key;
+    char *host;
+    char *region;
+    gboolean use_https;
+    gboolean path_style;
+    int max_in_flight;
+    int range_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_flight;
+    /* Idle curl handles. They keep their connections open. */
+    GQueue *handles;
+};
+
+typedef struct S3Request {
+    const char *method;
+    const char *key;            /* NULL for requests on the bucket */
+    const char *query;          /* canonical query string */
+    const char *range;
+    const char *copy_source;
+    const char *content_md5;
+    const guint8 *body;
+    gsize body_len;
+    gsize body_off;
+
+    long status;
+    GByteArray *rsp;
+    gint64 total_size;          /* from Content-Range */
+    gint64 content_length;
+    gint64 mtime;
+} S3Request;
+
+static pthread_once_t curl_init_once = PTHREAD_ONCE_INIT;
+
+static void
+init_curl ()
+{
+    curl_global_init (CURL_GLOBAL_ALL);
+}
+
+S3Client *
+s3_client_new (GKeyFile *config, const char *group)
+{
+    S3Client *client;
+    int range_size;
+
+    client = g_new0 (S3Client, 1);
+    client->bucket = g_key_file_get_string (config, group, "bucket", NULL);
+    client->key_id = g_key_file_get_string (config, group, "key_id", NULL);
+    client->key = g_key_file_get_string (config, group, "key", NULL);
+    if (!client->bucket || !client->key_id || !client->key) {
+        seaf_warning ("[s3] bucket, key_id and key must be set in [%s].\n", group);
+        g_free (client->bucket);
+        g_free (client->key_id);
+        g_free (client->key);
+        g_free (client);
+        return NULL;
+    }
+
+    client->host = g_key_file_get_string (config, group, "host", NULL);
+    if (!client->host)
+        client->host = g_strdup (DEFAULT_HOST);
+    client->region = g_key_file_get_string (config, group, "aws_region", NULL);
+    if (!client->region)
+        client->region = g_strdup (DEFAULT_REGION);
+
+    if (g_key_file_has_key (config, group, "use_https", NULL))
+        client->use_https = g_key_file_get_boolean (config, group,
+                                                    "use_https", NULL);
+    else
+        client->use_https = TRUE;
+    client->path_style = g_key_file_get_boolean (config, group,
+                                                 "path_style_request", NULL);
+
+    client->max_in_flight = g_key_file_get_integer (config, group,
+                                                    "max_in_flight", NULL);
+    if (client->max_in_flight <= 0)
+        client->max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    range_size = g_key_file_get_integer (config, group, "range_size", NULL);
+    if (range_size <= 0)
+        range_size = DEFAULT_RANGE_SIZE_MB;
+    client->range_size = range_size << 20;
+
+    pthread_mutex_init (&client->lock, NULL);
+    pthread_cond_init (&client->cond, NULL);
+    client->handles = g_queue_new ();
+
+    pthread_once (&curl_init_once, init_curl);
+
+    seaf_message ("[s3] Using bucket %s on %s, with at most %d requests "
+                  "in flight.\n", client->bucket, client->host,
+                  client->max_in_flight);
+
+    return client;
+}
+
+int
+s3_client_max_in_flight (S3Client *client)
+{
+    return client->max_in_flight;
+}
+
+static CURL *
+acquire_handle (S3Client *client)
+{
+    CURL *curl;
+
+    pthread_mutex_lock (&client->lock);
+    while (client->in_flight >= client->max_in_flight)
+        pthread_cond_wait (&client->cond, &client->lock);
+    ++client->in_flight;
+    curl = g_queue_pop_head (client->handles);
+    pthread_mutex_unlock (&client->lock);
+
+    if (!curl)
+        curl = curl_easy_init ();
+    else
+        curl_easy_reset (curl);
+    return curl;
+}
+
+static void
+release_handle (S3Client *client, CURL *curl)
+{
+    pthread_mutex_lock (&client->lock);
+    --client->in_flight;
+    if (curl)
+        g_queue_push_head (client->handles, curl);
+    pthread_cond_signal (&client->cond);
+    pthread_mutex_unlock (&client->lock);
+}
+
+/* Signing */
+
+static void
+sha256_hex (const void *data, gsize len, char hex[65])
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    EVP_Digest (data, len, md, &md_len, EVP_sha256(), NULL);
+    rawdata_to_hex (md, hex, md_len);
+}
+
+static void
+hmac_sha256 (const void *key, int key_len, const char *data, unsigned char out[32])
+{
+    unsigned int out_len;
+
+    HMAC (EVP_sha256(), key, key_len,
+          (const unsigned char *)data, strlen(data), out, &out_len);
+}
+
+static void
+uri_encode (GString *out, const char *s, gboolean keep_slash)
+{
+    for (; *s; ++s) {
+        if (g_ascii_isalnum (*s) || *s == '-' || *s == '_' ||
+            *s == '.' || *s == '~' || (keep_slash && *s == '/'))
+            g_string_append_c (out, *s);
+        else
+            g_string_append_printf (out, "%%%02X", (guint8)*s);
+    }
+}
+
+static struct curl_slist *
+sign_request (S3Client *client, S3Request *req,
+              const char *host, const char *uri)
+{
+    struct curl_slist *headers = NULL;
+    GString *canonical_headers = g_string_new (NULL);
+    GString *signed_headers = g_string_new (NULL);
+    char amz_date[32], date[16];
+    char payload_hash[65], request_hash[65], signature[65];
+    unsigned char k[32], k2[32];
+    char *canonical, *scope, *to_sign, *secret, *h;
+    time_t now = time(NULL);
+    struct tm tm;
+
+    gmtime_r (&now, &tm);
+    strftime (amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+    strftime (date, sizeof(date), "%Y%m%d", &tm);
+    sha256_hex (req->body ? (const void *)req->body : "", req->body_len,
+                payload_hash);
+
+    /* In the sorted order of the header names. */
+    if (req->content_md5) {
+        g_string_append_printf (canonical_headers, "content-md5:%s\n",
+                                req->content_md5);
+        g_string_append (signed_headers, "content-md5;");
+    }
+    g_string_append_printf (canonical_headers, "host:%s\n", host);
+    g_string_append (signed_headers, "host;");
+    g_string_append_printf (canonical_headers, "x-amz-content-sha256:%s\n",
+                            payload_hash);
+    g_string_append (signed_headers, "x-amz-content-sha256;");
+    if (req->copy_source) {
+        g_string_append_printf (canonical_headers, "x-amz-copy-source:%s\n",
+                                req->copy_source);
+        g_string_append (signed_headers, "x-amz-copy-source;");
+    }
+    g_string_append_printf (canonical_headers, "x-amz-date:%s\n", amz_date);
+    g_string_append (signed_headers, "x-amz-date");
+
+    canonical = g_strdup_printf ("%s\n%s\n%s\n%s\n%s\n%s",
+                                 req->method, uri, req->query ? req->query : "",
+                                 canonical_headers->str, signed_headers->str,
+                                 payload_hash);
+    sha256_hex (canonical, strlen(canonical), request_hash);
+
+    scope = g_strdup_printf ("%s/%s/s3/aws4_request", date, client->region);
+    to_sign = g_strdup_printf ("AWS4-HMAC-SHA256\n%s\n%s\n%s",
+                               amz_date, scope, request_hash);
+
+    secret = g_strconcat ("AWS4", client->key, NULL);
+    hmac_sha256 (secret, strlen(secret), date, k);
+    hmac_sha256 (k, 32, client->region, k2);
+    hmac_sha256 (k2, 32, "s3", k);
+    hmac_sha256 (k, 32, "aws4_request", k2);
+    hmac_sha256 (k2, 32, to_sign, k);
+    rawdata_to_hex (k, signature, 32);
+
+    h = g_strdup_printf ("Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+                         "SignedHeaders=%s, Signature=%s",
+                         client->key_id, scope, signed_headers->str, signature);
+    headers = curl_slist_append (headers, h);
+    g_free (h);
+    h = g_strdup_printf ("x-amz-date: %s", amz_date);
+    headers = curl_slist_append (headers, h);
+    g_free (h);
+    h = g_strdup_printf ("x-amz-content-sha256: %s", payload_hash);
+    headers = curl_slist_append (headers, h);
+    g_free (h);
+    if (req->content_md5) {
+        h = g_strdup_printf ("Content-MD5: %s", req->content_md5);
+        headers = curl_slist_append (headers, h);
+        g_free (h);
+    }
+    if (req->copy_source) {
+        h = g_strdup_printf ("x-amz-copy-source: %s", req->copy_source);
+        headers = curl_slist_append (headers, h);
+        g_free (h);
+    }
+    if (req->range) {
+        h = g_strdup_printf ("Range: %s", req->range);
+        headers = curl_slist_append (headers, h);
+        g_free (h);
+    }
+    /* Don't wait for 100 Continue before sending bodies. */
+    headers = curl_slist_append (headers, "Expect:");
+
+    g_string_free (canonical_headers, TRUE);
+    g_string_free (signed_headers, TRUE);
+    g_free (canonical);
+    g_free (scope);
+    g_free (to_sign);
+    g_free (secret);
+
+    return headers;
+}
+
+/* Transfers */
+
+static size_t
+recv_body (char *ptr, size_t size, size_t nmemb, void *vreq)
+{
+    S3Request *req = vreq;
+
+    g_byte_array_append (req->rsp, (guint8 *)ptr, size * nmemb);
+    return size * nmemb;
+}
+
+static size_t
+send_body (char *ptr, size_t size, size_t nmemb, void *vreq)
+{
+    S3Request *req = vreq;
+    size_t n = MIN (size * nmemb, req->body_len - req->body_off);
+
+    memcpy (ptr, req->body + req->body_off, n);
+    req->body_off += n;
+    return n;
+}
+
+static size_t
+recv_header (char *buf, size_t size, size_t nmemb, void *vreq)
+{
+    S3Request *req = vreq;
+    size_t len = size * nmemb;
+    char *line, *p;
+
+    line = g_strndup (buf, len);
+    g_strchomp (line);
+
+    if (g_ascii_strncasecmp (line, "Content-Range:", 14) == 0) {
+        p = strrchr (line, '/');
+        if (p && p[1] != '*')
+            req->total_size = g_ascii_strtoll (p + 1, NULL, 10);
+    } else if (g_ascii_strncasecmp (line, "Content-Length:", 15) == 0) {
+        req->content_length = g_ascii_strtoll (line + 15, NULL, 10);
+    } else if (g_ascii_strncasecmp (line, "Last-Modified:", 14) == 0) {
+        req->mtime = curl_getdate (g_strstrip (line + 14), NULL);
+    }
+
+    g_free (line);
+    return len;
+}
+
+/*
+ * Sends @req and fills in the status and response. Returns -1 if no
+ * response was received.
+ */
+static int
+perform (S3Client *client, S3Request *req)
+{
+    GString *uri = g_string_new ("/");
+    char *host, *url;
+    struct curl_slist *headers;
+    CURL *curl;
+    CURLcode rc = CURLE_OK;
+    int attempt, ret = -1;
+
+    if (client->path_style) {
+        host = g_strdup (client->host);
+        g_string_append (uri, client->bucket);
+        if (req->key)
+            g_string_append_c (uri, '/');
+    } else {
+        host = g_strdup_printf ("%s.%s", client->bucket, client->host);
+    }
+    if (req->key)
+        uri_encode (uri, req->key, TRUE);
+
+    url = g_strdup_printf ("%s://%s%s%s%s", client->use_https ? "https" : "http",
+                           host, uri->str, req->query ? "?" : "",
+                           req->query ? req->query : "");
+    headers = sign_request (client, req, host, uri->str);
+
+    for (attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+        if (attempt > 0)
+            g_usleep (RETRY_DELAY_USEC << (attempt - 1));
+
+        if (req->rsp)
+            g_byte_array_free (req->rsp, TRUE);
+        req->rsp = g_byte_array_new ();
+        req->status = 0;
+        req->body_off = 0;
+        req->total_size = -1;
+        req->content_length = -1;
+        req->mtime = 0;
+
+        curl = acquire_handle (client);
+        if (!curl) {
+            release_handle (client, NULL);
+            break;
+        }
+
+        curl_easy_setopt (curl, CURLOPT_URL, url);
+        curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, 10L);
+        /* Give up on connections that stall for a minute. */
+        curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, 60L);
+        curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_body);
+        curl_easy_setopt (curl, CURLOPT_WRITEDATA, req);
+        curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, recv_header);
+        curl_easy_setopt (curl, CURLOPT_HEADERDATA, req);
+
+        if (strcmp (req->method, "HEAD") == 0) {
+            curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+        } else if (strcmp (req->method, "PUT") == 0) {
+            curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_body);
+            curl_easy_setopt (curl, CURLOPT_READDATA, req);
+            curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE,
+                              (curl_off_t)req->body_len);
+        } else if (strcmp (req->method, "POST") == 0) {
+            curl_easy_setopt (curl, CURLOPT_POST, 1L);
+            curl_easy_setopt (curl, CURLOPT_POSTFIELDS, req->body);
+            curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                              (curl_off_t)req->body_len);
+        } else if (strcmp (req->method, "DELETE") == 0) {
+            curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+        }
+
+        rc = curl_easy_perform (curl);
+        if (rc == CURLE_OK)
+            curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &req->status);
+        release_handle (client, curl);
+
+        if (rc == CURLE_OK && req->status < 500) {
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        if (rc != CURLE_OK)
+            seaf_warning ("[s3] %s %s failed: %s.\n",
+                          req->method, url, curl_easy_strerror (rc));
+        else
+            seaf_warning ("[s3] %s %s failed with status %ld.\n",
+                          req->method, url, req->status);
+    }
+
+    curl_slist_free_all (headers);
+    g_string_free (uri, TRUE);
+    g_free (host);
+    g_free (url);
+    return ret;
+}
+
+static void
+request_free (S3Request *req)
+{
+    if (req->rsp)
+        g_byte_array_free (req->rsp, TRUE);
+}
+
+static gboolean
+response_has_error (S3Request *req)
+{
+    return req->rsp->len > 0 &&
+        g_strstr_len ((char *)req->rsp->data, req->rsp->len, "<Error>") != NULL;
+}
+
+/* Objects */
+
+typedef struct RangeReads {
+    S3Client *client;
+    const char *key;
+    guint8 *buf;
+    gint64 total;
+} RangeReads;
+
+/* Reads the range i + 1, the first one is read before. */
+static gboolean
+read_range (int i, void *vdata)
+{
+    RangeReads *reads = vdata;
+    int range_size = reads->client->range_size;
+    gint64 start = (gint64)(i + 1) * range_size;
+    gint64 end = MIN (start + range_size, reads->total) - 1;
+    S3Request req;
+    char range[64];
+    gboolean ret = FALSE;
+
+    snprintf (range, sizeof(range), "bytes=%"G_GINT64_FORMAT"-%"G_GINT64_FORMAT,
+              start, end);
+
+    memset (&req, 0, sizeof(req));
+    req.method = "GET";
+    req.key = reads->key;
+    req.range = range;
+    if (perform (reads->client, &req) == 0 && req.status == 206 &&
+        req.rsp->len == end - start + 1) {
+        memcpy (reads->buf + start, req.rsp->data, req.rsp->len);
+        ret = TRUE;
+    }
+    request_free (&req);
+
+    return ret;
+}
+
+int
+s3_client_get (S3Client *client, const char *key,
+               void **data, int *len, gboolean *not_found)
+{
+    S3Request req;
+    RangeReads reads;
+    char range[64];
+    gboolean *results = NULL;
+    int n_ranges, i, ret = -1;
+
+    *not_found = FALSE;
+
+    snprintf (range, sizeof(range), "bytes=0-%d", client->range_size - 1);
+
+    memset (&req, 0, sizeof(req));
+    req.method = "GET";
+    req.key = key;
+    req.range = range;
+    if (perform (client, &req) < 0)
+        goto out;
+
+    if (req.status == 404) {
+        *not_found = TRUE;
+        goto out;
+    }
+    /* Ranges of empty objects are not satisfiable. */
+    if (req.status == 416) {
+        *data = g_new0 (char, 1);
+        *len = 0;
+        ret = 0;
+        goto out;
+    }
+    if (req.status != 200 && req.status != 206) {
+        seaf_warning ("[s3] Failed to get %s: status %ld.\n", key, req.status);
+        goto out;
+    }
+
+    if (req.status == 200 || req.total_size <= (gint64)req.rsp->len) {
+        *len = req.rsp->len;
+        g_byte_array_append (req.rsp, (guint8 *)"", 1);
+        *data = g_byte_array_free (req.rsp, FALSE);
+        req.rsp = NULL;
+        ret = 0;
+        goto out;
+    }
+
+    if (req.total_size > G_MAXINT) {
+        seaf_warning ("[s3] Object %s is too large.\n", key);
+        goto out;
+    }
+
+    reads.client = client;
+    reads.key = key;
+    reads.total = req.total_size;
+    reads.buf = g_malloc (req.total_size + 1);
+    memcpy (reads.buf, req.rsp->data, req.rsp->len);
+    reads.buf[req.total_size] = 0;
+
+    n_ranges = (req.total_size + client->range_size - 1) / client->range_size;
+    results = g_new0 (gboolean, n_ranges - 1);
+    run_parallel_jobs (n_ranges - 1, client->max_in_flight,
+                       read_range, &reads, results);
+    for (i = 0; i < n_ranges - 1; ++i) {
+        if (!results[i]) {
+            seaf_warning ("[s3] Failed to read %s in ranges.\n", key);
+            g_free (reads.buf);
+            goto out;
+        }
+    }
+
+    *data = reads.buf;
+    *len = (int)req.total_size;
+    ret = 0;
+
+out:
+    g_free (results);
+    request_free (&req);
+    return ret;
+}
+
+int
+s3_client_put (S3Client *client, const char *key,
+               const void *data, int len)
+{
+    S3Request req;
+    int ret = -1;
+
+    memset (&req, 0, sizeof(req));
+    req.method = "PUT";
+    req.key = key;
+    req.body = data;
+    req.body_len = len;
+    if (perform (client, &req) < 0)
+        goto out;
+    if (req.status != 200) {
+        seaf_warning ("[s3] Failed to put %s: status %ld.\n", key, req.status);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    request_free (&req);
+    return ret;
+}
+
+int
+s3_client_head (S3Client *client, const char *key,
+                gint64 *size, gint64 *mtime)
+{
+    S3Request req;
+    int ret = -1;
+
+    memset (&req, 0, sizeof(req));
+    req.method = "HEAD";
+    req.key = key;
+    if (perform (client, &req) < 0)
+        goto out;
+
+    if (req.status == 404) {
+        ret = 0;
+    } else if (req.status == 200) {
+        if (size)
+            *size = req.content_length;
+        if (mtime)
+            *mtime = req.mtime;
+        ret = 1;
+    } else {
+        seaf_warning ("[s3] Failed to head %s: status %ld.\n", key, req.status);
+    }
+
+out:
+    request_free (&req);
+    return ret;
+}
+
+typedef struct HeadMany {
+    S3Client *client;
+    const char **keys;
+} HeadMany;
+
+static gboolean
+head_one (int i, void *vdata)
+{
+    HeadMany *data = vdata;
+
+    return s3_client_head (data->client, data->keys[i], NULL, NULL) == 1;
+}
+
+void
+s3_client_head_many (S3Client *client, const char **keys, int n_keys,
+                     gboolean *results)
+{
+    HeadMany data;
+
+    data.client = client;
+    data.keys = keys;
+    run_parallel_checks (n_keys, client->max_in_flight,
+                         head_one, &data, results);
+}
+
+int
+s3_client_delete (S3Client *client, const char *key)
+{
+    S3Request req;
+    int ret = -1;
+
+    memset (&req, 0, sizeof(req));
+    req.method = "DELETE";
+    req.key = key;
+    if (perform (client, &req) < 0)
+        goto out;
+    if (req.status != 204 && req.status != 200 && req.status != 404) {
+        seaf_warning ("[s3] Failed to delete %s: status %ld.\n", key, req.status);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    request_free (&req);
+    return ret;
+}
+
+static void
+xml_escape (GString *out, const char *s)
+{
+    char *escaped = g_markup_escape_text (s, -1);
+
+    g_string_append (out, escaped);
+    g_free (escaped);
+}
+
+static int
+delete_batch (S3Client *client, const char **keys, int n_keys)
+{
+    GString *body = g_string_new ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                                  "<Delete><Quiet>true</Quiet>");
+    unsigned char md5[EVP_MAX_MD_SIZE];
+    unsigned int md5_len;
+    char *content_md5;
+    S3Request req;
+    int i, ret = -1;
+
+    for (i = 0; i < n_keys; ++i) {
+        g_string_append (body, "<Object><Key>");
+        xml_escape (body, keys[i]);
+        g_string_append (body, "</Key></Object>");
+    }
+    g_string_append (body, "</Delete>");
+
+    EVP_Digest (body->str, body->len, md5, &md5_len, EVP_md5(), NULL);
+    content_md5 = g_base64_encode (md5, md5_len);
+
+    memset (&req, 0, sizeof(req));
+    req.method = "POST";
+    req.query = "delete=";
+    req.content_md5 = content_md5;
+    req.body = (guint8 *)body->str;
+    req.body_len = body->len;
+    if (perform (client, &req) < 0)
+        goto out;
+    /* In quiet mode only the keys that failed are listed. */
+    if (req.status != 200 || response_has_error (&req)) {
+        seaf_warning ("[s3] Failed to delete %d objects: status %ld.\n",
+                      n_keys, req.status);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    request_free (&req);
+    g_free (content_md5);
+    g_string_free (body, TRUE);
+    return ret;
+}
+
+int
+s3_client_delete_many (S3Client *client, const char **keys, int n_keys)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < n_keys; i += DELETE_BATCH_SIZE) {
+        if (delete_batch (client, keys + i,
+                          MIN (DELETE_BATCH_SIZE, n_keys - i)) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+int
+s3_client_copy (S3Client *client, const char *src_key, const char *dst_key)
+{
+    GString *source = g_string_new ("/");
+    S3Request req;
+    int ret = -1;
+
+    uri_encode (source, client->bucket, FALSE);
+    g_string_append_c (source, '/');
+    uri_encode (source, src_key, TRUE);
+
+    memset (&req, 0, sizeof(req));
+    req.method = "PUT";
+    req.key = dst_key;
+    req.copy_source = source->str;
+    if (perform (client, &req) < 0)
+        goto out;
+    /* Copies may fail after the 200 status is sent. */
+    if (req.status != 200 || response_has_error (&req)) {
+        seaf_warning ("[s3] Failed to copy %s to %s: status %ld.\n",
+                      src_key, dst_key, req.status);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    request_free (&req);
+    g_string_free (source, TRUE);
+    return ret;
+}
+
+/* Returns the unescaped text of the first <@tag> between @p and @end. */
+static char *
+xml_element (const char *p, const char *end, const char *tag, const char **next)
+{
+    char *open = g_strdup_printf ("<%s>", tag);
+    char *close = g_strdup_printf ("</%s>", tag);
+    const char *start, *stop;
+    GString *text = NULL;
+
+    start = g_strstr_len (p, end - p, open);
+    if (!start)
+        goto out;
+    start += strlen(open);
+    stop = g_strstr_len (start, end - start, close);
+    if (!stop)
+        goto out;
+    if (next)
+        *next = stop + strlen(close);
+
+    text = g_string_new (NULL);
+    for (p = start; p < stop; ++p) {
+        if (*p != '&') {
+            g_string_append_c (text, *p);
+        } else if (strncmp (p, "&amp;", 5) == 0) {
+            g_string_append_c (text, '&');
+            p += 4;
+        } else if (strncmp (p, "&lt;", 4) == 0) {
+            g_string_append_c (text, '<');
+            p += 3;
+        } else if (strncmp (p, "&gt;", 4) == 0) {
+            g_string_append_c (text, '>');
+            p += 3;
+        } else if (strncmp (p, "&quot;", 6) == 0) {
+            g_string_append_c (text, '"');
+            p += 5;
+        } else if (strncmp (p, "&apos;", 6) == 0) {
+            g_string_append_c (text, '\'');
+            p += 5;
+        } else {
+            g_string_append_c (text, *p);
+        }
+    }
+
+out:
+    g_free (open);
+    g_free (close);
+    return text ? g_string_free (text, FALSE) : NULL;
+}
+
+int
+s3_client_list (S3Client *client, const char *prefix,
+                S3KeyFunc func, void *user_data)
+{
+    GString *query = g_string_new (NULL);
+    char *token = NULL, *truncated, *key, *size;
+    const char *p, *end, *contents_end;
+    S3Request req;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    memset (&req, 0, sizeof(req));
+
+    do {
+        /* Parameters are sorted by name in the canonical query. */
+        g_string_truncate (query, 0);
+        if (token) {
+            g_string_append (query, "continuation-token=");
+            uri_encode (query, token, FALSE);
+            g_string_append_c (query, '&');
+        }
+        g_string_append (query, "list-type=2&prefix=");
+        uri_encode (query, prefix, FALSE);
+
+        request_free (&req);
+        memset (&req, 0, sizeof(req));
+        req.method = "GET";
+        req.query = query->str;
+        if (perform (client, &req) < 0 || req.status != 200) {
+            seaf_warning ("[s3] Failed to list %s: status %ld.\n",
+                          prefix, req.status);
+            ret = -1;
+            break;
+        }
+
+        /* Terminated for the parser. */
+        g_byte_array_append (req.rsp, (guint8 *)"", 1);
+        p = (const char *)req.rsp->data;
+        end = p + req.rsp->len - 1;
+        while (!stop &&
+               (p = g_strstr_len (p, end - p, "<Contents>")) != NULL) {
+            contents_end = g_strstr_len (p, end - p, "</Contents>");
+            if (!contents_end)
+                break;
+            key = xml_element (p, contents_end, "Key", NULL);
+            size = xml_element (p, contents_end, "Size", NULL);
+            if (key && !func (key, size ? g_ascii_strtoll (size, NULL, 10) : 0,
+                              user_data))
+                stop = TRUE;
+            g_free (key);
+            g_free (size);
+            p = contents_end;
+        }
+
+        g_free (token);
+        token = NULL;
+        truncated = xml_element ((const char *)req.rsp->data, end,
+                                 "IsTruncated", NULL);
+        if (g_strcmp0 (truncated, "true") == 0)
+            token = xml_element ((const char *)req.rsp->data, end,
+                                 "NextContinuationToken", NULL);
+        g_free (truncated);
+    } while (token && !stop);
+
+    g_free (token);
+    request_free (&req);
+    g_string_free (query, TRUE);
+    return ret;
+}
+
+typedef struct DeletePrefix {
+    S3Client *client;
+    GPtrArray *keys;
+    int ret;
+} DeletePrefix;
+
+static void
+flush_deletes (DeletePrefix *data)
+{
+    if (data->keys->len == 0)
+        return;
+    if (s3_client_delete_many (data->client, (const char **)data->keys->pdata,
+                               data->keys->len) < 0)
+        data->ret = -1;
+    g_ptr_array_set_size (data->keys, 0);
+}
+
+static gboolean
+collect_delete (const char *key, gint64 size, void *vdata)
+{
+    DeletePrefix *data = vdata;
+
+    g_ptr_array_add (data->keys, g_strdup (key));
+    if (data->keys->len == DELETE_BATCH_SIZE)
+        flush_deletes (data);
+    return TRUE;
+}
+
+int
+s3_client_delete_prefix (S3Client *client, const char *prefix)
+{
+    DeletePrefix data;
+
+    data.client = client;
+    data.keys = g_ptr_array_new_with_free_func (g_free);
+    data.ret = 0;
+
+    if (s3_client_list (client, prefix, collect_delete, &data) < 0)
+        data.ret = -1;
+    flush_deletes (&data);
+
+    g_ptr_array_free (data.keys, TRUE);
+    return data.ret;
+}
+
+#endif  /* HAVE_S3 */
@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef S3_CLIENT_H
+#define S3_CLIENT_H
+
+#include <glib.h>
+
+/*
+ * A client for S3 compatible object storage, shared by the s3 block and
+ * object backends. Requests are signed with AWS signature version 4 and
+ * sent over a pool of keep-alive connections. At most max_in_flight
+ * requests are sent at once, by all threads together.
+ *
+ * Settings are read from a group of seafile.conf, e.g. [block_backend]:
+ *
+ *   name = s3
+ *   bucket = seafile-blocks
+ *   key_id = ...
+ *   key = ...
+ *   host = s3.example.com       # defaults to s3.amazonaws.com
+ *   aws_region = us-east-1
+ *   use_https = true
+ *   path_style_request = false  # true for most S3 compatible servers
+ *   max_in_flight = 32          # concurrent requests
+ *   range_size = 1              # MB, larger objects are read in parallel
+ */
+
+typedef struct S3Client S3Client;
+
+/* Returns NULL if the settings in @group are incomplete. */
+S3Client *
+s3_client_new (GKeyFile *config, const char *group);
+
+int
+s3_client_max_in_flight (S3Client *client);
+
+/*
+ * Reads the object at @key into a newly allocated buffer. Objects larger
+ * than range_size are read with parallel ranged GETs. Returns -1 on error,
+ * and sets @not_found if the object doesn't exist.
+ */
+int
+s3_client_get (S3Client *client, const char *key,
+               void **data, int *len, gboolean *not_found);
+
+int
+s3_client_put (S3Client *client, const char *key,
+               const void *data, int len);
+
+/* Returns 1 if the object exists, 0 if not, -1 on error. @size and @mtime
+ * can be NULL. */
+int
+s3_client_head (S3Client *client, const char *key,
+                gint64 *size, gint64 *mtime);
+
+/*
+ * Checks many objects with concurrent HEAD requests. S3 has no batched
+ * existence check. Errors count as missing.
+ */
+void
+s3_client_head_many (S3Client *client, const char **keys, int n_keys,
+                     gboolean *results);
+
+int
+s3_client_delete (S3Client *client, const char *key);
+
+/* Deletes up to 1000 objects per request. Returns -1 if any of them could
+ * not be deleted. */
+int
+s3_client_delete_many (S3Client *client, const char **keys, int n_keys);
+
+/* Server side copy. */
+int
+s3_client_copy (S3Client *client, const char *src_key, const char *dst_key);
+
+typedef gboolean (*S3KeyFunc) (const char *key, gint64 size, void *user_data);
+
+/* Calls @func for each key starting with @prefix, until it returns FALSE. */
+int
+s3_client_list (S3Client *client, const char *prefix,
+                S3KeyFunc func, void *user_data);
+
+/* Deletes all objects whose keys start with @prefix. */
+int
+s3_client_delete_prefix (S3Client *client, const char *prefix);
+
+#endif
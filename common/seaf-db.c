@@ -1,9 +1,12 @@
 
 #include "common.h"
 
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
 #include "seaf-db.h"
+#include "utils.h"
+#include "lock-stats.h"
 
 #include <stdarg.h>
 #ifdef HAVE_MYSQL
@@ -11,39 +14,251 @@
 #endif
 #include <sqlite3.h>
 #include <pthread.h>
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
 
+/*
+ * Idle connections are kept in a queue, so checking out and returning a
+ * connection are O(1) and never do network round trips under the pool
+ * lock. Idle connections are validated by the keepalive thread. When all
+ * connections are in use, callers wait for one to be returned, up to
+ * CONN_WAIT_TIMEOUT seconds.
+ */
 struct DBConnPool {
-    GPtrArray *connections;
-    pthread_mutex_t lock;
+    SeafLock lock;
+    pthread_cond_t cond;
+    /* Idle connections, the most recently returned first. */
+    GQueue *idle;
+    /* Open connections, idle or in use. */
+    int n_connections;
     int max_connections;
+
+    int n_in_use;
+    int n_waiters;
+    guint64 n_waits;
+    guint64 n_timeouts;
+    gint64 wait_time;
 };
 typedef struct DBConnPool DBConnPool;
 
 struct SeafDB {
     int type;
     DBConnPool *pool;
+    /* Read replicas, used by the read-only helpers in turn. */
+    GPtrArray *replicas;
+    volatile gint next_replica;
+    /* Seconds the keys of a write are read from the primary. */
+    int pin_time;
+    /* Pinned repo ids and emails, to the monotonic time they expire. */
+    pthread_mutex_t pin_lock;
+    GHashTable *pinned;
+    gint64 pinned_all_until;
+    gint64 last_prune;
 };
 
+/*
+ * Prepared statements of a connection, keyed by sql text, so that the
+ * same queries are not parsed again on every call. A statement is taken
+ * out of the cache while it's in use, so nested queries with the same sql
+ * prepare their own. Only statements that ran to completion are returned.
+ */
+typedef struct StmtCache {
+    /* sql -> link in lru */
+    GHashTable *stmts;
+    /* CachedStmt, the most recently used first. */
+    GQueue *lru;
+    void (*close) (void *stmt);
+} StmtCache;
+
+typedef struct CachedStmt {
+    char *sql;
+    void *stmt;
+} CachedStmt;
+
+#define STMT_CACHE_SIZE 64
+
 typedef struct DBConnection {
-    gboolean is_available;
     DBConnPool *pool;
+    StmtCache stmts;
 } DBConnection;
 
+static void
+stmt_cache_init (StmtCache *cache, void (*close) (void *stmt))
+{
+    cache->stmts = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->lru = g_queue_new ();
+    cache->close = close;
+}
+
+static void
+cached_stmt_free (StmtCache *cache, CachedStmt *cached)
+{
+    cache->close (cached->stmt);
+    g_free (cached->sql);
+    g_free (cached);
+}
+
+/* Close all statements, e.g. when they are lost with a reconnect. */
+static void
+stmt_cache_clear (StmtCache *cache)
+{
+    CachedStmt *cached;
+
+    if (!cache->lru)
+        return;
+
+    g_hash_table_remove_all (cache->stmts);
+    while ((cached = g_queue_pop_head (cache->lru)) != NULL)
+        cached_stmt_free (cache, cached);
+}
+
+static void
+stmt_cache_destroy (StmtCache *cache)
+{
+    if (!cache->lru)
+        return;
+
+    stmt_cache_clear (cache);
+    g_hash_table_destroy (cache->stmts);
+    g_queue_free (cache->lru);
+    cache->stmts = NULL;
+    cache->lru = NULL;
+}
+
+static void *
+stmt_cache_take (StmtCache *cache, const char *sql)
+{
+    GList *link;
+    CachedStmt *cached;
+    void *stmt;
+
+    link = g_hash_table_lookup (cache->stmts, sql);
+    if (!link)
+        return NULL;
+
+    cached = link->data;
+    g_hash_table_remove (cache->stmts, sql);
+    g_queue_delete_link (cache->lru, link);
+
+    stmt = cached->stmt;
+    g_free (cached->sql);
+    g_free (cached);
+    return stmt;
+}
+
+static void
+stmt_cache_put (StmtCache *cache, const char *sql, void *stmt)
+{
+    CachedStmt *cached;
+
+    /* A nested query with the same sql was returned first. */
+    if (g_hash_table_lookup (cache->stmts, sql)) {
+        cache->close (stmt);
+        return;
+    }
+
+    cached = g_new0 (CachedStmt, 1);
+    cached->sql = g_strdup (sql);
+    cached->stmt = stmt;
+    g_queue_push_head (cache->lru, cached);
+    g_hash_table_insert (cache->stmts, cached->sql, cache->lru->head);
+
+    if (cache->lru->length > STMT_CACHE_SIZE) {
+        cached = g_queue_pop_tail (cache->lru);
+        g_hash_table_remove (cache->stmts, cached->sql);
+        cached_stmt_free (cache, cached);
+    }
+}
+
 struct SeafDBRow {
     /* Empty */
 };
 
 struct SeafDBTrans {
+    SeafDB *db;
     DBConnection *conn;
     gboolean need_close;
+    /* Pinned for reads on commit. */
+    GPtrArray *pin_keys;
+    gboolean pin_all;
 };
 
+/*
+ * Statement parameters. The va_list of "type", value pairs taken by the
+ * public API is collected into an array, so that statements built from
+ * many rows, like batches, can be bound the same way.
+ */
+enum {
+    DB_PARAM_INT,
+    DB_PARAM_INT64,
+    DB_PARAM_STRING,
+};
+
+typedef struct DBParam {
+    int type;
+    union {
+        int i;
+        gint64 i64;
+        const char *s;
+    } v;
+} DBParam;
+
+static int
+collect_param (DBParam *param, const char *type, va_list *args)
+{
+    if (strcmp (type, "int") == 0) {
+        param->type = DB_PARAM_INT;
+        param->v.i = va_arg (*args, int);
+    } else if (strcmp (type, "int64") == 0) {
+        param->type = DB_PARAM_INT64;
+        param->v.i64 = va_arg (*args, gint64);
+    } else if (strcmp (type, "string") == 0) {
+        param->type = DB_PARAM_STRING;
+        param->v.s = va_arg (*args, const char *);
+    } else {
+        seaf_warning ("BUG: invalid prep stmt parameter type %s.\n", type);
+        return -1;
+    }
+    return 0;
+}
+
+/* Strings in the returned array point to the arguments. */
+static DBParam *
+collect_params (int n, va_list args, gboolean *error)
+{
+    DBParam *params;
+    va_list copy;
+    int i;
+
+    *error = FALSE;
+    if (n == 0)
+        return NULL;
+
+    params = g_new0 (DBParam, n);
+    va_copy (copy, args);
+    for (i = 0; i < n; ++i) {
+        const char *type = va_arg (copy, const char *);
+        if (collect_param (&params[i], type, &copy) < 0) {
+            *error = TRUE;
+            break;
+        }
+    }
+    va_end (copy);
+
+    if (*error) {
+        g_free (params);
+        return NULL;
+    }
+    return params;
+}
+
 typedef struct DBOperations {
     DBConnection* (*get_connection)(SeafDB *db);
     void (*release_connection)(DBConnection *conn, gboolean need_close);
     int (*execute_sql_no_stmt)(DBConnection *conn, const char *sql);
     int (*execute_sql)(DBConnection *conn, const char *sql,
-                       int n, va_list args);
+                       int n, const DBParam *params);
     int (*query_foreach_row)(DBConnection *conn,
                              const char *sql, SeafDBRowFunc callback, void *data,
                              int n, va_list args);
@@ -74,7 +289,8 @@ mysql_db_release_connection (DBConnection *vconn);
 static int
 mysql_db_execute_sql_no_stmt (DBConnection *vconn, const char *sql);
 static int
-mysql_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args);
+mysql_db_execute_sql (DBConnection *vconn, const char *sql,
+                      int n, const DBParam *values);
 static int
 mysql_db_query_foreach_row (DBConnection *vconn, const char *sql,
                             SeafDBRowFunc callback, void *data,
@@ -94,72 +310,112 @@ static DBConnPool *
 init_conn_pool_common (int max_connections)
 {
     DBConnPool *pool = g_new0(DBConnPool, 1);
-    pool->connections = g_ptr_array_sized_new (max_connections);
-    pthread_mutex_init (&pool->lock, NULL);
+    seaf_lock_init (&pool->lock, "db_pool");
+    pthread_cond_init (&pool->cond, NULL);
+    pool->idle = g_queue_new ();
     pool->max_connections = max_connections;
 
     return pool;
 }
 
+#define CONN_WAIT_TIMEOUT 10
+
 static DBConnection *
 mysql_conn_pool_get_connection (SeafDB *db)
 {
     DBConnPool *pool = db->pool;
     DBConnection *conn = NULL;
+    struct timespec deadline;
+    gint64 wait_start = 0;
+    gboolean timed_out = FALSE;
 
     if (pool->max_connections == 0) {
         conn = mysql_db_get_connection (db);
-        conn->pool = pool;
+        if (conn)
+            conn->pool = pool;
         return conn;
     }
 
-    pthread_mutex_lock (&pool->lock);
+    seaf_lock_lock (&pool->lock);
 
-    guint i, size = pool->connections->len;
-    for (i = 0; i < size; ++i) {
-        conn = g_ptr_array_index (pool->connections, i);
-        if (conn->is_available && mysql_db_connection_ping (conn)) {
-            conn->is_available = FALSE;
-            goto out;
-        }
-    }
-    conn = NULL;
-    if (size < pool->max_connections) {
-        conn = mysql_db_get_connection (db);
+    while (1) {
+        conn = g_queue_pop_head (pool->idle);
         if (conn) {
-            conn->pool = pool;
-            conn->is_available = FALSE;
-            g_ptr_array_add (pool->connections, conn);
+            ++(pool->n_in_use);
+            break;
+        }
+
+        if (pool->n_connections < pool->max_connections) {
+            /* Reserve the slot and connect outside of the lock. */
+            ++(pool->n_connections);
+            ++(pool->n_in_use);
+            seaf_lock_unlock (&pool->lock);
+
+            conn = mysql_db_get_connection (db);
+            if (conn) {
+                conn->pool = pool;
+                seaf_lock_lock (&pool->lock);
+                break;
+            }
+
+            seaf_lock_lock (&pool->lock);
+            --(pool->n_connections);
+            --(pool->n_in_use);
+            pthread_cond_signal (&pool->cond);
+            break;
         }
+
+        if (timed_out) {
+            ++(pool->n_timeouts);
+            seaf_warning ("Timed out waiting for a database connection, "
+                          "%d connections in use.\n", pool->n_in_use);
+            break;
+        }
+
+        if (!wait_start) {
+            wait_start = g_get_monotonic_time ();
+            clock_gettime (CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += CONN_WAIT_TIMEOUT;
+            ++(pool->n_waits);
+        }
+        ++(pool->n_waiters);
+        if (seaf_lock_cond_timedwait (&pool->cond, &pool->lock, &deadline) == ETIMEDOUT)
+            timed_out = TRUE;
+        --(pool->n_waiters);
     }
 
-out:
-    pthread_mutex_unlock (&pool->lock);
+    if (wait_start)
+        pool->wait_time += g_get_monotonic_time () - wait_start;
+
+    seaf_lock_unlock (&pool->lock);
     return conn;
 }
 
 static void
 mysql_conn_pool_release_connection (DBConnection *conn, gboolean need_close)
 {
+    DBConnPool *pool;
+
     if (!conn)
         return;
 
-    if (conn->pool->max_connections == 0) {
+    pool = conn->pool;
+    if (pool->max_connections == 0) {
         mysql_db_release_connection (conn);
         return;
     }
 
-    if (need_close) {
-        pthread_mutex_lock (&conn->pool->lock);
-        g_ptr_array_remove (conn->pool->connections, conn);
-        pthread_mutex_unlock (&conn->pool->lock);
-        mysql_db_release_connection (conn);
-        return;
-    }
+    seaf_lock_lock (&pool->lock);
+    --(pool->n_in_use);
+    if (need_close)
+        --(pool->n_connections);
+    else
+        g_queue_push_head (pool->idle, conn);
+    pthread_cond_signal (&pool->cond);
+    seaf_lock_unlock (&pool->lock);
 
-    pthread_mutex_lock (&conn->pool->lock);
-    conn->is_available = TRUE;
-    pthread_mutex_unlock (&conn->pool->lock);
+    if (need_close)
+        mysql_db_release_connection (conn);
 }
 
 #define KEEPALIVE_INTERVAL 30
@@ -168,18 +424,44 @@ mysql_conn_keepalive (void *arg)
 {
     DBConnPool *pool = arg;
     DBConnection *conn = NULL;
+    GQueue *idle;
+    GList *ptr;
 
     while (1) {
-        pthread_mutex_lock (&pool->lock);
-
-        guint i, size = pool->connections->len;
-        for (i = 0; i < size; ++i) {
-            conn = g_ptr_array_index (pool->connections, i);
-            if (conn->is_available) {
-                mysql_db_connection_ping (conn);
+        /* Take the idle connections out of the pool and ping them without
+         * holding the lock. Broken connections are closed.
+         */
+        seaf_lock_lock (&pool->lock);
+        idle = pool->idle;
+        pool->idle = g_queue_new ();
+        pool->n_in_use += idle->length;
+        seaf_lock_unlock (&pool->lock);
+
+        for (ptr = idle->head; ptr; ptr = ptr->next) {
+            conn = ptr->data;
+            if (!mysql_db_connection_ping (conn)) {
+                mysql_db_release_connection (conn);
+                ptr->data = NULL;
             }
         }
-        pthread_mutex_unlock (&pool->lock);
+
+        seaf_lock_lock (&pool->lock);
+        for (ptr = idle->head; ptr; ptr = ptr->next) {
+            --(pool->n_in_use);
+            if (ptr->data)
+                g_queue_push_tail (pool->idle, ptr->data);
+            else
+                --(pool->n_connections);
+            pthread_cond_signal (&pool->cond);
+        }
+        seaf_debug ("Database connection pool: %d connections, %d in use, "
+                    "%d waiters, %"G_GUINT64_FORMAT" waits, "
+                    "%"G_GUINT64_FORMAT" timeouts, %"G_GINT64_FORMAT" us waited.\n",
+                    pool->n_connections, pool->n_in_use, pool->n_waiters,
+                    pool->n_waits, pool->n_timeouts, pool->wait_time);
+        seaf_lock_unlock (&pool->lock);
+
+        g_queue_free (idle);
 
         sleep (KEEPALIVE_INTERVAL);
     }
@@ -230,6 +512,25 @@ seaf_db_new_mysql (const char *host,
 
 #endif
 
+void
+seaf_db_get_pool_stats (SeafDB *db, SeafDBPoolStats *stats)
+{
+    DBConnPool *pool = db->pool;
+
+    memset (stats, 0, sizeof(SeafDBPoolStats));
+    if (!pool)
+        return;
+
+    seaf_lock_lock (&pool->lock);
+    stats->n_connections = pool->n_connections;
+    stats->n_in_use = pool->n_in_use;
+    stats->n_waiters = pool->n_waiters;
+    stats->n_waits = pool->n_waits;
+    stats->n_timeouts = pool->n_timeouts;
+    stats->wait_time = pool->wait_time;
+    seaf_lock_unlock (&pool->lock);
+}
+
 /* SQLite Ops */
 static SeafDB *
 sqlite_db_new (const char *db_path);
@@ -240,7 +541,8 @@ sqlite_db_release_connection (DBConnection *vconn, gboolean need_close);
 static int
 sqlite_db_execute_sql_no_stmt (DBConnection *vconn, const char *sql);
 static int
-sqlite_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args);
+sqlite_db_execute_sql (DBConnection *vconn, const char *sql,
+                       int n, const DBParam *values);
 static int
 sqlite_db_query_foreach_row (DBConnection *vconn, const char *sql,
                              SeafDBRowFunc callback, void *data,
@@ -283,6 +585,521 @@ seaf_db_type (SeafDB *db)
     return db->type;
 }
 
+/*
+ * Read replicas.
+ *
+ * Read-only helpers pick the replicas in turn, writes and transactions
+ * always use the primary. The requests of a client run on different
+ * threads, so its own writes are found by what they touched: the repo ids
+ * and user emails among the parameters of a write are pinned for the next
+ * pin_time seconds, and reads with a pinned parameter use the primary.
+ * A write with no parameters pins all reads.
+ */
+
+#define DEFAULT_REPLICA_PIN_TIME 5
+
+static gboolean
+is_pin_key (const char *s)
+{
+    return (s && (strchr (s, '@') != NULL || is_uuid_valid (s)));
+}
+
+static gboolean
+pin_expired (gpointer key, gpointer value, gpointer now)
+{
+    return (*(gint64 *)value <= *(gint64 *)now);
+}
+
+static void
+pin_keys (SeafDB *db, int n, const char **keys)
+{
+    gint64 now, until, *value;
+    int i;
+
+    now = g_get_monotonic_time ();
+    until = now + (gint64)db->pin_time * G_USEC_PER_SEC;
+
+    pthread_mutex_lock (&db->pin_lock);
+    for (i = 0; i < n; ++i) {
+        value = g_hash_table_lookup (db->pinned, keys[i]);
+        if (!value) {
+            value = g_new (gint64, 1);
+            g_hash_table_insert (db->pinned, g_strdup (keys[i]), value);
+        }
+        *value = until;
+    }
+    /* Expired pins are dropped once every pin_time. */
+    if (now - db->last_prune > (gint64)db->pin_time * G_USEC_PER_SEC) {
+        g_hash_table_foreach_remove (db->pinned, pin_expired, &now);
+        db->last_prune = now;
+    }
+    pthread_mutex_unlock (&db->pin_lock);
+}
+
+static void
+pin_all (SeafDB *db)
+{
+    gint64 until = g_get_monotonic_time () + (gint64)db->pin_time * G_USEC_PER_SEC;
+
+    pthread_mutex_lock (&db->pin_lock);
+    if (until > db->pinned_all_until)
+        db->pinned_all_until = until;
+    pthread_mutex_unlock (&db->pin_lock);
+}
+
+/* Adds the pin keys among @params to @keys, without copying them. */
+static void
+collect_pin_keys (int n, const DBParam *params, GPtrArray *keys)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (params[i].type == DB_PARAM_STRING && is_pin_key (params[i].v.s))
+            g_ptr_array_add (keys, (gpointer)params[i].v.s);
+    }
+}
+
+static void
+pin_params (SeafDB *db, int n, const DBParam *params)
+{
+    GPtrArray *keys;
+
+    if (!db->replicas)
+        return;
+    if (n == 0) {
+        pin_all (db);
+        return;
+    }
+
+    keys = g_ptr_array_new ();
+    collect_pin_keys (n, params, keys);
+    pin_keys (db, keys->len, (const char **)keys->pdata);
+    g_ptr_array_free (keys, TRUE);
+}
+
+/* The keys are pinned when the transaction commits. */
+static void
+trans_pin_params (SeafDBTrans *trans, int n, const DBParam *params)
+{
+    GPtrArray *keys;
+    guint i;
+
+    if (!trans->db->replicas)
+        return;
+    if (n == 0) {
+        trans->pin_all = TRUE;
+        return;
+    }
+
+    keys = g_ptr_array_new ();
+    collect_pin_keys (n, params, keys);
+    for (i = 0; i < keys->len; ++i)
+        g_ptr_array_add (trans->pin_keys, g_strdup (keys->pdata[i]));
+    g_ptr_array_free (keys, TRUE);
+}
+
+static gboolean
+is_pinned (SeafDB *db, int n, const DBParam *params)
+{
+    gint64 now = g_get_monotonic_time (), *until;
+    gboolean ret = FALSE;
+    int i;
+
+    pthread_mutex_lock (&db->pin_lock);
+    if (db->pinned_all_until > now) {
+        ret = TRUE;
+        goto out;
+    }
+    for (i = 0; i < n; ++i) {
+        if (params[i].type != DB_PARAM_STRING || !is_pin_key (params[i].v.s))
+            continue;
+        until = g_hash_table_lookup (db->pinned, params[i].v.s);
+        if (until && *until > now) {
+            ret = TRUE;
+            break;
+        }
+    }
+out:
+    pthread_mutex_unlock (&db->pin_lock);
+    return ret;
+}
+
+static pthread_key_t primary_reads_key;
+static pthread_once_t primary_reads_once = PTHREAD_ONCE_INIT;
+
+static void
+create_primary_reads_key (void)
+{
+    pthread_key_create (&primary_reads_key, NULL);
+}
+
+static void
+add_primary_reads (int delta)
+{
+    int depth;
+
+    pthread_once (&primary_reads_once, create_primary_reads_key);
+    depth = GPOINTER_TO_INT (pthread_getspecific (primary_reads_key));
+    pthread_setspecific (primary_reads_key, GINT_TO_POINTER (depth + delta));
+}
+
+void
+seaf_db_begin_primary_reads ()
+{
+    add_primary_reads (1);
+}
+
+void
+seaf_db_end_primary_reads ()
+{
+    add_primary_reads (-1);
+}
+
+static gboolean
+in_primary_reads ()
+{
+    pthread_once (&primary_reads_once, create_primary_reads_key);
+    return (pthread_getspecific (primary_reads_key) != NULL);
+}
+
+static DBConnection *
+get_read_connection (SeafDB *db, int n, va_list args)
+{
+    SeafDB *replica;
+    DBConnection *conn;
+    DBParam *params;
+    gboolean bad_params, pinned;
+    guint i;
+
+    if (!db->replicas || in_primary_reads ())
+        return db_ops.get_connection (db);
+
+    /* Bad parameters fail the query later, wherever it runs. */
+    params = collect_params (n, args, &bad_params);
+    pinned = is_pinned (db, bad_params ? 0 : n, params);
+    g_free (params);
+    if (pinned)
+        return db_ops.get_connection (db);
+
+    i = (guint)g_atomic_int_add (&db->next_replica, 1) % db->replicas->len;
+    replica = g_ptr_array_index (db->replicas, i);
+    conn = db_ops.get_connection (replica);
+    if (conn)
+        return conn;
+
+    /* Fall back to the primary when a replica is down. */
+    return db_ops.get_connection (db);
+}
+
+void
+seaf_db_add_replica (SeafDB *db, SeafDB *replica)
+{
+    if (!db->replicas) {
+        db->replicas = g_ptr_array_new ();
+        pthread_mutex_init (&db->pin_lock, NULL);
+        db->pinned = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+        if (db->pin_time <= 0)
+            db->pin_time = DEFAULT_REPLICA_PIN_TIME;
+    }
+    g_ptr_array_add (db->replicas, replica);
+}
+
+void
+seaf_db_set_replica_pin_time (SeafDB *db, int pin_time)
+{
+    if (pin_time > 0)
+        db->pin_time = pin_time;
+}
+
+/*
+ * Statement stats.
+ *
+ * Statements are counted and timed by their sql, with quoted strings,
+ * numbers and parameter lists replaced by a single '?', so that queries
+ * built with printf or for a number of rows share an entry. Statements
+ * slower than slow_query_threshold ms are logged with their callers.
+ */
+
+#define MAX_QUERY_STATS 1000
+#define OTHER_QUERIES "(other)"
+#define SLOW_QUERY_CALLERS 4
+
+static pthread_mutex_t query_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* sql template -> SeafDBQueryStats */
+static GHashTable *query_stats;
+/* Statements without literals that normalize to another template, like
+ * ones with parameter lists.
+ */
+static GHashTable *query_aliases;
+static int slow_query_threshold;
+
+void
+seaf_db_set_slow_query_threshold (int threshold)
+{
+    slow_query_threshold = threshold;
+}
+
+static void
+append_placeholder (GString *buf)
+{
+    gsize len = buf->len;
+
+    /* Fold "?, ?" into "?". */
+    while (len > 0 && buf->str[len - 1] == ' ')
+        --len;
+    if (len >= 2 && buf->str[len - 1] == ',' && buf->str[len - 2] == '?') {
+        g_string_truncate (buf, len - 1);
+        return;
+    }
+    g_string_append_c (buf, '?');
+}
+
+static void
+append_close_paren (GString *buf)
+{
+    gsize len;
+
+    g_string_append_c (buf, ')');
+
+    /* Fold the rows of "VALUES (?), (?)" into one. */
+    if (!g_str_has_suffix (buf->str, "(?)"))
+        return;
+    len = buf->len - 3;
+    while (len > 0 && buf->str[len - 1] == ' ')
+        --len;
+    if (len == 0 || buf->str[len - 1] != ',')
+        return;
+    --len;
+    while (len > 0 && buf->str[len - 1] == ' ')
+        --len;
+    if (len >= 3 && strncmp (buf->str + len - 3, "(?)", 3) == 0)
+        g_string_truncate (buf, len);
+}
+
+static gboolean
+is_ident_char (char c)
+{
+    return g_ascii_isalnum (c) || c == '_';
+}
+
+static gboolean
+has_literals (const char *sql)
+{
+    const char *p;
+
+    for (p = sql; *p; ++p) {
+        if (*p == '\'' || *p == '"')
+            return TRUE;
+        if (g_ascii_isdigit (*p) && (p == sql || !is_ident_char (p[-1])))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static char *
+normalize_sql (const char *sql)
+{
+    GString *buf = g_string_sized_new (strlen(sql));
+    const char *p = sql;
+    char c;
+
+    while ((c = *p) != '\0') {
+        if (c == '\'' || c == '"') {
+            for (++p; *p && *p != c; ++p) {
+                if (*p == '\\' && p[1])
+                    ++p;
+            }
+            if (*p)
+                ++p;
+            append_placeholder (buf);
+        } else if (c == '?') {
+            ++p;
+            append_placeholder (buf);
+        } else if (g_ascii_isdigit (c) &&
+                   (buf->len == 0 || !is_ident_char (buf->str[buf->len - 1]))) {
+            for (++p; is_ident_char (*p) || *p == '.'; ++p)
+                ;
+            append_placeholder (buf);
+        } else if (c == ')') {
+            ++p;
+            append_close_paren (buf);
+        } else {
+            g_string_append_c (buf, c);
+            ++p;
+        }
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+static void
+query_stats_free (SeafDBQueryStats *stats)
+{
+    g_free (stats->sql);
+    g_free (stats);
+}
+
+static SeafDBQueryStats *
+add_query_stats (char *sql)
+{
+    SeafDBQueryStats *stats = g_new0 (SeafDBQueryStats, 1);
+
+    stats->sql = sql;
+    g_hash_table_insert (query_stats, sql, stats);
+    return stats;
+}
+
+static void
+log_slow_query (const char *sql, gint64 elapsed)
+{
+    GString *callers = g_string_new (NULL);
+#ifdef __GLIBC__
+    void *frames[SLOW_QUERY_CALLERS + 3];
+    char **symbols;
+    int n, i;
+
+    /* Skip this function, record_query() and the wrapper of db_ops. */
+    n = backtrace (frames, G_N_ELEMENTS(frames));
+    symbols = backtrace_symbols (frames, n);
+    for (i = 3; symbols && i < n; ++i)
+        g_string_append_printf (callers, "%s%s", i > 3 ? " < " : "", symbols[i]);
+    free (symbols);
+#endif
+
+    seaf_message ("Slow query (%"G_GINT64_FORMAT" ms): %s, called from %s\n",
+                  elapsed / 1000, sql, callers->len ? callers->str : "unknown");
+    g_string_free (callers, TRUE);
+}
+
+static void
+record_query (const char *sql, gint64 start, gboolean failed)
+{
+    gint64 elapsed = g_get_monotonic_time () - start;
+    SeafDBQueryStats *stats;
+    char *key;
+
+    pthread_mutex_lock (&query_stats_lock);
+    if (!query_stats) {
+        query_stats = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                             (GDestroyNotify)query_stats_free);
+        query_aliases = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+    }
+
+    stats = g_hash_table_lookup (query_stats, sql);
+    if (!stats)
+        stats = g_hash_table_lookup (query_aliases, sql);
+    if (!stats) {
+        /* Only templates are added, so queries with literals normalize
+         * on every call. That's cheaper than keeping each of them.
+         */
+        pthread_mutex_unlock (&query_stats_lock);
+        key = normalize_sql (sql);
+        pthread_mutex_lock (&query_stats_lock);
+
+        stats = g_hash_table_lookup (query_stats, key);
+        if (stats) {
+            g_free (key);
+        } else if (g_hash_table_size (query_stats) < MAX_QUERY_STATS) {
+            stats = add_query_stats (key);
+        } else {
+            g_free (key);
+            stats = g_hash_table_lookup (query_stats, OTHER_QUERIES);
+            if (!stats)
+                stats = add_query_stats (g_strdup (OTHER_QUERIES));
+        }
+
+        if (strcmp (stats->sql, sql) != 0 && !has_literals (sql) &&
+            g_hash_table_size (query_aliases) < MAX_QUERY_STATS)
+            g_hash_table_insert (query_aliases, g_strdup (sql), stats);
+    }
+
+    stats->count++;
+    if (failed)
+        stats->errors++;
+    stats->total_time += elapsed;
+    if (elapsed > stats->max_time)
+        stats->max_time = elapsed;
+    pthread_mutex_unlock (&query_stats_lock);
+
+    if (slow_query_threshold > 0 && elapsed >= (gint64)slow_query_threshold * 1000)
+        log_slow_query (sql, elapsed);
+}
+
+static gint
+compare_query_time (gconstpointer a, gconstpointer b)
+{
+    const SeafDBQueryStats *sa = a, *sb = b;
+
+    if (sa->total_time != sb->total_time)
+        return sa->total_time > sb->total_time ? -1 : 1;
+    return strcmp (sa->sql, sb->sql);
+}
+
+GList *
+seaf_db_get_query_stats ()
+{
+    GHashTableIter iter;
+    gpointer value;
+    SeafDBQueryStats *stats, *copy;
+    GList *ret = NULL;
+
+    pthread_mutex_lock (&query_stats_lock);
+    if (query_stats) {
+        g_hash_table_iter_init (&iter, query_stats);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            stats = value;
+            copy = g_memdup (stats, sizeof(SeafDBQueryStats));
+            copy->sql = g_strdup (stats->sql);
+            ret = g_list_prepend (ret, copy);
+        }
+    }
+    pthread_mutex_unlock (&query_stats_lock);
+
+    return g_list_sort (ret, compare_query_time);
+}
+
+void
+seaf_db_query_stats_free (GList *stats)
+{
+    g_list_free_full (stats, (GDestroyNotify)query_stats_free);
+}
+
+static int
+execute_sql_no_stmt (DBConnection *conn, const char *sql)
+{
+    gint64 start = g_get_monotonic_time ();
+    int ret;
+
+    ret = db_ops.execute_sql_no_stmt (conn, sql);
+    record_query (sql, start, ret < 0);
+    return ret;
+}
+
+static int
+execute_sql (DBConnection *conn, const char *sql, int n, const DBParam *params)
+{
+    gint64 start = g_get_monotonic_time ();
+    int ret;
+
+    ret = db_ops.execute_sql (conn, sql, n, params);
+    record_query (sql, start, ret < 0);
+    return ret;
+}
+
+static int
+query_foreach_row (DBConnection *conn, const char *sql,
+                   SeafDBRowFunc callback, void *data, int n, va_list args)
+{
+    gint64 start = g_get_monotonic_time ();
+    int ret;
+
+    ret = db_ops.query_foreach_row (conn, sql, callback, data, n, args);
+    record_query (sql, start, ret < 0);
+    return ret;
+}
+
 int
 seaf_db_query (SeafDB *db, const char *sql)
 {
@@ -291,7 +1108,8 @@ seaf_db_query (SeafDB *db, const char *sql)
         return -1;
 
     int ret;
-    ret = db_ops.execute_sql_no_stmt (conn, sql);
+    ret = execute_sql_no_stmt (conn, sql);
+    pin_params (db, 0, NULL);
 
     db_ops.release_connection (conn, ret < 0);
     return ret;
@@ -357,15 +1175,25 @@ seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...)
 {
     int ret;
     DBConnection *conn = NULL;
-
-    conn = db_ops.get_connection (db);
-    if (!conn)
-        return -1;
+    DBParam *params;
+    gboolean bad_params;
 
     va_list args;
     va_start (args, n);
-    ret = db_ops.execute_sql (conn, sql, n, args);
+    params = collect_params (n, args, &bad_params);
     va_end (args);
+    if (bad_params)
+        return -1;
+
+    conn = db_ops.get_connection (db);
+    if (!conn) {
+        g_free (params);
+        return -1;
+    }
+
+    ret = execute_sql (conn, sql, n, params);
+    pin_params (db, n, params);
+    g_free (params);
 
     db_ops.release_connection (conn, ret < 0);
 
@@ -378,15 +1206,16 @@ seaf_db_statement_exists (SeafDB *db, const char *sql, gboolean *db_err, int n,
     int n_rows;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection(db);
+    va_list args;
+    va_start (args, n);
+    conn = get_read_connection (db, n, args);
     if (!conn) {
+        va_end (args);
         *db_err = TRUE;
         return FALSE;
     }
 
-    va_list args;
-    va_start (args, n);
-    n_rows = db_ops.query_foreach_row (conn, sql, NULL, NULL, n, args);
+    n_rows = query_foreach_row (conn, sql, NULL, NULL, n, args);
     va_end (args);
 
     db_ops.release_connection(conn, n_rows < 0);
@@ -408,13 +1237,15 @@ seaf_db_statement_foreach_row (SeafDB *db, const char *sql,
     int ret;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
-    if (!conn)
-        return -1;
-
     va_list args;
     va_start (args, n);
-    ret = db_ops.query_foreach_row (conn, sql, callback, data, n, args);
+    conn = get_read_connection (db, n, args);
+    if (!conn) {
+        va_end (args);
+        return -1;
+    }
+
+    ret = query_foreach_row (conn, sql, callback, data, n, args);
     va_end (args);
 
     db_ops.release_connection (conn, ret < 0);
@@ -439,13 +1270,15 @@ seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
-    if (!conn)
-        return -1;
-
     va_list args;
     va_start (args, n);
-    rc = db_ops.query_foreach_row (conn, sql, get_int_cb, &ret, n, args);
+    conn = get_read_connection (db, n, args);
+    if (!conn) {
+        va_end (args);
+        return -1;
+    }
+
+    rc = query_foreach_row (conn, sql, get_int_cb, &ret, n, args);
     va_end (args);
 
     db_ops.release_connection (conn, rc < 0);
@@ -473,13 +1306,15 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
-    if (!conn)
-        return -1;
-
     va_list args;
     va_start (args, n);
-    rc = db_ops.query_foreach_row (conn, sql, get_int64_cb, &ret, n, args);
+    conn = get_read_connection (db, n, args);
+    if (!conn) {
+        va_end (args);
+        return -1;
+    }
+
+    rc = query_foreach_row (conn, sql, get_int64_cb, &ret, n, args);
     va_end(args);
 
     db_ops.release_connection (conn, rc < 0);
@@ -507,13 +1342,15 @@ seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
     int rc;
     DBConnection *conn = NULL;
 
-    conn = db_ops.get_connection (db);
-    if (!conn)
-        return NULL;
-
     va_list args;
     va_start (args, n);
-    rc = db_ops.query_foreach_row (conn, sql, get_string_cb, &ret, n, args);
+    conn = get_read_connection (db, n, args);
+    if (!conn) {
+        va_end (args);
+        return NULL;
+    }
+
+    rc = query_foreach_row (conn, sql, get_string_cb, &ret, n, args);
     va_end(args);
 
     db_ops.release_connection (conn, rc < 0);
@@ -535,13 +1372,15 @@ seaf_db_begin_transaction (SeafDB *db)
         return trans;
     }
 
-    if (db_ops.execute_sql_no_stmt (conn, "BEGIN") < 0) {
+    if (execute_sql_no_stmt (conn, "BEGIN") < 0) {
         db_ops.release_connection (conn, TRUE);
         return trans;
     }
 
     trans = g_new0 (SeafDBTrans, 1);
+    trans->db = db;
     trans->conn = conn;
+    trans->pin_keys = g_ptr_array_new_with_free_func (g_free);
 
     return trans;
 }
@@ -550,6 +1389,7 @@ void
 seaf_db_trans_close (SeafDBTrans *trans)
 {
     db_ops.release_connection (trans->conn, trans->need_close);
+    g_ptr_array_free (trans->pin_keys, TRUE);
     g_free (trans);
 }
 
@@ -558,11 +1398,17 @@ seaf_db_commit (SeafDBTrans *trans)
 {
     DBConnection *conn = trans->conn;
 
-    if (db_ops.execute_sql_no_stmt (conn, "COMMIT") < 0) {
+    if (execute_sql_no_stmt (conn, "COMMIT") < 0) {
         trans->need_close = TRUE;
         return -1;
     }
 
+    if (trans->pin_all)
+        pin_params (trans->db, 0, NULL);
+    else if (trans->db->replicas && trans->pin_keys->len > 0)
+        pin_keys (trans->db, trans->pin_keys->len,
+                  (const char **)trans->pin_keys->pdata);
+
     return 0;
 }
 
@@ -571,7 +1417,7 @@ seaf_db_rollback (SeafDBTrans *trans)
 {
     DBConnection *conn = trans->conn;
 
-    if (db_ops.execute_sql_no_stmt (conn, "ROLLBACK") < 0) {
+    if (execute_sql_no_stmt (conn, "ROLLBACK") < 0) {
         trans->need_close = TRUE;
         return -1;
     }
@@ -582,12 +1428,20 @@ seaf_db_rollback (SeafDBTrans *trans)
 int
 seaf_db_trans_query (SeafDBTrans *trans, const char *sql, int n, ...)
 {
+    DBParam *params;
+    gboolean bad_params;
     int ret;
 
     va_list args;
     va_start (args, n);
-    ret = db_ops.execute_sql (trans->conn, sql, n, args);
+    params = collect_params (n, args, &bad_params);
     va_end (args);
+    if (bad_params)
+        return -1;
+
+    ret = execute_sql (trans->conn, sql, n, params);
+    trans_pin_params (trans, n, params);
+    g_free (params);
 
     if (ret < 0)
         trans->need_close = TRUE;
@@ -605,7 +1459,7 @@ seaf_db_trans_check_for_existence (SeafDBTrans *trans,
 
     va_list args;
     va_start (args, n);
-    n_rows = db_ops.query_foreach_row (trans->conn, sql, NULL, NULL, n, args);
+    n_rows = query_foreach_row (trans->conn, sql, NULL, NULL, n, args);
     va_end (args);
 
     if (n_rows < 0) {
@@ -627,7 +1481,7 @@ seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
 
     va_list args;
     va_start (args, n);
-    ret = db_ops.query_foreach_row (trans->conn, sql, callback, data, n, args);
+    ret = query_foreach_row (trans->conn, sql, callback, data, n, args);
     va_end (args);
 
     if (ret < 0)
@@ -636,6 +1490,187 @@ seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
     return ret;
 }
 
+/* Batches */
+
+/*
+ * Rows added to a batch are written with multi-row statements, one per
+ * BATCH_MAX_ROWS rows. SQLite before 3.32 allows at most 999 parameters in
+ * a statement, so wide rows make smaller chunks.
+ */
+#define BATCH_MAX_ROWS 500
+#define BATCH_MAX_PARAMS 999
+
+struct SeafDBBatch {
+    SeafDB *db;
+    SeafDBTrans *trans;
+    char *sql_prefix;
+    int n_columns;
+    int max_rows;
+    int n_rows;
+    /* DBParam of the pending rows. */
+    GArray *params;
+    /* Copies of the string parameters. */
+    GPtrArray *strings;
+    gboolean failed;
+};
+
+static SeafDBBatch *
+batch_new (SeafDB *db, SeafDBTrans *trans, const char *sql_prefix, int n_columns)
+{
+    SeafDBBatch *batch;
+
+    g_return_val_if_fail (n_columns > 0 && n_columns <= BATCH_MAX_PARAMS, NULL);
+
+    batch = g_new0 (SeafDBBatch, 1);
+    batch->db = db;
+    batch->trans = trans;
+    batch->sql_prefix = g_strdup (sql_prefix);
+    batch->n_columns = n_columns;
+    batch->max_rows = MIN (BATCH_MAX_ROWS, BATCH_MAX_PARAMS / n_columns);
+    batch->params = g_array_new (FALSE, FALSE, sizeof(DBParam));
+    batch->strings = g_ptr_array_new_with_free_func (g_free);
+
+    return batch;
+}
+
+SeafDBBatch *
+seaf_db_batch_new (SeafDB *db, const char *sql_prefix, int n_columns)
+{
+    return batch_new (db, NULL, sql_prefix, n_columns);
+}
+
+SeafDBBatch *
+seaf_db_trans_batch_new (SeafDBTrans *trans, const char *sql_prefix, int n_columns)
+{
+    return batch_new (trans->db, trans, sql_prefix, n_columns);
+}
+
+static char *
+batch_build_sql (SeafDBBatch *batch)
+{
+    GString *sql = g_string_new (batch->sql_prefix);
+    int i, j;
+
+    g_string_append (sql, " VALUES ");
+    for (i = 0; i < batch->n_rows; ++i) {
+        if (i > 0)
+            g_string_append (sql, ", ");
+        g_string_append_c (sql, '(');
+        for (j = 0; j < batch->n_columns; ++j) {
+            if (j > 0)
+                g_string_append (sql, ", ");
+            g_string_append_c (sql, '?');
+        }
+        g_string_append_c (sql, ')');
+    }
+
+    return g_string_free (sql, FALSE);
+}
+
+static int
+batch_flush (SeafDBBatch *batch)
+{
+    DBConnection *conn;
+    char *sql;
+    int ret;
+
+    if (batch->n_rows == 0)
+        return 0;
+
+    /* All full chunks have the same sql, so their statement is cached. */
+    sql = batch_build_sql (batch);
+
+    if (batch->trans) {
+        ret = execute_sql (batch->trans->conn, sql, batch->params->len,
+                                  (DBParam *)batch->params->data);
+        trans_pin_params (batch->trans, batch->params->len,
+                          (DBParam *)batch->params->data);
+        if (ret < 0)
+            batch->trans->need_close = TRUE;
+    } else {
+        conn = db_ops.get_connection (batch->db);
+        if (!conn) {
+            ret = -1;
+        } else {
+            ret = execute_sql (conn, sql, batch->params->len,
+                                      (DBParam *)batch->params->data);
+            pin_params (batch->db, batch->params->len,
+                        (DBParam *)batch->params->data);
+            db_ops.release_connection (conn, ret < 0);
+        }
+    }
+
+    g_free (sql);
+    g_array_set_size (batch->params, 0);
+    g_ptr_array_set_size (batch->strings, 0);
+    batch->n_rows = 0;
+
+    if (ret < 0)
+        batch->failed = TRUE;
+    return ret;
+}
+
+int
+seaf_db_batch_add_row (SeafDBBatch *batch, ...)
+{
+    DBParam param;
+    guint len = batch->params->len;
+    int i;
+
+    if (batch->failed)
+        return -1;
+
+    va_list args;
+    va_start (args, batch);
+    for (i = 0; i < batch->n_columns; ++i) {
+        const char *type = va_arg (args, const char *);
+        if (collect_param (&param, type, &args) < 0)
+            break;
+        if (param.type == DB_PARAM_STRING && param.v.s) {
+            char *copy = g_strdup (param.v.s);
+            g_ptr_array_add (batch->strings, copy);
+            param.v.s = copy;
+        }
+        g_array_append_val (batch->params, param);
+    }
+    va_end (args);
+
+    if (i < batch->n_columns) {
+        g_array_set_size (batch->params, len);
+        batch->failed = TRUE;
+        return -1;
+    }
+
+    if (++batch->n_rows == batch->max_rows)
+        return batch_flush (batch);
+    return 0;
+}
+
+int
+seaf_db_batch_finish (SeafDBBatch *batch)
+{
+    int ret = 0;
+
+    if (!batch->failed)
+        batch_flush (batch);
+    if (batch->failed)
+        ret = -1;
+
+    seaf_db_batch_free (batch);
+    return ret;
+}
+
+void
+seaf_db_batch_free (SeafDBBatch *batch)
+{
+    if (!batch)
+        return;
+    g_free (batch->sql_prefix);
+    g_array_free (batch->params, TRUE);
+    g_ptr_array_free (batch->strings, TRUE);
+    g_free (batch);
+}
+
 int
 seaf_db_row_get_column_count (SeafDBRow *row)
 {
@@ -661,8 +1696,16 @@ typedef struct MySQLDB {
 typedef struct MySQLDBConnection {
     struct DBConnection parent;
     MYSQL *db_conn;
+    /* Changes when the client reconnects, which drops prepared statements. */
+    unsigned long thread_id;
 } MySQLDBConnection;
 
+static void
+mysql_stmt_close_cached (void *stmt)
+{
+    mysql_stmt_close ((MYSQL_STMT *)stmt);
+}
+
 static gboolean
 mysql_db_connection_ping (DBConnection *vconn)
 {
@@ -736,6 +1779,8 @@ mysql_db_get_connection (SeafDB *vdb)
 
     conn = g_new0 (MySQLDBConnection, 1);
     conn->db_conn = db_conn;
+    conn->thread_id = mysql_thread_id (db_conn);
+    stmt_cache_init (&conn->parent.stmts, mysql_stmt_close_cached);
 
     return (DBConnection *)conn;
 }
@@ -748,6 +1793,7 @@ mysql_db_release_connection (DBConnection *vconn)
 
     MySQLDBConnection *conn = (MySQLDBConnection *)vconn;
 
+    stmt_cache_destroy (&conn->parent.stmts);
     mysql_close (conn->db_conn);
 
     g_free (conn);
@@ -786,30 +1832,44 @@ _prepare_stmt_mysql (MYSQL *db, const char *sql)
     return stmt;
 }
 
+static MYSQL_STMT *
+_get_stmt_mysql (MySQLDBConnection *conn, const char *sql)
+{
+    MYSQL_STMT *stmt;
+    unsigned long thread_id = mysql_thread_id (conn->db_conn);
+
+    if (thread_id != conn->thread_id) {
+        stmt_cache_clear (&conn->parent.stmts);
+        conn->thread_id = thread_id;
+    }
+
+    stmt = stmt_cache_take (&conn->parent.stmts, sql);
+    if (stmt)
+        return stmt;
+
+    return _prepare_stmt_mysql (conn->db_conn, sql);
+}
+
 static int
-_bind_params_mysql (MYSQL_STMT *stmt, MYSQL_BIND *params, int n, va_list args)
+_bind_params_mysql (MYSQL_STMT *stmt, MYSQL_BIND *params, int n, const DBParam *values)
 {
     int i;
-    const char *type;
 
     for (i = 0; i < n; ++i) {
-        type = va_arg (args, const char *);
-        if (strcmp(type, "int") == 0) {
-            int x = va_arg (args, int);
+        if (values[i].type == DB_PARAM_INT) {
             int *pval = g_new (int, 1);
-            *pval = x;
+            *pval = values[i].v.i;
             params[i].buffer_type = MYSQL_TYPE_LONG;
             params[i].buffer = pval;
             params[i].is_null = 0;
-        } else if (strcmp (type, "int64") == 0) {
-            gint64 x = va_arg (args, gint64);
+        } else if (values[i].type == DB_PARAM_INT64) {
             gint64 *pval = g_new (gint64, 1);
-            *pval = x;
+            *pval = values[i].v.i64;
             params[i].buffer_type = MYSQL_TYPE_LONGLONG;
             params[i].buffer = pval;
             params[i].is_null = 0;
-        } else if (strcmp (type, "string") == 0) {
-            const char *s = va_arg (args, const char *);
+        } else {
+            const char *s = values[i].v.s;
             static my_bool yes = TRUE;
             params[i].buffer_type = MYSQL_TYPE_STRING;
             params[i].buffer = g_strdup(s);
@@ -824,9 +1884,6 @@ _bind_params_mysql (MYSQL_STMT *stmt, MYSQL_BIND *params, int n, va_list args)
                 params[i].buffer_length = *plen + 1;
                 params[i].is_null = 0;
             }
-        } else {
-            seaf_warning ("BUG: invalid prep stmt parameter type %s.\n", type);
-            g_return_val_if_reached (-1);
         }
     }
 
@@ -838,22 +1895,22 @@ _bind_params_mysql (MYSQL_STMT *stmt, MYSQL_BIND *params, int n, va_list args)
 }
 
 static int
-mysql_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args)
+mysql_db_execute_sql (DBConnection *vconn, const char *sql,
+                      int n, const DBParam *values)
 {
     MySQLDBConnection *conn = (MySQLDBConnection *)vconn;
-    MYSQL *db = conn->db_conn;
     MYSQL_STMT *stmt = NULL;
     MYSQL_BIND *params = NULL;
     int ret = 0;
 
-    stmt = _prepare_stmt_mysql (db, sql);
+    stmt = _get_stmt_mysql (conn, sql);
     if (!stmt) {
         return -1;
     }
 
     if (n > 0) {
         params = g_new0 (MYSQL_BIND, n);
-        if (_bind_params_mysql (stmt, params, n, args) < 0) {
+        if (_bind_params_mysql (stmt, params, n, values) < 0) {
             seaf_warning ("Failed to bind parameters for %s: %s.\n",
                           sql, mysql_stmt_error(stmt));
             ret = -1;
@@ -868,8 +1925,12 @@ mysql_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args)
     }
 
 out:
-    if (stmt)
-        mysql_stmt_close (stmt);
+    if (stmt) {
+        if (ret == 0)
+            stmt_cache_put (&conn->parent.stmts, sql, stmt);
+        else
+            mysql_stmt_close (stmt);
+    }
     if (params) {
         int i;
         for (i = 0; i < n; ++i) {
@@ -898,23 +1959,30 @@ mysql_db_query_foreach_row (DBConnection *vconn, const char *sql,
                             int n, va_list args)
 {
     MySQLDBConnection *conn = (MySQLDBConnection *)vconn;
-    MYSQL *db = conn->db_conn;
     MYSQL_STMT *stmt = NULL;
     MYSQL_BIND *params = NULL;
+    DBParam *values = NULL;
+    gboolean bad_params;
     MySQLDBRow row;
     int nrows = 0;
+    gboolean fetched_all = FALSE;
     int i;
 
     memset (&row, 0, sizeof(row));
 
-    stmt = _prepare_stmt_mysql (db, sql);
+    values = collect_params (n, args, &bad_params);
+    if (bad_params)
+        return -1;
+
+    stmt = _get_stmt_mysql (conn, sql);
     if (!stmt) {
+        g_free (values);
         return -1;
     }
 
     if (n > 0) {
         params = g_new0 (MYSQL_BIND, n);
-        if (_bind_params_mysql (stmt, params, n, args) < 0) {
+        if (_bind_params_mysql (stmt, params, n, values) < 0) {
             nrows = -1;
             goto out;
         }
@@ -957,8 +2025,10 @@ mysql_db_query_foreach_row (DBConnection *vconn, const char *sql,
             nrows = -1;
             goto out;
         }
-        if (rc == MYSQL_NO_DATA)
+        if (rc == MYSQL_NO_DATA) {
+            fetched_all = TRUE;
             break;
+        }
 
         /* rc == 0 or rc == MYSQL_DATA_TRUNCATED */
 
@@ -980,7 +2050,11 @@ mysql_db_query_foreach_row (DBConnection *vconn, const char *sql,
 out:
     if (stmt) {
         mysql_stmt_free_result (stmt);
-        mysql_stmt_close (stmt);
+        /* Unread rows would be left on a cached statement. */
+        if (fetched_all)
+            stmt_cache_put (&conn->parent.stmts, sql, stmt);
+        else
+            mysql_stmt_close (stmt);
     }
     if (params) {
         for (i = 0; i < n; ++i) {
@@ -989,6 +2063,7 @@ out:
         }
         g_free (params);
     }
+    g_free (values);
     if (row.results) {
         for (i = 0; i < row.column_count; ++i) {
             g_free (row.results[i].buffer);
@@ -1191,6 +2266,30 @@ typedef struct SQLiteDBConnection {
     sqlite3 *db_conn;
 } SQLiteDBConnection;
 
+static void
+sqlite_stmt_close_cached (void *stmt)
+{
+    sqlite3_finalize ((sqlite3_stmt *)stmt);
+}
+
+static int
+sqlite_get_stmt (SQLiteDBConnection *conn, const char *sql, sqlite3_stmt **pstmt)
+{
+    *pstmt = stmt_cache_take (&conn->parent.stmts, sql);
+    if (*pstmt)
+        return SQLITE_OK;
+
+    return sqlite3_blocking_prepare_v2 (conn->db_conn, sql, -1, pstmt, NULL);
+}
+
+static void
+sqlite_put_stmt (SQLiteDBConnection *conn, const char *sql, sqlite3_stmt *stmt)
+{
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+    stmt_cache_put (&conn->parent.stmts, sql, stmt);
+}
+
 static SeafDB *
 sqlite_db_new (const char *db_path)
 {
@@ -1218,6 +2317,7 @@ sqlite_db_get_connection (SeafDB *vdb)
 
     conn = g_new0 (SQLiteDBConnection, 1);
     conn->db_conn = db_conn;
+    stmt_cache_init (&conn->parent.stmts, sqlite_stmt_close_cached);
 
     return (DBConnection *)conn;
 }
@@ -1230,6 +2330,7 @@ sqlite_db_release_connection (DBConnection *vconn, gboolean need_close)
 
     SQLiteDBConnection *conn = (SQLiteDBConnection *)vconn;
 
+    stmt_cache_destroy (&conn->parent.stmts);
     sqlite3_close (conn->db_conn);
 
     g_free (conn);
@@ -1254,34 +2355,26 @@ sqlite_db_execute_sql_no_stmt (DBConnection *vconn, const char *sql)
 }
 
 static int
-_bind_parameters_sqlite (sqlite3 *db, sqlite3_stmt *stmt, int n, va_list args)
+_bind_parameters_sqlite (sqlite3 *db, sqlite3_stmt *stmt, int n, const DBParam *values)
 {
     int i;
-    const char *type;
 
     for (i = 0; i < n; ++i) {
-        type = va_arg (args, const char *);
-        if (strcmp(type, "int") == 0) {
-            int x = va_arg (args, int);
-            if (sqlite3_bind_int (stmt, i+1, x) != SQLITE_OK) {
+        if (values[i].type == DB_PARAM_INT) {
+            if (sqlite3_bind_int (stmt, i+1, values[i].v.i) != SQLITE_OK) {
                 seaf_warning ("sqlite3_bind_int failed: %s\n", sqlite3_errmsg(db));
                 return -1;
             }
-        } else if (strcmp (type, "int64") == 0) {
-            gint64 x = va_arg (args, gint64);
-            if (sqlite3_bind_int64 (stmt, i+1, x) != SQLITE_OK) {
+        } else if (values[i].type == DB_PARAM_INT64) {
+            if (sqlite3_bind_int64 (stmt, i+1, values[i].v.i64) != SQLITE_OK) {
                 seaf_warning ("sqlite3_bind_int64 failed: %s\n", sqlite3_errmsg(db));
                 return -1;
             }
-        } else if (strcmp (type, "string") == 0) {
-            const char *s = va_arg (args, const char *);
-            if (sqlite3_bind_text (stmt, i+1, s, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+        } else {
+            if (sqlite3_bind_text (stmt, i+1, values[i].v.s, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
                 seaf_warning ("sqlite3_bind_text failed: %s\n", sqlite3_errmsg(db));
                 return -1;
             }
-        } else {
-            seaf_warning ("BUG: invalid prep stmt parameter type %s.\n", type);
-            g_return_val_if_reached (-1);
         }
     }
 
@@ -1289,7 +2382,8 @@ _bind_parameters_sqlite (sqlite3 *db, sqlite3_stmt *stmt, int n, va_list args)
 }
 
 static int
-sqlite_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args)
+sqlite_db_execute_sql (DBConnection *vconn, const char *sql,
+                       int n, const DBParam *values)
 {
     SQLiteDBConnection *conn = (SQLiteDBConnection *)vconn;
     sqlite3 *db = conn->db_conn;
@@ -1297,13 +2391,13 @@ sqlite_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args
     int rc;
     int ret = 0;
 
-    rc = sqlite3_blocking_prepare_v2 (db, sql, -1, &stmt, NULL);
+    rc = sqlite_get_stmt (conn, sql, &stmt);
     if (rc != SQLITE_OK) {
         seaf_warning ("sqlite3_prepare_v2 failed %s: %s", sql, sqlite3_errmsg(db));
         return -1;
     }
 
-    if (_bind_parameters_sqlite (db, stmt, n, args) < 0) {
+    if (_bind_parameters_sqlite (db, stmt, n, values) < 0) {
         seaf_warning ("Failed to bind parameters for sql %s\n", sql);
         ret = -1;
         goto out;
@@ -1317,7 +2411,10 @@ sqlite_db_execute_sql (DBConnection *vconn, const char *sql, int n, va_list args
     }
 
 out:
-    sqlite3_finalize (stmt);
+    if (ret == 0)
+        sqlite_put_stmt (conn, sql, stmt);
+    else
+        sqlite3_finalize (stmt);
     return ret;
 }
 
@@ -1336,16 +2433,23 @@ sqlite_db_query_foreach_row (DBConnection *vconn, const char *sql,
     SQLiteDBConnection *conn = (SQLiteDBConnection *)vconn;
     sqlite3 *db = conn->db_conn;
     sqlite3_stmt *stmt;
+    DBParam *values;
+    gboolean bad_params;
     int rc;
     int nrows = 0;
 
-    rc = sqlite3_blocking_prepare_v2 (db, sql, -1, &stmt, NULL);
+    values = collect_params (n, args, &bad_params);
+    if (bad_params)
+        return -1;
+
+    rc = sqlite_get_stmt (conn, sql, &stmt);
     if (rc != SQLITE_OK) {
         seaf_warning ("sqlite3_prepare_v2 failed %s: %s", sql, sqlite3_errmsg(db));
+        g_free (values);
         return -1;
     }
 
-    if (_bind_parameters_sqlite (db, stmt, n, args) < 0) {
+    if (_bind_parameters_sqlite (db, stmt, n, values) < 0) {
         seaf_warning ("Failed to bind parameters for sql %s\n", sql);
         nrows = -1;
         goto out;
@@ -1373,7 +2477,11 @@ sqlite_db_query_foreach_row (DBConnection *vconn, const char *sql,
     }
 
 out:
-    sqlite3_finalize (stmt);
+    if (nrows >= 0)
+        sqlite_put_stmt (conn, sql, stmt);
+    else
+        sqlite3_finalize (stmt);
+    g_free (values);
     return nrows;
 }
 
@@ -13,6 +13,7 @@ typedef struct SeafDBRow SeafDBRow;
 typedef struct SeafDBRow CcnetDBRow;
 typedef struct SeafDBTrans SeafDBTrans;
 typedef struct SeafDBTrans CcnetDBTrans;
+typedef struct SeafDBBatch SeafDBBatch;
 
 typedef gboolean (*SeafDBRowFunc) (SeafDBRow *, void *);
 typedef gboolean (*CcnetDBRowFunc) (CcnetDBRow *, void *);
@@ -45,6 +46,71 @@ seaf_db_new_sqlite (const char *db_path, int max_connections);
 int
 seaf_db_type (SeafDB *db);
 
+/*
+ * Add a read replica of @db. Read-only helpers (foreach_row, exists and
+ * get_*) then use the replicas in turn, while writes and transactions use
+ * @db. For @pin_time seconds after a write, reads with one of its repo ids
+ * or user emails as a parameter use @db, so that a client sees its own
+ * writes from any thread.
+ */
+void
+seaf_db_add_replica (SeafDB *db, SeafDB *replica);
+
+void
+seaf_db_set_replica_pin_time (SeafDB *db, int pin_time);
+
+/*
+ * Between these calls, the reads of the calling thread use the primary of
+ * every db. Permission checks run so, since a lagging replica could still
+ * grant a revoked share. The calls nest.
+ */
+void
+seaf_db_begin_primary_reads ();
+
+void
+seaf_db_end_primary_reads ();
+
+typedef struct SeafDBPoolStats {
+    int n_connections;
+    int n_in_use;
+    int n_waiters;
+    /* Checkouts that had to wait, and those that gave up. */
+    guint64 n_waits;
+    guint64 n_timeouts;
+    /* Total wait time in microseconds. */
+    gint64 wait_time;
+} SeafDBPoolStats;
+
+/* Counters of the MySQL connection pool, all zero for other databases. */
+void
+seaf_db_get_pool_stats (SeafDB *db, SeafDBPoolStats *stats);
+
+/*
+ * Statements of all databases are counted and timed by their sql template,
+ * the sql with literals and parameter lists replaced by '?'.
+ */
+typedef struct SeafDBQueryStats {
+    char *sql;
+    guint64 count;
+    guint64 errors;
+    /* Total and maximum time in microseconds. */
+    gint64 total_time;
+    gint64 max_time;
+} SeafDBQueryStats;
+
+/* Statements slower than @threshold ms are logged with their callers.
+ * 0 disables it.
+ */
+void
+seaf_db_set_slow_query_threshold (int threshold);
+
+/* Returns copies of the stats, the most time consuming first. */
+GList *
+seaf_db_get_query_stats ();
+
+void
+seaf_db_query_stats_free (GList *stats);
+
 int
 seaf_db_query (SeafDB *db, const char *sql);
 
@@ -104,6 +170,32 @@ seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
 int
 seaf_db_row_get_column_count (SeafDBRow *row);
 
+/*
+ * Batches write many rows with few statements. @sql_prefix is the
+ * statement up to the VALUES keyword, like "INSERT INTO T (a, b)" or
+ * "REPLACE INTO T (a, b)". Rows are given as @n_columns "type", value
+ * pairs and are written in chunks. Rows of a batch on a transaction are
+ * only visible after the commit; other batches write each chunk on its own.
+ */
+
+SeafDBBatch *
+seaf_db_batch_new (SeafDB *db, const char *sql_prefix, int n_columns);
+
+SeafDBBatch *
+seaf_db_trans_batch_new (SeafDBTrans *trans, const char *sql_prefix, int n_columns);
+
+/* Once a chunk fails, rows are no longer added and -1 is returned. */
+int
+seaf_db_batch_add_row (SeafDBBatch *batch, ...);
+
+/* Write the pending rows and free the batch. Returns -1 if any chunk failed. */
+int
+seaf_db_batch_finish (SeafDBBatch *batch);
+
+/* Free the batch and drop the pending rows. */
+void
+seaf_db_batch_free (SeafDBBatch *batch);
+
 /* Prepared Statements */
 
 int
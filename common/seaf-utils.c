@@ -56,11 +56,53 @@ sqlite_db_start (SeafileSession *session)
 
 #define MYSQL_DEFAULT_PORT 3306
 
+/*
+ * Open a pool for each replica in @hosts, a list of host[:port] separated
+ * by commas. The replicas use the credentials of the primary.
+ */
+static void
+add_mysql_replicas (SeafDB *db, const char *hosts, int default_port,
+                    const char *user, const char *passwd, const char *db_name,
+                    gboolean use_ssl, const char *charset,
+                    int max_connections, int pin_time)
+{
+    char **tokens, **ptr;
+    char *host, *colon;
+    int port;
+    SeafDB *replica;
+
+    tokens = g_strsplit (hosts, ",", -1);
+    for (ptr = tokens; *ptr; ++ptr) {
+        host = g_strstrip (*ptr);
+        if (*host == '\0')
+            continue;
+
+        port = default_port;
+        colon = strrchr (host, ':');
+        if (colon) {
+            *colon = '\0';
+            port = atoi (colon + 1);
+        }
+
+        replica = seaf_db_new_mysql (host, port, user, passwd, db_name, NULL,
+                                     use_ssl, charset, max_connections);
+        if (!replica) {
+            seaf_warning ("Failed to start mysql replica %s.\n", host);
+            continue;
+        }
+        seaf_db_add_replica (db, replica);
+        seaf_message ("Reading from mysql replica %s:%d.\n", host, port);
+    }
+    g_strfreev (tokens);
+
+    seaf_db_set_replica_pin_time (db, pin_time);
+}
+
 static int
 mysql_db_start (SeafileSession *session)
 {
-    char *host, *user, *passwd, *db, *unix_socket, *charset;
-    int port;
+    char *host, *user, *passwd, *db, *unix_socket, *charset, *replica_hosts;
+    int port, pin_time;
     gboolean use_ssl = FALSE;
     int max_connections = 0;
     GError *error = NULL;
@@ -119,6 +161,16 @@ mysql_db_start (SeafileSession *session)
         return -1;
     }
 
+    replica_hosts = seaf_key_file_get_string (session->config,
+                                              "database", "replica_hosts", NULL);
+    if (replica_hosts) {
+        pin_time = g_key_file_get_integer (session->config,
+                                           "database", "replica_pin_time", NULL);
+        add_mysql_replicas (session->db, replica_hosts, port, user, passwd, db,
+                            use_ssl, charset, max_connections, pin_time);
+        g_free (replica_hosts);
+    }
+
     g_free (host);
     g_free (user);
     g_free (passwd);
@@ -198,6 +250,7 @@ load_database_config (SeafileSession *session)
     GError *error = NULL;
     int ret = 0;
     gboolean create_tables = FALSE;
+    int slow_query_threshold;
 
     type = seaf_key_file_get_string (session->config, "database", "type", &error);
     /* Default to use sqlite if not set. */
@@ -219,6 +272,11 @@ load_database_config (SeafileSession *session)
         ret = -1;
     }
     if (ret == 0) {
+        slow_query_threshold = g_key_file_get_integer (session->config,
+                                                       "database",
+                                                       "slow_query_threshold",
+                                                       NULL);
+        seaf_db_set_slow_query_threshold (slow_query_threshold);
         if (g_key_file_has_key (session->config, "database", "create_tables", NULL))
             create_tables = g_key_file_get_boolean (session->config,
                                                     "database", "create_tables", NULL);
@@ -249,8 +307,8 @@ ccnet_init_sqlite_database (SeafileSession *session)
 static int
 ccnet_init_mysql_database (SeafileSession *session)
 {
-    char *host, *user, *passwd, *db, *unix_socket, *charset;
-    int port;
+    char *host, *user, *passwd, *db, *unix_socket, *charset, *replica_hosts;
+    int port, pin_time;
     gboolean use_ssl = FALSE;
     int max_connections = 0;
 
@@ -304,6 +362,16 @@ ccnet_init_mysql_database (SeafileSession *session)
         return -1;
     }
 
+    replica_hosts = ccnet_key_file_get_string (session->ccnet_config,
+                                               "Database", "REPLICA_HOSTS");
+    if (replica_hosts) {
+        pin_time = g_key_file_get_integer (session->ccnet_config,
+                                           "Database", "REPLICA_PIN_TIME", NULL);
+        add_mysql_replicas (session->ccnet_db, replica_hosts, port, user, passwd, db,
+                            use_ssl, charset, max_connections, pin_time);
+        g_free (replica_hosts);
+    }
+
     g_free (host);
     g_free (user);
     g_free (passwd);
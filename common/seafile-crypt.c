@@ -1,9 +1,13 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <glib.h>
 #include "seafile-crypt.h"
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #include "utils.h"
 #include "log.h"
@@ -35,10 +39,169 @@ seafile_crypt_new (int version, unsigned char *key, unsigned char *iv)
     return crypt;
 }
 
+/*
+ * Cache of derived keys. Unlocking a library derives three keys, and the
+ * same password is given again by every web session and every node, so
+ * the results are kept for a while. Entries are found by an HMAC of the
+ * input under a random secret of the process, so neither passwords nor
+ * fast hashes of them are kept. The entries are in memory locked out of
+ * swap and core dumps, and cleared when they expire or are evicted.
+ */
+
+typedef struct DerivedKey {
+    unsigned char id[32];
+    int version;
+    unsigned char key[32];
+    unsigned char iv[16];
+    gint64 expire_time;
+    gint64 last_used;
+} DerivedKey;
+
+typedef struct DerivedKeyCache {
+    pthread_mutex_t lock;
+    unsigned char secret[32];
+    DerivedKey *entries;
+    int n_entries;
+    gint64 ttl;
+} DerivedKeyCache;
+
+static DerivedKeyCache *key_cache;
+
 int
-seafile_derive_key (const char *data_in, int in_len, int version,
-                    const char *repo_salt,
+seafile_derive_key_cache_init (int max_entries, int ttl)
+{
+    DerivedKeyCache *cache;
+    size_t size;
+
+    if (key_cache || max_entries <= 0 || ttl <= 0)
+        return 0;
+
+    cache = g_new0 (DerivedKeyCache, 1);
+    if (RAND_bytes (cache->secret, sizeof(cache->secret)) != 1) {
+        seaf_warning ("Failed to generate secret of derived key cache.\n");
+        g_free (cache);
+        return -1;
+    }
+
+    size = sizeof(DerivedKey) * max_entries;
+    cache->entries = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache->entries == MAP_FAILED) {
+        seaf_warning ("Failed to allocate derived key cache: %s.\n",
+                      strerror(errno));
+        OPENSSL_cleanse (cache->secret, sizeof(cache->secret));
+        g_free (cache);
+        return -1;
+    }
+    if (mlock (cache->entries, size) < 0)
+        seaf_warning ("Failed to lock derived key cache in memory: %s.\n",
+                      strerror(errno));
+#ifdef MADV_DONTDUMP
+    madvise (cache->entries, size, MADV_DONTDUMP);
+#endif
+
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->n_entries = max_entries;
+    cache->ttl = (gint64)ttl * G_USEC_PER_SEC;
+    key_cache = cache;
+
+    return 0;
+}
+
+static void
+compute_entry_id (const char *data_in, int in_len, int version,
+                  const char *repo_salt, unsigned char *id)
+{
+    int salt_len = repo_salt ? strlen(repo_salt) : 0;
+    int len = 1 + salt_len + 1 + in_len;
+    unsigned char *buf = g_malloc (len);
+
+    /* The version, the salt and the input, the salt ends with a 0. */
+    buf[0] = version;
+    if (repo_salt)
+        memcpy (buf + 1, repo_salt, salt_len);
+    buf[1 + salt_len] = 0;
+    memcpy (buf + 2 + salt_len, data_in, in_len);
+
+    HMAC (EVP_sha256(), key_cache->secret, sizeof(key_cache->secret),
+          buf, len, id, NULL);
+
+    OPENSSL_cleanse (buf, len);
+    g_free (buf);
+}
+
+static void
+clear_entry (DerivedKey *entry)
+{
+    OPENSSL_cleanse (entry, sizeof(DerivedKey));
+}
+
+/* Returns TRUE and fills @key and @iv if the key of @id is cached. */
+static gboolean
+lookup_derived_key (const unsigned char *id, int version,
                     unsigned char *key, unsigned char *iv)
+{
+    gint64 now = g_get_monotonic_time ();
+    DerivedKey *entry;
+    gboolean found = FALSE;
+    int i;
+
+    pthread_mutex_lock (&key_cache->lock);
+    for (i = 0; i < key_cache->n_entries; ++i) {
+        entry = &key_cache->entries[i];
+        if (entry->expire_time == 0)
+            continue;
+        if (entry->expire_time <= now) {
+            clear_entry (entry);
+            continue;
+        }
+        if (entry->version == version &&
+            CRYPTO_memcmp (entry->id, id, sizeof(entry->id)) == 0) {
+            memcpy (key, entry->key, sizeof(entry->key));
+            memcpy (iv, entry->iv, sizeof(entry->iv));
+            entry->last_used = now;
+            found = TRUE;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&key_cache->lock);
+
+    return found;
+}
+
+static void
+insert_derived_key (const unsigned char *id, int version,
+                    const unsigned char *key, const unsigned char *iv)
+{
+    gint64 now = g_get_monotonic_time ();
+    DerivedKey *entry, *victim = NULL;
+    int i;
+
+    pthread_mutex_lock (&key_cache->lock);
+    /* Use a free slot, otherwise the least recently used one. */
+    for (i = 0; i < key_cache->n_entries; ++i) {
+        entry = &key_cache->entries[i];
+        if (entry->expire_time <= now) {
+            victim = entry;
+            break;
+        }
+        if (!victim || entry->last_used < victim->last_used)
+            victim = entry;
+    }
+    clear_entry (victim);
+    memcpy (victim->id, id, sizeof(victim->id));
+    victim->version = version;
+    memcpy (victim->key, key, sizeof(victim->key));
+    memcpy (victim->iv, iv, sizeof(victim->iv));
+    victim->expire_time = now + key_cache->ttl;
+    victim->last_used = now;
+    pthread_mutex_unlock (&key_cache->lock);
+}
+
+static int
+derive_key (const char *data_in, int in_len, int version,
+            const char *repo_salt,
+            unsigned char *key, unsigned char *iv)
 {
     if (version >= 3) {
         unsigned char repo_salt_bin[32];
@@ -87,6 +250,30 @@ seafile_derive_key (const char *data_in, int in_len, int version,
                                iv); /* IV, initial vector */
 }
 
+int
+seafile_derive_key (const char *data_in, int in_len, int version,
+                    const char *repo_salt,
+                    unsigned char *key, unsigned char *iv)
+{
+    unsigned char id[32];
+    int ret;
+
+    /* Version 0 keys are cheap to derive. */
+    if (!key_cache || version < 1)
+        return derive_key (data_in, in_len, version, repo_salt, key, iv);
+
+    compute_entry_id (data_in, in_len, version, repo_salt, id);
+    if (lookup_derived_key (id, version, key, iv))
+        return version == 1 ? 16 : 0;
+
+    ret = derive_key (data_in, in_len, version, repo_salt, key, iv);
+    /* EVP_BytesToKey() returns the key length, 0 on errors. */
+    if ((version == 1 && ret > 0) || (version >= 2 && ret == 0))
+        insert_derived_key (id, version, key, iv);
+
+    return ret;
+}
+
 int
 seafile_generate_repo_salt (char *repo_salt)
 {
@@ -282,6 +469,216 @@ seafile_update_random_key (const char *old_passwd, const char *old_random_key,
     return 0;
 }
 
+struct SeafileCipher {
+    EVP_CIPHER_CTX *ctx;
+    int encrypt;
+    int version;
+    unsigned char key[32];
+    unsigned char iv[16];
+};
+
+static const EVP_CIPHER *
+cipher_for_version (int version)
+{
+    if (version == 1)
+        return EVP_aes_128_cbc ();
+    else if (version == 3)
+        return EVP_aes_128_ecb ();
+    else
+        return EVP_aes_256_cbc ();
+}
+
+int
+seafile_decrypted_len (SeafileCrypt *crypt, const char *data_in, int in_len)
+{
+    EVP_CIPHER_CTX *ctx;
+    const unsigned char *iv = crypt->iv;
+    const unsigned char *last;
+    unsigned char out[BLK_SIZE * 2];
+    int out_len = 0, pad;
+
+    if (in_len < BLK_SIZE || in_len % BLK_SIZE != 0)
+        return -1;
+
+    last = (const unsigned char *)data_in + in_len - BLK_SIZE;
+    /* In cbc mode the previous cipher block is the iv of the last one. */
+    if (in_len >= 2 * BLK_SIZE)
+        iv = last - BLK_SIZE;
+
+    ctx = EVP_CIPHER_CTX_new ();
+    if (!ctx ||
+        EVP_DecryptInit_ex (ctx, cipher_for_version (crypt->version),
+                            NULL, crypt->key, iv) == DEC_FAILURE) {
+        if (ctx)
+            EVP_CIPHER_CTX_free (ctx);
+        return -1;
+    }
+    EVP_CIPHER_CTX_set_padding (ctx, 0);
+    if (EVP_DecryptUpdate (ctx, out, &out_len, last, BLK_SIZE) == DEC_FAILURE)
+        out_len = 0;
+    EVP_CIPHER_CTX_free (ctx);
+
+    pad = out[BLK_SIZE - 1];
+    OPENSSL_cleanse (out, sizeof(out));
+    if (out_len != BLK_SIZE || pad < 1 || pad > BLK_SIZE)
+        return -1;
+
+    return in_len - pad;
+}
+
+SeafileCipher *
+seafile_cipher_new (SeafileCrypt *crypt, gboolean encrypt)
+{
+    SeafileCipher *cipher;
+
+    if (!crypt)
+        return NULL;
+
+    cipher = g_new0 (SeafileCipher, 1);
+    cipher->encrypt = encrypt ? 1 : 0;
+    cipher->version = crypt->version;
+    memcpy (cipher->key, crypt->key, sizeof(cipher->key));
+    memcpy (cipher->iv, crypt->iv, sizeof(cipher->iv));
+
+    cipher->ctx = EVP_CIPHER_CTX_new ();
+    if (!cipher->ctx ||
+        EVP_CipherInit_ex (cipher->ctx, cipher_for_version (crypt->version),
+                           NULL, cipher->key, cipher->iv,
+                           cipher->encrypt) == ENC_FAILURE) {
+        seaf_warning ("Failed to init cipher context.\n");
+        seafile_cipher_free (cipher);
+        return NULL;
+    }
+
+    return cipher;
+}
+
+void
+seafile_cipher_free (SeafileCipher *cipher)
+{
+    if (!cipher)
+        return;
+    if (cipher->ctx)
+        EVP_CIPHER_CTX_free (cipher->ctx);
+    g_free (cipher);
+}
+
+int
+seafile_cipher_reset (SeafileCipher *cipher)
+{
+    /* Only the iv has to be set again, the key schedule is kept. */
+    if (EVP_CipherInit_ex (cipher->ctx, NULL, NULL, NULL, cipher->iv, -1) ==
+        ENC_FAILURE)
+        return -1;
+    return 0;
+}
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       char *out, int *out_len,
+                       const char *in, int in_len)
+{
+    if (EVP_CipherUpdate (cipher->ctx,
+                          (unsigned char *)out, out_len,
+                          (const unsigned char *)in, in_len) == ENC_FAILURE) {
+        *out_len = -1;
+        seafile_cipher_reset (cipher);
+        return -1;
+    }
+    return 0;
+}
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len)
+{
+    int ret;
+
+    ret = EVP_CipherFinal_ex (cipher->ctx, (unsigned char *)out, out_len);
+    if (seafile_cipher_reset (cipher) < 0 || ret == ENC_FAILURE) {
+        *out_len = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+cipher_run (SeafileCipher *cipher,
+            char *out, int *out_len,
+            const char *in, int in_len)
+{
+    int update_len, final_len;
+
+    if (seafile_cipher_update (cipher, out, &update_len, in, in_len) < 0)
+        return -1;
+    if (seafile_cipher_final (cipher, out + update_len, &final_len) < 0)
+        return -1;
+
+    *out_len = update_len + final_len;
+    return 0;
+}
+
+/* seafile_encrypt() and seafile_decrypt() are called once per block, mostly
+ * with the same repo key. Each thread keeps the last cipher context it used
+ * so the key schedule is only computed again when the key changes.
+ */
+
+typedef struct ThreadCiphers {
+    SeafileCipher *enc;
+    SeafileCipher *dec;
+} ThreadCiphers;
+
+static pthread_key_t thread_ciphers_key;
+static pthread_once_t thread_ciphers_once = PTHREAD_ONCE_INIT;
+
+static void
+free_thread_ciphers (void *data)
+{
+    ThreadCiphers *tc = data;
+
+    seafile_cipher_free (tc->enc);
+    seafile_cipher_free (tc->dec);
+    g_free (tc);
+}
+
+static void
+create_thread_ciphers_key (void)
+{
+    pthread_key_create (&thread_ciphers_key, free_thread_ciphers);
+}
+
+static gboolean
+cipher_matches (SeafileCipher *cipher, SeafileCrypt *crypt)
+{
+    return (cipher->version == crypt->version &&
+            memcmp (cipher->key, crypt->key, sizeof(cipher->key)) == 0 &&
+            memcmp (cipher->iv, crypt->iv, sizeof(cipher->iv)) == 0);
+}
+
+static SeafileCipher *
+get_thread_cipher (SeafileCrypt *crypt, gboolean encrypt)
+{
+    ThreadCiphers *tc;
+    SeafileCipher **slot;
+
+    pthread_once (&thread_ciphers_once, create_thread_ciphers_key);
+
+    tc = pthread_getspecific (thread_ciphers_key);
+    if (!tc) {
+        tc = g_new0 (ThreadCiphers, 1);
+        pthread_setspecific (thread_ciphers_key, tc);
+    }
+
+    slot = encrypt ? &tc->enc : &tc->dec;
+    if (*slot && !cipher_matches (*slot, crypt)) {
+        seafile_cipher_free (*slot);
+        *slot = NULL;
+    }
+    if (!*slot)
+        *slot = seafile_cipher_new (crypt, encrypt);
+
+    return *slot;
+}
+
 int
 seafile_encrypt (char **data_out,
                  int *out_len,
@@ -289,6 +686,9 @@ seafile_encrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher *cipher;
+    int blks;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -298,38 +698,10 @@ seafile_encrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
-    int ret;
-    int blks;
-
-    /* Prepare CTX for encryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == ENC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
+    cipher = get_thread_cipher (crypt, TRUE);
+    if (!cipher)
         return -1;
-    }
-    /* Allocating output buffer. */
-    
+
     /*
       For EVP symmetric encryption, padding is always used __even if__
       data size is a multiple of block size, in which case the padding
@@ -340,56 +712,22 @@ seafile_encrypt (char **data_out,
 
     *data_out = (char *)g_malloc (blks * BLK_SIZE);
 
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
-        goto enc_error;
-    }                
-
-    int update_len, final_len;
-
-    /* Do the encryption. */
-    ret = EVP_EncryptUpdate (ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
-
-    if (ret == ENC_FAILURE)
-        goto enc_error;
-
-
-    /* Finish the possible partial block. */
-    ret = EVP_EncryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
-
     /* out_len should be equal to the allocated buffer size. */
-    if (ret == ENC_FAILURE || *out_len != (blks * BLK_SIZE))
+    if (cipher_run (cipher, *data_out, out_len, data_in, in_len) < 0 ||
+        *out_len != (blks * BLK_SIZE))
         goto enc_error;
-    
-    EVP_CIPHER_CTX_free (ctx);
 
     return 0;
 
 enc_error:
 
-    EVP_CIPHER_CTX_free (ctx);
-
     *out_len = -1;
 
-    if (*data_out != NULL)
-        g_free (*data_out);
-
+    g_free (*data_out);
     *data_out = NULL;
 
     return -1;
-    
 }
-                               
-
-    
 
 int
 seafile_decrypt (char **data_out,
@@ -398,6 +736,8 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher *cipher;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -410,84 +750,27 @@ seafile_decrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
-    int ret;
-
-    /* Prepare CTX for decryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
+    cipher = get_thread_cipher (crypt, FALSE);
+    if (!cipher)
         return -1;
-    }
-    /* Allocating output buffer. */
-    
-    *data_out = (char *)g_malloc (in_len);
-
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
-        goto dec_error;
-    }                
-
-    int update_len, final_len;
-
-    /* Do the decryption. */
-    ret = EVP_DecryptUpdate (ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
 
-    if (ret == DEC_FAILURE)
-        goto dec_error;
-
-
-    /* Finish the possible partial block. */
-    ret = EVP_DecryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
+    *data_out = (char *)g_malloc (in_len);
 
     /* out_len should be smaller than in_len. */
-    if (ret == DEC_FAILURE || *out_len > in_len)
+    if (cipher_run (cipher, *data_out, out_len, data_in, in_len) < 0 ||
+        *out_len > in_len)
         goto dec_error;
 
-    EVP_CIPHER_CTX_free (ctx);
-    
     return 0;
 
 dec_error:
 
-    EVP_CIPHER_CTX_free (ctx);
-
     *out_len = -1;
-    if (*data_out != NULL)
-        g_free (*data_out);
 
+    g_free (*data_out);
     *data_out = NULL;
 
     return -1;
-    
 }
 
 int
@@ -57,6 +57,14 @@ seafile_derive_key (const char *data_in, int in_len, int version,
                     const char *repo_salt,
                     unsigned char *key, unsigned char *iv);
 
+/*
+  Keep up to @max_entries keys derived by seafile_derive_key() for @ttl
+  seconds, in memory locked out of swap. Keys are derived every time if
+  it's never called.
+*/
+int
+seafile_derive_key_cache_init (int max_entries, int ttl);
+
 /* @salt must be an char array of size 65 bytes. */
 int
 seafile_generate_repo_salt (char *repo_salt);
@@ -110,6 +118,43 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt);
 
+/*
+  Returns the length of @data_in once decrypted, by decrypting only its
+  last cipher block to read the padding. -1 on errors.
+*/
+int
+seafile_decrypted_len (SeafileCrypt *crypt, const char *data_in, int in_len);
+
+/*
+ * A cipher context that is set up once and reused for many blocks, to
+ * avoid creating a context and expanding the key for every block.
+ *
+ * Data is fed with seafile_cipher_update() and the block is finished with
+ * seafile_cipher_final(), which also prepares the cipher for the next block.
+ * Encrypted blocks are padded, so @out must have room for @in_len + BLK_SIZE
+ * bytes. seafile_cipher_reset() drops a partially processed block.
+ *
+ * A cipher must only be used by one thread at a time.
+ */
+typedef struct SeafileCipher SeafileCipher;
+
+SeafileCipher *
+seafile_cipher_new (SeafileCrypt *crypt, gboolean encrypt);
+
+void
+seafile_cipher_free (SeafileCipher *cipher);
+
+int
+seafile_cipher_reset (SeafileCipher *cipher);
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       char *out, int *out_len,
+                       const char *in, int in_len);
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len);
+
 int
 seafile_decrypt_init (EVP_CIPHER_CTX **ctx,
                       int version,
@@ -12,11 +12,18 @@
 #include "user-mgr.h"
 #include "seaf-db.h"
 #include "seaf-utils.h"
+#include "row-count.h"
 
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 #include <openssl/evp.h>
 
+#include <pthread.h>
+
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+#include "executor.h"
+#endif
+
 #ifdef HAVE_LDAP
   #ifndef WIN32
     #define LDAP_DEPRECATED 1
@@ -52,7 +59,26 @@ static int try_load_ldap_settings (CcnetUserManager *manager);
 
 struct CcnetUserManagerPriv {
     CcnetDB    *db;
+    RowCounts  *row_counts;
     int         max_users;
+    /* Logins beyond this many waiting ones fail right away. */
+    guint       max_queued_logins;
+
+    /* Users looked up by email, see user_cache_lookup(). */
+    pthread_mutex_t cache_lock;
+    GHashTable *user_cache;
+    /* Most recently used first. */
+    GQueue      cache_lru;
+    guint       cache_size;
+    int         cache_ttl;
+    int         negative_cache_ttl;
+
+#ifdef HAVE_LDAP
+    /* Idle connections bound as the admin user. */
+    pthread_mutex_t ldap_lock;
+    GQueue      ldap_pool;
+    guint       ldap_pool_size;
+#endif
 };
 
 static void
@@ -66,6 +92,14 @@ static void
 ccnet_user_manager_init (CcnetUserManager *manager)
 {
     manager->priv = GET_PRIV(manager);
+
+    pthread_mutex_init (&manager->priv->cache_lock, NULL);
+    manager->priv->user_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&manager->priv->cache_lru);
+#ifdef HAVE_LDAP
+    pthread_mutex_init (&manager->priv->ldap_lock, NULL);
+    g_queue_init (&manager->priv->ldap_pool);
+#endif
 }
 
 CcnetUserManager*
@@ -81,6 +115,40 @@ ccnet_user_manager_new (SeafileSession *session)
 }
 
 #define DEFAULT_PASSWD_HASH_ITER 10000
+#define DEFAULT_USER_CACHE_SIZE 10000
+#define DEFAULT_USER_CACHE_TTL 300
+#define DEFAULT_NEGATIVE_USER_CACHE_TTL 60
+#define DEFAULT_LDAP_POOL_SIZE 4
+/* Logins waiting for a crypto worker, per running one. */
+#define DEFAULT_CRYPTO_QUEUE_FACTOR 4
+
+/* Names and queries of the user counts, see row-count.h. */
+static const char *
+user_count_name (gboolean ldap, gboolean is_active)
+{
+    if (ldap)
+        return is_active ? "active_ldap_users" : "inactive_ldap_users";
+    return is_active ? "active_users" : "inactive_users";
+}
+
+static const char *
+user_count_sql (gboolean ldap, gboolean is_active)
+{
+    if (ldap)
+        return is_active ? "SELECT COUNT(id) FROM LDAPUsers WHERE is_active = 1" :
+            "SELECT COUNT(id) FROM LDAPUsers WHERE is_active = 0";
+    return is_active ? "SELECT COUNT(id) FROM EmailUser WHERE is_active = 1" :
+        "SELECT COUNT(id) FROM EmailUser WHERE is_active = 0";
+}
+
+static gboolean
+get_is_active_cb (CcnetDBRow *row, void *data)
+{
+    int *is_active = data;
+
+    *is_active = (seaf_db_row_get_column_int (row, 0) != 0);
+    return FALSE;
+}
 
 // return current active user number
 static int
@@ -148,11 +216,54 @@ ccnet_user_manager_prepare (CcnetUserManager *manager)
         iter = DEFAULT_PASSWD_HASH_ITER;
     manager->passwd_hash_iter = iter;
 
+    GError *error = NULL;
+    int cache_size = g_key_file_get_integer (manager->session->ccnet_config,
+                                             "USER", "CACHE_SIZE", &error);
+    if (error) {
+        g_clear_error (&error);
+        cache_size = DEFAULT_USER_CACHE_SIZE;
+    }
+    manager->priv->cache_size = MAX (cache_size, 0);
+    int cache_ttl = g_key_file_get_integer (manager->session->ccnet_config,
+                                            "USER", "CACHE_TTL", &error);
+    if (error) {
+        g_clear_error (&error);
+        cache_ttl = DEFAULT_USER_CACHE_TTL;
+    }
+    manager->priv->cache_ttl = MAX (cache_ttl, 0);
+    /* Users are usually looked up just before they're added, so missing
+     * ones are remembered for less time.
+     */
+    manager->priv->negative_cache_ttl = MIN (manager->priv->cache_ttl,
+                                             DEFAULT_NEGATIVE_USER_CACHE_TTL);
+
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+    /* Password hashing runs on a few executor workers, so that a burst of
+     * logins can't hold all the rpc threads or all the cpus.
+     */
+    int crypto_threads = g_key_file_get_integer (manager->session->config,
+                                                 "executor", "crypto_threads",
+                                                 NULL);
+    if (crypto_threads <= 0)
+        crypto_threads = MAX (1, g_get_num_processors () / 2);
+    seaf_executor_set_max_running (manager->session->executor, SEAF_JOB_CRYPTO,
+                                   crypto_threads);
+    int max_queued = g_key_file_get_integer (manager->session->config,
+                                             "executor", "max_queued_logins",
+                                             NULL);
+    if (max_queued <= 0)
+        max_queued = crypto_threads * DEFAULT_CRYPTO_QUEUE_FACTOR;
+    manager->priv->max_queued_logins = max_queued;
+    seaf_message ("executor: crypto_threads = %d, max_queued_logins = %d\n",
+                  crypto_threads, max_queued);
+#endif
+
     manager->userdb_path = g_build_filename (manager->session->ccnet_dir,
                                              "user-db", NULL);
     ret = open_db(manager);
     if (ret < 0)
         return ret;
+    manager->priv->row_counts = row_counts_new (manager->priv->db);
 
     if (!check_user_number (manager, TRUE)) {
         return -1;
@@ -183,6 +294,129 @@ ccnet_user_manager_set_max_users (CcnetUserManager *manager, gint64 max_users)
     manager->priv->max_users = max_users;
 }
 
+/* -------- User cache --------- */
+
+/*
+ * Users are looked up by email on share dialogs, permission checks and
+ * every FUSE access, each time querying the DB and maybe LDAP. Lookups are
+ * cached for CACHE_TTL seconds, including the emails of users that don't
+ * exist. Entries are dropped by every update below, the TTL only covers
+ * changes made around this process.
+ */
+
+typedef struct CachedUser {
+    /* Lower case */
+    char *email;
+    /* NULL if the user doesn't exist. */
+    CcnetEmailUser *user;
+    gint64 expire;
+    GList *link;
+} CachedUser;
+
+static void
+cached_user_free (CachedUser *cu)
+{
+    if (cu->user)
+        g_object_unref (cu->user);
+    g_free (cu->email);
+    g_free (cu);
+}
+
+/* Called with the lock held. */
+static void
+remove_cached_user (CcnetUserManagerPriv *priv, CachedUser *cu)
+{
+    g_hash_table_remove (priv->user_cache, cu->email);
+    g_queue_delete_link (&priv->cache_lru, cu->link);
+    cached_user_free (cu);
+}
+
+/*
+ * Returns TRUE if @email is cached, and sets @user to a reference to the
+ * user, or NULL if it doesn't exist. The user must not be modified.
+ */
+static gboolean
+user_cache_lookup (CcnetUserManager *manager, const char *email,
+                   CcnetEmailUser **user)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    CachedUser *cu;
+    gboolean found = FALSE;
+
+    if (priv->cache_size == 0 || priv->cache_ttl == 0)
+        return FALSE;
+
+    char *email_down = g_ascii_strdown (email, -1);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    cu = g_hash_table_lookup (priv->user_cache, email_down);
+    if (cu) {
+        if (cu->expire <= (gint64)time(NULL)) {
+            remove_cached_user (priv, cu);
+        } else {
+            g_queue_unlink (&priv->cache_lru, cu->link);
+            g_queue_push_head_link (&priv->cache_lru, cu->link);
+            *user = cu->user ? g_object_ref (cu->user) : NULL;
+            found = TRUE;
+        }
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_free (email_down);
+    return found;
+}
+
+static void
+user_cache_insert (CcnetUserManager *manager, const char *email,
+                   CcnetEmailUser *user)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    CachedUser *cu;
+    int ttl = user ? priv->cache_ttl : priv->negative_cache_ttl;
+
+    if (priv->cache_size == 0 || ttl == 0)
+        return;
+
+    char *email_down = g_ascii_strdown (email, -1);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    cu = g_hash_table_lookup (priv->user_cache, email_down);
+    if (cu)
+        remove_cached_user (priv, cu);
+    while (g_queue_get_length (&priv->cache_lru) >= priv->cache_size)
+        remove_cached_user (priv, g_queue_peek_tail (&priv->cache_lru));
+
+    cu = g_new0 (CachedUser, 1);
+    cu->email = email_down;
+    cu->user = user ? g_object_ref (user) : NULL;
+    cu->expire = (gint64)time(NULL) + ttl;
+    g_queue_push_head (&priv->cache_lru, cu);
+    cu->link = priv->cache_lru.head;
+    g_hash_table_insert (priv->user_cache, cu->email, cu);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+/* Drops @email from the cache, or all users if @email is NULL. */
+static void
+user_cache_invalidate (CcnetUserManager *manager, const char *email)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    CachedUser *cu;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    if (!email) {
+        while ((cu = g_queue_peek_head (&priv->cache_lru)) != NULL)
+            remove_cached_user (priv, cu);
+    } else {
+        char *email_down = g_ascii_strdown (email, -1);
+        cu = g_hash_table_lookup (priv->user_cache, email_down);
+        if (cu)
+            remove_cached_user (priv, cu);
+        g_free (email_down);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
 /* -------- LDAP related --------- */
 
 #ifdef HAVE_LDAP
@@ -235,6 +469,14 @@ static int try_load_ldap_settings (CcnetUserManager *manager)
         manager->follow_referrals = TRUE;
     }
 
+    int pool_size = g_key_file_get_integer (config, "LDAP", "CONNECTION_POOL_SIZE",
+                                            &error);
+    if (error) {
+        g_clear_error (&error);
+        pool_size = DEFAULT_LDAP_POOL_SIZE;
+    }
+    manager->priv->ldap_pool_size = MAX (pool_size, 0);
+
     return 0;
 }
 
@@ -305,6 +547,82 @@ static LDAP *ldap_init_and_bind (CcnetUserManager *manager,
     return ld;
 }
 
+/*
+ * Connections bound as USER_DN are kept for the next searches, instead of
+ * binding again for each of them. Binds to check user passwords still use
+ * their own connections.
+ */
+static LDAP *
+ldap_pool_get (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    LDAP *ld;
+
+    pthread_mutex_lock (&priv->ldap_lock);
+    ld = g_queue_pop_head (&priv->ldap_pool);
+    pthread_mutex_unlock (&priv->ldap_lock);
+    if (ld)
+        return ld;
+
+    ld = ldap_init_and_bind (manager,
+                             manager->ldap_host,
+#ifdef WIN32
+                             manager->use_ssl,
+#endif
+                             manager->user_dn,
+                             manager->password);
+    if (!ld)
+        ccnet_warning ("Please check USER_DN and PASSWORD settings.\n");
+    return ld;
+}
+
+static void
+ldap_pool_put (CcnetUserManager *manager, LDAP *ld)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->ldap_lock);
+    if (g_queue_get_length (&priv->ldap_pool) < priv->ldap_pool_size) {
+        g_queue_push_head (&priv->ldap_pool, ld);
+        ld = NULL;
+    }
+    pthread_mutex_unlock (&priv->ldap_lock);
+
+    if (ld)
+        ldap_unbind_s (ld);
+}
+
+/*
+ * Searches on a pooled connection. A connection the server closed while
+ * it was idle is replaced once. @ld is set to NULL if no connection
+ * could be made.
+ */
+static int
+ldap_pool_search (CcnetUserManager *manager, LDAP **ld, char *base,
+                  char *filter, char **attrs, LDAPMessage **msg)
+{
+    int res;
+
+    res = ldap_search_s (*ld, base, LDAP_SCOPE_SUBTREE, filter, attrs, 0, msg);
+    if (res != LDAP_SERVER_DOWN)
+        return res;
+
+    ldap_msgfree (*msg);
+    *msg = NULL;
+    ldap_unbind_s (*ld);
+    *ld = ldap_init_and_bind (manager,
+                              manager->ldap_host,
+#ifdef WIN32
+                              manager->use_ssl,
+#endif
+                              manager->user_dn,
+                              manager->password);
+    if (!*ld)
+        return res;
+
+    return ldap_search_s (*ld, base, LDAP_SCOPE_SUBTREE, filter, attrs, 0, msg);
+}
+
 static gboolean
 get_uid_cb (CcnetDBRow *row, void *data)
 {
@@ -314,13 +632,15 @@ get_uid_cb (CcnetDBRow *row, void *data)
 }
 
 static int
-add_ldapuser (CcnetDB *db,
+add_ldapuser (CcnetUserManager *manager,
               const char *email,
               const char *password,
               gboolean is_staff,
               gboolean is_active,
               const char *extra_attrs)
 {
+    CcnetDB *db = manager->priv->db;
+    CcnetDBTrans *trans;
     int rc;
     int uid = -1;
 
@@ -336,17 +656,30 @@ add_ldapuser (CcnetDB *db,
         return uid;
     }
 
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
     if (extra_attrs)
-        rc = seaf_db_statement_query (db,
-                                       "INSERT INTO LDAPUsers (email, password, is_staff, "
-                                       "is_active, extra_attrs) VALUES (?, ?, ?, ?, ?)",
-                                       5, "string", email, "string", password, "int",
-                                       is_staff, "int", is_active, "string", extra_attrs);
+        rc = seaf_db_trans_query (trans,
+                                  "INSERT INTO LDAPUsers (email, password, is_staff, "
+                                  "is_active, extra_attrs) VALUES (?, ?, ?, ?, ?)",
+                                  5, "string", email, "string", password, "int",
+                                  is_staff, "int", is_active, "string", extra_attrs);
     else
-        rc = seaf_db_statement_query (db,
-                                       "INSERT INTO LDAPUsers (email, password, is_staff, "
-                                       "is_active) VALUES (?, ?, ?, ?)", 4, "string", email,
-                                       "string", password, "int", is_staff, "int", is_active);
+        rc = seaf_db_trans_query (trans,
+                                  "INSERT INTO LDAPUsers (email, password, is_staff, "
+                                  "is_active) VALUES (?, ?, ?, ?)", 4, "string", email,
+                                  "string", password, "int", is_staff, "int", is_active);
+    if (rc < 0) {
+        seaf_db_rollback (trans);
+        seaf_db_trans_close (trans);
+        return rc;
+    }
+    row_counts_trans_add (manager->priv->row_counts, trans,
+                          user_count_name (TRUE, is_active), 1);
+    rc = seaf_db_commit (trans);
+    seaf_db_trans_close (trans);
     if (rc < 0) {
         return rc;
     }
@@ -373,17 +706,9 @@ static int ldap_verify_user_password (CcnetUserManager *manager,
 
     /* First search for the DN with the given uid. */
 
-    ld = ldap_init_and_bind (manager,
-                             manager->ldap_host,
-#ifdef WIN32
-                             manager->use_ssl,
-#endif
-                             manager->user_dn,
-                             manager->password);
-    if (!ld) {
-        ccnet_warning ("Please check USER_DN and PASSWORD settings.\n");
+    ld = ldap_pool_get (manager);
+    if (!ld)
         return -1;
-    }
 
     filter = g_string_new (NULL);
     if (!manager->filter)
@@ -398,8 +723,7 @@ static int ldap_verify_user_password (CcnetUserManager *manager,
 
     char **base;
     for (base = manager->base_list; *base; base++) {
-        res = ldap_search_s (ld, *base, LDAP_SCOPE_SUBTREE,
-                             filter_str, attrs, 0, &msg);
+        res = ldap_pool_search (manager, &ld, *base, filter_str, attrs, &msg);
         if (res != LDAP_SUCCESS) {
             ccnet_warning ("ldap_search user '%s=%s' failed for base %s: %s.\n",
                            manager->login_attr, uid, *base, ldap_err2string(res));
@@ -427,7 +751,7 @@ static int ldap_verify_user_password (CcnetUserManager *manager,
 
     /* Then bind the DN with password. */
 
-    ldap_unbind_s (ld);
+    ldap_pool_put (manager, ld);
 
     ld = ldap_init_and_bind (manager,
                              manager->ldap_host,
@@ -438,20 +762,24 @@ static int ldap_verify_user_password (CcnetUserManager *manager,
     if (!ld) {
         ccnet_debug ("Password incorrect for %s in LDAP.\n", uid);
         ret = -1;
+    } else {
+        ldap_unbind_s (ld);
     }
+    ld = NULL;
 
 out:
     ldap_memfree (dn);
     g_free (filter_str);
-    if (ld) ldap_unbind_s (ld);
+    if (ld) ldap_pool_put (manager, ld);
     return ret;
 }
 
 /*
  * @uid: user's uid, list all users if * is passed in.
+ * @error: if not NULL, set to TRUE if LDAP couldn't be searched.
  */
 static GList *ldap_list_users (CcnetUserManager *manager, const char *uid,
-                               int start, int limit)
+                               int start, int limit, gboolean *error)
 {
     LDAP *ld = NULL;
     GList *ret = NULL;
@@ -461,15 +789,10 @@ static GList *ldap_list_users (CcnetUserManager *manager, const char *uid,
     char *attrs[2];
     LDAPMessage *msg = NULL, *entry;
 
-    ld = ldap_init_and_bind (manager,
-                             manager->ldap_host,
-#ifdef WIN32
-                             manager->use_ssl,
-#endif
-                             manager->user_dn,
-                             manager->password);
+    ld = ldap_pool_get (manager);
     if (!ld) {
-        ccnet_warning ("Please check USER_DN and PASSWORD settings.\n");
+        if (error)
+            *error = TRUE;
         return NULL;
     }
 
@@ -490,13 +813,15 @@ static GList *ldap_list_users (CcnetUserManager *manager, const char *uid,
 
     char **base;
     for (base = manager->base_list; *base; ++base) {
-        res = ldap_search_s (ld, *base, LDAP_SCOPE_SUBTREE,
-                             filter_str, attrs, 0, &msg);
+        res = ldap_pool_search (manager, &ld, *base, filter_str, attrs, &msg);
         if (res != LDAP_SUCCESS) {
             ccnet_warning ("ldap_search user '%s=%s' failed for base %s: %s.\n",
                            manager->login_attr, uid, *base, ldap_err2string(res));
             ccnet_warning ("Please check BASE setting in ccnet.conf.\n");
+            g_list_free_full (ret, g_object_unref);
             ret = NULL;
+            if (error)
+                *error = TRUE;
             ldap_msgfree (msg);
             goto out;
         }
@@ -542,7 +867,7 @@ static GList *ldap_list_users (CcnetUserManager *manager, const char *uid,
 
 out:
     g_free (filter_str);
-    if (ld) ldap_unbind_s (ld);
+    if (ld) ldap_pool_put (manager, ld);
     return ret;
 }
 
@@ -763,11 +1088,24 @@ open_db (CcnetUserManager *manager)
         return -1;
 
     manager->priv->db = db;
-    if ((manager->session->ccnet_create_tables || seaf_db_type(db) == SEAF_DB_TYPE_PGSQL)
-        && check_db_table (db) < 0) {
+    return 0;
+}
+
+int
+ccnet_user_manager_create_tables (CcnetUserManager *manager)
+{
+    CcnetDB *db = manager->priv->db;
+    gboolean create = (manager->session->ccnet_create_tables ||
+                       seaf_db_type(db) == SEAF_DB_TYPE_PGSQL);
+
+    if (create && check_db_table (db) < 0) {
         ccnet_warning ("Failed to create user db tables.\n");
         return -1;
     }
+    if (row_counts_init (manager->priv->row_counts, create) < 0) {
+        ccnet_warning ("Failed to create user count table.\n");
+        return -1;
+    }
     return 0;
 }
 
@@ -837,8 +1175,79 @@ hash_password_pbkdf2_sha256 (const char *passwd,
     *db_passwd = g_string_free (buf, FALSE);
 }
 
-static gboolean
-validate_passwd_pbkdf2_sha256 (const char *passwd, const char *db_passwd)
+typedef struct Pbkdf2Job {
+    const char *passwd;
+    const guint8 *salt;
+    int salt_len;
+    int iter;
+    guint8 *out;
+    int out_len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gboolean done;
+} Pbkdf2Job;
+
+static void
+pbkdf2_job_run (void *data, void *user_data)
+{
+    Pbkdf2Job *job = data;
+
+    PKCS5_PBKDF2_HMAC (job->passwd, strlen(job->passwd),
+                       job->salt, job->salt_len,
+                       job->iter,
+                       EVP_sha256(),
+                       job->out_len, job->out);
+
+    pthread_mutex_lock (&job->lock);
+    job->done = TRUE;
+    pthread_cond_signal (&job->cond);
+    pthread_mutex_unlock (&job->lock);
+}
+
+/*
+ * Computes the PBKDF2-SHA256 of @passwd on a crypto worker and waits for
+ * it. Returns -1 if too many logins are waiting already.
+ */
+static int
+run_pbkdf2_sha256 (CcnetUserManager *manager, const char *passwd,
+                   const guint8 *salt, int salt_len, int iter,
+                   guint8 *out, int out_len)
+{
+    Pbkdf2Job job = { passwd, salt, salt_len, iter, out, out_len };
+
+#if defined SEAFILE_SERVER && defined FULL_FEATURE
+    SeafExecutor *ex = manager->session->executor;
+
+    pthread_mutex_init (&job.lock, NULL);
+    pthread_cond_init (&job.cond, NULL);
+
+    if (seaf_executor_try_push (ex, SEAF_JOB_CRYPTO,
+                                manager->priv->max_queued_logins,
+                                pbkdf2_job_run, &job, NULL) < 0) {
+        pthread_mutex_destroy (&job.lock);
+        pthread_cond_destroy (&job.cond);
+        return -1;
+    }
+
+    pthread_mutex_lock (&job.lock);
+    while (!job.done)
+        pthread_cond_wait (&job.cond, &job.lock);
+    pthread_mutex_unlock (&job.lock);
+
+    pthread_mutex_destroy (&job.lock);
+    pthread_cond_destroy (&job.cond);
+#else
+    pbkdf2_job_run (&job, NULL);
+#endif
+
+    return 0;
+}
+
+/* Returns 1 if @passwd matches, 0 if not and -1 if the server is busy. */
+static int
+validate_passwd_pbkdf2_sha256 (CcnetUserManager *manager,
+                               const char *passwd, const char *db_passwd)
 {
     char **tokens;
     char *salt_str, *hash;
@@ -859,21 +1268,24 @@ validate_passwd_pbkdf2_sha256 (const char *passwd, const char *db_passwd)
 
     hex_to_rawdata (salt_str, salt, SHA256_DIGEST_LENGTH);
 
-    PKCS5_PBKDF2_HMAC (passwd, strlen(passwd),
-                       salt, sizeof(salt),
-                       iter,
-                       EVP_sha256(),
-                       sizeof(sha), sha);
+    if (run_pbkdf2_sha256 (manager, passwd, salt, sizeof(salt), iter,
+                           sha, sizeof(sha)) < 0) {
+        ccnet_warning ("Too many logins in progress, rejecting login.\n");
+        g_strfreev (tokens);
+        return -1;
+    }
     rawdata_to_hex (sha, hashed_passwd, SHA256_DIGEST_LENGTH);
 
-    gboolean ret = (strcmp (hash, hashed_passwd) == 0);
+    int ret = (strcmp (hash, hashed_passwd) == 0);
 
     g_strfreev (tokens);
     return ret;
 }
 
-static gboolean
-validate_passwd (const char *passwd, const char *stored_passwd,
+/* Returns 1 if @passwd matches, 0 if not and -1 if the server is busy. */
+static int
+validate_passwd (CcnetUserManager *manager,
+                 const char *passwd, const char *stored_passwd,
                  gboolean *need_upgrade)
 {
     char hashed_passwd[SHA256_DIGEST_LENGTH * 2 + 1];
@@ -888,13 +1300,13 @@ validate_passwd (const char *passwd, const char *stored_passwd,
         hash_password (passwd, hashed_passwd);
         *need_upgrade = TRUE;
     } else {
-        return validate_passwd_pbkdf2_sha256 (passwd, stored_passwd);
+        return validate_passwd_pbkdf2_sha256 (manager, passwd, stored_passwd);
     }
 
     if (strcmp (hashed_passwd, stored_passwd) == 0)
-        return TRUE;
+        return 1;
     else
-        return FALSE;
+        return 0;
 }
 
 static int
@@ -914,6 +1326,7 @@ update_user_passwd (CcnetUserManager *manager,
     ret = seaf_db_statement_query (db,
                                     "UPDATE EmailUser SET passwd=? WHERE email=?",
                                     2, "string", db_passwd, "string", email_down);
+    user_cache_invalidate (manager, email_down);
 
     g_free (db_passwd);
     g_free (email_down);
@@ -931,6 +1344,7 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
                                   int is_staff, int is_active)
 {
     CcnetDB *db = manager->priv->db;
+    CcnetDBTrans *trans;
     gint64 now = get_current_time();
     char *db_passwd = NULL;
     int ret;
@@ -952,12 +1366,27 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
     /* convert email to lower case for case insensitive lookup. */
     char *email_down = g_ascii_strdown (email, strlen(email));
 
-    ret = seaf_db_statement_query (db,
-                                    "INSERT INTO EmailUser(email, passwd, is_staff, "
-                                    "is_active, ctime) VALUES (?, ?, ?, ?, ?)",
-                                    5, "string", email_down, "string", db_passwd,
-                                    "int", is_staff, "int", is_active, "int64", now);
+    trans = seaf_db_begin_transaction (db);
+    if (!trans) {
+        ret = -1;
+        goto out;
+    }
+    ret = seaf_db_trans_query (trans,
+                               "INSERT INTO EmailUser(email, passwd, is_staff, "
+                               "is_active, ctime) VALUES (?, ?, ?, ?, ?)",
+                               5, "string", email_down, "string", db_passwd,
+                               "int", is_staff, "int", is_active, "int64", now);
+    if (ret < 0) {
+        seaf_db_rollback (trans);
+    } else {
+        row_counts_trans_add (manager->priv->row_counts, trans,
+                              user_count_name (FALSE, is_active != 0), 1);
+        ret = seaf_db_commit (trans);
+    }
+    seaf_db_trans_close (trans);
+    user_cache_invalidate (manager, email_down);
 
+out:
     g_free (db_passwd);
     g_free (email_down);
 
@@ -967,32 +1396,65 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
     return 0;
 }
 
+/* The row of the user is read and locked first, to know which count it's in. */
+static int
+remove_user_row (CcnetUserManager *manager, gboolean ldap, const char *email)
+{
+    CcnetDB *db = manager->priv->db;
+    const char *table = ldap ? "LDAPUsers" : "EmailUser";
+    CcnetDBTrans *trans;
+    char *sql;
+    int is_active = -1;
+    int ret = -1;
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
+    sql = g_strdup_printf ("SELECT is_active FROM %s WHERE email=?%s",
+                           table, row_counts_lock_clause (db));
+    if (seaf_db_trans_foreach_selected_row (trans, sql, get_is_active_cb,
+                                            &is_active, 1, "string", email) < 0)
+        goto rollback;
+    g_free (sql);
+
+    sql = g_strdup_printf ("DELETE FROM %s WHERE email=?", table);
+    if (seaf_db_trans_query (trans, sql, 1, "string", email) < 0)
+        goto rollback;
+    if (is_active >= 0)
+        row_counts_trans_add (manager->priv->row_counts, trans,
+                              user_count_name (ldap, is_active), -1);
+
+    ret = seaf_db_commit (trans);
+    goto out;
+
+rollback:
+    seaf_db_rollback (trans);
+out:
+    seaf_db_trans_close (trans);
+    g_free (sql);
+    return ret;
+}
+
 int
 ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
                                      const char *source,
                                      const char *email)
 {
     CcnetDB *db = manager->priv->db;
-    int ret;
+
+    user_cache_invalidate (manager, email);
 
     seaf_db_statement_query (db,
                               "DELETE FROM UserRole WHERE email=?",
                               1, "string", email);
 
-    if (strcmp (source, "DB") == 0) {
-        ret = seaf_db_statement_query (db,
-                                        "DELETE FROM EmailUser WHERE email=?",
-                                        1, "string", email);
-        return ret;
-    }
+    if (strcmp (source, "DB") == 0)
+        return remove_user_row (manager, FALSE, email);
 
 #ifdef HAVE_LDAP
-    if (strcmp (source, "LDAP") == 0 && manager->use_ldap) {
-        ret = seaf_db_statement_query (db,
-                                        "DELETE FROM LDAPUsers WHERE email=?",
-                                        1, "string", email);
-        return ret;
-    }
+    if (strcmp (source, "LDAP") == 0 && manager->use_ldap)
+        return remove_user_row (manager, TRUE, email);
 #endif
 
     return -1;
@@ -1007,6 +1469,25 @@ get_password (CcnetDBRow *row, void *data)
     return FALSE;
 }
 
+/* Returns 0 if @passwd matches, -1 if not and -2 if the server is busy. */
+static int
+check_stored_passwd (CcnetUserManager *manager, const char *login_id,
+                     const char *passwd, const char *stored_passwd)
+{
+    gboolean need_upgrade = FALSE;
+    int rc;
+
+    rc = validate_passwd (manager, passwd, stored_passwd, &need_upgrade);
+    if (rc < 0)
+        return -2;
+    if (rc == 0)
+        return -1;
+
+    if (need_upgrade)
+        update_user_passwd (manager, login_id, passwd);
+    return 0;
+}
+
 int
 ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
                                        const char *email,
@@ -1018,7 +1499,6 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
     char *email_down;
     char *login_id;
     char *stored_passwd = NULL;
-    gboolean need_upgrade = FALSE;
 
     /* Users with password "!" are for internal book keeping only. */
     if (g_strcmp0 (passwd, "!") == 0)
@@ -1043,14 +1523,8 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
     if (seaf_db_statement_foreach_row (db, sql,
                                         get_password, &stored_passwd,
                                         1, "string", login_id) > 0) {
-        if (validate_passwd (passwd, stored_passwd, &need_upgrade)) {
-            if (need_upgrade)
-                update_user_passwd (manager, login_id, passwd);
-            ret = 0;
-            goto out;
-        } else {
-            goto out;
-        }
+        ret = check_stored_passwd (manager, login_id, passwd, stored_passwd);
+        goto out;
     }
 
     email_down = g_ascii_strdown (email, strlen(login_id));
@@ -1058,14 +1532,8 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
                                         get_password, &stored_passwd,
                                         1, "string", email_down) > 0) {
         g_free (email_down);
-        if (validate_passwd (passwd, stored_passwd, &need_upgrade)) {
-            if (need_upgrade)
-                update_user_passwd (manager, login_id, passwd);
-            ret = 0;
-            goto out;
-        } else {
-            goto out;
-        }
+        ret = check_stored_passwd (manager, login_id, passwd, stored_passwd);
+        goto out;
     }
     g_free (email_down);
 
@@ -1139,29 +1607,38 @@ get_ldap_emailuser_cb (CcnetDBRow *row, void *data)
     return FALSE;
 }
 
+/* @error is set to TRUE if NULL is returned because of a failure. */
 static CcnetEmailUser*
-get_emailuser (CcnetUserManager *manager,
-               const char *email,
-               gboolean import)
+load_emailuser (CcnetUserManager *manager,
+                const char *email,
+                gboolean import,
+                gboolean *error)
 {
     CcnetDB *db = manager->priv->db;
     char *sql;
     CcnetEmailUser *emailuser = NULL;
     char *email_down;
+    int rc;
 
     sql = "SELECT e.id, e.email, is_staff, is_active, ctime, passwd, reference_id, role "
         " FROM EmailUser e LEFT JOIN UserRole ON e.email = UserRole.email "
         " WHERE e.email=?";
-    if (seaf_db_statement_foreach_row (db, sql, get_emailuser_cb, &emailuser,
-                                        1, "string", email) > 0) {
+    rc = seaf_db_statement_foreach_row (db, sql, get_emailuser_cb, &emailuser,
+                                        1, "string", email);
+    if (rc > 0) {
         return emailuser;
+    } else if (rc < 0) {
+        *error = TRUE;
     }
 
     email_down = g_ascii_strdown (email, strlen(email));
-    if (seaf_db_statement_foreach_row (db, sql, get_emailuser_cb, &emailuser,
-                                        1, "string", email_down) > 0) {
+    rc = seaf_db_statement_foreach_row (db, sql, get_emailuser_cb, &emailuser,
+                                        1, "string", email_down);
+    if (rc > 0) {
         g_free (email_down);
         return emailuser;
+    } else if (rc < 0) {
+        *error = TRUE;
     }
 
 #ifdef HAVE_LDAP
@@ -1175,6 +1652,7 @@ get_emailuser (CcnetUserManager *manager,
                                                   &emailuser, 1, "string", email_down);
         if (ret < 0) {
             ccnet_warning ("get ldapuser from db failed.\n");
+            *error = TRUE;
             g_free (email_down);
             return NULL;
         }
@@ -1182,7 +1660,7 @@ get_emailuser (CcnetUserManager *manager,
         if (!emailuser) {
             GList *users, *ptr;
 
-            users = ldap_list_users (manager, email, -1, -1);
+            users = ldap_list_users (manager, email, -1, -1, error);
             if (!users) {
                 /* Only print warning if this function is called in login. */
                 if (import)
@@ -1199,16 +1677,18 @@ get_emailuser (CcnetUserManager *manager,
 
             if (import) {
                 if (!check_user_number (manager, FALSE)) {
+                    *error = TRUE;
                     g_free (email_down);
                     g_object_unref (emailuser);
                     return NULL;
                 }
 
                 // add user to LDAPUsers
-                ret = add_ldapuser (manager->priv->db, email_down, "",
+                ret = add_ldapuser (manager, email_down, "",
                                     FALSE, TRUE, NULL);
                 if (ret < 0) {
                     ccnet_warning ("add ldapuser to db failed.\n");
+                    *error = TRUE;
                     g_free (email_down);
                     g_object_unref (emailuser);
                     return NULL;
@@ -1229,6 +1709,27 @@ get_emailuser (CcnetUserManager *manager,
 
 }
 
+static CcnetEmailUser*
+get_emailuser (CcnetUserManager *manager,
+               const char *email,
+               gboolean import)
+{
+    CcnetEmailUser *emailuser = NULL;
+    gboolean error = FALSE;
+
+    /* Imports go to LDAP, users found there aren't added to LDAPUsers
+     * by plain lookups.
+     */
+    if (!import && user_cache_lookup (manager, email, &emailuser))
+        return emailuser;
+
+    emailuser = load_emailuser (manager, email, import, &error);
+    if (!error)
+        user_cache_insert (manager, email, emailuser);
+
+    return emailuser;
+}
+
 CcnetEmailUser*
 ccnet_user_manager_get_emailuser (CcnetUserManager *manager,
                                   const char *email)
@@ -1339,7 +1840,7 @@ ccnet_user_manager_get_emailusers (CcnetUserManager *manager,
         GList *users = NULL;
 
         if (g_strcmp0 (source, "LDAP") == 0) {
-            users = ldap_list_users (manager, "*", start, limit);
+            users = ldap_list_users (manager, "*", start, limit, NULL);
             return g_list_reverse (users);
         } else if (g_strcmp0 (source, "LDAPImport") == 0) {
             if (start == -1 && limit == -1) {
@@ -1549,7 +2050,7 @@ ccnet_user_manager_search_ldapusers (CcnetUserManager *manager,
 
     char *ldap_patt = g_strdup_printf ("*%s*", keyword);
 
-    ret = ldap_list_users (manager, ldap_patt, start, limit);
+    ret = ldap_list_users (manager, ldap_patt, start, limit, NULL);
 
     g_free (ldap_patt);
 #endif
@@ -1560,13 +2061,13 @@ ccnet_user_manager_search_ldapusers (CcnetUserManager *manager,
 gint64
 ccnet_user_manager_count_emailusers (CcnetUserManager *manager, const char *source)
 {
-    CcnetDB* db = manager->priv->db;
-    char sql[512];
     gint64 ret;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap && g_strcmp0(source, "LDAP") == 0) {
-        gint64 ret = seaf_db_get_int64 (db, "SELECT COUNT(id) FROM LDAPUsers WHERE is_active = 1");
+        gint64 ret = row_counts_get (manager->priv->row_counts,
+                                     user_count_name (TRUE, TRUE),
+                                     user_count_sql (TRUE, TRUE));
         if (ret < 0)
             return -1;
         return ret;
@@ -1576,9 +2077,9 @@ ccnet_user_manager_count_emailusers (CcnetUserManager *manager, const char *sour
     if (g_strcmp0 (source, "DB") != 0)
         return -1;
 
-    snprintf (sql, 512, "SELECT COUNT(id) FROM EmailUser WHERE is_active = 1");
-
-    ret = seaf_db_get_int64 (db, sql);
+    ret = row_counts_get (manager->priv->row_counts,
+                          user_count_name (FALSE, TRUE),
+                          user_count_sql (FALSE, TRUE));
     if (ret < 0)
         return -1;
     return ret;
@@ -1587,13 +2088,13 @@ ccnet_user_manager_count_emailusers (CcnetUserManager *manager, const char *sour
 gint64
 ccnet_user_manager_count_inactive_emailusers (CcnetUserManager *manager, const char *source)
 {
-    CcnetDB* db = manager->priv->db;
-    char sql[512];
     gint64 ret;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap && g_strcmp0(source, "LDAP") == 0) {
-        gint64 ret = seaf_db_get_int64 (db, "SELECT COUNT(id) FROM LDAPUsers WHERE is_active = 0");
+        gint64 ret = row_counts_get (manager->priv->row_counts,
+                                     user_count_name (TRUE, FALSE),
+                                     user_count_sql (TRUE, FALSE));
         if (ret < 0)
             return -1;
         return ret;
@@ -1603,14 +2104,20 @@ ccnet_user_manager_count_inactive_emailusers (CcnetUserManager *manager, const c
     if (g_strcmp0 (source, "DB") != 0)
         return -1;
 
-    snprintf (sql, 512, "SELECT COUNT(id) FROM EmailUser WHERE is_active = 0");
-
-    ret = seaf_db_get_int64 (db, sql);
+    ret = row_counts_get (manager->priv->row_counts,
+                          user_count_name (FALSE, FALSE),
+                          user_count_sql (FALSE, FALSE));
     if (ret < 0)
         return -1;
     return ret;
 }
 
+int
+ccnet_user_manager_reset_counts (CcnetUserManager *manager)
+{
+    return row_counts_reset (manager->priv->row_counts);
+}
+
 #if 0
 GList*
 ccnet_user_manager_filter_emailusers_by_emails(CcnetUserManager *manager,
@@ -1652,14 +2159,69 @@ ccnet_user_manager_filter_emailusers_by_emails(CcnetUserManager *manager,
 }
 #endif
 
+/* Moves the user between the active and inactive counts if needed. */
+static int
+update_user_row (CcnetUserManager *manager, gboolean ldap, int id,
+                 const char *db_passwd, int is_staff, int is_active)
+{
+    CcnetDB *db = manager->priv->db;
+    const char *table = ldap ? "LDAPUsers" : "EmailUser";
+    CcnetDBTrans *trans;
+    char *sql;
+    int old_active = -1;
+    int ret = -1;
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
+    sql = g_strdup_printf ("SELECT is_active FROM %s WHERE id=?%s",
+                           table, row_counts_lock_clause (db));
+    if (seaf_db_trans_foreach_selected_row (trans, sql, get_is_active_cb,
+                                            &old_active, 1, "int", id) < 0)
+        goto rollback;
+    g_free (sql);
+
+    if (db_passwd) {
+        sql = g_strdup_printf ("UPDATE %s SET passwd=?, is_staff=?, is_active=? "
+                               "WHERE id=?", table);
+        ret = seaf_db_trans_query (trans, sql, 4, "string", db_passwd,
+                                   "int", is_staff, "int", is_active, "int", id);
+    } else {
+        sql = g_strdup_printf ("UPDATE %s SET is_staff=?, is_active=? WHERE id=?",
+                               table);
+        ret = seaf_db_trans_query (trans, sql, 3, "int", is_staff,
+                                   "int", is_active, "int", id);
+    }
+    if (ret < 0)
+        goto rollback;
+    if (old_active >= 0 && old_active != (is_active != 0)) {
+        row_counts_trans_add (manager->priv->row_counts, trans,
+                              user_count_name (ldap, old_active), -1);
+        row_counts_trans_add (manager->priv->row_counts, trans,
+                              user_count_name (ldap, is_active != 0), 1);
+    }
+
+    ret = seaf_db_commit (trans);
+    goto out;
+
+rollback:
+    ret = -1;
+    seaf_db_rollback (trans);
+out:
+    seaf_db_trans_close (trans);
+    g_free (sql);
+    return ret;
+}
+
 int
 ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
                                      const char *source,
                                      int id, const char* passwd,
                                      int is_staff, int is_active)
 {
-    CcnetDB* db = manager->priv->db;
     char *db_passwd = NULL;
+    int ret;
 
     // in case set user user1 to inactive, then add another active user user2,
     // if current user num already the max user num,
@@ -1668,30 +2230,22 @@ ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
         return -1;
     }
 
+    /* Users are cached by email, and updates by id are rare. */
+    user_cache_invalidate (manager, NULL);
+
     if (strcmp (source, "DB") == 0) {
-        if (g_strcmp0 (passwd, "!") == 0) {
-            /* Don't update passwd if it starts with '!' */
-            return seaf_db_statement_query (db, "UPDATE EmailUser SET is_staff=?, "
-                                             "is_active=? WHERE id=?",
-                                             3, "int", is_staff, "int", is_active,
-                                             "int", id);
-        } else {
+        /* Don't update passwd if it starts with '!' */
+        if (g_strcmp0 (passwd, "!") != 0)
             hash_password_pbkdf2_sha256 (passwd, manager->passwd_hash_iter, &db_passwd);
 
-            return seaf_db_statement_query (db, "UPDATE EmailUser SET passwd=?, "
-                                             "is_staff=?, is_active=? WHERE id=?",
-                                             4, "string", db_passwd, "int", is_staff,
-                                             "int", is_active, "int", id);
-        }
+        ret = update_user_row (manager, FALSE, id, db_passwd, is_staff, is_active);
+        g_free (db_passwd);
+        return ret;
     }
 
 #ifdef HAVE_LDAP
-    if (manager->use_ldap && strcmp (source, "LDAP") == 0) {
-        return seaf_db_statement_query (db, "UPDATE LDAPUsers SET is_staff=?, "
-                                         "is_active=? WHERE id=?",
-                                         3, "int", is_staff, "int", is_active,
-                                         "int", id);
-    }
+    if (manager->use_ldap && strcmp (source, "LDAP") == 0)
+        return update_user_row (manager, TRUE, id, NULL, is_staff, is_active);
 #endif
 
     return -1;
@@ -1728,6 +2282,8 @@ ccnet_user_manager_update_role_emailuser (CcnetUserManager *manager,
 {
     CcnetDB* db = manager->priv->db;
     char *old_role = ccnet_user_manager_get_role_emailuser (manager, email);
+
+    user_cache_invalidate (manager, email);
     if (old_role) {
         g_free (old_role);
         return seaf_db_statement_query (db, "UPDATE UserRole SET role=? "
@@ -1790,6 +2346,8 @@ ccnet_user_manager_set_reference_id (CcnetUserManager *manager,
     char *sql;
     gboolean exists, err;
 
+    user_cache_invalidate (manager, primary_id);
+
 #ifdef HAVE_LDAP
     if (manager->use_ldap) {
         sql = "SELECT email FROM LDAPUsers WHERE email = ?";
@@ -2001,6 +2559,9 @@ ccnet_user_manager_update_emailuser_id (CcnetUserManager *manager,
     int rc;
     GString *sql = g_string_new ("");
 
+    user_cache_invalidate (manager, old_email);
+    user_cache_invalidate (manager, new_email);
+
     //1.update RepoOwner
     g_string_printf (sql, "UPDATE RepoOwner SET owner_id=? WHERE owner_id=?");
     rc = seaf_db_statement_query (seaf->db, sql->str, 2,
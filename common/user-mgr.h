@@ -60,6 +60,11 @@ GType ccnet_user_manager_get_type  (void);
 CcnetUserManager* ccnet_user_manager_new (SeafileSession *);
 int ccnet_user_manager_prepare (CcnetUserManager *manager);
 
+/* Creates missing tables if configured to. Only needs the db opened by
+ * ccnet_user_manager_prepare().
+ */
+int ccnet_user_manager_create_tables (CcnetUserManager *manager);
+
 void ccnet_user_manager_free (CcnetUserManager *manager);
 
 void ccnet_user_manager_start (CcnetUserManager *manager);
@@ -78,6 +83,10 @@ ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
                                      const char *source,
                                      const char *email);
 
+/*
+ * Returns 0 if @passwd is correct, -1 if not, and -2 if too many logins are
+ * in progress to check it.
+ */
 int
 ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
                                        const char *email,
@@ -119,6 +128,10 @@ ccnet_user_manager_count_emailusers (CcnetUserManager *manager, const char *sour
 gint64
 ccnet_user_manager_count_inactive_emailusers (CcnetUserManager *manager, const char *source);
 
+/* Drops the stored user counts, to be counted again from the tables. */
+int
+ccnet_user_manager_reset_counts (CcnetUserManager *manager);
+
 GList*
 ccnet_user_manager_filter_emailusers_by_emails(CcnetUserManager *manager,
                                                const char *emails);
@@ -47,12 +47,12 @@ commit_tree_to_hash (SeafCommit *head)
 
     hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
-                                                    head->repo_id,
-                                                    head->version,
-                                                    head->commit_id,
-                                                    add_to_commit_hash,
-                                                    hash, FALSE);
+    res = seaf_commit_manager_traverse_commit_graph (seaf->commit_mgr,
+                                                     head->repo_id,
+                                                     head->version,
+                                                     head->commit_id,
+                                                     add_to_commit_hash,
+                                                     hash, FALSE);
     if (!res)
         goto fail;
 
@@ -16,9 +16,13 @@
 
 #include "utils.h"
 #include "log.h"
+#include "proc-policy.h"
 #include "seafile-controller.h"
 
 #define CHECK_PROCESS_INTERVAL 10        /* every 10 seconds */
+#define ROLLING_RESTART_INTERVAL 2       /* seconds between rolling restart steps */
+#define ROLLING_RESTART_MAX_TICKS 15     /* steps a new fileserver may take to start */
+#define MAX_FILESERVER_PROCESSES 64
 
 #if defined(__sun)
 #define PROC_SELF_PATH "/proc/self/path/a.out"
@@ -34,6 +38,8 @@ char *bin_dir = NULL;
 char *installpath = NULL;
 char *topdir = NULL;
 gboolean enabled_go_fileserver = FALSE;
+/* Set by SIGHUP, the fileservers are restarted one by one. */
+static volatile sig_atomic_t fileserver_restart_requested = 0;
 
 char *seafile_ld_library_path = NULL;
 
@@ -70,9 +76,9 @@ controller_exit (int code)
 // Utility functions Start
 //
 
-/* returns the pid of the newly created process */
+/* returns the pid of the newly created process. @policy can be NULL. */
 static int
-spawn_process (char *argv[], bool is_python_process)
+spawn_process (char *argv[], bool is_python_process, ProcPolicy *policy)
 {
     char **ptr = argv;
     GString *buf = g_string_new(argv[0]);
@@ -100,6 +106,7 @@ spawn_process (char *argv[], bool is_python_process)
             }
         }
         /* child process */
+        proc_policy_enter (policy);
         execvp (argv[0], argv);
         seaf_warning ("failed to execvp %s\n", argv[0]);
         
@@ -163,12 +170,8 @@ read_pid_from_pidfile (const char *pidfile)
 }
 
 static void
-kill_by_force (int which)
+kill_pidfile_by_force (const char *pidfile)
 {
-    if (which < 0 || which >= N_PID)
-        return;
-
-    char *pidfile = ctl->pidfile[which];
     int pid = read_pid_from_pidfile(pidfile);
     if (pid > 0) {
         // if SIGKILL send success, then remove related pid file
@@ -178,6 +181,15 @@ kill_by_force (int which)
     }
 }
 
+static void
+kill_by_force (int which)
+{
+    if (which < 0 || which >= N_PID)
+        return;
+
+    kill_pidfile_by_force (ctl->pidfile[which]);
+}
+
 //
 // Utility functions End
 //
@@ -204,7 +216,7 @@ start_seaf_server ()
         "-p", ctl->rpc_pipe_path,
         NULL};
 
-    int pid = spawn_process (argv, false);
+    int pid = spawn_process (argv, false, ctl->policies[PID_SERVER]);
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seaf-server\n");
         return -1;
@@ -213,8 +225,13 @@ start_seaf_server ()
     return 0;
 }
 
+/*
+ * All fileserver processes listen with SO_REUSEPORT, even a single one, so
+ * that a rolling restart can start the new process before the old one
+ * stops listening.
+ */
 static int
-start_go_fileserver()
+start_go_fileserver(int i)
 {
     if (!ctl->central_config_dir || !ctl->seafile_dir)
         return -1;
@@ -230,11 +247,12 @@ start_go_fileserver()
         "-d", ctl->seafile_dir,
         "-l", logfile,
         "-p", ctl->rpc_pipe_path,
-        "-P", ctl->pidfile[PID_FILESERVER],
+        "-P", ctl->fileserver_pidfiles[i],
+        "-reuseport",
         NULL};
 
-    seaf_message ("starting go-fileserver ...");
-    int pid = spawn_process(argv, false);
+    seaf_message ("starting go-fileserver %d ...", i);
+    int pid = spawn_process(argv, false, ctl->policies[PID_FILESERVER]);
 
     if (pid <= 0) {
         seaf_warning("Failed to spawn fileserver\n");
@@ -384,7 +402,7 @@ start_seafevents() {
         NULL
     };
 
-    int pid = spawn_process (argv, true);
+    int pid = spawn_process (argv, true, ctl->policies[PID_SEAFEVENTS]);
 
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seafevents.\n");
@@ -418,7 +436,7 @@ start_seafdav() {
         NULL
     };
 
-    int pid = spawn_process (argv, true);
+    int pid = spawn_process (argv, true, ctl->policies[PID_SEAFDAV]);
 
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seafdav\n");
@@ -437,28 +455,153 @@ run_controller_loop ()
 }
 
 static gboolean
-need_restart (int which)
+process_exists (int pid)
 {
-    if (which < 0 || which >= N_PID)
-        return FALSE;
+    char buf[256];
 
-    int pid = read_pid_from_pidfile (ctl->pidfile[which]);
+    snprintf (buf, sizeof(buf), "/proc/%d", pid);
+    return g_file_test (buf, G_FILE_TEST_IS_DIR);
+}
+
+static gboolean
+pidfile_need_restart (const char *pidfile)
+{
+    int pid = read_pid_from_pidfile (pidfile);
     if (pid == PID_ERROR_ENOENT) {
-        seaf_warning ("pid file %s does not exist\n", ctl->pidfile[which]);
+        seaf_warning ("pid file %s does not exist\n", pidfile);
         return TRUE;
     } else if (pid == PID_ERROR_OTHER) {
-        seaf_warning ("failed to read pidfile %s: %s\n", ctl->pidfile[which], strerror(errno));
+        seaf_warning ("failed to read pidfile %s: %s\n", pidfile, strerror(errno));
+        return FALSE;
+    } else if (process_exists (pid)) {
         return FALSE;
     } else {
-        char buf[256];
-        snprintf (buf, sizeof(buf), "/proc/%d", pid);
-        if (g_file_test (buf, G_FILE_TEST_IS_DIR)) {
-            return FALSE;
-        } else {
-            seaf_warning ("path /proc/%d doesn't exist, restart progress [%d]\n", pid, which);
+        seaf_warning ("path /proc/%d doesn't exist, restart progress %s\n", pid, pidfile);
+        return TRUE;
+    }
+}
+
+static gboolean
+need_restart (int which)
+{
+    if (which < 0 || which >= N_PID)
+        return FALSE;
+
+    return pidfile_need_restart (ctl->pidfile[which]);
+}
+
+static void
+write_pid_to_pidfile (const char *pidfile, int pid)
+{
+    char buf[32];
+
+    snprintf (buf, sizeof(buf), "%d", pid);
+    if (!g_file_set_contents (pidfile, buf, -1, NULL))
+        seaf_warning ("Failed to write pidfile %s.\n", pidfile);
+}
+
+/*
+ * A rolling restart replaces the fileservers one at a time: the new
+ * process is started next to the old one on the shared port, and once it
+ * runs the old one gets SIGTERM. The old process stops accepting
+ * connections and exits when its requests are done.
+ */
+static gboolean
+rolling_restart_step (void *data)
+{
+    int i = ctl->rolling_fileserver;
+    const char *pidfile;
+    int pid;
+
+    if (i < 0) {
+        i = 0;
+        goto start_next;
+    }
+
+    pidfile = ctl->fileserver_pidfiles[i];
+    pid = read_pid_from_pidfile (pidfile);
+    ++ctl->rolling_ticks;
+    if (pid > 0 && pid != ctl->rolling_old_pid && process_exists (pid)) {
+        /* Give it a step to fail on startup, before it takes over. */
+        if (ctl->rolling_ticks < 2)
             return TRUE;
-        }
+        if (ctl->rolling_old_pid > 0)
+            kill ((pid_t)ctl->rolling_old_pid, SIGTERM);
+        seaf_message ("fileserver %d restarted, pid %d\n", i, pid);
+        ++i;
+        goto start_next;
+    }
+
+    if ((pid > 0 && pid != ctl->rolling_old_pid) ||
+        ctl->rolling_ticks >= ROLLING_RESTART_MAX_TICKS) {
+        /* The new process failed, keep the old one. */
+        seaf_warning ("Failed to restart fileserver %d, rolling restart stopped.\n", i);
+        if (ctl->rolling_old_pid > 0 && process_exists (ctl->rolling_old_pid))
+            write_pid_to_pidfile (pidfile, ctl->rolling_old_pid);
+        ctl->rolling_fileserver = -1;
+        return FALSE;
     }
+
+    return TRUE;
+
+start_next:
+    if (i >= ctl->n_fileservers) {
+        seaf_message ("Rolling restart of fileservers finished.\n");
+        ctl->rolling_fileserver = -1;
+        return FALSE;
+    }
+    ctl->rolling_fileserver = i;
+    ctl->rolling_old_pid = read_pid_from_pidfile (ctl->fileserver_pidfiles[i]);
+    ctl->rolling_ticks = 0;
+    if (start_go_fileserver (i) < 0) {
+        seaf_warning ("Failed to restart fileserver %d, rolling restart stopped.\n", i);
+        ctl->rolling_fileserver = -1;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+start_rolling_restart ()
+{
+    seaf_message ("Rolling restart of %d fileservers.\n", ctl->n_fileservers);
+    /* Step -1 starts the first process at once. */
+    ctl->rolling_fileserver = -1;
+    if (rolling_restart_step (NULL)) {
+        g_timeout_add (ROLLING_RESTART_INTERVAL * 1000, rolling_restart_step, NULL);
+    }
+}
+
+/*
+ * The cgroups are set up once here; the processes join them when they are
+ * started, also when restarted by the monitor.
+ */
+static void
+load_proc_policies ()
+{
+    static const char *names[N_PID] = {
+        [PID_SERVER] = "seaf-server",
+        [PID_FILESERVER] = "fileserver",
+        [PID_SEAFDAV] = "seafdav",
+        [PID_SEAFEVENTS] = "seafevents",
+    };
+    char *seafile_conf = g_build_filename (ctl->central_config_dir, "seafile.conf", NULL);
+    GKeyFile *key_file = g_key_file_new ();
+    int i;
+
+    if (!g_key_file_load_from_file (key_file, seafile_conf, G_KEY_FILE_NONE, NULL))
+        goto out;
+
+    for (i = 0; i < N_PID; i++) {
+        if (!names[i])
+            continue;
+        ctl->policies[i] = proc_policy_load (key_file, names[i]);
+        proc_policy_setup (ctl->policies[i]);
+    }
+
+out:
+    g_key_file_free (key_file);
+    g_free (seafile_conf);
 }
 
 static gboolean
@@ -489,6 +632,10 @@ should_start_go_fileserver()
         }
     }
 
+    ctl->n_fileservers = g_key_file_get_integer (key_file, "fileserver",
+                                                 "fileserver_processes", NULL);
+    ctl->n_fileservers = CLAMP (ctl->n_fileservers, 1, MAX_FILESERVER_PROCESSES);
+
     if (ret) {
         char *type = NULL;
         type = g_key_file_get_string (key_file, "database", "type", NULL);
@@ -515,9 +662,21 @@ check_process (void *data)
     }
 
     if (enabled_go_fileserver) {
-        if (need_restart(PID_FILESERVER)) {
-            seaf_message("fileserver need restart...\n");
-            start_go_fileserver();
+        int i;
+        for (i = 0; i < ctl->n_fileservers; ++i) {
+            /* The rolling restart watches the process it replaces. */
+            if (i == ctl->rolling_fileserver)
+                continue;
+            if (pidfile_need_restart (ctl->fileserver_pidfiles[i])) {
+                seaf_message("fileserver %d need restart...\n", i);
+                start_go_fileserver(i);
+            }
+        }
+
+        if (fileserver_restart_requested) {
+            fileserver_restart_requested = 0;
+            if (ctl->rolling_fileserver < 0)
+                start_rolling_restart ();
         }
     }
 
@@ -551,7 +710,13 @@ stop_services ()
     seaf_message ("shutting down all services ...\n");
 
     kill_by_force(PID_SERVER);
-    kill_by_force(PID_FILESERVER);
+    if (ctl->fileserver_pidfiles) {
+        int i;
+        for (i = 0; i < ctl->n_fileservers; ++i)
+            kill_pidfile_by_force (ctl->fileserver_pidfiles[i]);
+    } else {
+        kill_by_force(PID_FILESERVER);
+    }
     kill_by_force(PID_SEAFDAV);
     if (ctl->has_seafevents)
         kill_by_force(PID_SEAFEVENTS);
@@ -574,6 +739,24 @@ init_pidfile_path (SeafileController *ctl)
     ctl->pidfile[PID_FILESERVER] = g_build_filename (pid_dir, "fileserver.pid", NULL);
 }
 
+static void
+init_fileserver_pidfiles (SeafileController *ctl)
+{
+    char *pid_dir = g_path_get_dirname (ctl->pidfile[PID_FILESERVER]);
+    char name[64];
+    int i;
+
+    ctl->fileserver_pidfiles = g_new0 (char *, ctl->n_fileservers + 1);
+    ctl->fileserver_pidfiles[0] = g_strdup (ctl->pidfile[PID_FILESERVER]);
+    for (i = 1; i < ctl->n_fileservers; ++i) {
+        snprintf (name, sizeof(name), "fileserver-%d.pid", i);
+        ctl->fileserver_pidfiles[i] = g_build_filename (pid_dir, name, NULL);
+    }
+    ctl->rolling_fileserver = -1;
+
+    g_free (pid_dir);
+}
+
 static int
 seaf_controller_init (SeafileController *ctl,
                       char *central_config_dir,
@@ -640,9 +823,13 @@ seaf_controller_start ()
     }
 
     if (enabled_go_fileserver) {
-        if (start_go_fileserver() < 0) {
-            seaf_warning ("Failed to start fileserver\n");
-            return -1;
+        int i;
+        init_fileserver_pidfiles (ctl);
+        for (i = 0; i < ctl->n_fileservers; ++i) {
+            if (start_go_fileserver(i) < 0) {
+                seaf_warning ("Failed to start fileserver\n");
+                return -1;
+            }
         }
     }
 
@@ -710,6 +897,12 @@ sigusr1_handler (int signo)
     seafile_log_reopen();
 }
 
+static void
+sighup_handler (int signo)
+{
+    fileserver_restart_requested = 1;
+}
+
 static void
 set_signal_handlers ()
 {
@@ -717,6 +910,7 @@ set_signal_handlers ()
     signal (SIGTERM, sigint_handler);
     signal (SIGCHLD, sigchld_handler);
     signal (SIGUSR1, sigusr1_handler);
+    signal (SIGHUP, sighup_handler);
     signal (SIGPIPE, SIG_IGN);
 }
 
@@ -979,6 +1173,7 @@ int main (int argc, char **argv)
     set_signal_handlers ();
 
     enabled_go_fileserver = should_start_go_fileserver();
+    load_proc_policies ();
 
     if (seaf_controller_start () < 0)
         controller_exit (1);
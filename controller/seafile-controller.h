@@ -20,6 +20,8 @@
 #ifndef SEAFILE_CONTROLLER_H
 #define SEAFILE_CONTROLLER_H
 
+#include "proc-policy.h"
+
 typedef struct _SeafileController SeafileController;
 
 enum {
@@ -56,5 +58,18 @@ struct _SeafileController {
     SeafDavConfig       seafdav_config;
 
     gboolean            has_seafevents;
+
+    /* Go fileserver processes sharing the listen port. The first one uses
+     * pidfile[PID_FILESERVER].
+     */
+    int                 n_fileservers;
+    char                **fileserver_pidfiles;
+    /* Process being replaced by a rolling restart, or -1. */
+    int                 rolling_fileserver;
+    int                 rolling_old_pid;
+    int                 rolling_ticks;
+
+    /* CPU and IO policies of the processes, NULL if not configured. */
+    ProcPolicy          *policies[N_PID];
 };
 #endif
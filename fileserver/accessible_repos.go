@@ -0,0 +1,229 @@
+package main
+
+import (
+	"crypto/sha1"
+	"fmt"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/share"
+)
+
+// Building the accessible repo list of a user takes a query for owned,
+// shared, group and public repos each, and sync clients poll it often. The
+// list is cached per user and dropped by the share, group and repo list
+// events of seaf-server, see popPermEvents. It also expires after
+// accessibleReposExpire, for changes made on other nodes of a cluster.
+//
+// Heads, names and mtimes change with every commit, so a cached list only
+// holds which repos the user can access and how. The rest is read for the
+// cached repo ids with one query per request.
+
+const (
+	accessibleReposExpire   = 10 * time.Minute
+	maxCachedAccessibleList = 100000
+)
+
+type accessibleRepoList struct {
+	repos      []*share.SharedRepo
+	expireTime time.Time
+}
+
+var accessibleRepoLists = struct {
+	sync.Mutex
+	lists map[string]*accessibleRepoList
+	// gen is bumped by invalidations, so that a list loaded before one
+	// isn't cached after it.
+	gen uint64
+}{lists: make(map[string]*accessibleRepoList)}
+
+// These are replaced in tests.
+var (
+	loadAccessibleRepos = listAccessibleRepos
+	loadRepoHeads       = share.GetRepoHeads
+)
+
+// getAccessibleRepos returns the repos user can access. The returned repos
+// may be modified by the caller.
+func getAccessibleRepos(user string) ([]*share.SharedRepo, error) {
+	key := strings.ToLower(user)
+	now := time.Now()
+
+	accessibleRepoLists.Lock()
+	list, ok := accessibleRepoLists.lists[key]
+	gen := accessibleRepoLists.gen
+	accessibleRepoLists.Unlock()
+
+	if ok && now.Before(list.expireTime) {
+		return refreshAccessibleRepos(list.repos)
+	}
+
+	repos, err := loadAccessibleRepos(user)
+	if err != nil {
+		return nil, err
+	}
+
+	cached := make([]*share.SharedRepo, len(repos))
+	for i, repo := range repos {
+		r := *repo
+		cached[i] = &r
+	}
+	accessibleRepoLists.Lock()
+	if accessibleRepoLists.gen == gen {
+		if len(accessibleRepoLists.lists) >= maxCachedAccessibleList {
+			accessibleRepoLists.lists = make(map[string]*accessibleRepoList)
+		}
+		accessibleRepoLists.lists[key] = &accessibleRepoList{cached, now.Add(accessibleReposExpire)}
+	}
+	accessibleRepoLists.Unlock()
+
+	return repos, nil
+}
+
+// refreshAccessibleRepos copies the cached repos with their current heads,
+// leaving out the repos that were deleted.
+func refreshAccessibleRepos(cached []*share.SharedRepo) ([]*share.SharedRepo, error) {
+	if len(cached) == 0 {
+		return nil, nil
+	}
+	repoIDs := make([]string, 0, len(cached))
+	for _, repo := range cached {
+		repoIDs = append(repoIDs, repo.ID)
+	}
+	heads, err := loadRepoHeads(repoIDs)
+	if err != nil {
+		return nil, fmt.Errorf("Failed to get repo heads: %v", err)
+	}
+
+	var repos []*share.SharedRepo
+	for _, repo := range cached {
+		head, ok := heads[repo.ID]
+		if !ok {
+			continue
+		}
+		r := *repo
+		r.HeadCommitID = head.HeadCommitID
+		r.Name = head.Name
+		r.MTime = head.MTime
+		r.Version = head.Version
+		repos = append(repos, &r)
+	}
+
+	return repos, nil
+}
+
+// invalidateAccessibleRepos drops the cached list of user, or the lists that
+// contain repoID if user is empty. If both are empty, all lists are dropped.
+func invalidateAccessibleRepos(repoID, user string) {
+	accessibleRepoLists.Lock()
+	defer accessibleRepoLists.Unlock()
+
+	accessibleRepoLists.gen++
+	switch {
+	case user != "":
+		delete(accessibleRepoLists.lists, strings.ToLower(user))
+	case repoID != "":
+		for key, list := range accessibleRepoLists.lists {
+			for _, repo := range list.repos {
+				if repo.ID == repoID {
+					delete(accessibleRepoLists.lists, key)
+					break
+				}
+			}
+		}
+	default:
+		accessibleRepoLists.lists = make(map[string]*accessibleRepoList)
+	}
+}
+
+// listAccessibleRepos builds the accessible repo list of user from the
+// database.
+func listAccessibleRepos(user string) ([]*share.SharedRepo, error) {
+	obtainedRepos := make(map[string]string)
+
+	repos, err := share.GetReposByOwner(user)
+	if err != nil {
+		return nil, fmt.Errorf("Failed to get repos by owner %s: %v", user, err)
+	}
+
+	var repoObjects []*share.SharedRepo
+	for _, repo := range repos {
+		if _, ok := obtainedRepos[repo.ID]; !ok {
+			obtainedRepos[repo.ID] = repo.ID
+		}
+		repo.Permission = "rw"
+		repo.Type = "repo"
+		repo.Owner = user
+		repoObjects = append(repoObjects, repo)
+	}
+
+	repos, err = share.ListShareRepos(user, "to_email")
+	if err != nil {
+		return nil, fmt.Errorf("Failed to get share repos by user %s: %v", user, err)
+	}
+	for _, sRepo := range repos {
+		if _, ok := obtainedRepos[sRepo.ID]; ok {
+			continue
+		}
+		sRepo.Type = "srepo"
+		sRepo.Owner = strings.ToLower(sRepo.Owner)
+		repoObjects = append(repoObjects, sRepo)
+	}
+
+	repos, err = share.GetGroupReposByUser(user, -1)
+	if err != nil {
+		return nil, fmt.Errorf("Failed to get group repos by user %s: %v", user, err)
+	}
+	reposTable := filterGroupRepos(repos)
+
+	// Walk the group repos in query order, so that the list, and its etag,
+	// is the same each time it's built.
+	for _, repo := range repos {
+		gRepo, ok := reposTable[repo.ID]
+		if !ok {
+			continue
+		}
+		delete(reposTable, repo.ID)
+		if _, ok := obtainedRepos[gRepo.ID]; ok {
+			continue
+		}
+
+		gRepo.Type = "grepo"
+		gRepo.Owner = strings.ToLower(gRepo.Owner)
+		repoObjects = append(repoObjects, gRepo)
+	}
+
+	repos, err = share.ListInnerPubRepos()
+	if err != nil {
+		return nil, fmt.Errorf("Failed to get inner public repos: %v", err)
+	}
+
+	for _, sRepo := range repos {
+		if _, ok := obtainedRepos[sRepo.ID]; ok {
+			continue
+		}
+
+		sRepo.Type = "grepo"
+		sRepo.Owner = "Organization"
+		repoObjects = append(repoObjects, sRepo)
+	}
+
+	return repoObjects, nil
+}
+
+func computeETag(data []byte) string {
+	return fmt.Sprintf("\"%x\"", sha1.Sum(data))
+}
+
+// etagMatches checks etag against an If-None-Match header.
+func etagMatches(ifNoneMatch, etag string) bool {
+	for _, tag := range strings.Split(ifNoneMatch, ",") {
+		tag = strings.TrimSpace(tag)
+		tag = strings.TrimPrefix(tag, "W/")
+		if tag == etag || tag == "*" {
+			return true
+		}
+	}
+	return false
+}
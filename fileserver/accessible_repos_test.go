@@ -0,0 +1,94 @@
+package main
+
+import (
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/share"
+)
+
+func TestAccessibleReposCache(t *testing.T) {
+	const repoA = "1a2b3c4d-1234-4321-abcd-0123456789ab"
+	const repoB = "2a2b3c4d-1234-4321-abcd-0123456789ab"
+
+	loads := 0
+	savedLoad, savedHeads := loadAccessibleRepos, loadRepoHeads
+	defer func() {
+		loadAccessibleRepos, loadRepoHeads = savedLoad, savedHeads
+		invalidateAccessibleRepos("", "")
+	}()
+	loadAccessibleRepos = func(user string) ([]*share.SharedRepo, error) {
+		loads++
+		return []*share.SharedRepo{
+			{ID: repoA, HeadCommitID: "a1", Permission: "rw", Type: "repo"},
+			{ID: repoB, HeadCommitID: "b1", Permission: "r", Type: "srepo"},
+		}, nil
+	}
+	heads := map[string]*share.RepoHead{
+		repoA: {HeadCommitID: "a2", Name: "A"},
+	}
+	loadRepoHeads = func(repoIDs []string) (map[string]*share.RepoHead, error) {
+		return heads, nil
+	}
+
+	repos, err := getAccessibleRepos("alice@example.com")
+	if err != nil || len(repos) != 2 || repos[0].HeadCommitID != "a1" {
+		t.Fatalf("unexpected first list: %v %v", repos, err)
+	}
+	repos[0].Permission = "r"
+
+	repos, err = getAccessibleRepos("Alice@example.com")
+	if err != nil {
+		t.Fatalf("failed to get cached list: %v", err)
+	}
+	if loads != 1 {
+		t.Errorf("cached list was loaded again")
+	}
+	if len(repos) != 1 || repos[0].HeadCommitID != "a2" || repos[0].Name != "A" {
+		t.Errorf("heads of the cached list were not refreshed: %v", repos)
+	}
+	if repos[0].Permission != "rw" {
+		t.Errorf("cached list was changed by the caller")
+	}
+
+	cases := []struct {
+		repoID, user string
+		reload       bool
+	}{
+		{"", "bob@example.com", false},
+		{repoA, "", true},
+		{"3a2b3c4d-1234-4321-abcd-0123456789ab", "", false},
+		{"", "alice@example.com", true},
+		{"", "", true},
+	}
+	for _, c := range cases {
+		invalidateAccessibleRepos(c.repoID, c.user)
+		before := loads
+		if _, err := getAccessibleRepos("alice@example.com"); err != nil {
+			t.Fatalf("failed to get list: %v", err)
+		}
+		if reloaded := loads != before; reloaded != c.reload {
+			t.Errorf("invalidating (%q, %q): reloaded %v, expected %v", c.repoID, c.user, reloaded, c.reload)
+		}
+	}
+
+	if _, user, ok := parseRepoListEvent("repo-list-change\t" + repoA + "\tbob@example.com"); !ok || user != "bob@example.com" {
+		t.Errorf("failed to parse repo list event")
+	}
+	if _, _, ok := parseRepoListEvent("perm-change\t\t"); ok {
+		t.Errorf("parsed a permission event as repo list event")
+	}
+}
+
+func TestETagMatches(t *testing.T) {
+	etag := computeETag([]byte("[]"))
+	for _, h := range []string{etag, "W/" + etag, "\"x\", " + etag, "*"} {
+		if !etagMatches(h, etag) {
+			t.Errorf("%q doesn't match %s", h, etag)
+		}
+	}
+	for _, h := range []string{"", "\"x\""} {
+		if etagMatches(h, etag) {
+			t.Errorf("%q matches %s", h, etag)
+		}
+	}
+}
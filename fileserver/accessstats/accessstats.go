@@ -0,0 +1,267 @@
+// Package accessstats keeps sampled statistics of the reads of objects, to
+// see how skewed they are, enabled with the sample rate in the [general]
+// section of seafile.conf:
+//
+//	[general]
+//	access_stats_sample_rate = 64
+//
+// For each class of objects, one read in sample rate is counted in a
+// count-min sketch, and the objects with the highest estimates are kept in
+// a heap of the top TopK. Independently, the objects whose id hashes to 0
+// modulo the sample rate have all their reads followed, and the number of
+// distinct followed objects read between two reads of the same object,
+// times the sample rate, estimates its reuse distance. An LRU cache of N
+// objects hits about the reads with a reuse distance below N.
+//
+// Reuse distances are measured within windows of ReuseWindow followed
+// reads; the first read of an object in a window is counted as cold. The
+// statistics are the same as the ones seaf-server returns from the
+// get_access_stats rpc.
+package accessstats
+
+import (
+	"container/heap"
+	"math/bits"
+	"sort"
+	"sync"
+	"sync/atomic"
+)
+
+// Class is a class of objects.
+type Class int
+
+// Classes of objects. Reads of blocks and dirs are also counted by the
+// repo they belong to.
+const (
+	Repo Class = iota
+	Dir
+	Block
+	NumClasses
+)
+
+var classNames = [NumClasses]string{"repo", "dir", "block"}
+
+func (c Class) String() string {
+	return classNames[c]
+}
+
+const (
+	// TopK is the number of most read objects kept for each class.
+	TopK = 32
+	// ReuseWindow is the number of followed reads in a window.
+	ReuseWindow = 1 << 16
+	// NumReuseBuckets is the number of buckets of reuse distances. Bucket
+	// i counts distances below 2^i, the last one the others.
+	NumReuseBuckets = 25
+
+	sketchDepth = 4
+	sketchWidth = 4096
+)
+
+// Hitter is an object and its estimated reads, scaled by the sample rate.
+type Hitter struct {
+	ID    string `json:"id"`
+	Reads uint64 `json:"reads"`
+}
+
+// Stats are the statistics of a class.
+type Stats struct {
+	// Reads counted in the sketch.
+	Sampled uint64
+	// Reads of the objects whose reuse distance is followed.
+	Followed uint64
+	Cold     uint64
+	Reuse    [NumReuseBuckets]uint64
+	// Most read first.
+	Top []Hitter
+}
+
+type hitterHeap []Hitter
+
+func (h hitterHeap) Len() int            { return len(h) }
+func (h hitterHeap) Less(i, j int) bool  { return h[i].Reads < h[j].Reads }
+func (h hitterHeap) Swap(i, j int)       { h[i], h[j] = h[j], h[i] }
+func (h *hitterHeap) Push(x interface{}) { *h = append(*h, x.(Hitter)) }
+func (h *hitterHeap) Pop() interface{} {
+	old := *h
+	x := old[len(old)-1]
+	*h = old[:len(old)-1]
+	return x
+}
+
+type classStats struct {
+	reads uint64
+
+	lock     sync.Mutex
+	sketch   [sketchDepth][sketchWidth]uint32
+	sampled  uint64
+	top      hitterHeap
+	lastRead map[string]uint32
+	// Fenwick tree marking the positions that are the last read of an
+	// object, so that the objects read since a position are counted in
+	// O(log n). Index 0 is unused.
+	lastMarks []int32
+	pos       uint32
+	followed  uint64
+	cold      uint64
+	reuse     [NumReuseBuckets]uint64
+}
+
+var sampleRate uint64
+var classes [NumClasses]*classStats
+
+// Init enables the statistics if rate is positive. It must be called
+// before any Record.
+func Init(rate int) {
+	if rate <= 0 {
+		return
+	}
+	for i := range classes {
+		classes[i] = &classStats{
+			lastRead:  make(map[string]uint32),
+			lastMarks: make([]int32, ReuseWindow+1),
+		}
+	}
+	sampleRate = uint64(rate)
+}
+
+// SampleRate returns the sample rate, 0 if the statistics are disabled.
+func SampleRate() int {
+	return int(sampleRate)
+}
+
+func hashID(id string) uint64 {
+	h := uint64(14695981039346656037)
+	for i := 0; i < len(id); i++ {
+		h ^= uint64(id[i])
+		h *= 1099511628211
+	}
+	return h
+}
+
+// Record counts a read of the object id of class c.
+func Record(c Class, id string) {
+	if sampleRate == 0 || id == "" {
+		return
+	}
+	st := classes[c]
+	h := hashID(id)
+	sketched := atomic.AddUint64(&st.reads, 1)%sampleRate == 0
+	followed := (h>>32)%sampleRate == 0
+	if !sketched && !followed {
+		return
+	}
+
+	st.lock.Lock()
+	defer st.lock.Unlock()
+	if sketched {
+		st.sampled++
+		est := st.sketchAdd(h)
+		if len(st.top) < TopK || uint64(est) > st.top[0].Reads {
+			st.updateTop(id, uint64(est))
+		}
+	}
+	if followed {
+		st.follow(id)
+	}
+}
+
+func (st *classStats) sketchAdd(h uint64) uint32 {
+	h1, h2 := uint32(h), uint32(h>>32)|1
+	est := ^uint32(0)
+	for i := 0; i < sketchDepth; i++ {
+		counter := &st.sketch[i][(h1+uint32(i)*h2)&(sketchWidth-1)]
+		if *counter < ^uint32(0) {
+			*counter++
+		}
+		if *counter < est {
+			est = *counter
+		}
+	}
+	return est
+}
+
+func (st *classStats) updateTop(id string, est uint64) {
+	// The heap is small enough to be searched.
+	for i := range st.top {
+		if st.top[i].ID == id {
+			st.top[i].Reads = est
+			heap.Fix(&st.top, i)
+			return
+		}
+	}
+	if len(st.top) < TopK {
+		heap.Push(&st.top, Hitter{id, est})
+	} else {
+		st.top[0] = Hitter{id, est}
+		heap.Fix(&st.top, 0)
+	}
+}
+
+func (st *classStats) marksAdd(pos uint32, delta int32) {
+	for ; pos <= ReuseWindow; pos += pos & -pos {
+		st.lastMarks[pos] += delta
+	}
+}
+
+func (st *classStats) marksSum(pos uint32) int32 {
+	var sum int32
+	for ; pos > 0; pos -= pos & -pos {
+		sum += st.lastMarks[pos]
+	}
+	return sum
+}
+
+func (st *classStats) follow(id string) {
+	if st.pos == ReuseWindow {
+		st.lastRead = make(map[string]uint32)
+		for i := range st.lastMarks {
+			st.lastMarks[i] = 0
+		}
+		st.pos = 0
+	}
+	st.pos++
+	st.followed++
+
+	if last, ok := st.lastRead[id]; ok {
+		distance := uint64(st.marksSum(st.pos-1)-st.marksSum(last)) * sampleRate
+		bucket := bits.Len64(distance)
+		if bucket >= NumReuseBuckets {
+			bucket = NumReuseBuckets - 1
+		}
+		st.reuse[bucket]++
+		st.marksAdd(last, -1)
+	} else {
+		st.cold++
+	}
+	st.lastRead[id] = st.pos
+	st.marksAdd(st.pos, 1)
+}
+
+// Get returns the statistics of class c.
+func Get(c Class) Stats {
+	var stats Stats
+	if sampleRate == 0 {
+		return stats
+	}
+	st := classes[c]
+
+	st.lock.Lock()
+	stats.Sampled = st.sampled
+	stats.Followed = st.followed
+	stats.Cold = st.cold
+	stats.Reuse = st.reuse
+	stats.Top = make([]Hitter, len(st.top))
+	for i, hitter := range st.top {
+		stats.Top[i] = Hitter{hitter.ID, hitter.Reads * sampleRate}
+	}
+	st.lock.Unlock()
+
+	sort.Slice(stats.Top, func(i, j int) bool {
+		if stats.Top[i].Reads != stats.Top[j].Reads {
+			return stats.Top[i].Reads > stats.Top[j].Reads
+		}
+		return stats.Top[i].ID < stats.Top[j].ID
+	})
+	return stats
+}
@@ -0,0 +1,76 @@
+package accessstats
+
+import (
+	"fmt"
+	"testing"
+)
+
+func TestTop(t *testing.T) {
+	Init(1)
+	for i := 0; i < 10; i++ {
+		Record(Block, "a")
+	}
+	for i := 0; i < 5; i++ {
+		Record(Block, "b")
+	}
+	for i := 0; i < 2*TopK; i++ {
+		Record(Block, fmt.Sprintf("c%d", i))
+	}
+
+	stats := Get(Block)
+	if stats.Sampled != 15+2*TopK {
+		t.Errorf("sampled %d reads, expected %d", stats.Sampled, 15+2*TopK)
+	}
+	if len(stats.Top) != TopK {
+		t.Fatalf("got %d top objects, expected %d", len(stats.Top), TopK)
+	}
+	if stats.Top[0] != (Hitter{"a", 10}) || stats.Top[1] != (Hitter{"b", 5}) {
+		t.Errorf("unexpected top objects %v", stats.Top[:2])
+	}
+	if other := Get(Dir); other.Sampled != 0 {
+		t.Errorf("reads counted in another class")
+	}
+}
+
+func TestReuseDistance(t *testing.T) {
+	Init(1)
+	for _, id := range []string{"a", "b", "c", "b", "a", "a"} {
+		Record(Dir, id)
+	}
+
+	stats := Get(Dir)
+	if stats.Followed != 6 || stats.Cold != 3 {
+		t.Errorf("followed %d reads with %d cold, expected 6 and 3",
+			stats.Followed, stats.Cold)
+	}
+	// b after c: 1, a after b c: 2, a right after a: 0.
+	expected := map[int]uint64{0: 1, 1: 1, 2: 1}
+	for i, n := range stats.Reuse {
+		if n != expected[i] {
+			t.Errorf("bucket %d has %d reads, expected %d", i, n, expected[i])
+		}
+	}
+}
+
+func TestDisabled(t *testing.T) {
+	sampleRate = 0
+	Record(Repo, "a")
+	if stats := Get(Repo); stats.Sampled != 0 || stats.Top != nil {
+		t.Errorf("reads counted while disabled")
+	}
+}
+
+func BenchmarkRecord(b *testing.B) {
+	Init(64)
+	ids := make([]string, 4096)
+	for i := range ids {
+		ids[i] = fmt.Sprintf("%040d", i)
+	}
+	b.RunParallel(func(pb *testing.PB) {
+		i := 0
+		for pb.Next() {
+			Record(Block, ids[i%len(ids)])
+			i++
+		}
+	})
+}
@@ -0,0 +1,66 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+)
+
+// Operations applied by seaf-server in a single commit. See
+// seaf_repo_manager_apply_batch_ops for their semantics.
+
+const maxBatchOps = 10000
+
+// BatchOp is one operation of a batch.
+type BatchOp struct {
+	Op      string `json:"op"`
+	Path    string `json:"path"`
+	NewName string `json:"new_name,omitempty"`
+	DstDir  string `json:"dst_dir,omitempty"`
+}
+
+func validateBatchOps(ops []BatchOp) error {
+	if len(ops) == 0 || len(ops) > maxBatchOps {
+		return fmt.Errorf("a batch must have 1 to %d operations", maxBatchOps)
+	}
+	for i, op := range ops {
+		if op.Path == "" {
+			return fmt.Errorf("operation %d has no path", i)
+		}
+		switch op.Op {
+		case "mkdir", "create", "delete":
+		case "rename":
+			if op.NewName == "" {
+				return fmt.Errorf("operation %d has no new_name", i)
+			}
+		case "move", "copy":
+			if op.DstDir == "" {
+				return fmt.Errorf("operation %d has no dst_dir", i)
+			}
+		default:
+			return fmt.Errorf("operation %d has unknown op %q", i, op.Op)
+		}
+	}
+	return nil
+}
+
+// applyBatchOps applies ops to the head of the repo atomically and returns
+// the id of the new head commit.
+func applyBatchOps(repoID string, ops []BatchOp, user string) (string, error) {
+	if err := validateBatchOps(ops); err != nil {
+		return "", err
+	}
+	buf, err := json.Marshal(ops)
+	if err != nil {
+		return "", err
+	}
+
+	ret, err := rpcclient.Call("seafile_apply_batch_ops", repoID, string(buf), user)
+	if err != nil {
+		return "", fmt.Errorf("failed to apply batch to repo %s: %v", repoID, err)
+	}
+	commitID, ok := ret.(string)
+	if !ok {
+		return "", fmt.Errorf("failed to apply batch to repo %s: invalid result", repoID)
+	}
+	return commitID, nil
+}
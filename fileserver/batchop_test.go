@@ -0,0 +1,51 @@
+package main
+
+import (
+	"encoding/json"
+	"testing"
+)
+
+func TestValidateBatchOps(t *testing.T) {
+	cases := []struct {
+		ops []BatchOp
+		ok  bool
+	}{
+		{nil, false},
+		{[]BatchOp{{Op: "mkdir", Path: "/a/b"}}, true},
+		{[]BatchOp{{Op: "create", Path: "/a/b/c.txt"}, {Op: "delete", Path: "/d"}}, true},
+		{[]BatchOp{{Op: "rename", Path: "/a", NewName: "b"}}, true},
+		{[]BatchOp{{Op: "rename", Path: "/a"}}, false},
+		{[]BatchOp{{Op: "move", Path: "/a", DstDir: "/b"}}, true},
+		{[]BatchOp{{Op: "copy", Path: "/a"}}, false},
+		{[]BatchOp{{Op: "delete"}}, false},
+		{[]BatchOp{{Op: "chmod", Path: "/a"}}, false},
+	}
+	for i, c := range cases {
+		err := validateBatchOps(c.ops)
+		if (err == nil) != c.ok {
+			t.Errorf("case %d: got error %v, expected ok %v", i, err, c.ok)
+		}
+	}
+
+	ops := make([]BatchOp, maxBatchOps+1)
+	for i := range ops {
+		ops[i] = BatchOp{Op: "delete", Path: "/a"}
+	}
+	if validateBatchOps(ops) == nil {
+		t.Errorf("a batch of %d operations should be rejected", len(ops))
+	}
+}
+
+func TestBatchOpJSON(t *testing.T) {
+	buf, err := json.Marshal([]BatchOp{
+		{Op: "move", Path: "/a", DstDir: "/b"},
+		{Op: "delete", Path: "/c"},
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	expected := `[{"op":"move","path":"/a","dst_dir":"/b"},{"op":"delete","path":"/c"}]`
+	if string(buf) != expected {
+		t.Errorf("got %s, expected %s", buf, expected)
+	}
+}
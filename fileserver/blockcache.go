@@ -0,0 +1,243 @@
+package main
+
+import (
+	"bytes"
+	"container/list"
+	"crypto/cipher"
+	"fmt"
+	"io"
+	"sync"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+// Decrypted blocks of encrypted libraries, kept for range requests, the same
+// as server/block-cache.c: a client seeking in a large file asks for many
+// ranges in the same blocks, which would otherwise be decrypted again for
+// each of them.
+//
+// Blocks are kept per library store in LRU order within decrypted_block_cache_size MB, and the
+// cache is disabled unless it's set. Since the fileserver isn't told when a
+// password is unset, blocks are also dropped after decryptedBlockTTL.
+// Every request still checks the password before it reads from the cache.
+
+const decryptedBlockTTL = 10 * time.Minute
+
+type decryptedBlock struct {
+	key     string
+	data    []byte
+	expires time.Time
+	// Requests sending the block. It's wiped once it's evicted and
+	// no longer sent.
+	refs    int
+	evicted bool
+}
+
+type decryptedBlockCache struct {
+	maxBytes int64
+	now      func() time.Time
+
+	mu    sync.Mutex
+	bytes int64
+	// Most recently used first.
+	lru    *list.List
+	blocks map[string]*list.Element
+}
+
+var blockCache = newDecryptedBlockCache(0)
+
+func newDecryptedBlockCache(maxBytes int64) *decryptedBlockCache {
+	return &decryptedBlockCache{
+		maxBytes: maxBytes,
+		now:      time.Now,
+		lru:      list.New(),
+		blocks:   make(map[string]*list.Element),
+	}
+}
+
+func blockCacheInit() {
+	blockCache = newDecryptedBlockCache(options.decryptedBlockCacheSize)
+}
+
+// wipe clears plaintext before it's left to the garbage collector.
+func wipe(p []byte) {
+	for i := range p {
+		p[i] = 0
+	}
+}
+
+// Called with the lock held.
+func (c *decryptedBlockCache) remove(e *list.Element) {
+	blk := e.Value.(*decryptedBlock)
+	c.lru.Remove(e)
+	delete(c.blocks, blk.key)
+	c.bytes -= int64(len(blk.data))
+	blk.evicted = true
+	if blk.refs == 0 {
+		wipe(blk.data)
+	}
+}
+
+// get returns the decrypted block, or nil. The block must be released
+// once it's sent, and its data must not be modified.
+func (c *decryptedBlockCache) get(storeID, blkID string) *decryptedBlock {
+	if c.maxBytes <= 0 {
+		return nil
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	e, ok := c.blocks[storeID+"/"+blkID]
+	if !ok {
+		return nil
+	}
+	blk := e.Value.(*decryptedBlock)
+	if !c.now().Before(blk.expires) {
+		c.remove(e)
+		return nil
+	}
+	c.lru.MoveToFront(e)
+	blk.refs++
+	return blk
+}
+
+func (c *decryptedBlockCache) release(blk *decryptedBlock) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	blk.refs--
+	if blk.refs == 0 && blk.evicted {
+		wipe(blk.data)
+	}
+}
+
+// put caches a copy of data.
+func (c *decryptedBlockCache) put(storeID, blkID string, data []byte) {
+	// A block taking much of the cache would evict everything else.
+	if c.maxBytes <= 0 || int64(len(data)) > c.maxBytes/4 {
+		return
+	}
+	key := storeID + "/" + blkID
+
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if _, ok := c.blocks[key]; ok {
+		return
+	}
+	for c.bytes+int64(len(data)) > c.maxBytes && c.lru.Len() > 0 {
+		c.remove(c.lru.Back())
+	}
+	blk := &decryptedBlock{key: key, data: append([]byte(nil), data...), expires: c.now().Add(decryptedBlockTTL)}
+	c.blocks[key] = c.lru.PushFront(blk)
+	c.bytes += int64(len(data))
+}
+
+// removeExpired drops the blocks past their TTL.
+func (c *decryptedBlockCache) removeExpired() {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	now := c.now()
+	for e := c.lru.Back(); e != nil; {
+		prev := e.Prev()
+		if !now.Before(e.Value.(*decryptedBlock).expires) {
+			c.remove(e)
+		}
+		e = prev
+	}
+}
+
+// decryptedLen returns the plaintext length of encrypted data. Only the
+// last cipher block is decrypted, to read the padding.
+func (crypt *seafileCrypt) decryptedLen(p []byte) (int, error) {
+	block, err := crypt.getBlock()
+	if err != nil {
+		return -1, err
+	}
+	size := block.BlockSize()
+	if len(p) == 0 || len(p)%size != 0 {
+		return -1, fmt.Errorf("invalid encrypted data length %d", len(p))
+	}
+
+	last := make([]byte, size)
+	tail := p[len(p)-size:]
+	if crypt.version == 3 {
+		block.Decrypt(last, tail)
+	} else {
+		// In CBC mode, the previous cipher block is the IV of the last.
+		iv := crypt.iv
+		if len(p) > size {
+			iv = p[len(p)-2*size : len(p)-size]
+		}
+		cipher.NewCBCDecrypter(block, iv).CryptBlocks(last, tail)
+	}
+	plain, err := pkcs7UnPadding(last, size)
+	if err != nil {
+		return -1, err
+	}
+	return len(p) - size + len(plain), nil
+}
+
+// getPlainBlockMap returns the block map of an encrypted file, with the
+// decrypted sizes of its blocks.
+func getPlainBlockMap(storeID string, file *fsmgr.Seafile, cryptKey *seafileCrypt) (*blockMap, error) {
+	cacheKey := "plain/" + file.FileID
+	if v, ok := blockMapCacheTable.Load(cacheKey); ok {
+		if blkMap, ok := v.(*blockMap); ok {
+			return blkMap, nil
+		}
+	}
+
+	blkSize := make([]uint64, file.NumBlocks())
+	var buf bytes.Buffer
+	for i := range blkSize {
+		blkID := file.BlockID(i)
+		buf.Reset()
+		if err := blockmgr.Read(storeID, blkID, &buf); err != nil {
+			return nil, fmt.Errorf("failed to read block %s: %v", blkID, err)
+		}
+		size, err := cryptKey.decryptedLen(buf.Bytes())
+		if err != nil {
+			return nil, fmt.Errorf("failed to get decrypted size of block %s: %v", blkID, err)
+		}
+		blkSize[i] = uint64(size)
+	}
+
+	blkMap := newBlockMap(blkSize)
+	if file.FileSize > cacheBlockMapThreshold {
+		blockMapCacheTable.Store(cacheKey, blkMap)
+	}
+	return blkMap, nil
+}
+
+// sendDecryptedBlock writes n bytes of the decrypted block starting from
+// offset to w.
+func sendDecryptedBlock(w io.Writer, storeID, blkID string, cryptKey *seafileCrypt, offset, n uint64) error {
+	if err := chargeBlock(w); err != nil {
+		return err
+	}
+
+	if blk := blockCache.get(storeID, blkID); blk != nil {
+		defer blockCache.release(blk)
+		return writeBlockSlice(w, blk.data, offset, n)
+	}
+
+	data, err := readBlock(storeID, blkID, cryptKey)
+	if err != nil {
+		return err
+	}
+	defer wipe(data)
+	blockCache.put(storeID, blkID, data)
+	return writeBlockSlice(w, data, offset, n)
+}
+
+func writeBlockSlice(w io.Writer, data []byte, offset, n uint64) error {
+	if offset+n > uint64(len(data)) {
+		return fmt.Errorf("range %d+%d is out of a block of %d bytes", offset, n, len(data))
+	}
+	_, err := w.Write(data[offset : offset+n])
+	return err
+}
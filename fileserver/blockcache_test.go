@@ -0,0 +1,120 @@
+package main
+
+import (
+	"bytes"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+const blockCacheTestRepoID = "6e7f8091-2345-5432-bcde-123456789abc"
+
+func TestDecryptedLen(t *testing.T) {
+	for _, version := range []int{2, 3} {
+		crypt := &seafileCrypt{key: bytes.Repeat([]byte{7}, 32), iv: bytes.Repeat([]byte{9}, 16), version: version}
+		for _, n := range []int{0, 1, 15, 16, 17, 100, 4096} {
+			enc, err := crypt.encrypt(bytes.Repeat([]byte{'x'}, n))
+			if err != nil {
+				t.Fatalf("failed to encrypt: %v", err)
+			}
+			size, err := crypt.decryptedLen(enc)
+			if err != nil || size != n {
+				t.Errorf("version %d: decrypted length of %d bytes is %d, %v", version, n, size, err)
+			}
+		}
+	}
+}
+
+func TestDecryptedBlockCache(t *testing.T) {
+	now := time.Now()
+	c := newDecryptedBlockCache(400)
+	c.now = func() time.Time { return now }
+
+	c.put(blockCacheTestRepoID, "a", bytes.Repeat([]byte{'a'}, 100))
+	c.put(blockCacheTestRepoID, "b", bytes.Repeat([]byte{'b'}, 100))
+	c.put(blockCacheTestRepoID, "big", bytes.Repeat([]byte{'c'}, 101))
+	if blk := c.get(blockCacheTestRepoID, "big"); blk != nil {
+		t.Errorf("cached a block larger than a quarter of the cache")
+	}
+
+	// a is used, so b is evicted first.
+	blk := c.get(blockCacheTestRepoID, "a")
+	if blk == nil {
+		t.Fatalf("block a isn't cached")
+	}
+	c.put(blockCacheTestRepoID, "c", bytes.Repeat([]byte{'c'}, 100))
+	c.put(blockCacheTestRepoID, "d", bytes.Repeat([]byte{'d'}, 100))
+	c.put(blockCacheTestRepoID, "e", bytes.Repeat([]byte{'e'}, 100))
+	if c.get(blockCacheTestRepoID, "b") != nil {
+		t.Errorf("block b wasn't evicted")
+	}
+
+	// Evicted blocks are wiped once they're released.
+	now = now.Add(decryptedBlockTTL)
+	c.removeExpired()
+	if c.lru.Len() != 0 || c.bytes != 0 {
+		t.Errorf("%d blocks of %d bytes are left after they expired", c.lru.Len(), c.bytes)
+	}
+	if blk.data[0] != 'a' {
+		t.Errorf("block was wiped while it's used")
+	}
+	c.release(blk)
+	if !bytes.Equal(blk.data, make([]byte, 100)) {
+		t.Errorf("block wasn't wiped")
+	}
+}
+
+func TestSendEncryptedFileRange(t *testing.T) {
+	dir, err := ioutil.TempDir("", "blockcache")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	blockCache = newDecryptedBlockCache(1 << 20)
+	defer func() { blockCache = newDecryptedBlockCache(0) }()
+
+	crypt := &seafileCrypt{key: bytes.Repeat([]byte{1}, 32), iv: bytes.Repeat([]byte{2}, 16), version: 2}
+	var blkIDs []string
+	var content string
+	for i := 0; i < 3; i++ {
+		blkID := strings.Repeat(string(rune('a'+i)), 40)
+		data := strings.Repeat(string(rune('0'+i)), 20+i)
+		enc, err := crypt.encrypt([]byte(data))
+		if err != nil {
+			t.Fatalf("failed to encrypt: %v", err)
+		}
+		if err := blockmgr.Write(blockCacheTestRepoID, blkID, bytes.NewReader(enc)); err != nil {
+			t.Fatalf("failed to write block: %v", err)
+		}
+		blkIDs = append(blkIDs, blkID)
+		content += data
+	}
+	file := &fsmgr.Seafile{FileID: strings.Repeat("f", 40), FileSize: uint64(len(content)), BlkIDs: blkIDs}
+
+	blkMap, err := getPlainBlockMap(blockCacheTestRepoID, file, crypt)
+	if err != nil {
+		t.Fatalf("failed to get block map: %v", err)
+	}
+
+	// Twice, the second time from the cache.
+	for i := 0; i < 2; i++ {
+		var buf bytes.Buffer
+		if err := sendFileRange(&buf, blockCacheTestRepoID, file, blkMap, crypt, 15, 50); err != nil {
+			t.Fatalf("failed to send range: %v", err)
+		}
+		if buf.String() != content[15:51] {
+			t.Errorf("sent %q instead of %q", buf.String(), content[15:51])
+		}
+	}
+	if blockCache.lru.Len() != 3 {
+		t.Errorf("%d blocks are cached instead of 3", blockCache.lru.Len())
+	}
+}
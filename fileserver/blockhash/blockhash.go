@@ -0,0 +1,43 @@
+// Package blockhash computes the SHA-1 ids of blocks.
+// On amd64 CPUs with the SHA extensions it uses them directly, since
+// crypto/sha1 doesn't. The ids are the same either way.
+package blockhash
+
+import (
+	"crypto/sha1"
+	"encoding/binary"
+)
+
+// Size is the size of a block id in bytes.
+const Size = sha1.Size
+
+// Sum returns the SHA-1 checksum of data.
+func Sum(data []byte) [Size]byte {
+	if useSHANI {
+		return sumSHANI(data)
+	}
+	return sha1.Sum(data)
+}
+
+func sumSHANI(data []byte) [Size]byte {
+	h := [5]uint32{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0}
+	n := len(data) &^ 63
+	blockSHANI(&h, data[:n])
+
+	// The last block(s) with the padding and the length in bits.
+	var tail [128]byte
+	rest := copy(tail[:], data[n:])
+	tail[rest] = 0x80
+	end := 64
+	if rest >= 56 {
+		end = 128
+	}
+	binary.BigEndian.PutUint64(tail[end-8:end], uint64(len(data))<<3)
+	blockSHANI(&h, tail[:end])
+
+	var sum [Size]byte
+	for i, v := range h {
+		binary.BigEndian.PutUint32(sum[4*i:], v)
+	}
+	return sum
+}
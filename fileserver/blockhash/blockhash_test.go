@@ -0,0 +1,43 @@
+package blockhash
+
+import (
+	"crypto/sha1"
+	"math/rand"
+	"testing"
+)
+
+func TestSum(t *testing.T) {
+	if !useSHANI {
+		t.Skip("SHA extensions are not available")
+	}
+	data := make([]byte, 1<<20+77)
+	rand.New(rand.NewSource(1)).Read(data)
+
+	lens := []int{len(data), 1 << 20}
+	for n := 0; n <= 300; n++ {
+		lens = append(lens, n)
+	}
+	for _, n := range lens {
+		if got, want := sumSHANI(data[:n]), sha1.Sum(data[:n]); got != want {
+			t.Errorf("Wrong checksum of %d bytes: got %x, want %x", n, got, want)
+		}
+	}
+}
+
+func benchmarkSum(b *testing.B, sum func([]byte) [Size]byte) {
+	data := make([]byte, 8<<20)
+	rand.New(rand.NewSource(1)).Read(data)
+	b.SetBytes(int64(len(data)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		sum(data)
+	}
+}
+
+func BenchmarkSum(b *testing.B) {
+	benchmarkSum(b, Sum)
+}
+
+func BenchmarkSHA1(b *testing.B) {
+	benchmarkSum(b, sha1.Sum)
+}
@@ -0,0 +1,8 @@
+package blockhash
+
+//go:noescape
+func blockSHANI(h *[5]uint32, p []byte)
+
+func hasSHANI() bool
+
+var useSHANI = hasSHANI()
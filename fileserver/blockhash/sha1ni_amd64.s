@@ -0,0 +1,228 @@
+#include "textflag.h"
+
+// SHA-1 block function using the Intel SHA extensions.
+// ABCD is kept in X0, E in X1/X2, the message words in X3-X6.
+
+// func blockSHANI(h *[5]uint32, p []byte)
+TEXT ·blockSHANI(SB), NOSPLIT, $0-32
+	MOVQ h+0(FP), DI
+	MOVQ p_base+8(FP), SI
+	MOVQ p_len+16(FP), DX
+	ANDQ $~63, DX
+	JZ   done
+	ADDQ SI, DX
+
+	MOVOU (DI), X0
+	PXOR X1, X1
+	PINSRD $3, 16(DI), X1
+	PSHUFD $0x1B, X0, X0
+	MOVOU flipMask<>(SB), X7
+
+loop:
+	// Save the state of this block.
+	MOVO X0, X8
+	MOVO X1, X9
+
+	// Rounds 0-3
+	MOVOU 0(SI), X3
+	PSHUFB X7, X3
+	PADDL X3, X1
+	MOVO X0, X2
+	SHA1RNDS4 $0, X1, X0
+
+	// Rounds 4-7
+	MOVOU 16(SI), X4
+	PSHUFB X7, X4
+	SHA1NEXTE X4, X2
+	MOVO X0, X1
+	SHA1RNDS4 $0, X2, X0
+	SHA1MSG1 X4, X3
+
+	// Rounds 8-11
+	MOVOU 32(SI), X5
+	PSHUFB X7, X5
+	SHA1NEXTE X5, X1
+	MOVO X0, X2
+	SHA1RNDS4 $0, X1, X0
+	SHA1MSG1 X5, X4
+	PXOR X5, X3
+
+	// Rounds 12-15
+	MOVOU 48(SI), X6
+	PSHUFB X7, X6
+	SHA1NEXTE X6, X2
+	MOVO X0, X1
+	SHA1MSG2 X6, X3
+	SHA1RNDS4 $0, X2, X0
+	SHA1MSG1 X6, X5
+	PXOR X6, X4
+
+	// Rounds 16-19
+	SHA1NEXTE X3, X1
+	MOVO X0, X2
+	SHA1MSG2 X3, X4
+	SHA1RNDS4 $0, X1, X0
+	SHA1MSG1 X3, X6
+	PXOR X3, X5
+
+	// Rounds 20-23
+	SHA1NEXTE X4, X2
+	MOVO X0, X1
+	SHA1MSG2 X4, X5
+	SHA1RNDS4 $1, X2, X0
+	SHA1MSG1 X4, X3
+	PXOR X4, X6
+
+	// Rounds 24-27
+	SHA1NEXTE X5, X1
+	MOVO X0, X2
+	SHA1MSG2 X5, X6
+	SHA1RNDS4 $1, X1, X0
+	SHA1MSG1 X5, X4
+	PXOR X5, X3
+
+	// Rounds 28-31
+	SHA1NEXTE X6, X2
+	MOVO X0, X1
+	SHA1MSG2 X6, X3
+	SHA1RNDS4 $1, X2, X0
+	SHA1MSG1 X6, X5
+	PXOR X6, X4
+
+	// Rounds 32-35
+	SHA1NEXTE X3, X1
+	MOVO X0, X2
+	SHA1MSG2 X3, X4
+	SHA1RNDS4 $1, X1, X0
+	SHA1MSG1 X3, X6
+	PXOR X3, X5
+
+	// Rounds 36-39
+	SHA1NEXTE X4, X2
+	MOVO X0, X1
+	SHA1MSG2 X4, X5
+	SHA1RNDS4 $1, X2, X0
+	SHA1MSG1 X4, X3
+	PXOR X4, X6
+
+	// Rounds 40-43
+	SHA1NEXTE X5, X1
+	MOVO X0, X2
+	SHA1MSG2 X5, X6
+	SHA1RNDS4 $2, X1, X0
+	SHA1MSG1 X5, X4
+	PXOR X5, X3
+
+	// Rounds 44-47
+	SHA1NEXTE X6, X2
+	MOVO X0, X1
+	SHA1MSG2 X6, X3
+	SHA1RNDS4 $2, X2, X0
+	SHA1MSG1 X6, X5
+	PXOR X6, X4
+
+	// Rounds 48-51
+	SHA1NEXTE X3, X1
+	MOVO X0, X2
+	SHA1MSG2 X3, X4
+	SHA1RNDS4 $2, X1, X0
+	SHA1MSG1 X3, X6
+	PXOR X3, X5
+
+	// Rounds 52-55
+	SHA1NEXTE X4, X2
+	MOVO X0, X1
+	SHA1MSG2 X4, X5
+	SHA1RNDS4 $2, X2, X0
+	SHA1MSG1 X4, X3
+	PXOR X4, X6
+
+	// Rounds 56-59
+	SHA1NEXTE X5, X1
+	MOVO X0, X2
+	SHA1MSG2 X5, X6
+	SHA1RNDS4 $2, X1, X0
+	SHA1MSG1 X5, X4
+	PXOR X5, X3
+
+	// Rounds 60-63
+	SHA1NEXTE X6, X2
+	MOVO X0, X1
+	SHA1MSG2 X6, X3
+	SHA1RNDS4 $3, X2, X0
+	SHA1MSG1 X6, X5
+	PXOR X6, X4
+
+	// Rounds 64-67
+	SHA1NEXTE X3, X1
+	MOVO X0, X2
+	SHA1MSG2 X3, X4
+	SHA1RNDS4 $3, X1, X0
+	SHA1MSG1 X3, X6
+	PXOR X3, X5
+
+	// Rounds 68-71
+	SHA1NEXTE X4, X2
+	MOVO X0, X1
+	SHA1MSG2 X4, X5
+	SHA1RNDS4 $3, X2, X0
+	PXOR X4, X6
+
+	// Rounds 72-75
+	SHA1NEXTE X5, X1
+	MOVO X0, X2
+	SHA1MSG2 X5, X6
+	SHA1RNDS4 $3, X1, X0
+
+	// Rounds 76-79
+	SHA1NEXTE X6, X2
+	MOVO X0, X1
+	SHA1RNDS4 $3, X2, X0
+	// Add the saved state.
+	SHA1NEXTE X9, X1
+	PADDL X8, X0
+
+	ADDQ $64, SI
+	CMPQ SI, DX
+	JNE  loop
+
+	PSHUFD $0x1B, X0, X0
+	MOVOU X0, (DI)
+	PEXTRD $3, X1, 16(DI)
+
+done:
+	RET
+
+// func hasSHANI() bool
+TEXT ·hasSHANI(SB), NOSPLIT, $0-1
+	MOVB $0, ret+0(FP)
+
+	// Max leaf must be at least 7.
+	XORL AX, AX
+	CPUID
+	CMPL AX, $7
+	JB   nosha
+
+	// SSSE3 for PSHUFB, SSE4.1 for PINSRD/PEXTRD.
+	MOVL $1, AX
+	XORL CX, CX
+	CPUID
+	MOVL CX, R8
+	ANDL $(1<<9 | 1<<19), R8
+	CMPL R8, $(1<<9 | 1<<19)
+	JNE  nosha
+
+	MOVL $7, AX
+	XORL CX, CX
+	CPUID
+	BTL  $29, BX
+	JCC  nosha
+	MOVB $1, ret+0(FP)
+
+nosha:
+	RET
+
+// Reverses the bytes of a 16 byte word.
+DATA flipMask<>+0(SB)/8, $0x08090a0b0c0d0e0f
+DATA flipMask<>+8(SB)/8, $0x0001020304050607
+GLOBL flipMask<>(SB), RODATA, $16
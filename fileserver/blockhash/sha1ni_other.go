@@ -0,0 +1,10 @@
+//go:build !amd64
+// +build !amd64
+
+package blockhash
+
+func blockSHANI(h *[5]uint32, p []byte) {
+	panic("blockhash: SHA extensions are not supported")
+}
+
+var useSHANI = false
@@ -2,6 +2,7 @@
 package blockmgr
 
 import (
+	"github.com/haiwen/seafile-server/fileserver/accessstats"
 	"github.com/haiwen/seafile-server/fileserver/objstore"
 	"io"
 )
@@ -15,6 +16,8 @@ func Init(seafileConfPath string, seafileDataDir string) {
 
 // Read reads block from storage backend.
 func Read(repoID string, blockID string, w io.Writer) error {
+	accessstats.Record(accessstats.Block, blockID)
+	accessstats.Record(accessstats.Repo, repoID)
 	err := store.Read(repoID, blockID, w)
 	if err != nil {
 		return err
@@ -23,6 +26,15 @@ func Read(repoID string, blockID string, w io.Writer) error {
 	return nil
 }
 
+// Open opens a block for reading. The caller must close it.
+// Blocks in the local file system are returned as *os.File,
+// so that io.Copy to a network connection can use sendfile.
+func Open(repoID string, blockID string) (objstore.ReadSeekCloser, error) {
+	accessstats.Record(accessstats.Block, blockID)
+	accessstats.Record(accessstats.Repo, repoID)
+	return store.Open(repoID, blockID)
+}
+
 // Write writes block to storage backend.
 func Write(repoID string, blockID string, r io.Reader) error {
 	err := store.Write(repoID, blockID, r, false)
@@ -39,6 +51,18 @@ func Exists(repoID string, blockID string) bool {
 	return ret
 }
 
+// ExistsMany checks the existence of many blocks at once.
+func ExistsMany(repoID string, blockIDs []string) ([]bool, error) {
+	return store.ExistsMany(repoID, blockIDs)
+}
+
+// Touch marks an existing block as just written. Blocks that are reused
+// instead of being written again are touched, so that an online GC keeps
+// them as recent ones. It fails if the block doesn't exist.
+func Touch(repoID string, blockID string) error {
+	return store.Touch(repoID, blockID)
+}
+
 // Stat calculates block size.
 func Stat(repoID string, blockID string) (int64, error) {
 	ret, err := store.Stat(repoID, blockID)
@@ -3,6 +3,7 @@ package blockmgr
 import (
 	"bytes"
 	"fmt"
+	"io"
 	"os"
 	"path"
 	"testing"
@@ -95,9 +96,62 @@ func testBlockExists(t *testing.T) {
 
 }
 
+func testBlockOpen(t *testing.T) {
+	blk, err := Open(repoID, blockID)
+	if err != nil {
+		t.Fatalf("Failed to open block: %v.\n", err)
+	}
+	defer blk.Close()
+
+	if _, ok := blk.(*os.File); !ok {
+		t.Errorf("Block in fs backend is not opened as a file.\n")
+	}
+
+	blk.Seek(13, io.SeekStart)
+	var buf bytes.Buffer
+	n, err := io.Copy(&buf, blk)
+	if err != nil || n != 117 {
+		t.Errorf("Failed to read block from offset, got %d bytes: %v.\n", n, err)
+	}
+}
+
 func TestBlock(t *testing.T) {
 	Init(seafileConfPath, seafileDataDir)
 	testBlockWrite(t)
 	testBlockRead(t)
 	testBlockExists(t)
+	testBlockOpen(t)
+}
+
+func BenchmarkBlockWrite(b *testing.B) {
+	Init(seafileConfPath, seafileDataDir)
+	data := make([]byte, 1<<20)
+	b.SetBytes(int64(len(data)))
+	for i := 0; i < b.N; i++ {
+		id := fmt.Sprintf("%040x", i%64+1)
+		if err := Write(repoID, id, bytes.NewReader(data)); err != nil {
+			b.Fatalf("Failed to write block %s: %v", id, err)
+		}
+	}
+}
+
+func BenchmarkBlockRead(b *testing.B) {
+	Init(seafileConfPath, seafileDataDir)
+	data := make([]byte, 1<<20)
+	for i := 0; i < 64; i++ {
+		id := fmt.Sprintf("%040x", i+1)
+		if err := Write(repoID, id, bytes.NewReader(data)); err != nil {
+			b.Fatalf("Failed to write block %s: %v", id, err)
+		}
+	}
+	var buf bytes.Buffer
+	b.SetBytes(int64(len(data)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		id := fmt.Sprintf("%040x", i%64+1)
+		buf.Reset()
+		if err := Read(repoID, id, &buf); err != nil {
+			b.Fatalf("Failed to read block %s: %v", id, err)
+		}
+	}
 }
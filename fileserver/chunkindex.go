@@ -0,0 +1,157 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"io/ioutil"
+	"mime/multipart"
+	"os"
+	"strconv"
+	"strings"
+
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	log "github.com/sirupsen/logrus"
+)
+
+// Chunks of resumable uploads that start and end on block boundaries are
+// cut into blocks when they arrive, and their block ids are appended to a
+// file beside the tmp file, one chunk per line:
+// "<start> <end> <block id> <block id> ...". The C fileserver writes the
+// same records. When every chunk of a file was indexed, the last chunk only
+// has to write the seafile object.
+const chunkBlocksSuffix = ".blocks"
+
+// chunkAligned reports whether the chunk covers whole blocks, the last
+// chunk of a file may end with a partial block.
+func chunkAligned(rstart, rend, fsize, blockSize int64) bool {
+	if rstart < 0 || fsize <= 0 || blockSize <= 0 {
+		return false
+	}
+	if rstart%blockSize != 0 {
+		return false
+	}
+	return rend == fsize-1 || (rend+1)%blockSize == 0
+}
+
+func indexChunk(ctx context.Context, repoID string, fsm *recvData, handler *multipart.FileHeader, tmpFile string) error {
+	if handler.Size != fsm.rend-fsm.rstart+1 {
+		return fmt.Errorf("chunk size %d doesn't match range %d-%d", handler.Size, fsm.rstart, fsm.rend)
+	}
+
+	repo := repomgr.Get(repoID)
+	if repo == nil {
+		return fmt.Errorf("failed to get repo %s", repoID)
+	}
+
+	var cryptKey *seafileCrypt
+	if repo.IsEncrypted {
+		key, appErr := parseCryptKey(nil, repoID, fsm.user, repo.EncVersion)
+		if appErr != nil {
+			return fmt.Errorf("failed to get decrypt key of repo %s", repoID)
+		}
+		cryptKey = key
+	}
+
+	blkIDs, err := chunker.chunkBlocks(ctx, chunkingData{repo.StoreID, "", handler, 0, cryptKey}, handler.Size)
+	if err != nil {
+		return err
+	}
+
+	return recordChunkBlocks(tmpFile, fsm.rstart, fsm.rend, blkIDs)
+}
+
+func recordChunkBlocks(tmpFile string, rstart, rend int64, blkIDs []string) error {
+	line := fmt.Sprintf("%d %d %s\n", rstart, rend, strings.Join(blkIDs, " "))
+
+	f, err := os.OpenFile(tmpFile+chunkBlocksSuffix, os.O_WRONLY|os.O_APPEND|os.O_CREATE, os.FileMode(options.clusterSharedTempFileMode))
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+
+	_, err = f.WriteString(line)
+	return err
+}
+
+// parseChunkRecord returns the start and end of a valid record. Chunks sent
+// by several nodes may be recorded at the same time, broken records are
+// skipped.
+func parseChunkRecord(fields []string, fsize, blockSize int64) (int64, int64, bool) {
+	if len(fields) < 3 {
+		return 0, 0, false
+	}
+	start, err := strconv.ParseInt(fields[0], 10, 64)
+	if err != nil || start < 0 {
+		return 0, 0, false
+	}
+	end, err := strconv.ParseInt(fields[1], 10, 64)
+	if err != nil || end < start || end >= fsize {
+		return 0, 0, false
+	}
+	if !chunkAligned(start, end, fsize, blockSize) {
+		return 0, 0, false
+	}
+	if int64(len(fields)-2) != (end-start+blockSize)/blockSize {
+		return 0, 0, false
+	}
+	for _, id := range fields[2:] {
+		if !isObjectIDValid(id) {
+			return 0, 0, false
+		}
+	}
+	return start, end, true
+}
+
+// loadChunkBlockIDs returns the block ids of a resumable upload, or nil
+// unless all of its chunks were indexed.
+func loadChunkBlockIDs(tmpFile string, fsize, blockSize int64) []string {
+	data, err := ioutil.ReadFile(tmpFile + chunkBlocksSuffix)
+	if err != nil {
+		return nil
+	}
+
+	type chunk struct {
+		end    int64
+		blkIDs []string
+	}
+	// A chunk sent again replaces the earlier record.
+	chunks := make(map[int64]chunk)
+	for _, line := range strings.Split(string(data), "\n") {
+		fields := strings.Split(line, " ")
+		start, end, ok := parseChunkRecord(fields, fsize, blockSize)
+		if !ok {
+			continue
+		}
+		chunks[start] = chunk{end, fields[2:]}
+	}
+
+	var blkIDs []string
+	for pos := int64(0); pos < fsize; {
+		c, ok := chunks[pos]
+		if !ok {
+			return nil
+		}
+		blkIDs = append(blkIDs, c.blkIDs...)
+		pos = c.end + 1
+	}
+	return blkIDs
+}
+
+// postIndexedChunks writes the seafile object of a resumable upload whose
+// chunks were all indexed. The blocks aren't referenced by any commit yet,
+// gc may have removed some of them during a long upload.
+func postIndexedChunks(repo *repomgr.Repo, tmpFile string, fsize int64) (string, bool) {
+	if !options.indexResumableChunks {
+		return "", false
+	}
+	blkIDs := loadChunkBlockIDs(tmpFile, fsize, chunker.blockSize)
+	if blkIDs == nil {
+		return "", false
+	}
+	fileID, appErr := indexExistedFileBlocks(repo.StoreID, repo.Version, blkIDs, fsize)
+	if appErr != nil {
+		log.Printf("blocks of %s are missing, indexing the file", tmpFile)
+		return "", false
+	}
+	return fileID, true
+}
@@ -0,0 +1,70 @@
+package main
+
+import (
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"reflect"
+	"strings"
+	"testing"
+)
+
+func TestChunkAligned(t *testing.T) {
+	tests := []struct {
+		rstart, rend, fsize int64
+		aligned             bool
+	}{
+		{0, 7, 20, true},
+		{8, 15, 20, true},
+		{16, 19, 20, true},
+		{0, 19, 20, true},
+		{0, 9, 20, false},
+		{4, 11, 20, false},
+		{-1, 7, 20, false},
+	}
+	for _, test := range tests {
+		if got := chunkAligned(test.rstart, test.rend, test.fsize, 8); got != test.aligned {
+			t.Errorf("chunkAligned(%d, %d, %d) = %v", test.rstart, test.rend, test.fsize, got)
+		}
+	}
+}
+
+func TestLoadChunkBlockIDs(t *testing.T) {
+	dir, err := ioutil.TempDir("", "chunkindex")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+
+	options.clusterSharedTempFileMode = 0600
+	tmpFile := filepath.Join(dir, "upload")
+	id := func(c string) string { return strings.Repeat(c, 40) }
+
+	// Chunks of 16 bytes of a 40 byte file, with blocks of 8 bytes.
+	recordChunkBlocks(tmpFile, 16, 31, []string{id("c"), id("d")})
+	if ids := loadChunkBlockIDs(tmpFile, 40, 8); ids != nil {
+		t.Errorf("incomplete upload returned %v", ids)
+	}
+
+	recordChunkBlocks(tmpFile, 0, 15, []string{id("a"), id("b")})
+	// A broken record, as left by concurrent writers.
+	f, _ := os.OpenFile(tmpFile+chunkBlocksSuffix, os.O_WRONLY|os.O_APPEND, 0600)
+	f.WriteString("32 39 " + id("x")[:20] + "\n")
+	f.Close()
+	if ids := loadChunkBlockIDs(tmpFile, 40, 8); ids != nil {
+		t.Errorf("upload with a broken record returned %v", ids)
+	}
+
+	recordChunkBlocks(tmpFile, 32, 39, []string{id("e")})
+	// A chunk sent again replaces the earlier record.
+	recordChunkBlocks(tmpFile, 16, 31, []string{id("f"), id("d")})
+	want := []string{id("a"), id("b"), id("f"), id("d"), id("e")}
+	if ids := loadChunkBlockIDs(tmpFile, 40, 8); !reflect.DeepEqual(ids, want) {
+		t.Errorf("block ids are %v, want %v", ids, want)
+	}
+
+	// Records of a different block size don't cover the file.
+	if ids := loadChunkBlockIDs(tmpFile, 40, 16); ids != nil {
+		t.Errorf("block size 16 returned %v", ids)
+	}
+}
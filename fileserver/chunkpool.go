@@ -0,0 +1,243 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"io"
+	"mime/multipart"
+	"os"
+	"runtime"
+	"runtime/debug"
+	"sync"
+	"sync/atomic"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// Uploaded files are cut into fixed size blocks by a pool of workers shared
+// by all uploads, so the number of goroutines doing it is bounded by
+// max_indexing_threads. Block buffers are reused across uploads.
+
+type chunkingData struct {
+	repoID   string
+	filePath string
+	handler  *multipart.FileHeader
+	offset   int64
+	cryptKey *seafileCrypt
+}
+
+type chunkingResult struct {
+	idx   int64
+	blkID string
+	err   error
+}
+
+type chunkingJob struct {
+	chunkingData
+	ctx     context.Context
+	results chan<- chunkingResult
+}
+
+type chunkerPool struct {
+	jobs      chan *chunkingJob
+	workers   int
+	blockSize int64
+	buffers   sync.Pool
+
+	// Accessed atomically.
+	busyWorkers      int64
+	buffersAllocated int64
+	buffersInUse     int64
+	chunks           int64
+	chunkedBytes     int64
+	dedupChunks      int64
+	dedupBytes       int64
+}
+
+// ChunkerStats contains counters of the chunker pool.
+type ChunkerStats struct {
+	Workers          int   `json:"workers"`
+	BusyWorkers      int64 `json:"busy_workers"`
+	QueuedJobs       int   `json:"queued_jobs"`
+	BuffersAllocated int64 `json:"buffers_allocated"`
+	BuffersInUse     int64 `json:"buffers_in_use"`
+	Chunks           int64 `json:"chunks"`
+	// Chunks that were already stored and not written again.
+	DedupChunks int64   `json:"dedup_chunks"`
+	DedupBytes  int64   `json:"dedup_bytes"`
+	DedupRatio  float64 `json:"dedup_ratio"`
+	Goroutines  int     `json:"goroutines"`
+}
+
+var chunker *chunkerPool
+
+func newChunkerPool(workers int, blockSize int64) *chunkerPool {
+	if workers < 1 {
+		workers = 1
+	}
+	p := &chunkerPool{
+		jobs:      make(chan *chunkingJob, workers),
+		workers:   workers,
+		blockSize: blockSize,
+	}
+	p.buffers.New = func() interface{} {
+		atomic.AddInt64(&p.buffersAllocated, 1)
+		buf := make([]byte, blockSize)
+		return &buf
+	}
+	for i := 0; i < workers; i++ {
+		go p.worker()
+	}
+	return p
+}
+
+func (p *chunkerPool) worker() {
+	for job := range p.jobs {
+		p.runJob(job)
+	}
+}
+
+func (p *chunkerPool) runJob(job *chunkingJob) {
+	idx := job.offset / p.blockSize
+	atomic.AddInt64(&p.busyWorkers, 1)
+	defer atomic.AddInt64(&p.busyWorkers, -1)
+	defer func() {
+		if err := recover(); err != nil {
+			log.Printf("panic: %v\n%s", err, debug.Stack())
+			job.results <- chunkingResult{idx, "", fmt.Errorf("panic when chunking file: %v", err)}
+		}
+	}()
+
+	// Don't bother with the rest of a failed or canceled upload.
+	if err := job.ctx.Err(); err != nil {
+		job.results <- chunkingResult{idx, "", err}
+		return
+	}
+
+	blkID, err := p.chunkFile(&job.chunkingData)
+	atomic.AddInt64(&p.chunks, 1)
+	job.results <- chunkingResult{idx, blkID, err}
+}
+
+func (p *chunkerPool) chunkFile(job *chunkingData) (string, error) {
+	var file multipart.File
+	if job.handler != nil {
+		f, err := job.handler.Open()
+		if err != nil {
+			err := fmt.Errorf("failed to open file for read: %v", err)
+			return "", err
+		}
+		defer f.Close()
+		file = f
+	} else {
+		f, err := os.Open(job.filePath)
+		if err != nil {
+			err := fmt.Errorf("failed to open file for read: %v", err)
+			return "", err
+		}
+		defer f.Close()
+		file = f
+	}
+	_, err := file.Seek(job.offset, io.SeekStart)
+	if err != nil {
+		err := fmt.Errorf("failed to seek file: %v", err)
+		return "", err
+	}
+
+	bufp := p.buffers.Get().(*[]byte)
+	atomic.AddInt64(&p.buffersInUse, 1)
+	defer func() {
+		atomic.AddInt64(&p.buffersInUse, -1)
+		p.buffers.Put(bufp)
+	}()
+
+	// The last block of a file is shorter.
+	n, err := io.ReadFull(file, *bufp)
+	if err != nil && err != io.ErrUnexpectedEOF {
+		err := fmt.Errorf("failed to read file: %v", err)
+		return "", err
+	}
+	buf := (*bufp)[:n]
+
+	blkID, existed, err := writeChunk(job.repoID, buf, int64(n), job.cryptKey)
+	if err != nil {
+		err := fmt.Errorf("failed to write chunk: %v", err)
+		return "", err
+	}
+	atomic.AddInt64(&p.chunkedBytes, int64(n))
+	if existed {
+		atomic.AddInt64(&p.dedupChunks, 1)
+		atomic.AddInt64(&p.dedupBytes, int64(n))
+	}
+
+	return blkID, nil
+}
+
+// chunkBlocks cuts a file of size bytes into blocks and returns their ids.
+// It waits for all the blocks it submitted, even after an error, so that no
+// worker is still using the file when it returns.
+func (p *chunkerPool) chunkBlocks(ctx context.Context, data chunkingData, size int64) ([]string, error) {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+
+	nBlocks := (size + p.blockSize - 1) / p.blockSize
+	blkIDs := make([]string, nBlocks)
+	// Workers never wait on a full results channel.
+	results := make(chan chunkingResult, nBlocks)
+
+	var firstErr error
+	handle := func(result chunkingResult) {
+		if result.err != nil {
+			if firstErr == nil {
+				firstErr = result.err
+				cancel()
+			}
+			return
+		}
+		blkIDs[result.idx] = result.blkID
+	}
+
+	submitted, received := 0, 0
+	for offset := int64(0); offset < size && firstErr == nil; offset += p.blockSize {
+		job := &chunkingJob{data, ctx, results}
+		job.offset = offset
+		for sent := false; !sent && firstErr == nil; {
+			select {
+			case p.jobs <- job:
+				submitted++
+				sent = true
+			case result := <-results:
+				received++
+				handle(result)
+			}
+		}
+	}
+	for ; received < submitted; received++ {
+		handle(<-results)
+	}
+
+	if firstErr != nil {
+		return nil, firstErr
+	}
+	return blkIDs, nil
+}
+
+func (p *chunkerPool) stats() ChunkerStats {
+	var ratio float64
+	dedupBytes := atomic.LoadInt64(&p.dedupBytes)
+	if chunked := atomic.LoadInt64(&p.chunkedBytes); chunked > 0 {
+		ratio = float64(dedupBytes) / float64(chunked)
+	}
+	return ChunkerStats{
+		Workers:          p.workers,
+		BusyWorkers:      atomic.LoadInt64(&p.busyWorkers),
+		QueuedJobs:       len(p.jobs),
+		BuffersAllocated: atomic.LoadInt64(&p.buffersAllocated),
+		BuffersInUse:     atomic.LoadInt64(&p.buffersInUse),
+		Chunks:           atomic.LoadInt64(&p.chunks),
+		DedupChunks:      atomic.LoadInt64(&p.dedupChunks),
+		DedupBytes:       dedupBytes,
+		DedupRatio:       ratio,
+		Goroutines:       runtime.NumGoroutine(),
+	}
+}
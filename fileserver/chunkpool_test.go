@@ -0,0 +1,123 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"crypto/sha1"
+	"encoding/hex"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sync"
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+)
+
+const chunkPoolTestRepoID = "9a8b7c6d-1234-4321-abcd-0123456789ab"
+
+func TestChunkerPool(t *testing.T) {
+	dir, err := ioutil.TempDir("", "chunkpool")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	const blockSize = 4096
+	pool := newChunkerPool(2, blockSize)
+
+	// Sizes around block boundaries, including an exact multiple.
+	sizes := []int{1, blockSize - 1, blockSize, 3 * blockSize, 3*blockSize + 17}
+	var wg sync.WaitGroup
+	for i, size := range sizes {
+		content := make([]byte, size)
+		for j := range content {
+			content[j] = byte(i*7 + j*13)
+		}
+		path := filepath.Join(dir, "file"+string(rune('a'+i)))
+		if err := ioutil.WriteFile(path, content, 0644); err != nil {
+			t.Fatalf("failed to write test file: %v", err)
+		}
+
+		// Uploads share the pool concurrently.
+		wg.Add(1)
+		go func(content []byte, path string) {
+			defer wg.Done()
+			data := chunkingData{chunkPoolTestRepoID, path, nil, 0, nil}
+			blkIDs, err := pool.chunkBlocks(context.Background(), data, int64(len(content)))
+			if err != nil {
+				t.Errorf("failed to chunk %s: %v", path, err)
+				return
+			}
+			n := (len(content) + blockSize - 1) / blockSize
+			if len(blkIDs) != n {
+				t.Errorf("%s: got %d blocks, expected %d", path, len(blkIDs), n)
+				return
+			}
+			for k, id := range blkIDs {
+				end := (k + 1) * blockSize
+				if end > len(content) {
+					end = len(content)
+				}
+				sum := sha1.Sum(content[k*blockSize : end])
+				if id != hex.EncodeToString(sum[:]) {
+					t.Errorf("%s: wrong id for block %d", path, k)
+				}
+				var buf bytes.Buffer
+				if err := blockmgr.Read(chunkPoolTestRepoID, id, &buf); err != nil ||
+					!bytes.Equal(buf.Bytes(), content[k*blockSize:end]) {
+					t.Errorf("%s: block %d was not written correctly", path, k)
+				}
+			}
+		}(content, path)
+	}
+	wg.Wait()
+
+	data := chunkingData{chunkPoolTestRepoID, filepath.Join(dir, "missing"), nil, 0, nil}
+	if _, err := pool.chunkBlocks(context.Background(), data, 5*blockSize); err == nil {
+		t.Errorf("chunked a missing file")
+	}
+
+	stats := pool.stats()
+	if stats.BusyWorkers != 0 || stats.BuffersInUse != 0 || stats.QueuedJobs != 0 {
+		t.Errorf("pool is not idle after chunking: %+v", stats)
+	}
+}
+
+func TestChunkerPoolDedup(t *testing.T) {
+	dir, err := ioutil.TempDir("", "chunkpool")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	const blockSize = 4096
+	pool := newChunkerPool(2, blockSize)
+
+	content := make([]byte, 2*blockSize+100)
+	for i := range content {
+		content[i] = byte(i*31 + i/blockSize)
+	}
+	path := filepath.Join(dir, "file")
+	if err := ioutil.WriteFile(path, content, 0644); err != nil {
+		t.Fatalf("failed to write test file: %v", err)
+	}
+
+	// Blocks differ, so only the second upload finds existing blocks.
+	data := chunkingData{chunkPoolTestRepoID, path, nil, 0, nil}
+	for i := 0; i < 2; i++ {
+		if _, err := pool.chunkBlocks(context.Background(), data, int64(len(content))); err != nil {
+			t.Fatalf("failed to chunk %s: %v", path, err)
+		}
+	}
+
+	stats := pool.stats()
+	if stats.DedupChunks != 3 || stats.DedupBytes != int64(len(content)) {
+		t.Errorf("wrong dedup counters: %+v", stats)
+	}
+	if stats.DedupRatio != 0.5 {
+		t.Errorf("dedup ratio is %v, expected 0.5", stats.DedupRatio)
+	}
+}
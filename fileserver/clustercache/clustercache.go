@@ -0,0 +1,342 @@
+// Package clustercache is a client of a cache shared by the nodes of a
+// cluster, a memcached or a Redis server, set up in the [cluster_cache]
+// section of seafile.conf:
+//
+//	[cluster_cache]
+//	backend = redis         (or memcached)
+//	host = 127.0.0.1:6379
+//	ttl = 86400             (seconds entries are kept)
+//	timeout = 100           (ms to wait for the server)
+//
+// It only holds data that doesn't change under a key, and seaf-server uses
+// the same keys:
+//
+//	seaf:<obj_type>:<repo_id>:<obj_id>   commit and fs objects as stored
+//	seaf:storeid:<repo_id>               store id of a (virtual) repo
+//
+// Errors are treated as misses. After the server fails to answer, the
+// cache is bypassed for a few seconds. All methods may be called on a nil
+// *Cache, which misses every lookup.
+package clustercache
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"io"
+	"net"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+	"gopkg.in/ini.v1"
+)
+
+const (
+	defaultTTL     = 24 * time.Hour
+	defaultTimeout = 100 * time.Millisecond
+	maxIdleConns   = 16
+	// Entries larger than this aren't stored, memcached refuses them.
+	maxValueSize = 1 << 20
+	// Memcached takes longer expire times as a unix time.
+	memcachedMaxTTL = 30 * 24 * time.Hour
+	retryInterval   = 5 * time.Second
+)
+
+const (
+	backendRedis = iota
+	backendMemcached
+)
+
+// Cache is a client of a cluster cache server.
+type Cache struct {
+	backend int
+	addr    string
+	ttl     time.Duration
+	timeout time.Duration
+
+	mu        sync.Mutex
+	idle      []*conn
+	downUntil time.Time
+}
+
+type conn struct {
+	net.Conn
+	r *bufio.Reader
+}
+
+// Load returns the cluster cache set up in seafile.conf, or nil if there is
+// none.
+func Load(seafileConfPath string) *Cache {
+	config, err := ini.Load(filepath.Join(seafileConfPath, "seafile.conf"))
+	if err != nil {
+		return nil
+	}
+	section, err := config.GetSection("cluster_cache")
+	if err != nil {
+		return nil
+	}
+	backend := section.Key("backend").String()
+	if backend == "" {
+		return nil
+	}
+	ttl := defaultTTL
+	if n, err := section.Key("ttl").Int(); err == nil && n > 0 {
+		ttl = time.Duration(n) * time.Second
+	}
+	timeout := defaultTimeout
+	if n, err := section.Key("timeout").Int(); err == nil && n > 0 {
+		timeout = time.Duration(n) * time.Millisecond
+	}
+
+	cache, err := New(backend, section.Key("host").String(), ttl, timeout)
+	if err != nil {
+		log.Warnf("failed to set up cluster cache: %v", err)
+		return nil
+	}
+	return cache
+}
+
+// New returns a client of a "redis" or "memcached" server at addr.
+func New(backend, addr string, ttl, timeout time.Duration) (*Cache, error) {
+	cache := &Cache{addr: addr, ttl: ttl, timeout: timeout}
+	switch backend {
+	case "redis":
+		cache.backend = backendRedis
+		if !strings.Contains(addr, ":") {
+			cache.addr = addr + ":6379"
+		}
+	case "memcached":
+		cache.backend = backendMemcached
+		if !strings.Contains(addr, ":") {
+			cache.addr = addr + ":11211"
+		}
+		if cache.ttl > memcachedMaxTTL {
+			cache.ttl = memcachedMaxTTL
+		}
+	default:
+		return nil, fmt.Errorf("unknown backend %s", backend)
+	}
+	if addr == "" {
+		return nil, fmt.Errorf("no host set")
+	}
+	return cache, nil
+}
+
+func (c *Cache) getConn() *conn {
+	c.mu.Lock()
+	if time.Now().Before(c.downUntil) {
+		c.mu.Unlock()
+		return nil
+	}
+	if n := len(c.idle); n > 0 {
+		cn := c.idle[n-1]
+		c.idle = c.idle[:n-1]
+		c.mu.Unlock()
+		return cn
+	}
+	c.mu.Unlock()
+
+	nc, err := net.DialTimeout("tcp", c.addr, c.timeout)
+	if err != nil {
+		log.Warnf("failed to connect to cluster cache %s: %v", c.addr, err)
+		c.mu.Lock()
+		c.downUntil = time.Now().Add(retryInterval)
+		c.mu.Unlock()
+		return nil
+	}
+	return &conn{nc, bufio.NewReader(nc)}
+}
+
+func (c *Cache) putConn(cn *conn, err error) {
+	if err != nil {
+		cn.Close()
+		return
+	}
+	c.mu.Lock()
+	if len(c.idle) < maxIdleConns {
+		c.idle = append(c.idle, cn)
+		cn = nil
+	}
+	c.mu.Unlock()
+	if cn != nil {
+		cn.Close()
+	}
+}
+
+// do sends a request and reads its reply with read.
+func (c *Cache) do(req []byte, read func(*bufio.Reader) error) error {
+	cn := c.getConn()
+	if cn == nil {
+		return fmt.Errorf("cluster cache unavailable")
+	}
+	cn.SetDeadline(time.Now().Add(c.timeout))
+	_, err := cn.Write(req)
+	if err == nil {
+		err = read(cn.r)
+	}
+	c.putConn(cn, err)
+	return err
+}
+
+func appendRedisArg(buf *bytes.Buffer, arg []byte) {
+	fmt.Fprintf(buf, "$%d\r\n", len(arg))
+	buf.Write(arg)
+	buf.WriteString("\r\n")
+}
+
+func redisCommand(args ...[]byte) []byte {
+	var buf bytes.Buffer
+	fmt.Fprintf(&buf, "*%d\r\n", len(args))
+	for _, arg := range args {
+		appendRedisArg(&buf, arg)
+	}
+	return buf.Bytes()
+}
+
+func readLine(r *bufio.Reader) (string, error) {
+	line, err := r.ReadString('\n')
+	if err != nil {
+		return "", err
+	}
+	return strings.TrimRight(line, "\r\n"), nil
+}
+
+// readValue reads n bytes followed by "\r\n".
+func readValue(r *bufio.Reader, n int) ([]byte, error) {
+	if n < 0 || n > maxValueSize {
+		return nil, fmt.Errorf("bad value size %d", n)
+	}
+	value := make([]byte, n+2)
+	if _, err := io.ReadFull(r, value); err != nil {
+		return nil, err
+	}
+	if value[n] != '\r' || value[n+1] != '\n' {
+		return nil, fmt.Errorf("bad value end")
+	}
+	return value[:n], nil
+}
+
+// Get returns the value of a key, and whether it was found.
+func (c *Cache) Get(key string) ([]byte, bool) {
+	if c == nil {
+		return nil, false
+	}
+
+	var req []byte
+	if c.backend == backendRedis {
+		req = redisCommand([]byte("GET"), []byte(key))
+	} else {
+		req = []byte("get " + key + "\r\n")
+	}
+
+	var value []byte
+	found := false
+	err := c.do(req, func(r *bufio.Reader) error {
+		line, err := readLine(r)
+		if err != nil {
+			return err
+		}
+		if c.backend == backendRedis {
+			if !strings.HasPrefix(line, "$") {
+				return fmt.Errorf("unexpected reply %s", line)
+			}
+			n, err := strconv.Atoi(line[1:])
+			if err != nil {
+				return err
+			}
+			if n < 0 {
+				return nil
+			}
+			value, err = readValue(r, n)
+			found = err == nil
+			return err
+		}
+
+		if line == "END" {
+			return nil
+		}
+		// VALUE <key> <flags> <bytes>
+		fields := strings.Fields(line)
+		if len(fields) != 4 || fields[0] != "VALUE" {
+			return fmt.Errorf("unexpected reply %s", line)
+		}
+		n, err := strconv.Atoi(fields[3])
+		if err != nil {
+			return err
+		}
+		if value, err = readValue(r, n); err != nil {
+			return err
+		}
+		if line, err = readLine(r); err != nil || line != "END" {
+			return fmt.Errorf("unexpected reply %s: %v", line, err)
+		}
+		found = true
+		return nil
+	})
+	if err != nil {
+		return nil, false
+	}
+	return value, found
+}
+
+func (c *Cache) doStatus(req []byte) error {
+	return c.do(req, func(r *bufio.Reader) error {
+		line, err := readLine(r)
+		if err != nil {
+			return err
+		}
+		if c.backend == backendRedis {
+			if strings.HasPrefix(line, "+") || strings.HasPrefix(line, ":") {
+				return nil
+			}
+			return fmt.Errorf("unexpected reply %s", line)
+		}
+		switch {
+		case line == "STORED", line == "DELETED", line == "NOT_FOUND":
+			return nil
+		case strings.HasPrefix(line, "SERVER_ERROR"):
+			// E.g. a too large value, the connection is usable.
+			return nil
+		}
+		return fmt.Errorf("unexpected reply %s", line)
+	})
+}
+
+// Set stores a value under a key for the ttl of the cache.
+func (c *Cache) Set(key string, value []byte) {
+	if c == nil || len(value) > maxValueSize {
+		return
+	}
+
+	ttl := strconv.Itoa(int(c.ttl / time.Second))
+	var req []byte
+	if c.backend == backendRedis {
+		req = redisCommand([]byte("SET"), []byte(key), value, []byte("EX"), []byte(ttl))
+	} else {
+		var buf bytes.Buffer
+		fmt.Fprintf(&buf, "set %s 0 %s %d\r\n", key, ttl, len(value))
+		buf.Write(value)
+		buf.WriteString("\r\n")
+		req = buf.Bytes()
+	}
+	c.doStatus(req)
+}
+
+// Delete removes a key.
+func (c *Cache) Delete(key string) {
+	if c == nil {
+		return
+	}
+
+	var req []byte
+	if c.backend == backendRedis {
+		req = redisCommand([]byte("DEL"), []byte(key))
+	} else {
+		req = []byte("delete " + key + "\r\n")
+	}
+	c.doStatus(req)
+}
@@ -0,0 +1,173 @@
+package clustercache
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"net"
+	"strconv"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+)
+
+// fakeServer speaks enough of the Redis and memcached protocols for the
+// client.
+type fakeServer struct {
+	ln      net.Listener
+	backend string
+	mu      sync.Mutex
+	data    map[string][]byte
+}
+
+func newFakeServer(t *testing.T, backend string) *fakeServer {
+	ln, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatalf("failed to listen: %v", err)
+	}
+	s := &fakeServer{ln: ln, backend: backend, data: make(map[string][]byte)}
+	go func() {
+		for {
+			c, err := ln.Accept()
+			if err != nil {
+				return
+			}
+			go s.serve(c)
+		}
+	}()
+	return s
+}
+
+func (s *fakeServer) serve(c net.Conn) {
+	defer c.Close()
+	r := bufio.NewReader(c)
+	for {
+		var err error
+		if s.backend == "redis" {
+			err = s.serveRedis(r, c)
+		} else {
+			err = s.serveMemcached(r, c)
+		}
+		if err != nil {
+			return
+		}
+	}
+}
+
+func (s *fakeServer) serveRedis(r *bufio.Reader, w io.Writer) error {
+	line, err := readLine(r)
+	if err != nil {
+		return err
+	}
+	n, _ := strconv.Atoi(line[1:])
+	var args []string
+	for i := 0; i < n; i++ {
+		line, err := readLine(r)
+		if err != nil {
+			return err
+		}
+		size, _ := strconv.Atoi(line[1:])
+		arg, err := readValue(r, size)
+		if err != nil {
+			return err
+		}
+		args = append(args, string(arg))
+	}
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	switch args[0] {
+	case "GET":
+		if v, ok := s.data[args[1]]; ok {
+			fmt.Fprintf(w, "$%d\r\n%s\r\n", len(v), v)
+		} else {
+			io.WriteString(w, "$-1\r\n")
+		}
+	case "SET":
+		s.data[args[1]] = []byte(args[2])
+		io.WriteString(w, "+OK\r\n")
+	case "DEL":
+		delete(s.data, args[1])
+		io.WriteString(w, ":1\r\n")
+	}
+	return nil
+}
+
+func (s *fakeServer) serveMemcached(r *bufio.Reader, w io.Writer) error {
+	line, err := readLine(r)
+	if err != nil {
+		return err
+	}
+	fields := strings.Fields(line)
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	switch fields[0] {
+	case "get":
+		if v, ok := s.data[fields[1]]; ok {
+			fmt.Fprintf(w, "VALUE %s 0 %d\r\n%s\r\n", fields[1], len(v), v)
+		}
+		io.WriteString(w, "END\r\n")
+	case "set":
+		size, _ := strconv.Atoi(fields[4])
+		v, err := readValue(r, size)
+		if err != nil {
+			return err
+		}
+		s.data[fields[1]] = v
+		io.WriteString(w, "STORED\r\n")
+	case "delete":
+		delete(s.data, fields[1])
+		io.WriteString(w, "DELETED\r\n")
+	}
+	return nil
+}
+
+func TestCache(t *testing.T) {
+	for _, backend := range []string{"redis", "memcached"} {
+		s := newFakeServer(t, backend)
+		defer s.ln.Close()
+
+		c, err := New(backend, s.ln.Addr().String(), time.Hour, time.Second)
+		if err != nil {
+			t.Fatalf("failed to create %s cache: %v", backend, err)
+		}
+
+		if _, ok := c.Get("seaf:fs:repo:obj"); ok {
+			t.Errorf("%s: missing key found", backend)
+		}
+		value := []byte("line\r\nwith binary \x00 data")
+		c.Set("seaf:fs:repo:obj", value)
+		if v, ok := c.Get("seaf:fs:repo:obj"); !ok || string(v) != string(value) {
+			t.Errorf("%s: got %q, %v", backend, v, ok)
+		}
+		c.Delete("seaf:fs:repo:obj")
+		if _, ok := c.Get("seaf:fs:repo:obj"); ok {
+			t.Errorf("%s: deleted key found", backend)
+		}
+	}
+}
+
+func TestCacheUnavailable(t *testing.T) {
+	ln, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatalf("failed to listen: %v", err)
+	}
+	addr := ln.Addr().String()
+	ln.Close()
+
+	c, _ := New("redis", addr, time.Hour, 50*time.Millisecond)
+	if _, ok := c.Get("key"); ok {
+		t.Errorf("key found without a server")
+	}
+	if c.getConn() != nil {
+		t.Errorf("unavailable server not skipped")
+	}
+
+	var nilCache *Cache
+	nilCache.Set("key", []byte("value"))
+	if _, ok := nilCache.Get("key"); ok {
+		t.Errorf("nil cache hit")
+	}
+}
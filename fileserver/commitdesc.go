@@ -0,0 +1,67 @@
+package main
+
+import (
+	"fmt"
+
+	"github.com/haiwen/seafile-server/fileserver/diff"
+	"github.com/haiwen/seafile-server/fileserver/workerpool"
+	log "github.com/sirupsen/logrus"
+)
+
+// With lazy_commit_description set in the [general] section, commits of web
+// operations are created with a placeholder description instead of diffing
+// against the parent on the commit path. The description is computed in the
+// background and stored in the CommitDescription table, where seaf-server
+// looks it up for readers. seaf-server also computes descriptions that are
+// still missing when they are read, so dropped jobs are not lost.
+const commitDescPending = "(description pending)"
+
+const commitDescQueueSize = 10000
+
+var lazyCommitDesc bool
+
+var commitDescPool *workerpool.WorkPool
+
+func commitDescInit() {
+	if lazyCommitDesc {
+		commitDescPool = workerpool.NewWorkerPool(computeCommitDescJob, 2, commitDescQueueSize)
+	}
+}
+
+// scheduleCommitDesc queues the computation of the description of a commit
+// created with the placeholder.
+func scheduleCommitDesc(repoID, storeID, commitID, root, parentRoot string) {
+	if commitDescPool == nil {
+		return
+	}
+	err := commitDescPool.Submit(workerpool.PriorityLow, repoID, storeID, commitID, root, parentRoot)
+	if err != nil {
+		log.Printf("failed to schedule description of commit %s:%s: %v", repoID, commitID, err)
+	}
+}
+
+func computeCommitDescJob(args ...interface{}) error {
+	if len(args) < 5 {
+		return nil
+	}
+	repoID := args[0].(string)
+	storeID := args[1].(string)
+	commitID := args[2].(string)
+	root := args[3].(string)
+	parentRoot := args[4].(string)
+
+	var results []*diff.DiffEntry
+	if err := diff.DiffCommitRoots(storeID, parentRoot, root, &results, true); err != nil {
+		return fmt.Errorf("failed to diff commit %s:%s with its parent: %v", repoID, commitID, err)
+	}
+	desc := diff.DiffResultsToDesc(results)
+	if desc == "" {
+		desc = "Auto merge by system"
+	}
+
+	sqlStr := "REPLACE INTO CommitDescription (repo_id, commit_id, description) VALUES (?, ?, ?)"
+	if _, err := seafileDB.Exec(sqlStr, repoID, commitID, desc); err != nil {
+		return fmt.Errorf("failed to save description of commit %s:%s: %v", repoID, commitID, err)
+	}
+	return nil
+}
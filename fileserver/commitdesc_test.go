@@ -0,0 +1,24 @@
+package main
+
+import (
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+)
+
+func TestLazyCommitDesc(t *testing.T) {
+	saved := lazyCommitDesc
+	defer func() { lazyCommitDesc = saved }()
+	lazyCommitDesc = true
+
+	repo := &repomgr.Repo{ID: "11111111-2222-3333-4444-555555555555"}
+	desc := genCommitDesc(repo, "0000000000000000000000000000000000000001",
+		"0000000000000000000000000000000000000002")
+	if desc != commitDescPending {
+		t.Errorf("description %q is computed on the commit path", desc)
+	}
+
+	// Without a pool nothing is queued.
+	scheduleCommitDesc(repo.ID, repo.ID, "0000000000000000000000000000000000000003",
+		"0000000000000000000000000000000000000001", "0000000000000000000000000000000000000002")
+}
@@ -0,0 +1,176 @@
+package commitmgr
+
+import (
+	"container/list"
+	"hash/fnv"
+	"sync"
+	"sync/atomic"
+)
+
+// Commits are content-addressed and never change once written, so cached
+// entries never need to be invalidated. Callers of Load are free to modify
+// the returned commit, so the cache always hands out copies.
+
+const (
+	defaultCacheLimit = 16 << 20
+	cacheShards       = 16
+)
+
+// CacheStats contains counters of the commit cache.
+type CacheStats struct {
+	Hits      uint64 `json:"hits"`
+	Misses    uint64 `json:"misses"`
+	Evictions uint64 `json:"evictions"`
+	Items     int64  `json:"items"`
+	Bytes     int64  `json:"bytes"`
+	Limit     int64  `json:"limit"`
+}
+
+type cacheEntry struct {
+	key    string
+	commit *Commit
+	size   int64
+}
+
+type cacheShard struct {
+	mu       sync.Mutex
+	entries  map[string]*list.Element
+	lru      *list.List
+	bytes    int64
+	maxBytes int64
+}
+
+type commitCache struct {
+	shards    [cacheShards]*cacheShard
+	limit     int64
+	hits      uint64
+	misses    uint64
+	evictions uint64
+}
+
+var cache = newCommitCache(defaultCacheLimit)
+
+func newCommitCache(limit int64) *commitCache {
+	if limit <= 0 {
+		return nil
+	}
+	c := new(commitCache)
+	c.limit = limit
+	for i := range c.shards {
+		c.shards[i] = &cacheShard{
+			entries:  make(map[string]*list.Element),
+			lru:      list.New(),
+			maxBytes: limit / cacheShards,
+		}
+	}
+	return c
+}
+
+// SetCacheLimit sets the memory budget of the commit cache in bytes.
+// Cached commits are dropped. A limit of 0 disables the cache.
+func SetCacheLimit(limit int64) {
+	cache = newCommitCache(limit)
+}
+
+// GetCacheStats returns the counters of the commit cache.
+func GetCacheStats() CacheStats {
+	var stats CacheStats
+	c := cache
+	if c == nil {
+		return stats
+	}
+	stats.Hits = atomic.LoadUint64(&c.hits)
+	stats.Misses = atomic.LoadUint64(&c.misses)
+	stats.Evictions = atomic.LoadUint64(&c.evictions)
+	stats.Limit = c.limit
+	for _, s := range c.shards {
+		s.mu.Lock()
+		stats.Items += int64(len(s.entries))
+		stats.Bytes += s.bytes
+		s.mu.Unlock()
+	}
+	return stats
+}
+
+func cacheKey(repoID, commitID string) string {
+	return repoID + "/" + commitID
+}
+
+func (c *commitCache) shard(key string) *cacheShard {
+	h := fnv.New32a()
+	h.Write([]byte(key))
+	return c.shards[h.Sum32()%cacheShards]
+}
+
+func (c *commitCache) get(key string) *Commit {
+	s := c.shard(key)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	elem, ok := s.entries[key]
+	if !ok {
+		atomic.AddUint64(&c.misses, 1)
+		return nil
+	}
+	atomic.AddUint64(&c.hits, 1)
+	s.lru.MoveToFront(elem)
+	commit := *elem.Value.(*cacheEntry).commit
+	return &commit
+}
+
+func (c *commitCache) contains(key string) bool {
+	s := c.shard(key)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	_, ok := s.entries[key]
+	return ok
+}
+
+func (c *commitCache) add(key string, commit *Commit) {
+	s := c.shard(key)
+	size := commit.memSize()
+	if size > s.maxBytes/4 {
+		return
+	}
+	copied := *commit
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if elem, ok := s.entries[key]; ok {
+		s.lru.MoveToFront(elem)
+		return
+	}
+	for s.bytes+size > s.maxBytes {
+		elem := s.lru.Back()
+		if elem == nil {
+			break
+		}
+		ent := s.lru.Remove(elem).(*cacheEntry)
+		delete(s.entries, ent.key)
+		s.bytes -= ent.size
+		atomic.AddUint64(&c.evictions, 1)
+	}
+	s.entries[key] = s.lru.PushFront(&cacheEntry{key, &copied, size})
+	s.bytes += size
+}
+
+func (commit *Commit) memSize() int64 {
+	return int64(384 + len(commit.Desc) + len(commit.CreatorName) +
+		len(commit.RepoName) + len(commit.RepoDesc) + len(commit.Magic) +
+		len(commit.RandomKey) + len(commit.Salt))
+}
+
+func getCachedCommit(repoID, commitID string) *Commit {
+	c := cache
+	if c == nil {
+		return nil
+	}
+	return c.get(cacheKey(repoID, commitID))
+}
+
+func addCachedCommit(repoID string, commit *Commit) {
+	c := cache
+	if c == nil {
+		return
+	}
+	c.add(cacheKey(repoID, commit.CommitID), commit)
+}
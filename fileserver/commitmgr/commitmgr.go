@@ -123,6 +123,10 @@ func WriteRaw(repoID string, commitID string, r io.Reader) error {
 
 // Load commit from storage backend.
 func Load(repoID string, commitID string) (*Commit, error) {
+	if cached := getCachedCommit(repoID, commitID); cached != nil {
+		return cached, nil
+	}
+
 	var buf bytes.Buffer
 	commit := new(Commit)
 	err := ReadRaw(repoID, commitID, &buf)
@@ -133,6 +137,7 @@ func Load(repoID string, commitID string) (*Commit, error) {
 	if err != nil {
 		return nil, err
 	}
+	addCachedCommit(repoID, commit)
 
 	return commit, nil
 }
@@ -149,11 +154,15 @@ func Save(commit *Commit) error {
 	if err != nil {
 		return err
 	}
+	addCachedCommit(commit.RepoID, commit)
 
 	return err
 }
 
 // Exists checks commit if exists.
 func Exists(repoID string, commitID string) (bool, error) {
+	if c := cache; c != nil && c.contains(cacheKey(repoID, commitID)) {
+		return true, nil
+	}
 	return store.Exists(repoID, commitID)
 }
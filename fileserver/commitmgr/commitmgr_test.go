@@ -65,3 +65,42 @@ func TestCommit(t *testing.T) {
 	assertEqual(t, commit.CreatorID, commitID)
 	assertEqual(t, commit.ParentID, commitID)
 }
+
+func TestCommitCache(t *testing.T) {
+	Init(seafileConfPath, seafileDataDir)
+	newCommit := new(Commit)
+	newCommit.CommitID = commitID
+	newCommit.RepoID = repoID
+	newCommit.Desc = "This is a commit"
+	if err := Save(newCommit); err != nil {
+		t.Fatalf("Failed to save commit: %v", err)
+	}
+
+	commit, err := Load(repoID, commitID)
+	if err != nil {
+		t.Fatalf("Failed to load commit: %v", err)
+	}
+	commit.Desc = "modified"
+
+	stats := GetCacheStats()
+	cached, err := Load(repoID, commitID)
+	if err != nil {
+		t.Fatalf("Failed to load commit: %v", err)
+	}
+	if GetCacheStats().Hits != stats.Hits+1 {
+		t.Errorf("commit %s is not served from cache", commitID)
+	}
+	if cached.Desc != "This is a commit" {
+		t.Errorf("cached commit was modified by caller")
+	}
+
+	if _, err := Load("00000000-0000-0000-0000-000000000000", commitID); err == nil {
+		t.Errorf("commit of another repo is served from cache")
+	}
+
+	SetCacheLimit(0)
+	defer SetCacheLimit(defaultCacheLimit)
+	if _, err := Load(repoID, commitID); err != nil {
+		t.Errorf("Failed to load commit with cache disabled: %v", err)
+	}
+}
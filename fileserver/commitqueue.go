@@ -0,0 +1,164 @@
+package main
+
+import (
+	"fmt"
+	"math/rand"
+	"sync"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/commitmgr"
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	log "github.com/sirupsen/logrus"
+)
+
+// Head updates of a repo are serialized through a per-repo queue instead of
+// racing on the branch and retrying. One goroutine per busy repo takes all
+// queued commits, chains them onto the current head, merging where a commit
+// is not based on the tip of the chain, and moves the head once for the
+// whole chain. Another server can still move the head under the queue, in
+// which case the chain is rebuilt on the new head.
+
+const maxCommitRetries = 3
+
+type commitRequest struct {
+	base            *commitmgr.Commit
+	commit          *commitmgr.Commit
+	user            string
+	retryOnConflict bool
+	commitID        string
+	err             error
+	done            chan struct{}
+}
+
+// A repo has a queue while commits of it are being applied.
+type commitQueue struct {
+	pending []*commitRequest
+}
+
+var commitQueues = struct {
+	sync.Mutex
+	queues map[string]*commitQueue
+}{queues: make(map[string]*commitQueue)}
+
+// applyCommits is replaced in tests.
+var applyCommits = applyCommitBatch
+
+// commitToHead makes commit, which is based on base, the head of the repo
+// and returns the new head commit id.
+func commitToHead(repoID string, base, commit *commitmgr.Commit, user string, retryOnConflict bool) (string, error) {
+	req := &commitRequest{
+		base:            base,
+		commit:          commit,
+		user:            user,
+		retryOnConflict: retryOnConflict,
+		done:            make(chan struct{}),
+	}
+
+	commitQueues.Lock()
+	q, ok := commitQueues.queues[repoID]
+	if !ok {
+		q = new(commitQueue)
+		commitQueues.queues[repoID] = q
+		go runCommitQueue(repoID, q)
+	}
+	q.pending = append(q.pending, req)
+	commitQueues.Unlock()
+
+	<-req.done
+	return req.commitID, req.err
+}
+
+func runCommitQueue(repoID string, q *commitQueue) {
+	for {
+		commitQueues.Lock()
+		batch := q.pending
+		q.pending = nil
+		if len(batch) == 0 {
+			delete(commitQueues.queues, repoID)
+			commitQueues.Unlock()
+			return
+		}
+		commitQueues.Unlock()
+
+		applyCommits(repoID, batch)
+		for _, req := range batch {
+			close(req.done)
+		}
+	}
+}
+
+func failCommitRequests(reqs []*commitRequest, err error) {
+	for _, req := range reqs {
+		req.commitID = ""
+		req.err = err
+	}
+}
+
+// applyCommitBatch chains the commits of batch onto the head and moves the
+// head to the tip of the chain.
+func applyCommitBatch(repoID string, batch []*commitRequest) {
+	var retryCnt int
+	todo := batch
+
+	for len(todo) > 0 {
+		repo := repomgr.Get(repoID)
+		if repo == nil {
+			failCommitRequests(todo, fmt.Errorf("repo %s doesn't exist", repoID))
+			return
+		}
+		head, err := commitmgr.Load(repoID, repo.HeadCommitID)
+		if err != nil {
+			failCommitRequests(todo, fmt.Errorf("failed to get head commit for repo %s", repoID))
+			return
+		}
+
+		tip := head
+		var chained []*commitRequest
+		var secondParentIDs []string
+		for _, req := range todo {
+			commit := req.commit
+			if req.base.CommitID != tip.CommitID {
+				commit, err = mergeWithHead(repo, req.base, tip, req.commit, req.user)
+				if err != nil {
+					req.err = err
+					continue
+				}
+				secondParentIDs = append(secondParentIDs, req.commit.CommitID)
+			}
+			req.commitID = commit.CommitID
+			tip = commit
+			chained = append(chained, req)
+		}
+		if len(chained) == 0 {
+			return
+		}
+
+		err = updateBranch(repoID, tip.CommitID, head.CommitID, secondParentIDs...)
+		if err == nil {
+			if len(chained) > 1 {
+				log.Debugf("moved head of repo %s over %d queued commits", repoID, len(chained))
+			}
+			return
+		}
+
+		// The head was moved by another server, rebuild the chain.
+		var next []*commitRequest
+		for _, req := range chained {
+			if !req.retryOnConflict {
+				failCommitRequests([]*commitRequest{req}, ErrConflict)
+				continue
+			}
+			next = append(next, req)
+		}
+		if len(next) > 0 && retryCnt >= maxCommitRetries {
+			failCommitRequests(next, fmt.Errorf("stop updating repo %s after %d retries", repoID, maxCommitRetries))
+			return
+		}
+		if len(next) > 0 {
+			retryCnt++
+			random := rand.Intn(10) + 1
+			time.Sleep(time.Duration(random*100) * time.Millisecond)
+		}
+		todo = next
+	}
+}
@@ -0,0 +1,88 @@
+package main
+
+import (
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/commitmgr"
+)
+
+func TestCommitQueue(t *testing.T) {
+	const repoID = "11111111-2222-3333-4444-555555555555"
+	const nCommits = 20
+
+	var mu sync.Mutex
+	var batches [][]*commitRequest
+	release := make(chan struct{})
+
+	saved := applyCommits
+	defer func() { applyCommits = saved }()
+	applyCommits = func(repoID string, batch []*commitRequest) {
+		mu.Lock()
+		batches = append(batches, batch)
+		first := len(batches) == 1
+		mu.Unlock()
+		// Hold the first batch so that the other commits queue up.
+		if first {
+			<-release
+		}
+		for _, req := range batch {
+			req.commitID = req.commit.CommitID
+		}
+	}
+
+	var wg sync.WaitGroup
+	results := make([]string, nCommits)
+	submit := func(i int) {
+		defer wg.Done()
+		commit := &commitmgr.Commit{CommitID: string(rune('a' + i))}
+		id, err := commitToHead(repoID, &commitmgr.Commit{}, commit, "user", true)
+		if err != nil {
+			t.Errorf("commit %d failed: %v", i, err)
+		}
+		results[i] = id
+	}
+
+	wg.Add(1)
+	go submit(0)
+	for {
+		mu.Lock()
+		n := len(batches)
+		mu.Unlock()
+		if n == 1 {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+	wg.Add(nCommits - 1)
+	for i := 1; i < nCommits; i++ {
+		go submit(i)
+	}
+	for {
+		commitQueues.Lock()
+		n := len(commitQueues.queues[repoID].pending)
+		commitQueues.Unlock()
+		if n == nCommits-1 {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+	close(release)
+	wg.Wait()
+
+	for i, id := range results {
+		if id != string(rune('a'+i)) {
+			t.Errorf("commit %d got head %q", i, id)
+		}
+	}
+	if len(batches) != 2 || len(batches[1]) != nCommits-1 {
+		t.Errorf("queued commits were not applied in one batch: %d batches", len(batches))
+	}
+
+	commitQueues.Lock()
+	defer commitQueues.Unlock()
+	if _, ok := commitQueues.queues[repoID]; ok {
+		t.Errorf("queue of idle repo was not removed")
+	}
+}
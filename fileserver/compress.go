@@ -0,0 +1,156 @@
+// Gzip content coding of the large sync replies and request bodies, as in
+// server/http-compress.c in seaf-server.
+package main
+
+import (
+	"compress/gzip"
+	"errors"
+	"io"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// Smaller replies gain little from compression.
+const defaultCompressMinSize = 8192
+
+// A compressed request body can't be decoded into more than this.
+const maxDecodedBodySize = 64 << 20
+
+var errDecodedBodyTooLarge = errors.New("decoded request body is too large")
+
+// Everything is compressed for speed, the stored fs objects sent by pack-fs
+// are compressed already.
+var gzipWriters sync.Pool
+
+func getGzipWriter(w io.Writer) *gzip.Writer {
+	if zw, ok := gzipWriters.Get().(*gzip.Writer); ok {
+		zw.Reset(w)
+		return zw
+	}
+	zw, _ := gzip.NewWriterLevel(w, gzip.BestSpeed)
+	return zw
+}
+
+func acceptsGzip(r *http.Request) bool {
+	for _, enc := range strings.Split(r.Header.Get("Accept-Encoding"), ",") {
+		parts := strings.SplitN(enc, ";", 2)
+		if strings.TrimSpace(parts[0]) != "gzip" {
+			continue
+		}
+		// "gzip;q=0" means gzip is not acceptable.
+		return len(parts) == 1 || strings.Replace(parts[1], " ", "", -1) != "q=0"
+	}
+	return false
+}
+
+// shouldCompress tells if a reply of size bytes to r is compressed.
+func shouldCompress(r *http.Request, size int) bool {
+	return options.compressMinSize >= 0 && size >= options.compressMinSize && acceptsGzip(r)
+}
+
+// writeReply sends data with status OK, compressed if it's large enough and
+// the client accepts it. The compressed reply is written out as it's
+// produced, without being held as a whole.
+func writeReply(rsp http.ResponseWriter, r *http.Request, data []byte) {
+	rsp.Header().Add("Vary", "Accept-Encoding")
+	if !shouldCompress(r, len(data)) {
+		rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
+		rsp.WriteHeader(http.StatusOK)
+		rsp.Write(data)
+		return
+	}
+
+	rsp.Header().Set("Content-Encoding", "gzip")
+	rsp.WriteHeader(http.StatusOK)
+	zw := getGzipWriter(rsp)
+	if _, err := zw.Write(data); err == nil {
+		zw.Close()
+	}
+	gzipWriters.Put(zw)
+}
+
+// replyStream writes a streamed reply of unknown size, compressed if the
+// client accepts it. The Content-Encoding header is only set by the first
+// write, so that errors before are replied to as usual.
+type replyStream struct {
+	rsp      http.ResponseWriter
+	compress bool
+	zw       *gzip.Writer
+}
+
+func newReplyStream(rsp http.ResponseWriter, r *http.Request) *replyStream {
+	rsp.Header().Add("Vary", "Accept-Encoding")
+	// Streamed replies are the long ones.
+	return &replyStream{rsp: rsp, compress: options.compressMinSize >= 0 && acceptsGzip(r)}
+}
+
+func (s *replyStream) Write(p []byte) (int, error) {
+	if !s.compress {
+		return s.rsp.Write(p)
+	}
+	if s.zw == nil {
+		s.rsp.Header().Set("Content-Encoding", "gzip")
+		s.zw = getGzipWriter(s.rsp)
+	}
+	return s.zw.Write(p)
+}
+
+// Flush sends what was written so far to the client.
+func (s *replyStream) Flush() {
+	if s.zw != nil {
+		s.zw.Flush()
+	}
+	if f, ok := s.rsp.(http.Flusher); ok {
+		f.Flush()
+	}
+}
+
+// Close ends the compressed stream.
+func (s *replyStream) Close() error {
+	if s.zw == nil {
+		return nil
+	}
+	err := s.zw.Close()
+	gzipWriters.Put(s.zw)
+	s.zw = nil
+	return err
+}
+
+// decodedBody reads at most one byte past the limit, to tell a body of
+// exactly maxDecodedBodySize bytes from a larger one.
+type decodedBody struct {
+	r    io.Reader
+	left int64
+}
+
+func (b *decodedBody) Read(p []byte) (int, error) {
+	if int64(len(p)) > b.left {
+		p = p[:b.left]
+	}
+	n, err := b.r.Read(p)
+	b.left -= int64(n)
+	if b.left <= 0 {
+		return n, errDecodedBodyTooLarge
+	}
+	return n, err
+}
+
+// requestBody returns the body of r, decoded if it has a Content-Encoding.
+// Reading a decoded body fails with errDecodedBodyTooLarge past
+// maxDecodedBodySize bytes.
+func requestBody(r *http.Request) (io.Reader, *appError) {
+	switch strings.ToLower(strings.TrimSpace(r.Header.Get("Content-Encoding"))) {
+	case "", "identity":
+		return r.Body, nil
+	case "gzip":
+		zr, err := gzip.NewReader(r.Body)
+		if err != nil {
+			return nil, &appError{nil, err.Error(), http.StatusBadRequest}
+		}
+		return &decodedBody{zr, maxDecodedBodySize + 1}, nil
+	}
+	msg := "Unsupported content encoding."
+	return nil, &appError{nil, msg, http.StatusUnsupportedMediaType}
+}
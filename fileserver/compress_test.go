@@ -0,0 +1,173 @@
+package main
+
+import (
+	"bytes"
+	"compress/gzip"
+	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"testing"
+)
+
+func gunzip(t *testing.T, data []byte) []byte {
+	zr, err := gzip.NewReader(bytes.NewReader(data))
+	if err != nil {
+		t.Fatalf("failed to read gzip stream: %v", err)
+	}
+	plain, err := ioutil.ReadAll(zr)
+	if err != nil {
+		t.Fatalf("failed to decompress: %v", err)
+	}
+	return plain
+}
+
+func TestWriteReply(t *testing.T) {
+	saved := options.compressMinSize
+	defer func() { options.compressMinSize = saved }()
+	options.compressMinSize = 1024
+
+	large := []byte("[\"" + strings.Repeat("0123456789abcdef", 256) + "\"]")
+	for _, test := range []struct {
+		data       []byte
+		accept     string
+		compressed bool
+	}{
+		{large, "gzip", true},
+		{large, "", false},
+		{large, "gzip;q=0", false},
+		{[]byte("[]"), "gzip", false},
+	} {
+		r, _ := http.NewRequest("GET", "/", nil)
+		r.Header.Set("Accept-Encoding", test.accept)
+		rec := httptest.NewRecorder()
+		writeReply(rec, r, test.data)
+
+		body := rec.Body.Bytes()
+		if test.compressed {
+			if rec.Header().Get("Content-Encoding") != "gzip" {
+				t.Errorf("reply of %d bytes to %q isn't compressed", len(test.data), test.accept)
+				continue
+			}
+			if len(body) >= len(test.data) {
+				t.Errorf("compressed reply has %d bytes, plain %d", len(body), len(test.data))
+			}
+			body = gunzip(t, body)
+		} else if rec.Header().Get("Content-Encoding") != "" {
+			t.Errorf("reply of %d bytes to %q is compressed", len(test.data), test.accept)
+			continue
+		}
+		if !bytes.Equal(body, test.data) {
+			t.Errorf("reply to %q doesn't match the data", test.accept)
+		}
+	}
+
+	options.compressMinSize = -1
+	r, _ := http.NewRequest("GET", "/", nil)
+	r.Header.Set("Accept-Encoding", "gzip")
+	rec := httptest.NewRecorder()
+	writeReply(rec, r, large)
+	if rec.Header().Get("Content-Encoding") != "" {
+		t.Errorf("reply is compressed with compression disabled")
+	}
+}
+
+func TestReplyStream(t *testing.T) {
+	saved := options.compressMinSize
+	defer func() { options.compressMinSize = saved }()
+	options.compressMinSize = defaultCompressMinSize
+
+	r, _ := http.NewRequest("GET", "/", nil)
+	r.Header.Set("Accept-Encoding", "gzip")
+	rec := httptest.NewRecorder()
+	w := newReplyStream(rec, r)
+	s := &idStream{w: w}
+	s.ids = append(s.ids, strings.Repeat("1", 40))
+	if err := s.flush(); err != nil {
+		t.Fatalf("failed to flush stream: %v", err)
+	}
+	if !rec.Flushed || rec.Body.Len() == 0 {
+		t.Errorf("flushed ids aren't sent")
+	}
+	s.ids = append(s.ids, strings.Repeat("2", 40))
+	if err := s.finish(); err != nil {
+		t.Fatalf("failed to finish stream: %v", err)
+	}
+	if err := w.Close(); err != nil {
+		t.Fatalf("failed to close stream: %v", err)
+	}
+
+	if rec.Header().Get("Content-Encoding") != "gzip" {
+		t.Fatalf("stream isn't compressed")
+	}
+	expected := "[\"" + strings.Repeat("1", 40) + "\",\"" + strings.Repeat("2", 40) + "\"]"
+	if plain := gunzip(t, rec.Body.Bytes()); string(plain) != expected {
+		t.Errorf("stream is %q, expected %q", plain, expected)
+	}
+
+	// Nothing is written before an error, which is then sent plain.
+	rec = httptest.NewRecorder()
+	w = newReplyStream(rec, r)
+	if rec.Header().Get("Content-Encoding") != "" || w.Close() != nil {
+		t.Errorf("unused stream set the content encoding")
+	}
+}
+
+func TestRequestBody(t *testing.T) {
+	var packed bytes.Buffer
+	zw := gzip.NewWriter(&packed)
+	zw.Write([]byte("[\"id\"]"))
+	zw.Close()
+
+	for _, test := range []struct {
+		encoding string
+		body     []byte
+		status   int
+		decoded  string
+	}{
+		{"", []byte("[]"), 0, "[]"},
+		{"identity", []byte("[]"), 0, "[]"},
+		{"gzip", packed.Bytes(), 0, "[\"id\"]"},
+		{"GZIP", packed.Bytes(), 0, "[\"id\"]"},
+		{"gzip", []byte("[]"), http.StatusBadRequest, ""},
+		{"br", []byte("[]"), http.StatusUnsupportedMediaType, ""},
+	} {
+		r, _ := http.NewRequest("POST", "/", bytes.NewReader(test.body))
+		r.Header.Set("Content-Encoding", test.encoding)
+		body, appErr := requestBody(r)
+		if appErr != nil {
+			if appErr.Code != test.status {
+				t.Errorf("body encoded with %q fails with %d", test.encoding, appErr.Code)
+			}
+			continue
+		}
+		if test.status != 0 {
+			t.Errorf("body encoded with %q doesn't fail", test.encoding)
+			continue
+		}
+		decoded, err := ioutil.ReadAll(body)
+		if err != nil || string(decoded) != test.decoded {
+			t.Errorf("body encoded with %q is decoded to %q: %v", test.encoding, decoded, err)
+		}
+	}
+
+	for size, tooLarge := range map[int]bool{
+		maxDecodedBodySize:     false,
+		maxDecodedBodySize + 1: true,
+	} {
+		packed.Reset()
+		zw.Reset(&packed)
+		zw.Write(make([]byte, size))
+		zw.Close()
+		r, _ := http.NewRequest("POST", "/", bytes.NewReader(packed.Bytes()))
+		r.Header.Set("Content-Encoding", "gzip")
+		body, _ := requestBody(r)
+		decoded, err := ioutil.ReadAll(body)
+		if tooLarge && err != errDecodedBodyTooLarge {
+			t.Errorf("body of %d bytes is decoded: %v", size, err)
+		}
+		if !tooLarge && (err != nil || len(decoded) != size) {
+			t.Errorf("body of %d bytes is decoded to %d bytes: %v", size, len(decoded), err)
+		}
+	}
+}
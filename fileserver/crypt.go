@@ -1,82 +1,101 @@
 package main
 
 import (
-	"bytes"
 	"crypto/aes"
 	"crypto/cipher"
+	"fmt"
+	"sync"
 )
 
 type seafileCrypt struct {
 	key     []byte
 	iv      []byte
 	version int
+
+	// The AES key schedule is computed once and used for all blocks.
+	blockOnce sync.Once
+	block     cipher.Block
+	blockErr  error
+}
+
+func (crypt *seafileCrypt) getBlock() (cipher.Block, error) {
+	crypt.blockOnce.Do(func() {
+		key := crypt.key
+		if crypt.version == 3 {
+			key = to16Bytes(key)
+		}
+		crypt.block, crypt.blockErr = aes.NewCipher(key)
+	})
+	return crypt.block, crypt.blockErr
 }
 
 func (crypt *seafileCrypt) encrypt(input []byte) ([]byte, error) {
-	key := crypt.key
-	if crypt.version == 3 {
-		key = to16Bytes(key)
-	}
-	block, err := aes.NewCipher(key)
+	block, err := crypt.getBlock()
 	if err != nil {
 		return nil, err
 	}
 	size := block.BlockSize()
-	input = pkcs7Padding(input, size)
-	out := make([]byte, len(input))
+	// Pad into the output buffer, so that input is left untouched.
+	padding := size - len(input)%size
+	out := make([]byte, len(input)+padding)
+	copy(out, input)
+	for i := len(input); i < len(out); i++ {
+		out[i] = byte(padding)
+	}
 
 	if crypt.version == 3 {
-		for bs, be := 0, size; bs < len(input); bs, be = bs+size, be+size {
-			block.Encrypt(out[bs:be], input[bs:be])
+		for bs, be := 0, size; bs < len(out); bs, be = bs+size, be+size {
+			block.Encrypt(out[bs:be], out[bs:be])
 		}
 		return out, nil
 	}
 
 	blockMode := cipher.NewCBCEncrypter(block, crypt.iv)
-	blockMode.CryptBlocks(out, input)
+	blockMode.CryptBlocks(out, out)
 
 	return out, nil
 }
 
 func (crypt *seafileCrypt) decrypt(input []byte) ([]byte, error) {
-	key := crypt.key
-	if crypt.version == 3 {
-		key = to16Bytes(key)
-	}
-	block, err := aes.NewCipher(key)
+	out := make([]byte, len(input))
+	copy(out, input)
+	return crypt.decryptInPlace(out)
+}
+
+// decryptInPlace decrypts p in place and returns the unpadded plaintext,
+// which shares p's storage.
+func (crypt *seafileCrypt) decryptInPlace(p []byte) ([]byte, error) {
+	block, err := crypt.getBlock()
 	if err != nil {
 		return nil, err
 	}
-	out := make([]byte, len(input))
 	size := block.BlockSize()
+	if len(p) == 0 || len(p)%size != 0 {
+		return nil, fmt.Errorf("invalid encrypted data length %d", len(p))
+	}
 
 	if crypt.version == 3 {
 		// Encryption repo v3 uses AES_128_ecb mode to encrypt and decrypt, each block is encrypted and decrypted independently,
 		// there is no relationship before and after, and iv is not required.
-		for bs, be := 0, size; bs < len(input); bs, be = bs+size, be+size {
-			block.Decrypt(out[bs:be], input[bs:be])
+		for bs, be := 0, size; bs < len(p); bs, be = bs+size, be+size {
+			block.Decrypt(p[bs:be], p[bs:be])
 		}
-		out = pkcs7UnPadding(out)
-		return out, nil
+		return pkcs7UnPadding(p, size)
 	}
 
 	blockMode := cipher.NewCBCDecrypter(block, crypt.iv)
-	blockMode.CryptBlocks(out, input)
-	out = pkcs7UnPadding(out)
+	blockMode.CryptBlocks(p, p)
 
-	return out, nil
+	return pkcs7UnPadding(p, size)
 }
 
-func pkcs7Padding(p []byte, blockSize int) []byte {
-	padding := blockSize - len(p)%blockSize
-	padtext := bytes.Repeat([]byte{byte(padding)}, padding)
-	return append(p, padtext...)
-}
-
-func pkcs7UnPadding(p []byte) []byte {
+func pkcs7UnPadding(p []byte, blockSize int) ([]byte, error) {
 	length := len(p)
 	paddLen := int(p[length-1])
-	return p[:(length - paddLen)]
+	if paddLen == 0 || paddLen > blockSize || paddLen > length {
+		return nil, fmt.Errorf("invalid padding")
+	}
+	return p[:(length - paddLen)], nil
 }
 
 func to16Bytes(input []byte) []byte {
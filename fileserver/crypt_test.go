@@ -0,0 +1,104 @@
+package main
+
+import (
+	"bytes"
+	"crypto/aes"
+	"crypto/cipher"
+	"testing"
+)
+
+// cryptTestOldEncrypt is the per-block encryption used before the cipher
+// was cached, to check the output did not change.
+func cryptTestOldEncrypt(crypt *seafileCrypt, input []byte) []byte {
+	key := crypt.key
+	if crypt.version == 3 {
+		key = to16Bytes(key)
+	}
+	block, _ := aes.NewCipher(key)
+	size := block.BlockSize()
+	padding := size - len(input)%size
+	in := append(append([]byte{}, input...), bytes.Repeat([]byte{byte(padding)}, padding)...)
+	out := make([]byte, len(in))
+	if crypt.version == 3 {
+		for i := 0; i < len(in); i += size {
+			block.Encrypt(out[i:i+size], in[i:i+size])
+		}
+		return out
+	}
+	cipher.NewCBCEncrypter(block, crypt.iv).CryptBlocks(out, in)
+	return out
+}
+
+func TestSeafileCrypt(t *testing.T) {
+	key := make([]byte, 32)
+	iv := make([]byte, 16)
+	for i := range key {
+		key[i] = byte(i * 7)
+	}
+	for i := range iv {
+		iv[i] = byte(i * 13)
+	}
+
+	for _, version := range []int{2, 3, 4} {
+		crypt := &seafileCrypt{key: key, iv: iv, version: version}
+		for _, n := range []int{1, 15, 16, 17, 4096, 100000} {
+			input := make([]byte, n, n+64)
+			for i := range input {
+				input[i] = byte(i * 31)
+			}
+			tail := input[:n+64]
+
+			enc, err := crypt.encrypt(input)
+			if err != nil {
+				t.Fatalf("version %d: failed to encrypt %d bytes: %v", version, n, err)
+			}
+			if !bytes.Equal(enc, cryptTestOldEncrypt(crypt, input)) {
+				t.Errorf("version %d: encrypted %d bytes differently", version, n)
+			}
+			for _, b := range tail[n:] {
+				if b != 0 {
+					t.Fatalf("version %d: encrypt wrote past the input", version)
+				}
+			}
+
+			dec, err := crypt.decrypt(enc)
+			if err != nil {
+				t.Fatalf("version %d: failed to decrypt %d bytes: %v", version, n, err)
+			}
+			if !bytes.Equal(dec, input) {
+				t.Errorf("version %d: decrypted %d bytes wrongly", version, n)
+			}
+
+			dec, err = crypt.decryptInPlace(enc)
+			if err != nil || !bytes.Equal(dec, input) {
+				t.Errorf("version %d: decrypted %d bytes in place wrongly", version, n)
+			}
+		}
+	}
+
+	crypt := &seafileCrypt{key: key, iv: iv, version: 2}
+	if _, err := crypt.decrypt(make([]byte, 15)); err == nil {
+		t.Errorf("decrypted data with a bad length")
+	}
+}
+
+func BenchmarkSeafileEncrypt(b *testing.B) {
+	crypt := &seafileCrypt{key: make([]byte, 32), iv: make([]byte, 16), version: 2}
+	input := make([]byte, 1<<20)
+	b.SetBytes(int64(len(input)))
+	for i := 0; i < b.N; i++ {
+		crypt.encrypt(input)
+	}
+}
+
+func BenchmarkSeafileDecrypt(b *testing.B) {
+	crypt := &seafileCrypt{key: make([]byte, 32), iv: make([]byte, 16), version: 2}
+	input, err := crypt.encrypt(make([]byte, 1<<20))
+	if err != nil {
+		b.Fatalf("failed to encrypt: %v", err)
+	}
+	b.SetBytes(int64(len(input)))
+	for i := 0; i < b.N; i++ {
+		crypt.decrypt(input)
+	}
+}
@@ -0,0 +1,204 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"net/http"
+	"path/filepath"
+	"strconv"
+	"syscall"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/commitmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	log "github.com/sirupsen/logrus"
+)
+
+// A file update can send only the blocks the server doesn't have. The
+// "blockids" field lists the block ids of the new version and "file_size"
+// its size, the file parts are the missing blocks, named by their ids. If
+// blocks are still missing, the reply is seafHTTPResBlockMissing with their
+// ids in "missing", for the client to send them. The C fileserver handles
+// the same requests.
+
+func parseDeltaBlockIDs(blockIDsJSON string) ([]string, error) {
+	var blkIDs []string
+	if err := json.Unmarshal([]byte(blockIDsJSON), &blkIDs); err != nil {
+		return nil, err
+	}
+	for _, id := range blkIDs {
+		if !isObjectIDValid(id) {
+			return nil, fmt.Errorf("invalid block id %s", id)
+		}
+	}
+	return blkIDs, nil
+}
+
+// missingBlocks returns the blocks of blkIDs that aren't stored, each once.
+func missingBlocks(blkIDs []string, exists func(string) bool) []string {
+	missing := []string{}
+	seen := make(map[string]bool)
+	for _, id := range blkIDs {
+		if seen[id] {
+			continue
+		}
+		seen[id] = true
+		if !exists(id) {
+			missing = append(missing, id)
+		}
+	}
+	return missing
+}
+
+func updateFileBlocks(rsp http.ResponseWriter, r *http.Request, fsm *recvData, parentDir, fileName string, isAjax bool) *appError {
+	repoID := fsm.repoID
+	user := fsm.user
+
+	blkIDs, err := parseDeltaBlockIDs(r.FormValue("blockids"))
+	if err != nil {
+		msg := "Invalid blockids.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+	fileSize, err := strconv.ParseInt(r.FormValue("file_size"), 10, 64)
+	if err != nil || fileSize < 0 {
+		msg := "Invalid file_size.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+
+	if parentDir[0] != '/' {
+		msg := "Invalid parent dir"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+	if err := checkParentDir(repoID, parentDir); err != nil {
+		return err
+	}
+
+	repo := repomgr.Get(repoID)
+	if repo == nil {
+		msg := "Failed to get repo.\n"
+		err := fmt.Errorf("Failed to get repo %s", repoID)
+		return &appError{err, msg, http.StatusInternalServerError}
+	}
+	// The ids of encrypted blocks depend on the key, the client can't
+	// compare them with the stored ones.
+	if repo.IsEncrypted {
+		msg := "Encrypted library not supported.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+
+	for _, handler := range r.MultipartForm.File["file"] {
+		fsm.fileNames = append(fsm.fileNames, filepath.Base(handler.Filename))
+		fsm.fileHeaders = append(fsm.fileHeaders, handler)
+	}
+	for _, id := range fsm.fileNames {
+		if !isObjectIDValid(id) {
+			msg := "Invalid block id.\n"
+			return &appError{nil, msg, http.StatusBadRequest}
+		}
+	}
+
+	// The blocks the new version shares with stored files aren't sent.
+	ret, err := checkQuota(repoID, r.ContentLength)
+	if err != nil {
+		msg := "Internal error.\n"
+		err := fmt.Errorf("failed to check quota: %v", err)
+		return &appError{err, msg, http.StatusInternalServerError}
+	}
+	if ret == 1 {
+		msg := "Out of quota.\n"
+		return &appError{nil, msg, seafHTTPResNoQuota}
+	}
+
+	if fsm.fileHeaders != nil {
+		if err := indexRawBlocks(repo.StoreID, fsm.fileNames, fsm.fileHeaders); err != nil {
+			err := fmt.Errorf("failed to index file blocks: %v", err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+	}
+
+	// The blocks not sent again are reused, see blockmgr.Touch.
+	missing := missingBlocks(blkIDs, func(id string) bool {
+		return blockmgr.Exists(repo.StoreID, id) && blockmgr.Touch(repo.StoreID, id) == nil
+	})
+	if len(missing) > 0 {
+		data, err := json.Marshal(map[string]interface{}{"error": "Block missing.", "missing": missing})
+		if err != nil {
+			err := fmt.Errorf("failed to encode missing blocks: %v", err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		rsp.Header().Set("Content-Type", "application/json; charset=utf-8")
+		rsp.WriteHeader(seafHTTPResBlockMissing)
+		rsp.Write(data)
+		return nil
+	}
+
+	headID := r.URL.Query().Get("head")
+	base := repo.HeadCommitID
+	if headID != "" {
+		base = headID
+	}
+	headCommit, err := commitmgr.Load(repo.ID, base)
+	if err != nil {
+		msg := "Failed to get head commit.\n"
+		err := fmt.Errorf("failed to get head commit for repo %s", repo.ID)
+		return &appError{err, msg, http.StatusInternalServerError}
+	}
+
+	canonPath := getCanonPath(parentDir)
+	exist, _ := checkFileExists(repo.StoreID, headCommit.RootID, canonPath, fileName)
+	if !exist {
+		msg := "File does not exist.\n"
+		return &appError{nil, msg, seafHTTPResNotExists}
+	}
+
+	fileID, appErr := indexExistedFileBlocks(repo.StoreID, repo.Version, blkIDs, fileSize)
+	if appErr != nil {
+		return appErr
+	}
+
+	fullPath := filepath.Join(parentDir, fileName)
+	oldFileID, _, _ := fsmgr.GetObjIDByPath(repo.StoreID, headCommit.RootID, fullPath)
+	if fileID != oldFileID {
+		mtime := time.Now().Unix()
+		mode := (syscall.S_IFREG | 0644)
+		newDent := fsmgr.NewDirent(fileID, fileName, uint32(mode), mtime, user, fileSize)
+
+		var names []string
+		rootID, err := doPostMultiFiles(repo, headCommit.RootID, canonPath, []*fsmgr.SeafDirent{newDent}, user, true, &names)
+		if err != nil {
+			err := fmt.Errorf("failed to put file %s to %s in repo %s: %v", fileName, canonPath, repo.ID, err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+
+		desc := fmt.Sprintf("Modified \"%s\"", fileName)
+		if _, err := genNewCommit(repo, headCommit, rootID, user, desc, true); err != nil {
+			err := fmt.Errorf("failed to generate new commit: %v", err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+
+		go scheduleMergeVirtualRepo(repo.ID, "")
+		go scheduleRepoSizeComputation(repo.ID)
+	}
+
+	if isAjax {
+		retJSON, err := formatUpdateJSONRet(fileName, fileID, fileSize)
+		if err != nil {
+			err := fmt.Errorf("failed to format json data")
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		rsp.Write(retJSON)
+	} else {
+		rsp.Write([]byte(fileID))
+	}
+
+	var contentLen uint64
+	if r.ContentLength > 0 {
+		contentLen = uint64(r.ContentLength)
+	}
+	sendStatisticMsg(repoID, user, "web-file-upload", contentLen)
+	log.Debugf("updated %s of repo %s from %d blocks", fullPath, repoID, len(blkIDs))
+
+	return nil
+}
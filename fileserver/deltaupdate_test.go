@@ -0,0 +1,34 @@
+package main
+
+import (
+	"reflect"
+	"strings"
+	"testing"
+)
+
+func TestParseDeltaBlockIDs(t *testing.T) {
+	a := strings.Repeat("a", 40)
+	ids, err := parseDeltaBlockIDs(`["` + a + `"]`)
+	if err != nil || !reflect.DeepEqual(ids, []string{a}) {
+		t.Errorf("parsed %v, %v", ids, err)
+	}
+	if _, err := parseDeltaBlockIDs(`["../x"]`); err == nil {
+		t.Errorf("invalid block id accepted")
+	}
+	if _, err := parseDeltaBlockIDs(`{}`); err == nil {
+		t.Errorf("non list accepted")
+	}
+}
+
+func TestMissingBlocks(t *testing.T) {
+	stored := map[string]bool{"a": true}
+	exists := func(id string) bool { return stored[id] }
+
+	missing := missingBlocks([]string{"a", "b", "c", "b"}, exists)
+	if !reflect.DeepEqual(missing, []string{"b", "c"}) {
+		t.Errorf("missing blocks are %v", missing)
+	}
+	if missing := missingBlocks([]string{"a"}, exists); len(missing) != 0 {
+		t.Errorf("missing blocks are %v", missing)
+	}
+}
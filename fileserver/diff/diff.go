@@ -5,6 +5,7 @@ import (
 	"fmt"
 	"path/filepath"
 	"strings"
+	"sync"
 
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
 	"github.com/haiwen/seafile-server/fileserver/fsmgr"
@@ -25,6 +26,39 @@ type DiffOptions struct {
 	RepoID string
 	Ctx    context.Context
 	Data   interface{}
+
+	// When Workers > 1, differing sub-directories are diffed by up to
+	// Workers goroutines. Each part of the diff is collected into its own
+	// data returned by NewData, and the parts are passed to MergeData in
+	// the order of a sequential diff, so the merged Data is the same. The
+	// callbacks must only touch their data argument.
+	Workers   int
+	NewData   func() interface{}
+	MergeData func(data, part interface{})
+
+	task *diffTask
+}
+
+type parallelDiff struct {
+	sem  chan struct{}
+	wg   sync.WaitGroup
+	once sync.Once
+	err  error
+	// Closed on the first error.
+	failed chan struct{}
+}
+
+// The output of a task is a sequence of pieces, each either a data or a sub
+// task diffed by another goroutine, in the order of a sequential diff.
+type diffTask struct {
+	par    *parallelDiff
+	opt    DiffOptions
+	pieces []diffPiece
+}
+
+type diffPiece struct {
+	data  interface{}
+	child *diffTask
 }
 
 type diffData struct {
@@ -48,9 +82,85 @@ func DiffTrees(roots []string, opt *DiffOptions) error {
 		trees[i] = root
 	}
 
+	if opt.Workers > 1 && opt.NewData != nil && opt.MergeData != nil {
+		return diffTreesParallel(trees, opt)
+	}
 	return diffTreesRecursive(trees, "", opt)
 }
 
+func diffTreesParallel(trees []*fsmgr.SeafDir, opt *DiffOptions) error {
+	// The calling goroutine diffs the root task.
+	par := &parallelDiff{
+		sem:    make(chan struct{}, opt.Workers-1),
+		failed: make(chan struct{}),
+	}
+	root := newDiffTask(par, opt)
+	err := diffTreesRecursive(trees, "", &root.opt)
+	if err != nil {
+		par.setErr(err)
+	}
+	par.wg.Wait()
+
+	root.merge(opt.Data, opt.MergeData)
+	return par.err
+}
+
+func (par *parallelDiff) setErr(err error) {
+	par.once.Do(func() {
+		par.err = err
+		close(par.failed)
+	})
+}
+
+func newDiffTask(par *parallelDiff, opt *DiffOptions) *diffTask {
+	task := &diffTask{par: par, opt: *opt}
+	task.opt.task = task
+	task.addData()
+	return task
+}
+
+func (task *diffTask) addData() {
+	task.opt.Data = task.opt.NewData()
+	task.pieces = append(task.pieces, diffPiece{data: task.opt.Data})
+}
+
+// spawn diffs subDirs in a new goroutine if one is available.
+func (task *diffTask) spawn(subDirs []*fsmgr.SeafDir, baseDir string) bool {
+	par := task.par
+	select {
+	case par.sem <- struct{}{}:
+	default:
+		return false
+	}
+
+	child := newDiffTask(par, &task.opt)
+	task.pieces = append(task.pieces, diffPiece{child: child})
+	// What this task finds next comes after the sub tree.
+	task.addData()
+
+	par.wg.Add(1)
+	go func() {
+		defer func() {
+			<-par.sem
+			par.wg.Done()
+		}()
+		if err := diffTreesRecursive(subDirs, baseDir, &child.opt); err != nil {
+			par.setErr(err)
+		}
+	}()
+	return true
+}
+
+func (task *diffTask) merge(data interface{}, mergeData func(data, part interface{})) {
+	for _, piece := range task.pieces {
+		if piece.child != nil {
+			piece.child.merge(data, mergeData)
+		} else {
+			mergeData(data, piece.data)
+		}
+	}
+}
+
 func diffTreesRecursive(trees []*fsmgr.SeafDir, baseDir string, opt *DiffOptions) error {
 	n := len(trees)
 	ptrs := make([][]*fsmgr.SeafDirent, 3)
@@ -151,6 +261,14 @@ func diffDirectories(baseDir string, dents []*fsmgr.SeafDirent, opt *DiffOptions
 		return nil
 	}
 
+	if opt.task != nil {
+		select {
+		case <-opt.task.par.failed:
+			return opt.task.par.err
+		default:
+		}
+	}
+
 	recurse := true
 	err := opt.DirCB(opt.Ctx, baseDir, dirs, opt.Data, &recurse)
 	if err != nil {
@@ -176,6 +294,9 @@ func diffDirectories(baseDir string, dents []*fsmgr.SeafDirent, opt *DiffOptions
 	}
 
 	newBaseDir := baseDir + dirName + "/"
+	if opt.task != nil && opt.task.spawn(subDirs, newBaseDir) {
+		return nil
+	}
 	return diffTreesRecursive(subDirs, newBaseDir, opt)
 }
 
@@ -313,6 +434,16 @@ func DiffCommitRoots(storeID, p1Root, p2Root string, results *[]*DiffEntry, fold
 }
 
 func DiffCommits(commit1, commit2 *commitmgr.Commit, results *[]*DiffEntry, foldDirDiff bool) error {
+	return diffCommits(commit1, commit2, results, foldDirDiff, true)
+}
+
+// DiffCommitsNoRenames is like DiffCommits, but renamed files are reported
+// as deleted and added. It's for callers that only sum up the changes.
+func DiffCommitsNoRenames(commit1, commit2 *commitmgr.Commit, results *[]*DiffEntry, foldDirDiff bool) error {
+	return diffCommits(commit1, commit2, results, foldDirDiff, false)
+}
+
+func diffCommits(commit1, commit2 *commitmgr.Commit, results *[]*DiffEntry, foldDirDiff, resolveRenames bool) error {
 	repo := repomgr.Get(commit1.RepoID)
 	if repo == nil {
 		err := fmt.Errorf("failed to get repo %s", commit1.RepoID)
@@ -332,7 +463,9 @@ func DiffCommits(commit1, commit2 *commitmgr.Commit, results *[]*DiffEntry, fold
 		return err
 	}
 
-	diffResolveRenames(results)
+	if resolveRenames {
+		diffResolveRenames(results)
+	}
 
 	return nil
 }
@@ -403,115 +536,91 @@ func twowayDiffDirs(ctx context.Context, baseDir string, dents []*fsmgr.SeafDire
 	return nil
 }
 
+// diffResolveRenames pairs deleted and added entries of the same content
+// into renames, in one pass to index the deleted entries and one over the
+// added ones. Renames come first, in the order of the added entries, the
+// other entries keep their order. Empty files and dirs are only paired if
+// there is one deleted and one added.
 func diffResolveRenames(des *[]*DiffEntry) error {
+	entries := *des
+	if len(entries) == 0 {
+		return nil
+	}
+
 	var deletedEmptyCount, deletedEmptyDirCount, addedEmptyCount, addedEmptyDirCount int
-	for _, de := range *des {
+	emptyFileIdx, emptyDirIdx := -1, -1
+	deletedFiles := make(map[string]int)
+	deletedDirs := make(map[string]int)
+	for i, de := range entries {
 		if de.Sha1 == EmptySha1 {
-			if de.Status == DiffStatusDeleted {
+			switch de.Status {
+			case DiffStatusDeleted:
 				deletedEmptyCount++
-			}
-			if de.Status == DiffStatusDirDeleted {
+				emptyFileIdx = i
+			case DiffStatusDirDeleted:
 				deletedEmptyDirCount++
-			}
-			if de.Status == DiffStatusAdded {
+				emptyDirIdx = i
+			case DiffStatusAdded:
 				addedEmptyCount++
-			}
-			if de.Status == DiffStatusDirAdded {
+			case DiffStatusDirAdded:
 				addedEmptyDirCount++
 			}
+			continue
 		}
-	}
-
-	deletedFiles := make(map[string]*DiffEntry)
-	deletedDirs := make(map[string]*DiffEntry)
-	var results []*DiffEntry
-	var added []*DiffEntry
-
-	checkEmptyDir := (deletedEmptyDirCount == 1 && addedEmptyDirCount == 1)
-	checkEmptyFile := (deletedEmptyCount == 1 && addedEmptyCount == 1)
 
-	for _, de := range *des {
 		if de.Status == DiffStatusDeleted {
-			if de.Sha1 == EmptySha1 && !checkEmptyFile {
-				results = append(results, de)
-				continue
-			}
-			deletedFiles[de.Sha1] = de
-		}
-
-		if de.Status == DiffStatusDirDeleted {
-			if de.Sha1 == EmptySha1 && !checkEmptyDir {
-				results = append(results, de)
-				continue
-			}
-			deletedDirs[de.Sha1] = de
-		}
-
-		if de.Status == DiffStatusAdded {
-			if de.Sha1 == EmptySha1 && !checkEmptyFile {
-				results = append(results, de)
-				continue
-			}
-			added = append(added, de)
-		}
-
-		if de.Status == DiffStatusDirAdded {
-			if de.Sha1 == EmptySha1 && !checkEmptyDir {
-				results = append(results, de)
-				continue
-			}
-
-			added = append(added, de)
+			deletedFiles[de.Sha1] = i
+		} else if de.Status == DiffStatusDirDeleted {
+			deletedDirs[de.Sha1] = i
 		}
+	}
 
-		if de.Status == DiffStatusModified {
-			results = append(results, de)
-		}
+	if deletedEmptyCount == 1 && addedEmptyCount == 1 {
+		deletedFiles[EmptySha1] = emptyFileIdx
+	}
+	if deletedEmptyDirCount == 1 && addedEmptyDirCount == 1 {
+		deletedDirs[EmptySha1] = emptyDirIdx
 	}
 
-	for _, de := range added {
-		var deAdd, deDel, deRename *DiffEntry
+	paired := make([]bool, len(entries))
+	var renames []*DiffEntry
+	for i, de := range entries {
+		var deleted map[string]int
 		var renameStatus rune
-
-		deAdd = de
-		if deAdd.Status == DiffStatusAdded {
-			deTmp, ok := deletedFiles[de.Sha1]
-			if !ok {
-				results = append(results, deAdd)
-				continue
-			}
-			deDel = deTmp
+		if de.Status == DiffStatusAdded {
+			deleted = deletedFiles
+			renameStatus = DiffStatusRenamed
+		} else if de.Status == DiffStatusDirAdded {
+			deleted = deletedDirs
+			renameStatus = DiffStatusDirRenamed
 		} else {
-			deTmp, ok := deletedDirs[de.Sha1]
-			if !ok {
-				results = append(results, deAdd)
-				continue
-			}
-			deDel = deTmp
+			continue
 		}
 
-		if deAdd.Status == DiffStatusDirAdded {
-			renameStatus = DiffStatusDirRenamed
-		} else {
-			renameStatus = DiffStatusRenamed
+		delIdx, ok := deleted[de.Sha1]
+		if !ok {
+			continue
 		}
+		delete(deleted, de.Sha1)
 
-		deRename = diffEntryNew(deDel.DiffType, renameStatus, deDel.Sha1, deDel.Name)
+		deDel := entries[delIdx]
+		deRename := diffEntryNew(deDel.DiffType, renameStatus, deDel.Sha1, deDel.Name)
 		deRename.NewName = de.Name
-		results = append(results, deRename)
-		if deDel.Status == DiffStatusDirDeleted {
-			delete(deletedDirs, deAdd.Sha1)
-		} else {
-			delete(deletedFiles, deAdd.Sha1)
-		}
+		renames = append(renames, deRename)
+		paired[i] = true
+		paired[delIdx] = true
 	}
 
-	for _, de := range deletedFiles {
-		results = append(results, de)
+	if len(renames) == 0 {
+		return nil
 	}
 
-	for _, de := range deletedDirs {
-		results = append(results, de)
+	results := make([]*DiffEntry, 0, len(entries)-len(renames))
+	results = append(results, renames...)
+	for i, de := range entries {
+		if !paired[i] {
+			results = append(results, de)
+		}
 	}
 	*des = results
 
@@ -223,6 +223,72 @@ func testDiffTrees5(t *testing.T) {
 	}
 }
 
+func TestDiffTreesParallel(t *testing.T) {
+	fsmgr.Init(diffTestSeafileConfPath, diffTestSeafileDataDir)
+	defer diffTestDelFile()
+
+	modeDir := uint32(syscall.S_IFDIR | 0644)
+	modeFile := uint32(syscall.S_IFREG | 0644)
+
+	// Three levels of directories, each with a file and three sub-directories.
+	size := int64(100)
+	var createTree func(depth int) string
+	createTree = func(depth int) string {
+		size++
+		file, err := fsmgr.NewSeafile(1, size, []string{fmt.Sprintf("%040d", size)})
+		if err != nil {
+			t.Fatalf("failed to new seafile: %v", err)
+		}
+		if err := fsmgr.SaveSeafile(diffTestRepoID, file); err != nil {
+			t.Fatalf("failed to save seafile: %v", err)
+		}
+		dents := []*fsmgr.SeafDirent{{ID: file.FileID, Name: "file", Mode: modeFile, Size: size}}
+		if depth > 0 {
+			for _, name := range []string{"c", "b", "a"} {
+				dents = append(dents, &fsmgr.SeafDirent{ID: createTree(depth - 1), Name: name, Mode: modeDir})
+			}
+		}
+		dir, err := diffTestCreateSeafdir(dents)
+		if err != nil {
+			t.Fatalf("failed to create seafdir: %v", err)
+		}
+		return dir
+	}
+	tree := createTree(3)
+
+	diffTree := func(workers int) []interface{} {
+		var results []interface{}
+		opt := &DiffOptions{
+			FileCB:  diffTestFileCB,
+			DirCB:   diffTestDirCB,
+			RepoID:  diffTestRepoID,
+			Workers: workers,
+			NewData: func() interface{} { return new([]interface{}) },
+			MergeData: func(data, part interface{}) {
+				results := data.(*[]interface{})
+				*results = append(*results, *part.(*[]interface{})...)
+			},
+		}
+		opt.Data = &results
+		if err := DiffTrees([]string{tree, emptySHA1}, opt); err != nil {
+			t.Fatalf("failed to diff trees: %v", err)
+		}
+		return results
+	}
+
+	expected := diffTree(1)
+	// 40 files and 39 sub-directories.
+	if len(expected) != 79 {
+		t.Fatalf("data length is %d not 79", len(expected))
+	}
+	for i := 0; i < 10; i++ {
+		results := diffTree(4)
+		if fmt.Sprint(results) != fmt.Sprint(expected) {
+			t.Fatalf("parallel diff result %v != %v", results, expected)
+		}
+	}
+}
+
 func diffTestCreateSeafdir(dents []*fsmgr.SeafDirent) (string, error) {
 	seafdir, err := fsmgr.NewSeafdir(1, dents)
 	if err != nil {
@@ -280,3 +346,85 @@ func diffTestDirCB(ctx context.Context, baseDir string, dirs []*fsmgr.SeafDirent
 
 	return nil
 }
+
+// diffBenchCreateTree saves a tree of 100 dirs with 100 files each. The
+// files of the 10 dirs from changedFrom get other ids than in the base tree.
+func diffBenchCreateTree(b *testing.B, changedFrom int) string {
+	modeDir := uint32(syscall.S_IFDIR | 0644)
+	modeFile := uint32(syscall.S_IFREG | 0644)
+
+	var dirs []*fsmgr.SeafDirent
+	for i := 99; i >= 0; i-- {
+		seed := uint64(i) * 100
+		if changedFrom >= 0 && i >= changedFrom && i < changedFrom+10 {
+			seed += uint64(changedFrom+1) * 10000
+		}
+		var files []*fsmgr.SeafDirent
+		for j := 99; j >= 0; j-- {
+			id := fmt.Sprintf("%040x", (seed+uint64(j))*0x9e3779b97f4a7c15)
+			files = append(files, &fsmgr.SeafDirent{ID: id, Name: fmt.Sprintf("file%06d.txt", j), Mode: modeFile, Size: 1 << 20})
+		}
+		dir, err := diffTestCreateSeafdir(files)
+		if err != nil {
+			b.Fatalf("failed to create seafdir: %v", err)
+		}
+		dirs = append(dirs, &fsmgr.SeafDirent{ID: dir, Name: fmt.Sprintf("dir%04d", i), Mode: modeDir})
+	}
+	root, err := diffTestCreateSeafdir(dirs)
+	if err != nil {
+		b.Fatalf("failed to create seafdir: %v", err)
+	}
+	return root
+}
+
+func BenchmarkDiffTrees(b *testing.B) {
+	fsmgr.Init(diffTestSeafileConfPath, diffTestSeafileDataDir)
+	defer diffTestDelFile()
+
+	base := diffBenchCreateTree(b, -1)
+	head := diffBenchCreateTree(b, 0)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		var results []interface{}
+		opt := &DiffOptions{
+			FileCB: diffTestFileCB,
+			DirCB:  diffTestDirCB,
+			RepoID: diffTestRepoID}
+		opt.Data = &results
+		if err := DiffTrees([]string{head, base}, opt); err != nil {
+			b.Fatalf("failed to diff trees: %v", err)
+		}
+		// 1000 files and their 10 dirs.
+		if len(results) != 1010 {
+			b.Fatalf("data length is %d not 1010", len(results))
+		}
+	}
+}
+
+func TestDiffResolveRenames(t *testing.T) {
+	id1 := "1111111111111111111111111111111111111111"
+	id2 := "2222222222222222222222222222222222222222"
+	results := []*DiffEntry{
+		diffEntryNew(DiffTypeCommits, DiffStatusModified, id2, "/m"),
+		diffEntryNew(DiffTypeCommits, DiffStatusDeleted, id1, "/a"),
+		diffEntryNew(DiffTypeCommits, DiffStatusAdded, id2, "/c"),
+		diffEntryNew(DiffTypeCommits, DiffStatusAdded, id1, "/b"),
+		// Empty files are only paired if there is one of each.
+		diffEntryNew(DiffTypeCommits, DiffStatusDeleted, emptySHA1, "/e1"),
+		diffEntryNew(DiffTypeCommits, DiffStatusAdded, emptySHA1, "/e2"),
+		diffEntryNew(DiffTypeCommits, DiffStatusAdded, emptySHA1, "/e3"),
+	}
+
+	diffResolveRenames(&results)
+
+	var got []string
+	for _, de := range results {
+		got = append(got, fmt.Sprintf("%c%s%s", de.Status, de.Name, de.NewName))
+	}
+	want := fmt.Sprintf("[%c/a/b %c/m %c/c %c/e1 %c/e2 %c/e3]",
+		DiffStatusRenamed, DiffStatusModified, DiffStatusAdded,
+		DiffStatusDeleted, DiffStatusAdded, DiffStatusAdded)
+	if fmt.Sprint(got) != want {
+		t.Errorf("resolved %v, want %s", got, want)
+	}
+}
@@ -0,0 +1,92 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// Statistics and repo events are published in batches, as the C fileserver
+// does. Statistics are summed up per (operation, user, repo) and identical
+// repo events are published once in each flush interval.
+
+const eventsFlushInterval = 10 * time.Second
+
+type statsKey struct {
+	eType  string
+	user   string
+	repoID string
+}
+
+type eventBatch struct {
+	mu         sync.Mutex
+	stats      map[statsKey]uint64
+	repoEvents map[string]struct{}
+}
+
+func newEventBatch() *eventBatch {
+	return &eventBatch{
+		stats:      make(map[statsKey]uint64),
+		repoEvents: make(map[string]struct{}),
+	}
+}
+
+func (b *eventBatch) addStats(rData *statusEventData) {
+	key := statsKey{rData.eType, rData.user, rData.repoID}
+	b.mu.Lock()
+	b.stats[key] += rData.bytes
+	b.mu.Unlock()
+}
+
+func (b *eventBatch) addRepoEvent(buf string) {
+	b.mu.Lock()
+	b.repoEvents[buf] = struct{}{}
+	b.mu.Unlock()
+}
+
+// take returns the pending repo events and formatted statistics, and
+// empties the batch.
+func (b *eventBatch) take() (repoEvents, stats []string) {
+	b.mu.Lock()
+	pendingStats := b.stats
+	pendingEvents := b.repoEvents
+	b.stats = make(map[statsKey]uint64)
+	b.repoEvents = make(map[string]struct{})
+	b.mu.Unlock()
+
+	for buf := range pendingEvents {
+		repoEvents = append(repoEvents, buf)
+	}
+	for key, bytes := range pendingStats {
+		buf := fmt.Sprintf("%s\t%s\t%s\t%d", key.eType, key.user, key.repoID, bytes)
+		stats = append(stats, buf)
+	}
+	return repoEvents, stats
+}
+
+var pendingEvents = newEventBatch()
+
+func eventBatchInit() {
+	ticker := time.NewTicker(eventsFlushInterval)
+	go RecoverWrapper(func() {
+		for range ticker.C {
+			flushPendingEvents()
+		}
+	})
+}
+
+func flushPendingEvents() {
+	repoEvents, stats := pendingEvents.take()
+	for _, buf := range repoEvents {
+		if _, err := rpcclient.Call("publish_event", seafileServerChannelEvent, buf); err != nil {
+			log.Printf("Failed to publish event: %v", err)
+		}
+	}
+	for _, buf := range stats {
+		if _, err := rpcclient.Call("publish_event", seafileServerChannelStats, buf); err != nil {
+			log.Printf("Failed to publish event: %v", err)
+		}
+	}
+}
@@ -0,0 +1,33 @@
+package main
+
+import (
+	"reflect"
+	"sort"
+	"testing"
+)
+
+func TestEventBatch(t *testing.T) {
+	b := newEventBatch()
+	b.addStats(&statusEventData{"web-file-download", "a@b.c", "repo1", 10})
+	b.addStats(&statusEventData{"web-file-download", "a@b.c", "repo1", 5})
+	b.addStats(&statusEventData{"sync-file-upload", "a@b.c", "repo1", 7})
+	b.addRepoEvent("repo-download-sync\ta@b.c")
+	b.addRepoEvent("repo-download-sync\ta@b.c")
+
+	repoEvents, stats := b.take()
+	sort.Strings(stats)
+	expected := []string{
+		"sync-file-upload\ta@b.c\trepo1\t7",
+		"web-file-download\ta@b.c\trepo1\t15",
+	}
+	if !reflect.DeepEqual(stats, expected) {
+		t.Errorf("stats are %q", stats)
+	}
+	if !reflect.DeepEqual(repoEvents, []string{"repo-download-sync\ta@b.c"}) {
+		t.Errorf("repo events are %q", repoEvents)
+	}
+
+	if repoEvents, stats := b.take(); len(repoEvents) != 0 || len(stats) != 0 {
+		t.Errorf("batch not emptied: %q %q", repoEvents, stats)
+	}
+}
@@ -4,7 +4,6 @@ import (
 	"archive/zip"
 	"bytes"
 	"context"
-	"crypto/sha1"
 	"encoding/hex"
 	"encoding/json"
 	"errors"
@@ -18,7 +17,6 @@ import (
 	"net/url"
 	"os"
 	"path/filepath"
-	"runtime/debug"
 	"strconv"
 	"strings"
 	"sync"
@@ -30,11 +28,13 @@ import (
 	"sort"
 	"syscall"
 
+	"github.com/haiwen/seafile-server/fileserver/blockhash"
 	"github.com/haiwen/seafile-server/fileserver/blockmgr"
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
 	"github.com/haiwen/seafile-server/fileserver/diff"
 	"github.com/haiwen/seafile-server/fileserver/fsmgr"
 	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	"github.com/haiwen/seafile-server/fileserver/share"
 	log "github.com/sirupsen/logrus"
 	"golang.org/x/text/unicode/norm"
 )
@@ -67,6 +67,7 @@ func fileopInit() {
 	go RecoverWrapper(func() {
 		for range ticker.C {
 			removeFileopExpireCache()
+			usedNonces.removeExpired(time.Now().Unix())
 		}
 	})
 }
@@ -74,6 +75,9 @@ func fileopInit() {
 func initUpload() {
 	objDir := filepath.Join(dataDir, "httptemp", "cluster-shared")
 	os.MkdirAll(objDir, os.ModePerm)
+
+	chunker = newChunkerPool(int(options.maxIndexingThreads), int64(options.fixedBlockSize))
+	initUploadMemory()
 }
 
 //contentType = "application/octet-stream"
@@ -132,6 +136,7 @@ func accessCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	if err != nil {
 		return err
 	}
+	labelProfile(r, accessInfo.op, accessInfo.repoID)
 
 	repoID := accessInfo.repoID
 	op := accessInfo.op
@@ -175,8 +180,8 @@ func accessCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{nil, msg, http.StatusBadRequest}
 	}
 
-	if !repo.IsEncrypted && len(byteRanges) != 0 {
-		if err := doFileRange(rsp, r, repo, objID, fileName, op, byteRanges, user); err != nil {
+	if len(byteRanges) != 0 {
+		if err := doFileRange(rsp, r, repo, objID, fileName, op, byteRanges, cryptKey, user); err != nil {
 			return err
 		}
 	} else if err := doFile(rsp, r, repo, objID, fileName, op, cryptKey, user); err != nil {
@@ -253,31 +258,46 @@ func doFile(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, fileID
 		return nil
 	}
 
-	if cryptKey != nil {
-		for _, blkID := range file.BlkIDs {
-			var buf bytes.Buffer
+	w := limitWriter(r.Context(), rsp, user, repo.ID)
+	if options.downloadReadAhead > 0 && file.NumBlocks() > 1 {
+		if !sendBlocksAhead(r.Context(), w, repo.StoreID, file, cryptKey) {
+			return nil
+		}
+		if cryptKey != nil {
+			return nil
+		}
+	} else if cryptKey != nil {
+		// The buffer is reused for all blocks and decrypted in place.
+		var buf bytes.Buffer
+		for i := 0; i < file.NumBlocks(); i++ {
+			blkID := file.BlockID(i)
+			if chargeBlock(w) != nil {
+				return nil
+			}
+			buf.Reset()
 			blockmgr.Read(repo.StoreID, blkID, &buf)
-			decoded, err := cryptKey.decrypt(buf.Bytes())
+			decoded, err := cryptKey.decryptInPlace(buf.Bytes())
 			if err != nil {
 				err := fmt.Errorf("failed to decrypt block %s: %v", blkID, err)
 				return &appError{err, "", http.StatusInternalServerError}
 			}
-			_, err = rsp.Write(decoded)
+			_, err = w.Write(decoded)
 			if err != nil {
 				log.Printf("failed to write block %s to response: %v", blkID, err)
 				return nil
 			}
 		}
 		return nil
-	}
-
-	for _, blkID := range file.BlkIDs {
-		err := blockmgr.Read(repo.StoreID, blkID, rsp)
-		if err != nil {
-			if !isNetworkErr(err) {
-				log.Printf("failed to read block %s: %v", blkID, err)
+	} else {
+		for i := 0; i < file.NumBlocks(); i++ {
+			blkID := file.BlockID(i)
+			err := sendBlock(w, repo.StoreID, blkID, 0, -1)
+			if err != nil {
+				if !isNetworkErr(err) {
+					log.Printf("failed to read block %s: %v", blkID, err)
+				}
+				return nil
 			}
-			return nil
 		}
 	}
 
@@ -292,6 +312,32 @@ func doFile(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, fileID
 	return nil
 }
 
+// sendBlock writes n bytes of a block starting from offset to w, or the rest
+// of the block if n is negative. Blocks in local files are copied with
+// io.Copy from an *os.File, so writing to an HTTP response uses sendfile.
+func sendBlock(w io.Writer, repoID string, blkID string, offset int64, n int64) error {
+	if err := chargeBlock(w); err != nil {
+		return err
+	}
+	blk, err := blockmgr.Open(repoID, blkID)
+	if err != nil {
+		return err
+	}
+	defer blk.Close()
+
+	if offset > 0 {
+		if _, err := blk.Seek(offset, io.SeekStart); err != nil {
+			return err
+		}
+	}
+	if n < 0 {
+		_, err = io.Copy(w, blk)
+	} else {
+		_, err = io.CopyN(w, blk, n)
+	}
+	return err
+}
+
 func isNetworkErr(err error) bool {
 	_, ok := err.(net.Error)
 	if ok {
@@ -301,12 +347,75 @@ func isNetworkErr(err error) bool {
 }
 
 type blockMap struct {
-	blkSize    []uint64
+	blkSize []uint64
+	// offsets[i] is where block i starts in the file.
+	offsets    []uint64
 	expireTime int64
 }
 
+func newBlockMap(blkSize []uint64) *blockMap {
+	offsets := make([]uint64, len(blkSize))
+	var off uint64
+	for i, size := range blkSize {
+		offsets[i] = off
+		off += size
+	}
+	return &blockMap{blkSize, offsets, time.Now().Unix() + blockMapCacheExpiretime}
+}
+
+// findBlock returns the index of the block holding byte offset of the file
+// and the position of the byte in the block.
+func (m *blockMap) findBlock(offset uint64) (int, uint64) {
+	i := sort.Search(len(m.offsets), func(i int) bool {
+		return m.offsets[i] > offset
+	}) - 1
+	if i < 0 {
+		return 0, offset
+	}
+	return i, offset - m.offsets[i]
+}
+
+// getBlockMap returns the block map of a file, read from the block map
+// store or built from the block metadata. Maps of large files are also kept
+// in memory, since their ranges are usually read one after another.
+func getBlockMap(storeID string, file *fsmgr.Seafile) (*blockMap, error) {
+	if v, ok := blockMapCacheTable.Load(file.FileID); ok {
+		if blkMap, ok := v.(*blockMap); ok {
+			return blkMap, nil
+		}
+	}
+
+	sizes, ok := fsmgr.GetBlockMap(storeID, file)
+	if !ok {
+		sizes = nil
+		for i := 0; i < file.NumBlocks(); i++ {
+			v := file.BlockID(i)
+			size, err := blockmgr.Stat(storeID, v)
+			if err != nil {
+				err := fmt.Errorf("failed to stat block %s : %v", v, err)
+				return nil, err
+			}
+			sizes = append(sizes, size)
+		}
+		if err := fsmgr.SaveBlockMap(storeID, file.FileID, sizes); err != nil {
+			log.Printf("Failed to save block map: %v", err)
+		}
+	}
+
+	blkSize := make([]uint64, len(sizes))
+	for i, size := range sizes {
+		blkSize[i] = uint64(size)
+	}
+	blkMap := newBlockMap(blkSize)
+	if file.FileSize > cacheBlockMapThreshold {
+		blockMapCacheTable.Store(file.FileID, blkMap)
+	}
+
+	return blkMap, nil
+}
+
 func doFileRange(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, fileID string,
-	fileName string, operation string, byteRanges string, user string) *appError {
+	fileName string, operation string, byteRanges string, cryptKey *seafileCrypt, user string) *appError {
 
 	file, err := fsmgr.GetSeafile(repo.StoreID, fileID)
 	if err != nil {
@@ -319,7 +428,7 @@ func doFileRange(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, f
 		return nil
 	}
 
-	start, end, ok := parseRange(byteRanges, file.FileSize)
+	ranges, ok := parseRanges(byteRanges, file.FileSize)
 	if !ok {
 		conRange := fmt.Sprintf("bytes */%d", file.FileSize)
 		rsp.Header().Set("Content-Range", conRange)
@@ -330,128 +439,36 @@ func doFileRange(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, f
 
 	setCommonHeaders(rsp, r, operation, fileName)
 
-	//filesize string
-	conLen := fmt.Sprintf("%d", end-start+1)
-	rsp.Header().Set("Content-Length", conLen)
-
-	conRange := fmt.Sprintf("bytes %d-%d/%d", start, end, file.FileSize)
-	rsp.Header().Set("Content-Range", conRange)
-
-	rsp.WriteHeader(http.StatusPartialContent)
-
-	var blkSize []uint64
-	if file.FileSize > cacheBlockMapThreshold {
-		if v, ok := blockMapCacheTable.Load(file.FileID); ok {
-			if blkMap, ok := v.(*blockMap); ok {
-				blkSize = blkMap.blkSize
-			}
-		}
-		if len(blkSize) == 0 {
-			for _, v := range file.BlkIDs {
-				size, err := blockmgr.Stat(repo.StoreID, v)
-				if err != nil {
-					err := fmt.Errorf("failed to stat block %s : %v", v, err)
-					return &appError{err, "", http.StatusInternalServerError}
-				}
-				blkSize = append(blkSize, uint64(size))
-			}
-			blockMapCacheTable.Store(file.FileID, &blockMap{blkSize, time.Now().Unix() + blockMapCacheExpiretime})
-		}
+	var blkMap *blockMap
+	if cryptKey != nil {
+		blkMap, err = getPlainBlockMap(repo.StoreID, file, cryptKey)
 	} else {
-		for _, v := range file.BlkIDs {
-			size, err := blockmgr.Stat(repo.StoreID, v)
-			if err != nil {
-				err := fmt.Errorf("failed to stat block %s : %v", v, err)
-				return &appError{err, "", http.StatusInternalServerError}
-			}
-			blkSize = append(blkSize, uint64(size))
-		}
+		blkMap, err = getBlockMap(repo.StoreID, file)
 	}
-
-	var off uint64
-	var pos uint64
-	var startBlock int
-	for i, v := range blkSize {
-		pos = start - off
-		off += v
-		if off > start {
-			startBlock = i
-			break
-		}
+	if err != nil {
+		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	// Read block from the start block and specified position
-	var i int
-	for ; i < len(file.BlkIDs); i++ {
-		if i < startBlock {
-			continue
-		}
+	w := limitWriter(r.Context(), rsp, user, repo.ID)
+	if len(ranges) == 1 {
+		start, end := ranges[0].start, ranges[0].end
+		//filesize string
+		conLen := fmt.Sprintf("%d", end-start+1)
+		rsp.Header().Set("Content-Length", conLen)
 
-		blkID := file.BlkIDs[i]
-		var buf bytes.Buffer
-		if end-start+1 <= blkSize[i]-pos {
-			err := blockmgr.Read(repo.StoreID, blkID, &buf)
-			if err != nil {
-				if !isNetworkErr(err) {
-					log.Printf("failed to read block %s: %v", blkID, err)
-				}
-				return nil
-			}
-			recvBuf := buf.Bytes()
-			_, err = rsp.Write(recvBuf[pos : pos+end-start+1])
-			if err != nil {
-				log.Printf("failed to write block %s to response: %v", blkID, err)
-			}
-			return nil
-		}
+		conRange := fmt.Sprintf("bytes %d-%d/%d", start, end, file.FileSize)
+		rsp.Header().Set("Content-Range", conRange)
 
-		err := blockmgr.Read(repo.StoreID, blkID, &buf)
-		if err != nil {
+		rsp.WriteHeader(http.StatusPartialContent)
+
+		if err := sendFileRange(w, repo.StoreID, file, blkMap, cryptKey, start, end); err != nil {
 			if !isNetworkErr(err) {
-				log.Printf("failed to read block %s: %v", blkID, err)
+				log.Printf("failed to send range of file %s: %v", fileID, err)
 			}
 			return nil
 		}
-		recvBuf := buf.Bytes()
-		_, err = rsp.Write(recvBuf[pos:])
-		if err != nil {
-			log.Printf("failed to write block %s to response: %v", blkID, err)
-			return nil
-		}
-		start += blkSize[i] - pos
-		i++
-		break
-	}
-
-	// Always read block from the remaining block and pos=0
-	for ; i < len(file.BlkIDs); i++ {
-		blkID := file.BlkIDs[i]
-		var buf bytes.Buffer
-		if end-start+1 <= blkSize[i] {
-			err := blockmgr.Read(repo.StoreID, blkID, &buf)
-			if err != nil {
-				if !isNetworkErr(err) {
-					log.Printf("failed to read block %s: %v", blkID, err)
-				}
-				return nil
-			}
-			recvBuf := buf.Bytes()
-			_, err = rsp.Write(recvBuf[:end-start+1])
-			if err != nil {
-				log.Printf("failed to write block %s to response: %v", blkID, err)
-				return nil
-			}
-			break
-		} else {
-			err := blockmgr.Read(repo.StoreID, blkID, rsp)
-			if err != nil {
-				if !isNetworkErr(err) {
-					log.Printf("failed to read block %s: %v", blkID, err)
-				}
-				return nil
-			}
-			start += blkSize[i]
-		}
+	} else if !sendByteRanges(rsp, w, repo.StoreID, file, blkMap, cryptKey, ranges) {
+		return nil
 	}
 
 	oper := "web-file-download"
@@ -463,25 +480,76 @@ func doFileRange(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, f
 	return nil
 }
 
-func parseRange(byteRanges string, fileSize uint64) (uint64, uint64, bool) {
-	start := strings.Index(byteRanges, "=")
-	end := strings.Index(byteRanges, "-")
+// At most maxByteRanges spans are sent in a multipart/byteranges response.
+// Overlapping and adjacent ranges are merged first. If there are still more,
+// the whole span from the first to the last range is sent.
+const maxByteRanges = 64
+
+type byteRange struct {
+	start uint64
+	end   uint64
+}
+
+// parseRanges parses a Range header of one or more ranges.
+func parseRanges(byteRanges string, fileSize uint64) ([]byteRange, bool) {
+	eq := strings.Index(byteRanges, "=")
+	if eq < 0 {
+		return nil, false
+	}
+
+	var ranges []byteRange
+	for _, spec := range strings.Split(byteRanges[eq+1:], ",") {
+		start, end, ok := parseRangeSpec(strings.TrimSpace(spec), fileSize)
+		if !ok {
+			return nil, false
+		}
+		ranges = append(ranges, byteRange{start, end})
+	}
+	if len(ranges) == 1 {
+		return ranges, true
+	}
+
+	sort.Slice(ranges, func(i, j int) bool { return ranges[i].start < ranges[j].start })
+	merged := ranges[:1]
+	for _, rg := range ranges[1:] {
+		last := &merged[len(merged)-1]
+		if rg.start <= last.end+1 {
+			if rg.end > last.end {
+				last.end = rg.end
+			}
+			continue
+		}
+		merged = append(merged, rg)
+	}
+	if len(merged) > maxByteRanges {
+		merged = []byteRange{{merged[0].start, merged[len(merged)-1].end}}
+	}
 
-	if end < 0 {
+	return merged, true
+}
+
+// parseRangeSpec parses a single range of a Range header: -num, num- or
+// num-num.
+func parseRangeSpec(spec string, fileSize uint64) (uint64, uint64, bool) {
+	minus := strings.Index(spec, "-")
+	if minus < 0 {
 		return 0, 0, false
 	}
 
 	var startByte, endByte uint64
 
-	if start+1 == end {
-		retByte, err := strconv.ParseUint(byteRanges[end+1:], 10, 64)
+	if minus == 0 {
+		retByte, err := strconv.ParseUint(spec[minus+1:], 10, 64)
 		if err != nil || retByte == 0 {
 			return 0, 0, false
 		}
+		if retByte > fileSize {
+			retByte = fileSize
+		}
 		startByte = fileSize - retByte
 		endByte = fileSize - 1
-	} else if end+1 == len(byteRanges) {
-		firstByte, err := strconv.ParseUint(byteRanges[start+1:end], 10, 64)
+	} else if minus+1 == len(spec) {
+		firstByte, err := strconv.ParseUint(spec[:minus], 10, 64)
 		if err != nil {
 			return 0, 0, false
 		}
@@ -489,11 +557,11 @@ func parseRange(byteRanges string, fileSize uint64) (uint64, uint64, bool) {
 		startByte = firstByte
 		endByte = fileSize - 1
 	} else {
-		firstByte, err := strconv.ParseUint(byteRanges[start+1:end], 10, 64)
+		firstByte, err := strconv.ParseUint(spec[:minus], 10, 64)
 		if err != nil {
 			return 0, 0, false
 		}
-		lastByte, err := strconv.ParseUint(byteRanges[end+1:], 10, 64)
+		lastByte, err := strconv.ParseUint(spec[minus+1:], 10, 64)
 		if err != nil {
 			return 0, 0, false
 		}
@@ -513,6 +581,69 @@ func parseRange(byteRanges string, fileSize uint64) (uint64, uint64, bool) {
 	return startByte, endByte, true
 }
 
+// sendFileRange writes the bytes from start to end, inclusive, of file.
+// Only the blocks holding them are read. Blocks of encrypted files are
+// decrypted whole, and blkMap has their decrypted sizes.
+func sendFileRange(w io.Writer, storeID string, file *fsmgr.Seafile, blkMap *blockMap, cryptKey *seafileCrypt, start, end uint64) error {
+	i, pos := blkMap.findBlock(start)
+	remain := end - start + 1
+	for ; i < file.NumBlocks() && remain > 0; i++ {
+		n := blkMap.blkSize[i] - pos
+		if n > remain {
+			n = remain
+		}
+		var err error
+		if cryptKey != nil {
+			err = sendDecryptedBlock(w, storeID, file.BlockID(i), cryptKey, pos, n)
+		} else {
+			err = sendBlock(w, storeID, file.BlockID(i), int64(pos), int64(n))
+		}
+		if err != nil {
+			return err
+		}
+		remain -= n
+		pos = 0
+	}
+	return nil
+}
+
+// sendByteRanges writes a multipart/byteranges response to w, the body of
+// rsp. It returns false if it failed.
+func sendByteRanges(rsp http.ResponseWriter, w io.Writer, storeID string, file *fsmgr.Seafile, blkMap *blockMap, cryptKey *seafileCrypt, ranges []byteRange) bool {
+	boundary := multipart.NewWriter(ioutil.Discard).Boundary()
+	contentType := rsp.Header().Get("Content-Type")
+
+	headers := make([]string, len(ranges))
+	var length uint64
+	for i, rg := range ranges {
+		headers[i] = fmt.Sprintf("\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %d-%d/%d\r\n\r\n",
+			boundary, contentType, rg.start, rg.end, file.FileSize)
+		length += uint64(len(headers[i])) + rg.end - rg.start + 1
+	}
+	closing := fmt.Sprintf("\r\n--%s--\r\n", boundary)
+	length += uint64(len(closing))
+
+	rsp.Header().Set("Content-Type", "multipart/byteranges; boundary="+boundary)
+	rsp.Header().Set("Content-Length", fmt.Sprintf("%d", length))
+	rsp.WriteHeader(http.StatusPartialContent)
+
+	for i, rg := range ranges {
+		if _, err := io.WriteString(w, headers[i]); err != nil {
+			return false
+		}
+		if err := sendFileRange(w, storeID, file, blkMap, cryptKey, rg.start, rg.end); err != nil {
+			if !isNetworkErr(err) {
+				log.Printf("failed to send range of file %s: %v", file.FileID, err)
+			}
+			return false
+		}
+	}
+	if _, err := io.WriteString(w, closing); err != nil {
+		return false
+	}
+	return true
+}
+
 func setCommonHeaders(rsp http.ResponseWriter, r *http.Request, operation, fileName string) {
 	fileType := parseContentType(fileName)
 	if fileType != "" {
@@ -555,6 +686,7 @@ func accessBlksCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	if err != nil {
 		return err
 	}
+	labelProfile(r, accessInfo.op, accessInfo.repoID)
 	repoID := accessInfo.repoID
 	op := accessInfo.op
 	user := accessInfo.user
@@ -601,8 +733,8 @@ func doBlock(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, fileI
 	}
 
 	var found bool
-	for _, id := range file.BlkIDs {
-		if id == blkID {
+	for i := 0; i < file.NumBlocks(); i++ {
+		if file.BlockID(i) == blkID {
 			found = true
 			break
 		}
@@ -635,7 +767,7 @@ func doBlock(rsp http.ResponseWriter, r *http.Request, repo *repomgr.Repo, fileI
 	fileSize := fmt.Sprintf("%d", size)
 	rsp.Header().Set("Content-Length", fileSize)
 
-	err = blockmgr.Read(repo.StoreID, blkID, rsp)
+	err = sendBlock(limitWriter(r.Context(), rsp, user, repo.ID), repo.StoreID, blkID, 0, -1)
 	if err != nil {
 		if !isNetworkErr(err) {
 			log.Printf("failed to read block %s: %v", blkID, err)
@@ -659,6 +791,7 @@ func accessZipCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	if err != nil {
 		return err
 	}
+	labelProfile(r, accessInfo.op, accessInfo.repoID)
 
 	repoID := accessInfo.repoID
 	op := accessInfo.op
@@ -744,7 +877,14 @@ func downloadZipFile(rsp http.ResponseWriter, r *http.Request, data, repoID, use
 		rsp.Header().Set("Content-Disposition", contFileName)
 		rsp.Header().Set("Content-Type", "application/octet-stream")
 
-		for _, v := range dirList {
+		entries := make([]*fsmgr.SeafDirent, len(dirList))
+		for i := range dirList {
+			entries[i] = &dirList[i]
+		}
+		prefetcher := newFilePrefetcher(repo.StoreID, entries)
+		defer prefetcher.close()
+
+		for _, v := range entries {
 			if fsmgr.IsDir(v.Mode) {
 				if err := packDir(ar, repo, v.ID, v.Name); err != nil {
 					if !isNetworkErr(err) {
@@ -753,7 +893,7 @@ func downloadZipFile(rsp http.ResponseWriter, r *http.Request, data, repoID, use
 					return nil
 				}
 			} else {
-				if err := packFiles(ar, &v, repo, ""); err != nil {
+				if err := packFiles(ar, v, repo, "", prefetcher.take(v)); err != nil {
 					if !isNetworkErr(err) {
 						log.Printf("failed to pack file %s: %v", v.Name, err)
 					}
@@ -831,6 +971,8 @@ func packDir(ar *zip.Writer, repo *repomgr.Repo, dirID, dirPath string) error {
 	}
 
 	entries := dirent.Entries
+	prefetcher := newFilePrefetcher(repo.StoreID, entries)
+	defer prefetcher.close()
 
 	for _, v := range entries {
 		fileDir := filepath.Join(dirPath, v.Name)
@@ -840,7 +982,7 @@ func packDir(ar *zip.Writer, repo *repomgr.Repo, dirID, dirPath string) error {
 				return err
 			}
 		} else {
-			if err := packFiles(ar, v, repo, dirPath); err != nil {
+			if err := packFiles(ar, v, repo, dirPath, prefetcher.take(v)); err != nil {
 				return err
 			}
 		}
@@ -849,8 +991,16 @@ func packDir(ar *zip.Writer, repo *repomgr.Repo, dirID, dirPath string) error {
 	return nil
 }
 
-func packFiles(ar *zip.Writer, dirent *fsmgr.SeafDirent, repo *repomgr.Repo, parentPath string) error {
-	file, err := fsmgr.GetSeafile(repo.StoreID, dirent.ID)
+// packFiles packs the file of dirent. pf is the file if it was prefetched.
+func packFiles(ar *zip.Writer, dirent *fsmgr.SeafDirent, repo *repomgr.Repo, parentPath string, pf *prefetchedFile) error {
+	var file *fsmgr.Seafile
+	var err error
+	if pf != nil {
+		defer pf.release()
+		file, err = pf.file, pf.err
+	} else {
+		file, err = fsmgr.GetSeafile(repo.StoreID, dirent.ID)
+	}
 	if err != nil {
 		err := fmt.Errorf("failed to get seafile : %v", err)
 		return err
@@ -862,15 +1012,24 @@ func packFiles(ar *zip.Writer, dirent *fsmgr.SeafDirent, repo *repomgr.Repo, par
 	fileHeader := new(zip.FileHeader)
 	fileHeader.Name = filePath
 	fileHeader.Modified = time.Unix(dirent.Mtime, 0)
-	fileHeader.Method = zip.Deflate
+	if options.zipStoreOnly {
+		fileHeader.Method = zip.Store
+	} else {
+		fileHeader.Method = zip.Deflate
+	}
 	zipFile, err := ar.CreateHeader(fileHeader)
 	if err != nil {
 		err := fmt.Errorf("failed to create zip file : %v", err)
 		return err
 	}
 
-	for _, blkID := range file.BlkIDs {
-		err := blockmgr.Read(repo.StoreID, blkID, zipFile)
+	if pf != nil && pf.data != nil {
+		_, err := zipFile.Write(pf.data)
+		return err
+	}
+
+	for i := 0; i < file.NumBlocks(); i++ {
+		err := blockmgr.Read(repo.StoreID, file.BlockID(i), zipFile)
 		if err != nil {
 			return err
 		}
@@ -890,6 +1049,7 @@ type recvData struct {
 	fileNames   []string
 	files       []string
 	fileHeaders []*multipart.FileHeader
+	trace       *uploadTrace
 }
 
 func uploadAPICB(rsp http.ResponseWriter, r *http.Request) *appError {
@@ -954,10 +1114,16 @@ func normalizeUTF8Path(p string) string {
 func doUpload(rsp http.ResponseWriter, r *http.Request, fsm *recvData, isAjax bool) *appError {
 	setAccessControl(rsp)
 
-	if err := r.ParseMultipartForm(1 << 20); err != nil {
+	fsm.trace = newUploadTrace("upload")
+	defer fsm.trace.finish(fsm.repoID, r.ContentLength)
+	recvStart := time.Now()
+	releaseForm, err := parseUploadForm(r)
+	if err != nil {
 		return &appError{nil, "", http.StatusBadRequest}
 	}
+	defer releaseForm()
 	defer r.MultipartForm.RemoveAll()
+	fsm.trace.add(stageRecv, recvStart)
 
 	repoID := fsm.repoID
 	user := fsm.user
@@ -987,6 +1153,10 @@ func doUpload(rsp http.ResponseWriter, r *http.Request, fsm *recvData, isAjax bo
 			msg := "Invalid relative path"
 			return &appError{nil, msg, http.StatusBadRequest}
 		}
+		if !checkRelativePath(relativePath) {
+			msg := "Invalid relative path"
+			return &appError{nil, msg, http.StatusBadRequest}
+		}
 	}
 
 	newParentDir := filepath.Join("/", parentDir, relativePath)
@@ -1088,11 +1258,7 @@ func doUpload(rsp http.ResponseWriter, r *http.Request, fsm *recvData, isAjax bo
 		return &appError{nil, msg, seafHTTPResNoQuota}
 	}
 
-	if err := createRelativePath(repoID, parentDir, relativePath, user); err != nil {
-		return err
-	}
-
-	if err := postMultiFiles(rsp, r, repoID, newParentDir, user, fsm,
+	if err := postMultiFiles(rsp, r, repoID, parentDir, relativePath, user, fsm,
 		replaceExisted, isAjax); err != nil {
 		return err
 	}
@@ -1173,52 +1339,37 @@ func writeBlockDataToTmpFile(r *http.Request, fsm *recvData, formFiles map[strin
 	io.Copy(f, file)
 	f.Close()
 
-	return nil
-}
-
-func createRelativePath(repoID, parentDir, relativePath, user string) *appError {
-	if relativePath == "" {
-		return nil
-	}
-
-	err := mkdirWithParents(repoID, parentDir, relativePath, user)
-	if err != nil {
-		msg := "Internal error.\n"
-		err := fmt.Errorf("Failed to create parent directory: %v", err)
-		return &appError{err, msg, http.StatusInternalServerError}
+	// Indexing a chunk is only a shortcut, the tmp file is indexed instead.
+	if options.indexResumableChunks && chunkAligned(fsm.rstart, fsm.rend, fsm.fsize, chunker.blockSize) {
+		if err := indexChunk(r.Context(), repoID, fsm, handler, tmpFile); err != nil && !errors.Is(err, context.Canceled) {
+			log.Printf("failed to index chunk of %s: %v", tmpFile, err)
+		}
 	}
 
 	return nil
 }
 
-func mkdirWithParents(repoID, parentDir, newDirPath, user string) error {
-	repo := repomgr.Get(repoID)
-	if repo == nil {
-		err := fmt.Errorf("failed to get repo %s", repoID)
-		return err
-	}
-
-	headCommit, err := commitmgr.Load(repo.ID, repo.HeadCommitID)
-	if err != nil {
-		err := fmt.Errorf("failed to get head commit for repo %s", repo.ID)
-		return err
+// checkRelativePath checks the names of the dirs an upload creates.
+func checkRelativePath(relativePath string) bool {
+	for _, name := range strings.Split(getCanonPath(relativePath), "/") {
+		if name == "" || name == "." {
+			continue
+		}
+		if name == ".." || shouldIgnoreFile(name) {
+			return false
+		}
 	}
+	return true
+}
 
+// mkdirWithParents adds the dirs of newDirPath under parentDir that don't
+// exist to the tree of rootID and returns the new root. Nothing is
+// committed, so uploads create their dirs in the commit of their files.
+func mkdirWithParents(repo *repomgr.Repo, rootID, parentDir, newDirPath, user string) (string, error) {
 	relativeDirCan := getCanonPath(newDirPath)
 
 	subFolders := strings.Split(relativeDirCan, "/")
 
-	for _, name := range subFolders {
-		if name == "" {
-			continue
-		}
-		if shouldIgnoreFile(name) {
-			err := fmt.Errorf("invalid dir name %s", name)
-			return err
-		}
-	}
-
-	var rootID string
 	var parentDirCan string
 	if parentDir == "/" || parentDir == "\\" {
 		parentDirCan = "/"
@@ -1226,36 +1377,26 @@ func mkdirWithParents(repoID, parentDir, newDirPath, user string) error {
 		parentDirCan = getCanonPath(parentDir)
 	}
 
-	absPath, dirID, err := checkAndCreateDir(repo, headCommit.RootID, parentDirCan, subFolders)
+	absPath, dirID, err := checkAndCreateDir(repo, rootID, parentDirCan, subFolders)
 	if err != nil {
 		err := fmt.Errorf("failed to check and create dir: %v", err)
-		return err
+		return "", err
 	}
 	if absPath == "" {
-		return nil
+		return rootID, nil
 	}
-	newRootID := headCommit.RootID
 	mtime := time.Now().Unix()
 	mode := (syscall.S_IFDIR | 0644)
 	dent := fsmgr.NewDirent(dirID, filepath.Base(absPath), uint32(mode), mtime, "", 0)
 
 	var names []string
-	rootID, _ = doPostMultiFiles(repo, newRootID, filepath.Dir(absPath), []*fsmgr.SeafDirent{dent}, user, false, &names)
-	if rootID == "" {
+	newRootID, _ := doPostMultiFiles(repo, rootID, filepath.Dir(absPath), []*fsmgr.SeafDirent{dent}, user, false, &names)
+	if newRootID == "" {
 		err := fmt.Errorf("failed to put dir")
-		return err
-	}
-
-	buf := fmt.Sprintf("Added directory \"%s\"", relativeDirCan)
-	_, err = genNewCommit(repo, headCommit, rootID, user, buf, true)
-	if err != nil {
-		err := fmt.Errorf("failed to generate new commit: %v", err)
-		return err
+		return "", err
 	}
 
-	go mergeVirtualRepoPool.AddTask(repo.ID, "")
-
-	return nil
+	return newRootID, nil
 }
 
 func checkAndCreateDir(repo *repomgr.Repo, rootID, parentDir string, subFolders []string) (string, string, error) {
@@ -1314,7 +1455,7 @@ func genDirRecursive(repo *repomgr.Repo, toPath []string) (string, error) {
 		mode := (syscall.S_IFDIR | 0644)
 		mtime := time.Now().Unix()
 		dent := fsmgr.NewDirent("", uniqueName, uint32(mode), mtime, "", 0)
-		newdir, err := fsmgr.NewSeafdir(1, []*fsmgr.SeafDirent{dent})
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), []*fsmgr.SeafDirent{dent})
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1338,7 +1479,7 @@ func genDirRecursive(repo *repomgr.Repo, toPath []string) (string, error) {
 		mode := (syscall.S_IFDIR | 0644)
 		mtime := time.Now().Unix()
 		dent := fsmgr.NewDirent(ret, uniqueName, uint32(mode), mtime, "", 0)
-		newdir, err := fsmgr.NewSeafdir(1, []*fsmgr.SeafDirent{dent})
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), []*fsmgr.SeafDirent{dent})
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1360,6 +1501,7 @@ func clearTmpFile(fsm *recvData, parentDir string) {
 		tmpFile, err := repomgr.GetUploadTmpFile(fsm.repoID, filePath)
 		if err == nil && tmpFile != "" {
 			os.Remove(tmpFile)
+			os.Remove(tmpFile + chunkBlocksSuffix)
 		}
 		repomgr.DelUploadTmpFile(fsm.repoID, filePath)
 	}
@@ -1385,6 +1527,7 @@ func parseUploadHeaders(r *http.Request) (*recvData, *appError) {
 	if appErr != nil {
 		return nil, appErr
 	}
+	labelProfile(r, accessInfo.op, accessInfo.repoID)
 
 	repoID := accessInfo.repoID
 	op := accessInfo.op
@@ -1437,10 +1580,15 @@ func parseUploadHeaders(r *http.Request) (*recvData, *appError) {
 		parseContentRange(ranges, fsm)
 	}
 
+	// The body is read by the upload handlers.
+	r.Body = limitReadCloser(r.Context(), r.Body, user, repoID)
+
 	return fsm, nil
 }
 
-func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, user string, fsm *recvData, replace bool, isAjax bool) *appError {
+// postMultiFiles adds the uploaded files to relativePath under parentDir.
+// The dirs of relativePath that don't exist are created in the same commit.
+func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, relativePath, user string, fsm *recvData, replace bool, isAjax bool) *appError {
 
 	fileNames := fsm.fileNames
 	files := fsm.files
@@ -1451,15 +1599,13 @@ func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir,
 		return &appError{err, msg, http.StatusInternalServerError}
 	}
 
-	canonPath := getCanonPath(parentDir)
-
 	for _, fileName := range fileNames {
 		if shouldIgnoreFile(fileName) {
 			msg := fmt.Sprintf("invalid fileName: %s.\n", fileName)
 			return &appError{nil, msg, http.StatusBadRequest}
 		}
 	}
-	if strings.Index(parentDir, "//") != -1 {
+	if strings.Index(filepath.Join("/", parentDir, relativePath), "//") != -1 {
 		msg := "parent_dir contains // sequence.\n"
 		return &appError{nil, msg, http.StatusBadRequest}
 	}
@@ -1475,8 +1621,14 @@ func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir,
 
 	var ids []string
 	var sizes []int64
+	indexStart := time.Now()
 	if fsm.rstart >= 0 {
 		for _, filePath := range files {
+			if id, ok := postIndexedChunks(repo, filePath, fsm.fsize); ok {
+				ids = append(ids, id)
+				sizes = append(sizes, fsm.fsize)
+				continue
+			}
 			id, size, err := indexBlocks(r.Context(), repo.StoreID, repo.Version, filePath, nil, cryptKey)
 			if err != nil {
 				if !errors.Is(err, context.Canceled) {
@@ -1502,8 +1654,9 @@ func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir,
 			sizes = append(sizes, size)
 		}
 	}
+	fsm.trace.add(stageIndex, indexStart)
 
-	retStr, err := postFilesAndGenCommit(fileNames, repo.ID, user, canonPath, replace, ids, sizes)
+	retStr, err := postFilesAndGenCommit(fileNames, repo.ID, user, parentDir, relativePath, replace, ids, sizes, fsm.trace)
 	if err != nil {
 		err := fmt.Errorf("failed to post files and gen commit: %v", err)
 		return &appError{err, "", http.StatusInternalServerError}
@@ -1538,7 +1691,8 @@ func postMultiFiles(rsp http.ResponseWriter, r *http.Request, repoID, parentDir,
 	return nil
 }
 
-func postFilesAndGenCommit(fileNames []string, repoID string, user, canonPath string, replace bool, ids []string, sizes []int64) (string, error) {
+func postFilesAndGenCommit(fileNames []string, repoID string, user, parentDir, relativePath string, replace bool, ids []string, sizes []int64, trace *uploadTrace) (string, error) {
+	canonPath := getCanonPath(filepath.Join("/", parentDir, relativePath))
 	repo := repomgr.Get(repoID)
 	if repo == nil {
 		err := fmt.Errorf("failed to get repo %s", repoID)
@@ -1564,7 +1718,17 @@ func postFilesAndGenCommit(fileNames []string, repoID string, user, canonPath st
 	}
 
 retry:
-	rootID, err := doPostMultiFiles(repo, headCommit.RootID, canonPath, dents, user, replace, &names)
+	treeStart := time.Now()
+	rootID := headCommit.RootID
+	if relativePath != "" {
+		rootID, err = mkdirWithParents(repo, rootID, parentDir, relativePath, user)
+		if err != nil {
+			err := fmt.Errorf("failed to create parent directory: %v", err)
+			return "", err
+		}
+	}
+	rootID, err = doPostMultiFiles(repo, rootID, canonPath, dents, user, replace, &names)
+	trace.add(stageTree, treeStart)
 	if err != nil {
 		err := fmt.Errorf("failed to post files to %s in repo %s", canonPath, repo.ID)
 		return "", err
@@ -1577,13 +1741,16 @@ retry:
 		buf = fmt.Sprintf("Added \"%s\".", fileNames[0])
 	}
 
+	commitStart := time.Now()
 	_, err = genNewCommit(repo, headCommit, rootID, user, buf, false)
+	trace.add(stageCommit, commitStart)
 	if err != nil {
 		if err != ErrConflict {
 			err := fmt.Errorf("failed to generate new commit: %v", err)
 			return "", err
 		}
 		retryCnt++
+		trace.addRetry()
 		/* Sleep random time between 0 and 3 seconds. */
 		random := rand.Intn(30) + 1
 		log.Debugf("concurrent upload retry :%d", retryCnt)
@@ -1601,7 +1768,7 @@ retry:
 		goto retry
 	}
 
-	go mergeVirtualRepoPool.AddTask(repo.ID, "")
+	go scheduleMergeVirtualRepo(repo.ID, "")
 
 	retJSON, err := formatJSONRet(names, ids, sizes)
 	if err != nil {
@@ -1642,7 +1809,6 @@ func getCanonPath(p string) string {
 var ErrConflict = fmt.Errorf("Concurent upload conflict")
 
 func genNewCommit(repo *repomgr.Repo, base *commitmgr.Commit, newRoot, user, desc string, retryOnConflict bool) (string, error) {
-	var retryCnt int
 	repoID := repo.ID
 	commit := commitmgr.NewCommit(repoID, base.CommitID, newRoot, user, desc)
 	repomgr.RepoToCommit(repo, commit)
@@ -1651,120 +1817,60 @@ func genNewCommit(repo *repomgr.Repo, base *commitmgr.Commit, newRoot, user, des
 		err := fmt.Errorf("failed to add commit: %v", err)
 		return "", err
 	}
-	var commitID string
-
-	for {
-		retry, err := genCommitNeedRetry(repo, base, commit, newRoot, user, &commitID)
-		if err != nil {
-			return "", err
-		}
-		if !retry {
-			break
-		}
-		if !retryOnConflict {
-			return "", ErrConflict
-		}
 
-		if retryCnt < 3 {
-			random := rand.Intn(10) + 1
-			time.Sleep(time.Duration(random*100) * time.Millisecond)
-			repo = repomgr.Get(repoID)
-			if repo == nil {
-				err := fmt.Errorf("repo %s doesn't exist", repoID)
-				return "", err
-			}
-			retryCnt++
-		} else {
-			err := fmt.Errorf("stop updating repo %s after 3 retries", repoID)
-			return "", err
-		}
+	newCommitID, err := commitToHead(repoID, base, commit, user, retryOnConflict)
+	if err != nil {
+		return "", err
 	}
-
-	return commitID, nil
+	if desc == commitDescPending {
+		scheduleCommitDesc(repoID, repo.StoreID, commit.CommitID, newRoot, base.RootID)
+	}
+	return newCommitID, nil
 }
 
 func fastForwardOrMerge(user string, repo *repomgr.Repo, base, newCommit *commitmgr.Commit) error {
-	var retryCnt int
-	for {
-		retry, err := genCommitNeedRetry(repo, base, newCommit, newCommit.RootID, user, nil)
-		if err != nil {
-			return err
-		}
-		if !retry {
-			break
-		}
-
-		if retryCnt < 3 {
-			random := rand.Intn(10) + 1
-			time.Sleep(time.Duration(random*100) * time.Millisecond)
-			retryCnt++
-		} else {
-			err = fmt.Errorf("stop updating repo %s after 3 retries", repo.ID)
-			return err
-		}
-	}
-	return nil
+	_, err := commitToHead(repo.ID, base, newCommit, user, true)
+	return err
 }
 
-func genCommitNeedRetry(repo *repomgr.Repo, base *commitmgr.Commit, commit *commitmgr.Commit, newRoot, user string, commitID *string) (bool, error) {
-	var secondParentID string
-	repoID := repo.ID
+// mergeWithHead merges commit, which is based on base, with head.
+func mergeWithHead(repo *repomgr.Repo, base, head, commit *commitmgr.Commit, user string) (*commitmgr.Commit, error) {
 	var mergeDesc string
-	var mergedCommit *commitmgr.Commit
-	currentHead, err := commitmgr.Load(repo.ID, repo.HeadCommitID)
+	repoID := repo.ID
+	roots := []string{base.RootID, head.RootID, commit.RootID}
+	opt := new(mergeOptions)
+	opt.remoteRepoID = repoID
+	opt.remoteHead = commit.CommitID
+
+	err := mergeTrees(repo.StoreID, roots, opt)
 	if err != nil {
-		err := fmt.Errorf("failed to get head commit for repo %s", repoID)
-		return false, err
+		err := fmt.Errorf("failed to merge")
+		return nil, err
 	}
 
-	if base.CommitID != currentHead.CommitID {
-		roots := []string{base.RootID, currentHead.RootID, newRoot}
-		opt := new(mergeOptions)
-		opt.remoteRepoID = repoID
-		opt.remoteHead = commit.CommitID
-
-		err := mergeTrees(repo.StoreID, roots, opt)
-		if err != nil {
-			err := fmt.Errorf("failed to merge")
-			return false, err
-		}
-
-		if !opt.conflict {
+	if !opt.conflict {
+		mergeDesc = fmt.Sprintf("Auto merge by system")
+	} else {
+		mergeDesc = genMergeDesc(repo, opt.mergedRoot, head.RootID, commit.RootID)
+		if mergeDesc == "" {
 			mergeDesc = fmt.Sprintf("Auto merge by system")
-		} else {
-			mergeDesc = genMergeDesc(repo, opt.mergedRoot, currentHead.RootID, newRoot)
-			if mergeDesc == "" {
-				mergeDesc = fmt.Sprintf("Auto merge by system")
-			}
 		}
-
-		secondParentID = commit.CommitID
-		mergedCommit = commitmgr.NewCommit(repoID, currentHead.CommitID, opt.mergedRoot, user, mergeDesc)
-		repomgr.RepoToCommit(repo, mergedCommit)
-		mergedCommit.SecondParentID.SetValid(commit.CommitID)
-		mergedCommit.NewMerge = 1
-		if opt.conflict {
-			mergedCommit.Conflict = 1
-		}
-
-		err = commitmgr.Save(mergedCommit)
-		if err != nil {
-			err := fmt.Errorf("failed to add commit: %v", err)
-			return false, err
-		}
-	} else {
-		mergedCommit = commit
 	}
 
-	err = updateBranch(repoID, mergedCommit.CommitID, currentHead.CommitID, secondParentID)
-	if err != nil {
-		return true, nil
+	mergedCommit := commitmgr.NewCommit(repoID, head.CommitID, opt.mergedRoot, user, mergeDesc)
+	repomgr.RepoToCommit(repo, mergedCommit)
+	mergedCommit.SecondParentID.SetValid(commit.CommitID)
+	mergedCommit.NewMerge = 1
+	if opt.conflict {
+		mergedCommit.Conflict = 1
 	}
 
-	if commitID != nil {
-		*commitID = mergedCommit.CommitID
+	err = commitmgr.Save(mergedCommit)
+	if err != nil {
+		err := fmt.Errorf("failed to add commit: %v", err)
+		return nil, err
 	}
-	return false, nil
+	return mergedCommit, nil
 }
 
 func genMergeDesc(repo *repomgr.Repo, mergedRoot, p1Root, p2Root string) string {
@@ -1779,7 +1885,7 @@ func genMergeDesc(repo *repomgr.Repo, mergedRoot, p1Root, p2Root string) string
 	return desc
 }
 
-func updateBranch(repoID, newCommitID, oldCommitID, secondParentID string) error {
+func updateBranch(repoID, newCommitID, oldCommitID string, secondParentIDs ...string) error {
 	var commitID string
 	name := "master"
 	var sqlStr string
@@ -1803,6 +1909,8 @@ func updateBranch(repoID, newCommitID, oldCommitID, secondParentID string) error
 	}
 	if oldCommitID != commitID {
 		trans.Rollback()
+		// Don't retry on a cached head.
+		repomgr.Invalidate(repoID)
 		err := fmt.Errorf("head commit id has changed")
 		return err
 	}
@@ -1816,7 +1924,14 @@ func updateBranch(repoID, newCommitID, oldCommitID, secondParentID string) error
 
 	trans.Commit()
 
-	if secondParentID != "" {
+	share.PinRepo(repoID)
+	headCommits.update(repoID, oldCommitID, newCommitID)
+	repomgr.Invalidate(repoID)
+
+	for _, secondParentID := range secondParentIDs {
+		if secondParentID == "" {
+			continue
+		}
 		if err := onBranchUpdated(repoID, secondParentID, false); err != nil {
 			return err
 		}
@@ -1836,6 +1951,9 @@ func onBranchUpdated(repoID string, commitID string, updateRepoInfo bool) error
 		}
 	}
 
+	// Virtual repos are synced too.
+	headUpdates.notify(repoID)
+
 	isVirtual, err := repomgr.IsVirtualRepo(repoID)
 	if err != nil {
 		return err
@@ -1876,7 +1994,7 @@ func postMultiFilesRecursive(repo *repomgr.Repo, dirID, toPath, user string, den
 			err := fmt.Errorf("failed to add new entries: %v", err)
 			return "", err
 		}
-		newdir, err := fsmgr.NewSeafdir(1, olddir.Entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), olddir.Entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -1917,7 +2035,7 @@ func postMultiFilesRecursive(repo *repomgr.Repo, dirID, toPath, user string, den
 	}
 
 	if ret != "" {
-		newdir, err := fsmgr.NewSeafdir(1, entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -2044,57 +2162,22 @@ func indexBlocks(ctx context.Context, repoID string, version int, filePath strin
 		return fsmgr.EmptySha1, 0, nil
 	}
 
-	chunkJobs := make(chan chunkingData, 10)
-	results := make(chan chunkingResult, 10)
-	go createChunkPool(ctx, int(options.maxIndexingThreads), chunkJobs, results)
-
-	var blkSize int64
-	var offset int64
-
-	jobNum := uint64(size)/options.fixedBlockSize + 1
-	blkIDs := make([]string, jobNum)
-
-	left := size
-	for {
-		if uint64(left) >= options.fixedBlockSize {
-			blkSize = int64(options.fixedBlockSize)
-		} else {
-			blkSize = left
-		}
-		if left > 0 {
-			job := chunkingData{repoID, filePath, handler, offset, cryptKey}
-			select {
-			case chunkJobs <- job:
-				left -= blkSize
-				offset += blkSize
-			case result := <-results:
-				if result.err != nil {
-					close(chunkJobs)
-
-					go RecoverWrapper(func() {
-						for result := range results {
-							_ = result
-						}
-					})
-					return "", -1, result.err
-				}
-				blkIDs[result.idx] = result.blkID
-			}
-		} else {
-			close(chunkJobs)
-			for result := range results {
-				if result.err != nil {
-					go RecoverWrapper(func() {
-						for result := range results {
-							_ = result
-						}
-					})
-					return "", -1, result.err
-				}
-				blkIDs[result.idx] = result.blkID
+	// The content is hashed while it is chunked.
+	var fingerprint chan string
+	if options.enableInstantUpload && cryptKey == nil {
+		fingerprint = make(chan string, 1)
+		go func() {
+			fp, err := fileFingerprint(filePath, handler)
+			if err != nil {
+				log.Printf("failed to compute fingerprint: %v", err)
 			}
-			break
-		}
+			fingerprint <- fp
+		}()
+	}
+
+	blkIDs, err := chunker.chunkBlocks(ctx, chunkingData{repoID, filePath, handler, 0, cryptKey}, size)
+	if err != nil {
+		return "", -1, err
 	}
 
 	fileID, err := writeSeafile(repoID, version, size, blkIDs)
@@ -2103,6 +2186,12 @@ func indexBlocks(ctx context.Context, repoID string, version int, filePath strin
 		return "", -1, err
 	}
 
+	if fingerprint != nil {
+		if fp := <-fingerprint; fp != "" {
+			recordFingerprint(fp, size, repoID, fileID)
+		}
+	}
+
 	return fileID, size, nil
 }
 
@@ -2122,142 +2211,44 @@ func writeSeafile(repoID string, version int, fileSize int64, blkIDs []string) (
 	return seafile.FileID, nil
 }
 
-type chunkingData struct {
-	repoID   string
-	filePath string
-	handler  *multipart.FileHeader
-	offset   int64
-	cryptKey *seafileCrypt
-}
-
-type chunkingResult struct {
-	idx   int64
-	blkID string
-	err   error
-}
-
-func createChunkPool(ctx context.Context, n int, chunkJobs chan chunkingData, res chan chunkingResult) {
-	defer func() {
-		if err := recover(); err != nil {
-			log.Printf("panic: %v\n%s", err, debug.Stack())
-		}
-	}()
-	var wg sync.WaitGroup
-	for i := 0; i < n; i++ {
-		wg.Add(1)
-		go chunkingWorker(ctx, &wg, chunkJobs, res)
-	}
-	wg.Wait()
-	close(res)
-}
-
-func chunkingWorker(ctx context.Context, wg *sync.WaitGroup, chunkJobs chan chunkingData, res chan chunkingResult) {
-	defer func() {
-		if err := recover(); err != nil {
-			log.Printf("panic: %v\n%s", err, debug.Stack())
-		}
-	}()
-	for job := range chunkJobs {
-		select {
-		case <-ctx.Done():
-			err := context.Canceled
-			result := chunkingResult{-1, "", err}
-			res <- result
-			wg.Done()
-			return
-		default:
-		}
-
-		job := job
-		blkID, err := chunkFile(job)
-		idx := job.offset / int64(options.fixedBlockSize)
-		result := chunkingResult{idx, blkID, err}
-		res <- result
-	}
-	wg.Done()
-}
-
-func chunkFile(job chunkingData) (string, error) {
-	repoID := job.repoID
-	offset := job.offset
-	filePath := job.filePath
-	handler := job.handler
-	blkSize := options.fixedBlockSize
-	cryptKey := job.cryptKey
-	var file multipart.File
-	if handler != nil {
-		f, err := handler.Open()
-		if err != nil {
-			err := fmt.Errorf("failed to open file for read: %v", err)
-			return "", err
-		}
-		defer f.Close()
-		file = f
-	} else {
-		f, err := os.Open(filePath)
-		if err != nil {
-			err := fmt.Errorf("failed to open file for read: %v", err)
-			return "", err
-		}
-		defer f.Close()
-		file = f
-	}
-	_, err := file.Seek(offset, os.SEEK_SET)
-	if err != nil {
-		err := fmt.Errorf("failed to seek file: %v", err)
-		return "", err
-	}
-	buf := make([]byte, blkSize)
-	n, err := file.Read(buf)
-	if err != nil {
-		err := fmt.Errorf("failed to seek file: %v", err)
-		return "", err
-	}
-	buf = buf[:n]
-
-	blkID, err := writeChunk(repoID, buf, int64(n), cryptKey)
-	if err != nil {
-		err := fmt.Errorf("failed to write chunk: %v", err)
-		return "", err
-	}
-
-	return blkID, nil
-}
-
-func writeChunk(repoID string, input []byte, blkSize int64, cryptKey *seafileCrypt) (string, error) {
+// writeChunk returns the id of the block and whether it was already stored,
+// in which case nothing is written.
+func writeChunk(repoID string, input []byte, blkSize int64, cryptKey *seafileCrypt) (string, bool, error) {
 	var blkID string
 	if cryptKey != nil && blkSize > 0 {
+		// The id of an encrypted block is the hash of the encrypted data,
+		// so it can't be looked up before encrypting.
 		encoded, err := cryptKey.encrypt(input)
 		if err != nil {
 			err := fmt.Errorf("failed to encrypt block: %v", err)
-			return "", err
+			return "", false, err
 		}
-		checkSum := sha1.Sum(encoded)
+		checkSum := blockhash.Sum(encoded)
 		blkID = hex.EncodeToString(checkSum[:])
-		if blockmgr.Exists(repoID, blkID) {
-			return blkID, nil
+		if blockmgr.Exists(repoID, blkID) && blockmgr.Touch(repoID, blkID) == nil {
+			return blkID, true, nil
 		}
 		reader := bytes.NewReader(encoded)
 		err = blockmgr.Write(repoID, blkID, reader)
 		if err != nil {
 			err := fmt.Errorf("failed to write block: %v", err)
-			return "", err
+			return "", false, err
 		}
 	} else {
-		checkSum := sha1.Sum(input)
+		checkSum := blockhash.Sum(input)
 		blkID = hex.EncodeToString(checkSum[:])
-		if blockmgr.Exists(repoID, blkID) {
-			return blkID, nil
+		if blockmgr.Exists(repoID, blkID) && blockmgr.Touch(repoID, blkID) == nil {
+			return blkID, true, nil
 		}
 		reader := bytes.NewReader(input)
 		err := blockmgr.Write(repoID, blkID, reader)
 		if err != nil {
 			err := fmt.Errorf("failed to write block: %v", err)
-			return "", err
+			return "", false, err
 		}
 	}
 
-	return blkID, nil
+	return blkID, false, nil
 }
 
 func checkTmpFileList(fsm *recvData) *appError {
@@ -2366,6 +2357,16 @@ type webaccessInfo struct {
 }
 
 func parseWebaccessInfo(token string) (*webaccessInfo, *appError) {
+	// Tokens issued before the secret was set are still in seaf-server.
+	if isSignedToken(token) {
+		accessInfo, err := verifySignedToken(token)
+		if err != nil {
+			msg := "Access token not found"
+			return nil, &appError{nil, msg, http.StatusForbidden}
+		}
+		return accessInfo, nil
+	}
+
 	webaccess, err := rpcclient.Call("seafile_web_query_access_token", token)
 	if err != nil {
 		err := fmt.Errorf("failed to get web access token: %v", err)
@@ -2484,12 +2485,16 @@ func updateDir(repoID, dirPath, newDirID, user, headID string) (string, error) {
 		return "", err
 	}
 
-	go updateSizePool.AddTask(repoID)
+	go scheduleRepoSizeComputation(repoID)
 
 	return newCommitID, nil
 }
 
 func genCommitDesc(repo *repomgr.Repo, root, parentRoot string) string {
+	// genNewCommit schedules the computation.
+	if lazyCommitDesc {
+		return commitDescPending
+	}
 	var results []*diff.DiffEntry
 	err := diff.DiffCommitRoots(repo.StoreID, parentRoot, root, &results, true)
 	if err != nil {
@@ -2529,7 +2534,7 @@ func putFileRecursive(repo *repomgr.Repo, dirID, toPath string, newDent *fsmgr.S
 			}
 		}
 
-		newdir, err := fsmgr.NewSeafdir(1, newEntries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), newEntries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -2568,7 +2573,7 @@ func putFileRecursive(repo *repomgr.Repo, dirID, toPath string, newDent *fsmgr.S
 	}
 
 	if ret != "" {
-		newdir, err := fsmgr.NewSeafdir(1, entries)
+		newdir, err := fsmgr.NewSeafdir(fsmgr.DirVersionFromRepoVersion(repo.Version), entries)
 		if err != nil {
 			err := fmt.Errorf("failed to new seafdir: %v", err)
 			return "", err
@@ -2627,10 +2632,16 @@ func updateAjaxCB(rsp http.ResponseWriter, r *http.Request) *appError {
 func doUpdate(rsp http.ResponseWriter, r *http.Request, fsm *recvData, isAjax bool) *appError {
 	setAccessControl(rsp)
 
-	if err := r.ParseMultipartForm(1 << 20); err != nil {
+	fsm.trace = newUploadTrace("update")
+	defer fsm.trace.finish(fsm.repoID, r.ContentLength)
+	recvStart := time.Now()
+	releaseForm, err := parseUploadForm(r)
+	if err != nil {
 		return &appError{nil, "", http.StatusBadRequest}
 	}
+	defer releaseForm()
 	defer r.MultipartForm.RemoveAll()
+	fsm.trace.add(stageRecv, recvStart)
 
 	repoID := fsm.repoID
 	user := fsm.user
@@ -2646,6 +2657,10 @@ func doUpdate(rsp http.ResponseWriter, r *http.Request, fsm *recvData, isAjax bo
 
 	defer clearTmpFile(fsm, parentDir)
 
+	if fsm.rstart < 0 && r.FormValue("blockids") != "" {
+		return updateFileBlocks(rsp, r, fsm, parentDir, fileName, isAjax)
+	}
+
 	if fsm.rstart >= 0 {
 		if parentDir[0] != '/' {
 			msg := "Invalid parent dir"
@@ -2811,6 +2826,7 @@ func putFile(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, user,
 
 	var fileID string
 	var size int64
+	indexStart := time.Now()
 	if fsm.rstart >= 0 {
 		filePath := files[0]
 		id, fileSize, err := indexBlocks(r.Context(), repo.StoreID, repo.Version, filePath, nil, cryptKey)
@@ -2836,6 +2852,7 @@ func putFile(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, user,
 		fileID = id
 		size = fileSize
 	}
+	fsm.trace.add(stageIndex, indexStart)
 
 	fullPath := filepath.Join(parentDir, fileName)
 	oldFileID, _, _ := fsmgr.GetObjIDByPath(repo.StoreID, headCommit.RootID, fullPath)
@@ -2858,14 +2875,18 @@ func putFile(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, user,
 	newDent := fsmgr.NewDirent(fileID, fileName, uint32(mode), mtime, user, size)
 
 	var names []string
+	treeStart := time.Now()
 	rootID, err := doPostMultiFiles(repo, headCommit.RootID, canonPath, []*fsmgr.SeafDirent{newDent}, user, true, &names)
+	fsm.trace.add(stageTree, treeStart)
 	if err != nil {
 		err := fmt.Errorf("failed to put file %s to %s in repo %s: %v", fileName, canonPath, repo.ID, err)
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
 	desc := fmt.Sprintf("Modified \"%s\"", fileName)
+	commitStart := time.Now()
 	_, err = genNewCommit(repo, headCommit, rootID, user, desc, true)
+	fsm.trace.add(stageCommit, commitStart)
 	if err != nil {
 		err := fmt.Errorf("failed to generate new commit: %v", err)
 		return &appError{err, "", http.StatusInternalServerError}
@@ -2882,7 +2903,7 @@ func putFile(rsp http.ResponseWriter, r *http.Request, repoID, parentDir, user,
 		rsp.Write([]byte(fileID))
 	}
 
-	go mergeVirtualRepoPool.AddTask(repo.ID)
+	go scheduleMergeVirtualRepo(repo.ID, "")
 
 	return nil
 }
@@ -2938,9 +2959,11 @@ func uploadBlksAPICB(rsp http.ResponseWriter, r *http.Request) *appError {
 }
 
 func doUploadBlks(rsp http.ResponseWriter, r *http.Request, fsm *recvData) *appError {
-	if err := r.ParseMultipartForm(1 << 20); err != nil {
+	releaseForm, err := parseUploadForm(r)
+	if err != nil {
 		return &appError{nil, "", http.StatusBadRequest}
 	}
+	defer releaseForm()
 	defer r.MultipartForm.RemoveAll()
 
 	repoID := fsm.repoID
@@ -3030,6 +3053,18 @@ func doUploadBlks(rsp http.ResponseWriter, r *http.Request, fsm *recvData) *appE
 }
 
 func commitFileBlocks(repoID, parentDir, fileName, blockIDsJSON, user string, fileSize int64, replace bool) (string, *appError) {
+	var blkIDs []string
+	err := json.Unmarshal([]byte(blockIDsJSON), &blkIDs)
+	if err != nil {
+		err := fmt.Errorf("failed to decode data to json: %v", err)
+		return "", &appError{err, "", http.StatusInternalServerError}
+	}
+
+	return commitFileBlockIDs(repoID, parentDir, fileName, blkIDs, user, fileSize, replace)
+}
+
+// commitFileBlockIDs adds a file made of stored blocks to parentDir.
+func commitFileBlockIDs(repoID, parentDir, fileName string, blkIDs []string, user string, fileSize int64, replace bool) (string, *appError) {
 	repo := repomgr.Get(repoID)
 	if repo == nil {
 		msg := "Failed to get repo.\n"
@@ -3056,13 +3091,6 @@ func commitFileBlocks(repoID, parentDir, fileName, blockIDsJSON, user string, fi
 		return "", &appError{nil, msg, http.StatusBadRequest}
 	}
 
-	var blkIDs []string
-	err = json.Unmarshal([]byte(blockIDsJSON), &blkIDs)
-	if err != nil {
-		err := fmt.Errorf("failed to decode data to json: %v", err)
-		return "", &appError{err, "", http.StatusInternalServerError}
-	}
-
 	appErr := checkQuotaBeforeCommitBlocks(repo.StoreID, blkIDs)
 	if appErr != nil {
 		return "", appErr
@@ -3123,7 +3151,8 @@ func indexExistedFileBlocks(repoID string, version int, blkIDs []string, fileSiz
 	}
 
 	for _, blkID := range blkIDs {
-		if !blockmgr.Exists(repoID, blkID) {
+		// The blocks are reused, see blockmgr.Touch.
+		if !blockmgr.Exists(repoID, blkID) || blockmgr.Touch(repoID, blkID) != nil {
 			err := fmt.Errorf("failed to check block: %s", blkID)
 			return "", &appError{err, "", seafHTTPResBlockMissing}
 		}
@@ -3153,9 +3182,11 @@ func uploadRawBlksAPICB(rsp http.ResponseWriter, r *http.Request) *appError {
 }
 
 func doUploadRawBlks(rsp http.ResponseWriter, r *http.Request, fsm *recvData) *appError {
-	if err := r.ParseMultipartForm(1 << 20); err != nil {
+	releaseForm, err := parseUploadForm(r)
+	if err != nil {
 		return &appError{nil, "", http.StatusBadRequest}
 	}
+	defer releaseForm()
 	defer r.MultipartForm.RemoveAll()
 
 	repoID := fsm.repoID
@@ -3222,7 +3253,7 @@ func postBlocks(repoID, user string, fsm *recvData) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	go updateSizePool.AddTask(repo.ID)
+	go scheduleRepoSizeComputation(repo.ID)
 
 	return nil
 }
@@ -3240,7 +3271,7 @@ func indexRawBlocks(repoID string, blockIDs []string, fileHeaders []*multipart.F
 			err := fmt.Errorf("failed to read block: %v", err)
 			return err
 		}
-		checkSum := sha1.Sum(buf.Bytes())
+		checkSum := blockhash.Sum(buf.Bytes())
 		blkID := hex.EncodeToString(checkSum[:])
 		if blkID != blockIDs[i] {
 			err := fmt.Errorf("block id %s:%s doesn't match content", blkID, blockIDs[i])
@@ -3268,4 +3299,5 @@ func removeFileopExpireCache() {
 	}
 
 	blockMapCacheTable.Range(deleteBlockMaps)
+	blockCache.removeExpired()
 }
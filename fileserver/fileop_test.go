@@ -0,0 +1,169 @@
+package main
+
+import (
+	"fmt"
+	"io/ioutil"
+	"mime"
+	"mime/multipart"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+func TestBlockMapFindBlock(t *testing.T) {
+	m := newBlockMap([]uint64{10, 20, 5})
+
+	cases := []struct {
+		offset uint64
+		block  int
+		pos    uint64
+	}{
+		{0, 0, 0},
+		{9, 0, 9},
+		{10, 1, 0},
+		{29, 1, 19},
+		{30, 2, 0},
+		{34, 2, 4},
+	}
+	for _, c := range cases {
+		block, pos := m.findBlock(c.offset)
+		if block != c.block || pos != c.pos {
+			t.Errorf("offset %d: got block %d at %d, expected block %d at %d",
+				c.offset, block, pos, c.block, c.pos)
+		}
+	}
+}
+
+func TestParseRanges(t *testing.T) {
+	const size = 1000
+	tests := []struct {
+		header string
+		ranges []byteRange
+		ok     bool
+	}{
+		{"bytes=0-99", []byteRange{{0, 99}}, true},
+		{"bytes=-100", []byteRange{{900, 999}}, true},
+		{"bytes=-2000", []byteRange{{0, 999}}, true},
+		{"bytes=950-", []byteRange{{950, 999}}, true},
+		{"bytes=900-5000", []byteRange{{900, 999}}, true},
+		{"bytes=500-400", nil, false},
+		{"bytes=abc", nil, false},
+		{"bytes=0-9, 20-29", []byteRange{{0, 9}, {20, 29}}, true},
+		// Sorted, and overlapping or adjacent ranges merged.
+		{"bytes=20-29,0-9,5-12,13-15", []byteRange{{0, 15}, {20, 29}}, true},
+		{"bytes=0-9,x", nil, false},
+	}
+
+	for _, test := range tests {
+		ranges, ok := parseRanges(test.header, size)
+		if ok != test.ok {
+			t.Errorf("parsing %q returned %v", test.header, ok)
+			continue
+		}
+		if len(ranges) != len(test.ranges) {
+			t.Errorf("got ranges %v for %q, expected %v", ranges, test.header, test.ranges)
+			continue
+		}
+		for i := range ranges {
+			if ranges[i] != test.ranges[i] {
+				t.Errorf("got ranges %v for %q, expected %v", ranges, test.header, test.ranges)
+				break
+			}
+		}
+	}
+
+	// Too many spans are sent as one.
+	var specs []string
+	for i := 0; i <= maxByteRanges; i++ {
+		specs = append(specs, fmt.Sprintf("%d-%d", i*10, i*10+1))
+	}
+	ranges, ok := parseRanges("bytes="+strings.Join(specs, ","), size)
+	if !ok || len(ranges) != 1 || ranges[0] != (byteRange{0, maxByteRanges*10 + 1}) {
+		t.Errorf("got ranges %v for %d spans", ranges, maxByteRanges+1)
+	}
+}
+
+func TestSendByteRanges(t *testing.T) {
+	const repoID = "7f809102-1234-4321-abcd-0123456789ab"
+	dir, err := ioutil.TempDir("", "byteranges")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	var blkIDs []string
+	var sizes []uint64
+	var content string
+	for i := 0; i < 3; i++ {
+		blkID := strings.Repeat(string(rune('a'+i)), 40)
+		data := strings.Repeat(string(rune('0'+i)), 10+i) + "xyz"
+		if err := blockmgr.Write(repoID, blkID, strings.NewReader(data)); err != nil {
+			t.Fatalf("failed to write block: %v", err)
+		}
+		blkIDs = append(blkIDs, blkID)
+		sizes = append(sizes, uint64(len(data)))
+		content += data
+	}
+	file := &fsmgr.Seafile{FileSize: uint64(len(content)), BlkIDs: blkIDs}
+	ranges := []byteRange{{2, 5}, {11, 20}, {uint64(len(content)) - 3, uint64(len(content)) - 1}}
+
+	rsp := httptest.NewRecorder()
+	rsp.Header().Set("Content-Type", "text/plain")
+	if !sendByteRanges(rsp, rsp, repoID, file, newBlockMap(sizes), nil, ranges) {
+		t.Fatalf("failed to send ranges")
+	}
+
+	body := rsp.Body.String()
+	if n, _ := strconv.Atoi(rsp.Header().Get("Content-Length")); n != len(body) {
+		t.Errorf("Content-Length is %d, body has %d bytes", n, len(body))
+	}
+	mediaType, params, err := mime.ParseMediaType(rsp.Header().Get("Content-Type"))
+	if err != nil || mediaType != "multipart/byteranges" {
+		t.Fatalf("unexpected content type %q", rsp.Header().Get("Content-Type"))
+	}
+	reader := multipart.NewReader(strings.NewReader(body), params["boundary"])
+	for _, rg := range ranges {
+		part, err := reader.NextPart()
+		if err != nil {
+			t.Fatalf("failed to read part: %v", err)
+		}
+		expected := fmt.Sprintf("bytes %d-%d/%d", rg.start, rg.end, len(content))
+		if got := part.Header.Get("Content-Range"); got != expected {
+			t.Errorf("got Content-Range %q, expected %q", got, expected)
+		}
+		data, _ := ioutil.ReadAll(part)
+		if string(data) != content[rg.start:rg.end+1] {
+			t.Errorf("got %q for range %v, expected %q", data, rg, content[rg.start:rg.end+1])
+		}
+	}
+	if _, err := reader.NextPart(); err == nil {
+		t.Errorf("found more parts than ranges")
+	}
+}
+
+func TestCheckRelativePath(t *testing.T) {
+	cases := []struct {
+		path string
+		ok   bool
+	}{
+		{"a", true},
+		{"a/b/c", true},
+		{"a//b/./c/", true},
+		{"a/../b", true},
+		{"../a", false},
+		{"a/" + strings.Repeat("x", 256), false},
+		{"a/\xff", false},
+	}
+	for _, c := range cases {
+		if ok := checkRelativePath(c.path); ok != c.ok {
+			t.Errorf("checkRelativePath(%q) = %v, expected %v", c.path, ok, c.ok)
+		}
+	}
+}
@@ -2,10 +2,13 @@
 package main
 
 import (
+	"context"
 	"database/sql"
+	"encoding/json"
 	"flag"
 	"fmt"
 	"io"
+	"io/ioutil"
 	"net/http"
 	"os"
 	"os/signal"
@@ -13,11 +16,15 @@ import (
 	"runtime/debug"
 	"strconv"
 	"strings"
+	"sync"
 	"syscall"
+	"time"
 
 	_ "github.com/go-sql-driver/mysql"
 	"github.com/gorilla/mux"
+	"github.com/haiwen/seafile-server/fileserver/accessstats"
 	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/clustercache"
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
 	"github.com/haiwen/seafile-server/fileserver/fsmgr"
 	"github.com/haiwen/seafile-server/fileserver/repomgr"
@@ -35,6 +42,9 @@ var centralDir string
 var logFile, absLogFile string
 var rpcPipePath string
 var pidFilePath string
+
+// Set when the controller runs several fileserver processes on one port.
+var reusePort bool
 var logFp *os.File
 
 var dbType string
@@ -42,6 +52,10 @@ var groupTableName string
 var cloudMode bool
 var seafileDB, ccnetDB *sql.DB
 
+// Read replicas of seafileDB, used for listings and repo heads.
+var seafileReplicaDBs []*sql.DB
+var replicaPinTime time.Duration
+
 // when SQLite is used, user and group db are separated.
 var userDB, groupDB *sql.DB
 
@@ -53,6 +67,9 @@ const (
 	TB = 1000000000000
 )
 
+// How long background jobs may take to finish on exit.
+const workerPoolShutdownTimeout = 10 * time.Second
+
 type fileServerOptions struct {
 	host               string
 	port               uint32
@@ -60,20 +77,78 @@ type fileServerOptions struct {
 	maxDownloadDirSize uint64
 	// Block size for indexing uploaded files
 	fixedBlockSize uint64
+	// Block aligned chunks of resumable uploads are indexed on arrival
+	indexResumableChunks bool
+	// Record fingerprints of uploaded files for instant uploads
+	enableInstantUpload bool
 	// Maximum number of goroutines to index uploaded files
 	maxIndexingThreads uint32
 	webTokenExpireTime uint32
+	// Key verifying signed web access tokens without an rpc call
+	webTokenSecret string
 	// File mode for temp files
 	clusterSharedTempFileMode uint32
 	windowsEncoding           string
 	// Timeout for fs-id-list requests.
 	fsIDListRequestTimeout uint32
 	defaultQuota           int64
+	// How long a cached user usage is trusted before it's recomputed
+	usageReconcileInterval int64
 	// Profile password
 	profilePassword string
 	enableProfiling bool
+	// Periodic labelled profiles, see profiler.go
+	profiler profilerOptions
+	// Serve request and pool metrics on /metrics
+	enableMetrics bool
 	// Go log level
 	logLevel string
+	// Memory budget of the fs object cache in bytes
+	fsCacheLimit int64
+	// Memory budget of the commit cache in bytes
+	commitCacheLimit int64
+	// Limit of the body of pack-blocks and recv-blocks requests
+	maxBlockBatchSize int64
+	// Memory all uploads may buffer at once, 0 for no limit
+	uploadMemoryLimit int64
+	// Memory budget of the computed fs id list cache in bytes
+	fsIDListCacheSize int64
+	// Goroutines diffing sub-directories when computing fs id lists
+	maxDiffThreads int
+	// Sync replies of at least this many bytes are sent gzipped to the
+	// clients that accept it, negative disables compression
+	compressMinSize int
+	// Certificate and key to serve HTTP/2 over TLS
+	tlsCertFile string
+	tlsKeyFile  string
+	// Sync requests served at once on a connection
+	maxConcurrentStreams int
+	// How long a cached head commit is trusted before it's read again
+	headCommitCacheTTL time.Duration
+	// How long a loaded repo is cached, 0 disables the cache
+	repoCacheTTL time.Duration
+	// Blocks read ahead of the one being sent by file downloads
+	downloadReadAhead int
+	// Recently updated repos whose caches are filled at startup
+	warmUpRepos int
+	// Bytes of decrypted blocks kept for range requests, 0 disables the cache
+	decryptedBlockCacheSize int64
+	// Store files in zip downloads without compressing them
+	zipStoreOnly bool
+	// Files read ahead of the one being packed by zip downloads
+	zipPrefetchFiles int
+	// Uploads slower than this are logged with the time of each stage
+	uploadTraceThreshold time.Duration
+	// Fraction of the other uploads logged the same way
+	uploadTraceSampleRate float64
+	// Per user and per repo bandwidth and block operation limits
+	transferLimits transferLimits
+	// How long requests in progress may take to finish on exit
+	shutdownTimeout time.Duration
+	// Connections to the pipelined rpc socket of seaf-server
+	rpcPoolSize int
+	// How long an rpc call may take, 0 for no limit
+	rpcTimeout time.Duration
 }
 
 var options fileServerOptions
@@ -84,6 +159,7 @@ func init() {
 	flag.StringVar(&logFile, "l", "", "log file path")
 	flag.StringVar(&rpcPipePath, "p", "", "rpc pipe path")
 	flag.StringVar(&pidFilePath, "P", "", "pid file path")
+	flag.BoolVar(&reusePort, "reuseport", false, "share the listen port with other fileserver processes")
 
 	log.SetFormatter(&LogFormatter{})
 }
@@ -229,6 +305,14 @@ func loadSeafileDB() {
 		if err != nil {
 			log.Fatalf("Failed to open database: %v", err)
 		}
+		if key, err = section.GetKey("replica_hosts"); err == nil {
+			seafileReplicaDBs = openReplicaDBs(key.String(), port, user, password, dbName, useTLS)
+		}
+		if key, err = section.GetKey("replica_pin_time"); err == nil {
+			if pin, err := key.Int(); err == nil && pin > 0 {
+				replicaPinTime = time.Duration(pin) * time.Second
+			}
+		}
 	} else if strings.EqualFold(dbEngine, "sqlite") {
 		seafileDBPath := filepath.Join(absDataDir, "seafile.db")
 		seafileDB, err = sql.Open("sqlite3", seafileDBPath)
@@ -241,6 +325,31 @@ func loadSeafileDB() {
 	dbType = dbEngine
 }
 
+// openReplicaDBs opens a handle for each replica in hosts, a list of
+// host[:port] separated by commas. The replicas use the credentials of the
+// primary.
+func openReplicaDBs(hosts string, defaultPort int, user, password, dbName string, useTLS bool) []*sql.DB {
+	var dbs []*sql.DB
+	for _, host := range strings.Split(hosts, ",") {
+		host = strings.TrimSpace(host)
+		if host == "" {
+			continue
+		}
+		addr := host
+		if !strings.Contains(host, ":") {
+			addr = fmt.Sprintf("%s:%d", host, defaultPort)
+		}
+		dsn := fmt.Sprintf("%s:%s@tcp(%s)/%s?tls=%t", user, password, addr, dbName, useTLS)
+		db, err := sql.Open("mysql", dsn)
+		if err != nil {
+			log.Printf("Failed to open database replica %s: %v", addr, err)
+			continue
+		}
+		dbs = append(dbs, db)
+	}
+	return dbs
+}
+
 func parseQuota(quotaStr string) int64 {
 	var quota int64
 	var multiplier int64 = GB
@@ -295,6 +404,13 @@ func loadFileServerOptions() {
 		if key, err := section.GetKey("cloud_mode"); err == nil {
 			cloudMode, _ = key.Bool()
 		}
+		if key, err := section.GetKey("lazy_commit_description"); err == nil {
+			lazyCommitDesc, _ = key.Bool()
+		}
+		if key, err := section.GetKey("access_stats_sample_rate"); err == nil {
+			rate, _ := key.Int()
+			accessstats.Init(rate)
+		}
 	}
 
 	initDefaultOptions()
@@ -306,11 +422,25 @@ func loadFileServerOptions() {
 		parseFileServerSection(section)
 	}
 
+	if section, err := config.GetSection("transfer_weights"); err == nil {
+		options.transferLimits.weights = make(map[string]int)
+		for _, key := range section.Keys() {
+			if weight, err := key.Int(); err == nil && weight > 0 {
+				options.transferLimits.weights[key.Name()] = weight
+			}
+		}
+	}
+
 	if section, err := config.GetSection("quota"); err == nil {
 		if key, err := section.GetKey("default"); err == nil {
 			quotaStr := key.String()
 			options.defaultQuota = parseQuota(quotaStr)
 		}
+		if key, err := section.GetKey("usage_reconcile_interval"); err == nil {
+			if interval, err := key.Int64(); err == nil && interval > 0 {
+				options.usageReconcileInterval = interval
+			}
+		}
 	}
 
 	ccnetConfPath := filepath.Join(centralDir, "ccnet.conf")
@@ -354,12 +484,21 @@ func parseFileServerSection(section *ini.Section) {
 			options.fixedBlockSize = blkSize
 		}
 	}
+	if key, err := section.GetKey("index_resumable_chunks"); err == nil {
+		options.indexResumableChunks, _ = key.Bool()
+	}
+	if key, err := section.GetKey("enable_instant_upload"); err == nil {
+		options.enableInstantUpload, _ = key.Bool()
+	}
 	if key, err := section.GetKey("web_token_expire_time"); err == nil {
 		expire, err := key.Uint()
 		if err == nil {
 			options.webTokenExpireTime = uint32(expire)
 		}
 	}
+	if key, err := section.GetKey("web_token_secret"); err == nil {
+		options.webTokenSecret = key.String()
+	}
 	if key, err := section.GetKey("cluster_shared_temp_file_mode"); err == nil {
 		fileMode, err := key.Uint()
 		if err == nil {
@@ -376,9 +515,185 @@ func parseFileServerSection(section *ini.Section) {
 			log.Fatal("password of profiling must be specified.")
 		}
 	}
+	if key, err := section.GetKey("continuous_profiling"); err == nil {
+		options.profiler.enabled, _ = key.Bool()
+	}
+	if key, err := section.GetKey("profile_dir"); err == nil {
+		options.profiler.dir = key.String()
+	}
+	if key, err := section.GetKey("profile_interval"); err == nil {
+		interval, err := key.Int()
+		if err == nil && interval > 0 {
+			options.profiler.interval = time.Duration(interval) * time.Second
+		}
+	}
+	if key, err := section.GetKey("profile_cpu_duration"); err == nil {
+		duration, err := key.Int()
+		if err == nil && duration > 0 {
+			options.profiler.cpuDuration = time.Duration(duration) * time.Second
+		}
+	}
+	if key, err := section.GetKey("profiles_kept"); err == nil {
+		keep, err := key.Int()
+		if err == nil && keep > 0 {
+			options.profiler.keep = keep
+		}
+	}
+	if key, err := section.GetKey("profile_upload_url"); err == nil {
+		options.profiler.uploadURL = key.String()
+	}
+	if key, err := section.GetKey("enable_metrics"); err == nil {
+		options.enableMetrics, _ = key.Bool()
+	}
 	if key, err := section.GetKey("go_log_level"); err == nil {
 		options.logLevel = key.String()
 	}
+	if key, err := section.GetKey("fs_cache_limit"); err == nil {
+		fsCacheLimit, err := key.Int64()
+		if err == nil {
+			options.fsCacheLimit = fsCacheLimit * (1 << 20)
+		}
+	}
+	if key, err := section.GetKey("commit_cache_limit"); err == nil {
+		commitCacheLimit, err := key.Int64()
+		if err == nil {
+			options.commitCacheLimit = commitCacheLimit * (1 << 20)
+		}
+	}
+	if key, err := section.GetKey("fs_id_list_cache_size"); err == nil {
+		size, err := key.Int64()
+		if err == nil && size >= 0 {
+			options.fsIDListCacheSize = size * (1 << 20)
+		}
+	}
+	if key, err := section.GetKey("compress_min_size"); err == nil {
+		size, err := key.Int()
+		if err == nil {
+			options.compressMinSize = size
+		}
+	}
+	if key, err := section.GetKey("tls_cert_file"); err == nil {
+		options.tlsCertFile = key.String()
+	}
+	if key, err := section.GetKey("tls_key_file"); err == nil {
+		options.tlsKeyFile = key.String()
+	}
+	if key, err := section.GetKey("max_concurrent_streams"); err == nil {
+		streams, err := key.Int()
+		if err == nil && streams >= 0 {
+			options.maxConcurrentStreams = streams
+		}
+	}
+	if key, err := section.GetKey("max_diff_threads"); err == nil {
+		threads, err := key.Int()
+		if err == nil && threads > 0 {
+			options.maxDiffThreads = threads
+		}
+	}
+	if key, err := section.GetKey("head_commit_cache_ttl"); err == nil {
+		ttl, err := key.Int()
+		if err == nil && ttl > 0 {
+			options.headCommitCacheTTL = time.Duration(ttl) * time.Second
+		}
+	}
+	if key, err := section.GetKey("repo_cache_ttl"); err == nil {
+		ttl, err := key.Int()
+		if err == nil && ttl >= 0 {
+			options.repoCacheTTL = time.Duration(ttl) * time.Second
+		}
+	}
+	if key, err := section.GetKey("download_read_ahead"); err == nil {
+		blocks, err := key.Int()
+		if err == nil && blocks >= 0 {
+			options.downloadReadAhead = blocks
+		}
+	}
+	if key, err := section.GetKey("warm_up_repos"); err == nil {
+		repos, err := key.Int()
+		if err == nil && repos >= 0 {
+			options.warmUpRepos = repos
+		}
+	}
+	if key, err := section.GetKey("decrypted_block_cache_size"); err == nil {
+		size, err := key.Int64()
+		if err == nil && size >= 0 {
+			options.decryptedBlockCacheSize = size << 20
+		}
+	}
+	if key, err := section.GetKey("zip_prefetch_files"); err == nil {
+		files, err := key.Int()
+		if err == nil && files >= 0 {
+			options.zipPrefetchFiles = files
+		}
+	}
+	if key, err := section.GetKey("zip_store_only"); err == nil {
+		options.zipStoreOnly, _ = key.Bool()
+	}
+	if key, err := section.GetKey("max_block_batch_size"); err == nil {
+		size, err := key.Int64()
+		if err == nil && size > 0 {
+			options.maxBlockBatchSize = size * (1 << 20)
+		}
+	}
+	if key, err := section.GetKey("upload_memory_limit"); err == nil {
+		size, err := key.Int64()
+		if err == nil {
+			if size < 0 {
+				size = 0
+			}
+			options.uploadMemoryLimit = size * (1 << 20)
+		}
+	}
+	if key, err := section.GetKey("graceful_shutdown_timeout"); err == nil {
+		timeout, err := key.Int()
+		if err == nil && timeout >= 0 {
+			options.shutdownTimeout = time.Duration(timeout) * time.Second
+		}
+	}
+	if key, err := section.GetKey("rpc_pool_size"); err == nil {
+		size, err := key.Int()
+		if err == nil && size > 0 {
+			options.rpcPoolSize = size
+		}
+	}
+	if key, err := section.GetKey("rpc_timeout"); err == nil {
+		timeout, err := key.Int()
+		if err == nil && timeout >= 0 {
+			options.rpcTimeout = time.Duration(timeout) * time.Second
+		}
+	}
+	if key, err := section.GetKey("upload_trace_threshold"); err == nil {
+		ms, err := key.Int()
+		if err == nil && ms > 0 {
+			options.uploadTraceThreshold = time.Duration(ms) * time.Millisecond
+		}
+	}
+	if key, err := section.GetKey("upload_trace_sample_rate"); err == nil {
+		rate, err := key.Float64()
+		if err == nil && rate > 0 {
+			options.uploadTraceSampleRate = rate
+		}
+	}
+	// Bandwidth limits are in KB/s, operation limits in blocks/s.
+	limits := []struct {
+		key   string
+		value *float64
+		unit  float64
+	}{
+		{"user_bandwidth_limit", &options.transferLimits.userRate, 1024},
+		{"repo_bandwidth_limit", &options.transferLimits.repoRate, 1024},
+		{"total_bandwidth_limit", &options.transferLimits.totalRate, 1024},
+		{"user_iops_limit", &options.transferLimits.userOps, 1},
+		{"repo_iops_limit", &options.transferLimits.repoOps, 1},
+	}
+	for _, limit := range limits {
+		if key, err := section.GetKey(limit.key); err == nil {
+			value, err := key.Int64()
+			if err == nil && value >= 0 {
+				*limit.value = float64(value) * limit.unit
+			}
+		}
+	}
 }
 
 func initDefaultOptions() {
@@ -390,10 +705,28 @@ func initDefaultOptions() {
 	options.webTokenExpireTime = 7200
 	options.clusterSharedTempFileMode = 0600
 	options.defaultQuota = InfiniteQuota
+	options.usageReconcileInterval = 3600
+	options.fsCacheLimit = 100 * (1 << 20)
+	options.commitCacheLimit = 16 * (1 << 20)
+	options.maxBlockBatchSize = 1 << 23
+	options.uploadMemoryLimit = 512 * (1 << 20)
+	options.fsIDListCacheSize = 64 * (1 << 20)
+	options.maxDiffThreads = 4
+	options.compressMinSize = defaultCompressMinSize
+	options.maxConcurrentStreams = 32
+	options.headCommitCacheTTL = defaultHeadCommitCacheTTL
+	options.repoCacheTTL = 10 * time.Second
+	options.zipPrefetchFiles = 8
+	options.shutdownTimeout = 30 * time.Second
+	options.profiler.interval = defaultProfileInterval
+	options.profiler.cpuDuration = defaultProfileCPUDuration
+	options.profiler.keep = defaultProfilesKept
+	options.rpcPoolSize = searpc.DefaultOptions.PoolSize
+	options.rpcTimeout = searpc.DefaultOptions.Timeout
 }
 
 func writePidFile(pid_file_path string) error {
-	file, err := os.OpenFile(pid_file_path, os.O_CREATE|os.O_WRONLY, 0664)
+	file, err := os.OpenFile(pid_file_path, os.O_CREATE|os.O_WRONLY|os.O_TRUNC, 0664)
 	if err != nil {
 		return err
 	}
@@ -410,6 +743,11 @@ func writePidFile(pid_file_path string) error {
 }
 
 func removePidfile(pid_file_path string) error {
+	// On a rolling restart, the new process has written its pid already.
+	if data, err := ioutil.ReadFile(pid_file_path); err == nil &&
+		strings.TrimSpace(string(data)) != strconv.Itoa(os.Getpid()) {
+		return nil
+	}
 	err := os.Remove(pid_file_path)
 	if err != nil {
 		return err
@@ -489,14 +827,20 @@ func main() {
 	}
 
 	repomgr.Init(seafileDB)
+	repomgr.SetCacheTTL(options.repoCacheTTL)
 
 	fsmgr.Init(centralDir, dataDir)
+	fsmgr.SetCacheLimit(options.fsCacheLimit)
 
 	blockmgr.Init(centralDir, dataDir)
 
 	commitmgr.Init(centralDir, dataDir)
+	commitmgr.SetCacheLimit(options.commitCacheLimit)
+
+	clusterCache = clustercache.Load(centralDir)
 
 	share.Init(ccnetDB, seafileDB, groupTableName, cloudMode)
+	share.SetReplicas(seafileReplicaDBs, replicaPinTime)
 
 	rpcClientInit()
 
@@ -505,33 +849,83 @@ func main() {
 	syncAPIInit()
 
 	sizeSchedulerInit()
+	commitDescInit()
 
 	virtualRepoInit()
 
 	initUpload()
 
+	transferLimitInit()
+	blockCacheInit()
+
+	go warmUpCaches(options.warmUpRepos)
+
+	if options.profiler.dir == "" {
+		options.profiler.dir = filepath.Join(absDataDir, "profiles")
+	}
+	if options.profiler.cpuDuration > options.profiler.interval {
+		options.profiler.cpuDuration = options.profiler.interval
+	}
+	startContinuousProfiling()
+
 	router := newHTTPRouter()
 
-	go handleSignals()
+	addr := fmt.Sprintf("%s:%d", options.host, options.port)
+	server := newHTTPServer(addr, router, options.maxConcurrentStreams)
+
+	go handleSignals(server)
 	go handleUser1Singal()
 
 	log.Print("Seafile file server started.")
 
-	addr := fmt.Sprintf("%s:%d", options.host, options.port)
-	err = http.ListenAndServe(addr, router)
+	err = serveHTTP(server, reusePort)
+	if err == http.ErrServerClosed {
+		// handleSignals exits once the requests in progress are done.
+		select {}
+	}
 	if err != nil {
 		log.Printf("File server exiting: %v", err)
 	}
 }
 
-func handleSignals() {
+// handleSignals stops accepting connections and lets the requests in
+// progress finish before exiting. With -reuseport the other processes on
+// the port keep serving meanwhile, so a restart drops no connection.
+func handleSignals(server *http.Server) {
 	signalChan := make(chan os.Signal, 1)
 	signal.Notify(signalChan, syscall.SIGINT, syscall.SIGTERM, os.Interrupt)
 	<-signalChan
+
+	ctx, cancel := context.WithTimeout(context.Background(), options.shutdownTimeout)
+	if err := server.Shutdown(ctx); err != nil {
+		log.Printf("Requests still in progress on exit: %v", err)
+	}
+	cancel()
+
+	shutdownWorkerPools()
 	removePidfile(pidFilePath)
 	os.Exit(0)
 }
 
+// shutdownWorkerPools lets the queued and running background jobs finish,
+// for at most workerPoolShutdownTimeout.
+func shutdownWorkerPools() {
+	ctx, cancel := context.WithTimeout(context.Background(), workerPoolShutdownTimeout)
+	defer cancel()
+
+	var wg sync.WaitGroup
+	for _, p := range workerPools() {
+		wg.Add(1)
+		go func(p namedPool) {
+			defer wg.Done()
+			if err := p.pool.Shutdown(ctx); err != nil {
+				log.Printf("Worker pool %s didn't finish its jobs: %v", p.name, err)
+			}
+		}(p)
+	}
+	wg.Wait()
+}
+
 func handleUser1Singal() {
 	signalChan := make(chan os.Signal, 1)
 	signal.Notify(signalChan, syscall.SIGUSR1)
@@ -560,6 +954,9 @@ func logRotate() {
 
 var rpcclient *searpc.Client
 
+// Cache shared by the nodes of a cluster, nil if not configured.
+var clusterCache *clustercache.Cache
+
 func rpcClientInit() {
 	var pipePath string
 	if rpcPipePath != "" {
@@ -567,49 +964,60 @@ func rpcClientInit() {
 	} else {
 		pipePath = filepath.Join(absDataDir, "seafile.sock")
 	}
-	rpcclient = searpc.Init(pipePath, "seafserv-threaded-rpcserver")
+	rpcclient = searpc.InitWithOptions(pipePath, "seafserv-threaded-rpcserver",
+		searpc.Options{PoolSize: options.rpcPoolSize, Timeout: options.rpcTimeout})
 }
 
 func newHTTPRouter() *mux.Router {
 	r := mux.NewRouter()
-	r.HandleFunc("/protocol-version{slash:\\/?}", handleProtocolVersion)
-	r.Handle("/files/{.*}/{.*}", appHandler(accessCB))
-	r.Handle("/blks/{.*}/{.*}", appHandler(accessBlksCB))
-	r.Handle("/zip/{.*}", appHandler(accessZipCB))
-	r.Handle("/upload-api/{.*}", appHandler(uploadAPICB))
-	r.Handle("/upload-aj/{.*}", appHandler(uploadAjaxCB))
-	r.Handle("/update-api/{.*}", appHandler(updateAPICB))
-	r.Handle("/update-aj/{.*}", appHandler(updateAjaxCB))
-	r.Handle("/upload-blks-api/{.*}", appHandler(uploadBlksAPICB))
-	r.Handle("/upload-raw-blks-api/{.*}", appHandler(uploadRawBlksAPICB))
+	r.Handle("/protocol-version{slash:\\/?}", instrument("protocol-version", http.HandlerFunc(handleProtocolVersion)))
+	r.Handle("/files/{.*}/{.*}", instrument("files", appHandler(accessCB)))
+	r.Handle("/blks/{.*}/{.*}", instrument("blks", appHandler(accessBlksCB)))
+	r.Handle("/zip/{.*}", instrument("zip", appHandler(accessZipCB)))
+	r.Handle("/upload-api/{.*}", instrument("upload-api", appHandler(uploadAPICB)))
+	r.Handle("/upload-aj/{.*}", instrument("upload-aj", appHandler(uploadAjaxCB)))
+	r.Handle("/update-api/{.*}", instrument("update-api", appHandler(updateAPICB)))
+	r.Handle("/update-aj/{.*}", instrument("update-aj", appHandler(updateAjaxCB)))
+	r.Handle("/upload-blks-api/{.*}", instrument("upload-blks-api", appHandler(uploadBlksAPICB)))
+	r.Handle("/upload-raw-blks-api/{.*}", instrument("upload-raw-blks-api", appHandler(uploadRawBlksAPICB)))
+	r.Handle("/upload-instant-api/{.*}", instrument("upload-instant-api", appHandler(uploadInstantAPICB)))
 	// file syncing api
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/permission-check{slash:\\/?}",
-		appHandler(permissionCheckCB))
+		instrument("permission-check", appHandler(permissionCheckCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/commit/HEAD{slash:\\/?}",
-		appHandler(headCommitOperCB))
+		instrument("head-commit", appHandler(headCommitOperCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/commit/{id:[\\da-z]{40}}",
-		appHandler(commitOperCB))
+		instrument("commit", appHandler(commitOperCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/block/{id:[\\da-z]{40}}",
-		appHandler(blockOperCB))
+		instrument("block", appHandler(blockOperCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/fs-id-list{slash:\\/?}",
-		appHandler(getFsObjIDCB))
+		instrument("fs-id-list", appHandler(getFsObjIDCB)))
 	r.Handle("/repo/head-commits-multi{slash:\\/?}",
-		appHandler(headCommitsMultiCB))
+		instrument("head-commits-multi", appHandler(headCommitsMultiCB)))
+	r.Handle("/repo/head-commits-wait{slash:\\/?}",
+		instrument("head-commits-wait", appHandler(headCommitsWaitCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/pack-fs{slash:\\/?}",
-		appHandler(packFSCB))
+		instrument("pack-fs", appHandler(packFSCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/check-fs{slash:\\/?}",
-		appHandler(checkFSCB))
+		instrument("check-fs", appHandler(checkFSCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/check-blocks{slash:\\/?}",
-		appHandler(checkBlockCB))
+		instrument("check-blocks", appHandler(checkBlockCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/recv-fs{slash:\\/?}",
-		appHandler(recvFSCB))
+		instrument("recv-fs", appHandler(recvFSCB)))
+	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/pack-blocks{slash:\\/?}",
+		instrument("pack-blocks", appHandler(packBlocksCB)))
+	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/recv-blocks{slash:\\/?}",
+		instrument("recv-blocks", appHandler(recvBlocksCB)))
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/quota-check{slash:\\/?}",
-		appHandler(getCheckQuotaCB))
+		instrument("quota-check", appHandler(getCheckQuotaCB)))
 
 	// seadrive api
 	r.Handle("/repo/{repoid:[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}}/block-map/{id:[\\da-z]{40}}",
-		appHandler(getBlockMapCB))
-	r.Handle("/accessible-repos{slash:\\/?}", appHandler(getAccessibleRepoListCB))
+		instrument("block-map", appHandler(getBlockMapCB)))
+	r.Handle("/accessible-repos{slash:\\/?}", instrument("accessible-repos", appHandler(getAccessibleRepoListCB)))
+
+	r.HandleFunc("/metrics", handleMetrics)
+	r.HandleFunc("/health", handleHealth)
 
 	// pprof
 	r.Handle("/debug/pprof", &profileHandler{http.HandlerFunc(pprof.Index)})
@@ -620,6 +1028,11 @@ func newHTTPRouter() *mux.Router {
 	r.Handle("/debug/pprof/block", &profileHandler{pprof.Handler("block")})
 	r.Handle("/debug/pprof/goroutine", &profileHandler{pprof.Handler("goroutine")})
 	r.Handle("/debug/pprof/threadcreate", &profileHandler{pprof.Handler("threadcreate")})
+	r.Handle("/debug/pprof/fs-cache", &profileHandler{http.HandlerFunc(handleFSCacheStats)})
+	r.Handle("/debug/pprof/commit-cache", &profileHandler{http.HandlerFunc(handleCommitCacheStats)})
+	r.Handle("/debug/pprof/indexing", &profileHandler{http.HandlerFunc(handleIndexingStats)})
+	r.Handle("/debug/pprof/fs-id-list-cache", &profileHandler{http.HandlerFunc(handleFsIDListCacheStats)})
+	r.Handle("/debug/pprof/access-stats", &profileHandler{http.HandlerFunc(handleAccessStats)})
 	return r
 }
 
@@ -627,6 +1040,18 @@ func handleProtocolVersion(rsp http.ResponseWriter, r *http.Request) {
 	io.WriteString(rsp, "{\"version\": 2}")
 }
 
+// handleHealth is a readiness probe. Requests also depend on seaf-server,
+// which finishes its startup after it begins answering rpcs.
+func handleHealth(rsp http.ResponseWriter, r *http.Request) {
+	ret, err := rpcclient.Call("is_server_ready")
+	if ready, ok := ret.(float64); err != nil || !ok || ready != 1 {
+		rsp.WriteHeader(http.StatusServiceUnavailable)
+		io.WriteString(rsp, "{\"status\": \"starting\"}")
+		return
+	}
+	io.WriteString(rsp, "{\"status\": \"ready\"}")
+}
+
 type appError struct {
 	Error   error
 	Message string
@@ -668,3 +1093,103 @@ func (p *profileHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 
 	p.pHandler.ServeHTTP(w, r)
 }
+
+func handleFSCacheStats(rsp http.ResponseWriter, r *http.Request) {
+	stats := fsmgr.GetCacheStats()
+	var hitRate float64
+	if total := stats.Hits + stats.Misses; total > 0 {
+		hitRate = float64(stats.Hits) / float64(total)
+	}
+	data, err := json.Marshal(struct {
+		fsmgr.CacheStats
+		HitRate float64 `json:"hit_rate"`
+	}{stats, hitRate})
+	if err != nil {
+		http.Error(rsp, "", http.StatusInternalServerError)
+		return
+	}
+	rsp.Header().Set("Content-Type", "application/json")
+	rsp.Write(data)
+}
+
+func handleCommitCacheStats(rsp http.ResponseWriter, r *http.Request) {
+	stats := commitmgr.GetCacheStats()
+	var hitRate float64
+	if total := stats.Hits + stats.Misses; total > 0 {
+		hitRate = float64(stats.Hits) / float64(total)
+	}
+	data, err := json.Marshal(struct {
+		commitmgr.CacheStats
+		HitRate float64 `json:"hit_rate"`
+	}{stats, hitRate})
+	if err != nil {
+		http.Error(rsp, "", http.StatusInternalServerError)
+		return
+	}
+	rsp.Header().Set("Content-Type", "application/json")
+	rsp.Write(data)
+}
+
+func handleFsIDListCacheStats(rsp http.ResponseWriter, r *http.Request) {
+	data, err := json.Marshal(fsIDLists.stats())
+	if err != nil {
+		http.Error(rsp, "", http.StatusInternalServerError)
+		return
+	}
+	rsp.Header().Set("Content-Type", "application/json")
+	rsp.Write(data)
+}
+
+type reuseBucket struct {
+	Below uint64 `json:"below"`
+	Reads uint64 `json:"reads"`
+}
+
+type classAccessStats struct {
+	Class         string               `json:"class"`
+	SampledReads  uint64               `json:"sampled_reads"`
+	FollowedReads uint64               `json:"followed_reads"`
+	ColdReads     uint64               `json:"cold_reads"`
+	Top           []accessstats.Hitter `json:"top"`
+	ReuseDistance []reuseBucket        `json:"reuse_distance"`
+}
+
+// handleAccessStats returns the same json as the get_access_stats rpc of
+// seaf-server. "below" is 0 for the last bucket of reuse distances.
+func handleAccessStats(rsp http.ResponseWriter, r *http.Request) {
+	ret := struct {
+		SampleRate int                `json:"sample_rate"`
+		Classes    []classAccessStats `json:"classes"`
+	}{SampleRate: accessstats.SampleRate()}
+	if ret.SampleRate > 0 {
+		for c := accessstats.Class(0); c < accessstats.NumClasses; c++ {
+			stats := accessstats.Get(c)
+			cls := classAccessStats{c.String(), stats.Sampled, stats.Followed, stats.Cold, stats.Top, nil}
+			for i, n := range stats.Reuse {
+				var below uint64
+				if i < accessstats.NumReuseBuckets-1 {
+					below = 1 << i
+				}
+				cls.ReuseDistance = append(cls.ReuseDistance, reuseBucket{below, n})
+			}
+			ret.Classes = append(ret.Classes, cls)
+		}
+	}
+	data, err := json.Marshal(ret)
+	if err != nil {
+		http.Error(rsp, "", http.StatusInternalServerError)
+		return
+	}
+	rsp.Header().Set("Content-Type", "application/json")
+	rsp.Write(data)
+}
+
+func handleIndexingStats(rsp http.ResponseWriter, r *http.Request) {
+	data, err := json.Marshal(chunker.stats())
+	if err != nil {
+		http.Error(rsp, "", http.StatusInternalServerError)
+		return
+	}
+	rsp.Header().Set("Content-Type", "application/json")
+	rsp.Write(data)
+}
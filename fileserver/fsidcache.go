@@ -0,0 +1,153 @@
+package main
+
+import (
+	"container/list"
+	"context"
+	"sync"
+	"sync/atomic"
+)
+
+// The fs id list for a pair of commits never changes, and when a commit is
+// pushed to a library shared by many devices they all ask for the same list.
+// So computed lists are cached as json, and a request for a list that is
+// being computed waits for the result instead of computing it again.
+// Finished lists are evicted in LRU order.
+
+// FsIDListCacheStats contains counters of the fs id list cache.
+type FsIDListCacheStats struct {
+	Hits      uint64 `json:"hits"`
+	Misses    uint64 `json:"misses"`
+	Coalesced uint64 `json:"coalesced"`
+	Items     int    `json:"items"`
+	Bytes     int64  `json:"bytes"`
+	Limit     int64  `json:"limit"`
+}
+
+type fsIDListEntry struct {
+	key  string
+	data []byte
+}
+
+type fsIDListCall struct {
+	done     chan struct{}
+	data     []byte
+	err      error
+	canceled bool
+}
+
+type fsIDListCache struct {
+	mu       sync.Mutex
+	entries  map[string]*list.Element
+	lru      *list.List
+	calls    map[string]*fsIDListCall
+	bytes    int64
+	maxBytes int64
+
+	// Accessed atomically.
+	hits      uint64
+	misses    uint64
+	coalesced uint64
+}
+
+var fsIDLists *fsIDListCache
+
+func newFsIDListCache(limit int64) *fsIDListCache {
+	return &fsIDListCache{
+		entries:  make(map[string]*list.Element),
+		lru:      list.New(),
+		calls:    make(map[string]*fsIDListCall),
+		maxBytes: limit,
+	}
+}
+
+// get returns the cached list of key, or the result of compute. Only one
+// compute runs for a key at a time. The returned data must not be modified.
+func (c *fsIDListCache) get(ctx context.Context, key string, compute func(ctx context.Context) ([]byte, error)) ([]byte, error) {
+	for {
+		c.mu.Lock()
+		if elem, ok := c.entries[key]; ok {
+			c.lru.MoveToFront(elem)
+			c.mu.Unlock()
+			atomic.AddUint64(&c.hits, 1)
+			return elem.Value.(*fsIDListEntry).data, nil
+		}
+
+		if call, ok := c.calls[key]; ok {
+			c.mu.Unlock()
+			atomic.AddUint64(&c.coalesced, 1)
+			select {
+			case <-call.done:
+			case <-ctx.Done():
+				return nil, ctx.Err()
+			}
+			// The request that computed the list went away, try again.
+			if call.canceled && ctx.Err() == nil {
+				continue
+			}
+			return call.data, call.err
+		}
+
+		call := &fsIDListCall{done: make(chan struct{})}
+		c.calls[key] = call
+		c.mu.Unlock()
+		atomic.AddUint64(&c.misses, 1)
+
+		call.data, call.err = compute(ctx)
+		call.canceled = call.err != nil && ctx.Err() != nil
+
+		c.mu.Lock()
+		delete(c.calls, key)
+		if call.err == nil {
+			c.add(key, call.data)
+		}
+		c.mu.Unlock()
+		close(call.done)
+
+		return call.data, call.err
+	}
+}
+
+// lookup returns the cached list of key, without computing it.
+func (c *fsIDListCache) lookup(key string) ([]byte, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if elem, ok := c.entries[key]; ok {
+		c.lru.MoveToFront(elem)
+		atomic.AddUint64(&c.hits, 1)
+		return elem.Value.(*fsIDListEntry).data, true
+	}
+	return nil, false
+}
+
+// add must be called with c.mu held.
+func (c *fsIDListCache) add(key string, data []byte) {
+	size := int64(len(key) + len(data))
+	// A single list must not flush a large part of the cache.
+	if size > c.maxBytes/4 {
+		return
+	}
+	for c.bytes+size > c.maxBytes {
+		elem := c.lru.Back()
+		if elem == nil {
+			break
+		}
+		ent := c.lru.Remove(elem).(*fsIDListEntry)
+		delete(c.entries, ent.key)
+		c.bytes -= int64(len(ent.key) + len(ent.data))
+	}
+	c.entries[key] = c.lru.PushFront(&fsIDListEntry{key, data})
+	c.bytes += size
+}
+
+func (c *fsIDListCache) stats() FsIDListCacheStats {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return FsIDListCacheStats{
+		Hits:      atomic.LoadUint64(&c.hits),
+		Misses:    atomic.LoadUint64(&c.misses),
+		Coalesced: atomic.LoadUint64(&c.coalesced),
+		Items:     len(c.entries),
+		Bytes:     c.bytes,
+		Limit:     c.maxBytes,
+	}
+}
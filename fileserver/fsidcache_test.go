@@ -0,0 +1,95 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"sync"
+	"sync/atomic"
+	"testing"
+)
+
+func TestFsIDListCache(t *testing.T) {
+	c := newFsIDListCache(1 << 20)
+
+	// Concurrent requests for one key share a single computation.
+	var computed int32
+	release := make(chan struct{})
+	compute := func(ctx context.Context) ([]byte, error) {
+		atomic.AddInt32(&computed, 1)
+		<-release
+		return []byte(`["a"]`), nil
+	}
+	var wg sync.WaitGroup
+	for i := 0; i < 10; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			data, err := c.get(context.Background(), "k", compute)
+			if err != nil || string(data) != `["a"]` {
+				t.Errorf("got %q, %v", data, err)
+			}
+		}()
+	}
+	for {
+		c.mu.Lock()
+		_, started := c.calls["k"]
+		c.mu.Unlock()
+		if started {
+			break
+		}
+	}
+	close(release)
+	wg.Wait()
+	if n := atomic.LoadInt32(&computed); n != 1 {
+		t.Errorf("list was computed %d times", n)
+	}
+	if _, err := c.get(context.Background(), "k", compute); err != nil || computed != 1 {
+		t.Errorf("finished list was not served from the cache")
+	}
+
+	// Failures are not cached.
+	fail := func(ctx context.Context) ([]byte, error) { return nil, fmt.Errorf("failed") }
+	if _, err := c.get(context.Background(), "bad", fail); err == nil {
+		t.Errorf("expected an error")
+	}
+	if _, ok := c.entries["bad"]; ok {
+		t.Errorf("failed list was cached")
+	}
+
+	// When the request computing a list goes away, a waiter computes it.
+	ctx, cancel := context.WithCancel(context.Background())
+	started := make(chan struct{})
+	go c.get(ctx, "c", func(ctx context.Context) ([]byte, error) {
+		close(started)
+		<-ctx.Done()
+		return nil, ctx.Err()
+	})
+	<-started
+	done := make(chan []byte)
+	go func() {
+		data, _ := c.get(context.Background(), "c", func(ctx context.Context) ([]byte, error) {
+			return []byte(`[]`), nil
+		})
+		done <- data
+	}()
+	cancel()
+	if data := <-done; string(data) != `[]` {
+		t.Errorf("waiter got %q after the computing request was canceled", data)
+	}
+
+	// Least recently used lists are evicted.
+	small := newFsIDListCache(400)
+	value := make([]byte, 90)
+	for i := 0; i < 5; i++ {
+		small.get(context.Background(), fmt.Sprint(i), func(ctx context.Context) ([]byte, error) {
+			return value, nil
+		})
+	}
+	stats := small.stats()
+	if stats.Bytes > 400 || stats.Items != 4 {
+		t.Errorf("cache is over its limit: %+v", stats)
+	}
+	if _, ok := small.entries["0"]; ok {
+		t.Errorf("oldest list was not evicted")
+	}
+}
@@ -0,0 +1,195 @@
+package fsmgr
+
+import (
+	"encoding/hex"
+	"strconv"
+)
+
+// The block ids of files read from the store are kept packed, as 20 raw
+// bytes for each block, and converted to hex one at a time by BlockID. A
+// file with hundreds of thousands of blocks then takes one allocation
+// instead of one string per block, and callers that only need some blocks,
+// like range requests, don't convert the others. Files built with
+// NewSeafile, and files whose JSON isn't in the form written by seafile,
+// keep their ids in BlkIDs.
+
+const rawBlockIDLen = 20
+
+// NumBlocks returns the number of blocks of the file.
+func (file *Seafile) NumBlocks() int {
+	if file.BlkIDs != nil {
+		return len(file.BlkIDs)
+	}
+	return len(file.rawBlkIDs) / rawBlockIDLen
+}
+
+// BlockID returns the id of block i.
+func (file *Seafile) BlockID(i int) string {
+	if file.BlkIDs != nil {
+		return file.BlkIDs[i]
+	}
+	return hex.EncodeToString(file.rawBlkIDs[i*rawBlockIDLen : (i+1)*rawBlockIDLen])
+}
+
+// BlockIDs returns the ids of all blocks. Iterating with NumBlocks and
+// BlockID is cheaper for large files.
+func (file *Seafile) BlockIDs() []string {
+	if file.BlkIDs != nil || file.rawBlkIDs == nil {
+		return file.BlkIDs
+	}
+	ids := make([]string, file.NumBlocks())
+	for i := range ids {
+		ids[i] = file.BlockID(i)
+	}
+	return ids
+}
+
+// jsonScanner reads the JSON of file objects as written by seafile: an
+// object of ints and an array of block ids, with no escapes in strings.
+// Anything else makes it fail, and the object is left to encoding/json.
+type jsonScanner struct {
+	p   []byte
+	pos int
+}
+
+func (s *jsonScanner) skipSpace() {
+	for s.pos < len(s.p) {
+		switch s.p[s.pos] {
+		case ' ', '\t', '\n', '\r':
+			s.pos++
+		default:
+			return
+		}
+	}
+}
+
+func (s *jsonScanner) consume(c byte) bool {
+	s.skipSpace()
+	if s.pos < len(s.p) && s.p[s.pos] == c {
+		s.pos++
+		return true
+	}
+	return false
+}
+
+// readString returns the bytes of a string without escapes.
+func (s *jsonScanner) readString() ([]byte, bool) {
+	if !s.consume('"') {
+		return nil, false
+	}
+	start := s.pos
+	for s.pos < len(s.p) {
+		switch s.p[s.pos] {
+		case '"':
+			s.pos++
+			return s.p[start : s.pos-1], true
+		case '\\':
+			return nil, false
+		}
+		s.pos++
+	}
+	return nil, false
+}
+
+func (s *jsonScanner) readInt() (int64, bool) {
+	s.skipSpace()
+	start := s.pos
+	if s.pos < len(s.p) && s.p[s.pos] == '-' {
+		s.pos++
+	}
+	for s.pos < len(s.p) && s.p[s.pos] >= '0' && s.p[s.pos] <= '9' {
+		s.pos++
+	}
+	v, err := strconv.ParseInt(string(s.p[start:s.pos]), 10, 64)
+	return v, err == nil
+}
+
+// readBlockIDs decodes an array of hex ids into raw ids. The size of the
+// object bounds the number of ids, so the result is allocated once.
+func (s *jsonScanner) readBlockIDs() ([]byte, bool) {
+	if !s.consume('[') {
+		return nil, false
+	}
+	// Each id takes at least 42 bytes with its quotes and a comma.
+	raw := make([]byte, 0, (len(s.p)-s.pos)/42*rawBlockIDLen+rawBlockIDLen)
+	if s.consume(']') {
+		return raw, true
+	}
+	for {
+		id, ok := s.readString()
+		if !ok || len(id) != 2*rawBlockIDLen {
+			return nil, false
+		}
+		n := len(raw)
+		raw = raw[:n+rawBlockIDLen]
+		if _, err := hex.Decode(raw[n:], id); err != nil {
+			return nil, false
+		}
+		// Upper case ids would not be written back the same.
+		for _, c := range id {
+			if c >= 'A' && c <= 'F' {
+				return nil, false
+			}
+		}
+		if s.consume(']') {
+			return raw, true
+		}
+		if !s.consume(',') {
+			return nil, false
+		}
+	}
+}
+
+// fromJSONFast decodes the JSON of a file object, returning false if the
+// data isn't in the expected form. The fields are only set on success.
+func (file *Seafile) fromJSONFast(p []byte) bool {
+	s := &jsonScanner{p: p}
+	var raw []byte
+	var size, fileType, version int64
+	var ok, hasBlocks bool
+
+	if !s.consume('{') {
+		return false
+	}
+	if !s.consume('}') {
+		for {
+			key, ok2 := s.readString()
+			if !ok2 || !s.consume(':') {
+				return false
+			}
+			switch string(key) {
+			case "block_ids":
+				raw, ok = s.readBlockIDs()
+				hasBlocks = true
+			case "size":
+				size, ok = s.readInt()
+			case "type":
+				fileType, ok = s.readInt()
+			case "version":
+				version, ok = s.readInt()
+			default:
+				ok = false
+			}
+			if !ok {
+				return false
+			}
+			if s.consume('}') {
+				break
+			}
+			if !s.consume(',') {
+				return false
+			}
+		}
+	}
+	s.skipSpace()
+	if s.pos != len(s.p) || !hasBlocks || size < 0 {
+		return false
+	}
+
+	file.rawBlkIDs = raw
+	file.BlkIDs = nil
+	file.FileSize = uint64(size)
+	file.FileType = int(fileType)
+	file.Version = int(version)
+	return true
+}
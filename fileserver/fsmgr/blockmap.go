@@ -0,0 +1,58 @@
+package fsmgr
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+
+	"github.com/haiwen/seafile-server/fileserver/objstore"
+)
+
+// The block map of a file lists the sizes of its blocks. Since a file id
+// always maps to the same blocks, the map is built once and kept in the
+// "blockmaps" object store next to the file object, keyed by the file id.
+// Files without a saved map have it built from the block metadata.
+
+var blockMapStore *objstore.ObjectStore
+
+// GetBlockMap returns the saved block map of seafile, or false if there is
+// none or it doesn't match the blocks of the file.
+func GetBlockMap(repoID string, seafile *Seafile) ([]int64, bool) {
+	if seafile.NumBlocks() == 0 {
+		return []int64{}, true
+	}
+
+	var buf bytes.Buffer
+	if err := blockMapStore.Read(repoID, seafile.FileID, &buf); err != nil {
+		return nil, false
+	}
+
+	var blockSizes []int64
+	if err := json.Unmarshal(buf.Bytes(), &blockSizes); err != nil {
+		return nil, false
+	}
+	if len(blockSizes) != seafile.NumBlocks() {
+		return nil, false
+	}
+
+	return blockSizes, true
+}
+
+// SaveBlockMap saves the block map of a file.
+func SaveBlockMap(repoID string, fileID string, blockSizes []int64) error {
+	if fileID == EmptySha1 {
+		return nil
+	}
+
+	data, err := json.Marshal(blockSizes)
+	if err != nil {
+		return err
+	}
+
+	err = blockMapStore.Write(repoID, fileID, bytes.NewReader(data), false)
+	if err != nil {
+		return fmt.Errorf("failed to write block map of %s/%s: %v", repoID, fileID, err)
+	}
+
+	return nil
+}
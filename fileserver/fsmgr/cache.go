@@ -0,0 +1,260 @@
+package fsmgr
+
+import (
+	"container/list"
+	"hash/fnv"
+	"sort"
+	"sync"
+	"sync/atomic"
+)
+
+// Objects are content-addressed and never change once written, so cached
+// entries never need to be invalidated. Callers of GetSeafdir and GetSeafile
+// are free to modify the returned object, so the cache always hands out copies.
+// Cached dirs also keep their entries sorted by name, so single entries can be
+// looked up without copying the whole dir.
+
+const (
+	defaultCacheLimit = 100 << 20
+	cacheShards       = 16
+)
+
+// CacheStats contains counters of the fs object cache.
+type CacheStats struct {
+	Hits      uint64 `json:"hits"`
+	Misses    uint64 `json:"misses"`
+	Evictions uint64 `json:"evictions"`
+	Items     int64  `json:"items"`
+	Bytes     int64  `json:"bytes"`
+	Limit     int64  `json:"limit"`
+}
+
+type cacheEntry struct {
+	key   string
+	value interface{}
+	size  int64
+}
+
+type cacheShard struct {
+	mu       sync.Mutex
+	entries  map[string]*list.Element
+	lru      *list.List
+	bytes    int64
+	maxBytes int64
+}
+
+type objCache struct {
+	shards    [cacheShards]*cacheShard
+	limit     int64
+	hits      uint64
+	misses    uint64
+	evictions uint64
+}
+
+var cache *objCache
+
+func newObjCache(limit int64) *objCache {
+	if limit <= 0 {
+		return nil
+	}
+	c := new(objCache)
+	c.limit = limit
+	for i := range c.shards {
+		c.shards[i] = &cacheShard{
+			entries:  make(map[string]*list.Element),
+			lru:      list.New(),
+			maxBytes: limit / cacheShards,
+		}
+	}
+	return c
+}
+
+// SetCacheLimit sets the memory budget of the fs object cache in bytes.
+// Cached objects are dropped. A limit of 0 disables the cache.
+func SetCacheLimit(limit int64) {
+	cache = newObjCache(limit)
+}
+
+// GetCacheStats returns the counters of the fs object cache.
+func GetCacheStats() CacheStats {
+	var stats CacheStats
+	c := cache
+	if c == nil {
+		return stats
+	}
+	stats.Hits = atomic.LoadUint64(&c.hits)
+	stats.Misses = atomic.LoadUint64(&c.misses)
+	stats.Evictions = atomic.LoadUint64(&c.evictions)
+	stats.Limit = c.limit
+	for _, s := range c.shards {
+		s.mu.Lock()
+		stats.Items += int64(len(s.entries))
+		stats.Bytes += s.bytes
+		s.mu.Unlock()
+	}
+	return stats
+}
+
+func cacheKey(repoID, objID string) string {
+	return repoID + "/" + objID
+}
+
+func (c *objCache) shard(key string) *cacheShard {
+	h := fnv.New32a()
+	h.Write([]byte(key))
+	return c.shards[h.Sum32()%cacheShards]
+}
+
+func (c *objCache) get(key string) interface{} {
+	s := c.shard(key)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	elem, ok := s.entries[key]
+	if !ok {
+		atomic.AddUint64(&c.misses, 1)
+		return nil
+	}
+	atomic.AddUint64(&c.hits, 1)
+	s.lru.MoveToFront(elem)
+	return elem.Value.(*cacheEntry).value
+}
+
+func (c *objCache) add(key string, value interface{}, size int64) {
+	s := c.shard(key)
+	// Admission control: a single object must not flush a large part of the shard.
+	if size > s.maxBytes/4 {
+		return
+	}
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if elem, ok := s.entries[key]; ok {
+		s.lru.MoveToFront(elem)
+		return
+	}
+	for s.bytes+size > s.maxBytes {
+		elem := s.lru.Back()
+		if elem == nil {
+			break
+		}
+		ent := s.lru.Remove(elem).(*cacheEntry)
+		delete(s.entries, ent.key)
+		s.bytes -= ent.size
+		atomic.AddUint64(&c.evictions, 1)
+	}
+	s.entries[key] = s.lru.PushFront(&cacheEntry{key, value, size})
+	s.bytes += size
+}
+
+type cachedDir struct {
+	dir    *SeafDir
+	byName []*SeafDirent
+}
+
+func newCachedDir(dir *SeafDir) *cachedDir {
+	cd := &cachedDir{dir: dir.clone()}
+	cd.byName = make([]*SeafDirent, len(cd.dir.Entries))
+	copy(cd.byName, cd.dir.Entries)
+	sort.Slice(cd.byName, func(i, j int) bool { return cd.byName[i].Name < cd.byName[j].Name })
+	return cd
+}
+
+func (cd *cachedDir) lookup(name string) *SeafDirent {
+	i := sort.Search(len(cd.byName), func(i int) bool { return cd.byName[i].Name >= name })
+	if i < len(cd.byName) && cd.byName[i].Name == name {
+		dent := *cd.byName[i]
+		return &dent
+	}
+	return nil
+}
+
+func (dir *SeafDir) memSize() int64 {
+	size := int64(128 + len(dir.DirID))
+	size += int64(len(dir.Entries)) * 8
+	for _, dent := range dir.Entries {
+		size += int64(96 + len(dent.ID) + len(dent.Name) + len(dent.Modifier))
+	}
+	return size
+}
+
+func (file *Seafile) memSize() int64 {
+	return int64(128+len(file.FileID)+len(file.rawBlkIDs)) + int64(len(file.BlkIDs))*(16+40)
+}
+
+func (dir *SeafDir) clone() *SeafDir {
+	newDir := &SeafDir{
+		Version: dir.Version,
+		DirType: dir.DirType,
+		DirID:   dir.DirID,
+	}
+	if dir.Entries != nil {
+		newDir.Entries = make([]*SeafDirent, len(dir.Entries))
+		for i, dent := range dir.Entries {
+			newDent := *dent
+			newDir.Entries[i] = &newDent
+		}
+	}
+	return newDir
+}
+
+func (file *Seafile) clone() *Seafile {
+	newFile := *file
+	newFile.data = nil
+	// rawBlkIDs is never modified and is shared.
+	if file.BlkIDs != nil {
+		newFile.BlkIDs = make([]string, len(file.BlkIDs))
+		copy(newFile.BlkIDs, file.BlkIDs)
+	}
+	return &newFile
+}
+
+func getCachedSeafdir(repoID, dirID string) *SeafDir {
+	c := cache
+	if c == nil {
+		return nil
+	}
+	if v := c.get(cacheKey(repoID, dirID)); v != nil {
+		return v.(*cachedDir).dir.clone()
+	}
+	return nil
+}
+
+// lookupCachedDirent returns a copy of the entry called name in a cached dir.
+// ok is false if the dir is not cached.
+func lookupCachedDirent(repoID, dirID, name string) (dent *SeafDirent, ok bool) {
+	c := cache
+	if c == nil {
+		return nil, false
+	}
+	if v := c.get(cacheKey(repoID, dirID)); v != nil {
+		return v.(*cachedDir).lookup(name), true
+	}
+	return nil, false
+}
+
+func addCachedSeafdir(repoID string, dir *SeafDir) {
+	c := cache
+	if c == nil {
+		return
+	}
+	c.add(cacheKey(repoID, dir.DirID), newCachedDir(dir), dir.memSize())
+}
+
+func getCachedSeafile(repoID, fileID string) *Seafile {
+	c := cache
+	if c == nil {
+		return nil
+	}
+	if v := c.get(cacheKey(repoID, fileID)); v != nil {
+		return v.(*Seafile).clone()
+	}
+	return nil
+}
+
+func addCachedSeafile(repoID string, file *Seafile) {
+	c := cache
+	if c == nil {
+		return
+	}
+	c.add(cacheKey(repoID, file.FileID), file.clone(), file.memSize())
+}
@@ -0,0 +1,160 @@
+package fsmgr
+
+import (
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"sort"
+)
+
+// The binary dir format is written for dir version 2 and later. It is the
+// same as in common/fs-mgr.c:
+//
+//	magic (4 bytes) | uvarint n_entries | n_entries * offset (4 bytes, BE) | entries
+//
+// Each offset is the position of an entry relative to the first entry. An entry is
+//
+//	uvarint mode | raw id (20 bytes) | uvarint name_len | name
+//	| varint mtime [| varint size | uvarint modifier_len | modifier]
+//
+// where size and modifier are only present for files. Entries are sorted by
+// name in descending order. Binary dir objects are not compressed.
+
+// DirVersionBinary is the first dir version stored in the binary format.
+const DirVersionBinary = 2
+
+const dirBinaryMagic = "SFD\x02"
+
+// DirVersionFromRepoVersion returns the dir object version for a repo version.
+func DirVersionFromRepoVersion(repoVersion int) int {
+	if repoVersion == 0 {
+		return 0
+	} else if repoVersion >= DirVersionSegmented {
+		return DirVersionSegmented
+	} else if repoVersion >= DirVersionBinary {
+		return DirVersionBinary
+	}
+	return 1
+}
+
+func isBinaryDir(p []byte) bool {
+	return len(p) >= len(dirBinaryMagic) && string(p[:len(dirBinaryMagic)]) == dirBinaryMagic
+}
+
+func appendUvarint(buf []byte, v uint64) []byte {
+	var tmp [binary.MaxVarintLen64]byte
+	n := binary.PutUvarint(tmp[:], v)
+	return append(buf, tmp[:n]...)
+}
+
+func appendVarint(buf []byte, v int64) []byte {
+	var tmp [binary.MaxVarintLen64]byte
+	n := binary.PutVarint(tmp[:], v)
+	return append(buf, tmp[:n]...)
+}
+
+func appendString(buf []byte, s string) []byte {
+	buf = appendUvarint(buf, uint64(len(s)))
+	return append(buf, s...)
+}
+
+func (dir *SeafDir) toBinary() ([]byte, error) {
+	dents := make([]*SeafDirent, len(dir.Entries))
+	copy(dents, dir.Entries)
+	sort.SliceStable(dents, func(i, j int) bool { return dents[i].Name > dents[j].Name })
+	return direntsToBinary(dents)
+}
+
+// direntsToBinary encodes dirents that are already sorted.
+func direntsToBinary(dents []*SeafDirent) ([]byte, error) {
+	offsets := make([]byte, 4*len(dents))
+	var entries []byte
+	for i, dent := range dents {
+		binary.BigEndian.PutUint32(offsets[4*i:], uint32(len(entries)))
+		id, err := hex.DecodeString(dent.ID)
+		if err != nil || len(id) != 20 {
+			return nil, fmt.Errorf("invalid dirent id %s", dent.ID)
+		}
+		entries = appendUvarint(entries, uint64(dent.Mode))
+		entries = append(entries, id...)
+		entries = appendString(entries, dent.Name)
+		entries = appendVarint(entries, dent.Mtime)
+		if IsRegular(dent.Mode) {
+			entries = appendVarint(entries, dent.Size)
+			entries = appendString(entries, dent.Modifier)
+		}
+	}
+
+	buf := []byte(dirBinaryMagic)
+	buf = appendUvarint(buf, uint64(len(dents)))
+	buf = append(buf, offsets...)
+	buf = append(buf, entries...)
+	return buf, nil
+}
+
+func readString(p []byte) (string, []byte, error) {
+	n, k := binary.Uvarint(p)
+	if k <= 0 || n > uint64(len(p)-k) {
+		return "", nil, fmt.Errorf("bad string")
+	}
+	p = p[k:]
+	return string(p[:n]), p[n:], nil
+}
+
+func parseBinaryDirent(p []byte) (*SeafDirent, error) {
+	dent := new(SeafDirent)
+	mode, k := binary.Uvarint(p)
+	if k <= 0 || len(p)-k < 20 {
+		return nil, fmt.Errorf("bad dirent")
+	}
+	dent.Mode = uint32(mode)
+	p = p[k:]
+	dent.ID = hex.EncodeToString(p[:20])
+	p = p[20:]
+
+	var err error
+	if dent.Name, p, err = readString(p); err != nil {
+		return nil, err
+	}
+	if dent.Mtime, k = binary.Varint(p); k <= 0 {
+		return nil, fmt.Errorf("bad dirent mtime")
+	}
+	p = p[k:]
+	if IsRegular(dent.Mode) {
+		if dent.Size, k = binary.Varint(p); k <= 0 {
+			return nil, fmt.Errorf("bad dirent size")
+		}
+		p = p[k:]
+		if dent.Modifier, _, err = readString(p); err != nil {
+			return nil, err
+		}
+	}
+	return dent, nil
+}
+
+func (dir *SeafDir) fromBinary(p []byte) error {
+	p = p[len(dirBinaryMagic):]
+	n, k := binary.Uvarint(p)
+	if k <= 0 || n > uint64(len(p)-k)/4 {
+		return fmt.Errorf("bad binary dir")
+	}
+	p = p[k:]
+	offsets := p[:4*n]
+	entries := p[4*n:]
+
+	dir.Version = DirVersionBinary
+	dir.DirType = SeafMetadataTypeDir
+	dir.Entries = make([]*SeafDirent, n)
+	for i := range dir.Entries {
+		off := binary.BigEndian.Uint32(offsets[4*i:])
+		if int64(off) >= int64(len(entries)) {
+			return fmt.Errorf("bad dirent offset")
+		}
+		dent, err := parseBinaryDirent(entries[off:])
+		if err != nil {
+			return err
+		}
+		dir.Entries[i] = dent
+	}
+	return nil
+}
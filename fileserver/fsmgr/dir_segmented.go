@@ -0,0 +1,193 @@
+package fsmgr
+
+import (
+	"bytes"
+	"crypto/sha1"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"sort"
+)
+
+// Large dirs of dir version 3 and later are split into segments, as in
+// common/fs-mgr.c. A dir with more than dirSegmentMaxEntries entries is
+// stored as an index
+//
+//	magic (4 bytes) | uvarint n_segments
+//	| n_segments * (raw id (20 bytes) | uvarint n_entries | uvarint name_len | name)
+//
+// where each segment is a binary dir object holding a run of the sorted
+// entries, and name is the first (largest) name in it. A segment ends after
+// an entry whose name hashes to a cut point, so adding or removing an entry
+// only rewrites one segment and the index. Smaller dirs use the binary format.
+
+// DirVersionSegmented is the first dir version whose large dirs are segmented.
+const DirVersionSegmented = 3
+
+const dirSegmentedMagic = "SFD\x03"
+
+const (
+	dirSegmentMinEntries = 64
+	dirSegmentMaxEntries = 4096
+	// Segments are 1024 entries long on average.
+	dirSegmentCutMask = 0x3ff
+)
+
+type dirSegment struct {
+	id       string
+	nEntries int
+	name     string
+	// Only set for dirs built in memory, until they are saved.
+	data []byte
+}
+
+func isSegmentedDir(p []byte) bool {
+	return len(p) >= len(dirSegmentedMagic) && string(p[:len(dirSegmentedMagic)]) == dirSegmentedMagic
+}
+
+// nameHash is FNV-1a.
+func nameHash(name string) uint32 {
+	hash := uint32(2166136261)
+	for i := 0; i < len(name); i++ {
+		hash ^= uint32(name[i])
+		hash *= 16777619
+	}
+	return hash
+}
+
+func isSegmentEnd(dent *SeafDirent, nEntries int) bool {
+	if nEntries >= dirSegmentMaxEntries {
+		return true
+	}
+	return nEntries >= dirSegmentMinEntries && nameHash(dent.Name)&dirSegmentCutMask == 0
+}
+
+// toSegmented returns the data of the index, and sets dir.segments to the
+// segments to be saved along with it.
+func (dir *SeafDir) toSegmented() ([]byte, error) {
+	if len(dir.Entries) <= dirSegmentMaxEntries {
+		return dir.toBinary()
+	}
+
+	dents := make([]*SeafDirent, len(dir.Entries))
+	copy(dents, dir.Entries)
+	sort.SliceStable(dents, func(i, j int) bool { return dents[i].Name > dents[j].Name })
+
+	dir.segments = nil
+	start := 0
+	for i, dent := range dents {
+		if i+1 < len(dents) && !isSegmentEnd(dent, i+1-start) {
+			continue
+		}
+		data, err := direntsToBinary(dents[start : i+1])
+		if err != nil {
+			return nil, err
+		}
+		checksum := sha1.Sum(data)
+		seg := &dirSegment{
+			id:       hex.EncodeToString(checksum[:]),
+			nEntries: i + 1 - start,
+			name:     dents[start].Name,
+			data:     data,
+		}
+		dir.segments = append(dir.segments, seg)
+		start = i + 1
+	}
+
+	buf := []byte(dirSegmentedMagic)
+	buf = appendUvarint(buf, uint64(len(dir.segments)))
+	for _, seg := range dir.segments {
+		id, _ := hex.DecodeString(seg.id)
+		buf = append(buf, id...)
+		buf = appendUvarint(buf, uint64(seg.nEntries))
+		buf = appendString(buf, seg.name)
+	}
+	return buf, nil
+}
+
+func parseSegments(p []byte) ([]*dirSegment, error) {
+	p = p[len(dirSegmentedMagic):]
+	n, k := binary.Uvarint(p)
+	if k <= 0 || n == 0 || n > uint64(len(p)-k)/20 {
+		return nil, fmt.Errorf("bad segmented dir")
+	}
+	p = p[k:]
+
+	segments := make([]*dirSegment, n)
+	for i := range segments {
+		if len(p) < 20 {
+			return nil, fmt.Errorf("bad segmented dir")
+		}
+		seg := &dirSegment{id: hex.EncodeToString(p[:20])}
+		p = p[20:]
+		nEntries, k := binary.Uvarint(p)
+		if k <= 0 {
+			return nil, fmt.Errorf("bad segmented dir")
+		}
+		seg.nEntries = int(nEntries)
+		var err error
+		if seg.name, p, err = readString(p[k:]); err != nil {
+			return nil, err
+		}
+		segments[i] = seg
+	}
+	return segments, nil
+}
+
+func readSegment(repoID string, seg *dirSegment) (*SeafDir, error) {
+	var buf bytes.Buffer
+	if err := ReadRaw(repoID, seg.id, &buf); err != nil {
+		return nil, fmt.Errorf("failed to read segment %s: %v", seg.id, err)
+	}
+	if !isBinaryDir(buf.Bytes()) {
+		return nil, fmt.Errorf("bad segment %s", seg.id)
+	}
+	part := new(SeafDir)
+	if err := part.fromBinary(buf.Bytes()); err != nil {
+		return nil, fmt.Errorf("bad segment %s: %v", seg.id, err)
+	}
+	part.DirID = seg.id
+	return part, nil
+}
+
+func (dir *SeafDir) fromSegmented(repoID string, p []byte) error {
+	segments, err := parseSegments(p)
+	if err != nil {
+		return err
+	}
+
+	dir.Version = DirVersionSegmented
+	dir.DirType = SeafMetadataTypeDir
+	dir.Entries = nil
+	for _, seg := range segments {
+		part, err := readSegment(repoID, seg)
+		if err != nil {
+			return err
+		}
+		dir.Entries = append(dir.Entries, part.Entries...)
+	}
+	dir.segments = segments
+	return nil
+}
+
+// lookupSegmentedDirent only loads the segment that can hold name. Segments
+// are sorted by name in descending order, so it is the last one whose first
+// name is not smaller.
+func lookupSegmentedDirent(repoID, dirID string, p []byte, name string) (*SeafDirent, error) {
+	segments, err := parseSegments(p)
+	if err != nil {
+		return nil, fmt.Errorf("failed to parse seafdir object %s/%s : %v", repoID, dirID, err)
+	}
+
+	var found *dirSegment
+	for _, seg := range segments {
+		if seg.name < name {
+			break
+		}
+		found = seg
+	}
+	if found == nil {
+		return nil, nil
+	}
+	return lookupDirent(repoID, found.id, name)
+}
@@ -0,0 +1,177 @@
+package fsmgr
+
+import (
+	"bytes"
+	"compress/zlib"
+	"io"
+	"strconv"
+	"sync"
+	"unicode/utf8"
+)
+
+// Fs objects are encoded by appending to pooled buffers, and compressed with
+// pooled zlib writers and readers, so saving and loading objects makes
+// little garbage. The JSON is the same as json.Marshal writes for each
+// value, since the object ids are the sha1 of it.
+
+// Buffers grown beyond this are not kept in the pools.
+const maxPooledBufferSize = 1 << 20
+
+var bufferPool = sync.Pool{
+	New: func() interface{} { return new(bytes.Buffer) },
+}
+
+func getBuffer() *bytes.Buffer {
+	return bufferPool.Get().(*bytes.Buffer)
+}
+
+func putBuffer(buf *bytes.Buffer) {
+	if buf.Cap() > maxPooledBufferSize {
+		return
+	}
+	buf.Reset()
+	bufferPool.Put(buf)
+}
+
+type jsonBuffer struct {
+	b []byte
+}
+
+var jsonBufferPool = sync.Pool{
+	New: func() interface{} { return &jsonBuffer{b: make([]byte, 0, 4096)} },
+}
+
+// encodeJSON runs encode on a pooled buffer and returns a copy of the result.
+func encodeJSON(encode func(b []byte) []byte) []byte {
+	jb := jsonBufferPool.Get().(*jsonBuffer)
+	jb.b = encode(jb.b[:0])
+	data := make([]byte, len(jb.b))
+	copy(data, jb.b)
+	if cap(jb.b) <= maxPooledBufferSize {
+		jsonBufferPool.Put(jb)
+	}
+	return data
+}
+
+const hexDigits = "0123456789abcdef"
+
+// appendJSONString appends s quoted like json.Marshal does, which escapes
+// <, > and & as well, and replaces invalid UTF-8 with U+FFFD.
+func appendJSONString(b []byte, s string) []byte {
+	b = append(b, '"')
+	start := 0
+	for i := 0; i < len(s); {
+		if c := s[i]; c < utf8.RuneSelf {
+			if c >= 0x20 && c != '"' && c != '\\' && c != '<' && c != '>' && c != '&' {
+				i++
+				continue
+			}
+			b = append(b, s[start:i]...)
+			switch c {
+			case '"', '\\':
+				b = append(b, '\\', c)
+			case '\n':
+				b = append(b, '\\', 'n')
+			case '\r':
+				b = append(b, '\\', 'r')
+			case '\t':
+				b = append(b, '\\', 't')
+			default:
+				b = append(b, '\\', 'u', '0', '0', hexDigits[c>>4], hexDigits[c&0xF])
+			}
+			i++
+			start = i
+			continue
+		}
+		r, size := utf8.DecodeRuneInString(s[i:])
+		if r == utf8.RuneError && size == 1 {
+			b = append(b, s[start:i]...)
+			b = append(b, `\ufffd`...)
+			i += size
+			start = i
+			continue
+		}
+		// U+2028 and U+2029 are escaped for JSONP, as by json.Marshal.
+		if r == '\u2028' || r == '\u2029' {
+			b = append(b, s[start:i]...)
+			b = append(b, '\\', 'u', '2', '0', '2', hexDigits[r&0xF])
+			i += size
+			start = i
+			continue
+		}
+		i += size
+	}
+	b = append(b, s[start:]...)
+	return append(b, '"')
+}
+
+// appendJSONKey appends `"key": `, with key not needing escapes.
+func appendJSONKey(b []byte, key string) []byte {
+	b = append(b, '"')
+	b = append(b, key...)
+	return append(b, '"', ':', ' ')
+}
+
+func appendJSONInt(b []byte, key string, v int64) []byte {
+	return strconv.AppendInt(appendJSONKey(b, key), v, 10)
+}
+
+func appendJSONUint(b []byte, key string, v uint64) []byte {
+	return strconv.AppendUint(appendJSONKey(b, key), v, 10)
+}
+
+var zlibWriterPool sync.Pool
+
+// compress returns the zlib stream of p in a pooled buffer, which the caller
+// releases with putBuffer.
+func compress(p []byte) (*bytes.Buffer, error) {
+	out := getBuffer()
+	w, ok := zlibWriterPool.Get().(*zlib.Writer)
+	if ok {
+		w.Reset(out)
+	} else {
+		w = zlib.NewWriter(out)
+	}
+
+	_, err := w.Write(p)
+	if err == nil {
+		err = w.Close()
+	}
+	zlibWriterPool.Put(w)
+	if err != nil {
+		putBuffer(out)
+		return nil, err
+	}
+
+	return out, nil
+}
+
+var zlibReaderPool sync.Pool
+
+// uncompress returns the data of the zlib stream p in a pooled buffer, which
+// the caller releases with putBuffer.
+func uncompress(p []byte) (*bytes.Buffer, error) {
+	var r io.ReadCloser
+	var err error
+	b := bytes.NewReader(p)
+	if pooled, ok := zlibReaderPool.Get().(io.ReadCloser); ok {
+		if err = pooled.(zlib.Resetter).Reset(b, nil); err != nil {
+			zlibReaderPool.Put(pooled)
+			return nil, err
+		}
+		r = pooled
+	} else if r, err = zlib.NewReader(b); err != nil {
+		return nil, err
+	}
+
+	out := getBuffer()
+	_, err = out.ReadFrom(r)
+	r.Close()
+	zlibReaderPool.Put(r)
+	if err != nil {
+		putBuffer(out)
+		return nil, err
+	}
+
+	return out, nil
+}
@@ -3,7 +3,6 @@ package fsmgr
 
 import (
 	"bytes"
-	"compress/zlib"
 	"crypto/sha1"
 	"encoding/hex"
 	"encoding/json"
@@ -13,72 +12,43 @@ import (
 	"strings"
 	"syscall"
 
+	"github.com/haiwen/seafile-server/fileserver/accessstats"
 	"github.com/haiwen/seafile-server/fileserver/objstore"
 )
 
 // Seafile is a file object
 type Seafile struct {
-	data     []byte
-	Version  int      `json:"version"`
-	FileType int      `json:"type"`
-	FileID   string   `json:"file_id"`
-	FileSize uint64   `json:"size"`
-	BlkIDs   []string `json:"block_ids"`
+	data []byte
+	// Block ids of files read from the store, see NumBlocks and BlockID.
+	rawBlkIDs []byte
+	Version   int      `json:"version"`
+	FileType  int      `json:"type"`
+	FileID    string   `json:"file_id"`
+	FileSize  uint64   `json:"size"`
+	BlkIDs    []string `json:"block_ids"`
 }
 
 // In the JSON encoding generated by C language, there are spaces after the ',' and ':', and the order of the fields is sorted by the key.
 // So it is not compatible with the json library generated by go.
 func (file *Seafile) toJSON() ([]byte, error) {
-	var buf bytes.Buffer
-	buf.WriteByte('{')
-	buf.WriteString("\"block_ids\": [")
-	for i, blkID := range file.BlkIDs {
-		data, err := json.Marshal(blkID)
-		if err != nil {
-			return nil, err
-		}
-		buf.Write(data)
-		if i < len(file.BlkIDs)-1 {
-			buf.WriteByte(',')
-			buf.WriteByte(' ')
-		}
-	}
-	buf.WriteByte(']')
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err := json.Marshal(file.FileSize)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"size\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err = json.Marshal(SeafMetadataTypeFile)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"type\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err = json.Marshal(file.Version)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"version\"", data)
-
-	buf.WriteByte('}')
-
-	return buf.Bytes(), nil
+	return encodeJSON(file.appendJSON), nil
 }
 
-func writeField(buf *bytes.Buffer, key string, value []byte) {
-	buf.WriteString(key)
-	buf.WriteByte(':')
-	buf.WriteByte(' ')
-	buf.Write(value)
+func (file *Seafile) appendJSON(b []byte) []byte {
+	b = append(b, "{\"block_ids\": ["...)
+	for i := 0; i < file.NumBlocks(); i++ {
+		if i > 0 {
+			b = append(b, ',', ' ')
+		}
+		b = appendJSONString(b, file.BlockID(i))
+	}
+	b = append(b, ']', ',', ' ')
+	b = appendJSONUint(b, "size", file.FileSize)
+	b = append(b, ',', ' ')
+	b = appendJSONInt(b, "type", SeafMetadataTypeFile)
+	b = append(b, ',', ' ')
+	b = appendJSONInt(b, "version", int64(file.Version))
+	return append(b, '}')
 }
 
 // SeafDirent is a dir entry object
@@ -91,108 +61,56 @@ type SeafDirent struct {
 	Size     int64  `json:"size"`
 }
 
-func (dent *SeafDirent) toJSON() ([]byte, error) {
-	var buf bytes.Buffer
-	buf.WriteByte('{')
-	data, err := json.Marshal(dent.ID)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"id\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err = json.Marshal(dent.Mode)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"mode\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
+func (dent *SeafDirent) appendJSON(b []byte) []byte {
+	b = append(b, '{')
+	b = appendJSONKey(b, "id")
+	b = appendJSONString(b, dent.ID)
+	b = append(b, ',', ' ')
+	b = appendJSONUint(b, "mode", uint64(dent.Mode))
+	b = append(b, ',', ' ')
 	if IsRegular(dent.Mode) {
-		data, err = json.Marshal(dent.Modifier)
-		if err != nil {
-			return nil, err
-		}
-		writeField(&buf, "\"modifier\"", data)
-		buf.WriteByte(',')
-		buf.WriteByte(' ')
-	}
-
-	data, err = json.Marshal(dent.Mtime)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"mtime\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err = json.Marshal(dent.Name)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"name\"", data)
-
+		b = appendJSONKey(b, "modifier")
+		b = appendJSONString(b, dent.Modifier)
+		b = append(b, ',', ' ')
+	}
+	b = appendJSONInt(b, "mtime", dent.Mtime)
+	b = append(b, ',', ' ')
+	b = appendJSONKey(b, "name")
+	b = appendJSONString(b, dent.Name)
 	if IsRegular(dent.Mode) {
-		buf.WriteByte(',')
-		buf.WriteByte(' ')
-		data, err = json.Marshal(dent.Size)
-		if err != nil {
-			return nil, err
-		}
-		writeField(&buf, "\"size\"", data)
+		b = append(b, ',', ' ')
+		b = appendJSONInt(b, "size", dent.Size)
 	}
-	buf.WriteByte('}')
-
-	return buf.Bytes(), nil
+	return append(b, '}')
 }
 
-//SeafDir is a dir object
+// SeafDir is a dir object
 type SeafDir struct {
-	data    []byte
-	Version int           `json:"version"`
-	DirType int           `json:"type"`
-	DirID   string        `json:"dir_id"`
-	Entries []*SeafDirent `json:"dirents"`
+	data     []byte
+	segments []*dirSegment
+	Version  int           `json:"version"`
+	DirType  int           `json:"type"`
+	DirID    string        `json:"dir_id"`
+	Entries  []*SeafDirent `json:"dirents"`
 }
 
 func (dir *SeafDir) toJSON() ([]byte, error) {
-	var buf bytes.Buffer
-	buf.WriteByte('{')
-	buf.WriteString("\"dirents\": [")
+	return encodeJSON(dir.appendJSON), nil
+}
+
+func (dir *SeafDir) appendJSON(b []byte) []byte {
+	b = append(b, "{\"dirents\": ["...)
 	for i, entry := range dir.Entries {
-		data, err := entry.toJSON()
-		if err != nil {
-			return nil, err
-		}
-		buf.Write(data)
-		if i < len(dir.Entries)-1 {
-			buf.WriteByte(',')
-			buf.WriteByte(' ')
+		if i > 0 {
+			b = append(b, ',', ' ')
 		}
+		b = entry.appendJSON(b)
 	}
-	buf.WriteByte(']')
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err := json.Marshal(SeafMetadataTypeDir)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"type\"", data)
-	buf.WriteByte(',')
-	buf.WriteByte(' ')
-
-	data, err = json.Marshal(dir.Version)
-	if err != nil {
-		return nil, err
-	}
-	writeField(&buf, "\"version\"", data)
-
-	buf.WriteByte('}')
-
-	return buf.Bytes(), nil
+	b = append(b, ']', ',', ' ')
+	b = appendJSONInt(b, "type", SeafMetadataTypeDir)
+	b = append(b, ',', ' ')
+	b = appendJSONInt(b, "version", int64(dir.Version))
+	return append(b, '}')
 }
 
 // FileCountInfo contains information of files
@@ -220,6 +138,8 @@ const (
 // Init initializes fs manager and creates underlying object store.
 func Init(seafileConfPath string, seafileDataDir string) {
 	store = objstore.New(seafileConfPath, seafileDataDir, "fs")
+	blockMapStore = objstore.New(seafileConfPath, seafileDataDir, "blockmaps")
+	cache = newObjCache(defaultCacheLimit)
 }
 
 // NewDirent initializes a SeafDirent object
@@ -249,13 +169,21 @@ func NewSeafdir(version int, entries []*SeafDirent) (*SeafDir, error) {
 		dir.DirID = EmptySha1
 		return dir, nil
 	}
-	jsonstr, err := dir.toJSON()
+	var data []byte
+	var err error
+	if version >= DirVersionSegmented {
+		data, err = dir.toSegmented()
+	} else if version >= DirVersionBinary {
+		data, err = dir.toBinary()
+	} else {
+		data, err = dir.toJSON()
+	}
 	if err != nil {
-		err := fmt.Errorf("failed to convert seafdir to json")
+		err := fmt.Errorf("failed to encode seafdir: %v", err)
 		return nil, err
 	}
-	dir.data = jsonstr
-	checksum := sha1.Sum(jsonstr)
+	dir.data = data
+	checksum := sha1.Sum(data)
 	dir.DirID = hex.EncodeToString(checksum[:])
 
 	return dir, nil
@@ -284,47 +212,17 @@ func NewSeafile(version int, fileSize int64, blkIDs []string) (*Seafile, error)
 	return seafile, nil
 }
 
-func uncompress(p []byte) ([]byte, error) {
-	b := bytes.NewReader(p)
-	var out bytes.Buffer
-	r, err := zlib.NewReader(b)
-	if err != nil {
-		return nil, err
-	}
-
-	_, err = io.Copy(&out, r)
-	if err != nil {
-		r.Close()
-		return nil, err
-	}
-
-	r.Close()
-
-	return out.Bytes(), nil
-}
-
-func compress(p []byte) ([]byte, error) {
-	var out bytes.Buffer
-	w := zlib.NewWriter(&out)
-
-	_, err := w.Write(p)
-	if err != nil {
-		w.Close()
-		return nil, err
-	}
-
-	w.Close()
-
-	return out.Bytes(), nil
-}
-
 // FromData reads from p and converts JSON-encoded data to Seafile.
 func (seafile *Seafile) FromData(p []byte) error {
 	b, err := uncompress(p)
 	if err != nil {
 		return err
 	}
-	err = json.Unmarshal(b, seafile)
+	defer putBuffer(b)
+	if seafile.fromJSONFast(b.Bytes()) {
+		return nil
+	}
+	err = json.Unmarshal(b.Bytes(), seafile)
 	if err != nil {
 		return err
 	}
@@ -339,7 +237,8 @@ func (seafile *Seafile) ToData(w io.Writer) error {
 		return err
 	}
 
-	_, err = w.Write(buf)
+	_, err = w.Write(buf.Bytes())
+	putBuffer(buf)
 	if err != nil {
 		return err
 	}
@@ -348,13 +247,19 @@ func (seafile *Seafile) ToData(w io.Writer) error {
 }
 
 // ToData converts seafdir to JSON-encoded data and writes to w.
+// Dirs in the binary format are written as they are.
 func (seafdir *SeafDir) ToData(w io.Writer) error {
+	if isBinaryDir(seafdir.data) || isSegmentedDir(seafdir.data) {
+		_, err := w.Write(seafdir.data)
+		return err
+	}
 	buf, err := compress(seafdir.data)
 	if err != nil {
 		return err
 	}
 
-	_, err = w.Write(buf)
+	_, err = w.Write(buf.Bytes())
+	putBuffer(buf)
 	if err != nil {
 		return err
 	}
@@ -362,13 +267,21 @@ func (seafdir *SeafDir) ToData(w io.Writer) error {
 	return nil
 }
 
-// FromData reads from p and converts JSON-encoded data to SeafDir.
+// FromData reads from p and converts JSON-encoded or binary data to SeafDir.
+// Segmented dirs can only be read with GetSeafdir.
 func (seafdir *SeafDir) FromData(p []byte) error {
+	if isBinaryDir(p) {
+		return seafdir.fromBinary(p)
+	}
+	if isSegmentedDir(p) {
+		return fmt.Errorf("segmented dir must be read from the store")
+	}
 	b, err := uncompress(p)
 	if err != nil {
 		return err
 	}
-	err = json.Unmarshal(b, seafdir)
+	err = json.Unmarshal(b.Bytes(), seafdir)
+	putBuffer(b)
 	if err != nil {
 		return err
 	}
@@ -397,14 +310,19 @@ func WriteRaw(repoID string, objID string, r io.Reader) error {
 
 // GetSeafile gets seafile from storage backend.
 func GetSeafile(repoID string, fileID string) (*Seafile, error) {
-	var buf bytes.Buffer
 	seafile := new(Seafile)
 	if fileID == EmptySha1 {
 		seafile.FileID = EmptySha1
 		return seafile, nil
 	}
 
-	err := ReadRaw(repoID, fileID, &buf)
+	if cached := getCachedSeafile(repoID, fileID); cached != nil {
+		return cached, nil
+	}
+
+	buf := getBuffer()
+	defer putBuffer(buf)
+	err := ReadRaw(repoID, fileID, buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to read seafile object from storage : %v", err)
 		return nil, errors
@@ -422,6 +340,7 @@ func GetSeafile(repoID string, fileID string) (*Seafile, error) {
 	}
 
 	seafile.FileID = fileID
+	addCachedSeafile(repoID, seafile)
 
 	return seafile, nil
 }
@@ -439,14 +358,15 @@ func SaveSeafile(repoID string, seafile *Seafile) error {
 	}
 
 	seafile.FileType = SeafMetadataTypeFile
-	var buf bytes.Buffer
-	err := seafile.ToData(&buf)
+	buf := getBuffer()
+	defer putBuffer(buf)
+	err := seafile.ToData(buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to convert seafile object %s/%s to json", repoID, fileID)
 		return errors
 	}
 
-	err = WriteRaw(repoID, fileID, &buf)
+	err = WriteRaw(repoID, fileID, buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to write seafile object to storage : %v", err)
 		return errors
@@ -457,20 +377,41 @@ func SaveSeafile(repoID string, seafile *Seafile) error {
 
 // GetSeafdir gets seafdir from storage backend.
 func GetSeafdir(repoID string, dirID string) (*SeafDir, error) {
-	var buf bytes.Buffer
 	seafdir := new(SeafDir)
 	if dirID == EmptySha1 {
 		seafdir.DirID = EmptySha1
 		return seafdir, nil
 	}
 
-	err := ReadRaw(repoID, dirID, &buf)
+	// Counted before the cache, to see what a cache would get.
+	accessstats.Record(accessstats.Dir, dirID)
+	accessstats.Record(accessstats.Repo, repoID)
+
+	if cached := getCachedSeafdir(repoID, dirID); cached != nil {
+		return cached, nil
+	}
+
+	// The decoders copy what they keep of the data.
+	buf := getBuffer()
+	defer putBuffer(buf)
+	err := ReadRaw(repoID, dirID, buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to read seafdir object from storage : %v", err)
 		return nil, errors
 	}
 
-	err = seafdir.FromData(buf.Bytes())
+	return decodeSeafdir(repoID, dirID, buf.Bytes())
+}
+
+// decodeSeafdir parses the data of dir dirID and caches the dir.
+func decodeSeafdir(repoID, dirID string, p []byte) (*SeafDir, error) {
+	seafdir := new(SeafDir)
+	var err error
+	if isSegmentedDir(p) {
+		err = seafdir.fromSegmented(repoID, p)
+	} else {
+		err = seafdir.FromData(p)
+	}
 	if err != nil {
 		errors := fmt.Errorf("failed to parse seafdir object %s/%s : %v", repoID, dirID, err)
 		return nil, errors
@@ -482,6 +423,7 @@ func GetSeafdir(repoID string, dirID string) (*SeafDir, error) {
 	}
 
 	seafdir.DirID = dirID
+	addCachedSeafdir(repoID, seafdir)
 
 	return seafdir, nil
 }
@@ -497,15 +439,29 @@ func SaveSeafdir(repoID string, seafdir *SeafDir) error {
 		return nil
 	}
 
+	// Segments go first, so that no index refers to missing segments.
+	for _, seg := range seafdir.segments {
+		if seg.data == nil {
+			continue
+		}
+		if exist, _ := store.Exists(repoID, seg.id); exist {
+			continue
+		}
+		if err := WriteRaw(repoID, seg.id, bytes.NewReader(seg.data)); err != nil {
+			return fmt.Errorf("failed to write seafdir segment to storage : %v", err)
+		}
+	}
+
 	seafdir.DirType = SeafMetadataTypeDir
-	var buf bytes.Buffer
-	err := seafdir.ToData(&buf)
+	buf := getBuffer()
+	defer putBuffer(buf)
+	err := seafdir.ToData(buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to convert seafdir object %s/%s to json", repoID, dirID)
 		return errors
 	}
 
-	err = WriteRaw(repoID, dirID, &buf)
+	err = WriteRaw(repoID, dirID, buf)
 	if err != nil {
 		errors := fmt.Errorf("failed to write seafdir object to storage : %v", err)
 		return errors
@@ -522,6 +478,20 @@ func Exists(repoID string, objID string) (bool, error) {
 	return store.Exists(repoID, objID)
 }
 
+// ExistsMany checks the existence of many fs objects at once.
+func ExistsMany(repoID string, objIDs []string) ([]bool, error) {
+	res, err := store.ExistsMany(repoID, objIDs)
+	if err != nil {
+		return nil, err
+	}
+	for i, objID := range objIDs {
+		if objID == EmptySha1 {
+			res[i] = true
+		}
+	}
+	return res, nil
+}
+
 func comp(c rune) bool {
 	return c == '/'
 }
@@ -541,36 +511,67 @@ var ErrPathNoExist = fmt.Errorf("path does not exist")
 
 // GetSeafdirByPath gets the object of seafdir by path.
 func GetSeafdirByPath(repoID string, rootID string, path string) (*SeafDir, error) {
-	dir, err := GetSeafdir(repoID, rootID)
+	dirID, err := dirPathToID(repoID, rootID, path)
+	if err != nil {
+		return nil, err
+	}
+
+	dir, err := GetSeafdir(repoID, dirID)
 	if err != nil {
 		errors := fmt.Errorf("directory is missing")
 		return nil, errors
 	}
 
-	path = filepath.Join("/", path)
-	parts := strings.FieldsFunc(path, comp)
-	var dirID string
-	for _, name := range parts {
-		entries := dir.Entries
-		for _, v := range entries {
-			if v.Name == name && IsDir(v.Mode) {
-				dirID = v.ID
-				break
-			}
-		}
+	return dir, nil
+}
+
+// lookupDirent returns the entry called name in dir dirID, or nil if there is none.
+func lookupDirent(repoID, dirID, name string) (*SeafDirent, error) {
+	if dirID == EmptySha1 {
+		return nil, nil
+	}
+	if dent, ok := lookupCachedDirent(repoID, dirID, name); ok {
+		return dent, nil
+	}
+
+	var buf bytes.Buffer
+	if err := ReadRaw(repoID, dirID, &buf); err != nil {
+		return nil, fmt.Errorf("failed to read seafdir object from storage : %v", err)
+	}
+	if isSegmentedDir(buf.Bytes()) {
+		return lookupSegmentedDirent(repoID, dirID, buf.Bytes(), name)
+	}
 
-		if dirID == `` {
-			return nil, ErrPathNoExist
+	dir, err := decodeSeafdir(repoID, dirID, buf.Bytes())
+	if err != nil {
+		return nil, err
+	}
+	for _, v := range dir.Entries {
+		if v.Name == name {
+			return v, nil
 		}
+	}
+	return nil, nil
+}
 
-		dir, err = GetSeafdir(repoID, dirID)
+// dirPathToID returns the id of the dir at path, walking down from rootID.
+func dirPathToID(repoID, rootID, path string) (string, error) {
+	path = filepath.Join("/", path)
+	parts := strings.FieldsFunc(path, comp)
+	dirID := rootID
+	for _, name := range parts {
+		dent, err := lookupDirent(repoID, dirID, name)
 		if err != nil {
 			errors := fmt.Errorf("directory is missing")
-			return nil, errors
+			return "", errors
+		}
+		if dent == nil || !IsDir(dent.Mode) {
+			return "", ErrPathNoExist
 		}
+		dirID = dent.ID
 	}
 
-	return dir, nil
+	return dirID, nil
 }
 
 // GetSeafdirIDByPath gets the dirID of SeafDir by path.
@@ -590,24 +591,19 @@ func GetSeafdirIDByPath(repoID, rootID, path string) (string, error) {
 // GetObjIDByPath gets the obj id by path
 func GetObjIDByPath(repoID, rootID, path string) (string, uint32, error) {
 	var name string
-	var baseDir *SeafDir
+	var dirID string
 	formatPath := filepath.Join(path)
 	if len(formatPath) == 0 || formatPath == "/" {
 		return rootID, syscall.S_IFDIR, nil
 	}
 	index := strings.Index(formatPath, "/")
 	if index < 0 {
-		dir, err := GetSeafdir(repoID, rootID)
-		if err != nil {
-			err := fmt.Errorf("failed to find root dir %s: %v", rootID, err)
-			return "", 0, err
-		}
 		name = formatPath
-		baseDir = dir
+		dirID = rootID
 	} else {
 		name = filepath.Base(formatPath)
 		dirName := filepath.Dir(formatPath)
-		dir, err := GetSeafdirByPath(repoID, rootID, dirName)
+		id, err := dirPathToID(repoID, rootID, dirName)
 		if err != nil {
 			if err == ErrPathNoExist {
 				return "", syscall.S_IFDIR, ErrPathNoExist
@@ -615,18 +611,23 @@ func GetObjIDByPath(repoID, rootID, path string) (string, uint32, error) {
 			err := fmt.Errorf("failed to find dir %s in repo %s: %v", dirName, repoID, err)
 			return "", syscall.S_IFDIR, err
 		}
-		baseDir = dir
+		dirID = id
 	}
 
-	entries := baseDir.Entries
-	for _, de := range entries {
-		if de.Name == name {
-			return de.ID, de.Mode, nil
+	dent, err := lookupDirent(repoID, dirID, name)
+	if err != nil {
+		if index < 0 {
+			err := fmt.Errorf("failed to find root dir %s: %v", rootID, err)
+			return "", 0, err
 		}
+		err := fmt.Errorf("failed to find dir %s in repo %s: %v", filepath.Dir(formatPath), repoID, err)
+		return "", syscall.S_IFDIR, err
+	}
+	if dent != nil {
+		return dent.ID, dent.Mode, nil
 	}
 
 	return "", 0, nil
-
 }
 
 // GetFileCountInfoByPath gets the count info of file by path.
@@ -646,7 +647,20 @@ func GetFileCountInfoByPath(repoID, rootID, path string) (*FileCountInfo, error)
 	return info, nil
 }
 
+// The counts of everything below a dir are cached by dir id, since a dir
+// object never changes. Counting a new version of a tree then only descends
+// into the dirs that changed.
+const countInfoCacheLimit = 8 << 20
+
+var countInfoCache = newObjCache(countInfoCacheLimit)
+
 func getFileCountInfo(repoID, dirID string) (*FileCountInfo, error) {
+	key := cacheKey(repoID, dirID)
+	if v := countInfoCache.get(key); v != nil {
+		info := *v.(*FileCountInfo)
+		return &info, nil
+	}
+
 	dir, err := GetSeafdir(repoID, dirID)
 	if err != nil {
 		err := fmt.Errorf("failed to get dir: %v", err)
@@ -663,7 +677,7 @@ func getFileCountInfo(repoID, dirID string) (*FileCountInfo, error) {
 				err := fmt.Errorf("failed to get file count: %v", err)
 				return nil, err
 			}
-			info.DirCount = tmpInfo.DirCount + 1
+			info.DirCount += tmpInfo.DirCount + 1
 			info.FileCount += tmpInfo.FileCount
 			info.Size += tmpInfo.Size
 		} else {
@@ -672,5 +686,8 @@ func getFileCountInfo(repoID, dirID string) (*FileCountInfo, error) {
 		}
 	}
 
+	cached := *info
+	countInfoCache.add(key, &cached, int64(64+len(key)))
+
 	return info, nil
 }
@@ -1,6 +1,8 @@
 package fsmgr
 
 import (
+	"bytes"
+	"encoding/json"
 	"fmt"
 	"os"
 	"testing"
@@ -90,13 +92,54 @@ func TestGetSeafile(t *testing.T) {
 		t.FailNow()
 	}
 
-	for _, v := range seafile.BlkIDs {
-		if v != blkID {
+	if seafile.NumBlocks() != 2 {
+		t.Errorf("Got %d blocks, expected 2.\n", seafile.NumBlocks())
+	}
+	for i := 0; i < seafile.NumBlocks(); i++ {
+		if seafile.BlockID(i) != blkID {
 			t.Errorf("Wrong file content.\n")
 		}
 	}
 }
 
+func TestSeafileFromData(t *testing.T) {
+	lower := "0401fc662e3bc87a41f299a907c056aaf8322a26"
+	upper := "0401FC662E3BC87A41F299A907C056AAF8322A26"
+	for _, data := range []string{
+		`{"block_ids": ["` + lower + `", "` + subDirID + `"], "size": 100, "type": 1, "version": 1}`,
+		`{"version":1,"type":1,"size":100,"block_ids":["` + lower + `","` + subDirID + `"]}`,
+		// Left to encoding/json.
+		`{"block_ids": ["` + upper + `"], "size": 100, "type": 1, "version": 1}`,
+		`{"block_ids": ["\u0030` + lower[1:] + `"], "size": 100, "type": 1, "version": 1, "extra": null}`,
+		`{"block_ids": [], "size": 0, "type": 1, "version": 1}`,
+	} {
+		compressed, err := compress([]byte(data))
+		if err != nil {
+			t.Fatalf("Failed to compress: %v", err)
+		}
+		var expected Seafile
+		json.Unmarshal([]byte(data), &expected)
+		file := new(Seafile)
+		if err := file.FromData(compressed.Bytes()); err != nil {
+			t.Errorf("Failed to load %s: %v", data, err)
+			continue
+		}
+		if file.FileSize != expected.FileSize || file.Version != 1 ||
+			file.NumBlocks() != len(expected.BlkIDs) {
+			t.Errorf("Loaded %s as %+v.\n", data, file)
+			continue
+		}
+		for i, id := range expected.BlkIDs {
+			if file.BlockID(i) != id {
+				t.Errorf("Got block %d of %s as %s.\n", i, data, file.BlockID(i))
+			}
+		}
+		if ids := file.BlockIDs(); len(ids) != len(expected.BlkIDs) {
+			t.Errorf("Got %d block ids of %s.\n", len(ids), data)
+		}
+	}
+}
+
 func TestGetSeafdir(t *testing.T) {
 	exists, err := Exists(repoID, dirID)
 	if !exists {
@@ -130,3 +173,426 @@ func TestGetSeafdirByPath(t *testing.T) {
 	}
 
 }
+
+func TestObjCache(t *testing.T) {
+	dir, err := GetSeafdir(repoID, dirID)
+	if err != nil {
+		t.Fatalf("Failed to get seafdir: %v", err)
+	}
+	dir.Entries[0].Name = "modified"
+	dir.Entries = dir.Entries[:1]
+
+	stats := GetCacheStats()
+	cached, err := GetSeafdir(repoID, dirID)
+	if err != nil {
+		t.Fatalf("Failed to get seafdir: %v", err)
+	}
+	if GetCacheStats().Hits != stats.Hits+1 {
+		t.Errorf("seafdir %s is not served from cache", dirID)
+	}
+	if len(cached.Entries) != 2 || cached.Entries[0].Name != "/" {
+		t.Errorf("cached seafdir was modified by caller")
+	}
+
+	file, err := GetSeafile(repoID, fileID)
+	if err != nil {
+		t.Fatalf("Failed to get seafile: %v", err)
+	}
+	file.BlkIDs = file.BlockIDs()
+	file.BlkIDs[0] = subDirID
+	cachedFile, err := GetSeafile(repoID, fileID)
+	if err != nil {
+		t.Fatalf("Failed to get seafile: %v", err)
+	}
+	if cachedFile.BlockID(0) != blkID {
+		t.Errorf("cached seafile was modified by caller")
+	}
+
+	SetCacheLimit(0)
+	defer SetCacheLimit(defaultCacheLimit)
+	if _, err := GetSeafdir(repoID, dirID); err != nil {
+		t.Errorf("Failed to get seafdir with cache disabled: %v", err)
+	}
+}
+
+func TestGetFileCountInfo(t *testing.T) {
+	fileMode := uint32(0100644)
+	leaf, err := NewSeafdir(1, []*SeafDirent{
+		{ID: fileID, Name: "f1", Mode: fileMode, Size: 10},
+		{ID: fileID, Name: "f2", Mode: fileMode, Size: 20},
+	})
+	if err != nil {
+		t.Fatalf("Failed to new seafdir: %v", err)
+	}
+	if err := SaveSeafdir(repoID, leaf); err != nil {
+		t.Fatalf("Failed to save seafdir: %v", err)
+	}
+	root, err := NewSeafdir(1, []*SeafDirent{
+		{ID: leaf.DirID, Name: "a", Mode: 0x4000},
+		{ID: leaf.DirID, Name: "b", Mode: 0x4000},
+		{ID: fileID, Name: "f", Mode: fileMode, Size: 5},
+	})
+	if err != nil {
+		t.Fatalf("Failed to new seafdir: %v", err)
+	}
+	if err := SaveSeafdir(repoID, root); err != nil {
+		t.Fatalf("Failed to save seafdir: %v", err)
+	}
+
+	for i := 0; i < 2; i++ {
+		info, err := GetFileCountInfoByPath(repoID, root.DirID, "/")
+		if err != nil {
+			t.Fatalf("Failed to get file count info: %v", err)
+		}
+		if info.DirCount != 2 || info.FileCount != 5 || info.Size != 65 {
+			t.Errorf("wrong file count info: %+v", info)
+		}
+		info.DirCount = 0
+	}
+	if countInfoCache.get(cacheKey(repoID, leaf.DirID)) == nil {
+		t.Errorf("count info of subdir is not cached")
+	}
+}
+
+func TestBinaryDir(t *testing.T) {
+	entries := []*SeafDirent{
+		NewDirent(subDirID, "a-dir", 0x4000, 1600000000, "", 0),
+		NewDirent(fileID, "b-file", 0x81a4, -1, "user@example.com", 1<<40),
+	}
+	dir, err := NewSeafdir(DirVersionBinary, entries)
+	if err != nil {
+		t.Fatalf("Failed to create binary seafdir: %v", err)
+	}
+	if err := SaveSeafdir(repoID, dir); err != nil {
+		t.Fatalf("Failed to save binary seafdir: %v", err)
+	}
+
+	SetCacheLimit(0)
+	defer SetCacheLimit(defaultCacheLimit)
+	loaded, err := GetSeafdir(repoID, dir.DirID)
+	if err != nil {
+		t.Fatalf("Failed to get binary seafdir: %v", err)
+	}
+	if loaded.Version != DirVersionBinary || len(loaded.Entries) != 2 {
+		t.Fatalf("Binary seafdir is loaded as version %d with %d entries",
+			loaded.Version, len(loaded.Entries))
+	}
+	// Entries are stored in descending order of names.
+	file, sub := loaded.Entries[0], loaded.Entries[1]
+	if file.Name != "b-file" || file.ID != fileID || file.Mtime != -1 ||
+		file.Size != 1<<40 || file.Modifier != "user@example.com" {
+		t.Errorf("Wrong file entry %+v", file)
+	}
+	if sub.Name != "a-dir" || sub.ID != subDirID || sub.Mode != 0x4000 || sub.Mtime != 1600000000 {
+		t.Errorf("Wrong dir entry %+v", sub)
+	}
+}
+
+func segmentedEntries(n int) []*SeafDirent {
+	entries := make([]*SeafDirent, n)
+	for i := range entries {
+		entries[i] = NewDirent(fmt.Sprintf("%040x", i), fmt.Sprintf("file-%06d", i), 0x81a4, 1600000000, "user@example.com", int64(i))
+	}
+	return entries
+}
+
+func TestSegmentedDir(t *testing.T) {
+	small, err := NewSeafdir(DirVersionSegmented, segmentedEntries(100))
+	if err != nil {
+		t.Fatalf("Failed to create seafdir: %v", err)
+	}
+	if !isBinaryDir(small.data) || small.segments != nil {
+		t.Errorf("small dir is segmented")
+	}
+
+	entries := segmentedEntries(20000)
+	dir, err := NewSeafdir(DirVersionSegmented, entries)
+	if err != nil {
+		t.Fatalf("Failed to create segmented seafdir: %v", err)
+	}
+	if len(dir.segments) < 5 {
+		t.Fatalf("dir is split into %d segments", len(dir.segments))
+	}
+	if err := SaveSeafdir(repoID, dir); err != nil {
+		t.Fatalf("Failed to save segmented seafdir: %v", err)
+	}
+
+	SetCacheLimit(0)
+	defer SetCacheLimit(defaultCacheLimit)
+	loaded, err := GetSeafdir(repoID, dir.DirID)
+	if err != nil {
+		t.Fatalf("Failed to get segmented seafdir: %v", err)
+	}
+	if loaded.Version != DirVersionSegmented || len(loaded.Entries) != len(entries) {
+		t.Fatalf("Segmented seafdir is loaded as version %d with %d entries",
+			loaded.Version, len(loaded.Entries))
+	}
+	for i, dent := range loaded.Entries {
+		if dent.Name != entries[len(entries)-1-i].Name {
+			t.Fatalf("entry %d is %s", i, dent.Name)
+		}
+	}
+
+	for _, i := range []int{0, 1234, 19999} {
+		dent, err := lookupDirent(repoID, dir.DirID, entries[i].Name)
+		if err != nil || dent == nil || dent.ID != entries[i].ID {
+			t.Errorf("failed to look up %s: %v, %v", entries[i].Name, dent, err)
+		}
+	}
+	for _, name := range []string{"a", "file-0012345", "z"} {
+		if dent, err := lookupDirent(repoID, dir.DirID, name); dent != nil || err != nil {
+			t.Errorf("found %s: %v, %v", name, dent, err)
+		}
+	}
+
+	// Adding an entry leaves most segments as they are.
+	added := append(segmentedEntries(20000), NewDirent(fileID, "file-012345x", 0x81a4, 0, "", 0))
+	changed, err := NewSeafdir(DirVersionSegmented, added)
+	if err != nil {
+		t.Fatalf("Failed to create segmented seafdir: %v", err)
+	}
+	old := make(map[string]bool)
+	for _, seg := range dir.segments {
+		old[seg.id] = true
+	}
+	n := 0
+	for _, seg := range changed.segments {
+		if !old[seg.id] {
+			n++
+		}
+	}
+	if n == 0 || n > 2 {
+		t.Errorf("%d segments changed", n)
+	}
+}
+
+func TestGetObjIDByPath(t *testing.T) {
+	var leafEntries []*SeafDirent
+	for i := 0; i < 1000; i++ {
+		name := fmt.Sprintf("file-%04d", i)
+		leafEntries = append(leafEntries, NewDirent(fileID, name, 0x81a4, 0, "", 100))
+	}
+	leaf, err := NewSeafdir(1, leafEntries)
+	if err != nil {
+		t.Fatalf("Failed to create seafdir: %v", err)
+	}
+	if err := SaveSeafdir(repoID, leaf); err != nil {
+		t.Fatalf("Failed to save seafdir: %v", err)
+	}
+	top, err := NewSeafdir(1, []*SeafDirent{
+		NewDirent(leaf.DirID, "sub", 0x4000, 0, "", 0),
+		NewDirent(fileID, "file", 0x81a4, 0, "", 100),
+	})
+	if err != nil {
+		t.Fatalf("Failed to create seafdir: %v", err)
+	}
+	if err := SaveSeafdir(repoID, top); err != nil {
+		t.Fatalf("Failed to save seafdir: %v", err)
+	}
+
+	check := func() {
+		if id, mode, err := GetObjIDByPath(repoID, top.DirID, "/sub/file-0777"); err != nil || id != fileID || !IsRegular(mode) {
+			t.Errorf("Failed to get /sub/file-0777: %s %o %v", id, mode, err)
+		}
+		if id, _, err := GetObjIDByPath(repoID, top.DirID, "sub"); err != nil || id != leaf.DirID {
+			t.Errorf("Failed to get sub: %s %v", id, err)
+		}
+		if id, _, err := GetObjIDByPath(repoID, top.DirID, "/sub/file-1000"); err != nil || id != "" {
+			t.Errorf("Got id %s for missing file: %v", id, err)
+		}
+		if _, _, err := GetObjIDByPath(repoID, top.DirID, "/missing/file-0001"); err != ErrPathNoExist {
+			t.Errorf("Got %v for missing dir", err)
+		}
+		if _, _, err := GetObjIDByPath(repoID, top.DirID, "/file/file-0001"); err != ErrPathNoExist {
+			t.Errorf("Got %v for path through a file", err)
+		}
+		if _, err := GetSeafdirByPath(repoID, top.DirID, "/sub/missing"); err != ErrPathNoExist {
+			t.Errorf("Got %v for missing dir", err)
+		}
+		if dir, err := GetSeafdirByPath(repoID, top.DirID, "/sub"); err != nil || len(dir.Entries) != 1000 {
+			t.Errorf("Failed to get dir /sub: %v", err)
+		}
+	}
+
+	// Misses fill the cache, the second pass is served from it.
+	check()
+	stats := GetCacheStats()
+	check()
+	if GetCacheStats().Hits == stats.Hits {
+		t.Errorf("Paths are not resolved from cache")
+	}
+
+	SetCacheLimit(0)
+	defer SetCacheLimit(defaultCacheLimit)
+	check()
+}
+
+func TestBlockMap(t *testing.T) {
+	seafile, err := GetSeafile(repoID, fileID)
+	if err != nil {
+		t.Fatalf("Failed to get seafile : %v.\n", err)
+	}
+
+	if _, ok := GetBlockMap(repoID, seafile); ok {
+		t.Errorf("Found a block map that was never saved.\n")
+	}
+
+	// A map of other blocks is ignored.
+	if err := SaveBlockMap(repoID, fileID, []int64{100}); err != nil {
+		t.Fatalf("Failed to save block map : %v.\n", err)
+	}
+	if _, ok := GetBlockMap(repoID, seafile); ok {
+		t.Errorf("Found a block map that doesn't match the blocks.\n")
+	}
+
+	if err := SaveBlockMap(repoID, fileID, []int64{60, 40}); err != nil {
+		t.Fatalf("Failed to save block map : %v.\n", err)
+	}
+	blockSizes, ok := GetBlockMap(repoID, seafile)
+	if !ok || len(blockSizes) != 2 || blockSizes[0] != 60 || blockSizes[1] != 40 {
+		t.Errorf("Got block map %v, expected [60 40].\n", blockSizes)
+	}
+}
+
+func TestJSONString(t *testing.T) {
+	for _, s := range []string{
+		"", "a.txt", "quote\" back\\slash", "<b>&amp;</b>", "tab\tnew\nline\r",
+		"\x00\x01\x1f", "中文.doc", "bad \xff utf8", "\u2028\u2029", "emoji 😀",
+	} {
+		expected, _ := json.Marshal(s)
+		got := appendJSONString(nil, s)
+		if !bytes.Equal(got, expected) {
+			t.Errorf("Encoded %q as %s, expected %s.\n", s, got, expected)
+		}
+	}
+}
+
+// The ids of existing objects depend on the encoding, which must not change.
+func TestObjectJSON(t *testing.T) {
+	file := &Seafile{Version: 1, FileSize: 12345, BlkIDs: []string{blkID, subDirID}}
+	data, _ := file.toJSON()
+	expected := `{"block_ids": ["` + blkID + `", "` + subDirID + `"], "size": 12345, "type": 1, "version": 1}`
+	if string(data) != expected {
+		t.Errorf("Encoded file as %s, expected %s.\n", data, expected)
+	}
+
+	dir := &SeafDir{Version: 1, Entries: []*SeafDirent{
+		NewDirent(blkID, "<a&b>.txt", 0x81a4, 1700000000, "me@example.com", 100),
+		NewDirent(subDirID, "sub", 0x4000, -1, "ignored", 0),
+	}}
+	data, _ = dir.toJSON()
+	expected = `{"dirents": [{"id": "` + blkID + `", "mode": 33188, "modifier": "me@example.com", ` +
+		`"mtime": 1700000000, "name": "\u003ca\u0026b\u003e.txt", "size": 100}, ` +
+		`{"id": "` + subDirID + `", "mode": 16384, "mtime": -1, "name": "sub"}], "type": 3, "version": 1}`
+	if string(data) != expected {
+		t.Errorf("Encoded dir as %s, expected %s.\n", data, expected)
+	}
+}
+
+func benchDir(b *testing.B, version int) *SeafDir {
+	var entries []*SeafDirent
+	// Entries are kept in descending order of names.
+	for i := 999; i >= 0; i-- {
+		id := fmt.Sprintf("%040x", uint64(i)*0x9e3779b97f4a7c15)
+		name := fmt.Sprintf("%06d.txt", i)
+		entries = append(entries, NewDirent(id, name, 0x81a4, 1700000000+int64(i), "bench@example.com", 1<<20))
+	}
+	dir, err := NewSeafdir(version, entries)
+	if err != nil {
+		b.Fatalf("Failed to create seafdir: %v", err)
+	}
+	return dir
+}
+
+func benchmarkDirToData(b *testing.B, version int) {
+	dir := benchDir(b, version)
+	var buf bytes.Buffer
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		buf.Reset()
+		if err := dir.ToData(&buf); err != nil {
+			b.Fatalf("Failed to convert seafdir: %v", err)
+		}
+	}
+}
+
+func benchmarkDirFromData(b *testing.B, version int) {
+	dir := benchDir(b, version)
+	var buf bytes.Buffer
+	if err := dir.ToData(&buf); err != nil {
+		b.Fatalf("Failed to convert seafdir: %v", err)
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		loaded := new(SeafDir)
+		if err := loaded.FromData(buf.Bytes()); err != nil {
+			b.Fatalf("Failed to load seafdir: %v", err)
+		}
+	}
+}
+
+func BenchmarkDirToDataV1(b *testing.B)   { benchmarkDirToData(b, 1) }
+func BenchmarkDirFromDataV1(b *testing.B) { benchmarkDirFromData(b, 1) }
+func BenchmarkDirToDataV2(b *testing.B)   { benchmarkDirToData(b, DirVersionBinary) }
+func BenchmarkDirFromDataV2(b *testing.B) { benchmarkDirFromData(b, DirVersionBinary) }
+
+func BenchmarkNewSeafdirV1(b *testing.B) {
+	entries := benchDir(b, 1).Entries
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := NewSeafdir(1, entries); err != nil {
+			b.Fatalf("Failed to create seafdir: %v", err)
+		}
+	}
+}
+
+func BenchmarkSeafileToFromData(b *testing.B) {
+	blkIDs := make([]string, 100)
+	for i := range blkIDs {
+		blkIDs[i] = fmt.Sprintf("%040x", uint64(i)*0x9e3779b97f4a7c15)
+	}
+	file, err := NewSeafile(1, 100<<20, blkIDs)
+	if err != nil {
+		b.Fatalf("Failed to create seafile: %v", err)
+	}
+	var buf bytes.Buffer
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		buf.Reset()
+		if err := file.ToData(&buf); err != nil {
+			b.Fatalf("Failed to convert seafile: %v", err)
+		}
+		loaded := new(Seafile)
+		if err := loaded.FromData(buf.Bytes()); err != nil {
+			b.Fatalf("Failed to load seafile: %v", err)
+		}
+	}
+}
+
+func BenchmarkLargeSeafileFromData(b *testing.B) {
+	blkIDs := make([]string, 100000)
+	for i := range blkIDs {
+		blkIDs[i] = fmt.Sprintf("%040x", uint64(i)*0x9e3779b97f4a7c15)
+	}
+	file, err := NewSeafile(1, 100<<30, blkIDs)
+	if err != nil {
+		b.Fatalf("Failed to create seafile: %v", err)
+	}
+	var buf bytes.Buffer
+	if err := file.ToData(&buf); err != nil {
+		b.Fatalf("Failed to convert seafile: %v", err)
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		loaded := new(Seafile)
+		if err := loaded.FromData(buf.Bytes()); err != nil {
+			b.Fatalf("Failed to load seafile: %v", err)
+		}
+		loaded.BlockID(loaded.NumBlocks() / 2)
+	}
+}
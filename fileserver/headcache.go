@@ -0,0 +1,100 @@
+package main
+
+import (
+	"sync"
+	"time"
+)
+
+// Sync clients poll the heads of their repos all the time, so the heads of
+// master branches are cached. updateBranch keeps the cache in step with the
+// branches it updates. Branches updated by seaf-server or by other servers
+// of a cluster are seen once the cached head expires after
+// head_commit_cache_ttl seconds and is read again.
+//
+// Every update bumps the generation. Heads read from the database are only
+// cached if no update happened during the query, so that a stale read never
+// replaces a newer head.
+
+const defaultHeadCommitCacheTTL = 10 * time.Second
+
+type cachedHead struct {
+	commitID   string
+	expireTime time.Time
+}
+
+type headCommitCache struct {
+	mu    sync.Mutex
+	ttl   time.Duration
+	gen   int64
+	heads map[string]cachedHead
+}
+
+var headCommits = newHeadCommitCache(defaultHeadCommitCacheTTL)
+
+func newHeadCommitCache(ttl time.Duration) *headCommitCache {
+	return &headCommitCache{
+		ttl:   ttl,
+		heads: make(map[string]cachedHead),
+	}
+}
+
+func (c *headCommitCache) get(repoID string) (string, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	head, ok := c.heads[repoID]
+	if !ok || !time.Now().Before(head.expireTime) {
+		return "", false
+	}
+	return head.commitID, true
+}
+
+// generation must be taken before reading heads to be passed to add.
+func (c *headCommitCache) generation() int64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.gen
+}
+
+// add caches heads read from the database after gen was taken.
+func (c *headCommitCache) add(gen int64, heads map[string]string) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if gen != c.gen {
+		return
+	}
+	expireTime := time.Now().Add(c.ttl)
+	for repoID, commitID := range heads {
+		c.heads[repoID] = cachedHead{commitID, expireTime}
+	}
+}
+
+// update replaces the cached head of a repo by newCommitID if it's
+// oldCommitID, otherwise the cached head is dropped. Concurrent updates may
+// get here out of order, only an update of the cached head is known to be
+// newer.
+func (c *headCommitCache) update(repoID, oldCommitID, newCommitID string) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	c.gen++
+	head, ok := c.heads[repoID]
+	if oldCommitID != "" && newCommitID != "" && (!ok || head.commitID == oldCommitID) {
+		c.heads[repoID] = cachedHead{newCommitID, time.Now().Add(c.ttl)}
+	} else {
+		delete(c.heads, repoID)
+	}
+}
+
+func (c *headCommitCache) drop(repoID string) {
+	c.update(repoID, "", "")
+}
+
+func (c *headCommitCache) expire() {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	now := time.Now()
+	for repoID, head := range c.heads {
+		if !now.Before(head.expireTime) {
+			delete(c.heads, repoID)
+		}
+	}
+}
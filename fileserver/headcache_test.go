@@ -0,0 +1,52 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func TestHeadCommitCache(t *testing.T) {
+	const repoID = "b1f2c3d4-1234-4321-abcd-0123456789ab"
+	c := newHeadCommitCache(time.Minute)
+
+	if _, ok := c.get(repoID); ok {
+		t.Fatalf("found a head in an empty cache")
+	}
+
+	// A read that raced with an update isn't cached.
+	gen := c.generation()
+	c.update(repoID, "a", "b")
+	c.add(gen, map[string]string{repoID: "a"})
+	if commitID, ok := c.get(repoID); !ok || commitID != "b" {
+		t.Errorf("got head %q, expected b", commitID)
+	}
+
+	// Updates arriving out of order drop the head.
+	c.update(repoID, "c", "d")
+	if _, ok := c.get(repoID); ok {
+		t.Errorf("cached a head of an update out of order")
+	}
+
+	gen = c.generation()
+	c.add(gen, map[string]string{repoID: "d"})
+	c.update(repoID, "d", "e")
+	if commitID, ok := c.get(repoID); !ok || commitID != "e" {
+		t.Errorf("got head %q, expected e", commitID)
+	}
+
+	c.drop(repoID)
+	if _, ok := c.get(repoID); ok {
+		t.Errorf("found a dropped head")
+	}
+
+	// Expired heads are read again.
+	c = newHeadCommitCache(-time.Second)
+	c.add(c.generation(), map[string]string{repoID: "a"})
+	if _, ok := c.get(repoID); ok {
+		t.Errorf("found an expired head")
+	}
+	c.expire()
+	if len(c.heads) != 0 {
+		t.Errorf("expired heads were not removed")
+	}
+}
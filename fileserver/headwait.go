@@ -0,0 +1,177 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"net/http"
+	"strconv"
+	"sync"
+	"time"
+)
+
+// head-commits-wait is a long-poll alternative to polling head-commits-multi.
+// The client posts a map of repo ids to the head commits it has. If some of
+// them are out of date, the current heads of those repos are returned at
+// once. Otherwise the request is held until a branch of these repos is
+// updated, and an empty map is returned after the timeout.
+//
+// Only branch updates made by this process wake up waiting requests.
+// Updates made by seaf-server itself, e.g. through its RPC, are seen when
+// the client starts its next wait.
+
+const (
+	defaultHeadCommitsWait = 30 * time.Second
+	maxHeadCommitsWait     = 300 * time.Second
+)
+
+type repoUpdate struct {
+	seq   int64
+	mtime time.Time
+}
+
+type repoUpdates struct {
+	mu    sync.Mutex
+	seq   int64
+	repos map[string]repoUpdate
+	// Closed and replaced on every update.
+	updated chan struct{}
+}
+
+var headUpdates = newRepoUpdates()
+
+func newRepoUpdates() *repoUpdates {
+	return &repoUpdates{
+		repos:   make(map[string]repoUpdate),
+		updated: make(chan struct{}),
+	}
+}
+
+func (u *repoUpdates) notify(repoID string) {
+	u.mu.Lock()
+	defer u.mu.Unlock()
+	u.seq++
+	u.repos[repoID] = repoUpdate{u.seq, time.Now()}
+	close(u.updated)
+	u.updated = make(chan struct{})
+}
+
+// since returns the current sequence, the repos of heads updated after seq,
+// and a channel that is closed on the next update.
+func (u *repoUpdates) since(seq int64, heads map[string]string) (int64, []string, <-chan struct{}) {
+	u.mu.Lock()
+	defer u.mu.Unlock()
+	var repoIDs []string
+	if seq != u.seq {
+		for repoID := range heads {
+			if update, ok := u.repos[repoID]; ok && update.seq > seq {
+				repoIDs = append(repoIDs, repoID)
+			}
+		}
+	}
+	return u.seq, repoIDs, u.updated
+}
+
+// expire forgets updates before t, which all waits have looked at.
+func (u *repoUpdates) expire(t time.Time) {
+	u.mu.Lock()
+	defer u.mu.Unlock()
+	for repoID, update := range u.repos {
+		if update.mtime.Before(t) {
+			delete(u.repos, repoID)
+		}
+	}
+}
+
+// getChangedHeads returns the current heads of the repos that differ from
+// the ones the client has.
+func getChangedHeads(knownHeads map[string]string, repoIDs []string) (map[string]string, error) {
+	heads, err := getHeadCommitIDs(repoIDs)
+	if err != nil {
+		return nil, err
+	}
+	for repoID, commitID := range heads {
+		if knownHeads[repoID] == commitID {
+			delete(heads, repoID)
+		}
+	}
+	return heads, nil
+}
+
+func headCommitsWaitCB(rsp http.ResponseWriter, r *http.Request) *appError {
+	var knownHeads map[string]string
+	if err := json.NewDecoder(r.Body).Decode(&knownHeads); err != nil {
+		return &appError{err, "", http.StatusBadRequest}
+	}
+	if len(knownHeads) == 0 {
+		return &appError{nil, "", http.StatusBadRequest}
+	}
+	repoIDs := make([]string, 0, len(knownHeads))
+	for repoID := range knownHeads {
+		if !isValidUUID(repoID) {
+			return &appError{nil, "", http.StatusBadRequest}
+		}
+		repoIDs = append(repoIDs, repoID)
+	}
+
+	timeout := defaultHeadCommitsWait
+	if timeoutStr := r.URL.Query().Get("timeout"); timeoutStr != "" {
+		seconds, err := strconv.Atoi(timeoutStr)
+		if err != nil {
+			return &appError{nil, "timeout is invalid", http.StatusBadRequest}
+		}
+		timeout = time.Duration(seconds) * time.Second
+		if timeout < 0 {
+			timeout = 0
+		} else if timeout > maxHeadCommitsWait {
+			timeout = maxHeadCommitsWait
+		}
+	}
+
+	// Take the sequence before reading the heads, so that no update in
+	// between is missed.
+	seq, _, _ := headUpdates.since(0, nil)
+	changed, err := getChangedHeads(knownHeads, repoIDs)
+	if err != nil {
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	if len(changed) == 0 && timeout > 0 {
+		timer := time.NewTimer(timeout)
+		defer timer.Stop()
+	wait:
+		for {
+			var updatedRepos []string
+			var updated <-chan struct{}
+			seq, updatedRepos, updated = headUpdates.since(seq, knownHeads)
+			if len(updatedRepos) > 0 {
+				changed, err = getChangedHeads(knownHeads, updatedRepos)
+				if err != nil {
+					return &appError{err, "", http.StatusInternalServerError}
+				}
+				if len(changed) > 0 {
+					break
+				}
+			}
+
+			select {
+			case <-updated:
+			case <-timer.C:
+				break wait
+			case <-r.Context().Done():
+				return nil
+			}
+		}
+	}
+
+	data, err := json.Marshal(changed)
+	if err != nil {
+		err := fmt.Errorf("Failed to marshal json: %v", err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
+	rsp.WriteHeader(http.StatusOK)
+	rsp.Write(data)
+
+	return nil
+}
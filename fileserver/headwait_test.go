@@ -0,0 +1,50 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func TestRepoUpdates(t *testing.T) {
+	const repoA = "11111111-2222-3333-4444-555555555555"
+	const repoB = "66666666-7777-8888-9999-000000000000"
+	heads := map[string]string{repoA: "", repoB: ""}
+
+	u := newRepoUpdates()
+	seq, repoIDs, updated := u.since(0, heads)
+	if seq != 0 || len(repoIDs) != 0 {
+		t.Fatalf("got updates before any notify: %d %v", seq, repoIDs)
+	}
+
+	// A waiter is woken up by an update of any repo, and finds its own.
+	woken := make(chan struct{})
+	go func() {
+		<-updated
+		close(woken)
+	}()
+	u.notify("aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee")
+	<-woken
+	seq, repoIDs, updated = u.since(seq, heads)
+	if seq != 1 || len(repoIDs) != 0 {
+		t.Errorf("unrelated update was reported: %d %v", seq, repoIDs)
+	}
+
+	u.notify(repoB)
+	select {
+	case <-updated:
+	case <-time.After(time.Second):
+		t.Fatalf("waiter was not woken up")
+	}
+	seq, repoIDs, _ = u.since(seq, heads)
+	if seq != 2 || len(repoIDs) != 1 || repoIDs[0] != repoB {
+		t.Errorf("got updates %d %v, expected %s", seq, repoIDs, repoB)
+	}
+	if _, repoIDs, _ = u.since(seq, heads); len(repoIDs) != 0 {
+		t.Errorf("update was reported twice: %v", repoIDs)
+	}
+
+	u.expire(time.Now().Add(time.Minute))
+	if len(u.repos) != 0 {
+		t.Errorf("%d updates were not expired", len(u.repos))
+	}
+}
@@ -0,0 +1,94 @@
+package main
+
+import (
+	"context"
+	"net"
+	"net/http"
+	"strings"
+	"syscall"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// With a TLS certificate configured, the standard library negotiates HTTP/2
+// through ALPN, so a client can multiplex its sync requests over a single
+// connection instead of opening several. HTTP/2 without TLS (h2c) is not
+// supported by net/http, so plain listeners keep serving HTTP/1.1 with
+// keep-alive, which is what a proxy in front of the server talks.
+//
+// Sync requests of one connection are limited to maxConcurrentStreams at a
+// time. Further streams wait for a slot, so that a single client pushing
+// blocks over many streams can't take all the workers.
+
+type connStreamsKey struct{}
+
+func newHTTPServer(addr string, handler http.Handler, maxStreams int) *http.Server {
+	server := &http.Server{
+		Addr:    addr,
+		Handler: handler,
+	}
+	if maxStreams > 0 {
+		server.Handler = &streamLimitHandler{handler}
+		server.ConnContext = func(ctx context.Context, c net.Conn) context.Context {
+			return context.WithValue(ctx, connStreamsKey{}, make(chan struct{}, maxStreams))
+		}
+	}
+	return server
+}
+
+// serveHTTP listens on the address of server. With reusePort the socket
+// is opened with SO_REUSEPORT, the kernel then spreads the connections
+// over all processes listening on the port.
+func serveHTTP(server *http.Server, reusePort bool) error {
+	lc := net.ListenConfig{}
+	if reusePort {
+		lc.Control = setReusePort
+	}
+	ln, err := lc.Listen(context.Background(), "tcp", server.Addr)
+	if err != nil {
+		return err
+	}
+
+	if options.tlsCertFile != "" && options.tlsKeyFile != "" {
+		log.Print("Serving HTTP/2 over TLS.")
+		return server.ServeTLS(ln, options.tlsCertFile, options.tlsKeyFile)
+	}
+	return server.Serve(ln)
+}
+
+// SO_REUSEPORT on Linux, the frozen syscall package doesn't define it.
+const soReusePort = 0xf
+
+func setReusePort(network, address string, c syscall.RawConn) error {
+	var sockErr error
+	err := c.Control(func(fd uintptr) {
+		sockErr = syscall.SetsockoptInt(int(fd), syscall.SOL_SOCKET, soReusePort, 1)
+	})
+	if err != nil {
+		return err
+	}
+	return sockErr
+}
+
+type streamLimitHandler struct {
+	handler http.Handler
+}
+
+func (h *streamLimitHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	slots, ok := r.Context().Value(connStreamsKey{}).(chan struct{})
+	// Long-polls are idle most of the time and don't take a slot.
+	if !ok || !strings.HasPrefix(r.URL.Path, "/repo/") ||
+		strings.HasPrefix(r.URL.Path, "/repo/head-commits-wait") {
+		h.handler.ServeHTTP(w, r)
+		return
+	}
+
+	select {
+	case slots <- struct{}{}:
+	case <-r.Context().Done():
+		return
+	}
+	defer func() { <-slots }()
+
+	h.handler.ServeHTTP(w, r)
+}
@@ -0,0 +1,101 @@
+package main
+
+import (
+	"context"
+	"net"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+)
+
+func TestStreamLimit(t *testing.T) {
+	const maxStreams = 2
+	const requests = 6
+
+	var running, maxRunning int32
+	release := make(chan struct{})
+	started := make(chan struct{}, requests)
+	handler := http.HandlerFunc(func(rsp http.ResponseWriter, r *http.Request) {
+		if r.ProtoMajor != 2 {
+			t.Errorf("request was served over %s", r.Proto)
+		}
+		if !strings.HasPrefix(r.URL.Path, "/repo/") {
+			return
+		}
+		n := atomic.AddInt32(&running, 1)
+		for {
+			max := atomic.LoadInt32(&maxRunning)
+			if n <= max || atomic.CompareAndSwapInt32(&maxRunning, max, n) {
+				break
+			}
+		}
+		started <- struct{}{}
+		<-release
+		atomic.AddInt32(&running, -1)
+	})
+
+	ts := httptest.NewUnstartedServer(nil)
+	ts.Config = newHTTPServer("", handler, maxStreams)
+	ts.EnableHTTP2 = true
+	ts.StartTLS()
+	defer ts.Close()
+	client := ts.Client()
+	get := func(path string) {
+		rsp, err := client.Get(ts.URL + path)
+		if err != nil {
+			t.Errorf("failed to send request: %v", err)
+			return
+		}
+		rsp.Body.Close()
+	}
+
+	// Set up the connection that the requests below share.
+	get("/protocol-version")
+
+	var wg sync.WaitGroup
+	for i := 0; i < requests; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			get("/repo/head-commits-multi")
+		}()
+	}
+
+	// Streams over the limit wait until a slot is released, other routes
+	// don't.
+	for i := 0; i < maxStreams; i++ {
+		<-started
+	}
+	get("/protocol-version")
+	for i := maxStreams; i < requests; i++ {
+		release <- struct{}{}
+		<-started
+	}
+	for i := 0; i < maxStreams; i++ {
+		release <- struct{}{}
+	}
+	wg.Wait()
+
+	if maxRunning != maxStreams {
+		t.Errorf("%d streams were served at once, expected %d", maxRunning, maxStreams)
+	}
+}
+
+func TestReusePort(t *testing.T) {
+	lc := net.ListenConfig{Control: setReusePort}
+	ln1, err := lc.Listen(context.Background(), "tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatalf("failed to listen: %v", err)
+	}
+	defer ln1.Close()
+
+	// A second process of the fileserver listens on the same port.
+	ln2, err := lc.Listen(context.Background(), "tcp", ln1.Addr().String())
+	if err != nil {
+		t.Fatalf("failed to share the port: %v", err)
+	}
+	ln2.Close()
+}
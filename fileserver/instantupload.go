@@ -0,0 +1,267 @@
+package main
+
+import (
+	"bytes"
+	"crypto/sha1"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"io"
+	"mime/multipart"
+	"net/http"
+	"os"
+	"strconv"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	"github.com/haiwen/seafile-server/fileserver/share"
+	log "github.com/sirupsen/logrus"
+)
+
+// When enable_instant_upload is set, the SHA-1 of the content of uploaded
+// files is recorded in the FileFingerprint table along with the size, the
+// store and the id of their seafile object. A client can then send the
+// fingerprint and size of a file to /upload-instant-api/ before uploading
+// it. If a store the user can read has a file with the same content, it is
+// added to the library without sending any data, copying its blocks when
+// they are in another store. Otherwise the reply is 404 and the client
+// uploads the file as usual.
+//
+// Only the content the server chunked itself is recorded, so a fingerprint
+// can't be bound to other data. Encrypted libraries are left out.
+
+// fileFingerprint returns the hex SHA-1 of the content of an uploaded file.
+func fileFingerprint(filePath string, handler *multipart.FileHeader) (string, error) {
+	var file io.ReadCloser
+	var err error
+	if handler != nil {
+		file, err = handler.Open()
+	} else {
+		file, err = os.Open(filePath)
+	}
+	if err != nil {
+		return "", err
+	}
+	defer file.Close()
+
+	h := sha1.New()
+	if _, err := io.Copy(h, file); err != nil {
+		return "", err
+	}
+	return hex.EncodeToString(h.Sum(nil)), nil
+}
+
+func recordFingerprint(fingerprint string, size int64, storeID, fileID string) {
+	sqlStr := "REPLACE INTO FileFingerprint (fingerprint, size, store_id, file_id) VALUES (?, ?, ?, ?)"
+	if _, err := seafileDB.Exec(sqlStr, fingerprint, size, storeID, fileID); err != nil {
+		log.Printf("failed to record fingerprint of file %s in store %s: %v", fileID, storeID, err)
+	}
+}
+
+func removeFingerprint(fingerprint string, size int64, storeID string) {
+	sqlStr := "DELETE FROM FileFingerprint WHERE fingerprint = ? AND size = ? AND store_id = ?"
+	if _, err := seafileDB.Exec(sqlStr, fingerprint, size, storeID); err != nil {
+		log.Printf("failed to remove fingerprint from store %s: %v", storeID, err)
+	}
+}
+
+type fingerprintMatch struct {
+	storeID string
+	fileID  string
+}
+
+// lookupFingerprint returns the files with the fingerprint, those in
+// storeID first.
+func lookupFingerprint(fingerprint string, size int64, storeID string) ([]fingerprintMatch, error) {
+	sqlStr := "SELECT store_id, file_id FROM FileFingerprint WHERE fingerprint = ? AND size = ?"
+	rows, err := seafileDB.Query(sqlStr, fingerprint, size)
+	if err != nil {
+		return nil, err
+	}
+	defer rows.Close()
+
+	var matches []fingerprintMatch
+	for rows.Next() {
+		var m fingerprintMatch
+		if err := rows.Scan(&m.storeID, &m.fileID); err != nil {
+			return nil, err
+		}
+		if m.storeID == storeID {
+			matches = append([]fingerprintMatch{m}, matches...)
+		} else {
+			matches = append(matches, m)
+		}
+	}
+	return matches, rows.Err()
+}
+
+// copyBlocks copies the blocks of blkIDs missing in dstStore from srcStore.
+func copyBlocks(srcStore, dstStore string, blkIDs []string) error {
+	// The blocks already in dstStore are reused, see blockmgr.Touch.
+	missing := missingBlocks(blkIDs, func(id string) bool {
+		return blockmgr.Exists(dstStore, id) && blockmgr.Touch(dstStore, id) == nil
+	})
+	for _, id := range missing {
+		var buf bytes.Buffer
+		if err := blockmgr.Read(srcStore, id, &buf); err != nil {
+			return fmt.Errorf("failed to read block %s from store %s: %v", id, srcStore, err)
+		}
+		if err := blockmgr.Write(dstStore, id, &buf); err != nil {
+			return fmt.Errorf("failed to write block %s to store %s: %v", id, dstStore, err)
+		}
+	}
+	return nil
+}
+
+// findFingerprintBlocks returns the block ids of a file with the
+// fingerprint that user can read, after making sure they are all in the
+// store of repo. It returns nil if there is no such file.
+func findFingerprintBlocks(repo *repomgr.Repo, user, fingerprint string, size int64) ([]string, error) {
+	matches, err := lookupFingerprint(fingerprint, size, repo.StoreID)
+	if err != nil {
+		return nil, err
+	}
+
+	for _, m := range matches {
+		if share.CheckPerm(m.storeID, user) == "" {
+			continue
+		}
+		src := repomgr.Get(m.storeID)
+		if src == nil || src.IsEncrypted {
+			continue
+		}
+		// Files and blocks removed by gc leave stale records behind.
+		file, err := fsmgr.GetSeafile(m.storeID, m.fileID)
+		if err != nil || file.FileSize != uint64(size) {
+			removeFingerprint(fingerprint, size, m.storeID)
+			continue
+		}
+		blkIDs := file.BlockIDs()
+		if err := copyBlocks(m.storeID, repo.StoreID, blkIDs); err != nil {
+			log.Printf("failed to reuse file %s of store %s: %v", m.fileID, m.storeID, err)
+			removeFingerprint(fingerprint, size, m.storeID)
+			continue
+		}
+		if blkIDs == nil {
+			return []string{}, nil
+		}
+		return blkIDs, nil
+	}
+	return nil, nil
+}
+
+func uploadInstantAPICB(rsp http.ResponseWriter, r *http.Request) *appError {
+	fsm, err := parseUploadHeaders(r)
+	if err != nil {
+		return err
+	}
+
+	if err := doInstantUpload(rsp, r, fsm); err != nil {
+		formatJSONError(rsp, err)
+		return err
+	}
+
+	return nil
+}
+
+func doInstantUpload(rsp http.ResponseWriter, r *http.Request, fsm *recvData) *appError {
+	if err := r.ParseForm(); err != nil {
+		return &appError{nil, "", http.StatusBadRequest}
+	}
+
+	// Whoever has an upload link can't read the files of its owner.
+	if fsm.tokenType == "upload-link" || !options.enableInstantUpload {
+		msg := "Instant upload not supported.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+
+	replace := false
+	if replaceStr := r.FormValue("replace"); replaceStr != "" {
+		v, err := strconv.ParseInt(replaceStr, 10, 64)
+		if err != nil || (v != 0 && v != 1) {
+			msg := "Invalid argument replace.\n"
+			return &appError{nil, msg, http.StatusBadRequest}
+		}
+		replace = v == 1
+	}
+
+	parentDir := normalizeUTF8Path(r.FormValue("parent_dir"))
+	if parentDir == "" {
+		msg := "No parent_dir given.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+	fileName := normalizeUTF8Path(r.FormValue("file_name"))
+	if fileName == "" {
+		msg := "No file_name given.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+	fingerprint := r.FormValue("fingerprint")
+	if !isObjectIDValid(fingerprint) {
+		msg := "Invalid fingerprint.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+	fileSize, err := strconv.ParseInt(r.FormValue("file_size"), 10, 64)
+	if err != nil || fileSize <= 0 {
+		msg := "Invalid file_size.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+
+	if err := checkParentDir(fsm.repoID, parentDir); err != nil {
+		return err
+	}
+
+	repo := repomgr.Get(fsm.repoID)
+	if repo == nil {
+		msg := "Failed to get repo.\n"
+		err := fmt.Errorf("Failed to get repo %s", fsm.repoID)
+		return &appError{err, msg, http.StatusInternalServerError}
+	}
+	if repo.IsEncrypted {
+		msg := "Encrypted library not supported.\n"
+		return &appError{nil, msg, http.StatusBadRequest}
+	}
+
+	// Copied blocks count as new data.
+	ret, err := checkQuota(repo.ID, fileSize)
+	if err != nil {
+		msg := "Internal error.\n"
+		err := fmt.Errorf("failed to check quota: %v", err)
+		return &appError{err, msg, http.StatusInternalServerError}
+	}
+	if ret == 1 {
+		msg := "Out of quota.\n"
+		return &appError{nil, msg, seafHTTPResNoQuota}
+	}
+
+	blkIDs, err := findFingerprintBlocks(repo, fsm.user, fingerprint, fileSize)
+	if err != nil {
+		err := fmt.Errorf("failed to look up fingerprint %s: %v", fingerprint, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+	if blkIDs == nil {
+		msg := "File not found.\n"
+		return &appError{nil, msg, http.StatusNotFound}
+	}
+
+	fileID, appErr := commitFileBlockIDs(repo.ID, parentDir, fileName, blkIDs, fsm.user, fileSize, replace)
+	if appErr != nil {
+		return appErr
+	}
+	recordFingerprint(fingerprint, fileSize, repo.StoreID, fileID)
+
+	if _, ok := r.Form["ret-json"]; ok {
+		data, err := json.Marshal(map[string]interface{}{"id": fileID})
+		if err != nil {
+			err := fmt.Errorf("failed to convert array to json: %v", err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		rsp.Header().Set("Content-Type", "application/json; charset=utf-8")
+		rsp.Write(data)
+	} else {
+		rsp.Write([]byte("\"" + fileID + "\""))
+	}
+	log.Debugf("added %s to repo %s from fingerprint %s", fileName, repo.ID, fingerprint)
+
+	return nil
+}
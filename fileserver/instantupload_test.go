@@ -0,0 +1,29 @@
+package main
+
+import (
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func TestFileFingerprint(t *testing.T) {
+	dir, err := ioutil.TempDir("", "fingerprint")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	path := filepath.Join(dir, "file")
+	if err := ioutil.WriteFile(path, []byte("hello world\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	fp, err := fileFingerprint(path, nil)
+	if err != nil || fp != "22596363b3de40b06f981fb85d82312e8c0ed511" {
+		t.Errorf("fingerprint is %s, %v", fp, err)
+	}
+
+	if _, err := fileFingerprint(filepath.Join(dir, "missing"), nil); err == nil {
+		t.Errorf("fingerprint of missing file")
+	}
+}
@@ -5,6 +5,7 @@ import (
 	"path/filepath"
 	"sort"
 	"strings"
+	"sync"
 	"time"
 
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
@@ -16,13 +17,45 @@ type mergeOptions struct {
 	remoteHead   string
 	mergedRoot   string
 	conflict     bool
+
+	// Sub-directories are merged concurrently.
+	mu sync.Mutex
+	// Conflict names that don't come from a file's mtime use the time the
+	// merge started, so they don't depend on the order of the merges.
+	mergeTime int64
+}
+
+func (opt *mergeOptions) setConflict() {
+	opt.mu.Lock()
+	opt.conflict = true
+	opt.mu.Unlock()
 }
 
+// Goroutines merging sub-directories besides the callers of mergeTrees.
+// A merge that finds no free slot goes on in its own goroutine, so nested
+// merges can't wait for each other.
+const maxMergeThreads = 4
+
+var mergeSlots = make(chan struct{}, maxMergeThreads)
+
 func mergeTrees(storeID string, roots []string, opt *mergeOptions) error {
 	if len(roots) != 3 {
 		err := fmt.Errorf("invalid argument")
 		return err
 	}
+	if opt.mergeTime == 0 {
+		opt.mergeTime = time.Now().Unix()
+	}
+
+	// Trees changed on one side only need no object to be loaded.
+	if roots[1] == roots[2] || roots[0] == roots[2] {
+		opt.mergedRoot = roots[1]
+		return nil
+	}
+	if roots[0] == roots[1] {
+		opt.mergedRoot = roots[2]
+		return nil
+	}
 
 	var trees []*fsmgr.SeafDir
 	for i := 0; i < 3; i++ {
@@ -34,18 +67,22 @@ func mergeTrees(storeID string, roots []string, opt *mergeOptions) error {
 		trees = append(trees, dir)
 	}
 
-	err := mergeTreesRecursive(storeID, trees, "", opt)
+	mergedRoot, err := mergeTreesRecursive(storeID, trees, "", opt)
 	if err != nil {
 		err := fmt.Errorf("failed to merge trees: %v", err)
 		return err
 	}
+	opt.mergedRoot = mergedRoot
 
 	return nil
 }
 
-func mergeTreesRecursive(storeID string, trees []*fsmgr.SeafDir, baseDir string, opt *mergeOptions) error {
+// mergeTreesRecursive returns the id of the merged tree.
+func mergeTreesRecursive(storeID string, trees []*fsmgr.SeafDir, baseDir string, opt *mergeOptions) (string, error) {
 	var ptrs [3][]*fsmgr.SeafDirent
 	var mergedDents []*fsmgr.SeafDirent
+	// Sub-directories changed on both sides, merged after this level.
+	var subMerges [][]*fsmgr.SeafDirent
 
 	n := 3
 	for i := 0; i < n; i++ {
@@ -95,41 +132,82 @@ func mergeTreesRecursive(storeID string, trees []*fsmgr.SeafDir, baseDir string,
 		if nFiles > 0 {
 			retDents, err := mergeEntries(storeID, dents, baseDir, opt)
 			if err != nil {
-				return err
+				return "", err
 			}
 			mergedDents = append(mergedDents, retDents...)
 		}
 
 		if nDirs > 0 {
-			retDents, err := mergeDirectories(storeID, dents, baseDir, opt)
+			retDents, resolved, err := resolveDirectories(dents)
 			if err != nil {
-				return err
+				return "", err
+			}
+			if resolved {
+				mergedDents = append(mergedDents, retDents...)
+			} else {
+				subMerges = append(subMerges, dents)
 			}
-			mergedDents = append(mergedDents, retDents...)
 		}
 	}
 
+	retDents, err := mergeSubDirectories(storeID, subMerges, baseDir, opt)
+	if err != nil {
+		return "", err
+	}
+	mergedDents = append(mergedDents, retDents...)
+
 	sort.Sort(Dirents(mergedDents))
 	mergedTree, err := fsmgr.NewSeafdir(1, mergedDents)
 	if err != nil {
 		err := fmt.Errorf("failed to new seafdir: %v", err)
-		return err
+		return "", err
 	}
 
-	opt.mergedRoot = mergedTree.DirID
-
 	if trees[1] != nil && trees[1].DirID == mergedTree.DirID ||
 		trees[2] != nil && trees[2].DirID == mergedTree.DirID {
-		return nil
+		return mergedTree.DirID, nil
 	}
 
 	err = fsmgr.SaveSeafdir(storeID, mergedTree)
 	if err != nil {
 		err := fmt.Errorf("failed to save merged tree %s/%s", storeID, baseDir)
-		return err
+		return "", err
 	}
 
-	return nil
+	return mergedTree.DirID, nil
+}
+
+// mergeSubDirectories merges the sub-directories changed on both sides,
+// in other goroutines while merge slots are free. The results keep the
+// order of subMerges.
+func mergeSubDirectories(storeID string, subMerges [][]*fsmgr.SeafDirent, baseDir string, opt *mergeOptions) ([]*fsmgr.SeafDirent, error) {
+	results := make([][]*fsmgr.SeafDirent, len(subMerges))
+	errs := make([]error, len(subMerges))
+
+	var wg sync.WaitGroup
+	for i, dents := range subMerges {
+		select {
+		case mergeSlots <- struct{}{}:
+			wg.Add(1)
+			go func(i int, dents []*fsmgr.SeafDirent) {
+				defer wg.Done()
+				defer func() { <-mergeSlots }()
+				results[i], errs[i] = mergeDirectories(storeID, dents, baseDir, opt)
+			}(i, dents)
+		default:
+			results[i], errs[i] = mergeDirectories(storeID, dents, baseDir, opt)
+		}
+	}
+	wg.Wait()
+
+	var mergedDents []*fsmgr.SeafDirent
+	for i := range subMerges {
+		if errs[i] != nil {
+			return nil, errs[i]
+		}
+		mergedDents = append(mergedDents, results[i]...)
+	}
+	return mergedDents, nil
 }
 
 func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt *mergeOptions) ([]*fsmgr.SeafDirent, error) {
@@ -160,9 +238,9 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 				err := fmt.Errorf("failed to generate conflict file name")
 				return nil, err
 			}
-			dents[2].Name = conflictName
+			remote = renamedDirent(remote, conflictName)
 			mergedDents = append(mergedDents, remote)
-			opt.conflict = true
+			opt.setConflict()
 		}
 	} else if base != nil && head == nil && remote != nil {
 		if base.ID != remote.ID {
@@ -172,9 +250,9 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 					err := fmt.Errorf("failed to generate conflict file name")
 					return nil, err
 				}
-				dents[2].Name = conflictName
+				remote = renamedDirent(remote, conflictName)
 				mergedDents = append(mergedDents, remote)
-				opt.conflict = true
+				opt.setConflict()
 			} else {
 				mergedDents = append(mergedDents, remote)
 			}
@@ -187,9 +265,9 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 					err := fmt.Errorf("failed to generate conflict file name")
 					return nil, err
 				}
-				dents[2].Name = conflictName
+				dents[2] = renamedDirent(dents[2], conflictName)
 				mergedDents = append(mergedDents, head)
-				opt.conflict = true
+				opt.setConflict()
 			} else {
 				mergedDents = append(mergedDents, head)
 			}
@@ -205,9 +283,9 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 				err := fmt.Errorf("failed to generate conflict file name")
 				return nil, err
 			}
-			dents[2].Name = conflictName
+			remote = renamedDirent(remote, conflictName)
 			mergedDents = append(mergedDents, remote)
-			opt.conflict = true
+			opt.setConflict()
 		}
 	} else if base == nil && head != nil && remote == nil {
 		if dents[2] == nil {
@@ -220,9 +298,9 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 				err := fmt.Errorf("failed to generate conflict file name")
 				return nil, err
 			}
-			dents[2].Name = conflictName
+			dents[2] = renamedDirent(dents[2], conflictName)
 			mergedDents = append(mergedDents, head)
-			opt.conflict = true
+			opt.setConflict()
 		}
 	} else if base != nil && head == nil && remote == nil {
 	}
@@ -230,61 +308,80 @@ func mergeEntries(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt
 	return mergedDents, nil
 }
 
-func mergeDirectories(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt *mergeOptions) ([]*fsmgr.SeafDirent, error) {
+// renamedDirent returns a copy of dent with a conflict name, the dirents
+// of loaded dirs may be shared with other readers.
+func renamedDirent(dent *fsmgr.SeafDirent, name string) *fsmgr.SeafDirent {
+	renamed := *dent
+	renamed.Name = name
+	return &renamed
+}
+
+func dirMaskOf(dents []*fsmgr.SeafDirent) int {
 	var dirMask int
-	var mergedDents []*fsmgr.SeafDirent
-	var dirName string
-	n := 3
-	subDirs := make([]*fsmgr.SeafDir, n)
-	for i := 0; i < n; i++ {
+	for i := 0; i < 3; i++ {
 		if dents[i] != nil && fsmgr.IsDir(dents[i].Mode) {
 			dirMask |= 1 << i
 		}
 	}
+	return dirMask
+}
 
-	switch dirMask {
+// resolveDirectories merges the dirs of dents by their ids. It returns
+// false if they were changed on both sides and must be merged entry by
+// entry.
+func resolveDirectories(dents []*fsmgr.SeafDirent) ([]*fsmgr.SeafDirent, bool, error) {
+	var mergedDents []*fsmgr.SeafDirent
+
+	switch dirMaskOf(dents) {
 	case 0:
 		err := fmt.Errorf("no dirent for merge")
-		return nil, err
+		return nil, true, err
 	case 1:
-		return mergedDents, nil
+		return mergedDents, true, nil
 	case 2:
 		mergedDents = append(mergedDents, dents[1])
-		return mergedDents, nil
+		return mergedDents, true, nil
 	case 3:
 		if dents[0].ID == dents[1].ID {
-			return mergedDents, nil
+			return mergedDents, true, nil
 		}
-		break
 	case 4:
 		mergedDents = append(mergedDents, dents[2])
-		return mergedDents, nil
+		return mergedDents, true, nil
 	case 5:
 		if dents[0].ID == dents[2].ID {
-			return mergedDents, nil
+			return mergedDents, true, nil
 		}
-		break
 	case 6:
 	case 7:
 		if dents[1].ID == dents[2].ID {
 			mergedDents = append(mergedDents, dents[1])
-			return mergedDents, nil
+			return mergedDents, true, nil
 		} else if dents[0] != nil && dents[0].ID == dents[1].ID {
 			mergedDents = append(mergedDents, dents[2])
-			return mergedDents, nil
+			return mergedDents, true, nil
 		} else if dents[0] != nil && dents[0].ID == dents[2].ID {
 			mergedDents = append(mergedDents, dents[1])
-			return mergedDents, nil
+			return mergedDents, true, nil
 		}
-		break
 	default:
 		err := fmt.Errorf("wrong dir mask for merge")
-		return nil, err
+		return nil, true, err
 	}
 
-	for i := 0; i < n; i++ {
-		subDirs[i] = nil
+	return nil, false, nil
+}
+
+func mergeDirectories(storeID string, dents []*fsmgr.SeafDirent, baseDir string, opt *mergeOptions) ([]*fsmgr.SeafDirent, error) {
+	var mergedDents []*fsmgr.SeafDirent
+	var dirName string
+	n := 3
+	subDirs := make([]*fsmgr.SeafDir, n)
+
+	if retDents, resolved, err := resolveDirectories(dents); resolved {
+		return retDents, err
 	}
+	dirMask := dirMaskOf(dents)
 
 	for i := 0; i < n; i++ {
 		if dents[i] != nil && fsmgr.IsDir(dents[i].Mode) {
@@ -300,20 +397,20 @@ func mergeDirectories(storeID string, dents []*fsmgr.SeafDirent, baseDir string,
 
 	newBaseDir := filepath.Join(baseDir, dirName)
 	newBaseDir = newBaseDir + "/"
-	err := mergeTreesRecursive(storeID, subDirs, newBaseDir, opt)
+	mergedRoot, err := mergeTreesRecursive(storeID, subDirs, newBaseDir, opt)
 	if err != nil {
 		err := fmt.Errorf("failed to merge trees: %v", err)
 		return nil, err
 	}
 
 	if dirMask == 3 || dirMask == 6 || dirMask == 7 {
-		dent := dents[1]
-		dent.ID = opt.mergedRoot
-		mergedDents = append(mergedDents, dent)
+		dent := *dents[1]
+		dent.ID = mergedRoot
+		mergedDents = append(mergedDents, &dent)
 	} else if dirMask == 5 {
-		dent := dents[2]
-		dent.ID = opt.mergedRoot
-		mergedDents = append(mergedDents, dent)
+		dent := *dents[2]
+		dent.ID = mergedRoot
+		mergedDents = append(mergedDents, &dent)
 	}
 
 	return mergedDents, nil
@@ -331,7 +428,7 @@ func mergeConflictFileName(storeID string, opt *mergeOptions, baseDir, fileName
 			return "", err
 		}
 		modifier = commit.CreatorName
-		mtime = time.Now().Unix()
+		mtime = opt.mergeTime
 	}
 
 	conflictName := genConflictPath(fileName, modifier, mtime)
@@ -341,8 +438,7 @@ func mergeConflictFileName(storeID string, opt *mergeOptions, baseDir, fileName
 
 func genConflictPath(originPath, modifier string, mtime int64) string {
 	var conflictPath string
-	now := time.Now()
-	timeBuf := now.Format("2006-Jan-2-15-04-05")
+	timeBuf := time.Unix(mtime, 0).Format("2006-Jan-2-15-04-05")
 	dot := strings.Index(originPath, ".")
 	if dot < 0 {
 		if modifier != "" {
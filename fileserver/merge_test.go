@@ -5,6 +5,7 @@ import (
 	"os"
 	"syscall"
 	"testing"
+	"time"
 
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
 	"github.com/haiwen/seafile-server/fileserver/fsmgr"
@@ -483,3 +484,68 @@ func testMergeTrees12(t *testing.T) {
 		t.Errorf("merge error %s/%s.\n", opt.mergedRoot, mergeTestTree1)
 	}
 }
+
+// mergeBenchCreateTree saves a tree of 100 dirs with 100 files each. The
+// files of the 10 dirs from changedFrom get other ids than in the base tree.
+func mergeBenchCreateTree(b *testing.B, changedFrom int) string {
+	modeDir := uint32(syscall.S_IFDIR | 0644)
+	modeFile := uint32(syscall.S_IFREG | 0644)
+
+	var dirs []*fsmgr.SeafDirent
+	for i := 99; i >= 0; i-- {
+		seed := uint64(i) * 100
+		if changedFrom >= 0 && i >= changedFrom && i < changedFrom+10 {
+			seed += uint64(changedFrom+1) * 10000
+		}
+		var files []*fsmgr.SeafDirent
+		for j := 99; j >= 0; j-- {
+			id := fmt.Sprintf("%040x", (seed+uint64(j))*0x9e3779b97f4a7c15)
+			files = append(files, &fsmgr.SeafDirent{ID: id, Name: fmt.Sprintf("file%06d.txt", j), Mode: modeFile, Size: 1 << 20})
+		}
+		dir, err := mergeTestCreateSeafdir(files)
+		if err != nil {
+			b.Fatalf("failed to create seafdir: %v", err)
+		}
+		dirs = append(dirs, &fsmgr.SeafDirent{ID: dir, Name: fmt.Sprintf("dir%04d", i), Mode: modeDir})
+	}
+	root, err := mergeTestCreateSeafdir(dirs)
+	if err != nil {
+		b.Fatalf("failed to create seafdir: %v", err)
+	}
+	return root
+}
+
+func BenchmarkMergeTrees(b *testing.B) {
+	fsmgr.Init(mergeTestSeafileConfPath, mergeTestSeafileDataDir)
+	defer mergeTestDelFile()
+
+	roots := []string{
+		mergeBenchCreateTree(b, -1),
+		mergeBenchCreateTree(b, 0),
+		mergeBenchCreateTree(b, 50),
+	}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		opt := new(mergeOptions)
+		opt.remoteRepoID = mergeTestRepoID
+		if err := mergeTrees(mergeTestRepoID, roots, opt); err != nil {
+			b.Fatalf("failed to merge: %v", err)
+		}
+		if opt.conflict {
+			b.Fatalf("unexpected conflict in merge")
+		}
+	}
+}
+
+func TestGenConflictPath(t *testing.T) {
+	mtime := int64(1600000000)
+	timeBuf := time.Unix(mtime, 0).Format("2006-Jan-2-15-04-05")
+
+	name := genConflictPath("test.txt", "user", mtime)
+	if name != "test.txt (SFConflict user "+timeBuf+").txt" {
+		t.Errorf("wrong conflict name %s", name)
+	}
+	if genConflictPath("test.txt", "user", mtime) != name {
+		t.Errorf("conflict names of the same file differ")
+	}
+}
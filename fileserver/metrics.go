@@ -0,0 +1,337 @@
+package main
+
+import (
+	"bufio"
+	"database/sql"
+	"fmt"
+	"io"
+	"math/bits"
+	"net/http"
+	"sync/atomic"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/accessstats"
+	"github.com/haiwen/seafile-server/fileserver/workerpool"
+)
+
+// Requests of every route are counted by status code, and their latencies
+// are kept in a histogram with buckets growing by powers of two. The
+// counters are only updated with atomic adds, so recording a request takes
+// no locks. The metrics are served on /metrics in the Prometheus text
+// format if enable_metrics is set.
+
+const (
+	// Upper bound of the first latency bucket, 256us.
+	latencyBucketShift = 8
+	// The last bounded bucket ends at about 67s.
+	nLatencyBuckets = 19
+	maxStatusCode   = 600
+)
+
+type routeMetrics struct {
+	name     string
+	inFlight int64
+	bytesIn  uint64
+	bytesOut uint64
+	// Sum of the latencies in microseconds.
+	latencySum uint64
+	// The last bucket counts requests slower than all bounds.
+	latency [nLatencyBuckets + 1]uint64
+	codes   [maxStatusCode]uint64
+}
+
+// The routes are registered by newHTTPRouter, before the server starts.
+var httpRoutes []*routeMetrics
+
+func latencyBucket(d time.Duration) int {
+	us := d.Microseconds()
+	if us <= 1<<latencyBucketShift {
+		return 0
+	}
+	i := bits.Len64(uint64(us-1)) - latencyBucketShift
+	if i > nLatencyBuckets {
+		return nLatencyBuckets
+	}
+	return i
+}
+
+func (m *routeMetrics) record(code int, d time.Duration, bytesIn, bytesOut int64) {
+	if code <= 0 || code >= maxStatusCode {
+		code = 0
+	}
+	atomic.AddUint64(&m.codes[code], 1)
+	atomic.AddUint64(&m.latency[latencyBucket(d)], 1)
+	atomic.AddUint64(&m.latencySum, uint64(d.Microseconds()))
+	atomic.AddUint64(&m.bytesIn, uint64(bytesIn))
+	atomic.AddUint64(&m.bytesOut, uint64(bytesOut))
+}
+
+type metricsWriter struct {
+	http.ResponseWriter
+	code  int
+	bytes int64
+}
+
+func (w *metricsWriter) WriteHeader(code int) {
+	if w.code == 0 {
+		w.code = code
+	}
+	w.ResponseWriter.WriteHeader(code)
+}
+
+func (w *metricsWriter) Write(p []byte) (int, error) {
+	if w.code == 0 {
+		w.code = http.StatusOK
+	}
+	n, err := w.ResponseWriter.Write(p)
+	w.bytes += int64(n)
+	return n, err
+}
+
+type metricsBody struct {
+	io.ReadCloser
+	bytes int64
+}
+
+func (b *metricsBody) Read(p []byte) (int, error) {
+	n, err := b.ReadCloser.Read(p)
+	b.bytes += int64(n)
+	return n, err
+}
+
+// instrument records the requests handled by h as route name.
+func instrument(name string, h http.Handler) http.Handler {
+	m := &routeMetrics{name: name}
+	httpRoutes = append(httpRoutes, m)
+
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		start := time.Now()
+		atomic.AddInt64(&m.inFlight, 1)
+		mw := &metricsWriter{ResponseWriter: w}
+		body := &metricsBody{ReadCloser: r.Body}
+		if r.Body != nil {
+			r.Body = body
+		}
+		defer func() {
+			atomic.AddInt64(&m.inFlight, -1)
+			code := mw.code
+			if code == 0 {
+				code = http.StatusOK
+			}
+			m.record(code, time.Since(start), body.bytes, mw.bytes)
+		}()
+
+		if options.profiler.enabled {
+			profileRequest(name, h, mw, r)
+			return
+		}
+		h.ServeHTTP(mw, r)
+	})
+}
+
+func writeRouteMetrics(w io.Writer, routes []*routeMetrics) {
+	fmt.Fprintf(w, "# TYPE seafile_http_requests_total counter\n")
+	for _, m := range routes {
+		for code := range m.codes {
+			if n := atomic.LoadUint64(&m.codes[code]); n > 0 {
+				fmt.Fprintf(w, "seafile_http_requests_total{route=\"%s\",code=\"%d\"} %d\n", m.name, code, n)
+			}
+		}
+	}
+
+	fmt.Fprintf(w, "# TYPE seafile_http_request_duration_seconds histogram\n")
+	for _, m := range routes {
+		var count uint64
+		for i := 0; i < nLatencyBuckets; i++ {
+			count += atomic.LoadUint64(&m.latency[i])
+			bound := float64(uint64(1)<<(latencyBucketShift+i)) / 1e6
+			fmt.Fprintf(w, "seafile_http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %d\n", m.name, bound, count)
+		}
+		count += atomic.LoadUint64(&m.latency[nLatencyBuckets])
+		fmt.Fprintf(w, "seafile_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %d\n", m.name, count)
+		fmt.Fprintf(w, "seafile_http_request_duration_seconds_sum{route=\"%s\"} %g\n", m.name,
+			float64(atomic.LoadUint64(&m.latencySum))/1e6)
+		fmt.Fprintf(w, "seafile_http_request_duration_seconds_count{route=\"%s\"} %d\n", m.name, count)
+	}
+
+	fmt.Fprintf(w, "# TYPE seafile_http_requests_in_flight gauge\n")
+	for _, m := range routes {
+		fmt.Fprintf(w, "seafile_http_requests_in_flight{route=\"%s\"} %d\n", m.name, atomic.LoadInt64(&m.inFlight))
+	}
+	fmt.Fprintf(w, "# TYPE seafile_http_request_bytes_total counter\n")
+	for _, m := range routes {
+		fmt.Fprintf(w, "seafile_http_request_bytes_total{route=\"%s\"} %d\n", m.name, atomic.LoadUint64(&m.bytesIn))
+	}
+	fmt.Fprintf(w, "# TYPE seafile_http_response_bytes_total counter\n")
+	for _, m := range routes {
+		fmt.Fprintf(w, "seafile_http_response_bytes_total{route=\"%s\"} %d\n", m.name, atomic.LoadUint64(&m.bytesOut))
+	}
+}
+
+type namedPool struct {
+	name string
+	pool *workerpool.WorkPool
+}
+
+// workerPools returns the named worker pools that have been created.
+func workerPools() []namedPool {
+	pools := []namedPool{
+		{"fs-id-list", calFsIdPool},
+		{"size-sched", updateSizePool},
+		{"merge-virtual-repo", mergeVirtualRepoPool},
+	}
+	var created []namedPool
+	for _, p := range pools {
+		if p.pool != nil {
+			created = append(created, p)
+		}
+	}
+	return created
+}
+
+func writePoolMetrics(w io.Writer) {
+	pools := workerPools()
+	stats := make([]workerpool.Stats, len(pools))
+	for i, p := range pools {
+		stats[i] = p.pool.Stats()
+	}
+
+	fmt.Fprintf(w, "# TYPE seafile_pool_queued_tasks gauge\n")
+	for i, p := range pools {
+		for _, prio := range workerpool.Priorities() {
+			fmt.Fprintf(w, "seafile_pool_queued_tasks{pool=\"%s\",priority=\"%s\"} %d\n", p.name, prio, stats[i].Queued[prio])
+		}
+	}
+	var chunkerStats ChunkerStats
+	if chunker != nil {
+		chunkerStats = chunker.stats()
+		fmt.Fprintf(w, "seafile_pool_queued_tasks{pool=\"index\"} %d\n", chunkerStats.QueuedJobs)
+	}
+	fmt.Fprintf(w, "# TYPE seafile_pool_busy_workers gauge\n")
+	for i, p := range pools {
+		fmt.Fprintf(w, "seafile_pool_busy_workers{pool=\"%s\"} %d\n", p.name, stats[i].Busy)
+	}
+	if chunker != nil {
+		fmt.Fprintf(w, "seafile_pool_busy_workers{pool=\"index\"} %d\n", chunkerStats.BusyWorkers)
+	}
+
+	counters := []struct {
+		name  string
+		value func(s *workerpool.Stats) string
+	}{
+		{"seafile_pool_completed_tasks_total", func(s *workerpool.Stats) string { return fmt.Sprint(s.Completed) }},
+		{"seafile_pool_rejected_tasks_total", func(s *workerpool.Stats) string { return fmt.Sprint(s.Rejected) }},
+		{"seafile_pool_coalesced_tasks_total", func(s *workerpool.Stats) string { return fmt.Sprint(s.Coalesced) }},
+		{"seafile_pool_task_wait_seconds_total", func(s *workerpool.Stats) string { return fmt.Sprintf("%g", s.WaitTime.Seconds()) }},
+		{"seafile_pool_task_run_seconds_total", func(s *workerpool.Stats) string { return fmt.Sprintf("%g", s.RunTime.Seconds()) }},
+	}
+	for _, c := range counters {
+		fmt.Fprintf(w, "# TYPE %s counter\n", c.name)
+		for i, p := range pools {
+			fmt.Fprintf(w, "%s{pool=\"%s\"} %s\n", c.name, p.name, c.value(&stats[i]))
+		}
+	}
+}
+
+func writeDBMetrics(w io.Writer) {
+	dbs := []struct {
+		name string
+		db   *sql.DB
+	}{
+		{"seafile", seafileDB},
+		{"ccnet", ccnetDB},
+	}
+
+	fmt.Fprintf(w, "# TYPE seafile_db_connections gauge\n")
+	for _, d := range dbs {
+		if d.db == nil {
+			continue
+		}
+		stats := d.db.Stats()
+		fmt.Fprintf(w, "seafile_db_connections{db=\"%s\",state=\"in_use\"} %d\n", d.name, stats.InUse)
+		fmt.Fprintf(w, "seafile_db_connections{db=\"%s\",state=\"idle\"} %d\n", d.name, stats.Idle)
+	}
+	fmt.Fprintf(w, "# TYPE seafile_db_waits_total counter\n")
+	for _, d := range dbs {
+		if d.db != nil {
+			fmt.Fprintf(w, "seafile_db_waits_total{db=\"%s\"} %d\n", d.name, d.db.Stats().WaitCount)
+		}
+	}
+	fmt.Fprintf(w, "# TYPE seafile_db_wait_seconds_total counter\n")
+	for _, d := range dbs {
+		if d.db != nil {
+			fmt.Fprintf(w, "seafile_db_wait_seconds_total{db=\"%s\"} %g\n", d.name, d.db.Stats().WaitDuration.Seconds())
+		}
+	}
+}
+
+func writeRPCMetrics(w io.Writer) {
+	if rpcclient == nil {
+		return
+	}
+	stats := rpcclient.Stats()
+
+	fmt.Fprintf(w, "# TYPE seafile_rpc_calls_total counter\n")
+	fmt.Fprintf(w, "seafile_rpc_calls_total %d\n", stats.Calls)
+	fmt.Fprintf(w, "# TYPE seafile_rpc_errors_total counter\n")
+	fmt.Fprintf(w, "seafile_rpc_errors_total %d\n", stats.Errors)
+	fmt.Fprintf(w, "# TYPE seafile_rpc_timeouts_total counter\n")
+	fmt.Fprintf(w, "seafile_rpc_timeouts_total %d\n", stats.Timeouts)
+	fmt.Fprintf(w, "# TYPE seafile_rpc_fallback_calls_total counter\n")
+	fmt.Fprintf(w, "seafile_rpc_fallback_calls_total %d\n", stats.FallbackCalls)
+	fmt.Fprintf(w, "# TYPE seafile_rpc_call_seconds_total counter\n")
+	fmt.Fprintf(w, "seafile_rpc_call_seconds_total %g\n", stats.CallTime.Seconds())
+	fmt.Fprintf(w, "# TYPE seafile_rpc_calls_in_flight gauge\n")
+	fmt.Fprintf(w, "seafile_rpc_calls_in_flight %d\n", stats.InFlight)
+	fmt.Fprintf(w, "# TYPE seafile_rpc_connections gauge\n")
+	fmt.Fprintf(w, "seafile_rpc_connections %d\n", stats.Conns)
+}
+
+// The most read objects aren't exported, their ids would make too many
+// series; they are served on /debug/pprof/access-stats.
+func writeAccessMetrics(w io.Writer) {
+	if accessstats.SampleRate() == 0 {
+		return
+	}
+	var stats [accessstats.NumClasses]accessstats.Stats
+	for c := range stats {
+		stats[c] = accessstats.Get(accessstats.Class(c))
+	}
+
+	fmt.Fprintf(w, "# TYPE seafile_access_sampled_reads_total counter\n")
+	for c := range stats {
+		fmt.Fprintf(w, "seafile_access_sampled_reads_total{class=\"%s\"} %d\n", accessstats.Class(c), stats[c].Sampled)
+	}
+	fmt.Fprintf(w, "# TYPE seafile_access_cold_reads_total counter\n")
+	for c := range stats {
+		fmt.Fprintf(w, "seafile_access_cold_reads_total{class=\"%s\"} %d\n", accessstats.Class(c), stats[c].Cold)
+	}
+	fmt.Fprintf(w, "# TYPE seafile_access_reuse_distance histogram\n")
+	for c := range stats {
+		name := accessstats.Class(c)
+		var count uint64
+		for i := 0; i < accessstats.NumReuseBuckets-1; i++ {
+			count += stats[c].Reuse[i]
+			fmt.Fprintf(w, "seafile_access_reuse_distance_bucket{class=\"%s\",le=\"%d\"} %d\n", name, uint64(1)<<i-1, count)
+		}
+		count += stats[c].Reuse[accessstats.NumReuseBuckets-1]
+		fmt.Fprintf(w, "seafile_access_reuse_distance_bucket{class=\"%s\",le=\"+Inf\"} %d\n", name, count)
+		fmt.Fprintf(w, "seafile_access_reuse_distance_count{class=\"%s\"} %d\n", name, count)
+	}
+}
+
+func handleMetrics(rsp http.ResponseWriter, r *http.Request) {
+	if !options.enableMetrics {
+		http.Error(rsp, "", http.StatusNotFound)
+		return
+	}
+
+	rsp.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	w := bufio.NewWriter(rsp)
+	writeRouteMetrics(w, httpRoutes)
+	writePoolMetrics(w)
+	writeDBMetrics(w)
+	writeRPCMetrics(w)
+	writeAccessMetrics(w)
+	w.Flush()
+}
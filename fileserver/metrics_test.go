@@ -0,0 +1,75 @@
+package main
+
+import (
+	"bytes"
+	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"testing"
+	"time"
+)
+
+func TestLatencyBucket(t *testing.T) {
+	cases := []struct {
+		d      time.Duration
+		bucket int
+	}{
+		{0, 0},
+		{256 * time.Microsecond, 0},
+		{257 * time.Microsecond, 1},
+		{512 * time.Microsecond, 1},
+		{time.Millisecond, 2},
+		{time.Hour, nLatencyBuckets},
+	}
+	for _, c := range cases {
+		if b := latencyBucket(c.d); b != c.bucket {
+			t.Errorf("latency %v is in bucket %d, expected %d", c.d, b, c.bucket)
+		}
+	}
+}
+
+func TestInstrument(t *testing.T) {
+	saved := httpRoutes
+	defer func() { httpRoutes = saved }()
+	httpRoutes = nil
+
+	h := instrument("test", appHandler(func(rsp http.ResponseWriter, r *http.Request) *appError {
+		body, _ := ioutil.ReadAll(r.Body)
+		if len(body) == 0 {
+			return &appError{nil, "no body", http.StatusBadRequest}
+		}
+		rsp.Write(body)
+		return nil
+	}))
+
+	for _, body := range []string{"hello", "", "world!"} {
+		req := httptest.NewRequest("POST", "/test", strings.NewReader(body))
+		h.ServeHTTP(httptest.NewRecorder(), req)
+	}
+
+	m := httpRoutes[0]
+	if m.codes[http.StatusOK] != 2 || m.codes[http.StatusBadRequest] != 1 {
+		t.Errorf("wrong status counts: 200: %d, 400: %d", m.codes[http.StatusOK], m.codes[http.StatusBadRequest])
+	}
+	if m.bytesIn != 11 || m.bytesOut != 11+uint64(len("no body\n")) {
+		t.Errorf("wrong byte counts: in %d, out %d", m.bytesIn, m.bytesOut)
+	}
+	if m.inFlight != 0 {
+		t.Errorf("%d requests still in flight", m.inFlight)
+	}
+
+	var buf bytes.Buffer
+	writeRouteMetrics(&buf, httpRoutes)
+	out := buf.String()
+	for _, line := range []string{
+		"seafile_http_requests_total{route=\"test\",code=\"200\"} 2\n",
+		"seafile_http_request_duration_seconds_bucket{route=\"test\",le=\"+Inf\"} 3\n",
+		"seafile_http_request_duration_seconds_count{route=\"test\"} 3\n",
+		"seafile_http_request_bytes_total{route=\"test\"} 11\n",
+	} {
+		if !strings.Contains(out, line) {
+			t.Errorf("metrics don't contain %q", line)
+		}
+	}
+}
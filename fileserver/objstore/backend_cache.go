@@ -0,0 +1,273 @@
+// Implementation of the read-through block cache backend.
+// It keeps recently read objects in a directory on a fast local disk, in the
+// same layout as common/block-backend-cache.c in seaf-server, so both servers
+// can share one cache directory.
+package objstore
+
+import (
+	"container/list"
+	"errors"
+	"io"
+	"io/ioutil"
+	"log"
+	"os"
+	"path/filepath"
+	"sync"
+)
+
+const (
+	defaultCacheSize   = 10 << 30
+	defaultFillThreads = 2
+	fillQueueSize      = 1024
+)
+
+var (
+	// errNoLocalFile is returned by open() if an object is not stored in a local file.
+	errNoLocalFile   = errors.New("object is not stored in a local file")
+	errAlreadyCached = errors.New("object is already cached")
+)
+
+type cachedObj struct {
+	key  string
+	size int64
+}
+
+type fillTask struct {
+	repoID string
+	objID  string
+}
+
+type cacheBackend struct {
+	base     storageBackend
+	cacheDir string
+	tmpDir   string
+	maxBytes int64
+
+	mu      sync.Mutex
+	entries map[string]*list.Element
+	lru     *list.List
+	bytes   int64
+	filling map[string]bool
+
+	fillQueue chan fillTask
+}
+
+func newCacheBackend(base storageBackend, cacheDir string, maxBytes int64, fillThreads int) (*cacheBackend, error) {
+	tmpDir := filepath.Join(cacheDir, "tmp")
+	err := os.MkdirAll(tmpDir, os.ModePerm)
+	if err != nil {
+		return nil, err
+	}
+	if maxBytes <= 0 {
+		maxBytes = defaultCacheSize
+	}
+	if fillThreads <= 0 {
+		fillThreads = defaultFillThreads
+	}
+
+	backend := new(cacheBackend)
+	backend.base = base
+	backend.cacheDir = cacheDir
+	backend.tmpDir = tmpDir
+	backend.maxBytes = maxBytes
+	backend.entries = make(map[string]*list.Element)
+	backend.lru = list.New()
+	backend.filling = make(map[string]bool)
+	backend.fillQueue = make(chan fillTask, fillQueueSize)
+
+	for i := 0; i < fillThreads; i++ {
+		go backend.fillWorker()
+	}
+	go backend.scanCacheDir()
+
+	return backend, nil
+}
+
+func (b *cacheBackend) cachePath(repoID string, objID string) string {
+	return filepath.Join(b.cacheDir, repoID, objID[:2], objID[2:])
+}
+
+// touch records an object in the LRU index, or marks it as recently used.
+func (b *cacheBackend) touch(repoID string, objID string, size int64) {
+	key := repoID + "/" + objID
+	b.mu.Lock()
+	defer b.mu.Unlock()
+
+	if elem, ok := b.entries[key]; ok {
+		b.lru.MoveToFront(elem)
+		return
+	}
+	b.entries[key] = b.lru.PushFront(&cachedObj{key, size})
+	b.bytes += size
+
+	for b.bytes > b.maxBytes {
+		elem := b.lru.Back()
+		if elem == nil {
+			break
+		}
+		obj := b.lru.Remove(elem).(*cachedObj)
+		delete(b.entries, obj.key)
+		b.bytes -= obj.size
+		os.Remove(filepath.Join(b.cacheDir, obj.key[:36], obj.key[37:39], obj.key[39:]))
+	}
+}
+
+// openCached opens the cached copy of an object, or returns nil on a miss.
+func (b *cacheBackend) openCached(repoID string, objID string) *os.File {
+	f, err := os.Open(b.cachePath(repoID, objID))
+	if err != nil {
+		return nil
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil
+	}
+	b.touch(repoID, objID, fi.Size())
+	return f
+}
+
+func (b *cacheBackend) scheduleFill(repoID string, objID string) {
+	key := repoID + "/" + objID
+	b.mu.Lock()
+	if b.filling[key] {
+		b.mu.Unlock()
+		return
+	}
+	b.filling[key] = true
+	b.mu.Unlock()
+
+	select {
+	case b.fillQueue <- fillTask{repoID, objID}:
+	default:
+		// Too many pending fills, skip this one.
+		b.mu.Lock()
+		delete(b.filling, key)
+		b.mu.Unlock()
+	}
+}
+
+func (b *cacheBackend) fillWorker() {
+	for task := range b.fillQueue {
+		if size, err := b.fill(task.repoID, task.objID); err == nil {
+			b.touch(task.repoID, task.objID, size)
+		} else if err != errAlreadyCached {
+			log.Printf("failed to cache block %s:%s: %v", task.repoID, task.objID, err)
+		}
+		b.mu.Lock()
+		delete(b.filling, task.repoID+"/"+task.objID)
+		b.mu.Unlock()
+	}
+}
+
+func (b *cacheBackend) fill(repoID string, objID string) (int64, error) {
+	p := b.cachePath(repoID, objID)
+	if _, err := os.Stat(p); err == nil {
+		return 0, errAlreadyCached
+	}
+
+	tFile, err := ioutil.TempFile(b.tmpDir, objID)
+	if err != nil {
+		return 0, err
+	}
+	defer os.Remove(tFile.Name())
+	defer tFile.Close()
+
+	if err := b.base.read(repoID, objID, tFile); err != nil {
+		return 0, err
+	}
+	fi, err := tFile.Stat()
+	if err != nil {
+		return 0, err
+	}
+	if err := os.MkdirAll(filepath.Dir(p), os.ModePerm); err != nil {
+		return 0, err
+	}
+	if err := os.Rename(tFile.Name(), p); err != nil {
+		return 0, err
+	}
+	return fi.Size(), nil
+}
+
+// scanCacheDir indexes the objects already in the cache dir, e.g. after a restart.
+func (b *cacheBackend) scanCacheDir() {
+	repos, err := ioutil.ReadDir(b.cacheDir)
+	if err != nil {
+		return
+	}
+	for _, repo := range repos {
+		if !repo.IsDir() || len(repo.Name()) != 36 {
+			continue
+		}
+		repoDir := filepath.Join(b.cacheDir, repo.Name())
+		subDirs, _ := ioutil.ReadDir(repoDir)
+		for _, sub := range subDirs {
+			files, _ := ioutil.ReadDir(filepath.Join(repoDir, sub.Name()))
+			for _, f := range files {
+				objID := sub.Name() + f.Name()
+				if len(objID) == 40 && f.Mode().IsRegular() {
+					b.touch(repo.Name(), objID, f.Size())
+				}
+			}
+		}
+	}
+}
+
+func (b *cacheBackend) read(repoID string, objID string, w io.Writer) error {
+	if f := b.openCached(repoID, objID); f != nil {
+		defer f.Close()
+		_, err := io.Copy(w, f)
+		return err
+	}
+
+	err := b.base.read(repoID, objID, w)
+	if err == nil {
+		b.scheduleFill(repoID, objID)
+	}
+	return err
+}
+
+func (b *cacheBackend) open(repoID string, objID string) (*os.File, error) {
+	if f := b.openCached(repoID, objID); f != nil {
+		return f, nil
+	}
+
+	fb, ok := b.base.(fileBackend)
+	if !ok {
+		b.scheduleFill(repoID, objID)
+		return nil, errNoLocalFile
+	}
+	f, err := fb.open(repoID, objID)
+	if err == nil {
+		b.scheduleFill(repoID, objID)
+	}
+	return f, err
+}
+
+func (b *cacheBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	return b.base.write(repoID, objID, r, sync)
+}
+
+func (b *cacheBackend) exists(repoID string, objID string) (bool, error) {
+	if _, err := os.Stat(b.cachePath(repoID, objID)); err == nil {
+		return true, nil
+	}
+	return b.base.exists(repoID, objID)
+}
+
+// existsMany doesn't check the cache, since blocks are only cached after
+// reading, while existence checks are mostly for blocks to be uploaded.
+func (b *cacheBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	return b.base.existsMany(repoID, objIDs)
+}
+
+func (b *cacheBackend) stat(repoID string, objID string) (int64, error) {
+	if fi, err := os.Stat(b.cachePath(repoID, objID)); err == nil {
+		return fi.Size(), nil
+	}
+	return b.base.stat(repoID, objID)
+}
+
+func (b *cacheBackend) refreshWriteTime(repoID string, objID string) error {
+	return refreshWriteTime(b.base, repoID, objID)
+}
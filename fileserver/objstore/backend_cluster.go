@@ -0,0 +1,70 @@
+package objstore
+
+import (
+	"bytes"
+	"io"
+
+	"github.com/haiwen/seafile-server/fileserver/clustercache"
+)
+
+// clusterBackend looks up commit and fs objects in the cluster cache before
+// the underlying backend. Objects are named by their content, so a cached
+// copy never becomes stale. Objects read from the backend or written are
+// added to the cache, for the other nodes to find them there.
+type clusterBackend struct {
+	base    storageBackend
+	cache   *clustercache.Cache
+	objType string
+}
+
+func newClusterBackend(base storageBackend, cache *clustercache.Cache, objType string) *clusterBackend {
+	return &clusterBackend{base, cache, objType}
+}
+
+func (b *clusterBackend) key(repoID, objID string) string {
+	return "seaf:" + b.objType + ":" + repoID + ":" + objID
+}
+
+func (b *clusterBackend) read(repoID string, objID string, w io.Writer) error {
+	key := b.key(repoID, objID)
+	if data, ok := b.cache.Get(key); ok {
+		_, err := w.Write(data)
+		return err
+	}
+
+	var buf bytes.Buffer
+	if err := b.base.read(repoID, objID, &buf); err != nil {
+		return err
+	}
+	b.cache.Set(key, buf.Bytes())
+	_, err := w.Write(buf.Bytes())
+	return err
+}
+
+func (b *clusterBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	var buf bytes.Buffer
+	if _, err := buf.ReadFrom(r); err != nil {
+		return err
+	}
+	if err := b.base.write(repoID, objID, bytes.NewReader(buf.Bytes()), sync); err != nil {
+		return err
+	}
+	b.cache.Set(b.key(repoID, objID), buf.Bytes())
+	return nil
+}
+
+func (b *clusterBackend) exists(repoID string, objID string) (bool, error) {
+	return b.base.exists(repoID, objID)
+}
+
+func (b *clusterBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	return b.base.existsMany(repoID, objIDs)
+}
+
+func (b *clusterBackend) stat(repoID string, objID string) (int64, error) {
+	return b.base.stat(repoID, objID)
+}
+
+func (b *clusterBackend) refreshWriteTime(repoID string, objID string) error {
+	return refreshWriteTime(b.base, repoID, objID)
+}
@@ -0,0 +1,268 @@
+// Implementation of transparent block compression.
+// The block format is the same as in common/block-backend-compress.c in
+// seaf-server: compressed blocks start with a 16-byte header
+//
+//	magic (8 bytes) | codec (1) | reserved (3) | size (4, big endian)
+//
+// followed by the encoded contents. Blocks that don't shrink are stored as
+// they are, unless they happen to begin with the magic.
+package objstore
+
+import (
+	"bytes"
+	"compress/zlib"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+)
+
+const (
+	blockHeaderSize = 16
+	blockMagic      = "\x89SFBLK\r\n"
+
+	codecNone = 0
+	codecZlib = 1
+)
+
+type compressBackend struct {
+	base  storageBackend
+	codec byte
+}
+
+func newCompressBackend(base storageBackend, codec string) (*compressBackend, error) {
+	backend := new(compressBackend)
+	backend.base = base
+	switch codec {
+	case "zlib":
+		backend.codec = codecZlib
+	case "none":
+		backend.codec = codecNone
+	default:
+		return nil, fmt.Errorf("unknown block compression %s", codec)
+	}
+	return backend, nil
+}
+
+// parseBlockHeader returns the codec and original size of an encoded block.
+func parseBlockHeader(hdr []byte) (byte, int64, bool) {
+	if len(hdr) < blockHeaderSize || string(hdr[:len(blockMagic)]) != blockMagic {
+		return 0, 0, false
+	}
+	return hdr[8], int64(binary.BigEndian.Uint32(hdr[12:16])), true
+}
+
+func decodeBlock(codec byte, size int64, data []byte) ([]byte, error) {
+	var out []byte
+	switch codec {
+	case codecNone:
+		out = data
+	case codecZlib:
+		r, err := zlib.NewReader(bytes.NewReader(data))
+		if err != nil {
+			return nil, err
+		}
+		defer r.Close()
+		out, err = ioutil.ReadAll(r)
+		if err != nil {
+			return nil, err
+		}
+	default:
+		return nil, fmt.Errorf("unknown block codec %d", codec)
+	}
+	if int64(len(out)) != size {
+		return nil, fmt.Errorf("block size is %d, expected %d", len(out), size)
+	}
+	return out, nil
+}
+
+// decodeWriter decodes a block while it's written to it. Unencoded blocks
+// are passed through to w, encoded blocks are decoded in Close().
+type decodeWriter struct {
+	w       io.Writer
+	hdr     []byte
+	decided bool
+	encoded bool
+	codec   byte
+	size    int64
+	buf     bytes.Buffer
+}
+
+func (d *decodeWriter) Write(p []byte) (int, error) {
+	n := len(p)
+	if !d.decided {
+		need := blockHeaderSize - len(d.hdr)
+		if len(p) < need {
+			d.hdr = append(d.hdr, p...)
+			return n, nil
+		}
+		d.hdr = append(d.hdr, p[:need]...)
+		p = p[need:]
+		d.decided = true
+		d.codec, d.size, d.encoded = parseBlockHeader(d.hdr)
+		if !d.encoded {
+			if _, err := d.w.Write(d.hdr); err != nil {
+				return 0, err
+			}
+		}
+	}
+	if d.encoded {
+		d.buf.Write(p)
+		return n, nil
+	}
+	if _, err := d.w.Write(p); err != nil {
+		return 0, err
+	}
+	return n, nil
+}
+
+func (d *decodeWriter) Close() error {
+	if !d.decided {
+		_, err := d.w.Write(d.hdr)
+		return err
+	}
+	if !d.encoded {
+		return nil
+	}
+	out, err := decodeBlock(d.codec, d.size, d.buf.Bytes())
+	if err != nil {
+		return err
+	}
+	_, err = d.w.Write(out)
+	return err
+}
+
+func (b *compressBackend) read(repoID string, objID string, w io.Writer) error {
+	d := &decodeWriter{w: w}
+	if err := b.base.read(repoID, objID, d); err != nil {
+		return err
+	}
+	return d.Close()
+}
+
+// open only returns the files of unencoded blocks.
+func (b *compressBackend) open(repoID string, objID string) (*os.File, error) {
+	fb, ok := b.base.(fileBackend)
+	if !ok {
+		return nil, errNoLocalFile
+	}
+	f, err := fb.open(repoID, objID)
+	if err != nil {
+		return nil, err
+	}
+	hdr := make([]byte, blockHeaderSize)
+	n, err := io.ReadFull(f, hdr)
+	if err != nil && err != io.EOF && err != io.ErrUnexpectedEOF {
+		f.Close()
+		return nil, err
+	}
+	if _, _, encoded := parseBlockHeader(hdr[:n]); encoded {
+		f.Close()
+		return nil, errNoLocalFile
+	}
+	if _, err := f.Seek(0, io.SeekStart); err != nil {
+		f.Close()
+		return nil, err
+	}
+	return f, nil
+}
+
+func (b *compressBackend) encode(data []byte) ([]byte, error) {
+	if b.codec == codecZlib && len(data) > 0 {
+		var buf bytes.Buffer
+		buf.Write(make([]byte, blockHeaderSize))
+		zw := zlib.NewWriter(&buf)
+		if _, err := zw.Write(data); err != nil {
+			return nil, err
+		}
+		if err := zw.Close(); err != nil {
+			return nil, err
+		}
+		if int64(buf.Len()) < int64(len(data))*9/10 {
+			out := buf.Bytes()
+			fillBlockHeader(out, codecZlib, len(data))
+			return out, nil
+		}
+	}
+	if len(data) >= len(blockMagic) && string(data[:len(blockMagic)]) == blockMagic {
+		out := make([]byte, blockHeaderSize+len(data))
+		fillBlockHeader(out, codecNone, len(data))
+		copy(out[blockHeaderSize:], data)
+		return out, nil
+	}
+	return data, nil
+}
+
+func fillBlockHeader(hdr []byte, codec byte, size int) {
+	copy(hdr, blockMagic)
+	hdr[8] = codec
+	hdr[9], hdr[10], hdr[11] = 0, 0, 0
+	binary.BigEndian.PutUint32(hdr[12:16], uint32(size))
+}
+
+func (b *compressBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	data, err := ioutil.ReadAll(r)
+	if err != nil {
+		return err
+	}
+	out, err := b.encode(data)
+	if err != nil {
+		return err
+	}
+	return b.base.write(repoID, objID, bytes.NewReader(out), sync)
+}
+
+func (b *compressBackend) exists(repoID string, objID string) (bool, error) {
+	return b.base.exists(repoID, objID)
+}
+
+func (b *compressBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	return b.base.existsMany(repoID, objIDs)
+}
+
+// stat returns the original size of a block.
+func (b *compressBackend) stat(repoID string, objID string) (int64, error) {
+	fb, ok := b.base.(fileBackend)
+	if !ok {
+		return b.statByReading(repoID, objID)
+	}
+	f, err := fb.open(repoID, objID)
+	if err == errNoLocalFile {
+		return b.statByReading(repoID, objID)
+	} else if err != nil {
+		return -1, err
+	}
+	defer f.Close()
+	hdr := make([]byte, blockHeaderSize)
+	n, _ := io.ReadFull(f, hdr)
+	if _, size, encoded := parseBlockHeader(hdr[:n]); encoded {
+		return size, nil
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		return -1, err
+	}
+	return fi.Size(), nil
+}
+
+func (b *compressBackend) refreshWriteTime(repoID string, objID string) error {
+	return refreshWriteTime(b.base, repoID, objID)
+}
+
+type countWriter struct {
+	n int64
+}
+
+func (c *countWriter) Write(p []byte) (int, error) {
+	c.n += int64(len(p))
+	return len(p), nil
+}
+
+func (b *compressBackend) statByReading(repoID string, objID string) (int64, error) {
+	var c countWriter
+	if err := b.read(repoID, objID, &c); err != nil {
+		return -1, err
+	}
+	return c.n, nil
+}
@@ -6,6 +6,9 @@ import (
 	"io/ioutil"
 	"os"
 	"path"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
 type fsBackend struct {
@@ -49,6 +52,11 @@ func (b *fsBackend) read(repoID string, objID string, w io.Writer) error {
 	return nil
 }
 
+func (b *fsBackend) open(repoID string, objID string) (*os.File, error) {
+	p := path.Join(b.objDir, repoID, objID[:2], objID[2:])
+	return os.Open(p)
+}
+
 func (b *fsBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
 	parentDir := path.Join(b.objDir, repoID, objID[:2])
 	p := path.Join(parentDir, objID[2:])
@@ -89,6 +97,41 @@ func (b *fsBackend) exists(repoID string, objID string) (bool, error) {
 	return true, nil
 }
 
+// existsManyWorkers limits the number of concurrent stat() calls of one existsMany call.
+const existsManyWorkers = 16
+
+func (b *fsBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	res := make([]bool, len(objIDs))
+	workers := len(objIDs) / 32
+	if workers > existsManyWorkers {
+		workers = existsManyWorkers
+	}
+	if workers <= 1 {
+		for i, objID := range objIDs {
+			res[i], _ = b.exists(repoID, objID)
+		}
+		return res, nil
+	}
+
+	var next int64 = -1
+	var wg sync.WaitGroup
+	wg.Add(workers)
+	for w := 0; w < workers; w++ {
+		go func() {
+			defer wg.Done()
+			for {
+				i := int(atomic.AddInt64(&next, 1))
+				if i >= len(objIDs) {
+					return
+				}
+				res[i], _ = b.exists(repoID, objIDs[i])
+			}
+		}()
+	}
+	wg.Wait()
+	return res, nil
+}
+
 func (b *fsBackend) stat(repoID string, objID string) (int64, error) {
 	path := path.Join(b.objDir, repoID, objID[:2], objID[2:])
 	fileInfo, err := os.Stat(path)
@@ -97,3 +140,9 @@ func (b *fsBackend) stat(repoID string, objID string) (int64, error) {
 	}
 	return fileInfo.Size(), nil
 }
+
+func (b *fsBackend) refreshWriteTime(repoID string, objID string) error {
+	path := path.Join(b.objDir, repoID, objID[:2], objID[2:])
+	now := time.Now()
+	return os.Chtimes(path, now, now)
+}
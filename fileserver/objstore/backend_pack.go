@@ -0,0 +1,471 @@
+// Implementation of pack file storage backend.
+// The on-disk format is shared with common/obj-backend-pack.c in seaf-server,
+// see there for a description of the layout. Compaction is only done by the
+// C implementation, during GC.
+package objstore
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sync"
+	"syscall"
+)
+
+const (
+	packObjMagic       = 0x5346504b
+	packObjHeaderSize  = 28
+	packIndexRecSize   = 40
+	packIndexFileName  = "index"
+	packRecordDeleted  = 1
+	defaultMaxPackSize = 64 << 20
+)
+
+type packEntry struct {
+	packID uint32
+	offset uint64
+	len    uint32
+}
+
+type packStore struct {
+	mu       sync.Mutex
+	dir      string
+	index    *os.File
+	indexIno uint64
+	// Bytes of the index log already replayed.
+	indexPos int64
+	entries  map[[20]byte]packEntry
+	curPack  uint32
+}
+
+type packBackend struct {
+	packDir     string
+	objType     string
+	maxPackSize int64
+
+	mu     sync.Mutex
+	stores map[string]*packStore
+}
+
+func newPackBackend(seafileDataDir string, objType string, maxPackSize int64) (*packBackend, error) {
+	packDir := filepath.Join(seafileDataDir, "storage", objType+"-packs")
+	err := os.MkdirAll(packDir, os.ModePerm)
+	if err != nil {
+		return nil, err
+	}
+	if maxPackSize <= 0 {
+		maxPackSize = defaultMaxPackSize
+	}
+	backend := new(packBackend)
+	backend.packDir = packDir
+	backend.objType = objType
+	backend.maxPackSize = maxPackSize
+	backend.stores = make(map[string]*packStore)
+	return backend, nil
+}
+
+func (b *packBackend) getStore(repoID string) *packStore {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	store, ok := b.stores[repoID]
+	if !ok {
+		store = &packStore{dir: filepath.Join(b.packDir, repoID)}
+		store.entries = make(map[[20]byte]packEntry)
+		b.stores[repoID] = store
+	}
+	return store
+}
+
+func parseObjID(objID string) ([20]byte, error) {
+	var sha1 [20]byte
+	raw, err := hex.DecodeString(objID)
+	if err != nil || len(raw) != 20 {
+		return sha1, fmt.Errorf("invalid object id %s", objID)
+	}
+	copy(sha1[:], raw)
+	return sha1, nil
+}
+
+func fileIno(fi os.FileInfo) uint64 {
+	if st, ok := fi.Sys().(*syscall.Stat_t); ok {
+		return uint64(st.Ino)
+	}
+	return 0
+}
+
+func (s *packStore) indexPath() string {
+	return filepath.Join(s.dir, packIndexFileName)
+}
+
+func (s *packStore) packPath(packID uint32) string {
+	return filepath.Join(s.dir, fmt.Sprintf("%08x.pack", packID))
+}
+
+func (s *packStore) reset() {
+	if s.index != nil {
+		s.index.Close()
+	}
+	s.index = nil
+	s.indexIno = 0
+	s.indexPos = 0
+	s.entries = make(map[[20]byte]packEntry)
+	s.curPack = 0
+}
+
+// openIndex opens the index file if it's not opened yet. If the index was
+// replaced by compaction, the in-memory index is dropped.
+// It returns false if the index doesn't exist and create is false.
+func (s *packStore) openIndex(create bool) (bool, error) {
+	if s.index != nil {
+		fi, err := os.Stat(s.indexPath())
+		if err == nil && fileIno(fi) == s.indexIno {
+			return true, nil
+		}
+		s.reset()
+	}
+
+	flags := os.O_RDWR
+	if create {
+		flags |= os.O_CREATE
+		if err := os.MkdirAll(s.dir, os.ModePerm); err != nil {
+			return false, err
+		}
+	}
+	f, err := os.OpenFile(s.indexPath(), flags, 0666)
+	if err != nil {
+		if os.IsNotExist(err) && !create {
+			return false, nil
+		}
+		return false, err
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return false, err
+	}
+	s.index = f
+	s.indexIno = fileIno(fi)
+	return true, nil
+}
+
+// lockIndex takes the exclusive lock for appending to the store.
+func (s *packStore) lockIndex() error {
+	for {
+		if _, err := s.openIndex(true); err != nil {
+			return err
+		}
+		if err := syscall.Flock(int(s.index.Fd()), syscall.LOCK_EX); err != nil {
+			return err
+		}
+		fi, err := os.Stat(s.indexPath())
+		if err == nil && fileIno(fi) == s.indexIno {
+			return nil
+		}
+		syscall.Flock(int(s.index.Fd()), syscall.LOCK_UN)
+		s.reset()
+	}
+}
+
+func (s *packStore) unlockIndex() {
+	if s.index != nil {
+		syscall.Flock(int(s.index.Fd()), syscall.LOCK_UN)
+	}
+}
+
+func (s *packStore) applyRecord(rec []byte) {
+	var sha1 [20]byte
+	copy(sha1[:], rec[:20])
+	flags := binary.BigEndian.Uint32(rec[36:40])
+	if flags&packRecordDeleted != 0 {
+		delete(s.entries, sha1)
+		return
+	}
+	entry := packEntry{
+		packID: binary.BigEndian.Uint32(rec[20:24]),
+		offset: binary.BigEndian.Uint64(rec[24:32]),
+		len:    binary.BigEndian.Uint32(rec[32:36]),
+	}
+	s.entries[sha1] = entry
+	if entry.packID > s.curPack {
+		s.curPack = entry.packID
+	}
+}
+
+// syncIndex replays index records appended since last time.
+func (s *packStore) syncIndex(locked bool) error {
+	if !locked {
+		ok, err := s.openIndex(false)
+		if !ok || err != nil {
+			return err
+		}
+		if err := syscall.Flock(int(s.index.Fd()), syscall.LOCK_SH); err != nil {
+			return err
+		}
+		defer syscall.Flock(int(s.index.Fd()), syscall.LOCK_UN)
+	}
+
+	fi, err := s.index.Stat()
+	if err != nil {
+		return err
+	}
+	// Ignore a partial record left by a crashed writer.
+	end := fi.Size() - fi.Size()%packIndexRecSize
+	if end <= s.indexPos {
+		return nil
+	}
+
+	buf := make([]byte, end-s.indexPos)
+	n, err := s.index.ReadAt(buf, s.indexPos)
+	if err != nil && err != io.EOF {
+		return err
+	}
+	n -= n % packIndexRecSize
+	for i := 0; i < n; i += packIndexRecSize {
+		s.applyRecord(buf[i : i+packIndexRecSize])
+	}
+	s.indexPos += int64(n)
+	return nil
+}
+
+// lookup finds an object, catching up with the index log on a miss.
+func (s *packStore) lookup(sha1 [20]byte) (packEntry, bool, error) {
+	entry, ok := s.entries[sha1]
+	if ok {
+		return entry, true, nil
+	}
+	if err := s.syncIndex(false); err != nil {
+		return entry, false, err
+	}
+	entry, ok = s.entries[sha1]
+	return entry, ok, nil
+}
+
+func (s *packStore) readEntry(entry packEntry) ([]byte, error) {
+	f, err := os.Open(s.packPath(entry.packID))
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	data := make([]byte, entry.len)
+	_, err = f.ReadAt(data, int64(entry.offset))
+	if err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// appendToPack must be called with the index lock held.
+func (s *packStore) appendToPack(maxPackSize int64, sha1 [20]byte, data []byte, sync bool) (uint32, uint64, error) {
+	packID := s.curPack
+	if packID == 0 {
+		packID = 1
+	}
+
+	f, err := os.OpenFile(s.packPath(packID), os.O_RDWR|os.O_CREATE, 0666)
+	if err != nil {
+		return 0, 0, err
+	}
+	size, err := f.Seek(0, io.SeekEnd)
+	if err == nil && size > 0 && size+int64(len(data)) > maxPackSize {
+		f.Close()
+		packID++
+		f, err = os.OpenFile(s.packPath(packID), os.O_RDWR|os.O_CREATE, 0666)
+		if err != nil {
+			return 0, 0, err
+		}
+		size, err = f.Seek(0, io.SeekEnd)
+	}
+	if err != nil {
+		f.Close()
+		return 0, 0, err
+	}
+
+	buf := make([]byte, packObjHeaderSize+len(data))
+	binary.BigEndian.PutUint32(buf[0:4], packObjMagic)
+	copy(buf[4:24], sha1[:])
+	binary.BigEndian.PutUint32(buf[24:28], uint32(len(data)))
+	copy(buf[packObjHeaderSize:], data)
+	if _, err := f.WriteAt(buf, size); err != nil {
+		f.Close()
+		return 0, 0, err
+	}
+	if sync {
+		if err := f.Sync(); err != nil {
+			f.Close()
+			return 0, 0, err
+		}
+	}
+	if err := f.Close(); err != nil {
+		return 0, 0, err
+	}
+	return packID, uint64(size) + packObjHeaderSize, nil
+}
+
+// appendRecord must be called with the index lock held.
+func (s *packStore) appendRecord(rec []byte, sync bool) error {
+	fi, err := s.index.Stat()
+	if err != nil {
+		return err
+	}
+	end := fi.Size() - fi.Size()%packIndexRecSize
+	if end != fi.Size() {
+		if err := s.index.Truncate(end); err != nil {
+			return err
+		}
+	}
+	if _, err := s.index.WriteAt(rec, end); err != nil {
+		return err
+	}
+	if sync {
+		if err := s.index.Sync(); err != nil {
+			return err
+		}
+	}
+	s.applyRecord(rec)
+	s.indexPos = end + packIndexRecSize
+	return nil
+}
+
+func (b *packBackend) readObj(repoID string, objID string) ([]byte, error) {
+	sha1, err := parseObjID(objID)
+	if err != nil {
+		return nil, err
+	}
+	s := b.getStore(repoID)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	entry, ok, err := s.lookup(sha1)
+	if err != nil {
+		return nil, err
+	}
+	if !ok {
+		return nil, os.ErrNotExist
+	}
+	data, err := s.readEntry(entry)
+	if err != nil && os.IsNotExist(err) {
+		// The pack was removed by compaction.
+		s.reset()
+		entry, ok, err = s.lookup(sha1)
+		if err != nil {
+			return nil, err
+		}
+		if !ok {
+			return nil, os.ErrNotExist
+		}
+		data, err = s.readEntry(entry)
+	}
+	return data, err
+}
+
+func (b *packBackend) read(repoID string, objID string, w io.Writer) error {
+	data, err := b.readObj(repoID, objID)
+	if err != nil {
+		return err
+	}
+	_, err = io.Copy(w, bytes.NewReader(data))
+	return err
+}
+
+func (b *packBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	sha1, err := parseObjID(objID)
+	if err != nil {
+		return err
+	}
+	data, err := ioutil.ReadAll(r)
+	if err != nil {
+		return err
+	}
+
+	s := b.getStore(repoID)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	if err := s.lockIndex(); err != nil {
+		return err
+	}
+	defer s.unlockIndex()
+
+	if err := s.syncIndex(true); err != nil {
+		return err
+	}
+	// Objects are content-addressed. Don't store duplicates.
+	if _, ok := s.entries[sha1]; ok {
+		return nil
+	}
+
+	packID, offset, err := s.appendToPack(b.maxPackSize, sha1, data, sync)
+	if err != nil {
+		return err
+	}
+
+	rec := make([]byte, packIndexRecSize)
+	copy(rec[:20], sha1[:])
+	binary.BigEndian.PutUint32(rec[20:24], packID)
+	binary.BigEndian.PutUint64(rec[24:32], offset)
+	binary.BigEndian.PutUint32(rec[32:36], uint32(len(data)))
+	return s.appendRecord(rec, sync)
+}
+
+func (b *packBackend) exists(repoID string, objID string) (bool, error) {
+	sha1, err := parseObjID(objID)
+	if err != nil {
+		return false, err
+	}
+	s := b.getStore(repoID)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	_, ok, err := s.lookup(sha1)
+	return ok, err
+}
+
+func (b *packBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	s := b.getStore(repoID)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	res := make([]bool, len(objIDs))
+	synced := false
+	for i, objID := range objIDs {
+		sha1, err := parseObjID(objID)
+		if err != nil {
+			continue
+		}
+		_, res[i] = s.entries[sha1]
+		// Catch up with the index once for the whole batch.
+		if !res[i] && !synced {
+			if err := s.syncIndex(false); err != nil {
+				return nil, err
+			}
+			synced = true
+			_, res[i] = s.entries[sha1]
+		}
+	}
+	return res, nil
+}
+
+func (b *packBackend) stat(repoID string, objID string) (int64, error) {
+	sha1, err := parseObjID(objID)
+	if err != nil {
+		return -1, err
+	}
+	s := b.getStore(repoID)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	entry, ok, err := s.lookup(sha1)
+	if err != nil {
+		return -1, err
+	}
+	if !ok {
+		return -1, os.ErrNotExist
+	}
+	return int64(entry.len), nil
+}
@@ -0,0 +1,175 @@
+// Logging of new objects for replication to a secondary backend.
+// The log format is the same as in common/repl-log.c in seaf-server, which
+// ships the logged objects to the secondary: each record is
+//
+//	ctime (4 bytes, big endian) | version (4) | repo id (36) | object id (40)
+//
+// Writers append under an exclusive flock on the log. The shipper renames
+// the log away once it's fully shipped, so writers reopen it when its inode
+// changes.
+package objstore
+
+import (
+	"encoding/binary"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"path/filepath"
+	"sync"
+	"syscall"
+	"time"
+)
+
+const replRecordSize = 84
+
+type replLog struct {
+	path string
+	lock sync.Mutex
+	file *os.File
+	ino  uint64
+}
+
+func newReplLog(seafileDataDir string, name string) *replLog {
+	return &replLog{path: filepath.Join(seafileDataDir, "storage", "replication", name+".log")}
+}
+
+func (l *replLog) reset() {
+	if l.file != nil {
+		l.file.Close()
+	}
+	l.file = nil
+	l.ino = 0
+}
+
+// lockFile opens the current log and takes the exclusive lock on it.
+func (l *replLog) lockFile() error {
+	for {
+		if l.file == nil {
+			if err := os.MkdirAll(filepath.Dir(l.path), os.ModePerm); err != nil {
+				return err
+			}
+			f, err := os.OpenFile(l.path, os.O_RDWR|os.O_CREATE, 0666)
+			if err != nil {
+				return err
+			}
+			fi, err := f.Stat()
+			if err != nil {
+				f.Close()
+				return err
+			}
+			l.file = f
+			l.ino = fileIno(fi)
+		}
+		if err := syscall.Flock(int(l.file.Fd()), syscall.LOCK_EX); err != nil {
+			return err
+		}
+		fi, err := os.Stat(l.path)
+		if err == nil && fileIno(fi) == l.ino {
+			return nil
+		}
+		syscall.Flock(int(l.file.Fd()), syscall.LOCK_UN)
+		l.reset()
+	}
+}
+
+func (l *replLog) append(repoID string, version uint32, objID string) error {
+	if len(repoID) != 36 || len(objID) != 40 {
+		return fmt.Errorf("invalid object %s:%s", repoID, objID)
+	}
+	rec := make([]byte, replRecordSize)
+	binary.BigEndian.PutUint32(rec[0:4], uint32(time.Now().Unix()))
+	binary.BigEndian.PutUint32(rec[4:8], version)
+	copy(rec[8:44], repoID)
+	copy(rec[44:84], objID)
+
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	if err := l.lockFile(); err != nil {
+		l.reset()
+		return err
+	}
+	defer syscall.Flock(int(l.file.Fd()), syscall.LOCK_UN)
+
+	fi, err := l.file.Stat()
+	if err != nil {
+		return err
+	}
+	// Overwrite a partial record left by a crashed writer.
+	end := fi.Size() - fi.Size()%replRecordSize
+	_, err = l.file.WriteAt(rec, end)
+	return err
+}
+
+type replBackend struct {
+	base      storageBackend
+	secondary storageBackend
+	log       *replLog
+}
+
+func newReplBackend(base storageBackend, secondary storageBackend, l *replLog) *replBackend {
+	return &replBackend{base: base, secondary: secondary, log: l}
+}
+
+// read reads objects missing from the primary from the secondary.
+func (b *replBackend) read(repoID string, objID string, w io.Writer) error {
+	err := b.base.read(repoID, objID, w)
+	if err == nil {
+		return nil
+	}
+	if exists, _ := b.base.exists(repoID, objID); exists {
+		return err
+	}
+	if err := b.secondary.read(repoID, objID, w); err != nil {
+		return err
+	}
+	log.Printf("read object %s:%s from the secondary", repoID, objID)
+	return nil
+}
+
+func (b *replBackend) open(repoID string, objID string) (*os.File, error) {
+	fb, ok := b.base.(fileBackend)
+	if !ok {
+		return nil, errNoLocalFile
+	}
+	f, err := fb.open(repoID, objID)
+	if os.IsNotExist(err) {
+		// Fall back to read(), which tries the secondary.
+		return nil, errNoLocalFile
+	}
+	return f, err
+}
+
+func (b *replBackend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	if err := b.base.write(repoID, objID, r, sync); err != nil {
+		return err
+	}
+	if err := b.log.append(repoID, 1, objID); err != nil {
+		log.Printf("failed to log object %s:%s for replication: %v", repoID, objID, err)
+	}
+	return nil
+}
+
+func (b *replBackend) exists(repoID string, objID string) (bool, error) {
+	return b.base.exists(repoID, objID)
+}
+
+func (b *replBackend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	return b.base.existsMany(repoID, objIDs)
+}
+
+func (b *replBackend) stat(repoID string, objID string) (int64, error) {
+	size, err := b.base.stat(repoID, objID)
+	if err == nil {
+		return size, nil
+	}
+	if exists, _ := b.base.exists(repoID, objID); exists {
+		return size, err
+	}
+	return b.secondary.stat(repoID, objID)
+}
+
+func (b *replBackend) refreshWriteTime(repoID string, objID string) error {
+	return refreshWriteTime(b.base, repoID, objID)
+}
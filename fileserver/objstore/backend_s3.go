@@ -0,0 +1,384 @@
+package objstore
+
+import (
+	"bytes"
+	"crypto/hmac"
+	"crypto/sha256"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net/http"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"gopkg.in/ini.v1"
+)
+
+// s3Backend stores objects in an S3 compatible bucket, named
+// <repo_id>/<obj_id>. It reads the same settings as the s3 backends of
+// the C server, see common/s3-client.h. Requests are signed with AWS
+// signature version 4 and sent over a pool of keep-alive connections, at
+// most maxInFlight at once. Objects larger than rangeSize are read with
+// parallel ranged GETs.
+type s3Backend struct {
+	conf   s3Config
+	client *http.Client
+	// Holds a token for every request in flight.
+	inFlight chan struct{}
+	now      func() time.Time
+}
+
+type s3Config struct {
+	bucket      string
+	keyID       string
+	key         string
+	host        string
+	region      string
+	useHTTPS    bool
+	pathStyle   bool
+	maxInFlight int
+	rangeSize   int64
+}
+
+const (
+	s3DefaultHost        = "s3.amazonaws.com"
+	s3DefaultRegion      = "us-east-1"
+	s3DefaultMaxInFlight = 32
+	s3DefaultRangeSizeMB = 1
+	s3MaxAttempts        = 3
+	s3RetryDelay         = 100 * time.Millisecond
+)
+
+// errS3NotFound is returned when an object doesn't exist.
+var errS3NotFound = fmt.Errorf("object not found")
+
+func loadS3Config(section *ini.Section) (*s3Config, error) {
+	conf := new(s3Config)
+	conf.bucket = section.Key("bucket").String()
+	conf.keyID = section.Key("key_id").String()
+	conf.key = section.Key("key").String()
+	if conf.bucket == "" || conf.keyID == "" || conf.key == "" {
+		return nil, fmt.Errorf("bucket, key_id and key must be set for the s3 backend")
+	}
+	conf.host = section.Key("host").String()
+	if conf.host == "" {
+		conf.host = s3DefaultHost
+	}
+	conf.region = section.Key("aws_region").String()
+	if conf.region == "" {
+		conf.region = s3DefaultRegion
+	}
+	conf.useHTTPS = true
+	if v, err := section.Key("use_https").Bool(); err == nil {
+		conf.useHTTPS = v
+	}
+	conf.pathStyle, _ = section.Key("path_style_request").Bool()
+	conf.maxInFlight, _ = section.Key("max_in_flight").Int()
+	if conf.maxInFlight <= 0 {
+		conf.maxInFlight = s3DefaultMaxInFlight
+	}
+	rangeSize, _ := section.Key("range_size").Int64()
+	if rangeSize <= 0 {
+		rangeSize = s3DefaultRangeSizeMB
+	}
+	conf.rangeSize = rangeSize << 20
+	return conf, nil
+}
+
+func newS3Backend(conf *s3Config) *s3Backend {
+	transport := &http.Transport{
+		Proxy:               http.ProxyFromEnvironment,
+		MaxIdleConns:        conf.maxInFlight,
+		MaxIdleConnsPerHost: conf.maxInFlight,
+		IdleConnTimeout:     90 * time.Second,
+	}
+	b := new(s3Backend)
+	b.conf = *conf
+	b.client = &http.Client{Transport: transport}
+	b.inFlight = make(chan struct{}, conf.maxInFlight)
+	b.now = time.Now
+	return b
+}
+
+type s3Response struct {
+	status int
+	header http.Header
+	body   []byte
+}
+
+func (b *s3Backend) url(key string) (host, path string) {
+	if b.conf.pathStyle {
+		return b.conf.host, "/" + b.conf.bucket + "/" + key
+	}
+	return b.conf.bucket + "." + b.conf.host, "/" + key
+}
+
+// do sends a request and reads the whole response. Network errors and 5xx
+// statuses are retried.
+func (b *s3Backend) do(method, key string, header http.Header, body []byte) (*s3Response, error) {
+	host, path := b.url(key)
+	scheme := "http"
+	if b.conf.useHTTPS {
+		scheme = "https"
+	}
+	sum := sha256.Sum256(body)
+	payloadHash := hex.EncodeToString(sum[:])
+
+	var err error
+	for attempt := 0; attempt < s3MaxAttempts; attempt++ {
+		if attempt > 0 {
+			time.Sleep(s3RetryDelay << uint(attempt-1))
+		}
+
+		var req *http.Request
+		req, err = http.NewRequest(method, scheme+"://"+host+path, bytes.NewReader(body))
+		if err != nil {
+			return nil, err
+		}
+		for k, v := range header {
+			req.Header[k] = v
+		}
+		b.sign(req, payloadHash, b.now())
+
+		b.inFlight <- struct{}{}
+		var rsp *s3Response
+		rsp, err = b.send(req)
+		<-b.inFlight
+		if err != nil {
+			continue
+		}
+		if rsp.status >= 500 {
+			err = fmt.Errorf("%s %s failed with status %d", method, path, rsp.status)
+			continue
+		}
+		return rsp, nil
+	}
+	return nil, err
+}
+
+func (b *s3Backend) send(req *http.Request) (*s3Response, error) {
+	rsp, err := b.client.Do(req)
+	if err != nil {
+		return nil, err
+	}
+	defer rsp.Body.Close()
+	data, err := ioutil.ReadAll(rsp.Body)
+	if err != nil {
+		return nil, err
+	}
+	return &s3Response{rsp.StatusCode, rsp.Header, data}, nil
+}
+
+func hmacSHA256(key []byte, data string) []byte {
+	h := hmac.New(sha256.New, key)
+	h.Write([]byte(data))
+	return h.Sum(nil)
+}
+
+// sign adds an AWS signature version 4 to req. The host, range, content-md5
+// and x-amz-* headers are signed.
+func (b *s3Backend) sign(req *http.Request, payloadHash string, t time.Time) {
+	amzDate := t.UTC().Format("20060102T150405Z")
+	date := amzDate[:8]
+	req.Header.Set("X-Amz-Date", amzDate)
+	req.Header.Set("X-Amz-Content-Sha256", payloadHash)
+
+	headers := map[string]string{"host": req.URL.Host}
+	for k, v := range req.Header {
+		name := strings.ToLower(k)
+		if name == "range" || name == "content-md5" || strings.HasPrefix(name, "x-amz-") {
+			headers[name] = strings.TrimSpace(v[0])
+		}
+	}
+	names := make([]string, 0, len(headers))
+	for name := range headers {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+
+	var canonicalHeaders strings.Builder
+	for _, name := range names {
+		canonicalHeaders.WriteString(name + ":" + headers[name] + "\n")
+	}
+	signedHeaders := strings.Join(names, ";")
+
+	canonical := strings.Join([]string{
+		req.Method,
+		req.URL.EscapedPath(),
+		req.URL.RawQuery,
+		canonicalHeaders.String(),
+		signedHeaders,
+		payloadHash,
+	}, "\n")
+	sum := sha256.Sum256([]byte(canonical))
+
+	scope := date + "/" + b.conf.region + "/s3/aws4_request"
+	toSign := "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n" + hex.EncodeToString(sum[:])
+
+	k := hmacSHA256([]byte("AWS4"+b.conf.key), date)
+	k = hmacSHA256(k, b.conf.region)
+	k = hmacSHA256(k, "s3")
+	k = hmacSHA256(k, "aws4_request")
+	signature := hex.EncodeToString(hmacSHA256(k, toSign))
+
+	req.Header.Set("Authorization", "AWS4-HMAC-SHA256 Credential="+b.conf.keyID+"/"+scope+
+		", SignedHeaders="+signedHeaders+", Signature="+signature)
+}
+
+func s3Key(repoID, objID string) string {
+	return repoID + "/" + objID
+}
+
+func (b *s3Backend) getRange(key string, start, end int64) (*s3Response, error) {
+	header := make(http.Header)
+	header.Set("Range", fmt.Sprintf("bytes=%d-%d", start, end))
+	return b.do("GET", key, header, nil)
+}
+
+// totalSize returns the object size in the Content-Range of a 206 response.
+func totalSize(rsp *s3Response) (int64, error) {
+	contentRange := rsp.header.Get("Content-Range")
+	pos := strings.LastIndex(contentRange, "/")
+	if pos < 0 {
+		return 0, fmt.Errorf("invalid Content-Range %q", contentRange)
+	}
+	return strconv.ParseInt(contentRange[pos+1:], 10, 64)
+}
+
+func (b *s3Backend) read(repoID string, objID string, w io.Writer) error {
+	key := s3Key(repoID, objID)
+	rangeSize := b.conf.rangeSize
+
+	rsp, err := b.getRange(key, 0, rangeSize-1)
+	if err != nil {
+		return err
+	}
+	switch rsp.status {
+	case http.StatusOK:
+		_, err := w.Write(rsp.body)
+		return err
+	case http.StatusRequestedRangeNotSatisfiable:
+		// Ranges of empty objects are not satisfiable.
+		return nil
+	case http.StatusNotFound:
+		return errS3NotFound
+	case http.StatusPartialContent:
+	default:
+		return fmt.Errorf("failed to get %s: status %d", key, rsp.status)
+	}
+
+	total, err := totalSize(rsp)
+	if err != nil {
+		return err
+	}
+	if total <= int64(len(rsp.body)) {
+		_, err := w.Write(rsp.body)
+		return err
+	}
+
+	buf := make([]byte, total)
+	copy(buf, rsp.body)
+	nRanges := int((total + rangeSize - 1) / rangeSize)
+	errs := make([]error, nRanges)
+	var wg sync.WaitGroup
+	for i := 1; i < nRanges; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			start := int64(i) * rangeSize
+			end := start + rangeSize
+			if end > total {
+				end = total
+			}
+			rsp, err := b.getRange(key, start, end-1)
+			if err != nil {
+				errs[i] = err
+			} else if rsp.status != http.StatusPartialContent || int64(len(rsp.body)) != end-start {
+				errs[i] = fmt.Errorf("failed to get range %d-%d of %s: status %d", start, end-1, key, rsp.status)
+			} else {
+				copy(buf[start:], rsp.body)
+			}
+		}(i)
+	}
+	wg.Wait()
+	for _, err := range errs {
+		if err != nil {
+			return err
+		}
+	}
+
+	_, err = w.Write(buf)
+	return err
+}
+
+func (b *s3Backend) write(repoID string, objID string, r io.Reader, sync bool) error {
+	data, err := ioutil.ReadAll(r)
+	if err != nil {
+		return err
+	}
+	key := s3Key(repoID, objID)
+	rsp, err := b.do("PUT", key, nil, data)
+	if err != nil {
+		return err
+	}
+	if rsp.status != http.StatusOK {
+		return fmt.Errorf("failed to put %s: status %d", key, rsp.status)
+	}
+	return nil
+}
+
+func (b *s3Backend) head(repoID string, objID string) (*s3Response, error) {
+	key := s3Key(repoID, objID)
+	rsp, err := b.do("HEAD", key, nil, nil)
+	if err != nil {
+		return nil, err
+	}
+	if rsp.status != http.StatusOK && rsp.status != http.StatusNotFound {
+		return nil, fmt.Errorf("failed to head %s: status %d", key, rsp.status)
+	}
+	return rsp, nil
+}
+
+func (b *s3Backend) exists(repoID string, objID string) (bool, error) {
+	rsp, err := b.head(repoID, objID)
+	if err != nil {
+		return false, err
+	}
+	return rsp.status == http.StatusOK, nil
+}
+
+// existsMany sends concurrent HEAD requests, since S3 has no batched check.
+func (b *s3Backend) existsMany(repoID string, objIDs []string) ([]bool, error) {
+	res := make([]bool, len(objIDs))
+	errs := make([]error, len(objIDs))
+	var wg sync.WaitGroup
+	for i, id := range objIDs {
+		wg.Add(1)
+		go func(i int, id string) {
+			defer wg.Done()
+			res[i], errs[i] = b.exists(repoID, id)
+		}(i, id)
+	}
+	wg.Wait()
+	for _, err := range errs {
+		if err != nil {
+			return nil, err
+		}
+	}
+	return res, nil
+}
+
+func (b *s3Backend) stat(repoID string, objID string) (int64, error) {
+	rsp, err := b.head(repoID, objID)
+	if err != nil {
+		return -1, err
+	}
+	if rsp.status == http.StatusNotFound {
+		return -1, errS3NotFound
+	}
+	return strconv.ParseInt(rsp.header.Get("Content-Length"), 10, 64)
+}
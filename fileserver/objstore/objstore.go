@@ -3,7 +3,14 @@
 package objstore
 
 import (
+	"bytes"
 	"io"
+	"log"
+	"os"
+	"path/filepath"
+
+	"github.com/haiwen/seafile-server/fileserver/clustercache"
+	"gopkg.in/ini.v1"
 )
 
 // ObjectStore is a container to access storage backend
@@ -22,19 +29,184 @@ type storageBackend interface {
 	write(repoID string, objID string, r io.Reader, sync bool) (err error)
 	// exists checks whether an object exists.
 	exists(repoID string, objID string) (res bool, err error)
+	// existsMany checks whether each of the objects exists.
+	existsMany(repoID string, objIDs []string) (res []bool, err error)
 	// stat calculates an object's size
 	stat(repoID string, objID string) (res int64, err error)
 }
 
+// fileBackend is implemented by backends that keep objects in local files.
+type fileBackend interface {
+	// open opens the file of an object for reading.
+	open(repoID string, objID string) (*os.File, error)
+}
+
+// writeTimeBackend is implemented by backends that keep the write time of
+// objects, which online GC checks before removing a block.
+type writeTimeBackend interface {
+	// refreshWriteTime sets the write time of an existing object to now.
+	refreshWriteTime(repoID string, objID string) error
+}
+
+func refreshWriteTime(b storageBackend, repoID string, objID string) error {
+	if t, ok := b.(writeTimeBackend); ok {
+		return t.refreshWriteTime(repoID, objID)
+	}
+	return nil
+}
+
+// ReadSeekCloser is the interface that groups the basic Read, Seek and Close methods.
+type ReadSeekCloser interface {
+	io.Reader
+	io.Seeker
+	io.Closer
+}
+
+type nopCloser struct {
+	*bytes.Reader
+}
+
+func (nopCloser) Close() error { return nil }
+
 // New returns a new object store for a given type of objects.
 // objType can be "commit", "fs", or "block".
 func New(seafileConfPath string, seafileDataDir string, objType string) *ObjectStore {
 	obj := new(ObjectStore)
 	obj.ObjType = objType
-	obj.backend, _ = newFSBackend(seafileDataDir, objType)
+	name, section := loadBackendConfig(seafileConfPath, objType)
+	obj.backend = newBaseBackend(name, section, seafileDataDir, objType)
+	obj.backend = loadReplication(seafileConfPath, seafileDataDir, objType, obj.backend)
+	if objType == "blocks" {
+		obj.backend = loadBlockCache(seafileConfPath, obj.backend)
+		obj.backend = loadBlockCompression(seafileConfPath, obj.backend)
+	} else if cache := clustercache.Load(seafileConfPath); cache != nil {
+		obj.backend = newClusterBackend(obj.backend, cache, objType)
+	}
 	return obj
 }
 
+func newBaseBackend(name string, section *ini.Section, seafileDataDir string, objType string) storageBackend {
+	switch name {
+	case "pack":
+		var maxPackSize int64
+		if size, err := section.Key("max_pack_size").Int64(); err == nil && size > 0 {
+			maxPackSize = size << 20
+		}
+		backend, _ := newPackBackend(seafileDataDir, objType, maxPackSize)
+		return backend
+	case "s3":
+		conf, err := loadS3Config(section)
+		if err != nil {
+			log.Printf("failed to set up s3 backend for %s: %v", objType, err)
+			backend, _ := newFSBackend(seafileDataDir, objType)
+			return backend
+		}
+		return newS3Backend(conf)
+	default:
+		backend, _ := newFSBackend(seafileDataDir, objType)
+		return backend
+	}
+}
+
+// loadReplication wraps the backend to log new objects for replication,
+// if there is a replica section for the object type in seafile.conf, e.g.
+// [block_backend_replica]. The logged objects are copied to the replica by
+// the C server, and read from it when they are missing here.
+func loadReplication(seafileConfPath string, seafileDataDir string, objType string, base storageBackend) storageBackend {
+	config, err := ini.Load(filepath.Join(seafileConfPath, "seafile.conf"))
+	if err != nil {
+		return base
+	}
+	section, err := config.GetSection(backendGroup(objType) + "_replica")
+	if err != nil {
+		return base
+	}
+	name := section.Key("name").String()
+	dataDir := section.Key("path").String()
+	if name != "s3" && dataDir == "" {
+		log.Printf("path is not set for the %s replica, objects are not replicated", objType)
+		return base
+	}
+	secondary := newBaseBackend(name, section, dataDir, objType)
+	return newReplBackend(base, secondary, newReplLog(seafileDataDir, objType))
+}
+
+// loadBlockCache wraps the block backend with a read cache on a local disk,
+// if cache_dir is set in the [block_backend] section of seafile.conf.
+func loadBlockCache(seafileConfPath string, base storageBackend) storageBackend {
+	config, err := ini.Load(filepath.Join(seafileConfPath, "seafile.conf"))
+	if err != nil {
+		return base
+	}
+	section, err := config.GetSection("block_backend")
+	if err != nil {
+		return base
+	}
+	cacheDir := section.Key("cache_dir").String()
+	if cacheDir == "" {
+		return base
+	}
+	cacheSize, _ := section.Key("cache_size").Int64()
+	fillThreads, _ := section.Key("cache_fill_threads").Int()
+
+	backend, err := newCacheBackend(base, cacheDir, cacheSize<<20, fillThreads)
+	if err != nil {
+		return base
+	}
+	return backend
+}
+
+// loadBlockCompression wraps the block backend to compress new blocks and
+// decode compressed ones, if compression is set in the [block_backend]
+// section of seafile.conf.
+func loadBlockCompression(seafileConfPath string, base storageBackend) storageBackend {
+	config, err := ini.Load(filepath.Join(seafileConfPath, "seafile.conf"))
+	if err != nil {
+		return base
+	}
+	section, err := config.GetSection("block_backend")
+	if err != nil {
+		return base
+	}
+	codec := section.Key("compression").String()
+	if codec == "" {
+		return base
+	}
+
+	backend, err := newCompressBackend(base, codec)
+	if err != nil {
+		log.Printf("failed to set up block compression: %v", err)
+		return base
+	}
+	return backend
+}
+
+// loadBackendConfig reads the [<type>_object_backend] section of seafile.conf,
+// which selects the backend for commit and fs objects, or the [block_backend]
+// section for blocks.
+func loadBackendConfig(seafileConfPath string, objType string) (string, *ini.Section) {
+	config, err := ini.Load(filepath.Join(seafileConfPath, "seafile.conf"))
+	if err != nil {
+		return "", nil
+	}
+	section, err := config.GetSection(backendGroup(objType))
+	if err != nil {
+		return "", nil
+	}
+	return section.Key("name").String(), section
+}
+
+// backendGroup returns the seafile.conf section configuring the objType backend.
+func backendGroup(objType string) string {
+	switch objType {
+	case "commits":
+		return "commit_object_backend"
+	case "blocks":
+		return "block_backend"
+	}
+	return objType + "_object_backend"
+}
+
 //Read data from storage backends.
 func (s *ObjectStore) Read(repoID string, objID string, w io.Writer) (err error) {
 	return s.backend.read(repoID, objID, w)
@@ -50,7 +222,37 @@ func (s *ObjectStore) Exists(repoID string, objID string) (res bool, err error)
 	return s.backend.exists(repoID, objID)
 }
 
+// Open returns a reader for an object, which must be closed after use.
+// For objects stored in local files the reader is an *os.File, so copying it
+// to a network connection with io.Copy can use sendfile. Objects in other
+// backends are read into memory.
+func (s *ObjectStore) Open(repoID string, objID string) (ReadSeekCloser, error) {
+	if b, ok := s.backend.(fileBackend); ok {
+		f, err := b.open(repoID, objID)
+		if err != errNoLocalFile {
+			return f, err
+		}
+	}
+	var buf bytes.Buffer
+	if err := s.backend.read(repoID, objID, &buf); err != nil {
+		return nil, err
+	}
+	return nopCloser{bytes.NewReader(buf.Bytes())}, nil
+}
+
+// ExistsMany checks the existence of many objects at once.
+// The result for objIDs[i] is stored in res[i].
+func (s *ObjectStore) ExistsMany(repoID string, objIDs []string) (res []bool, err error) {
+	return s.backend.existsMany(repoID, objIDs)
+}
+
 // Stat calculates object size.
 func (s *ObjectStore) Stat(repoID string, objID string) (res int64, err error) {
 	return s.backend.stat(repoID, objID)
 }
+
+// Touch sets the write time of an existing object to now, if the backend
+// keeps one. It fails if the object doesn't exist.
+func (s *ObjectStore) Touch(repoID string, objID string) error {
+	return refreshWriteTime(s.backend, repoID, objID)
+}
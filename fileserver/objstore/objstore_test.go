@@ -1,10 +1,16 @@
 package objstore
 
 import (
+	"bytes"
+	"encoding/binary"
 	"fmt"
+	"io/ioutil"
 	"os"
 	"path"
+	"path/filepath"
+	"strings"
 	"testing"
+	"time"
 )
 
 const (
@@ -103,3 +109,285 @@ func TestObjStore(t *testing.T) {
 	testRead(t)
 	testExists(t)
 }
+
+func TestPackBackend(t *testing.T) {
+	bend, err := newPackBackend(seafileDataDir, "fs", 1024)
+	if err != nil {
+		t.Fatalf("Failed to create pack backend: %v", err)
+	}
+
+	objs := make(map[string]string)
+	for i := 0; i < 50; i++ {
+		id := fmt.Sprintf("%040x", i+1)
+		objs[id] = fmt.Sprintf("object %d contents", i)
+		err := bend.write(repoID, id, strings.NewReader(objs[id]), true)
+		if err != nil {
+			t.Fatalf("Failed to write object %s: %v", id, err)
+		}
+	}
+
+	// A fresh backend must see the same objects by replaying the index.
+	other, _ := newPackBackend(seafileDataDir, "fs", 1024)
+	for id, contents := range objs {
+		var buf bytes.Buffer
+		if err := other.read(repoID, id, &buf); err != nil {
+			t.Fatalf("Failed to read object %s: %v", id, err)
+		}
+		if buf.String() != contents {
+			t.Errorf("Object %s has contents %q, expected %q", id, buf.String(), contents)
+		}
+		size, _ := other.stat(repoID, id)
+		if size != int64(len(contents)) {
+			t.Errorf("Object %s has size %d, expected %d", id, size, len(contents))
+		}
+	}
+
+	// Objects written by one backend become visible to the other.
+	newID := fmt.Sprintf("%040x", 1000)
+	bend.write(repoID, newID, strings.NewReader("new object"), false)
+	if ok, _ := other.exists(repoID, newID); !ok {
+		t.Errorf("Object %s written by another backend is not found", newID)
+	}
+
+	if ok, _ := other.exists(repoID, "ffffffffffffffffffffffffffffffffffffffff"); ok {
+		t.Errorf("Nonexistent object is found")
+	}
+
+	packs, _ := filepath.Glob(filepath.Join(seafileDataDir, "storage", "fs-packs", repoID, "*.pack"))
+	if len(packs) < 2 {
+		t.Errorf("Objects are not split into multiple packs, got %d packs", len(packs))
+	}
+}
+
+func TestCacheBackend(t *testing.T) {
+	base, err := newFSBackend(seafileDataDir, "blocks")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+	cacheDir := filepath.Join(seafileConfPath, "block-cache")
+	bend, err := newCacheBackend(base, cacheDir, 1<<20, 1)
+	if err != nil {
+		t.Fatalf("Failed to create cache backend: %v", err)
+	}
+
+	contents := "block contents"
+	if err := bend.write(repoID, objID, strings.NewReader(contents), false); err != nil {
+		t.Fatalf("Failed to write block: %v", err)
+	}
+	cachePath := bend.cachePath(repoID, objID)
+	if _, err := os.Stat(cachePath); err == nil {
+		t.Errorf("Written block is cached")
+	}
+
+	var buf bytes.Buffer
+	if err := bend.read(repoID, objID, &buf); err != nil || buf.String() != contents {
+		t.Fatalf("Failed to read block through cache: %v", err)
+	}
+
+	// The block is copied into the cache in the background.
+	for i := 0; i < 100; i++ {
+		if _, err := os.Stat(cachePath); err == nil {
+			break
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+	f, err := bend.open(repoID, objID)
+	if err != nil {
+		t.Fatalf("Failed to open block: %v", err)
+	}
+	defer f.Close()
+	if f.Name() != cachePath {
+		t.Errorf("Block is opened from %s instead of the cache", f.Name())
+	}
+
+	// Blocks beyond the size limit are evicted.
+	bend.touch(repoID, "ffffffffffffffffffffffffffffffffffffffff", 1<<20)
+	if _, err := os.Stat(cachePath); err == nil {
+		t.Errorf("Least recently used block is not evicted")
+	}
+}
+
+func TestExistsMany(t *testing.T) {
+	bend, err := newFSBackend(seafileDataDir, "fs")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+
+	var objIDs []string
+	for i := 0; i < 200; i++ {
+		id := fmt.Sprintf("%040x", i+1)
+		objIDs = append(objIDs, id)
+		if i%2 == 0 {
+			bend.write(repoID, id, strings.NewReader("obj"), false)
+		}
+	}
+
+	res, err := bend.existsMany(repoID, objIDs)
+	if err != nil {
+		t.Fatalf("Failed to check objects: %v", err)
+	}
+	for i := range objIDs {
+		if res[i] != (i%2 == 0) {
+			t.Errorf("Wrong result for object %s: %v", objIDs[i], res[i])
+		}
+	}
+}
+
+func TestCompressBackend(t *testing.T) {
+	base, err := newFSBackend(seafileDataDir, "blocks")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+	bend, err := newCompressBackend(base, "zlib")
+	if err != nil {
+		t.Fatalf("Failed to create compress backend: %v", err)
+	}
+
+	blocks := map[string]string{
+		"1000000000000000000000000000000000000001": strings.Repeat("compressible ", 1000),
+		"1000000000000000000000000000000000000002": "short",
+		"1000000000000000000000000000000000000003": blockMagic + "looks like a header",
+	}
+	for id, contents := range blocks {
+		if err := bend.write(repoID, id, strings.NewReader(contents), false); err != nil {
+			t.Fatalf("Failed to write block %s: %v", id, err)
+		}
+		var buf bytes.Buffer
+		if err := bend.read(repoID, id, &buf); err != nil || buf.String() != contents {
+			t.Errorf("Failed to read block %s: %v", id, err)
+		}
+		if size, err := bend.stat(repoID, id); err != nil || size != int64(len(contents)) {
+			t.Errorf("Block %s has size %d, expected %d", id, size, len(contents))
+		}
+	}
+
+	id := "1000000000000000000000000000000000000001"
+	if size, _ := base.stat(repoID, id); size >= int64(len(blocks[id])) {
+		t.Errorf("Block is not compressed, stored size is %d", size)
+	}
+	if _, err := bend.open(repoID, id); err != errNoLocalFile {
+		t.Errorf("Compressed block is opened as a file")
+	}
+	f, err := bend.open(repoID, "1000000000000000000000000000000000000002")
+	if err != nil {
+		t.Fatalf("Failed to open uncompressed block: %v", err)
+	}
+	f.Close()
+}
+
+func TestRefreshWriteTime(t *testing.T) {
+	base, err := newFSBackend(seafileDataDir, "blocks")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+	bend, err := newCompressBackend(base, "zlib")
+	if err != nil {
+		t.Fatalf("Failed to create compress backend: %v", err)
+	}
+	store := &ObjectStore{ObjType: "blocks", backend: bend}
+
+	id := "2000000000000000000000000000000000000001"
+	if err := store.Write(repoID, id, strings.NewReader("reused"), false); err != nil {
+		t.Fatalf("Failed to write block: %v", err)
+	}
+	p := path.Join(base.objDir, repoID, id[:2], id[2:])
+	old := time.Now().Add(-7 * 24 * time.Hour)
+	if err := os.Chtimes(p, old, old); err != nil {
+		t.Fatalf("Failed to set block mtime: %v", err)
+	}
+
+	if err := store.Touch(repoID, id); err != nil {
+		t.Fatalf("Failed to touch block: %v", err)
+	}
+	fi, err := os.Stat(p)
+	if err != nil || !fi.ModTime().After(old.Add(time.Hour)) {
+		t.Errorf("Touched block keeps its old write time")
+	}
+
+	if err := store.Touch(repoID, "2000000000000000000000000000000000000002"); err == nil {
+		t.Errorf("Missing block is touched")
+	}
+}
+
+func BenchmarkObjWrite(b *testing.B) {
+	bend := New(seafileConfPath, seafileDataDir, "fs")
+	data := make([]byte, 4096)
+	b.SetBytes(int64(len(data)))
+	for i := 0; i < b.N; i++ {
+		id := fmt.Sprintf("%040x", i%1000+1)
+		if err := bend.Write(repoID, id, bytes.NewReader(data), false); err != nil {
+			b.Fatalf("Failed to write object %s: %v", id, err)
+		}
+	}
+}
+
+func BenchmarkObjRead(b *testing.B) {
+	bend := New(seafileConfPath, seafileDataDir, "fs")
+	data := make([]byte, 4096)
+	for i := 0; i < 1000; i++ {
+		id := fmt.Sprintf("%040x", i+1)
+		if err := bend.Write(repoID, id, bytes.NewReader(data), false); err != nil {
+			b.Fatalf("Failed to write object %s: %v", id, err)
+		}
+	}
+	var buf bytes.Buffer
+	b.SetBytes(int64(len(data)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		id := fmt.Sprintf("%040x", i%1000+1)
+		buf.Reset()
+		if err := bend.Read(repoID, id, &buf); err != nil {
+			b.Fatalf("Failed to read object %s: %v", id, err)
+		}
+	}
+}
+
+func TestReplBackend(t *testing.T) {
+	base, err := newFSBackend(seafileDataDir, "commits")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+	secondary, err := newFSBackend(filepath.Join(seafileConfPath, "replica"), "commits")
+	if err != nil {
+		t.Fatalf("Failed to create fs backend: %v", err)
+	}
+	replLog := newReplLog(seafileDataDir, "commits")
+	bend := newReplBackend(base, secondary, replLog)
+
+	ids := []string{
+		"2000000000000000000000000000000000000001",
+		"2000000000000000000000000000000000000002",
+	}
+	for i, id := range ids {
+		if i == 1 {
+			// Writers reopen the log after the shipper renames it away.
+			if err := os.Rename(replLog.path, replLog.path+".old"); err != nil {
+				t.Fatalf("Failed to rename log: %v", err)
+			}
+		}
+		if err := bend.write(repoID, id, strings.NewReader("commit"), false); err != nil {
+			t.Fatalf("Failed to write object %s: %v", id, err)
+		}
+		data, err := ioutil.ReadFile(replLog.path)
+		if err != nil || len(data) != replRecordSize {
+			t.Fatalf("Log has %d bytes after writing object %s: %v", len(data), id, err)
+		}
+		if string(data[8:44]) != repoID || string(data[44:84]) != id ||
+			binary.BigEndian.Uint32(data[4:8]) != 1 {
+			t.Errorf("Wrong log record for object %s", id)
+		}
+	}
+
+	// Objects missing from the primary are read from the secondary.
+	missing := "2000000000000000000000000000000000000003"
+	if err := secondary.write(repoID, missing, strings.NewReader("replica"), false); err != nil {
+		t.Fatalf("Failed to write object to the secondary: %v", err)
+	}
+	var buf bytes.Buffer
+	if err := bend.read(repoID, missing, &buf); err != nil || buf.String() != "replica" {
+		t.Errorf("Failed to read object from the secondary: %v", err)
+	}
+	if size, err := bend.stat(repoID, missing); err != nil || size != int64(len("replica")) {
+		t.Errorf("Failed to stat object on the secondary: %v", err)
+	}
+}
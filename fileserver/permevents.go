@@ -0,0 +1,151 @@
+package main
+
+import (
+	"strings"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	"github.com/haiwen/seafile-server/fileserver/share"
+	log "github.com/sirupsen/logrus"
+)
+
+// seaf-server publishes an event when a share, a group membership or a repo
+// owner changes in a way that may revoke a permission. Since permCache only
+// holds granted permissions, dropping the matching entries on these events
+// keeps it from serving a revoked grant for the whole permExpireTime. When
+// the groups of a user change, an event drops the cached groups of the user
+// in the share package. These events, and the ones for new grants, also
+// drop the cached accessible repo lists. Head updates made by seaf-server
+// drop the cached repo objects of repomgr.
+//
+// Events are only seen by the file server of the node where the change was
+// made. Other nodes of a cluster rely on the expire time.
+
+const (
+	seafileServerChannelPerm = "seaf_server.perm"
+	permEventsPollInterval   = time.Second
+	// Events popped per rpc call, the most seaf-server returns.
+	permEventsBatchSize = 1000
+)
+
+func permEventsInit() {
+	ticker := time.NewTicker(permEventsPollInterval)
+	go RecoverWrapper(func() {
+		for range ticker.C {
+			popPermEvents()
+		}
+	})
+}
+
+func popPermEvents() {
+	for {
+		ret, err := rpcclient.Call("pop_events", seafileServerChannelPerm, permEventsBatchSize)
+		if err != nil {
+			log.Printf("Failed to pop permission events: %v", err)
+			return
+		}
+		events, ok := ret.([]interface{})
+		if !ok {
+			return
+		}
+		for _, event := range events {
+			msg, ok := event.(map[string]interface{})
+			if !ok {
+				continue
+			}
+			content, _ := msg["content"].(string)
+			handlePermEvent(content)
+		}
+		if len(events) < permEventsBatchSize {
+			return
+		}
+	}
+}
+
+func handlePermEvent(content string) {
+	if user, ok := parseGroupEvent(content); ok {
+		share.InvalidateUserGroups(user)
+		invalidateAccessibleRepos("", user)
+		return
+	}
+	if repoID, ok := parseRepoEvent(content); ok {
+		repomgr.Invalidate(repoID)
+		return
+	}
+	if _, user, ok := parseRepoListEvent(content); ok {
+		// The repo is new to the lists it gets into, so only
+		// the user selects the lists to drop.
+		invalidateAccessibleRepos("", user)
+		return
+	}
+	repoID, user, ok := parsePermEvent(content)
+	if !ok {
+		log.Printf("Invalid permission event: %s", content)
+		return
+	}
+	invalidatePerms(repoID, user)
+	invalidateAccessibleRepos(repoID, user)
+}
+
+// parsePermEvent parses "perm-change\t<repo id>\t<user>", where an empty
+// repo id or user matches any.
+func parsePermEvent(content string) (string, string, bool) {
+	parts := strings.Split(content, "\t")
+	if len(parts) != 3 || parts[0] != "perm-change" {
+		return "", "", false
+	}
+	return parts[1], parts[2], true
+}
+
+// parseRepoEvent parses "repo-change\t<repo id>", sent when seaf-server
+// moves the head or changes the virtual repo info of a repo.
+func parseRepoEvent(content string) (string, bool) {
+	parts := strings.Split(content, "\t")
+	if len(parts) != 2 || parts[0] != "repo-change" {
+		return "", false
+	}
+	return parts[1], true
+}
+
+// parseRepoListEvent parses "repo-list-change\t<repo id>\t<user>", sent
+// when repoID is shared to user, or to any user if it's empty, or gets a new
+// owner.
+func parseRepoListEvent(content string) (string, string, bool) {
+	parts := strings.Split(content, "\t")
+	if len(parts) != 3 || parts[0] != "repo-list-change" {
+		return "", "", false
+	}
+	return parts[1], parts[2], true
+}
+
+// parseGroupEvent parses "group-change\t<user>", sent when the groups of
+// user, or of any user if it's empty, change.
+func parseGroupEvent(content string) (string, bool) {
+	parts := strings.Split(content, "\t")
+	if len(parts) != 2 || parts[0] != "group-change" {
+		return "", false
+	}
+	return parts[1], true
+}
+
+// invalidatePerms drops the cached permissions of user on repoID. An empty
+// repoID or user matches any.
+func invalidatePerms(repoID, user string) {
+	permCache.Range(func(key interface{}, value interface{}) bool {
+		// Keys are "repo_id:user:op".
+		k := key.(string)
+		i := strings.Index(k, ":")
+		j := strings.LastIndex(k, ":")
+		if i < 0 || i == j {
+			return true
+		}
+		if repoID != "" && k[:i] != repoID {
+			return true
+		}
+		if user != "" && !strings.EqualFold(k[i+1:j], user) {
+			return true
+		}
+		permCache.Delete(key)
+		return true
+	})
+}
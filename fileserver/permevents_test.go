@@ -0,0 +1,71 @@
+package main
+
+import (
+	"fmt"
+	"testing"
+)
+
+func TestInvalidatePerms(t *testing.T) {
+	const repoA = "1a2b3c4d-1234-4321-abcd-0123456789ab"
+	const repoB = "2a2b3c4d-1234-4321-abcd-0123456789ab"
+	users := []string{"alice@example.com", "bob@example.com"}
+	ops := []string{"download", "upload"}
+	fill := func() {
+		for _, repoID := range []string{repoA, repoB} {
+			for _, user := range users {
+				for _, op := range ops {
+					permCache.Store(fmt.Sprintf("%s:%s:%s", repoID, user, op), &permInfo{})
+				}
+			}
+		}
+	}
+	count := func() int {
+		n := 0
+		permCache.Range(func(key, value interface{}) bool {
+			n++
+			return true
+		})
+		return n
+	}
+	defer invalidatePerms("", "")
+
+	cases := []struct {
+		event string
+		left  int
+	}{
+		{"perm-change\t" + repoA + "\tAlice@example.com", 6},
+		{"perm-change\t" + repoA + "\t", 4},
+		{"perm-change\t\tbob@example.com", 4},
+		{"perm-change\t\t", 0},
+	}
+	for _, c := range cases {
+		fill()
+		repoID, user, ok := parsePermEvent(c.event)
+		if !ok {
+			t.Fatalf("failed to parse %q", c.event)
+		}
+		invalidatePerms(repoID, user)
+		if n := count(); n != c.left {
+			t.Errorf("%q left %d entries, expected %d", c.event, n, c.left)
+		}
+		invalidatePerms("", "")
+	}
+
+	if _, _, ok := parsePermEvent("repo-update\t" + repoA); ok {
+		t.Errorf("parsed an event of another type")
+	}
+
+	if user, ok := parseGroupEvent("group-change\tbob@example.com"); !ok || user != "bob@example.com" {
+		t.Errorf("failed to parse group event")
+	}
+	if _, ok := parseGroupEvent("perm-change\t\t"); ok {
+		t.Errorf("parsed a permission event as group event")
+	}
+
+	if id, ok := parseRepoEvent("repo-change\t" + repoA); !ok || id != repoA {
+		t.Errorf("failed to parse repo event")
+	}
+	if _, ok := parseRepoEvent("group-change\t" + repoA); ok {
+		t.Errorf("parsed a group event as repo event")
+	}
+}
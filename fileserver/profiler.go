@@ -0,0 +1,239 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"net/url"
+	"os"
+	"path/filepath"
+	"runtime/pprof"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/gorilla/mux"
+	log "github.com/sirupsen/logrus"
+)
+
+// Continuous profiling takes a CPU profile of cpuDuration and a heap profile
+// every interval, and writes them to dir, keeping the newest keep files of
+// each kind, or posts them to uploadURL. Requests run with the pprof labels
+// route, op and repo_size, so CPU samples can be attributed to endpoints.
+// Go doesn't record labels in heap profiles; those are per process.
+type profilerOptions struct {
+	enabled     bool
+	dir         string
+	interval    time.Duration
+	cpuDuration time.Duration
+	keep        int
+	uploadURL   string
+}
+
+const (
+	defaultProfileInterval    = time.Minute
+	defaultProfileCPUDuration = 10 * time.Second
+	defaultProfilesKept       = 60
+
+	repoSizeClassTTL = 10 * time.Minute
+)
+
+// profileRequest runs h with the labels of the route. The op label is the
+// method until the handler knows better, see labelProfile.
+func profileRequest(name string, h http.Handler, w http.ResponseWriter, r *http.Request) {
+	labels := pprof.Labels("route", name, "op", r.Method, "repo_size", "unknown")
+	if repoID := repoIDFromVars(r); repoID != "" {
+		labels = pprof.Labels("route", name, "op", r.Method, "repo_size", repoSizeClass(repoID))
+	}
+	pprof.Do(r.Context(), labels, func(ctx context.Context) {
+		h.ServeHTTP(w, r.WithContext(ctx))
+	})
+}
+
+// labelProfile sets the operation and repo of an access token on the
+// samples taken for the rest of the request.
+func labelProfile(r *http.Request, op string, repoID string) {
+	if !options.profiler.enabled {
+		return
+	}
+	ctx := pprof.WithLabels(r.Context(), pprof.Labels("op", op, "repo_size", repoSizeClass(repoID)))
+	pprof.SetGoroutineLabels(ctx)
+}
+
+func repoIDFromVars(r *http.Request) string {
+	return mux.Vars(r)["repoid"]
+}
+
+type sizeClassEntry struct {
+	class  string
+	expire time.Time
+}
+
+var repoSizeClasses = struct {
+	sync.Mutex
+	entries map[string]*sizeClassEntry
+}{entries: make(map[string]*sizeClassEntry)}
+
+func sizeClassOf(size int64) string {
+	switch {
+	case size < 1<<30:
+		return "small"
+	case size < 100<<30:
+		return "medium"
+	default:
+		return "large"
+	}
+}
+
+// repoSizeClass never waits for the database: the size of a repo that
+// isn't cached is loaded in the background, and its samples are labelled
+// "unknown" until then.
+func repoSizeClass(repoID string) string {
+	now := time.Now()
+	repoSizeClasses.Lock()
+	entry := repoSizeClasses.entries[repoID]
+	if entry != nil && now.Before(entry.expire) {
+		class := entry.class
+		repoSizeClasses.Unlock()
+		return class
+	}
+	class := "unknown"
+	if entry != nil {
+		class = entry.class
+	}
+	repoSizeClasses.entries[repoID] = &sizeClassEntry{class, now.Add(repoSizeClassTTL)}
+	repoSizeClasses.Unlock()
+
+	go loadRepoSizeClass(repoID)
+	return class
+}
+
+func loadRepoSizeClass(repoID string) {
+	var size int64
+	if seafileDB == nil {
+		return
+	}
+	row := seafileDB.QueryRow("SELECT size FROM RepoSize WHERE repo_id = ?", repoID)
+	if err := row.Scan(&size); err != nil {
+		return
+	}
+	repoSizeClasses.Lock()
+	repoSizeClasses.entries[repoID] = &sizeClassEntry{sizeClassOf(size), time.Now().Add(repoSizeClassTTL)}
+	repoSizeClasses.Unlock()
+}
+
+func pruneRepoSizeClasses() {
+	now := time.Now()
+	repoSizeClasses.Lock()
+	for repoID, entry := range repoSizeClasses.entries {
+		if !now.Before(entry.expire) {
+			delete(repoSizeClasses.entries, repoID)
+		}
+	}
+	repoSizeClasses.Unlock()
+}
+
+func startContinuousProfiling() {
+	opts := options.profiler
+	if !opts.enabled {
+		return
+	}
+	if opts.uploadURL == "" {
+		if err := os.MkdirAll(opts.dir, 0755); err != nil {
+			log.Errorf("failed to create profile dir %s: %v", opts.dir, err)
+			return
+		}
+	}
+	log.Infof("continuous profiling every %v", opts.interval)
+	go func() {
+		ticker := time.NewTicker(opts.interval)
+		defer ticker.Stop()
+		for range ticker.C {
+			takeProfiles(&opts)
+			pruneRepoSizeClasses()
+		}
+	}()
+}
+
+func takeProfiles(opts *profilerOptions) {
+	now := time.Now()
+	var cpu bytes.Buffer
+	// Fails while a profile is taken through /debug/pprof/profile.
+	if err := pprof.StartCPUProfile(&cpu); err != nil {
+		log.Warnf("failed to start cpu profile: %v", err)
+	} else {
+		time.Sleep(opts.cpuDuration)
+		pprof.StopCPUProfile()
+		saveProfile(opts, "cpu", now, cpu.Bytes())
+	}
+
+	var heap bytes.Buffer
+	if err := pprof.Lookup("heap").WriteTo(&heap, 0); err != nil {
+		log.Warnf("failed to write heap profile: %v", err)
+		return
+	}
+	saveProfile(opts, "heap", now, heap.Bytes())
+}
+
+func saveProfile(opts *profilerOptions, kind string, t time.Time, data []byte) {
+	if opts.uploadURL != "" {
+		if err := uploadProfile(opts.uploadURL, kind, t, data); err != nil {
+			log.Warnf("failed to upload %s profile: %v", kind, err)
+		}
+		return
+	}
+
+	name := fmt.Sprintf("%s-%s.pb.gz", kind, t.UTC().Format("20060102T150405Z"))
+	tmp := filepath.Join(opts.dir, "."+name)
+	if err := ioutil.WriteFile(tmp, data, 0644); err != nil {
+		log.Warnf("failed to write %s profile: %v", kind, err)
+		os.Remove(tmp)
+		return
+	}
+	if err := os.Rename(tmp, filepath.Join(opts.dir, name)); err != nil {
+		log.Warnf("failed to write %s profile: %v", kind, err)
+		os.Remove(tmp)
+		return
+	}
+	rotateProfiles(opts.dir, kind, opts.keep)
+}
+
+// rotateProfiles removes all but the newest keep profiles of kind. The
+// names sort by time.
+func rotateProfiles(dir string, kind string, keep int) {
+	files, err := filepath.Glob(filepath.Join(dir, kind+"-*.pb.gz"))
+	if err != nil || len(files) <= keep {
+		return
+	}
+	sort.Strings(files)
+	for _, file := range files[:len(files)-keep] {
+		os.Remove(file)
+	}
+}
+
+var profileUploadClient = &http.Client{Timeout: 30 * time.Second}
+
+func uploadProfile(uploadURL string, kind string, t time.Time, data []byte) error {
+	host, _ := os.Hostname()
+	query := url.Values{}
+	query.Set("kind", kind)
+	query.Set("host", host)
+	query.Set("time", fmt.Sprintf("%d", t.Unix()))
+	sep := "?"
+	if strings.Contains(uploadURL, "?") {
+		sep = "&"
+	}
+	rsp, err := profileUploadClient.Post(uploadURL+sep+query.Encode(),
+		"application/octet-stream", bytes.NewReader(data))
+	if err != nil {
+		return err
+	}
+	rsp.Body.Close()
+	if rsp.StatusCode/100 != 2 {
+		return fmt.Errorf("collector returned %d", rsp.StatusCode)
+	}
+	return nil
+}
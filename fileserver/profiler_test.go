@@ -0,0 +1,69 @@
+package main
+
+import (
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"runtime/pprof"
+	"testing"
+	"time"
+
+	"github.com/gorilla/mux"
+)
+
+var farFuture = time.Now().Add(time.Hour)
+
+func TestRotateProfiles(t *testing.T) {
+	dir, err := ioutil.TempDir("", "profiles")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+
+	for i := 0; i < 5; i++ {
+		name := fmt.Sprintf("cpu-2024010%dT000000Z.pb.gz", i+1)
+		ioutil.WriteFile(filepath.Join(dir, name), nil, 0644)
+	}
+	ioutil.WriteFile(filepath.Join(dir, "heap-20240101T000000Z.pb.gz"), nil, 0644)
+
+	rotateProfiles(dir, "cpu", 2)
+
+	files, _ := filepath.Glob(filepath.Join(dir, "cpu-*"))
+	if len(files) != 2 || filepath.Base(files[0]) != "cpu-20240104T000000Z.pb.gz" {
+		t.Errorf("kept profiles %v", files)
+	}
+	if _, err := os.Stat(filepath.Join(dir, "heap-20240101T000000Z.pb.gz")); err != nil {
+		t.Errorf("heap profile was removed with the cpu profiles")
+	}
+}
+
+func TestProfileLabels(t *testing.T) {
+	saved := options.profiler.enabled
+	defer func() { options.profiler.enabled = saved }()
+	options.profiler.enabled = true
+
+	const repoID = "11111111-2222-3333-4444-555555555555"
+	repoSizeClasses.Lock()
+	repoSizeClasses.entries[repoID] = &sizeClassEntry{"large", farFuture}
+	repoSizeClasses.Unlock()
+
+	var route, op, size string
+	h := http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		route, _ = pprof.Label(r.Context(), "route")
+		op, _ = pprof.Label(r.Context(), "op")
+		size, _ = pprof.Label(r.Context(), "repo_size")
+	})
+	r := httptest.NewRequest("GET", "/repo/"+repoID+"/commit/HEAD", nil)
+	r = mux.SetURLVars(r, map[string]string{"repoid": repoID})
+	profileRequest("head-commit", h, httptest.NewRecorder(), r)
+	if route != "head-commit" || op != "GET" || size != "large" {
+		t.Errorf("request labelled route=%s op=%s repo_size=%s", route, op, size)
+	}
+
+	if sizeClassOf(1<<20) != "small" || sizeClassOf(1<<40) != "large" {
+		t.Errorf("wrong size classes")
+	}
+}
@@ -3,8 +3,10 @@ package main
 import (
 	"database/sql"
 	"fmt"
+	"time"
 
 	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	log "github.com/sirupsen/logrus"
 )
 
 // InfiniteQuota indicates that the quota is unlimited.
@@ -76,7 +78,62 @@ func getUserQuota(user string) (int64, error) {
 	return quota, nil
 }
 
+// The usage of users is cached in the UserUsage table, shared with
+// seaf-server. The cached usage is updated with the size changes of repos, in
+// the same transaction as RepoSize, and recomputed when it's older than
+// usage_reconcile_interval seconds, to correct drift from ownership changes.
+
+// addUsage adds the size change of the repo to the cached usage of its owner
+// and org.
+func addUsage(trans *sql.Tx, repoID string, delta int64) error {
+	if delta == 0 {
+		return nil
+	}
+
+	// Virtual repos don't count in the usage of their owners.
+	sqlStr := "UPDATE UserUsage SET size = size + ? WHERE user IN " +
+		"(SELECT o.owner_id FROM RepoOwner o LEFT JOIN VirtualRepo v " +
+		"ON o.repo_id = v.repo_id WHERE o.repo_id = ? AND v.repo_id IS NULL)"
+	if _, err := trans.Exec(sqlStr, delta, repoID); err != nil {
+		return err
+	}
+
+	sqlStr = "UPDATE OrgUsage SET size = size + ? WHERE org_id IN " +
+		"(SELECT org_id FROM OrgRepo WHERE repo_id = ?)"
+	if _, err := trans.Exec(sqlStr, delta, repoID); err != nil {
+		return err
+	}
+
+	return nil
+}
+
 func getUserUsage(user string) (int64, error) {
+	var cachedSize, updateTime int64
+	now := time.Now().Unix()
+	sqlStr := "SELECT size, update_time FROM UserUsage WHERE user=?"
+	row := seafileDB.QueryRow(sqlStr, user)
+	if err := row.Scan(&cachedSize, &updateTime); err == nil {
+		if now-updateTime < options.usageReconcileInterval {
+			return cachedSize, nil
+		}
+	} else if err != sql.ErrNoRows {
+		return -1, err
+	}
+
+	usage, err := sumUserUsage(user)
+	if err != nil {
+		return -1, err
+	}
+
+	sqlStr = "REPLACE INTO UserUsage (user, size, update_time) VALUES (?, ?, ?)"
+	if _, err := seafileDB.Exec(sqlStr, user, usage, now); err != nil {
+		log.Printf("failed to cache usage of user %s: %v", user, err)
+	}
+
+	return usage, nil
+}
+
+func sumUserUsage(user string) (int64, error) {
 	var usage sql.NullInt64
 	sqlStr := "SELECT SUM(size) FROM " +
 		"RepoOwner o LEFT JOIN VirtualRepo v ON o.repo_id=v.repo_id, " +
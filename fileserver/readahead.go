@@ -0,0 +1,147 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"io"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	log "github.com/sirupsen/logrus"
+)
+
+// With download_read_ahead set, the next blocks of a downloaded file are
+// read, and decrypted, while the current one is being sent, so that the
+// stream doesn't stall at every block boundary when the block backend has a
+// high latency. Blocks read ahead by all downloads are limited to
+// maxReadAheadBlocks. Beyond that, blocks are read when they're sent.
+
+const maxReadAheadBlocks = 32
+
+var readAheadSlots = make(chan struct{}, maxReadAheadBlocks)
+
+type aheadBlock struct {
+	id   string
+	data []byte
+	err  error
+	// Whether the block holds a read-ahead slot.
+	slot bool
+}
+
+func (blk *aheadBlock) release() {
+	blk.data = nil
+	if blk.slot {
+		blk.slot = false
+		<-readAheadSlots
+	}
+}
+
+// readBlock reads a whole block, decrypted if cryptKey is set.
+func readBlock(storeID, blkID string, cryptKey *seafileCrypt) ([]byte, error) {
+	var buf bytes.Buffer
+	if err := blockmgr.Read(storeID, blkID, &buf); err != nil {
+		return nil, err
+	}
+	if cryptKey == nil {
+		return buf.Bytes(), nil
+	}
+	return cryptKey.decryptInPlace(buf.Bytes())
+}
+
+// blockList is the block ids of a file, see fsmgr.Seafile.BlockID.
+type blockList interface {
+	NumBlocks() int
+	BlockID(i int) string
+}
+
+// blockIDList is a blockList held as strings.
+type blockIDList []string
+
+func (l blockIDList) NumBlocks() int       { return len(l) }
+func (l blockIDList) BlockID(i int) string { return l[i] }
+
+// readBlocksAhead returns the blocks in order. Up to depth of them are
+// read in the background ahead of the one taken by the caller, who must
+// release every block. Blocks are no longer read once ctx is done.
+func readBlocksAhead(ctx context.Context, storeID string, blocks blockList, depth int, cryptKey *seafileCrypt) <-chan *aheadBlock {
+	out := make(chan *aheadBlock)
+	pending := make(chan chan *aheadBlock, depth)
+
+	go func() {
+		defer close(pending)
+		for i := 0; i < blocks.NumBlocks(); i++ {
+			blkID := blocks.BlockID(i)
+			ch := make(chan *aheadBlock, 1)
+			select {
+			case pending <- ch:
+			case <-ctx.Done():
+				return
+			}
+
+			select {
+			case readAheadSlots <- struct{}{}:
+				go func(blkID string) {
+					data, err := readBlock(storeID, blkID, cryptKey)
+					ch <- &aheadBlock{blkID, data, err, true}
+				}(blkID)
+			default:
+				// Out of slots, leave the block to the sender.
+				ch <- &aheadBlock{id: blkID}
+			}
+		}
+	}()
+
+	go func() {
+		defer close(out)
+		for ch := range pending {
+			blk := <-ch
+			if !blk.slot {
+				blk.data, blk.err = readBlock(storeID, blk.id, cryptKey)
+			}
+			select {
+			case out <- blk:
+			case <-ctx.Done():
+				blk.release()
+				// Release the blocks read meanwhile.
+				for ch := range pending {
+					blk := <-ch
+					blk.release()
+				}
+				return
+			}
+		}
+	}()
+
+	return out
+}
+
+// sendBlocksAhead writes the blocks to w, reading them ahead. It returns
+// false if a block couldn't be read or written.
+func sendBlocksAhead(ctx context.Context, w io.Writer, storeID string, blkIDs blockList, cryptKey *seafileCrypt) bool {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+
+	blocks := readBlocksAhead(ctx, storeID, blkIDs, options.downloadReadAhead, cryptKey)
+	ok := true
+	for blk := range blocks {
+		if ok && blk.err != nil {
+			log.Printf("failed to read block %s: %v", blk.id, blk.err)
+			ok = false
+		}
+		if ok && chargeBlock(w) != nil {
+			ok = false
+		}
+		if ok {
+			if _, err := w.Write(blk.data); err != nil {
+				if !isNetworkErr(err) {
+					log.Printf("failed to write block %s to response: %v", blk.id, err)
+				}
+				ok = false
+			}
+		}
+		blk.release()
+		if !ok {
+			cancel()
+		}
+	}
+	return ok
+}
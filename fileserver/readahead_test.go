@@ -0,0 +1,73 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+)
+
+const readAheadTestRepoID = "5d6e7f80-1234-4321-abcd-0123456789ab"
+
+func TestSendBlocksAhead(t *testing.T) {
+	dir, err := ioutil.TempDir("", "readahead")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	var blkIDs []string
+	var expected bytes.Buffer
+	for i := 0; i < 5; i++ {
+		blkID := strings.Repeat(string(rune('a'+i)), 40)
+		content := strings.Repeat(string(rune('0'+i)), 1000+i)
+		if err := blockmgr.Write(readAheadTestRepoID, blkID, strings.NewReader(content)); err != nil {
+			t.Fatalf("failed to write block: %v", err)
+		}
+		blkIDs = append(blkIDs, blkID)
+		expected.WriteString(content)
+	}
+
+	options.downloadReadAhead = 2
+	defer func() { options.downloadReadAhead = 0 }()
+
+	var buf bytes.Buffer
+	if !sendBlocksAhead(context.Background(), &buf, readAheadTestRepoID, blockIDList(blkIDs), nil) {
+		t.Fatalf("failed to send blocks")
+	}
+	if !bytes.Equal(buf.Bytes(), expected.Bytes()) {
+		t.Errorf("sent blocks don't match the file")
+	}
+
+	// A missing block stops the download.
+	missing := append([]string{}, blkIDs[:2]...)
+	missing = append(missing, strings.Repeat("f", 40))
+	missing = append(missing, blkIDs[2:]...)
+	buf.Reset()
+	if sendBlocksAhead(context.Background(), &buf, readAheadTestRepoID, blockIDList(missing), nil) {
+		t.Errorf("sent a block that doesn't exist")
+	}
+
+	// Leaving early releases the blocks read ahead.
+	ctx, cancel := context.WithCancel(context.Background())
+	blocks := readBlocksAhead(ctx, readAheadTestRepoID, blockIDList(blkIDs), 2, nil)
+	blk := <-blocks
+	if blk.id != blkIDs[0] {
+		t.Errorf("got block %s first, expected %s", blk.id, blkIDs[0])
+	}
+	blk.release()
+	cancel()
+	for blk := range blocks {
+		blk.release()
+	}
+
+	if n := len(readAheadSlots); n != 0 {
+		t.Errorf("%d read-ahead slots are still taken", n)
+	}
+}
@@ -0,0 +1,92 @@
+package repomgr
+
+import (
+	"sync"
+	"time"
+)
+
+// A request resolves its repo several times, for permission, store id and
+// quota checks, and each Get queries the Repo, Branch and VirtualRepo tables.
+// Loaded repos are cached for cacheTTL and handed out as copies.
+//
+// Head updates and virtual repo changes made by the file server drop the
+// cached repo through Invalidate, and so do a failed head update, so that a
+// retried commit sees the current head. Changes made by seaf-server arrive
+// as repo-change events. Other cluster nodes rely on the ttl.
+
+const (
+	defaultCacheTTL = 10 * time.Second
+	maxCachedRepos  = 100000
+)
+
+type cachedRepo struct {
+	repo       *Repo
+	expireTime time.Time
+}
+
+var repoCache = struct {
+	sync.Mutex
+	repos map[string]*cachedRepo
+	// gen is bumped by invalidations, so that a repo loaded before one
+	// isn't cached after it.
+	gen uint64
+	ttl time.Duration
+}{repos: make(map[string]*cachedRepo), ttl: defaultCacheTTL}
+
+// SetCacheTTL sets how long a loaded repo is cached. 0 disables the cache.
+func SetCacheTTL(ttl time.Duration) {
+	repoCache.Lock()
+	repoCache.ttl = ttl
+	repoCache.repos = make(map[string]*cachedRepo)
+	repoCache.Unlock()
+}
+
+func copyRepo(repo *Repo) *Repo {
+	r := *repo
+	if repo.VirtualInfo != nil {
+		info := *repo.VirtualInfo
+		r.VirtualInfo = &info
+	}
+	return &r
+}
+
+// getCachedRepo returns a copy of the cached repo, or nil and the cache
+// generation to pass to cacheRepo.
+func getCachedRepo(id string) (*Repo, uint64) {
+	repoCache.Lock()
+	defer repoCache.Unlock()
+
+	if c, ok := repoCache.repos[id]; ok {
+		if time.Now().Before(c.expireTime) {
+			return copyRepo(c.repo), repoCache.gen
+		}
+		delete(repoCache.repos, id)
+	}
+	return nil, repoCache.gen
+}
+
+func cacheRepo(repo *Repo, gen uint64) {
+	if repo.IsCorrupted {
+		return
+	}
+	cached := &cachedRepo{copyRepo(repo), time.Time{}}
+
+	repoCache.Lock()
+	defer repoCache.Unlock()
+	if repoCache.ttl <= 0 || repoCache.gen != gen {
+		return
+	}
+	if len(repoCache.repos) >= maxCachedRepos {
+		repoCache.repos = make(map[string]*cachedRepo)
+	}
+	cached.expireTime = time.Now().Add(repoCache.ttl)
+	repoCache.repos[repo.ID] = cached
+}
+
+// Invalidate drops the cached repo of id.
+func Invalidate(id string) {
+	repoCache.Lock()
+	repoCache.gen++
+	delete(repoCache.repos, id)
+	repoCache.Unlock()
+}
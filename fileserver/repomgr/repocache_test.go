@@ -0,0 +1,50 @@
+package repomgr
+
+import (
+	"testing"
+	"time"
+)
+
+func TestRepoCache(t *testing.T) {
+	const id = "1a2b3c4d-1234-4321-abcd-0123456789ab"
+	defer SetCacheTTL(defaultCacheTTL)
+	SetCacheTTL(time.Minute)
+
+	_, gen := getCachedRepo(id)
+	cacheRepo(&Repo{ID: id, HeadCommitID: "a", VirtualInfo: &VRepoInfo{Path: "/a"}}, gen)
+
+	repo, _ := getCachedRepo(id)
+	if repo == nil || repo.HeadCommitID != "a" {
+		t.Fatalf("repo was not cached")
+	}
+	repo.HeadCommitID = "b"
+	repo.VirtualInfo.Path = "/b"
+	repo, _ = getCachedRepo(id)
+	if repo.HeadCommitID != "a" || repo.VirtualInfo.Path != "/a" {
+		t.Errorf("cached repo was changed by the caller")
+	}
+
+	// A repo loaded before an invalidation isn't cached.
+	_, gen = getCachedRepo(id)
+	Invalidate(id)
+	if repo, _ := getCachedRepo(id); repo != nil {
+		t.Errorf("invalidated repo is still cached")
+	}
+	cacheRepo(&Repo{ID: id, HeadCommitID: "a"}, gen)
+	if repo, _ := getCachedRepo(id); repo != nil {
+		t.Errorf("stale repo was cached after an invalidation")
+	}
+
+	_, gen = getCachedRepo(id)
+	cacheRepo(&Repo{ID: id, IsCorrupted: true}, gen)
+	if repo, _ := getCachedRepo(id); repo != nil {
+		t.Errorf("corrupted repo was cached")
+	}
+
+	SetCacheTTL(0)
+	_, gen = getCachedRepo(id)
+	cacheRepo(&Repo{ID: id, HeadCommitID: "a"}, gen)
+	if repo, _ := getCachedRepo(id); repo != nil {
+		t.Errorf("repo was cached with the cache disabled")
+	}
+}
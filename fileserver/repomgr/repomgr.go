@@ -62,9 +62,22 @@ func Init(seafDB *sql.DB) {
 
 // Get returns Repo object by repo ID.
 func Get(id string) *Repo {
-	query := `SELECT r.repo_id, b.commit_id, v.origin_repo, v.path, v.base_commit FROM ` +
+	repo, gen := getCachedRepo(id)
+	if repo != nil {
+		return repo
+	}
+	repo = loadRepo(id)
+	if repo != nil {
+		cacheRepo(repo, gen)
+	}
+	return repo
+}
+
+func loadRepo(id string) *Repo {
+	query := `SELECT r.repo_id, b.commit_id, v.origin_repo, v.path, v.base_commit, f.store_id FROM ` +
 		`Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id ` +
 		`LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id ` +
+		`LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) ` +
 		`WHERE r.repo_id = ? AND b.name = 'master'`
 
 	stmt, err := seafileDB.Prepare(query)
@@ -86,8 +99,9 @@ func Get(id string) *Repo {
 	var originRepoID sql.NullString
 	var path sql.NullString
 	var baseCommitID sql.NullString
+	var forkStoreID sql.NullString
 	if rows.Next() {
-		err := rows.Scan(&repo.ID, &repo.HeadCommitID, &originRepoID, &path, &baseCommitID)
+		err := rows.Scan(&repo.ID, &repo.HeadCommitID, &originRepoID, &path, &baseCommitID, &forkStoreID)
 		if err != nil {
 			log.Printf("failed to scan sql rows : %v", err)
 			return nil
@@ -116,6 +130,10 @@ func Get(id string) *Repo {
 	} else {
 		repo.StoreID = repo.ID
 	}
+	// Forks, and virtual repos of forks, use the store of the forked repo.
+	if forkStoreID.Valid {
+		repo.StoreID = forkStoreID.String
+	}
 
 	commit, err := commitmgr.Load(repo.ID, repo.HeadCommitID)
 	if err != nil {
@@ -174,9 +192,22 @@ func RepoToCommit(repo *Repo, commit *commitmgr.Commit) {
 
 // GetEx return repo object even if it's corrupted.
 func GetEx(id string) *Repo {
-	query := `SELECT r.repo_id, b.commit_id, v.origin_repo, v.path, v.base_commit FROM ` +
+	repo, gen := getCachedRepo(id)
+	if repo != nil {
+		return repo
+	}
+	repo = loadRepoEx(id)
+	if repo != nil {
+		cacheRepo(repo, gen)
+	}
+	return repo
+}
+
+func loadRepoEx(id string) *Repo {
+	query := `SELECT r.repo_id, b.commit_id, v.origin_repo, v.path, v.base_commit, f.store_id FROM ` +
 		`Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id ` +
 		`LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id ` +
+		`LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) ` +
 		`WHERE r.repo_id = ? AND b.name = 'master'`
 
 	stmt, err := seafileDB.Prepare(query)
@@ -198,8 +229,9 @@ func GetEx(id string) *Repo {
 	var originRepoID sql.NullString
 	var path sql.NullString
 	var baseCommitID sql.NullString
+	var forkStoreID sql.NullString
 	if rows.Next() {
-		err := rows.Scan(&repo.ID, &repo.HeadCommitID, &originRepoID, &path, &baseCommitID)
+		err := rows.Scan(&repo.ID, &repo.HeadCommitID, &originRepoID, &path, &baseCommitID, &forkStoreID)
 		if err != nil {
 			log.Printf("failed to scan sql rows : %v", err)
 			return nil
@@ -222,6 +254,10 @@ func GetEx(id string) *Repo {
 	} else {
 		repo.StoreID = repo.ID
 	}
+	// Forks, and virtual repos of forks, use the store of the forked repo.
+	if forkStoreID.Valid {
+		repo.StoreID = forkStoreID.String
+	}
 
 	if repo.HeadCommitID == "" {
 		repo.IsCorrupted = true
@@ -236,6 +272,7 @@ func GetEx(id string) *Repo {
 	}
 
 	repo.Name = commit.RepoName
+	repo.Desc = commit.RepoDesc
 	repo.LastModifier = commit.CreatorName
 	repo.LastModificationTime = commit.Ctime
 	repo.RootID = commit.RootID
@@ -285,7 +322,7 @@ func GetVirtualRepoInfoByOrigin(originRepo string) ([]*VRepoInfo, error) {
 	defer row.Close()
 	for row.Next() {
 		vRepoInfo := new(VRepoInfo)
-		if err := row.Scan(&vRepoInfo.OriginRepoID, &vRepoInfo.Path, &vRepoInfo.BaseCommitID); err != nil {
+		if err := row.Scan(&vRepoInfo.RepoID, &vRepoInfo.OriginRepoID, &vRepoInfo.Path, &vRepoInfo.BaseCommitID); err != nil {
 			if err != sql.ErrNoRows {
 				return nil, err
 			}
@@ -469,6 +506,7 @@ func SetVirtualRepoBaseCommitPath(repoID, baseCommitID, newPath string) error {
 	if _, err := seafileDB.Exec(sqlStr, baseCommitID, newPath, repoID); err != nil {
 		return err
 	}
+	Invalidate(repoID)
 	return nil
 }
 
@@ -507,6 +545,7 @@ func DelVirtualRepo(repoID string, cloudMode bool) error {
 	if err != nil {
 		return err
 	}
+	Invalidate(repoID)
 
 	return nil
 }
@@ -542,6 +581,18 @@ func removeVirtualRepoOndisk(repoID string, cloudMode bool) error {
 		}
 	}
 
+	// Drop the cached usage of the owner and org, see quota.go.
+	sqlStr = "DELETE FROM UserUsage WHERE user IN (SELECT owner_id FROM RepoOwner WHERE repo_id = ?)"
+	_, err = seafileDB.Exec(sqlStr, repoID)
+	if err != nil {
+		return err
+	}
+	sqlStr = "DELETE FROM OrgUsage WHERE org_id IN (SELECT org_id FROM OrgRepo WHERE repo_id = ?)"
+	_, err = seafileDB.Exec(sqlStr, repoID)
+	if err != nil {
+		return err
+	}
+
 	sqlStr = "DELETE FROM RepoOwner WHERE repo_id = ?"
 	_, err = seafileDB.Exec(sqlStr, repoID)
 	if err != nil {
@@ -0,0 +1,185 @@
+package searpc
+
+import (
+	"bytes"
+	"compress/zlib"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"sync"
+	"testing"
+	"time"
+)
+
+// servePipelined answers calls of the form ["echo", value, delay_ms] on the
+// pipelined socket in dir, each in its own goroutine so that responses come
+// back out of order. Calls of "hang" are never answered.
+func servePipelined(t *testing.T, dir string) net.Listener {
+	l, err := net.Listen("unix", filepath.Join(dir, pipelineSocketName))
+	if err != nil {
+		t.Fatalf("failed to listen: %v", err)
+	}
+	go func() {
+		for {
+			conn, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go servePipelinedConn(conn)
+		}
+	}()
+	return l
+}
+
+func servePipelinedConn(conn net.Conn) {
+	defer conn.Close()
+	var writeMu sync.Mutex
+	header := make([]byte, frameHeaderLen)
+	for {
+		if _, err := io.ReadFull(conn, header); err != nil {
+			return
+		}
+		body := make([]byte, binary.BigEndian.Uint32(header[0:]))
+		id := binary.BigEndian.Uint32(header[4:])
+		if _, err := io.ReadFull(conn, body); err != nil {
+			return
+		}
+
+		go func() {
+			var req request
+			var args []interface{}
+			json.Unmarshal(body, &req)
+			json.Unmarshal([]byte(req.Request), &args)
+			if args[0] == "hang" {
+				return
+			}
+			time.Sleep(time.Duration(args[2].(float64)) * time.Millisecond)
+
+			ret, _ := json.Marshal(map[string]interface{}{"ret": args[1]})
+			var flags uint32
+			if len(ret) > 1024 {
+				var buf bytes.Buffer
+				w := zlib.NewWriter(&buf)
+				w.Write(ret)
+				w.Close()
+				ret = buf.Bytes()
+				flags = flagZlib
+			}
+			frame := make([]byte, frameHeaderLen)
+			binary.BigEndian.PutUint32(frame[0:], uint32(len(ret)))
+			binary.BigEndian.PutUint32(frame[4:], id)
+			binary.BigEndian.PutUint32(frame[8:], flags)
+			writeMu.Lock()
+			conn.Write(append(frame, ret...))
+			writeMu.Unlock()
+		}()
+	}
+}
+
+// serveNamedPipe answers every call on the named pipe with "pipe".
+func serveNamedPipe(t *testing.T, path string) net.Listener {
+	l, err := net.Listen("unix", path)
+	if err != nil {
+		t.Fatalf("failed to listen: %v", err)
+	}
+	go func() {
+		for {
+			conn, err := l.Accept()
+			if err != nil {
+				return
+			}
+			header := make([]byte, 4)
+			io.ReadFull(conn, header)
+			io.ReadFull(conn, make([]byte, binary.LittleEndian.Uint32(header)))
+			ret := []byte(`{"ret": "pipe"}`)
+			binary.LittleEndian.PutUint32(header, uint32(len(ret)))
+			conn.Write(append(header, ret...))
+			conn.Close()
+		}
+	}()
+	return l
+}
+
+func TestPipelinedCalls(t *testing.T) {
+	dir, err := ioutil.TempDir("", "searpc")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	l := servePipelined(t, dir)
+	defer l.Close()
+
+	c := InitWithOptions(filepath.Join(dir, "seafile.sock"), service, Options{PoolSize: 2, Timeout: 5 * time.Second})
+
+	var wg sync.WaitGroup
+	for i := 0; i < 50; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			ret, err := c.Call("echo", fmt.Sprint(i), (50-i)%7)
+			if err != nil || ret != fmt.Sprint(i) {
+				t.Errorf("call %d returned %v, %v", i, ret, err)
+			}
+		}(i)
+	}
+	wg.Wait()
+
+	large := string(bytes.Repeat([]byte("x"), 10000))
+	if ret, err := c.Call("echo", large, 0); err != nil || ret != large {
+		t.Errorf("compressed result not decoded: %v", err)
+	}
+
+	stats := c.Stats()
+	if stats.Calls != 51 || stats.Errors != 0 || stats.FallbackCalls != 0 || stats.InFlight != 0 {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+	if stats.Conns != 2 {
+		t.Errorf("%d connections open, expected 2", stats.Conns)
+	}
+}
+
+func TestPipelinedTimeout(t *testing.T) {
+	dir, err := ioutil.TempDir("", "searpc")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	l := servePipelined(t, dir)
+	defer l.Close()
+
+	c := InitWithOptions(filepath.Join(dir, "seafile.sock"), service, Options{PoolSize: 1, Timeout: 50 * time.Millisecond})
+	if _, err := c.Call("hang"); err == nil {
+		t.Fatalf("call didn't time out")
+	}
+	// The connection that answered nothing is replaced.
+	if ret, err := c.Call("echo", "ok", 0); err != nil || ret != "ok" {
+		t.Errorf("call after timeout returned %v, %v", ret, err)
+	}
+	if stats := c.Stats(); stats.Timeouts != 1 || stats.Conns != 1 {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+}
+
+func TestNamedPipeFallback(t *testing.T) {
+	dir, err := ioutil.TempDir("", "searpc")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	pipe := filepath.Join(dir, "seafile.sock")
+	l := serveNamedPipe(t, pipe)
+	defer l.Close()
+
+	c := InitWithOptions(pipe, service, DefaultOptions)
+	if ret, err := c.Call("echo", "ok", 0); err != nil || ret != "pipe" {
+		t.Errorf("fallback call returned %v, %v", ret, err)
+	}
+	if stats := c.Stats(); stats.FallbackCalls != 1 || stats.Conns != 0 {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+}
@@ -1,21 +1,84 @@
 // Package searpc implements searpc client protocol with unix pipe transport.
+//
+// If seaf-server provides the pipelined socket next to the named pipe, calls
+// are sent over a few persistent connections to it instead, each carrying
+// any number of calls at the same time (see server/rpc-pipeline.h). Calls
+// fall back to a new connection to the named pipe while the socket can't be
+// reached.
 package searpc
 
 import (
 	"bufio"
+	"bytes"
+	"compress/zlib"
 	"encoding/binary"
 	"encoding/json"
 	"fmt"
 	"io"
+	"io/ioutil"
 	"net"
+	"path/filepath"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
+// Name of the pipelined socket, in the directory of the named pipe.
+const pipelineSocketName = "seafile-pipelined.sock"
+
+const (
+	frameHeaderLen = 12
+	flagAcceptZlib = 0x1
+	flagZlib       = 0x1
+)
+
+// How long calls use the named pipe after the pipelined socket couldn't be
+// reached.
+const pipelineRetryInterval = 5 * time.Second
+
+// Options of a client.
+type Options struct {
+	// Connections opened to the pipelined socket.
+	PoolSize int
+	// How long a call waits for its result, 0 for no limit.
+	Timeout time.Duration
+}
+
+// DefaultOptions are the options of clients created by Init.
+var DefaultOptions = Options{PoolSize: 4, Timeout: 60 * time.Second}
+
+// Stats are the call counters of a client.
+type Stats struct {
+	Calls    uint64
+	Errors   uint64
+	Timeouts uint64
+	// Calls sent to the named pipe because the pipelined socket wasn't there.
+	FallbackCalls uint64
+	InFlight      int64
+	// Open connections to the pipelined socket.
+	Conns int
+	// Total time spent in calls.
+	CallTime time.Duration
+}
+
 // Client represents a connections to the RPC server.
 type Client struct {
 	// path of the named pipe
-	pipePath string
+	pipePath     string
+	pipelinePath string
 	// RPC service name
 	Service string
+	opts    Options
+
+	mu    sync.Mutex
+	conns []*pipeConn
+	// Calls use the named pipe until then.
+	fallbackUntil time.Time
+
+	calls, errors, timeouts, fallbacks uint64
+	inFlight                           int64
+	// In nanoseconds.
+	callTime uint64
 }
 
 type request struct {
@@ -25,32 +88,45 @@ type request struct {
 
 // Init initializes rpc client.
 func Init(pipePath string, service string) *Client {
+	return InitWithOptions(pipePath, service, DefaultOptions)
+}
+
+// InitWithOptions initializes rpc client with the given pool options.
+func InitWithOptions(pipePath string, service string, opts Options) *Client {
 	client := new(Client)
 	client.pipePath = pipePath
+	client.pipelinePath = filepath.Join(filepath.Dir(pipePath), pipelineSocketName)
 	client.Service = service
+	if opts.PoolSize <= 0 {
+		opts.PoolSize = 1
+	}
+	client.opts = opts
 
 	return client
 }
 
+// Stats returns the call counters of the client.
+func (c *Client) Stats() Stats {
+	c.mu.Lock()
+	conns := len(c.conns)
+	c.mu.Unlock()
+
+	return Stats{
+		Calls:         atomic.LoadUint64(&c.calls),
+		Errors:        atomic.LoadUint64(&c.errors),
+		Timeouts:      atomic.LoadUint64(&c.timeouts),
+		FallbackCalls: atomic.LoadUint64(&c.fallbacks),
+		InFlight:      atomic.LoadInt64(&c.inFlight),
+		Conns:         conns,
+		CallTime:      time.Duration(atomic.LoadUint64(&c.callTime)),
+	}
+}
+
 // Call calls the RPC function funcname with variadic parameters.
 // The return value of the RPC function is return as interface{} type
 // The true returned type can be int32, int64, string, struct (object), list of struct (objects) or JSON
 func (c *Client) Call(funcname string, params ...interface{}) (interface{}, error) {
 	// TODO: use reflection to compose requests and parse results.
-	var unixAddr *net.UnixAddr
-	unixAddr, err := net.ResolveUnixAddr("unix", c.pipePath)
-	if err != nil {
-		err := fmt.Errorf("failed to resolve unix addr when calling rpc : %v", err)
-		return nil, err
-	}
-
-	conn, err := net.DialUnix("unix", nil, unixAddr)
-	if err != nil {
-		err := fmt.Errorf("failed to dial unix when calling rpc : %v", err)
-		return nil, err
-	}
-	defer conn.Close()
-
 	var req []interface{}
 	req = append(req, funcname)
 	req = append(req, params...)
@@ -70,15 +146,153 @@ func (c *Client) Call(funcname string, params ...interface{}) (interface{}, erro
 		return nil, err
 	}
 
+	start := time.Now()
+	atomic.AddUint64(&c.calls, 1)
+	atomic.AddInt64(&c.inFlight, 1)
+	msg, err := c.roundTrip(jsonstr)
+	atomic.AddInt64(&c.inFlight, -1)
+	atomic.AddUint64(&c.callTime, uint64(time.Since(start)))
+	if err != nil {
+		atomic.AddUint64(&c.errors, 1)
+		return nil, err
+	}
+
+	retlist := make(map[string]interface{})
+	err = json.Unmarshal(msg, &retlist)
+	if err != nil {
+		err := fmt.Errorf("failed to decode rpc response : %v", err)
+		return nil, err
+	}
+
+	if _, ok := retlist["err_code"]; ok {
+		err := fmt.Errorf("searpc server returned error : %v", retlist["err_msg"])
+		return nil, err
+	}
+
+	if _, ok := retlist["ret"]; ok {
+		ret := retlist["ret"]
+		return ret, nil
+	}
+
+	err = fmt.Errorf("No value returned")
+	return nil, err
+}
+
+// roundTrip sends an encoded request and returns the response payload.
+func (c *Client) roundTrip(body []byte) ([]byte, error) {
+	var pc *pipeConn
+	var id uint32
+	var wait chan callResult
+	var err error
+
+	// A connection found broken before anything was written to it is
+	// replaced, so a call is never sent twice.
+	for i := 0; i < 2; i++ {
+		pc = c.getConn()
+		if pc == nil {
+			atomic.AddUint64(&c.fallbacks, 1)
+			return c.callNamedPipe(body)
+		}
+		id, wait, err = pc.send(body)
+		if err != errConnClosed {
+			break
+		}
+	}
+	if err != nil {
+		return nil, err
+	}
+
+	if c.opts.Timeout <= 0 {
+		res := <-wait
+		return res.payload, res.err
+	}
+
+	start := time.Now()
+	timer := time.NewTimer(c.opts.Timeout)
+	defer timer.Stop()
+	select {
+	case res := <-wait:
+		return res.payload, res.err
+	case <-timer.C:
+		atomic.AddUint64(&c.timeouts, 1)
+		pc.cancel(id)
+		// Nothing answered on the connection during the whole call: the
+		// server side of it is stuck, later calls get a new one.
+		if pc.lastReadTime().Before(start) {
+			pc.close(fmt.Errorf("rpc connection is not responding"))
+		}
+		return nil, fmt.Errorf("rpc call timed out after %v", c.opts.Timeout)
+	}
+}
+
+// getConn returns the pipelined connection with the fewest calls in flight,
+// opening new ones up to the pool size. Returns nil if calls should use the
+// named pipe.
+func (c *Client) getConn() *pipeConn {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	conns := c.conns[:0]
+	for _, pc := range c.conns {
+		if !pc.isClosed() {
+			conns = append(conns, pc)
+		}
+	}
+	for i := len(conns); i < len(c.conns); i++ {
+		c.conns[i] = nil
+	}
+	c.conns = conns
+
+	if len(c.conns) < c.opts.PoolSize && time.Now().After(c.fallbackUntil) {
+		conn, err := net.Dial("unix", c.pipelinePath)
+		if err == nil {
+			pc := newPipeConn(conn)
+			c.conns = append(c.conns, pc)
+			return pc
+		}
+		c.fallbackUntil = time.Now().Add(pipelineRetryInterval)
+	}
+	if len(c.conns) == 0 {
+		return nil
+	}
+
+	best := c.conns[0]
+	for _, pc := range c.conns[1:] {
+		if pc.inFlight() < best.inFlight() {
+			best = pc
+		}
+	}
+	return best
+}
+
+// callNamedPipe sends a request on a new connection to the named pipe.
+func (c *Client) callNamedPipe(body []byte) ([]byte, error) {
+	var unixAddr *net.UnixAddr
+	unixAddr, err := net.ResolveUnixAddr("unix", c.pipePath)
+	if err != nil {
+		err := fmt.Errorf("failed to resolve unix addr when calling rpc : %v", err)
+		return nil, err
+	}
+
+	conn, err := net.DialUnix("unix", nil, unixAddr)
+	if err != nil {
+		err := fmt.Errorf("failed to dial unix when calling rpc : %v", err)
+		return nil, err
+	}
+	defer conn.Close()
+	if c.opts.Timeout > 0 {
+		conn.SetDeadline(time.Now().Add(c.opts.Timeout))
+	}
+
 	header := make([]byte, 4)
-	binary.LittleEndian.PutUint32(header, uint32(len(jsonstr)))
+	binary.LittleEndian.PutUint32(header, uint32(len(body)))
 	_, err = conn.Write([]byte(header))
 	if err != nil {
 		err := fmt.Errorf("Failed to write rpc request header : %v", err)
 		return nil, err
 	}
 
-	_, err = conn.Write([]byte(jsonstr))
+	_, err = conn.Write(body)
 	if err != nil {
 		err := fmt.Errorf("Failed to write rpc request body : %v", err)
 		return nil, err
@@ -100,23 +314,158 @@ func (c *Client) Call(funcname string, params ...interface{}) (interface{}, erro
 		return nil, err
 	}
 
-	retlist := make(map[string]interface{})
-	err = json.Unmarshal(msg, &retlist)
+	return msg, nil
+}
+
+var errConnClosed = fmt.Errorf("rpc connection is closed")
+
+type callResult struct {
+	payload []byte
+	err     error
+}
+
+// pipeConn is a connection to the pipelined socket, with a goroutine handing
+// responses to the calls waiting for them.
+type pipeConn struct {
+	conn net.Conn
+	// Keeps request frames from interleaving.
+	writeMu sync.Mutex
+
+	// mu guards the fields below.
+	mu      sync.Mutex
+	pending map[uint32]chan callResult
+	nextID  uint32
+	err     error
+
+	// Unix time in nanoseconds of the last response.
+	lastRead int64
+}
+
+func newPipeConn(conn net.Conn) *pipeConn {
+	pc := &pipeConn{
+		conn:     conn,
+		pending:  make(map[uint32]chan callResult),
+		lastRead: time.Now().UnixNano(),
+	}
+	go pc.readResponses()
+	return pc
+}
+
+func (pc *pipeConn) send(body []byte) (uint32, chan callResult, error) {
+	wait := make(chan callResult, 1)
+
+	pc.mu.Lock()
+	if pc.err != nil {
+		pc.mu.Unlock()
+		return 0, nil, errConnClosed
+	}
+	pc.nextID++
+	id := pc.nextID
+	pc.pending[id] = wait
+	pc.mu.Unlock()
+
+	frame := make([]byte, frameHeaderLen+len(body))
+	binary.BigEndian.PutUint32(frame[0:], uint32(len(body)))
+	binary.BigEndian.PutUint32(frame[4:], id)
+	binary.BigEndian.PutUint32(frame[8:], flagAcceptZlib)
+	copy(frame[frameHeaderLen:], body)
+
+	pc.writeMu.Lock()
+	_, err := pc.conn.Write(frame)
+	pc.writeMu.Unlock()
 	if err != nil {
-		err := fmt.Errorf("failed to decode rpc response : %v", err)
-		return nil, err
+		pc.cancel(id)
+		err = fmt.Errorf("Failed to write rpc request : %v", err)
+		pc.close(err)
+		return 0, nil, err
 	}
+	return id, wait, nil
+}
 
-	if _, ok := retlist["err_code"]; ok {
-		err := fmt.Errorf("searpc server returned error : %v", retlist["err_msg"])
-		return nil, err
+// cancel forgets a call; its response is dropped if it still comes.
+func (pc *pipeConn) cancel(id uint32) {
+	pc.mu.Lock()
+	delete(pc.pending, id)
+	pc.mu.Unlock()
+}
+
+func (pc *pipeConn) inFlight() int {
+	pc.mu.Lock()
+	defer pc.mu.Unlock()
+	return len(pc.pending)
+}
+
+func (pc *pipeConn) isClosed() bool {
+	pc.mu.Lock()
+	defer pc.mu.Unlock()
+	return pc.err != nil
+}
+
+func (pc *pipeConn) lastReadTime() time.Time {
+	return time.Unix(0, atomic.LoadInt64(&pc.lastRead))
+}
+
+// close fails the calls in flight with err.
+func (pc *pipeConn) close(err error) {
+	pc.mu.Lock()
+	if pc.err != nil {
+		pc.mu.Unlock()
+		return
 	}
+	pc.err = err
+	pending := pc.pending
+	pc.pending = make(map[uint32]chan callResult)
+	pc.mu.Unlock()
 
-	if _, ok := retlist["ret"]; ok {
-		ret := retlist["ret"]
-		return ret, nil
+	pc.conn.Close()
+	for _, wait := range pending {
+		wait <- callResult{err: err}
 	}
+}
 
-	err = fmt.Errorf("No value returned")
-	return nil, err
+func (pc *pipeConn) readResponses() {
+	reader := bufio.NewReader(pc.conn)
+	header := make([]byte, frameHeaderLen)
+	for {
+		if _, err := io.ReadFull(reader, header); err != nil {
+			pc.close(fmt.Errorf("failed to read response header from rpc server : %v", err))
+			return
+		}
+		length := binary.BigEndian.Uint32(header[0:])
+		id := binary.BigEndian.Uint32(header[4:])
+		flags := binary.BigEndian.Uint32(header[8:])
+
+		msg := make([]byte, length)
+		if _, err := io.ReadFull(reader, msg); err != nil {
+			pc.close(fmt.Errorf("failed to read response body from rpc server : %v", err))
+			return
+		}
+		atomic.StoreInt64(&pc.lastRead, time.Now().UnixNano())
+
+		res := callResult{payload: msg}
+		if flags&flagZlib != 0 {
+			res.payload, res.err = inflate(msg)
+		}
+
+		pc.mu.Lock()
+		wait := pc.pending[id]
+		delete(pc.pending, id)
+		pc.mu.Unlock()
+		if wait != nil {
+			wait <- res
+		}
+	}
+}
+
+func inflate(data []byte) ([]byte, error) {
+	r, err := zlib.NewReader(bytes.NewReader(data))
+	if err != nil {
+		return nil, fmt.Errorf("failed to decompress rpc response : %v", err)
+	}
+	defer r.Close()
+	msg, err := ioutil.ReadAll(r)
+	if err != nil {
+		return nil, fmt.Errorf("failed to decompress rpc response : %v", err)
+	}
+	return msg, nil
 }
@@ -6,21 +6,17 @@ import (
 	"database/sql"
 	"fmt"
 	"path/filepath"
+	"sort"
 	"strconv"
 	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 
 	"github.com/haiwen/seafile-server/fileserver/repomgr"
 	log "github.com/sirupsen/logrus"
 )
 
-type group struct {
-	id            int
-	groupName     string
-	creatorName   string
-	timestamp     int64
-	parentGroupID int
-}
-
 var ccnetDB *sql.DB
 var seafileDB *sql.DB
 var groupTableName string
@@ -34,6 +30,64 @@ func Init(cnDB *sql.DB, seafDB *sql.DB, grpTableName string, clMode bool) {
 	cloudMode = clMode
 }
 
+// Listings and repo heads are read from the replicas in turn when there are
+// any. Permission checks and the group closure read the primaries, a
+// lagging replica could still grant a revoked share.
+var seafileReplicas []*sql.DB
+var nextReplica uint32
+
+const defaultPinTime = 5 * time.Second
+
+// The heads of a repo are read from seafileDB for pinTime after its branch
+// is updated, so that a client sees its own commits.
+var pinTime = defaultPinTime
+var pinnedRepos sync.Map
+var lastPrune int64
+
+// SetReplicas sets the read replicas of seafileDB. A pinTime of 0 keeps the
+// default.
+func SetReplicas(seafDBs []*sql.DB, pin time.Duration) {
+	seafileReplicas = seafDBs
+	if pin > 0 {
+		pinTime = pin
+	}
+}
+
+// PinRepo reads the heads of repoID from the primary for the next pinTime.
+func PinRepo(repoID string) {
+	if len(seafileReplicas) == 0 {
+		return
+	}
+	now := time.Now()
+	pinnedRepos.Store(repoID, now.Add(pinTime))
+
+	// Expired pins are dropped once every pinTime.
+	last := atomic.LoadInt64(&lastPrune)
+	if now.UnixNano()-last < int64(pinTime) ||
+		!atomic.CompareAndSwapInt64(&lastPrune, last, now.UnixNano()) {
+		return
+	}
+	pinnedRepos.Range(func(key, value interface{}) bool {
+		if !value.(time.Time).After(now) {
+			pinnedRepos.Delete(key)
+		}
+		return true
+	})
+}
+
+func isRepoPinned(repoID string) bool {
+	until, ok := pinnedRepos.Load(repoID)
+	return ok && until.(time.Time).After(time.Now())
+}
+
+func readSeafileDB() *sql.DB {
+	if len(seafileReplicas) == 0 {
+		return seafileDB
+	}
+	i := atomic.AddUint32(&nextReplica, 1)
+	return seafileReplicas[i%uint32(len(seafileReplicas))]
+}
+
 // CheckPerm get user's repo permission
 func CheckPerm(repoID string, user string) string {
 	var perm string
@@ -69,125 +123,128 @@ func checkVirtualRepoPerm(repoID, originRepoID, user, vPath string) string {
 	return perm
 }
 
-func getUserGroups(sqlStr string, args ...interface{}) ([]group, error) {
-	rows, err := ccnetDB.Query(sqlStr, args...)
+// Permission checks and repo listings need the groups of a user and all
+// their ancestor departments. The ids are read with one query joining
+// GroupStructure, and cached per user for groupClosureExpire. seaf-server
+// publishes an event when it changes the groups of a user, see
+// InvalidateUserGroups; changes made on other nodes are seen after the
+// expire time.
+
+const (
+	groupClosureExpire = 300 * time.Second
+	maxCachedClosures  = 100000
+)
+
+type groupClosure struct {
+	groupIDs   []int
+	expireTime time.Time
+}
+
+var groupClosures = struct {
+	sync.Mutex
+	closures map[string]*groupClosure
+	// Bumped by each invalidation.
+	gen uint64
+}{closures: make(map[string]*groupClosure)}
+
+// loadGroupIDs is replaced in tests.
+var loadGroupIDs = loadGroupClosure
+
+func loadGroupClosure(userName string) ([]int, error) {
+	sqlStr := fmt.Sprintf("SELECT u.group_id, s.path FROM GroupUser u "+
+		"INNER JOIN `%s` g ON u.group_id = g.group_id "+
+		"LEFT JOIN GroupStructure s ON u.group_id = s.group_id "+
+		"WHERE u.user_name = ?", groupTableName)
+	rows, err := ccnetDB.Query(sqlStr, userName)
 	if err != nil {
 		return nil, err
 	}
-
 	defer rows.Close()
 
-	var groups []group
-	var g group
+	ids := make(map[int]struct{})
 	for rows.Next() {
-		if err := rows.Scan(&g.id, &g.groupName,
-			&g.creatorName, &g.timestamp,
-			&g.parentGroupID); err == nil {
-
-			groups = append(groups, g)
+		var groupID int
+		var path sql.NullString
+		if err := rows.Scan(&groupID, &path); err != nil {
+			return nil, err
+		}
+		ids[groupID] = struct{}{}
+		// The path lists the ancestors of the group and the group itself.
+		for _, s := range strings.Split(path.String, ",") {
+			id, err := strconv.Atoi(strings.TrimSpace(s))
+			if err == nil && id > 0 {
+				ids[id] = struct{}{}
+			}
 		}
 	}
-
 	if err := rows.Err(); err != nil {
 		return nil, err
 	}
-	return groups, nil
-}
 
-func getGroupsByUser(userName string, returnAncestors bool) ([]group, error) {
-	sqlStr := fmt.Sprintf("SELECT g.group_id, group_name, creator_name, timestamp, parent_group_id FROM "+
-		"`%s` g, GroupUser u WHERE g.group_id = u.group_id AND user_name=? ORDER BY g.group_id DESC",
-		groupTableName)
-	groups, err := getUserGroups(sqlStr, userName)
-	if err != nil {
-		err := fmt.Errorf("Failed to get groups by user %s: %v", userName, err)
-		return nil, err
+	groupIDs := make([]int, 0, len(ids))
+	for id := range ids {
+		groupIDs = append(groupIDs, id)
 	}
-	if !returnAncestors {
-		return groups, nil
-	}
-
-	sqlStr = ""
-	var ret []group
-	for _, group := range groups {
-		parentGroupID := group.parentGroupID
-		groupID := group.id
-		if parentGroupID != 0 {
-			if sqlStr == "" {
-				sqlStr = fmt.Sprintf("SELECT path FROM GroupStructure WHERE group_id IN (%d",
-					groupID)
-			} else {
-				sqlStr += fmt.Sprintf(", %d", groupID)
-			}
-		} else {
-			ret = append(ret, group)
-		}
-	}
-	if sqlStr != "" {
-		sqlStr += ")"
-		paths, err := getGroupPaths(sqlStr)
-		if err != nil {
-			log.Printf("Failed to get group paths: %v", err)
-		}
-		if paths == "" {
-			err := fmt.Errorf("Failed to get groups path for user %s", userName)
-			return nil, err
-		}
+	sort.Sort(sort.Reverse(sort.IntSlice(groupIDs)))
+	return groupIDs, nil
+}
 
-		sqlStr = fmt.Sprintf("SELECT g.group_id, group_name, creator_name, timestamp, parent_group_id FROM "+
-			"`%s` g WHERE g.group_id IN (%s) ORDER BY g.group_id DESC",
-			groupTableName, paths)
-		groups, err := getUserGroups(sqlStr)
-		if err != nil {
-			return nil, err
-		}
-		ret = append(ret, groups...)
+// getGroupIDsByUser returns the ids of the groups of userName and their
+// ancestors in descending order. The returned slice must not be modified.
+func getGroupIDsByUser(userName string) ([]int, error) {
+	now := time.Now()
+	groupClosures.Lock()
+	closure, ok := groupClosures.closures[userName]
+	gen := groupClosures.gen
+	groupClosures.Unlock()
+	if ok && now.Before(closure.expireTime) {
+		return closure.groupIDs, nil
 	}
-	return ret, nil
-}
 
-func getGroupPaths(sqlStr string) (string, error) {
-	var paths string
-	rows, err := ccnetDB.Query(sqlStr)
+	groupIDs, err := loadGroupIDs(userName)
 	if err != nil {
-		return paths, err
+		err := fmt.Errorf("Failed to get groups by user %s: %v", userName, err)
+		return nil, err
 	}
 
-	defer rows.Close()
-
-	var path string
-	for rows.Next() {
-		rows.Scan(&path)
-		if paths == "" {
-			paths = path
-		} else {
-			paths += fmt.Sprintf(", %s", path)
+	groupClosures.Lock()
+	// Don't cache a closure read before an invalidation.
+	if gen == groupClosures.gen {
+		if len(groupClosures.closures) >= maxCachedClosures {
+			groupClosures.closures = make(map[string]*groupClosure)
 		}
+		groupClosures.closures[userName] = &groupClosure{groupIDs, now.Add(groupClosureExpire)}
 	}
+	groupClosures.Unlock()
 
-	if err := rows.Err(); err != nil {
-		return "", err
-	}
-	return paths, nil
+	return groupIDs, nil
+}
+
+// InvalidateUserGroups drops the cached groups of userName, or of all users
+// if it's empty.
+func InvalidateUserGroups(userName string) {
+	groupClosures.Lock()
+	defer groupClosures.Unlock()
+	groupClosures.gen++
+	if userName == "" {
+		groupClosures.closures = make(map[string]*groupClosure)
+		return
+	}
+	delete(groupClosures.closures, userName)
 }
 
 func checkGroupPermByUser(repoID string, userName string) (string, error) {
-	groups, err := getGroupsByUser(userName, false)
+	groupIDs, err := getGroupIDsByUser(userName)
 	if err != nil {
 		return "", err
 	}
-	if len(groups) == 0 {
+	if len(groupIDs) == 0 {
 		return "", nil
 	}
 
 	var sqlBuilder strings.Builder
 	sqlBuilder.WriteString("SELECT permission FROM RepoGroup WHERE repo_id = ? AND group_id IN (")
-	for i := 0; i < len(groups); i++ {
-		sqlBuilder.WriteString(strconv.Itoa(groups[i].id))
-		if i+1 < len(groups) {
-			sqlBuilder.WriteString(",")
-		}
-	}
+	sqlBuilder.WriteString(convertGroupListToStr(groupIDs))
 	sqlBuilder.WriteString(")")
 
 	rows, err := seafileDB.Query(sqlBuilder.String(), repoID)
@@ -321,21 +378,21 @@ func getDirPerm(perms map[string]string, path string) string {
 	return perm
 }
 
-func convertGroupListToStr(groups []group) string {
-	var groupIDs strings.Builder
+func convertGroupListToStr(groupIDs []int) string {
+	var groupIDStr strings.Builder
 
-	for i, group := range groups {
-		groupIDs.WriteString(strconv.Itoa(group.id))
-		if i+1 < len(groups) {
-			groupIDs.WriteString(",")
+	for i, id := range groupIDs {
+		groupIDStr.WriteString(strconv.Itoa(id))
+		if i+1 < len(groupIDs) {
+			groupIDStr.WriteString(",")
 		}
 	}
-	return groupIDs.String()
+	return groupIDStr.String()
 }
 
-func getSharedDirsToGroup(originRepoID string, groups []group) (map[string]string, error) {
+func getSharedDirsToGroup(originRepoID string, groupIDList []int) (map[string]string, error) {
 	dirs := make(map[string]string)
-	groupIDs := convertGroupListToStr(groups)
+	groupIDs := convertGroupListToStr(groupIDList)
 
 	sqlStr := fmt.Sprintf("SELECT v.path, s.permission "+
 		"FROM RepoGroup s, VirtualRepo v WHERE "+
@@ -380,15 +437,15 @@ func checkPermOnParentRepo(originRepoID, user, vPath string) string {
 		}
 	}
 
-	groups, err := getGroupsByUser(user, false)
+	groupIDs, err := getGroupIDsByUser(user)
 	if err != nil {
 		log.Printf("Failed to get groups by user %s: %v", user, err)
 	}
-	if len(groups) == 0 {
+	if len(groupIDs) == 0 {
 		return perm
 	}
 
-	groupPerms, err := getSharedDirsToGroup(originRepoID, groups)
+	groupPerms, err := getSharedDirsToGroup(originRepoID, groupIDs)
 	if err != nil {
 		log.Printf("Failed to get all shared folder perm from parent repo %.8s to all user groups", originRepoID)
 		return ""
@@ -426,7 +483,7 @@ func GetReposByOwner(email string) ([]*SharedRepo, error) {
 		"o.repo_id NOT IN (SELECT v.repo_id FROM VirtualRepo v) " +
 		"ORDER BY i.update_time DESC, o.repo_id"
 
-	stmt, err := seafileDB.Prepare(query)
+	stmt, err := readSeafileDB().Prepare(query)
 	if err != nil {
 		return nil, err
 	}
@@ -478,7 +535,7 @@ func ListInnerPubRepos() ([]*SharedRepo, error) {
 		"WHERE InnerPubRepo.repo_id=RepoOwner.repo_id AND " +
 		"InnerPubRepo.repo_id = Branch.repo_id AND Branch.name = 'master'"
 
-	stmt, err := seafileDB.Prepare(query)
+	stmt, err := readSeafileDB().Prepare(query)
 	if err != nil {
 		return nil, err
 	}
@@ -544,7 +601,7 @@ func ListShareRepos(email, columnType string) ([]*SharedRepo, error) {
 		return nil, err
 	}
 
-	stmt, err := seafileDB.Prepare(query)
+	stmt, err := readSeafileDB().Prepare(query)
 	if err != nil {
 		return nil, err
 	}
@@ -586,11 +643,11 @@ func ListShareRepos(email, columnType string) ([]*SharedRepo, error) {
 
 // GetGroupReposByUser get group repos by user
 func GetGroupReposByUser(user string, orgID int) ([]*SharedRepo, error) {
-	groups, err := getGroupsByUser(user, true)
+	groupIDs, err := getGroupIDsByUser(user)
 	if err != nil {
 		return nil, err
 	}
-	if len(groups) == 0 {
+	if len(groupIDs) == 0 {
 		return nil, nil
 	}
 
@@ -613,15 +670,10 @@ func GetGroupReposByUser(user string, orgID int) ([]*SharedRepo, error) {
 			"b.name = 'master' AND group_id IN (")
 	}
 
-	for i := 0; i < len(groups); i++ {
-		sqlBuilder.WriteString(strconv.Itoa(groups[i].id))
-		if i+1 < len(groups) {
-			sqlBuilder.WriteString(",")
-		}
-	}
+	sqlBuilder.WriteString(convertGroupListToStr(groupIDs))
 	sqlBuilder.WriteString(" ) ORDER BY group_id")
 
-	rows, err := seafileDB.Query(sqlBuilder.String())
+	rows, err := readSeafileDB().Query(sqlBuilder.String())
 	if err != nil {
 		return nil, err
 	}
@@ -644,3 +696,82 @@ func GetGroupReposByUser(user string, orgID int) ([]*SharedRepo, error) {
 
 	return repos, nil
 }
+
+// RepoHead holds the fields of a repo listing that change with each commit.
+type RepoHead struct {
+	HeadCommitID string
+	Name         string
+	MTime        int64
+	Version      int
+}
+
+const maxRepoHeadsPerQuery = 500
+
+// GetRepoHeads gets the heads of repoIDs. Repos that don't exist anymore are
+// missing from the result.
+func GetRepoHeads(repoIDs []string) (map[string]*RepoHead, error) {
+	heads := make(map[string]*RepoHead)
+	for len(repoIDs) > 0 {
+		n := len(repoIDs)
+		if n > maxRepoHeadsPerQuery {
+			n = maxRepoHeadsPerQuery
+		}
+		if err := getRepoHeadsChunk(repoIDs[:n], heads); err != nil {
+			return nil, err
+		}
+		repoIDs = repoIDs[n:]
+	}
+
+	return heads, nil
+}
+
+func getRepoHeadsChunk(repoIDs []string, heads map[string]*RepoHead) error {
+	var sqlBuilder strings.Builder
+	sqlBuilder.WriteString("SELECT b.repo_id, b.commit_id, i.name, " +
+		"i.update_time, i.version FROM Branch b " +
+		"LEFT JOIN RepoInfo i ON b.repo_id = i.repo_id " +
+		"WHERE b.name = 'master' AND b.repo_id IN (")
+	args := make([]interface{}, len(repoIDs))
+	for i, id := range repoIDs {
+		if i > 0 {
+			sqlBuilder.WriteString(", ")
+		}
+		sqlBuilder.WriteString("?")
+		args[i] = id
+	}
+	sqlBuilder.WriteString(")")
+
+	db := readSeafileDB()
+	for _, id := range repoIDs {
+		if isRepoPinned(id) {
+			db = seafileDB
+			break
+		}
+	}
+	rows, err := db.Query(sqlBuilder.String(), args...)
+	if err != nil {
+		return err
+	}
+	defer rows.Close()
+
+	for rows.Next() {
+		var repoID string
+		var repoName sql.NullString
+		var mtime sql.NullInt64
+		var version sql.NullInt64
+		head := new(RepoHead)
+		if err := rows.Scan(&repoID, &head.HeadCommitID, &repoName,
+			&mtime, &version); err != nil {
+			continue
+		}
+		if !repoName.Valid || repoName.String == "" {
+			continue
+		}
+		head.Name = repoName.String
+		head.MTime = mtime.Int64
+		head.Version = int(version.Int64)
+		heads[repoID] = head
+	}
+
+	return rows.Err()
+}
@@ -0,0 +1,73 @@
+package share
+
+import (
+	"database/sql"
+	"testing"
+	"time"
+)
+
+func TestGroupClosureCache(t *testing.T) {
+	loads := make(map[string]int)
+	saved := loadGroupIDs
+	defer func() { loadGroupIDs = saved }()
+	loadGroupIDs = func(userName string) ([]int, error) {
+		loads[userName]++
+		return []int{loads[userName]}, nil
+	}
+	defer InvalidateUserGroups("")
+
+	get := func(user string) int {
+		ids, err := getGroupIDsByUser(user)
+		if err != nil || len(ids) != 1 {
+			t.Fatalf("failed to get groups of %s: %v %v", user, ids, err)
+		}
+		return ids[0]
+	}
+
+	if get("alice@example.com") != 1 || get("alice@example.com") != 1 {
+		t.Errorf("cached groups were loaded again")
+	}
+	get("bob@example.com")
+
+	InvalidateUserGroups("alice@example.com")
+	if get("alice@example.com") != 2 {
+		t.Errorf("groups were not loaded after invalidation")
+	}
+	if get("bob@example.com") != 1 {
+		t.Errorf("groups of another user were invalidated")
+	}
+
+	InvalidateUserGroups("")
+	if get("bob@example.com") != 2 {
+		t.Errorf("groups were not loaded after invalidating all users")
+	}
+}
+
+func TestPinRepo(t *testing.T) {
+	savedReplicas, savedPin := seafileReplicas, pinTime
+	defer func() { seafileReplicas, pinTime = savedReplicas, savedPin }()
+
+	repoID := "b1f2ad61-9164-418a-a47f-ab805dbd5694"
+	PinRepo(repoID)
+	if isRepoPinned(repoID) {
+		t.Errorf("repo is pinned without replicas")
+	}
+
+	SetReplicas([]*sql.DB{new(sql.DB)}, 50*time.Millisecond)
+	PinRepo(repoID)
+	if !isRepoPinned(repoID) {
+		t.Errorf("updated repo isn't pinned")
+	}
+	if isRepoPinned("0a4bf5e3-c800-4aa2-b4a2-a2e13d1f8b39") {
+		t.Errorf("another repo is pinned")
+	}
+
+	time.Sleep(60 * time.Millisecond)
+	if isRepoPinned(repoID) {
+		t.Errorf("pin doesn't expire")
+	}
+	PinRepo("0a4bf5e3-c800-4aa2-b4a2-a2e13d1f8b39")
+	if _, ok := pinnedRepos.Load(repoID); ok {
+		t.Errorf("expired pin isn't dropped")
+	}
+}
@@ -7,6 +7,8 @@ import (
 	"gopkg.in/ini.v1"
 
 	"database/sql"
+	"sync"
+	"time"
 
 	"github.com/haiwen/seafile-server/fileserver/commitmgr"
 	"github.com/haiwen/seafile-server/fileserver/diff"
@@ -16,8 +18,23 @@ import (
 	log "github.com/sirupsen/logrus"
 )
 
+// All dirty repos are queued on start, at low priority so that repos
+// updated since go first.
+const sizeQueueSize = 10000
+
 var updateSizePool *workerpool.WorkPool
 
+// Repos whose size needs to be recomputed are kept in a dirty set, so that a
+// burst of head updates of a repo queues only one job, which computes against
+// the head at the time it starts. The set is also stored in the RepoSizeDirty
+// table, shared with seaf-server, so that pending computations survive
+// restarts. A row is removed only if the repo isn't marked dirty again after
+// the computation started.
+var pendingSizeRepos = struct {
+	sync.Mutex
+	repos map[string]bool
+}{repos: make(map[string]bool)}
+
 func sizeSchedulerInit() {
 	var n int = 1
 	var seafileConfPath string
@@ -38,21 +55,106 @@ func sizeSchedulerInit() {
 			}
 		}
 	}
-	updateSizePool = workerpool.CreateWorkerPool(computeRepoSize, n)
+	updateSizePool = workerpool.NewWorkerPool(computeSizeJob, n, sizeQueueSize)
+
+	loadDirtyRepos()
+}
+
+func loadDirtyRepos() {
+	rows, err := seafileDB.Query("SELECT repo_id FROM RepoSizeDirty")
+	if err != nil {
+		log.Printf("failed to load repos waiting for size computation: %v", err)
+		return
+	}
+	defer rows.Close()
+
+	for rows.Next() {
+		var repoID string
+		if err := rows.Scan(&repoID); err != nil {
+			log.Printf("failed to load repos waiting for size computation: %v", err)
+			return
+		}
+		pushSizeJob(repoID, workerpool.PriorityLow)
+	}
 }
 
-func computeRepoSize(args ...interface{}) error {
+// scheduleRepoSizeComputation marks the size of the repo as dirty and queues
+// a computation unless one is pending.
+func scheduleRepoSizeComputation(repoID string) {
+	pendingSizeRepos.Lock()
+	pending := pendingSizeRepos.repos[repoID]
+	pendingSizeRepos.Unlock()
+
+	// The pending job will see this head.
+	if pending {
+		return
+	}
+
+	sqlStr := "REPLACE INTO RepoSizeDirty (repo_id, dirty_time) VALUES (?, ?)"
+	if _, err := seafileDB.Exec(sqlStr, repoID, time.Now().UnixNano()/1000); err != nil {
+		log.Printf("failed to mark size of repo %s as dirty: %v", repoID, err)
+	}
+
+	pushSizeJob(repoID, workerpool.PriorityNormal)
+}
+
+// pushSizeJob returns false if the repo already has a pending job, or the
+// queue is full. A repo whose job was rejected stays dirty in the database.
+func pushSizeJob(repoID string, prio workerpool.Priority) bool {
+	pendingSizeRepos.Lock()
+	if pendingSizeRepos.repos[repoID] {
+		pendingSizeRepos.Unlock()
+		return false
+	}
+	pendingSizeRepos.repos[repoID] = true
+	pendingSizeRepos.Unlock()
+
+	if err := updateSizePool.Submit(prio, repoID); err != nil {
+		log.Printf("failed to schedule size computation of repo %s: %v", repoID, err)
+		startSizeJob(repoID)
+		return false
+	}
+	return true
+}
+
+// startSizeJob is called when the job of the repo starts. Head updates from
+// now on need another job.
+func startSizeJob(repoID string) {
+	pendingSizeRepos.Lock()
+	delete(pendingSizeRepos.repos, repoID)
+	pendingSizeRepos.Unlock()
+}
+
+func computeSizeJob(args ...interface{}) error {
 	if len(args) < 1 {
 		return nil
 	}
 	repoID := args[0].(string)
+
+	startSizeJob(repoID)
+	startTime := time.Now().UnixNano() / 1000
+
+	if err := computeRepoSize(repoID); err != nil {
+		return err
+	}
+
+	sqlStr := "DELETE FROM RepoSizeDirty WHERE repo_id = ? AND dirty_time <= ?"
+	if _, err := seafileDB.Exec(sqlStr, repoID, startTime); err != nil {
+		return fmt.Errorf("failed to clear dirty size of repo %s: %v", repoID, err)
+	}
+
+	return nil
+}
+
+func computeRepoSize(repoID string) error {
 	var size int64
 	var fileCount int64
 
 	repo := repomgr.Get(repoID)
 	if repo == nil {
-		err := fmt.Errorf("failed to get repo %s", repoID)
-		return err
+		// Nothing left to compute for a deleted repo.
+		log.Printf("failed to get repo %s", repoID)
+		return nil
 	}
 
 	info, err := getOldRepoInfo(repoID)
@@ -81,7 +183,8 @@ func computeRepoSize(args ...interface{}) error {
 		var results []*diff.DiffEntry
 		var changeSize int64
 		var changeFileCount int64
-		err := diff.DiffCommits(oldHead, head, &results, false)
+		// A rename changes neither the size nor the file count.
+		err := diff.DiffCommitsNoRenames(oldHead, head, &results, false)
 		if err != nil {
 			err := fmt.Errorf("failed to do diff commits: %v", err)
 			return err
@@ -128,10 +231,11 @@ func setRepoSizeAndFileCount(repoID, newHeadID string, size, fileCount int64) er
 	}
 
 	var headID string
-	sqlStr := "SELECT head_id FROM RepoSize WHERE repo_id=?"
+	var oldSize sql.NullInt64
+	sqlStr := "SELECT head_id, size FROM RepoSize WHERE repo_id=?"
 
 	row := trans.QueryRow(sqlStr, repoID)
-	if err := row.Scan(&headID); err != nil {
+	if err := row.Scan(&headID, &oldSize); err != nil {
 		if err != sql.ErrNoRows {
 			trans.Rollback()
 			return err
@@ -154,6 +258,11 @@ func setRepoSizeAndFileCount(repoID, newHeadID string, size, fileCount int64) er
 		}
 	}
 
+	if err := addUsage(trans, repoID, size-oldSize.Int64); err != nil {
+		trans.Rollback()
+		return err
+	}
+
 	var exist int
 	sqlStr = "SELECT 1 FROM RepoFileCount WHERE repo_id=?"
 	row = trans.QueryRow(sqlStr, repoID)
@@ -0,0 +1,44 @@
+package main
+
+import (
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/workerpool"
+)
+
+func TestSizeJobCoalescing(t *testing.T) {
+	const repoID = "11111111-2222-3333-4444-555555555555"
+
+	started := make(chan string, 10)
+	saved := updateSizePool
+	defer func() { updateSizePool = saved }()
+	updateSizePool = workerpool.CreateWorkerPool(func(args ...interface{}) error {
+		started <- args[0].(string)
+		return nil
+	}, 1)
+
+	if !pushSizeJob(repoID, workerpool.PriorityNormal) {
+		t.Fatalf("first job was not queued")
+	}
+	for i := 0; i < 5; i++ {
+		if pushSizeJob(repoID, workerpool.PriorityNormal) {
+			t.Errorf("job %d was queued while one is pending", i)
+		}
+	}
+
+	if id := <-started; id != repoID {
+		t.Fatalf("started job of %s", id)
+	}
+	startSizeJob(repoID)
+	if !pushSizeJob(repoID, workerpool.PriorityNormal) {
+		t.Errorf("job was not queued after the pending one started")
+	}
+	<-started
+	startSizeJob(repoID)
+
+	select {
+	case id := <-started:
+		t.Errorf("unexpected job of %s", id)
+	default:
+	}
+}
@@ -2,13 +2,16 @@ package main
 
 import (
 	"bytes"
+	"compress/gzip"
 	"context"
 	"database/sql"
 	"encoding/binary"
 	"encoding/json"
 	"fmt"
 	"html"
+	"io"
 	"io/ioutil"
+	"math"
 	"net"
 	"net/http"
 	"strconv"
@@ -95,6 +98,10 @@ func syncAPIInit() {
 	})
 
 	calFsIdPool = workerpool.CreateWorkerPool(getFsId, fsIdWorkers)
+	fsIDLists = newFsIDListCache(options.fsIDListCacheSize)
+	headCommits = newHeadCommitCache(options.headCommitCacheTTL)
+	permEventsInit()
+	eventBatchInit()
 }
 
 type calResult struct {
@@ -154,30 +161,36 @@ func getFsId(args ...interface{}) error {
 		resChan <- &calResult{user, appErr}
 		return nil
 	}
-	ret, err := calculateSendObjectList(r.Context(), repo, serverHead, clientHead, dirOnly)
+	key := fmt.Sprintf("%s/%s/%s/%t", repo.ID, serverHead, clientHead, dirOnly)
+	if queries.Get("stream") != "" {
+		if _, ok := fsIDLists.lookup(key); !ok {
+			w := newReplyStream(rsp, r)
+			appErr := streamSendObjectList(r.Context(), w, repo, serverHead, clientHead, dirOnly)
+			if appErr == nil && w.Close() != nil {
+				appErr = errStreamAborted
+			}
+			resChan <- &calResult{user, appErr}
+			return nil
+		}
+	}
+	objList, err := fsIDLists.get(r.Context(), key, func(ctx context.Context) ([]byte, error) {
+		ret, err := calculateSendObjectList(ctx, repo, serverHead, clientHead, dirOnly)
+		if err != nil {
+			return nil, fmt.Errorf("Failed to get fs id list: %v", err)
+		}
+		if ret == nil {
+			// when get obj list is nil, return []
+			return []byte{'[', ']'}, nil
+		}
+		return json.Marshal(ret)
+	})
 	if err != nil {
-		err := fmt.Errorf("Failed to get fs id list: %v", err)
 		appErr := &appError{err, "", http.StatusInternalServerError}
 		resChan <- &calResult{user, appErr}
 		return nil
 	}
 
-	var objList []byte
-	if ret != nil {
-		objList, err = json.Marshal(ret)
-		if err != nil {
-			appErr := &appError{err, "", http.StatusInternalServerError}
-			resChan <- &calResult{user, appErr}
-			return nil
-		}
-	} else {
-		// when get obj list is nil, return []
-		objList = []byte{'[', ']'}
-	}
-
-	rsp.Header().Set("Content-Length", strconv.Itoa(len(objList)))
-	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(objList)
+	writeReply(rsp, r, objList)
 
 	resChan <- &calResult{user, nil}
 
@@ -291,18 +304,14 @@ func getBlockMapCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{nil, msg, http.StatusNotFound}
 	}
 
-	var blockSizes []int64
-	for _, blockID := range seafile.BlkIDs {
-		blockSize, err := blockmgr.Stat(storeID, blockID)
-		if err != nil {
-			err := fmt.Errorf("Failed to find block %s/%s", storeID, blockID)
-			return &appError{err, "", http.StatusInternalServerError}
-		}
-		blockSizes = append(blockSizes, blockSize)
+	blkMap, err := getBlockMap(storeID, seafile)
+	if err != nil {
+		return &appError{err, "", http.StatusInternalServerError}
 	}
+	blockSizes := blkMap.blkSize
 
 	var data []byte
-	if blockSizes != nil {
+	if len(blockSizes) > 0 {
 		data, err = json.Marshal(blockSizes)
 		if err != nil {
 			err := fmt.Errorf("Failed to marshal json: %v", err)
@@ -312,9 +321,7 @@ func getBlockMapCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		data = []byte{'[', ']'}
 	}
 
-	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
-	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data)
+	writeReply(rsp, r, data)
 
 	return nil
 }
@@ -333,71 +340,10 @@ func getAccessibleRepoListCB(rsp http.ResponseWriter, r *http.Request) *appError
 		return appErr
 	}
 
-	obtainedRepos := make(map[string]string)
-
-	repos, err := share.GetReposByOwner(user)
-	if err != nil {
-		err := fmt.Errorf("Failed to get repos by owner %s: %v", user, err)
-		return &appError{err, "", http.StatusInternalServerError}
-	}
-
-	var repoObjects []*share.SharedRepo
-	for _, repo := range repos {
-		if _, ok := obtainedRepos[repo.ID]; !ok {
-			obtainedRepos[repo.ID] = repo.ID
-		}
-		repo.Permission = "rw"
-		repo.Type = "repo"
-		repo.Owner = user
-		repoObjects = append(repoObjects, repo)
-	}
-
-	repos, err = share.ListShareRepos(user, "to_email")
-	if err != nil {
-		err := fmt.Errorf("Failed to get share repos by user %s: %v", user, err)
-		return &appError{err, "", http.StatusInternalServerError}
-	}
-	for _, sRepo := range repos {
-		if _, ok := obtainedRepos[sRepo.ID]; ok {
-			continue
-		}
-		sRepo.Type = "srepo"
-		sRepo.Owner = strings.ToLower(sRepo.Owner)
-		repoObjects = append(repoObjects, sRepo)
-	}
-
-	repos, err = share.GetGroupReposByUser(user, -1)
+	repoObjects, err := getAccessibleRepos(user)
 	if err != nil {
-		err := fmt.Errorf("Failed to get group repos by user %s: %v", user, err)
 		return &appError{err, "", http.StatusInternalServerError}
 	}
-	reposTable := filterGroupRepos(repos)
-
-	for _, gRepo := range reposTable {
-		if _, ok := obtainedRepos[gRepo.ID]; ok {
-			continue
-		}
-
-		gRepo.Type = "grepo"
-		gRepo.Owner = strings.ToLower(gRepo.Owner)
-		repoObjects = append(repoObjects, gRepo)
-	}
-
-	repos, err = share.ListInnerPubRepos()
-	if err != nil {
-		err := fmt.Errorf("Failed to get inner public repos: %v", err)
-		return &appError{err, "", http.StatusInternalServerError}
-	}
-
-	for _, sRepo := range repos {
-		if _, ok := obtainedRepos[sRepo.ID]; ok {
-			continue
-		}
-
-		sRepo.Type = "grepo"
-		sRepo.Owner = "Organization"
-		repoObjects = append(repoObjects, sRepo)
-	}
 
 	var data []byte
 	if repoObjects != nil {
@@ -409,9 +355,19 @@ func getAccessibleRepoListCB(rsp http.ResponseWriter, r *http.Request) *appError
 	} else {
 		data = []byte{'[', ']'}
 	}
-	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
-	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data)
+
+	etag := computeETag(data)
+	// The etag of the compressed list is weak, as the bytes differ.
+	if shouldCompress(r, len(data)) {
+		rsp.Header().Set("ETag", "W/"+etag)
+	} else {
+		rsp.Header().Set("ETag", etag)
+	}
+	if etagMatches(r.Header.Get("If-None-Match"), etag) {
+		rsp.WriteHeader(http.StatusNotModified)
+		return nil
+	}
+	writeReply(rsp, r, data)
 	return nil
 }
 
@@ -516,24 +472,45 @@ func postCheckExistCB(rsp http.ResponseWriter, r *http.Request, existType checkE
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
+	body, appErr := requestBody(r)
+	if appErr != nil {
+		return appErr
+	}
 	var objIDList []string
-	if err := json.NewDecoder(r.Body).Decode(&objIDList); err != nil {
+	if err := json.NewDecoder(body).Decode(&objIDList); err != nil {
+		if err == errDecodedBodyTooLarge {
+			return &appError{nil, err.Error(), http.StatusRequestEntityTooLarge}
+		}
 		return &appError{nil, err.Error(), http.StatusBadRequest}
 	}
 
-	var neededObjs []string
-	var ret bool
-	for i := 0; i < len(objIDList); i++ {
-		if !isObjectIDValid(objIDList[i]) {
-			continue
+	var validIDs []string
+	for _, objID := range objIDList {
+		if isObjectIDValid(objID) {
+			validIDs = append(validIDs, objID)
 		}
-		if existType == checkFSExist {
-			ret, _ = fsmgr.Exists(storeID, objIDList[i])
-		} else if existType == checkBlockExist {
-			ret = blockmgr.Exists(storeID, objIDList[i])
+	}
+
+	var exists []bool
+	if existType == checkFSExist {
+		exists, err = fsmgr.ExistsMany(storeID, validIDs)
+	} else {
+		exists, err = blockmgr.ExistsMany(storeID, validIDs)
+	}
+	if err != nil {
+		err := fmt.Errorf("Failed to check objects existence in repo %s: %v", repoID, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	var neededObjs []string
+	for i, objID := range validIDs {
+		// The client won't upload the blocks it's told exist, so they
+		// are reused. See blockmgr.Touch.
+		if exists[i] && existType != checkFSExist && blockmgr.Touch(storeID, objID) != nil {
+			exists[i] = false
 		}
-		if !ret {
-			neededObjs = append(neededObjs, objIDList[i])
+		if !exists[i] {
+			neededObjs = append(neededObjs, objID)
 		}
 	}
 
@@ -547,13 +524,13 @@ func postCheckExistCB(rsp http.ResponseWriter, r *http.Request, existType checkE
 	} else {
 		data = []byte{'[', ']'}
 	}
-	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
-	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data)
+	writeReply(rsp, r, data)
 
 	return nil
 }
 
+// packFSCB streams the fs objects of a json id list, compressed with gzip
+// if the client accepts it. The client asks for the rest in another request.
 func packFSCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	vars := mux.Vars(r)
 	repoID := vars["repoid"]
@@ -578,56 +555,308 @@ func packFSCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{nil, err.Error(), http.StatusBadRequest}
 	}
 
-	var totalSize int
-	var data bytes.Buffer
-	for i := 0; i < len(fsIDList); i++ {
-		if !isObjectIDValid(fsIDList[i]) {
-			msg := fmt.Sprintf("Invalid fs id %s", fsIDList[i])
+	for _, fsID := range fsIDList {
+		if !isObjectIDValid(fsID) {
+			msg := fmt.Sprintf("Invalid fs id %s", fsID)
 			return &appError{nil, msg, http.StatusBadRequest}
 		}
-		data.WriteString(fsIDList[i])
-		var tmp bytes.Buffer
-		if err := fsmgr.ReadRaw(storeID, fsIDList[i], &tmp); err != nil {
-			err := fmt.Errorf("Failed to read fs %s:%s: %v", storeID, fsIDList[i], err)
-			return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	// Objects are sent as they are read, so the reply is chunked.
+	var zw *gzip.Writer
+	var w io.Writer = rsp
+	if acceptsGzip(r) {
+		rsp.Header().Set("Content-Encoding", "gzip")
+		zw = getGzipWriter(rsp)
+		defer gzipWriters.Put(zw)
+		w = zw
+	}
+	rsp.WriteHeader(http.StatusOK)
+
+	err = writeFSFrames(w, storeID, fsIDList)
+	if err == nil && zw != nil {
+		err = zw.Close()
+	}
+	if err != nil {
+		if !isNetworkErr(err) {
+			log.Printf("failed to send fs objects of %s: %v", storeID, err)
 		}
-		tmpLen := make([]byte, 4)
-		binary.BigEndian.PutUint32(tmpLen, uint32(tmp.Len()))
-		data.Write(tmpLen)
-		data.Write(tmp.Bytes())
+		// Drop the connection, so that the client doesn't take the cut
+		// reply for a complete one.
+		panic(http.ErrAbortHandler)
+	}
+	return nil
+}
 
-		totalSize += tmp.Len()
+// writeFSFrames writes the fs objects one by one, each as the 40 bytes id,
+// the object size as 4 bytes in big endian, then the stored object. It stops
+// after maxObjectPackSize bytes of objects.
+func writeFSFrames(w io.Writer, storeID string, fsIDList []string) error {
+	var obj bytes.Buffer
+	hdr := make([]byte, 44)
+	var totalSize int
+	for _, fsID := range fsIDList {
+		obj.Reset()
+		if err := fsmgr.ReadRaw(storeID, fsID, &obj); err != nil {
+			err := fmt.Errorf("failed to read fs %s:%s: %v", storeID, fsID, err)
+			return err
+		}
+		copy(hdr, fsID)
+		binary.BigEndian.PutUint32(hdr[40:], uint32(obj.Len()))
+		if _, err := w.Write(hdr); err != nil {
+			return err
+		}
+		if _, err := w.Write(obj.Bytes()); err != nil {
+			return err
+		}
+
+		totalSize += obj.Len()
 		if totalSize >= maxObjectPackSize {
 			break
 		}
 	}
+	return nil
+}
+
+// Blocks are transferred in batches framed like fs objects in pack-fs and
+// recv-fs: the 40 bytes block id, the block size as 4 bytes in big endian,
+// then the content. A batch body is at most maxBlockBatchSize bytes, except
+// that a single block larger than that is still sent.
+const blockFrameHdrSize = 44
 
-	rsp.Header().Set("Content-Length", strconv.Itoa(data.Len()))
+// packBlocksCB sends the blocks of a json id list that fit in one batch.
+// The client asks for the rest in another request.
+func packBlocksCB(rsp http.ResponseWriter, r *http.Request) *appError {
+	vars := mux.Vars(r)
+	repoID := vars["repoid"]
+
+	user, appErr := validateToken(r, repoID, false)
+	if appErr != nil {
+		return appErr
+	}
+	appErr = checkPermission(repoID, user, "download", false)
+	if appErr != nil {
+		return appErr
+	}
+
+	storeID, err := getRepoStoreID(repoID)
+	if err != nil {
+		err := fmt.Errorf("Failed to get repo store id by repo id %s: %v", repoID, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	var blockIDs []string
+	if err := json.NewDecoder(r.Body).Decode(&blockIDs); err != nil {
+		return &appError{nil, err.Error(), http.StatusBadRequest}
+	}
+	for _, blockID := range blockIDs {
+		if !isObjectIDValid(blockID) {
+			msg := fmt.Sprintf("Invalid block id %s", blockID)
+			return &appError{nil, msg, http.StatusBadRequest}
+		}
+	}
+
+	sizes, total, err := packBlockBatch(storeID, blockIDs, options.maxBlockBatchSize)
+	if err != nil {
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	rsp.Header().Set("Content-Length", strconv.FormatInt(total, 10))
 	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data.Bytes())
+	w := limitWriter(r.Context(), rsp, user, repoID)
+	if err := writeBlockFrames(w, storeID, blockIDs, sizes); err != nil {
+		if !isNetworkErr(err) {
+			log.Printf("failed to send blocks of %s: %v", storeID, err)
+		}
+		return nil
+	}
+
+	sendStatisticMsg(storeID, user, "sync-file-download", uint64(total))
 	return nil
 }
 
-func headCommitsMultiCB(rsp http.ResponseWriter, r *http.Request) *appError {
-	var repoIDList []string
-	if err := json.NewDecoder(r.Body).Decode(&repoIDList); err != nil {
-		return &appError{err, "", http.StatusBadRequest}
+// packBlockBatch returns the sizes of the leading blocks that fit in a batch
+// of limit bytes, and the size of the batch body.
+func packBlockBatch(storeID string, blockIDs []string, limit int64) ([]int64, int64, error) {
+	var sizes []int64
+	var total int64
+	for _, blockID := range blockIDs {
+		size, err := blockmgr.Stat(storeID, blockID)
+		if err != nil {
+			err := fmt.Errorf("failed to stat block %.8s:%s: %v", storeID, blockID, err)
+			return nil, 0, err
+		}
+		if size <= 0 || size > math.MaxUint32 {
+			err := fmt.Errorf("block %.8s:%s size invalid", storeID, blockID)
+			return nil, 0, err
+		}
+		sizes = append(sizes, size)
+		total += blockFrameHdrSize + size
+		if total >= limit {
+			break
+		}
 	}
-	if len(repoIDList) == 0 {
-		return &appError{nil, "", http.StatusBadRequest}
+	return sizes, total, nil
+}
+
+// writeBlockFrames streams the blocks one by one, without reading a whole
+// batch into memory. Blocks in local files are sent with sendfile.
+func writeBlockFrames(w io.Writer, storeID string, blockIDs []string, sizes []int64) error {
+	hdr := make([]byte, blockFrameHdrSize)
+	for i, size := range sizes {
+		copy(hdr, blockIDs[i])
+		binary.BigEndian.PutUint32(hdr[40:], uint32(size))
+		if err := chargeBlock(w); err != nil {
+			return err
+		}
+		if _, err := w.Write(hdr); err != nil {
+			return err
+		}
+
+		f, err := blockmgr.Open(storeID, blockIDs[i])
+		if err != nil {
+			return err
+		}
+		_, err = io.CopyN(w, f, size)
+		f.Close()
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// recvBlocksCB writes the blocks of a batch as they are received.
+func recvBlocksCB(rsp http.ResponseWriter, r *http.Request) *appError {
+	vars := mux.Vars(r)
+	repoID := vars["repoid"]
+
+	user, appErr := validateToken(r, repoID, false)
+	if appErr != nil {
+		return appErr
+	}
+
+	appErr = checkPermission(repoID, user, "upload", false)
+	if appErr != nil {
+		return appErr
 	}
 
+	storeID, err := getRepoStoreID(repoID)
+	if err != nil {
+		err := fmt.Errorf("Failed to get repo store id by repo id %s: %v", repoID, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+
+	// The size is also checked as blocks arrive, for chunked requests.
+	if r.ContentLength > options.maxBlockBatchSize {
+		msg := "Block batch is too large"
+		return &appError{nil, msg, http.StatusRequestEntityTooLarge}
+	}
+
+	body := limitReadCloser(r.Context(), r.Body, user, repoID)
+	total, appErr := recvBlockFrames(storeID, body, options.maxBlockBatchSize)
+	if appErr != nil {
+		return appErr
+	}
+
+	sendStatisticMsg(storeID, user, "sync-file-upload", uint64(total))
+	rsp.WriteHeader(http.StatusOK)
+	return nil
+}
+
+func recvBlockFrames(storeID string, r io.Reader, limit int64) (int64, *appError) {
+	hdr := make([]byte, blockFrameHdrSize)
+	var total int64
+	for {
+		if _, err := io.ReadFull(r, hdr); err != nil {
+			if err == io.EOF && total > 0 {
+				return total, nil
+			}
+			msg := "Request body size invalid"
+			return 0, &appError{nil, msg, http.StatusBadRequest}
+		}
+
+		blockID := string(hdr[:40])
+		if !isObjectIDValid(blockID) {
+			msg := fmt.Sprintf("Block id %s is invalid", blockID)
+			return 0, &appError{nil, msg, http.StatusBadRequest}
+		}
+		size := int64(binary.BigEndian.Uint32(hdr[40:]))
+		if size == 0 {
+			msg := fmt.Sprintf("Block %s is empty", blockID)
+			return 0, &appError{nil, msg, http.StatusBadRequest}
+		}
+		total += blockFrameHdrSize + size
+		if total > limit {
+			msg := "Block batch is too large"
+			return 0, &appError{nil, msg, http.StatusRequestEntityTooLarge}
+		}
+		if err := chargeBlock(r); err != nil {
+			return 0, &appError{nil, err.Error(), http.StatusBadRequest}
+		}
+
+		body := &blockFrameReader{r: r, n: size}
+		if err := blockmgr.Write(storeID, blockID, body); err != nil {
+			if body.err != nil {
+				return 0, &appError{nil, body.err.Error(), http.StatusBadRequest}
+			}
+			err := fmt.Errorf("Failed to write block %.8s:%s: %v", storeID, blockID, err)
+			return 0, &appError{err, "", http.StatusInternalServerError}
+		}
+	}
+}
+
+// blockFrameReader reads the content of one block from a batch. A batch that
+// ends early is an error, so that a truncated block is never stored.
+type blockFrameReader struct {
+	r   io.Reader
+	n   int64
+	err error
+}
+
+func (f *blockFrameReader) Read(p []byte) (int, error) {
+	if f.n <= 0 {
+		return 0, io.EOF
+	}
+	if int64(len(p)) > f.n {
+		p = p[:f.n]
+	}
+	n, err := f.r.Read(p)
+	f.n -= int64(n)
+	if err == io.EOF {
+		if f.n > 0 {
+			err = io.ErrUnexpectedEOF
+		} else {
+			err = nil
+		}
+	}
+	if err != nil {
+		f.err = err
+	}
+	return n, err
+}
+
+// getHeadCommitIDs returns the head commits of the repos, which must have
+// valid ids. Only heads that are not cached are read from the database.
+func getHeadCommitIDs(repoIDList []string) (map[string]string, error) {
+	commitIDMap := make(map[string]string)
 	var repoIDs strings.Builder
-	for i := 0; i < len(repoIDList); i++ {
-		if !isValidUUID(repoIDList[i]) {
-			return &appError{nil, "", http.StatusBadRequest}
+	for _, repoID := range repoIDList {
+		if commitID, ok := headCommits.get(repoID); ok {
+			commitIDMap[repoID] = commitID
+			continue
 		}
-		if i == 0 {
-			repoIDs.WriteString(fmt.Sprintf("'%s'", repoIDList[i]))
+		if repoIDs.Len() == 0 {
+			repoIDs.WriteString(fmt.Sprintf("'%s'", repoID))
 		} else {
-			repoIDs.WriteString(fmt.Sprintf(",'%s'", repoIDList[i]))
+			repoIDs.WriteString(fmt.Sprintf(",'%s'", repoID))
 		}
 	}
+	if repoIDs.Len() == 0 {
+		return commitIDMap, nil
+	}
+
+	gen := headCommits.generation()
 
 	sqlStr := fmt.Sprintf(
 		"SELECT repo_id, commit_id FROM Branch WHERE name='master' AND "+
@@ -637,22 +866,48 @@ func headCommitsMultiCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	rows, err := seafileDB.Query(sqlStr)
 	if err != nil {
 		err := fmt.Errorf("Failed to get commit id: %v", err)
-		return &appError{err, "", http.StatusInternalServerError}
+		return nil, err
 	}
 
 	defer rows.Close()
 
-	commitIDMap := make(map[string]string)
+	fetched := make(map[string]string)
 	var repoID string
 	var commitID string
 	for rows.Next() {
 		if err := rows.Scan(&repoID, &commitID); err == nil {
-			commitIDMap[repoID] = commitID
+			fetched[repoID] = commitID
 		}
 	}
 
 	if err := rows.Err(); err != nil {
 		err := fmt.Errorf("Failed to get commit id: %v", err)
+		return nil, err
+	}
+	headCommits.add(gen, fetched)
+	for repoID, commitID := range fetched {
+		commitIDMap[repoID] = commitID
+	}
+	return commitIDMap, nil
+}
+
+func headCommitsMultiCB(rsp http.ResponseWriter, r *http.Request) *appError {
+	var repoIDList []string
+	if err := json.NewDecoder(r.Body).Decode(&repoIDList); err != nil {
+		return &appError{err, "", http.StatusBadRequest}
+	}
+	if len(repoIDList) == 0 {
+		return &appError{nil, "", http.StatusBadRequest}
+	}
+
+	for i := 0; i < len(repoIDList); i++ {
+		if !isValidUUID(repoIDList[i]) {
+			return &appError{nil, "", http.StatusBadRequest}
+		}
+	}
+
+	commitIDMap, err := getHeadCommitIDs(repoIDList)
+	if err != nil {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
@@ -662,9 +917,7 @@ func headCommitsMultiCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	rsp.Header().Set("Content-Length", strconv.Itoa(len(data)))
-	rsp.WriteHeader(http.StatusOK)
-	rsp.Write(data)
+	writeReply(rsp, r, data)
 
 	return nil
 }
@@ -712,8 +965,18 @@ func isValidUUID(u string) bool {
 func getFsObjIDCB(rsp http.ResponseWriter, r *http.Request) *appError {
 	recvChan := make(chan *calResult)
 
-	calFsIdPool.AddTask(recvChan, rsp, r)
+	// Clients retry a failed sync, so a busy server turns them away instead
+	// of holding their requests.
+	if err := calFsIdPool.Submit(workerpool.PriorityNormal, recvChan, rsp, r); err != nil {
+		rsp.Header().Set("Retry-After", "10")
+		return &appError{nil, "Server is busy.\n", http.StatusServiceUnavailable}
+	}
 	result := <-recvChan
+	if result.err == errStreamAborted {
+		// The client can only tell from the dropped connection that the
+		// list is incomplete.
+		panic(http.ErrAbortHandler)
+	}
 	return result.err
 }
 
@@ -765,7 +1028,11 @@ func putSendBlockCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	if err := blockmgr.Write(storeID, blockID, r.Body); err != nil {
+	body := limitReadCloser(r.Context(), r.Body, user, repoID)
+	if err := chargeBlock(body); err != nil {
+		return &appError{nil, err.Error(), http.StatusBadRequest}
+	}
+	if err := blockmgr.Write(storeID, blockID, body); err != nil {
 		err := fmt.Errorf("Failed to close block %.8s:%s", storeID, blockID)
 		return &appError{err, "", http.StatusInternalServerError}
 	}
@@ -807,7 +1074,11 @@ func getBlockInfo(rsp http.ResponseWriter, r *http.Request) *appError {
 
 	blockLen := fmt.Sprintf("%d", blockSize)
 	rsp.Header().Set("Content-Length", blockLen)
-	if err := blockmgr.Read(storeID, blockID, rsp); err != nil {
+	w := limitWriter(r.Context(), rsp, user, repoID)
+	if err := chargeBlock(w); err != nil {
+		return nil
+	}
+	if err := blockmgr.Read(storeID, blockID, w); err != nil {
 		if !isNetworkErr(err) {
 			log.Printf("failed to read block %s: %v", blockID, err)
 		}
@@ -836,14 +1107,27 @@ func getRepoStoreID(repoID string) (string, error) {
 	}
 
 	var vInfo virtualRepoInfo
+	// The store of a virtual repo or a fork never changes.
+	key := "seaf:storeid:" + repoID
+	if value, ok := clusterCache.Get(key); ok && isValidUUID(string(value)) {
+		vInfo.storeID = string(value)
+		vInfo.expireTime = time.Now().Unix() + virtualRepoExpireTime
+		virtualRepoInfoCache.Store(repoID, &vInfo)
+		return vInfo.storeID, nil
+	}
+
 	var rID, originRepoID sql.NullString
-	sqlStr := "SELECT repo_id, origin_repo FROM VirtualRepo where repo_id = ?"
-	row := seafileDB.QueryRow(sqlStr, repoID)
+	// Forks are never virtual, so at most one row is returned.
+	sqlStr := "SELECT v.repo_id, COALESCE(f.store_id, v.origin_repo) FROM VirtualRepo v " +
+		"LEFT JOIN ForkedRepo f ON f.repo_id = v.origin_repo WHERE v.repo_id = ? " +
+		"UNION ALL SELECT repo_id, store_id FROM ForkedRepo WHERE repo_id = ?"
+	row := seafileDB.QueryRow(sqlStr, repoID, repoID)
 	if err := row.Scan(&rID, &originRepoID); err != nil {
 		if err == sql.ErrNoRows {
 			vInfo.storeID = repoID
 			vInfo.expireTime = time.Now().Unix() + virtualRepoExpireTime
 			virtualRepoInfoCache.Store(repoID, &vInfo)
+			clusterCache.Set(key, []byte(repoID))
 			return repoID, nil
 		}
 		return "", err
@@ -856,6 +1140,7 @@ func getRepoStoreID(repoID string) (string, error) {
 	vInfo.storeID = originRepoID.String
 	vInfo.expireTime = time.Now().Unix() + virtualRepoExpireTime
 	virtualRepoInfoCache.Store(repoID, &vInfo)
+	clusterCache.Set(key, []byte(vInfo.storeID))
 	return originRepoID.String, nil
 }
 
@@ -866,12 +1151,7 @@ func sendStatisticMsg(repoID, user, operation string, bytes uint64) {
 }
 
 func publishStatusEvent(rData *statusEventData) {
-	buf := fmt.Sprintf("%s\t%s\t%s\t%d",
-		rData.eType, rData.user,
-		rData.repoID, rData.bytes)
-	if _, err := rpcclient.Call("publish_event", seafileServerChannelStats, buf); err != nil {
-		log.Printf("Failed to publish event: %v", err)
-	}
+	pendingEvents.addStats(rData)
 }
 
 func putCommitCB(rsp http.ResponseWriter, r *http.Request) *appError {
@@ -995,9 +1275,9 @@ func putUpdateBranchCB(rsp http.ResponseWriter, r *http.Request) *appError {
 		return &appError{err, "", http.StatusInternalServerError}
 	}
 
-	go mergeVirtualRepoPool.AddTask(repoID, "")
+	go scheduleMergeVirtualRepo(repoID, "")
 
-	go updateSizePool.AddTask(repoID)
+	go scheduleRepoSizeComputation(repoID)
 
 	rsp.WriteHeader(http.StatusOK)
 	return nil
@@ -1006,6 +1286,16 @@ func putUpdateBranchCB(rsp http.ResponseWriter, r *http.Request) *appError {
 func getHeadCommit(rsp http.ResponseWriter, r *http.Request) *appError {
 	vars := mux.Vars(r)
 	repoID := vars["repoid"]
+	if commitID, ok := headCommits.get(repoID); ok {
+		if _, err := validateToken(r, repoID, false); err != nil {
+			return err
+		}
+		msg := fmt.Sprintf("{\"is_corrupted\": 0, \"head_commit_id\": \"%s\"}", commitID)
+		rsp.WriteHeader(http.StatusOK)
+		rsp.Write([]byte(msg))
+		return nil
+	}
+
 	sqlStr := "SELECT EXISTS(SELECT 1 FROM Repo WHERE repo_id=?)"
 	var exists bool
 	row := seafileDB.QueryRow(sqlStr, repoID)
@@ -1027,6 +1317,7 @@ func getHeadCommit(rsp http.ResponseWriter, r *http.Request) *appError {
 	}
 
 	var commitID string
+	gen := headCommits.generation()
 	sqlStr = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?"
 	row = seafileDB.QueryRow(sqlStr, repoID)
 
@@ -1042,6 +1333,7 @@ func getHeadCommit(rsp http.ResponseWriter, r *http.Request) *appError {
 	if commitID == "" {
 		return &appError{nil, "", http.StatusBadRequest}
 	}
+	headCommits.add(gen, map[string]string{repoID: commitID})
 
 	msg := fmt.Sprintf("{\"is_corrupted\": 0, \"head_commit_id\": \"%s\"}", commitID)
 	rsp.WriteHeader(http.StatusOK)
@@ -1196,9 +1488,7 @@ func publishRepoEvent(rData *repoEventData) {
 	buf := fmt.Sprintf("%s\t%s\t%s\t%s\t%s\t%s",
 		rData.eType, rData.user, rData.ip,
 		rData.clientName, rData.repoID, rData.path)
-	if _, err := rpcclient.Call("publish_event", seafileServerChannelEvent, buf); err != nil {
-		log.Printf("Failed to publish event: %v", err)
-	}
+	pendingEvents.addRepoEvent(buf)
 }
 
 func publishUpdateEvent(repoID string, commitID string) {
@@ -1239,6 +1529,8 @@ func removeSyncAPIExpireCache() {
 	tokenCache.Range(deleteTokens)
 	permCache.Range(deletePerms)
 	virtualRepoInfoCache.Range(deleteVirtualRepoInfo)
+	headUpdates.expire(time.Now().Add(-(maxHeadCommitsWait + time.Minute)))
+	headCommits.expire()
 }
 
 func calculateSendObjectList(ctx context.Context, repo *repomgr.Repo, serverHead string, clientHead string, dirOnly bool) ([]interface{}, error) {
@@ -1279,6 +1571,9 @@ func calculateSendObjectList(ctx context.Context, repo *repomgr.Repo, serverHead
 			RepoID: repo.StoreID}
 		opt.Data = &results
 	}
+	opt.Workers = options.maxDiffThreads
+	opt.NewData = newIDList
+	opt.MergeData = mergeIDLists
 	trees := []string{masterHead.RootID, remoteHeadRoot}
 
 	if err := diff.DiffTrees(trees, opt); err != nil {
@@ -1287,6 +1582,132 @@ func calculateSendObjectList(ctx context.Context, repo *repomgr.Repo, serverHead
 	return results, nil
 }
 
+// A streamed fs id list is written out while the trees are diffed, at most
+// idStreamBatch ids at a time, instead of being computed into memory first.
+// Streamed lists aren't cached, as holding them is what streaming avoids.
+
+const idStreamBatch = 1024
+
+var errStreamAborted = &appError{nil, "", http.StatusInternalServerError}
+
+type idStream struct {
+	ids     []interface{}
+	w       io.Writer
+	started bool
+}
+
+func (s *idStream) flush() error {
+	var buf bytes.Buffer
+	for _, id := range s.ids {
+		if !s.started {
+			buf.WriteByte('[')
+			s.started = true
+		} else {
+			buf.WriteByte(',')
+		}
+		buf.WriteByte('"')
+		buf.WriteString(id.(string))
+		buf.WriteByte('"')
+	}
+	s.ids = s.ids[:0]
+	if _, err := s.w.Write(buf.Bytes()); err != nil {
+		return err
+	}
+	if f, ok := s.w.(http.Flusher); ok {
+		f.Flush()
+	}
+	return nil
+}
+
+func (s *idStream) finish() error {
+	if err := s.flush(); err != nil {
+		return err
+	}
+	if !s.started {
+		_, err := s.w.Write([]byte("[]"))
+		return err
+	}
+	_, err := s.w.Write([]byte{']'})
+	return err
+}
+
+func streamFileIDs(ctx context.Context, baseDir string, files []*fsmgr.SeafDirent, data interface{}) error {
+	s := data.(*idStream)
+	if err := collectFileIDs(ctx, baseDir, files, &s.ids); err != nil {
+		return err
+	}
+	if len(s.ids) >= idStreamBatch {
+		return s.flush()
+	}
+	return nil
+}
+
+func streamDirIDs(ctx context.Context, baseDir string, dirs []*fsmgr.SeafDirent, data interface{}, recurse *bool) error {
+	s := data.(*idStream)
+	if err := collectDirIDs(ctx, baseDir, dirs, &s.ids, recurse); err != nil {
+		return err
+	}
+	if len(s.ids) >= idStreamBatch {
+		return s.flush()
+	}
+	return nil
+}
+
+func streamSendObjectList(ctx context.Context, w io.Writer, repo *repomgr.Repo, serverHead string, clientHead string, dirOnly bool) *appError {
+	masterHead, err := commitmgr.Load(repo.ID, serverHead)
+	if err != nil {
+		err := fmt.Errorf("Failed to load server head commit %s:%s: %v", repo.ID, serverHead, err)
+		return &appError{err, "", http.StatusInternalServerError}
+	}
+	remoteHeadRoot := emptySHA1
+	if clientHead != "" {
+		remoteHead, err := commitmgr.Load(repo.ID, clientHead)
+		if err != nil {
+			err := fmt.Errorf("Failed to load remote head commit %s:%s: %v", repo.ID, clientHead, err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		remoteHeadRoot = remoteHead.RootID
+	}
+
+	s := &idStream{w: w}
+	if remoteHeadRoot != masterHead.RootID && masterHead.RootID != emptySHA1 {
+		s.ids = append(s.ids, masterHead.RootID)
+	}
+
+	opt := &diff.DiffOptions{
+		FileCB: streamFileIDs,
+		DirCB:  streamDirIDs,
+		Ctx:    ctx,
+		RepoID: repo.StoreID,
+		Data:   s,
+	}
+	if dirOnly {
+		opt.FileCB = collectFileIDsNOp
+	}
+	trees := []string{masterHead.RootID, remoteHeadRoot}
+	if err := diff.DiffTrees(trees, opt); err != nil {
+		if !s.started {
+			err := fmt.Errorf("Failed to get fs id list: %v", err)
+			return &appError{err, "", http.StatusInternalServerError}
+		}
+		log.Printf("Failed to stream fs id list of repo %.8s: %v", repo.ID, err)
+		return errStreamAborted
+	}
+	if err := s.finish(); err != nil {
+		return errStreamAborted
+	}
+	return nil
+}
+
+func newIDList() interface{} {
+	return new([]interface{})
+}
+
+func mergeIDLists(data, part interface{}) {
+	results := data.(*[]interface{})
+	*results = append(*results, *part.(*[]interface{})...)
+}
+
 func collectFileIDs(ctx context.Context, baseDir string, files []*fsmgr.SeafDirent, data interface{}) error {
 	select {
 	case <-ctx.Done():
@@ -0,0 +1,202 @@
+package main
+
+import (
+	"bytes"
+	"compress/gzip"
+	"crypto/sha1"
+	"encoding/binary"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+const blockBatchTestStoreID = "1b2c3d4e-5678-8765-dcba-ba9876543210"
+
+func makeBlockFrame(content []byte) (string, []byte) {
+	sum := sha1.Sum(content)
+	blockID := hex.EncodeToString(sum[:])
+	frame := make([]byte, blockFrameHdrSize, blockFrameHdrSize+len(content))
+	copy(frame, blockID)
+	binary.BigEndian.PutUint32(frame[40:], uint32(len(content)))
+	return blockID, append(frame, content...)
+}
+
+func TestBlockBatch(t *testing.T) {
+	dir, err := ioutil.TempDir("", "blockbatch")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	var body bytes.Buffer
+	var blockIDs []string
+	var contents [][]byte
+	for i, size := range []int{1, 1000, 5000} {
+		content := bytes.Repeat([]byte{byte('a' + i)}, size)
+		blockID, frame := makeBlockFrame(content)
+		blockIDs = append(blockIDs, blockID)
+		contents = append(contents, content)
+		body.Write(frame)
+	}
+	batch := body.Bytes()
+
+	total, appErr := recvBlockFrames(blockBatchTestStoreID, bytes.NewReader(batch), int64(len(batch)))
+	if appErr != nil {
+		t.Fatalf("failed to receive blocks: %v %s", appErr.Error, appErr.Message)
+	}
+	if total != int64(len(batch)) {
+		t.Errorf("received %d bytes, expected %d", total, len(batch))
+	}
+	for i, blockID := range blockIDs {
+		var buf bytes.Buffer
+		if err := blockmgr.Read(blockBatchTestStoreID, blockID, &buf); err != nil ||
+			!bytes.Equal(buf.Bytes(), contents[i]) {
+			t.Errorf("block %d was not written correctly", i)
+		}
+	}
+
+	// The batch is sent back in the same format.
+	sizes, size, err := packBlockBatch(blockBatchTestStoreID, blockIDs, 1<<20)
+	if err != nil || size != int64(len(batch)) || len(sizes) != len(blockIDs) {
+		t.Fatalf("failed to pack blocks: %v", err)
+	}
+	var packed bytes.Buffer
+	if err := writeBlockFrames(&packed, blockBatchTestStoreID, blockIDs, sizes); err != nil {
+		t.Fatalf("failed to write blocks: %v", err)
+	}
+	if !bytes.Equal(packed.Bytes(), batch) {
+		t.Errorf("packed blocks don't match the received batch")
+	}
+
+	// Blocks after the limit are left for another batch.
+	sizes, _, err = packBlockBatch(blockBatchTestStoreID, blockIDs, blockFrameHdrSize+2)
+	if err != nil || len(sizes) != 2 {
+		t.Errorf("got %d blocks in a limited batch, expected 2", len(sizes))
+	}
+
+	_, frame := makeBlockFrame([]byte("truncated block"))
+	truncated := frame[:len(frame)-1]
+	if _, appErr := recvBlockFrames(blockBatchTestStoreID, bytes.NewReader(truncated), 1<<20); appErr == nil ||
+		appErr.Code != http.StatusBadRequest {
+		t.Errorf("accepted a truncated batch")
+	}
+	sum := sha1.Sum([]byte("truncated block"))
+	if blockmgr.Exists(blockBatchTestStoreID, hex.EncodeToString(sum[:])) {
+		t.Errorf("stored a truncated block")
+	}
+
+	if _, appErr := recvBlockFrames(blockBatchTestStoreID, bytes.NewReader(batch), 100); appErr == nil ||
+		appErr.Code != http.StatusRequestEntityTooLarge {
+		t.Errorf("accepted a batch over the limit")
+	}
+}
+
+func TestPackFS(t *testing.T) {
+	dir, err := ioutil.TempDir("", "packfs")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	fsmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	var fsIDs []string
+	var expected bytes.Buffer
+	for i := 0; i < 3; i++ {
+		blockID := fmt.Sprintf("%040d", i)
+		file, err := fsmgr.NewSeafile(1, int64(i+1), []string{blockID})
+		if err != nil {
+			t.Fatalf("failed to new seafile: %v", err)
+		}
+		if err := fsmgr.SaveSeafile(blockBatchTestStoreID, file); err != nil {
+			t.Fatalf("failed to save seafile: %v", err)
+		}
+		var obj bytes.Buffer
+		if err := fsmgr.ReadRaw(blockBatchTestStoreID, file.FileID, &obj); err != nil {
+			t.Fatalf("failed to read seafile: %v", err)
+		}
+		frame := make([]byte, 44)
+		copy(frame, file.FileID)
+		binary.BigEndian.PutUint32(frame[40:], uint32(obj.Len()))
+		expected.Write(frame)
+		expected.Write(obj.Bytes())
+		fsIDs = append(fsIDs, file.FileID)
+	}
+
+	var packed bytes.Buffer
+	zw := getGzipWriter(&packed)
+	if err := writeFSFrames(zw, blockBatchTestStoreID, fsIDs); err != nil {
+		t.Fatalf("failed to write fs objects: %v", err)
+	}
+	if err := zw.Close(); err != nil {
+		t.Fatalf("failed to close gzip writer: %v", err)
+	}
+	zr, err := gzip.NewReader(&packed)
+	if err != nil {
+		t.Fatalf("failed to read gzip stream: %v", err)
+	}
+	unpacked, err := ioutil.ReadAll(zr)
+	if err != nil || !bytes.Equal(unpacked, expected.Bytes()) {
+		t.Errorf("packed fs objects don't match the stored ones: %v", err)
+	}
+
+	missing := append(fsIDs, fmt.Sprintf("%040d", 9))
+	if err := writeFSFrames(ioutil.Discard, blockBatchTestStoreID, missing); err == nil {
+		t.Errorf("packed a missing fs object")
+	}
+
+	for header, accepts := range map[string]bool{
+		"":                  false,
+		"gzip":              true,
+		"deflate, gzip":     true,
+		"gzip;q=0.5, br":    true,
+		"gzip; q=0":         false,
+		"x-gzip, identity":  false,
+		"identity;q=1,gzip": true,
+	} {
+		r, _ := http.NewRequest("POST", "/", nil)
+		r.Header.Set("Accept-Encoding", header)
+		if acceptsGzip(r) != accepts {
+			t.Errorf("acceptsGzip(%q) != %v", header, accepts)
+		}
+	}
+}
+
+func TestIDStream(t *testing.T) {
+	var buf bytes.Buffer
+	s := &idStream{w: &buf}
+	if err := s.finish(); err != nil || buf.String() != "[]" {
+		t.Errorf("empty stream is %q, %v", buf.String(), err)
+	}
+
+	buf.Reset()
+	s = &idStream{w: &buf}
+	var expected []string
+	for i := 0; i < idStreamBatch+10; i++ {
+		id := fmt.Sprintf("%040x", i)
+		expected = append(expected, id)
+		s.ids = append(s.ids, id)
+		if len(s.ids) >= idStreamBatch {
+			s.flush()
+		}
+	}
+	if err := s.finish(); err != nil {
+		t.Fatalf("failed to finish stream: %v", err)
+	}
+
+	var ids []string
+	if err := json.Unmarshal(buf.Bytes(), &ids); err != nil {
+		t.Fatalf("invalid json %q: %v", buf.String(), err)
+	}
+	if len(ids) != len(expected) || ids[0] != expected[0] || ids[len(ids)-1] != expected[len(expected)-1] {
+		t.Errorf("streamed %d ids, expected %d", len(ids), len(expected))
+	}
+}
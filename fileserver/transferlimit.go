@@ -0,0 +1,302 @@
+package main
+
+import (
+	"context"
+	"io"
+	"sync"
+	"time"
+)
+
+// Token buckets of the bytes and block operations of each user and repo,
+// the same as server/transfer-limit.c. A transfer that overdraws a bucket
+// waits until the debt is paid before it moves on, so one bulk transfer
+// can't take the disk and the network from everyone else.
+//
+// With a total bandwidth, every user active in the last seconds gets a
+// share of it proportional to its weight.
+
+const (
+	// Buckets hold up to this many seconds of their rate.
+	transferBurst = time.Second
+	// Users that transferred in this window share the total bandwidth.
+	transferActiveWindow  = 2 * time.Second
+	transferSweepInterval = time.Second
+	// Buckets idle this long are full again and can be dropped.
+	transferIdleTimeout = 60 * time.Second
+	// Writes are charged in chunks of this size, so that the waits stay
+	// short and smooth.
+	transferChunkSize = 64 * 1024
+)
+
+type transferLimits struct {
+	// Per second, 0 means not limited.
+	userRate  float64
+	repoRate  float64
+	totalRate float64
+	userOps   float64
+	repoOps   float64
+	// user -> weight
+	weights map[string]int
+}
+
+func (l *transferLimits) enabled() bool {
+	return l.userRate > 0 || l.repoRate > 0 || l.totalRate > 0 || l.userOps > 0 || l.repoOps > 0
+}
+
+type transferBucket struct {
+	tokens float64
+	last   time.Time
+}
+
+// take returns how long until the bucket is out of debt.
+func (b *transferBucket) take(rate, n float64, now time.Time) time.Duration {
+	if rate <= 0 {
+		return 0
+	}
+
+	burst := rate * transferBurst.Seconds()
+	// New buckets start full.
+	if b.last.IsZero() {
+		b.tokens = burst
+	} else {
+		b.tokens += rate * now.Sub(b.last).Seconds()
+		if b.tokens > burst {
+			b.tokens = burst
+		}
+	}
+	b.last = now
+	b.tokens -= n
+
+	if b.tokens >= 0 {
+		return 0
+	}
+	return time.Duration(-b.tokens / rate * float64(time.Second))
+}
+
+type transferEntry struct {
+	bytes      transferBucket
+	ops        transferBucket
+	weight     int
+	lastActive time.Time
+}
+
+type transferLimiter struct {
+	limits transferLimits
+	now    func() time.Time
+
+	mu    sync.Mutex
+	users map[string]*transferEntry
+	repos map[string]*transferEntry
+	// Sum of the weights of the active users.
+	activeWeight int
+	lastSweep    time.Time
+}
+
+// transferLimit is nil unless a limit is configured.
+var transferLimit *transferLimiter
+
+func newTransferLimiter(limits transferLimits) *transferLimiter {
+	return &transferLimiter{
+		limits: limits,
+		now:    time.Now,
+		users:  make(map[string]*transferEntry),
+		repos:  make(map[string]*transferEntry),
+	}
+}
+
+func transferLimitInit() {
+	limits := options.transferLimits
+	if !limits.enabled() {
+		return
+	}
+	transferLimit = newTransferLimiter(limits)
+}
+
+// Called with the lock held.
+func (l *transferLimiter) sweep(now time.Time) {
+	l.activeWeight = 0
+	for user, e := range l.users {
+		if now.Sub(e.lastActive) >= transferIdleTimeout {
+			delete(l.users, user)
+		} else if now.Sub(e.lastActive) < transferActiveWindow {
+			l.activeWeight += e.weight
+		}
+	}
+	for repoID, e := range l.repos {
+		if now.Sub(e.lastActive) >= transferIdleTimeout {
+			delete(l.repos, repoID)
+		}
+	}
+	l.lastSweep = now
+}
+
+// charge charges bytes and ops block operations to user and repoID, either
+// can be empty. It returns how long the caller should wait before its next
+// transfer.
+func (l *transferLimiter) charge(user, repoID string, bytes int64, ops int) time.Duration {
+	var wait time.Duration
+	maxWait := func(d time.Duration) {
+		if d > wait {
+			wait = d
+		}
+	}
+
+	now := l.now()
+
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	if now.Sub(l.lastSweep) >= transferSweepInterval {
+		l.sweep(now)
+	}
+
+	if user != "" {
+		e, ok := l.users[user]
+		if !ok {
+			e = &transferEntry{weight: 1}
+			if w := l.limits.weights[user]; w > 0 {
+				e.weight = w
+			}
+			l.users[user] = e
+		}
+		if !ok || now.Sub(e.lastActive) >= transferActiveWindow {
+			l.activeWeight += e.weight
+		}
+		e.lastActive = now
+
+		rate := l.limits.userRate
+		if l.limits.totalRate > 0 {
+			active := l.activeWeight
+			if active < e.weight {
+				active = e.weight
+			}
+			share := l.limits.totalRate * float64(e.weight) / float64(active)
+			if rate <= 0 || share < rate {
+				rate = share
+			}
+		}
+		maxWait(e.bytes.take(rate, float64(bytes), now))
+		maxWait(e.ops.take(l.limits.userOps, float64(ops), now))
+	}
+
+	if repoID != "" {
+		e, ok := l.repos[repoID]
+		if !ok {
+			e = &transferEntry{weight: 1}
+			l.repos[repoID] = e
+		}
+		e.lastActive = now
+		maxWait(e.bytes.take(l.limits.repoRate, float64(bytes), now))
+		maxWait(e.ops.take(l.limits.repoOps, float64(ops), now))
+	}
+
+	return wait
+}
+
+// waitTransfer charges a transfer and waits for it, or until ctx is done.
+func waitTransfer(ctx context.Context, user, repoID string, bytes int64, ops int) error {
+	if transferLimit == nil {
+		return nil
+	}
+	d := transferLimit.charge(user, repoID, bytes, ops)
+	if d <= 0 {
+		return nil
+	}
+
+	timer := time.NewTimer(d)
+	defer timer.Stop()
+	select {
+	case <-timer.C:
+		return nil
+	case <-ctx.Done():
+		return ctx.Err()
+	}
+}
+
+type limitedWriter struct {
+	ctx    context.Context
+	w      io.Writer
+	user   string
+	repoID string
+}
+
+// limitWriter returns w limited to the transfer rates of user and repoID.
+// It's w itself if nothing is limited, so that copies from block files
+// still use sendfile.
+func limitWriter(ctx context.Context, w io.Writer, user, repoID string) io.Writer {
+	if transferLimit == nil {
+		return w
+	}
+	return &limitedWriter{ctx, w, user, repoID}
+}
+
+func (w *limitedWriter) Write(p []byte) (int, error) {
+	var written int
+	for len(p) > 0 {
+		chunk := p
+		if len(chunk) > transferChunkSize {
+			chunk = chunk[:transferChunkSize]
+		}
+		if err := waitTransfer(w.ctx, w.user, w.repoID, int64(len(chunk)), 0); err != nil {
+			return written, err
+		}
+		n, err := w.w.Write(chunk)
+		written += n
+		if err != nil {
+			return written, err
+		}
+		p = p[n:]
+	}
+	return written, nil
+}
+
+func (w *limitedWriter) chargeBlock() error {
+	return waitTransfer(w.ctx, w.user, w.repoID, 0, 1)
+}
+
+type limitedReadCloser struct {
+	ctx    context.Context
+	r      io.ReadCloser
+	user   string
+	repoID string
+}
+
+// limitReadCloser returns r limited to the transfer rates of user and
+// repoID, for request bodies.
+func limitReadCloser(ctx context.Context, r io.ReadCloser, user, repoID string) io.ReadCloser {
+	if transferLimit == nil {
+		return r
+	}
+	return &limitedReadCloser{ctx, r, user, repoID}
+}
+
+func (r *limitedReadCloser) Read(p []byte) (int, error) {
+	n, err := r.r.Read(p)
+	if n > 0 {
+		if werr := waitTransfer(r.ctx, r.user, r.repoID, int64(n), 0); werr != nil {
+			return n, werr
+		}
+	}
+	return n, err
+}
+
+func (r *limitedReadCloser) Close() error {
+	return r.r.Close()
+}
+
+func (r *limitedReadCloser) chargeBlock() error {
+	return waitTransfer(r.ctx, r.user, r.repoID, 0, 1)
+}
+
+type blockCharger interface {
+	chargeBlock() error
+}
+
+// chargeBlock charges one block operation to a limited reader or writer,
+// and waits for it. Others aren't limited.
+func chargeBlock(v interface{}) error {
+	if c, ok := v.(blockCharger); ok {
+		return c.chargeBlock()
+	}
+	return nil
+}
@@ -0,0 +1,78 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func newTestTransferLimiter(limits transferLimits) (*transferLimiter, *time.Time) {
+	now := time.Unix(1000, 0)
+	l := newTransferLimiter(limits)
+	l.now = func() time.Time { return now }
+	return l, &now
+}
+
+func TestTransferLimitUser(t *testing.T) {
+	l, now := newTestTransferLimiter(transferLimits{userRate: 1000})
+
+	// The burst of a new bucket is free.
+	if d := l.charge("a@x.com", "", 1000, 0); d != 0 {
+		t.Fatalf("first charge waits %v", d)
+	}
+	if d := l.charge("a@x.com", "", 500, 0); d != 500*time.Millisecond {
+		t.Fatalf("overdraft waits %v, want 500ms", d)
+	}
+	// Other users have their own buckets.
+	if d := l.charge("b@x.com", "", 1000, 0); d != 0 {
+		t.Fatalf("other user waits %v", d)
+	}
+
+	*now = now.Add(time.Second)
+	if d := l.charge("a@x.com", "", 500, 0); d != 0 {
+		t.Fatalf("charge after refill waits %v", d)
+	}
+}
+
+func TestTransferLimitRepoOps(t *testing.T) {
+	l, _ := newTestTransferLimiter(transferLimits{repoOps: 10})
+
+	if d := l.charge("a@x.com", "repo", 1<<30, 10); d != 0 {
+		t.Fatalf("first charge waits %v", d)
+	}
+	// Two users of the same repo share its bucket.
+	if d := l.charge("b@x.com", "repo", 0, 5); d != 500*time.Millisecond {
+		t.Fatalf("overdraft waits %v, want 500ms", d)
+	}
+}
+
+func TestTransferLimitFairShare(t *testing.T) {
+	limits := transferLimits{
+		totalRate: 3000,
+		weights:   map[string]int{"heavy@x.com": 2},
+	}
+	l, now := newTestTransferLimiter(limits)
+
+	// Alone, a user gets the whole total bandwidth.
+	l.charge("light@x.com", "", 3000, 0)
+	*now = now.Add(100 * time.Millisecond)
+	if d := l.charge("light@x.com", "", 300, 0); d != 0 {
+		t.Fatalf("alone waits %v", d)
+	}
+
+	// With heavy@x.com active, light@x.com gets a third of it.
+	l.charge("heavy@x.com", "", 0, 0)
+	*now = now.Add(time.Second)
+	if d := l.charge("light@x.com", "", 2000, 0); d != time.Second {
+		t.Fatalf("light user waits %v, want 1s", d)
+	}
+	if d := l.charge("heavy@x.com", "", 3000, 0); d != time.Second/2 {
+		t.Fatalf("heavy user waits %v, want 500ms", d)
+	}
+
+	// Once light@x.com is idle, heavy@x.com gets everything again.
+	*now = now.Add(5 * time.Second)
+	l.charge("heavy@x.com", "", 0, 0)
+	if n := l.activeWeight; n != 2 {
+		t.Fatalf("active weight is %d, want 2", n)
+	}
+}
@@ -0,0 +1,113 @@
+package main
+
+import (
+	"context"
+	"net/http"
+	"sync"
+)
+
+// Memory multipart forms of uploads may keep in memory; larger file parts
+// are written to temp files.
+const uploadFormMemory = 1 << 20
+
+// memBudget bounds the memory held by in-flight uploads. An upload that
+// doesn't fit waits without reading its body, so the client is slowed
+// down by the network rather than the server running out of memory.
+// Waiters are served in arrival order.
+type memBudget struct {
+	mu      sync.Mutex
+	limit   int64
+	used    int64
+	waiters []*memWaiter
+}
+
+type memWaiter struct {
+	n     int64
+	ready chan struct{}
+}
+
+// A limit of 0 or less disables the budget.
+func newMemBudget(limit int64) *memBudget {
+	return &memBudget{limit: limit}
+}
+
+func (b *memBudget) clamp(n int64) int64 {
+	if n > b.limit {
+		return b.limit
+	}
+	return n
+}
+
+func (b *memBudget) acquire(ctx context.Context, n int64) error {
+	if b.limit <= 0 {
+		return nil
+	}
+	n = b.clamp(n)
+
+	b.mu.Lock()
+	if len(b.waiters) == 0 && b.used+n <= b.limit {
+		b.used += n
+		b.mu.Unlock()
+		return nil
+	}
+	w := &memWaiter{n, make(chan struct{})}
+	b.waiters = append(b.waiters, w)
+	b.mu.Unlock()
+
+	select {
+	case <-w.ready:
+		return nil
+	case <-ctx.Done():
+		b.mu.Lock()
+		for i, waiter := range b.waiters {
+			if waiter == w {
+				b.waiters = append(b.waiters[:i], b.waiters[i+1:]...)
+				b.mu.Unlock()
+				return ctx.Err()
+			}
+		}
+		b.mu.Unlock()
+		// Granted meanwhile.
+		b.release(n)
+		return ctx.Err()
+	}
+}
+
+func (b *memBudget) release(n int64) {
+	if b.limit <= 0 {
+		return
+	}
+	n = b.clamp(n)
+
+	b.mu.Lock()
+	b.used -= n
+	for len(b.waiters) > 0 && b.used+b.waiters[0].n <= b.limit {
+		w := b.waiters[0]
+		b.waiters = b.waiters[1:]
+		b.used += w.n
+		close(w.ready)
+	}
+	b.mu.Unlock()
+}
+
+var uploadMemory = newMemBudget(0)
+
+func initUploadMemory() {
+	uploadMemory = newMemBudget(options.uploadMemoryLimit)
+}
+
+// parseUploadForm parses the multipart form of an upload within the memory
+// budget of all uploads. The returned function releases its share, once
+// the form is no longer used.
+func parseUploadForm(r *http.Request) (func(), error) {
+	if err := uploadMemory.acquire(r.Context(), uploadFormMemory); err != nil {
+		return nil, err
+	}
+	release := func() { uploadMemory.release(uploadFormMemory) }
+
+	if err := r.ParseMultipartForm(uploadFormMemory); err != nil {
+		release()
+		return nil, err
+	}
+	return release, nil
+}
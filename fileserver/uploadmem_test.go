@@ -0,0 +1,58 @@
+package main
+
+import (
+	"context"
+	"testing"
+	"time"
+)
+
+func TestMemBudget(t *testing.T) {
+	b := newMemBudget(10)
+	ctx := context.Background()
+
+	if err := b.acquire(ctx, 6); err != nil {
+		t.Fatalf("failed to acquire: %v", err)
+	}
+
+	acquired := make(chan struct{})
+	go func() {
+		b.acquire(ctx, 6)
+		close(acquired)
+	}()
+	select {
+	case <-acquired:
+		t.Fatalf("acquired over the limit")
+	case <-time.After(50 * time.Millisecond):
+	}
+
+	b.release(6)
+	select {
+	case <-acquired:
+	case <-time.After(time.Second):
+		t.Fatalf("waiter not woken by release")
+	}
+
+	// Requests over the limit take the whole budget.
+	b.release(6)
+	if err := b.acquire(ctx, 100); err != nil {
+		t.Fatalf("failed to acquire: %v", err)
+	}
+
+	cctx, cancel := context.WithTimeout(ctx, 20*time.Millisecond)
+	defer cancel()
+	if err := b.acquire(cctx, 1); err == nil {
+		t.Fatalf("acquired over the limit")
+	}
+	b.release(100)
+	if b.used != 0 || len(b.waiters) != 0 {
+		t.Errorf("used %d with %d waiters", b.used, len(b.waiters))
+	}
+}
+
+func TestMemBudgetUnlimited(t *testing.T) {
+	b := newMemBudget(0)
+	if err := b.acquire(context.Background(), 1<<40); err != nil {
+		t.Errorf("unlimited budget refused: %v", err)
+	}
+	b.release(1 << 40)
+}
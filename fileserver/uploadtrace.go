@@ -0,0 +1,75 @@
+package main
+
+import (
+	"fmt"
+	"math/rand"
+	"strings"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// An uploadTrace records the time an upload spends in each stage. A finished
+// trace is logged with the breakdown if the upload took longer than
+// upload_trace_threshold, or if it's sampled by upload_trace_sample_rate.
+// Receiving the body includes writing the parts kept in temp files.
+
+type uploadStage int
+
+const (
+	stageRecv uploadStage = iota
+	stageIndex
+	stageTree
+	stageCommit
+	numUploadStages
+)
+
+var uploadStageNames = [numUploadStages]string{"recv", "index", "tree", "commit"}
+
+type uploadTrace struct {
+	op      string
+	start   time.Time
+	stages  [numUploadStages]time.Duration
+	retries int
+}
+
+func newUploadTrace(op string) *uploadTrace {
+	return &uploadTrace{op: op, start: time.Now()}
+}
+
+// add adds the time since since to stage. It does nothing on a nil trace.
+func (t *uploadTrace) add(stage uploadStage, since time.Time) {
+	if t == nil {
+		return
+	}
+	t.stages[stage] += time.Since(since)
+}
+
+func (t *uploadTrace) addRetry() {
+	if t != nil {
+		t.retries++
+	}
+}
+
+func (t *uploadTrace) format(repoID string, bytes int64, total time.Duration) string {
+	var b strings.Builder
+	fmt.Fprintf(&b, "%s to repo %.8s: %d bytes in %dms,", t.op, repoID, bytes, total.Milliseconds())
+	for i, d := range t.stages {
+		fmt.Fprintf(&b, " %s=%dms", uploadStageNames[i], d.Milliseconds())
+	}
+	fmt.Fprintf(&b, " retries=%d", t.retries)
+	return b.String()
+}
+
+func (t *uploadTrace) finish(repoID string, bytes int64) {
+	if t == nil {
+		return
+	}
+	total := time.Since(t.start)
+	threshold := options.uploadTraceThreshold
+	if threshold > 0 && total >= threshold {
+		log.Infof("Slow upload %s", t.format(repoID, bytes, total))
+	} else if options.uploadTraceSampleRate > 0 && rand.Float64() < options.uploadTraceSampleRate {
+		log.Infof("Upload trace %s", t.format(repoID, bytes, total))
+	}
+}
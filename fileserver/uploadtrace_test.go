@@ -0,0 +1,29 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func TestUploadTrace(t *testing.T) {
+	var nilTrace *uploadTrace
+	nilTrace.add(stageIndex, time.Now())
+	nilTrace.addRetry()
+	nilTrace.finish("", 0)
+
+	trace := newUploadTrace("upload")
+	trace.add(stageIndex, time.Now().Add(-1500*time.Millisecond))
+	trace.add(stageIndex, time.Now().Add(-500*time.Millisecond))
+	trace.add(stageCommit, time.Now().Add(-20*time.Millisecond))
+	trace.addRetry()
+	if trace.stages[stageIndex] < 2*time.Second {
+		t.Errorf("index time wasn't summed: %v", trace.stages[stageIndex])
+	}
+
+	trace.stages = [numUploadStages]time.Duration{time.Second, 2 * time.Second, 3 * time.Millisecond, 40 * time.Millisecond}
+	got := trace.format("1a2b3c4d-1234-4321-abcd-0123456789ab", 1024, 3100*time.Millisecond)
+	expected := "upload to repo 1a2b3c4d: 1024 bytes in 3100ms, recv=1000ms index=2000ms tree=3ms commit=40ms retries=1"
+	if got != expected {
+		t.Errorf("unexpected trace %q", got)
+	}
+}
@@ -5,6 +5,7 @@ import (
 	"fmt"
 	"path/filepath"
 	"strings"
+	"sync"
 	"time"
 
 	"math/rand"
@@ -17,12 +18,44 @@ import (
 	log "github.com/sirupsen/logrus"
 )
 
-const mergeVirtualRepoWorkerNumber = 5
+const (
+	mergeVirtualRepoWorkerNumber = 5
+	mergeVirtualRepoQueueSize    = 1000
+)
 
 var mergeVirtualRepoPool *workerpool.WorkPool
 
 func virtualRepoInit() {
-	mergeVirtualRepoPool = workerpool.CreateWorkerPool(mergeVirtualRepo, mergeVirtualRepoWorkerNumber)
+	mergeVirtualRepoPool = workerpool.NewWorkerPool(mergeVirtualRepo, mergeVirtualRepoWorkerNumber, mergeVirtualRepoQueueSize)
+}
+
+// An update of an origin repo only needs merging into the virtual repos
+// whose dirs it touched. The origin head that merges were last dispatched
+// for is kept, and its tree is compared with the new one once, descending
+// only into changed dirs on the way to a virtual repo path. Every virtual
+// repo is merged when there's no earlier head or the trees can't be
+// compared.
+//
+// Merges are coalesced: a merge of a repo that is still queued is dropped,
+// since the queued one reads the heads when it runs. A merge that finds the
+// queue full is dropped too; the next update of the repo schedules another.
+
+var dispatchedHeads = struct {
+	sync.Mutex
+	heads map[string]string
+}{heads: make(map[string]string)}
+
+// getSeafdir is replaced in tests.
+var getSeafdir = fsmgr.GetSeafdir
+
+// scheduleMergeVirtualRepo queues a merge of a virtual repo, or of the
+// virtual repos of an origin repo except excludeRepo.
+func scheduleMergeVirtualRepo(repoID, excludeRepo string) {
+	key := repoID + ":" + excludeRepo
+	err := mergeVirtualRepoPool.SubmitKeyed(key, workerpool.PriorityNormal, repoID, excludeRepo)
+	if err != nil {
+		log.Printf("failed to schedule merge of virtual repos of %s: %v", repoID, err)
+	}
 }
 
 func mergeVirtualRepo(args ...interface{}) error {
@@ -30,6 +63,11 @@ func mergeVirtualRepo(args ...interface{}) error {
 		return nil
 	}
 	repoID := args[0].(string)
+	excludeRepo := ""
+	if len(args) > 1 {
+		excludeRepo = args[1].(string)
+	}
+
 	virtual, err := repomgr.IsVirtualRepo(repoID)
 	if err != nil {
 		return err
@@ -41,32 +79,132 @@ func mergeVirtualRepo(args ...interface{}) error {
 			log.Printf("%v", err)
 		}
 
-		go updateSizePool.AddTask(repoID)
+		go scheduleRepoSizeComputation(repoID)
 
 		return nil
 	}
 
-	excludeRepo := ""
-	if len(args) > 1 {
-		excludeRepo = args[1].(string)
+	vInfos, _ := repomgr.GetVirtualRepoInfoByOrigin(repoID)
+	if len(vInfos) == 0 {
+		dispatchedHeads.Lock()
+		delete(dispatchedHeads.heads, repoID)
+		dispatchedHeads.Unlock()
 	}
-	vRepos, _ := repomgr.GetVirtualRepoIDsByOrigin(repoID)
-	for _, id := range vRepos {
-		if id == excludeRepo {
+	changed := findChangedVirtualRepos(repoID, vInfos)
+	for _, vInfo := range vInfos {
+		if vInfo.RepoID == excludeRepo {
 			continue
 		}
-
-		err := mergeRepo(id)
-		if err != nil {
-			log.Printf("%v", err)
+		if changed != nil && !changed[vInfo.RepoID] {
+			continue
 		}
+
+		go scheduleMergeVirtualRepo(vInfo.RepoID, "")
 	}
 
-	go updateSizePool.AddTask(repoID)
+	go scheduleRepoSizeComputation(repoID)
 
 	return nil
 }
 
+type virtPath struct {
+	repoID string
+	names  []string
+}
+
+// findChangedVirtualRepos returns the ids of the virtual repos in vInfos
+// whose dirs changed since merges were last dispatched for the origin repo,
+// or nil if that's unknown.
+func findChangedVirtualRepos(repoID string, vInfos []*repomgr.VRepoInfo) map[string]bool {
+	if len(vInfos) == 0 {
+		return nil
+	}
+	repo := repomgr.Get(repoID)
+	if repo == nil {
+		return nil
+	}
+
+	dispatchedHeads.Lock()
+	oldHeadID := dispatchedHeads.heads[repoID]
+	dispatchedHeads.heads[repoID] = repo.HeadCommitID
+	dispatchedHeads.Unlock()
+
+	if oldHeadID == "" {
+		return nil
+	}
+	oldHead, err := commitmgr.Load(repo.ID, oldHeadID)
+	if err != nil {
+		return nil
+	}
+
+	var vPaths []*virtPath
+	for _, vInfo := range vInfos {
+		names := strings.FieldsFunc(vInfo.Path, func(r rune) bool { return r == '/' })
+		vPaths = append(vPaths, &virtPath{vInfo.RepoID, names})
+	}
+	changed := make(map[string]bool)
+	collectChangedVirtPaths(repo.StoreID, oldHead.RootID, repo.RootID, 0, vPaths, changed)
+
+	return changed
+}
+
+// collectChangedVirtPaths adds the repos of vPaths whose dirs differ between
+// the trees of oldID and newID, the dirs at the first depth names of the
+// paths. An empty id means the dir is missing.
+func collectChangedVirtPaths(storeID, oldID, newID string, depth int, vPaths []*virtPath, changed map[string]bool) {
+	if oldID == newID {
+		return
+	}
+
+	children := make(map[string][]*virtPath)
+	for _, vp := range vPaths {
+		if len(vp.names) == depth {
+			changed[vp.repoID] = true
+			continue
+		}
+		name := vp.names[depth]
+		children[name] = append(children[name], vp)
+	}
+	if len(children) == 0 {
+		return
+	}
+
+	var oldDir, newDir *fsmgr.SeafDir
+	var oldErr, newErr error
+	if oldID != "" {
+		oldDir, oldErr = getSeafdir(storeID, oldID)
+	}
+	if newID != "" {
+		newDir, newErr = getSeafdir(storeID, newID)
+	}
+
+	for name, vps := range children {
+		if oldErr != nil || newErr != nil {
+			for _, vp := range vps {
+				changed[vp.repoID] = true
+			}
+			continue
+		}
+		collectChangedVirtPaths(storeID, getSubdirID(oldDir, name), getSubdirID(newDir, name),
+			depth+1, vps, changed)
+	}
+}
+
+func getSubdirID(dir *fsmgr.SeafDir, name string) string {
+	if dir == nil {
+		return ""
+	}
+	for _, dent := range dir.Entries {
+		if dent.Name == name {
+			if fsmgr.IsDir(dent.Mode) {
+				return dent.ID
+			}
+			return ""
+		}
+	}
+	return ""
+}
+
 func mergeRepo(repoID string) error {
 	repo := repomgr.Get(repoID)
 	if repo == nil {
@@ -226,6 +364,7 @@ func handleMissingVirtualRepo(repo *repomgr.Repo, head *commitmgr.Commit, vInfo
 
 			if err == fsmgr.ErrPathNoExist {
 				repomgr.DelVirtualRepo(vInfo.RepoID, cloudMode)
+				headCommits.drop(vInfo.RepoID)
 			}
 			err := fmt.Errorf("failed to find %s under commit %s in repo %s", parPath, parent.CommitID, repo.StoreID)
 			return "", err
@@ -268,6 +407,7 @@ func handleMissingVirtualRepo(repo *repomgr.Repo, head *commitmgr.Commit, vInfo
 
 	if !isRenamed {
 		repomgr.DelVirtualRepo(vInfo.RepoID, cloudMode)
+		headCommits.drop(vInfo.RepoID)
 	}
 
 	return returnPath, nil
@@ -0,0 +1,81 @@
+package main
+
+import (
+	"fmt"
+	"testing"
+
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+func TestCollectChangedVirtPaths(t *testing.T) {
+	dirMode := uint32(0040000)
+	fileMode := uint32(0100644)
+	dirs := map[string]*fsmgr.SeafDir{
+		"root1": {Entries: []*fsmgr.SeafDirent{
+			{Name: "a", ID: "a1", Mode: dirMode},
+			{Name: "b", ID: "b1", Mode: dirMode},
+			{Name: "f", ID: "f1", Mode: fileMode},
+		}},
+		"root2": {Entries: []*fsmgr.SeafDirent{
+			{Name: "a", ID: "a2", Mode: dirMode},
+			{Name: "b", ID: "b1", Mode: dirMode},
+			{Name: "f", ID: "f2", Mode: fileMode},
+		}},
+		"a1": {Entries: []*fsmgr.SeafDirent{
+			{Name: "x", ID: "x1", Mode: dirMode},
+			{Name: "y", ID: "y1", Mode: dirMode},
+		}},
+		"a2": {Entries: []*fsmgr.SeafDirent{
+			{Name: "x", ID: "x2", Mode: dirMode},
+			{Name: "y", ID: "y1", Mode: dirMode},
+			{Name: "z", ID: "z1", Mode: dirMode},
+		}},
+	}
+	loads := make(map[string]int)
+	saved := getSeafdir
+	defer func() { getSeafdir = saved }()
+	getSeafdir = func(storeID, id string) (*fsmgr.SeafDir, error) {
+		loads[id]++
+		dir, ok := dirs[id]
+		if !ok {
+			return nil, fmt.Errorf("dir %s not found", id)
+		}
+		return dir, nil
+	}
+
+	vPaths := []*virtPath{
+		{"ax", []string{"a", "x"}},
+		{"ay", []string{"a", "y"}},
+		{"az", []string{"a", "z"}},
+		{"b", []string{"b"}},
+		{"bsub", []string{"b", "sub"}},
+		{"f", []string{"f", "sub"}},
+		{"root", nil},
+	}
+	changed := make(map[string]bool)
+	collectChangedVirtPaths("store", "root1", "root2", 0, vPaths, changed)
+
+	expected := map[string]bool{"ax": true, "az": true, "root": true}
+	if len(changed) != len(expected) {
+		t.Errorf("changed virtual repos %v, expected %v", changed, expected)
+	}
+	for id := range expected {
+		if !changed[id] {
+			t.Errorf("virtual repo %s was not found changed", id)
+		}
+	}
+	if loads["b1"] != 0 {
+		t.Errorf("unchanged dir was loaded")
+	}
+	for id, n := range loads {
+		if n > 1 {
+			t.Errorf("dir %s was loaded %d times", id, n)
+		}
+	}
+
+	changed = make(map[string]bool)
+	collectChangedVirtPaths("store", "missing", "root2", 0, vPaths[:3], changed)
+	if len(changed) != 3 {
+		t.Errorf("virtual repos below an unreadable dir were not changed: %v", changed)
+	}
+}
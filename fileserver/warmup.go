@@ -0,0 +1,77 @@
+package main
+
+import (
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/commitmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+	"github.com/haiwen/seafile-server/fileserver/repomgr"
+	log "github.com/sirupsen/logrus"
+)
+
+// After a restart every cache is empty, and the first minutes of traffic
+// hit the database and storage hard. warmUpCaches loads, for the n most
+// recently updated repos, what sync clients ask for first: the store id,
+// the head commit, the root dir and the permissions of the owner. It runs
+// while requests are already served. seaf-server does the same for its
+// own file server.
+func warmUpCaches(n int) {
+	if n <= 0 {
+		return
+	}
+	start := time.Now()
+
+	repoIDs, err := recentlyUpdatedRepos(n)
+	if err != nil {
+		log.Warnf("Failed to get recently updated repos to warm up caches: %v", err)
+		return
+	}
+	if _, err := getHeadCommitIDs(repoIDs); err != nil {
+		log.Warnf("Failed to warm up head commits: %v", err)
+	}
+	for _, repoID := range repoIDs {
+		warmUpRepo(repoID)
+	}
+
+	log.Infof("Warmed up caches of %d repos in %v", len(repoIDs), time.Since(start))
+}
+
+func recentlyUpdatedRepos(n int) ([]string, error) {
+	sqlStr := "SELECT repo_id FROM RepoInfo ORDER BY update_time DESC LIMIT ?"
+	rows, err := seafileDB.Query(sqlStr, n)
+	if err != nil {
+		return nil, err
+	}
+	defer rows.Close()
+
+	var repoIDs []string
+	for rows.Next() {
+		var repoID string
+		if err := rows.Scan(&repoID); err != nil {
+			return nil, err
+		}
+		if isValidUUID(repoID) {
+			repoIDs = append(repoIDs, repoID)
+		}
+	}
+	return repoIDs, rows.Err()
+}
+
+func warmUpRepo(repoID string) {
+	getRepoStoreID(repoID)
+
+	repo := repomgr.Get(repoID)
+	if repo == nil {
+		return
+	}
+	commit, err := commitmgr.Load(repo.ID, repo.HeadCommitID)
+	if err == nil {
+		fsmgr.GetSeafdir(repo.StoreID, commit.RootID)
+	}
+
+	owner, err := repomgr.GetRepoOwner(repoID)
+	if err == nil && owner != "" {
+		checkPermission(repoID, owner, "download", false)
+		checkPermission(repoID, owner, "upload", false)
+	}
+}
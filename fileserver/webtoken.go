@@ -0,0 +1,111 @@
+package main
+
+import (
+	"crypto/hmac"
+	"crypto/sha256"
+	"encoding/base64"
+	"encoding/json"
+	"fmt"
+	"strings"
+	"sync"
+	"time"
+)
+
+// When web_token_secret is set, seaf-server issues signed web access
+// tokens instead of keeping them in memory. A token is <payload>.<signature>,
+// the payload is the base64url encoded json of the access info and the
+// signature the base64url encoded HMAC-SHA256 of the encoded payload. They
+// are verified here without an rpc call. One-time tokens carry a nonce that
+// this file server accepts only once.
+
+type signedTokenPayload struct {
+	RepoID   string `json:"repo_id"`
+	ObjID    string `json:"obj_id"`
+	Op       string `json:"op"`
+	Username string `json:"username"`
+	Exp      int64  `json:"exp"`
+	Nonce    string `json:"nonce"`
+}
+
+func isSignedToken(token string) bool {
+	return options.webTokenSecret != "" && strings.Contains(token, ".")
+}
+
+func signTokenPayload(secret, payload string) string {
+	mac := hmac.New(sha256.New, []byte(secret))
+	mac.Write([]byte(payload))
+	return base64.RawURLEncoding.EncodeToString(mac.Sum(nil))
+}
+
+func parseSignedToken(secret, token string, now int64) (*signedTokenPayload, error) {
+	dot := strings.IndexByte(token, '.')
+	if dot < 0 {
+		return nil, fmt.Errorf("not a signed token")
+	}
+	payload, sig := token[:dot], token[dot+1:]
+	if !hmac.Equal([]byte(sig), []byte(signTokenPayload(secret, payload))) {
+		return nil, fmt.Errorf("bad signature")
+	}
+
+	data, err := base64.RawURLEncoding.DecodeString(payload)
+	if err != nil {
+		return nil, err
+	}
+	info := new(signedTokenPayload)
+	if err := json.Unmarshal(data, info); err != nil {
+		return nil, err
+	}
+	if info.RepoID == "" || info.Op == "" || info.Username == "" {
+		return nil, fmt.Errorf("incomplete token")
+	}
+	if now >= info.Exp {
+		return nil, fmt.Errorf("token expired")
+	}
+	return info, nil
+}
+
+// nonceCache holds the nonces of the used one-time tokens until they
+// expire.
+type nonceCache struct {
+	mu     sync.Mutex
+	nonces map[string]int64
+}
+
+func newNonceCache() *nonceCache {
+	return &nonceCache{nonces: make(map[string]int64)}
+}
+
+// use records a nonce, it returns false if it was used before.
+func (c *nonceCache) use(nonce string, expire int64) bool {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if _, ok := c.nonces[nonce]; ok {
+		return false
+	}
+	c.nonces[nonce] = expire
+	return true
+}
+
+func (c *nonceCache) removeExpired(now int64) {
+	c.mu.Lock()
+	for nonce, expire := range c.nonces {
+		if now >= expire {
+			delete(c.nonces, nonce)
+		}
+	}
+	c.mu.Unlock()
+}
+
+var usedNonces = newNonceCache()
+
+func verifySignedToken(token string) (*webaccessInfo, error) {
+	now := time.Now().Unix()
+	info, err := parseSignedToken(options.webTokenSecret, token, now)
+	if err != nil {
+		return nil, err
+	}
+	if info.Nonce != "" && !usedNonces.use(info.Nonce, info.Exp) {
+		return nil, fmt.Errorf("token already used")
+	}
+	return &webaccessInfo{info.RepoID, info.ObjID, info.Op, info.Username}, nil
+}
@@ -0,0 +1,49 @@
+package main
+
+import (
+	"encoding/base64"
+	"encoding/json"
+	"testing"
+)
+
+func genSignedToken(t *testing.T, secret string, info *signedTokenPayload) string {
+	data, err := json.Marshal(info)
+	if err != nil {
+		t.Fatalf("failed to encode payload: %v", err)
+	}
+	payload := base64.RawURLEncoding.EncodeToString(data)
+	return payload + "." + signTokenPayload(secret, payload)
+}
+
+func TestParseSignedToken(t *testing.T) {
+	info := &signedTokenPayload{"repo1", "obj1", "download", "a@b.c", 100, ""}
+	token := genSignedToken(t, "secret", info)
+
+	parsed, err := parseSignedToken("secret", token, 50)
+	if err != nil || *parsed != *info {
+		t.Errorf("parsed %v, %v", parsed, err)
+	}
+	if _, err := parseSignedToken("other", token, 50); err == nil {
+		t.Errorf("token with a wrong key accepted")
+	}
+	if _, err := parseSignedToken("secret", token, 100); err == nil {
+		t.Errorf("expired token accepted")
+	}
+	if _, err := parseSignedToken("secret", token[1:], 50); err == nil {
+		t.Errorf("modified token accepted")
+	}
+}
+
+func TestNonceCache(t *testing.T) {
+	c := newNonceCache()
+	if !c.use("n", 100) {
+		t.Errorf("new nonce refused")
+	}
+	if c.use("n", 100) {
+		t.Errorf("used nonce accepted")
+	}
+	c.removeExpired(100)
+	if len(c.nonces) != 0 {
+		t.Errorf("expired nonce kept")
+	}
+}
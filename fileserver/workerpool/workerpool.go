@@ -1,56 +1,291 @@
 package workerpool
 
 import (
-	log "github.com/sirupsen/logrus"
+	"context"
+	"errors"
 	"runtime/debug"
+	"sync"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// A WorkPool runs jobs on a fixed number of workers. Jobs wait in one
+// bounded queue per priority, and workers take the oldest job of the
+// highest priority. Submit never blocks: a job that finds its queue full is
+// rejected, so that callers can shed load instead of piling up goroutines.
+//
+// A job can carry a key. A keyed job is dropped if a job with the same key
+// is still queued, since the queued one will do the same work when it runs.
+
+// Priority is the queue a job waits in.
+type Priority int
+
+const (
+	PriorityHigh Priority = iota
+	PriorityNormal
+	PriorityLow
+	numPriorities
+)
+
+// String returns the name of the priority, as used in metrics.
+func (prio Priority) String() string {
+	switch prio {
+	case PriorityHigh:
+		return "high"
+	case PriorityLow:
+		return "low"
+	default:
+		return "normal"
+	}
+}
+
+// DefaultQueueSize is the length of each priority queue of CreateWorkerPool.
+const DefaultQueueSize = 100
+
+var (
+	// ErrQueueFull is returned when the queue of the job's priority is full.
+	ErrQueueFull = errors.New("worker pool queue is full")
+	// ErrPoolClosed is returned for jobs submitted after Shutdown.
+	ErrPoolClosed = errors.New("worker pool is shut down")
 )
 
 type WorkPool struct {
-	jobs  chan Job
-	jobCB JobCB
+	jobCB     JobCB
+	queueSize int
+
+	mu sync.Mutex
+	// Signaled when a job is queued, or the pool is shut down.
+	queued *sync.Cond
+	// Signaled when a job is taken or finished.
+	done   *sync.Cond
+	queues [numPriorities][]*Job
+	keys   map[string]bool
+	busy   int
+	closed bool
+
+	stats Stats
 }
 
 // Job is the job object of workpool.
 type Job struct {
 	callback JobCB
 	args     []interface{}
+	key      string
+	queuedAt time.Time
 }
 
 type JobCB func(args ...interface{}) error
 
+// Stats are the counters of a pool. Times are totals over all jobs.
+type Stats struct {
+	Queued    [numPriorities]int
+	Busy      int
+	Completed uint64
+	Rejected  uint64
+	Coalesced uint64
+	WaitTime  time.Duration
+	RunTime   time.Duration
+}
+
+// CreateWorkerPool creates a pool of n workers with DefaultQueueSize jobs
+// per priority.
 func CreateWorkerPool(jobCB JobCB, n int) *WorkPool {
+	return NewWorkerPool(jobCB, n, DefaultQueueSize)
+}
+
+// NewWorkerPool creates a pool of n workers with queueSize jobs per
+// priority.
+func NewWorkerPool(jobCB JobCB, n int, queueSize int) *WorkPool {
 	pool := new(WorkPool)
 	pool.jobCB = jobCB
-	pool.jobs = make(chan Job, 100)
+	pool.queueSize = queueSize
+	pool.queued = sync.NewCond(&pool.mu)
+	pool.done = sync.NewCond(&pool.mu)
+	pool.keys = make(map[string]bool)
 	for i := 0; i < n; i++ {
-		go worker(pool.jobs)
+		go pool.worker()
 	}
 	return pool
 }
 
+// Submit queues a job with priority prio. It returns ErrQueueFull if the
+// queue of prio is full, and ErrPoolClosed after Shutdown.
+func (pool *WorkPool) Submit(prio Priority, args ...interface{}) error {
+	return pool.SubmitKeyed("", prio, args...)
+}
+
+// SubmitKeyed is like Submit, but if key isn't empty and a job with the
+// same key is still waiting for a worker, the job is dropped and nil is
+// returned.
+func (pool *WorkPool) SubmitKeyed(key string, prio Priority, args ...interface{}) error {
+	if prio < 0 || prio >= numPriorities {
+		prio = PriorityNormal
+	}
+
+	pool.mu.Lock()
+	defer pool.mu.Unlock()
+
+	if pool.closed {
+		return ErrPoolClosed
+	}
+	if key != "" && pool.keys[key] {
+		pool.stats.Coalesced++
+		return nil
+	}
+	if len(pool.queues[prio]) >= pool.queueSize {
+		pool.stats.Rejected++
+		return ErrQueueFull
+	}
+
+	job := &Job{pool.jobCB, args, key, time.Now()}
+	pool.queues[prio] = append(pool.queues[prio], job)
+	if key != "" {
+		pool.keys[key] = true
+	}
+	pool.queued.Signal()
+	return nil
+}
+
+// AddTask queues a job with normal priority, waiting while the queue is
+// full. Jobs added after Shutdown are dropped.
 func (pool *WorkPool) AddTask(args ...interface{}) {
-	defer func() {
-		if err := recover(); err != nil {
-			log.Printf("panic: %v\n%s", err, debug.Stack())
+	pool.mu.Lock()
+	defer pool.mu.Unlock()
+
+	for !pool.closed && len(pool.queues[PriorityNormal]) >= pool.queueSize {
+		pool.done.Wait()
+	}
+	if pool.closed {
+		return
+	}
+	job := &Job{pool.jobCB, args, "", time.Now()}
+	pool.queues[PriorityNormal] = append(pool.queues[PriorityNormal], job)
+	pool.queued.Signal()
+}
+
+// next waits for a job and takes it off its queue. It returns nil when
+// the pool is shut down and all queues are empty.
+func (pool *WorkPool) next() *Job {
+	pool.mu.Lock()
+	defer pool.mu.Unlock()
+
+	for {
+		for prio := range pool.queues {
+			queue := pool.queues[prio]
+			if len(queue) == 0 {
+				continue
+			}
+			job := queue[0]
+			queue[0] = nil
+			pool.queues[prio] = queue[1:]
+			if job.key != "" {
+				delete(pool.keys, job.key)
+			}
+			pool.busy++
+			pool.stats.WaitTime += time.Since(job.queuedAt)
+			pool.done.Broadcast()
+			return job
 		}
-	}()
-	job := Job{pool.jobCB, args}
-	pool.jobs <- job
+		if pool.closed {
+			return nil
+		}
+		pool.queued.Wait()
+	}
+}
+
+func (pool *WorkPool) finish(runTime time.Duration) {
+	pool.mu.Lock()
+	pool.busy--
+	pool.stats.Completed++
+	pool.stats.RunTime += runTime
+	pool.done.Broadcast()
+	pool.mu.Unlock()
 }
 
-func worker(jobs chan Job) {
+func (pool *WorkPool) worker() {
+	for {
+		job := pool.next()
+		if job == nil {
+			return
+		}
+		start := time.Now()
+		runJob(job)
+		pool.finish(time.Since(start))
+	}
+}
+
+func runJob(job *Job) {
 	defer func() {
 		if err := recover(); err != nil {
 			log.Printf("panic: %v\n%s", err, debug.Stack())
 		}
 	}()
 
-	for job := range jobs {
-		if job.callback != nil {
-			err := job.callback(job.args...)
-			if err != nil {
-				log.Printf("failed to call jobs: %v.\n", err)
-			}
+	if job.callback != nil {
+		err := job.callback(job.args...)
+		if err != nil {
+			log.Printf("failed to call jobs: %v.\n", err)
 		}
 	}
 }
+
+// Shutdown stops accepting jobs and waits until the queued and running
+// jobs are done, or ctx is done.
+func (pool *WorkPool) Shutdown(ctx context.Context) error {
+	pool.mu.Lock()
+	pool.closed = true
+	pool.queued.Broadcast()
+	pool.done.Broadcast()
+	pool.mu.Unlock()
+
+	idle := make(chan struct{})
+	go func() {
+		pool.mu.Lock()
+		for pool.busy > 0 || pool.queuedLocked() > 0 {
+			pool.done.Wait()
+		}
+		pool.mu.Unlock()
+		close(idle)
+	}()
+
+	select {
+	case <-idle:
+		return nil
+	case <-ctx.Done():
+		return ctx.Err()
+	}
+}
+
+func (pool *WorkPool) queuedLocked() int {
+	n := 0
+	for _, queue := range pool.queues {
+		n += len(queue)
+	}
+	return n
+}
+
+// QueueLen returns the number of jobs waiting for a worker.
+func (pool *WorkPool) QueueLen() int {
+	pool.mu.Lock()
+	defer pool.mu.Unlock()
+	return pool.queuedLocked()
+}
+
+// Stats returns the current counters of the pool.
+func (pool *WorkPool) Stats() Stats {
+	pool.mu.Lock()
+	defer pool.mu.Unlock()
+
+	stats := pool.stats
+	for prio, queue := range pool.queues {
+		stats.Queued[prio] = len(queue)
+	}
+	stats.Busy = pool.busy
+	return stats
+}
+
+// Priorities returns the priorities in the order of Stats.Queued.
+func Priorities() []Priority {
+	return []Priority{PriorityHigh, PriorityNormal, PriorityLow}
+}
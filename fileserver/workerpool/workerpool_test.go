@@ -0,0 +1,105 @@
+package workerpool
+
+import (
+	"context"
+	"sync"
+	"testing"
+	"time"
+)
+
+func TestWorkPool(t *testing.T) {
+	release := make(chan struct{})
+	started := make(chan string, 10)
+	var mu sync.Mutex
+	var order []string
+
+	pool := NewWorkerPool(func(args ...interface{}) error {
+		name := args[0].(string)
+		if name == "blocker" {
+			started <- name
+			<-release
+			return nil
+		}
+		mu.Lock()
+		order = append(order, name)
+		mu.Unlock()
+		return nil
+	}, 1, 2)
+
+	// Hold the only worker, so that the other jobs queue up.
+	if err := pool.Submit(PriorityNormal, "blocker"); err != nil {
+		t.Fatalf("failed to submit: %v", err)
+	}
+	<-started
+
+	for _, job := range []struct {
+		name string
+		prio Priority
+	}{
+		{"low1", PriorityLow},
+		{"normal1", PriorityNormal},
+		{"high1", PriorityHigh},
+		{"normal2", PriorityNormal},
+	} {
+		if err := pool.Submit(job.prio, job.name); err != nil {
+			t.Fatalf("failed to submit %s: %v", job.name, err)
+		}
+	}
+	if err := pool.Submit(PriorityNormal, "normal3"); err != ErrQueueFull {
+		t.Errorf("submitted to a full queue: %v", err)
+	}
+	if err := pool.SubmitKeyed("k", PriorityLow, "keyed"); err != nil {
+		t.Fatalf("failed to submit keyed job: %v", err)
+	}
+	if err := pool.SubmitKeyed("k", PriorityLow, "keyed"); err != nil {
+		t.Errorf("coalesced job returned %v", err)
+	}
+
+	stats := pool.Stats()
+	if stats.Queued != [numPriorities]int{1, 2, 2} || stats.Busy != 1 ||
+		stats.Rejected != 1 || stats.Coalesced != 1 {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+
+	close(release)
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Second)
+	defer cancel()
+	if err := pool.Shutdown(ctx); err != nil {
+		t.Fatalf("failed to shut down: %v", err)
+	}
+	if err := pool.Submit(PriorityHigh, "late"); err != ErrPoolClosed {
+		t.Errorf("submitted after shutdown: %v", err)
+	}
+
+	expected := []string{"high1", "normal1", "normal2", "low1", "keyed"}
+	if len(order) != len(expected) {
+		t.Fatalf("ran %v, expected %v", order, expected)
+	}
+	for i := range order {
+		if order[i] != expected[i] {
+			t.Fatalf("ran %v, expected %v", order, expected)
+		}
+	}
+	if stats := pool.Stats(); stats.Completed != 6 || stats.Busy != 0 {
+		t.Errorf("unexpected stats after shutdown %+v", stats)
+	}
+}
+
+func TestWorkPoolShutdownTimeout(t *testing.T) {
+	release := make(chan struct{})
+	defer close(release)
+	started := make(chan struct{})
+	pool := CreateWorkerPool(func(args ...interface{}) error {
+		close(started)
+		<-release
+		return nil
+	}, 1)
+
+	pool.AddTask()
+	<-started
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Millisecond)
+	defer cancel()
+	if err := pool.Shutdown(ctx); err != context.DeadlineExceeded {
+		t.Errorf("shutdown with a running job returned %v", err)
+	}
+}
@@ -0,0 +1,150 @@
+package main
+
+import (
+	"bytes"
+	"sync"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+// Files of a zip download are packed one after another, so with many small
+// files on a block backend of high latency most of the time goes into
+// waiting for blocks. The next zip_prefetch_files files of a directory are
+// read in the background while the current one is packed. The archive is
+// still written in order. Prefetched files of all downloads take at most
+// zipPrefetchMaxBytes. Only the file objects of files larger than
+// zipPrefetchMaxFileSize are prefetched, their blocks are read when they're
+// packed.
+
+const (
+	zipPrefetchMaxFileSize = 4 << 20
+	zipPrefetchMaxBytes    = 256 << 20
+)
+
+var zipPrefetchBudget struct {
+	sync.Mutex
+	bytes int64
+}
+
+func reserveZipPrefetch(size int64) bool {
+	zipPrefetchBudget.Lock()
+	defer zipPrefetchBudget.Unlock()
+	if zipPrefetchBudget.bytes+size > zipPrefetchMaxBytes {
+		return false
+	}
+	zipPrefetchBudget.bytes += size
+	return true
+}
+
+func releaseZipPrefetch(size int64) {
+	zipPrefetchBudget.Lock()
+	zipPrefetchBudget.bytes -= size
+	zipPrefetchBudget.Unlock()
+}
+
+type prefetchedFile struct {
+	dent *fsmgr.SeafDirent
+	file *fsmgr.Seafile
+	err  error
+	// Content of the file, nil if its blocks weren't prefetched.
+	data     []byte
+	reserved int64
+	done     chan struct{}
+}
+
+func (pf *prefetchedFile) release() {
+	pf.data = nil
+	if pf.reserved > 0 {
+		releaseZipPrefetch(pf.reserved)
+		pf.reserved = 0
+	}
+}
+
+type filePrefetcher struct {
+	storeID string
+	depth   int
+	entries []*fsmgr.SeafDirent
+	next    int
+	// Files being prefetched, in the order of entries.
+	queue []*prefetchedFile
+}
+
+// newFilePrefetcher returns nil if prefetching is disabled. Files must be
+// taken in the order of entries.
+func newFilePrefetcher(storeID string, entries []*fsmgr.SeafDirent) *filePrefetcher {
+	if options.zipPrefetchFiles <= 0 {
+		return nil
+	}
+	return &filePrefetcher{storeID: storeID, depth: options.zipPrefetchFiles, entries: entries}
+}
+
+func (p *filePrefetcher) schedule() {
+	for len(p.queue) < p.depth && p.next < len(p.entries) {
+		dent := p.entries[p.next]
+		p.next++
+		if fsmgr.IsDir(dent.Mode) {
+			continue
+		}
+		pf := &prefetchedFile{dent: dent, done: make(chan struct{})}
+		p.queue = append(p.queue, pf)
+		go p.fetch(pf)
+	}
+}
+
+func (p *filePrefetcher) fetch(pf *prefetchedFile) {
+	defer close(pf.done)
+
+	pf.file, pf.err = fsmgr.GetSeafile(p.storeID, pf.dent.ID)
+	if pf.err != nil {
+		return
+	}
+	size := int64(pf.file.FileSize)
+	if size > zipPrefetchMaxFileSize || !reserveZipPrefetch(size) {
+		return
+	}
+
+	buf := bytes.NewBuffer(make([]byte, 0, size))
+	for i := 0; i < pf.file.NumBlocks(); i++ {
+		if err := blockmgr.Read(p.storeID, pf.file.BlockID(i), buf); err != nil {
+			// Leave the blocks, and the error, to the writer.
+			releaseZipPrefetch(size)
+			return
+		}
+	}
+	pf.data = buf.Bytes()
+	pf.reserved = size
+}
+
+// take returns dent once it's prefetched, or nil if it isn't. The caller
+// must release it.
+func (p *filePrefetcher) take(dent *fsmgr.SeafDirent) *prefetchedFile {
+	if p == nil {
+		return nil
+	}
+	p.schedule()
+	if len(p.queue) == 0 || p.queue[0].dent != dent {
+		return nil
+	}
+	pf := p.queue[0]
+	p.queue = p.queue[1:]
+	<-pf.done
+	p.schedule()
+	return pf
+}
+
+// close releases the files prefetched but not taken.
+func (p *filePrefetcher) close() {
+	if p == nil {
+		return
+	}
+	queue := p.queue
+	p.queue = nil
+	p.next = len(p.entries)
+	go func() {
+		for _, pf := range queue {
+			<-pf.done
+			pf.release()
+		}
+	}()
+}
@@ -0,0 +1,95 @@
+package main
+
+import (
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/blockmgr"
+	"github.com/haiwen/seafile-server/fileserver/fsmgr"
+)
+
+const zipPrefetchTestRepoID = "6e7f8091-1234-4321-abcd-0123456789ab"
+
+func TestFilePrefetcher(t *testing.T) {
+	dir, err := ioutil.TempDir("", "zipprefetch")
+	if err != nil {
+		t.Fatalf("failed to create temp dir: %v", err)
+	}
+	defer os.RemoveAll(dir)
+	blockmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+	fsmgr.Init(dir, filepath.Join(dir, "seafile-data"))
+
+	var entries []*fsmgr.SeafDirent
+	contents := make(map[string]string)
+	for i := 0; i < 6; i++ {
+		name := string(rune('a' + i))
+		if i == 2 {
+			entries = append(entries, fsmgr.NewDirent("", name, 0040000, 0, "", 0))
+			continue
+		}
+		blkID := strings.Repeat(name, 40)
+		content := strings.Repeat(name, 1000+i)
+		if err := blockmgr.Write(zipPrefetchTestRepoID, blkID, strings.NewReader(content)); err != nil {
+			t.Fatalf("failed to write block: %v", err)
+		}
+		file, err := fsmgr.NewSeafile(1, int64(len(content)), []string{blkID})
+		if err != nil {
+			t.Fatalf("failed to create seafile: %v", err)
+		}
+		if err := fsmgr.SaveSeafile(zipPrefetchTestRepoID, file); err != nil {
+			t.Fatalf("failed to save seafile: %v", err)
+		}
+		entries = append(entries, fsmgr.NewDirent(file.FileID, name, 0100644, 0, "", int64(len(content))))
+		contents[name] = content
+	}
+
+	options.zipPrefetchFiles = 2
+	defer func() { options.zipPrefetchFiles = 8 }()
+
+	p := newFilePrefetcher(zipPrefetchTestRepoID, entries)
+	for _, dent := range entries {
+		pf := p.take(dent)
+		if fsmgr.IsDir(dent.Mode) {
+			if pf != nil {
+				t.Errorf("prefetched dir %s", dent.Name)
+			}
+			continue
+		}
+		if pf == nil || pf.err != nil {
+			t.Fatalf("file %s wasn't prefetched", dent.Name)
+		}
+		if string(pf.data) != contents[dent.Name] {
+			t.Errorf("prefetched content of %s doesn't match", dent.Name)
+		}
+		pf.release()
+	}
+	p.close()
+
+	// Files not taken are released on close.
+	p = newFilePrefetcher(zipPrefetchTestRepoID, entries)
+	pf := p.take(entries[0])
+	pf.release()
+	p.close()
+	deadline := time.Now().Add(5 * time.Second)
+	for {
+		zipPrefetchBudget.Lock()
+		n := zipPrefetchBudget.bytes
+		zipPrefetchBudget.Unlock()
+		if n == 0 {
+			break
+		}
+		if time.Now().After(deadline) {
+			t.Fatalf("%d prefetched bytes weren't released", n)
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	options.zipPrefetchFiles = 0
+	if p := newFilePrefetcher(zipPrefetchTestRepoID, entries); p != nil || p.take(entries[0]) != nil {
+		t.Errorf("prefetched with zip_prefetch_files = 0")
+	}
+}
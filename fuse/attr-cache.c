@@ -0,0 +1,279 @@
+#include "common.h"
+
+#define FUSE_USE_VERSION  26
+#include <fuse.h>
+
+#include <pthread.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <seaf-db.h>
+
+#include "log.h"
+#include "utils.h"
+#include "lru-cache.h"
+
+#include "seaf-fuse.h"
+#include "seafile-session.h"
+
+/*
+ * find or rsync over the mount look up every path several times, and each
+ * lookup used to load the repo and its head commit and walk the path from
+ * the root. The heads of repos are now kept for attr_timeout seconds, after
+ * which the branch is read again. Stats are cached by the root id of the
+ * head, so when a repo changes, lookups of its new head miss the cache
+ * and the old entries are evicted by the LRU. Users are remembered for
+ * attr_timeout seconds too.
+ *
+ * The kernel is told to keep entries and attributes for as long, so changes
+ * made on the server show up on the mount after at most attr_timeout
+ * seconds. attr_timeout and attr_cache_size (MB) are read from the [fuse]
+ * section of seafile.conf.
+ */
+
+#define DEFAULT_ATTR_TIMEOUT 5
+#define DEFAULT_ATTR_CACHE_SIZE_MB 16
+#define ATTR_CACHE_SHARDS 16
+
+static int attr_timeout;
+static LRUCache *attr_cache;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo id -> FuseRepoHead */
+static GHashTable *repo_heads;
+/* user -> expire time */
+static GHashTable *known_users;
+
+void
+fuse_attr_cache_init (SeafileSession *session)
+{
+    GError *error = NULL;
+    int size_mb;
+
+    attr_timeout = g_key_file_get_integer (session->config,
+                                           "fuse", "attr_timeout",
+                                           &error);
+    if (error) {
+        attr_timeout = DEFAULT_ATTR_TIMEOUT;
+        g_clear_error (&error);
+    }
+    if (attr_timeout < 0)
+        attr_timeout = 0;
+
+    size_mb = g_key_file_get_integer (session->config,
+                                      "fuse", "attr_cache_size",
+                                      &error);
+    if (error) {
+        size_mb = DEFAULT_ATTR_CACHE_SIZE_MB;
+        g_clear_error (&error);
+    }
+
+    repo_heads = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    known_users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    if (attr_timeout == 0 || size_mb <= 0) {
+        seaf_message ("fuse attribute cache is disabled.\n");
+        return;
+    }
+
+    attr_cache = lru_cache_new ((gint64)size_mb << 20, ATTR_CACHE_SHARDS,
+                                g_free);
+}
+
+int
+fuse_attr_timeout (void)
+{
+    return attr_timeout;
+}
+
+static int
+load_repo_head (SeafileSession *seaf, const char *repo_id, FuseRepoHead *head)
+{
+    SeafRepo *repo;
+    SeafCommit *commit;
+
+    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to get repo %s.\n", repo_id);
+        return -1;
+    }
+
+    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
+                                            repo->id, repo->version,
+                                            repo->head->commit_id);
+    if (!commit) {
+        seaf_warning ("Failed to get commit %s:%.8s.\n",
+                      repo->id, repo->head->commit_id);
+        seaf_repo_unref (repo);
+        return -1;
+    }
+
+    memcpy (head->repo_id, repo->id, 37);
+    memcpy (head->store_id, repo->store_id, 37);
+    head->version = repo->version;
+    head->encrypted = repo->encrypted;
+    memcpy (head->commit_id, commit->commit_id, 41);
+    memcpy (head->root_id, commit->root_id, 41);
+
+    seaf_commit_unref (commit);
+    seaf_repo_unref (repo);
+    return 0;
+}
+
+/* Re-read the branch of a head that expired. Only the head commit is
+ * loaded again, and only if the branch moved.
+ */
+static int
+refresh_repo_head (SeafileSession *seaf, FuseRepoHead *head)
+{
+    SeafBranch *branch;
+    SeafCommit *commit;
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             head->repo_id, "master");
+    if (!branch)
+        return -1;
+
+    if (strcmp (branch->commit_id, head->commit_id) != 0) {
+        commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
+                                                head->repo_id, head->version,
+                                                branch->commit_id);
+        if (!commit) {
+            seaf_warning ("Failed to get commit %s:%.8s.\n",
+                          head->repo_id, branch->commit_id);
+            seaf_branch_unref (branch);
+            return -1;
+        }
+        memcpy (head->commit_id, commit->commit_id, 41);
+        memcpy (head->root_id, commit->root_id, 41);
+        seaf_commit_unref (commit);
+    }
+
+    seaf_branch_unref (branch);
+    return 0;
+}
+
+int
+fuse_get_repo_head (SeafileSession *seaf, const char *repo_id,
+                    FuseRepoHead *head)
+{
+    FuseRepoHead *cached;
+    gint64 now = (gint64)time(NULL);
+    int ret;
+
+    pthread_mutex_lock (&cache_lock);
+    cached = g_hash_table_lookup (repo_heads, repo_id);
+    if (cached && cached->expire > now) {
+        *head = *cached;
+        pthread_mutex_unlock (&cache_lock);
+        return 0;
+    }
+    if (cached)
+        *head = *cached;
+    pthread_mutex_unlock (&cache_lock);
+
+    /* Lookups of the same repo may race here, which only costs a few
+     * extra queries.
+     */
+    if (cached)
+        ret = refresh_repo_head (seaf, head);
+    else
+        ret = load_repo_head (seaf, repo_id, head);
+
+    pthread_mutex_lock (&cache_lock);
+    if (ret < 0) {
+        g_hash_table_remove (repo_heads, repo_id);
+    } else if (attr_timeout > 0) {
+        head->expire = now + attr_timeout;
+        cached = g_new (FuseRepoHead, 1);
+        *cached = *head;
+        g_hash_table_replace (repo_heads, cached->repo_id, cached);
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
+}
+
+static char *
+make_attr_key (const FuseRepoHead *head, const char *path)
+{
+    return g_strdup_printf ("%s:%s:%s", head->repo_id, head->root_id, path);
+}
+
+static gpointer
+copy_stat (gconstpointer value)
+{
+    return g_memdup (value, sizeof(struct stat));
+}
+
+gboolean
+fuse_attr_cache_lookup (const FuseRepoHead *head, const char *path,
+                        struct stat *stbuf)
+{
+    struct stat *st;
+    char *key;
+
+    if (!attr_cache)
+        return FALSE;
+
+    key = make_attr_key (head, path);
+    st = lru_cache_lookup (attr_cache, key, copy_stat);
+    g_free (key);
+    if (!st)
+        return FALSE;
+
+    *stbuf = *st;
+    g_free (st);
+    return TRUE;
+}
+
+void
+fuse_attr_cache_add (const FuseRepoHead *head, const char *path,
+                     const struct stat *stbuf)
+{
+    char *key;
+
+    if (!attr_cache)
+        return;
+
+    key = make_attr_key (head, path);
+    lru_cache_insert (attr_cache, key, g_memdup (stbuf, sizeof(struct stat)),
+                      sizeof(struct stat) + strlen(key));
+    g_free (key);
+}
+
+gboolean
+fuse_user_exists (SeafileSession *seaf, const char *user)
+{
+    CcnetEmailUser *emailuser;
+    gint64 *expire;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&cache_lock);
+    expire = g_hash_table_lookup (known_users, user);
+    if (expire && *expire > now) {
+        pthread_mutex_unlock (&cache_lock);
+        return TRUE;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    emailuser = ccnet_user_manager_get_emailuser (seaf->user_mgr, user);
+    if (!emailuser) {
+        pthread_mutex_lock (&cache_lock);
+        g_hash_table_remove (known_users, user);
+        pthread_mutex_unlock (&cache_lock);
+        return FALSE;
+    }
+    g_object_unref (emailuser);
+
+    if (attr_timeout > 0) {
+        expire = g_new (gint64, 1);
+        *expire = now + attr_timeout;
+        pthread_mutex_lock (&cache_lock);
+        g_hash_table_replace (known_users, g_strdup(user), expire);
+        pthread_mutex_unlock (&cache_lock);
+    }
+
+    return TRUE;
+}
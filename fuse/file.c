@@ -3,6 +3,8 @@
 #define FUSE_USE_VERSION  26
 #include <fuse.h>
 
+#include <pthread.h>
+
 #include <glib.h>
 #include <glib-object.h>
 
@@ -10,97 +12,436 @@
 
 #include "log.h"
 #include "utils.h"
+#include "lru-cache.h"
 
 #include "seaf-fuse.h"
 
-int read_file(SeafileSession *seaf,
-              const char *store_id, int version,
-              Seafile *file,
-              char *buf, size_t size,
-              off_t offset, struct fuse_file_info *info)
+/*
+ * Backups and indexers read files through the mount in small sequential
+ * chunks, so whole blocks are kept in a shared LRU cache and every read
+ * copies its part of a block from there. The size of the cache is set in
+ * MB by block_cache_size in the [fuse] section of seafile.conf, 0 disables
+ * it. Without the cache a block is read at the requested offset and closed.
+ *
+ * When a handle is read sequentially, the next read_ahead_blocks blocks
+ * ([fuse] section, default 4, 0 disables it) are loaded into the cache by
+ * a pool of read_ahead_threads threads, so a reader rarely waits for the
+ * block backend. A read missing a block that is being loaded waits for it
+ * instead of loading it again.
+ */
+
+#define DEFAULT_BLOCK_CACHE_SIZE_MB 256
+#define BLOCK_CACHE_SHARDS 16
+#define DEFAULT_READ_AHEAD_BLOCKS 4
+#define DEFAULT_READ_AHEAD_THREADS 8
+
+typedef struct CachedBlock {
+    guint32 size;
+    char data[];
+} CachedBlock;
+
+static LRUCache *block_cache;
+
+static int read_ahead_blocks;
+static int read_ahead_threads;
+static GThreadPool *read_ahead_pool;
+
+static pthread_mutex_t loading_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loading_cond = PTHREAD_COND_INITIALIZER;
+/* Cache keys of the blocks being loaded. */
+static GHashTable *loading_blocks;
+
+typedef struct ReadAheadJob {
+    char store_id[37];
+    int version;
+    char blk_id[41];
+} ReadAheadJob;
+
+static int
+get_fuse_config_int (SeafileSession *session, const char *key, int def)
 {
-    BlockHandle *handle = NULL;;
+    GError *error = NULL;
+    int val;
+
+    val = g_key_file_get_integer (session->config, "fuse", key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return def;
+    }
+    return val;
+}
+
+void
+fuse_block_cache_init (SeafileSession *session)
+{
+    int size_mb;
+
+    size_mb = get_fuse_config_int (session, "block_cache_size",
+                                   DEFAULT_BLOCK_CACHE_SIZE_MB);
+    if (size_mb <= 0) {
+        seaf_message ("fuse block cache is disabled.\n");
+        return;
+    }
+
+    block_cache = lru_cache_new ((gint64)size_mb << 20, BLOCK_CACHE_SHARDS,
+                                 g_free);
+    loading_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+
+    /* Blocks are read ahead into the cache. */
+    read_ahead_blocks = get_fuse_config_int (session, "read_ahead_blocks",
+                                             DEFAULT_READ_AHEAD_BLOCKS);
+    read_ahead_threads = get_fuse_config_int (session, "read_ahead_threads",
+                                              DEFAULT_READ_AHEAD_THREADS);
+    if (read_ahead_threads <= 0)
+        read_ahead_blocks = 0;
+}
+
+static void read_ahead_fetch (gpointer job_data, gpointer user_data);
+
+void
+fuse_block_cache_start (SeafileSession *session)
+{
+    if (read_ahead_blocks <= 0)
+        return;
+
+    read_ahead_pool = g_thread_pool_new (read_ahead_fetch, session,
+                                         read_ahead_threads, FALSE, NULL);
+    if (!read_ahead_pool)
+        seaf_warning ("Failed to create read-ahead thread pool.\n");
+}
+
+FuseFile *
+fuse_file_new (const char *store_id, int version, Seafile *file)
+{
+    FuseFile *ff = g_new0 (FuseFile, 1);
+
+    memcpy (ff->store_id, store_id, 36);
+    ff->version = version;
+    ff->file = file;
+    ff->ahead_idx = -1;
+    pthread_mutex_init (&ff->lock, NULL);
+
+    return ff;
+}
+
+void
+fuse_file_free (FuseFile *ff)
+{
+    if (!ff)
+        return;
+    seafile_unref (ff->file);
+    pthread_mutex_destroy (&ff->lock);
+    g_free (ff);
+}
+
+typedef struct CopyRange {
+    char *buf;
+    guint32 offset;
+    guint32 size;
+    guint32 copied;
+} CopyRange;
+
+static gpointer
+copy_block_range (gconstpointer value, gpointer user_data)
+{
+    const CachedBlock *blk = value;
+    CopyRange *range = user_data;
+
+    if (range->offset < blk->size) {
+        range->copied = MIN (range->size, blk->size - range->offset);
+        memcpy (range->buf, blk->data + range->offset, range->copied);
+    }
+
+    /* Any non-NULL value tells the block was found. */
+    return (gpointer)blk;
+}
+
+static CachedBlock *
+load_block (SeafileSession *seaf, const char *store_id, int version,
+            const char *blkid)
+{
+    BlockHandle *handle;
     BlockMetadata *bmd;
-    char *blkid;
-    char *ptr;
-    off_t off = 0, nleft;
-    int i, n, ret = -EIO;
+    CachedBlock *blk = NULL;
+    guint32 size;
+    int n;
 
-    for (i = 0; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
+    handle = seaf_block_manager_open_block(seaf->block_mgr,
+                                           store_id, version,
+                                           blkid, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s.\n", store_id, blkid);
+        return NULL;
+    }
 
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id, version, blkid);
-        if (!bmd)
-            return -EIO;
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s:%s.\n", store_id, blkid);
+        goto out;
+    }
+    size = bmd->size;
+    g_free (bmd);
 
-        if (offset < off + bmd->size) {
-            g_free (bmd);
-            break;
+    blk = g_malloc (sizeof(CachedBlock) + size);
+    blk->size = 0;
+    while (blk->size < size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           blk->data + blk->size,
+                                           size - blk->size);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
+            g_free (blk);
+            blk = NULL;
+            goto out;
+        }
+        blk->size += n;
+    }
+
+out:
+    seaf_block_manager_close_block(seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return blk;
+}
+
+/* Returns FALSE if the block is being loaded by another thread. */
+static gboolean
+try_claim_block_load (const char *key)
+{
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&loading_lock);
+    if (!g_hash_table_lookup (loading_blocks, key)) {
+        g_hash_table_insert (loading_blocks, g_strdup(key), (gpointer)1);
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&loading_lock);
+
+    return ret;
+}
+
+/* Claims the load of a block. If another thread is loading it, waits for
+ * that to finish and returns FALSE without claiming it.
+ */
+static gboolean
+claim_block_load (const char *key)
+{
+    gboolean waited = FALSE;
+
+    pthread_mutex_lock (&loading_lock);
+    while (g_hash_table_lookup (loading_blocks, key)) {
+        waited = TRUE;
+        pthread_cond_wait (&loading_cond, &loading_lock);
+    }
+    if (!waited)
+        g_hash_table_insert (loading_blocks, g_strdup(key), (gpointer)1);
+    pthread_mutex_unlock (&loading_lock);
+
+    return !waited;
+}
+
+static void
+release_block_load (const char *key)
+{
+    pthread_mutex_lock (&loading_lock);
+    g_hash_table_remove (loading_blocks, key);
+    pthread_cond_broadcast (&loading_cond);
+    pthread_mutex_unlock (&loading_lock);
+}
+
+/* Read @size bytes from @blk_off of a block through the block cache.
+ * Returns the number of bytes read, which is less than @size only at
+ * the end of the block.
+ */
+static int
+read_cached_block (SeafileSession *seaf, const char *store_id, int version,
+                   const char *blkid, guint32 blk_off, char *buf, guint32 size)
+{
+    CopyRange range;
+    CachedBlock *blk;
+    char key[80];
+
+    range.buf = buf;
+    range.offset = blk_off;
+    range.size = size;
+    range.copied = 0;
+
+    snprintf (key, sizeof(key), "%s:%s", store_id, blkid);
+    if (lru_cache_lookup_full (block_cache, key, copy_block_range, &range))
+        return range.copied;
+
+    while (!claim_block_load (key)) {
+        /* Loaded by another thread meanwhile, unless that failed. */
+        if (lru_cache_lookup_full (block_cache, key, copy_block_range, &range))
+            return range.copied;
+    }
+
+    blk = load_block (seaf, store_id, version, blkid);
+    if (blk) {
+        copy_block_range (blk, &range);
+        lru_cache_insert (block_cache, key, blk,
+                          sizeof(CachedBlock) + blk->size + strlen(key));
+    }
+    release_block_load (key);
+
+    return blk ? (int)range.copied : -EIO;
+}
+
+static gpointer
+block_found (gconstpointer value, gpointer user_data)
+{
+    return (gpointer)value;
+}
+
+static void
+read_ahead_fetch (gpointer job_data, gpointer user_data)
+{
+    SeafileSession *seaf = user_data;
+    ReadAheadJob *job = job_data;
+    CachedBlock *blk;
+    char key[80];
+
+    snprintf (key, sizeof(key), "%s:%s", job->store_id, job->blk_id);
+    blk = load_block (seaf, job->store_id, job->version, job->blk_id);
+    if (blk)
+        lru_cache_insert (block_cache, key, blk,
+                          sizeof(CachedBlock) + blk->size + strlen(key));
+    release_block_load (key);
+
+    g_free (job);
+}
+
+/* Queue the loads of blocks [from, to) of a file that aren't cached or
+ * being loaded already.
+ */
+static void
+read_ahead_schedule (FuseFile *ff, int from, int to)
+{
+    ReadAheadJob *job;
+    char key[80];
+    int i;
+
+    for (i = from; i < to && i < ff->file->n_blocks; i++) {
+        snprintf (key, sizeof(key), "%s:%s",
+                  ff->store_id, ff->file->blk_sha1s[i]);
+        if (lru_cache_lookup_full (block_cache, key, block_found, NULL))
+            continue;
+        if (!try_claim_block_load (key))
+            continue;
+
+        job = g_new0 (ReadAheadJob, 1);
+        memcpy (job->store_id, ff->store_id, 36);
+        job->version = ff->version;
+        memcpy (job->blk_id, ff->file->blk_sha1s[i], 40);
+        g_thread_pool_push (read_ahead_pool, job, NULL);
+    }
+}
+
+/* Read @size bytes from @blk_off of a block without caching it. */
+static int
+read_block_at (SeafileSession *seaf, const char *store_id, int version,
+               const char *blkid, guint32 blk_off, char *buf, guint32 size)
+{
+    BlockHandle *handle;
+    char tmp[4096];
+    guint32 skipped = 0, done = 0;
+    int n, ret = -EIO;
+
+    handle = seaf_block_manager_open_block(seaf->block_mgr,
+                                           store_id, version,
+                                           blkid, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s.\n", store_id, blkid);
+        return -EIO;
+    }
+
+    /* Block handles can't seek, skip to the offset in a small buffer. */
+    while (skipped < blk_off) {
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle, tmp,
+                                          MIN (sizeof(tmp), blk_off - skipped));
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
+            goto out;
         }
+        skipped += n;
+    }
 
-        off += bmd->size;
-        g_free (bmd);
+    while (done < size) {
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle,
+                                          buf + done, size - done);
+        if (n < 0) {
+            seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
+            goto out;
+        }
+        if (n == 0)
+            break;
+        done += n;
     }
+    ret = done;
+
+out:
+    seaf_block_manager_close_block(seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+int read_file(SeafileSession *seaf, FuseFile *ff,
+              char *buf, size_t size, off_t offset)
+{
+    Seafile *file = ff->file;
+    char *blkid;
+    char *ptr;
+    guint64 blk_start = 0;
+    size_t nleft;
+    guint32 blk_off;
+    int i, n;
+
+    if (seaf_fs_manager_find_block (seaf->fs_mgr, ff->store_id, ff->version,
+                                    file, offset, &i, &blk_start) < 0)
+        return -EIO;
 
     /* beyond the file size */
     if (i == file->n_blocks)
         return 0;
 
+    if (read_ahead_pool) {
+        gboolean sequential;
+        int from;
+
+        pthread_mutex_lock (&ff->lock);
+        sequential = ((guint64)offset == ff->next_off);
+        ff->next_off = offset + size;
+        if (!sequential)
+            ff->ahead_idx = i;
+        from = MAX (i + 1, ff->ahead_idx + 1);
+        if (sequential && from <= i + read_ahead_blocks)
+            ff->ahead_idx = i + read_ahead_blocks;
+        pthread_mutex_unlock (&ff->lock);
+
+        if (sequential)
+            read_ahead_schedule (ff, from, i + read_ahead_blocks + 1);
+    }
+
+    blk_off = offset - blk_start;
     nleft = size;
     ptr = buf;
     while (nleft > 0 && i < file->n_blocks) {
         blkid = file->blk_sha1s[i];
 
-        handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                               store_id, version,
-                                               blkid, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s:%s.\n", store_id, blkid);
-            return -EIO;
-        }
-
-        /* trim the offset in a block */
-        if (offset > off) {
-            char *tmp = (char *)malloc(sizeof(char) * (offset - off));
-            if (!tmp)
-                return -ENOMEM;
-
-            n = seaf_block_manager_read_block(seaf->block_mgr, handle,
-                                              tmp, offset-off);
-            if (n != offset - off) {
-                seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
-                free (tmp);
-                goto out;
-            }
-
-            off += n;
-            free(tmp);
-        }
-
-        if ((n = seaf_block_manager_read_block(seaf->block_mgr,
-                                               handle, ptr, nleft)) < 0) {
-            seaf_warning ("Failed to read block %s:%s.\n", store_id, blkid);
-            goto out;
-        }
+        if (block_cache)
+            n = read_cached_block (seaf, ff->store_id, ff->version, blkid,
+                                   blk_off, ptr, nleft);
+        else
+            n = read_block_at (seaf, ff->store_id, ff->version, blkid,
+                               blk_off, ptr, nleft);
+        if (n < 0)
+            return n;
 
         nleft -= n;
         ptr += n;
-        off += n;
+        blk_off = 0;
         ++i;
-
-        /* At this point we should have read all the content of the block or
-         * have read up to @size bytes. So it's safe to close the block.
-         */
-        seaf_block_manager_close_block(seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
     }
 
     return size - nleft;
-
-out:
-    if (handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-    }
-    return ret;
 }
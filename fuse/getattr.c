@@ -33,13 +33,9 @@ static int getattr_root(SeafileSession *seaf, struct stat *stbuf)
 
 static int getattr_user(SeafileSession *seaf, const char *user, struct stat *stbuf)
 {
-    CcnetEmailUser *emailuser;
-
-    emailuser = ccnet_user_manager_get_emailuser (seaf->user_mgr, user);
-    if (!emailuser) {
+    if (!fuse_user_exists (seaf, user)) {
         return -ENOENT;
     }
-    g_object_unref (emailuser);
 
     stbuf->st_mode = S_IFDIR | 0755;
     stbuf->st_nlink = 2;
@@ -52,33 +48,21 @@ static int getattr_repo(SeafileSession *seaf,
                         const char *user, const char *repo_id, const char *repo_path,
                         struct stat *stbuf)
 {
-    SeafRepo *repo = NULL;
-    SeafBranch *branch;
-    SeafCommit *commit = NULL;
+    FuseRepoHead head;
     guint32 mode = 0;
     char *id = NULL;
+    gboolean cacheable = TRUE;
     int ret = 0;
 
-    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to get repo %s.\n", repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    if (fuse_get_repo_head (seaf, repo_id, &head) < 0)
+        return -ENOENT;
 
-    branch = repo->head;
-    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
-                                            repo->id, repo->version,
-                                            branch->commit_id);
-    if (!commit) {
-        seaf_warning ("Failed to get commit %s:%.8s.\n", repo->id, branch->commit_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    if (fuse_attr_cache_lookup (&head, repo_path, stbuf))
+        return 0;
 
     id = seaf_fs_manager_path_to_obj_id(seaf->fs_mgr,
-                                        repo->store_id, repo->version,
-                                        commit->root_id,
+                                        head.store_id, head.version,
+                                        head.root_id,
                                         repo_path, &mode, NULL);
     if (!id) {
         seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
@@ -92,20 +76,22 @@ static int getattr_repo(SeafileSession *seaf,
         int cnt = 2; /* '.' and '..' */
 
         dir = seaf_fs_manager_get_seafdir(seaf->fs_mgr,
-                                          repo->store_id, repo->version, id);
+                                          head.store_id, head.version, id);
         if (dir) {
             for (l = dir->entries; l; l = l->next)
                 cnt++;
+        } else {
+            cacheable = FALSE;
         }
 
         if (strcmp (repo_path, "/") != 0) {
             // get dirent of the dir
             SeafDirent *dirent = seaf_fs_manager_get_dirent_by_path (seaf->fs_mgr,
-                                                                     repo->store_id,
-                                                                     repo->version,
-                                                                     commit->root_id,
+                                                                     head.store_id,
+                                                                     head.version,
+                                                                     head.root_id,
                                                                      repo_path, NULL);
-            if (dirent && repo->version != 0)
+            if (dirent && head.version != 0)
                 stbuf->st_mtime = dirent->mtime;
 
             seaf_dirent_free (dirent);
@@ -120,16 +106,18 @@ static int getattr_repo(SeafileSession *seaf,
         Seafile *file;
 
         file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
-                                           repo->store_id, repo->version, id);
+                                           head.store_id, head.version, id);
         if (file)
             stbuf->st_size = file->file_size;
+        else
+            cacheable = FALSE;
 
         SeafDirent *dirent = seaf_fs_manager_get_dirent_by_path (seaf->fs_mgr,
-                                                                 repo->store_id,
-                                                                 repo->version,
-                                                                 commit->root_id,
+                                                                 head.store_id,
+                                                                 head.version,
+                                                                 head.root_id,
                                                                  repo_path, NULL);
-        if (dirent && repo->version != 0)
+        if (dirent && head.version != 0)
             stbuf->st_mtime = dirent->mtime;
 
         stbuf->st_mode = mode | 0644;
@@ -138,13 +126,15 @@ static int getattr_repo(SeafileSession *seaf,
         seaf_dirent_free (dirent);
         seafile_unref (file);
     } else {
-        return -ENOENT;
+        ret = -ENOENT;
+        goto out;
     }
 
+    if (cacheable)
+        fuse_attr_cache_add (&head, repo_path, stbuf);
+
 out:
     g_free (id);
-    seaf_repo_unref (repo);
-    seaf_commit_unref (commit);
     return ret;
 }
 
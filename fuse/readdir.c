@@ -90,15 +90,12 @@ static int readdir_user(SeafileSession *seaf, const char *user,
                         void *buf, fuse_fill_dir_t filler, off_t offset,
                         struct fuse_file_info *info)
 {
-    CcnetEmailUser *emailuser;
     GList *list = NULL, *p;
     GString *name;
 
-    emailuser = ccnet_user_manager_get_emailuser (seaf->user_mgr, user);
-    if (!emailuser) {
+    if (!fuse_user_exists (seaf, user)) {
         return -ENOENT;
     }
-    g_object_unref (emailuser);
 
     list = seaf_repo_manager_get_repos_by_owner (seaf->repo_mgr, user);
     if (!list) {
@@ -135,56 +132,75 @@ static int readdir_user(SeafileSession *seaf, const char *user,
     return 0;
 }
 
+/* Cache the stats of the files of a listed dir, which a listing is
+ * usually followed by. Stats of version 0 dirents lack the size.
+ */
+static void
+cache_file_stats (const FuseRepoHead *head, const char *repo_path, SeafDir *dir)
+{
+    struct stat st;
+    GList *l;
+
+    if (head->version == 0)
+        return;
+
+    for (l = dir->entries; l; l = l->next) {
+        SeafDirent *seaf_dent = (SeafDirent *) l->data;
+        char *path;
+
+        if (!S_ISREG(seaf_dent->mode))
+            continue;
+
+        memset (&st, 0, sizeof(st));
+        st.st_mode = seaf_dent->mode | 0644;
+        st.st_nlink = 1;
+        st.st_size = seaf_dent->size;
+        st.st_mtime = seaf_dent->mtime;
+
+        if (strcmp (repo_path, "/") == 0)
+            path = g_strdup (seaf_dent->name);
+        else
+            path = g_strconcat (repo_path, "/", seaf_dent->name, NULL);
+        fuse_attr_cache_add (head, path, &st);
+        g_free (path);
+    }
+}
+
 static int readdir_repo(SeafileSession *seaf,
                         const char *user, const char *repo_id, const char *repo_path,
                         void *buf, fuse_fill_dir_t filler, off_t offset,
                         struct fuse_file_info *info)
 {
-    SeafRepo *repo = NULL;
-    SeafBranch *branch;
-    SeafCommit *commit = NULL;
+    FuseRepoHead head;
     SeafDir *dir = NULL;
     GList *l;
-    int ret = 0;
-
-    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to get repo %s.\n", repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
 
-    branch = repo->head;
-    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
-                                            repo->id, repo->version,
-                                            branch->commit_id);
-    if (!commit) {
-        seaf_warning ("Failed to get commit %s:%.8s.\n", repo->id, branch->commit_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    if (fuse_get_repo_head (seaf, repo_id, &head) < 0)
+        return -ENOENT;
 
     dir = seaf_fs_manager_get_seafdir_by_path(seaf->fs_mgr,
-                                              repo->store_id, repo->version,
-                                              commit->root_id,
+                                              head.store_id, head.version,
+                                              head.root_id,
                                               repo_path, NULL);
     if (!dir) {
         seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
-        ret = -ENOENT;
-        goto out;
+        return -ENOENT;
     }
 
     for (l = dir->entries; l; l = l->next) {
         SeafDirent *seaf_dent = (SeafDirent *) l->data;
-        /* FIXME: maybe we need to return stbuf */
-        filler(buf, seaf_dent->name, NULL, 0);
+        struct stat st;
+
+        /* The high level API only passes the type of entries on. */
+        memset (&st, 0, sizeof(st));
+        st.st_mode = seaf_dent->mode;
+        filler(buf, seaf_dent->name, &st, 0);
     }
 
-out:
-    seaf_repo_unref (repo);
-    seaf_commit_unref (commit);
+    cache_file_stats (&head, repo_path, dir);
+
     seaf_dir_free (dir);
-    return ret;
+    return 0;
 }
 
 int do_readdir(SeafileSession *seaf, const char *path, void *buf,
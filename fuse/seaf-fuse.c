@@ -101,10 +101,10 @@ static int seaf_fuse_open(const char *path, struct fuse_file_info *info)
 {
     int n_parts;
     char *user, *repo_id, *repo_path;
-    SeafRepo *repo = NULL;
-    SeafBranch *branch = NULL;
-    SeafCommit *commit = NULL;
+    FuseRepoHead head;
+    Seafile *file;
     guint32 mode = 0;
+    char *id = NULL;
     int ret = 0;
 
     /* Now we only support read-only mode */
@@ -122,121 +122,64 @@ static int seaf_fuse_open(const char *path, struct fuse_file_info *info)
         goto out;
     }
 
-    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to get repo %s.\n", repo_id);
+    if (fuse_get_repo_head (seaf, repo_id, &head) < 0) {
         ret = -ENOENT;
         goto out;
     }
 
-    branch = repo->head;
-    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
-                                            repo->id,
-                                            repo->version,
-                                            branch->commit_id);
-    if (!commit) {
-        seaf_warning ("Failed to get commit %s:%.8s.\n", repo->id, branch->commit_id);
+    id = seaf_fs_manager_path_to_obj_id(seaf->fs_mgr,
+                                        head.store_id, head.version,
+                                        head.root_id,
+                                        repo_path, &mode, NULL);
+    if (!id) {
+        seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
         ret = -ENOENT;
         goto out;
     }
 
-    char *id = seaf_fs_manager_path_to_obj_id(seaf->fs_mgr,
-                                              repo->store_id, repo->version,
-                                              commit->root_id,
-                                              repo_path, &mode, NULL);
-    if (!id) {
-        seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
-        ret = -ENOENT;
+    if (!S_ISREG(mode)) {
+        ret = -EACCES;
         goto out;
     }
-    g_free (id);
 
-    if (!S_ISREG(mode))
-        return -EACCES;
+    /* Reads of the handle see the file as it was when it was opened. */
+    file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
+                                       head.store_id, head.version, id);
+    if (!file) {
+        ret = -ENOENT;
+        goto out;
+    }
+    info->fh = (uint64_t)(uintptr_t)fuse_file_new (head.store_id,
+                                                   head.version, file);
 
 out:
+    g_free (id);
     g_free (user);
     g_free (repo_id);
     g_free (repo_path);
-    seaf_repo_unref (repo);
-    seaf_commit_unref (commit);
     return ret;
 }
 
 static int seaf_fuse_read(const char *path, char *buf, size_t size,
                           off_t offset, struct fuse_file_info *info)
 {
-    int n_parts;
-    char *user, *repo_id, *repo_path;
-    SeafRepo *repo = NULL;
-    SeafBranch *branch = NULL;
-    SeafCommit *commit = NULL;
-    Seafile *file = NULL;
-    char *file_id = NULL;
-    int ret = 0;
+    FuseFile *ff = (FuseFile *)(uintptr_t)info->fh;
 
     /* Now we only support read-only mode */
     if ((info->flags & 3) != O_RDONLY)
         return -EACCES;
 
-    if (parse_fuse_path (path, &n_parts, &user, &repo_id, &repo_path) < 0) {
-        seaf_warning ("Invalid input path %s.\n", path);
-        return -ENOENT;
-    }
-
-    if (n_parts != 2 && n_parts != 3) {
-        seaf_warning ("Invalid input path for open: %s.\n", path);
-        ret = -EACCES;
-        goto out;
-    }
-
-    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to get repo %s.\n", repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    if (!ff)
+        return -EBADF;
 
-    branch = repo->head;
-    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
-                                            repo->id,
-                                            repo->version,
-                                            branch->commit_id);
-    if (!commit) {
-        seaf_warning ("Failed to get commit %s:%.8s.\n", repo->id, branch->commit_id);
-        ret = -ENOENT;
-        goto out;
-    }
-
-    file_id = seaf_fs_manager_get_seafile_id_by_path(seaf->fs_mgr,
-                                                     repo->store_id, repo->version,
-                                                     commit->root_id,
-                                                     repo_path, NULL);
-    if (!file_id) {
-        seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
-
-    file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
-                                       repo->store_id, repo->version, file_id);
-    if (!file) {
-        ret = -ENOENT;
-        goto out;
-    }
-
-    ret = read_file(seaf, repo->store_id, repo->version,
-                    file, buf, size, offset, info);
-    seafile_unref (file);
+    return read_file(seaf, ff, buf, size, offset);
+}
 
-out:
-    g_free (user);
-    g_free (repo_id);
-    g_free (repo_path);
-    g_free (file_id);
-    seaf_repo_unref (repo);
-    seaf_commit_unref (commit);
-    return ret;
+static int seaf_fuse_release(const char *path, struct fuse_file_info *info)
+{
+    fuse_file_free ((FuseFile *)(uintptr_t)info->fh);
+    info->fh = 0;
+    return 0;
 }
 
 struct options {
@@ -275,6 +218,7 @@ static struct fuse_operations seaf_fuse_ops = {
     .readdir = seaf_fuse_readdir,
     .open    = seaf_fuse_open,
     .read    = seaf_fuse_read,
+    .release = seaf_fuse_release,
 };
 
 int main(int argc, char *argv[])
@@ -287,6 +231,9 @@ int main(int argc, char *argv[])
     char *logfile = NULL;
     char *ccnet_debug_level_str = "info";
     char *seafile_debug_level_str = "debug";
+    struct fuse *fuse;
+    char *mountpoint;
+    int multithreaded;
     int ret;
 
     memset(&options, 0, sizeof(struct options));
@@ -337,7 +284,34 @@ int main(int argc, char *argv[])
 
     set_syslog_config (seaf->config);
 
-    ret = fuse_main(args.argc, args.argv, &seaf_fuse_ops, NULL);
+    fuse_block_cache_init (seaf);
+    fuse_attr_cache_init (seaf);
+
+    /* Let the kernel reuse lookups for as long as the caches keep them.
+     * Inserted before the user's options, which take precedence.
+     */
+    char *timeouts = g_strdup_printf ("-oentry_timeout=%d,attr_timeout=%d",
+                                      fuse_attr_timeout (), fuse_attr_timeout ());
+    fuse_opt_insert_arg (&args, 1, timeouts);
+    g_free (timeouts);
+
+    /* fuse_setup() daemonizes, threads must only be started after it. */
+    fuse = fuse_setup (args.argc, args.argv, &seaf_fuse_ops,
+                       sizeof(seaf_fuse_ops), &mountpoint, &multithreaded, NULL);
     fuse_opt_free_args(&args);
-    return ret;
+    if (!fuse)
+        exit(1);
+
+    fuse_block_cache_start (seaf);
+
+    /* Requests are served by a pool of threads, unless -s is given. */
+    if (multithreaded) {
+        ret = fuse_loop_mt (fuse);
+    } else {
+        seaf_message ("Running single-threaded.\n");
+        ret = fuse_loop (fuse);
+    }
+
+    fuse_teardown (fuse, mountpoint);
+    return ret < 0 ? 1 : 0;
 }
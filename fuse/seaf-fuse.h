@@ -1,6 +1,8 @@
 #ifndef SEAF_FUSE_H
 #define SEAF_FUSE_H
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 
 int parse_fuse_path (const char *path,
@@ -14,9 +16,61 @@ fuse_get_dirent_by_path (SeafFSManager *mgr,
                          const char *path);
 
 /* file.c */
-int read_file(SeafileSession *seaf, const char *store_id, int version,
-              Seafile *file, char *buf, size_t size,
-              off_t offset, struct fuse_file_info *info);
+
+/* A file opened through the mount, kept in fuse_file_info->fh. */
+typedef struct FuseFile {
+    char store_id[37];
+    int version;
+    Seafile *file;
+
+    /* Reads of a handle may run in parallel. */
+    pthread_mutex_t lock;
+    /* Offset a sequential read continues from. */
+    guint64 next_off;
+    /* Last block read ahead. */
+    int ahead_idx;
+} FuseFile;
+
+void fuse_block_cache_init (SeafileSession *session);
+
+/* Starts the read-ahead threads, once the process runs in the background. */
+void fuse_block_cache_start (SeafileSession *session);
+
+FuseFile *fuse_file_new (const char *store_id, int version, Seafile *file);
+
+void fuse_file_free (FuseFile *ff);
+
+int read_file(SeafileSession *seaf, FuseFile *ff,
+              char *buf, size_t size, off_t offset);
+
+/* attr-cache.c */
+
+/* The head of a repo as last read, see attr-cache.c. */
+typedef struct FuseRepoHead {
+    char repo_id[37];
+    char store_id[37];
+    int version;
+    gboolean encrypted;
+    char commit_id[41];
+    char root_id[41];
+    gint64 expire;
+} FuseRepoHead;
+
+void fuse_attr_cache_init (SeafileSession *session);
+
+/* Seconds the kernel and the caches keep entries and attributes. */
+int fuse_attr_timeout (void);
+
+int fuse_get_repo_head (SeafileSession *seaf, const char *repo_id,
+                        FuseRepoHead *head);
+
+gboolean fuse_attr_cache_lookup (const FuseRepoHead *head, const char *path,
+                                 struct stat *stbuf);
+
+void fuse_attr_cache_add (const FuseRepoHead *head, const char *path,
+                          const struct stat *stbuf);
+
+gboolean fuse_user_exists (SeafileSession *seaf, const char *user);
 
 /* getattr.c */
 int do_getattr(SeafileSession *seaf, const char *path, struct stat *stbuf);
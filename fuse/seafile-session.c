@@ -193,6 +193,10 @@ seafile_session_init (SeafileSession *session)
         return -1;
     }
 
+    if (ccnet_user_manager_create_tables (session->user_mgr) < 0 ||
+        ccnet_group_manager_create_tables (session->group_mgr) < 0)
+        return -1;
+
     return 0;
 }
 
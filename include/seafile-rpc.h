@@ -442,6 +442,23 @@ seafile_set_repo_owner(const char *repo_id, const char *email,
 char *
 seafile_get_repo_owner(const char *repo_id, GError **error);
 
+/*
+ * Batched lookups for list views. @repo_ids is a json array of repo ids.
+ */
+GList *
+seafile_get_repos_by_ids (const char *repo_ids, GError **error);
+
+/* Returns a json object from repo id to owner. */
+json_t *
+seafile_get_repo_owners (const char *repo_ids, GError **error);
+
+/* Returns a json object from repo id to {"size": ..., "file_count": ...}. */
+json_t *
+seafile_get_repo_sizes (const char *repo_ids, GError **error);
+
+GList *
+seafile_get_repo_head_commits (const char *repo_ids, GError **error);
+
 GList *
 seafile_get_orphan_repo_list(GError **error);
 
@@ -506,6 +523,35 @@ seafile_query_zip_progress (const char *token, GError **error);
 int
 seafile_cancel_zip_task (const char *token, GError **error);
 
+char *
+seafile_get_zip_task_stats (GError **error);
+
+/* Counts and times of the sql templates run, as a json array. */
+char *
+seafile_get_db_query_stats (GError **error);
+
+/* Acquisitions, waits and hold times of the instrumented locks, as a json
+ * array. Empty unless lock_stats is enabled.
+ */
+char *
+seafile_get_lock_stats (GError **error);
+
+/*
+ * Returns the sampled read stats of repos, dirs and blocks as a JSON
+ * object, see lib/access-stats.h. Empty unless access_stats_sample_rate
+ * is set.
+ */
+char *
+seafile_get_access_stats (GError **error);
+
+/* Version stamps of cacheable data, see server/cache-version.h. */
+char *
+seafile_get_cache_versions (GError **error);
+
+/* Storage reclaim jobs of deleted repos, as a json array. */
+char *
+seafile_get_repo_reclaim_progress (GError **error);
+
 GObject *
 seafile_get_checkout_task (const char *repo_id, GError **error);
 
@@ -541,6 +587,12 @@ seafile_add_share (const char *repo_id, const char *from_email,
                    const char *to_email, const char *permission,
                    GError **error);
 
+/* @to_emails: json array of emails. */
+int
+seafile_add_shares (const char *repo_id, const char *from_email,
+                    const char *to_emails, const char *permission,
+                    GError **error);
+
 GList *
 seafile_list_share_repos (const char *email, const char *type,
                           int start, int limit, GError **error);
@@ -585,6 +637,11 @@ int
 seafile_group_share_repo (const char *repo_id, int group_id,
                           const char *user_name, const char *permission,
                           GError **error);
+/* @group_ids: json array of group ids. */
+int
+seafile_group_share_repo_to_groups (const char *repo_id, const char *group_ids,
+                                    const char *user_name, const char *permission,
+                                    GError **error);
 int
 seafile_group_unshare_repo (const char *repo_id, int group_id,
                             const char *user_name, GError **error);
@@ -797,6 +854,16 @@ seafile_rename_file (const char *repo_id,
                      const char *user,
                      GError **error);
 
+/**
+ * Apply a list of file operations in one commit.
+ * Return the id of the new head commit.
+ */
+char *
+seafile_apply_batch_ops (const char *repo_id,
+                         const char *ops_json,
+                         const char *user,
+                         GError **error);
+
 /**
  * Return non-zero if filename is valid.
  */
@@ -991,6 +1058,16 @@ seafile_create_virtual_repo (const char *origin_repo_id,
                              const char *passwd,
                              GError **error);
 
+/* Create a library sharing the content of a commit of src_repo_id, which
+ * is its head if commit_id is empty. */
+char *
+seafile_fork_repo (const char *src_repo_id,
+                   const char *commit_id,
+                   const char *repo_name,
+                   const char *owner,
+                   const char *passwd,
+                   GError **error);
+
 GList *
 seafile_get_virtual_repos_by_owner (const char *owner, GError **error);
 
@@ -1003,6 +1080,10 @@ seafile_get_virtual_repo (const char *origin_repo,
 char *
 seafile_get_system_default_repo_id (GError **error);
 
+/* Returns 1 once startup is complete, 0 before. */
+int
+seafile_is_server_ready (GError **error);
+
 /* Clean trash */
 
 int
@@ -1138,9 +1219,16 @@ seafile_publish_event(const char *channel, const char *content, GError **error);
 json_t *
 seafile_pop_event(const char *channel, GError **error);
 
+/* Returns a json array of up to @max_events events, at most 1000. */
+json_t *
+seafile_pop_events (const char *channel, int max_events, GError **error);
+
 GList *
 seafile_search_files (const char *repo_id, const char *str, GError **error);
 
+int
+seafile_rebuild_search_index (const char *repo_id, GError **error);
+
 /*Following is ccnet rpc*/
 int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
@@ -1182,6 +1270,13 @@ ccnet_rpc_count_emailusers (const char *source, GError **error);
 gint64
 ccnet_rpc_count_inactive_emailusers (const char *source, GError **error);
 
+/*
+ * Drop the stored user and org counts, so that they are counted again.
+ * Needed after users or orgs are changed in the database directly.
+ */
+int
+ccnet_rpc_reconcile_row_counts (GError **error);
+
 int
 ccnet_rpc_update_emailuser (const char *source, int id, const char* passwd,
                             int is_staff, int is_active,
@@ -1213,6 +1308,10 @@ ccnet_rpc_remove_group (int group_id, GError **error);
 int
 ccnet_rpc_group_add_member (int group_id, const char *user_name,
                             const char *member_name, GError **error);
+/* @member_names: json array of user names. */
+int
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *member_names, GError **error);
 int
 ccnet_rpc_group_remove_member (int group_id, const char *user_name,
                                const char *member_name, GError **error);
@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "access-stats.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+
+typedef struct ClassStats {
+    pthread_mutex_t lock;
+
+    guint32 sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    guint64 sampled;
+    /* Min-heap by count of the top objects, ids are owned. */
+    AccessHitter heap[ACCESS_TOP_K];
+    int n_heap;
+
+    /* id -> position of its last read in the window, from 1. */
+    GHashTable *last_read;
+    /* Fenwick tree marking the positions that are the last read of an
+     * object, so that the objects read since a position are counted in
+     * O(log n). Index 0 is unused.
+     */
+    guint32 *last_marks;
+    guint32 pos;
+    guint64 followed;
+    guint64 cold;
+    guint64 reuse[ACCESS_N_REUSE_BUCKETS];
+} ClassStats;
+
+static int sample_rate;
+static ClassStats classes[ACCESS_N_CLASSES];
+
+static const char *class_names[ACCESS_N_CLASSES] = {
+    "repo",
+    "dir",
+    "block",
+};
+
+void
+seaf_access_stats_init (int rate)
+{
+    int i;
+
+    if (rate <= 0)
+        return;
+
+    for (i = 0; i < ACCESS_N_CLASSES; ++i) {
+        pthread_mutex_init (&classes[i].lock, NULL);
+        classes[i].last_read = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+        classes[i].last_marks = g_new0 (guint32, ACCESS_REUSE_WINDOW + 1);
+    }
+    sample_rate = rate;
+}
+
+int
+seaf_access_stats_sample_rate ()
+{
+    return sample_rate;
+}
+
+const char *
+seaf_access_class_name (AccessClass cls)
+{
+    return class_names[cls];
+}
+
+static guint64
+hash_id (const char *id)
+{
+    guint64 h = 14695981039346656037ULL;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)id; *p; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static __thread guint32 rand_state;
+
+static guint32
+next_rand ()
+{
+    guint32 x = rand_state;
+
+    if (x == 0)
+        x = (guint32)(gsize)&rand_state ^ (guint32)time(NULL) ^ 0x9e3779b9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rand_state = x;
+
+    return x;
+}
+
+static guint32
+sketch_add (ClassStats *st, guint64 h)
+{
+    guint32 h1 = (guint32)h, h2 = (guint32)(h >> 32) | 1;
+    guint32 est = G_MAXUINT32;
+    guint32 *counter;
+    int i;
+
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        counter = &st->sketch[i][(h1 + i * h2) & (SKETCH_WIDTH - 1)];
+        if (*counter < G_MAXUINT32)
+            ++(*counter);
+        if (*counter < est)
+            est = *counter;
+    }
+
+    return est;
+}
+
+static void
+heap_swap (ClassStats *st, int i, int j)
+{
+    AccessHitter tmp = st->heap[i];
+
+    st->heap[i] = st->heap[j];
+    st->heap[j] = tmp;
+}
+
+static void
+heap_sift_down (ClassStats *st, int i)
+{
+    int l, r, min;
+
+    while (1) {
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+        if (l < st->n_heap && st->heap[l].count < st->heap[min].count)
+            min = l;
+        if (r < st->n_heap && st->heap[r].count < st->heap[min].count)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap (st, i, min);
+        i = min;
+    }
+}
+
+static void
+heap_sift_up (ClassStats *st, int i)
+{
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (st->heap[parent].count <= st->heap[i].count)
+            return;
+        heap_swap (st, i, parent);
+        i = parent;
+    }
+}
+
+static void
+update_top (ClassStats *st, const char *id, guint32 est)
+{
+    int i;
+
+    /* The heap is small enough to be searched. */
+    for (i = 0; i < st->n_heap; ++i) {
+        if (strcmp (st->heap[i].id, id) == 0) {
+            st->heap[i].count = est;
+            heap_sift_down (st, i);
+            return;
+        }
+    }
+
+    if (st->n_heap < ACCESS_TOP_K) {
+        i = st->n_heap++;
+        st->heap[i].id = g_strdup (id);
+        st->heap[i].count = est;
+        heap_sift_up (st, i);
+    } else if (est > st->heap[0].count) {
+        g_free (st->heap[0].id);
+        st->heap[0].id = g_strdup (id);
+        st->heap[0].count = est;
+        heap_sift_down (st, 0);
+    }
+}
+
+static void
+marks_add (ClassStats *st, guint32 pos, int delta)
+{
+    for (; pos <= ACCESS_REUSE_WINDOW; pos += pos & (-pos))
+        st->last_marks[pos] += delta;
+}
+
+static guint32
+marks_sum (ClassStats *st, guint32 pos)
+{
+    guint32 sum = 0;
+
+    for (; pos > 0; pos -= pos & (-pos))
+        sum += st->last_marks[pos];
+
+    return sum;
+}
+
+static void
+follow_read (ClassStats *st, const char *id)
+{
+    gpointer value;
+    guint32 last;
+    guint64 distance;
+    guint bucket;
+
+    if (st->pos == ACCESS_REUSE_WINDOW) {
+        g_hash_table_remove_all (st->last_read);
+        memset (st->last_marks, 0, sizeof(guint32) * (ACCESS_REUSE_WINDOW + 1));
+        st->pos = 0;
+    }
+    ++st->pos;
+    ++st->followed;
+
+    value = g_hash_table_lookup (st->last_read, id);
+    if (value) {
+        last = GPOINTER_TO_UINT (value);
+        distance = (guint64)(marks_sum (st, st->pos - 1) - marks_sum (st, last)) *
+            sample_rate;
+        bucket = distance ? g_bit_storage (distance) : 0;
+        if (bucket >= ACCESS_N_REUSE_BUCKETS)
+            bucket = ACCESS_N_REUSE_BUCKETS - 1;
+        ++st->reuse[bucket];
+        marks_add (st, last, -1);
+        g_hash_table_insert (st->last_read, g_strdup (id),
+                             GUINT_TO_POINTER (st->pos));
+    } else {
+        ++st->cold;
+        g_hash_table_insert (st->last_read, g_strdup (id),
+                             GUINT_TO_POINTER (st->pos));
+    }
+    marks_add (st, st->pos, 1);
+}
+
+void
+seaf_access_stats_record (AccessClass cls, const char *id)
+{
+    ClassStats *st = &classes[cls];
+    gboolean sketched, followed;
+    guint64 h;
+    guint32 est;
+
+    if (sample_rate <= 0 || !id)
+        return;
+
+    h = hash_id (id);
+    sketched = (next_rand () % sample_rate == 0);
+    followed = ((h >> 32) % sample_rate == 0);
+    if (!sketched && !followed)
+        return;
+
+    pthread_mutex_lock (&st->lock);
+    if (sketched) {
+        ++st->sampled;
+        est = sketch_add (st, h);
+        if (st->n_heap < ACCESS_TOP_K || est > st->heap[0].count)
+            update_top (st, id, est);
+    }
+    if (followed)
+        follow_read (st, id);
+    pthread_mutex_unlock (&st->lock);
+}
+
+static gint
+compare_hitters (gconstpointer a, gconstpointer b)
+{
+    const AccessHitter *ha = a, *hb = b;
+
+    if (ha->count != hb->count)
+        return ha->count > hb->count ? -1 : 1;
+    return strcmp (ha->id, hb->id);
+}
+
+void
+seaf_access_stats_get (AccessClass cls, SeafAccessStats *stats)
+{
+    ClassStats *st = &classes[cls];
+    AccessHitter *hitter;
+    int i;
+
+    memset (stats, 0, sizeof(*stats));
+    if (sample_rate <= 0)
+        return;
+
+    pthread_mutex_lock (&st->lock);
+    stats->sampled = st->sampled;
+    stats->followed = st->followed;
+    stats->cold = st->cold;
+    memcpy (stats->reuse, st->reuse, sizeof(stats->reuse));
+    for (i = 0; i < st->n_heap; ++i) {
+        hitter = g_new0 (AccessHitter, 1);
+        hitter->id = g_strdup (st->heap[i].id);
+        hitter->count = st->heap[i].count * (guint64)sample_rate;
+        stats->top = g_list_prepend (stats->top, hitter);
+    }
+    pthread_mutex_unlock (&st->lock);
+
+    stats->top = g_list_sort (stats->top, compare_hitters);
+}
+
+static void
+hitter_free (AccessHitter *hitter)
+{
+    g_free (hitter->id);
+    g_free (hitter);
+}
+
+void
+seaf_access_stats_clear (SeafAccessStats *stats)
+{
+    g_list_free_full (stats->top, (GDestroyNotify)hitter_free);
+    stats->top = NULL;
+}
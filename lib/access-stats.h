@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ACCESS_STATS_H
+#define ACCESS_STATS_H
+
+#include <glib.h>
+
+/*
+ * Sampled tracking of the reads of objects, to see how skewed they are.
+ *
+ * For each class of objects, one read in sample_rate is counted in a
+ * count-min sketch, and the objects with the highest estimates are kept in a
+ * heap of the top ACCESS_TOP_K. Independently, the objects whose id hashes to
+ * 0 modulo sample_rate have all their reads followed, and the number of
+ * distinct sampled objects read between two reads of the same object, times
+ * sample_rate, estimates its reuse distance. An LRU cache of N objects hits
+ * about the reads with a reuse distance below N.
+ *
+ * Reuse distances are measured within windows of ACCESS_REUSE_WINDOW
+ * sampled reads; the first read of an object in a window is counted as cold.
+ */
+
+typedef enum AccessClass {
+    /* Reads of blocks and dirs, by the store they belong to. */
+    ACCESS_CLASS_REPO = 0,
+    ACCESS_CLASS_DIR,
+    ACCESS_CLASS_BLOCK,
+    ACCESS_N_CLASSES,
+} AccessClass;
+
+#define ACCESS_TOP_K 32
+#define ACCESS_REUSE_WINDOW (1 << 16)
+/* Bucket i counts reuse distances below 2^i, the last one the others. */
+#define ACCESS_N_REUSE_BUCKETS 25
+
+typedef struct AccessHitter {
+    char *id;
+    /* Estimated reads, scaled by the sample rate. */
+    guint64 count;
+} AccessHitter;
+
+typedef struct SeafAccessStats {
+    /* Reads counted in the sketch. */
+    guint64 sampled;
+    /* Reads of the objects whose reuse distance is followed. */
+    guint64 followed;
+    guint64 cold;
+    guint64 reuse[ACCESS_N_REUSE_BUCKETS];
+    /* Most read first. */
+    GList *top;
+} SeafAccessStats;
+
+/* 0 disables the tracking, which is the default. Called once at startup. */
+void
+seaf_access_stats_init (int sample_rate);
+
+int
+seaf_access_stats_sample_rate ();
+
+const char *
+seaf_access_class_name (AccessClass cls);
+
+void
+seaf_access_stats_record (AccessClass cls, const char *id);
+
+/* Copies the stats of @cls into @stats. */
+void
+seaf_access_stats_get (AccessClass cls, SeafAccessStats *stats);
+
+void
+seaf_access_stats_clear (SeafAccessStats *stats);
+
+#endif
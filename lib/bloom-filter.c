@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <openssl/sha.h>
 #include <assert.h>
 
@@ -174,3 +175,210 @@ int bloom_test(Bloom *bloom, const char *s)
 
     return 1;
 }
+
+/* Blocked Bloom filter */
+
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 64)
+#define BLOCK_BYTES (BLOCK_BITS / 8)
+#define MAX_K 16
+/* Bits that can be taken from an id after the 64 that pick its block. */
+#define MAX_RAW_K ((SHA_DIGEST_LENGTH * 8 - 64) / 9)
+
+static int
+hex_val (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void
+id_to_raw (const char *id, unsigned char raw[SHA_DIGEST_LENGTH])
+{
+    int i, hi, lo;
+
+    if (strlen(id) == SHA_DIGEST_LENGTH * 2) {
+        for (i = 0; i < SHA_DIGEST_LENGTH; i++) {
+            hi = hex_val (id[2*i]);
+            lo = hex_val (id[2*i+1]);
+            if (hi < 0 || lo < 0)
+                break;
+            raw[i] = (hi << 4) | lo;
+        }
+        if (i == SHA_DIGEST_LENGTH)
+            return;
+    }
+
+    SHA1 ((const unsigned char *)id, strlen(id), raw);
+}
+
+/* The block of an id and the mask of its k bits in the block. The first 8
+ * bytes of the id pick the block, and every following 9 bits one bit in it.
+ * That's enough for MAX_K bits, the remaining ones come from a second
+ * SHA-1 of the id.
+ */
+static uint64_t *
+id_to_mask (BlockedBloom *bloom, const char *id, uint64_t mask[BLOCK_WORDS])
+{
+    unsigned char raw[SHA_DIGEST_LENGTH * 2];
+    uint64_t h;
+    unsigned int pos, bit;
+    int i;
+
+    id_to_raw (id, raw);
+    if (bloom->k > MAX_RAW_K)
+        SHA1 (raw, SHA_DIGEST_LENGTH, raw + SHA_DIGEST_LENGTH);
+    memcpy (&h, raw, sizeof(h));
+
+    memset (mask, 0, sizeof(uint64_t) * BLOCK_WORDS);
+    for (i = 0; i < bloom->k; i++) {
+        bit = 64 + i * 9;
+        pos = ((raw[bit / 8] << 8 | raw[bit / 8 + 1]) >> (7 - bit % 8)) & (BLOCK_BITS - 1);
+        mask[pos / 64] |= (uint64_t)1 << (pos % 64);
+    }
+
+    return bloom->blocks + (h % bloom->n_blocks) * BLOCK_WORDS;
+}
+
+/* False positive rate of a blocked filter with @bits_per_item bits per
+ * item and @k hashes. The number of items in a block follows a Poisson
+ * distribution.
+ */
+static double
+blocked_fpr (double bits_per_item, int k)
+{
+    double lambda = BLOCK_BITS / bits_per_item;
+    double term = exp (-lambda);
+    double fpr = 0;
+    int j, max_j = (int)(lambda * 4) + 64;
+
+    for (j = 0; j <= max_j; j++) {
+        fpr += term * pow (1 - pow (1 - 1.0 / BLOCK_BITS, (double)k * j), k);
+        term *= lambda / (j + 1);
+    }
+
+    return fpr;
+}
+
+BlockedBloom *
+blocked_bloom_create (uint64_t n_items, double fpr, size_t max_bytes)
+{
+    BlockedBloom *bloom;
+    double bits_per_item;
+    int k, best_k = 1;
+    uint64_t n_blocks;
+
+    if (fpr <= 0 || fpr >= 1)
+        return NULL;
+    if (n_items == 0)
+        n_items = 1;
+
+    /* Start from the size of a classic Bloom filter, blocked ones need a
+     * few more bits for the same rate.
+     */
+    bits_per_item = -log (fpr) / (M_LN2 * M_LN2);
+    for (; bits_per_item < 64; bits_per_item += 0.5) {
+        double best = 1;
+        for (k = 1; k <= MAX_K; k++) {
+            double p = blocked_fpr (bits_per_item, k);
+            if (p < best) {
+                best = p;
+                best_k = k;
+            }
+        }
+        if (best <= fpr)
+            break;
+    }
+
+    n_blocks = (uint64_t)(n_items * bits_per_item / BLOCK_BITS) + 1;
+    if (max_bytes > 0 && n_blocks > max_bytes / BLOCK_BYTES)
+        n_blocks = max_bytes / BLOCK_BYTES;
+    if (n_blocks == 0)
+        n_blocks = 1;
+
+    if (!(bloom = malloc (sizeof(BlockedBloom))))
+        return NULL;
+    /* Blocks are aligned to cache lines. */
+    bloom->mem = calloc (n_blocks * BLOCK_BYTES + BLOCK_BYTES - 1, 1);
+    if (!bloom->mem) {
+        free (bloom);
+        return NULL;
+    }
+    bloom->blocks = (uint64_t *)(((uintptr_t)bloom->mem + BLOCK_BYTES - 1) &
+                                 ~(uintptr_t)(BLOCK_BYTES - 1));
+    bloom->n_blocks = n_blocks;
+    bloom->k = best_k;
+
+    return bloom;
+}
+
+void
+blocked_bloom_destroy (BlockedBloom *bloom)
+{
+    free (bloom->mem);
+    free (bloom);
+}
+
+void
+blocked_bloom_add (BlockedBloom *bloom, const char *id)
+{
+    uint64_t mask[BLOCK_WORDS];
+    uint64_t *block = id_to_mask (bloom, id, mask);
+    int i;
+
+    for (i = 0; i < BLOCK_WORDS; i++)
+        block[i] |= mask[i];
+}
+
+int
+blocked_bloom_test (BlockedBloom *bloom, const char *id)
+{
+    uint64_t mask[BLOCK_WORDS];
+    uint64_t *block = id_to_mask (bloom, id, mask);
+    uint64_t missing = 0;
+    int i;
+
+    /* Branch-free over the whole line, which compilers vectorize. */
+    for (i = 0; i < BLOCK_WORDS; i++)
+        missing |= mask[i] & ~block[i];
+
+    return missing == 0;
+}
+
+size_t
+blocked_bloom_size (BlockedBloom *bloom)
+{
+    return bloom->n_blocks * BLOCK_BYTES;
+}
+
+static int
+popcount64 (uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
+double
+blocked_bloom_estimate_fpr (BlockedBloom *bloom)
+{
+    double sum = 0;
+    size_t i;
+    int j, bits;
+
+    /* A random id falls in any block, and matches it if its k bits are set. */
+    for (i = 0; i < bloom->n_blocks; i++) {
+        bits = 0;
+        for (j = 0; j < BLOCK_WORDS; j++)
+            bits += popcount64 (bloom->blocks[i * BLOCK_WORDS + j]);
+        sum += pow ((double)bits / BLOCK_BITS, bloom->k);
+    }
+
+    return sum / bloom->n_blocks;
+}
@@ -4,6 +4,7 @@
 #define __BLOOM_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef struct {
     size_t          asize;
@@ -20,4 +21,28 @@ int bloom_add (Bloom *bloom, const char *s);
 int bloom_remove (Bloom *bloom, const char *s);
 int bloom_test (Bloom *bloom, const char *s);
 
+/*
+ * A blocked Bloom filter for object ids: the k bits of an id all lie in one
+ * 64-byte block, so adding or testing an id touches a single cache line.
+ * Ids are expected to be 40-char hex SHA-1s, whose raw bytes are used as
+ * hashes. Other strings are hashed with SHA-1 first.
+ */
+typedef struct {
+    size_t          n_blocks;
+    uint64_t       *blocks;
+    void           *mem;
+    int             k;
+} BlockedBloom;
+
+/* Sized for @n_items ids at a false positive rate of @fpr, with at most
+ * @max_bytes of memory (0 for no limit).
+ */
+BlockedBloom *blocked_bloom_create (uint64_t n_items, double fpr, size_t max_bytes);
+void blocked_bloom_destroy (BlockedBloom *bloom);
+void blocked_bloom_add (BlockedBloom *bloom, const char *id);
+int blocked_bloom_test (BlockedBloom *bloom, const char *id);
+size_t blocked_bloom_size (BlockedBloom *bloom);
+/* Estimated false positive rate, from the bits set in every block. */
+double blocked_bloom_estimate_fpr (BlockedBloom *bloom);
+
 #endif
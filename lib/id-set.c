@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "id-set.h"
+#include "utils.h"
+
+/*
+ * Linear probing over a power-of-two table of 20-byte slots. An all-zero
+ * slot is empty, so the all-zero id (the id of empty dirs and files) is kept
+ * in a flag of its own. The table grows to twice its size when it's 70%
+ * full, which keeps probe sequences short while using 29 to 57 bytes per id.
+ */
+
+#define MIN_SLOTS 64
+#define MAX_LOAD_PERCENT 70
+
+struct IdSet {
+    unsigned char  *slots;
+    guint64         n_slots;
+    guint64         n_ids;      /* excluding the zero id */
+    gboolean        has_zero;
+};
+
+static const unsigned char zero_id[ID_SET_RAW_LEN];
+
+static inline guint64
+slot_of (const unsigned char *raw, guint64 mask)
+{
+    guint64 h;
+
+    memcpy (&h, raw, sizeof(h));
+    return h & mask;
+}
+
+static inline gboolean
+slot_is_empty (const unsigned char *slot)
+{
+    return memcmp (slot, zero_id, ID_SET_RAW_LEN) == 0;
+}
+
+static guint64
+slots_for (guint64 n_ids)
+{
+    guint64 n = MIN_SLOTS;
+
+    while (n * MAX_LOAD_PERCENT / 100 < n_ids)
+        n <<= 1;
+    return n;
+}
+
+IdSet *
+id_set_new (guint64 expected)
+{
+    IdSet *set = g_new0 (IdSet, 1);
+
+    set->n_slots = slots_for (expected);
+    set->slots = g_malloc0 (set->n_slots * ID_SET_RAW_LEN);
+
+    return set;
+}
+
+void
+id_set_free (IdSet *set)
+{
+    if (!set)
+        return;
+
+    g_free (set->slots);
+    g_free (set);
+}
+
+/* Returns the slot holding @raw, or the empty slot where it would go. */
+static unsigned char *
+find_slot (unsigned char *slots, guint64 n_slots, const unsigned char *raw)
+{
+    guint64 mask = n_slots - 1;
+    guint64 i = slot_of (raw, mask);
+    unsigned char *slot;
+
+    while (1) {
+        slot = slots + i * ID_SET_RAW_LEN;
+        if (slot_is_empty (slot) || memcmp (slot, raw, ID_SET_RAW_LEN) == 0)
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static void
+grow (IdSet *set)
+{
+    guint64 n_slots = set->n_slots << 1;
+    unsigned char *slots = g_malloc0 (n_slots * ID_SET_RAW_LEN);
+    unsigned char *old;
+    guint64 i;
+
+    for (i = 0; i < set->n_slots; i++) {
+        old = set->slots + i * ID_SET_RAW_LEN;
+        if (!slot_is_empty (old))
+            memcpy (find_slot (slots, n_slots, old), old, ID_SET_RAW_LEN);
+    }
+
+    g_free (set->slots);
+    set->slots = slots;
+    set->n_slots = n_slots;
+}
+
+int
+id_set_add_raw (IdSet *set, const unsigned char *raw)
+{
+    unsigned char *slot;
+
+    if (slot_is_empty (raw)) {
+        if (set->has_zero)
+            return 0;
+        set->has_zero = TRUE;
+        return 1;
+    }
+
+    slot = find_slot (set->slots, set->n_slots, raw);
+    if (!slot_is_empty (slot))
+        return 0;
+
+    if ((set->n_ids + 1) * 100 > set->n_slots * MAX_LOAD_PERCENT) {
+        grow (set);
+        slot = find_slot (set->slots, set->n_slots, raw);
+    }
+
+    memcpy (slot, raw, ID_SET_RAW_LEN);
+    ++set->n_ids;
+    return 1;
+}
+
+gboolean
+id_set_contains_raw (IdSet *set, const unsigned char *raw)
+{
+    if (slot_is_empty (raw))
+        return set->has_zero;
+
+    return !slot_is_empty (find_slot (set->slots, set->n_slots, raw));
+}
+
+int
+id_set_add (IdSet *set, const char *id)
+{
+    unsigned char raw[ID_SET_RAW_LEN];
+
+    if (strlen (id) != ID_SET_RAW_LEN * 2 ||
+        hex_to_rawdata (id, raw, ID_SET_RAW_LEN) < 0)
+        return -1;
+
+    return id_set_add_raw (set, raw);
+}
+
+gboolean
+id_set_contains (IdSet *set, const char *id)
+{
+    unsigned char raw[ID_SET_RAW_LEN];
+
+    if (strlen (id) != ID_SET_RAW_LEN * 2 ||
+        hex_to_rawdata (id, raw, ID_SET_RAW_LEN) < 0)
+        return FALSE;
+
+    return id_set_contains_raw (set, raw);
+}
+
+guint64
+id_set_size (IdSet *set)
+{
+    return set->n_ids + (set->has_zero ? 1 : 0);
+}
+
+void
+id_set_foreach (IdSet *set, IdSetFunc func, void *user_data)
+{
+    unsigned char *slot;
+    guint64 i;
+
+    if (set->has_zero)
+        func (zero_id, user_data);
+
+    for (i = 0; i < set->n_slots; i++) {
+        slot = set->slots + i * ID_SET_RAW_LEN;
+        if (!slot_is_empty (slot))
+            func (slot, user_data);
+    }
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <glib.h>
+
+#define ID_SET_RAW_LEN 20
+
+/*
+ * A set of SHA-1 object ids, stored as raw 20-byte values in one open
+ * addressing table. It takes about a third of the memory of a GHashTable of
+ * g_strdup'd hex ids, and no allocation per id. Ids are hashed by their own
+ * first bytes, so they must be real SHA-1s, not arbitrary strings.
+ *
+ * The set is not thread-safe.
+ */
+
+typedef struct IdSet IdSet;
+
+/* @expected is a hint of the number of ids, 0 if unknown. */
+IdSet *
+id_set_new (guint64 expected);
+
+void
+id_set_free (IdSet *set);
+
+/* Returns 1 if @id was added, 0 if it was already in the set and -1 if
+ * it's not a 40-char hex id.
+ */
+int
+id_set_add (IdSet *set, const char *id);
+
+gboolean
+id_set_contains (IdSet *set, const char *id);
+
+int
+id_set_add_raw (IdSet *set, const unsigned char *raw);
+
+gboolean
+id_set_contains_raw (IdSet *set, const unsigned char *raw);
+
+guint64
+id_set_size (IdSet *set);
+
+typedef void (*IdSetFunc) (const unsigned char *raw, void *user_data);
+
+void
+id_set_foreach (IdSet *set, IdSetFunc func, void *user_data);
+
+#endif
@@ -0,0 +1,335 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "json-scanner.h"
+
+/* Values nested deeper are left to jansson. */
+#define MAX_SKIP_DEPTH 32
+
+void
+json_scanner_init (JsonScanner *scanner, const char *data, gsize len)
+{
+    scanner->p = data;
+    scanner->end = data + len;
+    scanner->buf = g_string_sized_new (64);
+    scanner->first = FALSE;
+}
+
+void
+json_scanner_destroy (JsonScanner *scanner)
+{
+    g_string_free (scanner->buf, TRUE);
+}
+
+static inline void
+skip_ws (JsonScanner *scanner)
+{
+    const char *p = scanner->p;
+
+    while (p < scanner->end &&
+           (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+        ++p;
+    scanner->p = p;
+}
+
+static int
+expect_char (JsonScanner *scanner, char c)
+{
+    skip_ws (scanner);
+    if (scanner->p >= scanner->end || *scanner->p != c)
+        return -1;
+    scanner->p++;
+    return 0;
+}
+
+int
+json_scanner_enter_object (JsonScanner *scanner)
+{
+    if (expect_char (scanner, '{') < 0)
+        return -1;
+    scanner->first = TRUE;
+    return 0;
+}
+
+int
+json_scanner_enter_array (JsonScanner *scanner)
+{
+    if (expect_char (scanner, '[') < 0)
+        return -1;
+    scanner->first = TRUE;
+    return 0;
+}
+
+/* Returns 1 if there is another item before @close. Nested values reset
+ * scanner->first while they are read, but they end with it unset, as it
+ * is for every item but the first.
+ */
+static int
+next_item (JsonScanner *scanner, char close)
+{
+    gboolean first = scanner->first;
+
+    scanner->first = FALSE;
+    skip_ws (scanner);
+    if (scanner->p >= scanner->end)
+        return -1;
+    if (*scanner->p == close) {
+        scanner->p++;
+        return 0;
+    }
+    if (!first) {
+        if (*scanner->p != ',')
+            return -1;
+        scanner->p++;
+    }
+    return 1;
+}
+
+int
+json_scanner_next_member (JsonScanner *scanner)
+{
+    int ret;
+
+    ret = next_item (scanner, '}');
+    if (ret <= 0)
+        return ret;
+
+    if (json_scanner_read_string (scanner) < 0 ||
+        expect_char (scanner, ':') < 0)
+        return -1;
+    return 1;
+}
+
+int
+json_scanner_next_element (JsonScanner *scanner)
+{
+    return next_item (scanner, ']');
+}
+
+static int
+hex_value (const char *p, guint32 *value)
+{
+    guint32 v = 0;
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        v <<= 4;
+        if (p[i] >= '0' && p[i] <= '9')
+            v |= p[i] - '0';
+        else if (p[i] >= 'a' && p[i] <= 'f')
+            v |= p[i] - 'a' + 10;
+        else if (p[i] >= 'A' && p[i] <= 'F')
+            v |= p[i] - 'A' + 10;
+        else
+            return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+/* Decode the escape sequence at scanner->p, just after the backslash. */
+static int
+read_escape (JsonScanner *scanner)
+{
+    const char *p = scanner->p;
+    guint32 c, low;
+    char utf8[6];
+    int n;
+
+    if (p >= scanner->end)
+        return -1;
+
+    switch (*p) {
+    case '"':
+    case '\\':
+    case '/':
+        g_string_append_c (scanner->buf, *p);
+        break;
+    case 'b':
+        g_string_append_c (scanner->buf, '\b');
+        break;
+    case 'f':
+        g_string_append_c (scanner->buf, '\f');
+        break;
+    case 'n':
+        g_string_append_c (scanner->buf, '\n');
+        break;
+    case 'r':
+        g_string_append_c (scanner->buf, '\r');
+        break;
+    case 't':
+        g_string_append_c (scanner->buf, '\t');
+        break;
+    case 'u':
+        if (scanner->end - p < 5 || hex_value (p + 1, &c) < 0)
+            return -1;
+        p += 4;
+        /* jansson refuses NUL characters, as well as unpaired surrogates. */
+        if (c == 0 || (c >= 0xDC00 && c <= 0xDFFF))
+            return -1;
+        if (c >= 0xD800 && c <= 0xDBFF) {
+            if (scanner->end - p < 7 || p[1] != '\\' || p[2] != 'u' ||
+                hex_value (p + 3, &low) < 0 ||
+                low < 0xDC00 || low > 0xDFFF)
+                return -1;
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            p += 6;
+        }
+        n = g_unichar_to_utf8 (c, utf8);
+        g_string_append_len (scanner->buf, utf8, n);
+        break;
+    default:
+        return -1;
+    }
+
+    scanner->p = p + 1;
+    return 0;
+}
+
+int
+json_scanner_read_string (JsonScanner *scanner)
+{
+    const char *p, *run;
+
+    if (expect_char (scanner, '"') < 0)
+        return -1;
+
+    g_string_truncate (scanner->buf, 0);
+    p = scanner->p;
+    while (1) {
+        run = p;
+        while (p < scanner->end && *p != '"' && *p != '\\' &&
+               (unsigned char)*p >= 0x20)
+            ++p;
+        g_string_append_len (scanner->buf, run, p - run);
+
+        if (p >= scanner->end || (unsigned char)*p < 0x20)
+            return -1;
+        if (*p == '"')
+            break;
+
+        scanner->p = p + 1;
+        if (read_escape (scanner) < 0)
+            return -1;
+        p = scanner->p;
+    }
+    scanner->p = p + 1;
+
+    /* Escapes always decode to whole characters, so checking the result
+     * also covers the raw bytes around them.
+     */
+    if (!g_utf8_validate (scanner->buf->str, scanner->buf->len, NULL))
+        return -1;
+    return 0;
+}
+
+static gboolean
+read_literal (JsonScanner *scanner, const char *literal)
+{
+    size_t len = strlen (literal);
+
+    skip_ws (scanner);
+    if ((size_t)(scanner->end - scanner->p) < len ||
+        memcmp (scanner->p, literal, len) != 0)
+        return FALSE;
+    scanner->p += len;
+    return TRUE;
+}
+
+gboolean
+json_scanner_read_null (JsonScanner *scanner)
+{
+    return read_literal (scanner, "null");
+}
+
+int
+json_scanner_read_int (JsonScanner *scanner, gint64 *value)
+{
+    const char *p;
+    gboolean neg = FALSE;
+    guint64 v = 0, max;
+    int digit;
+
+    skip_ws (scanner);
+    p = scanner->p;
+    if (p < scanner->end && *p == '-') {
+        neg = TRUE;
+        ++p;
+    }
+    if (p >= scanner->end || *p < '0' || *p > '9')
+        return -1;
+    /* No leading zeros in JSON. */
+    if (*p == '0' && p + 1 < scanner->end && p[1] >= '0' && p[1] <= '9')
+        return -1;
+
+    max = neg ? (guint64)G_MAXINT64 + 1 : (guint64)G_MAXINT64;
+    while (p < scanner->end && *p >= '0' && *p <= '9') {
+        digit = *p - '0';
+        if (v > (max - digit) / 10)
+            return -1;
+        v = v * 10 + digit;
+        ++p;
+    }
+    /* Real numbers. */
+    if (p < scanner->end && (*p == '.' || *p == 'e' || *p == 'E'))
+        return -1;
+
+    scanner->p = p;
+    *value = neg ? (gint64)(0 - v) : (gint64)v;
+    return 0;
+}
+
+static int
+skip_value (JsonScanner *scanner, int depth)
+{
+    gint64 n;
+    int ret;
+
+    if (depth > MAX_SKIP_DEPTH)
+        return -1;
+
+    skip_ws (scanner);
+    if (scanner->p >= scanner->end)
+        return -1;
+
+    switch (*scanner->p) {
+    case '{':
+        json_scanner_enter_object (scanner);
+        while ((ret = json_scanner_next_member (scanner)) > 0) {
+            if (skip_value (scanner, depth + 1) < 0)
+                return -1;
+        }
+        return ret;
+    case '[':
+        json_scanner_enter_array (scanner);
+        while ((ret = json_scanner_next_element (scanner)) > 0) {
+            if (skip_value (scanner, depth + 1) < 0)
+                return -1;
+        }
+        return ret;
+    case '"':
+        return json_scanner_read_string (scanner);
+    case 't':
+        return read_literal (scanner, "true") ? 0 : -1;
+    case 'f':
+        return read_literal (scanner, "false") ? 0 : -1;
+    case 'n':
+        return read_literal (scanner, "null") ? 0 : -1;
+    default:
+        return json_scanner_read_int (scanner, &n);
+    }
+}
+
+int
+json_scanner_skip_value (JsonScanner *scanner)
+{
+    return skip_value (scanner, 0);
+}
+
+int
+json_scanner_finish (JsonScanner *scanner)
+{
+    skip_ws (scanner);
+    return scanner->p == scanner->end ? 0 : -1;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef JSON_SCANNER_H
+#define JSON_SCANNER_H
+
+#include <glib.h>
+
+/*
+ * A pull parser for JSON objects of a known schema, which decodes values
+ * as they are read instead of building a tree first.
+ *
+ * The scanner only accepts a subset of what jansson accepts: integers must
+ * fit in 64 bits, real numbers, "\u0000" and deep nesting are refused. So
+ * whatever it accepts jansson decodes to the same values, and callers fall
+ * back to jansson whenever a function returns -1.
+ */
+
+typedef struct JsonScanner {
+    const char *p;
+    const char *end;
+    /* The last key or string read. */
+    GString    *buf;
+    gboolean    first;
+} JsonScanner;
+
+void
+json_scanner_init (JsonScanner *scanner, const char *data, gsize len);
+
+void
+json_scanner_destroy (JsonScanner *scanner);
+
+/* Consume the '{' of an object. */
+int
+json_scanner_enter_object (JsonScanner *scanner);
+
+/* Read the key of the next member into scanner->buf, leaving the scanner at
+ * its value. Returns 1 for a member, 0 at the end of the object, -1 on
+ * errors.
+ */
+int
+json_scanner_next_member (JsonScanner *scanner);
+
+/* Consume the '[' of an array. */
+int
+json_scanner_enter_array (JsonScanner *scanner);
+
+/* Returns 1 if the scanner is at the next element, 0 at the end of the
+ * array, -1 on errors.
+ */
+int
+json_scanner_next_element (JsonScanner *scanner);
+
+/* Read a string value into scanner->buf. */
+int
+json_scanner_read_string (JsonScanner *scanner);
+
+/* Consume a null value. Returns FALSE and consumes nothing for others. */
+gboolean
+json_scanner_read_null (JsonScanner *scanner);
+
+int
+json_scanner_read_int (JsonScanner *scanner, gint64 *value);
+
+/* Read and validate a value of any type. */
+int
+json_scanner_skip_value (JsonScanner *scanner);
+
+/* Check that nothing but whitespace is left after the top level value. */
+int
+json_scanner_finish (JsonScanner *scanner);
+
+#endif
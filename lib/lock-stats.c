@@ -0,0 +1,200 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "lock-stats.h"
+
+static gboolean stats_enabled;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* name -> SeafLockStats, never freed since locks may outlive each other. */
+static GHashTable *registry;
+
+void
+seaf_lock_stats_set_enabled (gboolean enabled)
+{
+    stats_enabled = enabled;
+}
+
+static SeafLockStats *
+get_stats (const char *name)
+{
+    SeafLockStats *stats;
+
+    pthread_mutex_lock (&registry_lock);
+    if (!registry)
+        registry = g_hash_table_new (g_str_hash, g_str_equal);
+    stats = g_hash_table_lookup (registry, name);
+    if (!stats) {
+        stats = g_new0 (SeafLockStats, 1);
+        stats->name = g_strdup (name);
+        g_hash_table_insert (registry, stats->name, stats);
+    }
+    pthread_mutex_unlock (&registry_lock);
+
+    return stats;
+}
+
+void
+seaf_lock_set_name (SeafLock *lock, const char *name)
+{
+    lock->stats = (stats_enabled && name) ? get_stats (name) : NULL;
+}
+
+void
+seaf_lock_init (SeafLock *lock, const char *name)
+{
+    pthread_mutex_init (&lock->mutex, NULL);
+    lock->locked_at = 0;
+    seaf_lock_set_name (lock, name);
+}
+
+void
+seaf_lock_destroy (SeafLock *lock)
+{
+    pthread_mutex_destroy (&lock->mutex);
+}
+
+static inline void
+update_max (gint64 *max, gint64 value)
+{
+    gint64 cur = __atomic_load_n (max, __ATOMIC_RELAXED);
+
+    while (value > cur &&
+           !__atomic_compare_exchange_n (max, &cur, value, TRUE,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void
+seaf_lock_lock (SeafLock *lock)
+{
+    SeafLockStats *stats = lock->stats;
+    gint64 start, now;
+
+    if (!stats) {
+        pthread_mutex_lock (&lock->mutex);
+        return;
+    }
+
+    if (pthread_mutex_trylock (&lock->mutex) == 0) {
+        now = g_get_monotonic_time ();
+    } else {
+        start = g_get_monotonic_time ();
+        pthread_mutex_lock (&lock->mutex);
+        now = g_get_monotonic_time ();
+        __atomic_fetch_add (&stats->contentions, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&stats->wait_time, now - start, __ATOMIC_RELAXED);
+        update_max (&stats->max_wait, now - start);
+    }
+    __atomic_fetch_add (&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    lock->locked_at = now;
+}
+
+int
+seaf_lock_trylock (SeafLock *lock)
+{
+    int ret;
+
+    ret = pthread_mutex_trylock (&lock->mutex);
+    if (ret == 0 && lock->stats) {
+        __atomic_fetch_add (&lock->stats->acquisitions, 1, __ATOMIC_RELAXED);
+        lock->locked_at = g_get_monotonic_time ();
+    }
+
+    return ret;
+}
+
+static inline void
+record_hold (SeafLock *lock)
+{
+    update_max (&lock->stats->max_hold, g_get_monotonic_time () - lock->locked_at);
+}
+
+void
+seaf_lock_unlock (SeafLock *lock)
+{
+    if (lock->stats)
+        record_hold (lock);
+    pthread_mutex_unlock (&lock->mutex);
+}
+
+int
+seaf_lock_cond_wait (pthread_cond_t *cond, SeafLock *lock)
+{
+    int ret;
+
+    if (lock->stats)
+        record_hold (lock);
+    ret = pthread_cond_wait (cond, &lock->mutex);
+    if (lock->stats)
+        lock->locked_at = g_get_monotonic_time ();
+
+    return ret;
+}
+
+int
+seaf_lock_cond_timedwait (pthread_cond_t *cond, SeafLock *lock,
+                          const struct timespec *abstime)
+{
+    int ret;
+
+    if (lock->stats)
+        record_hold (lock);
+    ret = pthread_cond_timedwait (cond, &lock->mutex, abstime);
+    if (lock->stats)
+        lock->locked_at = g_get_monotonic_time ();
+
+    return ret;
+}
+
+static gint
+compare_wait_time (gconstpointer a, gconstpointer b)
+{
+    const SeafLockStats *sa = a, *sb = b;
+
+    if (sa->wait_time != sb->wait_time)
+        return sa->wait_time > sb->wait_time ? -1 : 1;
+    return strcmp (sa->name, sb->name);
+}
+
+GList *
+seaf_lock_get_stats ()
+{
+    GHashTableIter iter;
+    gpointer value;
+    SeafLockStats *stats, *copy;
+    GList *ret = NULL;
+
+    pthread_mutex_lock (&registry_lock);
+    if (registry) {
+        g_hash_table_iter_init (&iter, registry);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            stats = value;
+            copy = g_new0 (SeafLockStats, 1);
+            copy->name = g_strdup (stats->name);
+            copy->acquisitions = __atomic_load_n (&stats->acquisitions, __ATOMIC_RELAXED);
+            copy->contentions = __atomic_load_n (&stats->contentions, __ATOMIC_RELAXED);
+            copy->wait_time = __atomic_load_n (&stats->wait_time, __ATOMIC_RELAXED);
+            copy->max_wait = __atomic_load_n (&stats->max_wait, __ATOMIC_RELAXED);
+            copy->max_hold = __atomic_load_n (&stats->max_hold, __ATOMIC_RELAXED);
+            ret = g_list_prepend (ret, copy);
+        }
+    }
+    pthread_mutex_unlock (&registry_lock);
+
+    return g_list_sort (ret, compare_wait_time);
+}
+
+static void
+lock_stats_free (SeafLockStats *stats)
+{
+    g_free (stats->name);
+    g_free (stats);
+}
+
+void
+seaf_lock_stats_free (GList *stats)
+{
+    g_list_free_full (stats, (GDestroyNotify)lock_stats_free);
+}
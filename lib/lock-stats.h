@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+#include <glib.h>
+#include <pthread.h>
+
+/*
+ * A pthread mutex which optionally records how it's used.
+ *
+ * When lock stats are enabled, every lock initialized with a name counts its
+ * acquisitions, the ones that found it held by another thread, the time spent
+ * waiting for it and the longest time it was held. Locks with the same name,
+ * like the shards of a cache, share their stats. The uncontended path costs a
+ * trylock and two reads of the monotonic clock; with stats disabled it's a
+ * plain pthread_mutex_lock().
+ */
+
+typedef struct SeafLockStats {
+    char *name;
+    guint64 acquisitions;
+    guint64 contentions;
+    /* Total and maximum times in microseconds. */
+    gint64 wait_time;
+    gint64 max_wait;
+    gint64 max_hold;
+} SeafLockStats;
+
+typedef struct SeafLock {
+    pthread_mutex_t mutex;
+    /* NULL if not instrumented. */
+    SeafLockStats *stats;
+    gint64 locked_at;
+} SeafLock;
+
+/* Only affects the locks initialized afterwards. */
+void
+seaf_lock_stats_set_enabled (gboolean enabled);
+
+void
+seaf_lock_init (SeafLock *lock, const char *name);
+
+void
+seaf_lock_destroy (SeafLock *lock);
+
+/* Record the stats of an already initialized, unused lock under @name. */
+void
+seaf_lock_set_name (SeafLock *lock, const char *name);
+
+void
+seaf_lock_lock (SeafLock *lock);
+
+/* Returns 0 if @lock was taken, like pthread_mutex_trylock(). */
+int
+seaf_lock_trylock (SeafLock *lock);
+
+void
+seaf_lock_unlock (SeafLock *lock);
+
+/* The time spent waiting for @cond is not counted as held. */
+int
+seaf_lock_cond_wait (pthread_cond_t *cond, SeafLock *lock);
+
+int
+seaf_lock_cond_timedwait (pthread_cond_t *cond, SeafLock *lock,
+                          const struct timespec *abstime);
+
+/* Returns copies of the stats, the longest waited for first. */
+GList *
+seaf_lock_get_stats ();
+
+void
+seaf_lock_stats_free (GList *stats);
+
+#endif
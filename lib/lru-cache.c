@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "lru-cache.h"
+#include "lock-stats.h"
+
+typedef struct CacheEntry {
+    char       *key;
+    gpointer    value;
+    gint64      size;
+    GList       link;           /* node in the shard's LRU queue */
+} CacheEntry;
+
+typedef struct CacheShard {
+    SeafLock        lock;
+    GHashTable     *entries;    /* key -> CacheEntry */
+    GQueue          lru;        /* most recently used at head */
+    gint64          bytes;
+    gint64          max_bytes;
+    guint64         hits;
+    guint64         misses;
+    guint64         evictions;
+    guint64         contentions;    /* times the lock was held by another thread */
+} CacheShard;
+
+struct LRUCache {
+    int             n_shards;
+    CacheShard     *shards;
+    gint64          max_bytes;
+    GDestroyNotify  value_free;
+};
+
+static void
+cache_entry_free (LRUCache *cache, CacheEntry *entry)
+{
+    if (cache->value_free)
+        cache->value_free (entry->value);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+LRUCache *
+lru_cache_new (gint64 max_bytes, int n_shards, GDestroyNotify value_free)
+{
+    LRUCache *cache;
+    CacheShard *shard;
+    int i;
+
+    if (max_bytes <= 0)
+        return NULL;
+    if (n_shards <= 0)
+        n_shards = 1;
+
+    cache = g_new0 (LRUCache, 1);
+    cache->n_shards = n_shards;
+    cache->max_bytes = max_bytes;
+    cache->value_free = value_free;
+    cache->shards = g_new0 (CacheShard, n_shards);
+
+    for (i = 0; i < n_shards; ++i) {
+        shard = &cache->shards[i];
+        seaf_lock_init (&shard->lock, NULL);
+        /* Entries are freed explicitly, since they're also linked in the queue. */
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+        g_queue_init (&shard->lru);
+        shard->max_bytes = max_bytes / n_shards;
+    }
+
+    return cache;
+}
+
+static void
+shard_clear (LRUCache *cache, CacheShard *shard)
+{
+    GList *link;
+
+    while ((link = g_queue_pop_head_link (&shard->lru)) != NULL)
+        cache_entry_free (cache, link->data);
+    g_hash_table_remove_all (shard->entries);
+    shard->bytes = 0;
+}
+
+void
+lru_cache_free (LRUCache *cache)
+{
+    CacheShard *shard;
+    int i;
+
+    if (!cache)
+        return;
+
+    for (i = 0; i < cache->n_shards; ++i) {
+        shard = &cache->shards[i];
+        shard_clear (cache, shard);
+        g_hash_table_destroy (shard->entries);
+        seaf_lock_destroy (&shard->lock);
+    }
+    g_free (cache->shards);
+    g_free (cache);
+}
+
+static inline CacheShard *
+get_shard (LRUCache *cache, const char *key)
+{
+    return &cache->shards[g_str_hash (key) % cache->n_shards];
+}
+
+static inline void
+shard_lock (CacheShard *shard)
+{
+    if (seaf_lock_trylock (&shard->lock) != 0) {
+        seaf_lock_lock (&shard->lock);
+        ++shard->contentions;
+    }
+}
+
+gpointer
+lru_cache_lookup_full (LRUCache *cache, const char *key,
+                       LRUCacheLookupFunc func, gpointer user_data)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+    gpointer ret = NULL;
+
+    shard_lock (shard);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_queue_push_head_link (&shard->lru, &entry->link);
+        ret = func (entry->value, user_data);
+        ++shard->hits;
+    } else {
+        ++shard->misses;
+    }
+
+    seaf_lock_unlock (&shard->lock);
+
+    return ret;
+}
+
+static gpointer
+copy_value (gconstpointer value, gpointer user_data)
+{
+    LRUCacheCopyFunc *copy_func = user_data;
+
+    return (*copy_func) (value);
+}
+
+gpointer
+lru_cache_lookup (LRUCache *cache, const char *key, LRUCacheCopyFunc copy_func)
+{
+    return lru_cache_lookup_full (cache, key, copy_value, &copy_func);
+}
+
+static void
+shard_remove_entry (LRUCache *cache, CacheShard *shard, CacheEntry *entry)
+{
+    g_hash_table_remove (shard->entries, entry->key);
+    g_queue_unlink (&shard->lru, &entry->link);
+    shard->bytes -= entry->size;
+    cache_entry_free (cache, entry);
+}
+
+void
+lru_cache_insert (LRUCache *cache, const char *key, gpointer value, gint64 size)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+    GList *tail;
+
+    /* Don't let a single huge value flush the whole shard. */
+    if (size > shard->max_bytes / 4) {
+        if (cache->value_free)
+            cache->value_free (value);
+        return;
+    }
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->key = g_strdup (key);
+    entry->value = value;
+    entry->size = size;
+    entry->link.data = entry;
+
+    shard_lock (shard);
+
+    CacheEntry *old = g_hash_table_lookup (shard->entries, key);
+    if (old)
+        shard_remove_entry (cache, shard, old);
+
+    while (shard->bytes + size > shard->max_bytes &&
+           (tail = g_queue_peek_tail_link (&shard->lru)) != NULL) {
+        shard_remove_entry (cache, shard, tail->data);
+        ++shard->evictions;
+    }
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    g_queue_push_head_link (&shard->lru, &entry->link);
+    shard->bytes += size;
+
+    seaf_lock_unlock (&shard->lock);
+}
+
+void
+lru_cache_remove (LRUCache *cache, const char *key)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+
+    shard_lock (shard);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry)
+        shard_remove_entry (cache, shard, entry);
+
+    seaf_lock_unlock (&shard->lock);
+}
+
+void
+lru_cache_clear (LRUCache *cache)
+{
+    CacheShard *shard;
+    int i;
+
+    for (i = 0; i < cache->n_shards; ++i) {
+        shard = &cache->shards[i];
+        shard_lock (shard);
+        shard_clear (cache, shard);
+        seaf_lock_unlock (&shard->lock);
+    }
+}
+
+int
+lru_cache_remove_if (LRUCache *cache, GHRFunc func, gpointer user_data)
+{
+    CacheShard *shard;
+    GList *link, *prev;
+    CacheEntry *entry;
+    int i, n_removed = 0;
+
+    for (i = 0; i < cache->n_shards; ++i) {
+        shard = &cache->shards[i];
+        shard_lock (shard);
+        for (link = shard->lru.tail; link; link = prev) {
+            prev = link->prev;
+            entry = link->data;
+            if (func (entry->key, entry->value, user_data)) {
+                shard_remove_entry (cache, shard, entry);
+                ++n_removed;
+            }
+        }
+        seaf_lock_unlock (&shard->lock);
+    }
+
+    return n_removed;
+}
+
+void
+lru_cache_set_lock_name (LRUCache *cache, const char *name)
+{
+    int i;
+
+    for (i = 0; i < cache->n_shards; ++i)
+        seaf_lock_set_name (&cache->shards[i].lock, name);
+}
+
+int
+lru_cache_get_n_shards (LRUCache *cache)
+{
+    return cache->n_shards;
+}
+
+void
+lru_cache_get_shard_stats (LRUCache *cache, int i, LRUCacheStats *stats)
+{
+    CacheShard *shard = &cache->shards[i];
+
+    memset (stats, 0, sizeof(LRUCacheStats));
+
+    seaf_lock_lock (&shard->lock);
+    stats->hits = shard->hits;
+    stats->misses = shard->misses;
+    stats->evictions = shard->evictions;
+    stats->contentions = shard->contentions;
+    stats->n_items = g_hash_table_size (shard->entries);
+    stats->bytes = shard->bytes;
+    stats->max_bytes = shard->max_bytes;
+    seaf_lock_unlock (&shard->lock);
+}
+
+void
+lru_cache_get_stats (LRUCache *cache, LRUCacheStats *stats)
+{
+    LRUCacheStats shard_stats;
+    int i;
+
+    memset (stats, 0, sizeof(LRUCacheStats));
+    stats->max_bytes = cache->max_bytes;
+
+    for (i = 0; i < cache->n_shards; ++i) {
+        lru_cache_get_shard_stats (cache, i, &shard_stats);
+        stats->hits += shard_stats.hits;
+        stats->misses += shard_stats.misses;
+        stats->evictions += shard_stats.evictions;
+        stats->contentions += shard_stats.contentions;
+        stats->n_items += shard_stats.n_items;
+        stats->bytes += shard_stats.bytes;
+    }
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <glib.h>
+
+/*
+ * A memory bounded, thread-safe LRU cache keyed by strings.
+ *
+ * The cache is split into shards, each protected by its own lock, so that
+ * concurrent lookups on different keys rarely contend. Every shard gets an
+ * equal part of the byte budget. Values are owned by the cache; callers get
+ * their own copy on lookup, so cached values must never be modified.
+ *
+ * Besides hits and misses, every shard counts the times its lock was found
+ * held by another thread, which shows whether it needs more shards.
+ */
+
+typedef struct LRUCache LRUCache;
+
+typedef gpointer (*LRUCacheCopyFunc) (gconstpointer value);
+
+typedef gpointer (*LRUCacheLookupFunc) (gconstpointer value, gpointer user_data);
+
+typedef struct LRUCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 contentions;
+    gint64  n_items;
+    gint64  bytes;
+    gint64  max_bytes;
+} LRUCacheStats;
+
+LRUCache *
+lru_cache_new (gint64 max_bytes, int n_shards, GDestroyNotify value_free);
+
+void
+lru_cache_free (LRUCache *cache);
+
+/*
+ * Returns a copy of the cached value made by @copy_func,
+ * or NULL if @key is not in the cache.
+ */
+gpointer
+lru_cache_lookup (LRUCache *cache, const char *key, LRUCacheCopyFunc copy_func);
+
+/*
+ * Like lru_cache_lookup(), but returns what @func extracts from the cached
+ * value, e.g. a copy of a small part of it. @func runs with the shard locked.
+ * Returns NULL if @key is not in the cache.
+ */
+gpointer
+lru_cache_lookup_full (LRUCache *cache, const char *key,
+                       LRUCacheLookupFunc func, gpointer user_data);
+
+/*
+ * Insert @value, which takes approximately @size bytes, into the cache.
+ * The cache takes ownership of @value. An existing value for @key is replaced.
+ */
+void
+lru_cache_insert (LRUCache *cache, const char *key, gpointer value, gint64 size);
+
+void
+lru_cache_remove (LRUCache *cache, const char *key);
+
+void
+lru_cache_clear (LRUCache *cache);
+
+/*
+ * Remove the values for which @func returns TRUE. Shards are locked one at a
+ * time, so lookups of other shards go on meanwhile. Returns the number of
+ * values removed.
+ */
+int
+lru_cache_remove_if (LRUCache *cache, GHRFunc func, gpointer user_data);
+
+void
+lru_cache_get_stats (LRUCache *cache, LRUCacheStats *stats);
+
+/*
+ * Record the lock stats of all shards under @name, see lock-stats.h.
+ * Must be called before the cache is used.
+ */
+void
+lru_cache_set_lock_name (LRUCache *cache, const char *name);
+
+int
+lru_cache_get_n_shards (LRUCache *cache);
+
+/* Counters of shard @i, @max_bytes is the budget of the shard. */
+void
+lru_cache_get_shard_stats (LRUCache *cache, int i, LRUCacheStats *stats);
+
+#endif
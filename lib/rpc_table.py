@@ -107,4 +107,5 @@ func_table = [
     [ "object", ["string", "string", "string", "string", "string", "string", "string", "int", "int"] ],
     [ "object", ["string", "string", "string", "string", "string", "string", "int", "string", "int", "int"] ],
     ["json", ["string"]],
+    ["json", ["string", "int"]],
 ]
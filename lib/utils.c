@@ -2512,3 +2512,80 @@ ccnet_key_file_get_string (GKeyFile *keyf,
 
     return g_strchomp(v);
 }
+
+#include <pthread.h>
+
+typedef struct ParallelChecks {
+    int                 n;
+    volatile gint       next;
+    ParallelCheckFunc   func;
+    void               *user_data;
+    gboolean           *results;
+} ParallelChecks;
+
+static void *
+parallel_check_worker (void *vdata)
+{
+    ParallelChecks *checks = vdata;
+    int i;
+
+    while ((i = g_atomic_int_add (&checks->next, 1)) < checks->n)
+        checks->results[i] = checks->func (i, checks->user_data);
+
+    return NULL;
+}
+
+static void
+run_parallel (int n, int max_threads, int per_thread,
+              ParallelCheckFunc func, void *user_data,
+              gboolean *results)
+{
+    ParallelChecks checks;
+    pthread_t *tids;
+    int n_threads, n_started, i;
+
+    checks.n = n;
+    checks.next = 0;
+    checks.func = func;
+    checks.user_data = user_data;
+    checks.results = results;
+
+    /* Threads are not worth it for a few checks. */
+    n_threads = MIN (max_threads, n / per_thread);
+    if (n_threads <= 1) {
+        parallel_check_worker (&checks);
+        return;
+    }
+
+    tids = g_new (pthread_t, n_threads);
+    n_started = 0;
+    for (i = 0; i < n_threads; ++i) {
+        if (pthread_create (&tids[n_started], NULL,
+                            parallel_check_worker, &checks) == 0)
+            ++n_started;
+    }
+
+    /* Make sure all checks are done even if no thread could be started. */
+    parallel_check_worker (&checks);
+
+    for (i = 0; i < n_started; ++i)
+        pthread_join (tids[i], NULL);
+    g_free (tids);
+}
+
+void
+run_parallel_checks (int n, int max_threads,
+                     ParallelCheckFunc func, void *user_data,
+                     gboolean *results)
+{
+    run_parallel (n, max_threads, PARALLEL_CHECKS_PER_THREAD,
+                  func, user_data, results);
+}
+
+void
+run_parallel_jobs (int n, int max_threads,
+                   ParallelCheckFunc func, void *user_data,
+                   gboolean *results)
+{
+    run_parallel (n, max_threads, 1, func, user_data, results);
+}
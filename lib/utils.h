@@ -407,4 +407,27 @@ gchar* ccnet_key_file_get_string (GKeyFile *keyf,
                                   const char *category,
                                   const char *key);
 
+typedef gboolean (*ParallelCheckFunc) (int index, void *user_data);
+
+#define PARALLEL_CHECKS_PER_THREAD 32
+
+/*
+ * Run @func for every index in [0, @n) on up to @max_threads threads, and
+ * store the return values in @results. For batches of blocking checks,
+ * such as stat() calls on network file systems.
+ */
+void
+run_parallel_checks (int n, int max_threads,
+                     ParallelCheckFunc func, void *user_data,
+                     gboolean *results);
+
+/*
+ * Like run_parallel_checks(), but starts a thread for every job up to
+ * @max_threads. For a few slow jobs, such as copying files.
+ */
+void
+run_parallel_jobs (int n, int max_threads,
+                   ParallelCheckFunc func, void *user_data,
+                   gboolean *results);
+
 #endif
@@ -1,4 +1,5 @@
 from .rpcclient import SeafServerThreadedRpcClient as ServerThreadedRpcClient
+from .pipelined import SeafServerPipelinedRpcClient as ServerPipelinedRpcClient
 
 class TaskType(object):
     DOWNLOAD = 0
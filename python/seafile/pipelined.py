@@ -0,0 +1,157 @@
+"""Pipelined transport of the seaf-server rpc, see server/rpc-pipeline.h.
+
+Each connection carries any number of calls at the same time, so threads
+sharing a client don't wait for each other's calls, and submit() lets one
+thread issue several calls and collect the results later.
+"""
+
+import json
+import os
+import socket
+import struct
+import threading
+import zlib
+from concurrent.futures import Future, ThreadPoolExecutor
+
+from pysearpc import SearpcClient
+
+from .rpcclient import SeafServerThreadedRpcClient
+
+PIPELINE_SOCKET_NAME = 'seafile-pipelined.sock'
+
+_HEADER = struct.Struct('!III')
+_ACCEPT_ZLIB = 0x1
+_ZLIB = 0x1
+
+
+class _Connection(object):
+    """A socket with a thread that hands responses to waiting futures."""
+
+    def __init__(self, socket_path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(socket_path)
+        # lock guards pending, send_lock keeps requests from interleaving.
+        self.lock = threading.Lock()
+        self.send_lock = threading.Lock()
+        self.pending = {}
+        self.next_id = 0
+        self.closed = False
+        reader = threading.Thread(target=self._read_responses)
+        reader.daemon = True
+        reader.start()
+
+    def call(self, body):
+        future = Future()
+        with self.lock:
+            if self.closed:
+                raise ConnectionError('rpc connection is closed')
+            self.next_id = (self.next_id + 1) & 0xffffffff
+            req_id = self.next_id
+            self.pending[req_id] = future
+        try:
+            with self.send_lock:
+                self.sock.sendall(_HEADER.pack(len(body), req_id, _ACCEPT_ZLIB) + body)
+        except OSError:
+            with self.lock:
+                self.pending.pop(req_id, None)
+                self._close_locked()
+            raise
+        return future
+
+    def in_flight(self):
+        return len(self.pending)
+
+    def _recv(self, n):
+        buf = bytearray()
+        while len(buf) < n:
+            chunk = self.sock.recv(n - len(buf))
+            if not chunk:
+                raise ConnectionError('rpc connection closed by server')
+            buf += chunk
+        return bytes(buf)
+
+    def _read_responses(self):
+        try:
+            while True:
+                length, req_id, flags = _HEADER.unpack(self._recv(_HEADER.size))
+                payload = self._recv(length)
+                if flags & _ZLIB:
+                    payload = zlib.decompress(payload)
+                with self.lock:
+                    future = self.pending.pop(req_id, None)
+                if future is not None:
+                    future.set_result(payload.decode('utf-8'))
+        except Exception as e:
+            with self.lock:
+                self._close_locked()
+                pending, self.pending = self.pending, {}
+            for future in pending.values():
+                future.set_exception(ConnectionError(str(e)))
+
+    def _close_locked(self):
+        if not self.closed:
+            self.closed = True
+            self.sock.close()
+
+
+class PipelinedClient(SearpcClient):
+    """Runs calls over a few shared connections.
+
+    New calls go to the connection with the fewest calls in flight.
+    Connections are opened on first use and replaced when they fail.
+    """
+
+    def __init__(self, socket_path, service_name, pool_size=2, max_workers=8):
+        self.socket_path = socket_path
+        self.service_name = service_name
+        self.pool_size = pool_size
+        self.conns = []
+        self.lock = threading.Lock()
+        self.max_workers = max_workers
+        self.executor = None
+
+    def _get_connection(self):
+        with self.lock:
+            self.conns = [c for c in self.conns if not c.closed]
+            if len(self.conns) < self.pool_size:
+                conn = _Connection(self.socket_path)
+                self.conns.append(conn)
+                return conn
+            return min(self.conns, key=lambda c: c.in_flight())
+
+    def call_remote_func_async(self, fcall_str):
+        body = json.dumps({'service': self.service_name,
+                           'request': fcall_str}).encode('utf-8')
+        return self._get_connection().call(body)
+
+    def call_remote_func_sync(self, fcall_str):
+        return self.call_remote_func_async(fcall_str).result()
+
+    def submit(self, func, *args, **kwargs):
+        """Calls func, a method of this client, in a worker thread and
+        returns a Future of its result. The calls of all workers share the
+        pool's connections.
+        """
+        with self.lock:
+            if self.executor is None:
+                self.executor = ThreadPoolExecutor(max_workers=self.max_workers)
+        return self.executor.submit(func, *args, **kwargs)
+
+
+class SeafServerPipelinedRpcClient(PipelinedClient, SeafServerThreadedRpcClient):
+    """SeafServerThreadedRpcClient on the pipelined socket."""
+
+    def __init__(self, pipe_dir, pool_size=2, max_workers=8):
+        PipelinedClient.__init__(self,
+                                 os.path.join(pipe_dir, PIPELINE_SOCKET_NAME),
+                                 "seafserv-threaded-rpcserver",
+                                 pool_size, max_workers)
+
+
+def create_rpc_client(pipe_dir, **kwargs):
+    """Returns a pipelined client if seaf-server provides the socket,
+    otherwise a client of the named pipe in pipe_dir.
+    """
+    if os.path.exists(os.path.join(pipe_dir, PIPELINE_SOCKET_NAME)):
+        return SeafServerPipelinedRpcClient(pipe_dir, **kwargs)
+    return SeafServerThreadedRpcClient(os.path.join(pipe_dir, 'seafile.sock'))
@@ -61,6 +61,27 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
         pass
     get_repo_owner = seafile_get_repo_owner
 
+    # batched lookups, repo_ids is a json array of repo ids
+    @searpc_func("objlist", ["string"])
+    def seafile_get_repos_by_ids(repo_ids):
+        pass
+    get_repos_by_ids = seafile_get_repos_by_ids
+
+    @searpc_func("json", ["string"])
+    def seafile_get_repo_owners(repo_ids):
+        pass
+    get_repo_owners = seafile_get_repo_owners
+
+    @searpc_func("json", ["string"])
+    def seafile_get_repo_sizes(repo_ids):
+        pass
+    get_repo_sizes = seafile_get_repo_sizes
+
+    @searpc_func("objlist", ["string"])
+    def seafile_get_repo_head_commits(repo_ids):
+        pass
+    get_repo_head_commits = seafile_get_repo_head_commits
+
     @searpc_func("objlist", [])
     def seafile_get_orphan_repo_list():
         pass
@@ -141,6 +162,11 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
         pass
     rename_file = seafile_rename_file
 
+    @searpc_func("string", ["string", "string", "string"])
+    def seafile_apply_batch_ops(repo_id, ops_json, user):
+        pass
+    apply_batch_ops = seafile_apply_batch_ops
+
     @searpc_func("int", ["string", "string"])
     def seafile_is_valid_filename(repo_id, filename):
         pass
@@ -240,6 +266,11 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
         pass
     add_share = seafile_add_share
 
+    @searpc_func("int", ["string", "string", "string", "string"])
+    def seafile_add_shares(repo_id, from_email, to_emails, permission):
+        pass
+    add_shares = seafile_add_shares
+
     @searpc_func("objlist", ["string", "string", "int", "int"])
     def seafile_list_share_repos(email, query_col, start, limit):
         pass
@@ -286,6 +317,11 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
         pass
     group_share_repo = seafile_group_share_repo
 
+    @searpc_func("int", ["string", "string", "string", "string"])
+    def seafile_group_share_repo_to_groups(repo_id, group_ids, user_name, permisson):
+        pass
+    group_share_repo_to_groups = seafile_group_share_repo_to_groups
+
     @searpc_func("int", ["string", "int", "string"])
     def seafile_group_unshare_repo(repo_id, group_id, user_name):
         pass
@@ -612,6 +648,10 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def create_virtual_repo(origin_repo_id, path, repo_name, repo_desc, owner, passwd=''):
         pass
 
+    @searpc_func("string", ["string", "string", "string", "string", "string"])
+    def fork_repo(src_repo_id, commit_id, repo_name, owner, passwd=''):
+        pass
+
     @searpc_func("objlist", ["string"])
     def get_virtual_repos_by_owner(owner):
         pass
@@ -625,6 +665,10 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def get_system_default_repo_id():
         pass
 
+    @searpc_func("int", [])
+    def is_server_ready():
+        pass
+
     # Change password
     @searpc_func("int", ["string", "string", "string", "string"])
     def seafile_change_repo_passwd(repo_id, old_passwd, new_passwd, user):
@@ -772,6 +816,30 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def cancel_zip_task(token):
         pass
 
+    @searpc_func("string", [])
+    def get_zip_task_stats():
+        pass
+
+    @searpc_func("string", [])
+    def get_db_query_stats():
+        pass
+
+    @searpc_func("string", [])
+    def get_lock_stats():
+        pass
+
+    @searpc_func("string", [])
+    def get_access_stats():
+        pass
+
+    @searpc_func("string", [])
+    def get_cache_versions():
+        pass
+
+    @searpc_func("string", [])
+    def get_repo_reclaim_progress():
+        pass
+
     ###### GC    ####################
     @searpc_func("int", [])
     def seafile_gc():
@@ -813,10 +881,18 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def pop_event(channel):
         pass
 
+    @searpc_func("json", ["string", "int"])
+    def pop_events(channel, max_events):
+        pass
+
     @searpc_func("objlist", ["string", "string"])
     def search_files(self, repo_id, search_str):
         pass
 
+    @searpc_func("int", ["string"])
+    def rebuild_search_index(self, repo_id):
+        pass
+
     #user management
     @searpc_func("int", ["string", "string", "int", "int"])
     def add_emailuser(self, email, passwd, is_staff, is_active):
@@ -862,6 +938,10 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def count_inactive_emailusers(self, source):
         pass
 
+    @searpc_func("int", [])
+    def reconcile_row_counts(self):
+        pass
+
     @searpc_func("objlist", ["string"])
     def filter_emailusers_by_emails(self):
         pass
@@ -903,6 +983,10 @@ class SeafServerThreadedRpcClient(NamedPipeClient):
     def group_add_member(self, group_id, user_name, member_name):
         pass
 
+    @searpc_func("int", ["int", "string", "string"])
+    def group_add_members(self, group_id, user_name, member_names):
+        pass
+
     @searpc_func("int", ["int", "string", "string"])
     def group_remove_member(self, group_id, user_name, member_name):
         pass
@@ -1,5 +1,7 @@
 from .service import seafserv_threaded_rpc, ccnet_threaded_rpc
+from . import cache
 from pysearpc import SearpcError
+from contextlib import contextmanager
 import json
 
 """
@@ -19,7 +21,53 @@ REPO_STATUS_READ_ONLY = 1
 class SeafileAPI(object):
 
     def __init__(self):
-        pass
+        self.shared_cache = None
+
+    # caching, see cache.py
+
+    @contextmanager
+    def request_cache(self):
+        """Memoize get_repo, get_repo_owner, get_owned_repo_list and
+        get_repo_size in the block, and coalesce the lookups of repos seen
+        in lists. Writes made through this API drop the cached values; call
+        clear_request_cache() after changes made otherwise.
+
+            with seafile_api.request_cache():
+                render_page()
+        """
+        cache.push(cache.RequestCache(seafserv_threaded_rpc.get_cache_versions,
+                                      self.shared_cache))
+        try:
+            yield
+        finally:
+            cache.pop()
+
+    def clear_request_cache(self):
+        rc = cache.current()
+        if rc is not None:
+            rc.invalidate()
+
+    def enable_shared_cache(self, max_entries=10000):
+        """Keep the values of request caches across requests, as long as
+        seaf-server reports no change of their kind. Not for clusters."""
+        self.shared_cache = cache.SharedCache(max_entries)
+
+    def disable_shared_cache(self):
+        self.shared_cache = None
+
+    def prefetch_repos(self, repo_ids):
+        """Look up the repos and owners of repo_ids together, on the first
+        get_repo or get_repo_owner of one of them in the request cache."""
+        rc = cache.current()
+        if rc is not None:
+            rc.note_repo_ids(repo_ids)
+
+    def get_cache_versions(self):
+        """
+        Return a dict with the instance id of seaf-server and the versions
+        of the repo, repo_list and perm data.
+        """
+        return json.loads(seafserv_threaded_rpc.get_cache_versions())
 
     # fileserver token
 
@@ -69,6 +117,7 @@ class SeafileAPI(object):
         """
         return seafserv_threaded_rpc.get_decrypt_key(repo_id, username)
 
+    @cache.invalidates
     def change_repo_passwd(self, repo_id, old_passwd, new_passwd, user):
         return seafserv_threaded_rpc.change_repo_passwd(repo_id, old_passwd,
                                                         new_passwd, user)
@@ -86,9 +135,11 @@ class SeafileAPI(object):
 
     # repo manipulation
 
+    @cache.invalidates
     def create_repo(self, name, desc, username, passwd=None, enc_version=2, storage_id=None):
         return seafserv_threaded_rpc.create_repo(name, desc, username, passwd, enc_version)
 
+    @cache.invalidates
     def create_enc_repo(self, repo_id, name, desc, username, magic, random_key, salt, enc_version):
         return seafserv_threaded_rpc.create_enc_repo(repo_id, name, desc, username, magic, random_key, salt, enc_version)
 
@@ -102,8 +153,34 @@ class SeafileAPI(object):
         """
         Return: a Repo object (lib/repo.vala)
         """
-        return seafserv_threaded_rpc.get_repo(repo_id)
+        rc = cache.current()
+        if rc is None:
+            return seafserv_threaded_rpc.get_repo(repo_id)
+        return cache._copy_result(
+            rc.get_bulk('get_repo', repo_id, ('repo',), rc.pending_repos,
+                        seafserv_threaded_rpc.get_repo, self._get_repo_dict))
 
+    def _get_repo_dict(self, repo_ids):
+        repos = seafserv_threaded_rpc.get_repos_by_ids(json.dumps(repo_ids))
+        return dict((repo.id, repo) for repo in repos)
+
+    def get_repos_by_ids(self, repo_ids):
+        """
+        Return: a list of the Repo objects of repo_ids that exist
+        """
+        repos = seafserv_threaded_rpc.get_repos_by_ids(json.dumps(repo_ids))
+        rc = cache.current()
+        if rc is not None:
+            rc.note_repos(repos)
+        return repos
+
+    def get_repo_owners(self, repo_ids):
+        """
+        Return: a dict from repo id to owner
+        """
+        return seafserv_threaded_rpc.get_repo_owners(json.dumps(repo_ids))
+
+    @cache.invalidates
     def remove_repo(self, repo_id):
         return seafserv_threaded_rpc.remove_repo(repo_id)
 
@@ -116,6 +193,7 @@ class SeafileAPI(object):
     def count_repos(self):
         return seafserv_threaded_rpc.count_repos()
 
+    @cache.invalidates
     def edit_repo(self, repo_id, name, description, username):
         return seafserv_threaded_rpc.edit_repo(repo_id, name, description, username)
 
@@ -125,6 +203,7 @@ class SeafileAPI(object):
         """
         return seafserv_threaded_rpc.is_repo_owner(username, repo_id)
 
+    @cache.invalidates
     def set_repo_owner(self, email, repo_id):
         return seafserv_threaded_rpc.set_repo_owner(email, repo_id)
 
@@ -132,15 +211,25 @@ class SeafileAPI(object):
         """
         Return: repo owner in string
         """
-        return seafserv_threaded_rpc.get_repo_owner(repo_id)
+        rc = cache.current()
+        if rc is None:
+            return seafserv_threaded_rpc.get_repo_owner(repo_id)
+        return rc.get_bulk('get_repo_owner', repo_id, ('repo_list',),
+                           rc.pending_owners, seafserv_threaded_rpc.get_repo_owner,
+                           self.get_repo_owners)
 
+    @cache.cached('repo', 'repo_list')
     def get_owned_repo_list(self, username, ret_corrupted=False, start=-1, limit=-1):
         """
         Return: a list of Repo objects
         """
-        return seafserv_threaded_rpc.list_owned_repos(username,
-                                                      1 if ret_corrupted else 0,
-                                                      start, limit)
+        repos = seafserv_threaded_rpc.list_owned_repos(username,
+                                                       1 if ret_corrupted else 0,
+                                                       start, limit)
+        rc = cache.current()
+        if rc is not None:
+            rc.note_repos(repos, owner=username)
+        return repos
 
     def search_repos_by_name(self, name):
         return seafserv_threaded_rpc.search_repos_by_name(name)
@@ -148,9 +237,11 @@ class SeafileAPI(object):
     def get_orphan_repo_list(self):
         return seafserv_threaded_rpc.get_orphan_repo_list()
 
+    @cache.cached('repo')
     def get_repo_size(self, repo_id):
         return seafserv_threaded_rpc.server_repo_size(repo_id)
 
+    @cache.invalidates
     def revert_repo(self, repo_id, commit_id, username):
         return seafserv_threaded_rpc.revert_on_server(repo_id, commit_id, username)
 
@@ -177,9 +268,13 @@ class SeafileAPI(object):
     def get_system_default_repo_id (self):
         return seafserv_threaded_rpc.get_system_default_repo_id()
 
+    def is_server_ready (self):
+        return seafserv_threaded_rpc.is_server_ready() == 1
+
     def get_org_id_by_repo_id (self, repo_id):
         return seafserv_threaded_rpc.get_org_id_by_repo_id(repo_id)
 
+    @cache.invalidates
     def set_repo_status (self, repo_id, status):
         return seafserv_threaded_rpc.set_repo_status(repo_id, status)
 
@@ -262,6 +357,7 @@ class SeafileAPI(object):
     def list_dir_with_perm(self, repo_id, dir_path, dir_id, user, offset=-1, limit=-1):
         return seafserv_threaded_rpc.list_dir_with_perm (repo_id, dir_path, dir_id, user, offset, limit)
 
+    @cache.invalidates
     def mkdir_with_parents (self, repo_id, parent_dir, relative_path, username):
         return seafserv_threaded_rpc.mkdir_with_parents(repo_id, parent_dir, relative_path, username)
 
@@ -276,15 +372,18 @@ class SeafileAPI(object):
 
     # file/dir operations
 
+    @cache.invalidates
     def post_file(self, repo_id, tmp_file_path, parent_dir, filename, username):
         """Add a file to a directory"""
         return seafserv_threaded_rpc.post_file(repo_id, tmp_file_path, parent_dir,
                                                filename, username)
 
+    @cache.invalidates
     def post_empty_file(self, repo_id, parent_dir, filename, username):
         return seafserv_threaded_rpc.post_empty_file(repo_id, parent_dir,
                                                      filename, username)
 
+    @cache.invalidates
     def put_file(self, repo_id, tmp_file_path, parent_dir, filename,
                  username, head_id):
         """Update an existing file
@@ -298,6 +397,7 @@ class SeafileAPI(object):
     If you want to delete multiple files in a batch, @filename should be in
     the following format: 'filename1\tfilename2\tfilename3'
     '''
+    @cache.invalidates
     def del_file(self, repo_id, parent_dir, filename, username):
         return seafserv_threaded_rpc.del_file(repo_id, parent_dir, filename, username)
 
@@ -306,12 +406,14 @@ class SeafileAPI(object):
     should be in the following format: 'filename1\tfilename2\tfilename3',make sure the number of files
     in @src_filename and @dst_filename parameters match
     '''
+    @cache.invalidates
     def copy_file(self, src_repo, src_dir, src_filename, dst_repo,
                   dst_dir, dst_filename, username, need_progress, synchronous=0):
         return seafserv_threaded_rpc.copy_file(src_repo, src_dir, src_filename,
                                                dst_repo, dst_dir, dst_filename,
                                                username, need_progress, synchronous)
 
+    @cache.invalidates
     def move_file(self, src_repo, src_dir, src_filename, dst_repo, dst_dir,
                   dst_filename, replace, username, need_progress, synchronous=0):
         return seafserv_threaded_rpc.move_file(src_repo, src_dir, src_filename,
@@ -324,17 +426,29 @@ class SeafileAPI(object):
     def cancel_copy_task(self, task_id):
         return seafserv_threaded_rpc.cancel_copy_task(task_id)
 
+    @cache.invalidates
     def rename_file(self, repo_id, parent_dir, oldname, newname, username):
         return seafserv_threaded_rpc.rename_file(repo_id, parent_dir,
                                                  oldname, newname, username)
 
+    @cache.invalidates
+    def apply_batch_ops(self, repo_id, ops, username):
+        """Apply a list of operations in one commit, return the new head commit id.
+
+        Each operation is a dict like {"op": "move", "path": "/a", "dst_dir": "/b"}.
+        """
+        return seafserv_threaded_rpc.apply_batch_ops(repo_id, json.dumps(ops), username)
+
+    @cache.invalidates
     def post_dir(self, repo_id, parent_dir, dirname, username):
         """Add a directory"""
         return seafserv_threaded_rpc.post_dir(repo_id, parent_dir, dirname, username)
 
+    @cache.invalidates
     def revert_file(self, repo_id, commit_id, path, username):
         return seafserv_threaded_rpc.revert_file(repo_id, commit_id, path, username)
 
+    @cache.invalidates
     def revert_dir(self, repo_id, commit_id, path, username):
         return seafserv_threaded_rpc.revert_dir(repo_id, commit_id, path, username)
 
@@ -415,6 +529,13 @@ class SeafileAPI(object):
         return seafserv_threaded_rpc.add_share(repo_id, from_username,
                                                to_username, permission)
 
+    def share_repo_to_users(self, repo_id, from_username, to_usernames, permission):
+        """
+        @to_usernames: list of usernames
+        """
+        return seafserv_threaded_rpc.add_shares(repo_id, from_username,
+                                                json.dumps(to_usernames), permission)
+
     def remove_share(self, repo_id, from_username, to_username):
         return seafserv_threaded_rpc.remove_share(repo_id, from_username,
                                                   to_username)
@@ -478,6 +599,13 @@ class SeafileAPI(object):
         return seafserv_threaded_rpc.group_share_repo(repo_id, group_id,
                                                       username, permission)
 
+    def set_group_repos(self, repo_id, group_ids, username, permission):
+        """
+        @group_ids: list of group ids
+        """
+        return seafserv_threaded_rpc.group_share_repo_to_groups(repo_id, json.dumps(group_ids),
+                                                                username, permission)
+
     def group_unshare_repo(self, repo_id, group_id, username):
         # deprecated, use ``unset_group_repo``
         return seafserv_threaded_rpc.group_unshare_repo(repo_id, group_id, username)
@@ -753,6 +881,14 @@ class SeafileAPI(object):
                                                          owner,
                                                          passwd)
 
+    @cache.invalidates
+    def fork_repo(self, src_repo_id, repo_name, owner, commit_id='', passwd=''):
+        """Creates a library from commit_id of src_repo_id, or from its head,
+        sharing its content instead of copying it. Returns the new repo id.
+        """
+        return seafserv_threaded_rpc.fork_repo(src_repo_id, commit_id,
+                                               repo_name, owner, passwd)
+
     def get_virtual_repos_by_owner(self, owner):
         return seafserv_threaded_rpc.get_virtual_repos_by_owner(owner)
 
@@ -856,6 +992,39 @@ class SeafileAPI(object):
 
     def search_files(self, repo_id, search_str):
         return seafserv_threaded_rpc.search_files(repo_id, search_str)
+
+    def rebuild_search_index(self, repo_id):
+        return seafserv_threaded_rpc.rebuild_search_index(repo_id)
+
+    def get_db_query_stats(self):
+        """
+        Return a list of dicts with the count, errors, total_time_ms and
+        max_time_ms of each sql template, the most time consuming first.
+        """
+        return json.loads(seafserv_threaded_rpc.get_db_query_stats())
+
+    def get_lock_stats(self):
+        """
+        Return a list of dicts with the acquisitions, contentions,
+        wait_time_us, max_wait_us and max_hold_us of each instrumented lock,
+        the longest waited for first. Empty unless lock_stats is enabled.
+        """
+        return json.loads(seafserv_threaded_rpc.get_lock_stats())
+
+    def get_access_stats(self):
+        """
+        Return the sample_rate and, for each class of objects (repo, dir and
+        block), the most read objects and a histogram of the reads by reuse
+        distance. Classes are empty unless access_stats_sample_rate is set.
+        """
+        return json.loads(seafserv_threaded_rpc.get_access_stats())
+
+    def get_repo_reclaim_progress(self):
+        """
+        Return a list of dicts with the repo_id, queued and started times and
+        removed_blocks of the deleted repos whose storage is being reclaimed.
+        """
+        return json.loads(seafserv_threaded_rpc.get_repo_reclaim_progress())
     
 seafile_api = SeafileAPI()
 
@@ -977,6 +1146,13 @@ class CcnetAPI(object):
         """
         return ccnet_threaded_rpc.count_inactive_emailusers(source)
 
+    def reconcile_row_counts(self):
+        """
+        Make the user and org counts be counted again from the database.
+        Call it after users or orgs are changed in the database directly.
+        """
+        return ccnet_threaded_rpc.reconcile_row_counts()
+
     def update_emailuser(self, source, user_id, password, is_staff, is_active):
         """
         source: 'DB' for local db user; 'LDAP' for imported LDAP user.
@@ -1029,6 +1205,13 @@ class CcnetAPI(object):
         """
         return ccnet_threaded_rpc.group_add_member(group_id, user_name, member_name)
     
+    def group_add_members(self, group_id, user_name, member_names):
+        """
+        @member_names: list of usernames
+        """
+        return ccnet_threaded_rpc.group_add_members(group_id, user_name,
+                                                    json.dumps(member_names))
+
     def group_remove_member(self, group_id, user_name, member_name):
         """
         user_name: unused.
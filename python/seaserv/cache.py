@@ -0,0 +1,197 @@
+"""Memoization of SeafileAPI reads, see SeafileAPI.request_cache().
+
+Within a request cache, each cached method runs its rpc once per set of
+arguments. Repo ids returned by list calls are remembered, and the first
+get_repo() or get_repo_owner() of one of them fetches all of them with one
+bulk rpc, so pages that show a repo list and then look at each repo make two
+rpcs instead of one per repo.
+
+The shared cache keeps results across requests. Entries are stamped with the
+versions seaf-server reports by get_cache_versions at the start of the
+request (see server/cache-version.h), and used while the versions of their
+kinds are unchanged. seaf-server only knows about its own changes, so the
+shared cache must not be used with a cluster.
+"""
+
+import copy
+import json
+import threading
+from collections import OrderedDict
+from functools import wraps
+
+# Repo ids fetched by one bulk rpc.
+BULK_BATCH_SIZE = 100
+
+
+def _copy_result(value):
+    """Callers may set attributes on cached objects, give them their own."""
+    if isinstance(value, list):
+        return [copy.copy(v) for v in value]
+    if value is None or isinstance(value, (str, int, float, bool)):
+        return value
+    return copy.copy(value)
+
+
+class SharedCache(object):
+    """Results kept across requests, the least recently used are dropped
+    beyond max_entries."""
+
+    def __init__(self, max_entries):
+        self.max_entries = max_entries
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+
+    def get(self, key, stamp):
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is None:
+                return False, None
+            if entry[0] != stamp:
+                del self.entries[key]
+                return False, None
+            self.entries.move_to_end(key)
+            return True, entry[1]
+
+    def put(self, key, stamp, value):
+        with self.lock:
+            self.entries[key] = (stamp, value)
+            self.entries.move_to_end(key)
+            while len(self.entries) > self.max_entries:
+                self.entries.popitem(last=False)
+
+    def clear(self):
+        with self.lock:
+            self.entries.clear()
+
+
+class RequestCache(object):
+
+    def __init__(self, load_versions, shared=None):
+        self.load_versions = load_versions
+        self.shared = shared
+        self.versions = None
+        self.values = {}
+        # Repo ids seen in results but not looked up yet.
+        self.pending_repos = set()
+        self.pending_owners = set()
+
+    def _stamp(self, kinds):
+        if self.versions is None:
+            self.versions = json.loads(self.load_versions())
+        return (self.versions['instance'],) + \
+            tuple(self.versions[kind] for kind in kinds)
+
+    def lookup(self, key, kinds):
+        if key in self.values:
+            return True, self.values[key]
+        if self.shared is not None:
+            found, value = self.shared.get(key, self._stamp(kinds))
+            if found:
+                self.values[key] = value
+                return True, value
+        return False, None
+
+    def store(self, key, kinds, value):
+        self.values[key] = value
+        if self.shared is not None:
+            self.shared.put(key, self._stamp(kinds), value)
+
+    def note_repos(self, repos, owner=None):
+        """Remembers the repos of a list of Repo objects, owned by owner if
+        it's known."""
+        for repo in repos or []:
+            self.values.setdefault(('get_repo', (repo.id,)), repo)
+            if owner is not None:
+                self.values[('get_repo_owner', (repo.id,))] = owner
+            elif ('get_repo_owner', (repo.id,)) not in self.values:
+                self.pending_owners.add(repo.id)
+
+    def note_repo_ids(self, repo_ids):
+        for repo_id in repo_ids:
+            if ('get_repo', (repo_id,)) not in self.values:
+                self.pending_repos.add(repo_id)
+            if ('get_repo_owner', (repo_id,)) not in self.values:
+                self.pending_owners.add(repo_id)
+
+    def take_batch(self, pending, repo_id):
+        """Returns repo_id and up to BULK_BATCH_SIZE - 1 other pending ids."""
+        pending.discard(repo_id)
+        batch = [repo_id]
+        while pending and len(batch) < BULK_BATCH_SIZE:
+            batch.append(pending.pop())
+        return batch
+
+    def get_bulk(self, name, repo_id, kinds, pending, fetch_one, fetch_many):
+        """Looks up name(repo_id). A pending repo_id is fetched together
+        with other pending ids by fetch_many, which returns a dict by id."""
+        key = (name, (repo_id,))
+        found, value = self.lookup(key, kinds)
+        if found:
+            return value
+        if repo_id not in pending:
+            value = fetch_one(repo_id)
+            self.store(key, kinds, value)
+            return value
+        batch = self.take_batch(pending, repo_id)
+        values = fetch_many(batch)
+        for batch_id in batch:
+            self.store((name, (batch_id,)), kinds, values.get(batch_id))
+        return values.get(repo_id)
+
+    def invalidate(self):
+        """Called after writes; the versions are read again since the
+        server bumped them."""
+        self.values.clear()
+        self.pending_repos.clear()
+        self.pending_owners.clear()
+        self.versions = None
+
+
+_local = threading.local()
+
+
+def current():
+    stack = getattr(_local, 'stack', None)
+    return stack[-1] if stack else None
+
+
+def push(cache):
+    if not hasattr(_local, 'stack'):
+        _local.stack = []
+    _local.stack.append(cache)
+
+
+def pop():
+    _local.stack.pop()
+
+
+def cached(*kinds):
+    """Memoizes a read in the current request cache. kinds are the versions
+    in get_cache_versions that cover the result."""
+    def decorator(func):
+        @wraps(func)
+        def wrapper(self, *args, **kwargs):
+            cache = current()
+            if cache is None:
+                return func(self, *args, **kwargs)
+            key = (func.__name__, args, tuple(sorted(kwargs.items())))
+            found, value = cache.lookup(key, kinds)
+            if not found:
+                value = func(self, *args, **kwargs)
+                cache.store(key, kinds, value)
+            return _copy_result(value)
+        return wrapper
+    return decorator
+
+
+def invalidates(func):
+    """Drops the current request cache after a write."""
+    @wraps(func)
+    def wrapper(self, *args, **kwargs):
+        try:
+            return func(self, *args, **kwargs)
+        finally:
+            cache = current()
+            if cache is not None:
+                cache.invalidate()
+    return wrapper
@@ -95,6 +95,13 @@ CREATE TABLE IF NOT EXISTS Organization (
   UNIQUE INDEX (url_prefix)
 ) ENGINE=INNODB;
 
+CREATE TABLE IF NOT EXISTS RowCount (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  name VARCHAR(64) NOT NULL,
+  num BIGINT NOT NULL,
+  UNIQUE INDEX (name)
+) ENGINE=INNODB;
+
 CREATE TABLE IF NOT EXISTS UserRole (
   id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
   email VARCHAR(255),
@@ -133,6 +133,22 @@ CREATE TABLE IF NOT EXISTS OrgUserQuota (
   UNIQUE INDEX(org_id, user)
 ) ENGINE=INNODB;
 
+CREATE TABLE IF NOT EXISTS UserUsage (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  user VARCHAR(255),
+  size BIGINT,
+  update_time BIGINT,
+  UNIQUE INDEX(user)
+) ENGINE=INNODB;
+
+CREATE TABLE IF NOT EXISTS OrgUsage (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  org_id INTEGER,
+  size BIGINT,
+  update_time BIGINT,
+  UNIQUE INDEX(org_id)
+) ENGINE=INNODB;
+
 CREATE TABLE IF NOT EXISTS Repo (
   id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
   repo_id CHAR(37),
@@ -146,6 +162,41 @@ CREATE TABLE IF NOT EXISTS RepoFileCount (
   UNIQUE INDEX(repo_id)
 ) ENGINE=INNODB;
 
+CREATE TABLE IF NOT EXISTS RepoSizeDirty (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  repo_id CHAR(36),
+  dirty_time BIGINT,
+  UNIQUE INDEX(repo_id)
+) ENGINE=INNODB;
+
+CREATE TABLE IF NOT EXISTS CommitDescription (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  repo_id CHAR(36),
+  commit_id CHAR(40),
+  description TEXT,
+  UNIQUE INDEX(repo_id, commit_id)
+) ENGINE=INNODB;
+
+CREATE TABLE IF NOT EXISTS RepoDeletedEntry (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  repo_id CHAR(36),
+  commit_id CHAR(40),
+  obj_id CHAR(40),
+  obj_name TEXT,
+  basedir TEXT,
+  mode INTEGER,
+  file_size BIGINT,
+  delete_time BIGINT,
+  INDEX(repo_id, delete_time)
+) ENGINE=INNODB;
+
+CREATE TABLE IF NOT EXISTS RepoDeletedIndex (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  repo_id CHAR(36),
+  head_id CHAR(40),
+  UNIQUE INDEX(repo_id)
+) ENGINE=INNODB;
+
 CREATE TABLE IF NOT EXISTS RepoGroup (
   id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
   repo_id CHAR(37),
@@ -311,6 +362,16 @@ CREATE TABLE IF NOT EXISTS VirtualRepo (
   INDEX(origin_repo)
 ) ENGINE=INNODB;
 
+CREATE TABLE IF NOT EXISTS ForkedRepo (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  repo_id CHAR(36),
+  origin_repo CHAR(36),
+  origin_commit CHAR(40),
+  store_id CHAR(36),
+  UNIQUE INDEX(repo_id),
+  INDEX(store_id)
+) ENGINE=INNODB;
+
 CREATE TABLE IF NOT EXISTS WebAP (
   id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
   repo_id CHAR(37),
@@ -324,3 +385,12 @@ CREATE TABLE IF NOT EXISTS WebUploadTempFiles (
   file_path TEXT NOT NULL,
   tmp_file_path TEXT NOT NULL
 ) ENGINE=INNODB;
+
+CREATE TABLE IF NOT EXISTS FileFingerprint (
+  id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT,
+  fingerprint CHAR(40) NOT NULL,
+  size BIGINT NOT NULL,
+  store_id CHAR(36) NOT NULL,
+  file_id CHAR(40) NOT NULL,
+  UNIQUE INDEX(fingerprint, size, store_id)
+) ENGINE=INNODB;
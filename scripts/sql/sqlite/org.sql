@@ -8,3 +8,5 @@ CREATE UNIQUE INDEX IF NOT EXISTS url_prefix_indx on Organization (url_prefix);
 CREATE TABLE IF NOT EXISTS OrgUser (org_id INTEGER, email TEXT, is_staff bool NOT NULL);
 CREATE INDEX IF NOT EXISTS email_indx on OrgUser (email);
 CREATE UNIQUE INDEX IF NOT EXISTS orgid_email_indx on OrgUser (org_id, email);
+
+CREATE TABLE IF NOT EXISTS RowCount (name VARCHAR(64) NOT NULL PRIMARY KEY, num BIGINT NOT NULL);
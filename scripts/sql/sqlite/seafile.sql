@@ -31,23 +31,33 @@ CREATE TABLE IF NOT EXISTS RepoValidSince (repo_id CHAR(37) PRIMARY KEY, timesta
 CREATE TABLE IF NOT EXISTS WebAP (repo_id CHAR(37) PRIMARY KEY, access_property CHAR(10));
 CREATE TABLE IF NOT EXISTS VirtualRepo (repo_id CHAR(36) PRIMARY KEY, origin_repo CHAR(36), path TEXT, base_commit CHAR(40));
 CREATE INDEX IF NOT EXISTS virtualrepo_origin_repo_idx ON VirtualRepo (origin_repo);
+CREATE TABLE IF NOT EXISTS ForkedRepo (repo_id CHAR(36) PRIMARY KEY, origin_repo CHAR(36), origin_commit CHAR(40), store_id CHAR(36));
+CREATE INDEX IF NOT EXISTS forkedrepo_store_id_idx ON ForkedRepo (store_id);
 CREATE TABLE IF NOT EXISTS GarbageRepos (repo_id CHAR(36) PRIMARY KEY);
 CREATE TABLE IF NOT EXISTS RepoTrash (repo_id CHAR(36) PRIMARY KEY, repo_name VARCHAR(255), head_id CHAR(40), owner_id VARCHAR(255), size BIGINT UNSIGNED, org_id INTEGER, del_time BIGINT);
 CREATE INDEX IF NOT EXISTS repotrash_owner_id_idx ON RepoTrash(owner_id);
 CREATE INDEX IF NOT EXISTS repotrash_org_id_idx ON RepoTrash(org_id);
 CREATE TABLE IF NOT EXISTS RepoFileCount (repo_id CHAR(36) PRIMARY KEY, file_count BIGINT UNSIGNED);
+CREATE TABLE IF NOT EXISTS RepoSizeDirty (repo_id CHAR(36) PRIMARY KEY, dirty_time BIGINT);
+CREATE TABLE IF NOT EXISTS CommitDescription (repo_id CHAR(36), commit_id CHAR(40), description TEXT, PRIMARY KEY (repo_id, commit_id));
+CREATE TABLE IF NOT EXISTS RepoDeletedEntry (repo_id CHAR(36), commit_id CHAR(40), obj_id CHAR(40), obj_name TEXT, basedir TEXT, mode INTEGER, file_size BIGINT, delete_time BIGINT);
+CREATE INDEX IF NOT EXISTS repodeletedentry_repo_id_idx ON RepoDeletedEntry (repo_id, delete_time);
+CREATE TABLE IF NOT EXISTS RepoDeletedIndex (repo_id CHAR(36) PRIMARY KEY, head_id CHAR(40));
 CREATE TABLE IF NOT EXISTS FolderUserPerm (repo_id CHAR(36) NOT NULL, path TEXT NOT NULL, permission CHAR(15), user VARCHAR(255) NOT NULL);
 CREATE INDEX IF NOT EXISTS folder_user_perm_idx ON FolderUserPerm(repo_id);
 CREATE TABLE IF NOT EXISTS FolderGroupPerm (repo_id CHAR(36) NOT NULL, path TEXT NOT NULL, permission CHAR(15), group_id INTEGER NOT NULL);
 CREATE INDEX IF NOT EXISTS folder_group_perm_idx ON FolderGroupPerm(repo_id);
 CREATE TABLE IF NOT EXISTS FolderPermTimestamp (repo_id CHAR(36) PRIMARY KEY, timestamp INTEGER);
 CREATE TABLE IF NOT EXISTS WebUploadTempFiles (repo_id CHAR(40) NOT NULL, file_path TEXT NOT NULL, tmp_file_path TEXT NOT NULL);
+CREATE TABLE IF NOT EXISTS FileFingerprint (fingerprint CHAR(40) NOT NULL, size BIGINT NOT NULL, store_id CHAR(36) NOT NULL, file_id CHAR(40) NOT NULL, PRIMARY KEY (fingerprint, size, store_id));
 CREATE TABLE IF NOT EXISTS RepoInfo (repo_id CHAR(36) PRIMARY KEY, name VARCHAR(255) NOT NULL, update_time INTEGER, version INTEGER, is_encrypted INTEGER, last_modifier VARCHAR(255), status INTEGER DEFAULT 0);
 CREATE TABLE IF NOT EXISTS RepoStorageId (repo_id CHAR(40) NOT NULL, storage_id VARCHAR(255) NOT NULL);
 CREATE TABLE IF NOT EXISTS UserQuota (user VARCHAR(255) PRIMARY KEY, quota BIGINT);
 CREATE TABLE IF NOT EXISTS UserShareQuota (user VARCHAR(255) PRIMARY KEY, quota BIGINT);
 CREATE TABLE IF NOT EXISTS OrgQuota (org_id INTEGER PRIMARY KEY, quota BIGINT);
 CREATE TABLE IF NOT EXISTS OrgUserQuota (org_id INTEGER, user VARCHAR(255), quota BIGINT, PRIMARY KEY (org_id, user));
+CREATE TABLE IF NOT EXISTS UserUsage (user VARCHAR(255) PRIMARY KEY, size BIGINT, update_time BIGINT);
+CREATE TABLE IF NOT EXISTS OrgUsage (org_id INTEGER PRIMARY KEY, size BIGINT, update_time BIGINT);
 CREATE TABLE IF NOT EXISTS RoleQuota (role VARCHAR(255) PRIMARY KEY, quota BIGINT);
 CREATE TABLE IF NOT EXISTS SeafileConf (cfg_group VARCHAR(255) NOT NULL, cfg_key VARCHAR(255) NOT NULL, value VARCHAR(255), property INTEGER);
 CREATE TABLE IF NOT EXISTS FileLocks (repo_id CHAR(40) NOT NULL, path TEXT NOT NULL, user_name VARCHAR(255) NOT NULL, lock_time BIGINT, expire BIGINT);
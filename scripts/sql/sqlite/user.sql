@@ -14,3 +14,5 @@ CREATE UNIQUE INDEX IF NOT EXISTS ldapusers_reference_id_index on LDAPUsers(refe
 CREATE TABLE IF NOT EXISTS UserRole (email TEXT, role TEXT, is_manual_set INTEGER DEFAULT 0);
 CREATE INDEX IF NOT EXISTS userrole_email_index on UserRole (email);
 CREATE UNIQUE INDEX IF NOT EXISTS userrole_userrole_index on UserRole (email, role);
+
+CREATE TABLE IF NOT EXISTS RowCount (name VARCHAR(64) NOT NULL PRIMARY KEY, num BIGINT NOT NULL);
@@ -7,6 +7,7 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_struct.h>
+#include <event2/buffer.h>
 #else
 #include <event.h>
 #endif
@@ -16,6 +17,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "seafile-object.h"
 #include "seafile-crypt.h"
@@ -26,6 +28,10 @@
 #include "access-file.h"
 #include "zip-download-mgr.h"
 #include "http-server.h"
+#include "http-metrics.h"
+#include "transfer-limit.h"
+#include "block-cache.h"
+#include "http-io.h"
 
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 #define BUFFER_SIZE 1024 * 64
@@ -36,17 +42,62 @@ struct file_type_map {
     char *type;
 };
 
+/*
+ * With download_read_ahead set, the next blocks of a downloaded file are
+ * read, and decrypted, by a thread pool while the current one is being
+ * sent. So the stream doesn't stall at every block boundary when the block
+ * backend has a high latency. Blocks read ahead by all downloads take at
+ * most READ_AHEAD_MAX_BYTES; beyond that blocks are read when they are sent.
+ */
+#define READ_AHEAD_THREADS 8
+#define READ_AHEAD_MAX_BYTES ((gint64)256 << 20)
+
+typedef struct ReadAheadBlock {
+    int idx;
+    char *data;
+    int len;
+    /* 0 while being read, 1 when read, -1 if reading failed. */
+    int status;
+} ReadAheadBlock;
+
+typedef struct ReadAhead {
+    gint ref_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    Seafile *file;
+    SeafileCrypt *crypt;
+    char store_id[37];
+    int repo_version;
+
+    int depth;
+    /* ReadAheadBlock's in the order of the file. */
+    GQueue *blocks;
+    /* The next block to read ahead. */
+    int next_idx;
+    gboolean cancelled;
+} ReadAhead;
+
+typedef struct ReadAheadJob {
+    ReadAhead *ra;
+    ReadAheadBlock *blk;
+} ReadAheadJob;
+
 typedef struct SendBlockData {
     evhtp_request_t *req;
     char *block_id;
     BlockHandle *handle;
     uint32_t bsize;
     uint32_t remain;
+    /* The whole block was queued with evbuffer_add_file(). */
+    gboolean file_queued;
 
     char store_id[37];
     int repo_version;
 
     char *user;
+    TransferThrottle throttle;
+    HttpIOStream stream;
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -58,17 +109,24 @@ typedef struct SendfileData {
     evhtp_request_t *req;
     Seafile *file;
     SeafileCrypt *crypt;
-    gboolean enc_init;
-    EVP_CIPHER_CTX *ctx;
+    /* Set up once and reused for all blocks of the file. */
+    SeafileCipher *cipher;
+    /* NULL if read-ahead is disabled. */
+    ReadAhead *ra;
     BlockHandle *handle;
     size_t remain;
     int idx;
+    /* The whole block was queued with evbuffer_add_file(), or was read
+     * ahead and queued from memory. */
+    gboolean file_queued;
 
     char store_id[37];
     int repo_version;
 
     char *user;
     char *token_type;
+    TransferThrottle throttle;
+    HttpIOStream stream;
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -76,6 +134,11 @@ typedef struct SendfileData {
     void *saved_cb_arg;
 } SendfileData;
 
+typedef struct ByteRange {
+    guint64 start;
+    guint64 end;
+} ByteRange;
+
 typedef struct SendFileRangeData {
     evhtp_request_t *req;
     Seafile *file;
@@ -84,11 +147,27 @@ typedef struct SendFileRangeData {
     guint64 start_off;
     guint64 range_remain;
 
+    /* Set for encrypted repos. Blocks are decrypted whole, and the range
+     * starts at blk_off in the decrypted block blk_idx. */
+    SeafileCrypt *crypt;
+    char repo_id[37];
+    guint64 blk_off;
+
+    /* Set for a multipart/byteranges response. */
+    GArray *ranges;
+    guint range_idx;
+    char *boundary;
+    char *content_type;
+
     char store_id[37];
     int repo_version;
 
     char *user;
     char *token_type;
+    TransferThrottle throttle;
+    HttpIOStream stream;
+    /* The range ends at the end of file, reported as a download. */
+    gboolean to_file_end;
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -107,6 +186,7 @@ typedef struct SendDirData {
     char *user;
     char *token_type;
     char repo_id[37];
+    HttpIOStream stream;
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -114,10 +194,32 @@ typedef struct SendDirData {
     void *saved_cb_arg;
 } SendDirData;
 
+/* A zip read from the pipe it's packed into, see streaming_zip. */
+typedef struct SendZipStreamData {
+    evhtp_request_t *req;
+    int pipefd;
+    struct event *read_ev;
+    guint64 total_size;
+
+    char *token;
+    char *user;
+    char *token_type;
+    char repo_id[37];
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendZipStreamData;
+
 
 
 extern SeafileSession *seaf;
 
+static GThreadPool *read_ahead_pool;
+static pthread_mutex_t read_ahead_bytes_lock = PTHREAD_MUTEX_INITIALIZER;
+static gint64 read_ahead_bytes;
+
 static struct file_type_map ftmap[] = {
     { "txt", "text/plain" },
     { "doc", "application/vnd.ms-word" },
@@ -154,9 +256,275 @@ free_sendblock_data (SendBlockData *data)
 
     g_free (data->block_id);
     g_free (data->user);
+    transfer_throttle_clear (&data->throttle);
+    http_io_stream_clear (&data->stream);
     g_free (data);
 }
 
+static void
+read_ahead_add_bytes (gint64 bytes)
+{
+    pthread_mutex_lock (&read_ahead_bytes_lock);
+    read_ahead_bytes += bytes;
+    pthread_mutex_unlock (&read_ahead_bytes_lock);
+}
+
+static gboolean
+read_ahead_has_room ()
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&read_ahead_bytes_lock);
+    ret = (read_ahead_bytes < READ_AHEAD_MAX_BYTES);
+    pthread_mutex_unlock (&read_ahead_bytes_lock);
+
+    return ret;
+}
+
+static void
+read_ahead_block_free (ReadAheadBlock *blk)
+{
+    if (blk->data) {
+        read_ahead_add_bytes (-blk->len);
+        g_free (blk->data);
+    }
+    g_free (blk);
+}
+
+static ReadAhead *
+read_ahead_new (Seafile *file, SeafileCrypt *crypt,
+                const char *store_id, int repo_version, int depth)
+{
+    ReadAhead *ra = g_new0 (ReadAhead, 1);
+
+    ra->ref_count = 1;
+    pthread_mutex_init (&ra->lock, NULL);
+    pthread_cond_init (&ra->cond, NULL);
+    seafile_ref (file);
+    ra->file = file;
+    if (crypt)
+        ra->crypt = g_memdup (crypt, sizeof(SeafileCrypt));
+    memcpy (ra->store_id, store_id, 36);
+    ra->repo_version = repo_version;
+    ra->depth = depth;
+    ra->blocks = g_queue_new ();
+
+    return ra;
+}
+
+static void
+read_ahead_unref (ReadAhead *ra)
+{
+    ReadAheadBlock *blk;
+
+    if (!g_atomic_int_dec_and_test (&ra->ref_count))
+        return;
+
+    while ((blk = g_queue_pop_head (ra->blocks)) != NULL)
+        read_ahead_block_free (blk);
+    g_queue_free (ra->blocks);
+
+    seafile_unref (ra->file);
+    g_free (ra->crypt);
+    pthread_mutex_destroy (&ra->lock);
+    pthread_cond_destroy (&ra->cond);
+    g_free (ra);
+}
+
+/* Reads a whole block, and decrypts it if @crypt is set. */
+static int
+read_block_data (const char *store_id, int repo_version, const char *blk_id,
+                 SeafileCrypt *crypt, char **data, int *len)
+{
+    BlockHandle *handle;
+    BlockMetadata *bmd;
+    char *buf = NULL;
+    int size, n, off = 0;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            store_id, repo_version,
+                                            blk_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s\n", store_id, blk_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd)
+        goto out;
+    size = bmd->size;
+    g_free (bmd);
+
+    buf = g_malloc (size > 0 ? size : 1);
+    while (off < size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           buf + off, size - off);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s:%s.\n", store_id, blk_id);
+            goto out;
+        }
+        off += n;
+    }
+
+    if (crypt && size > 0) {
+        char *dec_out = NULL;
+        int dec_out_len = -1;
+
+        if (seafile_decrypt (&dec_out, &dec_out_len, buf, size, crypt) < 0) {
+            seaf_warning ("Decrypt block %s:%s failed.\n", store_id, blk_id);
+            goto out;
+        }
+        g_free (buf);
+        buf = dec_out;
+        size = dec_out_len;
+    }
+
+    *data = buf;
+    *len = size;
+    buf = NULL;
+    ret = 0;
+
+out:
+    g_free (buf);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+static void
+read_ahead_fetch (gpointer job_data, gpointer user_data)
+{
+    ReadAheadJob *job = job_data;
+    ReadAhead *ra = job->ra;
+    ReadAheadBlock *blk = job->blk;
+    char *data = NULL;
+    int len = 0;
+    int status = -1;
+    gboolean cancelled;
+
+    pthread_mutex_lock (&ra->lock);
+    cancelled = ra->cancelled;
+    pthread_mutex_unlock (&ra->lock);
+
+    if (!cancelled &&
+        read_block_data (ra->store_id, ra->repo_version,
+                         ra->file->blk_sha1s[blk->idx], ra->crypt,
+                         &data, &len) == 0) {
+        read_ahead_add_bytes (len);
+        status = 1;
+    }
+
+    pthread_mutex_lock (&ra->lock);
+    blk->data = data;
+    blk->len = len;
+    blk->status = status;
+    pthread_cond_broadcast (&ra->cond);
+    pthread_mutex_unlock (&ra->lock);
+
+    read_ahead_unref (ra);
+    g_free (job);
+}
+
+/* Start reading the blocks after @from_idx that aren't read yet,
+ * up to the read-ahead depth. */
+static void
+read_ahead_schedule (ReadAhead *ra, int from_idx)
+{
+    ReadAheadBlock *blk;
+    ReadAheadJob *job;
+
+    pthread_mutex_lock (&ra->lock);
+
+    if (ra->next_idx < from_idx)
+        ra->next_idx = from_idx;
+
+    while ((int)g_queue_get_length (ra->blocks) < ra->depth &&
+           ra->next_idx < ra->file->n_blocks &&
+           read_ahead_has_room ()) {
+        blk = g_new0 (ReadAheadBlock, 1);
+        blk->idx = ra->next_idx++;
+        g_queue_push_tail (ra->blocks, blk);
+
+        job = g_new0 (ReadAheadJob, 1);
+        g_atomic_int_inc (&ra->ref_count);
+        job->ra = ra;
+        job->blk = blk;
+        g_thread_pool_push (read_ahead_pool, job, NULL);
+    }
+
+    pthread_mutex_unlock (&ra->lock);
+}
+
+/* Returns block @idx once it's read, or NULL if it isn't read ahead. */
+static ReadAheadBlock *
+read_ahead_take (ReadAhead *ra, int idx)
+{
+    ReadAheadBlock *blk;
+
+    pthread_mutex_lock (&ra->lock);
+
+    blk = g_queue_peek_head (ra->blocks);
+    if (!blk || blk->idx != idx) {
+        pthread_mutex_unlock (&ra->lock);
+        return NULL;
+    }
+
+    while (blk->status == 0)
+        pthread_cond_wait (&ra->cond, &ra->lock);
+    g_queue_pop_head (ra->blocks);
+
+    pthread_mutex_unlock (&ra->lock);
+
+    return blk;
+}
+
+static void
+read_ahead_cancel (ReadAhead *ra)
+{
+    pthread_mutex_lock (&ra->lock);
+    ra->cancelled = TRUE;
+    pthread_mutex_unlock (&ra->lock);
+
+    read_ahead_unref (ra);
+}
+
+static void
+read_ahead_block_sent (const void *data, size_t datalen, void *extra)
+{
+    read_ahead_block_free ((ReadAheadBlock *)extra);
+}
+
+/*
+ * Queue block @data->idx on the output buffer if it was read ahead.
+ * Returns -1 if the caller has to read and send the block itself.
+ */
+static int
+queue_read_ahead_block (struct evbuffer *out, SendfileData *data)
+{
+    ReadAheadBlock *blk;
+
+    blk = read_ahead_take (data->ra, data->idx);
+    read_ahead_schedule (data->ra, data->idx + 1);
+    if (!blk)
+        return -1;
+
+    if (blk->status < 0 || blk->len == 0) {
+        read_ahead_block_free (blk);
+        return -1;
+    }
+
+    transfer_throttle_charge (&data->throttle, data->user, data->store_id,
+                              blk->len, 1);
+    if (evbuffer_add_reference (out, blk->data, blk->len,
+                                read_ahead_block_sent, blk) < 0) {
+        read_ahead_block_free (blk);
+        return -1;
+    }
+
+    return 0;
+}
+
 static void
 free_sendfile_data (SendfileData *data)
 {
@@ -165,13 +533,16 @@ free_sendfile_data (SendfileData *data)
         seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
     }
 
-    if (data->enc_init)
-        EVP_CIPHER_CTX_free (data->ctx);
+    seafile_cipher_free (data->cipher);
+    if (data->ra)
+        read_ahead_cancel (data->ra);
 
     seafile_unref (data->file);
     g_free (data->user);
     g_free (data->token_type);
     g_free (data->crypt);
+    transfer_throttle_clear (&data->throttle);
+    http_io_stream_clear (&data->stream);
     g_free (data);
 }
 
@@ -184,8 +555,15 @@ free_send_file_range_data (SendFileRangeData *data)
     }
 
     seafile_unref (data->file);
+    if (data->ranges)
+        g_array_free (data->ranges, TRUE);
+    g_free (data->boundary);
+    g_free (data->content_type);
+    g_free (data->crypt);
     g_free (data->user);
     g_free (data->token_type);
+    transfer_throttle_clear (&data->throttle);
+    http_io_stream_clear (&data->stream);
     g_free (data);
 }
 
@@ -199,13 +577,47 @@ free_senddir_data (SendDirData *data)
     g_free (data->user);
     g_free (data->token_type);
     g_free (data->token);
+    http_io_stream_clear (&data->stream);
     g_free (data);
 }
 
-static void
-write_block_data_cb (struct bufferevent *bev, void *ctx)
+/*
+ * Queue the whole block on @out with evbuffer_add_file(), which lets
+ * libevent send it with sendfile() instead of copying it through user
+ * space. Only possible for unencrypted blocks stored as local files.
+ * Returns -1 if the caller has to read and send the block itself.
+ */
+static int
+queue_block_file (struct evbuffer *out, BlockHandle *handle, guint64 size)
 {
-    SendBlockData *data = ctx;
+    int fd;
+
+    if (size == 0)
+        return -1;
+
+    fd = seaf_block_manager_dup_block_fd (seaf->block_mgr, handle);
+    if (fd < 0)
+        return -1;
+
+    /* The fd is closed by libevent after the data is sent. */
+    if (evbuffer_add_file (out, fd, 0, size) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The send paths below read the storage in a fill function run on an I/O
+ * thread, see http-io.h. The write callbacks only start the next fill, and
+ * the filled functions hand the chunks to the connection.
+ */
+
+static int
+fill_block_data (void *vdata, struct evbuffer *out)
+{
+    SendBlockData *data = vdata;
     char *blk_id;
     BlockHandle *handle;
     char buf[1024 * 64];
@@ -220,240 +632,332 @@ write_block_data_cb (struct bufferevent *bev, void *ctx)
                                                      blk_id, BLOCK_READ);
         if (!data->handle) {
             seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
+            return -1;
         }
 
         data->remain = data->bsize;
+
+        if (queue_block_file (out, data->handle, data->remain) == 0) {
+            transfer_throttle_charge (&data->throttle, data->user, data->store_id,
+                                      data->remain, 1);
+            data->remain = 0;
+            data->file_queued = TRUE;
+            return 0;
+        }
+        transfer_throttle_charge (&data->throttle, data->user, data->store_id, 0, 1);
     }
     handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    if (data->file_queued) {
+        /* The queued block has been sent out. */
+        data->file_queued = FALSE;
+        n = 0;
+    } else {
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    }
     data->remain -= n;
     if (n < 0) {
         seaf_warning ("Error when reading from block %s:%s.\n",
                       data->store_id, blk_id);
-        goto err;
+        return -1;
     } else if (n == 0) {
         /* We've read up the data of this block, finish. */
         seaf_block_manager_close_block (seaf->block_mgr, handle);
         seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
         data->handle = NULL;
+        return 1;
+    }
 
-        /* Recover evhtp's callbacks */
-        bev->readcb = data->saved_read_cb;
-        bev->writecb = data->saved_write_cb;
-        bev->errorcb = data->saved_event_cb;
-        bev->cbarg = data->saved_cb_arg;
-
-        /* Resume reading incomming requests. */
-        evhtp_request_resume (data->req);
+    /* OK, we've got some data to send. */
+    transfer_throttle_charge (&data->throttle, data->user, data->store_id, n, 0);
+    evbuffer_add (out, buf, n);
 
-        evhtp_send_reply_end (data->req);
+    return 0;
+}
 
-        send_statistic_msg (data->store_id, data->user, "web-file-download", (guint64)data->bsize);
+static void
+block_data_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendBlockData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
 
+    if (status < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
         free_sendblock_data (data);
         return;
     }
 
-    /* OK, we've got some data to send. */
-    bufferevent_write (bev, buf, n);
+    if (status == 0) {
+        /* This may call write_block_data_cb() recursively. */
+        bufferevent_write_buffer (bev, out);
+        return;
+    }
 
-    return;
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    send_statistic_msg (data->store_id, data->user, "web-file-download", (guint64)data->bsize);
 
-err:
-    evhtp_connection_free (evhtp_request_get_connection (data->req));
     free_sendblock_data (data);
-    return;
 }
 
 static void
-write_data_cb (struct bufferevent *bev, void *ctx)
+write_block_data_cb (struct bufferevent *bev, void *ctx)
 {
-    SendfileData *data = ctx;
+    SendBlockData *data = ctx;
+
+    if (data->stream.pending)
+        return;
+
+    if (transfer_throttle_wait (&data->throttle, bev, write_block_data_cb, data))
+        return;
+
+    http_io_stream_next (&data->stream);
+}
+
+static int
+fill_file_data (void *vdata, struct evbuffer *out)
+{
+    SendfileData *data = vdata;
     char *blk_id;
     BlockHandle *handle;
     char buf[1024 * 64];
+    /* Decrypted data is at most one cipher block longer than the input. */
+    char dec_out[sizeof(buf) + BLK_SIZE];
     int n;
 
 next:
     blk_id = data->file->blk_sha1s[data->idx];
 
-    if (!data->handle) {
+    if (data->ra && !data->handle && !data->file_queued &&
+        queue_read_ahead_block (out, data) == 0) {
+        /* Wait until the block is sent before taking the next one. */
+        data->file_queued = TRUE;
+        return 0;
+    }
+
+    if (!data->handle && !data->file_queued) {
         data->handle = seaf_block_manager_open_block(seaf->block_mgr,
                                                      data->store_id,
                                                      data->repo_version,
                                                      blk_id, BLOCK_READ);
         if (!data->handle) {
             seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
+            return -1;
         }
 
         BlockMetadata *bmd;
         bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
                                                        data->handle);
         if (!bmd)
-            goto err;
+            return -1;
         data->remain = bmd->size;
         g_free (bmd);
 
         if (data->crypt) {
-            if (seafile_decrypt_init (&data->ctx,
-                                      data->crypt->version,
-                                      (unsigned char *)data->crypt->key,
-                                      (unsigned char *)data->crypt->iv) < 0) {
+            if (!data->cipher)
+                data->cipher = seafile_cipher_new (data->crypt, FALSE);
+            if (!data->cipher || seafile_cipher_reset (data->cipher) < 0) {
                 seaf_warning ("Failed to init decrypt.\n");
-                goto err;
+                return -1;
             }
-            data->enc_init = TRUE;
+        } else if (queue_block_file (out, data->handle, data->remain) == 0) {
+            transfer_throttle_charge (&data->throttle, data->user, data->store_id,
+                                      data->remain, 1);
+            /* Wait until the block is sent before opening the next one. */
+            data->remain = 0;
+            data->file_queued = TRUE;
+            return 0;
         }
+        transfer_throttle_charge (&data->throttle, data->user, data->store_id, 0, 1);
     }
     handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    if (data->file_queued) {
+        /* The queued block has been sent out. */
+        data->file_queued = FALSE;
+        n = 0;
+    } else {
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    }
     data->remain -= n;
     if (n < 0) {
         seaf_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
+        return -1;
     } else if (n == 0) {
         /* We've read up the data of this block, finish or try next block. */
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        data->handle = NULL;
-        if (data->crypt != NULL) {
-            EVP_CIPHER_CTX_free (data->ctx);
-            data->enc_init = FALSE;
+        if (handle) {
+            seaf_block_manager_close_block (seaf->block_mgr, handle);
+            seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+            data->handle = NULL;
         }
 
-        if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
-
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
-
-            evhtp_send_reply_end (data->req);
-
-            if (g_strcmp0(data->token_type, "view") != 0) {
-                char *oper = "web-file-download";
-                if (g_strcmp0(data->token_type, "download-link") == 0)
-                    oper = "link-file-download";
-
-                send_statistic_msg(data->store_id, data->user, oper,
-                                   (guint64)data->file->file_size);
-            }
-
-            free_sendfile_data (data);
-            return;
-        }
+        if (data->idx == data->file->n_blocks - 1)
+            return 1;
 
         ++(data->idx);
         goto next;
     }
 
     /* OK, we've got some data to send. */
+    transfer_throttle_charge (&data->throttle, data->user, data->store_id, n, 0);
     if (data->crypt != NULL) {
-        char *dec_out;
-        int dec_out_len = -1;
-        struct evbuffer *tmp_buf;
+        int dec_out_len = -1, final_len = 0;
 
-        dec_out = g_new (char, n + 16);
-        if (!dec_out) {
-            seaf_warning ("Failed to alloc memory.\n");
-            goto err;
+        if (seafile_cipher_update (data->cipher, dec_out, &dec_out_len,
+                                   buf, n) < 0) {
+            seaf_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
+            return -1;
         }
 
-        int ret = EVP_DecryptUpdate (data->ctx,
-                                     (unsigned char *)dec_out,
-                                     &dec_out_len,
-                                     (unsigned char *)buf,
-                                     n);
-        if (ret == 0) {
+        /* If it's the last piece of a block, call decrypt_final()
+         * to decrypt the possible partial block. */
+        if (data->remain == 0 &&
+            seafile_cipher_final (data->cipher, dec_out + dec_out_len,
+                                  &final_len) < 0) {
             seaf_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-            g_free (dec_out);
-            goto err;
+            return -1;
         }
+        evbuffer_add (out, dec_out, dec_out_len + final_len);
+    } else {
+        evbuffer_add (out, buf, n);
+    }
 
-        tmp_buf = evbuffer_new ();
+    return 0;
+}
 
-        evbuffer_add (tmp_buf, dec_out, dec_out_len);
+static void
+file_data_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendfileData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
 
-        /* If it's the last piece of a block, call decrypt_final()
-         * to decrypt the possible partial block. */
-        if (data->remain == 0) {
-            ret = EVP_DecryptFinal_ex (data->ctx,
-                                       (unsigned char *)dec_out,
-                                       &dec_out_len);
-            if (ret == 0) {
-                seaf_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-                evbuffer_free (tmp_buf);
-                g_free (dec_out);
-                goto err;
-            }
-            evbuffer_add (tmp_buf, dec_out, dec_out_len);
-        }
+    if (status < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_sendfile_data (data);
+        return;
+    }
+
+    if (status == 0) {
         /* This may call write_data_cb() recursively (by libevent_openssl).
          * SendfileData struct may be free'd in the recursive calls.
          * So don't use "data" variable after here.
          */
-        bufferevent_write_buffer (bev, tmp_buf);
-
-        evbuffer_free (tmp_buf);
-        g_free (dec_out);
-    } else {
-        bufferevent_write (bev, buf, n);
+        bufferevent_write_buffer (bev, out);
+        return;
     }
 
-    return;
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    if (g_strcmp0(data->token_type, "view") != 0) {
+        char *oper = "web-file-download";
+        if (g_strcmp0(data->token_type, "download-link") == 0)
+            oper = "link-file-download";
+
+        send_statistic_msg(data->store_id, data->user, oper,
+                           (guint64)data->file->file_size);
+    }
 
-err:
-    evhtp_connection_free (evhtp_request_get_connection (data->req));
     free_sendfile_data (data);
-    return;
 }
 
 static void
-write_dir_data_cb (struct bufferevent *bev, void *ctx)
+write_data_cb (struct bufferevent *bev, void *ctx)
 {
-    SendDirData *data = ctx;
+    SendfileData *data = ctx;
+
+    if (data->stream.pending)
+        return;
+
+    if (transfer_throttle_wait (&data->throttle, bev, write_data_cb, data))
+        return;
+
+    http_io_stream_next (&data->stream);
+}
+
+static int
+fill_dir_data (void *vdata, struct evbuffer *out)
+{
+    SendDirData *data = vdata;
     char buf[64 * 1024];
     int n;
 
-    n = readn (data->zipfd, buf, sizeof(buf));
-    if (n < 0) {
-        seaf_warning ("Failed to read zipfile %s: %s.\n", data->zipfile, strerror (errno));
+    if (data->remain == 0)
+        return 1;
+
+    n = readn (data->zipfd, buf, MIN (sizeof(buf), data->remain));
+    if (n <= 0) {
+        seaf_warning ("Failed to read zipfile %s: %s.\n", data->zipfile,
+                      n < 0 ? strerror (errno) : "unexpected end of file");
+        return -1;
+    }
+    evbuffer_add (out, buf, n);
+    data->remain -= n;
+
+    return 0;
+}
+
+static void
+dir_data_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendDirData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (status < 0) {
         evhtp_connection_free (evhtp_request_get_connection (data->req));
         free_senddir_data (data);
-    } else if (n > 0) {
-        bufferevent_write (bev, buf, n);
-        data->remain -= n;
+        return;
+    }
 
-        if (data->remain == 0) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+    if (status == 0) {
+        bufferevent_write_buffer (bev, out);
+        return;
+    }
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
 
-            evhtp_send_reply_end (data->req);
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
 
-            char *oper = "web-file-download";
-            if (g_strcmp0(data->token_type, "download-dir-link") == 0 ||
-                g_strcmp0(data->token_type, "download-multi-link") == 0)
-                oper = "link-file-download";
+    evhtp_send_reply_end (data->req);
 
-            send_statistic_msg(data->repo_id, data->user, oper, data->total_size);
+    char *oper = "web-file-download";
+    if (g_strcmp0(data->token_type, "download-dir-link") == 0 ||
+        g_strcmp0(data->token_type, "download-multi-link") == 0)
+        oper = "link-file-download";
 
-            free_senddir_data (data);
-            return;
-        }
-    }
+    send_statistic_msg(data->repo_id, data->user, oper, data->total_size);
+
+    free_senddir_data (data);
+}
+
+static void
+write_dir_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendDirData *data = ctx;
+
+    http_io_stream_next (&data->stream);
 }
 
 static void
@@ -463,8 +967,9 @@ my_block_event_cb (struct bufferevent *bev, short events, void *ctx)
 
     data->saved_event_cb (bev, events, data->saved_cb_arg);
 
-    /* Free aux data. */
-    free_sendblock_data (data);
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_sendblock_data (data);
 }
 
 static void
@@ -474,8 +979,9 @@ my_event_cb (struct bufferevent *bev, short events, void *ctx)
 
     data->saved_event_cb (bev, events, data->saved_cb_arg);
 
-    /* Free aux data. */
-    free_sendfile_data (data);
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_sendfile_data (data);
 }
 
 static void
@@ -485,8 +991,9 @@ file_range_event_cb (struct bufferevent *bev, short events, void *ctx)
 
     data->saved_event_cb (bev, events, data->saved_cb_arg);
 
-    /* Free aux data. */
-    free_send_file_range_data (data);
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_send_file_range_data (data);
 }
 
 static void
@@ -496,8 +1003,9 @@ my_dir_event_cb (struct bufferevent *bev, short events, void *ctx)
 
     data->saved_event_cb (bev, events, data->saved_cb_arg);
 
-    /* Free aux data. */
-    free_senddir_data (data);
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_senddir_data (data);
 }
 
 static char *
@@ -647,6 +1155,12 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
+    if (read_ahead_pool) {
+        data->ra = read_ahead_new (file, crypt, repo->store_id, repo->version,
+                                   seaf->http_server->download_read_ahead);
+        read_ahead_schedule (data->ra, 0);
+    }
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -655,6 +1169,8 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
     data->saved_cb_arg = bev->cbarg;
+    http_io_stream_init (&data->stream, req, fill_file_data, file_data_filled,
+                         (GDestroyNotify)free_sendfile_data, data);
     bufferevent_setcb (bev,
                        NULL,
                        write_data_cb,
@@ -677,31 +1193,19 @@ get_start_block_handle (const char *store_id, int version, Seafile *file,
                         guint64 start, int *blk_idx)
 {
     BlockHandle *handle = NULL;
-    BlockMetadata *bmd;
     char *blkid;
     guint64 tolsize = 0;
     int i = 0;
 
-    for (; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id,
-                                            version, blkid);
-        if (!bmd)
-            return NULL;
-
-        if (start < tolsize + bmd->size) {
-            g_free (bmd);
-            break;
-        }
-        tolsize += bmd->size;
-        g_free (bmd);
-    }
+    if (seaf_fs_manager_find_block (seaf->fs_mgr, store_id, version, file,
+                                    start, &i, &tolsize) < 0)
+        return NULL;
 
     /* beyond the file size */
     if (i == file->n_blocks)
         return NULL;
 
+    blkid = file->blk_sha1s[i];
     handle = seaf_block_manager_open_block(seaf->block_mgr,
                                            store_id, version,
                                            blkid, BLOCK_READ);
@@ -726,17 +1230,145 @@ get_start_block_handle (const char *store_id, int version, Seafile *file,
         free (tmp);
     }
 
-    *blk_idx = i;
-    return handle;
+    *blk_idx = i;
+    return handle;
+
+err:
+    seaf_block_manager_close_block(seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return NULL;
+}
+
+/* Returns a reference to block @blk_idx of the file, decrypted. */
+static GBytes *
+get_decrypted_block (SendFileRangeData *data, int blk_idx)
+{
+    const char *blk_id = data->file->blk_sha1s[blk_idx];
+    GBytes *blk;
+    char *buf = NULL;
+    int len = 0;
+
+    blk = block_cache_lookup (data->repo_id, blk_id);
+    if (blk)
+        return blk;
+
+    if (read_block_data (data->store_id, data->repo_version, blk_id,
+                         data->crypt, &buf, &len) < 0)
+        return NULL;
+
+    blk = block_cache_new_bytes (buf, len);
+    memset (buf, 0, len);
+    g_free (buf);
+
+    block_cache_set_plain_size (blk_id, len);
+    block_cache_insert (data->repo_id, blk_id, blk);
+
+    return blk;
+}
+
+/* Returns the size of block @blk_idx of the file once decrypted. */
+static int
+get_plain_block_size (SendFileRangeData *data, int blk_idx)
+{
+    const char *blk_id = data->file->blk_sha1s[blk_idx];
+    GBytes *blk;
+    char *buf = NULL;
+    int len = 0, size;
+
+    size = block_cache_get_plain_size (blk_id);
+    if (size >= 0)
+        return size;
+
+    blk = block_cache_lookup (data->repo_id, blk_id);
+    if (blk) {
+        size = g_bytes_get_size (blk);
+        g_bytes_unref (blk);
+        return size;
+    }
+
+    /* Only the last cipher block has to be decrypted to get the size. */
+    if (read_block_data (data->store_id, data->repo_version, blk_id,
+                         NULL, &buf, &len) < 0)
+        return -1;
+    size = seafile_decrypted_len (data->crypt, buf, len);
+    g_free (buf);
+    if (size < 0) {
+        seaf_warning ("Failed to get decrypted size of block %s:%s.\n",
+                      data->store_id, blk_id);
+        return -1;
+    }
+
+    block_cache_set_plain_size (blk_id, size);
+    return size;
+}
+
+/* Finds the decrypted block holding @offset of the file. */
+static int
+find_plain_block (SendFileRangeData *data, guint64 offset)
+{
+    guint64 pos = 0;
+    int i, size;
+
+    for (i = 0; i < data->file->n_blocks; ++i) {
+        size = get_plain_block_size (data, i);
+        if (size < 0)
+            return -1;
+        if (offset < pos + size) {
+            data->blk_idx = i;
+            data->blk_off = offset - pos;
+            return 0;
+        }
+        pos += size;
+    }
+
+    return -1;
+}
+
+static void
+unref_block_data (const void *data, size_t len, void *blk)
+{
+    g_bytes_unref (blk);
+}
+
+/* Queues the part of the range in the current decrypted block, without
+ * copying it. Returns the number of bytes queued, -1 on errors.
+ */
+static int
+send_decrypted_range (struct evbuffer *out, SendFileRangeData *data)
+{
+    GBytes *blk;
+    const char *plain;
+    gsize len;
+    guint64 n;
+
+    if (data->blk_idx >= data->file->n_blocks)
+        return -1;
+
+    blk = get_decrypted_block (data, data->blk_idx);
+    if (!blk)
+        return -1;
+
+    plain = g_bytes_get_data (blk, &len);
+    if (data->blk_off >= len) {
+        g_bytes_unref (blk);
+        return -1;
+    }
+    n = MIN (len - data->blk_off, data->range_remain);
+
+    transfer_throttle_charge (&data->throttle, data->user, data->store_id, n, 1);
+    evbuffer_add_reference (out, plain + data->blk_off, n,
+                            unref_block_data, blk);
 
-err:
-    seaf_block_manager_close_block(seaf->block_mgr, handle);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-    return NULL;
+    data->range_remain -= n;
+    data->blk_off = 0;
+    data->blk_idx++;
+
+    return (int)n;
 }
 
 static void
-finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data)
+finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data,
+                           struct evbuffer *out)
 {
     /* Recover evhtp's callbacks */
     bev->readcb = data->saved_read_cb;
@@ -744,6 +1376,8 @@ finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data)
     bev->errorcb = data->saved_event_cb;
     bev->cbarg = data->saved_cb_arg;
 
+    bufferevent_write_buffer (bev, out);
+
     /* Resume reading incomming requests. */
     evhtp_request_resume (data->req);
 
@@ -752,22 +1386,53 @@ finish_file_range_request (struct bufferevent *bev, SendFileRangeData *data)
     free_send_file_range_data (data);
 }
 
-static void
-write_file_range_cb (struct bufferevent *bev, void *ctx)
+static char *
+byte_range_part_header (SendFileRangeData *data, guint idx)
 {
-    SendFileRangeData *data = ctx;
+    ByteRange *range = &g_array_index (data->ranges, ByteRange, idx);
+
+    return g_strdup_printf ("\r\n--%s\r\nContent-Type: %s\r\n"
+                            "Content-Range: bytes %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                            "/%"G_GUINT64_FORMAT"\r\n\r\n",
+                            data->boundary, data->content_type,
+                            range->start, range->end,
+                            (guint64)data->file->file_size);
+}
+
+static int
+fill_file_range (void *vdata, struct evbuffer *out)
+{
+    SendFileRangeData *data = vdata;
     char *blk_id;
     char buf[BUFFER_SIZE];
     int bsize;
     int n;
 
     if (data->blk_idx == -1) {
-        // start to send block
-        data->handle = get_start_block_handle (data->store_id, data->repo_version,
-                                               data->file, data->start_off,
-                                               &data->blk_idx);
-        if (!data->handle)
-            goto err;
+        if (data->ranges) {
+            char *part_header = byte_range_part_header (data, data->range_idx);
+            evbuffer_add (out, part_header, strlen(part_header));
+            g_free (part_header);
+        }
+
+        if (data->crypt) {
+            if (find_plain_block (data, data->start_off) < 0)
+                return -1;
+        } else {
+            // start to send block
+            data->handle = get_start_block_handle (data->store_id, data->repo_version,
+                                                   data->file, data->start_off,
+                                                   &data->blk_idx);
+            if (!data->handle)
+                return -1;
+        }
+    }
+
+    if (data->crypt) {
+        n = send_decrypted_range (out, data);
+        if (n < 0)
+            return -1;
+        goto sent;
     }
 
 next:
@@ -780,8 +1445,9 @@ next:
                                                      blk_id, BLOCK_READ);
         if (!data->handle) {
             seaf_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
+            return -1;
         }
+        transfer_throttle_charge (&data->throttle, data->user, data->store_id, 0, 1);
     }
 
     bsize = data->range_remain < BUFFER_SIZE ? data->range_remain : BUFFER_SIZE;
@@ -790,7 +1456,7 @@ next:
     if (n < 0) {
         seaf_warning ("Error when reading from block %s:%s.\n",
                       data->store_id, blk_id);
-        goto err;
+        return -1;
     } else if (n == 0) {
         seaf_block_manager_close_block (seaf->block_mgr, data->handle);
         seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
@@ -799,9 +1465,52 @@ next:
         goto next;
     }
 
-    bufferevent_write (bev, buf, n);
+    transfer_throttle_charge (&data->throttle, data->user, data->store_id, n, 0);
+    evbuffer_add (out, buf, n);
+
+sent:
+    if (data->range_remain == 0 && data->ranges) {
+        if (++data->range_idx < data->ranges->len) {
+            /* The next part is started once this one is written out. */
+            ByteRange *range = &g_array_index (data->ranges, ByteRange,
+                                               data->range_idx);
+            if (data->handle) {
+                seaf_block_manager_close_block (seaf->block_mgr, data->handle);
+                seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+                data->handle = NULL;
+            }
+            data->blk_idx = -1;
+            data->start_off = range->start;
+            data->range_remain = range->end - range->start + 1;
+            return 0;
+        }
+
+        char *closing = g_strdup_printf ("\r\n--%s--\r\n", data->boundary);
+        evbuffer_add (out, closing, strlen(closing));
+        g_free (closing);
+    }
+
     if (data->range_remain == 0) {
-        if (data->start_off + n >= data->file->file_size) {
+        data->to_file_end = (data->start_off + n >= data->file->file_size);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+file_range_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendFileRangeData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (status < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_send_file_range_data (data);
+    } else if (status == 0) {
+        bufferevent_write_buffer (bev, out);
+    } else {
+        if (data->to_file_end) {
             char *oper = "web-file-download";
             if (g_strcmp0(data->token_type, "download-link") == 0)
                 oper = "link-file-download";
@@ -809,48 +1518,54 @@ next:
             send_statistic_msg (data->store_id, data->user, oper,
                                 (guint64)data->file->file_size);
         }
-        finish_file_range_request (bev, data);
+        finish_file_range_request (bev, data, out);
     }
+}
 
-    return;
+static void
+write_file_range_cb (struct bufferevent *bev, void *ctx)
+{
+    SendFileRangeData *data = ctx;
 
-err:
-    evhtp_connection_free (evhtp_request_get_connection (data->req));
-    free_send_file_range_data (data);
+    if (data->stream.pending)
+        return;
+
+    if (transfer_throttle_wait (&data->throttle, bev, write_file_range_cb, data))
+        return;
+
+    http_io_stream_next (&data->stream);
 }
 
-// parse range offset, only support single range (-num, num-num, num-)
+// parse a single range of a Range header (-num, num-num, num-)
 static gboolean
-parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
-                 guint64 fsize)
+parse_range_spec (const char *spec, guint64 *pstart, guint64 *pend,
+                  guint64 fsize)
 {
-    char *minus;
+    const char *minus;
     char *end_ptr;
     gboolean error = FALSE;
-    char *ranges_dup = g_strdup (strchr(byte_ranges, '=') + 1);
-    char *tmp = ranges_dup;
     guint64 start;
     guint64 end;
 
-    minus = strchr(tmp, '-');
+    minus = strchr(spec, '-');
     if (!minus)
         return FALSE;
 
-    if (minus == tmp) {
+    if (minus == spec) {
         // -num mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (start == 0) {
+        start = strtoll(minus + 1, &end_ptr, 10);
+        if (start == 0 || end_ptr == minus + 1) {
             // range format is invalid
             error = TRUE;
         } else if (*end_ptr == '\0') {
             end = fsize - 1;
-            start += fsize;
+            start = start < fsize ? fsize - start : 0;
         } else {
             error = TRUE;
         }
     } else if (*(minus + 1) == '\0') {
         // num- mode
-        start = strtoll(tmp, &end_ptr, 10);
+        start = strtoll(spec, &end_ptr, 10);
         if (end_ptr == minus) {
             end = fsize - 1;
         } else {
@@ -858,7 +1573,7 @@ parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
         }
     } else {
         // num-num mode
-        start = strtoll(tmp, &end_ptr, 10);
+        start = strtoll(spec, &end_ptr, 10);
         if (end_ptr == minus) {
             end = strtoll(minus + 1, &end_ptr, 10);
             if (*end_ptr != '\0') {
@@ -869,8 +1584,6 @@ parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
         }
     }
 
-    g_free (ranges_dup);
-
     if (error)
         return FALSE;
 
@@ -888,6 +1601,79 @@ parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
     return TRUE;
 }
 
+static gint
+compare_byte_ranges (gconstpointer a, gconstpointer b)
+{
+    const ByteRange *ra = a, *rb = b;
+
+    if (ra->start < rb->start)
+        return -1;
+    return ra->start > rb->start;
+}
+
+/*
+ * Parse the ranges of a Range header, returns NULL if any is invalid.
+ * Several ranges are sorted, and overlapping or adjacent ones merged. If
+ * there are still more than MAX_BYTE_RANGES, the whole span from the first
+ * to the last one is returned.
+ */
+#define MAX_BYTE_RANGES 64
+
+static GArray *
+parse_range_val (const char *byte_ranges, guint64 fsize)
+{
+    const char *eq = strchr (byte_ranges, '=');
+    GArray *ranges;
+    ByteRange range, *last;
+    char **specs;
+    guint i, n;
+
+    if (!eq)
+        return NULL;
+
+    ranges = g_array_new (FALSE, FALSE, sizeof(ByteRange));
+    specs = g_strsplit (eq + 1, ",", 0);
+    for (i = 0; specs[i] != NULL; i++) {
+        if (!parse_range_spec (g_strstrip (specs[i]), &range.start, &range.end,
+                               fsize)) {
+            g_strfreev (specs);
+            g_array_free (ranges, TRUE);
+            return NULL;
+        }
+        g_array_append_val (ranges, range);
+    }
+    g_strfreev (specs);
+
+    if (ranges->len == 0) {
+        g_array_free (ranges, TRUE);
+        return NULL;
+    }
+    if (ranges->len == 1)
+        return ranges;
+
+    g_array_sort (ranges, compare_byte_ranges);
+    n = 1;
+    for (i = 1; i < ranges->len; i++) {
+        ByteRange *cur = &g_array_index (ranges, ByteRange, i);
+        last = &g_array_index (ranges, ByteRange, n - 1);
+        if (cur->start <= last->end + 1) {
+            if (cur->end > last->end)
+                last->end = cur->end;
+        } else {
+            g_array_index (ranges, ByteRange, n++) = *cur;
+        }
+    }
+    g_array_set_size (ranges, n);
+
+    if (ranges->len > MAX_BYTE_RANGES) {
+        g_array_index (ranges, ByteRange, 0).end =
+            g_array_index (ranges, ByteRange, ranges->len - 1).end;
+        g_array_set_size (ranges, 1);
+    }
+
+    return ranges;
+}
+
 static void
 set_resp_disposition (evhtp_request_t *req, const char *operation,
                       const char *filename)
@@ -920,10 +1706,12 @@ set_resp_disposition (evhtp_request_t *req, const char *operation,
 static int
 do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                const char *filename, const char *operation, const char *byte_ranges,
-               const char *user)
+               SeafileCryptKey *crypt_key, const char *user)
 {
     Seafile *file;
     SendFileRangeData *data = NULL;
+    GArray *ranges;
+    ByteRange *range;
     guint64 start;
     guint64 end;
     char *policy = "sandbox";
@@ -940,16 +1728,48 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         return 0;
     }
 
-    if (!parse_range_val (byte_ranges, &start, &end, file->file_size)) {
-        seafile_unref (file);
+    ranges = parse_range_val (byte_ranges, file->file_size);
+    if (!ranges) {
         char *con_range = g_strdup_printf ("bytes */%"G_GUINT64_FORMAT, file->file_size);
         evhtp_headers_add_header (req->headers_out,
                                   evhtp_header_new("Content-Range", con_range,
                                                    0, 1));
         g_free (con_range);
+        seafile_unref (file);
         evhtp_send_reply (req, EVHTP_RES_RANGENOTSC);
         return 0;
     }
+    range = &g_array_index (ranges, ByteRange, 0);
+    start = range->start;
+    end = range->end;
+
+    data = g_new0 (SendFileRangeData, 1);
+    data->req = req;
+    data->file = file;
+    data->blk_idx = -1;
+    data->start_off = start;
+    data->range_remain = end-start+1;
+    data->user = g_strdup(user);
+    data->token_type = g_strdup (operation);
+    memcpy (data->repo_id, repo->id, 36);
+
+    if (crypt_key != NULL) {
+        char *key_hex, *iv_hex;
+        unsigned char enc_key[32], enc_iv[16];
+
+        g_object_get (crypt_key,
+                      "key", &key_hex,
+                      "iv", &iv_hex,
+                      NULL);
+        if (repo->enc_version == 1)
+            hex_to_rawdata (key_hex, enc_key, 16);
+        else
+            hex_to_rawdata (key_hex, enc_key, 32);
+        hex_to_rawdata (iv_hex, enc_iv, 16);
+        data->crypt = seafile_crypt_new (repo->enc_version, enc_key, enc_iv);
+        g_free (key_hex);
+        g_free (iv_hex);
+    }
 
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new ("Accept-Ranges", "bytes", 0, 0));
@@ -970,21 +1790,54 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         content_type = g_strdup ("application/octet-stream");
     }
 
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Type", content_type, 0, 1));
-    g_free (content_type);
+    if (ranges->len == 1) {
+        g_array_free (ranges, TRUE);
 
-    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, end-start+1);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new("Content-Length", con_len, 0, 1));
-    g_free (con_len);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", content_type, 0, 1));
+        g_free (content_type);
 
-    char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
-                                       "/%"G_GUINT64_FORMAT, "bytes",
-                                       start, end, file->file_size);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Range", con_range, 0, 1));
-    g_free (con_range);
+        char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, end-start+1);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Length", con_len, 0, 1));
+        g_free (con_len);
+
+        char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                                           "/%"G_GUINT64_FORMAT, "bytes",
+                                           start, end, file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range, 0, 1));
+        g_free (con_range);
+    } else {
+        /* Several ranges are sent as parts of a multipart/byteranges body,
+         * whose length is known beforehand.
+         */
+        guint64 body_len = 0;
+        guint i;
+
+        data->ranges = ranges;
+        data->content_type = content_type;
+        data->boundary = gen_uuid ();
+
+        for (i = 0; i < ranges->len; i++) {
+            char *part_header = byte_range_part_header (data, i);
+            range = &g_array_index (ranges, ByteRange, i);
+            body_len += strlen(part_header) + range->end - range->start + 1;
+            g_free (part_header);
+        }
+        body_len += strlen(data->boundary) + strlen("\r\n----\r\n");
+
+        char *multi_type = g_strdup_printf ("multipart/byteranges; boundary=%s",
+                                            data->boundary);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", multi_type, 0, 1));
+        g_free (multi_type);
+
+        char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, body_len);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Length", con_len, 0, 1));
+        g_free (con_len);
+    }
 
     set_resp_disposition (req, operation, filename);
 
@@ -994,19 +1847,6 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                                                   1, 1));
     }
 
-    data = g_new0 (SendFileRangeData, 1);
-    if (!data) {
-        seafile_unref (file);
-        return -1;
-    }
-    data->req = req;
-    data->file = file;
-    data->blk_idx = -1;
-    data->start_off = start;
-    data->range_remain = end-start+1;
-    data->user = g_strdup(user);
-    data->token_type = g_strdup (operation);
-
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
@@ -1018,6 +1858,8 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
     data->saved_cb_arg = bev->cbarg;
+    http_io_stream_init (&data->stream, req, fill_file_range, file_range_filled,
+                         (GDestroyNotify)free_send_file_range_data, data);
     bufferevent_setcb (bev,
                        NULL,
                        write_file_range_cb,
@@ -1090,6 +1932,8 @@ start_download_zip_file (evhtp_request_t *req, const char *token,
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
     data->saved_cb_arg = bev->cbarg;
+    http_io_stream_init (&data->stream, req, fill_dir_data, dir_data_filled,
+                         (GDestroyNotify)free_senddir_data, data);
     bufferevent_setcb (bev,
                        NULL,
                        write_dir_data_cb,
@@ -1106,6 +1950,176 @@ start_download_zip_file (evhtp_request_t *req, const char *token,
     return 0;
 }
 
+static void
+free_zip_stream_data (SendZipStreamData *data)
+{
+    event_free (data->read_ev);
+    /* Packing fails on a closed pipe if the zip wasn't sent out. */
+    close (data->pipefd);
+
+    zip_download_mgr_del_zip_progress (seaf->zip_download_mgr, data->token);
+
+    g_free (data->user);
+    g_free (data->token_type);
+    g_free (data->token);
+    g_free (data);
+}
+
+/* Sends what was packed so far. Called when the output buffer is drained,
+ * so a slow client holds the packing back through the pipe.
+ */
+static void
+send_zip_stream_data (SendZipStreamData *data)
+{
+    char buf[64 * 1024];
+    ssize_t n;
+
+    n = read (data->pipefd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        event_add (data->read_ev, NULL);
+        return;
+    }
+    if (n < 0) {
+        seaf_warning ("Failed to read zip stream for token %s: %s.\n",
+                      data->token, strerror (errno));
+        goto err;
+    }
+
+    if (n > 0) {
+        struct evbuffer *out = evbuffer_new ();
+        evbuffer_add (out, buf, n);
+        evhtp_send_reply_chunk (data->req, out);
+        evbuffer_free (out);
+        data->total_size += n;
+        return;
+    }
+
+    if (zip_download_mgr_zip_stream_failed (seaf->zip_download_mgr, data->token)) {
+        seaf_warning ("Failed to pack zip for token %s.\n", data->token);
+        goto err;
+    }
+
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_chunk_end (data->req);
+
+    char *oper = "web-file-download";
+    if (g_strcmp0(data->token_type, "download-dir-link") == 0 ||
+        g_strcmp0(data->token_type, "download-multi-link") == 0)
+        oper = "link-file-download";
+
+    send_statistic_msg(data->repo_id, data->user, oper, data->total_size);
+
+    free_zip_stream_data (data);
+    return;
+
+err:
+    /* The headers are out, so the client can only tell from the dropped
+     * connection that the zip is incomplete.
+     */
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_zip_stream_data (data);
+}
+
+static void
+write_zip_stream_cb (struct bufferevent *bev, void *ctx)
+{
+    send_zip_stream_data (ctx);
+}
+
+static void
+zip_stream_readable_cb (evutil_socket_t fd, short what, void *ctx)
+{
+    send_zip_stream_data (ctx);
+}
+
+static void
+zip_stream_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendZipStreamData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_zip_stream_data (data);
+}
+
+static int
+start_stream_zip (evhtp_request_t *req, const char *token,
+                  const char *zipname, const char *repo_id,
+                  const char *user, const char *token_type)
+{
+    char cont_filename[SEAF_PATH_MAX];
+    int fds[2];
+
+    if (pipe (fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        return -1;
+    }
+    if (fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK) < 0) {
+        seaf_warning ("Failed to set pipe non-blocking: %s.\n", strerror(errno));
+        close (fds[0]);
+        close (fds[1]);
+        return -1;
+    }
+
+    /* The write end is owned by the packing thread from here. */
+    if (zip_download_mgr_start_zip_stream (seaf->zip_download_mgr, token, fds[1]) < 0) {
+        close (fds[0]);
+        return -1;
+    }
+
+    /* The size is only known at the end, so the zip is sent in chunks. */
+    evhtp_headers_add_header(req->headers_out,
+                             evhtp_header_new("Content-Type", "application/zip", 1, 1));
+
+    snprintf(cont_filename, SEAF_PATH_MAX,
+             "attachment;filename=\"%s.zip\"", zipname);
+
+    evhtp_headers_add_header(req->headers_out,
+            evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
+
+    SendZipStreamData *data;
+    data = g_new0 (SendZipStreamData, 1);
+    data->req = req;
+    data->pipefd = fds[0];
+    data->read_ev = event_new (evhtp_request_get_connection (req)->evbase,
+                               fds[0], EV_READ, zip_stream_readable_cb, data);
+    data->token = g_strdup (token);
+    data->user = g_strdup (user);
+    data->token_type = g_strdup (token_type);
+    snprintf(data->repo_id, sizeof(data->repo_id), "%s", repo_id);
+
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_zip_stream_cb,
+                       zip_stream_event_cb,
+                       data);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+
+    return 0;
+}
+
 static gboolean
 can_use_cached_content (evhtp_request_t *req)
 {
@@ -1201,6 +2215,19 @@ access_zip_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    if (zip_download_mgr_is_streaming (seaf->zip_download_mgr, token)) {
+        g_object_get (info, "username", &user, NULL);
+        g_object_get (info, "repo_id", &repo_id, NULL);
+        g_object_get (info, "op", &token_type, NULL);
+        if (start_stream_zip (req, token, filename, repo_id, user, token_type) < 0) {
+            seaf_warning ("Failed to start streaming zip: %s for token: %s.\n",
+                          filename, token);
+            error = "Internal server error\n";
+            error_code = EVHTP_RES_SERVERR;
+        }
+        goto out;
+    }
+
     zip_file_path = zip_download_mgr_get_zip_file_path (seaf->zip_download_mgr, token);
     if (!zip_file_path) {
         g_object_get (info, "repo_id", &repo_id, NULL);
@@ -1323,8 +2350,9 @@ access_cb(evhtp_request_t *req, void *arg)
         goto on_error;
     }
 
-    if (!repo->encrypted && byte_ranges) {
-        if (do_file_range (req, repo, data, filename, operation, byte_ranges, user) < 0) {
+    if (byte_ranges) {
+        if (do_file_range (req, repo, data, filename, operation, byte_ranges,
+                           key, user) < 0) {
             error = "Internal server error\n";
             error_code = EVHTP_RES_SERVERR;
             goto on_error;
@@ -1434,6 +2462,8 @@ do_block(evhtp_request_t *req, SeafRepo *repo, const char *user, const char *fil
     data->saved_event_cb = bev->errorcb;
     data->saved_cb_arg = bev->cbarg;
     data->bsize = bsize;
+    http_io_stream_init (&data->stream, req, fill_block_data, block_data_filled,
+                         (GDestroyNotify)free_sendblock_data, data);
     bufferevent_setcb (bev,
                        NULL,
                        write_block_data_cb,
@@ -1537,9 +2567,19 @@ on_error:
 int
 access_file_init (evhtp_t *htp)
 {
-    evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/zip/.*", access_zip_cb, NULL);
+    evhtp_callback_t *cb;
+
+    http_metrics_set_regex_cb (htp, "^/files/.*", "files", access_cb, NULL);
+    http_metrics_set_regex_cb (htp, "^/blks/.*", "blks", access_blks_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/zip/.*", "zip", access_zip_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_ZIP);
+
+    if (seaf->http_server->download_read_ahead > 0) {
+        read_ahead_pool = g_thread_pool_new (read_ahead_fetch, NULL,
+                                             READ_AHEAD_THREADS, FALSE, NULL);
+        if (!read_ahead_pool)
+            seaf_warning ("Failed to create read-ahead thread pool.\n");
+    }
 
     return 0;
 }
@@ -0,0 +1,216 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <pthread.h>
+
+#include "log.h"
+#include "seafile-session.h"
+#include "fileserver-config.h"
+#include "block-cache.h"
+
+/* Plaintext sizes are forgotten all at once past this many blocks. */
+#define MAX_PLAIN_SIZES 100000
+
+typedef struct CachedBlock {
+    /* "repo_id/block_id" */
+    char *key;
+    char repo_id[37];
+    GBytes *data;
+    GList *link;
+} CachedBlock;
+
+typedef struct BlockCache {
+    pthread_mutex_t lock;
+    gint64 max_bytes;
+    gint64 bytes;
+    GHashTable *blocks;
+    /* Most recently used first. */
+    GQueue lru;
+    /* block_id -> plaintext size */
+    GHashTable *plain_sizes;
+} BlockCache;
+
+static BlockCache *cache;
+
+void
+block_cache_init (SeafileSession *session)
+{
+    GError *error = NULL;
+    int size;
+
+    cache = g_new0 (BlockCache, 1);
+    pthread_mutex_init (&cache->lock, NULL);
+    g_queue_init (&cache->lru);
+    cache->plain_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+
+    size = fileserver_config_get_integer (session->config,
+                                          "decrypted_block_cache_size", &error);
+    if (error) {
+        g_clear_error (&error);
+        return;
+    }
+    if (size <= 0)
+        return;
+    seaf_message ("fileserver: decrypted_block_cache_size = %d MB\n", size);
+
+    cache->max_bytes = (gint64)size << 20;
+    cache->blocks = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static void
+free_plaintext (gpointer data)
+{
+    char *buf = data;
+
+    /* The size was stored in front of the data. */
+    buf -= sizeof(gsize);
+    memset (buf, 0, *(gsize *)buf + sizeof(gsize));
+    g_free (buf);
+}
+
+GBytes *
+block_cache_new_bytes (const char *data, gsize len)
+{
+    char *buf = g_malloc (sizeof(gsize) + len);
+
+    *(gsize *)buf = len;
+    memcpy (buf + sizeof(gsize), data, len);
+    return g_bytes_new_with_free_func (buf + sizeof(gsize), len,
+                                       free_plaintext, buf + sizeof(gsize));
+}
+
+static void
+cached_block_free (CachedBlock *blk)
+{
+    cache->bytes -= g_bytes_get_size (blk->data);
+    g_bytes_unref (blk->data);
+    g_free (blk->key);
+    g_free (blk);
+}
+
+/* Called with the lock held. */
+static void
+remove_block (CachedBlock *blk)
+{
+    g_hash_table_remove (cache->blocks, blk->key);
+    g_queue_delete_link (&cache->lru, blk->link);
+    cached_block_free (blk);
+}
+
+GBytes *
+block_cache_lookup (const char *repo_id, const char *block_id)
+{
+    CachedBlock *blk;
+    GBytes *data = NULL;
+    char *key;
+
+    if (!cache || !cache->blocks)
+        return NULL;
+
+    key = g_strconcat (repo_id, "/", block_id, NULL);
+
+    pthread_mutex_lock (&cache->lock);
+    blk = g_hash_table_lookup (cache->blocks, key);
+    if (blk) {
+        g_queue_unlink (&cache->lru, blk->link);
+        g_queue_push_head_link (&cache->lru, blk->link);
+        data = g_bytes_ref (blk->data);
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    g_free (key);
+    return data;
+}
+
+void
+block_cache_insert (const char *repo_id, const char *block_id, GBytes *data)
+{
+    CachedBlock *blk;
+    gsize len = g_bytes_get_size (data);
+    char *key;
+
+    /* A block taking much of the cache would evict everything else. */
+    if (!cache || !cache->blocks || len > cache->max_bytes / 4)
+        return;
+
+    key = g_strconcat (repo_id, "/", block_id, NULL);
+
+    pthread_mutex_lock (&cache->lock);
+    if (g_hash_table_lookup (cache->blocks, key)) {
+        pthread_mutex_unlock (&cache->lock);
+        g_free (key);
+        return;
+    }
+
+    while (cache->bytes + (gint64)len > cache->max_bytes &&
+           !g_queue_is_empty (&cache->lru))
+        remove_block (g_queue_peek_tail (&cache->lru));
+
+    blk = g_new0 (CachedBlock, 1);
+    blk->key = key;
+    memcpy (blk->repo_id, repo_id, 36);
+    blk->data = g_bytes_ref (data);
+    g_queue_push_head (&cache->lru, blk);
+    blk->link = cache->lru.head;
+    g_hash_table_insert (cache->blocks, blk->key, blk);
+    cache->bytes += len;
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+block_cache_purge_repo (const char *repo_id)
+{
+    GList *ptr, *next;
+    CachedBlock *blk;
+    int n = 0;
+
+    if (!cache || !cache->blocks)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+    for (ptr = cache->lru.head; ptr; ptr = next) {
+        next = ptr->next;
+        blk = ptr->data;
+        if (strcmp (blk->repo_id, repo_id) == 0) {
+            remove_block (blk);
+            ++n;
+        }
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    if (n > 0)
+        seaf_debug ("Dropped %d decrypted blocks of repo %.8s.\n", n, repo_id);
+}
+
+int
+block_cache_get_plain_size (const char *block_id)
+{
+    gpointer value;
+    int size = -1;
+
+    if (!cache)
+        return -1;
+
+    pthread_mutex_lock (&cache->lock);
+    if (g_hash_table_lookup_extended (cache->plain_sizes, block_id, NULL, &value))
+        size = GPOINTER_TO_INT (value);
+    pthread_mutex_unlock (&cache->lock);
+
+    return size;
+}
+
+void
+block_cache_set_plain_size (const char *block_id, int size)
+{
+    if (!cache)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+    if (g_hash_table_size (cache->plain_sizes) >= MAX_PLAIN_SIZES)
+        g_hash_table_remove_all (cache->plain_sizes);
+    g_hash_table_insert (cache->plain_sizes, g_strdup (block_id),
+                         GINT_TO_POINTER (size));
+    pthread_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,48 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Decrypted blocks of encrypted libraries, kept for range requests: a
+ * client seeking in a large file asks for many ranges in the same blocks,
+ * which would otherwise be decrypted again for each of them.
+ *
+ * Blocks are kept per repo in LRU order, within decrypted_block_cache_size
+ * MB of [fileserver]. The cache is disabled unless it's set. All blocks
+ * of a repo are dropped when a password of the repo is unset.
+ *
+ * The plaintext sizes of blocks, needed to find the block of an offset,
+ * are kept separately and aren't bounded by the memory limit.
+ */
+
+struct _SeafileSession;
+
+void
+block_cache_init (struct _SeafileSession *session);
+
+/*
+ * Returns a copy of decrypted @data, cleared from memory when the last
+ * reference is dropped.
+ */
+GBytes *
+block_cache_new_bytes (const char *data, gsize len);
+
+/* Returns a reference to the decrypted block, or NULL. */
+GBytes *
+block_cache_lookup (const char *repo_id, const char *block_id);
+
+void
+block_cache_insert (const char *repo_id, const char *block_id, GBytes *data);
+
+void
+block_cache_purge_repo (const char *repo_id);
+
+/* Returns the plaintext size of the block, or -1 if it's not known. */
+int
+block_cache_get_plain_size (const char *block_id);
+
+void
+block_cache_set_plain_size (const char *block_id, int size);
+
+#endif
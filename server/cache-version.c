@@ -0,0 +1,55 @@
+#include "common.h"
+
+#include <jansson.h>
+
+#include "utils.h"
+#include "cache-version.h"
+
+static const char *version_names[N_SEAF_CACHE_VERSIONS] = {
+    "repo",
+    "repo_list",
+    "perm",
+};
+
+static gint64 versions[N_SEAF_CACHE_VERSIONS];
+
+static char *
+get_instance_id ()
+{
+    static gsize inited = 0;
+    static char *instance;
+
+    if (g_once_init_enter (&inited)) {
+        instance = gen_uuid ();
+        g_once_init_leave (&inited, 1);
+    }
+    return instance;
+}
+
+void
+seaf_cache_version_bump (SeafCacheVersionKind kind)
+{
+    __atomic_add_fetch (&versions[kind], 1, __ATOMIC_RELAXED);
+}
+
+char *
+seaf_cache_versions_to_json ()
+{
+    json_t *obj;
+    char *json_data, *ret;
+    int i;
+
+    obj = json_object ();
+    json_object_set_new (obj, "instance", json_string (get_instance_id ()));
+    for (i = 0; i < N_SEAF_CACHE_VERSIONS; ++i)
+        json_object_set_new (obj, version_names[i],
+                             json_integer (__atomic_load_n (&versions[i],
+                                                            __ATOMIC_RELAXED)));
+
+    json_data = json_dumps (obj, JSON_COMPACT);
+    ret = g_strdup (json_data);
+
+    free (json_data);
+    json_decref (obj);
+    return ret;
+}
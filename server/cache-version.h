@@ -0,0 +1,33 @@
+#ifndef CACHE_VERSION_H
+#define CACHE_VERSION_H
+
+#include <glib.h>
+
+/*
+ * Version stamps of the data that rpc clients may cache across requests.
+ * A version is bumped whenever this process changes, or learns about a
+ * change of, data of its kind: repo objects when a cached repo is dropped,
+ * repo lists and owners on seaf_repo_manager_notify_repo_list_change(), and
+ * permissions on seaf_repo_manager_notify_perm_change(). A client keeps
+ * what it cached while the stamps it was read under are unchanged.
+ *
+ * The stamps include an id of the process, since the counters restart with
+ * it. They only cover the changes seen by this process, so they don't help
+ * clients of a cluster, whose nodes make changes of their own.
+ */
+
+typedef enum {
+    SEAF_CACHE_VERSION_REPO,
+    SEAF_CACHE_VERSION_REPO_LIST,
+    SEAF_CACHE_VERSION_PERM,
+    N_SEAF_CACHE_VERSIONS,
+} SeafCacheVersionKind;
+
+void
+seaf_cache_version_bump (SeafCacheVersionKind kind);
+
+/* Returns {"instance": ..., "repo": ..., "repo_list": ..., "perm": ...}. */
+char *
+seaf_cache_versions_to_json ();
+
+#endif
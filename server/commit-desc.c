@@ -0,0 +1,143 @@
+#include "common.h"
+
+#include "seafile-session.h"
+#include "commit-desc.h"
+#include "diff-simple.h"
+#include "executor.h"
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define DEFAULT_COMMIT_DESC "Auto merge by system"
+#define DESC_JOB_MAX_RUNNING 2
+
+typedef struct CommitDescJob {
+    CommitDescScheduler *sched;
+    char repo_id[37];
+    char commit_id[41];
+} CommitDescJob;
+
+CommitDescScheduler *
+commit_desc_scheduler_new (SeafileSession *session)
+{
+    CommitDescScheduler *sched = g_new0 (CommitDescScheduler, 1);
+
+    sched->seaf = session;
+    sched->lazy = g_key_file_get_boolean (session->config, "general",
+                                          "lazy_commit_description", NULL);
+    if (sched->lazy)
+        seaf_executor_set_max_running (session->executor, SEAF_JOB_DESC,
+                                       DESC_JOB_MAX_RUNNING);
+
+    return sched;
+}
+
+static char *
+compute_desc (CommitDescScheduler *sched, SeafCommit *commit)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *parent = NULL;
+    GList *results = NULL;
+    char *desc = NULL;
+
+    repo = seaf_repo_manager_get_repo (sched->seaf->repo_mgr, commit->repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to get repo %s.\n", commit->repo_id);
+        goto out;
+    }
+
+    parent = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
+                                             repo->id, repo->version,
+                                             commit->parent_id);
+    if (!parent) {
+        seaf_warning ("Failed to get commit %s:%s.\n",
+                      repo->id, commit->parent_id);
+        goto out;
+    }
+
+    if (diff_commit_roots (repo->store_id, repo->version,
+                           parent->root_id, commit->root_id,
+                           &results, TRUE) < 0) {
+        seaf_warning ("Failed to diff commit %s:%s with its parent.\n",
+                      repo->id, commit->commit_id);
+        goto out;
+    }
+
+    desc = diff_results_to_description (results);
+    if (!desc)
+        desc = g_strdup (DEFAULT_COMMIT_DESC);
+
+    if (seaf_db_statement_query (sched->seaf->db,
+                                 "REPLACE INTO CommitDescription "
+                                 "(repo_id, commit_id, description) VALUES (?, ?, ?)",
+                                 3, "string", commit->repo_id,
+                                 "string", commit->commit_id,
+                                 "string", desc) < 0)
+        seaf_warning ("Failed to save description of commit %s:%s.\n",
+                      commit->repo_id, commit->commit_id);
+
+out:
+    g_list_free_full (results, (GDestroyNotify)diff_entry_free);
+    seaf_commit_unref (parent);
+    seaf_repo_unref (repo);
+    return desc;
+}
+
+char *
+commit_desc_get (CommitDescScheduler *sched, SeafCommit *commit)
+{
+    char *desc;
+
+    if (!commit->desc || strcmp (commit->desc, SEAF_COMMIT_DESC_PENDING) != 0 ||
+        !commit->parent_id)
+        return g_strdup (commit->desc);
+
+    desc = seaf_db_statement_get_string (sched->seaf->db,
+                                         "SELECT description FROM CommitDescription "
+                                         "WHERE repo_id = ? AND commit_id = ?",
+                                         2, "string", commit->repo_id,
+                                         "string", commit->commit_id);
+    if (desc)
+        return desc;
+
+    desc = compute_desc (sched, commit);
+    if (!desc)
+        desc = g_strdup (commit->desc);
+    return desc;
+}
+
+static void
+desc_task (void *data, void *user_data)
+{
+    CommitDescJob *job = data;
+    SeafRepo *repo;
+    SeafCommit *commit = NULL;
+
+    repo = seaf_repo_manager_get_repo (job->sched->seaf->repo_mgr, job->repo_id);
+    if (!repo)
+        goto out;
+
+    commit = seaf_commit_manager_get_commit (job->sched->seaf->commit_mgr,
+                                             repo->id, repo->version,
+                                             job->commit_id);
+    if (commit)
+        g_free (commit_desc_get (job->sched, commit));
+
+out:
+    seaf_commit_unref (commit);
+    seaf_repo_unref (repo);
+    g_free (job);
+}
+
+void
+schedule_commit_desc (CommitDescScheduler *sched,
+                      const char *repo_id,
+                      const char *commit_id)
+{
+    CommitDescJob *job = g_new0 (CommitDescJob, 1);
+
+    job->sched = sched;
+    memcpy (job->repo_id, repo_id, 36);
+    memcpy (job->commit_id, commit_id, 40);
+
+    seaf_executor_push (sched->seaf->executor, SEAF_JOB_DESC, desc_task, job, NULL);
+}
@@ -0,0 +1,40 @@
+#ifndef COMMIT_DESC_H
+#define COMMIT_DESC_H
+
+struct _SeafileSession;
+struct _SeafCommit;
+
+/*
+ * With "lazy_commit_description = true" in the [general] group, commits of
+ * web operations are created with the description SEAF_COMMIT_DESC_PENDING
+ * instead of running a diff against the parent on the commit path. The
+ * description is computed by a background job, or by the first reader, and
+ * stored in the CommitDescription table. Since the description is part of
+ * the commit id, the commit object itself keeps the placeholder; clients
+ * that read commit objects directly see it.
+ */
+
+#define SEAF_COMMIT_DESC_PENDING "(description pending)"
+
+typedef struct CommitDescScheduler {
+    struct _SeafileSession *seaf;
+    gboolean lazy;
+} CommitDescScheduler;
+
+CommitDescScheduler *
+commit_desc_scheduler_new (struct _SeafileSession *session);
+
+/* Computes the description of a commit created with the placeholder. */
+void
+schedule_commit_desc (CommitDescScheduler *sched,
+                      const char *repo_id,
+                      const char *commit_id);
+
+/*
+ * Returns the description of @commit, computing it first if it's still
+ * pending. The result must be freed.
+ */
+char *
+commit_desc_get (CommitDescScheduler *sched, struct _SeafCommit *commit);
+
+#endif
@@ -14,11 +14,13 @@
 #include "log.h"
 
 #define DEFAULT_MAX_THREADS 5
+#define DEFAULT_MAX_WORKERS 16
+#define DEFAULT_MAX_TASK_WORKERS 8
 
 struct _SeafCopyManagerPriv {
     GHashTable *copy_tasks;
     pthread_mutex_t lock;
-    CcnetJobManager *job_mgr;
+    int n_running;
 };
 
 static void
@@ -49,14 +51,25 @@ seaf_copy_manager_new (struct _SeafileSession *session)
     /* size is given in MB */
     mgr->max_size <<= 20;
 
+    mgr->max_workers = g_key_file_get_integer (session->config,
+                                               "web_copy", "max_workers", NULL);
+    if (mgr->max_workers <= 0)
+        mgr->max_workers = DEFAULT_MAX_WORKERS;
+    mgr->max_task_workers = g_key_file_get_integer (session->config,
+                                                    "web_copy", "max_task_workers",
+                                                    NULL);
+    if (mgr->max_task_workers <= 0)
+        mgr->max_task_workers = DEFAULT_MAX_TASK_WORKERS;
+
+    seaf_executor_set_max_running (session->executor, SEAF_JOB_COPY,
+                                   DEFAULT_MAX_THREADS);
+
     return mgr;
 }
 
 int
 seaf_copy_manager_start (SeafCopyManager *mgr)
 {
-    mgr->priv->job_mgr = ccnet_job_manager_new (DEFAULT_MAX_THREADS);
-
     return 1;
 }
 
@@ -75,6 +88,8 @@ seaf_copy_manager_get_task (SeafCopyManager *mgr,
     if (task) {
         t = seafile_copy_task_new ();
         g_object_set (t, "done", task->done, "total", task->total,
+                      "done_bytes", task->done_bytes,
+                      "total_bytes", task->total_bytes,
                       "canceled", task->canceled, "failed", task->failed,
                       "failed_reason", task->failed_reason, "successful", task->successful,
                       NULL);
@@ -102,23 +117,9 @@ struct CopyThreadData {
 };
 typedef struct CopyThreadData CopyThreadData;
 
-static void *
-copy_thread (void *vdata)
-{
-    CopyThreadData *data = vdata;
-
-    data->func (data->src_repo_id, data->src_path, data->src_filename,
-                data->dst_repo_id, data->dst_path, data->dst_filename,
-                data->replace, data->modifier, data->task);
-
-    return vdata;
-}
-
 static void
-copy_done (void *vdata)
+copy_data_free (CopyThreadData *data)
 {
-    CopyThreadData *data = vdata;
-
     g_free (data->src_path);
     g_free (data->src_filename);
     g_free (data->dst_path);
@@ -127,6 +128,27 @@ copy_done (void *vdata)
     g_free (data);
 }
 
+static void
+copy_job (void *vdata, void *user_data)
+{
+    CopyThreadData *data = vdata;
+    SeafCopyManagerPriv *priv = data->mgr->priv;
+
+    pthread_mutex_lock (&priv->lock);
+    ++(priv->n_running);
+    pthread_mutex_unlock (&priv->lock);
+
+    data->func (data->src_repo_id, data->src_path, data->src_filename,
+                data->dst_repo_id, data->dst_path, data->dst_filename,
+                data->replace, data->modifier, data->task);
+
+    pthread_mutex_lock (&priv->lock);
+    --(priv->n_running);
+    pthread_mutex_unlock (&priv->lock);
+
+    copy_data_free (data);
+}
+
 char *
 seaf_copy_manager_add_task (SeafCopyManager *mgr,
                             const char *src_repo_id,
@@ -168,13 +190,49 @@ seaf_copy_manager_add_task (SeafCopyManager *mgr,
     data->task = task;
     data->func = function;
 
-    ccnet_job_manager_schedule_job (mgr->priv->job_mgr,
-                                    copy_thread,
-                                    copy_done,
-                                    data);
+    seaf_executor_push (mgr->session->executor, SEAF_JOB_COPY,
+                        copy_job, data, NULL);
     return task_id;
 }
 
+void
+seaf_copy_manager_add_progress (SeafCopyManager *mgr, CopyTask *task,
+                                gint64 files, gint64 bytes)
+{
+    if (!task)
+        return;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    task->done += files;
+    task->done_bytes += bytes;
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
+int
+seaf_copy_manager_get_task_workers (SeafCopyManager *mgr)
+{
+    int n_running, n;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    n_running = mgr->priv->n_running;
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    /* Tasks run synchronously are not counted. */
+    if (n_running < 1)
+        n_running = 1;
+
+    n = mgr->max_workers / n_running;
+    if (n > mgr->max_task_workers)
+        n = mgr->max_task_workers;
+    return MAX (n, 1);
+}
+
+int
+seaf_copy_manager_get_queue_len (SeafCopyManager *mgr)
+{
+    return seaf_executor_get_queued (mgr->session->executor, SEAF_JOB_COPY);
+}
+
 int
 seaf_copy_manager_cancel_task (SeafCopyManager *mgr, const char *task_id)
 {
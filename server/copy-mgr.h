@@ -19,6 +19,10 @@ struct _SeafCopyManager {
 
     gint64 max_files;
     gint64 max_size;
+
+    /* Worker threads shared by the running tasks, and the most one task may use. */
+    int max_workers;
+    int max_task_workers;
 };
 typedef struct _SeafCopyManager SeafCopyManager;
 typedef struct _SeafCopyManagerPriv SeafCopyManagerPriv;
@@ -27,6 +31,8 @@ struct CopyTask {
     char task_id[37];
     gint64 done;
     gint64 total;
+    gint64 done_bytes;
+    gint64 total_bytes;
     gint canceled;
     gboolean failed;
     char *failed_reason;
@@ -61,7 +67,23 @@ struct _SeafileCopyTask *
 seaf_copy_manager_get_task (SeafCopyManager *mgr,
                             const char * id);
 
+/* Add copied files and bytes to the progress of @task. */
+void
+seaf_copy_manager_add_progress (SeafCopyManager *mgr, CopyTask *task,
+                                gint64 files, gint64 bytes);
+
+/*
+ * The number of worker threads a task may use for its files and blocks,
+ * an even share of the workers among the running tasks.
+ */
+int
+seaf_copy_manager_get_task_workers (SeafCopyManager *mgr);
+
 int
 seaf_copy_manager_cancel_task (SeafCopyManager *mgr, const char *task_id);
 
+/* Copy tasks waiting for a thread. */
+int
+seaf_copy_manager_get_queue_len (SeafCopyManager *mgr);
+
 #endif
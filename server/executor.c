@@ -0,0 +1,245 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "executor.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Each class has a queue, a quota of running jobs and a number of workers
+ * it must leave idle. The idle workers are kept for the more urgent
+ * classes, so that a burst of size computations or copies can't delay
+ * indexing of uploads until it is done. Jobs aren't interrupted once they
+ * run, so urgent classes only get ahead when a worker takes its next job.
+ */
+
+#define DEFAULT_MIN_WORKERS 8
+
+typedef struct ExecutorJob {
+    SeafJobFunc func;
+    void *data;
+    void *user_data;
+    gint64 queued_at;
+} ExecutorJob;
+
+typedef struct JobClass {
+    GQueue queue;
+    int running;
+    int max_running;
+    /* Workers that must stay idle for a job of this class to start. */
+    int reserved;
+    guint64 n_done;
+    guint64 n_rejected;
+    gint64 wait_time;
+} JobClass;
+
+struct SeafExecutor {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_workers;
+    int n_running;
+    JobClass classes[SEAF_JOB_N_CLASSES];
+};
+
+static const char *class_names[SEAF_JOB_N_CLASSES] = {
+    "crypto",
+    "index",
+    "zip",
+    "copy",
+    "size",
+    "desc",
+    "trash",
+};
+
+static void *
+worker_thread (void *vex);
+
+SeafExecutor *
+seaf_executor_new (SeafileSession *session)
+{
+    SeafExecutor *ex = g_new0 (SeafExecutor, 1);
+    JobClass *cls;
+    pthread_t tid;
+    int i;
+
+    ex->n_workers = g_key_file_get_integer (session->config,
+                                            "executor", "worker_threads", NULL);
+    if (ex->n_workers <= 0)
+        ex->n_workers = MAX (DEFAULT_MIN_WORKERS, 2 * g_get_num_processors ());
+
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i) {
+        cls = &ex->classes[i];
+        g_queue_init (&cls->queue);
+        cls->max_running = ex->n_workers;
+    }
+    pthread_mutex_init (&ex->lock, NULL);
+    pthread_cond_init (&ex->cond, NULL);
+
+    /* Workers wait for the setup to be done. */
+    pthread_mutex_lock (&ex->lock);
+    for (i = 0; i < ex->n_workers; ++i) {
+        if (pthread_create (&tid, NULL, worker_thread, ex) != 0) {
+            seaf_warning ("Failed to create executor worker thread.\n");
+            break;
+        }
+        pthread_detach (tid);
+    }
+    if (i == 0) {
+        pthread_mutex_unlock (&ex->lock);
+        g_free (ex);
+        return NULL;
+    }
+    ex->n_workers = i;
+
+    /* Zip checks and copies are started by users too, size computations,
+     * commit descriptions and trash maintenance can always wait.
+     */
+    ex->classes[SEAF_JOB_ZIP].reserved = MIN (1, ex->n_workers - 1);
+    ex->classes[SEAF_JOB_COPY].reserved = MIN (1, ex->n_workers - 1);
+    ex->classes[SEAF_JOB_SIZE].reserved = ex->n_workers / 2;
+    ex->classes[SEAF_JOB_DESC].reserved = ex->n_workers / 2;
+    ex->classes[SEAF_JOB_TRASH].reserved = ex->n_workers / 2;
+    ex->classes[SEAF_JOB_TRASH].max_running = 2;
+    pthread_mutex_unlock (&ex->lock);
+
+    seaf_message ("executor: worker_threads = %d\n", ex->n_workers);
+
+    return ex;
+}
+
+void
+seaf_executor_set_max_running (SeafExecutor *ex, SeafJobClass cls,
+                               int max_running)
+{
+    pthread_mutex_lock (&ex->lock);
+    ex->classes[cls].max_running = CLAMP (max_running, 1, ex->n_workers);
+    pthread_mutex_unlock (&ex->lock);
+}
+
+void
+seaf_executor_push (SeafExecutor *ex, SeafJobClass cls,
+                    SeafJobFunc func, void *data, void *user_data)
+{
+    seaf_executor_try_push (ex, cls, G_MAXUINT, func, data, user_data);
+}
+
+int
+seaf_executor_try_push (SeafExecutor *ex, SeafJobClass cls, guint max_queued,
+                        SeafJobFunc func, void *data, void *user_data)
+{
+    JobClass *c = &ex->classes[cls];
+    ExecutorJob *job;
+
+    pthread_mutex_lock (&ex->lock);
+    if (g_queue_get_length (&c->queue) >= max_queued) {
+        c->n_rejected++;
+        pthread_mutex_unlock (&ex->lock);
+        return -1;
+    }
+
+    job = g_new0 (ExecutorJob, 1);
+    job->func = func;
+    job->data = data;
+    job->user_data = user_data;
+    job->queued_at = g_get_monotonic_time ();
+
+    g_queue_push_tail (&c->queue, job);
+    pthread_cond_signal (&ex->cond);
+    pthread_mutex_unlock (&ex->lock);
+
+    return 0;
+}
+
+/* Called with the lock held. */
+static ExecutorJob *
+take_job (SeafExecutor *ex, JobClass **job_class)
+{
+    int idle = ex->n_workers - ex->n_running;
+    JobClass *cls;
+    int i;
+
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i) {
+        cls = &ex->classes[i];
+        if (g_queue_is_empty (&cls->queue) ||
+            cls->running >= cls->max_running ||
+            idle <= cls->reserved)
+            continue;
+        cls->running++;
+        ex->n_running++;
+        *job_class = cls;
+        return g_queue_pop_head (&cls->queue);
+    }
+
+    return NULL;
+}
+
+static void *
+worker_thread (void *vex)
+{
+    SeafExecutor *ex = vex;
+    ExecutorJob *job;
+    JobClass *cls = NULL;
+    gint64 wait;
+
+    pthread_mutex_lock (&ex->lock);
+    while (1) {
+        job = take_job (ex, &cls);
+        if (!job) {
+            pthread_cond_wait (&ex->cond, &ex->lock);
+            continue;
+        }
+        pthread_mutex_unlock (&ex->lock);
+
+        wait = g_get_monotonic_time () - job->queued_at;
+        job->func (job->data, job->user_data);
+        g_free (job);
+
+        pthread_mutex_lock (&ex->lock);
+        cls->running--;
+        ex->n_running--;
+        cls->n_done++;
+        cls->wait_time += wait;
+        /* A finished job may let a job of another class start. */
+        pthread_cond_broadcast (&ex->cond);
+    }
+
+    return NULL;
+}
+
+guint
+seaf_executor_get_queued (SeafExecutor *ex, SeafJobClass cls)
+{
+    guint n;
+
+    pthread_mutex_lock (&ex->lock);
+    n = g_queue_get_length (&ex->classes[cls].queue);
+    pthread_mutex_unlock (&ex->lock);
+
+    return n;
+}
+
+void
+seaf_executor_get_stats (SeafExecutor *ex, SeafJobClass cls,
+                         SeafExecutorStats *stats)
+{
+    JobClass *c = &ex->classes[cls];
+
+    pthread_mutex_lock (&ex->lock);
+    stats->queued = g_queue_get_length (&c->queue);
+    stats->running = c->running;
+    stats->max_running = c->max_running;
+    stats->n_done = c->n_done;
+    stats->n_rejected = c->n_rejected;
+    stats->wait_time = c->wait_time;
+    pthread_mutex_unlock (&ex->lock);
+}
+
+const char *
+seaf_job_class_name (SeafJobClass cls)
+{
+    return class_names[cls];
+}
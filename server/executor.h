@@ -0,0 +1,79 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_EXECUTOR_H
+#define SEAF_EXECUTOR_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Background jobs of all managers, and the password hashing of logins,
+ * run on one set of worker threads.
+ * Classes are listed from the most to the least urgent. An idle worker
+ * runs the oldest job of the most urgent class that is under its quota.
+ */
+typedef enum SeafJobClass {
+    /* Password hashing of logins, the rpc caller waits for the result. */
+    SEAF_JOB_CRYPTO = 0,
+    /* Indexing of uploaded files, the client polls for the result. */
+    SEAF_JOB_INDEX,
+    /* Checks before packing a zip download. */
+    SEAF_JOB_ZIP,
+    /* Asynchronous copy and move between repos. */
+    SEAF_JOB_COPY,
+    /* Repo size computation. */
+    SEAF_JOB_SIZE,
+    /* Deferred commit descriptions. */
+    SEAF_JOB_DESC,
+    /* Expiry of the library trash and indexing of deleted entries. */
+    SEAF_JOB_TRASH,
+    SEAF_JOB_N_CLASSES,
+} SeafJobClass;
+
+typedef void (*SeafJobFunc) (void *data, void *user_data);
+
+typedef struct SeafExecutor SeafExecutor;
+
+SeafExecutor *
+seaf_executor_new (struct _SeafileSession *session);
+
+/* Sets the number of jobs of @cls that may run at the same time. */
+void
+seaf_executor_set_max_running (SeafExecutor *ex, SeafJobClass cls,
+                               int max_running);
+
+void
+seaf_executor_push (SeafExecutor *ex, SeafJobClass cls,
+                    SeafJobFunc func, void *data, void *user_data);
+
+/*
+ * Like seaf_executor_push(), but returns -1 without queueing the job if
+ * @max_queued jobs of @cls are already waiting.
+ */
+int
+seaf_executor_try_push (SeafExecutor *ex, SeafJobClass cls, guint max_queued,
+                        SeafJobFunc func, void *data, void *user_data);
+
+/* Jobs of @cls waiting for a worker. */
+guint
+seaf_executor_get_queued (SeafExecutor *ex, SeafJobClass cls);
+
+typedef struct SeafExecutorStats {
+    guint queued;
+    int running;
+    int max_running;
+    guint64 n_done;
+    guint64 n_rejected;
+    /* Total time the finished jobs waited for a worker, in microseconds. */
+    gint64 wait_time;
+} SeafExecutorStats;
+
+void
+seaf_executor_get_stats (SeafExecutor *ex, SeafJobClass cls,
+                         SeafExecutorStats *stats);
+
+const char *
+seaf_job_class_name (SeafJobClass cls);
+
+#endif
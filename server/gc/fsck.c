@@ -1,21 +1,38 @@
 #include "common.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "seafile-session.h"
 #include "log.h"
 #include "utils.h"
+#include "id-set.h"
+#include "phase-stats.h"
 
 #include "fsck.h"
 
 typedef struct FsckData {
     gboolean repair;
     SeafRepo *repo;
-    GHashTable *existing_blocks;
+    /* Blocks found intact. Filled by the verify threads under lock. */
+    IdSet *existing_blocks;
+    IdSet *damaged_blocks;
+    /* Dirs whose whole subtree was found intact. */
+    IdSet *checked_dirs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending_blocks;
+    gint64 last_checkpoint;
     GList *repaired_files;
     GList *repaired_folders;
+    /* Dirs and files looked at by the check of the tree. */
+    gint64 checked_objs;
 } FsckData;
 
+/* Shared by all repos, so it bounds the block reads of the whole run. */
+static GThreadPool *verify_pool;
+static gboolean resume_fsck;
+
 typedef struct CheckAndRecoverRepoObj {
     char *repo_id;
     gboolean repair;
@@ -66,6 +83,273 @@ fsck_verify_seafobj (const char *store_id,
     return valid;
 }
 
+/*
+ * Checkpoints of a repo are kept in <seafile_dir>/fsck-state/<repo_id>: the
+ * raw ids of the checked dirs, then those of the intact blocks. Since ids
+ * are hashes of the content, they stay valid when the repo changes. The
+ * file is written every FSCK_CHECKPOINT_INTERVAL seconds and removed when
+ * the repo is done, so --resume only skips work of an interrupted run.
+ */
+
+#define FSCK_STATE_DIR "fsck-state"
+#define FSCK_STATE_MAGIC "SFCK"
+#define FSCK_STATE_VERSION 1
+#define FSCK_CHECKPOINT_INTERVAL 60
+
+typedef struct FsckStateHeader {
+    char magic[4];
+    guint32 version;
+    guint64 n_dirs;
+    guint64 n_blocks;
+} FsckStateHeader;
+
+static char *
+fsck_state_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, FSCK_STATE_DIR, repo_id, NULL);
+}
+
+static void
+load_checkpoint (FsckData *fsck_data)
+{
+    const char *repo_id = fsck_data->repo->id;
+    char *path = fsck_state_path (repo_id);
+    char *contents = NULL;
+    gsize len;
+    FsckStateHeader hdr;
+    const char *ptr;
+    guint64 i;
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS) ||
+        !g_file_get_contents (path, &contents, &len, NULL))
+        goto out;
+
+    if (len < sizeof(hdr))
+        goto invalid;
+    memcpy (&hdr, contents, sizeof(hdr));
+    if (memcmp (hdr.magic, FSCK_STATE_MAGIC, 4) != 0 ||
+        hdr.version != FSCK_STATE_VERSION ||
+        len != sizeof(hdr) + (hdr.n_dirs + hdr.n_blocks) * ID_SET_RAW_LEN)
+        goto invalid;
+
+    ptr = contents + sizeof(hdr);
+    for (i = 0; i < hdr.n_dirs; i++, ptr += ID_SET_RAW_LEN)
+        id_set_add_raw (fsck_data->checked_dirs, (const unsigned char *)ptr);
+    for (i = 0; i < hdr.n_blocks; i++, ptr += ID_SET_RAW_LEN)
+        id_set_add_raw (fsck_data->existing_blocks, (const unsigned char *)ptr);
+
+    seaf_message ("Resuming fsck of repo %.8s, %"G_GUINT64_FORMAT" dirs and "
+                  "%"G_GUINT64_FORMAT" blocks were checked.\n",
+                  repo_id, hdr.n_dirs, hdr.n_blocks);
+    goto out;
+
+invalid:
+    seaf_warning ("Fsck checkpoint %s is invalid, ignore it.\n", path);
+out:
+    g_free (contents);
+    g_free (path);
+}
+
+static void
+append_raw_id (const unsigned char *raw, void *buf)
+{
+    g_string_append_len ((GString *)buf, (const char *)raw, ID_SET_RAW_LEN);
+}
+
+static void
+save_checkpoint (FsckData *fsck_data)
+{
+    char *dir = g_build_filename (seaf->seaf_dir, FSCK_STATE_DIR, NULL);
+    char *path = fsck_state_path (fsck_data->repo->id);
+    FsckStateHeader hdr;
+    GString *buf;
+    GError *error = NULL;
+
+    fsck_data->last_checkpoint = (gint64)time(NULL);
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create fsck state dir %s.\n", dir);
+        goto out;
+    }
+
+    pthread_mutex_lock (&fsck_data->lock);
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, FSCK_STATE_MAGIC, 4);
+    hdr.version = FSCK_STATE_VERSION;
+    hdr.n_dirs = id_set_size (fsck_data->checked_dirs);
+    hdr.n_blocks = id_set_size (fsck_data->existing_blocks);
+
+    buf = g_string_sized_new (sizeof(hdr) +
+                              (hdr.n_dirs + hdr.n_blocks) * ID_SET_RAW_LEN);
+    g_string_append_len (buf, (const char *)&hdr, sizeof(hdr));
+    id_set_foreach (fsck_data->checked_dirs, append_raw_id, buf);
+    id_set_foreach (fsck_data->existing_blocks, append_raw_id, buf);
+
+    pthread_mutex_unlock (&fsck_data->lock);
+
+    if (!g_file_set_contents (path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to write fsck checkpoint %s: %s.\n",
+                      path, error->message);
+        g_clear_error (&error);
+    }
+    g_string_free (buf, TRUE);
+
+out:
+    g_free (dir);
+    g_free (path);
+}
+
+static void
+maybe_save_checkpoint (FsckData *fsck_data)
+{
+    if ((gint64)time(NULL) - fsck_data->last_checkpoint >= FSCK_CHECKPOINT_INTERVAL)
+        save_checkpoint (fsck_data);
+}
+
+static void
+remove_checkpoint (const char *repo_id)
+{
+    char *path = fsck_state_path (repo_id);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) && seaf_util_unlink (path) < 0)
+        seaf_warning ("Failed to remove fsck checkpoint %s.\n", path);
+    g_free (path);
+}
+
+/*
+ * Before the tree is checked, all its blocks are verified by verify_pool.
+ * Intact blocks are added to existing_blocks, so the check only has to
+ * look at the missing or damaged ones, and report them. Blocks are queued
+ * as files are read, with at most MAX_PENDING_BLOCKS in flight per repo.
+ */
+
+#define MAX_PENDING_BLOCKS 1024
+
+typedef struct VerifyBlockTask {
+    FsckData *fsck_data;
+    char block_id[41];
+} VerifyBlockTask;
+
+static void
+verify_block_task (gpointer data, gpointer user_data)
+{
+    VerifyBlockTask *task = data;
+    FsckData *fsck_data = task->fsck_data;
+    SeafRepo *repo = fsck_data->repo;
+    gboolean io_error = FALSE;
+    gboolean ok;
+
+    ok = seaf_block_manager_block_exists (seaf->block_mgr,
+                                          repo->store_id, repo->version,
+                                          task->block_id) &&
+        seaf_block_manager_verify_block (seaf->block_mgr,
+                                         repo->store_id, repo->version,
+                                         task->block_id, &io_error);
+
+    pthread_mutex_lock (&fsck_data->lock);
+    if (ok)
+        id_set_add (fsck_data->existing_blocks, task->block_id);
+    --fsck_data->pending_blocks;
+    pthread_cond_signal (&fsck_data->cond);
+    pthread_mutex_unlock (&fsck_data->lock);
+
+    g_free (task);
+}
+
+typedef struct VerifyTreeData {
+    FsckData *fsck_data;
+    IdSet *visited;
+    IdSet *queued_blocks;
+} VerifyTreeData;
+
+static gboolean
+queue_blocks (SeafFSManager *mgr,
+              const char *store_id,
+              int version,
+              const char *obj_id,
+              int type,
+              void *user_data,
+              gboolean *stop)
+{
+    VerifyTreeData *vdata = user_data;
+    FsckData *fsck_data = vdata->fsck_data;
+    Seafile *seafile;
+    VerifyBlockTask *task;
+    gboolean verified;
+    int i;
+
+    if (id_set_add (vdata->visited, obj_id) == 0 ||
+        id_set_contains (fsck_data->checked_dirs, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (type != SEAF_METADATA_TYPE_FILE)
+        return TRUE;
+
+    /* Damaged files are reported when the tree is checked. */
+    seafile = seaf_fs_manager_get_seafile (mgr, store_id, version, obj_id);
+    if (!seafile)
+        return TRUE;
+
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        if (id_set_add (vdata->queued_blocks, seafile->blk_sha1s[i]) != 1)
+            continue;
+
+        pthread_mutex_lock (&fsck_data->lock);
+        verified = id_set_contains (fsck_data->existing_blocks,
+                                    seafile->blk_sha1s[i]);
+        while (!verified && fsck_data->pending_blocks >= MAX_PENDING_BLOCKS)
+            pthread_cond_wait (&fsck_data->cond, &fsck_data->lock);
+        if (!verified)
+            ++fsck_data->pending_blocks;
+        pthread_mutex_unlock (&fsck_data->lock);
+
+        if (verified)
+            continue;
+
+        task = g_new0 (VerifyBlockTask, 1);
+        task->fsck_data = fsck_data;
+        memcpy (task->block_id, seafile->blk_sha1s[i], 40);
+        g_thread_pool_push (verify_pool, task, NULL);
+    }
+
+    seafile_unref (seafile);
+
+    maybe_save_checkpoint (fsck_data);
+
+    return TRUE;
+}
+
+static void
+verify_tree_blocks (const char *root_id, FsckData *fsck_data)
+{
+    SeafRepo *repo = fsck_data->repo;
+    VerifyTreeData vdata;
+    gint64 start = g_get_monotonic_time ();
+
+    vdata.fsck_data = fsck_data;
+    vdata.visited = id_set_new (0);
+    vdata.queued_blocks = id_set_new (0);
+
+    seaf_fs_manager_traverse_tree (seaf->fs_mgr, repo->store_id, repo->version,
+                                   root_id, queue_blocks, &vdata, TRUE);
+
+    pthread_mutex_lock (&fsck_data->lock);
+    while (fsck_data->pending_blocks > 0)
+        pthread_cond_wait (&fsck_data->cond, &fsck_data->lock);
+    pthread_mutex_unlock (&fsck_data->lock);
+
+    seaf_message ("Verified %"G_GUINT64_FORMAT" blocks of repo %.8s.\n",
+                  id_set_size (vdata.queued_blocks), repo->id);
+    phase_stats_add (PHASE_FSCK_VERIFY, g_get_monotonic_time () - start,
+                     id_set_size (vdata.queued_blocks));
+
+    id_set_free (vdata.visited);
+    id_set_free (vdata.queued_blocks);
+}
+
 static int
 check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
 {
@@ -73,7 +357,6 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
     int i;
     char *block_id;
     int ret = 0;
-    int dummy;
 
     gboolean ok = TRUE;
     SeafRepo *repo = fsck_data->repo;
@@ -86,9 +369,15 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
     for (i = 0; i < seafile->n_blocks; ++i) {
         block_id = seafile->blk_sha1s[i];
 
-        if (g_hash_table_lookup (fsck_data->existing_blocks, block_id))
+        if (id_set_contains (fsck_data->existing_blocks, block_id))
             continue;
 
+        if (id_set_contains (fsck_data->damaged_blocks, block_id)) {
+            seaf_message ("Repo[%.8s] block %s is damaged.\n", repo->id, block_id);
+            ret = -1;
+            continue;
+        }
+
         if (!seaf_block_manager_block_exists (seaf->block_mgr,
                                               store_id, version,
                                               block_id)) {
@@ -117,11 +406,13 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
                 } else {
                     seaf_message ("Repo[%.8s] block %s is damaged.\n", repo->id, block_id);
                 }
+                id_set_add (fsck_data->damaged_blocks, block_id);
                 ret = -1;
             }
+            continue;
         }
 
-        g_hash_table_insert (fsck_data->existing_blocks, g_strdup(block_id), &dummy);
+        id_set_add (fsck_data->existing_blocks, block_id);
     }
 
     seafile_unref (seafile);
@@ -145,11 +436,17 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
     int version = fsck_data->repo->version;
     gboolean is_corrupted = FALSE;
 
+    if (id_set_contains (fsck_data->checked_dirs, id))
+        return g_strdup (id);
+
     dir = seaf_fs_manager_get_seafdir (mgr, store_id, version, id);
+    ++fsck_data->checked_objs;
 
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = p->data;
         io_error = FALSE;
+        if (S_ISREG(seaf_dent->mode))
+            ++fsck_data->checked_objs;
 
         if (S_ISREG(seaf_dent->mode)) {
             path = g_strdup_printf ("%s%s", parent_dir, seaf_dent->name);
@@ -263,6 +560,8 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
         dir->entries = NULL;
     } else {
         dir_id = g_strdup (dir->dir_id);
+        id_set_add (fsck_data->checked_dirs, dir_id);
+        maybe_save_checkpoint (fsck_data);
     }
 
 out:
@@ -417,6 +716,7 @@ check_and_recover_repo (SeafRepo *repo, gboolean reset, gboolean repair)
     FsckData fsck_data;
     SeafCommit *rep_commit = NULL;
     char *root_id = NULL;
+    gint64 start;
 
     seaf_message ("Checking file system integrity of repo %s(%.8s)...\n",
                   repo->name, repo->id);
@@ -432,11 +732,33 @@ check_and_recover_repo (SeafRepo *repo, gboolean reset, gboolean repair)
     memset (&fsck_data, 0, sizeof(fsck_data));
     fsck_data.repair = repair;
     fsck_data.repo = repo;
-    fsck_data.existing_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                       g_free, NULL);
+    fsck_data.existing_blocks = id_set_new (0);
+    fsck_data.damaged_blocks = id_set_new (0);
+    fsck_data.checked_dirs = id_set_new (0);
+    pthread_mutex_init (&fsck_data.lock, NULL);
+    pthread_cond_init (&fsck_data.cond, NULL);
+    fsck_data.last_checkpoint = (gint64)time(NULL);
+
+    if (resume_fsck)
+        load_checkpoint (&fsck_data);
 
+    if (verify_pool)
+        verify_tree_blocks (rep_commit->root_id, &fsck_data);
+
+    start = g_get_monotonic_time ();
     root_id = fsck_check_dir_recursive (rep_commit->root_id, "/", &fsck_data);
-    g_hash_table_destroy (fsck_data.existing_blocks);
+    phase_stats_add (PHASE_FSCK_CHECK, g_get_monotonic_time () - start,
+                     fsck_data.checked_objs);
+    if (root_id == NULL)
+        save_checkpoint (&fsck_data);
+    else
+        remove_checkpoint (repo->id);
+
+    id_set_free (fsck_data.existing_blocks);
+    id_set_free (fsck_data.damaged_blocks);
+    id_set_free (fsck_data.checked_dirs);
+    pthread_mutex_destroy (&fsck_data.lock);
+    pthread_cond_destroy (&fsck_data.cond);
     if (root_id == NULL) {
         goto out;
     }
@@ -705,13 +1027,28 @@ repair_repos (GList *repo_id_list, gboolean repair, int max_thread_num)
 }
 
 int
-seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num)
+seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num,
+           int io_thread_num, gboolean resume)
 {
     if (!repo_id_list)
         repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
 
+    resume_fsck = resume;
+    if (io_thread_num > 0) {
+        verify_pool = g_thread_pool_new (verify_block_task, NULL,
+                                         io_thread_num, FALSE, NULL);
+        if (!verify_pool)
+            seaf_warning ("Failed to create block verify thread pool, "
+                          "verify blocks serially.\n");
+    }
+
     repair_repos (repo_id_list, repair, max_thread_num);
 
+    if (verify_pool) {
+        g_thread_pool_free (verify_pool, FALSE, TRUE);
+        verify_pool = NULL;
+    }
+
     while (repo_id_list) {
         g_free (repo_id_list->data);
         repo_id_list = g_list_delete_link (repo_id_list, repo_id_list);
@@ -835,31 +1172,98 @@ out:
     return ret;
 }*/
 
-static gboolean
+/*
+ * Files are written by export_pool, if threads are given, while the calling
+ * thread walks the dirs and creates them. At most MAX_PENDING_EXPORTS files
+ * are queued, so the walk doesn't run ahead of the writers. Files are
+ * fsync'ed unless --no-fsync is given, which is much faster for bulk
+ * restores that are checked afterwards anyway.
+ */
+
+#define MAX_PENDING_EXPORTS 1024
+#define EXPORT_REPORT_INTERVAL 10
+
+typedef struct ExportStats {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    guint64 files;
+    guint64 failed;
+    guint64 bytes;
+    gint64 start_time;
+    gint64 last_report;
+} ExportStats;
+
+typedef struct ExportFileTask {
+    char repo_id[37];
+    char file_id[41];
+    gint64 mtime;
+    char *path;
+} ExportFileTask;
+
+static GThreadPool *export_pool;
+static gboolean export_fsync = TRUE;
+static ExportStats export_stats = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+/* Called with export_stats.lock held. */
+static void
+report_export_progress (gint64 now)
+{
+    ExportStats *st = &export_stats;
+    gint64 elapsed = now - st->start_time;
+
+    st->last_report = now;
+    seaf_message ("Exported %"G_GUINT64_FORMAT" files (%"G_GUINT64_FORMAT" failed), "
+                  "%.1f MB, %.1f MB/s.\n",
+                  st->files, st->failed, st->bytes / 1048576.0,
+                  elapsed > 0 ? st->bytes / 1048576.0 / elapsed : 0.0);
+}
+
+static void
+export_file_done (gint64 bytes)
+{
+    ExportStats *st = &export_stats;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&st->lock);
+    if (bytes < 0) {
+        ++st->failed;
+    } else {
+        ++st->files;
+        st->bytes += bytes;
+    }
+    if (now - st->last_report >= EXPORT_REPORT_INTERVAL)
+        report_export_progress (now);
+    pthread_mutex_unlock (&st->lock);
+}
+
+/* Returns the number of bytes written, or -1 on failure. */
+static gint64
 write_nonenc_block_to_file (const char *repo_id,
                             int version,
                             const char *block_id,
-                            const gint64 mtime,
                             int fd,
                             const char *path)
 {
     BlockHandle *handle;
     char buf[64 * 1024];
-    gboolean ret = TRUE;
+    gint64 ret = 0;
     int n;
 
     handle = seaf_block_manager_open_block (seaf->block_mgr,
                                             repo_id, version,
                                             block_id, BLOCK_READ);
     if (!handle) {
-        return FALSE;
+        return -1;
     }
 
     while (1) {
         n = seaf_block_manager_read_block (seaf->block_mgr, handle, buf, sizeof(buf));
         if (n < 0) {
             seaf_warning ("Failed to read block %s.\n", block_id);
-            ret = FALSE;
+            ret = -1;
             break;
         } else if (n == 0) {
             break;
@@ -868,18 +1272,10 @@ write_nonenc_block_to_file (const char *repo_id,
         if (writen (fd, buf, n) != n) {
             seaf_warning ("Failed to write block %s to file %s.\n",
                           block_id, path);
-            ret = FALSE;
+            ret = -1;
             break;
         }
-    }
-
-    struct utimbuf timebuf;
-
-    timebuf.modtime = mtime;
-    timebuf.actime = mtime;
-
-    if(utime(path, &timebuf) == -1) {
-      seaf_warning ("Current file (%s) lose it\"s mtime.\n", path);
+        ret += n;
     }
 
     seaf_block_manager_close_block (seaf->block_mgr, handle);
@@ -900,10 +1296,13 @@ create_file (const char *repo_id,
     Seafile *seafile;
     gboolean ret = TRUE;
     int version = 1;
+    gint64 n, bytes = 0;
+    struct utimbuf timebuf;
 
     fd = g_open (path, O_CREAT | O_WRONLY | O_BINARY, 0666);
     if (fd < 0) {
         seaf_warning ("Open file %s failed: %s.\n", path, strerror (errno));
+        export_file_done (-1);
         return;
     }
 
@@ -917,11 +1316,18 @@ create_file (const char *repo_id,
     for (i = 0; i < seafile->n_blocks; ++i) {
         block_id = seafile->blk_sha1s[i];
 
-        ret = write_nonenc_block_to_file (repo_id, version, block_id, mtime,
-                                          fd, path);
-        if (!ret) {
+        n = write_nonenc_block_to_file (repo_id, version, block_id,
+                                        fd, path);
+        if (n < 0) {
+            ret = FALSE;
             break;
         }
+        bytes += n;
+    }
+
+    if (ret && export_fsync && fsync (fd) < 0) {
+        seaf_warning ("Failed to fsync file %s: %s.\n", path, strerror (errno));
+        ret = FALSE;
     }
 
 out:
@@ -932,9 +1338,65 @@ out:
         }
         seaf_message ("Failed to export file %s.\n", path);
     } else {
+        timebuf.modtime = mtime;
+        timebuf.actime = mtime;
+        if (utime (path, &timebuf) == -1) {
+            seaf_warning ("Current file (%s) lose it\"s mtime.\n", path);
+        }
         seaf_message ("Export file %s.\n", path);
     }
     seafile_unref (seafile);
+
+    export_file_done (ret ? bytes : -1);
+}
+
+static void
+export_file_task (gpointer data, gpointer user_data)
+{
+    ExportFileTask *task = data;
+
+    create_file (task->repo_id, task->file_id, task->mtime, task->path);
+
+    pthread_mutex_lock (&export_stats.lock);
+    --export_stats.pending;
+    pthread_cond_signal (&export_stats.cond);
+    pthread_mutex_unlock (&export_stats.lock);
+
+    g_free (task->path);
+    g_free (task);
+}
+
+static void
+queue_export_file (const char *repo_id, SeafDirent *dent, const char *path)
+{
+    ExportFileTask *task;
+
+    if (!export_pool) {
+        create_file (repo_id, dent->id, dent->mtime, path);
+        return;
+    }
+
+    pthread_mutex_lock (&export_stats.lock);
+    while (export_stats.pending >= MAX_PENDING_EXPORTS)
+        pthread_cond_wait (&export_stats.cond, &export_stats.lock);
+    ++export_stats.pending;
+    pthread_mutex_unlock (&export_stats.lock);
+
+    task = g_new0 (ExportFileTask, 1);
+    memcpy (task->repo_id, repo_id, 36);
+    memcpy (task->file_id, dent->id, 40);
+    task->mtime = dent->mtime;
+    task->path = g_strdup (path);
+    g_thread_pool_push (export_pool, task, NULL);
+}
+
+static void
+wait_for_exports ()
+{
+    pthread_mutex_lock (&export_stats.lock);
+    while (export_stats.pending > 0)
+        pthread_cond_wait (&export_stats.cond, &export_stats.lock);
+    pthread_mutex_unlock (&export_stats.lock);
 }
 
 static void
@@ -961,7 +1423,7 @@ export_repo_files_recursive (const char *repo_id,
 
         if (S_ISREG(seaf_dent->mode)) {
             // create file
-            create_file (repo_id, seaf_dent->id, seaf_dent->mtime, path);
+            queue_export_file (repo_id, seaf_dent, path);
         } else if (S_ISDIR(seaf_dent->mode)) {
             if (g_mkdir (path, 0777) < 0) {
                 seaf_warning ("Failed to mkdir %s: %s.\n", path,
@@ -1081,6 +1543,7 @@ export_repo_files (const char *repo_id,
     }
 
     export_repo_files_recursive (repo_id, commit->root_id, export_path);
+    wait_for_exports ();
 
     seaf_message ("Finish exporting files for repo %.8s.\n\n", repo_id);
 
@@ -1123,7 +1586,8 @@ print_enc_repo (gpointer key, gpointer value, gpointer user_data)
 }
 
 void
-export_file (GList *repo_id_list, const char *seafile_dir, char *export_path)
+export_file (GList *repo_id_list, const char *seafile_dir, char *export_path,
+             int max_thread_num, gboolean no_fsync)
 {
     struct stat dir_st;
 
@@ -1153,6 +1617,16 @@ export_file (GList *repo_id_list, const char *seafile_dir, char *export_path)
             return;
     }
 
+    export_fsync = !no_fsync;
+    if (max_thread_num > 0) {
+        export_pool = g_thread_pool_new (export_file_task, NULL,
+                                         max_thread_num, FALSE, NULL);
+        if (!export_pool)
+            seaf_warning ("Failed to create export thread pool, "
+                          "export files serially.\n");
+    }
+    export_stats.start_time = export_stats.last_report = (gint64)time(NULL);
+
     GList *iter = repo_id_list;
     char *repo_id;
     GHashTable *enc_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
@@ -1168,6 +1642,14 @@ export_file (GList *repo_id_list, const char *seafile_dir, char *export_path)
         export_repo_files (repo_id, export_path, enc_repos);
     }
 
+    if (export_pool) {
+        g_thread_pool_free (export_pool, FALSE, TRUE);
+        export_pool = NULL;
+    }
+    pthread_mutex_lock (&export_stats.lock);
+    report_export_progress ((gint64)time(NULL));
+    pthread_mutex_unlock (&export_stats.lock);
+
     if (g_hash_table_size (enc_repos) > 0) {
         seaf_message ("The following repos are encrypted and are not exported:\n");
         g_hash_table_foreach (enc_repos, print_enc_repo, NULL);
@@ -2,8 +2,10 @@
 #define SEAF_FSCK_H
 
 int
-seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num);
+seaf_fsck (GList *repo_id_list, gboolean repair, int max_thread_num,
+           int io_thread_num, gboolean resume);
 
-void export_file (GList *repo_id_list, const char *seafile_dir, char *export_path);
+void export_file (GList *repo_id_list, const char *seafile_dir, char *export_path,
+                  int max_thread_num, gboolean no_fsync);
 
 #endif
@@ -2,52 +2,58 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "bloom-filter.h"
+#include "id-set.h"
 #include "gc-core.h"
+#include "gc-state.h"
+#include "phase-stats.h"
+#include "file-rev-index.h"
 #include "utils.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
-#define MAX_BF_SIZE (((size_t)1) << 29)   /* 64 MB */
+#define GC_INDEX_FPR 0.01
+#define MAX_GC_INDEX_SIZE (((size_t)1) << 30)   /* 1 GB */
 
 /*
- * The number of bits in the bloom filter is 4 times the number of all blocks.
- * Let m be the bits in the bf, n be the number of blocks to be added to the bf
- * (the number of live blocks), and k = 3 (closed to optimal for m/n = 4),
- * the probability of false-positive is
- *
- *     p = (1 - e^(-kn/m))^k = 0.15
- *
- * Because m = 4 * total_blocks >= 4 * (live blocks) = 4n, we should have p <= 0.15.
- * Put it another way, we'll clean up at least 85% dead blocks in each gc operation.
- * See http://en.wikipedia.org/wiki/Bloom_filter.
- *
- * Supose we have 8TB space, and the avg block size is 1MB, we'll have 8M blocks, then
- * the size of bf is (8M * 4)/8 = 4MB.
+ * Live ids are kept in a blocked bloom filter sized for a false positive rate
+ * of 1%, that is about 10 bits per object with k = 7. So we'll clean up about
+ * 99% dead blocks in each gc operation. All bits of an id lie in one 64-byte
+ * block, so marking and checking an object costs a single cache miss.
  *
- * If total_blocks is a small number (e.g. < 100), we should try to clean all dead blocks.
- * So we set the minimal size of the bf to 1KB.
+ * The filter is sized by the total number of objects, which is no less than
+ * the number of live objects, so the actual rate is lower. Supose we have 8TB
+ * space, and the avg block size is 1MB, we'll have 8M blocks, then the size
+ * of the index is about 10MB. With more than about 800M objects the index is
+ * capped at 1GB, and the rate rises. The rate estimated from the filled
+ * index is logged after marking.
  */
-static Bloom *
+static BlockedBloom *
 alloc_gc_index (guint64 total_objs)
 {
-    size_t size;
+    BlockedBloom *index;
 
-    size = (size_t) MAX(total_objs << 2, 1 << 13);
-    size = MIN (size, MAX_BF_SIZE);
+    index = blocked_bloom_create (total_objs, GC_INDEX_FPR, MAX_GC_INDEX_SIZE);
+    if (!index)
+        return NULL;
 
-    seaf_message ("GC index size is %u Byte.\n", (int)size >> 3);
+    seaf_message ("GC index size is %"G_GUINT64_FORMAT" Byte, %d hashes.\n",
+                  (guint64)blocked_bloom_size (index), index->k);
 
-    return bloom_create (size, 3, 0);
+    return index;
 }
 
 typedef struct {
     SeafRepo *repo;
-    Bloom *blocks_index;
-    Bloom *fs_index;
-    GHashTable *visited;
+    BlockedBloom *blocks_index;
+    BlockedBloom *fs_index;
+    IdSet *visited;
+    /* Commits marked by earlier passes of an online GC. */
+    IdSet *marked_commits;
 
     /* > 0: keep a period of history;
      * == 0: only keep data in head commit;
@@ -61,13 +67,20 @@ typedef struct {
 
     int verbose;
     gint64 traversed_fs_objs;
+    /* Of all commits, traversed_fs_objs is per commit. */
+    gint64 marked_fs_objs;
+
+    /* Live set being marked, NULL if it's not kept. */
+    GCState *state;
+    /* Whether the state holds the live set marked by the last GC. */
+    gboolean incremental;
 } GCData;
 
 static int
 add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
 {
     SeafRepo *repo = data->repo;
-    Bloom *blocks_index = data->blocks_index;
+    BlockedBloom *blocks_index = data->blocks_index;
     Seafile *seafile;
     int i;
 
@@ -78,7 +91,9 @@ add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        bloom_add (blocks_index, seafile->blk_sha1s[i]);
+        blocked_bloom_add (blocks_index, seafile->blk_sha1s[i]);
+        if (data->state)
+            gc_state_add_block (data->state, seafile->blk_sha1s[i]);
         ++data->traversed_blocks;
     }
 
@@ -90,11 +105,12 @@ add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
 static void
 add_fs_to_index(GCData *data, const char *file_id)
 {
-    Bloom *fs_index = data->fs_index;
+    BlockedBloom *fs_index = data->fs_index;
     if (fs_index) {
-        bloom_add (fs_index, file_id);
+        blocked_bloom_add (fs_index, file_id);
     }
     ++(data->traversed_fs_objs);
+    ++(data->marked_fs_objs);
 }
 
 static gboolean
@@ -108,17 +124,20 @@ fs_callback (SeafFSManager *mgr,
 {
     GCData *data = user_data;
 
-    if (data->visited != NULL) {
-        if (g_hash_table_lookup (data->visited, obj_id) != NULL) {
-            *stop = TRUE;
-            return TRUE;
-        }
+    if (data->visited != NULL && id_set_add (data->visited, obj_id) == 0) {
+        *stop = TRUE;
+        return TRUE;
+    }
 
-        char *key = g_strdup(obj_id);
-        g_hash_table_replace (data->visited, key, key);
+    /* Marked by the last GC, along with everything below it. */
+    if (data->incremental && gc_state_has_fs (data->state, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
     }
 
     add_fs_to_index(data, obj_id);
+    if (data->state)
+        gc_state_add_fs (data->state, obj_id);
 
     if (type == SEAF_METADATA_TYPE_FILE &&
         add_blocks_to_index (mgr, data, obj_id) < 0)
@@ -133,6 +152,21 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
     GCData *data = vdata;
     int ret;
 
+    /* Marked along with its ancestors by the first pass. */
+    if (data->marked_commits &&
+        id_set_add (data->marked_commits, commit->commit_id) == 0) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    /* The last GC marked this commit and all its ancestors. */
+    if (data->incremental && gc_state_has_commit (data->state, commit->commit_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+    if (data->state)
+        gc_state_add_commit (data->state, commit->commit_id);
+
     if (data->truncate_time == 0)
     {
         *stop = TRUE;
@@ -154,7 +188,8 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
         data->traversed_head = TRUE;
 
     if (data->verbose)
-        seaf_message ("Traversing commit %.8s.\n", commit->commit_id);
+        seaf_message ("Traversing commit %.8s of repo %.8s.\n",
+                      commit->commit_id, data->repo->id);
 
     ++data->traversed_commits;
 
@@ -169,14 +204,21 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
         return FALSE;
 
     if (data->verbose)
-        seaf_message ("Traversed %"G_GINT64_FORMAT" fs objects.\n",
-                      data->traversed_fs_objs);
+        seaf_message ("Traversed %"G_GINT64_FORMAT" fs objects of repo %.8s.\n",
+                      data->traversed_fs_objs, data->repo->id);
 
     return TRUE;
 }
 
+/*
+ * @visited and @marked_commits are kept across the passes of an online GC,
+ * so that the last pass only traverses what was added since the first.
+ * Both are NULL otherwise.
+ */
 static gint64
-populate_gc_index_for_repo (SeafRepo *repo, Bloom *blocks_index, Bloom *fs_index, int verbose)
+populate_gc_index_for_repo (SeafRepo *repo, BlockedBloom *blocks_index, BlockedBloom *fs_index,
+                            GCState *state, gboolean incremental, int verbose,
+                            IdSet *visited, IdSet *marked_commits)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
@@ -198,8 +240,11 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *blocks_index, Bloom *fs_index
     data->repo = repo;
     data->blocks_index = blocks_index;
     data->fs_index = fs_index;
-    data->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data->visited = visited ? visited : id_set_new (0);
+    data->marked_commits = marked_commits;
     data->verbose = verbose;
+    data->state = state;
+    data->incremental = incremental;
 
     gint64 truncate_time = seaf_repo_manager_get_repo_truncate_time (repo->manager,
                                                                      repo->id);
@@ -223,13 +268,13 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *blocks_index, Bloom *fs_index
 
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
-        gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
-                                                                 repo->id,
-                                                                 repo->version,
-                                                                 branch->commit_id,
-                                                                 traverse_commit,
-                                                                 data,
-                                                                 FALSE);
+        gboolean res = seaf_commit_manager_traverse_commit_graph (seaf->commit_mgr,
+                                                                  repo->id,
+                                                                  repo->version,
+                                                                  branch->commit_id,
+                                                                  traverse_commit,
+                                                                  data,
+                                                                  FALSE);
         seaf_branch_unref (branch);
         if (!res) {
             ret = -1;
@@ -237,38 +282,112 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *blocks_index, Bloom *fs_index
         }
     }
 
-    seaf_message ("Traversed %d commits, %"G_GINT64_FORMAT" blocks.\n",
-                  data->traversed_commits, data->traversed_blocks);
-    ret = data->traversed_blocks;
+    seaf_message ("Traversed %d commits, %"G_GINT64_FORMAT" blocks of repo %.8s.\n",
+                  data->traversed_commits, data->traversed_blocks, repo->id);
+    if (ret == 0)
+        ret = data->traversed_blocks;
+    phase_stats_add (PHASE_GC_MARK, 0,
+                     data->traversed_commits + data->marked_fs_objs +
+                     data->traversed_blocks);
 
     g_list_free (branches);
-    g_hash_table_destroy (data->visited);
+    if (!visited)
+        id_set_free (data->visited);
     g_free (data);
 
     return ret;
 }
 
+/*
+ * Stores are listed on up to scan_threads threads, one fan-out directory
+ * per thread, so the callbacks below may run concurrently.
+ */
+#define DEFAULT_SCAN_THREADS 8
+static int scan_threads = DEFAULT_SCAN_THREADS;
+
+/* Dead blocks are removed in batches, with parallel unlinks. */
+#define REMOVE_BATCH_SIZE 256
+
 typedef struct {
-    Bloom *index;
+    BlockedBloom *index;
     int dry_run;
     guint64 removed_blocks;
+    /* Dead blocks written since then are kept. 0 to remove them all
+     * without stat'ing them. */
+    gint64 keep_since;
+    guint64 kept_blocks;
+    guint64 removed_bytes;
+
+    pthread_mutex_t lock;
+    char *batch[REMOVE_BATCH_SIZE];
+    int n_batch;
 } CheckBlocksData;
 
+static void
+remove_dead_blocks (const char *store_id, int version, char **block_ids, int n)
+{
+    int i;
+
+    if (seaf_block_manager_remove_blocks (seaf->block_mgr, store_id, version,
+                                          (const char **)block_ids, n) < 0)
+        seaf_warning ("GC: Failed to remove some dead blocks of store %.8s.\n",
+                      store_id);
+    for (i = 0; i < n; ++i)
+        g_free (block_ids[i]);
+}
+
 static gboolean
 check_block_liveness (const char *store_id, int version,
                       const char *block_id, void *vdata)
 {
     CheckBlocksData *data = vdata;
-    Bloom *index = data->index;
+    BlockedBloom *index = data->index;
+    BlockMetadata *bmd = NULL;
+    char *full_batch[REMOVE_BATCH_SIZE];
+    int n_full = 0;
+
+    if (blocked_bloom_test (index, block_id))
+        return TRUE;
+
+    if (data->keep_since > 0)
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             store_id, version, block_id);
 
-    if (!bloom_test (index, block_id)) {
-        data->removed_blocks++;
-        if (!data->dry_run)
-            seaf_block_manager_remove_block (seaf->block_mgr,
-                                             store_id, version,
-                                             block_id);
+    pthread_mutex_lock (&data->lock);
+    /* Blocks written since GC started may belong to commits made
+     * after the repo was marked.
+     */
+    if (bmd && bmd->ctime >= data->keep_since) {
+        data->kept_blocks++;
+        pthread_mutex_unlock (&data->lock);
+        g_free (bmd);
+        return TRUE;
+    }
+    if (bmd)
+        data->removed_bytes += bmd->size;
+    data->removed_blocks++;
+    if (!data->dry_run) {
+        data->batch[data->n_batch++] = g_strdup (block_id);
+        if (data->n_batch == REMOVE_BATCH_SIZE) {
+            memcpy (full_batch, data->batch, sizeof(full_batch));
+            n_full = data->n_batch;
+            data->n_batch = 0;
+        }
     }
+    pthread_mutex_unlock (&data->lock);
+    g_free (bmd);
+
+    if (n_full > 0)
+        remove_dead_blocks (store_id, version, full_batch, n_full);
+
+    return TRUE;
+}
 
+static gboolean
+count_block (const char *store_id, int version,
+             const char *block_id, void *vdata)
+{
+    g_atomic_int_inc ((gint *)vdata);
     return TRUE;
 }
 
@@ -276,7 +395,7 @@ check_block_liveness (const char *store_id, int version,
 
 static gint64
 check_existing_fs (char *store_id, int repo_version, GHashTable *exist_fs,
-                   Bloom *fs_index, int dry_run)
+                   BlockedBloom *fs_index, int dry_run)
 {
     GHashTableIter iter;
     gpointer key, value;
@@ -285,7 +404,7 @@ check_existing_fs (char *store_id, int repo_version, GHashTable *exist_fs,
     g_hash_table_iter_init (&iter, exist_fs);
 
     while (g_hash_table_iter_next (&iter, &key, &value)) {
-        if (!bloom_test (fs_index, (char *)key)) {
+        if (!blocked_bloom_test (fs_index, (char *)key)) {
             ret++;
             if (dry_run)
                 continue;
@@ -298,20 +417,29 @@ check_existing_fs (char *store_id, int repo_version, GHashTable *exist_fs,
     return ret;
 }
 
+typedef struct {
+    GHashTable *exist_fs;
+    pthread_mutex_t lock;
+} CollectFsData;
+
 static gboolean
 collect_exist_fs (const char *store_id, int version,
                    const char *fs_id, void *vdata)
 {
-    GHashTable *exist_fs = vdata;
+    CollectFsData *data = vdata;
     int dummy;
 
-    g_hash_table_replace (exist_fs, g_strdup (fs_id), &dummy);
+    pthread_mutex_lock (&data->lock);
+    g_hash_table_replace (data->exist_fs, g_strdup (fs_id), &dummy);
+    pthread_mutex_unlock (&data->lock);
 
     return TRUE;
 }
 
 static gint64
-populate_gc_index_for_virtual_repos (SeafRepo *repo, Bloom *blocks_index, Bloom *fs_index, int verbose)
+populate_gc_index_for_virtual_repos (SeafRepo *repo, BlockedBloom *blocks_index, BlockedBloom *fs_index,
+                                     GCState *state, gboolean incremental, int verbose,
+                                     IdSet *visited, IdSet *marked_commits)
 {
     GList *vrepo_ids = NULL, *ptr;
     char *repo_id;
@@ -330,7 +458,9 @@ populate_gc_index_for_virtual_repos (SeafRepo *repo, Bloom *blocks_index, Bloom
             goto out;
         }
 
-        scan_ret = populate_gc_index_for_repo (vrepo, blocks_index, fs_index, verbose);
+        scan_ret = populate_gc_index_for_repo (vrepo, blocks_index, fs_index,
+                                               state, incremental, verbose,
+                                               visited, marked_commits);
         seaf_repo_unref (vrepo);
         if (scan_ret < 0) {
             ret = -1;
@@ -344,34 +474,293 @@ out:
     return ret;
 }
 
+/*
+ * Forks share the store of the repo they were forked from, so a store is
+ * collected once for all the repos using it: by the repo it belongs to, or
+ * by its first fork once that repo is deleted. Objects are live while any of
+ * the repos, or their virtual repos, reach them.
+ */
+static gboolean
+collects_store (SeafRepo *repo)
+{
+    GList *fork_ids, *ptr;
+    gboolean db_err = FALSE;
+    gboolean ret = FALSE;
+
+    if (repo->is_virtual)
+        return FALSE;
+    if (strcmp (repo->store_id, repo->id) == 0)
+        return TRUE;
+    if (seaf_repo_manager_repo_exists (seaf->repo_mgr, repo->store_id))
+        return FALSE;
+
+    fork_ids = seaf_repo_manager_get_fork_ids_by_store (seaf->repo_mgr,
+                                                        repo->store_id, &db_err);
+    /* Forks in the trash, or deleted but not removed yet, are passed over. */
+    for (ptr = fork_ids; ptr; ptr = ptr->next) {
+        if (seaf_repo_manager_repo_exists (seaf->repo_mgr, ptr->data)) {
+            ret = (strcmp (ptr->data, repo->id) == 0);
+            break;
+        }
+    }
+    string_list_free (fork_ids);
+
+    return ret;
+}
+
+/*
+ * Returns the ids of the repos, other than virtual ones, using the store of
+ * repo. Returns 1 if one of them is in the trash: it may be restored, but
+ * what it reaches isn't known, so the store isn't collected.
+ */
+static int
+get_store_repo_ids (SeafRepo *repo, GList **repo_ids)
+{
+    GList *fork_ids, *ptr;
+    gboolean db_err = FALSE;
+    char *repo_id;
+    int ret = 0;
+
+    *repo_ids = NULL;
+
+    fork_ids = seaf_repo_manager_get_fork_ids_by_store (seaf->repo_mgr,
+                                                        repo->store_id, &db_err);
+    if (db_err)
+        return -1;
+
+    fork_ids = g_list_prepend (fork_ids, g_strdup (repo->store_id));
+    for (ptr = fork_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
+            *repo_ids = g_list_prepend (*repo_ids, g_strdup (repo_id));
+            continue;
+        }
+        if (seaf_repo_manager_repo_in_trash (seaf->repo_mgr, repo_id, &db_err)) {
+            seaf_message ("Repo %.8s using the store of repo %.8s is in the trash.\n",
+                          repo_id, repo->id);
+            ret = 1;
+            break;
+        }
+        if (db_err) {
+            ret = -1;
+            break;
+        }
+    }
+    string_list_free (fork_ids);
+
+    if (ret != 0) {
+        string_list_free (*repo_ids);
+        *repo_ids = NULL;
+    }
+    *repo_ids = g_list_reverse (*repo_ids);
+
+    return ret;
+}
+
+static gint64
+populate_gc_index_for_store (SeafRepo *repo, BlockedBloom *blocks_index, BlockedBloom *fs_index,
+                             GCState *state, gboolean incremental, int verbose,
+                             IdSet *visited, IdSet *marked_commits)
+{
+    GList *repo_ids = NULL, *ptr;
+    char *repo_id;
+    SeafRepo *srepo;
+    gint64 ret = 0;
+    gint64 scan_ret = 0;
+
+    /* Forks created since GC started are found by the second pass. */
+    if (get_store_repo_ids (repo, &repo_ids) != 0)
+        return -1;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (strcmp (repo_id, repo->id) == 0) {
+            srepo = repo;
+            seaf_repo_ref (srepo);
+        } else {
+            srepo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        }
+        if (!srepo) {
+            seaf_warning ("Failed to get repo %s.\n", repo_id);
+            ret = -1;
+            goto out;
+        }
+
+        scan_ret = populate_gc_index_for_repo (srepo, blocks_index, fs_index,
+                                               state, incremental, verbose,
+                                               visited, marked_commits);
+        if (scan_ret < 0) {
+            seaf_repo_unref (srepo);
+            ret = -1;
+            goto out;
+        }
+        ret += scan_ret;
+
+        /* Since virtual repos share fs and block store with the origin repo,
+         * it's necessary to do GC for them together.
+         */
+        scan_ret = populate_gc_index_for_virtual_repos (srepo, blocks_index, fs_index,
+                                                        state, incremental, verbose,
+                                                        visited, marked_commits);
+        seaf_repo_unref (srepo);
+        if (scan_ret < 0) {
+            ret = -1;
+            goto out;
+        }
+        ret += scan_ret;
+    }
+
+out:
+    string_list_free (repo_ids);
+    return ret;
+}
+
+/*
+ * Listing and deleting the blocks and fs objects of a store is what loads
+ * the storage backend. With several repos collected at once, at most
+ * io_slots of them scan their store at the same time. 0 means no limit.
+ */
+static int io_slots;
+static int io_slots_used;
+static pthread_mutex_t io_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_slots_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+io_slot_acquire ()
+{
+    if (io_slots <= 0)
+        return;
+
+    pthread_mutex_lock (&io_slots_lock);
+    while (io_slots_used >= io_slots)
+        pthread_cond_wait (&io_slots_cond, &io_slots_lock);
+    ++io_slots_used;
+    pthread_mutex_unlock (&io_slots_lock);
+}
+
+static void
+io_slot_release ()
+{
+    if (io_slots <= 0)
+        return;
+
+    pthread_mutex_lock (&io_slots_lock);
+    --io_slots_used;
+    pthread_cond_signal (&io_slots_cond);
+    pthread_mutex_unlock (&io_slots_lock);
+}
+
+/*
+ * When the repos of a store and their virtual repos keep their whole
+ * history, nothing
+ * reachable ever becomes garbage, so the live set marked by a GC stays
+ * live. The next GC starts from it and only traverses the commits added
+ * since, skipping the fs objects already marked. Once history is limited
+ * or truncated, commits do become garbage and every GC does a full mark.
+ * A full mark is also done every GC_FULL_MARK_INTERVAL, to drop what
+ * deleted branches and virtual repos kept alive.
+ */
+#define GC_FULL_MARK_INTERVAL (30 * 24 * 3600)
+
+static gboolean
+repo_keeps_full_history (const char *repo_id)
+{
+    GList *vrepo_ids, *ptr;
+    gboolean ret = TRUE;
+
+    if (seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr, repo_id) >= 0)
+        return FALSE;
+
+    vrepo_ids = seaf_repo_manager_get_virtual_repo_ids_by_origin (seaf->repo_mgr,
+                                                                  repo_id);
+    for (ptr = vrepo_ids; ptr; ptr = ptr->next) {
+        if (seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr,
+                                                      ptr->data) >= 0) {
+            ret = FALSE;
+            break;
+        }
+    }
+    string_list_free (vrepo_ids);
+
+    return ret;
+}
+
+static gboolean
+keeps_full_history (GList *repo_ids)
+{
+    GList *ptr;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        if (!repo_keeps_full_history (ptr->data))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+add_id_to_index (const char *id, void *user_data)
+{
+    blocked_bloom_add ((BlockedBloom *)user_data, id);
+}
+
 gint64
-gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
+gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs, int full_mark,
+            gint64 online_grace)
 {
-    Bloom *blocks_index = NULL;
-    Bloom *fs_index = NULL;
+    IdSet *visited = NULL, *marked_commits = NULL;
+    BlockedBloom *blocks_index = NULL;
+    BlockedBloom *fs_index = NULL;
     GHashTable *exist_fs = NULL;
+    CollectFsData collect;
+    gint n_blocks = 0;
     guint64 total_blocks;
     guint64 removed_blocks;
     guint64 reachable_blocks;
     guint64 total_fs = 0;
     gint64 removed_fs = 0;
+    GCState *state = NULL;
+    gboolean incremental = FALSE;
+    GList *repo_ids = NULL;
+    gint64 now = (gint64)time(NULL);
+    gint64 phase_start = g_get_monotonic_time ();
     gint64 ret;
 
-    total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr,
-                                                        repo->store_id, repo->version);
+    ret = get_store_repo_ids (repo, &repo_ids);
+    if (ret < 0) {
+        seaf_warning ("Failed to get the repos using the store of repo %.8s.\n",
+                      repo->id);
+        return -1;
+    } else if (ret > 0) {
+        seaf_message ("Skip GC of repo %.8s.\n\n", repo->id);
+        return 0;
+    }
+
+    seaf_block_manager_foreach_block_parallel (seaf->block_mgr,
+                                               repo->store_id, repo->version,
+                                               scan_threads, count_block,
+                                               &n_blocks);
+    total_blocks = (guint)n_blocks;
     reachable_blocks = 0;
 
     if (total_blocks == 0) {
-        seaf_message ("No blocks. Skip GC.\n\n");
+        seaf_message ("No blocks in repo %.8s. Skip GC.\n\n", repo->id);
+        string_list_free (repo_ids);
         return 0;
     }
 
     if (rm_fs) {
         exist_fs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-        ret = seaf_obj_store_foreach_obj (seaf->fs_mgr->obj_store,
-                                          repo->store_id, repo->version,
-                                          collect_exist_fs,
-                                          exist_fs);
+        collect.exist_fs = exist_fs;
+        pthread_mutex_init (&collect.lock, NULL);
+        io_slot_acquire ();
+        ret = seaf_obj_store_foreach_obj_parallel (seaf->fs_mgr->obj_store,
+                                                   repo->store_id, repo->version,
+                                                   scan_threads,
+                                                   collect_exist_fs,
+                                                   &collect);
+        io_slot_release ();
+        pthread_mutex_destroy (&collect.lock);
         if (ret < 0) {
             seaf_warning ("Failed to collect existing fs for repo %.8s, stop GC.\n\n",
                         repo->id);
@@ -380,11 +769,13 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
 
         total_fs = g_hash_table_size (exist_fs);
     }
+    phase_stats_add (PHASE_GC_SCAN, g_get_monotonic_time () - phase_start,
+                     total_blocks + total_fs);
 
     if (rm_fs)
-        seaf_message ("GC started. Total block number is %"G_GUINT64_FORMAT", total fs number is %"G_GUINT64_FORMAT".\n", total_blocks, total_fs);
+        seaf_message ("GC started for repo %.8s. Total block number is %"G_GUINT64_FORMAT", total fs number is %"G_GUINT64_FORMAT".\n", repo->id, total_blocks, total_fs);
     else
-        seaf_message ("GC started. Total block number is %"G_GUINT64_FORMAT".\n", total_blocks);
+        seaf_message ("GC started for repo %.8s. Total block number is %"G_GUINT64_FORMAT".\n", repo->id, total_blocks);
 
     /*
      * Store the index of live blocks in bloom filter to save memory.
@@ -409,51 +800,142 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
         }
     }
 
-    seaf_message ("Populating index.\n");
+    /* The live set is kept by store, since any of its repos may collect it. */
+    if (keeps_full_history (repo_ids)) {
+        if (!full_mark)
+            state = gc_state_load (repo->store_id);
+        if (state &&
+            now - gc_state_get_full_mark_time (state) < GC_FULL_MARK_INTERVAL) {
+            incremental = TRUE;
+        } else {
+            gc_state_free (state);
+            state = gc_state_new ();
+            gc_state_set_full_mark_time (state, now);
+        }
+    } else {
+        gc_state_remove (repo->store_id);
+    }
+
+    if (incremental) {
+        seaf_message ("Populating index of repo %.8s from %u commits marked "
+                      "by the last GC.\n", repo->id, gc_state_n_commits (state));
+        gc_state_foreach_block (state, add_id_to_index, blocks_index);
+        if (fs_index)
+            gc_state_foreach_fs (state, add_id_to_index, fs_index);
+        reachable_blocks += gc_state_n_blocks (state);
+    } else {
+        seaf_message ("Populating index of repo %.8s.\n", repo->id);
+    }
 
-    ret = populate_gc_index_for_repo (repo, blocks_index, fs_index, verbose);
+    if (online_grace > 0) {
+        visited = id_set_new (0);
+        marked_commits = id_set_new (0);
+    }
+
+    phase_start = g_get_monotonic_time ();
+
+    ret = populate_gc_index_for_store (repo, blocks_index, fs_index,
+                                       state, incremental, verbose,
+                                       visited, marked_commits);
     if (ret < 0)
         goto out;
-    
+
     reachable_blocks += ret;
 
-    /* Since virtual repos share fs and block store with the origin repo,
-     * it's necessary to do GC for them together.
+    /* Mark the commits made while the first pass ran. Only what they added
+     * is traversed.
      */
-    ret = populate_gc_index_for_virtual_repos (repo, blocks_index, fs_index, verbose);
-    if (ret < 0)
-        goto out;
+    if (online_grace > 0) {
+        seaf_message ("Marking commits added to repo %.8s during GC.\n", repo->id);
+        ret = populate_gc_index_for_store (repo, blocks_index, fs_index,
+                                           state, incremental, verbose,
+                                           visited, marked_commits);
+        if (ret < 0)
+            goto out;
+        reachable_blocks += ret;
+    }
 
-    reachable_blocks += ret;
+    phase_stats_add (PHASE_GC_MARK, g_get_monotonic_time () - phase_start, 0);
+
+    if (state && gc_state_save (state, repo->store_id) < 0)
+        seaf_warning ("GC: Failed to save the live set of repo %.8s, "
+                      "the next GC will do a full mark.\n", repo->id);
+
+    seaf_message ("Estimated false positive rate of the block index of repo %.8s "
+                  "is %.4f%%.\n", repo->id,
+                  blocked_bloom_estimate_fpr (blocks_index) * 100);
 
     if (!dry_run)
-        seaf_message ("Scanning and deleting unused blocks.\n");
+        seaf_message ("Scanning and deleting unused blocks of repo %.8s.\n", repo->id);
     else
-        seaf_message ("Scanning unused blocks.\n");
+        seaf_message ("Scanning unused blocks of repo %.8s.\n", repo->id);
 
     CheckBlocksData data;
+    memset (&data, 0, sizeof(data));
     data.index = blocks_index;
     data.dry_run = dry_run;
     data.removed_blocks = 0;
-
-    ret = seaf_block_manager_foreach_block (seaf->block_mgr,
-                                            repo->store_id, repo->version,
-                                            check_block_liveness,
-                                            &data);
+    /* Blocks uploaded before GC started may still wait for their commit,
+     * as long as an upload may take. Blocks an upload reuses are touched,
+     * so they count as uploaded then. Otherwise only those written during
+     * the mark are kept, if knowing it doesn't reach the storage.
+     */
+    if (online_grace > 0)
+        data.keep_since = now - online_grace;
+    else if (seaf->block_mgr->metadata_index)
+        data.keep_since = now;
+    else
+        data.keep_since = 0;
+    pthread_mutex_init (&data.lock, NULL);
+
+    phase_start = g_get_monotonic_time ();
+    io_slot_acquire ();
+    ret = seaf_block_manager_foreach_block_parallel (seaf->block_mgr,
+                                                     repo->store_id, repo->version,
+                                                     scan_threads,
+                                                     check_block_liveness,
+                                                     &data);
+    if (data.n_batch > 0)
+        remove_dead_blocks (repo->store_id, repo->version,
+                            data.batch, data.n_batch);
+    io_slot_release ();
+    pthread_mutex_destroy (&data.lock);
     if (ret < 0) {
         seaf_warning ("GC: Failed to clean dead blocks.\n");
         goto out;
     }
 
+    phase_stats_add (PHASE_GC_SWEEP, g_get_monotonic_time () - phase_start,
+                     total_blocks);
+
     removed_blocks = data.removed_blocks;
     ret = removed_blocks;
 
+    if (data.keep_since > 0)
+        seaf_message ("Unused blocks of repo %.8s take %"G_GUINT64_FORMAT" bytes. "
+                      "%"G_GUINT64_FORMAT" unused blocks written since %"G_GINT64_FORMAT
+                      " are kept.\n",
+                      repo->id, data.removed_bytes, data.kept_blocks, data.keep_since);
+
     if (rm_fs && total_fs > 0) {
+        phase_start = g_get_monotonic_time ();
+        io_slot_acquire ();
         removed_fs = check_existing_fs(repo->store_id, repo->version, exist_fs,
                                        fs_index, dry_run);
+        io_slot_release ();
         if (removed_fs < 0) {
             goto out;
         }
+        phase_stats_add (PHASE_GC_SWEEP_FS, g_get_monotonic_time () - phase_start,
+                         total_fs);
+    }
+
+    /* Packed fs objects are only marked dead on removal. Reclaim the space. */
+    if (!dry_run && removed_fs > 0) {
+        if (seaf_obj_store_compact_store (seaf->fs_mgr->obj_store,
+                                          repo->store_id) < 0)
+            seaf_warning ("GC: Failed to compact fs objects of repo %.8s.\n",
+                          repo->id);
     }
 
     if (!dry_run) {
@@ -464,10 +946,10 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
                           "%"G_GUINT64_FORMAT" fs are removed.\n",
                           repo->id, total_blocks, reachable_blocks, removed_blocks, removed_fs);
         else
-            seaf_message ("GC finished. %"G_GUINT64_FORMAT" blocks total, "
+            seaf_message ("GC finished for repo %.8s. %"G_GUINT64_FORMAT" blocks total, "
                           "about %"G_GUINT64_FORMAT" reachable blocks, "
                           "%"G_GUINT64_FORMAT" blocks are removed.\n",
-                          total_blocks, reachable_blocks, removed_blocks);
+                          repo->id, total_blocks, reachable_blocks, removed_blocks);
     } else {
         if (rm_fs)
             seaf_message ("GC finished for repo %.8s. %"G_GUINT64_FORMAT" blocks total, "
@@ -476,22 +958,27 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose, int rm_fs)
                           "%"G_GUINT64_FORMAT" fs can be removed.\n",
                           repo->id, total_blocks, reachable_blocks, removed_blocks, removed_fs);
         else
-            seaf_message ("GC finished. %"G_GUINT64_FORMAT" blocks total, "
+            seaf_message ("GC finished for repo %.8s. %"G_GUINT64_FORMAT" blocks total, "
                           "about %"G_GUINT64_FORMAT" reachable blocks, "
                           "%"G_GUINT64_FORMAT" blocks can be removed.\n",
-                          total_blocks, reachable_blocks, removed_blocks);
+                          repo->id, total_blocks, reachable_blocks, removed_blocks);
     }
 
 out:
-    printf ("\n");
+    gc_state_free (state);
+    string_list_free (repo_ids);
+    if (visited)
+        id_set_free (visited);
+    if (marked_commits)
+        id_set_free (marked_commits);
 
     if (exist_fs)
         g_hash_table_destroy (exist_fs);
 
     if (blocks_index)
-        bloom_destroy (blocks_index);
+        blocked_bloom_destroy (blocks_index);
     if (fs_index)
-        bloom_destroy (fs_index);
+        blocked_bloom_destroy (fs_index);
     return ret;
 }
 
@@ -499,13 +986,35 @@ void
 delete_garbaged_repos (int dry_run)
 {
     GList *del_repos = NULL;
-    GList *ptr;
+    GList *ptr, *fork_ids;
+    gboolean db_err;
 
     seaf_message ("=== Repos deleted by users ===\n");
     del_repos = seaf_repo_manager_list_garbage_repos (seaf->repo_mgr);
     for (ptr = del_repos; ptr; ptr = ptr->next) {
         char *repo_id = ptr->data;
 
+        /* Forks still use the fs and block store of the repo. Its record
+         * is kept, and the store removed by the GC after the last fork is
+         * gone.
+         */
+        db_err = FALSE;
+        fork_ids = seaf_repo_manager_get_fork_ids_by_store (seaf->repo_mgr,
+                                                            repo_id, &db_err);
+        if (fork_ids || db_err) {
+            if (!db_err && !dry_run &&
+                !seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
+                seaf_message ("GC deleted the commits of repo %.8s, "
+                              "its store is used by %u forks.\n",
+                              repo_id, g_list_length (fork_ids));
+                seaf_commit_manager_remove_store (seaf->commit_mgr, repo_id);
+                file_rev_index_remove (repo_id);
+            }
+            string_list_free (fork_ids);
+            g_free (repo_id);
+            continue;
+        }
+
         /* Confirm repo doesn't exist before removing blocks. */
         if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
             if (!dry_run) {
@@ -513,6 +1022,10 @@ delete_garbaged_repos (int dry_run)
                 seaf_commit_manager_remove_store (seaf->commit_mgr, repo_id);
                 seaf_fs_manager_remove_store (seaf->fs_mgr, repo_id);
                 seaf_block_manager_remove_store (seaf->block_mgr, repo_id);
+                gc_state_remove (repo_id);
+                file_rev_index_remove (repo_id);
+                /* Kept while a fork is in the trash. */
+                seaf_repo_manager_remove_fork_record (seaf->repo_mgr, repo_id);
             } else {
                 seaf_message ("Repo %.8s can be GC'ed.\n", repo_id);
             }
@@ -525,50 +1038,134 @@ delete_garbaged_repos (int dry_run)
     g_list_free (del_repos);
 }
 
+typedef struct GCRunData {
+    int dry_run;
+    int verbose;
+    int rm_fs;
+    int full_mark;
+    gint64 online_grace;
+
+    pthread_mutex_t lock;
+    GList *corrupt_repos;
+    GList *del_block_repos;
+    int n_done;
+    int n_total;
+} GCRunData;
+
+static void
+gc_repo (const char *repo_id, GCRunData *run)
+{
+    SeafRepo *repo;
+    gint64 gc_ret = 0;
+    gboolean corrupt = FALSE;
+
+    repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, repo_id);
+    if (!repo)
+        goto done;
+
+    if (repo->is_corrupted) {
+        corrupt = TRUE;
+        seaf_message ("Repo %s is damaged, skip GC.\n\n", repo->id);
+    } else if (collects_store (repo)) {
+        seaf_message ("GC version %d repo %s(%s)\n",
+                      repo->version, repo->name, repo->id);
+        gc_ret = gc_v1_repo (repo, run->dry_run, run->verbose, run->rm_fs,
+                             run->full_mark, run->online_grace);
+        if (gc_ret < 0)
+            corrupt = TRUE;
+    }
+
+done:
+    pthread_mutex_lock (&run->lock);
+    if (corrupt)
+        run->corrupt_repos = g_list_prepend (run->corrupt_repos,
+                                             g_strdup(repo_id));
+    else if (run->dry_run && gc_ret > 0)
+        run->del_block_repos = g_list_prepend (run->del_block_repos,
+                                               g_strdup(repo_id));
+    ++run->n_done;
+    if (repo && !repo->is_virtual && !repo->is_corrupted &&
+        strcmp (repo->store_id, repo->id) == 0)
+        seaf_message ("GC progress: %d/%d repos done.\n\n",
+                      run->n_done, run->n_total);
+    pthread_mutex_unlock (&run->lock);
+
+    seaf_repo_unref (repo);
+}
+
+static void
+gc_repo_with_thread_pool (gpointer data, gpointer user_data)
+{
+    char *repo_id = data;
+
+    gc_repo (repo_id, user_data);
+    g_free (repo_id);
+}
+
 int
-gc_core_run (GList *repo_id_list, int dry_run, int verbose, int rm_fs)
+gc_core_run (GList *repo_id_list, int dry_run, int verbose, int rm_fs,
+             int full_mark, int max_thread_num, int max_io_num,
+             gint64 online_grace)
 {
     GList *ptr;
-    SeafRepo *repo;
     GList *corrupt_repos = NULL;
     GList *del_block_repos = NULL;
     gboolean del_garbage = FALSE;
-    gint64 gc_ret;
+    GThreadPool *pool = NULL;
+    GCRunData run;
     char *repo_id;
 
+    /* Fs objects written for uncommitted uploads, or reused by commits
+     * made after the mark, would be removed.
+     */
+    if (rm_fs && online_grace > 0) {
+        seaf_warning ("GC: Fs objects can't be removed by online GC.\n");
+        return -1;
+    }
+
     if (repo_id_list == NULL) {
         repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
         del_garbage = TRUE;
     }
 
-    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
-        repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, (const gchar *)ptr->data);
-
-        g_free (ptr->data);
-
-        if (!repo)
-            continue;
-
-        if (repo->is_corrupted) {
-            corrupt_repos = g_list_prepend (corrupt_repos, g_strdup(repo->id));
-            seaf_message ("Repo %s is damaged, skip GC.\n\n", repo->id);
-            continue;
-        }
+    memset (&run, 0, sizeof(run));
+    run.dry_run = dry_run;
+    run.verbose = verbose;
+    run.rm_fs = rm_fs;
+    run.full_mark = full_mark;
+    run.online_grace = online_grace;
+    run.n_total = g_list_length (repo_id_list);
+    pthread_mutex_init (&run.lock, NULL);
+
+    scan_threads = g_key_file_get_integer (seaf->config, "gc", "scan_threads", NULL);
+    if (scan_threads <= 0)
+        scan_threads = DEFAULT_SCAN_THREADS;
+
+    if (max_thread_num > 1) {
+        io_slots = max_io_num;
+        pool = g_thread_pool_new (gc_repo_with_thread_pool, &run,
+                                  max_thread_num, FALSE, NULL);
+        if (!pool)
+            seaf_warning ("Failed to create GC thread pool, "
+                          "collecting repos one by one.\n");
+    }
 
-        if (!repo->is_virtual) {
-            seaf_message ("GC version %d repo %s(%s)\n",
-                          repo->version, repo->name, repo->id);
-            gc_ret = gc_v1_repo (repo, dry_run, verbose, rm_fs);
-            if (gc_ret < 0) {
-                corrupt_repos = g_list_prepend (corrupt_repos, g_strdup(repo->id));
-            } else if (dry_run && gc_ret) {
-                del_block_repos = g_list_prepend (del_block_repos, g_strdup(repo->id));
-            }
+    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+        if (pool) {
+            g_thread_pool_push (pool, ptr->data, NULL);
+        } else {
+            gc_repo ((const char *)ptr->data, &run);
+            g_free (ptr->data);
         }
-        seaf_repo_unref (repo);
     }
     g_list_free (repo_id_list);
 
+    if (pool)
+        g_thread_pool_free (pool, FALSE, TRUE);
+    pthread_mutex_destroy (&run.lock);
+    corrupt_repos = run.corrupt_repos;
+    del_block_repos = run.del_block_repos;
+
     if (del_garbage) {
         delete_garbaged_repos (dry_run);
     }
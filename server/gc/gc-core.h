@@ -1,7 +1,19 @@
 #ifndef GC_CORE_H
 #define GC_CORE_H
 
-int gc_core_run (GList *repo_id_list, int dry_run, int verbose, int rm_fs);
+/*
+ * With @full_mark, the live sets kept by the last GC are ignored.
+ * With @max_thread_num > 1, that many repos are collected at once, and at
+ * most @max_io_num of them scan their store at the same time (0 for
+ * no limit).
+ * With @online_grace > 0, GC is safe while the server keeps running:
+ * commits made during the mark are marked too, and dead blocks written in
+ * the last @online_grace seconds are kept for the next GC. Fs objects have
+ * no write time to keep them by, so @rm_fs is refused then.
+ */
+int gc_core_run (GList *repo_id_list, int dry_run, int verbose, int rm_fs,
+                 int full_mark, int max_thread_num, int max_io_num,
+                 gint64 online_grace);
 
 void
 delete_garbaged_repos (int dry_run);
@@ -0,0 +1,288 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "gc-state.h"
+#include "utils.h"
+#include "id-set.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * States are kept in <seafile_dir>/gc-state/<repo_id>, one per origin repo.
+ * The file holds a header followed by the raw 20-byte ids of the commits,
+ * the fs objects and the blocks, in that order. Numbers are in host byte
+ * order, the file is only read on the host that wrote it. A file of an
+ * unknown version or of the wrong size is ignored, which makes the next GC
+ * do a full mark.
+ */
+
+#define GC_STATE_DIR "gc-state"
+#define GC_STATE_MAGIC "SGCS"
+#define GC_STATE_VERSION 1
+#define ID_LEN ID_SET_RAW_LEN
+
+typedef struct GCStateHeader {
+    char magic[4];
+    guint32 version;
+    gint64 full_mark_time;
+    guint32 n_commits;
+    guint32 n_fs;
+    guint32 n_blocks;
+    guint32 padding;
+} GCStateHeader;
+
+struct GCState {
+    gint64 full_mark_time;
+    IdSet *commits;
+    IdSet *fs;
+    IdSet *blocks;
+};
+
+GCState *
+gc_state_new ()
+{
+    GCState *state = g_new0 (GCState, 1);
+
+    state->commits = id_set_new (0);
+    state->fs = id_set_new (0);
+    state->blocks = id_set_new (0);
+
+    return state;
+}
+
+void
+gc_state_free (GCState *state)
+{
+    if (!state)
+        return;
+
+    id_set_free (state->commits);
+    id_set_free (state->fs);
+    id_set_free (state->blocks);
+    g_free (state);
+}
+
+static char *
+gc_state_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, GC_STATE_DIR, repo_id, NULL);
+}
+
+static const char *
+load_ids (IdSet *set, const char *ptr, guint32 n)
+{
+    guint32 i;
+
+    for (i = 0; i < n; i++, ptr += ID_LEN)
+        id_set_add_raw (set, (const unsigned char *)ptr);
+    return ptr;
+}
+
+GCState *
+gc_state_load (const char *repo_id)
+{
+    char *path = gc_state_path (repo_id);
+    char *contents = NULL;
+    gsize len;
+    GCStateHeader hdr;
+    GCState *state = NULL;
+    const char *ptr;
+    GError *error = NULL;
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        goto out;
+
+    if (!g_file_get_contents (path, &contents, &len, &error)) {
+        seaf_warning ("Failed to read GC state %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    if (len < sizeof(hdr)) {
+        seaf_warning ("GC state %s is invalid, ignore it.\n", path);
+        goto out;
+    }
+    memcpy (&hdr, contents, sizeof(hdr));
+    if (memcmp (hdr.magic, GC_STATE_MAGIC, 4) != 0 ||
+        hdr.version != GC_STATE_VERSION ||
+        len != sizeof(hdr) + ((guint64)hdr.n_commits + hdr.n_fs + hdr.n_blocks) * ID_LEN) {
+        seaf_warning ("GC state %s is invalid, ignore it.\n", path);
+        goto out;
+    }
+
+    state = g_new0 (GCState, 1);
+    state->commits = id_set_new (hdr.n_commits);
+    state->fs = id_set_new (hdr.n_fs);
+    state->blocks = id_set_new (hdr.n_blocks);
+    state->full_mark_time = hdr.full_mark_time;
+    ptr = contents + sizeof(hdr);
+    ptr = load_ids (state->commits, ptr, hdr.n_commits);
+    ptr = load_ids (state->fs, ptr, hdr.n_fs);
+    load_ids (state->blocks, ptr, hdr.n_blocks);
+
+out:
+    g_free (contents);
+    g_free (path);
+    return state;
+}
+
+static void
+write_id (const unsigned char *raw, void *user_data)
+{
+    g_string_append_len ((GString *)user_data, (const char *)raw, ID_LEN);
+}
+
+static void
+write_ids (IdSet *set, GString *buf)
+{
+    id_set_foreach (set, write_id, buf);
+}
+
+int
+gc_state_save (GCState *state, const char *repo_id)
+{
+    char *dir = g_build_filename (seaf->seaf_dir, GC_STATE_DIR, NULL);
+    char *path = gc_state_path (repo_id);
+    GCStateHeader hdr;
+    GString *buf;
+    GError *error = NULL;
+    int ret = 0;
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create GC state dir %s.\n", dir);
+        ret = -1;
+        goto out;
+    }
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, GC_STATE_MAGIC, 4);
+    hdr.version = GC_STATE_VERSION;
+    hdr.full_mark_time = state->full_mark_time;
+    hdr.n_commits = id_set_size (state->commits);
+    hdr.n_fs = id_set_size (state->fs);
+    hdr.n_blocks = id_set_size (state->blocks);
+
+    buf = g_string_sized_new (sizeof(hdr) +
+                              (hdr.n_commits + hdr.n_fs + hdr.n_blocks) * ID_LEN);
+    g_string_append_len (buf, (const char *)&hdr, sizeof(hdr));
+    write_ids (state->commits, buf);
+    write_ids (state->fs, buf);
+    write_ids (state->blocks, buf);
+
+    /* Written to a temp file and renamed, a crash never leaves half a state. */
+    if (!g_file_set_contents (path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to write GC state %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    }
+    g_string_free (buf, TRUE);
+
+out:
+    g_free (dir);
+    g_free (path);
+    return ret;
+}
+
+void
+gc_state_remove (const char *repo_id)
+{
+    char *path = gc_state_path (repo_id);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) && seaf_util_unlink (path) < 0)
+        seaf_warning ("Failed to remove GC state %s.\n", path);
+    g_free (path);
+}
+
+gint64
+gc_state_get_full_mark_time (GCState *state)
+{
+    return state->full_mark_time;
+}
+
+void
+gc_state_set_full_mark_time (GCState *state, gint64 t)
+{
+    state->full_mark_time = t;
+}
+
+gboolean
+gc_state_has_commit (GCState *state, const char *commit_id)
+{
+    return id_set_contains (state->commits, commit_id);
+}
+
+gboolean
+gc_state_has_fs (GCState *state, const char *fs_id)
+{
+    return id_set_contains (state->fs, fs_id);
+}
+
+void
+gc_state_add_commit (GCState *state, const char *commit_id)
+{
+    id_set_add (state->commits, commit_id);
+}
+
+void
+gc_state_add_fs (GCState *state, const char *fs_id)
+{
+    id_set_add (state->fs, fs_id);
+}
+
+void
+gc_state_add_block (GCState *state, const char *block_id)
+{
+    id_set_add (state->blocks, block_id);
+}
+
+typedef struct {
+    GCStateIdFunc func;
+    void *user_data;
+} ForeachIdData;
+
+static void
+call_with_hex (const unsigned char *raw, void *vdata)
+{
+    ForeachIdData *data = vdata;
+    char hex[ID_LEN * 2 + 1];
+
+    rawdata_to_hex (raw, hex, ID_LEN);
+    data->func (hex, data->user_data);
+}
+
+static void
+foreach_id (IdSet *set, GCStateIdFunc func, void *user_data)
+{
+    ForeachIdData data;
+
+    data.func = func;
+    data.user_data = user_data;
+    id_set_foreach (set, call_with_hex, &data);
+}
+
+void
+gc_state_foreach_fs (GCState *state, GCStateIdFunc func, void *user_data)
+{
+    foreach_id (state->fs, func, user_data);
+}
+
+void
+gc_state_foreach_block (GCState *state, GCStateIdFunc func, void *user_data)
+{
+    foreach_id (state->blocks, func, user_data);
+}
+
+guint
+gc_state_n_commits (GCState *state)
+{
+    return id_set_size (state->commits);
+}
+
+guint
+gc_state_n_blocks (GCState *state)
+{
+    return id_set_size (state->blocks);
+}
@@ -0,0 +1,64 @@
+#ifndef GC_STATE_H
+#define GC_STATE_H
+
+#include <glib.h>
+
+/*
+ * The live set of a store as marked by the last GC: the commits traversed
+ * and the fs objects and blocks reachable from them.
+ */
+typedef struct GCState GCState;
+
+GCState *
+gc_state_new ();
+
+void
+gc_state_free (GCState *state);
+
+/* Returns NULL if there's no valid state for the repo. */
+GCState *
+gc_state_load (const char *repo_id);
+
+int
+gc_state_save (GCState *state, const char *repo_id);
+
+void
+gc_state_remove (const char *repo_id);
+
+/* Time of the last full mark the state builds on. */
+gint64
+gc_state_get_full_mark_time (GCState *state);
+
+void
+gc_state_set_full_mark_time (GCState *state, gint64 t);
+
+gboolean
+gc_state_has_commit (GCState *state, const char *commit_id);
+
+gboolean
+gc_state_has_fs (GCState *state, const char *fs_id);
+
+void
+gc_state_add_commit (GCState *state, const char *commit_id);
+
+void
+gc_state_add_fs (GCState *state, const char *fs_id);
+
+void
+gc_state_add_block (GCState *state, const char *block_id);
+
+typedef void (*GCStateIdFunc) (const char *id, void *user_data);
+
+void
+gc_state_foreach_fs (GCState *state, GCStateIdFunc func, void *user_data);
+
+void
+gc_state_foreach_block (GCState *state, GCStateIdFunc func, void *user_data);
+
+guint
+gc_state_n_commits (GCState *state);
+
+guint
+gc_state_n_blocks (GCState *state);
+
+#endif
@@ -0,0 +1,45 @@
+#include "common.h"
+
+#include "phase-stats.h"
+
+static const char *phase_names[N_PHASES] = {
+    "gc/scan",
+    "gc/mark",
+    "gc/sweep",
+    "gc/sweep_fs",
+    "fsck/verify",
+    "fsck/check",
+};
+
+static PhaseStats phase_stats[N_PHASES];
+
+const char *
+phase_stats_name (Phase phase)
+{
+    return phase_names[phase];
+}
+
+void
+phase_stats_add (Phase phase, gint64 usec, gint64 objects)
+{
+    __atomic_fetch_add (&phase_stats[phase].usec, usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&phase_stats[phase].objects, objects, __ATOMIC_RELAXED);
+}
+
+void
+phase_stats_get (Phase phase, PhaseStats *stats)
+{
+    stats->usec = __atomic_load_n (&phase_stats[phase].usec, __ATOMIC_RELAXED);
+    stats->objects = __atomic_load_n (&phase_stats[phase].objects, __ATOMIC_RELAXED);
+}
+
+void
+phase_stats_reset ()
+{
+    int i;
+
+    for (i = 0; i < N_PHASES; ++i) {
+        __atomic_store_n (&phase_stats[i].usec, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&phase_stats[i].objects, 0, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef PHASE_STATS_H
+#define PHASE_STATS_H
+
+#include <glib.h>
+
+/*
+ * Time spent and objects processed by each phase of GC and fsck, summed over
+ * all repos. Repos collected or checked in parallel add up their times, so
+ * with more than one thread a phase may take more time than the whole run.
+ * Used by seaf-gc-bench to report the speed of each phase.
+ */
+
+typedef enum {
+    /* Listing the blocks and fs objects of stores. */
+    PHASE_GC_SCAN,
+    /* Traversing commits, fs objects and blocks into the live indexes. */
+    PHASE_GC_MARK,
+    /* Checking each block against the index, removing the dead ones. */
+    PHASE_GC_SWEEP,
+    PHASE_GC_SWEEP_FS,
+    /* Reading and hashing the blocks of the head tree. */
+    PHASE_FSCK_VERIFY,
+    /* Checking the fs objects of the head tree. */
+    PHASE_FSCK_CHECK,
+    N_PHASES
+} Phase;
+
+typedef struct PhaseStats {
+    gint64 usec;
+    gint64 objects;
+} PhaseStats;
+
+const char *
+phase_stats_name (Phase phase);
+
+void
+phase_stats_add (Phase phase, gint64 usec, gint64 objects);
+
+void
+phase_stats_get (Phase phase, PhaseStats *stats);
+
+void
+phase_stats_reset ();
+
+#endif
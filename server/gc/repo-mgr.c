@@ -309,6 +309,7 @@ load_repo (SeafRepoManager *manager, const char *repo_id, gboolean ret_corrupt)
     SeafRepo *repo;
     SeafBranch *branch;
     SeafVirtRepo *vinfo = NULL;
+    char *fork_store_id;
 
     repo = seaf_repo_new(repo_id, NULL, NULL);
     if (!repo) {
@@ -343,6 +344,13 @@ load_repo (SeafRepoManager *manager, const char *repo_id, gboolean ret_corrupt)
         repo->is_virtual = FALSE;
         memcpy (repo->store_id, repo->id, 36);
     }
+
+    /* Forks, and virtual repos of forks, use the store of the forked repo. */
+    fork_store_id = seaf_repo_manager_get_fork_store_id (manager,
+                                                         vinfo ? vinfo->origin_repo_id : repo->id);
+    if (fork_store_id)
+        memcpy (repo->store_id, fork_store_id, 36);
+    g_free (fork_store_id);
     seaf_virtual_repo_info_free (vinfo);
 
     return repo;
@@ -646,6 +654,52 @@ seaf_repo_manager_get_virtual_repo_ids_by_origin (SeafRepoManager *mgr,
     return g_list_reverse (ret);
 }
 
+char *
+seaf_repo_manager_get_fork_store_id (SeafRepoManager *mgr, const char *repo_id)
+{
+    return seaf_db_statement_get_string (mgr->seaf->db,
+                                         "SELECT store_id FROM ForkedRepo WHERE repo_id = ?",
+                                         1, "string", repo_id);
+}
+
+GList *
+seaf_repo_manager_get_fork_ids_by_store (SeafRepoManager *mgr,
+                                         const char *store_id,
+                                         gboolean *db_err)
+{
+    GList *ret = NULL;
+
+    *db_err = FALSE;
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT repo_id FROM ForkedRepo WHERE store_id = ? "
+                                       "ORDER BY repo_id",
+                                       collect_virtual_repo_ids, &ret,
+                                       1, "string", store_id) < 0) {
+        *db_err = TRUE;
+        string_list_free (ret);
+        return NULL;
+    }
+
+    return g_list_reverse (ret);
+}
+
+void
+seaf_repo_manager_remove_fork_record (SeafRepoManager *mgr, const char *repo_id)
+{
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM ForkedRepo WHERE repo_id = ?",
+                             1, "string", repo_id);
+}
+
+gboolean
+seaf_repo_manager_repo_in_trash (SeafRepoManager *mgr, const char *repo_id,
+                                 gboolean *db_err)
+{
+    return seaf_db_statement_exists (mgr->seaf->db,
+                                     "SELECT 1 FROM RepoTrash WHERE repo_id = ?",
+                                     db_err, 1, "string", repo_id);
+}
+
 static gboolean
 get_garbage_repo_id (SeafDBRow *row, void *vid_list)
 {
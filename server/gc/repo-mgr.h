@@ -40,8 +40,9 @@ struct _SeafRepo {
 
     int version;
     /* Used to access fs and block sotre.
-     * This id is different from repo_id when this repo is virtual.
-     * Virtual repos share fs and block store with its origin repo.
+     * This id is different from repo_id when this repo is virtual or a fork.
+     * Virtual repos share fs and block store with its origin repo, and
+     * forks with the repo they were forked from.
      * However, commit store for each repo is always independent.
      * So always use repo_id to access commit store.
      */
@@ -152,6 +153,24 @@ GList *
 seaf_repo_manager_get_virtual_repo_ids_by_origin (SeafRepoManager *mgr,
                                                   const char *origin_repo);
 
+/* Returns the store of a fork, or NULL if repo_id isn't a fork. */
+char *
+seaf_repo_manager_get_fork_store_id (SeafRepoManager *mgr, const char *repo_id);
+
+/* Returns the ids of the forks sharing store_id, in the order of their ids. */
+GList *
+seaf_repo_manager_get_fork_ids_by_store (SeafRepoManager *mgr,
+                                         const char *store_id,
+                                         gboolean *db_err);
+
+/* Drops the fork record of a repo deleted for good. */
+void
+seaf_repo_manager_remove_fork_record (SeafRepoManager *mgr, const char *repo_id);
+
+gboolean
+seaf_repo_manager_repo_in_trash (SeafRepoManager *mgr, const char *repo_id,
+                                 gboolean *db_err);
+
 GList *
 seaf_repo_manager_list_garbage_repos (SeafRepoManager *mgr);
 
@@ -0,0 +1,791 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Microbenchmarks for the core data paths: chunking, dir objects,
+ * encryption, bloom filters, tree diff and merge, and the fs object and
+ * block backends. Objects and blocks are written to a temporary data dir.
+ *
+ * Each result is printed as one JSON object per line:
+ *
+ *   {"name": "...", "iterations": n, "ns_per_op": t, "mb_per_s": r}
+ *
+ * mb_per_s is only set for benchmarks that process a known amount of data.
+ *
+ *   seaf-bench [-t min_seconds] [-f name_prefix] [-d tmp_dir]
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "seafile-session.h"
+#include "seafile-crypt.h"
+#include "bloom-filter.h"
+#include "diff-simple.h"
+#include "merge-new.h"
+#include "cdc/cdc.h"
+#include "cdc/rabin-checksum.h"
+
+SeafileSession *seaf;
+
+#define STORE_ID "00000000-0000-0000-0000-000000000000"
+
+#define CHUNK_FILE_SIZE (16 << 20)
+#define DATA_SIZE (1 << 20)
+#define OBJ_SIZE 4096
+#define N_DIRENTS 1000
+#define N_IDS 100000
+#define TREE_DIRS 100
+#define TREE_FILES 100
+#define TREE_CHANGED_DIRS 10
+
+typedef struct Bench {
+    const char *name;
+    /* Runs @n iterations. */
+    int (*run) (gint64 n);
+    /* Bytes processed by one iteration, 0 if it doesn't apply. */
+    gint64 bytes;
+} Bench;
+
+static char *data;
+static char *chunk_file;
+
+/* Fake ids, fixed so that runs are comparable. */
+static void
+fake_id (guint64 n, char *id)
+{
+    snprintf (id, 41, "%040" G_GINT64_MODIFIER "x", n * 0x9e3779b97f4a7c15ULL);
+}
+
+static void
+fill_random (char *buf, int len)
+{
+    guint64 state = 1;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buf[i] = (char)(state >> 56);
+    }
+}
+
+/* Chunking */
+
+static int
+skip_block (const char *repo_id,
+            int version,
+            CDCDescriptor *chunk_descr,
+            struct SeafileCrypt *crypt,
+            uint8_t *checksum,
+            gboolean write_data)
+{
+    memset (checksum, 0, CHECKSUM_LENGTH);
+    return 0;
+}
+
+static int
+create_chunk_file ()
+{
+    int fd, i;
+
+    chunk_file = g_build_filename (seaf->tmp_file_dir, "chunk-file", NULL);
+    fd = g_open (chunk_file, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        fprintf (stderr, "Failed to create %s: %s.\n", chunk_file, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < CHUNK_FILE_SIZE / DATA_SIZE; ++i) {
+        /* Vary the data, so that it doesn't repeat every DATA_SIZE bytes. */
+        data[i] ^= 0x5a;
+        if (writen (fd, data, DATA_SIZE) != DATA_SIZE) {
+            fprintf (stderr, "Failed to write %s: %s.\n", chunk_file, strerror(errno));
+            close (fd);
+            return -1;
+        }
+    }
+    close (fd);
+    return 0;
+}
+
+static int
+chunk_file_with (int algorithm, gint64 n)
+{
+    CDCFileDescriptor cdc;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        memset (&cdc, 0, sizeof(cdc));
+        cdc.block_min_sz = 6 << 20;
+        cdc.block_sz = 8 << 20;
+        cdc.block_max_sz = 10 << 20;
+        cdc.write_block = skip_block;
+        cdc.algorithm = algorithm;
+        if (filename_chunk_cdc (chunk_file, &cdc, NULL, FALSE, NULL) < 0)
+            return -1;
+        free (cdc.blk_sha1s);
+    }
+    return 0;
+}
+
+static int
+bench_cdc_rabin (gint64 n)
+{
+    return chunk_file_with (CDC_ALGORITHM_RABIN, n);
+}
+
+static int
+bench_cdc_gear (gint64 n)
+{
+    return chunk_file_with (CDC_ALGORITHM_GEAR, n);
+}
+
+#define RABIN_WIN_SZ 48
+
+static volatile unsigned int rabin_sink;
+
+static int
+bench_rabin_rolling (gint64 n)
+{
+    unsigned int csum;
+    gint64 i;
+    int pos;
+
+    for (i = 0; i < n; ++i) {
+        csum = rabin_checksum (data, RABIN_WIN_SZ);
+        for (pos = RABIN_WIN_SZ; pos < DATA_SIZE; ++pos)
+            csum = rabin_rolling_checksum (csum, RABIN_WIN_SZ,
+                                           data[pos - RABIN_WIN_SZ], data[pos]);
+        rabin_sink = csum;
+    }
+    return 0;
+}
+
+/* Dir objects */
+
+static SeafDir *dirs[DIR_OBJ_VERSION_BINARY + 1];
+
+static SeafDir *
+make_dir (int version, int n_entries, const char *prefix, guint64 seed)
+{
+    GList *entries = NULL;
+    SeafDirent *dent;
+    char id[41], name[64];
+    int i;
+
+    /* Dirents are kept sorted by name in descending order. */
+    for (i = 0; i < n_entries; ++i) {
+        fake_id (seed + i, id);
+        snprintf (name, sizeof(name), "%s%06d.txt", prefix, i);
+        dent = seaf_dirent_new (version, id, S_IFREG | 0644, name,
+                                1700000000 + i, "bench@example.com", 1 << 20);
+        entries = g_list_prepend (entries, dent);
+    }
+
+    return seaf_dir_new (NULL, entries, version);
+}
+
+static int
+dir_to_data (int version, gint64 n)
+{
+    void *buf;
+    int len;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        buf = seaf_dir_to_data (dirs[version], &len);
+        if (!buf)
+            return -1;
+        g_free (buf);
+    }
+    return 0;
+}
+
+static int
+dir_from_data (int version, gint64 n)
+{
+    SeafDir *dir = dirs[version];
+    SeafDir *d;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        d = seaf_dir_from_data (dir->dir_id, (uint8_t *)dir->ondisk,
+                                dir->ondisk_size, TRUE);
+        if (!d)
+            return -1;
+        seaf_dir_free (d);
+    }
+    return 0;
+}
+
+static int
+bench_dir_to_data_v1 (gint64 n)
+{
+    return dir_to_data (1, n);
+}
+
+static int
+bench_dir_from_data_v1 (gint64 n)
+{
+    return dir_from_data (1, n);
+}
+
+static int
+bench_dir_to_data_v2 (gint64 n)
+{
+    return dir_to_data (DIR_OBJ_VERSION_BINARY, n);
+}
+
+static int
+bench_dir_from_data_v2 (gint64 n)
+{
+    return dir_from_data (DIR_OBJ_VERSION_BINARY, n);
+}
+
+/* Encryption */
+
+static SeafileCrypt *bench_crypt;
+static char *encrypted;
+static int encrypted_len;
+
+static int
+bench_encrypt (gint64 n)
+{
+    char *out;
+    int out_len;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        if (seafile_encrypt (&out, &out_len, data, DATA_SIZE, bench_crypt) < 0)
+            return -1;
+        g_free (out);
+    }
+    return 0;
+}
+
+static int
+bench_decrypt (gint64 n)
+{
+    char *out;
+    int out_len;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        if (seafile_decrypt (&out, &out_len, encrypted, encrypted_len, bench_crypt) < 0)
+            return -1;
+        g_free (out);
+    }
+    return 0;
+}
+
+/* Bloom filters */
+
+static char (*ids)[41];
+static Bloom *bloom;
+static BlockedBloom *blocked_bloom;
+static volatile int bloom_sink;
+
+static int
+bench_bloom_add (gint64 n)
+{
+    gint64 i;
+
+    for (i = 0; i < n; ++i)
+        bloom_add (bloom, ids[i % N_IDS]);
+    return 0;
+}
+
+static int
+bench_bloom_test (gint64 n)
+{
+    gint64 i;
+    int hits = 0;
+
+    for (i = 0; i < n; ++i)
+        hits += bloom_test (bloom, ids[i % N_IDS]);
+    bloom_sink = hits;
+    return 0;
+}
+
+static int
+bench_blocked_bloom_add (gint64 n)
+{
+    gint64 i;
+
+    for (i = 0; i < n; ++i)
+        blocked_bloom_add (blocked_bloom, ids[i % N_IDS]);
+    return 0;
+}
+
+static int
+bench_blocked_bloom_test (gint64 n)
+{
+    gint64 i;
+    int hits = 0;
+
+    for (i = 0; i < n; ++i)
+        hits += blocked_bloom_test (blocked_bloom, ids[i % N_IDS]);
+    bloom_sink = hits;
+    return 0;
+}
+
+/* Trees */
+
+static char base_root[41], head_root[41], remote_root[41];
+
+/*
+ * Saves a root of TREE_DIRS dirs with TREE_FILES files each. Files of
+ * TREE_CHANGED_DIRS dirs, starting at @changed_from, get other ids than in
+ * the base tree.
+ */
+static int
+save_tree (int changed_from, char *root_id)
+{
+    GList *subdirs = NULL;
+    SeafDir *dir, *root;
+    SeafDirent *dent;
+    char name[64];
+    guint64 seed;
+    int i, ret = 0;
+
+    for (i = 0; i < TREE_DIRS; ++i) {
+        seed = (guint64)i * TREE_FILES;
+        if (changed_from >= 0 && i >= changed_from &&
+            i < changed_from + TREE_CHANGED_DIRS)
+            seed += (guint64)(changed_from + 1) * TREE_DIRS * TREE_FILES;
+
+        dir = make_dir (1, TREE_FILES, "file", seed);
+        if (seaf_dir_save (seaf->fs_mgr, STORE_ID, 1, dir) < 0)
+            ret = -1;
+
+        snprintf (name, sizeof(name), "dir%04d", i);
+        dent = seaf_dirent_new (1, dir->dir_id, S_IFDIR, name,
+                                1700000000, "bench@example.com", 0);
+        subdirs = g_list_prepend (subdirs, dent);
+        seaf_dir_free (dir);
+    }
+
+    root = seaf_dir_new (NULL, subdirs, 1);
+    if (seaf_dir_save (seaf->fs_mgr, STORE_ID, 1, root) < 0)
+        ret = -1;
+    memcpy (root_id, root->dir_id, 41);
+    seaf_dir_free (root);
+
+    return ret;
+}
+
+static int
+count_files (int n, const char *basedir, SeafDirent *files[], void *data)
+{
+    if (!files[0] || !files[1] || strcmp (files[0]->id, files[1]->id) != 0)
+        ++*(int *)data;
+    return 0;
+}
+
+static int
+recurse_dirs (int n, const char *basedir, SeafDirent *dirs[], void *data,
+              gboolean *recurse)
+{
+    *recurse = TRUE;
+    return 0;
+}
+
+static int
+bench_diff_trees (gint64 n)
+{
+    const char *roots[] = { base_root, head_root };
+    DiffOptions opt;
+    int changed;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        changed = 0;
+        memset (&opt, 0, sizeof(opt));
+        memcpy (opt.store_id, STORE_ID, 36);
+        opt.version = 1;
+        opt.file_cb = count_files;
+        opt.dir_cb = recurse_dirs;
+        opt.data = &changed;
+        if (diff_trees (2, roots, &opt) < 0)
+            return -1;
+        if (changed != TREE_CHANGED_DIRS * TREE_FILES) {
+            fprintf (stderr, "Diff found %d changed files.\n", changed);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+bench_merge_trees (gint64 n)
+{
+    const char *roots[] = { base_root, head_root, remote_root };
+    MergeOptions opt;
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        memset (&opt, 0, sizeof(opt));
+        opt.n_ways = 3;
+        opt.do_merge = TRUE;
+        memcpy (opt.remote_repo_id, STORE_ID, 36);
+        memcpy (opt.remote_head, remote_root, 40);
+        if (seaf_merge_trees (STORE_ID, 1, 3, roots, &opt) < 0)
+            return -1;
+        if (opt.conflict) {
+            fprintf (stderr, "Unexpected conflict in merge.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Object and block backends */
+
+static gint64 n_written_objs;
+
+static int
+bench_obj_write (gint64 n)
+{
+    char id[41];
+    gint64 i;
+
+    for (i = 0; i < n; ++i) {
+        fake_id (n_written_objs + i, id);
+        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store, STORE_ID, 1, id,
+                                      data, OBJ_SIZE, FALSE) < 0)
+            return -1;
+    }
+    n_written_objs = MAX (n_written_objs, n);
+    return 0;
+}
+
+static int
+bench_obj_read (gint64 n)
+{
+    char id[41];
+    void *buf;
+    int len;
+    gint64 i;
+
+    if (n_written_objs == 0 && bench_obj_write (1000) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        fake_id (i % n_written_objs, id);
+        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, STORE_ID, 1, id,
+                                     &buf, &len) < 0)
+            return -1;
+        g_free (buf);
+    }
+    return 0;
+}
+
+#define N_BLOCKS 64
+
+static int n_written_blocks;
+
+static int
+write_block (const char *block_id)
+{
+    BlockHandle *handle;
+    int ret = 0;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr, STORE_ID, 1,
+                                            block_id, BLOCK_WRITE);
+    if (!handle)
+        return -1;
+    if (seaf_block_manager_write_block (seaf->block_mgr, handle,
+                                        data, DATA_SIZE) != DATA_SIZE)
+        ret = -1;
+    if (seaf_block_manager_close_block (seaf->block_mgr, handle) < 0)
+        ret = -1;
+    if (ret == 0 && seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0)
+        ret = -1;
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+static int
+bench_block_write (gint64 n)
+{
+    char id[41];
+    gint64 i;
+
+    /* Overwrite a bounded set of blocks, to not fill up the disk. */
+    for (i = 0; i < n; ++i) {
+        fake_id (i % N_BLOCKS, id);
+        if (write_block (id) < 0)
+            return -1;
+    }
+    n_written_blocks = MAX (n_written_blocks, MIN (n, N_BLOCKS));
+    return 0;
+}
+
+static int
+bench_block_read (gint64 n)
+{
+    BlockHandle *handle;
+    char *buf;
+    char id[41];
+    gint64 i;
+    int ret = 0;
+
+    if (n_written_blocks == 0 && bench_block_write (N_BLOCKS) < 0)
+        return -1;
+
+    buf = g_malloc (DATA_SIZE);
+    for (i = 0; i < n && ret == 0; ++i) {
+        fake_id (i % n_written_blocks, id);
+        handle = seaf_block_manager_open_block (seaf->block_mgr, STORE_ID, 1,
+                                                id, BLOCK_READ);
+        if (!handle) {
+            ret = -1;
+            break;
+        }
+        if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           buf, DATA_SIZE) != DATA_SIZE)
+            ret = -1;
+        seaf_block_manager_close_block (seaf->block_mgr, handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    }
+    g_free (buf);
+    return ret;
+}
+
+static Bench benches[] = {
+    { "cdc/rabin", bench_cdc_rabin, CHUNK_FILE_SIZE },
+    { "cdc/gear", bench_cdc_gear, CHUNK_FILE_SIZE },
+    { "rabin/rolling", bench_rabin_rolling, DATA_SIZE },
+    { "dir/to_data/v1", bench_dir_to_data_v1, 0 },
+    { "dir/from_data/v1", bench_dir_from_data_v1, 0 },
+    { "dir/to_data/v2", bench_dir_to_data_v2, 0 },
+    { "dir/from_data/v2", bench_dir_from_data_v2, 0 },
+    { "crypt/encrypt", bench_encrypt, DATA_SIZE },
+    { "crypt/decrypt", bench_decrypt, DATA_SIZE },
+    { "bloom/add", bench_bloom_add, 0 },
+    { "bloom/test", bench_bloom_test, 0 },
+    { "blocked_bloom/add", bench_blocked_bloom_add, 0 },
+    { "blocked_bloom/test", bench_blocked_bloom_test, 0 },
+    { "tree/diff", bench_diff_trees, 0 },
+    { "tree/merge", bench_merge_trees, 0 },
+    { "obj/write", bench_obj_write, OBJ_SIZE },
+    { "obj/read", bench_obj_read, OBJ_SIZE },
+    { "block/write", bench_block_write, DATA_SIZE },
+    { "block/read", bench_block_read, DATA_SIZE },
+};
+
+static int
+setup ()
+{
+    unsigned char key[32], iv[16];
+    int i;
+
+    data = g_malloc (DATA_SIZE);
+    fill_random (data, DATA_SIZE);
+
+    if (create_chunk_file () < 0)
+        return -1;
+
+    dirs[1] = make_dir (1, N_DIRENTS, "", 0);
+    dirs[DIR_OBJ_VERSION_BINARY] = make_dir (DIR_OBJ_VERSION_BINARY,
+                                             N_DIRENTS, "", 0);
+    if (!dirs[1]->ondisk || !dirs[DIR_OBJ_VERSION_BINARY]->ondisk) {
+        fprintf (stderr, "Failed to serialize dir objects.\n");
+        return -1;
+    }
+
+    fill_random ((char *)key, sizeof(key));
+    fill_random ((char *)iv, sizeof(iv));
+    bench_crypt = seafile_crypt_new (2, key, iv);
+    if (seafile_encrypt (&encrypted, &encrypted_len, data, DATA_SIZE, bench_crypt) < 0) {
+        fprintf (stderr, "Failed to encrypt data.\n");
+        return -1;
+    }
+
+    ids = g_malloc (N_IDS * sizeof(*ids));
+    for (i = 0; i < N_IDS; ++i)
+        fake_id (i, ids[i]);
+    bloom = bloom_create (N_IDS * 10, 3, 0);
+    blocked_bloom = blocked_bloom_create (N_IDS, 0.01, 0);
+    if (!bloom || !blocked_bloom) {
+        fprintf (stderr, "Failed to create bloom filters.\n");
+        return -1;
+    }
+
+    if (save_tree (-1, base_root) < 0 ||
+        save_tree (0, head_root) < 0 ||
+        save_tree (TREE_DIRS / 2, remote_root) < 0) {
+        fprintf (stderr, "Failed to save trees.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Doubles the iterations until a run takes at least @min_time seconds. */
+static int
+run_bench (Bench *bench, double min_time)
+{
+    GTimer *timer = g_timer_new ();
+    gint64 n = 1;
+    double elapsed;
+
+    while (1) {
+        g_timer_start (timer);
+        if (bench->run (n) < 0) {
+            fprintf (stderr, "Benchmark %s failed.\n", bench->name);
+            g_timer_destroy (timer);
+            return -1;
+        }
+        elapsed = g_timer_elapsed (timer, NULL);
+        if (elapsed >= min_time || n >= G_MAXINT64 / 2)
+            break;
+        /* Jump close to min_time, at most 100 times the last run. */
+        if (elapsed > 0)
+            n = MIN (n * 100, (gint64)(n * min_time * 1.2 / elapsed) + 1);
+        else
+            n *= 100;
+    }
+    g_timer_destroy (timer);
+
+    printf ("{\"name\": \"%s\", \"iterations\": %" G_GINT64_FORMAT
+            ", \"ns_per_op\": %.1f",
+            bench->name, n, elapsed * 1e9 / n);
+    if (bench->bytes > 0)
+        printf (", \"mb_per_s\": %.1f", bench->bytes * n / elapsed / 1048576.0);
+    printf ("}\n");
+    fflush (stdout);
+
+    return 0;
+}
+
+static int
+create_data_dir (const char *dir)
+{
+    char *tmp_dir = g_build_filename (dir, "tmpfiles", NULL);
+    char *conf = g_build_filename (dir, "seafile.conf", NULL);
+    int ret = 0;
+
+    if (g_mkdir_with_parents (tmp_dir, 0700) < 0 ||
+        !g_file_set_contents (conf, "[fileserver]\n", -1, NULL)) {
+        fprintf (stderr, "Failed to create data dir %s.\n", dir);
+        ret = -1;
+    }
+
+    g_free (tmp_dir);
+    g_free (conf);
+    return ret;
+}
+
+static void
+remove_dir (const char *path)
+{
+    GDir *dir;
+    const char *name;
+    char *child;
+    SeafStat st;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            child = g_build_filename (path, name, NULL);
+            if (seaf_stat (child, &st) == 0 && S_ISDIR(st.st_mode))
+                remove_dir (child);
+            else
+                g_unlink (child);
+            g_free (child);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (path);
+}
+
+static void
+usage ()
+{
+    fprintf (stderr, "usage: seaf-bench [-t min_seconds] [-f name_prefix] "
+             "[-d tmp_dir]\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    double min_time = 1.0;
+    const char *filter = NULL;
+    const char *tmp_dir = g_get_tmp_dir ();
+    char *seafile_dir;
+    int i, c;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "t:f:d:h")) != -1) {
+        switch (c) {
+        case 't':
+            min_time = atof (optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        default:
+            usage ();
+            return 1;
+        }
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    if (seafile_log_init ("-", "info", "warning") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        return 1;
+    }
+
+    seafile_dir = g_build_filename (tmp_dir, "seaf-bench-XXXXXX", NULL);
+    if (!g_mkdtemp (seafile_dir)) {
+        fprintf (stderr, "Failed to create temp dir.\n");
+        g_free (seafile_dir);
+        return 1;
+    }
+    if (create_data_dir (seafile_dir) < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    seaf = seafile_session_new (NULL, seafile_dir, seafile_dir, FALSE);
+    if (!seaf) {
+        fprintf (stderr, "Failed to create seafile session.\n");
+        ret = 1;
+        goto out;
+    }
+
+    cdc_init ();
+
+    if (setup () < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(benches); ++i) {
+        if (filter && !g_str_has_prefix (benches[i].name, filter))
+            continue;
+        if (run_bench (&benches[i], min_time) < 0)
+            ret = 1;
+    }
+
+out:
+    remove_dir (seafile_dir);
+    g_free (seafile_dir);
+    return ret;
+}
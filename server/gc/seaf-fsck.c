@@ -5,6 +5,8 @@
 
 #include "seafile-session.h"
 #include "fsck.h"
+#include "bg-throttle.h"
+#include "proc-policy.h"
 
 #include "utils.h"
 
@@ -14,14 +16,17 @@ static char *central_config_dir = NULL;
 
 SeafileSession *seaf;
 
-static const char *short_opts = "hvft:c:d:rE:F:";
+static const char *short_opts = "hvft:i:RNc:d:rE:F:";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
     { "force", no_argument, NULL, 'f', },
     { "repair", no_argument, NULL, 'r', },
     { "threads", required_argument, NULL, 't', },
+    { "io-threads", required_argument, NULL, 'i', },
+    { "resume", no_argument, NULL, 'R', },
     { "export", required_argument, NULL, 'E', },
+    { "no-fsync", no_argument, NULL, 'N', },
     { "config-file", required_argument, NULL, 'c', },
     { "central-config-dir", required_argument, NULL, 'F' },
     { "seafdir", required_argument, NULL, 'd', },
@@ -31,8 +36,16 @@ static const struct option long_opts[] = {
 static void usage ()
 {
     fprintf (stderr,
-             "usage: seaf-fsck [-r] [-E exported_path] [-c config_dir] [-d seafile_dir] "
-             "[repo_id_1 [repo_id_2 ...]]\n");
+             "usage: seaf-fsck [-r] [-t threads] [-i io_threads] [-R] "
+             "[-E exported_path] [-c config_dir] [-d seafile_dir] "
+             "[repo_id_1 [repo_id_2 ...]]\n"
+             "Additional options:\n"
+             "-t, --threads: number of repos checked in parallel, "
+             "or of files written in parallel with -E\n"
+             "-i, --io-threads: number of threads verifying blocks, shared by all repos, "
+             "defaults to verifying on the checking thread\n"
+             "-R, --resume: skip dirs and blocks checked by an interrupted run\n"
+             "-N, --no-fsync: don't fsync exported files\n");
 }
 
 #ifdef WIN32
@@ -94,6 +107,11 @@ main(int argc, char *argv[])
     gboolean force = FALSE;
     char *export_path = NULL;
     int max_thread_num = 0;
+    int io_thread_num = 0;
+    gboolean resume = FALSE;
+    gboolean no_fsync = FALSE;
+    BgThrottle *throttle;
+    ProcPolicy *policy;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
@@ -116,6 +134,15 @@ main(int argc, char *argv[])
 	case 't':
 	    max_thread_num = atoi(strdup(optarg));
 	    break;
+        case 'i':
+            io_thread_num = atoi(optarg);
+            break;
+        case 'R':
+            resume = TRUE;
+            break;
+        case 'N':
+            no_fsync = TRUE;
+            break;
         case 'r':
             repair = TRUE;
             break;
@@ -166,15 +193,25 @@ main(int argc, char *argv[])
         exit (1);
     }
 
+    /* Run in the cgroup of [resources.fsck], away from the serving processes. */
+    policy = proc_policy_load (seaf->config, "fsck");
+    proc_policy_setup (policy);
+    proc_policy_enter (policy);
+
+    throttle = bg_throttle_new (seaf->config, "fsck");
+    bg_throttle_apply_priority (throttle);
+    bg_throttle_set_global (throttle);
+
     GList *repo_id_list = NULL;
     int i;
     for (i = optind; i < argc; i++)
         repo_id_list = g_list_append (repo_id_list, g_strdup(argv[i]));
 
     if (export_path) {
-        export_file (repo_id_list, seafile_dir, export_path);
+        export_file (repo_id_list, seafile_dir, export_path,
+                     max_thread_num, no_fsync);
     } else {
-        seaf_fsck (repo_id_list, repair, max_thread_num);
+        seaf_fsck (repo_id_list, repair, max_thread_num, io_thread_num, resume);
     }
 
     return 0;
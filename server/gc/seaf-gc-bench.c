@@ -0,0 +1,791 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmark of GC and fsck on synthetic libraries.
+ *
+ * The generator builds repos with the same code paths as the server: blocks
+ * are written by the block manager, files and dirs by the fs manager and
+ * commits by the commit manager. Each commit changes some files of the
+ * tree, adding, modifying and deleting them. The shape of the store is
+ * controlled by:
+ *
+ *   -r repos, -c commits of each repo, -m a merge commit every n commits,
+ *   -n files changed per commit, -w dirs per repo, -b blocks per file,
+ *   -s block size, -S ratio of blocks shared with earlier files,
+ *   -g ratio of garbage in the store, -l days of history to keep.
+ *
+ * Commits are one day apart and end now, so that -l makes GC drop part of
+ * the history. Garbage is written as files that no commit refers to.
+ *
+ * The driver runs fsck, then GC with -R, on all repos of a store, and prints
+ * one JSON object per line for each phase and each tool:
+ *
+ *   {"name": "gc/mark", "seconds": t, "objects": n, "objects_per_s": r}
+ *   {"name": "gc", "seconds": t, "peak_rss_kb": k}
+ *
+ * Phase times are summed over repos, see phase-stats.h. The peak RSS is the
+ * one of the tool's run where the kernel can reset it, of the process
+ * otherwise.
+ *
+ *   seaf-gc-bench [generate options] [run options]
+ *       generates a store in a temp dir, runs the tools and removes it
+ *   seaf-gc-bench -G dir [generate options]
+ *       only generates a store in dir, to be used by several runs
+ *   seaf-gc-bench -d dir [run options]
+ *       runs the tools on a generated store, -D not to remove anything
+ *
+ * Run options: -t repos processed in parallel, -i fsck verify threads,
+ * -D GC dry run, -v log what the tools do.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "seafile-session.h"
+#include "gc-core.h"
+#include "fsck.h"
+#include "phase-stats.h"
+
+SeafileSession *seaf;
+
+#define BENCH_USER "bench@example.com"
+#define DAY_SECONDS (24 * 3600)
+
+typedef struct GenParams {
+    int n_repos;
+    int n_commits;
+    int merge_every;
+    int files_per_commit;
+    int n_dirs;
+    int blocks_per_file;
+    int block_size;
+    double share_ratio;
+    double garbage_ratio;
+    int history_days;
+} GenParams;
+
+typedef struct GenStats {
+    gint64 commits;
+    gint64 fs_objs;
+    gint64 blocks;
+    gint64 shared_blocks;
+    gint64 garbage_fs_objs;
+    gint64 garbage_blocks;
+} GenStats;
+
+typedef struct GenFile {
+    int serial;
+    char id[41];
+    gint64 size;
+} GenFile;
+
+typedef struct GenDir {
+    GArray *files;
+    int next_serial;
+    char id[41];
+    gboolean dirty;
+} GenDir;
+
+typedef struct GenRepo {
+    char id[37];
+    int index;
+    guint64 rand;
+    GenDir *dirs;
+    /* Raw ids of the blocks written, 20 bytes each, to be shared. */
+    GByteArray *blocks;
+    gint64 next_block;
+} GenRepo;
+
+static GenParams params = {
+    .n_repos = 4,
+    .n_commits = 100,
+    .merge_every = 0,
+    .files_per_commit = 20,
+    .n_dirs = 16,
+    .blocks_per_file = 4,
+    .block_size = 8192,
+    .share_ratio = 0.1,
+    .garbage_ratio = 0.2,
+    .history_days = -1,
+};
+
+static GenStats gen_stats;
+static char *block_data;
+
+static guint64
+gen_rand (GenRepo *repo)
+{
+    /* xorshift64*, seeded by the repo, so that stores are reproducible. */
+    repo->rand ^= repo->rand >> 12;
+    repo->rand ^= repo->rand << 25;
+    repo->rand ^= repo->rand >> 27;
+    return repo->rand * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+gen_rand_double (GenRepo *repo)
+{
+    return (gen_rand (repo) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+write_block (const char *store_id, const char *block_id,
+             const char *buf, int len)
+{
+    BlockHandle *handle;
+    int ret = 0;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr, store_id, 1,
+                                            block_id, BLOCK_WRITE);
+    if (!handle)
+        return -1;
+    if (seaf_block_manager_write_block (seaf->block_mgr, handle, buf, len) != len)
+        ret = -1;
+    if (seaf_block_manager_close_block (seaf->block_mgr, handle) < 0)
+        ret = -1;
+    if (ret == 0 && seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0)
+        ret = -1;
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+/*
+ * Blocks are the same random data with the repo and a counter in front, so
+ * that every block has its own id and fsck can verify them.
+ */
+static int
+new_block (GenRepo *repo, char *block_id)
+{
+    unsigned char sha1[20];
+    gint64 header[2];
+
+    header[0] = repo->index;
+    header[1] = repo->next_block++;
+    memcpy (block_data, header, sizeof(header));
+
+    calculate_sha1 (sha1, block_data, params.block_size);
+    rawdata_to_hex (sha1, block_id, 20);
+    if (write_block (repo->id, block_id, block_data, params.block_size) < 0) {
+        fprintf (stderr, "Failed to write block %s.\n", block_id);
+        return -1;
+    }
+
+    g_byte_array_append (repo->blocks, sha1, 20);
+    return 0;
+}
+
+static int
+pick_block (GenRepo *repo, double share_ratio, char *block_id)
+{
+    guint n_blocks = repo->blocks->len / 20;
+    guint i;
+
+    if (n_blocks > 0 && gen_rand_double (repo) < share_ratio) {
+        i = gen_rand (repo) % n_blocks;
+        rawdata_to_hex (repo->blocks->data + i * 20, block_id, 20);
+        ++gen_stats.shared_blocks;
+        return 0;
+    }
+
+    ++gen_stats.blocks;
+    return new_block (repo, block_id);
+}
+
+static int
+make_file (GenRepo *repo, double share_ratio, GenFile *file)
+{
+    GList *block_ids = NULL;
+    unsigned char sha1[20];
+    char block_id[41];
+    int n_blocks, i;
+    int ret = 0;
+
+    /* Between 1 and 2 * blocks_per_file - 1 blocks. */
+    n_blocks = 1 + gen_rand (repo) % (2 * params.blocks_per_file - 1);
+    for (i = 0; i < n_blocks; ++i) {
+        if (pick_block (repo, share_ratio, block_id) < 0) {
+            ret = -1;
+            goto out;
+        }
+        block_ids = g_list_prepend (block_ids, g_strdup (block_id));
+    }
+    block_ids = g_list_reverse (block_ids);
+
+    file->size = (gint64)n_blocks * params.block_size;
+    if (seaf_fs_manager_index_existed_file_blocks (seaf->fs_mgr, repo->id, 1,
+                                                   block_ids, sha1,
+                                                   file->size) < 0) {
+        fprintf (stderr, "Failed to write file object.\n");
+        ret = -1;
+        goto out;
+    }
+    rawdata_to_hex (sha1, file->id, 20);
+    ++gen_stats.fs_objs;
+
+out:
+    g_list_free_full (block_ids, g_free);
+    return ret;
+}
+
+/* Adds, modifies or deletes files_per_commit files of random dirs. */
+static int
+change_tree (GenRepo *repo)
+{
+    GenDir *dir;
+    GenFile file, *old;
+    guint64 r;
+    int i;
+
+    for (i = 0; i < params.files_per_commit; ++i) {
+        dir = &repo->dirs[gen_rand (repo) % params.n_dirs];
+        dir->dirty = TRUE;
+        r = gen_rand (repo) % 10;
+
+        if (dir->files->len > 0 && r == 0) {
+            g_array_remove_index (dir->files, gen_rand (repo) % dir->files->len);
+        } else if (dir->files->len > 0 && r < 6) {
+            old = &g_array_index (dir->files, GenFile,
+                                  gen_rand (repo) % dir->files->len);
+            if (make_file (repo, params.share_ratio, old) < 0)
+                return -1;
+        } else {
+            file.serial = dir->next_serial++;
+            if (make_file (repo, params.share_ratio, &file) < 0)
+                return -1;
+            g_array_append_val (dir->files, file);
+        }
+    }
+
+    return 0;
+}
+
+static int
+save_dir (GenRepo *repo, GList *entries, char *dir_id)
+{
+    SeafDir *dir;
+    int ret = 0;
+
+    dir = seaf_dir_new (NULL, entries, 1);
+    if (seaf_dir_save (seaf->fs_mgr, repo->id, 1, dir) < 0) {
+        fprintf (stderr, "Failed to save dir object.\n");
+        ret = -1;
+    }
+    memcpy (dir_id, dir->dir_id, 41);
+    seaf_dir_free (dir);
+    ++gen_stats.fs_objs;
+
+    return ret;
+}
+
+static int
+save_tree (GenRepo *repo, gint64 mtime, char *root_id)
+{
+    GList *entries;
+    GenDir *dir;
+    GenFile *file;
+    char name[64];
+    int i;
+    guint j;
+
+    /* Dirents are kept sorted by name in descending order. */
+    for (i = 0; i < params.n_dirs; ++i) {
+        dir = &repo->dirs[i];
+        if (!dir->dirty)
+            continue;
+        entries = NULL;
+        for (j = 0; j < dir->files->len; ++j) {
+            file = &g_array_index (dir->files, GenFile, j);
+            snprintf (name, sizeof(name), "file%07d.bin", file->serial);
+            entries = g_list_prepend (entries,
+                                      seaf_dirent_new (1, file->id, S_IFREG | 0644,
+                                                       name, mtime, BENCH_USER,
+                                                       file->size));
+        }
+        if (save_dir (repo, entries, dir->id) < 0)
+            return -1;
+        dir->dirty = FALSE;
+    }
+
+    entries = NULL;
+    for (i = 0; i < params.n_dirs; ++i) {
+        snprintf (name, sizeof(name), "dir%04d", i);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (1, repo->dirs[i].id, S_IFDIR,
+                                                   name, mtime, BENCH_USER, 0));
+    }
+    return save_dir (repo, entries, root_id);
+}
+
+static int
+add_commit (GenRepo *repo, const char *root_id, const char *parent_id,
+            const char *second_parent_id, gint64 ctime, char *commit_id)
+{
+    SeafCommit *commit;
+    char creator_id[41];
+    int ret;
+
+    memset (creator_id, '0', 40);
+    creator_id[40] = '\0';
+
+    commit = seaf_commit_new (NULL, repo->id, root_id, BENCH_USER, creator_id,
+                              "Changed files", ctime);
+    commit->parent_id = g_strdup (parent_id);
+    commit->second_parent_id = g_strdup (second_parent_id);
+    commit->repo_name = g_strdup ("bench");
+    commit->repo_desc = g_strdup ("");
+    commit->version = 1;
+
+    ret = seaf_commit_manager_add_commit (seaf->commit_mgr, commit);
+    if (ret < 0)
+        fprintf (stderr, "Failed to add commit.\n");
+    memcpy (commit_id, commit->commit_id, 41);
+    seaf_commit_unref (commit);
+    ++gen_stats.commits;
+
+    return ret;
+}
+
+static int
+commit_changes (GenRepo *repo, const char *parent_id,
+                const char *second_parent_id, gint64 ctime, char *commit_id)
+{
+    char root_id[41];
+
+    if (change_tree (repo) < 0 || save_tree (repo, ctime, root_id) < 0)
+        return -1;
+    return add_commit (repo, root_id, parent_id, second_parent_id, ctime,
+                       commit_id);
+}
+
+static int
+add_repo_to_db (GenRepo *repo, const char *head_id)
+{
+    SeafBranch *branch;
+    int ret;
+
+    if (seaf_db_statement_query (seaf->db, "INSERT INTO Repo (repo_id) VALUES (?)",
+                                 1, "string", repo->id) < 0)
+        return -1;
+
+    branch = seaf_branch_new ("master", repo->id, head_id);
+    ret = seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+    seaf_branch_unref (branch);
+    if (ret < 0)
+        return -1;
+
+    if (params.history_days >= 0 &&
+        seaf_repo_manager_set_repo_history_limit (seaf->repo_mgr, repo->id,
+                                                  params.history_days) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Files of fresh blocks that no dir refers to. */
+static int
+add_garbage (GenRepo *repo)
+{
+    gint64 live_blocks = repo->blocks->len / 20;
+    gint64 target;
+    gint64 start = repo->next_block;
+    gint64 n_files = 0;
+    GenFile file;
+
+    target = (gint64)(live_blocks * params.garbage_ratio /
+                      (1 - params.garbage_ratio));
+    while (repo->next_block - start < target) {
+        if (make_file (repo, 0, &file) < 0)
+            return -1;
+        ++n_files;
+    }
+
+    /* make_file() counted them as live. */
+    gen_stats.garbage_fs_objs += n_files;
+    gen_stats.fs_objs -= n_files;
+    gen_stats.garbage_blocks += repo->next_block - start;
+    gen_stats.blocks -= repo->next_block - start;
+    return 0;
+}
+
+static int
+generate_repo (int index, gint64 now)
+{
+    GenRepo repo;
+    char head[41], prev[41], side[41], merged[41];
+    gboolean has_head = FALSE, has_prev = FALSE;
+    gint64 ctime;
+    int i, ret = 0;
+
+    memset (&repo, 0, sizeof(repo));
+    snprintf (repo.id, sizeof(repo.id), "%08x-0000-4000-8000-%012x",
+              0xbe000000 + index, index);
+    repo.index = index;
+    repo.rand = 0x9e3779b97f4a7c15ULL * (index + 1);
+    repo.dirs = g_new0 (GenDir, params.n_dirs);
+    for (i = 0; i < params.n_dirs; ++i) {
+        repo.dirs[i].files = g_array_new (FALSE, FALSE, sizeof(GenFile));
+        repo.dirs[i].dirty = TRUE;
+    }
+    repo.blocks = g_byte_array_new ();
+
+    for (i = 0; i < params.n_commits; ++i) {
+        ctime = now - (gint64)(params.n_commits - 1 - i) * DAY_SECONDS;
+
+        if (params.merge_every > 0 && has_prev && i % params.merge_every == 0) {
+            /* A commit made on top of the previous one, then merged. */
+            if (commit_changes (&repo, prev, NULL, ctime, side) < 0 ||
+                commit_changes (&repo, head, side, ctime, merged) < 0) {
+                ret = -1;
+                break;
+            }
+            memcpy (prev, head, 41);
+            memcpy (head, merged, 41);
+            continue;
+        }
+
+        if (has_head)
+            memcpy (prev, head, 41);
+        has_prev = has_head;
+        if (commit_changes (&repo, has_head ? prev : NULL, NULL, ctime, head) < 0) {
+            ret = -1;
+            break;
+        }
+        has_head = TRUE;
+    }
+
+    if (ret == 0 && has_head && add_repo_to_db (&repo, head) < 0) {
+        fprintf (stderr, "Failed to add repo %s to the database.\n", repo.id);
+        ret = -1;
+    }
+    if (ret == 0 && params.garbage_ratio > 0)
+        ret = add_garbage (&repo);
+
+    for (i = 0; i < params.n_dirs; ++i)
+        g_array_free (repo.dirs[i].files, TRUE);
+    g_free (repo.dirs);
+    g_byte_array_free (repo.blocks, TRUE);
+    return ret;
+}
+
+/* The tables GC and fsck read, as created by seaf-server. */
+static const char *table_sqls[] = {
+    "CREATE TABLE IF NOT EXISTS Repo (repo_id CHAR(37) PRIMARY KEY)",
+    "CREATE TABLE IF NOT EXISTS Branch (name VARCHAR(10), repo_id CHAR(40), "
+    "commit_id CHAR(40), PRIMARY KEY (repo_id, name))",
+    "CREATE TABLE IF NOT EXISTS VirtualRepo (repo_id CHAR(36) PRIMARY KEY, "
+    "origin_repo CHAR(36), path TEXT, base_commit CHAR(40))",
+    "CREATE TABLE IF NOT EXISTS RepoHistoryLimit (repo_id CHAR(37) PRIMARY KEY, "
+    "days INTEGER)",
+    "CREATE TABLE IF NOT EXISTS RepoValidSince (repo_id CHAR(37) PRIMARY KEY, "
+    "timestamp BIGINT)",
+    "CREATE TABLE IF NOT EXISTS GarbageRepos (repo_id CHAR(36) PRIMARY KEY)",
+    "CREATE TABLE IF NOT EXISTS RepoUserToken (repo_id CHAR(37), "
+    "email VARCHAR(255), token CHAR(41))",
+    "CREATE TABLE IF NOT EXISTS RepoTokenPeerInfo (token CHAR(41) PRIMARY KEY, "
+    "peer_id CHAR(41), peer_ip VARCHAR(41), peer_name VARCHAR(255), "
+    "sync_time BIGINT, client_ver VARCHAR(20))",
+};
+
+static int
+generate ()
+{
+    GTimer *timer = g_timer_new ();
+    gint64 now = (gint64)time(NULL);
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(table_sqls); ++i) {
+        if (seaf_db_query (seaf->db, table_sqls[i]) < 0) {
+            fprintf (stderr, "Failed to create tables.\n");
+            g_timer_destroy (timer);
+            return -1;
+        }
+    }
+
+    block_data = g_malloc (params.block_size);
+    for (i = 0; i < params.block_size; ++i)
+        block_data[i] = (char)(i * 2654435761U >> 24);
+
+    for (i = 0; i < params.n_repos; ++i) {
+        if (generate_repo (i, now) < 0) {
+            g_timer_destroy (timer);
+            return -1;
+        }
+    }
+
+    printf ("{\"name\": \"generate\", \"seconds\": %.3f, \"repos\": %d, "
+            "\"commits\": %" G_GINT64_FORMAT ", \"fs_objects\": %" G_GINT64_FORMAT
+            ", \"blocks\": %" G_GINT64_FORMAT ", \"shared_blocks\": %" G_GINT64_FORMAT
+            ", \"garbage_fs_objects\": %" G_GINT64_FORMAT
+            ", \"garbage_blocks\": %" G_GINT64_FORMAT "}\n",
+            g_timer_elapsed (timer, NULL), params.n_repos, gen_stats.commits,
+            gen_stats.fs_objs, gen_stats.blocks, gen_stats.shared_blocks,
+            gen_stats.garbage_fs_objs, gen_stats.garbage_blocks);
+    fflush (stdout);
+
+    g_timer_destroy (timer);
+    return 0;
+}
+
+/* Linux resets the peak RSS of VmHWM when 5 is written to clear_refs. */
+static gboolean
+reset_peak_rss ()
+{
+    return g_file_set_contents ("/proc/self/clear_refs", "5", 1, NULL);
+}
+
+static gint64
+get_peak_rss_kb ()
+{
+    struct rusage usage;
+    char *status = NULL, *p;
+    gint64 kb = -1;
+
+    if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL)) {
+        p = strstr (status, "VmHWM:");
+        if (p)
+            kb = g_ascii_strtoll (p + strlen("VmHWM:"), NULL, 10);
+        g_free (status);
+    }
+    if (kb < 0 && getrusage (RUSAGE_SELF, &usage) == 0)
+        kb = usage.ru_maxrss;
+
+    return kb;
+}
+
+static void
+print_phases (Phase first, Phase last)
+{
+    PhaseStats stats;
+    double seconds;
+    Phase phase;
+
+    for (phase = first; phase <= last; ++phase) {
+        phase_stats_get (phase, &stats);
+        if (stats.usec == 0 && stats.objects == 0)
+            continue;
+        seconds = stats.usec / 1e6;
+        printf ("{\"name\": \"%s\", \"seconds\": %.3f, \"objects\": %" G_GINT64_FORMAT
+                ", \"objects_per_s\": %.1f}\n",
+                phase_stats_name (phase), seconds, stats.objects,
+                seconds > 0 ? stats.objects / seconds : 0);
+    }
+}
+
+static void
+print_tool (const char *name, double seconds)
+{
+    printf ("{\"name\": \"%s\", \"seconds\": %.3f, \"peak_rss_kb\": %" G_GINT64_FORMAT "}\n",
+            name, seconds, get_peak_rss_kb ());
+    fflush (stdout);
+}
+
+static int
+run_tools (int threads, int io_threads, int dry_run, int verbose)
+{
+    GTimer *timer = g_timer_new ();
+
+    reset_peak_rss ();
+    phase_stats_reset ();
+    g_timer_start (timer);
+    seaf_fsck (NULL, FALSE, threads > 1 ? threads : 0, io_threads, FALSE);
+    print_phases (PHASE_FSCK_VERIFY, PHASE_FSCK_CHECK);
+    print_tool ("fsck", g_timer_elapsed (timer, NULL));
+
+    reset_peak_rss ();
+    phase_stats_reset ();
+    g_timer_start (timer);
+    gc_core_run (NULL, dry_run, verbose, 1, 1, threads, 0, 0);
+    print_phases (PHASE_GC_SCAN, PHASE_GC_SWEEP_FS);
+    print_tool ("gc", g_timer_elapsed (timer, NULL));
+
+    g_timer_destroy (timer);
+    return 0;
+}
+
+static int
+create_data_dir (const char *dir)
+{
+    char *tmp_dir = g_build_filename (dir, "tmpfiles", NULL);
+    char *conf = g_build_filename (dir, "seafile.conf", NULL);
+    int ret = 0;
+
+    if (g_mkdir_with_parents (tmp_dir, 0700) < 0 ||
+        !g_file_set_contents (conf, "[database]\ntype = sqlite\n", -1, NULL)) {
+        fprintf (stderr, "Failed to create data dir %s.\n", dir);
+        ret = -1;
+    }
+
+    g_free (tmp_dir);
+    g_free (conf);
+    return ret;
+}
+
+static void
+remove_dir (const char *path)
+{
+    GDir *dir;
+    const char *name;
+    char *child;
+    SeafStat st;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            child = g_build_filename (path, name, NULL);
+            if (seaf_stat (child, &st) == 0 && S_ISDIR(st.st_mode))
+                remove_dir (child);
+            else
+                g_unlink (child);
+            g_free (child);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (path);
+}
+
+static void
+usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-gc-bench [-G dir | -d dir] [-r repos] [-c commits] "
+             "[-m merge_every] [-n files_per_commit] [-w dirs] "
+             "[-b blocks_per_file] [-s block_size] [-S share_ratio] "
+             "[-g garbage_ratio] [-l history_days] [-t threads] "
+             "[-i io_threads] [-D] [-v]\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *gen_dir = NULL, *data_dir = NULL;
+    char *seafile_dir;
+    gboolean temp_dir = FALSE;
+    int threads = 1, io_threads = 0;
+    int dry_run = 0, verbose = 0;
+    int c;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "G:d:r:c:m:n:w:b:s:S:g:l:t:i:Dvh")) != -1) {
+        switch (c) {
+        case 'G':
+            gen_dir = optarg;
+            break;
+        case 'd':
+            data_dir = optarg;
+            break;
+        case 'r':
+            params.n_repos = atoi (optarg);
+            break;
+        case 'c':
+            params.n_commits = atoi (optarg);
+            break;
+        case 'm':
+            params.merge_every = atoi (optarg);
+            break;
+        case 'n':
+            params.files_per_commit = atoi (optarg);
+            break;
+        case 'w':
+            params.n_dirs = atoi (optarg);
+            break;
+        case 'b':
+            params.blocks_per_file = atoi (optarg);
+            break;
+        case 's':
+            params.block_size = atoi (optarg);
+            break;
+        case 'S':
+            params.share_ratio = atof (optarg);
+            break;
+        case 'g':
+            params.garbage_ratio = atof (optarg);
+            break;
+        case 'l':
+            params.history_days = atoi (optarg);
+            break;
+        case 't':
+            threads = atoi (optarg);
+            break;
+        case 'i':
+            io_threads = atoi (optarg);
+            break;
+        case 'D':
+            dry_run = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage ();
+            return 1;
+        }
+    }
+
+    if ((gen_dir && data_dir) || params.n_repos <= 0 || params.n_commits <= 0 ||
+        params.n_dirs <= 0 || params.blocks_per_file <= 0 ||
+        params.block_size < 16 || params.garbage_ratio < 0 ||
+        params.garbage_ratio >= 1) {
+        usage ();
+        return 1;
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    if (seafile_log_init ("-", "info", verbose ? "info" : "warning") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        return 1;
+    }
+
+    if (gen_dir) {
+        seafile_dir = g_strdup (gen_dir);
+    } else if (data_dir) {
+        seafile_dir = g_strdup (data_dir);
+    } else {
+        seafile_dir = g_build_filename (g_get_tmp_dir (), "seaf-gc-bench-XXXXXX", NULL);
+        if (!g_mkdtemp (seafile_dir)) {
+            fprintf (stderr, "Failed to create temp dir.\n");
+            g_free (seafile_dir);
+            return 1;
+        }
+        temp_dir = TRUE;
+    }
+
+    if (!data_dir && create_data_dir (seafile_dir) < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    seaf = seafile_session_new (NULL, seafile_dir, seafile_dir, TRUE);
+    if (!seaf) {
+        fprintf (stderr, "Failed to create seafile session.\n");
+        ret = 1;
+        goto out;
+    }
+
+    if (!data_dir && generate () < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    if (!gen_dir)
+        run_tools (threads, io_threads, dry_run, verbose);
+
+out:
+    if (temp_dir)
+        remove_dir (seafile_dir);
+    g_free (seafile_dir);
+    return ret;
+}
@@ -6,6 +6,8 @@
 #include "seafile-session.h"
 #include "gc-core.h"
 #include "verify.h"
+#include "bg-throttle.h"
+#include "proc-policy.h"
 
 #include "utils.h"
 
@@ -15,7 +17,10 @@ static char *central_config_dir = NULL;
 
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:VDrRF:";
+/* Long enough for any upload to be committed. */
+#define DEFAULT_GRACE_HOURS 24
+
+static const char *short_opts = "hvc:d:VDrRfF:t:i:og:";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -26,6 +31,11 @@ static const struct option long_opts[] = {
     { "dry-run", no_argument, NULL, 'D' },
     { "rm-deleted", no_argument, NULL, 'r' },
     { "rm-fs", no_argument, NULL, 'R' },
+    { "full", no_argument, NULL, 'f' },
+    { "threads", required_argument, NULL, 't', },
+    { "io-limit", required_argument, NULL, 'i', },
+    { "online", no_argument, NULL, 'o', },
+    { "grace-hours", required_argument, NULL, 'g', },
     { 0, 0, 0, 0 },
 };
 
@@ -37,8 +47,17 @@ static void usage ()
              "Additional options:\n"
              "-r, --rm-deleted: remove garbaged repos\n"
              "-R, --rm-fs: remove fs object\n"
+             "-f, --full: traverse the whole history, "
+             "instead of the commits added since the last GC\n"
              "-D, --dry-run: report blocks that can be remove, but not remove them\n"
-             "-V, --verbose: verbose output messages\n");
+             "-V, --verbose: verbose output messages\n"
+             "-t, --threads: number of repos collected at once\n"
+             "-i, --io-limit: max number of repos scanning their storage at once, "
+             "defaults to no limit\n"
+             "-o, --online: run at low priority while the server keeps serving\n"
+             "-g, --grace-hours: with --online, keep unused blocks written in the "
+             "last hours, defaults to 24\n"
+             "--online can't be used with --rm-fs.\n");
 }
 
 #ifdef WIN32
@@ -75,6 +94,13 @@ main(int argc, char *argv[])
     int dry_run = 0;
     int rm_garbage = 0;
     int rm_fs = 0;
+    int full_mark = 0;
+    int max_thread_num = 0;
+    int max_io_num = 0;
+    int online = 0;
+    int grace_hours = DEFAULT_GRACE_HOURS;
+    BgThrottle *throttle;
+    ProcPolicy *policy;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
@@ -112,6 +138,21 @@ main(int argc, char *argv[])
         case 'R':
             rm_fs = 1;
             break;
+        case 'f':
+            full_mark = 1;
+            break;
+        case 't':
+            max_thread_num = atoi(optarg);
+            break;
+        case 'i':
+            max_io_num = atoi(optarg);
+            break;
+        case 'o':
+            online = 1;
+            break;
+        case 'g':
+            grace_hours = atoi(optarg);
+            break;
         default:
             usage();
             exit(-1);
@@ -136,6 +177,29 @@ main(int argc, char *argv[])
         exit (1);
     }
 
+    if (online) {
+        if (grace_hours <= 0) {
+            seaf_warning ("Grace period must be at least one hour.\n");
+            exit (1);
+        }
+        if (rm_fs) {
+            seaf_warning ("Fs objects can't be removed by online GC.\n");
+            exit (1);
+        }
+        /* Leave the CPU and disks to the server. */
+        bg_set_priority ("idle", 19);
+    }
+
+    /* Settings in [gc] override the defaults of --online. */
+    /* Run in the cgroup of [resources.gc], away from the serving processes. */
+    policy = proc_policy_load (seaf->config, "gc");
+    proc_policy_setup (policy);
+    proc_policy_enter (policy);
+
+    throttle = bg_throttle_new (seaf->config, "gc");
+    bg_throttle_apply_priority (throttle);
+    bg_throttle_set_global (throttle);
+
     if (rm_garbage) {
         delete_garbaged_repos (dry_run);
         return 0;
@@ -146,7 +210,9 @@ main(int argc, char *argv[])
     for (i = optind; i < argc; i++)
         repo_id_list = g_list_append (repo_id_list, g_strdup(argv[i]));
 
-    gc_core_run (repo_id_list, dry_run, verbose, rm_fs);
+    gc_core_run (repo_id_list, dry_run, verbose, rm_fs, full_mark,
+                 max_thread_num, max_io_num,
+                 online ? (gint64)grace_hours * 3600 : 0);
 
     return 0;
 }
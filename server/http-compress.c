@@ -0,0 +1,320 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <string.h>
+
+#include "log.h"
+#include "seafile-session.h"
+#include "fileserver-config.h"
+#include "http-io.h"
+#include "http-compress.h"
+
+/* Smaller replies gain little, and the chunked reply costs a round of
+ * the write callback per piece.
+ */
+#define DEFAULT_COMPRESS_MIN_SIZE 8192
+
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+
+/* A compressed body can't be decoded into more than this. */
+#define MAX_DECODED_BODY_SIZE ((gint64)64 << 20)
+
+static int compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+
+void
+http_compress_init (SeafileSession *session)
+{
+    GError *error = NULL;
+    int min_size;
+
+    min_size = fileserver_config_get_integer (session->config,
+                                              "compress_min_size", &error);
+    if (error) {
+        g_clear_error (&error);
+    } else {
+        compress_min_size = min_size;
+    }
+    seaf_message ("fileserver: compress_min_size = %d\n", compress_min_size);
+}
+
+gboolean
+http_accepts_gzip (evhtp_request_t *req)
+{
+    const char *accept = evhtp_kv_find (req->headers_in, "Accept-Encoding");
+    char **encodings, **ptr, *param;
+    gboolean ret = FALSE;
+
+    if (!accept)
+        return FALSE;
+
+    encodings = g_strsplit (accept, ",", 0);
+    for (ptr = encodings; *ptr; ++ptr) {
+        param = strchr (*ptr, ';');
+        if (param)
+            *param++ = '\0';
+        if (strcmp (g_strstrip (*ptr), "gzip") != 0)
+            continue;
+        /* "gzip;q=0" means gzip is not acceptable. */
+        ret = !param || strcmp (g_strstrip (param), "q=0") != 0;
+        break;
+    }
+    g_strfreev (encodings);
+
+    return ret;
+}
+
+gboolean
+http_should_compress (evhtp_request_t *req, size_t len)
+{
+    return compress_min_size >= 0 && len >= (size_t)compress_min_size &&
+        http_accepts_gzip (req);
+}
+
+z_stream *
+http_gzip_stream_new ()
+{
+    z_stream *zstrm = g_new0 (z_stream, 1);
+
+    if (deflateInit2 (zstrm, Z_BEST_SPEED, Z_DEFLATED,
+                      MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        seaf_warning ("Failed to init gzip stream.\n");
+        g_free (zstrm);
+        return NULL;
+    }
+
+    return zstrm;
+}
+
+void
+http_gzip_stream_free (z_stream *zstrm)
+{
+    if (!zstrm)
+        return;
+    deflateEnd (zstrm);
+    g_free (zstrm);
+}
+
+int
+http_gzip_deflate (z_stream *zstrm, struct evbuffer *in, size_t len,
+                   int flush, struct evbuffer *out)
+{
+    unsigned char buf[COMPRESS_CHUNK_SIZE];
+    int rc;
+
+    zstrm->next_in = len > 0 ? evbuffer_pullup (in, len) : NULL;
+    zstrm->avail_in = len;
+    do {
+        zstrm->next_out = buf;
+        zstrm->avail_out = sizeof(buf);
+        rc = deflate (zstrm, flush);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+        evbuffer_add (out, buf, sizeof(buf) - zstrm->avail_out);
+    } while (zstrm->avail_out == 0);
+    evbuffer_drain (in, len);
+
+    return 0;
+}
+
+typedef struct SendCompressedData {
+    evhtp_request_t *req;
+    struct evbuffer *body;
+    z_stream *zstrm;
+    HttpIOStream stream;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendCompressedData;
+
+static void
+free_send_compressed_data (SendCompressedData *data)
+{
+    evbuffer_free (data->body);
+    http_gzip_stream_free (data->zstrm);
+    http_io_stream_clear (&data->stream);
+    g_free (data);
+}
+
+/* Runs on an I/O thread, which keeps the compression off the event loop. */
+static int
+fill_compressed_data (void *vdata, struct evbuffer *out)
+{
+    SendCompressedData *data = vdata;
+    size_t len = evbuffer_get_length (data->body);
+    gboolean last = TRUE;
+
+    if (len > COMPRESS_CHUNK_SIZE) {
+        len = COMPRESS_CHUNK_SIZE;
+        last = FALSE;
+    }
+
+    if (http_gzip_deflate (data->zstrm, data->body, len,
+                           last ? Z_FINISH : Z_NO_FLUSH, out) < 0) {
+        seaf_warning ("Failed to compress reply.\n");
+        return -1;
+    }
+
+    return last ? 1 : 0;
+}
+
+static void
+compressed_data_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendCompressedData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (status < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_send_compressed_data (data);
+        return;
+    }
+
+    if (status == 0) {
+        /* This may call write_compressed_data_cb() recursively and free data.
+         * So don't use "data" variable after here.
+         */
+        evhtp_send_reply_chunk (data->req, out);
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    if (evbuffer_get_length (out) > 0)
+        evhtp_send_reply_chunk (data->req, out);
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_send_compressed_data (data);
+}
+
+static void
+write_compressed_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendCompressedData *data = ctx;
+
+    http_io_stream_next (&data->stream);
+}
+
+static void
+send_compressed_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendCompressedData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_send_compressed_data (data);
+}
+
+void
+http_send_reply_compressed (evhtp_request_t *req, int code)
+{
+    SendCompressedData *data;
+    z_stream *zstrm;
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Vary", "Accept-Encoding", 1, 1));
+
+    if (!http_should_compress (req, evbuffer_get_length (req->buffer_out)) ||
+        !(zstrm = http_gzip_stream_new ())) {
+        evhtp_send_reply (req, code);
+        return;
+    }
+
+    data = g_new0 (SendCompressedData, 1);
+    data->req = req;
+    data->zstrm = zstrm;
+    /* Moves the body without copying it. */
+    data->body = evbuffer_new ();
+    evbuffer_add_buffer (data->body, req->buffer_out);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Encoding", "gzip", 1, 1));
+
+    /* We need to overwrite evhtp's callback functions to
+     * write the compressed body piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    http_io_stream_init (&data->stream, req, fill_compressed_data,
+                         compressed_data_filled,
+                         (GDestroyNotify)free_send_compressed_data, data);
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_compressed_data_cb,
+                       send_compressed_event_cb,
+                       data);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, code);
+}
+
+int
+http_decode_request_body (evhtp_request_t *req)
+{
+    const char *encoding = evhtp_kv_find (req->headers_in, "Content-Encoding");
+    struct evbuffer *decoded;
+    unsigned char buf[COMPRESS_CHUNK_SIZE];
+    size_t len;
+    z_stream zstrm;
+    int rc, status = EVHTP_RES_OK;
+
+    if (!encoding || g_ascii_strcasecmp (encoding, "identity") == 0)
+        return EVHTP_RES_OK;
+    if (g_ascii_strcasecmp (encoding, "gzip") != 0)
+        return EVHTP_RES_UNSUPPORTED;
+
+    memset (&zstrm, 0, sizeof(zstrm));
+    if (inflateInit2 (&zstrm, MAX_WBITS + 16) != Z_OK) {
+        seaf_warning ("Failed to init gzip stream.\n");
+        return EVHTP_RES_SERVERR;
+    }
+
+    len = evbuffer_get_length (req->buffer_in);
+    zstrm.next_in = len > 0 ? evbuffer_pullup (req->buffer_in, -1) : NULL;
+    zstrm.avail_in = len;
+
+    decoded = evbuffer_new ();
+    do {
+        zstrm.next_out = buf;
+        zstrm.avail_out = sizeof(buf);
+        rc = inflate (&zstrm, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END) {
+            seaf_debug ("Failed to decode request body: %d.\n", rc);
+            status = EVHTP_RES_BADREQ;
+            goto out;
+        }
+        evbuffer_add (decoded, buf, sizeof(buf) - zstrm.avail_out);
+        if (evbuffer_get_length (decoded) > MAX_DECODED_BODY_SIZE) {
+            status = EVHTP_RES_DATA_TOO_LONG;
+            goto out;
+        }
+    } while (rc != Z_STREAM_END);
+
+    evbuffer_drain (req->buffer_in, len);
+    evbuffer_add_buffer (req->buffer_in, decoded);
+
+out:
+    inflateEnd (&zstrm);
+    evbuffer_free (decoded);
+    return status;
+}
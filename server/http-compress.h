@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+#include <glib.h>
+#include <zlib.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
+#include <evhtp.h>
+
+/*
+ * Gzip content coding of the large sync replies and request bodies.
+ *
+ * Replies of at least compress_min_size bytes, set in the [fileserver]
+ * section, are compressed for the clients that accept gzip. They are sent
+ * chunked, compressing a piece of the body each time the previous one is
+ * written out, so the compressed reply is never held as a whole. A negative
+ * compress_min_size disables compression.
+ */
+
+struct _SeafileSession;
+
+void
+http_compress_init (struct _SeafileSession *session);
+
+/* Checks the Accept-Encoding header of @req. */
+gboolean
+http_accepts_gzip (evhtp_request_t *req);
+
+/* Whether a reply of @len bytes to @req would be compressed. */
+gboolean
+http_should_compress (evhtp_request_t *req, size_t len);
+
+/*
+ * Sends the content of req->buffer_out, compressed if it's large enough and
+ * the client accepts it. Used instead of evhtp_send_reply().
+ */
+void
+http_send_reply_compressed (evhtp_request_t *req, int code);
+
+/* A gzip stream compressed for speed, NULL on errors. */
+z_stream *
+http_gzip_stream_new ();
+
+void
+http_gzip_stream_free (z_stream *zstrm);
+
+/*
+ * Compresses the first @len bytes of @in, which are drained, into @out.
+ * @flush is passed to deflate(). Returns -1 on errors.
+ */
+int
+http_gzip_deflate (z_stream *zstrm, struct evbuffer *in, size_t len,
+                   int flush, struct evbuffer *out);
+
+/*
+ * Decodes req->buffer_in in place if the body has a Content-Encoding.
+ * Returns EVHTP_RES_OK, or the status to reply with.
+ */
+int
+http_decode_request_body (evhtp_request_t *req);
+
+#endif
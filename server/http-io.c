@@ -0,0 +1,316 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "log.h"
+#include "seafile-session.h"
+#include "fileserver-config.h"
+#include "http-metrics.h"
+#include "http-io.h"
+
+/* Storage I/O mostly waits, so there can be more threads than cores. */
+#define DEFAULT_IO_THREADS 32
+
+/*
+ * Libevent isn't built with locking, so the I/O threads don't touch the
+ * event bases. Each event base has a queue of finished jobs and a pipe,
+ * written when the queue gets its first job and watched by the loop.
+ */
+typedef struct IOCompletions {
+    struct event_base *evbase;
+    int fds[2];
+    struct event *read_ev;
+    pthread_mutex_t lock;
+    GQueue done;
+} IOCompletions;
+
+typedef struct IOJob {
+    IOCompletions *completions;
+    HttpIOFunc func;
+    HttpIODoneFunc done;
+    void *data;
+    gint64 queued_at;
+} IOJob;
+
+static GThreadPool *io_pool;
+
+static pthread_mutex_t completions_lock = PTHREAD_MUTEX_INITIALIZER;
+/* event base -> IOCompletions, never freed since the loops run until exit. */
+static GHashTable *completions;
+
+static int n_running;
+static guint64 n_done;
+static gint64 wait_time;
+
+static void
+io_thread (gpointer vjob, gpointer user_data);
+
+void
+http_io_init (SeafileSession *session)
+{
+    GError *error = NULL;
+    int n_threads;
+
+    n_threads = fileserver_config_get_integer (session->config, "io_threads", &error);
+    if (error) {
+        n_threads = DEFAULT_IO_THREADS;
+        g_clear_error (&error);
+    } else if (n_threads <= 0) {
+        n_threads = DEFAULT_IO_THREADS;
+    }
+    seaf_message ("fileserver: io_threads = %d\n", n_threads);
+
+    completions = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    io_pool = g_thread_pool_new (io_thread, NULL, n_threads, FALSE, &error);
+    if (!io_pool) {
+        seaf_warning ("Failed to create I/O thread pool: %s, "
+                      "storage I/O runs on event threads.\n",
+                      error ? error->message : "");
+        g_clear_error (&error);
+    }
+}
+
+static void
+completions_readable_cb (evutil_socket_t fd, short what, void *arg)
+{
+    IOCompletions *c = arg;
+    GQueue done = G_QUEUE_INIT;
+    IOJob *job;
+    char buf[64];
+
+    while (read (fd, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock (&c->lock);
+    done = c->done;
+    g_queue_init (&c->done);
+    pthread_mutex_unlock (&c->lock);
+
+    while ((job = g_queue_pop_head (&done)) != NULL) {
+        job->done (job->data);
+        g_free (job);
+    }
+}
+
+static int
+set_nonblock (int fd)
+{
+    return fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Called from the loop of @evbase, which can then add events to it. */
+static IOCompletions *
+get_completions (struct event_base *evbase)
+{
+    IOCompletions *c;
+
+    pthread_mutex_lock (&completions_lock);
+
+    c = g_hash_table_lookup (completions, evbase);
+    if (c)
+        goto out;
+
+    c = g_new0 (IOCompletions, 1);
+    if (pipe (c->fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        g_free (c);
+        c = NULL;
+        goto out;
+    }
+    /* A full pipe already wakes the loop up, so writes needn't block. */
+    if (set_nonblock (c->fds[0]) < 0 || set_nonblock (c->fds[1]) < 0) {
+        seaf_warning ("Failed to set pipe non-blocking: %s.\n", strerror(errno));
+        close (c->fds[0]);
+        close (c->fds[1]);
+        g_free (c);
+        c = NULL;
+        goto out;
+    }
+
+    c->evbase = evbase;
+    pthread_mutex_init (&c->lock, NULL);
+    g_queue_init (&c->done);
+    c->read_ev = event_new (evbase, c->fds[0], EV_READ | EV_PERSIST,
+                            completions_readable_cb, c);
+    event_add (c->read_ev, NULL);
+    g_hash_table_insert (completions, evbase, c);
+
+out:
+    pthread_mutex_unlock (&completions_lock);
+    return c;
+}
+
+static void
+io_thread (gpointer vjob, gpointer user_data)
+{
+    IOJob *job = vjob;
+    IOCompletions *c = job->completions;
+    gboolean was_empty;
+
+    __atomic_fetch_add (&wait_time, g_get_monotonic_time () - job->queued_at,
+                        __ATOMIC_RELAXED);
+    __atomic_fetch_add (&n_running, 1, __ATOMIC_RELAXED);
+    job->func (job->data);
+    __atomic_fetch_sub (&n_running, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&n_done, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock (&c->lock);
+    was_empty = g_queue_is_empty (&c->done);
+    g_queue_push_tail (&c->done, job);
+    pthread_mutex_unlock (&c->lock);
+
+    /* Otherwise the loop is already woken up and takes the whole queue. */
+    if (was_empty && write (c->fds[1], "", 1) < 0 && errno != EAGAIN)
+        seaf_warning ("Failed to wake up event loop: %s.\n", strerror(errno));
+}
+
+void
+http_io_run (struct event_base *evbase,
+             HttpIOFunc func, HttpIODoneFunc done, void *data)
+{
+    IOCompletions *c = NULL;
+    IOJob *job;
+
+    if (io_pool)
+        c = get_completions (evbase);
+    if (!c) {
+        func (data);
+        done (data);
+        return;
+    }
+
+    job = g_new0 (IOJob, 1);
+    job->completions = c;
+    job->func = func;
+    job->done = done;
+    job->data = data;
+    job->queued_at = g_get_monotonic_time ();
+    g_thread_pool_push (io_pool, job, NULL);
+}
+
+static evhtp_res
+io_request_fini_cb (evhtp_request_t *req, void *arg)
+{
+    HttpIORequest *ioreq = arg;
+
+    ioreq->req = NULL;
+
+    return EVHTP_RES_OK;
+}
+
+void
+http_io_run_request (HttpIORequest *ioreq, evhtp_request_t *req,
+                     HttpIOFunc func, HttpIODoneFunc done, void *data)
+{
+    ioreq->req = req;
+    http_metrics_set_fini_hook (req, io_request_fini_cb, ioreq);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    http_io_run (evhtp_request_get_connection (req)->evbase, func, done, data);
+}
+
+gboolean
+http_io_request_finish (HttpIORequest *ioreq)
+{
+    if (!ioreq->req)
+        return FALSE;
+
+    http_metrics_set_fini_hook (ioreq->req, NULL, NULL);
+    evhtp_request_resume (ioreq->req);
+
+    return TRUE;
+}
+
+static void
+stream_fill_job (void *vstream)
+{
+    HttpIOStream *stream = vstream;
+
+    do {
+        stream->status = stream->fill (stream->data, stream->out);
+    } while (stream->status == 0 && evbuffer_get_length (stream->out) == 0);
+}
+
+static void
+stream_filled (void *vstream)
+{
+    HttpIOStream *stream = vstream;
+    struct evbuffer *chunk;
+
+    stream->pending = FALSE;
+    if (stream->closed) {
+        stream->free_data (stream->data);
+        return;
+    }
+
+    /* Sending the chunk may call the write callback, which starts filling
+     * the next one on another buffer.
+     */
+    chunk = stream->out;
+    stream->out = evbuffer_new ();
+
+    /* This may free the stream. */
+    stream->filled (stream->data, chunk, stream->status);
+    evbuffer_free (chunk);
+}
+
+void
+http_io_stream_init (HttpIOStream *stream, evhtp_request_t *req,
+                     HttpIOFillFunc fill, HttpIOFilledFunc filled,
+                     GDestroyNotify free_data, void *data)
+{
+    memset (stream, 0, sizeof(HttpIOStream));
+    stream->evbase = evhtp_request_get_connection (req)->evbase;
+    stream->fill = fill;
+    stream->filled = filled;
+    stream->free_data = free_data;
+    stream->data = data;
+    stream->out = evbuffer_new ();
+}
+
+void
+http_io_stream_next (HttpIOStream *stream)
+{
+    if (stream->pending || stream->closed)
+        return;
+
+    stream->pending = TRUE;
+    http_io_run (stream->evbase, stream_fill_job, stream_filled, stream);
+}
+
+gboolean
+http_io_stream_close (HttpIOStream *stream)
+{
+    if (!stream->pending)
+        return FALSE;
+
+    stream->closed = TRUE;
+    return TRUE;
+}
+
+void
+http_io_stream_clear (HttpIOStream *stream)
+{
+    if (stream->out)
+        evbuffer_free (stream->out);
+    stream->out = NULL;
+}
+
+void
+http_io_get_stats (HttpIOStats *stats)
+{
+    stats->queued = io_pool ? g_thread_pool_unprocessed (io_pool) : 0;
+    stats->running = __atomic_load_n (&n_running, __ATOMIC_RELAXED);
+    stats->n_done = __atomic_load_n (&n_done, __ATOMIC_RELAXED);
+    stats->wait_time = __atomic_load_n (&wait_time, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP_IO_H
+#define HTTP_IO_H
+
+#include <glib.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
+#include <evhtp.h>
+
+/*
+ * Blocking block and object I/O of the http handlers runs on a pool of I/O
+ * threads, so that one slow read from the storage doesn't stall all the
+ * connections of an event thread. The result is handed back to the event
+ * loop the job was started from, through a pipe watched by that loop: the
+ * event threads only do network work.
+ *
+ * The pool has io_threads threads, set in the [fileserver] section.
+ */
+
+struct _SeafileSession;
+
+void
+http_io_init (struct _SeafileSession *session);
+
+/* Runs on an I/O thread. */
+typedef void (*HttpIOFunc) (void *data);
+/* Runs in the event loop that started the job. */
+typedef void (*HttpIODoneFunc) (void *data);
+
+/*
+ * Called from the event loop of @evbase. Runs @func on an I/O thread, then
+ * @done in that loop. If the I/O threads couldn't be started, both are
+ * called before it returns, so the caller must not use @data after it.
+ */
+void
+http_io_run (struct event_base *evbase,
+             HttpIOFunc func, HttpIODoneFunc done, void *data);
+
+/*
+ * A request replied to once an I/O job is done. The request is paused
+ * meanwhile, and the connection can be closed before the job is done:
+ * @req is then set to NULL and the done callback must only free its data.
+ */
+typedef struct HttpIORequest {
+    evhtp_request_t *req;
+} HttpIORequest;
+
+void
+http_io_run_request (HttpIORequest *ioreq, evhtp_request_t *req,
+                     HttpIOFunc func, HttpIODoneFunc done, void *data);
+
+/*
+ * Called first by the done callback. Returns FALSE if the request is gone,
+ * otherwise it's resumed and can be replied to.
+ */
+gboolean
+http_io_request_finish (HttpIORequest *ioreq);
+
+/*
+ * A response streamed from the storage. The fill function produces the
+ * next chunk on an I/O thread, the filled function sends it from the event
+ * loop. Only one chunk is filled at a time, the next is started by the
+ * write callback of the connection once the previous one is written out.
+ *
+ * The fill function returns 1 for the last chunk, 0 if more is to come and
+ * -1 on errors. An empty chunk that isn't the last is filled again before
+ * calling the filled function. The filled function must not keep @out.
+ */
+typedef int (*HttpIOFillFunc) (void *data, struct evbuffer *out);
+typedef void (*HttpIOFilledFunc) (void *data, struct evbuffer *out, int status);
+
+typedef struct HttpIOStream {
+    struct event_base *evbase;
+    HttpIOFillFunc fill;
+    HttpIOFilledFunc filled;
+    /* Frees the state of a stream closed while a chunk was filled. */
+    GDestroyNotify free_data;
+    void *data;
+
+    struct evbuffer *out;
+    int status;
+    /* Set while a chunk is filled, the state must not be touched
+     * by the event loop then.
+     */
+    gboolean pending;
+    gboolean closed;
+} HttpIOStream;
+
+void
+http_io_stream_init (HttpIOStream *stream, evhtp_request_t *req,
+                     HttpIOFillFunc fill, HttpIOFilledFunc filled,
+                     GDestroyNotify free_data, void *data);
+
+/* Called from the write callback, does nothing while a chunk is filled. */
+void
+http_io_stream_next (HttpIOStream *stream);
+
+/*
+ * Called when the connection is closed. Returns TRUE if a chunk is being
+ * filled, the state is then freed with free_data once it's done.
+ */
+gboolean
+http_io_stream_close (HttpIOStream *stream);
+
+void
+http_io_stream_clear (HttpIOStream *stream);
+
+typedef struct HttpIOStats {
+    guint queued;
+    int running;
+    guint64 n_done;
+    /* Total time the finished jobs waited for a thread, in microseconds. */
+    gint64 wait_time;
+} HttpIOStats;
+
+void
+http_io_get_stats (HttpIOStats *stats);
+
+#endif
@@ -0,0 +1,848 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <string.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include <evhtp.h>
+
+#include "log.h"
+#include "seafile-session.h"
+#include "seaf-db.h"
+#include "lock-stats.h"
+#include "access-stats.h"
+#include "http-metrics.h"
+#include "http-io.h"
+
+#define MAX_ROUTES 64
+/* Upper bound of the first latency bucket, 256us. */
+#define LATENCY_BUCKET_SHIFT 8
+/* The last bounded bucket ends at about 67s. */
+#define N_LATENCY_BUCKETS 19
+#define MAX_STATUS_CODE 600
+
+#define DEFAULT_QUEUE_TIMEOUT_MSEC 1000
+/* How often queued requests check for a free slot. */
+#define QUEUE_CHECK_INTERVAL_MSEC 10
+#define RETRY_AFTER_SECONDS "1"
+
+typedef struct RouteClass {
+    /* 0 means not limited. */
+    gint64 max_running;
+    gint64 running;
+    gint64 queued;
+    guint64 rejected;
+    guint64 timed_out;
+} RouteClass;
+
+typedef struct RouteMetrics {
+    char *name;
+    evhtp_callback_cb cb;
+    void *arg;
+    HttpRouteClass cls;
+    evhtp_hook_headers_cb headers_cb;
+    void *headers_arg;
+
+    gint64 in_flight;
+    guint64 bytes_in;
+    guint64 bytes_out;
+    /* Sum of the latencies in microseconds. */
+    guint64 latency_sum;
+    /* The last bucket counts requests slower than all bounds. */
+    guint64 latency[N_LATENCY_BUCKETS + 1];
+    guint64 codes[MAX_STATUS_CODE];
+} RouteMetrics;
+
+typedef struct RequestMetrics {
+    RouteMetrics *route;
+    evhtp_request_t *req;
+    gint64 start;
+    /* Fini hook of the request callback. */
+    evhtp_hook_request_fini_cb fini_cb;
+    void *fini_arg;
+    /* Arg of the route callback, headers hooks may replace it. */
+    void *cb_arg;
+    /* Holds a slot of the route class. */
+    gboolean admitted;
+    /* Set while the request waits for a slot. */
+    struct event *queue_timer;
+} RequestMetrics;
+
+static RouteMetrics *routes[MAX_ROUTES];
+static int n_routes;
+
+static RouteClass classes[HTTP_ROUTE_N_CLASSES];
+static gint64 queue_timeout = DEFAULT_QUEUE_TIMEOUT_MSEC * 1000;
+
+static const char *class_names[HTTP_ROUTE_N_CLASSES] = {
+    "unlimited",
+    "sync_meta",
+    "block",
+    "upload",
+    "zip",
+};
+
+static int
+latency_bucket (gint64 usec)
+{
+    int i;
+
+    if (usec <= (1 << LATENCY_BUCKET_SHIFT))
+        return 0;
+    i = 64 - __builtin_clzll ((guint64)(usec - 1)) - LATENCY_BUCKET_SHIFT;
+    return MIN (i, N_LATENCY_BUCKETS);
+}
+
+static gint64
+get_content_length (evhtp_headers_t *headers)
+{
+    const char *value = evhtp_kv_find (headers, "Content-Length");
+
+    if (!value)
+        return 0;
+    return strtoll (value, NULL, 10);
+}
+
+static gboolean
+try_admit (RouteClass *cls)
+{
+    gint64 n = __atomic_load_n (&cls->running, __ATOMIC_RELAXED);
+
+    do {
+        if (cls->max_running > 0 && n >= cls->max_running)
+            return FALSE;
+    } while (!__atomic_compare_exchange_n (&cls->running, &n, n + 1, TRUE,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return TRUE;
+}
+
+static void
+stop_queueing (RequestMetrics *rm)
+{
+    event_free (rm->queue_timer);
+    rm->queue_timer = NULL;
+    __atomic_fetch_sub (&classes[rm->route->cls].queued, 1, __ATOMIC_RELAXED);
+}
+
+static void
+reject_request (evhtp_request_t *req)
+{
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Retry-After", RETRY_AFTER_SECONDS, 1, 1));
+    evhtp_send_reply (req, EVHTP_RES_SERVUNAVAIL);
+}
+
+/* Byte counts are taken from the Content-Length headers, streamed bodies
+ * aren't counted.
+ */
+static evhtp_res
+request_fini_cb (evhtp_request_t *req, void *arg)
+{
+    RequestMetrics *rm = arg;
+    RouteMetrics *route = rm->route;
+    gint64 latency = g_get_monotonic_time () - rm->start;
+    int code = req->status;
+    evhtp_res ret = EVHTP_RES_OK;
+
+    if (code <= 0 || code >= MAX_STATUS_CODE)
+        code = 0;
+
+    __atomic_fetch_add (&route->codes[code], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&route->latency[latency_bucket (latency)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&route->latency_sum, latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&route->bytes_in, get_content_length (req->headers_in),
+                        __ATOMIC_RELAXED);
+    __atomic_fetch_add (&route->bytes_out, get_content_length (req->headers_out),
+                        __ATOMIC_RELAXED);
+    __atomic_fetch_sub (&route->in_flight, 1, __ATOMIC_RELAXED);
+
+    /* The connection was closed while the request was queued. */
+    if (rm->queue_timer)
+        stop_queueing (rm);
+    if (rm->admitted)
+        __atomic_fetch_sub (&classes[route->cls].running, 1, __ATOMIC_RELEASE);
+
+    if (rm->fini_cb)
+        ret = rm->fini_cb (req, rm->fini_arg);
+    g_free (rm);
+
+    return ret;
+}
+
+static RequestMetrics *
+start_request (evhtp_request_t *req, RouteMetrics *route)
+{
+    RequestMetrics *rm = g_new0 (RequestMetrics, 1);
+
+    rm->route = route;
+    rm->req = req;
+    rm->start = g_get_monotonic_time ();
+    /* Header hooks, e.g. of uploads, may have set a fini hook already. */
+    if (req->hooks && req->hooks->on_request_fini) {
+        rm->fini_cb = req->hooks->on_request_fini;
+        rm->fini_arg = req->hooks->on_request_fini_arg;
+    }
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, request_fini_cb, rm);
+    __atomic_fetch_add (&route->in_flight, 1, __ATOMIC_RELAXED);
+
+    return rm;
+}
+
+static void
+check_queued_request (evutil_socket_t sock, short type, void *arg)
+{
+    RequestMetrics *rm = arg;
+    RouteClass *cls = &classes[rm->route->cls];
+
+    if (try_admit (cls)) {
+        rm->admitted = TRUE;
+        stop_queueing (rm);
+        evhtp_request_resume (rm->req);
+        rm->route->cb (rm->req, rm->cb_arg);
+        return;
+    }
+
+    if (g_get_monotonic_time () - rm->start >= queue_timeout) {
+        __atomic_fetch_add (&cls->timed_out, 1, __ATOMIC_RELAXED);
+        stop_queueing (rm);
+        evhtp_request_resume (rm->req);
+        reject_request (rm->req);
+    }
+}
+
+/* Queued requests are checked by timers of their own thread, since
+ * libevent calls can't be made on the event bases of other threads.
+ */
+static void
+queue_request (RequestMetrics *rm)
+{
+    struct timeval tv;
+
+    rm->queue_timer = event_new (evhtp_request_get_connection (rm->req)->evbase,
+                                 -1, EV_PERSIST, check_queued_request, rm);
+    tv.tv_sec = 0;
+    tv.tv_usec = QUEUE_CHECK_INTERVAL_MSEC * 1000;
+    evtimer_add (rm->queue_timer, &tv);
+
+    /* Block any new request from this connection until it's handled. */
+    evhtp_request_pause (rm->req);
+}
+
+static void
+route_cb (evhtp_request_t *req, void *arg)
+{
+    RouteMetrics *route;
+    RequestMetrics *rm;
+    RouteClass *cls;
+
+    /* Routes with a headers hook were admitted there. */
+    if (req->hooks && req->hooks->on_request_fini == request_fini_cb) {
+        rm = req->hooks->on_request_fini_arg;
+        rm->route->cb (req, rm->cb_arg);
+        return;
+    }
+
+    route = arg;
+    rm = start_request (req, route);
+    rm->cb_arg = route->arg;
+
+    if (route->cls == HTTP_ROUTE_UNLIMITED) {
+        route->cb (req, route->arg);
+        return;
+    }
+
+    /* Requests don't get ahead of the queued ones. */
+    cls = &classes[route->cls];
+    if (__atomic_load_n (&cls->queued, __ATOMIC_RELAXED) == 0 && try_admit (cls)) {
+        rm->admitted = TRUE;
+        route->cb (req, route->arg);
+        return;
+    }
+
+    if (__atomic_add_fetch (&cls->queued, 1, __ATOMIC_RELAXED) > cls->max_running) {
+        __atomic_fetch_sub (&cls->queued, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&cls->rejected, 1, __ATOMIC_RELAXED);
+        reject_request (req);
+        return;
+    }
+    queue_request (rm);
+}
+
+/*
+ * Called before the body is read, so a rejected request is replied to and
+ * the connection closed without waiting for it. The route callback is then
+ * called with a NULL arg, which request callbacks take as already replied.
+ */
+static evhtp_res
+route_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    RouteMetrics *route = arg;
+    RouteClass *cls = &classes[route->cls];
+    RequestMetrics *rm;
+    gboolean limited = TRUE, admitted;
+    evhtp_res ret = EVHTP_RES_OK;
+
+    /* CORS preflights of uploads are replied to by the route callback. */
+    if (route->cls == HTTP_ROUTE_UNLIMITED ||
+        evhtp_request_get_method (req) == htp_method_OPTIONS)
+        limited = FALSE;
+    admitted = !limited || try_admit (cls);
+    if (admitted) {
+        req->cbarg = route->arg;
+        ret = route->headers_cb (req, hdr, route->headers_arg);
+    }
+
+    rm = start_request (req, route);
+    rm->admitted = limited && admitted;
+    if (admitted) {
+        rm->cb_arg = req->cbarg;
+    } else {
+        __atomic_fetch_add (&cls->rejected, 1, __ATOMIC_RELAXED);
+        req->keepalive = 0;
+        reject_request (req);
+    }
+
+    return ret;
+}
+
+void
+http_metrics_set_fini_hook (evhtp_request_t *req,
+                            evhtp_hook_request_fini_cb cb, void *arg)
+{
+    RequestMetrics *rm;
+
+    if (req->hooks && req->hooks->on_request_fini == request_fini_cb) {
+        rm = req->hooks->on_request_fini_arg;
+        rm->fini_cb = cb;
+        rm->fini_arg = arg;
+        return;
+    }
+
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, cb, arg);
+}
+
+static RouteMetrics *
+add_route (const char *name, evhtp_callback_cb cb, void *arg)
+{
+    RouteMetrics *route;
+
+    if (n_routes == MAX_ROUTES) {
+        seaf_warning ("Too many http routes, %s is not counted.\n", name);
+        return NULL;
+    }
+
+    route = g_new0 (RouteMetrics, 1);
+    route->name = g_strdup (name);
+    route->cb = cb;
+    route->arg = arg;
+    routes[n_routes++] = route;
+
+    return route;
+}
+
+evhtp_callback_t *
+http_metrics_set_regex_cb (evhtp_t *htp, const char *regex, const char *name,
+                           evhtp_callback_cb cb, void *arg)
+{
+    RouteMetrics *route = add_route (name, cb, arg);
+
+    if (!route)
+        return evhtp_set_regex_cb (htp, regex, cb, arg);
+    return evhtp_set_regex_cb (htp, regex, route_cb, route);
+}
+
+evhtp_callback_t *
+http_metrics_set_cb (evhtp_t *htp, const char *path, const char *name,
+                     evhtp_callback_cb cb, void *arg)
+{
+    RouteMetrics *route = add_route (name, cb, arg);
+
+    if (!route)
+        return evhtp_set_cb (htp, path, cb, arg);
+    return evhtp_set_cb (htp, path, route_cb, route);
+}
+
+void
+http_metrics_set_route_class (evhtp_callback_t *cb, HttpRouteClass cls)
+{
+    /* Routes over MAX_ROUTES are neither counted nor limited. */
+    if (cb->cb != route_cb)
+        return;
+    ((RouteMetrics *)cb->cbarg)->cls = cls;
+}
+
+void
+http_metrics_set_headers_hook (evhtp_callback_t *cb,
+                               evhtp_hook_headers_cb hook, void *arg)
+{
+    RouteMetrics *route;
+
+    if (cb->cb != route_cb) {
+        evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, hook, arg);
+        return;
+    }
+
+    route = cb->cbarg;
+    route->headers_cb = hook;
+    route->headers_arg = arg;
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, route_headers_cb, route);
+}
+
+void
+http_metrics_set_class_limit (HttpRouteClass cls, int max_running)
+{
+    classes[cls].max_running = MAX (max_running, 0);
+}
+
+void
+http_metrics_set_queue_timeout (int msec)
+{
+    queue_timeout = (gint64)MAX (msec, 0) * 1000;
+}
+
+const char *
+http_route_class_name (HttpRouteClass cls)
+{
+    return class_names[cls];
+}
+
+static void
+format_route_metrics (GString *buf)
+{
+    RouteMetrics *route;
+    guint64 n, count;
+    int i, j;
+
+    g_string_append (buf, "# TYPE seafile_http_requests_total counter\n");
+    for (i = 0; i < n_routes; ++i) {
+        route = routes[i];
+        for (j = 0; j < MAX_STATUS_CODE; ++j) {
+            n = __atomic_load_n (&route->codes[j], __ATOMIC_RELAXED);
+            if (n > 0)
+                g_string_append_printf (buf,
+                                        "seafile_http_requests_total{route=\"%s\",code=\"%d\"} %"G_GUINT64_FORMAT"\n",
+                                        route->name, j, n);
+        }
+    }
+
+    g_string_append (buf, "# TYPE seafile_http_request_duration_seconds histogram\n");
+    for (i = 0; i < n_routes; ++i) {
+        route = routes[i];
+        count = 0;
+        for (j = 0; j < N_LATENCY_BUCKETS; ++j) {
+            count += __atomic_load_n (&route->latency[j], __ATOMIC_RELAXED);
+            g_string_append_printf (buf,
+                                    "seafile_http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %"G_GUINT64_FORMAT"\n",
+                                    route->name,
+                                    (double)((guint64)1 << (LATENCY_BUCKET_SHIFT + j)) / 1e6,
+                                    count);
+        }
+        count += __atomic_load_n (&route->latency[N_LATENCY_BUCKETS], __ATOMIC_RELAXED);
+        g_string_append_printf (buf,
+                                "seafile_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %"G_GUINT64_FORMAT"\n",
+                                route->name, count);
+        g_string_append_printf (buf,
+                                "seafile_http_request_duration_seconds_sum{route=\"%s\"} %g\n",
+                                route->name,
+                                (double)__atomic_load_n (&route->latency_sum, __ATOMIC_RELAXED) / 1e6);
+        g_string_append_printf (buf,
+                                "seafile_http_request_duration_seconds_count{route=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                route->name, count);
+    }
+
+    g_string_append (buf, "# TYPE seafile_http_requests_in_flight gauge\n");
+    for (i = 0; i < n_routes; ++i)
+        g_string_append_printf (buf,
+                                "seafile_http_requests_in_flight{route=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                routes[i]->name,
+                                __atomic_load_n (&routes[i]->in_flight, __ATOMIC_RELAXED));
+    g_string_append (buf, "# TYPE seafile_http_request_bytes_total counter\n");
+    for (i = 0; i < n_routes; ++i)
+        g_string_append_printf (buf,
+                                "seafile_http_request_bytes_total{route=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                routes[i]->name,
+                                __atomic_load_n (&routes[i]->bytes_in, __ATOMIC_RELAXED));
+    g_string_append (buf, "# TYPE seafile_http_response_bytes_total counter\n");
+    for (i = 0; i < n_routes; ++i)
+        g_string_append_printf (buf,
+                                "seafile_http_response_bytes_total{route=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                routes[i]->name,
+                                __atomic_load_n (&routes[i]->bytes_out, __ATOMIC_RELAXED));
+}
+
+static void
+format_class_metrics (GString *buf)
+{
+    RouteClass *cls;
+    int i;
+
+    g_string_append (buf, "# TYPE seafile_http_class_running_requests gauge\n");
+    for (i = HTTP_ROUTE_SYNC_META; i < HTTP_ROUTE_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_http_class_running_requests{class=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                class_names[i],
+                                __atomic_load_n (&classes[i].running, __ATOMIC_RELAXED));
+    g_string_append (buf, "# TYPE seafile_http_class_max_running_requests gauge\n");
+    for (i = HTTP_ROUTE_SYNC_META; i < HTTP_ROUTE_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_http_class_max_running_requests{class=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                class_names[i], classes[i].max_running);
+    g_string_append (buf, "# TYPE seafile_http_class_queued_requests gauge\n");
+    for (i = HTTP_ROUTE_SYNC_META; i < HTTP_ROUTE_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_http_class_queued_requests{class=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                class_names[i],
+                                __atomic_load_n (&classes[i].queued, __ATOMIC_RELAXED));
+    g_string_append (buf, "# TYPE seafile_http_class_rejected_requests_total counter\n");
+    for (i = HTTP_ROUTE_SYNC_META; i < HTTP_ROUTE_N_CLASSES; ++i) {
+        cls = &classes[i];
+        g_string_append_printf (buf, "seafile_http_class_rejected_requests_total{class=\"%s\",reason=\"full\"} %"G_GUINT64_FORMAT"\n",
+                                class_names[i],
+                                __atomic_load_n (&cls->rejected, __ATOMIC_RELAXED));
+        g_string_append_printf (buf, "seafile_http_class_rejected_requests_total{class=\"%s\",reason=\"timeout\"} %"G_GUINT64_FORMAT"\n",
+                                class_names[i],
+                                __atomic_load_n (&cls->timed_out, __ATOMIC_RELAXED));
+    }
+}
+
+static void
+format_pool_metrics (GString *buf)
+{
+    g_string_append (buf, "# TYPE seafile_pool_queued_tasks gauge\n");
+    g_string_append_printf (buf, "seafile_pool_queued_tasks{pool=\"index\"} %d\n",
+                            seaf_fs_manager_get_indexing_queue_len (seaf->fs_mgr));
+    g_string_append_printf (buf, "seafile_pool_queued_tasks{pool=\"zip\"} %d\n",
+                            zip_download_mgr_get_queue_len (seaf->zip_download_mgr));
+    g_string_append_printf (buf, "seafile_pool_queued_tasks{pool=\"size-sched\"} %d\n",
+                            size_scheduler_get_queue_len (seaf->size_sched));
+    g_string_append_printf (buf, "seafile_pool_queued_tasks{pool=\"copy\"} %d\n",
+                            seaf_copy_manager_get_queue_len (seaf->copy_mgr));
+    g_string_append_printf (buf, "seafile_pool_queued_tasks{pool=\"crypto\"} %u\n",
+                            seaf_executor_get_queued (seaf->executor, SEAF_JOB_CRYPTO));
+}
+
+static void
+format_executor_metrics (GString *buf)
+{
+    SeafExecutorStats stats[SEAF_JOB_N_CLASSES];
+    int i;
+
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        seaf_executor_get_stats (seaf->executor, i, &stats[i]);
+
+    g_string_append (buf, "# TYPE seafile_executor_running_jobs gauge\n");
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_executor_running_jobs{class=\"%s\"} %d\n",
+                                seaf_job_class_name (i), stats[i].running);
+    g_string_append (buf, "# TYPE seafile_executor_max_running_jobs gauge\n");
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_executor_max_running_jobs{class=\"%s\"} %d\n",
+                                seaf_job_class_name (i), stats[i].max_running);
+    g_string_append (buf, "# TYPE seafile_executor_jobs_total counter\n");
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_executor_jobs_total{class=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                seaf_job_class_name (i), stats[i].n_done);
+    g_string_append (buf, "# TYPE seafile_executor_rejected_jobs_total counter\n");
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_executor_rejected_jobs_total{class=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                seaf_job_class_name (i), stats[i].n_rejected);
+    g_string_append (buf, "# TYPE seafile_executor_wait_seconds_total counter\n");
+    for (i = 0; i < SEAF_JOB_N_CLASSES; ++i)
+        g_string_append_printf (buf, "seafile_executor_wait_seconds_total{class=\"%s\"} %g\n",
+                                seaf_job_class_name (i), (double)stats[i].wait_time / 1e6);
+}
+
+static void
+format_io_metrics (GString *buf)
+{
+    HttpIOStats stats;
+
+    http_io_get_stats (&stats);
+
+    g_string_append (buf, "# TYPE seafile_io_queued_jobs gauge\n");
+    g_string_append_printf (buf, "seafile_io_queued_jobs %u\n", stats.queued);
+    g_string_append (buf, "# TYPE seafile_io_running_jobs gauge\n");
+    g_string_append_printf (buf, "seafile_io_running_jobs %d\n", stats.running);
+    g_string_append (buf, "# TYPE seafile_io_jobs_total counter\n");
+    g_string_append_printf (buf, "seafile_io_jobs_total %"G_GUINT64_FORMAT"\n", stats.n_done);
+    g_string_append (buf, "# TYPE seafile_io_wait_seconds_total counter\n");
+    g_string_append_printf (buf, "seafile_io_wait_seconds_total %g\n",
+                            (double)stats.wait_time / 1e6);
+}
+
+static void
+format_cache_metrics (GString *buf)
+{
+    LRUCacheStats stats;
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &stats);
+
+    g_string_append (buf, "# TYPE seafile_cache_hits_total counter\n");
+    g_string_append_printf (buf, "seafile_cache_hits_total{cache=\"fs\"} %"G_GUINT64_FORMAT"\n",
+                            stats.hits);
+    g_string_append (buf, "# TYPE seafile_cache_misses_total counter\n");
+    g_string_append_printf (buf, "seafile_cache_misses_total{cache=\"fs\"} %"G_GUINT64_FORMAT"\n",
+                            stats.misses);
+    g_string_append (buf, "# TYPE seafile_cache_evictions_total counter\n");
+    g_string_append_printf (buf, "seafile_cache_evictions_total{cache=\"fs\"} %"G_GUINT64_FORMAT"\n",
+                            stats.evictions);
+    g_string_append (buf, "# TYPE seafile_cache_items gauge\n");
+    g_string_append_printf (buf, "seafile_cache_items{cache=\"fs\"} %"G_GINT64_FORMAT"\n",
+                            stats.n_items);
+    g_string_append (buf, "# TYPE seafile_cache_bytes gauge\n");
+    g_string_append_printf (buf, "seafile_cache_bytes{cache=\"fs\"} %"G_GINT64_FORMAT"\n",
+                            stats.bytes);
+    g_string_append (buf, "# TYPE seafile_cache_max_bytes gauge\n");
+    g_string_append_printf (buf, "seafile_cache_max_bytes{cache=\"fs\"} %"G_GINT64_FORMAT"\n",
+                            stats.max_bytes);
+}
+
+static void
+format_mq_metrics (GString *buf)
+{
+    GList *channels = seaf_mq_manager_get_stats (seaf->mq_mgr), *ptr;
+    SeafMqChannelStats *stats;
+
+    g_string_append (buf, "# TYPE seafile_mq_queued_events gauge\n");
+    for (ptr = channels; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        g_string_append_printf (buf, "seafile_mq_queued_events{channel=\"%s\"} %d\n",
+                                stats->channel, stats->queued);
+    }
+    g_string_append (buf, "# TYPE seafile_mq_published_events_total counter\n");
+    for (ptr = channels; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        g_string_append_printf (buf, "seafile_mq_published_events_total{channel=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                stats->channel, stats->n_published);
+    }
+    g_string_append (buf, "# TYPE seafile_mq_dropped_events_total counter\n");
+    for (ptr = channels; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        g_string_append_printf (buf, "seafile_mq_dropped_events_total{channel=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                stats->channel, stats->n_dropped);
+    }
+
+    g_list_free_full (channels, (GDestroyNotify)seaf_mq_channel_stats_free);
+}
+
+static void
+format_db_metrics (GString *buf)
+{
+    struct {
+        const char *name;
+        SeafDB *db;
+    } dbs[] = {
+        { "seafile", seaf->db },
+        { "ccnet", seaf->ccnet_db },
+    };
+    SeafDBPoolStats stats[G_N_ELEMENTS(dbs)];
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(dbs); ++i)
+        seaf_db_get_pool_stats (dbs[i].db, &stats[i]);
+
+    g_string_append (buf, "# TYPE seafile_db_connections gauge\n");
+    for (i = 0; i < G_N_ELEMENTS(dbs); ++i) {
+        g_string_append_printf (buf,
+                                "seafile_db_connections{db=\"%s\",state=\"in_use\"} %d\n",
+                                dbs[i].name, stats[i].n_in_use);
+        g_string_append_printf (buf,
+                                "seafile_db_connections{db=\"%s\",state=\"idle\"} %d\n",
+                                dbs[i].name, stats[i].n_connections - stats[i].n_in_use);
+    }
+    g_string_append (buf, "# TYPE seafile_db_waiters gauge\n");
+    for (i = 0; i < G_N_ELEMENTS(dbs); ++i)
+        g_string_append_printf (buf, "seafile_db_waiters{db=\"%s\"} %d\n",
+                                dbs[i].name, stats[i].n_waiters);
+    g_string_append (buf, "# TYPE seafile_db_waits_total counter\n");
+    for (i = 0; i < G_N_ELEMENTS(dbs); ++i)
+        g_string_append_printf (buf, "seafile_db_waits_total{db=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                dbs[i].name, stats[i].n_waits);
+    g_string_append (buf, "# TYPE seafile_db_wait_seconds_total counter\n");
+    for (i = 0; i < G_N_ELEMENTS(dbs); ++i)
+        g_string_append_printf (buf, "seafile_db_wait_seconds_total{db=\"%s\"} %g\n",
+                                dbs[i].name, (double)stats[i].wait_time / 1e6);
+}
+
+static void
+append_label_value (GString *buf, const char *value)
+{
+    const char *p;
+
+    for (p = value; *p; ++p) {
+        if (*p == '\\' || *p == '"')
+            g_string_append_c (buf, '\\');
+        if (*p == '\n')
+            g_string_append (buf, "\\n");
+        else
+            g_string_append_c (buf, *p);
+    }
+}
+
+static void
+format_query_metrics (GString *buf)
+{
+    GList *stats, *ptr;
+    SeafDBQueryStats *st;
+    GPtrArray *labels = g_ptr_array_new_with_free_func (g_free);
+    GString *label;
+    guint i;
+
+    /* Samples of a metric must be listed together. */
+    stats = seaf_db_get_query_stats ();
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        label = g_string_new (NULL);
+        append_label_value (label, st->sql);
+        g_ptr_array_add (labels, g_string_free (label, FALSE));
+    }
+
+    g_string_append (buf, "# TYPE seafile_db_queries_total counter\n");
+    for (ptr = stats, i = 0; ptr; ptr = ptr->next, ++i) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_db_queries_total{sql=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                (char *)g_ptr_array_index (labels, i), st->count);
+    }
+    g_string_append (buf, "# TYPE seafile_db_query_errors_total counter\n");
+    for (ptr = stats, i = 0; ptr; ptr = ptr->next, ++i) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_db_query_errors_total{sql=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                (char *)g_ptr_array_index (labels, i), st->errors);
+    }
+    g_string_append (buf, "# TYPE seafile_db_query_seconds_total counter\n");
+    for (ptr = stats, i = 0; ptr; ptr = ptr->next, ++i) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_db_query_seconds_total{sql=\"%s\"} %g\n",
+                                (char *)g_ptr_array_index (labels, i),
+                                (double)st->total_time / 1e6);
+    }
+    g_string_append (buf, "# TYPE seafile_db_query_max_seconds gauge\n");
+    for (ptr = stats, i = 0; ptr; ptr = ptr->next, ++i) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_db_query_max_seconds{sql=\"%s\"} %g\n",
+                                (char *)g_ptr_array_index (labels, i),
+                                (double)st->max_time / 1e6);
+    }
+
+    g_ptr_array_free (labels, TRUE);
+    seaf_db_query_stats_free (stats);
+}
+
+static void
+format_lock_metrics (GString *buf)
+{
+    GList *stats, *ptr;
+    SeafLockStats *st;
+
+    stats = seaf_lock_get_stats ();
+    if (!stats)
+        return;
+
+    g_string_append (buf, "# TYPE seafile_lock_acquisitions_total counter\n");
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_lock_acquisitions_total{lock=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                st->name, st->acquisitions);
+    }
+    g_string_append (buf, "# TYPE seafile_lock_waits_total counter\n");
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_lock_waits_total{lock=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                st->name, st->contentions);
+    }
+    g_string_append (buf, "# TYPE seafile_lock_wait_seconds_total counter\n");
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_lock_wait_seconds_total{lock=\"%s\"} %g\n",
+                                st->name, (double)st->wait_time / 1e6);
+    }
+    g_string_append (buf, "# TYPE seafile_lock_max_wait_seconds gauge\n");
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_lock_max_wait_seconds{lock=\"%s\"} %g\n",
+                                st->name, (double)st->max_wait / 1e6);
+    }
+    g_string_append (buf, "# TYPE seafile_lock_max_hold_seconds gauge\n");
+    for (ptr = stats; ptr; ptr = ptr->next) {
+        st = ptr->data;
+        g_string_append_printf (buf, "seafile_lock_max_hold_seconds{lock=\"%s\"} %g\n",
+                                st->name, (double)st->max_hold / 1e6);
+    }
+
+    seaf_lock_stats_free (stats);
+}
+
+/* The top objects are only returned by the get_access_stats rpc, since
+ * their ids would make too many series.
+ */
+static void
+format_access_metrics (GString *buf)
+{
+    SeafAccessStats stats[ACCESS_N_CLASSES];
+    const char *name;
+    guint64 count;
+    int cls, i;
+
+    if (seaf_access_stats_sample_rate () <= 0)
+        return;
+
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls)
+        seaf_access_stats_get (cls, &stats[cls]);
+
+    g_string_append (buf, "# TYPE seafile_access_sampled_reads_total counter\n");
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls)
+        g_string_append_printf (buf, "seafile_access_sampled_reads_total{class=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                seaf_access_class_name (cls), stats[cls].sampled);
+    g_string_append (buf, "# TYPE seafile_access_cold_reads_total counter\n");
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls)
+        g_string_append_printf (buf, "seafile_access_cold_reads_total{class=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                seaf_access_class_name (cls), stats[cls].cold);
+    g_string_append (buf, "# TYPE seafile_access_reuse_distance histogram\n");
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls) {
+        name = seaf_access_class_name (cls);
+        count = 0;
+        for (i = 0; i < ACCESS_N_REUSE_BUCKETS - 1; ++i) {
+            count += stats[cls].reuse[i];
+            g_string_append_printf (buf, "seafile_access_reuse_distance_bucket{class=\"%s\",le=\"%"G_GUINT64_FORMAT"\"} %"G_GUINT64_FORMAT"\n",
+                                    name, (((guint64)1) << i) - 1, count);
+        }
+        count += stats[cls].reuse[ACCESS_N_REUSE_BUCKETS - 1];
+        g_string_append_printf (buf, "seafile_access_reuse_distance_bucket{class=\"%s\",le=\"+Inf\"} %"G_GUINT64_FORMAT"\n",
+                                name, count);
+        g_string_append_printf (buf, "seafile_access_reuse_distance_count{class=\"%s\"} %"G_GUINT64_FORMAT"\n",
+                                name, count);
+    }
+
+    for (cls = 0; cls < ACCESS_N_CLASSES; ++cls)
+        seaf_access_stats_clear (&stats[cls]);
+}
+
+void
+http_metrics_cb (evhtp_request_t *req, void *arg)
+{
+    GString *buf = g_string_new (NULL);
+
+    format_route_metrics (buf);
+    format_class_metrics (buf);
+    format_pool_metrics (buf);
+    format_executor_metrics (buf);
+    format_io_metrics (buf);
+    format_cache_metrics (buf);
+    format_mq_metrics (buf);
+    format_db_metrics (buf);
+    format_query_metrics (buf);
+    format_lock_metrics (buf);
+    format_access_metrics (buf);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Type",
+                                                "text/plain; version=0.0.4", 1, 1));
+    evbuffer_add (req->buffer_out, buf->str, buf->len);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    g_string_free (buf, TRUE);
+}
@@ -0,0 +1,72 @@
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include <evhtp.h>
+
+/*
+ * Requests of every route are counted by status code, and their latencies
+ * are kept in a histogram with buckets growing by powers of two. The
+ * counters are only updated with atomic adds, so recording a request takes
+ * no locks. http_metrics_cb() serves them in the Prometheus text format.
+ *
+ * Routes must be registered before the server starts.
+ *
+ * A route can also be put in a class with a limit of requests in flight.
+ * Requests over the limit wait up to the queue timeout for a slot, then get
+ * 503 with Retry-After. Routes with a headers hook are admitted when their
+ * headers arrive, before the body is read, and aren't queued.
+ */
+
+typedef enum HttpRouteClass {
+    /* Not limited, e.g. long polls and progress queries. */
+    HTTP_ROUTE_UNLIMITED = 0,
+    HTTP_ROUTE_SYNC_META,
+    HTTP_ROUTE_BLOCK,
+    HTTP_ROUTE_UPLOAD,
+    HTTP_ROUTE_ZIP,
+    HTTP_ROUTE_N_CLASSES,
+} HttpRouteClass;
+
+/* Like evhtp_set_regex_cb(), counting the requests as route @name. */
+evhtp_callback_t *
+http_metrics_set_regex_cb (evhtp_t *htp, const char *regex, const char *name,
+                           evhtp_callback_cb cb, void *arg);
+
+/* Like evhtp_set_cb(), counting the requests as route @name. */
+evhtp_callback_t *
+http_metrics_set_cb (evhtp_t *htp, const char *path, const char *name,
+                     evhtp_callback_cb cb, void *arg);
+
+void
+http_metrics_set_route_class (evhtp_callback_t *cb, HttpRouteClass cls);
+
+/*
+ * Like evhtp_set_hook() with evhtp_hook_on_headers, so that admission is
+ * done before the hook runs.
+ */
+void
+http_metrics_set_headers_hook (evhtp_callback_t *cb,
+                               evhtp_hook_headers_cb hook, void *arg);
+
+/* Limits are set before the server starts, max_running <= 0 disables it. */
+void
+http_metrics_set_class_limit (HttpRouteClass cls, int max_running);
+
+void
+http_metrics_set_queue_timeout (int msec);
+
+const char *
+http_route_class_name (HttpRouteClass cls);
+
+/*
+ * Request callbacks set their request fini hook with this instead of
+ * evhtp_set_hook(), so that the hook recording the request is kept.
+ */
+void
+http_metrics_set_fini_hook (evhtp_request_t *req,
+                            evhtp_hook_request_fini_cb cb, void *arg);
+
+void
+http_metrics_cb (evhtp_request_t *req, void *arg);
+
+#endif
@@ -1,10 +1,14 @@
 #include "common.h"
 
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
 #include <pthread.h>
 #include <string.h>
 #include <jansson.h>
 #include <locale.h>
 #include <sys/types.h>
+#include <zlib.h>
+#include <fcntl.h>
 
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #include <event2/event.h>
@@ -20,14 +24,23 @@
 #include "http-server.h"
 #include "seafile-session.h"
 #include "diff-simple.h"
-#include "merge-new.h"
 #include "seaf-db.h"
+#include "lru-cache.h"
+#include "lock-stats.h"
 
 #include "access-file.h"
 #include "upload-file.h"
 #include "fileserver-config.h"
 
 #include "http-status-codes.h"
+#include "http-metrics.h"
+#include "upload-trace.h"
+#include "transfer-limit.h"
+#include "block-cache.h"
+#include "http-io.h"
+#include "http-compress.h"
+#include "http-temp.h"
+#include "cluster-cache.h"
 
 #define DEFAULT_BIND_HOST "0.0.0.0"
 #define DEFAULT_BIND_PORT 8082
@@ -37,22 +50,42 @@
 #define DEFAULT_MAX_INDEX_PROCESSING_THREADS 3
 #define DEFAULT_FIXED_BLOCK_SIZE ((gint64)1 << 23) /* 8MB */
 #define DEFAULT_CLUSTER_SHARED_TEMP_FILE_MODE 0600
+#define DEFAULT_MAX_BLOCK_BATCH_SIZE ((gint64)1 << 23) /* 8MB */
+#define DEFAULT_UPLOAD_MEMORY_LIMIT ((gint64)512 << 20) /* 512MB */
+#define DEFAULT_FS_ID_LIST_CACHE_SIZE ((gint64)64 << 20) /* 64MB */
+#define DEFAULT_MAX_DIFF_THREADS 4
+#define DEFAULT_HEAD_COMMIT_CACHE_TTL 10
+#define DEFAULT_AUTH_CACHE_SHARDS 16
+#define DEFAULT_DOWNLOAD_READ_AHEAD 0
+#define DEFAULT_ZIP_PREFETCH_FILES 8
+#define DEFAULT_ZIP_CACHE_SIZE 0
+#define DEFAULT_ZIP_THREADS 5
+#define DEFAULT_REQUEST_QUEUE_TIMEOUT 1000 /* ms */
+
+/* Default limits of requests in flight of each route class, in worker
+ * threads. Block transfers and uploads are limited closer to the number of
+ * threads, so that they can't take all of them from metadata requests.
+ */
+static const int default_class_limits[HTTP_ROUTE_N_CLASSES] = {
+    [HTTP_ROUTE_SYNC_META] = 10,
+    [HTTP_ROUTE_BLOCK] = 4,
+    [HTTP_ROUTE_UPLOAD] = 2,
+    [HTTP_ROUTE_ZIP] = 2,
+};
 
 #define HOST "host"
 #define PORT "port"
 
-#define HTTP_TEMP_FILE_SCAN_INTERVAL  3600 /*1h*/
-#define HTTP_TEMP_FILE_DEFAULT_TTL 3600 * 24 * 3 /*3days*/
-#define HTTP_TEMP_FILE_TTL "http_temp_file_ttl"
-#define HTTP_SCAN_INTERVAL "http_temp_scan_interval"
-
 #define INIT_INFO "If you see this page, Seafile HTTP syncing component works."
 #define PROTO_VERSION "{\"version\": 2}"
 
 #define CLEANING_INTERVAL_SEC 300	/* 5 minutes */
 #define TOKEN_EXPIRE_TIME 7200	    /* 2 hours */
 #define PERM_EXPIRE_TIME 7200       /* 2 hours */
+#define AUTH_CACHE_SIZE ((gint64)64 << 20) /* 64MB for each of token and perm caches */
 #define VIRINFO_EXPIRE_TIME 7200       /* 2 hours */
+#define EVENTS_FLUSH_INTERVAL_SEC 10
+#define EVENTS_SHARDS 16
 
 #define FS_ID_LIST_MAX_WORKERS 3
 #define FS_ID_LIST_TOKEN_LEN 36
@@ -62,21 +95,43 @@ struct _HttpServer {
     evhtp_t *evhtp;
     pthread_t thread_id;
 
-    GHashTable *token_cache;
-    pthread_mutex_t token_cache_lock; /* token -> username */
+    /* Sharded, so that worker threads checking different tokens don't
+     * contend on one lock.
+     */
+    LRUCache *token_cache; /* token -> username */
 
-    GHashTable *perm_cache;
-    pthread_mutex_t perm_cache_lock; /* repo_id:username -> permission */
+    LRUCache *perm_cache; /* repo_id:username -> permission */
 
     GHashTable *vir_repo_info_cache;
-    pthread_mutex_t vir_repo_info_cache_lock;
+    SeafLock vir_repo_info_cache_lock;
+
+    /* Shared by the nodes of a cluster, NULL if not configured. */
+    ClusterCache *cluster_cache;
 
     event_t *reap_timer;
+    event_t *events_timer;
 
     GThreadPool *compute_fs_obj_id_pool;
 
     GHashTable *fs_obj_ids;
-    pthread_mutex_t fs_obj_ids_lock;
+    SeafLock fs_obj_ids_lock;
+
+    /* Computed fs id lists, see get_fs_id_list(). */
+    GHashTable *fs_id_lists;
+    GQueue *fs_id_list_lru;
+    gint64 fs_id_list_bytes;
+    SeafLock fs_id_list_lock;
+    pthread_cond_t fs_id_list_cond;
+
+    /* Recent branch updates, see wait_head_commits_cb(). */
+    GHashTable *repo_updates;
+    gint64 repo_update_seq;
+    SeafLock repo_updates_lock;
+
+    /* Heads of master branches, see lookup_head_commit(). */
+    GHashTable *head_commit_cache;
+    gint64 head_commit_cache_gen;
+    SeafLock head_commit_cache_lock;
 };
 typedef struct _HttpServer HttpServer;
 
@@ -123,6 +178,7 @@ const char *OP_PERM_CHECK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\
 const char *GET_CHECK_QUOTA_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/quota-check/.*";
 const char *HEAD_COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/HEAD";
 const char *GET_HEAD_COMMITS_MULTI_REGEX = "^/repo/head-commits-multi";
+const char *WAIT_HEAD_COMMITS_REGEX = "^/repo/head-commits-wait";
 const char *COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *PUT_COMMIT_INFO_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *GET_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/fs-id-list/.*";
@@ -134,6 +190,8 @@ const char *POST_CHECK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\
 const char *POST_CHECK_BLOCK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-blocks";
 const char *POST_RECV_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-fs";
 const char *POST_PACK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-fs";
+const char *POST_PACK_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-blocks";
+const char *POST_RECV_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-blocks";
 const char *GET_BLOCK_MAP_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block-map/[\\da-z]{40}";
 
 //accessible repos
@@ -151,6 +209,25 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     char *encoding;
     int max_indexing_threads;
     int max_index_processing_threads;
+    int max_block_batch_size_mb;
+    int upload_memory_limit_mb;
+    int fs_id_list_cache_size_mb;
+    int max_diff_threads;
+    int head_commit_cache_ttl;
+    int auth_cache_shards;
+    int download_read_ahead;
+    int warm_up_repos;
+    int upload_trace_threshold;
+    char *upload_trace_sample_rate;
+    double sample_rate = 0;
+    int zip_prefetch_files;
+    int zip_cache_size;
+    int zip_threads;
+    int max_zip_threads;
+    int max_requests;
+    int request_queue_timeout;
+    char *key;
+    int i;
     char *cluster_shared_temp_file_mode = NULL;
 
     host = fileserver_config_get_string (session->config, HOST, &error);
@@ -194,6 +271,34 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     }
     seaf_message ("fileserver: worker_threads = %d\n", htp_server->worker_threads);
 
+    /* 0 disables the limit of a class. */
+    for (i = HTTP_ROUTE_SYNC_META; i < HTTP_ROUTE_N_CLASSES; ++i) {
+        key = g_strdup_printf ("max_%s_requests", http_route_class_name (i));
+        max_requests = fileserver_config_get_integer (session->config, key, &error);
+        if (error) {
+            max_requests = default_class_limits[i] * htp_server->worker_threads;
+            g_clear_error (&error);
+        } else if (max_requests < 0) {
+            max_requests = default_class_limits[i] * htp_server->worker_threads;
+        }
+        http_metrics_set_class_limit (i, max_requests);
+        seaf_message ("fileserver: %s = %d\n", key, max_requests);
+        g_free (key);
+    }
+
+    /* Milliseconds a request over the limit of its class waits for a slot. */
+    request_queue_timeout = fileserver_config_get_integer (session->config,
+                                                           "request_queue_timeout",
+                                                           &error);
+    if (error) {
+        request_queue_timeout = DEFAULT_REQUEST_QUEUE_TIMEOUT;
+        g_clear_error (&error);
+    } else if (request_queue_timeout < 0) {
+        request_queue_timeout = DEFAULT_REQUEST_QUEUE_TIMEOUT;
+    }
+    http_metrics_set_queue_timeout (request_queue_timeout);
+    seaf_message ("fileserver: request_queue_timeout = %d\n", request_queue_timeout);
+
     fixed_block_size_mb = fileserver_config_get_integer (session->config,
                                                   "fixed_block_size",
                                                   &error);
@@ -224,6 +329,18 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     seaf_message ("fileserver: web_token_expire_time = %d\n",
                   htp_server->web_token_expire_time);
 
+    htp_server->web_token_secret = fileserver_config_get_string (session->config,
+                                                                 "web_token_secret",
+                                                                 &error);
+    if (error)
+        g_clear_error (&error);
+    if (htp_server->web_token_secret && *htp_server->web_token_secret == '\0') {
+        g_free (htp_server->web_token_secret);
+        htp_server->web_token_secret = NULL;
+    }
+    seaf_message ("fileserver: signed web access tokens %s\n",
+                  htp_server->web_token_secret ? "enabled" : "disabled");
+
     max_indexing_threads = fileserver_config_get_integer (session->config,
                                                           "max_indexing_threads",
                                                           &error);
@@ -276,6 +393,264 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     seaf_message ("fileserver: cluster_shared_temp_file_mode = %o\n",
                   htp_server->cluster_shared_temp_file_mode);
 
+    htp_server->streaming_upload = fileserver_config_get_boolean (session->config,
+                                                                  "streaming_upload",
+                                                                  &error);
+    if (error) {
+        htp_server->streaming_upload = FALSE;
+        g_clear_error (&error);
+    }
+    seaf_message ("fileserver: streaming_upload = %d\n",
+                  htp_server->streaming_upload);
+
+    htp_server->index_resumable_chunks = fileserver_config_get_boolean (session->config,
+                                                                        "index_resumable_chunks",
+                                                                        &error);
+    if (error) {
+        htp_server->index_resumable_chunks = FALSE;
+        g_clear_error (&error);
+    }
+    seaf_message ("fileserver: index_resumable_chunks = %d\n",
+                  htp_server->index_resumable_chunks);
+
+    htp_server->enable_metrics = fileserver_config_get_boolean (session->config,
+                                                                "enable_metrics",
+                                                                &error);
+    if (error) {
+        htp_server->enable_metrics = FALSE;
+        g_clear_error (&error);
+    }
+
+    htp_server->streaming_zip = fileserver_config_get_boolean (session->config,
+                                                               "streaming_zip",
+                                                               &error);
+    if (error) {
+        htp_server->streaming_zip = FALSE;
+        g_clear_error (&error);
+    }
+    seaf_message ("fileserver: streaming_zip = %d\n",
+                  htp_server->streaming_zip);
+
+    htp_server->zip_store_only = fileserver_config_get_boolean (session->config,
+                                                                "zip_store_only",
+                                                                &error);
+    if (error) {
+        htp_server->zip_store_only = FALSE;
+        g_clear_error (&error);
+    }
+    seaf_message ("fileserver: zip_store_only = %d\n",
+                  htp_server->zip_store_only);
+
+    zip_prefetch_files = fileserver_config_get_integer (session->config,
+                                                        "zip_prefetch_files",
+                                                        &error);
+    if (error) {
+        htp_server->zip_prefetch_files = DEFAULT_ZIP_PREFETCH_FILES;
+        g_clear_error (&error);
+    } else {
+        if (zip_prefetch_files < 0)
+            htp_server->zip_prefetch_files = DEFAULT_ZIP_PREFETCH_FILES;
+        else
+            htp_server->zip_prefetch_files = zip_prefetch_files;
+    }
+    seaf_message ("fileserver: zip_prefetch_files = %d\n",
+                  htp_server->zip_prefetch_files);
+
+    zip_cache_size = fileserver_config_get_integer (session->config,
+                                                    "zip_cache_size",
+                                                    &error);
+    if (error) {
+        htp_server->zip_cache_size = DEFAULT_ZIP_CACHE_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (zip_cache_size < 0)
+            htp_server->zip_cache_size = DEFAULT_ZIP_CACHE_SIZE;
+        else
+            htp_server->zip_cache_size = zip_cache_size;
+    }
+    seaf_message ("fileserver: zip_cache_size = %d\n",
+                  htp_server->zip_cache_size);
+
+    zip_threads = fileserver_config_get_integer (session->config,
+                                                 "zip_threads",
+                                                 &error);
+    if (error) {
+        htp_server->zip_threads = DEFAULT_ZIP_THREADS;
+        g_clear_error (&error);
+    } else {
+        if (zip_threads <= 0)
+            htp_server->zip_threads = DEFAULT_ZIP_THREADS;
+        else
+            htp_server->zip_threads = zip_threads;
+    }
+    seaf_message ("fileserver: zip_threads = %d\n",
+                  htp_server->zip_threads);
+
+    max_zip_threads = fileserver_config_get_integer (session->config,
+                                                     "max_zip_threads",
+                                                     &error);
+    if (error) {
+        htp_server->max_zip_threads = htp_server->zip_threads;
+        g_clear_error (&error);
+    } else {
+        if (max_zip_threads < htp_server->zip_threads)
+            htp_server->max_zip_threads = htp_server->zip_threads;
+        else
+            htp_server->max_zip_threads = max_zip_threads;
+    }
+    seaf_message ("fileserver: max_zip_threads = %d\n",
+                  htp_server->max_zip_threads);
+
+    max_block_batch_size_mb = fileserver_config_get_integer (session->config,
+                                                             "max_block_batch_size",
+                                                             &error);
+    if (error) {
+        htp_server->max_block_batch_size = DEFAULT_MAX_BLOCK_BATCH_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (max_block_batch_size_mb <= 0)
+            htp_server->max_block_batch_size = DEFAULT_MAX_BLOCK_BATCH_SIZE;
+        else
+            htp_server->max_block_batch_size = max_block_batch_size_mb * ((gint64)1 << 20);
+    }
+    seaf_message ("fileserver: max_block_batch_size = %"G_GINT64_FORMAT"\n",
+                  htp_server->max_block_batch_size);
+
+    upload_memory_limit_mb = fileserver_config_get_integer (session->config,
+                                                            "upload_memory_limit",
+                                                            &error);
+    if (error) {
+        htp_server->upload_memory_limit = DEFAULT_UPLOAD_MEMORY_LIMIT;
+        g_clear_error (&error);
+    } else if (upload_memory_limit_mb <= 0) {
+        htp_server->upload_memory_limit = 0;
+    } else {
+        htp_server->upload_memory_limit = upload_memory_limit_mb * ((gint64)1 << 20);
+    }
+    seaf_message ("fileserver: upload_memory_limit = %"G_GINT64_FORMAT"\n",
+                  htp_server->upload_memory_limit);
+
+    fs_id_list_cache_size_mb = fileserver_config_get_integer (session->config,
+                                                              "fs_id_list_cache_size",
+                                                              &error);
+    if (error) {
+        htp_server->fs_id_list_cache_size = DEFAULT_FS_ID_LIST_CACHE_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (fs_id_list_cache_size_mb < 0)
+            htp_server->fs_id_list_cache_size = DEFAULT_FS_ID_LIST_CACHE_SIZE;
+        else
+            htp_server->fs_id_list_cache_size = fs_id_list_cache_size_mb * ((gint64)1 << 20);
+    }
+    seaf_message ("fileserver: fs_id_list_cache_size = %"G_GINT64_FORMAT"\n",
+                  htp_server->fs_id_list_cache_size);
+
+    max_diff_threads = fileserver_config_get_integer (session->config,
+                                                      "max_diff_threads",
+                                                      &error);
+    if (error) {
+        htp_server->max_diff_threads = DEFAULT_MAX_DIFF_THREADS;
+        g_clear_error (&error);
+    } else {
+        if (max_diff_threads <= 0)
+            htp_server->max_diff_threads = DEFAULT_MAX_DIFF_THREADS;
+        else
+            htp_server->max_diff_threads = max_diff_threads;
+    }
+    seaf_message ("fileserver: max_diff_threads = %d\n",
+                  htp_server->max_diff_threads);
+
+    head_commit_cache_ttl = fileserver_config_get_integer (session->config,
+                                                           "head_commit_cache_ttl",
+                                                           &error);
+    if (error) {
+        htp_server->head_commit_cache_ttl = DEFAULT_HEAD_COMMIT_CACHE_TTL;
+        g_clear_error (&error);
+    } else {
+        if (head_commit_cache_ttl <= 0)
+            htp_server->head_commit_cache_ttl = DEFAULT_HEAD_COMMIT_CACHE_TTL;
+        else
+            htp_server->head_commit_cache_ttl = head_commit_cache_ttl;
+    }
+    seaf_message ("fileserver: head_commit_cache_ttl = %d\n",
+                  htp_server->head_commit_cache_ttl);
+
+    auth_cache_shards = fileserver_config_get_integer (session->config,
+                                                       "auth_cache_shards",
+                                                       &error);
+    if (error) {
+        htp_server->auth_cache_shards = DEFAULT_AUTH_CACHE_SHARDS;
+        g_clear_error (&error);
+    } else {
+        if (auth_cache_shards <= 0)
+            htp_server->auth_cache_shards = DEFAULT_AUTH_CACHE_SHARDS;
+        else
+            htp_server->auth_cache_shards = auth_cache_shards;
+    }
+    seaf_message ("fileserver: auth_cache_shards = %d\n",
+                  htp_server->auth_cache_shards);
+
+    download_read_ahead = fileserver_config_get_integer (session->config,
+                                                         "download_read_ahead",
+                                                         &error);
+    if (error) {
+        htp_server->download_read_ahead = DEFAULT_DOWNLOAD_READ_AHEAD;
+        g_clear_error (&error);
+    } else {
+        if (download_read_ahead < 0)
+            htp_server->download_read_ahead = DEFAULT_DOWNLOAD_READ_AHEAD;
+        else
+            htp_server->download_read_ahead = download_read_ahead;
+    }
+    seaf_message ("fileserver: download_read_ahead = %d\n",
+                  htp_server->download_read_ahead);
+
+    warm_up_repos = fileserver_config_get_integer (session->config,
+                                                   "warm_up_repos",
+                                                   &error);
+    if (error) {
+        htp_server->warm_up_repos = 0;
+        g_clear_error (&error);
+    } else {
+        htp_server->warm_up_repos = MAX (warm_up_repos, 0);
+    }
+    seaf_message ("fileserver: warm_up_repos = %d\n",
+                  htp_server->warm_up_repos);
+
+    /* Uploads slower than this many milliseconds are logged with the time
+     * spent in each stage.
+     */
+    upload_trace_threshold = fileserver_config_get_integer (session->config,
+                                                            "upload_trace_threshold",
+                                                            &error);
+    if (error) {
+        upload_trace_threshold = 0;
+        g_clear_error (&error);
+    } else if (upload_trace_threshold < 0) {
+        upload_trace_threshold = 0;
+    }
+
+    /* Fraction of the other uploads logged the same way. */
+    upload_trace_sample_rate = fileserver_config_get_string (session->config,
+                                                             "upload_trace_sample_rate",
+                                                             &error);
+    if (error) {
+        g_clear_error (&error);
+    } else {
+        sample_rate = g_ascii_strtod (upload_trace_sample_rate, NULL);
+        if (sample_rate < 0)
+            sample_rate = 0;
+        g_free (upload_trace_sample_rate);
+    }
+    upload_trace_init (upload_trace_threshold, sample_rate);
+    seaf_message ("fileserver: upload_trace_threshold = %d, upload_trace_sample_rate = %g\n",
+                  upload_trace_threshold, sample_rate);
+
+    transfer_limit_init (session);
+    block_cache_init (session);
+    http_io_init (session);
+    http_compress_init (session);
+
     encoding = g_key_file_get_string (session->config,
                                       "zip", "windows_encoding",
                                       &error);
@@ -288,6 +663,26 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     }
 }
 
+static void token_cache_value_free (gpointer data);
+
+/* Expired tokens are left to the reaper, but never returned. */
+static gpointer
+token_cache_value_copy (gconstpointer value)
+{
+    const TokenInfo *token_info = value;
+    TokenInfo *copy;
+
+    if (token_info->expire_time <= (gint64)time(NULL))
+        return NULL;
+
+    copy = g_new0 (TokenInfo, 1);
+    copy->repo_id = g_strdup (token_info->repo_id);
+    copy->email = g_strdup (token_info->email);
+    copy->expire_time = token_info->expire_time;
+
+    return copy;
+}
+
 static int
 validate_token (HttpServer *htp_server, evhtp_request_t *req,
                 const char *repo_id, char **username,
@@ -303,30 +698,25 @@ validate_token (HttpServer *htp_server, evhtp_request_t *req,
     }
 
     if (!skip_cache) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-
-        token_info = g_hash_table_lookup (htp_server->token_cache, token);
+        token_info = lru_cache_lookup (htp_server->token_cache, token,
+                                       token_cache_value_copy);
         if (token_info) {
             if (strcmp (token_info->repo_id, repo_id) != 0) {
-                pthread_mutex_unlock (&htp_server->token_cache_lock);
+                token_cache_value_free (token_info);
                 return EVHTP_RES_FORBIDDEN;
             }
 
             if (username)
                 *username = g_strdup(token_info->email);
-            pthread_mutex_unlock (&htp_server->token_cache_lock);
+            token_cache_value_free (token_info);
             return EVHTP_RES_OK;
         }
-
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
     }
 
     email = seaf_repo_manager_get_email_by_token (seaf->repo_mgr,
                                                   repo_id, token);
     if (email == NULL) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-        g_hash_table_remove (htp_server->token_cache, token);
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
+        lru_cache_remove (htp_server->token_cache, token);
         return EVHTP_RES_FORBIDDEN;
     }
 
@@ -335,29 +725,37 @@ validate_token (HttpServer *htp_server, evhtp_request_t *req,
     token_info->expire_time = (gint64)time(NULL) + TOKEN_EXPIRE_TIME;
     token_info->email = email;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_insert (htp_server->token_cache, g_strdup (token), token_info);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    lru_cache_insert (htp_server->token_cache, token, token_info,
+                      sizeof(TokenInfo) + strlen(token) + strlen(repo_id) +
+                      strlen(email) + 64);
 
     if (username)
         *username = g_strdup(email);
     return EVHTP_RES_OK;
 }
 
+static gpointer
+perm_cache_value_copy (gconstpointer value)
+{
+    const PermInfo *perm_info = value;
+    PermInfo *copy;
+
+    if (perm_info->expire_time <= (gint64)time(NULL))
+        return NULL;
+
+    copy = g_new0 (PermInfo, 1);
+    copy->expire_time = perm_info->expire_time;
+
+    return copy;
+}
+
 static PermInfo *
 lookup_perm_cache (HttpServer *htp_server, const char *repo_id, const char *username, const char *op)
 {
-    PermInfo *ret = NULL;
     PermInfo *perm = NULL;
     char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    ret = g_hash_table_lookup (htp_server->perm_cache, key);
-    if (ret) {
-        perm = g_new0 (PermInfo, 1);
-        perm->expire_time = ret->expire_time;
-    }
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    perm = lru_cache_lookup (htp_server->perm_cache, key, perm_cache_value_copy);
     g_free (key);
 
     return perm;
@@ -371,9 +769,9 @@ insert_perm_cache (HttpServer *htp_server,
 {
     char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_insert (htp_server->perm_cache, key, perm);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    lru_cache_insert (htp_server->perm_cache, key, perm,
+                      sizeof(PermInfo) + strlen(key) + 64);
+    g_free (key);
 }
 
 static void
@@ -383,13 +781,57 @@ remove_perm_cache (HttpServer *htp_server,
 {
     char *key = g_strdup_printf ("%s:%s:%s", repo_id, username, op);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_remove (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    lru_cache_remove (htp_server->perm_cache, key);
 
     g_free (key);
 }
 
+typedef struct PermMatch {
+    const char *repo_id;
+    const char *user;
+} PermMatch;
+
+/* Keys are "repo_id:username:op". */
+static gboolean
+perm_cache_key_matches (gpointer key, gpointer value, gpointer arg)
+{
+    PermMatch *match = arg;
+    const char *repo_id = key, *user, *op;
+
+    user = strchr (repo_id, ':');
+    op = strrchr (repo_id, ':');
+    if (!user || user == op)
+        return FALSE;
+
+    if (match->repo_id &&
+        (user - repo_id != strlen (match->repo_id) ||
+         strncmp (repo_id, match->repo_id, user - repo_id) != 0))
+        return FALSE;
+
+    ++user;
+    if (match->user &&
+        (op - user != strlen (match->user) ||
+         g_ascii_strncasecmp (user, match->user, op - user) != 0))
+        return FALSE;
+
+    return TRUE;
+}
+
+void
+seaf_http_server_invalidate_perms (HttpServerStruct *server,
+                                   const char *repo_id,
+                                   const char *user)
+{
+    PermMatch match;
+
+    if (!server || !server->priv || !server->priv->perm_cache)
+        return;
+
+    match.repo_id = repo_id;
+    match.user = user;
+    lru_cache_remove_if (server->priv->perm_cache, perm_cache_key_matches, &match);
+}
+
 static void perm_cache_value_free (gpointer data);
 
 static int
@@ -462,7 +904,7 @@ get_store_id_from_vir_repo_info_cache (HttpServer *htp_server, const char *repo_
     char *store_id = NULL;
     VirRepoInfo *vinfo = NULL;
 
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_lock (&htp_server->vir_repo_info_cache_lock);
     vinfo = g_hash_table_lookup (htp_server->vir_repo_info_cache, repo_id);
 
     if (vinfo) {
@@ -474,7 +916,7 @@ get_store_id_from_vir_repo_info_cache (HttpServer *htp_server, const char *repo_
         vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
     }
 
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_unlock (&htp_server->vir_repo_info_cache_lock);
 
     return store_id;
 }
@@ -483,9 +925,9 @@ static void
 add_vir_info_to_cache (HttpServer *htp_server, const char *repo_id,
                        VirRepoInfo *vinfo)
 {
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_lock (&htp_server->vir_repo_info_cache_lock);
     g_hash_table_insert (htp_server->vir_repo_info_cache, g_strdup (repo_id), vinfo);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_unlock (&htp_server->vir_repo_info_cache_lock);
 }
 
 static char *
@@ -498,30 +940,59 @@ get_repo_store_id (HttpServer *htp_server, const char *repo_id)
     }
 
     VirRepoInfo *vinfo = NULL;
-    char *sql = "SELECT repo_id, origin_repo FROM VirtualRepo where repo_id = ?";
+    char *key = NULL;
+    void *value = NULL;
+    int len;
+
+    /* The store of a virtual repo or a fork never changes. */
+    if (htp_server->cluster_cache) {
+        key = g_strdup_printf ("seaf:storeid:%s", repo_id);
+        if (cluster_cache_get (htp_server->cluster_cache, key, &value, &len) == 0 &&
+            is_uuid_valid ((char *)value)) {
+            vinfo = g_new0 (VirRepoInfo, 1);
+            if (strcmp ((char *)value, repo_id) != 0)
+                vinfo->store_id = g_strdup ((char *)value);
+            vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
+            add_vir_info_to_cache (htp_server, repo_id, vinfo);
+
+            g_free (key);
+            return value;
+        }
+        g_free (value);
+    }
+
+    /* Forks are never virtual, so at most one row is returned. */
+    char *sql = "SELECT v.repo_id, COALESCE(f.store_id, v.origin_repo) FROM VirtualRepo v "
+        "LEFT JOIN ForkedRepo f ON f.repo_id = v.origin_repo WHERE v.repo_id = ? "
+        "UNION ALL SELECT repo_id, store_id FROM ForkedRepo WHERE repo_id = ?";
     int n_row = seaf_db_statement_foreach_row (seaf->db, sql, get_vir_repo_info,
-                                               &vinfo, 1, "string", repo_id);
+                                               &vinfo, 2, "string", repo_id,
+                                               "string", repo_id);
     if (n_row < 0) {
         // db error, return NULL
-        return NULL;
+        store_id = NULL;
     } else if (n_row == 0) {
         // repo is not virtual repo
         vinfo = g_new0 (VirRepoInfo, 1);
-        if (!vinfo)
-            return NULL;
         vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
 
         add_vir_info_to_cache (htp_server, repo_id, vinfo);
 
-        return g_strdup (repo_id);
+        store_id = g_strdup (repo_id);
     } else if (!vinfo || !vinfo->store_id) {
         // out of memory, return NULL
-        return NULL;
+        store_id = NULL;
+    } else {
+        add_vir_info_to_cache (htp_server, repo_id, vinfo);
+
+        store_id = g_strdup (vinfo->store_id);
     }
 
-    add_vir_info_to_cache (htp_server, repo_id, vinfo);
+    if (key && store_id)
+        cluster_cache_set (htp_server->cluster_cache, key, store_id, strlen(store_id));
+    g_free (key);
 
-    return g_strdup (vinfo->store_id);
+    return store_id;
 }
 
 typedef struct {
@@ -560,31 +1031,137 @@ free_stats_event_data (StatsEventData *data)
     g_free (data);
 }
 
+/*
+ * Statistics and repo events are published in batches. Each worker thread
+ * adds to a shard of the pending events, chosen by the thread, so threads
+ * rarely wait on each other. Statistics are summed up per
+ * (operation, user, repo) and identical repo events are published once in
+ * each flush interval.
+ */
+typedef struct EventsShard {
+    SeafLock lock;
+    /* Formatted event without the bytes -> guint64 *bytes. */
+    GHashTable *stats;
+    /* Formatted event -> NULL. */
+    GHashTable *repo_events;
+} EventsShard;
+
+static EventsShard events_shards[EVENTS_SHARDS];
+static gsize events_shards_inited = 0;
+
+static void
+init_events_shards ()
+{
+    int i;
+
+    if (!g_once_init_enter (&events_shards_inited))
+        return;
+
+    for (i = 0; i < EVENTS_SHARDS; ++i) {
+        seaf_lock_init (&events_shards[i].lock, "events_shard");
+        events_shards[i].stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, g_free);
+        events_shards[i].repo_events = g_hash_table_new_full (g_str_hash,
+                                                               g_str_equal,
+                                                               g_free, NULL);
+    }
+
+    g_once_init_leave (&events_shards_inited, 1);
+}
+
+static EventsShard *
+get_events_shard ()
+{
+    init_events_shards ();
+    return &events_shards[(guint)((gsize)pthread_self() >> 4) % EVENTS_SHARDS];
+}
+
 static void
 publish_repo_event (RepoEventData *rdata)
 {
-    GString *buf = g_string_new (NULL);
-    g_string_printf (buf, "%s\t%s\t%s\t%s\t%s\t%s",
-                     rdata->etype, rdata->user, rdata->ip,
-                     rdata->client_name ? rdata->client_name : "",
-                     rdata->repo_id, rdata->path ? rdata->path : "/");
+    EventsShard *shard = get_events_shard ();
+    char *buf;
 
-    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_EVENT, buf->str);
+    buf = g_strdup_printf ("%s\t%s\t%s\t%s\t%s\t%s",
+                           rdata->etype, rdata->user, rdata->ip,
+                           rdata->client_name ? rdata->client_name : "",
+                           rdata->repo_id, rdata->path ? rdata->path : "/");
 
-    g_string_free (buf, TRUE);
+    seaf_lock_lock (&shard->lock);
+    g_hash_table_replace (shard->repo_events, buf, NULL);
+    seaf_lock_unlock (&shard->lock);
 }
 
 static void
 publish_stats_event (StatsEventData *rdata)
 {
-    GString *buf = g_string_new (NULL);
-    g_string_printf (buf, "%s\t%s\t%s\t%"G_GUINT64_FORMAT,
-                     rdata->etype, rdata->user,
-                     rdata->repo_id, rdata->bytes);
+    EventsShard *shard = get_events_shard ();
+    char *key;
+    guint64 *bytes;
 
-    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_STATS, buf->str);
+    key = g_strdup_printf ("%s\t%s\t%s", rdata->etype, rdata->user, rdata->repo_id);
 
-    g_string_free (buf, TRUE);
+    seaf_lock_lock (&shard->lock);
+    bytes = g_hash_table_lookup (shard->stats, key);
+    if (bytes) {
+        *bytes += rdata->bytes;
+        g_free (key);
+    } else {
+        bytes = g_new (guint64, 1);
+        *bytes = rdata->bytes;
+        g_hash_table_insert (shard->stats, key, bytes);
+    }
+    seaf_lock_unlock (&shard->lock);
+}
+
+static void
+flush_pending_events ()
+{
+    EventsShard *shard;
+    GHashTable *stats, *repo_events;
+    GHashTableIter iter;
+    gpointer key, value;
+    char *buf;
+    int i;
+
+    init_events_shards ();
+
+    for (i = 0; i < EVENTS_SHARDS; ++i) {
+        shard = &events_shards[i];
+
+        seaf_lock_lock (&shard->lock);
+        stats = shard->stats;
+        repo_events = shard->repo_events;
+        shard->stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+        shard->repo_events = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+        seaf_lock_unlock (&shard->lock);
+
+        g_hash_table_iter_init (&iter, repo_events);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            seaf_mq_manager_publish_event (seaf->mq_mgr,
+                                           SEAFILE_SERVER_CHANNEL_EVENT,
+                                           (char *)key);
+
+        g_hash_table_iter_init (&iter, stats);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            buf = g_strdup_printf ("%s\t%"G_GUINT64_FORMAT,
+                                   (char *)key, *(guint64 *)value);
+            seaf_mq_manager_publish_event (seaf->mq_mgr,
+                                           SEAFILE_SERVER_CHANNEL_STATS, buf);
+            g_free (buf);
+        }
+
+        g_hash_table_destroy (repo_events);
+        g_hash_table_destroy (stats);
+    }
+}
+
+static void
+flush_pending_events_cb (evutil_socket_t sock, short type, void *data)
+{
+    flush_pending_events ();
 }
 
 static void
@@ -883,6 +1460,112 @@ get_branch (SeafDBRow *row, void *vid)
     return FALSE;
 }
 
+/*
+ * Sync clients poll the heads of their repos all the time, so the heads of
+ * master branches are cached. The branch manager keeps the cache in step
+ * with the branches it updates, see seaf_http_server_update_head_commit().
+ * Branches updated by other servers of a cluster are seen once the cached
+ * head expires after head_commit_cache_ttl seconds and is read again.
+ *
+ * Every update bumps head_commit_cache_gen. Heads read from the database are
+ * only cached if no update happened during the query, so that a stale read
+ * never replaces a newer head.
+ */
+typedef struct HeadCommitInfo {
+    char commit_id[41];
+    gint64 expire_time;
+} HeadCommitInfo;
+
+static gboolean
+lookup_head_commit (HttpServer *htp_server, const char *repo_id, char *commit_id)
+{
+    HeadCommitInfo *info;
+    gboolean found = FALSE;
+
+    seaf_lock_lock (&htp_server->head_commit_cache_lock);
+    info = g_hash_table_lookup (htp_server->head_commit_cache, repo_id);
+    if (info && info->expire_time > (gint64)time(NULL)) {
+        memcpy (commit_id, info->commit_id, sizeof(info->commit_id));
+        found = TRUE;
+    }
+    seaf_lock_unlock (&htp_server->head_commit_cache_lock);
+
+    return found;
+}
+
+static gint64
+get_head_commit_cache_gen (HttpServer *htp_server)
+{
+    gint64 gen;
+
+    seaf_lock_lock (&htp_server->head_commit_cache_lock);
+    gen = htp_server->head_commit_cache_gen;
+    seaf_lock_unlock (&htp_server->head_commit_cache_lock);
+
+    return gen;
+}
+
+/* Called with head_commit_cache_lock held. */
+static void
+set_head_commit (HttpServer *htp_server, const char *repo_id, const char *commit_id)
+{
+    HeadCommitInfo *info;
+
+    info = g_hash_table_lookup (htp_server->head_commit_cache, repo_id);
+    if (!info) {
+        info = g_new0 (HeadCommitInfo, 1);
+        g_hash_table_insert (htp_server->head_commit_cache, g_strdup (repo_id), info);
+    }
+    g_strlcpy (info->commit_id, commit_id, sizeof(info->commit_id));
+    info->expire_time = (gint64)time(NULL) + seaf->http_server->head_commit_cache_ttl;
+}
+
+/* Caches a head read from the database after @gen was taken. */
+static void
+cache_head_commit (HttpServer *htp_server, gint64 gen,
+                   const char *repo_id, const char *commit_id)
+{
+    seaf_lock_lock (&htp_server->head_commit_cache_lock);
+    if (htp_server->head_commit_cache_gen == gen)
+        set_head_commit (htp_server, repo_id, commit_id);
+    seaf_lock_unlock (&htp_server->head_commit_cache_lock);
+}
+
+void
+seaf_http_server_update_head_commit (HttpServerStruct *server,
+                                     const char *repo_id,
+                                     const char *old_commit_id,
+                                     const char *new_commit_id)
+{
+    HttpServer *htp_server;
+    HeadCommitInfo *info;
+
+    if (!server || !server->priv)
+        return;
+    htp_server = server->priv;
+
+    seaf_lock_lock (&htp_server->head_commit_cache_lock);
+    ++htp_server->head_commit_cache_gen;
+    info = g_hash_table_lookup (htp_server->head_commit_cache, repo_id);
+    /* Concurrent updates may get here out of order. Only an update of the
+     * cached head is known to be newer.
+     */
+    if (old_commit_id && new_commit_id &&
+        (!info || strcmp (info->commit_id, old_commit_id) == 0))
+        set_head_commit (htp_server, repo_id, new_commit_id);
+    else
+        g_hash_table_remove (htp_server->head_commit_cache, repo_id);
+    seaf_lock_unlock (&htp_server->head_commit_cache_lock);
+}
+
+static gboolean
+is_head_commit_expire (gpointer key, gpointer value, gpointer arg)
+{
+    HeadCommitInfo *info = value;
+
+    return info->expire_time <= (gint64)time(NULL);
+}
+
 static void
 get_head_commit_cb (evhtp_request_t *req, void *arg)
 {
@@ -893,19 +1576,25 @@ get_head_commit_cb (evhtp_request_t *req, void *arg)
     int token_status;
     char commit_id[41];
     char *sql;
-
-    sql = "SELECT 1 FROM Repo WHERE repo_id=?";
-    exists = seaf_db_statement_exists (seaf->db, sql, &db_err, 1, "string", repo_id);
-    if (!exists) {
-        if (db_err) {
-            seaf_warning ("DB error when check repo existence.\n");
-            evbuffer_add_printf (req->buffer_out,
-                                 "{\"is_corrupted\": 1}");
-            evhtp_send_reply (req, EVHTP_RES_OK);
+    gboolean cached;
+    gint64 gen;
+
+    /* The head of a deleted repo is dropped from the cache. */
+    cached = lookup_head_commit (htp_server, repo_id, commit_id);
+    if (!cached) {
+        sql = "SELECT 1 FROM Repo WHERE repo_id=?";
+        exists = seaf_db_statement_exists (seaf->db, sql, &db_err, 1, "string", repo_id);
+        if (!exists) {
+            if (db_err) {
+                seaf_warning ("DB error when check repo existence.\n");
+                evbuffer_add_printf (req->buffer_out,
+                                     "{\"is_corrupted\": 1}");
+                evhtp_send_reply (req, EVHTP_RES_OK);
+                goto out;
+            }
+            evhtp_send_reply (req, SEAF_HTTP_RES_REPO_DELETED);
             goto out;
         }
-        evhtp_send_reply (req, SEAF_HTTP_RES_REPO_DELETED);
-        goto out;
     }
 
     token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
@@ -914,22 +1603,27 @@ get_head_commit_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    commit_id[0] = 0;
+    if (!cached) {
+        commit_id[0] = 0;
 
-    sql = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?";
-    if (seaf_db_statement_foreach_row (seaf->db, sql,
-                                       get_branch, commit_id,
-                                       1, "string", repo_id) < 0) {
-        seaf_warning ("DB error when get branch master.\n");
-        evbuffer_add_printf (req->buffer_out,
-                             "{\"is_corrupted\": 1}");
-        evhtp_send_reply (req, EVHTP_RES_OK);
-        goto out;
-    }
+        gen = get_head_commit_cache_gen (htp_server);
+        sql = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?";
+        if (seaf_db_statement_foreach_row (seaf->db, sql,
+                                           get_branch, commit_id,
+                                           1, "string", repo_id) < 0) {
+            seaf_warning ("DB error when get branch master.\n");
+            evbuffer_add_printf (req->buffer_out,
+                                 "{\"is_corrupted\": 1}");
+            evhtp_send_reply (req, EVHTP_RES_OK);
+            goto out;
+        }
 
-    if (commit_id[0] == 0) {
-        evhtp_send_reply (req, SEAF_HTTP_RES_REPO_DELETED);
-        goto out;
+        if (commit_id[0] == 0) {
+            evhtp_send_reply (req, SEAF_HTTP_RES_REPO_DELETED);
+            goto out;
+        }
+
+        cache_head_commit (htp_server, gen, repo_id, commit_id);
     }
 
     evbuffer_add_printf (req->buffer_out,
@@ -941,153 +1635,6 @@ out:
     g_strfreev (parts);
 }
 
-static char *
-gen_merge_description (SeafRepo *repo,
-                       const char *merged_root,
-                       const char *p1_root,
-                       const char *p2_root)
-{
-    GList *p;
-    GList *results = NULL;
-    char *desc;
-
-    diff_merge_roots (repo->store_id, repo->version,
-                      merged_root, p1_root, p2_root, &results, TRUE);
-
-    desc = diff_results_to_description (results);
-
-    for (p = results; p; p = p->next) {
-        DiffEntry *de = p->data;
-        diff_entry_free (de);
-    }
-    g_list_free (results);
-
-    return desc;
-}
-
-static int
-fast_forward_or_merge (const char *repo_id,
-                       SeafCommit *base,
-                       SeafCommit *new_commit)
-{
-#define MAX_RETRY_COUNT 3
-
-    SeafRepo *repo = NULL;
-    SeafCommit *current_head = NULL, *merged_commit = NULL;
-    int retry_cnt = 0;
-    int ret = 0;
-
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Repo %s doesn't exist.\n", repo_id);
-        ret = -1;
-        goto out;
-    }
-
-retry:
-    current_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                   repo->id, repo->version,
-                                                   repo->head->commit_id);
-    if (!current_head) {
-        seaf_warning ("Failed to find head commit of %s.\n", repo_id);
-        ret = -1;
-        goto out;
-    }
-
-    /* Merge if base and head are not the same. */
-    if (strcmp (base->commit_id, current_head->commit_id) != 0) {
-        MergeOptions opt;
-        const char *roots[3];
-        char *desc = NULL;
-
-        memset (&opt, 0, sizeof(opt));
-        opt.n_ways = 3;
-        memcpy (opt.remote_repo_id, repo_id, 36);
-        memcpy (opt.remote_head, new_commit->commit_id, 40);
-        opt.do_merge = TRUE;
-
-        roots[0] = base->root_id; /* base */
-        roots[1] = current_head->root_id; /* head */
-        roots[2] = new_commit->root_id;      /* remote */
-
-        if (seaf_merge_trees (repo->store_id, repo->version, 3, roots, &opt) < 0) {
-            seaf_warning ("Failed to merge.\n");
-            ret = -1;
-            goto out;
-        }
-
-        if (!opt.conflict)
-            desc = g_strdup("Auto merge by system");
-        else {
-            desc = gen_merge_description (repo,
-                                          opt.merged_tree_root,
-                                          current_head->root_id,
-                                          new_commit->root_id);
-            if (!desc)
-                desc = g_strdup("Auto merge by system");
-        }
-
-        merged_commit = seaf_commit_new(NULL, repo->id, opt.merged_tree_root,
-                                        new_commit->creator_name, EMPTY_SHA1,
-                                        desc,
-                                        0);
-        g_free (desc);
-
-        merged_commit->parent_id = g_strdup (current_head->commit_id);
-        merged_commit->second_parent_id = g_strdup (new_commit->commit_id);
-        merged_commit->new_merge = TRUE;
-        if (opt.conflict)
-            merged_commit->conflict = TRUE;
-        seaf_repo_to_commit (repo, merged_commit);
-
-        if (seaf_commit_manager_add_commit (seaf->commit_mgr, merged_commit) < 0) {
-            seaf_warning ("Failed to add commit.\n");
-            ret = -1;
-            goto out;
-        }
-    } else {
-        seaf_commit_ref (new_commit);
-        merged_commit = new_commit;
-    }
-
-    seaf_branch_set_commit(repo->head, merged_commit->commit_id);
-
-    if (seaf_branch_manager_test_and_update_branch(seaf->branch_mgr,
-                                                   repo->head,
-                                                   current_head->commit_id) < 0)
-    {
-        seaf_repo_unref (repo);
-        repo = NULL;
-        seaf_commit_unref (current_head);
-        current_head = NULL;
-        seaf_commit_unref (merged_commit);
-        merged_commit = NULL;
-
-        if (++retry_cnt <= MAX_RETRY_COUNT) {
-            /* Sleep random time between 100 and 1000 millisecs. */
-            usleep (g_random_int_range(1, 11) * 100 * 1000);
-
-            repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-            if (!repo) {
-                seaf_warning ("Repo %s doesn't exist.\n", repo_id);
-                ret = -1;
-                goto out;
-            }
-
-            goto retry;
-        } else {
-            ret = -1;
-            goto out;
-        }
-    }
-
-out:
-    seaf_commit_unref (current_head);
-    seaf_commit_unref (merged_commit);
-    seaf_repo_unref (repo);
-    return ret;
-}
-
 static void
 put_update_branch_cb (evhtp_request_t *req, void *arg)
 {
@@ -1097,6 +1644,7 @@ put_update_branch_cb (evhtp_request_t *req, void *arg)
     char *username = NULL;
     SeafRepo *repo = NULL;
     SeafCommit *new_commit = NULL, *base = NULL;
+    GError *error = NULL;
 
     const char *new_commit_id = evhtp_kv_find (req->uri->query, "head");
     if (new_commit_id == NULL || !is_object_id_valid (new_commit_id)) {
@@ -1149,8 +1697,11 @@ put_update_branch_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (fast_forward_or_merge (repo_id, base, new_commit) < 0) {
-        seaf_warning ("Fast forward merge for repo %s is failed.\n", repo_id);
+    if (seaf_repo_manager_commit_to_head (seaf->repo_mgr, repo_id, base,
+                                          new_commit, TRUE, NULL, &error) < 0) {
+        seaf_warning ("Fast forward merge for repo %s is failed: %s.\n",
+                      repo_id, error->message);
+        g_clear_error (&error);
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
@@ -1193,14 +1744,76 @@ collect_head_commit_ids (SeafDBRow *row, void *data)
     return TRUE;
 }
 
+/* Returns a map of repo id to head commit id for the repos in @repo_ids, or
+ * NULL on error. Only heads that are not cached are read from the database.
+ */
+static json_t *
+get_head_commit_ids (HttpServer *htp_server, GList *repo_ids)
+{
+    char *sql;
+    json_t *commit_id_map, *fetched;
+    GString *id_list = NULL;
+    char commit_id[41];
+    const char *repo_id;
+    void *iter;
+    gint64 gen;
+    GList *ptr;
+
+    commit_id_map = json_object();
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (lookup_head_commit (htp_server, repo_id, commit_id)) {
+            json_object_set_new (commit_id_map, repo_id, json_string (commit_id));
+            continue;
+        }
+        if (!id_list)
+            id_list = g_string_new ("");
+        else
+            g_string_append_c (id_list, ',');
+        g_string_append_printf (id_list, "'%s'", repo_id);
+    }
+    if (!id_list)
+        return commit_id_map;
+
+    gen = get_head_commit_cache_gen (htp_server);
+    if (seaf_db_type (seaf->db) == SEAF_DB_TYPE_MYSQL)
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s) LOCK IN SHARE MODE",
+                                id_list->str);
+    else
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s)",
+                                id_list->str);
+    fetched = json_object();
+    if (seaf_db_statement_foreach_row (seaf->db, sql,
+                                       collect_head_commit_ids, fetched, 0) < 0) {
+        json_decref (commit_id_map);
+        commit_id_map = NULL;
+        goto out;
+    }
+
+    for (iter = json_object_iter (fetched); iter;
+         iter = json_object_iter_next (fetched, iter)) {
+        repo_id = json_object_iter_key (iter);
+        json_object_set (commit_id_map, repo_id, json_object_iter_value (iter));
+        cache_head_commit (htp_server, gen, repo_id,
+                           json_string_value (json_object_iter_value (iter)));
+    }
+
+out:
+    json_decref (fetched);
+    g_string_free (id_list, TRUE);
+    g_free (sql);
+
+    return commit_id_map;
+}
+
 static void
 head_commits_multi_cb (evhtp_request_t *req, void *arg)
 {
+    HttpServer *htp_server = arg;
     size_t list_len;
     json_t *repo_id_array = NULL;
     size_t n, i;
-    GString *id_list_str = NULL;
-    char *sql = NULL;
+    GList *repo_ids = NULL;
     json_t *commit_id_map = NULL;
     char *data = NULL;
 
@@ -1235,7 +1848,6 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
     }
 
     json_t *id;
-    id_list_str = g_string_new ("");
     for (i = 0; i < n; ++i) {
         id = json_array_get (repo_id_array, i);
         if (json_typeof(id) != JSON_STRING) {
@@ -1247,21 +1859,11 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
             evhtp_send_reply (req, EVHTP_RES_BADREQ);
             goto out;
         }
-        if (i == 0)
-            g_string_append_printf (id_list_str, "'%s'", json_string_value(id));
-        else
-            g_string_append_printf (id_list_str, ",'%s'", json_string_value(id));
+        repo_ids = g_list_prepend (repo_ids, (char *)json_string_value (id));
     }
 
-    if (seaf_db_type (seaf->db) == SEAF_DB_TYPE_MYSQL)
-        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s) LOCK IN SHARE MODE",
-                                id_list_str->str);
-    else
-        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s)",
-                                id_list_str->str);
-    commit_id_map = json_object();
-    if (seaf_db_statement_foreach_row (seaf->db, sql,
-                                       collect_head_commit_ids, commit_id_map, 0) < 0) {
+    commit_id_map = get_head_commit_ids (htp_server, repo_ids);
+    if (!commit_id_map) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
@@ -1274,20 +1876,291 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
     }
 
     evbuffer_add (req->buffer_out, data, strlen(data));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    http_send_reply_compressed (req, EVHTP_RES_OK);
 
 out:
     if (repo_id_array)
         json_decref (repo_id_array);
-    if (id_list_str)
-        g_string_free (id_list_str, TRUE);
-    g_free (sql);
+    g_list_free (repo_ids);
     if (commit_id_map)
         json_decref (commit_id_map);
     if (data)
         free (data);
 }
 
+/*
+ * head-commits-wait is a long-poll alternative to polling head-commits-multi.
+ * The client posts a map of repo ids to the head commits it has. If some of
+ * them are out of date, the current heads of those repos are returned at
+ * once. Otherwise the request is held until a branch of these repos is
+ * updated, and an empty map is returned after the timeout.
+ *
+ * Branch updates are recorded with a sequence number by
+ * seaf_http_server_notify_repo_update(). A waiting request checks the
+ * sequence every second from its own event loop, so an idle wait costs no
+ * database query.
+ */
+#define DEFAULT_HEAD_COMMITS_WAIT 30
+#define MAX_HEAD_COMMITS_WAIT 300
+#define HEAD_COMMITS_WAIT_CHECK_INTERVAL 1
+
+typedef struct RepoUpdate {
+    gint64 seq;
+    gint64 mtime;
+} RepoUpdate;
+
+typedef struct HeadCommitsWait {
+    evhtp_request_t *req;
+    HttpServer *htp_server;
+    /* repo id -> head commit id the client has */
+    json_t *known_heads;
+    /* Updates up to this one have been looked at. */
+    gint64 seq;
+    gint64 deadline;
+    event_t *timer;
+    gboolean replied;
+} HeadCommitsWait;
+
+void
+seaf_http_server_notify_repo_update (HttpServerStruct *server,
+                                     const char *repo_id)
+{
+    HttpServer *htp_server;
+    RepoUpdate *update;
+
+    if (!server || !server->priv)
+        return;
+    htp_server = server->priv;
+
+    seaf_lock_lock (&htp_server->repo_updates_lock);
+    update = g_hash_table_lookup (htp_server->repo_updates, repo_id);
+    if (!update) {
+        update = g_new0 (RepoUpdate, 1);
+        g_hash_table_insert (htp_server->repo_updates, g_strdup (repo_id), update);
+    }
+    update->seq = ++htp_server->repo_update_seq;
+    update->mtime = (gint64)time(NULL);
+    seaf_lock_unlock (&htp_server->repo_updates_lock);
+}
+
+static gboolean
+is_repo_update_expire (gpointer key, gpointer value, gpointer arg)
+{
+    RepoUpdate *update = value;
+
+    /* All waits have looked at it by now. */
+    return update->mtime + MAX_HEAD_COMMITS_WAIT + 60 < (gint64)time(NULL);
+}
+
+/* Returns the current heads of the repos in @repo_ids that the client doesn't
+ * have, or NULL on error.
+ */
+static json_t *
+get_changed_heads (HeadCommitsWait *wait, GList *repo_ids)
+{
+    json_t *heads, *changed, *value;
+    const char *repo_id, *known;
+    void *iter;
+
+    heads = get_head_commit_ids (wait->htp_server, repo_ids);
+    if (!heads)
+        return NULL;
+
+    changed = json_object ();
+    for (iter = json_object_iter (heads); iter;
+         iter = json_object_iter_next (heads, iter)) {
+        repo_id = json_object_iter_key (iter);
+        value = json_object_iter_value (iter);
+        known = json_string_value (json_object_get (wait->known_heads, repo_id));
+        if (g_strcmp0 (known, json_string_value (value)) != 0)
+            json_object_set (changed, repo_id, value);
+    }
+    json_decref (heads);
+
+    return changed;
+}
+
+static void
+reply_head_commits_wait (HeadCommitsWait *wait, json_t *changed)
+{
+    char *data = NULL;
+
+    wait->replied = TRUE;
+    if (wait->timer) {
+        event_del (wait->timer);
+        /* Resume reading incomming requests. */
+        evhtp_request_resume (wait->req);
+    }
+
+    if (changed)
+        data = json_dumps (changed, JSON_COMPACT);
+    if (!data) {
+        evhtp_send_reply (wait->req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    evbuffer_add (wait->req->buffer_out, data, strlen(data));
+    evhtp_send_reply (wait->req, EVHTP_RES_OK);
+    free (data);
+}
+
+static void
+check_head_commits_wait (evutil_socket_t sock, short type, void *arg)
+{
+    HeadCommitsWait *wait = arg;
+    HttpServer *htp_server = wait->htp_server;
+    GList *repo_ids = NULL;
+    RepoUpdate *update;
+    const char *repo_id;
+    json_t *changed;
+    void *iter;
+
+    if (wait->replied)
+        return;
+
+    seaf_lock_lock (&htp_server->repo_updates_lock);
+    if (htp_server->repo_update_seq != wait->seq) {
+        for (iter = json_object_iter (wait->known_heads); iter;
+             iter = json_object_iter_next (wait->known_heads, iter)) {
+            repo_id = json_object_iter_key (iter);
+            update = g_hash_table_lookup (htp_server->repo_updates, repo_id);
+            if (!update || update->seq <= wait->seq)
+                continue;
+            repo_ids = g_list_prepend (repo_ids, (char *)repo_id);
+        }
+        wait->seq = htp_server->repo_update_seq;
+    }
+    seaf_lock_unlock (&htp_server->repo_updates_lock);
+
+    if (repo_ids) {
+        changed = get_changed_heads (wait, repo_ids);
+        g_list_free (repo_ids);
+        if (!changed || json_object_size (changed) > 0) {
+            reply_head_commits_wait (wait, changed);
+            if (changed)
+                json_decref (changed);
+            return;
+        }
+        json_decref (changed);
+    }
+
+    if ((gint64)time(NULL) >= wait->deadline) {
+        changed = json_object ();
+        reply_head_commits_wait (wait, changed);
+        json_decref (changed);
+    }
+}
+
+static evhtp_res
+head_commits_wait_fini_cb (evhtp_request_t *req, void *arg)
+{
+    HeadCommitsWait *wait = arg;
+
+    if (wait->timer)
+        event_free (wait->timer);
+    json_decref (wait->known_heads);
+    g_free (wait);
+
+    return EVHTP_RES_OK;
+}
+
+static void
+wait_head_commits_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    size_t len;
+    char *body = NULL;
+    json_t *known_heads = NULL, *value, *changed = NULL;
+    json_error_t jerror;
+    const char *repo_id, *timeout_str;
+    GList *repo_ids = NULL;
+    HeadCommitsWait *wait;
+    gint64 seq;
+    int timeout = DEFAULT_HEAD_COMMITS_WAIT;
+    void *iter;
+
+    len = evbuffer_get_length (req->buffer_in);
+    if (len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+    body = g_new0 (char, len);
+    evbuffer_remove (req->buffer_in, body, len);
+    known_heads = json_loadb (body, len, 0, &jerror);
+    g_free (body);
+
+    if (!known_heads || !json_is_object (known_heads) ||
+        json_object_size (known_heads) == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    for (iter = json_object_iter (known_heads); iter;
+         iter = json_object_iter_next (known_heads, iter)) {
+        repo_id = json_object_iter_key (iter);
+        value = json_object_iter_value (iter);
+        /* Make sure ids are in UUID format. */
+        if (!is_uuid_valid (repo_id) || !json_is_string (value)) {
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            goto out;
+        }
+        repo_ids = g_list_prepend (repo_ids, (char *)repo_id);
+    }
+
+    timeout_str = evhtp_kv_find (req->uri->query, "timeout");
+    if (timeout_str) {
+        timeout = atoi (timeout_str);
+        if (timeout < 0)
+            timeout = 0;
+        else if (timeout > MAX_HEAD_COMMITS_WAIT)
+            timeout = MAX_HEAD_COMMITS_WAIT;
+    }
+
+    wait = g_new0 (HeadCommitsWait, 1);
+    wait->req = req;
+    wait->htp_server = htp_server;
+    wait->known_heads = known_heads;
+    known_heads = NULL;
+    wait->deadline = (gint64)time(NULL) + timeout;
+    http_metrics_set_fini_hook (req, head_commits_wait_fini_cb, wait);
+
+    /* Take the sequence before reading the heads, so that no update in
+     * between is missed.
+     */
+    seaf_lock_lock (&htp_server->repo_updates_lock);
+    seq = htp_server->repo_update_seq;
+    seaf_lock_unlock (&htp_server->repo_updates_lock);
+    wait->seq = seq;
+
+    changed = get_changed_heads (wait, repo_ids);
+    if (!changed || json_object_size (changed) > 0 || timeout == 0) {
+        reply_head_commits_wait (wait, changed);
+        goto out;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = HEAD_COMMITS_WAIT_CHECK_INTERVAL;
+    tv.tv_usec = 0;
+    wait->timer = event_new (evhtp_request_get_connection (req)->evbase,
+                             -1,
+                             EV_PERSIST,
+                             check_head_commits_wait,
+                             wait);
+    evtimer_add (wait->timer, &tv);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+out:
+    if (known_heads)
+        json_decref (known_heads);
+    if (changed)
+        json_decref (changed);
+    g_list_free (repo_ids);
+}
+
 static void
 get_commit_info_cb (evhtp_request_t *req, void *arg)
 {
@@ -1403,16 +2276,27 @@ commit_oper_cb (evhtp_request_t *req, void *arg)
     }
 }
 
+/* Object lists are arrays of raw 20-byte ids, converted to hex only
+ * when they are sent.
+ */
+static void
+id_list_append (GByteArray *ids, const char *id)
+{
+    unsigned char raw[20];
+
+    hex_to_rawdata (id, raw, 20);
+    g_byte_array_append (ids, raw, 20);
+}
+
 static int
 collect_file_ids (int n, const char *basedir, SeafDirent *files[], void *data)
 {
     SeafDirent *file1 = files[0];
     SeafDirent *file2 = files[1];
-    GList **pret = data;
 
     if (file1 && (!file2 || strcmp(file1->id, file2->id) != 0) &&
         strcmp (file1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(file1->id));
+        id_list_append (data, file1->id);
 
     return 0;
 }
@@ -1429,11 +2313,74 @@ collect_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *data,
 {
     SeafDirent *dir1 = dirs[0];
     SeafDirent *dir2 = dirs[1];
-    GList **pret = data;
 
     if (dir1 && (!dir2 || strcmp(dir1->id, dir2->id) != 0) &&
         strcmp (dir1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(dir1->id));
+        id_list_append (data, dir1->id);
+
+    return 0;
+}
+
+static void *
+new_id_list (void)
+{
+    return g_byte_array_new ();
+}
+
+static void
+merge_id_lists (void *data, void *part)
+{
+    GByteArray *ids = data, *part_ids = part;
+
+    g_byte_array_append (ids, part_ids->data, part_ids->len);
+    g_byte_array_free (part_ids, TRUE);
+}
+
+static json_t *
+id_list_to_json_array (GByteArray *ids)
+{
+    json_t *obj_array = json_array ();
+    char hex[41];
+    guint i;
+
+    for (i = 0; i + 20 <= ids->len; i += 20) {
+        rawdata_to_hex (ids->data + i, hex, 20);
+        json_array_append_new (obj_array, json_string (hex));
+    }
+
+    return obj_array;
+}
+
+/* Gets the roots of the trees whose difference is sent to the client. */
+static int
+get_send_object_roots (SeafRepo *repo,
+                       const char *server_head,
+                       const char *client_head,
+                       char master_root[],
+                       char remote_root[])
+{
+    SeafCommit *commit;
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             repo->id, repo->version,
+                                             server_head);
+    if (!commit) {
+        seaf_warning ("Server head commit %s:%s not found.\n", repo->id, server_head);
+        return -1;
+    }
+    memcpy (master_root, commit->root_id, 41);
+    seaf_commit_unref (commit);
+
+    if (client_head) {
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 client_head);
+        if (!commit)
+            return -1;
+        memcpy (remote_root, commit->root_id, 41);
+        seaf_commit_unref (commit);
+    } else
+        memcpy (remote_root, EMPTY_SHA1, 41);
 
     return 0;
 }
@@ -1443,38 +2390,24 @@ calculate_send_object_list (SeafRepo *repo,
                             const char *server_head,
                             const char *client_head,
                             gboolean dir_only,
-                            GList **results)
+                            GByteArray **results)
 {
-    SeafCommit *remote_head = NULL, *master_head = NULL;
-    char *remote_head_root;
+    char master_root[41], remote_root[41];
+    GByteArray *ids;
     int ret = 0;
 
     *results = NULL;
 
-    master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                  repo->id, repo->version,
-                                                  server_head);
-    if (!master_head) {
-        seaf_warning ("Server head commit %s:%s not found.\n", repo->id, server_head);
+    if (get_send_object_roots (repo, server_head, client_head,
+                               master_root, remote_root) < 0)
         return -1;
-    }
 
-    if (client_head) {
-        remote_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                      repo->id, repo->version,
-                                                      client_head);
-        if (!remote_head) {
-            ret = -1;
-            goto out;
-        }
-        remote_head_root = remote_head->root_id;
-    } else
-        remote_head_root = EMPTY_SHA1;
+    ids = g_byte_array_new ();
 
     /* Diff won't traverse the root object itself. */
-    if (strcmp (remote_head_root, master_head->root_id) != 0 &&
-        strcmp (master_head->root_id, EMPTY_SHA1) != 0)
-        *results = g_list_prepend (*results, g_strdup(master_head->root_id));
+    if (strcmp (remote_root, master_root) != 0 &&
+        strcmp (master_root, EMPTY_SHA1) != 0)
+        id_list_append (ids, master_root);
 
     DiffOptions opts;
     memset (&opts, 0, sizeof(opts));
@@ -1485,37 +2418,561 @@ calculate_send_object_list (SeafRepo *repo,
     else
         opts.file_cb = collect_file_ids_nop;
     opts.dir_cb = collect_dir_ids;
-    opts.data = results;
+    opts.data = ids;
+    opts.new_data = new_id_list;
+    opts.merge_data = merge_id_lists;
 
     const char *trees[2];
-    trees[0] = master_head->root_id;
-    trees[1] = remote_head_root;
-    if (diff_trees (2, trees, &opts) < 0) {
+    trees[0] = master_root;
+    trees[1] = remote_root;
+    if (diff_trees_parallel (2, trees, &opts,
+                             seaf->http_server->max_diff_threads) < 0) {
         seaf_warning ("Failed to diff remote and master head for repo %.8s.\n",
                       repo->id);
-        string_list_free (*results);
+        g_byte_array_free (ids, TRUE);
         ret = -1;
+    } else {
+        *results = ids;
     }
 
-out:
-    seaf_commit_unref (remote_head);
-    seaf_commit_unref (master_head);
     return ret;
 }
 
+/*
+ * The fs id list for a pair of commits never changes, and when a commit is
+ * pushed to a library shared by many devices they all ask for the same list.
+ * So computed lists are cached as json, and a request for a list that is
+ * being computed waits for the result instead of computing it again.
+ * Finished lists are evicted in LRU order when the cache is over
+ * fs_id_list_cache_size.
+ */
+typedef struct FsIdList {
+    char *key;
+    char *json;
+    gsize len;
+    int status;                 /* 1: computing, 0: done, -1: failed */
+    int refcnt;
+    GList *lru_link;
+} FsIdList;
+
 static void
-get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
+fs_id_list_unref (FsIdList *list)
 {
-    HttpServer *htp_server = arg;
-    char **parts;
-    char *repo_id;
-    SeafRepo *repo = NULL;
-    gboolean dir_only = FALSE;
-    char *username = NULL;
+    if (!g_atomic_int_dec_and_test (&list->refcnt))
+        return;
 
-    const char *server_head = evhtp_kv_find (req->uri->query, "server-head");
-    if (server_head == NULL || !is_object_id_valid (server_head)) {
-        char *error = "Invalid server-head parameter.\n";
+    g_free (list->key);
+    g_free (list->json);
+    g_free (list);
+}
+
+static char *
+fs_id_list_to_json (GByteArray *ids)
+{
+    json_t *obj_array = id_list_to_json_array (ids);
+    char *ret;
+
+    ret = json_dumps (obj_array, JSON_COMPACT);
+    json_decref (obj_array);
+    return ret;
+}
+
+/* Must be called with fs_id_list_lock held. */
+static void
+cache_fs_id_list (HttpServer *htp_server, FsIdList *list)
+{
+    gint64 limit = seaf->http_server->fs_id_list_cache_size;
+    FsIdList *old;
+
+    /* A single list must not flush a large part of the cache. */
+    if ((gint64)list->len > limit / 4) {
+        g_hash_table_remove (htp_server->fs_id_lists, list->key);
+        fs_id_list_unref (list);
+        return;
+    }
+
+    g_queue_push_head (htp_server->fs_id_list_lru, list);
+    list->lru_link = htp_server->fs_id_list_lru->head;
+    htp_server->fs_id_list_bytes += list->len;
+
+    while (htp_server->fs_id_list_bytes > limit) {
+        old = g_queue_pop_tail (htp_server->fs_id_list_lru);
+        old->lru_link = NULL;
+        g_hash_table_remove (htp_server->fs_id_lists, old->key);
+        htp_server->fs_id_list_bytes -= old->len;
+        fs_id_list_unref (old);
+    }
+}
+
+static char *
+fs_id_list_key (SeafRepo *repo, const char *server_head,
+                const char *client_head, gboolean dir_only)
+{
+    return g_strdup_printf ("%s/%s/%s/%d", repo->id, server_head,
+                            client_head ? client_head : "", dir_only);
+}
+
+static gboolean
+fs_id_list_is_cached (HttpServer *htp_server, SeafRepo *repo,
+                      const char *server_head, const char *client_head,
+                      gboolean dir_only)
+{
+    char *key = fs_id_list_key (repo, server_head, client_head, dir_only);
+    FsIdList *list;
+    gboolean ret;
+
+    seaf_lock_lock (&htp_server->fs_id_list_lock);
+    list = g_hash_table_lookup (htp_server->fs_id_lists, key);
+    ret = (list && list->status == 0);
+    seaf_lock_unlock (&htp_server->fs_id_list_lock);
+
+    g_free (key);
+    return ret;
+}
+
+/* Returns a reference to the list, or NULL on error. */
+static FsIdList *
+get_fs_id_list (HttpServer *htp_server, SeafRepo *repo,
+                const char *server_head, const char *client_head,
+                gboolean dir_only)
+{
+    FsIdList *list;
+    GByteArray *ids = NULL;
+    char *key;
+
+    key = fs_id_list_key (repo, server_head, client_head, dir_only);
+
+    seaf_lock_lock (&htp_server->fs_id_list_lock);
+    list = g_hash_table_lookup (htp_server->fs_id_lists, key);
+    if (list) {
+        g_free (key);
+        g_atomic_int_inc (&list->refcnt);
+        while (list->status == 1)
+            seaf_lock_cond_wait (&htp_server->fs_id_list_cond,
+                                 &htp_server->fs_id_list_lock);
+        if (list->status < 0) {
+            seaf_lock_unlock (&htp_server->fs_id_list_lock);
+            fs_id_list_unref (list);
+            return NULL;
+        }
+        /* Lists that were evicted or too large to keep have no link. */
+        if (list->lru_link) {
+            g_queue_unlink (htp_server->fs_id_list_lru, list->lru_link);
+            g_queue_push_head_link (htp_server->fs_id_list_lru, list->lru_link);
+        }
+        seaf_lock_unlock (&htp_server->fs_id_list_lock);
+        return list;
+    }
+
+    list = g_new0 (FsIdList, 1);
+    list->key = key;
+    list->status = 1;
+    /* One reference for the cache and one for the caller. */
+    list->refcnt = 2;
+    g_hash_table_insert (htp_server->fs_id_lists, list->key, list);
+    seaf_lock_unlock (&htp_server->fs_id_list_lock);
+
+    if (calculate_send_object_list (repo, server_head, client_head,
+                                    dir_only, &ids) == 0) {
+        list->json = fs_id_list_to_json (ids);
+        list->len = strlen (list->json);
+        g_byte_array_free (ids, TRUE);
+    }
+
+    seaf_lock_lock (&htp_server->fs_id_list_lock);
+    if (list->json) {
+        list->status = 0;
+        cache_fs_id_list (htp_server, list);
+    } else {
+        list->status = -1;
+        g_hash_table_remove (htp_server->fs_id_lists, list->key);
+        fs_id_list_unref (list);
+    }
+    pthread_cond_broadcast (&htp_server->fs_id_list_cond);
+    seaf_lock_unlock (&htp_server->fs_id_list_lock);
+
+    if (list->status < 0) {
+        fs_id_list_unref (list);
+        return NULL;
+    }
+    return list;
+}
+
+/*
+ * A streamed fs id list (the "stream" parameter) is sent while the trees
+ * are diffed, instead of being computed into memory first. A diff thread
+ * writes the json to a pipe, which is sent out in chunks when the output
+ * buffer is drained. So the pipe bounds the buffered ids, and a slow client
+ * holds the diff back. Streamed lists aren't cached, as holding them is
+ * what streaming avoids. Over MAX_FS_ID_STREAMS streams, lists are computed
+ * as usual.
+ */
+#define MAX_FS_ID_STREAMS 16
+#define FS_ID_STREAM_BATCH 1024
+
+static gint n_fs_id_streams = 0;
+
+typedef struct FsIdStream {
+    int refcnt;
+    int failed;
+
+    /* Only used by the diff thread. */
+    int fd;
+    GByteArray *ids;
+    gboolean started;
+    char store_id[37];
+    int version;
+    char master_root[41];
+    char remote_root[41];
+    gboolean dir_only;
+} FsIdStream;
+
+typedef struct SendFsIdStreamData {
+    evhtp_request_t *req;
+    int pipefd;
+    event_t *read_ev;
+    FsIdStream *stream;
+    /* Set if the list is sent compressed. */
+    z_stream *zstrm;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendFsIdStreamData;
+
+static void
+fs_id_stream_unref (FsIdStream *stream)
+{
+    if (!g_atomic_int_dec_and_test (&stream->refcnt))
+        return;
+
+    if (stream->ids)
+        g_byte_array_free (stream->ids, TRUE);
+    g_free (stream);
+}
+
+static int
+fs_id_stream_write (FsIdStream *stream, const char *buf, gsize len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write (stream->fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+fs_id_stream_flush (FsIdStream *stream)
+{
+    GString *buf = g_string_sized_new (stream->ids->len / 20 * 43 + 1);
+    char hex[41];
+    guint i;
+    int ret;
+
+    for (i = 0; i + 20 <= stream->ids->len; i += 20) {
+        rawdata_to_hex (stream->ids->data + i, hex, 20);
+        g_string_append_c (buf, stream->started ? ',' : '[');
+        stream->started = TRUE;
+        g_string_append_c (buf, '"');
+        g_string_append_len (buf, hex, 40);
+        g_string_append_c (buf, '"');
+    }
+    g_byte_array_set_size (stream->ids, 0);
+
+    ret = fs_id_stream_write (stream, buf->str, buf->len);
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
+static int
+stream_file_ids (int n, const char *basedir, SeafDirent *files[], void *data)
+{
+    FsIdStream *stream = data;
+
+    collect_file_ids (n, basedir, files, stream->ids);
+    if (stream->ids->len >= FS_ID_STREAM_BATCH * 20)
+        return fs_id_stream_flush (stream);
+    return 0;
+}
+
+static int
+stream_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *data,
+                gboolean *recurse)
+{
+    FsIdStream *stream = data;
+
+    collect_dir_ids (n, basedir, dirs, stream->ids, recurse);
+    if (stream->ids->len >= FS_ID_STREAM_BATCH * 20)
+        return fs_id_stream_flush (stream);
+    return 0;
+}
+
+static void *
+fs_id_stream_thread (void *vdata)
+{
+    FsIdStream *stream = vdata;
+    DiffOptions opts;
+    const char *trees[2];
+    int ret;
+
+    memset (&opts, 0, sizeof(opts));
+    memcpy (opts.store_id, stream->store_id, 36);
+    opts.version = stream->version;
+    opts.file_cb = stream->dir_only ? collect_file_ids_nop : stream_file_ids;
+    opts.dir_cb = stream_dir_ids;
+    opts.data = stream;
+
+    trees[0] = stream->master_root;
+    trees[1] = stream->remote_root;
+    ret = diff_trees (2, trees, &opts);
+    if (ret == 0)
+        ret = fs_id_stream_flush (stream);
+    if (ret == 0)
+        ret = fs_id_stream_write (stream, stream->started ? "]" : "[]",
+                                  stream->started ? 1 : 2);
+
+    /* Set before closing the pipe, it's checked at the end of the pipe. */
+    if (ret < 0)
+        g_atomic_int_set (&stream->failed, 1);
+    close (stream->fd);
+
+    g_atomic_int_add (&n_fs_id_streams, -1);
+    fs_id_stream_unref (stream);
+    return NULL;
+}
+
+static void
+free_send_fs_id_stream_data (SendFsIdStreamData *data)
+{
+    event_free (data->read_ev);
+    /* The diff fails on a closed pipe if the list wasn't sent out. */
+    close (data->pipefd);
+    fs_id_stream_unref (data->stream);
+    http_gzip_stream_free (data->zstrm);
+    g_free (data);
+}
+
+static void
+send_fs_id_stream_data (SendFsIdStreamData *data)
+{
+    char buf[64 * 1024];
+    ssize_t n;
+
+    n = read (data->pipefd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        event_add (data->read_ev, NULL);
+        return;
+    }
+    if (n < 0) {
+        seaf_warning ("Failed to read fs id list stream: %s.\n", strerror (errno));
+        goto err;
+    }
+
+    if (n > 0) {
+        struct evbuffer *out = evbuffer_new ();
+        evbuffer_add (out, buf, n);
+        /* Flushed, so that the client gets the ids as they are found. */
+        if (data->zstrm) {
+            struct evbuffer *zout = evbuffer_new ();
+            if (http_gzip_deflate (data->zstrm, out, n, Z_SYNC_FLUSH, zout) < 0) {
+                seaf_warning ("Failed to compress fs id list.\n");
+                evbuffer_free (zout);
+                evbuffer_free (out);
+                goto err;
+            }
+            evbuffer_free (out);
+            out = zout;
+        }
+        evhtp_send_reply_chunk (data->req, out);
+        evbuffer_free (out);
+        return;
+    }
+
+    if (g_atomic_int_get (&data->stream->failed)) {
+        seaf_warning ("Failed to stream fs id list.\n");
+        goto err;
+    }
+
+    struct evbuffer *trailer = NULL;
+    if (data->zstrm) {
+        trailer = evbuffer_new ();
+        if (http_gzip_deflate (data->zstrm, trailer, 0, Z_FINISH, trailer) < 0) {
+            seaf_warning ("Failed to compress fs id list.\n");
+            evbuffer_free (trailer);
+            goto err;
+        }
+    }
+
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    if (trailer) {
+        evhtp_send_reply_chunk (data->req, trailer);
+        evbuffer_free (trailer);
+    }
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_send_fs_id_stream_data (data);
+    return;
+
+err:
+    /* The headers are out, so the client can only tell from the dropped
+     * connection that the list is incomplete.
+     */
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_send_fs_id_stream_data (data);
+}
+
+static void
+write_fs_id_stream_cb (struct bufferevent *bev, void *ctx)
+{
+    send_fs_id_stream_data (ctx);
+}
+
+static void
+fs_id_stream_readable_cb (evutil_socket_t fd, short what, void *ctx)
+{
+    send_fs_id_stream_data (ctx);
+}
+
+static void
+fs_id_stream_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendFsIdStreamData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_send_fs_id_stream_data (data);
+}
+
+/* Returns 0 when the list is being streamed, 1 if there are too many
+ * streams, and -1 on error.
+ */
+static int
+start_fs_id_stream (evhtp_request_t *req, SeafRepo *repo,
+                    const char *server_head, const char *client_head,
+                    gboolean dir_only)
+{
+    FsIdStream *stream;
+    SendFsIdStreamData *data;
+    pthread_t tid;
+    int fds[2];
+
+    if (g_atomic_int_add (&n_fs_id_streams, 1) >= MAX_FS_ID_STREAMS) {
+        g_atomic_int_add (&n_fs_id_streams, -1);
+        return 1;
+    }
+
+    stream = g_new0 (FsIdStream, 1);
+    if (get_send_object_roots (repo, server_head, client_head,
+                               stream->master_root, stream->remote_root) < 0)
+        goto error;
+    memcpy (stream->store_id, repo->store_id, 36);
+    stream->version = repo->version;
+    stream->dir_only = dir_only;
+    stream->ids = g_byte_array_new ();
+
+    /* Diff won't traverse the root object itself. */
+    if (strcmp (stream->remote_root, stream->master_root) != 0 &&
+        strcmp (stream->master_root, EMPTY_SHA1) != 0)
+        id_list_append (stream->ids, stream->master_root);
+
+    if (pipe (fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        goto error;
+    }
+    if (fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK) < 0) {
+        seaf_warning ("Failed to set pipe non-blocking: %s.\n", strerror(errno));
+        close (fds[0]);
+        close (fds[1]);
+        goto error;
+    }
+
+    stream->fd = fds[1];
+    /* One reference for the diff thread and one for the sending side. */
+    stream->refcnt = 2;
+    if (pthread_create (&tid, NULL, fs_id_stream_thread, stream) != 0) {
+        seaf_warning ("Failed to start fs id list stream thread.\n");
+        close (fds[0]);
+        close (fds[1]);
+        goto error;
+    }
+    pthread_detach (tid);
+
+    data = g_new0 (SendFsIdStreamData, 1);
+    data->req = req;
+    data->pipefd = fds[0];
+    data->stream = stream;
+    data->read_ev = event_new (evhtp_request_get_connection (req)->evbase,
+                               fds[0], EV_READ, fs_id_stream_readable_cb, data);
+
+    /* The size isn't known up front, but streamed lists are the long ones. */
+    if (http_should_compress (req, G_MAXSIZE))
+        data->zstrm = http_gzip_stream_new ();
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Vary", "Accept-Encoding", 1, 1));
+    if (data->zstrm)
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Encoding", "gzip", 1, 1));
+
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_fs_id_stream_cb,
+                       fs_id_stream_event_cb,
+                       data);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+
+    return 0;
+
+error:
+    if (stream->ids)
+        g_byte_array_free (stream->ids, TRUE);
+    g_free (stream);
+    g_atomic_int_add (&n_fs_id_streams, -1);
+    return -1;
+}
+
+static void
+get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts;
+    char *repo_id;
+    SeafRepo *repo = NULL;
+    gboolean dir_only = FALSE;
+    char *username = NULL;
+
+    const char *server_head = evhtp_kv_find (req->uri->query, "server-head");
+    if (server_head == NULL || !is_object_id_valid (server_head)) {
+        char *error = "Invalid server-head parameter.\n";
         seaf_warning ("%s", error);
         evbuffer_add (req->buffer_out, error, strlen (error));
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
@@ -1535,6 +2992,8 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     if (dir_only_arg)
         dir_only = TRUE;
 
+    const char *stream_arg = evhtp_kv_find (req->uri->query, "stream");
+
     parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
 
@@ -1551,7 +3010,7 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    GList *list = NULL, *ptr;
+    FsIdList *list;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -1560,25 +3019,27 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (calculate_send_object_list (repo, server_head, client_head, dir_only, &list) < 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+    if (stream_arg &&
+        !fs_id_list_is_cached (htp_server, repo, server_head, client_head, dir_only)) {
+        int rc = start_fs_id_stream (req, repo, server_head, client_head, dir_only);
+        if (rc == 0)
+            goto out;
+        if (rc < 0) {
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            goto out;
+        }
     }
 
-    json_t *obj_array = json_array ();
-
-    for (ptr = list; ptr; ptr = ptr->next) {
-        json_array_append_new (obj_array, json_string (ptr->data));
-        g_free (ptr->data);
+    list = get_fs_id_list (htp_server, repo, server_head, client_head, dir_only);
+    if (!list) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
     }
-    g_list_free (list);
 
-    char *obj_list = json_dumps (obj_array, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, obj_list, strlen (obj_list));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    evbuffer_add (req->buffer_out, list->json, list->len);
+    http_send_reply_compressed (req, EVHTP_RES_OK);
 
-    g_free (obj_list);
-    json_decref (obj_array);
+    fs_id_list_unref (list);
 
 out:
     g_free (username);
@@ -1596,7 +3057,7 @@ typedef struct ComputeObjTask {
 } ComputeObjTask;
 
 typedef struct CalObjResult {
-    GList *list;
+    GByteArray *list;
     gboolean done;
 } CalObjResult;
 
@@ -1625,7 +3086,7 @@ free_obj_cal_result (gpointer data)
         return;
 
     if (result->list)
-        g_list_free (result->list);
+        g_byte_array_free (result->list, TRUE);
 
     g_free(result);
 }
@@ -1642,9 +3103,9 @@ compute_fs_obj_id (gpointer ptask, gpointer ppara)
     HttpServer *htp_server = task->htp_server;
     CalObjResult *result = NULL;
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_lock (&htp_server->fs_obj_ids_lock);
     result = g_hash_table_lookup (htp_server->fs_obj_ids, task->token);
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
     if (!result) {
         goto out;
     }
@@ -1656,9 +3117,9 @@ compute_fs_obj_id (gpointer ptask, gpointer ppara)
     }
 
     if (calculate_send_object_list (repo, server_head, client_head, dir_only, &result->list) < 0) {
-        pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+        seaf_lock_lock (&htp_server->fs_obj_ids_lock);
         g_hash_table_remove (htp_server->fs_obj_ids, task->token);
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+        seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
         goto out;
     }
 
@@ -1731,9 +3192,9 @@ start_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     task->client_head = g_strdup(client_head);
     task->server_head = g_strdup(server_head);
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_lock (&htp_server->fs_obj_ids_lock);
     g_hash_table_insert (htp_server->fs_obj_ids, g_strdup(task->token), result);
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
     g_thread_pool_push (htp_server->compute_fs_obj_id_pool, task, NULL);
     obj = json_object ();
     json_object_set_new (obj, "token", json_string (new_token));
@@ -1775,10 +3236,10 @@ query_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 
     obj = json_object ();
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_lock (&htp_server->fs_obj_ids_lock);
     result = g_hash_table_lookup (htp_server->fs_obj_ids, token);
     if (!result) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+        seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
         evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
         goto out;
     } else {
@@ -1788,7 +3249,7 @@ query_fs_obj_id_cb (evhtp_request_t *req, void *arg)
             json_object_set_new (obj, "success", json_true());
         }
     }
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
 
     json_object_set_new (obj, "token", json_string (token));
 
@@ -1811,7 +3272,7 @@ retrieve_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     char **parts;
     const char *token = NULL;
     char *repo_id = NULL;
-    GList *list = NULL;
+    GByteArray *list = NULL;
     CalObjResult *result = NULL;
     HttpServer *htp_server = (HttpServer *)arg;
 
@@ -1830,16 +3291,16 @@ retrieve_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_lock (&htp_server->fs_obj_ids_lock);
     result = g_hash_table_lookup (htp_server->fs_obj_ids, token);
     if (!result) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+        seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
         evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
 
         return;
     }
     if (!result->done) {
-        pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+        seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
 
         char *error = "The cauculation task is not completed.\n";
         evbuffer_add (req->buffer_out, error, strlen(error));
@@ -1847,23 +3308,17 @@ retrieve_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         return;
     }
     list = result->list;
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
-
-    GList *ptr;
-    json_t *obj_array = json_array ();
+    seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
 
-    for (ptr = list; ptr; ptr = ptr->next) {
-        json_array_append_new (obj_array, json_string (ptr->data));
-        g_free (ptr->data);
-    }
+    json_t *obj_array = id_list_to_json_array (list);
 
-    pthread_mutex_lock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_lock (&htp_server->fs_obj_ids_lock);
     g_hash_table_remove (htp_server->fs_obj_ids, token);
-    pthread_mutex_unlock (&htp_server->fs_obj_ids_lock);
+    seaf_lock_unlock (&htp_server->fs_obj_ids_lock);
 
     char *obj_list = json_dumps (obj_array, JSON_COMPACT);
     evbuffer_add (req->buffer_out, obj_list, strlen (obj_list));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    http_send_reply_compressed (req, EVHTP_RES_OK);
 
     g_free (obj_list);
     json_decref (obj_array);
@@ -1873,98 +3328,103 @@ out:
     return;
 }
 
+/* A block read or written on an I/O thread, see http-io.h. */
+typedef struct BlockIOData {
+    HttpIORequest ioreq;
+    char *store_id;
+    char *block_id;
+    char *username;
+    char *content;
+    int size;
+    int status;
+} BlockIOData;
+
 static void
-get_block_cb (evhtp_request_t *req, void *arg)
+free_block_io_data (BlockIOData *data)
 {
-    const char *repo_id = NULL;
-    char *block_id = NULL;
-    char *store_id = NULL;
-    HttpServer *htp_server = arg;
-    BlockMetadata *blk_meta = NULL;
-    char *username = NULL;
-
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    repo_id = parts[1];
-    block_id = parts[3];
-
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
+    g_free (data->store_id);
+    g_free (data->block_id);
+    g_free (data->username);
+    g_free (data->content);
+    g_free (data);
+}
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "download", FALSE);
-    if (perm_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
-    }
+static void
+read_block_job (void *vdata)
+{
+    BlockIOData *data = vdata;
+    BlockMetadata *blk_meta = NULL;
+    BlockHandle *blk_handle = NULL;
+    int rsize;
 
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+    data->status = EVHTP_RES_SERVERR;
 
     blk_meta = seaf_block_manager_stat_block (seaf->block_mgr,
-                                              store_id, 1, block_id);
-    if (blk_meta == NULL || blk_meta->size <= 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+                                              data->store_id, 1, data->block_id);
+    if (blk_meta == NULL || blk_meta->size <= 0)
         goto out;
-    }
 
-    BlockHandle *blk_handle = NULL;
     blk_handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                               store_id, 1, block_id, BLOCK_READ);
+                                               data->store_id, 1, data->block_id,
+                                               BLOCK_READ);
     if (!blk_handle) {
-        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        seaf_warning ("Failed to open block %.8s:%s.\n", data->store_id, data->block_id);
         goto out;
     }
 
-    void *block_con = g_new0 (char, blk_meta->size);
-    if (!block_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %d bytes memeory.\n", blk_meta->size);
-        goto free_handle;
-    }
-
-    int rsize = seaf_block_manager_read_block (seaf->block_mgr,
-                                               blk_handle, block_con,
-                                               blk_meta->size);
+    data->content = g_new0 (char, blk_meta->size);
+    rsize = seaf_block_manager_read_block (seaf->block_mgr,
+                                           blk_handle, data->content,
+                                           blk_meta->size);
     if (rsize != blk_meta->size) {
-        seaf_warning ("Failed to read block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        seaf_warning ("Failed to read block %.8s:%s.\n", data->store_id, data->block_id);
     } else {
-        evbuffer_add (req->buffer_out, block_con, blk_meta->size);
-        evhtp_send_reply (req, EVHTP_RES_OK);
+        data->size = rsize;
+        data->status = EVHTP_RES_OK;
     }
-    g_free (block_con);
-    send_statistic_msg (store_id, username, "sync-file-download", (guint64)rsize);
 
-free_handle:
     seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
     seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
 
 out:
-    g_free (username);
     g_free (blk_meta);
-    g_free (store_id);
-    g_strfreev (parts);
 }
 
 static void
-put_send_block_cb (evhtp_request_t *req, void *arg)
+read_block_done (void *vdata)
+{
+    BlockIOData *data = vdata;
+    evhtp_request_t *req = data->ioreq.req;
+
+    if (!http_io_request_finish (&data->ioreq))
+        goto out;
+
+    if (data->status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, data->status);
+        goto out;
+    }
+
+    evbuffer_add (req->buffer_out, data->content, data->size);
+    transfer_throttle_send_reply (req, EVHTP_RES_OK, data->username, data->store_id,
+                                  data->size, 1);
+    send_statistic_msg (data->store_id, data->username, "sync-file-download",
+                        (guint64)data->size);
+
+out:
+    free_block_io_data (data);
+}
+
+static void
+get_block_cb (evhtp_request_t *req, void *arg)
 {
     const char *repo_id = NULL;
     char *block_id = NULL;
     char *store_id = NULL;
-    char *username = NULL;
     HttpServer *htp_server = arg;
-    char **parts = NULL;
-    void *blk_con = NULL;
+    char *username = NULL;
+    BlockIOData *data;
 
-    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
     block_id = parts[3];
 
@@ -1975,8 +3435,8 @@ put_send_block_cb (evhtp_request_t *req, void *arg)
     }
 
     int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
+                                        "download", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
         goto out;
     }
@@ -1987,65 +3447,136 @@ put_send_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int blk_len = evbuffer_get_length (req->buffer_in);
-    if (blk_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
-    }
+    data = g_new0 (BlockIOData, 1);
+    data->store_id = store_id;
+    data->block_id = g_strdup (block_id);
+    data->username = username;
+    store_id = NULL;
+    username = NULL;
+    http_io_run_request (&data->ioreq, req, read_block_job, read_block_done, data);
 
-    blk_con = g_new0 (char, blk_len);
-    if (!blk_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %d bytes memory.\n", blk_len);
-        goto out;
-    }
-
-    evbuffer_remove (req->buffer_in, blk_con, blk_len);
+out:
+    g_free (username);
+    g_free (store_id);
+    g_strfreev (parts);
+}
 
+static void
+write_block_job (void *vdata)
+{
+    BlockIOData *data = vdata;
     BlockHandle *blk_handle = NULL;
+
+    data->status = EVHTP_RES_SERVERR;
+
     blk_handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                store_id, 1, block_id, BLOCK_WRITE);
+                                                data->store_id, 1, data->block_id,
+                                                BLOCK_WRITE);
     if (blk_handle == NULL) {
-        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+        seaf_warning ("Failed to open block %.8s:%s.\n", data->store_id, data->block_id);
+        return;
     }
 
     if (seaf_block_manager_write_block (seaf->block_mgr, blk_handle,
-                                        blk_con, blk_len) != blk_len) {
-        seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+                                        data->content, data->size) != data->size) {
+        seaf_warning ("Failed to write block %.8s:%s.\n", data->store_id, data->block_id);
         seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return;
     }
 
     if (seaf_block_manager_close_block (seaf->block_mgr, blk_handle) < 0) {
-        seaf_warning ("Failed to close block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        seaf_warning ("Failed to close block %.8s:%s.\n", data->store_id, data->block_id);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return;
     }
 
     if (seaf_block_manager_commit_block (seaf->block_mgr,
                                          blk_handle) < 0) {
-        seaf_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        seaf_warning ("Failed to commit block %.8s:%s.\n", data->store_id, data->block_id);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return;
     }
 
     seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    data->status = EVHTP_RES_OK;
+}
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+static void
+write_block_done (void *vdata)
+{
+    BlockIOData *data = vdata;
+
+    if (!http_io_request_finish (&data->ioreq))
+        goto out;
+
+    evhtp_send_reply (data->ioreq.req, data->status);
 
-    send_statistic_msg (store_id, username, "sync-file-upload", (guint64)blk_len);
+    if (data->status == EVHTP_RES_OK)
+        send_statistic_msg (data->store_id, data->username, "sync-file-upload",
+                            (guint64)data->size);
+
+out:
+    free_block_io_data (data);
+}
+
+static void
+put_send_block_cb (evhtp_request_t *req, void *arg)
+{
+    const char *repo_id = NULL;
+    char *block_id = NULL;
+    char *store_id = NULL;
+    char *username = NULL;
+    HttpServer *htp_server = arg;
+    char **parts = NULL;
+    BlockIOData *data;
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+    block_id = parts[3];
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    int blk_len = evbuffer_get_length (req->buffer_in);
+    if (blk_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    data = g_new0 (BlockIOData, 1);
+    data->store_id = store_id;
+    data->block_id = g_strdup (block_id);
+    data->username = username;
+    data->content = g_new0 (char, blk_len);
+    data->size = blk_len;
+    store_id = NULL;
+    username = NULL;
+
+    evbuffer_remove (req->buffer_in, data->content, blk_len);
+
+    http_io_run_request (&data->ioreq, req, write_block_job, write_block_done, data);
 
 out:
     g_free (username);
     g_free (store_id);
     g_strfreev (parts);
-    g_free (blk_con);
 }
 
 static void
@@ -2060,6 +3591,88 @@ block_oper_cb (evhtp_request_t *req, void *arg)
     }
 }
 
+/* The ids of a check-fs or check-blocks request, checked on an I/O thread. */
+typedef struct CheckExistData {
+    HttpIORequest ioreq;
+    CheckExistType type;
+    char *store_id;
+    json_t *obj_array;
+    char *needed;
+} CheckExistData;
+
+static void
+check_exist_job (void *vdata)
+{
+    CheckExistData *data = vdata;
+    json_t *obj = NULL;
+    const char *obj_id = NULL;
+    int index = 0;
+
+    int array_size = json_array_size (data->obj_array);
+    json_t *needed_objs = json_array();
+
+    /* Collect the valid ids and check them in one batch. */
+    json_t **objs = g_new (json_t *, array_size);
+    const char **obj_ids = g_new (const char *, array_size);
+    gboolean *exists = g_new (gboolean, array_size);
+    int n_ids = 0;
+
+    for (; index < array_size; ++index) {
+        obj = json_array_get (data->obj_array, index);
+        obj_id = json_string_value (obj);
+        if (!is_object_id_valid (obj_id))
+            continue;
+        objs[n_ids] = obj;
+        obj_ids[n_ids] = obj_id;
+        ++n_ids;
+    }
+
+    if (data->type == CHECK_FS_EXIST) {
+        seaf_fs_manager_objects_exist (seaf->fs_mgr, data->store_id, 1,
+                                       obj_ids, n_ids, exists);
+    } else if (data->type == CHECK_BLOCK_EXIST) {
+        seaf_block_manager_blocks_exist (seaf->block_mgr, data->store_id, 1,
+                                         obj_ids, n_ids, exists);
+    }
+
+    for (index = 0; index < n_ids; ++index) {
+        /* The client won't upload the blocks it's told exist, so they are
+         * reused. See seaf_block_manager_touch_block().
+         */
+        if (exists[index] && data->type == CHECK_BLOCK_EXIST &&
+            seaf_block_manager_touch_block (seaf->block_mgr, data->store_id, 1,
+                                            obj_ids[index]) < 0)
+            exists[index] = FALSE;
+        if (!exists[index]) {
+            json_array_append (needed_objs, objs[index]);
+        }
+    }
+
+    g_free (objs);
+    g_free (obj_ids);
+    g_free (exists);
+
+    data->needed = json_dumps (needed_objs, JSON_COMPACT);
+    json_decref (needed_objs);
+}
+
+static void
+check_exist_done (void *vdata)
+{
+    CheckExistData *data = vdata;
+    evhtp_request_t *req = data->ioreq.req;
+
+    if (http_io_request_finish (&data->ioreq)) {
+        evbuffer_add (req->buffer_out, data->needed, strlen (data->needed));
+        http_send_reply_compressed (req, EVHTP_RES_OK);
+    }
+
+    g_free (data->needed);
+    json_decref (data->obj_array);
+    g_free (data->store_id);
+    g_free (data);
+}
+
 static void
 post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
 {
@@ -2088,6 +3701,12 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
         goto out;
     }
 
+    int body_status = http_decode_request_body (req);
+    if (body_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, body_status);
+        goto out;
+    }
+
     size_t list_len = evbuffer_get_length (req->buffer_in);
     if (list_len == 0) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
@@ -2109,43 +3728,15 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
     if (!obj_array) {
         seaf_warning ("dump obj_id to json failed, error: %s\n", jerror.text);
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return;
-    }
-
-    json_t *obj = NULL;
-    gboolean ret = TRUE;
-    const char *obj_id = NULL;
-    int index = 0;
-
-    int array_size = json_array_size (obj_array);
-    json_t *needed_objs = json_array();
-
-    for (; index < array_size; ++index) {
-        obj = json_array_get (obj_array, index);
-        obj_id = json_string_value (obj);
-        if (!is_object_id_valid (obj_id))
-            continue;
-
-        if (type == CHECK_FS_EXIST) {
-            ret = seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, 1,
-                                                 obj_id);
-        } else if (type == CHECK_BLOCK_EXIST) {
-            ret = seaf_block_manager_block_exists (seaf->block_mgr, store_id, 1,
-                                                   obj_id);
-        }
-
-        if (!ret) {
-            json_array_append (needed_objs, obj);
-        }
+        goto out;
     }
 
-    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
-    evhtp_send_reply (req, EVHTP_RES_OK);
-
-    g_free (ret_array);
-    json_decref (needed_objs);
-    json_decref (obj_array);
+    CheckExistData *data = g_new0 (CheckExistData, 1);
+    data->type = type;
+    data->store_id = store_id;
+    data->obj_array = obj_array;
+    store_id = NULL;
+    http_io_run_request (&data->ioreq, req, check_exist_job, check_exist_done, data);
 
 out:
     g_free (username);
@@ -2210,157 +3801,723 @@ post_recv_fs_cb (evhtp_request_t *req, void *arg)
     void *obj_con = NULL;
     int con_len;
 
-    while (fs_con_len > 0) {
-        if (fs_con_len < sizeof(FsHdr)) {
-            seaf_warning ("Bad fs object content format from %.8s:%s.\n",
-                          repo_id, username);
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
-        }
+    while (fs_con_len > 0) {
+        if (fs_con_len < sizeof(FsHdr)) {
+            seaf_warning ("Bad fs object content format from %.8s:%s.\n",
+                          repo_id, username);
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            break;
+        }
+
+        evbuffer_remove (req->buffer_in, hdr, sizeof(FsHdr));
+        con_len = ntohl (hdr->obj_size);
+        memcpy (obj_id, hdr->obj_id, 40);
+        obj_id[40] = 0;
+
+        if (!is_object_id_valid (obj_id)) {
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            break;
+        }
+
+        obj_con = g_new0 (char, con_len);
+        if (!obj_con) {
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            break;
+        }
+        evbuffer_remove (req->buffer_in, obj_con, con_len);
+
+        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
+                                      store_id, 1, obj_id, obj_con,
+                                      con_len, FALSE) < 0) {
+            seaf_warning ("Failed to write fs object %.8s to disk.\n",
+                          obj_id);
+            g_free (obj_con);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            break;
+        }
+
+        fs_con_len -= (con_len + sizeof(FsHdr));
+        g_free (obj_con);
+    }
+
+    if (fs_con_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_OK);
+    }
+
+out:
+    g_free (store_id);
+    g_free (hdr);
+    g_free (username);
+    g_strfreev (parts);
+}
+
+#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+#define PACK_FS_CHUNK_SIZE (64 * 1024)
+
+/*
+ * pack-fs replies are streamed: objects are read and sent a chunk at a time,
+ * whenever the previous chunk has been written to the socket. If the client
+ * accepts gzip, the whole stream is compressed.
+ */
+typedef struct SendFsData {
+    evhtp_request_t *req;
+    char *store_id;
+    json_t *fs_ids;
+    size_t index;
+    int total_size;
+    z_stream *zstrm;
+    HttpIOStream stream;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendFsData;
+
+static void
+free_send_fs_data (SendFsData *data)
+{
+    http_gzip_stream_free (data->zstrm);
+    json_decref (data->fs_ids);
+    g_free (data->store_id);
+    http_io_stream_clear (&data->stream);
+    g_free (data);
+}
+
+/* Returns 1 when all objects have been packed, -1 on error. */
+static int
+pack_fs_objects (SendFsData *data, struct evbuffer *buf)
+{
+    size_t n = json_array_size (data->fs_ids);
+    const char *obj_id;
+    void *fs_data = NULL;
+    int data_len;
+    int data_len_net;
+
+    while (evbuffer_get_length (buf) < PACK_FS_CHUNK_SIZE) {
+        if (data->index >= n || data->total_size >= MAX_OBJECT_PACK_SIZE)
+            return 1;
+
+        obj_id = json_string_value (json_array_get (data->fs_ids, data->index));
+        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, data->store_id, 1,
+                                     obj_id, &fs_data, &data_len) < 0) {
+            seaf_warning ("Failed to read seafile object %s:%s.\n",
+                          data->store_id, obj_id);
+            return -1;
+        }
+
+        evbuffer_add (buf, obj_id, 40);
+        data_len_net = htonl (data_len);
+        evbuffer_add (buf, &data_len_net, 4);
+        evbuffer_add (buf, fs_data, data_len);
+
+        data->total_size += data_len;
+        g_free (fs_data);
+        ++(data->index);
+    }
+
+    return 0;
+}
+
+static int
+fill_fs_data (void *vdata, struct evbuffer *out)
+{
+    SendFsData *data = vdata;
+    struct evbuffer *buf;
+    int rc;
+
+    if (!data->zstrm)
+        return pack_fs_objects (data, out);
+
+    /* Deflate may hold back its output, the chunk is then packed again. */
+    buf = evbuffer_new ();
+    rc = pack_fs_objects (data, buf);
+    if (rc >= 0 && http_gzip_deflate (data->zstrm, buf, evbuffer_get_length (buf),
+                                      rc == 1 ? Z_FINISH : Z_NO_FLUSH, out) < 0) {
+        seaf_warning ("Failed to compress fs objects.\n");
+        rc = -1;
+    }
+    evbuffer_free (buf);
+
+    return rc;
+}
+
+static void
+fs_data_filled (void *vdata, struct evbuffer *out, int status)
+{
+    SendFsData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    if (status < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_send_fs_data (data);
+        return;
+    }
+
+    if (status == 0) {
+        /* This may call write_fs_data_cb() recursively and free data.
+         * So don't use "data" variable after here.
+         */
+        evhtp_send_reply_chunk (data->req, out);
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    if (evbuffer_get_length (out) > 0)
+        evhtp_send_reply_chunk (data->req, out);
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_send_fs_data (data);
+}
+
+static void
+write_fs_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendFsData *data = ctx;
+
+    http_io_stream_next (&data->stream);
+}
+
+static void
+send_fs_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendFsData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data, once the I/O thread is done with it. */
+    if (!http_io_stream_close (&data->stream))
+        free_send_fs_data (data);
+}
+
+static void
+post_pack_fs_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    const char *repo_id = parts[1];
+    char *store_id = NULL;
+    char *username = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "download", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
+    if (fs_id_list_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    char *fs_id_list = g_new0 (char, fs_id_list_len);
+    if (!fs_id_list) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        seaf_warning ("Failed to allocate %d bytes memory.\n", fs_id_list_len);
+        goto out;
+    }
+
+    json_error_t jerror;
+    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
+    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
+
+    g_free (fs_id_list);
+
+    if (!fs_id_array) {
+        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    json_t *obj = NULL;
+    const char *obj_id = NULL;
+    int index = 0;
+
+    int array_size = json_array_size (fs_id_array);
+
+    for (; index < array_size; ++index) {
+        obj = json_array_get (fs_id_array, index);
+        obj_id = json_string_value (obj);
+
+        if (!is_object_id_valid (obj_id)) {
+            seaf_warning ("Invalid fs id %s.\n", obj_id);
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            json_decref (fs_id_array);
+            goto out;
+        }
+    }
+
+    if (array_size == 0) {
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        json_decref (fs_id_array);
+        goto out;
+    }
+
+    SendFsData *data = g_new0 (SendFsData, 1);
+    data->req = req;
+    data->store_id = store_id;
+    store_id = NULL;
+    data->fs_ids = fs_id_array;
+
+    if (http_accepts_gzip (req)) {
+        /* The stored objects are already compressed, so compress for speed. */
+        data->zstrm = http_gzip_stream_new ();
+        if (data->zstrm) {
+            evhtp_headers_add_header (req->headers_out,
+                                      evhtp_header_new ("Content-Encoding", "gzip",
+                                                        1, 1));
+        }
+    }
+
+    /* We need to overwrite evhtp's callback functions to
+     * write fs objects piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    http_io_stream_init (&data->stream, req, fill_fs_data, fs_data_filled,
+                         (GDestroyNotify)free_send_fs_data, data);
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_fs_data_cb,
+                       send_fs_event_cb,
+                       data);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+
+out:
+    g_free (username);
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+/*
+ * Blocks are transferred in batches framed like fs objects in pack-fs and
+ * recv-fs: the 40 bytes block id, the block size as 4 bytes in network byte
+ * order, then the content. A batch body is at most max_block_batch_size
+ * bytes, except that a single block larger than that is still sent.
+ */
+
+/* Blocks stored as local files are queued with evbuffer_add_file(), so that
+ * they are sent without being read into memory.
+ */
+static int
+add_block_to_pack (evbuf_t *out, const char *store_id, const char *block_id,
+                   gint64 *size)
+{
+    BlockHandle *handle;
+    BlockMetadata *blk_meta = NULL;
+    FsHdr hdr;
+    char *buf;
+    int fd;
+    int ret = 0;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            store_id, 1, block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+        return -1;
+    }
+
+    blk_meta = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!blk_meta || blk_meta->size <= 0) {
+        seaf_warning ("Failed to stat block %.8s:%s.\n", store_id, block_id);
+        ret = -1;
+        goto out;
+    }
+
+    memcpy (hdr.obj_id, block_id, 40);
+    hdr.obj_size = htonl (blk_meta->size);
+
+    fd = seaf_block_manager_dup_block_fd (seaf->block_mgr, handle);
+    if (fd >= 0) {
+        evbuffer_add (out, &hdr, sizeof(hdr));
+        /* The fd is closed by libevent after the data is sent. */
+        if (evbuffer_add_file (out, fd, 0, blk_meta->size) < 0) {
+            seaf_warning ("Failed to queue block %.8s:%s.\n", store_id, block_id);
+            close (fd);
+            ret = -1;
+        }
+        goto out;
+    }
+
+    buf = g_malloc (blk_meta->size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                       buf, blk_meta->size) != blk_meta->size) {
+        seaf_warning ("Failed to read block %.8s:%s.\n", store_id, block_id);
+        g_free (buf);
+        ret = -1;
+        goto out;
+    }
+    evbuffer_add (out, &hdr, sizeof(hdr));
+    evbuffer_add (out, buf, blk_meta->size);
+    g_free (buf);
+
+out:
+    if (ret == 0)
+        *size = blk_meta->size;
+    g_free (blk_meta);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+/* The request is a json array of block ids. Blocks that don't fit in the
+ * batch are left out, and the client asks for them in another request.
+ */
+static void
+post_pack_blocks_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    const char *repo_id = parts[1];
+    char *store_id = NULL;
+    char *username = NULL;
+    char *id_list = NULL;
+    json_t *id_array = NULL;
+    json_error_t jerror;
+    const char *block_id;
+    gint64 size, total_size = 0;
+    int array_size, i, n_blocks = 0;
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "download", FALSE);
+    if (perm_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    int id_list_len = evbuffer_get_length (req->buffer_in);
+    if (id_list_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    id_list = g_new0 (char, id_list_len);
+    evbuffer_remove (req->buffer_in, id_list, id_list_len);
+    id_array = json_loadb (id_list, id_list_len, 0, &jerror);
+    if (!id_array || !json_is_array (id_array)) {
+        seaf_warning ("Failed to load block id list from json: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    array_size = json_array_size (id_array);
+    for (i = 0; i < array_size; ++i) {
+        block_id = json_string_value (json_array_get (id_array, i));
+        if (!is_object_id_valid (block_id)) {
+            seaf_warning ("Invalid block id %s.\n", block_id);
+            evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            goto out;
+        }
+
+        if (add_block_to_pack (req->buffer_out, store_id, block_id, &size) < 0) {
+            evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+            goto out;
+        }
+
+        total_size += sizeof(FsHdr) + size;
+        ++n_blocks;
+        if (total_size >= seaf->http_server->max_block_batch_size)
+            break;
+    }
+
+    transfer_throttle_send_reply (req, EVHTP_RES_OK, username, store_id,
+                                  total_size, n_blocks);
+
+    send_statistic_msg (store_id, username, "sync-file-download", (guint64)total_size);
+
+out:
+    if (id_array)
+        json_decref (id_array);
+    g_free (id_list);
+    g_free (username);
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+/* State of a recv-blocks request. The body is parsed as it arrives and each
+ * block is written piece by piece, so a batch is never held in memory.
+ */
+typedef struct RecvBlocksData {
+    char *store_id;
+    char *username;
+    gint64 received;
+    /* Header of the block being received, and how much of it was read. */
+    FsHdr hdr;
+    size_t hdr_len;
+    char block_id[41];
+    guint32 remaining;
+    BlockHandle *handle;
+    gboolean failed;
+    TransferThrottle throttle;
+} RecvBlocksData;
+
+static void
+abort_recv_block (RecvBlocksData *data)
+{
+    if (!data->handle)
+        return;
+
+    seaf_block_manager_close_block (seaf->block_mgr, data->handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+    data->handle = NULL;
+}
+
+static int
+start_recv_block (RecvBlocksData *data)
+{
+    memcpy (data->block_id, data->hdr.obj_id, 40);
+    data->block_id[40] = 0;
+    data->remaining = ntohl (data->hdr.obj_size);
+    data->hdr_len = 0;
+
+    if (!is_object_id_valid (data->block_id) || data->remaining == 0) {
+        seaf_warning ("Bad block header from %.8s:%s.\n",
+                      data->store_id, data->username);
+        return EVHTP_RES_BADREQ;
+    }
+
+    data->received += sizeof(FsHdr) + data->remaining;
+    if (data->received > seaf->http_server->max_block_batch_size) {
+        seaf_warning ("Block batch from %.8s:%s is too large.\n",
+                      data->store_id, data->username);
+        return EVHTP_RES_DATA_TOO_LONG;
+    }
+
+    data->handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                  data->store_id, 1,
+                                                  data->block_id, BLOCK_WRITE);
+    if (!data->handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        return EVHTP_RES_SERVERR;
+    }
+
+    return EVHTP_RES_OK;
+}
+
+static int
+finish_recv_block (RecvBlocksData *data)
+{
+    BlockHandle *handle = data->handle;
+
+    data->handle = NULL;
+    if (seaf_block_manager_close_block (seaf->block_mgr, handle) < 0) {
+        seaf_warning ("Failed to close block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        return EVHTP_RES_SERVERR;
+    }
+
+    if (seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0) {
+        seaf_warning ("Failed to commit block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        return EVHTP_RES_SERVERR;
+    }
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return EVHTP_RES_OK;
+}
 
-        evbuffer_remove (req->buffer_in, hdr, sizeof(FsHdr));
-        con_len = ntohl (hdr->obj_size);
-        memcpy (obj_id, hdr->obj_id, 40);
-        obj_id[40] = 0;
+static evhtp_res
+recv_blocks_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    RecvBlocksData *data = arg;
+    char content[1024 * 64];
+    size_t n;
+    gint64 len = evbuffer_get_length (buf);
+    int blocks = 0;
+    int status = EVHTP_RES_OK;
+
+    if (data->failed) {
+        evbuffer_drain (buf, evbuffer_get_length (buf));
+        return EVHTP_RES_OK;
+    }
 
-        if (!is_object_id_valid (obj_id)) {
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
-        }
+    while (evbuffer_get_length (buf) > 0) {
+        if (!data->handle) {
+            n = MIN (sizeof(FsHdr) - data->hdr_len, evbuffer_get_length (buf));
+            evbuffer_remove (buf, (char *)&data->hdr + data->hdr_len, n);
+            data->hdr_len += n;
+            if (data->hdr_len < sizeof(FsHdr))
+                break;
 
-        obj_con = g_new0 (char, con_len);
-        if (!obj_con) {
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
+            status = start_recv_block (data);
+            if (status != EVHTP_RES_OK)
+                goto out;
+            ++blocks;
+            continue;
         }
-        evbuffer_remove (req->buffer_in, obj_con, con_len);
 
-        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
-                                      store_id, 1, obj_id, obj_con,
-                                      con_len, FALSE) < 0) {
-            seaf_warning ("Failed to write fs object %.8s to disk.\n",
-                          obj_id);
-            g_free (obj_con);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
+        n = MIN (MIN (sizeof(content), data->remaining), evbuffer_get_length (buf));
+        evbuffer_remove (buf, content, n);
+        if (seaf_block_manager_write_block (seaf->block_mgr, data->handle,
+                                            content, n) != (int)n) {
+            seaf_warning ("Failed to write block %.8s:%s.\n",
+                          data->store_id, data->block_id);
+            status = EVHTP_RES_SERVERR;
+            goto out;
         }
 
-        fs_con_len -= (con_len + sizeof(FsHdr));
-        g_free (obj_con);
-    }
-
-    if (fs_con_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
+        data->remaining -= n;
+        if (data->remaining == 0) {
+            status = finish_recv_block (data);
+            if (status != EVHTP_RES_OK)
+                goto out;
+        }
     }
 
 out:
-    g_free (store_id);
-    g_free (hdr);
-    g_free (username);
-    g_strfreev (parts);
+    if (status != EVHTP_RES_OK) {
+        abort_recv_block (data);
+        evbuffer_drain (buf, evbuffer_get_length (buf));
+        data->failed = TRUE;
+        /* Close the connection after the reply, instead of reading the
+         * rest of the batch.
+         */
+        req->keepalive = 0;
+        evhtp_send_reply (req, status);
+    } else {
+        transfer_throttle_read (&data->throttle, req, data->username,
+                                data->store_id, len, blocks);
+    }
+    return EVHTP_RES_OK;
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+static evhtp_res
+recv_blocks_fini_cb (evhtp_request_t *req, void *arg)
+{
+    RecvBlocksData *data = arg;
 
-static void
-post_pack_fs_cb (evhtp_request_t *req, void *arg)
+    abort_recv_block (data);
+    transfer_throttle_clear (&data->throttle);
+    g_free (data->store_id);
+    g_free (data->username);
+    g_free (data);
+
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+recv_blocks_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     const char *repo_id = parts[1];
     char *store_id = NULL;
     char *username = NULL;
+    const char *content_len;
+    RecvBlocksData *data;
+    int status;
 
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
+    status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (status != EVHTP_RES_OK)
+        goto err;
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "download", FALSE);
-    if (perm_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
+    status = check_permission (htp_server, repo_id, username, "upload", FALSE);
+    if (status != EVHTP_RES_OK) {
+        status = EVHTP_RES_FORBIDDEN;
+        goto err;
     }
+
     store_id = get_repo_store_id (htp_server, repo_id);
     if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
-    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
-    if (fs_id_list_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
-    }
-
-    char *fs_id_list = g_new0 (char, fs_id_list_len);
-    if (!fs_id_list) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_warning ("Failed to allocate %d bytes memory.\n", fs_id_list_len);
-        goto out;
+        status = EVHTP_RES_SERVERR;
+        goto err;
     }
 
-    json_error_t jerror;
-    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
-    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
-
-    g_free (fs_id_list);
-
-    if (!fs_id_array) {
-        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
+    /* The size is also checked as blocks arrive, for chunked requests. */
+    content_len = evhtp_kv_find (hdr, "Content-Length");
+    if (content_len &&
+        strtoll (content_len, NULL, 10) > seaf->http_server->max_block_batch_size) {
+        status = EVHTP_RES_DATA_TOO_LONG;
+        goto err;
     }
 
-    json_t *obj = NULL;
-    const char *obj_id = NULL;
-    int index = 0;
-    void *fs_data = NULL;
-    int data_len;
-    int data_len_net;
-    int total_size = 0;
+    data = g_new0 (RecvBlocksData, 1);
+    data->store_id = store_id;
+    data->username = username;
 
-    int array_size = json_array_size (fs_id_array);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, recv_blocks_read_cb, data);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, recv_blocks_fini_cb, data);
+    req->cbarg = data;
 
-    for (; index < array_size; ++index) {
-        obj = json_array_get (fs_id_array, index);
-        obj_id = json_string_value (obj);
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
 
-        if (!is_object_id_valid (obj_id)) {
-            seaf_warning ("Invalid fs id %s.\n", obj_id);
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            json_decref (fs_id_array);
-            goto out;
-        }
-        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, store_id, 1,
-                                     obj_id, &fs_data, &data_len) < 0) {
-            seaf_warning ("Failed to read seafile object %s:%s.\n", store_id, obj_id);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            json_decref (fs_id_array);
-            goto out;
-        }
+err:
+    req->keepalive = 0;
+    evhtp_send_reply (req, status);
+    g_free (store_id);
+    g_free (username);
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
+}
 
-        evbuffer_add (req->buffer_out, obj_id, 40);
-        data_len_net = htonl (data_len);
-        evbuffer_add (req->buffer_out, &data_len_net, 4);
-        evbuffer_add (req->buffer_out, fs_data, data_len);
+static void
+post_recv_blocks_cb (evhtp_request_t *req, void *arg)
+{
+    RecvBlocksData *data = arg;
 
-        total_size += data_len;
-        g_free (fs_data);
+    /* The reply was already sent if the request failed in a hook. */
+    if (!data || data->failed)
+        return;
 
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
-            break;
+    if (data->handle || data->hdr_len > 0 || data->received == 0) {
+        seaf_warning ("Incomplete block batch from %.8s:%s.\n",
+                      data->store_id, data->username);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
     }
 
     evhtp_send_reply (req, EVHTP_RES_OK);
 
-    json_decref (fs_id_array);
-out:
-    g_free (username);
-    g_free (store_id);
-    g_strfreev (parts);
+    send_statistic_msg (data->store_id, data->username,
+                        "sync-file-upload", (guint64)data->received);
 }
 
 static void
@@ -2371,9 +4528,6 @@ get_block_map_cb (evhtp_request_t *req, void *arg)
     char *store_id = NULL;
     HttpServer *htp_server = arg;
     Seafile *file = NULL;
-    char *block_id;
-    BlockMetadata *blk_meta = NULL;
-    json_t *array = NULL;
     char *data = NULL;
     char *username = NULL;
 
@@ -2406,35 +4560,20 @@ get_block_map_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    array = json_array ();
-
-    int i;
-    for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
-        blk_meta = seaf_block_manager_stat_block (seaf->block_mgr,
-                                                  store_id, 1, block_id);
-        if (blk_meta == NULL) {
-            seaf_warning ("Failed to find block %s/%s\n", store_id, block_id);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            g_free (blk_meta);
-            goto out;
-        }
-        json_array_append_new (array, json_integer(blk_meta->size));
-        g_free (blk_meta);
+    data = seaf_fs_manager_get_block_map (seaf->fs_mgr, store_id, 1, file);
+    if (!data) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
     }
 
-    data = json_dumps (array, JSON_COMPACT);
     evbuffer_add (req->buffer_out, data, strlen (data));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    http_send_reply_compressed (req, EVHTP_RES_OK);
 
 out:
     g_free (username);
     g_free (store_id);
     seafile_unref (file);
-    if (array)
-        json_decref (array);
-    if (data)
-        free (data);
+    g_free (data);
     g_strfreev (parts);
 }
 
@@ -2553,6 +4692,28 @@ group_repos_to_json (json_t *repo_array, GHashTable *group_repos,
     }
 }
 
+/* Check @etag against an If-None-Match header, which may list several. */
+static gboolean
+etag_matches (const char *if_none_match, const char *etag)
+{
+    char **tags = g_strsplit (if_none_match, ",", -1);
+    char **ptr;
+    gboolean ret = FALSE;
+
+    for (ptr = tags; *ptr; ptr++) {
+        char *tag = g_strstrip (*ptr);
+        if (g_str_has_prefix (tag, "W/"))
+            tag += 2;
+        if (g_strcmp0 (tag, etag) == 0 || g_strcmp0 (tag, "*") == 0) {
+            ret = TRUE;
+            break;
+        }
+    }
+
+    g_strfreev (tags);
+    return ret;
+}
+
 static void
 get_accessible_repo_list_cb (evhtp_request_t *req, void *arg)
 {
@@ -2682,45 +4843,93 @@ out:
     }
 
     char *json_str = json_dumps (repo_array, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, json_str, strlen(json_str));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    unsigned char sha1[20];
+    char hex[41];
+    char *etag, *etag_header;
+    const char *if_none_match;
+
+    /* Clients that send back the etag of an unchanged list get a 304.
+     * The etag of the compressed list is weak, as the bytes differ.
+     */
+    calculate_sha1 (sha1, json_str, strlen(json_str));
+    rawdata_to_hex (sha1, hex, 20);
+    etag = g_strdup_printf ("\"%s\"", hex);
+    etag_header = g_strdup_printf ("%s%s",
+                                   http_should_compress (req, strlen(json_str)) ?
+                                   "W/" : "", etag);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("ETag", etag_header, 1, 1));
+
+    if_none_match = evhtp_kv_find (req->headers_in, "If-None-Match");
+    if (if_none_match && etag_matches (if_none_match, etag)) {
+        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
+    } else {
+        evbuffer_add (req->buffer_out, json_str, strlen(json_str));
+        http_send_reply_compressed (req, EVHTP_RES_OK);
+    }
 
+    g_free (etag);
+    g_free (etag_header);
     g_free (json_str);
     json_decref (repo_array);
 }
 
+/* Readiness probe: 503 until startup is complete, 200 after. */
+static void
+health_cb (evhtp_request_t *req, void *arg)
+{
+    if (seafile_session_is_ready (seaf)) {
+        evbuffer_add_printf (req->buffer_out, "{\"status\": \"ready\"}");
+        evhtp_send_reply (req, EVHTP_RES_OK);
+    } else {
+        evbuffer_add_printf (req->buffer_out, "{\"status\": \"starting\"}");
+        evhtp_send_reply (req, EVHTP_RES_SERVUNAVAIL);
+    }
+}
+
 static void
 http_request_init (HttpServerStruct *server)
 {
     HttpServer *priv = server->priv;
-
-    evhtp_set_cb (priv->evhtp,
-                  GET_PROTO_PATH, get_protocol_cb,
-                  NULL);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        OP_PERM_CHECK_REGEX, get_check_permission_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_HEAD_COMMITS_MULTI_REGEX, head_commits_multi_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        COMMIT_OPER_REGEX, commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
-                        priv);
+    evhtp_callback_t *cb;
+
+    http_metrics_set_cb (priv->evhtp,
+                         GET_PROTO_PATH, "protocol-version",
+                         get_protocol_cb, NULL);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    GET_CHECK_QUOTA_REGEX, "quota-check",
+                                    get_check_quota_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    OP_PERM_CHECK_REGEX, "permission-check",
+                                    get_check_permission_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    HEAD_COMMIT_OPER_REGEX, "head-commit",
+                                    head_commit_oper_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    GET_HEAD_COMMITS_MULTI_REGEX, "head-commits-multi",
+                                    head_commits_multi_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               WAIT_HEAD_COMMITS_REGEX, "head-commits-wait",
+                               wait_head_commits_cb, priv);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    COMMIT_OPER_REGEX, "commit",
+                                    commit_oper_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    GET_FS_OBJ_ID_REGEX, "fs-id-list",
+                                    get_fs_obj_id_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
 
     // evhtp_set_regex_cb (priv->evhtp,
     //                     START_FS_OBJ_ID_REGEX, start_fs_obj_id_cb,
@@ -2734,33 +4943,56 @@ http_request_init (HttpServerStruct *server)
     //                     RETRIEVE_FS_OBJ_ID_REGEX, retrieve_fs_obj_id_cb,
     //                     priv);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        BLOCK_OPER_REGEX, block_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_FS_REGEX, post_check_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_BLOCK_REGEX, post_check_block_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_RECV_FS_REGEX, post_recv_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_PACK_FS_REGEX, post_pack_fs_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_BLOCK_MAP_REGEX, get_block_map_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_ACCESSIBLE_REPO_LIST_REGEX, get_accessible_repo_list_cb,
-                        priv);
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    BLOCK_OPER_REGEX, "block",
+                                    block_oper_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_BLOCK);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_CHECK_FS_REGEX, "check-fs",
+                                    post_check_fs_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_CHECK_BLOCK_REGEX, "check-blocks",
+                                    post_check_block_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_RECV_FS_REGEX, "recv-fs",
+                                    post_recv_fs_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_PACK_FS_REGEX, "pack-fs",
+                                    post_pack_fs_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_PACK_BLOCKS_REGEX, "pack-blocks",
+                                    post_pack_blocks_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_BLOCK);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    POST_RECV_BLOCKS_REGEX, "recv-blocks",
+                                    post_recv_blocks_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_BLOCK);
+    http_metrics_set_headers_hook (cb, recv_blocks_headers_cb, priv);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    GET_BLOCK_MAP_REGEX, "block-map",
+                                    get_block_map_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    cb = http_metrics_set_regex_cb (priv->evhtp,
+                                    GET_ACCESSIBLE_REPO_LIST_REGEX, "accessible-repos",
+                                    get_accessible_repo_list_cb, priv);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_SYNC_META);
+
+    if (server->enable_metrics)
+        evhtp_set_cb (priv->evhtp, "/metrics", http_metrics_cb, NULL);
+
+    evhtp_set_cb (priv->evhtp, "/health", health_cb, NULL);
 
     /* Web access file */
     access_file_init (priv->evhtp);
@@ -2838,23 +5070,48 @@ free_vir_repo_info (gpointer data)
     g_free (vinfo);
 }
 
+static void
+log_auth_cache_stats (const char *name, LRUCache *cache)
+{
+    LRUCacheStats stats;
+    int i, n_shards;
+
+    n_shards = lru_cache_get_n_shards (cache);
+    for (i = 0; i < n_shards; ++i) {
+        lru_cache_get_shard_stats (cache, i, &stats);
+        seaf_debug ("%s cache shard %d: %"G_GINT64_FORMAT" items, "
+                    "%"G_GUINT64_FORMAT" hits, %"G_GUINT64_FORMAT" misses, "
+                    "%"G_GUINT64_FORMAT" contentions.\n",
+                    name, i, stats.n_items, stats.hits, stats.misses,
+                    stats.contentions);
+    }
+}
+
 static void
 remove_expire_cache_cb (evutil_socket_t sock, short type, void *data)
 {
     HttpServer *htp_server = data;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_foreach_remove (htp_server->token_cache, is_token_expire, NULL);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    lru_cache_remove_if (htp_server->token_cache, is_token_expire, NULL);
+    log_auth_cache_stats ("token", htp_server->token_cache);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_foreach_remove (htp_server->perm_cache, is_perm_expire, NULL);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    lru_cache_remove_if (htp_server->perm_cache, is_perm_expire, NULL);
+    log_auth_cache_stats ("perm", htp_server->perm_cache);
 
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_lock (&htp_server->vir_repo_info_cache_lock);
     g_hash_table_foreach_remove (htp_server->vir_repo_info_cache,
                                  is_vir_repo_info_expire, NULL);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    seaf_lock_unlock (&htp_server->vir_repo_info_cache_lock);
+
+    seaf_lock_lock (&htp_server->repo_updates_lock);
+    g_hash_table_foreach_remove (htp_server->repo_updates,
+                                 is_repo_update_expire, NULL);
+    seaf_lock_unlock (&htp_server->repo_updates_lock);
+
+    seaf_lock_lock (&htp_server->head_commit_cache_lock);
+    g_hash_table_foreach_remove (htp_server->head_commit_cache,
+                                 is_head_commit_expire, NULL);
+    seaf_lock_unlock (&htp_server->head_commit_cache_lock);
 }
 
 static void *
@@ -2887,6 +5144,15 @@ http_server_run (void *arg)
                                   priv);
     evtimer_add (priv->reap_timer, &tv);
 
+    tv.tv_sec = EVENTS_FLUSH_INTERVAL_SEC;
+    tv.tv_usec = 0;
+    priv->events_timer = event_new (priv->evbase,
+                                    -1,
+                                    EV_PERSIST,
+                                    flush_pending_events_cb,
+                                    priv);
+    evtimer_add (priv->events_timer, &tv);
+
     event_base_loop (priv->evbase, 0);
 
     return NULL;
@@ -2903,26 +5169,42 @@ seaf_http_server_new (struct _SeafileSession *session)
 
     load_http_config (server, session);
 
-    priv->token_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, token_cache_value_free);
-    pthread_mutex_init (&priv->token_cache_lock, NULL);
+    priv->token_cache = lru_cache_new (AUTH_CACHE_SIZE, server->auth_cache_shards,
+                                       token_cache_value_free);
+    lru_cache_set_lock_name (priv->token_cache, "token_cache");
 
-    priv->perm_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, perm_cache_value_free);
-    pthread_mutex_init (&priv->perm_cache_lock, NULL);
+    priv->perm_cache = lru_cache_new (AUTH_CACHE_SIZE, server->auth_cache_shards,
+                                      perm_cache_value_free);
+    lru_cache_set_lock_name (priv->perm_cache, "perm_cache");
 
     priv->vir_repo_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                        g_free, free_vir_repo_info);
-    pthread_mutex_init (&priv->vir_repo_info_cache_lock, NULL);
+    seaf_lock_init (&priv->vir_repo_info_cache_lock, "vir_repo_info_cache");
+
+    priv->cluster_cache = cluster_cache_new (session->config);
+
+    priv->fs_id_lists = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->fs_id_list_lru = g_queue_new ();
+    seaf_lock_init (&priv->fs_id_list_lock, "fs_id_list");
+    pthread_cond_init (&priv->fs_id_list_cond, NULL);
+
+    priv->repo_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    seaf_lock_init (&priv->repo_updates_lock, "repo_updates");
+
+    priv->head_commit_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+    seaf_lock_init (&priv->head_commit_cache_lock, "head_commit_cache");
 
     server->http_temp_dir = g_build_filename (session->seaf_dir, "httptemp", NULL);
+    http_temp_init (session, server->http_temp_dir);
 
     // priv->compute_fs_obj_id_pool = g_thread_pool_new (compute_fs_obj_id, NULL,
     //                                                   FS_ID_LIST_MAX_WORKERS, FALSE, NULL);
 
     // priv->fs_obj_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
     //                                           g_free, free_obj_cal_result);
-    // pthread_mutex_init (&priv->fs_obj_ids_lock, NULL);
+    // seaf_lock_init (&priv->fs_obj_ids_lock, "fs_obj_ids");
 
     server->seaf_session = session;
     server->priv = priv;
@@ -2941,100 +5223,113 @@ get_last_modify_time (const char *path)
     return st.st_mtime;
 }
 
-static gint64
-check_httptemp_dir_recursive (const char *parent_dir, gint64 expired_time)
+int
+seaf_http_server_start (HttpServerStruct *server)
 {
-    char *full_path;
-    const char *dname;
-    gint64 cur_time;
-    gint64 last_modify = -1;
-    GDir *dir = NULL;
-    gint64 file_num = 0;
-
-    dir = g_dir_open (parent_dir, 0, NULL);
-
-    while ((dname = g_dir_read_name(dir)) != NULL) {
-        full_path = g_build_path ("/", parent_dir, dname, NULL);
+   int ret = pthread_create (&server->priv->thread_id, NULL, http_server_run, server);
+   if (ret != 0)
+       return -1;
 
-        if (g_file_test (full_path, G_FILE_TEST_IS_DIR)) {
-            file_num += check_httptemp_dir_recursive (full_path, expired_time);
-        } else {
-            cur_time = time (NULL);
-            last_modify = get_last_modify_time (full_path);
-            if (last_modify == -1) {
-                g_free (full_path);
-                continue;
-            }
-            /*remove blokc cache from local*/
-            if (last_modify + expired_time <= cur_time) {
-                g_unlink (full_path);
-                file_num ++;
-            }
-        }
-        g_free (full_path);
-    }
+   pthread_detach (server->priv->thread_id);
 
-    g_dir_close (dir);
+   if (http_temp_start () < 0)
+       return -1;
 
-    return file_num;
+   return 0;
 }
 
-static int
-scan_httptemp_dir (const char *httptemp_dir, gint64 expired_time)
+/*
+ * After a restart every cache is empty, and the first minutes of traffic
+ * hit the database and storage hard. Warming up loads, for the most
+ * recently updated repos, what sync clients ask for first: the store id,
+ * the head commit, the root dir and the permissions of the owner.
+ */
+
+static gboolean
+collect_repo_id (SeafDBRow *row, void *data)
 {
-    return check_httptemp_dir_recursive (httptemp_dir, expired_time);
+    GList **repo_ids = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+
+    if (repo_id)
+        *repo_ids = g_list_prepend (*repo_ids, g_strdup (repo_id));
+    return TRUE;
 }
 
-static void *
-cleanup_expired_httptemp_file (void *arg)
+static void
+warm_up_repo (HttpServer *htp_server, const char *repo_id)
 {
-    GError *error = NULL;
-    HttpServerStruct *server = arg;
-    SeafileSession *session = server->seaf_session;
-    gint64 ttl = 0;
-    gint64 scan_interval = 0;
-    gint64 file_num = 0;
+    SeafRepo *repo;
+    SeafDir *root;
+    char *store_id, *owner;
+    gint64 gen;
 
-    ttl = fileserver_config_get_int64 (session->config, HTTP_TEMP_FILE_TTL, &error);
-    if (error) {
-        ttl = HTTP_TEMP_FILE_DEFAULT_TTL;
-        g_clear_error (&error);
+    store_id = get_repo_store_id (htp_server, repo_id);
+    g_free (store_id);
+
+    gen = get_head_commit_cache_gen (htp_server);
+    /* Also loads the head commit into the commit cache. */
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return;
+    if (repo->head)
+        cache_head_commit (htp_server, gen, repo_id, repo->head->commit_id);
+
+    root = seaf_fs_manager_get_seafdir (seaf->fs_mgr, repo->store_id,
+                                        repo->version, repo->root_id);
+    seaf_dir_free (root);
+
+    owner = seaf_repo_manager_get_repo_owner (seaf->repo_mgr, repo_id);
+    if (owner) {
+        check_permission (htp_server, repo_id, owner, "download", FALSE);
+        check_permission (htp_server, repo_id, owner, "upload", FALSE);
+        g_free (owner);
     }
 
-    scan_interval = fileserver_config_get_int64 (session->config, HTTP_SCAN_INTERVAL, &error);
-    if (error) {
-        scan_interval = HTTP_TEMP_FILE_SCAN_INTERVAL;
-        g_clear_error (&error);
+    seaf_repo_unref (repo);
+}
+
+static void *
+warm_up_caches (void *vdata)
+{
+    HttpServerStruct *server = vdata;
+    GList *repo_ids = NULL, *ptr;
+    gint64 start = g_get_monotonic_time ();
+    int n = 0;
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT repo_id FROM RepoInfo "
+                                       "ORDER BY update_time DESC LIMIT ?",
+                                       collect_repo_id, &repo_ids,
+                                       1, "int", server->warm_up_repos) < 0) {
+        seaf_warning ("Failed to get recently updated repos to warm up caches.\n");
+        return NULL;
     }
+    repo_ids = g_list_reverse (repo_ids);
 
-    while (TRUE) {
-        sleep (scan_interval);
-        file_num = scan_httptemp_dir (server->http_temp_dir, ttl);
-        if (file_num) {
-            seaf_message ("Clean up %ld http temp files\n", file_num);
-            file_num = 0;
-        }
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        warm_up_repo (server->priv, ptr->data);
+        ++n;
     }
+    g_list_free_full (repo_ids, g_free);
 
+    seaf_message ("Warmed up caches of %d repos in %" G_GINT64_FORMAT " ms.\n",
+                  n, (g_get_monotonic_time () - start) / 1000);
     return NULL;
 }
 
 int
-seaf_http_server_start (HttpServerStruct *server)
+seaf_http_server_warm_up (HttpServerStruct *server)
 {
-   int ret = pthread_create (&server->priv->thread_id, NULL, http_server_run, server);
-   if (ret != 0)
-       return -1;
-
-   pthread_detach (server->priv->thread_id);
+    pthread_t tid;
 
-   pthread_t tid;
-   ret = pthread_create (&tid, NULL, cleanup_expired_httptemp_file, server);
-   if (ret != 0)
-       return -1;
+    if (server->warm_up_repos <= 0)
+        return 0;
 
-   pthread_detach (tid);
-   return 0;
+    if (pthread_create (&tid, NULL, warm_up_caches, server) != 0)
+        return -1;
+    pthread_detach (tid);
+    return 0;
 }
 
 int
@@ -3043,11 +5338,9 @@ seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
 {
     const GList *p;
 
-    pthread_mutex_lock (&htp_server->priv->token_cache_lock);
     for (p = tokens; p; p = p->next) {
         const char *token = (char *)p->data;
-        g_hash_table_remove (htp_server->priv->token_cache, token);
+        lru_cache_remove (htp_server->priv->token_cache, token);
     }
-    pthread_mutex_unlock (&htp_server->priv->token_cache_lock);
     return 0;
 }
@@ -18,10 +18,45 @@ struct _HttpServerStruct {
     char *windows_encoding;
     gint64 fixed_block_size;
     int web_token_expire_time;
+    /* Key signing web access tokens so that any node verifies them,
+     * NULL keeps the tokens in memory. */
+    char *web_token_secret;
     int max_indexing_threads;
     int worker_threads;
     int max_index_processing_threads;
     int cluster_shared_temp_file_mode;
+    gboolean streaming_upload;
+    /* Block aligned chunks of resumable uploads are indexed on arrival. */
+    gboolean index_resumable_chunks;
+    /* Zip downloads are packed while they are sent, not into temp files. */
+    gboolean streaming_zip;
+    /* Files are stored in zip downloads without compression. */
+    gboolean zip_store_only;
+    /* Files read ahead of the one being packed by zip tasks. */
+    int zip_prefetch_files;
+    /* MB of finished zip archives kept for identical downloads. */
+    int zip_cache_size;
+    /* Threads packing zips, tuned up to max_zip_threads if it's larger. */
+    int zip_threads;
+    int max_zip_threads;
+    /* Limit of the body of pack-blocks and recv-blocks requests. */
+    gint64 max_block_batch_size;
+    /* Memory all uploads may buffer at once, 0 for no limit. */
+    gint64 upload_memory_limit;
+    /* Memory budget of the computed fs id list cache, 0 disables it. */
+    gint64 fs_id_list_cache_size;
+    /* Threads diffing sub-directories when computing fs id lists. */
+    int max_diff_threads;
+    /* Seconds a cached head commit is trusted before it's read again. */
+    int head_commit_cache_ttl;
+    /* Shards of the token and permission caches. */
+    int auth_cache_shards;
+    /* Blocks fetched ahead of the one being sent by file downloads. */
+    int download_read_ahead;
+    /* Recently updated repos whose caches are filled at startup, 0 for none. */
+    int warm_up_repos;
+    /* Serve request and pool metrics on /metrics. */
+    gboolean enable_metrics;
 };
 
 typedef struct _HttpServerStruct HttpServerStruct;
@@ -32,6 +67,12 @@ seaf_http_server_new (struct _SeafileSession *session);
 int
 seaf_http_server_start (HttpServerStruct *htp_server);
 
+/* Fills the caches of the most recently updated repos in the background,
+ * while requests are already served.
+ */
+int
+seaf_http_server_warm_up (HttpServerStruct *htp_server);
+
 int
 seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
                                     const GList *tokens);
@@ -39,4 +80,25 @@ seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
 void
 send_statistic_msg (const char *repo_id, char *user, char *operation, guint64 bytes);
 
+/* Wakes up head-commits-wait requests waiting on @repo_id. */
+void
+seaf_http_server_notify_repo_update (HttpServerStruct *htp_server,
+                                     const char *repo_id);
+
+/* Drops cached permission results of @user on @repo_id. NULL matches any. */
+void
+seaf_http_server_invalidate_perms (HttpServerStruct *htp_server,
+                                   const char *repo_id,
+                                   const char *user);
+
+/* Keeps the head commit cache in step with the master branch of @repo_id.
+ * If @old_commit_id is the cached head, it's replaced by @new_commit_id,
+ * otherwise the cached head is dropped.
+ */
+void
+seaf_http_server_update_head_commit (HttpServerStruct *htp_server,
+                                     const char *repo_id,
+                                     const char *old_commit_id,
+                                     const char *new_commit_id);
+
 #endif
@@ -0,0 +1,384 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+#include "seafile-session.h"
+#include "fileserver-config.h"
+#include "http-temp.h"
+
+#define HTTP_TEMP_FILE_SCAN_INTERVAL  3600 /*1h*/
+#define HTTP_TEMP_FILE_DEFAULT_TTL 3600 * 24 * 3 /*3days*/
+#define HTTP_TEMP_FILE_TTL "http_temp_file_ttl"
+#define HTTP_SCAN_INTERVAL "http_temp_scan_interval"
+
+/* Rows of WebUploadTempFiles read by one query. */
+#define DB_SYNC_BATCH 1000
+
+typedef struct TempFile {
+    char *path;
+    gint64 expire_time;
+    /* Its row in WebUploadTempFiles, or 0. */
+    gint64 db_id;
+} TempFile;
+
+typedef struct HttpTemp {
+    SeafileSession *session;
+    char *temp_dir;
+    gint64 ttl;
+    gint64 scan_interval;
+
+    pthread_mutex_t lock;
+    /* Min-heap of TempFile on expire_time. */
+    GPtrArray *heap;
+    /* path -> TempFile, for all files in the heap or being expired. */
+    GHashTable *files;
+    /* Rows of WebUploadTempFiles up to this one are queued. */
+    gint64 last_db_id;
+} HttpTemp;
+
+static HttpTemp *temp;
+
+void
+http_temp_init (SeafileSession *session, const char *temp_dir)
+{
+    GError *error = NULL;
+
+    temp = g_new0 (HttpTemp, 1);
+    temp->session = session;
+    temp->temp_dir = g_strdup (temp_dir);
+    pthread_mutex_init (&temp->lock, NULL);
+    temp->heap = g_ptr_array_new ();
+    temp->files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    temp->ttl = fileserver_config_get_int64 (session->config, HTTP_TEMP_FILE_TTL, &error);
+    if (error) {
+        temp->ttl = HTTP_TEMP_FILE_DEFAULT_TTL;
+        g_clear_error (&error);
+    }
+
+    temp->scan_interval = fileserver_config_get_int64 (session->config, HTTP_SCAN_INTERVAL, &error);
+    if (error) {
+        temp->scan_interval = HTTP_TEMP_FILE_SCAN_INTERVAL;
+        g_clear_error (&error);
+    }
+    if (temp->scan_interval <= 0)
+        temp->scan_interval = HTTP_TEMP_FILE_SCAN_INTERVAL;
+}
+
+#define EXPIRE_TIME(i) (((TempFile *)heap->pdata[i])->expire_time)
+
+static void
+heap_swap (GPtrArray *heap, guint i, guint j)
+{
+    gpointer tmp = heap->pdata[i];
+
+    heap->pdata[i] = heap->pdata[j];
+    heap->pdata[j] = tmp;
+}
+
+static void
+heap_push (GPtrArray *heap, TempFile *file)
+{
+    guint i, parent;
+
+    g_ptr_array_add (heap, file);
+
+    i = heap->len - 1;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (EXPIRE_TIME(parent) <= EXPIRE_TIME(i))
+            break;
+        heap_swap (heap, i, parent);
+        i = parent;
+    }
+}
+
+static TempFile *
+heap_pop (GPtrArray *heap)
+{
+    TempFile *top;
+    guint i = 0, child;
+
+    if (heap->len == 0)
+        return NULL;
+
+    top = heap->pdata[0];
+    heap->pdata[0] = heap->pdata[heap->len - 1];
+    g_ptr_array_remove_index_fast (heap, heap->len - 1);
+
+    while ((child = 2 * i + 1) < heap->len) {
+        if (child + 1 < heap->len && EXPIRE_TIME(child + 1) < EXPIRE_TIME(child))
+            ++child;
+        if (EXPIRE_TIME(i) <= EXPIRE_TIME(child))
+            break;
+        heap_swap (heap, i, child);
+        i = child;
+    }
+
+    return top;
+}
+
+/* Called with the lock held. */
+static void
+queue_file (const char *path, gint64 expire_time, gint64 db_id)
+{
+    TempFile *file;
+
+    file = g_hash_table_lookup (temp->files, path);
+    if (file) {
+        if (!file->db_id)
+            file->db_id = db_id;
+        return;
+    }
+
+    file = g_new0 (TempFile, 1);
+    file->path = g_strdup (path);
+    file->expire_time = expire_time;
+    file->db_id = db_id;
+    g_hash_table_insert (temp->files, file->path, file);
+    heap_push (temp->heap, file);
+}
+
+void
+http_temp_register (const char *path)
+{
+    if (!temp)
+        return;
+
+    pthread_mutex_lock (&temp->lock);
+    queue_file (path, (gint64)time(NULL) + temp->ttl, 0);
+    pthread_mutex_unlock (&temp->lock);
+}
+
+typedef struct SyncData {
+    gint64 expire_time;
+    int n_rows;
+} SyncData;
+
+static gboolean
+queue_db_row (SeafDBRow *row, void *vdata)
+{
+    SyncData *data = vdata;
+    gint64 id = seaf_db_row_get_column_int64 (row, 0);
+    const char *path = seaf_db_row_get_column_text (row, 1);
+
+    ++data->n_rows;
+    if (id > temp->last_db_id)
+        temp->last_db_id = id;
+    if (path)
+        queue_file (path, data->expire_time, id);
+
+    return TRUE;
+}
+
+/*
+ * Queues the rows added to WebUploadTempFiles since the last call, by this
+ * server, the Go fileserver or other nodes sharing the temp dir. They are
+ * given a full ttl from now, the file is checked when that is reached.
+ *
+ * Sqlite may reuse the id of the last row after it's removed, such a file
+ * is only found by the next startup walk. Uploads of this process are
+ * registered directly though.
+ */
+static void
+sync_db_rows ()
+{
+    SeafDB *db = temp->session->db;
+    const char *sql;
+    SyncData data;
+    int ret;
+
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL)
+        sql = "SELECT id, tmp_file_path FROM WebUploadTempFiles "
+            "WHERE id > ? ORDER BY id LIMIT ?";
+    else if (seaf_db_type (db) == SEAF_DB_TYPE_SQLITE)
+        sql = "SELECT rowid, tmp_file_path FROM WebUploadTempFiles "
+            "WHERE rowid > ? ORDER BY rowid LIMIT ?";
+    else
+        return;
+
+    do {
+        data.expire_time = (gint64)time(NULL) + temp->ttl;
+        data.n_rows = 0;
+
+        pthread_mutex_lock (&temp->lock);
+        ret = seaf_db_statement_foreach_row (db, sql, queue_db_row, &data,
+                                             2, "int64", temp->last_db_id,
+                                             "int", DB_SYNC_BATCH);
+        pthread_mutex_unlock (&temp->lock);
+        if (ret < 0) {
+            seaf_warning ("Failed to read upload temp files from db.\n");
+            return;
+        }
+    } while (data.n_rows == DB_SYNC_BATCH);
+}
+
+static void
+delete_db_row (gint64 db_id)
+{
+    SeafDB *db = temp->session->db;
+
+    if (!db_id)
+        return;
+
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL)
+        seaf_db_statement_query (db, "DELETE FROM WebUploadTempFiles WHERE id = ?",
+                                 1, "int64", db_id);
+    else if (seaf_db_type (db) == SEAF_DB_TYPE_SQLITE)
+        seaf_db_statement_query (db, "DELETE FROM WebUploadTempFiles WHERE rowid = ?",
+                                 1, "int64", db_id);
+}
+
+static void
+forget_file (TempFile *file)
+{
+    pthread_mutex_lock (&temp->lock);
+    g_hash_table_remove (temp->files, file->path);
+    pthread_mutex_unlock (&temp->lock);
+
+    g_free (file->path);
+    g_free (file);
+}
+
+/*
+ * Removes the queued files expired by now. Files written to since they
+ * were queued go back to the heap, with their new expiry time.
+ */
+static int
+expire_files ()
+{
+    TempFile *file;
+    SeafStat st;
+    gint64 now = (gint64)time(NULL);
+    int n_removed = 0;
+
+    while (1) {
+        pthread_mutex_lock (&temp->lock);
+        if (temp->heap->len == 0 ||
+            ((TempFile *)temp->heap->pdata[0])->expire_time > now) {
+            pthread_mutex_unlock (&temp->lock);
+            break;
+        }
+        file = heap_pop (temp->heap);
+        pthread_mutex_unlock (&temp->lock);
+
+        if (seaf_stat (file->path, &st) < 0) {
+            /* Finished uploads remove their temp files. */
+            if (errno == ENOENT) {
+                delete_db_row (file->db_id);
+                forget_file (file);
+            } else {
+                seaf_warning ("Failed to stat %s: %s.\n", file->path, strerror(errno));
+                file->expire_time = now + temp->scan_interval;
+                pthread_mutex_lock (&temp->lock);
+                heap_push (temp->heap, file);
+                pthread_mutex_unlock (&temp->lock);
+            }
+            continue;
+        }
+
+        if ((gint64)st.st_mtime + temp->ttl > now) {
+            file->expire_time = (gint64)st.st_mtime + temp->ttl;
+            pthread_mutex_lock (&temp->lock);
+            heap_push (temp->heap, file);
+            pthread_mutex_unlock (&temp->lock);
+            continue;
+        }
+
+        g_unlink (file->path);
+        delete_db_row (file->db_id);
+        forget_file (file);
+        ++n_removed;
+    }
+
+    return n_removed;
+}
+
+/* Removes expired files and queues the others, once at startup. */
+static gint64
+walk_temp_dir (const char *parent_dir, gint64 now)
+{
+    char *full_path;
+    const char *dname;
+    SeafStat st;
+    GDir *dir;
+    gint64 file_num = 0;
+
+    dir = g_dir_open (parent_dir, 0, NULL);
+    if (!dir)
+        return 0;
+
+    while ((dname = g_dir_read_name(dir)) != NULL) {
+        full_path = g_build_path ("/", parent_dir, dname, NULL);
+
+        if (g_file_test (full_path, G_FILE_TEST_IS_DIR)) {
+            file_num += walk_temp_dir (full_path, now);
+        } else if (seaf_stat (full_path, &st) == 0) {
+            if ((gint64)st.st_mtime + temp->ttl <= now) {
+                g_unlink (full_path);
+                file_num++;
+            } else {
+                pthread_mutex_lock (&temp->lock);
+                queue_file (full_path, (gint64)st.st_mtime + temp->ttl, 0);
+                pthread_mutex_unlock (&temp->lock);
+            }
+        }
+        g_free (full_path);
+    }
+
+    g_dir_close (dir);
+
+    return file_num;
+}
+
+static void *
+cleanup_expired_httptemp_file (void *arg)
+{
+    gint64 file_num;
+    gint64 wait;
+
+    /* Rows first, so that the files found by the walk keep their row ids. */
+    sync_db_rows ();
+    file_num = walk_temp_dir (temp->temp_dir, (gint64)time(NULL));
+    if (file_num)
+        seaf_message ("Clean up %"G_GINT64_FORMAT" http temp files\n", file_num);
+
+    while (TRUE) {
+        /* Sleep until the next file expires, and pick new rows at least
+         * every scan interval.
+         */
+        wait = temp->scan_interval;
+        pthread_mutex_lock (&temp->lock);
+        if (temp->heap->len > 0) {
+            gint64 next = ((TempFile *)temp->heap->pdata[0])->expire_time - (gint64)time(NULL);
+            if (next < wait)
+                wait = next;
+        }
+        pthread_mutex_unlock (&temp->lock);
+        if (wait > 0)
+            sleep (wait);
+
+        sync_db_rows ();
+        file_num = expire_files ();
+        if (file_num)
+            seaf_message ("Clean up %"G_GINT64_FORMAT" http temp files\n", file_num);
+    }
+
+    return NULL;
+}
+
+int
+http_temp_start ()
+{
+    pthread_t tid;
+
+    if (pthread_create (&tid, NULL, cleanup_expired_httptemp_file, NULL) != 0)
+        return -1;
+
+    pthread_detach (tid);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef HTTP_TEMP_H
+#define HTTP_TEMP_H
+
+/*
+ * Expiry of the temp files of uploads under http_temp_dir.
+ *
+ * Resumable uploads record their temp files in WebUploadTempFiles, new
+ * rows are picked up every http_temp_scan_interval seconds into a heap
+ * ordered by expiry time, so a cleanup only looks at the files that may
+ * have expired. A file modified since it was queued gets queued again
+ * for http_temp_file_ttl seconds after its last change.
+ *
+ * The whole directory is only walked once at startup, for the files left
+ * behind by earlier runs.
+ */
+
+struct _SeafileSession;
+
+void
+http_temp_init (struct _SeafileSession *session, const char *temp_dir);
+
+int
+http_temp_start ();
+
+/* Queues a temp file created by this process for expiry. */
+void
+http_temp_register (const char *path);
+
+#endif
@@ -10,6 +10,7 @@
 #include <timer.h>
 
 #include "utils.h"
+#include "lock-stats.h"
 #include "log.h"
 
 #include "seafile-session.h"
@@ -18,14 +19,31 @@
 #include "seafile-error.h"
 #include "seafile-crypt.h"
 #include "index-blocks-mgr.h"
+#include "upload-trace.h"
 
 #define TOKEN_LEN 36
 #define PROGRESS_TTL 5 * 3600 // 5 hours
 #define SCAN_PROGRESS_INTERVAL 24 * 3600 // 1 day
 
+/*
+ * Queued tasks are ordered by a virtual queue time. A task is placed as if
+ * it was queued one second later per INDEX_SIZE_DELAY_RATE bytes, up to
+ * INDEX_MAX_SIZE_DELAY seconds, and INDEX_USER_DELAY seconds later per task
+ * of the same user being indexed. So small uploads go ahead of large ones,
+ * but a task queued long enough runs before anything newer.
+ */
+#define INDEX_SIZE_DELAY_RATE (10 * 1024 * 1024)
+#define INDEX_MAX_SIZE_DELAY 600
+#define INDEX_USER_DELAY 30
+/* Indexing speed assumed before any task finished, in bytes per second. */
+#define INDEX_DEFAULT_RATE (50 * 1024 * 1024)
+
 static void
 start_index_task (gpointer data, gpointer user_data);
 
+static void
+run_index_task (gpointer data, gpointer user_data);
+
 static char *
 gen_new_token (GHashTable *token_hash);
 
@@ -35,11 +53,19 @@ scan_progress (void *data);
 struct SeafileCrypt;
 
 typedef struct IndexBlksMgrPriv {
-    pthread_mutex_t progress_lock;
+    SeafLock progress_lock;
     GHashTable *progress_store;
-    GThreadPool *idx_tpool;
     // This timer is used to scan progress and remove invalid progress.
     CcnetTimer *scan_progress_timer;
+
+    SeafLock queue_lock;
+    /* IndexPara of the tasks waiting for a worker. */
+    GList *pending;
+    /* user -> number of tasks being indexed. */
+    GHashTable *user_running;
+    /* Moving average of the indexing speed of one task, bytes per second. */
+    double rate;
+    int max_running;
 } IndexBlksMgrPriv;
 
 typedef struct IndexPara {
@@ -49,9 +75,12 @@ typedef struct IndexPara {
     char *user;
     char *canon_path;
     int replace_existed;
+    gboolean create_parents;
     SeafileCrypt *crypt;
     gboolean ret_json;
     IdxProgress *progress;
+    UploadTrace trace;
+    gint64 queued_at;
 } IndexPara;
 
 static void
@@ -68,27 +97,19 @@ free_progress (IdxProgress *progress)
 IndexBlksMgr *
 index_blocks_mgr_new (SeafileSession *session)
 {
-    GError *error = NULL;
     IndexBlksMgr *mgr = g_new0 (IndexBlksMgr, 1);
     IndexBlksMgrPriv *priv = g_new0 (IndexBlksMgrPriv, 1);
 
-    priv->idx_tpool = g_thread_pool_new (start_index_task,
-                                         priv,
-                                         session->http_server->max_index_processing_threads,
-                                         FALSE, &error);
-    if (!priv->idx_tpool) {
-        if (error) {
-            seaf_warning ("Failed to create index task thread pool: %s.\n", error->message);
-            g_clear_error (&error);
-        } else {
-            seaf_warning ("Failed to create index task thread pool.\n");
-        }
-        g_free (priv);
-        g_free (mgr);
-        return NULL;
-    }
+    seaf_executor_set_max_running (session->executor, SEAF_JOB_INDEX,
+                                   session->http_server->max_index_processing_threads);
 
-    pthread_mutex_init (&priv->progress_lock, NULL);
+    priv->max_running = session->http_server->max_index_processing_threads;
+    priv->rate = INDEX_DEFAULT_RATE;
+    seaf_lock_init (&priv->queue_lock, "index_blocks_queue");
+    priv->user_running = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+
+    seaf_lock_init (&priv->progress_lock, "index_blocks_progress");
     priv->progress_store = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                   (GDestroyNotify)free_progress);
     priv->scan_progress_timer = ccnet_timer_new (scan_progress, priv,
@@ -107,7 +128,7 @@ scan_progress (void *data)
     gpointer key, value;
     IdxProgress *progress;
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
 
     g_hash_table_iter_init (&iter, priv->progress_store);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
@@ -117,7 +138,7 @@ scan_progress (void *data)
         }
     }
 
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
 
     return TRUE;
 }
@@ -150,6 +171,11 @@ start_index_task (gpointer data, gpointer user_data)
     int ret = 0;
     IdxProgress *progress = idx_para->progress;
     SeafileCrypt *crypt = idx_para->crypt;
+    UploadTrace *trace = &idx_para->trace;
+    gint64 index_start = g_get_monotonic_time ();
+
+    upload_trace_add (trace, UPLOAD_STAGE_QUEUE, trace->start);
+    upload_trace_set_current (trace);
 
     gint64 *size;
     for (ptr = idx_para->paths; ptr; ptr = ptr->next) {
@@ -158,7 +184,8 @@ start_index_task (gpointer data, gpointer user_data)
         size = g_new (gint64, 1);
         if (seaf_fs_manager_index_blocks (seaf->fs_mgr,
                     repo->store_id, repo->version,
-                    path, sha1, size, crypt, TRUE, FALSE, &(progress->indexed)) < 0) {
+                    path, sha1, size, crypt, TRUE, FALSE,
+                    &(progress->indexed), &(progress->deduped)) < 0) {
             seaf_warning ("failed to index blocks");
             progress->status = -1;
             goto out;
@@ -170,11 +197,13 @@ start_index_task (gpointer data, gpointer user_data)
     }
     id_list = g_list_reverse (id_list);
     size_list = g_list_reverse (size_list);
+    upload_trace_add (trace, UPLOAD_STAGE_INDEX, index_start);
     ret = post_files_and_gen_commit (idx_para->filenames,
                                      idx_para->repo->id,
                                      idx_para->user,
                                      idx_para->ret_json ? &ret_json : NULL,
                                      idx_para->replace_existed,
+                                     idx_para->create_parents,
                                      idx_para->canon_path,
                                      id_list,
                                      size_list,
@@ -186,6 +215,9 @@ start_index_task (gpointer data, gpointer user_data)
     }
 
 out:
+    upload_trace_set_current (NULL);
+    upload_trace_finish (trace, repo->id, progress->total);
+
     /* remove temp files */
     for (ptr = idx_para->paths; ptr; ptr = ptr->next)
         g_unlink (ptr->data);
@@ -196,6 +228,140 @@ out:
     return;
 }
 
+/* Called with the queue lock held. */
+static gint64
+virtual_queue_time (IndexBlksMgrPriv *priv, IndexPara *para)
+{
+    gint64 delay;
+    int running;
+
+    delay = MIN (para->progress->total / INDEX_SIZE_DELAY_RATE, INDEX_MAX_SIZE_DELAY);
+    running = GPOINTER_TO_INT (g_hash_table_lookup (priv->user_running, para->user));
+    delay += (gint64)running * INDEX_USER_DELAY;
+
+    return para->queued_at + delay;
+}
+
+/* Called with the queue lock held. */
+static IndexPara *
+take_next_task (IndexBlksMgrPriv *priv)
+{
+    GList *ptr, *best = NULL;
+    gint64 t, best_t = 0;
+
+    for (ptr = priv->pending; ptr; ptr = ptr->next) {
+        t = virtual_queue_time (priv, ptr->data);
+        if (!best || t < best_t) {
+            best = ptr;
+            best_t = t;
+        }
+    }
+    if (!best)
+        return NULL;
+
+    priv->pending = g_list_delete_link (priv->pending, best);
+    return best->data;
+}
+
+static void
+user_running_add (IndexBlksMgrPriv *priv, const char *user, int n)
+{
+    int running = GPOINTER_TO_INT (g_hash_table_lookup (priv->user_running, user));
+
+    running += n;
+    if (running > 0)
+        g_hash_table_replace (priv->user_running, g_strdup (user),
+                              GINT_TO_POINTER (running));
+    else
+        g_hash_table_remove (priv->user_running, user);
+}
+
+/*
+ * Each queued task pushes one job to the executor, the job runs whichever
+ * pending task comes first when it gets a worker.
+ */
+static void
+run_index_task (gpointer data, gpointer user_data)
+{
+    IndexBlksMgrPriv *priv = user_data;
+    IndexPara *idx_para;
+    char *user;
+    gint64 total, start, elapsed;
+
+    seaf_lock_lock (&priv->queue_lock);
+    idx_para = take_next_task (priv);
+    if (idx_para) {
+        user_running_add (priv, idx_para->user, 1);
+        idx_para->progress->start_ts = (gint64)time(NULL);
+    }
+    seaf_lock_unlock (&priv->queue_lock);
+    if (!idx_para)
+        return;
+
+    user = g_strdup (idx_para->user);
+    total = idx_para->progress->total;
+    start = g_get_monotonic_time ();
+
+    start_index_task (idx_para, priv);
+
+    elapsed = g_get_monotonic_time () - start;
+    seaf_lock_lock (&priv->queue_lock);
+    user_running_add (priv, user, -1);
+    /* Tiny files mostly measure the commit, not the indexing speed. */
+    if (total >= INDEX_SIZE_DELAY_RATE && elapsed > 0)
+        priv->rate = 0.8 * priv->rate + 0.2 * ((double)total * G_USEC_PER_SEC / elapsed);
+    seaf_lock_unlock (&priv->queue_lock);
+
+    g_free (user);
+}
+
+/* Estimated seconds until the task is done, or -1 if it's finished. */
+static gint64
+estimate_eta (IndexBlksMgrPriv *priv, IdxProgress *progress)
+{
+    GList *ptr;
+    IndexPara *para, *self = NULL;
+    gint64 now = (gint64)time(NULL);
+    gint64 ahead = 0, self_t;
+    double rate;
+
+    if (progress->status != 1)
+        return -1;
+
+    seaf_lock_lock (&priv->queue_lock);
+    rate = priv->rate;
+
+    if (progress->start_ts > 0) {
+        /* Prefer the speed of the task itself once it's measurable. */
+        if (now > progress->start_ts && progress->indexed > 0)
+            rate = (double)progress->indexed / (now - progress->start_ts);
+        seaf_lock_unlock (&priv->queue_lock);
+        return (gint64)((progress->total - progress->indexed) / rate);
+    }
+
+    for (ptr = priv->pending; ptr; ptr = ptr->next) {
+        para = ptr->data;
+        if (para->progress == progress) {
+            self = para;
+            break;
+        }
+    }
+    if (!self) {
+        seaf_lock_unlock (&priv->queue_lock);
+        return 0;
+    }
+    /* The tasks that will run first share the workers. */
+    self_t = virtual_queue_time (priv, self);
+    for (ptr = priv->pending; ptr; ptr = ptr->next) {
+        para = ptr->data;
+        if (para != self && virtual_queue_time (priv, para) <= self_t)
+            ahead += para->progress->total;
+    }
+    seaf_lock_unlock (&priv->queue_lock);
+
+    return (gint64)(ahead / (rate * priv->max_running) + progress->total / rate);
+}
+
 char *
 index_blocks_mgr_query_progress (IndexBlksMgr *mgr,
                                  const char *token,
@@ -206,9 +372,9 @@ index_blocks_mgr_query_progress (IndexBlksMgr *mgr,
     IdxProgress *progress;
     IndexBlksMgrPriv *priv = mgr->priv;
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
     progress = g_hash_table_lookup (priv->progress_store, token);
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
 
     if (!progress) {
         seaf_warning ("Index progress not found for token %s\n", token);
@@ -220,16 +386,23 @@ index_blocks_mgr_query_progress (IndexBlksMgr *mgr,
     obj = json_object ();
     json_object_set_int_member (obj, "indexed", progress->indexed);
     json_object_set_int_member (obj, "total", progress->total);
+    json_object_set_int_member (obj, "deduped", progress->deduped);
+    json_object_set_new (obj, "dedup_ratio",
+                         json_real (progress->indexed > 0 ?
+                                    (double)progress->deduped / progress->indexed : 0));
     json_object_set_int_member (obj, "status", progress->status);
     json_object_set_string_member (obj, "ret_json", progress->ret_json);
+    json_object_set_new (obj, "queued",
+                         json_boolean (progress->status == 1 && progress->start_ts == 0));
+    json_object_set_int_member (obj, "eta", estimate_eta (priv, progress));
     ret_info = json_dumps (obj, JSON_COMPACT);
     json_decref (obj);
 
     /* index finished */
     if (progress->status != 1) {
-        pthread_mutex_lock (&priv->progress_lock);
+        seaf_lock_lock (&priv->progress_lock);
         g_hash_table_remove (priv->progress_store, token);
-        pthread_mutex_unlock (&priv->progress_lock);
+        seaf_lock_unlock (&priv->progress_lock);
     }
 
     return ret_info;
@@ -242,6 +415,7 @@ index_blocks_mgr_start_index (IndexBlksMgr *mgr,
                               const char *repo_id,
                               const char *user,
                               int replace_existed,
+                              gboolean create_parents,
                               gboolean ret_json,
                               const char *canon_path,
                               SeafileCrypt *crypt,
@@ -280,9 +454,11 @@ index_blocks_mgr_start_index (IndexBlksMgr *mgr,
     idx_para->user = g_strdup (user);
     idx_para->canon_path = g_strdup(canon_path);
     idx_para->replace_existed = replace_existed;
+    idx_para->create_parents = create_parents;
     idx_para->ret_json = ret_json;
     idx_para->crypt = _crypt;
     idx_para->progress = progress;
+    upload_trace_start (&idx_para->trace, "index");
 
     progress->status = 1;
     progress->expire_ts = time(NULL) + PROGRESS_TTL;
@@ -302,11 +478,17 @@ index_blocks_mgr_start_index (IndexBlksMgr *mgr,
         progress->total += (gint64)sb.st_size;
     }
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
     g_hash_table_replace (priv->progress_store, g_strdup (token), progress);
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
+
+    seaf_lock_lock (&priv->queue_lock);
+    idx_para->queued_at = (gint64)time(NULL);
+    priv->pending = g_list_append (priv->pending, idx_para);
+    seaf_lock_unlock (&priv->queue_lock);
 
-    g_thread_pool_push (priv->idx_tpool, idx_para, NULL);
+    seaf_executor_push (seaf->executor, SEAF_JOB_INDEX,
+                        run_index_task, NULL, priv);
 
     g_free (token);
     return 0;
@@ -13,9 +13,13 @@ typedef struct IndexBlksMgr {
 typedef struct IdxProgress {
     gint64 indexed;
     gint64 total;
+    /* Bytes of finished files in blocks that were already stored. */
+    gint64 deduped;
     int status; /* 0: finished, -1: error, 1: indexing */
     char *ret_json;
     gint64 expire_ts;
+    /* When the index started, 0 while the task is queued. */
+    gint64 start_ts;
 } IdxProgress;
 
 IndexBlksMgr *
@@ -33,6 +37,7 @@ index_blocks_mgr_start_index (IndexBlksMgr *mgr,
                               const char *repo_id,
                               const char *user,
                               int replace_existed,
+                              gboolean create_parents,
                               gboolean ret_json,
                               const char *canon_path,
                               SeafileCrypt *crypt,
@@ -15,16 +15,72 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <iconv.h>
+#include <pthread.h>
 
 #ifdef WIN32
 #define S_IFLNK    0120000 /* Symbolic link */
 #define S_ISLNK(x) (((x) & S_IFMT) == S_IFLNK)
 #endif
 
+/*
+ * Files are packed one after another, so with many small files on a block
+ * backend of high latency most of the time goes into waiting for blocks.
+ * The next zip_prefetch_files files of a directory are read, and decrypted,
+ * by a thread pool while the current one is packed. The archive is still
+ * written in order. Prefetched files of all tasks take at most
+ * PREFETCH_MAX_BYTES. Only the file objects of files larger than
+ * PREFETCH_MAX_FILE_SIZE are prefetched, their blocks are read when they're
+ * packed.
+ */
+#define PREFETCH_THREADS 16
+#define PREFETCH_MAX_FILE_SIZE ((gint64)4 << 20)
+#define PREFETCH_MAX_BYTES ((gint64)256 << 20)
+
+typedef struct PrefetchFile {
+    SeafDirent *dent;
+    Seafile *file;
+    /* Content of the file, NULL if its blocks weren't prefetched. */
+    char *data;
+    gint64 len;
+    /* Bytes taken from PREFETCH_MAX_BYTES. */
+    gint64 reserved;
+    /* 0 while being read, 1 when read, -1 if reading failed. */
+    int status;
+} PrefetchFile;
+
+typedef struct Prefetch {
+    gint ref_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    char store_id[37];
+    int repo_version;
+    SeafileCrypt *crypt;
+
+    int depth;
+    /* PrefetchFile's in the order of the directory. */
+    GQueue *files;
+    /* The next entry of the directory to prefetch. */
+    GList *next;
+    gboolean cancelled;
+} Prefetch;
+
+typedef struct PrefetchJob {
+    Prefetch *pf;
+    PrefetchFile *pfile;
+    char file_id[41];
+} PrefetchJob;
+
+static GThreadPool *prefetch_pool;
+static pthread_mutex_t prefetch_bytes_lock = PTHREAD_MUTEX_INITIALIZER;
+static gint64 prefetch_bytes;
+
 
 typedef struct {
     struct archive *a;
     SeafileCrypt *crypt;
+    /* Shared by all files of the task, NULL if not encrypted. */
+    SeafileCipher *cipher;
     const char *top_dir_name;
     gboolean is_windows;
     time_t mtime;
@@ -63,13 +119,329 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+static gboolean
+prefetch_reserve_bytes (gint64 bytes)
+{
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&prefetch_bytes_lock);
+    if (prefetch_bytes + bytes <= PREFETCH_MAX_BYTES) {
+        prefetch_bytes += bytes;
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&prefetch_bytes_lock);
+
+    return ret;
+}
+
+static void
+prefetch_release_bytes (gint64 bytes)
+{
+    pthread_mutex_lock (&prefetch_bytes_lock);
+    prefetch_bytes -= bytes;
+    pthread_mutex_unlock (&prefetch_bytes_lock);
+}
+
+static void
+prefetch_file_free (PrefetchFile *pfile)
+{
+    if (!pfile)
+        return;
+
+    if (pfile->file)
+        seafile_unref (pfile->file);
+    g_free (pfile->data);
+    if (pfile->reserved > 0)
+        prefetch_release_bytes (pfile->reserved);
+    g_free (pfile);
+}
+
+static Prefetch *
+prefetch_new (PackDirData *data, GList *entries)
+{
+    Prefetch *pf;
+    int depth = seaf->http_server->zip_prefetch_files;
+
+    if (!prefetch_pool || depth <= 0)
+        return NULL;
+
+    pf = g_new0 (Prefetch, 1);
+    pf->ref_count = 1;
+    pthread_mutex_init (&pf->lock, NULL);
+    pthread_cond_init (&pf->cond, NULL);
+    memcpy (pf->store_id, data->store_id, 36);
+    pf->repo_version = data->repo_version;
+    if (data->crypt)
+        pf->crypt = g_memdup (data->crypt, sizeof(SeafileCrypt));
+    pf->depth = depth;
+    pf->files = g_queue_new ();
+    pf->next = entries;
+
+    return pf;
+}
+
+static void
+prefetch_unref (Prefetch *pf)
+{
+    PrefetchFile *pfile;
+
+    if (!g_atomic_int_dec_and_test (&pf->ref_count))
+        return;
+
+    while ((pfile = g_queue_pop_head (pf->files)) != NULL)
+        prefetch_file_free (pfile);
+    g_queue_free (pf->files);
+
+    g_free (pf->crypt);
+    pthread_mutex_destroy (&pf->lock);
+    pthread_cond_destroy (&pf->cond);
+    g_free (pf);
+}
+
+/* Reads the whole content of @file, decrypted, into @buf of @size bytes. */
+static int
+prefetch_read_file (Prefetch *pf, Seafile *file, char *buf, gint64 size)
+{
+    BlockHandle *handle;
+    BlockMetadata *bmd;
+    char *blk = NULL;
+    char *dec_out;
+    int dec_out_len;
+    int blk_size, n, off;
+    gint64 total = 0;
+    int i;
+
+    for (i = 0; i < file->n_blocks; i++) {
+        handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                pf->store_id, pf->repo_version,
+                                                file->blk_sha1s[i], BLOCK_READ);
+        if (!handle) {
+            seaf_warning ("Failed to open block %s:%s\n", pf->store_id,
+                          file->blk_sha1s[i]);
+            return -1;
+        }
+
+        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+        if (!bmd) {
+            seaf_block_manager_close_block (seaf->block_mgr, handle);
+            seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+            return -1;
+        }
+        blk_size = bmd->size;
+        g_free (bmd);
+
+        blk = g_malloc (blk_size > 0 ? blk_size : 1);
+        for (off = 0; off < blk_size; off += n) {
+            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                               blk + off, blk_size - off);
+            if (n <= 0)
+                break;
+        }
+        seaf_block_manager_close_block (seaf->block_mgr, handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        if (off < blk_size) {
+            seaf_warning ("Failed to read block %s:%s\n", pf->store_id,
+                          file->blk_sha1s[i]);
+            goto error;
+        }
+
+        if (pf->crypt && blk_size > 0) {
+            dec_out = NULL;
+            dec_out_len = -1;
+            if (seafile_decrypt (&dec_out, &dec_out_len, blk, blk_size,
+                                 pf->crypt) < 0) {
+                seaf_warning ("Decrypt block %s:%s failed.\n", pf->store_id,
+                              file->blk_sha1s[i]);
+                goto error;
+            }
+            g_free (blk);
+            blk = dec_out;
+            blk_size = dec_out_len;
+        }
+
+        if (total + blk_size > size) {
+            seaf_warning ("Blocks of file %s:%s are larger than the file.\n",
+                          pf->store_id, file->file_id);
+            goto error;
+        }
+        memcpy (buf + total, blk, blk_size);
+        total += blk_size;
+        g_free (blk);
+        blk = NULL;
+    }
+
+    if (total != size) {
+        seaf_warning ("Blocks of file %s:%s are smaller than the file.\n",
+                      pf->store_id, file->file_id);
+        return -1;
+    }
+
+    return 0;
+
+error:
+    g_free (blk);
+    return -1;
+}
+
+static void
+prefetch_file (gpointer job_data, gpointer user_data)
+{
+    PrefetchJob *job = job_data;
+    Prefetch *pf = job->pf;
+    PrefetchFile *pfile = job->pfile;
+    Seafile *file = NULL;
+    char *buf = NULL;
+    gint64 reserved = 0;
+    int status = -1;
+    gboolean cancelled;
+
+    pthread_mutex_lock (&pf->lock);
+    cancelled = pf->cancelled;
+    pthread_mutex_unlock (&pf->lock);
+
+    if (cancelled)
+        goto out;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        pf->store_id, pf->repo_version,
+                                        job->file_id);
+    if (!file)
+        goto out;
+    status = 1;
+
+    if (file->file_size <= PREFETCH_MAX_FILE_SIZE &&
+        prefetch_reserve_bytes (file->file_size)) {
+        reserved = file->file_size;
+        buf = g_malloc (reserved > 0 ? reserved : 1);
+        if (prefetch_read_file (pf, file, buf, reserved) < 0) {
+            /* Leave the blocks, and the error, to the writer. */
+            g_free (buf);
+            buf = NULL;
+            prefetch_release_bytes (reserved);
+            reserved = 0;
+        }
+    }
+
+out:
+    pthread_mutex_lock (&pf->lock);
+    pfile->file = file;
+    pfile->data = buf;
+    pfile->len = reserved;
+    pfile->reserved = reserved;
+    pfile->status = status;
+    pthread_cond_broadcast (&pf->cond);
+    pthread_mutex_unlock (&pf->lock);
+
+    prefetch_unref (pf);
+    g_free (job);
+}
+
+/* Starts prefetching the next files of the directory, up to the depth. */
+static void
+prefetch_schedule (Prefetch *pf)
+{
+    SeafDirent *dent;
+    PrefetchFile *pfile;
+    PrefetchJob *job;
+
+    if (!pf)
+        return;
+
+    pthread_mutex_lock (&pf->lock);
+
+    while ((int)g_queue_get_length (pf->files) < pf->depth && pf->next) {
+        dent = pf->next->data;
+        pf->next = pf->next->next;
+        if (!S_ISREG(dent->mode))
+            continue;
+
+        pfile = g_new0 (PrefetchFile, 1);
+        pfile->dent = dent;
+        g_queue_push_tail (pf->files, pfile);
+
+        job = g_new0 (PrefetchJob, 1);
+        g_atomic_int_inc (&pf->ref_count);
+        job->pf = pf;
+        job->pfile = pfile;
+        memcpy (job->file_id, dent->id, 40);
+        g_thread_pool_push (prefetch_pool, job, NULL);
+    }
+
+    pthread_mutex_unlock (&pf->lock);
+}
+
+/* Returns @dent once it's prefetched, or NULL if it isn't. */
+static PrefetchFile *
+prefetch_take (Prefetch *pf, SeafDirent *dent)
+{
+    PrefetchFile *pfile;
+
+    if (!pf)
+        return NULL;
+
+    pthread_mutex_lock (&pf->lock);
+
+    pfile = g_queue_peek_head (pf->files);
+    if (!pfile || pfile->dent != dent) {
+        pthread_mutex_unlock (&pf->lock);
+        return NULL;
+    }
+
+    while (pfile->status == 0)
+        pthread_cond_wait (&pf->cond, &pf->lock);
+    g_queue_pop_head (pf->files);
+
+    pthread_mutex_unlock (&pf->lock);
+
+    if (pfile->status < 0) {
+        prefetch_file_free (pfile);
+        return NULL;
+    }
+
+    return pfile;
+}
+
+static void
+prefetch_cancel (Prefetch *pf)
+{
+    if (!pf)
+        return;
+
+    pthread_mutex_lock (&pf->lock);
+    pf->cancelled = TRUE;
+    pthread_mutex_unlock (&pf->lock);
+
+    prefetch_unref (pf);
+}
+
+int
+pack_dir_init ()
+{
+    GError *error = NULL;
+
+    prefetch_pool = g_thread_pool_new (prefetch_file, NULL,
+                                       PREFETCH_THREADS, FALSE, &error);
+    if (!prefetch_pool) {
+        if (error) {
+            seaf_warning ("Failed to create zip prefetch thread pool: %s.\n",
+                          error->message);
+            g_clear_error (&error);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 add_file_to_archive (PackDirData *data,
                      const char *parent_dir,
-                     SeafDirent *dent)
+                     SeafDirent *dent,
+                     PrefetchFile *pfile)
 {
     struct archive *a = data->a;
     struct SeafileCrypt *crypt = data->crypt;
+    SeafileCipher *cipher = data->cipher;
     gboolean is_windows = data->is_windows;
     const char *top_dir_name = data->top_dir_name;
     
@@ -77,6 +449,8 @@ add_file_to_archive (PackDirData *data,
     Seafile *file = NULL;
     char *pathname = NULL;
     char buf[64 * 1024];
+    /* Decrypted data is at most one cipher block longer than the input. */
+    char dec_out[sizeof(buf) + BLK_SIZE];
     int len = 0;
     int n = 0;
     int idx = 0;
@@ -84,17 +458,19 @@ add_file_to_archive (PackDirData *data,
     BlockMetadata *bmd = NULL;
     char *blk_id = NULL;
     uint32_t remain = 0;
-    EVP_CIPHER_CTX *ctx;
-    gboolean enc_init = FALSE;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
+    int dec_out_len = -1, final_len = 0;
     int ret = 0;
 
     pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
 
-    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                        data->store_id, data->repo_version,
-                                        dent->id);
+    if (pfile) {
+        file = pfile->file;
+        pfile->file = NULL;
+    } else {
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                            data->store_id, data->repo_version,
+                                            dent->id);
+    }
     if (!file) {
         ret = -1;
         goto out;
@@ -132,6 +508,22 @@ add_file_to_archive (PackDirData *data,
         goto out;
     }
 
+    if (pfile && pfile->data) {
+        gint64 off = 0;
+
+        while (off < pfile->len) {
+            len = archive_write_data (a, pfile->data + off,
+                                      MIN (pfile->len - off, sizeof(buf)));
+            if (len <= 0) {
+                seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
+                ret = -1;
+                goto out;
+            }
+            off += len;
+        }
+        goto out;
+    }
+
     /* Read data of this entry block by block */
     while (idx < file->n_blocks) {
         blk_id = file->blk_sha1s[idx];
@@ -155,14 +547,10 @@ add_file_to_archive (PackDirData *data,
         remain = bmd->size;
         g_free (bmd);
 
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt->version,
-                                      crypt->key, crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                ret = -1;
-                goto out;
-            }
-            enc_init = TRUE;
+        if (crypt && seafile_cipher_reset (cipher) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            ret = -1;
+            goto out;
         }
 
         while (remain != 0) {
@@ -187,59 +575,33 @@ add_file_to_archive (PackDirData *data,
 
             } else {
                 /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
+                if (seafile_cipher_update (cipher, dec_out, &dec_out_len,
+                                           buf, n) < 0) {
+                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
                     ret = -1;
                     goto out;
                 }
 
-                int r = EVP_DecryptUpdate (ctx,
-                                           (unsigned char *)dec_out,
-                                           &dec_out_len,
-                                           (unsigned char *)buf,
-                                           n);
-
-                /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
-                if (r != 1) {
+                /* If it's the last piece of a block, call decrypt_final()
+                 * to decrypt the possible partial block. */
+                final_len = 0;
+                if (remain == 0 &&
+                    seafile_cipher_final (cipher, dec_out + dec_out_len,
+                                          &final_len) < 0) {
                     seaf_warning ("Decrypt block %s failed.\n", blk_id);
                     ret = -1;
                     goto out;
                 }
 
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
+                if (dec_out_len + final_len > 0) {
+                    len = archive_write_data (a, dec_out,
+                                              dec_out_len + final_len);
                     if (len <= 0) {
                         seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
                         ret = -1;
                         goto out;
                     }
                 }
-
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = EVP_DecryptFinal_ex (ctx,
-                                             (unsigned char *)dec_out,
-                                             &dec_out_len);
-                    if (r != 1) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                            ret = -1;
-                            goto out;
-                        }
-                    }
-                }
-
-                g_free (dec_out);
-                dec_out = NULL;
             }
         }
 
@@ -261,9 +623,6 @@ out:
         seaf_block_manager_close_block (seaf->block_mgr, handle);
         seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
     }
-    if (crypt != NULL && enc_init)
-        EVP_CIPHER_CTX_free (ctx);
-    g_free (dec_out);
 
     return ret;
 }
@@ -278,6 +637,8 @@ archive_dir (PackDirData *data,
     SeafDirent *dent;
     GList *ptr;
     char *subpath = NULL;
+    Prefetch *pf = NULL;
+    PrefetchFile *pfile;
     int ret = 0;
 
     dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
@@ -323,15 +684,21 @@ archive_dir (PackDirData *data,
         goto out;
     }
 
+    pf = prefetch_new (data, dir->entries);
+
     for (ptr = dir->entries; ptr; ptr = ptr->next) {
         if (progress->canceled) {
             ret = -1;
             goto out;
         }
 
+        prefetch_schedule (pf);
+
         dent = ptr->data;
         if (S_ISREG(dent->mode)) {
-            ret = add_file_to_archive (data, dirpath, dent);
+            pfile = prefetch_take (pf, dent);
+            ret = add_file_to_archive (data, dirpath, dent, pfile);
+            prefetch_file_free (pfile);
             if (ret == 0) {
                 g_atomic_int_inc (&progress->zipped);
             }
@@ -339,7 +706,7 @@ archive_dir (PackDirData *data,
             if (archive_version_number() >= 3000001) {
                 /* Symlink in zip arhive is not supported in earlier version
                  * of libarchive */
-                ret = add_file_to_archive (data, dirpath, dent);
+                ret = add_file_to_archive (data, dirpath, dent, NULL);
             }
 
         } else if (S_ISDIR(dent->mode)) {
@@ -354,6 +721,7 @@ archive_dir (PackDirData *data,
     }
 
 out:
+    prefetch_cancel (pf);
     if (dir)
         seaf_dir_free (dir);
 
@@ -365,29 +733,47 @@ pack_dir_data_new (const char *store_id,
                    int repo_version,
                    const char *dirname,
                    SeafileCrypt *crypt,
-                   gboolean is_windows)
+                   gboolean is_windows,
+                   int fd)
 {
     struct archive *a = NULL;
     char *tmpfile_name = NULL ;
-    int fd = -1;
     PackDirData *data = NULL;
 
-    tmpfile_name = g_strdup_printf ("%s/seafile-XXXXXX.zip",
-                                    seaf->http_server->http_temp_dir);
-    fd = g_mkstemp (tmpfile_name);
     if (fd < 0) {
-        seaf_warning ("Failed to open temp file: %s.\n", strerror (errno));
-        g_free (tmpfile_name);
-        return NULL;
+        tmpfile_name = g_strdup_printf ("%s/seafile-XXXXXX.zip",
+                                        seaf->http_server->http_temp_dir);
+        fd = g_mkstemp (tmpfile_name);
+        if (fd < 0) {
+            seaf_warning ("Failed to open temp file: %s.\n", strerror (errno));
+            g_free (tmpfile_name);
+            return NULL;
+        }
     }
 
     a = archive_write_new ();
     archive_write_add_filter_none (a);
     archive_write_set_format_zip (a);
+    if (seaf->http_server->zip_store_only &&
+        archive_write_set_format_option (a, "zip", "compression", "store") != ARCHIVE_OK)
+        seaf_warning ("Failed to disable zip compression: %s\n",
+                      archive_error_string (a));
     archive_write_open_fd (a, fd);
 
     data = g_new0 (PackDirData, 1);
     data->crypt = crypt;
+    if (crypt) {
+        data->cipher = seafile_cipher_new (crypt, FALSE);
+        if (!data->cipher) {
+            archive_write_free (a);
+            close (fd);
+            if (tmpfile_name)
+                g_unlink (tmpfile_name);
+            g_free (tmpfile_name);
+            g_free (data);
+            return NULL;
+        }
+    }
     data->is_windows = is_windows;
     data->a = a;
     data->top_dir_name = dirname;
@@ -406,26 +792,42 @@ archive_multi (PackDirData *data, GList *dirent_list,
 {
     GList *iter;
     SeafDirent *dirent;
+    Prefetch *pf;
+    PrefetchFile *pfile;
+    int ret = 0;
+
+    pf = prefetch_new (data, dirent_list);
 
     for (iter = dirent_list; iter; iter = iter->next) {
-        if (progress->canceled)
-            return -1;
+        if (progress->canceled) {
+            ret = -1;
+            break;
+        }
+
+        prefetch_schedule (pf);
+
         dirent = iter->data;
         if (S_ISREG(dirent->mode)) {
-            if (add_file_to_archive (data, "", dirent) < 0) {
+            pfile = prefetch_take (pf, dirent);
+            ret = add_file_to_archive (data, "", dirent, pfile);
+            prefetch_file_free (pfile);
+            if (ret < 0) {
                 seaf_warning ("Failed to archive file: %s.\n", dirent->name);
-                return -1;
+                break;
             }
             g_atomic_int_inc (&progress->zipped);
         } else if (S_ISDIR(dirent->mode)) {
-            if (archive_dir (data, dirent->id, dirent->name, progress) < 0) {
+            ret = archive_dir (data, dirent->id, dirent->name, progress);
+            if (ret < 0) {
                 seaf_warning ("Failed to archive dir: %s.\n", dirent->name);
-                return -1;
+                break;
             }
         }
     }
 
-    return 0;
+    prefetch_cancel (pf);
+
+    return ret;
 }
 
 int
@@ -435,20 +837,22 @@ pack_files (const char *store_id,
             void *internal,
             SeafileCrypt *crypt,
             gboolean is_windows,
+            int fd,
             Progress *progress)
 {
     int ret = 0;
     PackDirData *data = NULL;
 
     data = pack_dir_data_new (store_id, repo_version, dirname,
-                              crypt, is_windows);
+                              crypt, is_windows, fd);
     if (!data) {
         seaf_warning ("Failed to create pack dir data for %s.\n",
                       strcmp (dirname, "")==0 ? "multi files" : dirname);
         return -1;
     }
 
-    progress->zip_file_path = data->tmp_zip_file;
+    if (data->tmp_zip_file)
+        progress->zip_file_path = data->tmp_zip_file;
 
     if (strcmp (dirname, "") != 0) {
         // Pack dir
@@ -477,6 +881,7 @@ pack_files (const char *store_id,
     }
 
     close (data->tmp_fd);
+    seafile_cipher_free (data->cipher);
     free (data);
 
     return ret;
@@ -13,8 +13,23 @@ typedef struct Progress {
     gboolean canceled;
     gboolean size_too_large;
     gboolean internal_error;
+    /* Set when the zip is packed while it's sent, see streaming_zip. */
+    gboolean streaming;
+    /* The download waiting for its client, until streaming starts. */
+    void *stream_obj;
+    gboolean stream_started;
+    gboolean stream_done;
+    /* The cached archive at zip_file_path, see zip_cache_size. */
+    void *cache_entry;
 } Progress;
 
+/* Starts the threads prefetching files for pack_files(). */
+int
+pack_dir_init ();
+
+/* Packs into @fd if it's not -1, otherwise into a temp file saved in
+ * @progress->zip_file_path. @fd is closed when packing finishes.
+ */
 int
 pack_files (const char *store_id,
             int repo_version,
@@ -22,6 +37,7 @@ pack_files (const char *store_id,
             void *internal,
             SeafileCrypt *crypt,
             gboolean is_windows,
+            int fd,
             Progress *progress);
 
 #endif
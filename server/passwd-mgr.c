@@ -10,6 +10,7 @@
 #include "seafile-crypt.h"
 
 #include "utils.h"
+#include "block-cache.h"
 
 #define REAP_INTERVAL 60
 #define REAP_THRESHOLD 3600
@@ -179,6 +180,8 @@ seaf_passwd_manager_unset_passwd (SeafPasswdManager *mgr,
     g_hash_table_remove (mgr->priv->decrypt_keys, hash_key->str);
     g_string_free (hash_key, TRUE);
 
+    block_cache_purge_repo (repo_id);
+
     return 0;
 }     
 
@@ -274,6 +277,7 @@ reap_expired_passwd (void *vmgr)
     gpointer key, value;
     DecryptKey *crypt_key;
     guint64 now = (guint64)time(NULL);
+    char repo_id[37];
 
     g_hash_table_iter_init (&iter, mgr->priv->decrypt_keys);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
@@ -281,6 +285,10 @@ reap_expired_passwd (void *vmgr)
         if (crypt_key->expire_time <= now) {
             /* g_debug ("[passwd mgr] Remove passwd for %s\n", (char *)key); */
             g_hash_table_iter_remove (&iter);
+            /* The key is "<repo_id>.<user>". */
+            memcpy (repo_id, key, 36);
+            repo_id[36] = 0;
+            block_cache_purge_repo (repo_id);
         }
     }
 
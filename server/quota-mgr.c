@@ -15,6 +15,8 @@
 #define GB 1000000000L
 #define TB 1000000000000L
 
+#define DEFAULT_USAGE_RECONCILE_INTERVAL 3600
+
 static gint64
 get_default_quota (SeafCfgManager *mgr)
 {
@@ -69,6 +71,12 @@ seaf_quota_manager_new (struct _SeafileSession *session)
     mgr->calc_share_usage = g_key_file_get_boolean (session->config,
                                                     "quota", "calc_share_usage",
                                                     NULL);
+    mgr->usage_reconcile_interval = g_key_file_get_integer (session->config,
+                                                            "quota",
+                                                            "usage_reconcile_interval",
+                                                            NULL);
+    if (mgr->usage_reconcile_interval <= 0)
+        mgr->usage_reconcile_interval = DEFAULT_USAGE_RECONCILE_INTERVAL;
 
     return mgr;
 }
@@ -105,6 +113,16 @@ seaf_quota_manager_init (SeafQuotaManager *mgr)
         if (seaf_db_query (db, sql) < 0)
             return -1;
 
+        sql = "CREATE TABLE IF NOT EXISTS UserUsage (\"user\" VARCHAR(255) PRIMARY KEY,"
+            "size BIGINT, update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS OrgUsage (org_id INTEGER PRIMARY KEY,"
+            "size BIGINT, update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
         break;
     case SEAF_DB_TYPE_SQLITE:
         sql = "CREATE TABLE IF NOT EXISTS UserQuota (user VARCHAR(255) PRIMARY KEY,"
@@ -127,6 +145,16 @@ seaf_quota_manager_init (SeafQuotaManager *mgr)
         if (seaf_db_query (db, sql) < 0)
             return -1;
 
+        sql = "CREATE TABLE IF NOT EXISTS UserUsage (user VARCHAR(255) PRIMARY KEY,"
+            "size BIGINT, update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS OrgUsage (org_id INTEGER PRIMARY KEY,"
+            "size BIGINT, update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
         break;
     case SEAF_DB_TYPE_MYSQL:
         sql = "CREATE TABLE IF NOT EXISTS UserQuota (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
@@ -154,6 +182,18 @@ seaf_quota_manager_init (SeafQuotaManager *mgr)
         if (seaf_db_query (db, sql) < 0)
             return -1;
 
+        sql = "CREATE TABLE IF NOT EXISTS UserUsage (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+            "user VARCHAR(255), size BIGINT, update_time BIGINT, "
+            "UNIQUE INDEX(user)) ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS OrgUsage (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+            "org_id INTEGER, size BIGINT, update_time BIGINT, "
+            "UNIQUE INDEX(org_id)) ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
         break;
     }
 
@@ -459,19 +499,110 @@ seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
     return ret;
 }
 
+/*
+ * The usage of users and orgs is cached in the UserUsage and OrgUsage
+ * tables, so that quota checks don't sum the sizes of all repos of a user.
+ * The cached usage is updated with the size changes of repos, in the same
+ * transaction as RepoSize, and recomputed when it's older than
+ * usage_reconcile_interval seconds, to correct drift from ownership
+ * changes. Deleting a row makes the next check recompute it.
+ */
+
+typedef struct CachedUsage {
+    gboolean found;
+    gint64 size;
+    gint64 update_time;
+} CachedUsage;
+
+static gboolean
+get_cached_usage (SeafDBRow *row, void *data)
+{
+    CachedUsage *usage = data;
+
+    usage->found = TRUE;
+    usage->size = seaf_db_row_get_column_int64 (row, 0);
+    usage->update_time = seaf_db_row_get_column_int64 (row, 1);
+
+    return FALSE;
+}
+
+int
+seaf_quota_manager_add_usage_trans (SeafQuotaManager *mgr,
+                                    SeafDBTrans *trans,
+                                    const char *repo_id,
+                                    gint64 delta)
+{
+    if (delta == 0)
+        return 0;
+
+    /* Virtual repos don't count in the usage of their owners. */
+    if (seaf_db_trans_query (trans,
+                             "UPDATE UserUsage SET size = size + ? WHERE user IN "
+                             "(SELECT o.owner_id FROM RepoOwner o LEFT JOIN VirtualRepo v "
+                             "ON o.repo_id = v.repo_id WHERE o.repo_id = ? "
+                             "AND v.repo_id IS NULL)",
+                             2, "int64", delta, "string", repo_id) < 0)
+        return -1;
+
+    if (seaf_db_trans_query (trans,
+                             "UPDATE OrgUsage SET size = size + ? WHERE org_id IN "
+                             "(SELECT org_id FROM OrgRepo WHERE repo_id = ?)",
+                             2, "int64", delta, "string", repo_id) < 0)
+        return -1;
+
+    return 0;
+}
+
+void
+seaf_quota_manager_invalidate_repo_usage (SeafQuotaManager *mgr,
+                                          const char *repo_id)
+{
+    SeafDB *db = mgr->session->db;
+
+    seaf_db_statement_query (db,
+                             "DELETE FROM UserUsage WHERE user IN "
+                             "(SELECT owner_id FROM RepoOwner WHERE repo_id = ?)",
+                             1, "string", repo_id);
+    seaf_db_statement_query (db,
+                             "DELETE FROM OrgUsage WHERE org_id IN "
+                             "(SELECT org_id FROM OrgRepo WHERE repo_id = ?)",
+                             1, "string", repo_id);
+}
+
 gint64
 seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user)
 {
+    SeafDB *db = mgr->session->db;
+    CachedUsage cached = {0};
+    gint64 now = (gint64)time(NULL);
+    gint64 usage;
     char *sql;
 
+    sql = "SELECT size, update_time FROM UserUsage WHERE user=?";
+    if (seaf_db_statement_foreach_row (db, sql, get_cached_usage, &cached,
+                                       1, "string", user) < 0)
+        return -1;
+    if (cached.found && now - cached.update_time < mgr->usage_reconcile_interval)
+        return cached.size;
+
     sql = "SELECT SUM(size) FROM "
         "RepoOwner o LEFT JOIN VirtualRepo v ON o.repo_id=v.repo_id, "
         "RepoSize WHERE "
         "owner_id=? AND o.repo_id=RepoSize.repo_id "
         "AND v.repo_id IS NULL";
 
-    return seaf_db_statement_get_int64 (mgr->session->db, sql,
-                                        1, "string", user);
+    usage = seaf_db_statement_get_int64 (db, sql, 1, "string", user);
+    if (usage < 0)
+        return usage;
+
+    if (seaf_db_statement_query (db,
+                                 "REPLACE INTO UserUsage (user, size, update_time) "
+                                 "VALUES (?, ?, ?)",
+                                 3, "string", user, "int64", usage,
+                                 "int64", now) < 0)
+        seaf_warning ("Failed to cache usage of user %s.\n", user);
+
+    return usage;
 
     /* Add size of repos in trash. */
     /* sql = "SELECT size FROM RepoTrash WHERE owner_id = ?"; */
@@ -532,13 +663,34 @@ seaf_quota_manager_get_user_share_usage (SeafQuotaManager *mgr,
 gint64
 seaf_quota_manager_get_org_usage (SeafQuotaManager *mgr, int org_id)
 {
+    SeafDB *db = mgr->session->db;
+    CachedUsage cached = {0};
+    gint64 now = (gint64)time(NULL);
+    gint64 usage;
     char *sql;
 
+    sql = "SELECT size, update_time FROM OrgUsage WHERE org_id=?";
+    if (seaf_db_statement_foreach_row (db, sql, get_cached_usage, &cached,
+                                       1, "int", org_id) < 0)
+        return -1;
+    if (cached.found && now - cached.update_time < mgr->usage_reconcile_interval)
+        return cached.size;
+
     sql = "SELECT SUM(size) FROM OrgRepo, RepoSize WHERE "
         "org_id=? AND OrgRepo.repo_id=RepoSize.repo_id";
 
-    return seaf_db_statement_get_int64 (mgr->session->db, sql,
-                                        1, "int", org_id);
+    usage = seaf_db_statement_get_int64 (db, sql, 1, "int", org_id);
+    if (usage < 0)
+        return usage;
+
+    if (seaf_db_statement_query (db,
+                                 "REPLACE INTO OrgUsage (org_id, size, update_time) "
+                                 "VALUES (?, ?, ?)",
+                                 3, "int", org_id, "int64", usage,
+                                 "int64", now) < 0)
+        seaf_warning ("Failed to cache usage of org %d.\n", org_id);
+
+    return usage;
 }
 
 gint64
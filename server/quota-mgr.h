@@ -3,12 +3,16 @@
 #ifndef QUOTA_MGR_H
 #define QUOTA_MGR_H
 
+#include "seaf-db.h"
+
 #define INFINITE_QUOTA (gint64)-2
 
 struct _SeafQuotaManager {
     struct _SeafileSession *session;
 
     gboolean calc_share_usage;
+    /* Seconds before a cached usage is recomputed. */
+    int usage_reconcile_interval;
 };
 typedef struct _SeafQuotaManager SeafQuotaManager;
 
@@ -50,6 +54,24 @@ seaf_quota_manager_check_quota_with_delta (SeafQuotaManager *mgr,
 gint64
 seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user);
 
+gint64
+seaf_quota_manager_get_org_usage (SeafQuotaManager *mgr, int org_id);
+
+/* Add the size change of @repo_id to the cached usage of its owner and org. */
+int
+seaf_quota_manager_add_usage_trans (SeafQuotaManager *mgr,
+                                    SeafDBTrans *trans,
+                                    const char *repo_id,
+                                    gint64 delta);
+
+/*
+ * Drop the cached usage of the owner and org of @repo_id. Call it before
+ * the repo changes owner or is deleted.
+ */
+void
+seaf_quota_manager_invalidate_repo_usage (SeafQuotaManager *mgr,
+                                          const char *repo_id);
+
 GList *
 seaf_repo_quota_manager_list_user_quota_usage (SeafQuotaManager *mgr);
 
@@ -0,0 +1,272 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+#include "branch-mgr.h"
+#include "repo-mgr.h"
+#include "seafile-error.h"
+#include "seafile-crypt.h"
+
+#include "seaf-db.h"
+
+/*
+ * A fork is a library whose first commit has no parent and points to the
+ * root of a commit of the source library. Fs objects and blocks are never
+ * copied: the fork uses the store of the source, recorded in ForkedRepo,
+ * and GC marks what all the libraries of a store reach before sweeping it.
+ * So forking takes the same time whatever the size of the source.
+ */
+
+static int
+save_fork_info (SeafRepoManager *mgr,
+                const char *repo_id,
+                const char *origin_repo_id,
+                const char *origin_commit,
+                const char *store_id)
+{
+    return seaf_db_statement_query (mgr->seaf->db,
+                                    "INSERT INTO ForkedRepo (repo_id, origin_repo, "
+                                    "origin_commit, store_id) VALUES (?, ?, ?, ?)",
+                                    4, "string", repo_id, "string", origin_repo_id,
+                                    "string", origin_commit, "string", store_id);
+}
+
+static void
+remove_fork_info (SeafRepoManager *mgr, const char *repo_id)
+{
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM ForkedRepo WHERE repo_id = ?",
+                             1, "string", repo_id);
+}
+
+/*
+ * The head is always kept. Older commits are kept for the history limit
+ * of the repo, and their root must still be there.
+ */
+static gboolean
+commit_in_history (SeafRepoManager *mgr, SeafRepo *repo, SeafCommit *commit)
+{
+    gint64 truncate_time;
+
+    if (strcmp (commit->commit_id, repo->head->commit_id) == 0)
+        return TRUE;
+
+    truncate_time = seaf_repo_manager_get_repo_truncate_time (mgr, repo->id);
+    if (truncate_time == 0 ||
+        (truncate_time > 0 && (gint64)commit->ctime < truncate_time))
+        return FALSE;
+
+    return (strcmp (commit->root_id, EMPTY_SHA1) == 0 ||
+            seaf_fs_manager_object_exists (seaf->fs_mgr, repo->store_id,
+                                           repo->version, commit->root_id));
+}
+
+static int
+do_create_fork (SeafRepoManager *mgr,
+                SeafRepo *src_repo,
+                SeafCommit *src_commit,
+                const char *repo_id,
+                const char *repo_name,
+                const char *owner,
+                const char *passwd,
+                GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *commit = NULL;
+    SeafBranch *master = NULL;
+    char *desc = NULL;
+    int ret = -1;
+
+    repo = seaf_repo_new (repo_id, repo_name, src_repo->desc);
+
+    repo->no_local_history = TRUE;
+    if (src_repo->encrypted) {
+        repo->encrypted = TRUE;
+        repo->enc_version = src_repo->enc_version;
+        if (repo->enc_version >= 3)
+            memcpy (repo->salt, src_repo->salt, 64);
+        seafile_generate_magic (repo->enc_version, repo_id, passwd, repo->salt, repo->magic);
+        memcpy (repo->random_key, src_repo->random_key, 96);
+    }
+
+    repo->version = src_repo->version;
+    memcpy (repo->store_id, src_repo->store_id, 36);
+
+    desc = g_strdup_printf ("Forked from library \"%s\"", src_repo->name);
+    commit = seaf_commit_new (NULL, repo->id,
+                              src_commit->root_id, /* root id */
+                              owner, /* creator */
+                              EMPTY_SHA1, /* creator id */
+                              desc,  /* description */
+                              0);         /* ctime */
+
+    seaf_repo_to_commit (repo, commit);
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        seaf_warning ("Failed to add commit.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to add commit");
+        goto out;
+    }
+
+    master = seaf_branch_new ("master", repo->id, commit->commit_id);
+    if (seaf_branch_manager_add_branch (seaf->branch_mgr, master) < 0) {
+        seaf_warning ("Failed to add branch.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to add branch");
+        goto out;
+    }
+
+    if (seaf_repo_set_head (repo, master) < 0) {
+        seaf_warning ("Failed to set repo head.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to set repo head.");
+        goto out;
+    }
+
+    if (seaf_repo_manager_add_repo (mgr, repo) < 0) {
+        seaf_warning ("Failed to add repo.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to add repo.");
+        goto out;
+    }
+
+    seaf_repo_manager_update_repo_info (mgr, repo->id, repo->head->commit_id);
+
+    ret = 0;
+out:
+    g_free (desc);
+    if (repo)
+        seaf_repo_unref (repo);
+    if (commit)
+        seaf_commit_unref (commit);
+    if (master)
+        seaf_branch_unref (master);
+
+    return ret;
+}
+
+char *
+seaf_repo_manager_fork_repo (SeafRepoManager *mgr,
+                             const char *src_repo_id,
+                             const char *commit_id,
+                             const char *repo_name,
+                             const char *owner,
+                             const char *passwd,
+                             GError **error)
+{
+    SeafRepo *src_repo = NULL;
+    SeafCommit *src_commit = NULL;
+    char *repo_id = NULL;
+
+    src_repo = seaf_repo_manager_get_repo (mgr, src_repo_id);
+    if (!src_repo) {
+        seaf_warning ("Failed to get repo %.10s\n", src_repo_id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Library not exists");
+        return NULL;
+    }
+    if (src_repo->status != REPO_STATUS_NORMAL) {
+        seaf_warning ("Status of repo %.8s is %d, can't fork it.\n",
+                      src_repo_id, src_repo->status);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Unnormal repo status");
+        goto error;
+    }
+
+    if (src_repo->encrypted) {
+        if (src_repo->enc_version < 2) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Library encryption version must be higher than 2");
+            goto error;
+        }
+
+        if (!passwd || passwd[0] == 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Password is not set");
+            goto error;
+        }
+
+        if (seafile_verify_repo_passwd (src_repo_id,
+                                        passwd,
+                                        src_repo->magic,
+                                        src_repo->enc_version,
+                                        src_repo->salt) < 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Incorrect password");
+            goto error;
+        }
+    }
+
+    if (!commit_id)
+        commit_id = src_repo->head->commit_id;
+    src_commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 src_repo->id,
+                                                 src_repo->version,
+                                                 commit_id);
+    if (!src_commit) {
+        seaf_warning ("Failed to get commit %.8s of repo %s.\n",
+                      commit_id, src_repo->id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Commit not exists");
+        goto error;
+    }
+
+    /* Commit objects outlive the history limit, but GC sweeps the fs
+     * objects and blocks of older commits.
+     */
+    if (!commit_in_history (mgr, src_repo, src_commit)) {
+        seaf_warning ("Commit %.8s of repo %.8s is out of its history.\n",
+                      commit_id, src_repo->id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Commit is out of the library history");
+        goto error;
+    }
+
+    repo_id = gen_uuid ();
+
+    /* Save the store of the fork before creating it, so that GC marks its
+     * objects as soon as it exists.
+     */
+    if (save_fork_info (mgr, repo_id, src_repo->id, src_commit->commit_id,
+                        src_repo->store_id) < 0) {
+        seaf_warning ("Failed to save fork info for %.10s.\n", src_repo_id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Internal error");
+        goto error;
+    }
+
+    if (do_create_fork (mgr, src_repo, src_commit, repo_id,
+                        repo_name, owner, passwd, error) < 0) {
+        remove_fork_info (mgr, repo_id);
+        goto error;
+    }
+
+    if (seaf_repo_manager_set_repo_owner (mgr, repo_id, owner) < 0) {
+        seaf_warning ("Failed to set repo owner for %.10s.\n", repo_id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to set repo owner.");
+        /* An ownerless fork would keep the source store from GC forever. */
+        seaf_repo_manager_remove_repo_ondisk (mgr, repo_id);
+        remove_fork_info (mgr, repo_id);
+        goto error;
+    }
+
+    /* Like a virtual repo, the fork isn't empty at the beginning. */
+    schedule_repo_size_computation (seaf->size_sched, repo_id);
+
+    seaf_repo_unref (src_repo);
+    seaf_commit_unref (src_commit);
+    return repo_id;
+
+error:
+    seaf_repo_unref (src_repo);
+    seaf_commit_unref (src_commit);
+    g_free (repo_id);
+    return NULL;
+}
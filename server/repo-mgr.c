@@ -21,11 +21,22 @@
 
 #include "seaf-db.h"
 #include "seaf-utils.h"
+#include "mq-mgr.h"
+#include "file-rev-index.h"
+#include "executor.h"
+#include "cache-version.h"
 
 #define REAP_TOKEN_INTERVAL 300 /* 5 mins */
 #define DECRYPTED_TOKEN_TTL 3600 /* 1 hour */
 #define SCAN_TRASH_DAYS 1 /* one day */
 #define TRASH_EXPIRE_DAYS 30 /* one month */
+#define DEFAULT_TRASH_EXPIRE_BATCH 100
+#define DEFAULT_TRASH_EXPIRE_RATE 10 /* repos per second */
+#define RECLAIM_INTERVAL 60 /* seconds */
+#define DEFAULT_RECLAIM_RATE 2000 /* blocks per second */
+#define RECLAIM_BATCH 100
+#define DEFAULT_REPO_CACHE_TTL 10 /* seconds */
+#define MAX_CACHED_REPOS 100000
 
 typedef struct DecryptedToken {
     char *token;
@@ -39,6 +50,24 @@ struct _SeafRepoManagerPriv {
     CcnetTimer *reap_token_timer;
 
     CcnetTimer *scan_trash_timer;
+    int trash_expire_batch;
+    int trash_expire_rate;
+    /* Set while an expiry job is queued or running. */
+    gint trash_expiring;
+
+    CcnetTimer *reclaim_timer;
+    int reclaim_rate;
+    /* repo_id -> ReclaimJob, for the stores queued or being removed. */
+    GHashTable *reclaim_jobs;
+    pthread_mutex_t reclaim_lock;
+
+    /* repo_id -> CachedRepo */
+    GHashTable *repo_cache;
+    pthread_mutex_t repo_cache_lock;
+    /* Bumped by invalidations, so that a repo loaded before one isn't
+     * cached after it. */
+    guint64 repo_cache_gen;
+    int repo_cache_ttl;
 };
 
 static void
@@ -260,11 +289,66 @@ should_ignore_file(const char *filename, void *data)
 static gboolean
 collect_repo_id (SeafDBRow *row, void *data);
 
+/*
+ * Expired repos are deleted from the trash by a background job, a batch at
+ * a time and at most trash_expire_rate repos per second, so that a big
+ * trash doesn't hold the main loop or flood the DB. The job queues itself
+ * again while full batches are found, letting other jobs run in between.
+ */
+
+typedef struct ExpireTrashJob {
+    gint64 expire_time;
+} ExpireTrashJob;
+
+static void
+expire_trash_job (void *vjob, void *unused)
+{
+    ExpireTrashJob *job = vjob;
+    SeafRepoManager *mgr = seaf->repo_mgr;
+    SeafRepoManagerPriv *priv = mgr->priv;
+    GList *repo_ids = NULL, *iter;
+    int ret, n = 0;
+
+    char *sql = "SELECT repo_id FROM RepoTrash WHERE del_time <= ? "
+        "ORDER BY del_time LIMIT ?";
+    ret = seaf_db_statement_foreach_row (seaf->db, sql,
+                                         collect_repo_id, &repo_ids,
+                                         2, "int64", job->expire_time,
+                                         "int", priv->trash_expire_batch);
+    if (ret < 0) {
+        seaf_warning ("Get expired repo from trash failed.\n");
+        goto done;
+    }
+
+    for (iter = repo_ids; iter; iter = iter->next) {
+        ret = seaf_repo_manager_del_repo_from_trash (mgr, iter->data, NULL);
+        if (ret < 0)
+            goto done;
+        ++n;
+        g_usleep (G_USEC_PER_SEC / priv->trash_expire_rate);
+    }
+
+    if (n > 0)
+        seaf_message ("Deleted %d expired repos from trash.\n", n);
+
+    if (n == priv->trash_expire_batch) {
+        string_list_free (repo_ids);
+        seaf_executor_push (seaf->executor, SEAF_JOB_TRASH,
+                            expire_trash_job, job, NULL);
+        return;
+    }
+
+done:
+    string_list_free (repo_ids);
+    g_free (job);
+    g_atomic_int_set (&priv->trash_expiring, 0);
+}
+
 static int
 scan_trash (void *data)
 {
-    GList *repo_ids = NULL;
-    SeafRepoManager *mgr = seaf->repo_mgr;
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    ExpireTrashJob *job;
     gint64 trash_expire_interval = TRASH_EXPIRE_DAYS * 24 * 3600;
     int expire_days = seaf_cfg_manager_get_config_int (seaf->cfg_mgr,
                                                        "library_trash",
@@ -273,28 +357,14 @@ scan_trash (void *data)
         trash_expire_interval = expire_days * 24 * 3600;
     }
 
-    gint64 expire_time = time(NULL) - trash_expire_interval;
-    char *sql = "SELECT repo_id FROM RepoTrash WHERE del_time <= ?";
-
-    int ret = seaf_db_statement_foreach_row (seaf->db, sql,
-                                             collect_repo_id, &repo_ids,
-                                             1, "int64", expire_time);
-    if (ret < 0) {
-        seaf_warning ("Get expired repo from trash failed.");
-        string_list_free (repo_ids);
+    /* The last scan isn't done yet. */
+    if (!g_atomic_int_compare_and_exchange (&priv->trash_expiring, 0, 1))
         return TRUE;
-    }
 
-    GList *iter;
-    char *repo_id;
-    for (iter=repo_ids; iter; iter=iter->next) {
-        repo_id = iter->data;
-        ret = seaf_repo_manager_del_repo_from_trash (mgr, repo_id, NULL);
-        if (ret < 0)
-            break;
-    }
-
-    string_list_free (repo_ids);
+    job = g_new0 (ExpireTrashJob, 1);
+    job->expire_time = time(NULL) - trash_expire_interval;
+    seaf_executor_push (seaf->executor, SEAF_JOB_TRASH,
+                        expire_trash_job, job, NULL);
 
     return TRUE;
 }
@@ -313,10 +383,399 @@ init_scan_trash_timer (SeafRepoManagerPriv *priv, GKeyFile *config)
        g_clear_error (&error);
     }
 
+    priv->trash_expire_batch = g_key_file_get_integer (config,
+                                                       "library_trash",
+                                                       "expire_batch_size",
+                                                       NULL);
+    if (priv->trash_expire_batch <= 0)
+        priv->trash_expire_batch = DEFAULT_TRASH_EXPIRE_BATCH;
+    priv->trash_expire_rate = g_key_file_get_integer (config,
+                                                      "library_trash",
+                                                      "expire_repos_per_second",
+                                                      NULL);
+    if (priv->trash_expire_rate <= 0)
+        priv->trash_expire_rate = DEFAULT_TRASH_EXPIRE_RATE;
+
     priv->scan_trash_timer = ccnet_timer_new (scan_trash, NULL,
                                               scan_days * 24 * 3600 * 1000);
 }
 
+/*
+ * Stores of repos deleted for good are listed in GarbageRepos. seafserv-gc
+ * removes them with --rm-deleted. With [library_trash] reclaim_in_background
+ * set, seaf-server removes them instead, in jobs of the trash class, which
+ * run alongside other trash jobs. Blocks are removed at most
+ * reclaim_blocks_per_second, so that the storage keeps serving requests.
+ * Commits and fs objects are left to remove_store(), as they are packed or
+ * far fewer.
+ *
+ * The GarbageRepos row is only dropped after the stores are gone, so a job
+ * cut short by a restart is queued again by the next scan and picks up
+ * what's left.
+ */
+
+typedef struct ReclaimJob {
+    char repo_id[37];
+    gint64 queued;
+    gint64 started;
+    guint64 removed_blocks;
+    int n_batch;
+    gint64 batch_start;
+} ReclaimJob;
+
+static gboolean
+reclaim_block (const char *store_id, int version,
+               const char *block_id, void *vjob)
+{
+    ReclaimJob *job = vjob;
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    gint64 elapsed, expected;
+
+    if (seaf_block_manager_remove_block (seaf->block_mgr,
+                                         store_id, version, block_id) < 0)
+        return TRUE;
+
+    pthread_mutex_lock (&priv->reclaim_lock);
+    ++job->removed_blocks;
+    pthread_mutex_unlock (&priv->reclaim_lock);
+
+    if (++job->n_batch < RECLAIM_BATCH)
+        return TRUE;
+
+    elapsed = g_get_monotonic_time () - job->batch_start;
+    expected = (gint64)RECLAIM_BATCH * G_USEC_PER_SEC / priv->reclaim_rate;
+    if (elapsed < expected)
+        g_usleep (expected - elapsed);
+    job->n_batch = 0;
+    job->batch_start = g_get_monotonic_time ();
+
+    return TRUE;
+}
+
+static void
+remove_gc_state (const char *repo_id)
+{
+    /* The live set saved by seafserv-gc, see gc-state.c. */
+    char *path = g_build_filename (seaf->seaf_dir, "gc-state", repo_id, NULL);
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) && seaf_util_unlink (path) < 0)
+        seaf_warning ("Failed to remove GC state %s.\n", path);
+    g_free (path);
+}
+
+static void
+reclaim_repo_job (void *vjob, void *unused)
+{
+    ReclaimJob *job = vjob;
+    SeafRepoManager *mgr = seaf->repo_mgr;
+    SeafRepoManagerPriv *priv = mgr->priv;
+    const char *repo_id = job->repo_id;
+    gboolean has_forks, db_err = FALSE;
+    int ret = 0;
+
+    pthread_mutex_lock (&priv->reclaim_lock);
+    job->started = (gint64)time(NULL);
+    pthread_mutex_unlock (&priv->reclaim_lock);
+
+    /* The repo may have been restored under the same id. */
+    if (seaf_repo_manager_repo_exists (mgr, repo_id))
+        goto remove_record;
+
+    /* Forks still use the fs and block store. Only the commits are removed,
+     * and the record is kept until the last fork is gone, as seafserv-gc
+     * does.
+     */
+    has_forks = seaf_db_statement_exists (seaf->db,
+                                          "SELECT 1 FROM ForkedRepo WHERE store_id = ?",
+                                          &db_err, 1, "string", repo_id);
+    if (db_err)
+        goto out;
+    if (has_forks) {
+        seaf_commit_manager_remove_store (seaf->commit_mgr, repo_id);
+        goto out;
+    }
+
+    seaf_message ("Reclaiming the storage of deleted repo %.8s.\n", repo_id);
+
+    job->batch_start = g_get_monotonic_time ();
+    /* Deleted repos are of version 1, see remove_store(). */
+    if (seaf_block_manager_foreach_block (seaf->block_mgr, repo_id, 1,
+                                          reclaim_block, job) < 0)
+        ret = -1;
+    if (seaf_block_manager_remove_store (seaf->block_mgr, repo_id) < 0 ||
+        seaf_fs_manager_remove_store (seaf->fs_mgr, repo_id) < 0 ||
+        seaf_commit_manager_remove_store (seaf->commit_mgr, repo_id) < 0)
+        ret = -1;
+    if (ret < 0) {
+        seaf_warning ("Failed to reclaim the storage of repo %.8s, "
+                      "will retry later.\n", repo_id);
+        goto out;
+    }
+    remove_gc_state (repo_id);
+    file_rev_index_remove (repo_id);
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM ForkedRepo WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    seaf_message ("Reclaimed the storage of deleted repo %.8s, "
+                  "%"G_GUINT64_FORMAT" blocks removed.\n",
+                  repo_id, job->removed_blocks);
+
+remove_record:
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GarbageRepos WHERE repo_id = ?",
+                             1, "string", repo_id);
+out:
+    pthread_mutex_lock (&priv->reclaim_lock);
+    g_hash_table_remove (priv->reclaim_jobs, repo_id);
+    pthread_mutex_unlock (&priv->reclaim_lock);
+}
+
+static void
+queue_reclaim_job (SeafRepoManagerPriv *priv, const char *repo_id)
+{
+    ReclaimJob *job;
+
+    pthread_mutex_lock (&priv->reclaim_lock);
+    if (g_hash_table_lookup (priv->reclaim_jobs, repo_id)) {
+        pthread_mutex_unlock (&priv->reclaim_lock);
+        return;
+    }
+    job = g_new0 (ReclaimJob, 1);
+    memcpy (job->repo_id, repo_id, 36);
+    job->queued = (gint64)time(NULL);
+    g_hash_table_insert (priv->reclaim_jobs, job->repo_id, job);
+    pthread_mutex_unlock (&priv->reclaim_lock);
+
+    seaf_executor_push (seaf->executor, SEAF_JOB_TRASH,
+                        reclaim_repo_job, job, NULL);
+}
+
+static int
+scan_garbage_repos (void *data)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    GList *repo_ids = NULL, *iter;
+
+    if (!seafile_session_is_ready (seaf))
+        return TRUE;
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT repo_id FROM GarbageRepos",
+                                       collect_repo_id, &repo_ids, 0) < 0) {
+        seaf_warning ("Failed to list deleted repos.\n");
+        return TRUE;
+    }
+
+    for (iter = repo_ids; iter; iter = iter->next) {
+        if (is_repo_id_valid (iter->data))
+            queue_reclaim_job (priv, iter->data);
+    }
+    string_list_free (repo_ids);
+
+    return TRUE;
+}
+
+static void
+init_reclaim_timer (SeafRepoManagerPriv *priv, GKeyFile *config)
+{
+    pthread_mutex_init (&priv->reclaim_lock, NULL);
+    priv->reclaim_jobs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                NULL, g_free);
+
+    if (!g_key_file_get_boolean (config, "library_trash",
+                                 "reclaim_in_background", NULL))
+        return;
+
+    priv->reclaim_rate = g_key_file_get_integer (config, "library_trash",
+                                                 "reclaim_blocks_per_second",
+                                                 NULL);
+    if (priv->reclaim_rate <= 0)
+        priv->reclaim_rate = DEFAULT_RECLAIM_RATE;
+
+    priv->reclaim_timer = ccnet_timer_new (scan_garbage_repos, NULL,
+                                           RECLAIM_INTERVAL * 1000);
+}
+
+char *
+seaf_repo_manager_get_reclaim_progress (SeafRepoManager *mgr)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    ReclaimJob *job;
+    json_t *array, *obj;
+    char *json_data, *ret;
+
+    array = json_array ();
+
+    pthread_mutex_lock (&priv->reclaim_lock);
+    g_hash_table_iter_init (&iter, priv->reclaim_jobs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        job = value;
+        obj = json_object ();
+        json_object_set_string_member (obj, "repo_id", job->repo_id);
+        json_object_set_int_member (obj, "queued", job->queued);
+        json_object_set_int_member (obj, "started", job->started);
+        json_object_set_int_member (obj, "removed_blocks", job->removed_blocks);
+        json_array_append_new (array, obj);
+    }
+    pthread_mutex_unlock (&priv->reclaim_lock);
+
+    json_data = json_dumps (array, JSON_COMPACT);
+    ret = g_strdup (json_data);
+
+    free (json_data);
+    json_decref (array);
+    return ret;
+}
+
+/*
+ * A request resolves its repo several times, for permission, store id and
+ * quota checks. Loaded repos are cached for repo_cache_ttl seconds and
+ * handed out as copies, since callers move the head of the repos they get.
+ *
+ * Writes made by this process drop the cached repo through
+ * seaf_repo_manager_notify_repo_change(), and the Go file server's head
+ * updates through its repo-update events. A failed compare-and-swap of the
+ * head drops it too, so retried commits see the current head. Other cluster
+ * nodes rely on the ttl.
+ */
+
+typedef struct CachedRepo {
+    SeafRepo *repo;
+    gint64 expire_time;
+} CachedRepo;
+
+static void
+cached_repo_free (CachedRepo *cached)
+{
+    seaf_repo_unref (cached->repo);
+    g_free (cached);
+}
+
+static void
+init_repo_cache (SeafRepoManagerPriv *priv, GKeyFile *config)
+{
+    int ttl;
+    GError *error = NULL;
+
+    ttl = g_key_file_get_integer (config, "general", "repo_cache_ttl", &error);
+    if (error) {
+        ttl = DEFAULT_REPO_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    /* 0 disables the cache. */
+    priv->repo_cache_ttl = ttl > 0 ? ttl : 0;
+
+    priv->repo_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify)cached_repo_free);
+    pthread_mutex_init (&priv->repo_cache_lock, NULL);
+}
+
+static SeafRepo *
+copy_repo (SeafRepo *src)
+{
+    SeafRepo *repo = g_new0 (SeafRepo, 1);
+
+    *repo = *src;
+    repo->ref_cnt = 1;
+    repo->name = g_strdup (src->name);
+    repo->desc = g_strdup (src->desc);
+    repo->last_modifier = g_strdup (src->last_modifier);
+    repo->head = seaf_branch_new (src->head->name, src->head->repo_id,
+                                  src->head->commit_id);
+    if (src->virtual_info) {
+        repo->virtual_info = g_new0 (SeafVirtRepo, 1);
+        *repo->virtual_info = *src->virtual_info;
+        repo->virtual_info->path = g_strdup (src->virtual_info->path);
+    }
+
+    return repo;
+}
+
+/* Returns a copy of the cached repo, or NULL and the cache generation to
+ * pass to cache_repo(). */
+static SeafRepo *
+get_cached_repo (SeafRepoManager *mgr, const char *repo_id, guint64 *gen)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    CachedRepo *cached;
+    SeafRepo *repo = NULL;
+
+    if (priv->repo_cache_ttl == 0)
+        return NULL;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+    cached = g_hash_table_lookup (priv->repo_cache, repo_id);
+    if (cached) {
+        if (cached->expire_time > (gint64)time(NULL))
+            repo = copy_repo (cached->repo);
+        else
+            g_hash_table_remove (priv->repo_cache, repo_id);
+    }
+    *gen = priv->repo_cache_gen;
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+
+    return repo;
+}
+
+static void
+cache_repo (SeafRepoManager *mgr, SeafRepo *repo, guint64 gen)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    CachedRepo *cached;
+
+    if (priv->repo_cache_ttl == 0 || repo->is_corrupted)
+        return;
+
+    cached = g_new0 (CachedRepo, 1);
+    cached->repo = copy_repo (repo);
+    cached->expire_time = (gint64)time(NULL) + priv->repo_cache_ttl;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+    if (priv->repo_cache_gen != gen) {
+        pthread_mutex_unlock (&priv->repo_cache_lock);
+        cached_repo_free (cached);
+        return;
+    }
+    if (g_hash_table_size (priv->repo_cache) >= MAX_CACHED_REPOS)
+        g_hash_table_remove_all (priv->repo_cache);
+    g_hash_table_replace (priv->repo_cache, g_strdup (repo->id), cached);
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+}
+
+void
+seaf_repo_manager_invalidate_repo_cache (SeafRepoManager *mgr,
+                                         const char *repo_id)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+    priv->repo_cache_gen++;
+    g_hash_table_remove (priv->repo_cache, repo_id);
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+
+    seaf_cache_version_bump (SEAF_CACHE_VERSION_REPO);
+}
+
+void
+seaf_repo_manager_notify_repo_change (SeafRepoManager *mgr,
+                                      const char *repo_id)
+{
+    char *buf;
+
+    seaf_repo_manager_invalidate_repo_cache (mgr, repo_id);
+
+    if (!seaf->go_fileserver)
+        return;
+
+    buf = g_strdup_printf ("repo-change\t%s", repo_id);
+    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_PERM, buf);
+    g_free (buf);
+}
+
 SeafRepoManager*
 seaf_repo_manager_new (SeafileSession *seaf)
 {
@@ -333,6 +792,8 @@ seaf_repo_manager_new (SeafileSession *seaf)
                                                    REAP_TOKEN_INTERVAL * 1000);
 
     init_scan_trash_timer (mgr->priv, seaf->config);
+    init_reclaim_timer (mgr->priv, seaf->config);
+    init_repo_cache (mgr->priv, seaf->config);
 
     return mgr;
 }
@@ -343,19 +804,29 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
     /* On the server, we load repos into memory on-demand, because
      * there are too many repos.
      */
-    if (create_db_tables_if_not_exist (mgr) < 0) {
-        seaf_warning ("[repo mgr] failed to create tables.\n");
+    if (seaf_repo_manager_init_merge_scheduler() < 0) {
+        seaf_warning ("Failed to init merge scheduler.\n");
         return -1;
     }
 
-    if (seaf_repo_manager_init_merge_scheduler() < 0) {
-        seaf_warning ("Failed to init merge scheduler.\n");
+    if (seaf_repo_manager_init_last_modified_cache () < 0) {
+        seaf_warning ("Failed to init last modified cache.\n");
         return -1;
     }
 
     return 0;
 }
 
+int
+seaf_repo_manager_create_tables (SeafRepoManager *mgr)
+{
+    if (create_db_tables_if_not_exist (mgr) < 0) {
+        seaf_warning ("[repo mgr] failed to create tables.\n");
+        return -1;
+    }
+    return 0;
+}
+
 int
 seaf_repo_manager_start (SeafRepoManager *mgr)
 {
@@ -464,6 +935,8 @@ remove_virtual_repo_ondisk (SeafRepoManager *mgr,
     }
     seaf_branch_list_free (branch_list);
 
+    seaf_quota_manager_invalidate_repo_usage (seaf->quota_mgr, repo_id);
+
     seaf_db_statement_query (db, "DELETE FROM RepoOwner WHERE repo_id = ?",
                    1, "string", repo_id);
 
@@ -582,6 +1055,8 @@ del_repo:
     }
     seaf_branch_list_free (branch_list);
 
+    seaf_quota_manager_invalidate_repo_usage (seaf->quota_mgr, repo_id);
+
     seaf_db_statement_query (mgr->seaf->db, "DELETE FROM RepoOwner WHERE repo_id = ?",
                              1, "string", repo_id);
 
@@ -627,9 +1102,16 @@ del_repo:
                              "WHERE repo_id=? OR origin_repo=?",
                              2, "string", repo_id, "string", repo_id);
 
+    /* The ForkedRepo record of a fork is kept while it's in the trash, so
+     * GC keeps what it reaches and restoring it finds its store. It's
+     * removed with the stores of the repo, once it's deleted for good.
+     */
     if (!head_commit)
         add_deleted_repo_record(mgr, repo_id);
 
+    seaf_repo_manager_invalidate_repo_cache (mgr, repo_id);
+    seaf_repo_manager_notify_repo_list_change (mgr, repo_id, NULL);
+
     return 0;
 }
 
@@ -647,6 +1129,23 @@ seaf_repo_manager_del_virtual_repo (SeafRepoManager *mgr,
                                     1, "string", repo_id);
 }
 
+int
+seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
+                                      const char *repo_id)
+{
+    int ret = remove_virtual_repo_ondisk (mgr, repo_id);
+
+    if (ret < 0)
+        return ret;
+
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM RepoHistoryLimit WHERE repo_id = ?",
+                             1, "string", repo_id);
+    seaf_repo_manager_invalidate_repo_cache (mgr, repo_id);
+
+    return 0;
+}
+
 static gboolean
 repo_exists_in_db (SeafDB *db, const char *id, gboolean *db_err)
 {
@@ -667,6 +1166,7 @@ create_repo_fill_size (SeafDBRow *row, void *data)
     const char *vrepo_id = seaf_db_row_get_column_text (row, 3);
     gint64 file_count = seaf_db_row_get_column_int64 (row, 7);
     int status = seaf_db_row_get_column_int(row, 8);
+    const char *fork_store_id = seaf_db_row_get_column_text (row, 9);
 
     *repo = seaf_repo_new (repo_id, NULL, NULL);
     if (!*repo)
@@ -700,6 +1200,10 @@ create_repo_fill_size (SeafDBRow *row, void *data)
         memcpy ((*repo)->store_id, repo_id, 36);
     }
 
+    /* Forks, and virtual repos of forks, use the store of the forked repo. */
+    if (fork_store_id)
+        memcpy ((*repo)->store_id, fork_store_id, 36);
+
     return TRUE;
 }
 
@@ -711,19 +1215,21 @@ get_repo_from_db (SeafRepoManager *mgr, const char *id, gboolean *db_err)
 
     if (seaf_db_type(mgr->seaf->db) != SEAF_DB_TYPE_PGSQL)
         sql = "SELECT r.repo_id, s.size, b.commit_id, "
-            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status FROM "
+            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status, f.store_id FROM "
             "Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id "
             "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
             "LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id "
+            "LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) "
             "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
             "LEFT JOIN RepoInfo i on r.repo_id = i.repo_id "
             "WHERE r.repo_id = ? AND b.name = 'master'";
     else
         sql = "SELECT r.repo_id, s.\"size\", b.commit_id, "
-            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status FROM "
+            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status, f.store_id FROM "
             "Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id "
             "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
             "LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id "
+            "LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) "
             "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
             "LEFT JOIN RepoInfo i on r.repo_id = i.repo_id "
             "WHERE r.repo_id = ? AND b.name = 'master'";
@@ -743,10 +1249,15 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
     int len = strlen(id);
     SeafRepo *repo = NULL;
     gboolean has_err = FALSE;
+    guint64 gen;
 
     if (len >= 37)
         return NULL;
 
+    repo = get_cached_repo (manager, id, &gen);
+    if (repo)
+        return repo;
+
     repo = get_repo_from_db (manager, id, &has_err);
 
     if (repo) {
@@ -760,6 +1271,7 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
             seaf_repo_unref (repo);
             return NULL;
         }
+        cache_repo (manager, repo, gen);
     }
 
     return repo;
@@ -771,10 +1283,15 @@ seaf_repo_manager_get_repo_ex (SeafRepoManager *manager, const gchar *id)
     int len = strlen(id);
     gboolean has_err = FALSE;
     SeafRepo *ret = NULL;
+    guint64 gen;
 
     if (len >= 37)
         return NULL;
 
+    ret = get_cached_repo (manager, id, &gen);
+    if (ret)
+        return ret;
+
     ret = get_repo_from_db (manager, id, &has_err);
     if (has_err) {
         ret = seaf_repo_new(id, NULL, NULL);
@@ -788,6 +1305,7 @@ seaf_repo_manager_get_repo_ex (SeafRepoManager *manager, const gchar *id)
         }
 
         load_repo (manager, ret);
+        cache_repo (manager, ret, gen);
     }
 
     return ret;
@@ -1047,6 +1565,13 @@ create_tables_mysql (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS ForkedRepo (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "repo_id CHAR(36), origin_repo CHAR(36), origin_commit CHAR(40), "
+        "store_id CHAR(36), UNIQUE INDEX(repo_id), INDEX(store_id))"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS GarbageRepos (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
           "repo_id CHAR(36), UNIQUE INDEX(repo_id))";
     if (seaf_db_query (db, sql) < 0)
@@ -1067,6 +1592,33 @@ create_tables_mysql (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS RepoSizeDirty ("
+        "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "repo_id CHAR(36), dirty_time BIGINT, UNIQUE INDEX(repo_id))ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS CommitDescription ("
+        "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "repo_id CHAR(36), commit_id CHAR(40), description TEXT, "
+        "UNIQUE INDEX(repo_id, commit_id))ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS RepoDeletedEntry ("
+        "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "repo_id CHAR(36), commit_id CHAR(40), obj_id CHAR(40), obj_name TEXT, "
+        "basedir TEXT, mode INTEGER, file_size BIGINT, delete_time BIGINT, "
+        "INDEX(repo_id, delete_time))ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS RepoDeletedIndex ("
+        "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "repo_id CHAR(36), head_id CHAR(40), UNIQUE INDEX(repo_id))ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoInfo (id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
         "repo_id CHAR(36), "
         "name VARCHAR(255) NOT NULL, update_time BIGINT, version INTEGER, "
@@ -1080,6 +1632,15 @@ create_tables_mysql (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    /* Written by the Go fileserver for instant uploads. */
+    sql = "CREATE TABLE IF NOT EXISTS FileFingerprint ("
+        "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+        "fingerprint CHAR(40) NOT NULL, size BIGINT NOT NULL, "
+        "store_id CHAR(36) NOT NULL, file_id CHAR(40) NOT NULL, "
+        "UNIQUE INDEX(fingerprint, size, store_id)) ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -1198,6 +1759,16 @@ create_tables_sqlite (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS ForkedRepo (repo_id CHAR(36) PRIMARY KEY,"
+        "origin_repo CHAR(36), origin_commit CHAR(40), store_id CHAR(36))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE INDEX IF NOT EXISTS forkedrepo_store_id_idx "
+        "ON ForkedRepo (store_id)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS GarbageRepos (repo_id CHAR(36) PRIMARY KEY)";
     if (seaf_db_query (db, sql) < 0)
         return -1;
@@ -1222,6 +1793,33 @@ create_tables_sqlite (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS RepoSizeDirty ("
+        "repo_id CHAR(36) PRIMARY KEY, dirty_time BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS CommitDescription ("
+        "repo_id CHAR(36), commit_id CHAR(40), description TEXT, "
+        "PRIMARY KEY (repo_id, commit_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS RepoDeletedEntry (repo_id CHAR(36), "
+        "commit_id CHAR(40), obj_id CHAR(40), obj_name TEXT, basedir TEXT, "
+        "mode INTEGER, file_size BIGINT, delete_time BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE INDEX IF NOT EXISTS repodeletedentry_repo_id_idx "
+        "ON RepoDeletedEntry (repo_id, delete_time)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS RepoDeletedIndex ("
+        "repo_id CHAR(36) PRIMARY KEY, head_id CHAR(40))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoInfo (repo_id CHAR(36) PRIMARY KEY, "
         "name VARCHAR(255) NOT NULL, update_time INTEGER, version INTEGER, "
         "is_encrypted INTEGER, last_modifier VARCHAR(255), status INTEGER DEFAULT 0)";
@@ -1233,6 +1831,14 @@ create_tables_sqlite (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    /* Written by the Go fileserver for instant uploads. */
+    sql = "CREATE TABLE IF NOT EXISTS FileFingerprint ("
+        "fingerprint CHAR(40) NOT NULL, size BIGINT NOT NULL, "
+        "store_id CHAR(36) NOT NULL, file_id CHAR(40) NOT NULL, "
+        "PRIMARY KEY (fingerprint, size, store_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -1871,9 +2477,12 @@ seaf_repo_manager_get_email_by_token (SeafRepoManager *manager,
     sql = "SELECT email FROM RepoUserToken "
         "WHERE repo_id = ? AND token = ?";
 
+    /* A deleted token must not be found on a lagging replica. */
+    seaf_db_begin_primary_reads ();
     seaf_db_statement_foreach_row (seaf->db, sql,
                                    get_email_by_token_cb, &email,
                                    2, "string", repo_id, "string", token);
+    seaf_db_end_primary_reads ();
 
     return email;
 }
@@ -2082,6 +2691,11 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
     if (g_strcmp0 (orig_owner, email) == 0)
         goto out;
 
+    /* The usage of both the old and the new owner changes. */
+    seaf_quota_manager_invalidate_repo_usage (seaf->quota_mgr, repo_id);
+    seaf_db_statement_query (db, "DELETE FROM UserUsage WHERE user = ?",
+                             1, "string", email);
+
     if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
         gboolean err;
         snprintf(sql, sizeof(sql),
@@ -2112,6 +2726,8 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
         }
     }
 
+    seaf_repo_manager_notify_repo_list_change (mgr, repo_id, email);
+
     /* If the repo was newly created, no need to remove share and virtual repos. */
     if (!orig_owner)
         goto out;
@@ -2127,6 +2743,9 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
                                  1, "string", repo_id);
     }
 
+    /* The old owner and those shared to lose access. */
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+
     /* Remove virtual repos when repo ownership changes. */
     GList *vrepos, *ptr;
     vrepos = seaf_repo_manager_get_virtual_repo_ids_by_origin (mgr, repo_id);
@@ -2446,6 +3065,258 @@ seaf_repo_manager_get_repos_by_id_prefix (SeafRepoManager *mgr,
     return repo_list;
 }
 
+/* The ids are checked uuids, so they're put into the IN (...) list of the
+ * statement directly. Longer lists are split into several statements.
+ */
+#define MAX_IDS_PER_QUERY 500
+
+static int
+foreach_repo_id_batch (SeafDB *db, const char *sql_head, const char *sql_tail,
+                       GList *repo_ids, SeafDBRowFunc callback, void *data)
+{
+    GString *sql = g_string_new (NULL);
+    GList *ptr = repo_ids;
+    const char *repo_id;
+    int n, ret = 0;
+
+    while (ptr) {
+        g_string_printf (sql, "%s IN (", sql_head);
+        for (n = 0; ptr && n < MAX_IDS_PER_QUERY; ptr = ptr->next) {
+            repo_id = ptr->data;
+            if (!is_uuid_valid (repo_id))
+                continue;
+            g_string_append_printf (sql, "%s'%s'", n > 0 ? "," : "", repo_id);
+            ++n;
+        }
+        if (n == 0)
+            break;
+        g_string_append_c (sql, ')');
+        if (sql_tail)
+            g_string_append (sql, sql_tail);
+
+        if (seaf_db_statement_foreach_row (db, sql->str, callback, data, 0) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    g_string_free (sql, TRUE);
+    return ret;
+}
+
+static gboolean
+collect_repo_fill_size (SeafDBRow *row, void *data)
+{
+    GHashTable *repos = data;
+    SeafRepo *repo = NULL;
+
+    create_repo_fill_size (row, &repo);
+    if (repo)
+        g_hash_table_replace (repos, repo->id, repo);
+
+    return TRUE;
+}
+
+GList *
+seaf_repo_manager_get_repos_by_ids (SeafRepoManager *mgr, GList *repo_ids)
+{
+    GHashTable *repos, *seen;
+    GList *missing = NULL, *ret = NULL, *ptr;
+    SeafRepo *repo;
+    const char *sql;
+    guint64 gen = 0, miss_gen;
+    gboolean first_miss = TRUE;
+
+    repos = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify)seaf_repo_unref);
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        if (g_hash_table_lookup (seen, ptr->data))
+            continue;
+        g_hash_table_insert (seen, ptr->data, ptr->data);
+        repo = get_cached_repo (mgr, ptr->data, &miss_gen);
+        if (repo) {
+            g_hash_table_replace (repos, repo->id, repo);
+            continue;
+        }
+        /* Repos changed after the first miss aren't cached. */
+        if (first_miss) {
+            gen = miss_gen;
+            first_miss = FALSE;
+        }
+        missing = g_list_prepend (missing, ptr->data);
+    }
+
+    if (seaf_db_type(mgr->seaf->db) != SEAF_DB_TYPE_PGSQL)
+        sql = "SELECT r.repo_id, s.size, b.commit_id, "
+            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status, f.store_id FROM "
+            "Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id "
+            "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+            "LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id "
+            "LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) "
+            "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
+            "LEFT JOIN RepoInfo i on r.repo_id = i.repo_id "
+            "WHERE b.name = 'master' AND r.repo_id";
+    else
+        sql = "SELECT r.repo_id, s.\"size\", b.commit_id, "
+            "v.repo_id, v.origin_repo, v.path, v.base_commit, fc.file_count, i.status, f.store_id FROM "
+            "Repo r LEFT JOIN Branch b ON r.repo_id = b.repo_id "
+            "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+            "LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id "
+            "LEFT JOIN ForkedRepo f ON f.repo_id = COALESCE(v.origin_repo, r.repo_id) "
+            "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
+            "LEFT JOIN RepoInfo i on r.repo_id = i.repo_id "
+            "WHERE b.name = 'master' AND r.repo_id";
+
+    if (missing &&
+        foreach_repo_id_batch (mgr->seaf->db, sql, NULL, missing,
+                               collect_repo_fill_size, repos) < 0)
+        seaf_warning ("Failed to get repos by ids.\n");
+
+    for (ptr = missing; ptr; ptr = ptr->next) {
+        repo = g_hash_table_lookup (repos, ptr->data);
+        if (!repo)
+            continue;
+        if (!repo->is_corrupted)
+            load_repo (mgr, repo);
+        if (repo->is_corrupted)
+            g_hash_table_remove (repos, ptr->data);
+        else
+            cache_repo (mgr, repo, gen);
+    }
+    g_list_free (missing);
+    g_hash_table_destroy (seen);
+
+    /* Keep the order of the ids. */
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo = g_hash_table_lookup (repos, ptr->data);
+        if (repo) {
+            seaf_repo_ref (repo);
+            ret = g_list_prepend (ret, repo);
+            g_hash_table_remove (repos, ptr->data);
+        }
+    }
+    g_hash_table_destroy (repos);
+
+    return g_list_reverse (ret);
+}
+
+static gboolean
+collect_owner (SeafDBRow *row, void *data)
+{
+    GHashTable *owners = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *owner = seaf_db_row_get_column_text (row, 1);
+
+    if (owner)
+        g_hash_table_replace (owners, g_strdup (repo_id),
+                              g_ascii_strdown (owner, -1));
+
+    return TRUE;
+}
+
+GHashTable *
+seaf_repo_manager_get_repo_owners (SeafRepoManager *mgr, GList *repo_ids)
+{
+    GHashTable *owners = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+
+    if (foreach_repo_id_batch (mgr->seaf->db,
+                               "SELECT repo_id, owner_id FROM RepoOwner WHERE repo_id",
+                               NULL, repo_ids, collect_owner, owners) < 0) {
+        seaf_warning ("Failed to get owners of repos.\n");
+        g_hash_table_destroy (owners);
+        return NULL;
+    }
+
+    return owners;
+}
+
+static gboolean
+collect_repo_size (SeafDBRow *row, void *data)
+{
+    GList **prepos = data;
+    SeafRepo *repo;
+
+    repo = seaf_repo_new (seaf_db_row_get_column_text (row, 0), NULL, NULL);
+    repo->size = seaf_db_row_get_column_int64 (row, 1);
+    repo->file_count = seaf_db_row_get_column_int64 (row, 2);
+    *prepos = g_list_prepend (*prepos, repo);
+
+    return TRUE;
+}
+
+GList *
+seaf_repo_manager_get_repo_sizes (SeafRepoManager *mgr, GList *repo_ids,
+                                  gboolean *db_err)
+{
+    GList *repos = NULL;
+    const char *sql;
+
+    if (seaf_db_type(mgr->seaf->db) != SEAF_DB_TYPE_PGSQL)
+        sql = "SELECT r.repo_id, s.size, fc.file_count FROM Repo r "
+            "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+            "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
+            "WHERE r.repo_id";
+    else
+        sql = "SELECT r.repo_id, s.\"size\", fc.file_count FROM Repo r "
+            "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+            "LEFT JOIN RepoFileCount fc ON r.repo_id = fc.repo_id "
+            "WHERE r.repo_id";
+
+    if (foreach_repo_id_batch (mgr->seaf->db, sql, NULL, repo_ids,
+                               collect_repo_size, &repos) < 0) {
+        *db_err = TRUE;
+        g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
+        return NULL;
+    }
+
+    return repos;
+}
+
+static gboolean
+collect_head (SeafDBRow *row, void *data)
+{
+    GList **pheads = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+
+    *pheads = g_list_prepend (*pheads,
+                              seaf_branch_new ("master", repo_id, commit_id));
+
+    return TRUE;
+}
+
+GList *
+seaf_repo_manager_get_head_commits (SeafRepoManager *mgr, GList *repo_ids)
+{
+    GList *heads = NULL, *ret = NULL, *ptr;
+    SeafBranch *head;
+    SeafCommit *commit;
+
+    if (foreach_repo_id_batch (mgr->seaf->db,
+                               "SELECT repo_id, commit_id FROM Branch "
+                               "WHERE name = 'master' AND repo_id",
+                               NULL, repo_ids, collect_head, &heads) < 0)
+        seaf_warning ("Failed to get head commits of repos.\n");
+
+    for (ptr = heads; ptr; ptr = ptr->next) {
+        head = ptr->data;
+        commit = seaf_commit_manager_get_commit_compatible (mgr->seaf->commit_mgr,
+                                                            head->repo_id,
+                                                            head->commit_id);
+        if (!commit) {
+            seaf_warning ("Commit %s:%s is missing\n", head->repo_id, head->commit_id);
+            continue;
+        }
+        ret = g_list_prepend (ret, commit);
+    }
+    g_list_free_full (heads, (GDestroyNotify)seaf_branch_unref);
+
+    return ret;
+}
+
 GList *
 seaf_repo_manager_search_repos_by_name (SeafRepoManager *mgr, const char *name)
 {
@@ -2794,6 +3665,8 @@ seaf_repo_manager_del_repo_from_trash (SeafRepoManager *mgr,
                      "DB error: Add deleted record");
         return -1;
     }
+    if (mgr->priv->reclaim_timer)
+        queue_reclaim_job (mgr->priv, repo_id);
 
     seaf_db_statement_query (mgr->seaf->db,
                              "DELETE FROM RepoFileCount WHERE repo_id = ?",
@@ -2807,6 +3680,14 @@ seaf_repo_manager_del_repo_from_trash (SeafRepoManager *mgr,
                              "DELETE FROM RepoInfo WHERE repo_id = ?",
                              1, "string", repo_id);
 
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM RepoDeletedEntry WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM RepoDeletedIndex WHERE repo_id = ?",
+                             1, "string", repo_id);
+
     return 0;
 }
 
@@ -3093,19 +3974,79 @@ seaf_repo_manager_add_group_repo (SeafRepoManager *mgr,
                                  "string", owner, "string", permission) < 0)
         return -1;
 
+    seaf_repo_manager_notify_repo_list_change (mgr, repo_id, NULL);
+
     return 0;
 }
 
+static gboolean
+collect_group_ids (SeafDBRow *row, void *data)
+{
+    GHashTable *group_ids = data;
+    int group_id = seaf_db_row_get_column_int (row, 0);
+
+    g_hash_table_insert (group_ids, GINT_TO_POINTER(group_id),
+                         GINT_TO_POINTER(group_id));
+
+    return TRUE;
+}
+
+int
+seaf_repo_manager_add_group_repos (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   GList *group_ids,
+                                   const char *owner,
+                                   const char *permission,
+                                   GError **error)
+{
+    GHashTable *shared;
+    SeafDBBatch *batch;
+    GList *ptr;
+    int ret;
+
+    shared = g_hash_table_new (g_direct_hash, g_direct_equal);
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT group_id FROM RepoGroup WHERE repo_id = ?",
+                                       collect_group_ids, shared,
+                                       1, "string", repo_id) < 0) {
+        g_hash_table_destroy (shared);
+        return -1;
+    }
+
+    batch = seaf_db_batch_new (mgr->seaf->db,
+                               "INSERT INTO RepoGroup (repo_id, group_id, user_name, permission)",
+                               4);
+    for (ptr = group_ids; ptr; ptr = ptr->next) {
+        int group_id = GPOINTER_TO_INT(ptr->data);
+        if (g_hash_table_lookup (shared, ptr->data))
+            continue;
+        seaf_db_batch_add_row (batch, "string", repo_id, "int", group_id,
+                               "string", owner, "string", permission);
+        g_hash_table_insert (shared, ptr->data, ptr->data);
+    }
+    ret = seaf_db_batch_finish (batch);
+    if (ret == 0)
+        seaf_repo_manager_notify_repo_list_change (mgr, repo_id, NULL);
+
+    g_hash_table_destroy (shared);
+    return ret;
+}
+
 int
 seaf_repo_manager_del_group_repo (SeafRepoManager *mgr,
                                   const char *repo_id,
                                   int group_id,
                                   GError **error)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "DELETE FROM RepoGroup WHERE group_id=? "
-                                    "AND repo_id=?",
-                                    2, "int", group_id, "string", repo_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "DELETE FROM RepoGroup WHERE group_id=? "
+                                  "AND repo_id=?",
+                                  2, "int", group_id, "string", repo_id);
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+
+    return rc;
 }
 
 static gboolean
@@ -3182,11 +4123,16 @@ seaf_repo_manager_set_group_repo_perm (SeafRepoManager *mgr,
                                        const char *permission,
                                        GError **error)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "UPDATE RepoGroup SET permission=? WHERE "
-                                    "repo_id=? AND group_id=?",
-                                    3, "string", permission, "string", repo_id,
-                                    "int", group_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "UPDATE RepoGroup SET permission=? WHERE "
+                                  "repo_id=? AND group_id=?",
+                                  3, "string", permission, "string", repo_id,
+                                  "int", group_id);
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+
+    return rc;
 }
 
 int
@@ -3197,15 +4143,20 @@ seaf_repo_manager_set_subdir_group_perm_by_path (SeafRepoManager *mgr,
                                                  const char *permission,
                                                  const char *path)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "UPDATE RepoGroup SET permission=? WHERE repo_id IN "
-                                    "(SELECT repo_id FROM VirtualRepo WHERE origin_repo=? AND path=?) "
-                                    "AND group_id=? AND user_name=?",
-                                    5, "string", permission,
-                                    "string", repo_id,
-                                    "string", path,
-                                    "int", group_id,
-                                    "string", username);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "UPDATE RepoGroup SET permission=? WHERE repo_id IN "
+                                  "(SELECT repo_id FROM VirtualRepo WHERE origin_repo=? AND path=?) "
+                                  "AND group_id=? AND user_name=?",
+                                  5, "string", permission,
+                                  "string", repo_id,
+                                  "string", path,
+                                  "int", group_id,
+                                  "string", username);
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+
+    return rc;
 }
 static gboolean
 get_group_repoids_cb (SeafDBRow *row, void *data)
@@ -3478,6 +4429,9 @@ seaf_repo_manager_remove_group_repos (SeafRepoManager *mgr,
                                       2, "int", group_id, "string", owner);
     }
 
+    /* Members of the group aren't known here. */
+    seaf_repo_manager_notify_perm_change (mgr, NULL, NULL);
+
     return rc;
 }
 
@@ -3490,6 +4444,7 @@ seaf_repo_manager_set_inner_pub_repo (SeafRepoManager *mgr,
 {
     SeafDB *db = mgr->seaf->db;
     char sql[256];
+    int rc;
 
     if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
         gboolean err;
@@ -3506,23 +4461,31 @@ seaf_repo_manager_set_inner_pub_repo (SeafRepoManager *mgr,
                      "('%s', '%s')", repo_id, permission);
         if (err)
             return -1;
-        return seaf_db_query (db, sql);
+        rc = seaf_db_query (db, sql);
     } else {
-        return seaf_db_statement_query (db,
-                                        "REPLACE INTO InnerPubRepo (repo_id, permission) VALUES (?, ?)",
-                                        2, "string", repo_id, "string", permission);
+        rc = seaf_db_statement_query (db,
+                                      "REPLACE INTO InnerPubRepo (repo_id, permission) VALUES (?, ?)",
+                                      2, "string", repo_id, "string", permission);
     }
 
-    return -1;
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+    seaf_repo_manager_notify_repo_list_change (mgr, repo_id, NULL);
+
+    return rc;
 }
 
 int
 seaf_repo_manager_unset_inner_pub_repo (SeafRepoManager *mgr,
                                         const char *repo_id)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "DELETE FROM InnerPubRepo WHERE repo_id = ?",
-                                    1, "string", repo_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "DELETE FROM InnerPubRepo WHERE repo_id = ?",
+                                  1, "string", repo_id);
+    seaf_repo_manager_notify_perm_change (mgr, repo_id, NULL);
+
+    return rc;
 }
 
 gboolean
@@ -4698,9 +5661,7 @@ seaf_repo_manager_convert_repo_path (SeafRepoManager *mgr,
 {
     char *ret = NULL;
     int rc;
-    int group_id;
     GString *sql;
-    CcnetGroup *group;
     GList *groups = NULL, *p1;
     GList *repo_paths = NULL;
     SeafVirtRepo *vinfo = NULL;
@@ -4736,8 +5697,7 @@ seaf_repo_manager_convert_repo_path (SeafRepoManager *mgr,
 
     /* Get the groups this user belongs to. */
 
-    groups = ccnet_group_manager_get_groups_by_user (seaf->group_mgr, user,
-                                                     1, NULL);
+    groups = ccnet_group_manager_get_group_ids_by_user (seaf->group_mgr, user, NULL);
     if (!groups) {
         goto out;
     }
@@ -4746,10 +5706,7 @@ seaf_repo_manager_convert_repo_path (SeafRepoManager *mgr,
                      "v.origin_repo=? AND v.repo_id=r.repo_id AND r.group_id IN(",
                      is_org ? "OrgGroupRepo" : "RepoGroup");
     for (p1 = groups; p1 != NULL; p1 = p1->next) {
-        group = p1->data;
-        g_object_get (group, "id", &group_id, NULL);
-
-        g_string_append_printf (sql, "%d", group_id);
+        g_string_append_printf (sql, "%d", GPOINTER_TO_INT(p1->data));
         if (p1->next)
             g_string_append_printf (sql, ",");
     }
@@ -4773,8 +5730,6 @@ out:
     if (vinfo)
         seaf_virtual_repo_info_free (vinfo);
     g_string_free (sql, TRUE);
-    for (p1 = groups; p1 != NULL; p1 = p1->next)
-        g_object_unref ((GObject *)p1->data);
     g_list_free (groups);
 
     return ret;
@@ -4794,6 +5749,13 @@ seaf_repo_manager_set_repo_status(SeafRepoManager *mgr,
                                  "string", repo_id, "string", repo_id) < 0)
         ret = -1;
 
+    GList *vrepos, *ptr;
+    seaf_repo_manager_invalidate_repo_cache (mgr, repo_id);
+    vrepos = seaf_repo_manager_get_virtual_repo_ids_by_origin (mgr, repo_id);
+    for (ptr = vrepos; ptr; ptr = ptr->next)
+        seaf_repo_manager_invalidate_repo_cache (mgr, ptr->data);
+    string_list_free (vrepos);
+
     return ret;
 }
 
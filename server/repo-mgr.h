@@ -53,8 +53,9 @@ struct _SeafRepo {
 
     int version;
     /* Used to access fs and block sotre.
-     * This id is different from repo_id when this repo is virtual.
-     * Virtual repos share fs and block store with its origin repo.
+     * This id is different from repo_id when this repo is virtual or a fork.
+     * Virtual repos share fs and block store with its origin repo, and
+     * forks with the repo they were forked from.
      * However, commit store for each repo is always independent.
      * So always use repo_id to access commit store.
      */
@@ -113,9 +114,26 @@ struct _SeafRepoManager {
 SeafRepoManager* 
 seaf_repo_manager_new (struct _SeafileSession *seaf);
 
+/* Drop the cached object of @repo_id in this process. */
+void
+seaf_repo_manager_invalidate_repo_cache (SeafRepoManager *mgr,
+                                         const char *repo_id);
+
+/*
+ * Drop the cached object of @repo_id here and in the file server, after
+ * its head or virtual repo info changed.
+ */
+void
+seaf_repo_manager_notify_repo_change (SeafRepoManager *mgr,
+                                      const char *repo_id);
+
 int
 seaf_repo_manager_init (SeafRepoManager *mgr);
 
+/* Creates missing tables if configured to. */
+int
+seaf_repo_manager_create_tables (SeafRepoManager *mgr);
+
 int
 seaf_repo_manager_start (SeafRepoManager *mgr);
 
@@ -135,6 +153,14 @@ int
 seaf_repo_manager_del_virtual_repo (SeafRepoManager *mgr,
                                     const char *repo_id);
 
+/*
+ * Remove a repo without putting it into the trash, e.g. when creating it
+ * failed halfway. Its commits are left to GC.
+ */
+int
+seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
+                                      const char *repo_id);
+
 SeafRepo* 
 seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id);
 
@@ -168,6 +194,11 @@ seaf_repo_manager_del_repo_from_trash (SeafRepoManager *mgr,
                                        const char *repo_id,
                                        GError **error);
 
+/* The stores of deleted repos being reclaimed in the background, as a json
+ * array. */
+char *
+seaf_repo_manager_get_reclaim_progress (SeafRepoManager *mgr);
+
 /* Remove all entries in the repo trash. */
 int
 seaf_repo_manager_empty_repo_trash (SeafRepoManager *mgr, GError **error);
@@ -325,10 +356,31 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *paths_json,
                                     const char *user,
                                     int replace_existed,
+                                    gboolean create_parents,
                                     char **new_ids,
                                     char **task_id,
                                     GError **error);
 
+/* Like seaf_repo_manager_post_multi_files(), for files whose blocks and
+ * seafile objects have already been written. @id_list holds the file ids
+ * and @size_list the file sizes (gint64 *), in the order of @filenames.
+ *
+ * With @create_parents, the dirs of @parent_dir that don't exist are
+ * created in the commit of the files, e.g. for folder uploads.
+ */
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      GList *filenames,
+                                      GList *id_list,
+                                      GList *size_list,
+                                      const char *user,
+                                      int replace_existed,
+                                      gboolean create_parents,
+                                      char **ret_json,
+                                      GError **error);
+
 /* int */
 /* seaf_repo_manager_post_file_blocks (SeafRepoManager *mgr, */
 /*                                     const char *repo_id, */
@@ -404,6 +456,24 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
                             char **new_file_id,                            
                             GError **error);
 
+/* Replaces an existing file with one made of the blocks in @blockids_json,
+ * all stored already, so that an update only uploads the blocks that
+ * changed. If some are missing, fails with POST_FILE_ERR_BLOCK_MISSING and
+ * returns their ids in @missing_json.
+ */
+int
+seaf_repo_manager_put_file_blocks_delta (SeafRepoManager *mgr,
+                                         const char *repo_id,
+                                         const char *parent_dir,
+                                         const char *file_name,
+                                         const char *blockids_json,
+                                         gint64 file_size,
+                                         const char *user,
+                                         const char *head_id,
+                                         char **new_file_id,
+                                         char **missing_json,
+                                         GError **error);
+
 /* int */
 /* seaf_repo_manager_put_file_blocks (SeafRepoManager *mgr, */
 /*                                    const char *repo_id, */
@@ -577,6 +647,37 @@ seaf_repo_manager_update_dir (SeafRepoManager *mgr,
                               char *new_commit_id,
                               GError **error);
 
+/*
+ * Make @new_commit, which is based on @base, the head of the repo, merging
+ * it with the current head if the head has moved. Concurrent updates of a
+ * repo are queued and applied together. With @retry_on_conflict unset, fails
+ * with SEAF_ERR_CONCURRENT_UPLOAD if another process moves the head first.
+ * @new_commit_id: The new head commit id after the update.
+ */
+int
+seaf_repo_manager_commit_to_head (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  SeafCommit *base,
+                                  SeafCommit *new_commit,
+                                  gboolean retry_on_conflict,
+                                  char *new_commit_id,
+                                  GError **error);
+
+/*
+ * Apply the operations in @ops_json to the head of the repo and create a
+ * single commit. @ops_json is an array of objects like
+ * {"op": "mkdir", "path": "/a/b"}. Supported ops are mkdir (with parents),
+ * create (an empty file), delete, rename (with "new_name"), move and copy
+ * (with "dst_dir"). Either all operations are applied or none.
+ * Returns the id of the new head commit.
+ */
+char *
+seaf_repo_manager_apply_batch_ops (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   const char *ops_json,
+                                   const char *user,
+                                   GError **error);
+
 /*
  * Permission related functions.
  */
@@ -615,6 +716,27 @@ seaf_repo_manager_get_repos_by_id_prefix (SeafRepoManager *mgr,
 GList *
 seaf_repo_manager_search_repos_by_name (SeafRepoManager *mgr, const char *name);
 
+/*
+ * Batched lookups for list views, one query per up to 500 ids. Invalid and
+ * unknown ids are skipped.
+ */
+
+/* Same repos as seaf_repo_manager_get_repo(), in the order of @repo_ids. */
+GList *
+seaf_repo_manager_get_repos_by_ids (SeafRepoManager *mgr, GList *repo_ids);
+
+/* Returns a table from repo id to owner. */
+GHashTable *
+seaf_repo_manager_get_repo_owners (SeafRepoManager *mgr, GList *repo_ids);
+
+/* Returns repos with only size and file_count set. */
+GList *
+seaf_repo_manager_get_repo_sizes (SeafRepoManager *mgr, GList *repo_ids,
+                                  gboolean *db_err);
+
+GList *
+seaf_repo_manager_get_head_commits (SeafRepoManager *mgr, GList *repo_ids);
+
 GList *
 seaf_repo_manager_get_repo_ids_by_owner (SeafRepoManager *mgr,
                                          const char *email);
@@ -628,6 +750,16 @@ seaf_repo_manager_add_group_repo (SeafRepoManager *mgr,
                                   const char *owner,
                                   const char *permission,
                                   GError **error);
+
+/* Share @repo_id to the groups in @group_ids it's not shared to yet. */
+int
+seaf_repo_manager_add_group_repos (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   GList *group_ids,
+                                   const char *owner,
+                                   const char *permission,
+                                   GError **error);
+
 int
 seaf_repo_manager_del_group_repo (SeafRepoManager *mgr,
                                   const char *repo_id,
@@ -721,6 +853,25 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
                                     const char *user,
                                     GError **error);
 
+/*
+ * Tells the file server that permissions of @user on @repo_id and its
+ * virtual repos may have been revoked, so that it drops its cached results.
+ * A NULL @repo_id means all repos, a NULL @user means all users.
+ */
+void
+seaf_repo_manager_notify_perm_change (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *user);
+
+/*
+ * Tells the file server that @repo_id became accessible to @user, or to
+ * any user if @user is NULL, so that it drops the cached repo lists.
+ */
+void
+seaf_repo_manager_notify_repo_list_change (SeafRepoManager *mgr,
+                                           const char *repo_id,
+                                           const char *user);
+
 GList *
 seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
                                       const char *repo_id,
@@ -814,6 +965,27 @@ seaf_repo_manager_cleanup_virtual_repos (SeafRepoManager *mgr,
 int
 seaf_repo_manager_init_merge_scheduler ();
 
+/* Fork related. */
+
+/*
+ * Create a library whose history starts from @commit_id of @src_repo_id, or
+ * from its head if @commit_id is NULL. The fork shares the fs and block
+ * store of the source, so nothing is copied. Encrypted libraries are forked
+ * with their password.
+ * Returns the id of the new library.
+ */
+char *
+seaf_repo_manager_fork_repo (SeafRepoManager *mgr,
+                             const char *src_repo_id,
+                             const char *commit_id,
+                             const char *repo_name,
+                             const char *owner,
+                             const char *passwd,
+                             GError **error);
+
+int
+seaf_repo_manager_init_last_modified_cache ();
+
 GList *
 seaf_repo_manager_get_shared_users_for_subdir (SeafRepoManager *mgr,
                                                const char *repo_id,
@@ -904,6 +1076,7 @@ post_files_and_gen_commit (GList *filenames,
                           const char *user,
                           char **ret_json,
                           int replace_existed,
+                          gboolean create_parents,
                           const char *canon_path,
                           GList *id_list,
                           GList *size_list,
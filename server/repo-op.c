@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include <jansson.h>
 #include <openssl/sha.h>
@@ -21,6 +22,11 @@
 #include "seafile-crypt.h"
 #include "diff-simple.h"
 #include "merge-new.h"
+#include "file-rev-index.h"
+#include "lru-cache.h"
+#include "tree-overlay.h"
+#include "upload-trace.h"
+#include "executor.h"
 
 #include "seaf-db.h"
 
@@ -48,6 +54,7 @@ post_files_and_gen_commit (GList *filenames,
                           const char *user,
                           char **ret_json,
                           int replace_existed,
+                          gboolean create_parents,
                           const char *canon_path,
                           GList *id_list,
                           GList *size_list,
@@ -57,29 +64,6 @@ post_files_and_gen_commit (GList *filenames,
  * Repo operations.
  */
 
-static gint
-compare_dirents (gconstpointer a, gconstpointer b)
-{
-    const SeafDirent *ent_a = a, *ent_b = b;
-
-    return strcmp (ent_b->name, ent_a->name);
-}
-
-static inline GList *
-dup_seafdir_entries (const GList *entries)
-{
-    const GList *p;
-    GList *newentries = NULL;
-    SeafDirent *dent;
-    
-    for (p = entries; p; p = p->next) {
-        dent = p->data;
-        newentries = g_list_prepend (newentries, seaf_dirent_dup(dent));
-    }
-
-    return g_list_reverse(newentries);
-}
-
 static gboolean
 filename_exists (GList *entries, const char *filename)
 {
@@ -138,140 +122,48 @@ generate_unique_filename (const char *file, GList *entries)
     }
 }
 
-/* We need to call this function recursively because every dirs in canon_path
- * need to be updated.
- */
 static char *
-post_file_recursive (SeafRepo *repo,
-                     const char *dir_id,
-                     const char *to_path,
-                     int replace_existed,
-                     SeafDirent *newdent)
+do_post_file_replace (SeafRepo *repo,
+                      const char *root_id,
+                      const char *parent_dir,
+                      int replace_existed,
+                      SeafDirent *dent)
 {
-    SeafDir *olddir, *newdir;
-    SeafDirent *dent;
-    GList *ptr;
-    char *slash;
-    char *to_path_dup = NULL;
-    char *remain = NULL;
-    char *id = NULL;
+    TreeOverlay *overlay;
+    TreeOverlayDir *dir;
+    SeafDirent *newdent;
+    char *unique_name;
     char *ret = NULL;
 
-    olddir = seaf_fs_manager_get_seafdir_sorted(seaf->fs_mgr,
-                                                repo->store_id, repo->version,
-                                                dir_id);
-    if (!olddir)
+    overlay = tree_overlay_new (repo->store_id, repo->version, root_id);
+    if (!overlay)
         return NULL;
 
-    /* we reach the target dir.  new dir entry is added */
-    if (*to_path == '\0') {
-        GList *newentries = NULL;
-        char *unique_name;
-        SeafDirent *dent_dup;
-        if (replace_existed && filename_exists(olddir->entries, newdent->name)) {
-            GList *p;
-            SeafDirent *dent;
-
-            for (p = olddir->entries; p; p = p->next) {
-                dent = p->data;
-                if (strcmp(dent->name, newdent->name) == 0) {
-                    newentries = g_list_prepend (newentries, seaf_dirent_dup(newdent));
-                } else {
-                    newentries = g_list_prepend (newentries, seaf_dirent_dup(dent));
-                }
-            }
-            newentries = g_list_reverse (newentries);
-            newdir = seaf_dir_new (NULL, newentries,
-                                   dir_version_from_repo_version(repo->version));
-            if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0) {
-                ret = g_strdup (newdir->dir_id);
-            }
-            seaf_dir_free (newdir);
-            goto out;
-        }
+    dir = tree_overlay_get_dir (overlay, parent_dir, FALSE, NULL);
+    if (!dir)
+        goto out;
 
-        unique_name = generate_unique_filename (newdent->name, olddir->entries);
+    if (replace_existed && tree_overlay_dir_lookup (dir, dent->name)) {
+        tree_overlay_dir_replace (dir, seaf_dirent_dup (dent));
+    } else {
+        unique_name = generate_unique_filename (dent->name,
+                                                tree_overlay_dir_get_entries (dir));
         if (!unique_name)
             goto out;
-        dent_dup = seaf_dirent_new (newdent->version,
-                                    newdent->id, newdent->mode, unique_name,
-                                    newdent->mtime, newdent->modifier, newdent->size);
+        newdent = seaf_dirent_new (dent->version,
+                                   dent->id, dent->mode, unique_name,
+                                   dent->mtime, dent->modifier, dent->size);
         g_free (unique_name);
-
-        newentries = dup_seafdir_entries (olddir->entries);
-
-        newentries = g_list_insert_sorted (newentries,
-                                           dent_dup,
-                                           compare_dirents);
-
-        newdir = seaf_dir_new (NULL, newentries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup (newdir->dir_id);
-        seaf_dir_free (newdir);
-
-        goto out;
-    }
-
-    to_path_dup = g_strdup (to_path);
-    slash = strchr (to_path_dup, '/');
-
-    if (!slash) {
-        remain = to_path_dup + strlen(to_path_dup);
-    } else {
-        *slash = '\0';
-        remain = slash + 1;
+        tree_overlay_dir_add (dir, newdent, NULL);
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
-        id = post_file_recursive (repo, dent->id, remain, replace_existed, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
-    
-    if (id != NULL) {
-        /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strndup (newdir->dir_id, 40);
-        seaf_dir_free (newdir);
-    }
+    ret = tree_overlay_save (overlay);
 
 out:
-    g_free (to_path_dup);
-    g_free (id);
-    seaf_dir_free(olddir);
+    tree_overlay_free (overlay);
     return ret;
 }
 
-static char *
-do_post_file_replace (SeafRepo *repo,
-                      const char *root_id,
-                      const char *parent_dir,
-                      int replace_existed,
-                      SeafDirent *dent)
-{
-    /* if parent_dir is a absolutely path, we will remove the first '/' */
-    if (*parent_dir == '/')
-        parent_dir = parent_dir + 1;
-
-    return post_file_recursive(repo, root_id, parent_dir, replace_existed, dent);
-}
-
 static char *
 do_post_file (SeafRepo *repo,
               const char *root_id,
@@ -448,6 +340,342 @@ gen_merge_description (SeafRepo *repo,
     return desc;
 }
 
+/*
+ * Record the paths @commit changed relative to @parent in the file revision
+ * index of the repo. With @index NULL, the record is only written to disk.
+ */
+static int
+index_commit_changes (SeafRepo *repo, SeafCommit *parent, SeafCommit *commit,
+                      FileRevIndex *index)
+{
+    GList *results = NULL, *paths = NULL, *ptr;
+    DiffEntry *de;
+    int ret = 0;
+
+    if (diff_commit_roots (repo->store_id, repo->version,
+                           parent->root_id, commit->root_id,
+                           &results, TRUE) < 0) {
+        seaf_warning ("Failed to diff commit %s:%s with its parent.\n",
+                      repo->id, commit->commit_id);
+        ret = -1;
+        goto out;
+    }
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        paths = g_list_prepend (paths, de->name);
+        if (de->new_name)
+            paths = g_list_prepend (paths, de->new_name);
+    }
+    file_rev_index_add (index, repo->id, commit->commit_id, paths);
+
+out:
+    g_list_free (paths);
+    for (ptr = results; ptr; ptr = ptr->next)
+        diff_entry_free ((DiffEntry *)ptr->data);
+    g_list_free (results);
+    return ret;
+}
+
+/*
+ * Commit queue.
+ *
+ * Head updates of a repo are serialized through a per-repo queue instead of
+ * racing on the branch and retrying. The first writer to find the queue idle
+ * becomes its leader: it takes all queued commits, chains them onto the
+ * current head, merging where a commit is not based on the tip of the chain,
+ * and moves the head once for the whole chain. The other writers wait for
+ * their results. Another process can still move the head under the leader,
+ * in which case the chain is rebuilt on the new head.
+ */
+
+typedef struct CommitRequest {
+    SeafCommit *base;
+    SeafCommit *new_commit;
+    gboolean retry_on_conflict;
+    char result_id[41];
+    GError *error;
+    gboolean done;
+} CommitRequest;
+
+typedef struct CommitQueue {
+    GQueue *pending;
+    gboolean running;
+} CommitQueue;
+
+static pthread_mutex_t commit_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_queues_cond = PTHREAD_COND_INITIALIZER;
+static GHashTable *commit_queues;       /* repo id -> CommitQueue */
+
+static void
+commit_queue_free (gpointer p)
+{
+    CommitQueue *queue = p;
+
+    g_queue_free (queue->pending);
+    g_free (queue);
+}
+
+/* Merge @new_commit, based on @base, with @head. */
+static SeafCommit *
+merge_with_head (SeafRepo *repo, SeafCommit *base, SeafCommit *head,
+                 SeafCommit *new_commit, GError **error)
+{
+    MergeOptions opt;
+    const char *roots[3];
+    SeafCommit *merged_commit;
+    char *desc = NULL;
+
+    memset (&opt, 0, sizeof(opt));
+    opt.n_ways = 3;
+    memcpy (opt.remote_repo_id, repo->id, 36);
+    memcpy (opt.remote_head, new_commit->commit_id, 40);
+    opt.do_merge = TRUE;
+
+    roots[0] = base->root_id; /* base */
+    roots[1] = head->root_id; /* head */
+    roots[2] = new_commit->root_id;      /* remote */
+
+    if (seaf_merge_trees (repo->store_id, repo->version, 3, roots, &opt) < 0) {
+        seaf_warning ("Failed to merge.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Internal error");
+        return NULL;
+    }
+
+    seaf_debug ("Number of dirs visted in merge %.8s: %d.\n",
+                repo->id, opt.visit_dirs);
+
+    if (!opt.conflict)
+        desc = g_strdup("Auto merge by system");
+    else {
+        desc = gen_merge_description (repo,
+                                      opt.merged_tree_root,
+                                      head->root_id,
+                                      new_commit->root_id);
+        if (!desc)
+            desc = g_strdup("Auto merge by system");
+    }
+
+    merged_commit = seaf_commit_new(NULL, repo->id, opt.merged_tree_root,
+                                    new_commit->creator_name, EMPTY_SHA1,
+                                    desc,
+                                    0);
+    g_free (desc);
+
+    merged_commit->parent_id = g_strdup (head->commit_id);
+    merged_commit->second_parent_id = g_strdup (new_commit->commit_id);
+    merged_commit->new_merge = TRUE;
+    if (opt.conflict)
+        merged_commit->conflict = TRUE;
+    seaf_repo_to_commit (repo, merged_commit);
+
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, merged_commit) < 0) {
+        seaf_warning ("Failed to add commit.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to add commit");
+        seaf_commit_unref (merged_commit);
+        return NULL;
+    }
+
+    index_commit_changes (repo, head, merged_commit, NULL);
+
+    return merged_commit;
+}
+
+static void
+set_commit_request_done (gpointer data, gpointer user_data)
+{
+    ((CommitRequest *)data)->done = TRUE;
+}
+
+static void
+fail_commit_requests (GList *reqs, int code, const char *msg)
+{
+    GList *ptr;
+    CommitRequest *req;
+
+    for (ptr = reqs; ptr; ptr = ptr->next) {
+        req = ptr->data;
+        g_set_error (&req->error, SEAFILE_DOMAIN, code, "%s", msg);
+    }
+}
+
+/* Chain the commits of @batch onto the head and move the head to the tip. */
+static void
+apply_commit_batch (const char *repo_id, GList *batch)
+{
+#define MAX_RETRY_COUNT 3
+
+    SeafRepo *repo = NULL;
+    SeafCommit *head = NULL, *tip = NULL, *merged;
+    CommitRequest *req;
+    GList *todo, *chained = NULL, *ptr;
+    int retry_cnt = 0;
+
+    todo = g_list_copy (batch);
+
+    while (todo) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (!repo) {
+            seaf_warning ("Repo %s doesn't exist.\n", repo_id);
+            fail_commit_requests (todo, SEAF_ERR_GENERAL, "Invalid repo");
+            break;
+        }
+
+        head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                               repo->id, repo->version,
+                                               repo->head->commit_id);
+        if (!head) {
+            seaf_warning ("Failed to find head commit %s of %s.\n",
+                          repo->head->commit_id, repo_id);
+            fail_commit_requests (todo, SEAF_ERR_GENERAL, "Invalid repo");
+            break;
+        }
+
+        seaf_commit_ref (head);
+        tip = head;
+        for (ptr = todo; ptr; ptr = ptr->next) {
+            req = ptr->data;
+            if (strcmp (req->base->commit_id, tip->commit_id) == 0) {
+                seaf_commit_ref (req->new_commit);
+                merged = req->new_commit;
+            } else {
+                merged = merge_with_head (repo, req->base, tip,
+                                          req->new_commit, &req->error);
+                if (!merged)
+                    continue;
+            }
+            memcpy (req->result_id, merged->commit_id, 41);
+            seaf_commit_unref (tip);
+            tip = merged;
+            chained = g_list_prepend (chained, req);
+        }
+        chained = g_list_reverse (chained);
+
+        g_list_free (todo);
+        todo = NULL;
+
+        if (!chained)
+            break;
+
+        seaf_branch_set_commit (repo->head, tip->commit_id);
+        if (seaf_branch_manager_test_and_update_branch (seaf->branch_mgr,
+                                                        repo->head,
+                                                        head->commit_id) == 0)
+            break;
+
+        /* The head was moved by another process, rebuild the chain. */
+        for (ptr = chained; ptr; ptr = ptr->next) {
+            req = ptr->data;
+            if (!req->retry_on_conflict)
+                g_set_error (&req->error, SEAFILE_DOMAIN,
+                             SEAF_ERR_CONCURRENT_UPLOAD, "Concurrent upload");
+            else
+                todo = g_list_prepend (todo, req);
+        }
+        todo = g_list_reverse (todo);
+        g_list_free (chained);
+        chained = NULL;
+
+        seaf_commit_unref (tip);
+        tip = NULL;
+        seaf_commit_unref (head);
+        head = NULL;
+        seaf_repo_unref (repo);
+        repo = NULL;
+
+        if (todo && ++retry_cnt > MAX_RETRY_COUNT) {
+            seaf_warning ("Stop updating repo %s after %d retries.\n",
+                          repo_id, MAX_RETRY_COUNT);
+            fail_commit_requests (todo, SEAF_ERR_GENERAL, "Concurrent update");
+            break;
+        }
+        if (todo)
+            /* Sleep random time between 100 and 1000 millisecs. */
+            usleep (g_random_int_range(1, 11) * 100 * 1000);
+    }
+
+    if (chained && g_list_length (chained) > 1)
+        seaf_debug ("Moved head of repo %.8s over %u queued commits.\n",
+                    repo_id, g_list_length (chained));
+
+    g_list_free (todo);
+    g_list_free (chained);
+    seaf_commit_unref (tip);
+    seaf_commit_unref (head);
+    seaf_repo_unref (repo);
+}
+
+int
+seaf_repo_manager_commit_to_head (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  SeafCommit *base,
+                                  SeafCommit *new_commit,
+                                  gboolean retry_on_conflict,
+                                  char *new_commit_id,
+                                  GError **error)
+{
+    CommitRequest req;
+    CommitQueue *queue;
+    GList *batch;
+    gpointer p;
+
+    memset (&req, 0, sizeof(req));
+    req.base = base;
+    req.new_commit = new_commit;
+    req.retry_on_conflict = retry_on_conflict;
+
+    pthread_mutex_lock (&commit_queues_lock);
+
+    if (!commit_queues)
+        commit_queues = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, commit_queue_free);
+    queue = g_hash_table_lookup (commit_queues, repo_id);
+    if (!queue) {
+        queue = g_new0 (CommitQueue, 1);
+        queue->pending = g_queue_new ();
+        g_hash_table_insert (commit_queues, g_strdup (repo_id), queue);
+    }
+    g_queue_push_tail (queue->pending, &req);
+
+    while (!req.done) {
+        if (queue->running) {
+            pthread_cond_wait (&commit_queues_cond, &commit_queues_lock);
+            continue;
+        }
+
+        queue->running = TRUE;
+        batch = NULL;
+        while ((p = g_queue_pop_head (queue->pending)) != NULL)
+            batch = g_list_prepend (batch, p);
+        batch = g_list_reverse (batch);
+        pthread_mutex_unlock (&commit_queues_lock);
+
+        apply_commit_batch (repo_id, batch);
+
+        pthread_mutex_lock (&commit_queues_lock);
+        g_list_foreach (batch, set_commit_request_done, NULL);
+        g_list_free (batch);
+        queue->running = FALSE;
+        /* Waiters still reference the queue while it has pending requests. */
+        if (g_queue_is_empty (queue->pending))
+            g_hash_table_remove (commit_queues, repo_id);
+        pthread_cond_broadcast (&commit_queues_cond);
+    }
+
+    pthread_mutex_unlock (&commit_queues_lock);
+
+    if (req.error) {
+        g_propagate_error (error, req.error);
+        return -1;
+    }
+
+    if (new_commit_id)
+        memcpy (new_commit_id, req.result_id, 41);
+    return 0;
+}
+
 static int
 gen_new_commit (const char *repo_id,
                 SeafCommit *base,
@@ -458,11 +686,9 @@ gen_new_commit (const char *repo_id,
                 gboolean retry_on_conflict,
                 GError **error)
 {
-#define MAX_RETRY_COUNT 3
-
     SeafRepo *repo = NULL;
-    SeafCommit *new_commit = NULL, *current_head = NULL, *merged_commit = NULL;
-    int retry_cnt = 0;
+    SeafCommit *new_commit = NULL;
+    gint64 start = g_get_monotonic_time ();
     int ret = 0;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
@@ -488,127 +714,21 @@ gen_new_commit (const char *repo_id,
         goto out;
     }
 
-retry:
-    current_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                   repo->id, repo->version, 
-                                                   repo->head->commit_id);
-    if (!current_head) {
-        seaf_warning ("Failed to find head commit %s of %s.\n",
-                      repo->head->commit_id, repo_id);
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Invalid repo");
+    index_commit_changes (repo, base, new_commit, NULL);
+
+    if (seaf_repo_manager_commit_to_head (seaf->repo_mgr, repo_id,
+                                          base, new_commit, retry_on_conflict,
+                                          new_commit_id, error) < 0) {
         ret = -1;
         goto out;
     }
 
-    /* Merge if base and head are not the same. */
-    if (strcmp (base->commit_id, current_head->commit_id) != 0) {
-        MergeOptions opt;
-        const char *roots[3];
-        char *desc = NULL;
-
-        memset (&opt, 0, sizeof(opt));
-        opt.n_ways = 3;
-        memcpy (opt.remote_repo_id, repo_id, 36);
-        memcpy (opt.remote_head, new_commit->commit_id, 40);
-        opt.do_merge = TRUE;
-
-        roots[0] = base->root_id; /* base */
-        roots[1] = current_head->root_id; /* head */
-        roots[2] = new_root;      /* remote */
-
-        if (seaf_merge_trees (repo->store_id, repo->version, 3, roots, &opt) < 0) {
-            seaf_warning ("Failed to merge.\n");
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                         "Internal error");
-            ret = -1;
-            goto out;
-        }
-
-        seaf_debug ("Number of dirs visted in merge %.8s: %d.\n",
-                    repo_id, opt.visit_dirs);
-
-        if (!opt.conflict)
-            desc = g_strdup("Auto merge by system");
-        else {
-            desc = gen_merge_description (repo,
-                                          opt.merged_tree_root,
-                                          current_head->root_id,
-                                          new_root);
-            if (!desc)
-                desc = g_strdup("Auto merge by system");
-        }
-
-        merged_commit = seaf_commit_new(NULL, repo->id, opt.merged_tree_root,
-                                        user, EMPTY_SHA1,
-                                        desc,
-                                        0);
-        g_free (desc);
-
-        merged_commit->parent_id = g_strdup (current_head->commit_id);
-        merged_commit->second_parent_id = g_strdup (new_commit->commit_id);
-        merged_commit->new_merge = TRUE;
-        if (opt.conflict)
-            merged_commit->conflict = TRUE;
-        seaf_repo_to_commit (repo, merged_commit);
-
-        if (seaf_commit_manager_add_commit (seaf->commit_mgr, merged_commit) < 0) {
-            seaf_warning ("Failed to add commit.\n");
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                         "Failed to add commit");
-            ret = -1;
-            goto out;
-        }
-    } else {
-        seaf_commit_ref (new_commit);
-        merged_commit = new_commit;
-    }
-
-    seaf_branch_set_commit(repo->head, merged_commit->commit_id);
-
-    if (seaf_branch_manager_test_and_update_branch(seaf->branch_mgr,
-                                                   repo->head,
-                                                   current_head->commit_id) < 0)
-    {
-        if (!retry_on_conflict) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_CONCURRENT_UPLOAD, "Concurrent upload");
-            ret = -1;
-            goto out;
-        }
-        seaf_repo_unref (repo);
-        repo = NULL;
-        seaf_commit_unref (current_head);
-        current_head = NULL;
-        seaf_commit_unref (merged_commit);
-        merged_commit = NULL;
-
-        if (++retry_cnt <= MAX_RETRY_COUNT) {
-            /* Sleep random time between 100 and 1000 millisecs. */
-            usleep (g_random_int_range(1, 11) * 100 * 1000);
-
-            repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-            if (!repo) {
-                seaf_warning ("Repo %s doesn't exist.\n", repo_id);
-                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Invalid repo");
-                ret = -1;
-                goto out;
-            }
-
-            goto retry;
-        } else {
-            seaf_warning ("Stop updating repo %s after %d retries.\n", repo_id, MAX_RETRY_COUNT);
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Concurrent update");
-            ret = -1;
-            goto out;
-        }
-    }
-
-    if (new_commit_id)
-        memcpy (new_commit_id, merged_commit->commit_id, 41);
+    if (strcmp (desc, SEAF_COMMIT_DESC_PENDING) == 0)
+        schedule_commit_desc (seaf->desc_sched, repo_id, new_commit->commit_id);
 
 out:
+    upload_trace_add (upload_trace_current (), UPLOAD_STAGE_COMMIT, start);
     seaf_commit_unref (new_commit);
-    seaf_commit_unref (current_head);
-    seaf_commit_unref (merged_commit);
     seaf_repo_unref (repo);
     return ret;
 }
@@ -686,16 +806,18 @@ seaf_repo_manager_post_file (SeafRepoManager *mgr,
     }
 
     gint64 size;
+    gint64 index_start = g_get_monotonic_time ();
     if (seaf_fs_manager_index_blocks (seaf->fs_mgr,
                                       repo->store_id, repo->version,
                                       temp_file_path,
-                                      sha1, &size, crypt, TRUE, FALSE, NULL) < 0) {
+                                      sha1, &size, crypt, TRUE, FALSE, NULL, NULL) < 0) {
         seaf_warning ("failed to index blocks");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                      "Failed to index blocks");
         ret = -1;
         goto out;
     }
+    upload_trace_add (upload_trace_current (), UPLOAD_STAGE_INDEX, index_start);
 
     rawdata_to_hex(sha1, hex, 20);
     new_dent = seaf_dirent_new (dir_version_from_repo_version (repo->version),
@@ -723,6 +845,7 @@ retry:
         }
 
         retry_cnt++;
+        upload_trace_add_retry (upload_trace_current ());
         seaf_debug ("[post file] Concurrent upload retry :%d\n", retry_cnt);
         /* Sleep random time between 0 and 3 seconds. */
         usleep (g_random_int_range(0, 30) * 100 * 1000);
@@ -758,7 +881,7 @@ out:
 }
 
 static int
-add_new_entries (SeafRepo *repo, const char *user, GList **entries,
+add_new_entries (SeafRepo *repo, const char *user, TreeOverlayDir *dir,
                  GList *dents, int replace_existed, GList **name_list)
 {
     GList *ptr;
@@ -769,32 +892,18 @@ add_new_entries (SeafRepo *repo, const char *user, GList **entries,
 
         char *unique_name;
         SeafDirent *newdent;
-        gboolean replace = FALSE;
-
-        if (replace_existed) {
-            GList *p;
-            SeafDirent *tmp_dent;
-            for (p = *entries; p; p = p->next) {
-                tmp_dent = p->data;
-                if (strcmp(tmp_dent->name, dent->name) == 0) {
-                    replace = TRUE;
-                    *entries = g_list_delete_link (*entries, p);
-                    seaf_dirent_free (tmp_dent);
-                    break;
-                }
-            }
-        }
 
-        if (replace)
+        if (replace_existed && tree_overlay_dir_remove (dir, dent->name) == 0)
             unique_name = g_strdup (dent->name);
         else
-            unique_name = generate_unique_filename (dent->name, *entries);
+            unique_name = generate_unique_filename (dent->name,
+                                                    tree_overlay_dir_get_entries (dir));
 
         if (unique_name != NULL) {
             newdent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
                                        dent->id, dent->mode, unique_name,
                                        dent->mtime, user, dent->size);
-            *entries = g_list_insert_sorted (*entries, newdent, compare_dirents);
+            tree_overlay_dir_add (dir, newdent, NULL);
             *name_list = g_list_append (*name_list, unique_name);
             /* No need to free unique_name */
         } else {
@@ -806,114 +915,35 @@ add_new_entries (SeafRepo *repo, const char *user, GList **entries,
 }
 
 static char *
-post_multi_files_recursive (SeafRepo *repo,
-                            const char *dir_id,
-                            const char *to_path,
-                            GList *dents,
-                            const char *user,
-                            int replace_existed,
-                            GList **name_list)
+do_post_multi_files (SeafRepo *repo,
+                     const char *root_id,
+                     const char *parent_dir,
+                     GList *filenames,
+                     GList *id_list,
+                     GList *size_list,
+                     const char *user,
+                     int replace_existed,
+                     gboolean create_parents,
+                     GList **name_list)
 {
-    SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
-    char *slash;
-    char *to_path_dup = NULL;
-    char *remain = NULL;
-    char *id = NULL;
+    GList *dents = NULL;
+    GList *ptr1, *ptr2, *ptr3;
+    TreeOverlay *overlay;
+    TreeOverlayDir *dir;
     char *ret = NULL;
 
-    olddir = seaf_fs_manager_get_seafdir_sorted(seaf->fs_mgr,
-                                                repo->store_id,
-                                                repo->version,
-                                                dir_id);
-    if (!olddir)
+    overlay = tree_overlay_new (repo->store_id, repo->version, root_id);
+    if (!overlay)
         return NULL;
 
-    /* we reach the target dir.  new dir entry is added */
-    if (*to_path == '\0') {
-        GList *newentries;
-
-        newentries = dup_seafdir_entries (olddir->entries);
-
-        if (add_new_entries (repo, user,
-                             &newentries, dents, replace_existed, name_list) < 0)
-            goto out;
-
-        newdir = seaf_dir_new (NULL, newentries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup (newdir->dir_id);
-        seaf_dir_free (newdir);
-
+    dir = tree_overlay_get_dir (overlay, parent_dir, create_parents, NULL);
+    if (!dir)
         goto out;
-    }
 
-    to_path_dup = g_strdup (to_path);
-    slash = strchr (to_path_dup, '/');
-
-    if (!slash) {
-        remain = to_path_dup + strlen(to_path_dup);
-    } else {
-        *slash = '\0';
-        remain = slash + 1;
-    }
-
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
-        id = post_multi_files_recursive (repo, dent->id, remain, dents, user,
-                                         replace_existed, name_list);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
-    
-    if (id != NULL) {
-        /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup (newdir->dir_id);
-        seaf_dir_free (newdir);
-    }
-
-out:
-    g_free (to_path_dup);
-    g_free (id);
-    seaf_dir_free(olddir);
-    return ret;
-}
-
-static char *
-do_post_multi_files (SeafRepo *repo,
-                     const char *root_id,
-                     const char *parent_dir,
-                     GList *filenames,
-                     GList *id_list,
-                     GList *size_list,
-                     const char *user,
-                     int replace_existed,
-                     GList **name_list)
-{
-    SeafDirent *dent;
-    GList *dents = NULL;
-    GList *ptr1, *ptr2, *ptr3;
-    char *ret;
-
-    for (ptr1 = filenames, ptr2 = id_list, ptr3 = size_list;
-         ptr1 && ptr2 && ptr3;
-         ptr1 = ptr1->next, ptr2 = ptr2->next, ptr3 = ptr3->next) {
+    for (ptr1 = filenames, ptr2 = id_list, ptr3 = size_list;
+         ptr1 && ptr2 && ptr3;
+         ptr1 = ptr1->next, ptr2 = ptr2->next, ptr3 = ptr3->next) {
 
         char *name = ptr1->data;
         char *id = ptr2->data;
@@ -929,14 +959,15 @@ do_post_multi_files (SeafRepo *repo,
 
         dents = g_list_append (dents, dent);
     }
-    /* if parent_dir is a absolutely path, we will remove the first '/' */
-    if (*parent_dir == '/')
-        parent_dir = parent_dir + 1;
 
-    ret = post_multi_files_recursive(repo, root_id, parent_dir,
-                                     dents, user, replace_existed, name_list);
-    g_list_free_full (dents, g_free);
+    if (add_new_entries (repo, user, dir, dents, replace_existed, name_list) < 0)
+        goto out;
 
+    ret = tree_overlay_save (overlay);
+
+out:
+    g_list_free_full (dents, g_free);
+    tree_overlay_free (overlay);
     return ret;
 }
 
@@ -1018,6 +1049,32 @@ format_json_ret (GList *name_list, GList *id_list, GList *size_list)
     return ret;
 }
 
+static int
+check_post_files_args (GList *filenames, const char *parent_dir, GError **error)
+{
+    GList *ptr;
+    char *filename;
+
+    for (ptr = filenames; ptr; ptr = ptr->next) {
+        filename = ptr->data;
+        if (should_ignore_file (filename, NULL)) {
+            seaf_debug ("[post files] Invalid filename %s.\n", filename);
+            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
+                         "%s", filename);
+            return -1;
+        }
+    }
+
+    if (strstr (parent_dir, "//") != NULL) {
+        seaf_debug ("[post file] parent_dir cantains // sequence.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid parent dir");
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *repo_id,
@@ -1026,6 +1083,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *paths_json,
                                     const char *user,
                                     int replace_existed,
+                                    gboolean create_parents,
                                     char **ret_json,
                                     char **task_id,
                                     GError **error)
@@ -1033,7 +1091,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     SeafRepo *repo = NULL;
     char *canon_path = NULL;
     GList *filenames = NULL, *paths = NULL, *id_list = NULL, *size_list = NULL, *ptr;
-    char *filename, *path;
+    char *path;
     unsigned char sha1[20];
     SeafileCrypt *crypt = NULL;
     char hex[41];
@@ -1053,22 +1111,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
         goto out;
     }
 
-    /* Check inputs. */
-    for (ptr = filenames; ptr; ptr = ptr->next) {
-        filename = ptr->data;
-        if (should_ignore_file (filename, NULL)) {
-            seaf_debug ("[post files] Invalid filename %s.\n", filename);
-            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
-                         "%s", filename);
-            ret = -1;
-            goto out;
-        }
-    }
-
-    if (strstr (parent_dir, "//") != NULL) {
-        seaf_debug ("[post file] parent_dir cantains // sequence.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
-                     "Invalid parent dir");
+    if (check_post_files_args (filenames, parent_dir, error) < 0) {
         ret = -1;
         goto out;
     }
@@ -1090,13 +1133,14 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
 
     if (!task_id) {
         gint64 *size;
+        gint64 index_start = g_get_monotonic_time ();
         for (ptr = paths; ptr; ptr = ptr->next) {
             path = ptr->data;
 
             size = g_new (gint64, 1);
             if (seaf_fs_manager_index_blocks (seaf->fs_mgr,
                                               repo->store_id, repo->version,
-                                              path, sha1, size, crypt, TRUE, FALSE, NULL) < 0) {
+                                              path, sha1, size, crypt, TRUE, FALSE, NULL, NULL) < 0) {
                 seaf_warning ("failed to index blocks");
                 g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                              "Failed to index blocks");
@@ -1110,12 +1154,14 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
         }
         id_list = g_list_reverse (id_list);
         size_list = g_list_reverse (size_list);
+        upload_trace_add (upload_trace_current (), UPLOAD_STAGE_INDEX, index_start);
 
         ret = post_files_and_gen_commit (filenames,
                                          repo->id,
                                          user,
                                          ret_json,
                                          replace_existed,
+                                         create_parents,
                                          canon_path,
                                          id_list,
                                          size_list,
@@ -1127,6 +1173,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                             repo_id,
                                             user,
                                             replace_existed,
+                                            create_parents,
                                             ret_json == NULL ? FALSE : TRUE,
                                             canon_path,
                                             crypt,
@@ -1148,12 +1195,54 @@ out:
     return ret;
 }
 
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      GList *filenames,
+                                      GList *id_list,
+                                      GList *size_list,
+                                      const char *user,
+                                      int replace_existed,
+                                      gboolean create_parents,
+                                      char **ret_json,
+                                      GError **error)
+{
+    char *canon_path = NULL;
+    int ret = 0;
+
+    if (!filenames || g_list_length (filenames) != g_list_length (id_list)) {
+        seaf_debug ("[post files] Invalid filenames or file ids.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid files");
+        return -1;
+    }
+
+    if (check_post_files_args (filenames, parent_dir, error) < 0)
+        return -1;
+
+    canon_path = get_canonical_path (parent_dir);
+    ret = post_files_and_gen_commit (filenames,
+                                     repo_id,
+                                     user,
+                                     ret_json,
+                                     replace_existed,
+                                     create_parents,
+                                     canon_path,
+                                     id_list,
+                                     size_list,
+                                     error);
+    g_free (canon_path);
+
+    return ret;
+}
+
 int
 post_files_and_gen_commit (GList *filenames,
                            const char *repo_id,
                            const char *user,
                            char **ret_json,
                            int replace_existed,
+                           gboolean create_parents,
                            const char *canon_path,
                            GList *id_list,
                            GList *size_list,
@@ -1164,6 +1253,8 @@ post_files_and_gen_commit (GList *filenames,
     GString *buf = g_string_new (NULL);
     SeafCommit *head_commit = NULL;
     char *root_id = NULL;
+    UploadTrace *trace = upload_trace_current ();
+    gint64 tree_start;
     int ret = 0;
     int retry_cnt = 0;
 
@@ -1172,9 +1263,11 @@ post_files_and_gen_commit (GList *filenames,
 
 retry:
     /* Add the files to parent dir and commit. */
+    tree_start = g_get_monotonic_time ();
     root_id = do_post_multi_files (repo, head_commit->root_id, canon_path,
                                    filenames, id_list, size_list, user,
-                                   replace_existed, &name_list);
+                                   replace_existed, create_parents, &name_list);
+    upload_trace_add (trace, UPLOAD_STAGE_TREE, tree_start);
     if (!root_id) {
         seaf_warning ("[post multi-file] Failed to post files to %s in repo %s.\n",
                       canon_path, repo->id);
@@ -1198,6 +1291,7 @@ retry:
         }
 
         retry_cnt++;
+        upload_trace_add_retry (trace);
         seaf_debug ("[post multi-file] Concurrent upload retry :%d\n", retry_cnt);
 
         /* Sleep random time between 0 and 3 seconds. */
@@ -1542,149 +1636,61 @@ out:
 }
 
 static char *
-del_file_recursive(SeafRepo *repo,
-                   const char *dir_id,
-                   const char *to_path,
-                   const char *filename,
-                   int *mode, int *p_deleted_num, char **desc_file)
+do_del_file(SeafRepo *repo,
+            const char *root_id,
+            const char *parent_dir,
+            const char *file_name,
+            int *mode, int *p_deleted_num, char **desc_file)
 {
-    SeafDir *olddir, *newdir;
+    TreeOverlay *overlay;
+    TreeOverlayDir *dir;
     SeafDirent *dent;
-    GList *ptr;
-    char *to_path_dup = NULL;
-    char *remain = NULL;
-    char *slash;
-    char *id = NULL;
-    char *ret = NULL;
+    GList *filenames = NULL, *deleted = NULL, *p, *ptr;
     int deleted_num = 0;
+    char *ret = NULL;
 
-    olddir = seaf_fs_manager_get_seafdir_sorted(seaf->fs_mgr,
-                                                repo->store_id, repo->version,
-                                                dir_id);
-    if (!olddir)
-        return NULL;
-
-    /* we reach the target dir. Remove the given entry from it. */
-    if (*to_path == '\0') {
-        SeafDirent *old, *new;
-        GList *newentries = NULL, *p;
-        GList *filenames = NULL, *ptr;
-        char *name;
-        int found_flag;
-
-        filenames = json_to_file_list (filename);
-        if (!filenames) {
-            seaf_dir_free(olddir);
-            return NULL;
-        }
-
-        for (p = olddir->entries; p != NULL; p = p->next) {
-            found_flag = 0;
-            old = p->data;
-            for (ptr = filenames; ptr; ptr = ptr->next) {
-                name = ptr->data;
-                if (strcmp(old->name, name) == 0) {
-                    found_flag = 1;
-                    deleted_num++;
-                    if (mode)
-                        *mode = old->mode;
-                    if (desc_file && *desc_file==NULL)
-                        *desc_file = g_strdup(old->name);
-                    break;
-                }
-            }
-            if (!found_flag) {
-                new = seaf_dirent_dup (old);
-                newentries = g_list_prepend (newentries, new);
-            }
-        }
-
-        string_list_free (filenames);
-
-        if (deleted_num == 0) {
-            ret = g_strdup(olddir->dir_id);
-            if (newentries)
-                g_list_free_full (newentries, (GDestroyNotify)seaf_dirent_free);
-            goto out;
-        }
-
-        newentries = g_list_reverse (newentries);
+    overlay = tree_overlay_new (repo->store_id, repo->version, root_id);
+    if (!overlay)
+        goto out;
 
-        newdir = seaf_dir_new(NULL, newentries,
-                              dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save(seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup(newdir->dir_id);
-        seaf_dir_free(newdir);
+    dir = tree_overlay_get_dir (overlay, parent_dir, FALSE, NULL);
+    if (!dir)
         goto out;
-    }
 
-    to_path_dup = g_strdup (to_path);
-    slash = strchr (to_path_dup, '/');
+    filenames = json_to_file_list (file_name);
+    if (!filenames)
+        goto out;
 
-    if (!slash) {
-        remain = to_path_dup + strlen(to_path_dup);
-    } else {
-        *slash = '\0';
-        remain = slash + 1;
+    for (p = tree_overlay_dir_get_entries (dir); p != NULL; p = p->next) {
+        dent = p->data;
+        for (ptr = filenames; ptr; ptr = ptr->next) {
+            if (strcmp(dent->name, ptr->data) == 0) {
+                deleted_num++;
+                if (mode)
+                    *mode = dent->mode;
+                if (desc_file && *desc_file==NULL)
+                    *desc_file = g_strdup(dent->name);
+                deleted = g_list_prepend (deleted, ptr->data);
+                break;
+            }
+        }
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
+    for (ptr = deleted; ptr; ptr = ptr->next)
+        tree_overlay_dir_remove (dir, ptr->data);
 
-        id = del_file_recursive(repo, dent->id, remain, filename,
-                                mode, &deleted_num, desc_file);
-        if (id != NULL && deleted_num > 0) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
-    if (id != NULL) {
-        if (deleted_num == 0) {
-            ret = g_strdup(olddir->dir_id);
-        } else {
-            /* Create a new SeafDir. */
-            GList *new_entries;
-        
-            new_entries = dup_seafdir_entries (olddir->entries);
-            newdir = seaf_dir_new (NULL, new_entries,
-                                   dir_version_from_repo_version(repo->version));
-            if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-                ret = g_strdup (newdir->dir_id);
-            seaf_dir_free (newdir);
-        }
-    }
+    ret = tree_overlay_save (overlay);
 
 out:
     if (p_deleted_num)
         *p_deleted_num = deleted_num;
 
-    g_free (to_path_dup);
-    g_free (id);
-    seaf_dir_free(olddir);
+    g_list_free (deleted);
+    string_list_free (filenames);
+    tree_overlay_free (overlay);
     return ret;
 }
 
-static char *
-do_del_file(SeafRepo *repo,
-            const char *root_id,
-            const char *parent_dir,
-            const char *file_name,
-            int *mode, int *deleted_num, char **desc_file)
-{
-    /* if parent_dir is a absolutely path, we will remove the first '/' */
-    if (*parent_dir == '/')
-        parent_dir = parent_dir + 1;
-
-    return del_file_recursive(repo, root_id, parent_dir, file_name,
-                              mode, deleted_num, desc_file);
-}
-
 int
 seaf_repo_manager_del_file (SeafRepoManager *mgr,
                             const char *repo_id,
@@ -1895,9 +1901,51 @@ out:
     return ret;
 }
 
+typedef struct CopyBlocksData {
+    SeafRepo *src_repo;
+    SeafRepo *dst_repo;
+    Seafile *file;
+    CopyTask *task;
+} CopyBlocksData;
+
+static gboolean
+copy_block (int i, void *vdata)
+{
+    CopyBlocksData *data = vdata;
+    Seafile *file = data->file;
+    const char *block_id = file->blk_sha1s[i];
+    gint64 bytes;
+
+    /* Check cancel before copying a block. */
+    if (data->task && g_atomic_int_get (&data->task->canceled))
+        return FALSE;
+
+    if (seaf_block_manager_copy_block (seaf->block_mgr,
+                                       data->src_repo->store_id,
+                                       data->src_repo->version,
+                                       data->dst_repo->store_id,
+                                       data->dst_repo->version,
+                                       block_id) < 0) {
+        seaf_warning ("Failed to copy block %s from repo %s to %s.\n",
+                      block_id, data->src_repo->id, data->dst_repo->id);
+        return FALSE;
+    }
+
+    /* Block sizes are not stored in the file object, count an even share
+     * of the file size for every block.
+     */
+    bytes = file->file_size / file->n_blocks;
+    if (i == file->n_blocks - 1)
+        bytes += file->file_size % file->n_blocks;
+    seaf_copy_manager_add_progress (seaf->copy_mgr, data->task, 0, bytes);
+
+    return TRUE;
+}
+
+/* Copy a file object and its blocks, on up to @max_workers threads. */
 static char *
 copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
-              CopyTask *task, guint64 *size)
+              CopyTask *task, int max_workers, guint64 *size)
 {
     Seafile *file;
 
@@ -1923,29 +1971,28 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
         return NULL;
     }
 
+    CopyBlocksData data;
+    gboolean *results;
     int i;
-    char *block_id;
-    for (i = 0; i < file->n_blocks; ++i) {
-        /* Check cancel before copying a block. */
-        if (task && g_atomic_int_get (&task->canceled)) {
-            seafile_unref (file);
-            return NULL;
-        }
 
-        block_id = file->blk_sha1s[i];
-        if (seaf_block_manager_copy_block (seaf->block_mgr,
-                                           src_repo->store_id, src_repo->version,
-                                           dst_repo->store_id, dst_repo->version,
-                                           block_id) < 0) {
-            seaf_warning ("Failed to copy block %s from repo %s to %s.\n",
-                          block_id, src_repo->id, dst_repo->id);
+    data.src_repo = src_repo;
+    data.dst_repo = dst_repo;
+    data.file = file;
+    data.task = task;
+
+    results = g_new0 (gboolean, file->n_blocks);
+    run_parallel_jobs (file->n_blocks, max_workers,
+                       copy_block, &data, results);
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (!results[i]) {
+            g_free (results);
             seafile_unref (file);
             return NULL;
         }
     }
+    g_free (results);
 
-    if (task)
-        ++(task->done);
+    seaf_copy_manager_add_progress (seaf->copy_mgr, task, 1, 0);
 
     *size = file->file_size;
     char *ret = g_strdup(file->file_id);
@@ -1954,63 +2001,187 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
     return ret;
 }
 
-static char *
-copy_recursive (SeafRepo *src_repo, SeafRepo *dst_repo,
-                const char *obj_id, guint32 mode, const char *modifier,
-                CopyTask *task, guint64 *size)
+/*
+ * A dir tree is copied in three passes: collect the files of the tree,
+ * copy the files on the workers of the task, then write the dirs, which
+ * need the sizes of the copied files.
+ */
+
+typedef struct CopyFilesData {
+    SeafRepo *src_repo;
+    SeafRepo *dst_repo;
+    CopyTask *task;
+    /* file id -> index of the file */
+    GHashTable *index;
+    GPtrArray *file_ids;
+    guint64 *sizes;
+    int block_workers;
+} CopyFilesData;
+
+static int
+collect_files (CopyFilesData *data, const char *dir_id)
 {
-    if (S_ISREG(mode)) {
-        return copy_seafile (src_repo, dst_repo, obj_id, task, size);
-    } else if (S_ISDIR(mode)) {
-        SeafDir *src_dir = NULL, *dst_dir = NULL;
-        GList *dst_ents = NULL, *ptr;
-        char *new_id = NULL;
-        SeafDirent *dent, *new_dent = NULL;
-
-        src_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                               src_repo->store_id,
-                                               src_repo->version,
-                                               obj_id);
-        if (!src_dir) {
-            seaf_warning ("Seafdir %s doesn't exist in repo %s.\n",
-                          obj_id, src_repo->id);
-            return NULL;
+    SeafDir *dir;
+    GList *ptr;
+    SeafDirent *dent;
+    int ret = 0;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       data->src_repo->store_id,
+                                       data->src_repo->version,
+                                       dir_id);
+    if (!dir) {
+        seaf_warning ("Seafdir %s doesn't exist in repo %s.\n",
+                      dir_id, data->src_repo->id);
+        return -1;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISDIR(dent->mode)) {
+            if (collect_files (data, dent->id) < 0) {
+                ret = -1;
+                break;
+            }
+        } else if (!g_hash_table_lookup (data->index, dent->id)) {
+            g_ptr_array_add (data->file_ids, g_strdup(dent->id));
+            g_hash_table_insert (data->index,
+                                 g_ptr_array_index (data->file_ids,
+                                                    data->file_ids->len - 1),
+                                 GINT_TO_POINTER(data->file_ids->len));
         }
+    }
+
+    seaf_dir_free (dir);
+    return ret;
+}
+
+static gboolean
+copy_file_job (int i, void *vdata)
+{
+    CopyFilesData *data = vdata;
+    char *new_id;
 
-        for (ptr = src_dir->entries; ptr; ptr = ptr->next) {
-            dent = ptr->data;
+    if (data->task && g_atomic_int_get (&data->task->canceled))
+        return FALSE;
+
+    new_id = copy_seafile (data->src_repo, data->dst_repo,
+                           g_ptr_array_index (data->file_ids, i),
+                           data->task, data->block_workers,
+                           &data->sizes[i]);
+    if (!new_id)
+        return FALSE;
+    g_free (new_id);
+    return TRUE;
+}
+
+static char *
+copy_dirs (CopyFilesData *data, const char *obj_id, const char *modifier)
+{
+    SeafRepo *src_repo = data->src_repo, *dst_repo = data->dst_repo;
+    SeafDir *src_dir = NULL, *dst_dir = NULL;
+    GList *dst_ents = NULL, *ptr;
+    char *new_id = NULL;
+    SeafDirent *dent, *new_dent = NULL;
+    guint64 new_size;
+
+    src_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                           src_repo->store_id,
+                                           src_repo->version,
+                                           obj_id);
+    if (!src_dir) {
+        seaf_warning ("Seafdir %s doesn't exist in repo %s.\n",
+                      obj_id, src_repo->id);
+        return NULL;
+    }
+
+    for (ptr = src_dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
 
-            guint64 new_size = 0;
-            new_id = copy_recursive (src_repo, dst_repo,
-                                     dent->id, dent->mode, modifier, task, &new_size);
+        if (S_ISDIR(dent->mode)) {
+            new_id = copy_dirs (data, dent->id, modifier);
             if (!new_id) {
                 seaf_dir_free (src_dir);
+                g_list_free_full (dst_ents, (GDestroyNotify)seaf_dirent_free);
                 return NULL;
             }
-
-            new_dent = seaf_dirent_new (dir_version_from_repo_version(dst_repo->version),
-                                        new_id, dent->mode, dent->name,
-                                        dent->mtime, modifier, new_size);
-            dst_ents = g_list_prepend (dst_ents, new_dent);
-            g_free (new_id);
+            new_size = 0;
+        } else {
+            int idx = GPOINTER_TO_INT(g_hash_table_lookup (data->index, dent->id));
+            new_id = g_strdup(dent->id);
+            new_size = data->sizes[idx - 1];
         }
-        dst_ents = g_list_reverse (dst_ents);
 
-        seaf_dir_free (src_dir);
+        new_dent = seaf_dirent_new (dir_version_from_repo_version(dst_repo->version),
+                                    new_id, dent->mode, dent->name,
+                                    dent->mtime, modifier, new_size);
+        dst_ents = g_list_prepend (dst_ents, new_dent);
+        g_free (new_id);
+    }
+    dst_ents = g_list_reverse (dst_ents);
+
+    seaf_dir_free (src_dir);
 
-        dst_dir = seaf_dir_new (NULL, dst_ents,
-                                dir_version_from_repo_version(dst_repo->version));
-        if (seaf_dir_save (seaf->fs_mgr,
-                           dst_repo->store_id, dst_repo->version,
-                           dst_dir) < 0) {
-            seaf_warning ("Failed to save new dir.\n");
-            seaf_dir_free (dst_dir);
-            return NULL;
+    dst_dir = seaf_dir_new (NULL, dst_ents,
+                            dir_version_from_repo_version(dst_repo->version));
+    if (seaf_dir_save (seaf->fs_mgr,
+                       dst_repo->store_id, dst_repo->version,
+                       dst_dir) < 0) {
+        seaf_warning ("Failed to save new dir.\n");
+        seaf_dir_free (dst_dir);
+        return NULL;
+    }
+
+    char *ret = g_strdup(dst_dir->dir_id);
+    seaf_dir_free (dst_dir);
+    return ret;
+}
+
+static char *
+copy_recursive (SeafRepo *src_repo, SeafRepo *dst_repo,
+                const char *obj_id, guint32 mode, const char *modifier,
+                CopyTask *task, guint64 *size)
+{
+    int workers = seaf_copy_manager_get_task_workers (seaf->copy_mgr);
+
+    if (S_ISREG(mode)) {
+        return copy_seafile (src_repo, dst_repo, obj_id, task, workers, size);
+    } else if (S_ISDIR(mode)) {
+        CopyFilesData data;
+        gboolean *results = NULL;
+        char *ret = NULL;
+        int i, n;
+
+        memset (&data, 0, sizeof(data));
+        data.src_repo = src_repo;
+        data.dst_repo = dst_repo;
+        data.task = task;
+        data.index = g_hash_table_new (g_str_hash, g_str_equal);
+        data.file_ids = g_ptr_array_new_with_free_func (g_free);
+
+        if (collect_files (&data, obj_id) < 0)
+            goto out;
+
+        n = data.file_ids->len;
+        data.sizes = g_new0 (guint64, n);
+        /* Workers that files can't use go to the blocks of big files. */
+        data.block_workers = (n > 0 && n < workers) ? workers / n : 1;
+
+        results = g_new0 (gboolean, n);
+        run_parallel_jobs (n, workers, copy_file_job, &data, results);
+        for (i = 0; i < n; ++i) {
+            if (!results[i])
+                goto out;
         }
 
-        char *ret = g_strdup(dst_dir->dir_id);
+        ret = copy_dirs (&data, obj_id, modifier);
         *size = 0;
-        seaf_dir_free (dst_dir);
+
+    out:
+        g_free (results);
+        g_free (data.sizes);
+        g_hash_table_destroy (data.index);
+        g_ptr_array_free (data.file_ids, TRUE);
         return ret;
     }
 
@@ -2046,8 +2217,8 @@ get_sub_dirents_hash_map(SeafRepo *repo, const char *parent_dir)
     }
 
     g_list_free (dir->entries);
-    g_free (dir->ondisk);
-    g_free(dir);
+    dir->entries = NULL;
+    seaf_dir_free (dir);
 
     return dirent_hash;
 }
@@ -2164,8 +2335,10 @@ cross_repo_copy (const char *src_repo_id,
         goto out;
     }
 
-    if (task)
+    if (task) {
         task->total = total_files_all;
+        task->total_bytes = total_size_all;
+    }
 
     i = 0;
     /* do copy */
@@ -2850,8 +3023,10 @@ cross_repo_move (const char *src_repo_id,
         goto out;
     }
 
-    if (task)
+    if (task) {
         task->total = total_files_all;
+        task->total_bytes = total_size_all;
+    }
 
     i = 0;
     /* do copy */
@@ -3641,120 +3816,38 @@ out:
 }
 
 static char *
-rename_file_recursive(SeafRepo *repo,
-                      const char *dir_id,
-                      const char *to_path,
-                      const char *oldname,
-                      const char *newname)
-{
-    SeafDir *olddir, *newdir;
-    SeafDirent *dent;
-    GList *ptr;
-    char *to_path_dup = NULL;
-    char *remain = NULL;
-    char *slash;
-    char *id = NULL;
+do_rename_file(SeafRepo *repo,
+               const char *root_id,
+               const char *parent_dir,
+               const char *oldname,
+               const char *newname)
+{
+    TreeOverlay *overlay;
+    TreeOverlayDir *dir;
     char *ret = NULL;
 
-    olddir = seaf_fs_manager_get_seafdir_sorted(seaf->fs_mgr,
-                                                repo->store_id, repo->version,
-                                                dir_id);
-    if (!olddir)
+    overlay = tree_overlay_new (repo->store_id, repo->version, root_id);
+    if (!overlay)
         return NULL;
 
-    /* we reach the target dir. */
-    if (*to_path == '\0') {
-        SeafDirent *old, *newdent = NULL;
-        GList *newentries = NULL, *p;
-
-        /* When renameing, there is a pitfall: we can't simply rename the
-         * dirent, since the dirents are required to be sorted in descending
-         * order. We need to copy all old dirents except the target dirent,
-         * and then rename the target dirent, and then insert the new
-         * dirent, so that we can maintain the descending order of dirents. */
-        for (p = olddir->entries; p != NULL; p = p->next) {
-            old = p->data;
-            if (strcmp(old->name, oldname) != 0) {
-                newentries = g_list_prepend (newentries, seaf_dirent_dup(old));
-            } else {
-                newdent = seaf_dirent_new (old->version, old->id, old->mode,
-                                           newname, old->mtime,
-                                           old->modifier, old->size);
-            }
-        }
-
-        newentries = g_list_reverse (newentries);
-
-        if (newdent) {
-            newentries = g_list_insert_sorted(newentries, newdent, compare_dirents);
-        }
-
-        newdir = seaf_dir_new (NULL, newentries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strndup (newdir->dir_id, 40);
-        seaf_dir_free (newdir);
+    /* Renaming doesn't change the mtimes of the parent dirs. */
+    tree_overlay_set_update_mtime (overlay, FALSE);
 
+    dir = tree_overlay_get_dir (overlay, parent_dir, FALSE, NULL);
+    if (!dir)
         goto out;
-    }
-
-    to_path_dup = g_strdup (to_path);
-    slash = strchr (to_path_dup, '/');
 
-    if (!slash) {
-        remain = to_path_dup + strlen(to_path_dup);
-    } else {
-        *slash = '\0';
-        remain = slash + 1;
-    }
-
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
+    if (tree_overlay_dir_lookup (dir, oldname) &&
+        tree_overlay_move (dir, oldname, dir, newname, NULL) < 0)
+        goto out;
 
-        id = rename_file_recursive (repo, dent->id, remain, oldname, newname);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
-        break;
-    }
-    
-    if (id != NULL) {
-        /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup(newdir->dir_id);
-        seaf_dir_free (newdir);
-    }
+    ret = tree_overlay_save (overlay);
 
 out:
-    g_free (to_path_dup);
-    g_free (id);
-    seaf_dir_free(olddir);
+    tree_overlay_free (overlay);
     return ret;
 }
 
-static char *
-do_rename_file(SeafRepo *repo,
-               const char *root_id,
-               const char *parent_dir,
-               const char *oldname,
-               const char *newname)
-{
-    /* if parent_dir is a absolutely path, we will remove the first '/' */
-    if (*parent_dir == '/')
-        parent_dir = parent_dir + 1;
-
-    return rename_file_recursive(repo, root_id, parent_dir, oldname, newname);
-}
-
 
 int
 seaf_repo_manager_rename_file (SeafRepoManager *mgr,
@@ -3831,106 +3924,95 @@ out:
 }
 
 static char *
-put_file_recursive(SeafRepo *repo,
-                   const char *dir_id,
-                   const char *to_path,
-                   SeafDirent *newdent)
+do_put_file (SeafRepo *repo,
+             const char *root_id,
+             const char *parent_dir,
+             SeafDirent *dent)
 {
-    SeafDir *olddir, *newdir;
-    SeafDirent *dent;
-    GList *ptr;
-    char *to_path_dup = NULL;
-    char *remain = NULL;
-    char *slash;
-    char *id = NULL;
+    TreeOverlay *overlay;
+    TreeOverlayDir *dir;
     char *ret = NULL;
 
-    olddir = seaf_fs_manager_get_seafdir_sorted(seaf->fs_mgr,
-                                                repo->store_id, repo->version,
-                                                dir_id);
-    if (!olddir)
+    overlay = tree_overlay_new (repo->store_id, repo->version, root_id);
+    if (!overlay)
         return NULL;
 
-    /* we reach the target dir. Update the target dirent. */
-    if (*to_path == '\0') {
-        GList *newentries = NULL, *p;
-        SeafDirent *dent;
+    dir = tree_overlay_get_dir (overlay, parent_dir, FALSE, NULL);
+    if (!dir)
+        goto out;
 
-        for (p = olddir->entries; p; p = p->next) {
-            dent = p->data;
-            if (strcmp(dent->name, newdent->name) == 0) {
-                newentries = g_list_prepend (newentries, seaf_dirent_dup(newdent));
-            } else {
-                newentries = g_list_prepend (newentries, seaf_dirent_dup(dent));
-            }
-        }
+    if (tree_overlay_dir_lookup (dir, dent->name))
+        tree_overlay_dir_replace (dir, seaf_dirent_dup (dent));
 
-        newentries = g_list_reverse (newentries);
-        newdir = seaf_dir_new (NULL, newentries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup (newdir->dir_id);
-        seaf_dir_free (newdir);
+    ret = tree_overlay_save (overlay);
 
-        goto out;
-    }
+out:
+    tree_overlay_free (overlay);
+    return ret;
+}
 
-    to_path_dup = g_strdup (to_path);
-    slash = strchr (to_path_dup, '/');
+/* Replaces @file_name with file @file_id on top of @head_commit, and
+ * commits.
+ */
+static int
+put_file_and_commit (SeafRepo *repo, SeafCommit *head_commit,
+                     const char *parent_dir, const char *canon_path,
+                     const char *file_name, const char *file_id, gint64 size,
+                     const char *user, char **new_file_id, GError **error)
+{
+    SeafDirent *new_dent = NULL;
+    char buf[SEAF_PATH_MAX];
+    char *root_id = NULL;
+    char *old_file_id = NULL, *fullpath = NULL;
+    int ret = 0;
 
-    if (!slash) {
-        remain = to_path_dup + strlen(to_path_dup);
-    } else {
-        *slash = '\0';
-        remain = slash + 1;
-    }
+    new_dent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
+                                file_id, STD_FILE_MODE, file_name,
+                                (gint64)time(NULL), user, size);
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
+    fullpath = g_build_filename(parent_dir, file_name, NULL);
 
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
+    old_file_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr,
+                                                  repo->store_id, repo->version,
+                                                  head_commit->root_id,
+                                                  fullpath, NULL, NULL);
 
-        id = put_file_recursive (repo, dent->id, remain, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
+    if (g_strcmp0(old_file_id, new_dent->id) == 0) {
+        if (new_file_id)
+            *new_file_id = g_strdup(new_dent->id);
+        goto out;
     }
-    
-    if (id != NULL) {
-        /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries,
-                               dir_version_from_repo_version(repo->version));
-        if (seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir) == 0)
-            ret = g_strdup(newdir->dir_id);
-        seaf_dir_free (newdir);
+
+    gint64 tree_start = g_get_monotonic_time ();
+    root_id = do_put_file (repo, head_commit->root_id, canon_path, new_dent);
+    upload_trace_add (upload_trace_current (), UPLOAD_STAGE_TREE, tree_start);
+    if (!root_id) {
+        seaf_warning ("[put file] Failed to put file %s to %s in repo %s.\n",
+                      file_name, canon_path, repo->id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to put file");
+        ret = -1;
+        goto out;
     }
 
-out:
-    g_free (to_path_dup);
-    g_free (id);
-    seaf_dir_free(olddir);
-    return ret;
-}
+    /* Commit. */
+    snprintf(buf, SEAF_PATH_MAX, "Modified \"%s\"", file_name);
+    if (gen_new_commit (repo->id, head_commit, root_id, user, buf, NULL, TRUE, error) < 0) {
+        ret = -1;
+        goto out;       
+    }
 
-static char *
-do_put_file (SeafRepo *repo,
-             const char *root_id,
-             const char *parent_dir,
-             SeafDirent *dent)
-{
-    /* if parent_dir is a absolutely path, we will remove the first '/' */
-    if (*parent_dir == '/')
-        parent_dir = parent_dir + 1;
+    if (new_file_id)
+        *new_file_id = g_strdup(new_dent->id);
+
+    seaf_repo_manager_merge_virtual_repo (seaf->repo_mgr, repo->id, NULL);
 
-    return put_file_recursive(repo, root_id, parent_dir, dent);
+out:
+    seaf_dirent_free (new_dent);
+    g_free (root_id);
+    g_free (old_file_id);
+    g_free (fullpath);
+    return ret;
 }
 
 int
@@ -3948,12 +4030,8 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     SeafCommit *head_commit = NULL;
     char *canon_path = NULL;
     unsigned char sha1[20];
-    char buf[SEAF_PATH_MAX];
-    char *root_id = NULL;
     SeafileCrypt *crypt = NULL;
-    SeafDirent *new_dent = NULL;
     char hex[41];
-    char *old_file_id = NULL, *fullpath = NULL;
     int ret = 0;
 
     if (g_access (temp_file_path, R_OK) != 0) {
@@ -4006,182 +4084,619 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     }
 
     gint64 size;
+    gint64 index_start = g_get_monotonic_time ();
     if (seaf_fs_manager_index_blocks (seaf->fs_mgr,
                                       repo->store_id, repo->version,
                                       temp_file_path,
-                                      sha1, &size, crypt, TRUE, FALSE, NULL) < 0) {
+                                      sha1, &size, crypt, TRUE, FALSE, NULL, NULL) < 0) {
         seaf_warning ("failed to index blocks");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                      "Failed to index blocks");
         ret = -1;
         goto out;
     }
+    upload_trace_add (upload_trace_current (), UPLOAD_STAGE_INDEX, index_start);
         
     rawdata_to_hex(sha1, hex, 20);
-    new_dent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
-                                hex, STD_FILE_MODE, file_name,
-                                (gint64)time(NULL), user, size);
+    ret = put_file_and_commit (repo, head_commit, parent_dir, canon_path,
+                               file_name, hex, size, user, new_file_id, error);
 
-    if (!fullpath)
-        fullpath = g_build_filename(parent_dir, file_name, NULL);
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref(head_commit);
+    g_free (canon_path);
+    g_free (crypt);
 
-    old_file_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr,
-                                                  repo->store_id, repo->version,
-                                                  head_commit->root_id,
-                                                  fullpath, NULL, NULL);
+    if (ret == 0) {
+        update_repo_size (repo_id);
+    }
 
-    if (g_strcmp0(old_file_id, new_dent->id) == 0) {
-        if (new_file_id)
-            *new_file_id = g_strdup(new_dent->id);
+    return ret;
+}
+
+int
+seaf_repo_manager_put_file_blocks_delta (SeafRepoManager *mgr,
+                                         const char *repo_id,
+                                         const char *parent_dir,
+                                         const char *file_name,
+                                         const char *blockids_json,
+                                         gint64 file_size,
+                                         const char *user,
+                                         const char *head_id,
+                                         char **new_file_id,
+                                         char **missing_json,
+                                         GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    char *canon_path = NULL;
+    GList *blockids = NULL, *missing = NULL, *ptr;
+    unsigned char sha1[20];
+    char hex[41];
+    int ret = 0;
+
+    blockids = json_to_file_list (blockids_json);
+    for (ptr = blockids; ptr; ptr = ptr->next) {
+        if (!is_object_id_valid ((char *)ptr->data)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid block ids");
+            ret = -1;
+            goto out;
+        }
+    }
+    if (!blockids && file_size != 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid block ids");
+        ret = -1;
         goto out;
     }
 
-    root_id = do_put_file (repo, head_commit->root_id, canon_path, new_dent);
-    if (!root_id) {
-        seaf_warning ("[put file] Failed to put file %s to %s in repo %s.\n",
-                      file_name, canon_path, repo->id);
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                     "Failed to put file");
+    GET_REPO_OR_FAIL(repo, repo_id);
+
+    /* Blocks of encrypted repos are encrypted by the server, the client
+     * can't know their ids.
+     */
+    if (repo->encrypted) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Block updates of encrypted libraries are not supported");
         ret = -1;
         goto out;
     }
 
-    /* Commit. */
-    snprintf(buf, SEAF_PATH_MAX, "Modified \"%s\"", file_name);
-    if (gen_new_commit (repo_id, head_commit, root_id, user, buf, NULL, TRUE, error) < 0) {
+    const char *base = head_id ? head_id : repo->head->commit_id;
+    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, base);
+
+    canon_path = get_canonical_path (parent_dir);
+
+    if (should_ignore_file (file_name, NULL)) {
+        seaf_warning ("[put file] Invalid filename %s.\n", file_name);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid filename");
         ret = -1;
-        goto out;       
+        goto out;
     }
 
-    if (new_file_id)
-        *new_file_id = g_strdup(new_dent->id);
+    if (strstr (parent_dir, "//") != NULL) {
+        seaf_warning ("[put file] parent_dir cantains // sequence.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid parent dir");
+        ret = -1;
+        goto out;
+    }
 
-    seaf_repo_manager_merge_virtual_repo (mgr, repo_id, NULL);
+    FAIL_IF_FILE_NOT_EXISTS(repo->store_id, repo->version,
+                            head_commit->root_id, canon_path, file_name, NULL);
+
+    for (ptr = blockids; ptr; ptr = ptr->next) {
+        /* The blocks are reused, see seaf_block_manager_touch_block(). */
+        if (!seaf_block_manager_block_exists (seaf->block_mgr, repo->store_id,
+                                              repo->version, ptr->data) ||
+            seaf_block_manager_touch_block (seaf->block_mgr, repo->store_id,
+                                            repo->version, ptr->data) < 0)
+            missing = g_list_prepend (missing, ptr->data);
+    }
+    if (missing) {
+        missing = g_list_reverse (missing);
+        if (missing_json) {
+            json_t *array = json_array ();
+            char *json_str;
+
+            for (ptr = missing; ptr; ptr = ptr->next)
+                json_array_append_new (array, json_string ((char *)ptr->data));
+            json_str = json_dumps (array, JSON_COMPACT);
+            *missing_json = g_strdup (json_str);
+            free (json_str);
+            json_decref (array);
+        }
+        g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_BLOCK_MISSING,
+                     "Blocks missing");
+        ret = -1;
+        goto out;
+    }
+
+    if (seaf_fs_manager_index_existed_file_blocks (seaf->fs_mgr,
+                                                   repo->store_id, repo->version,
+                                                   blockids, sha1, file_size) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_BLOCK_MISSING,
+                     "Failed to index file blocks");
+        ret = -1;
+        goto out;
+    }
+
+    rawdata_to_hex(sha1, hex, 20);
+    ret = put_file_and_commit (repo, head_commit, parent_dir, canon_path,
+                               file_name, hex, file_size, user, new_file_id, error);
 
 out:
     if (repo)
         seaf_repo_unref (repo);
     if (head_commit)
         seaf_commit_unref(head_commit);
-    seaf_dirent_free (new_dent);
-    g_free (root_id);
     g_free (canon_path);
-    g_free (crypt);
-    g_free (old_file_id);
-    g_free (fullpath);
+    g_list_free (missing);
+    string_list_free (blockids);
 
     if (ret == 0) {
         update_repo_size (repo_id);
     }
 
-    return ret;
+    return ret;
+}
+
+static char *
+gen_commit_description (SeafRepo *repo,
+                        const char *root,
+                        const char *parent_root)
+{
+    GList *p;
+    GList *results = NULL;
+    char *desc;
+
+    /* gen_new_commit() schedules the computation. */
+    if (seaf->desc_sched->lazy)
+        return g_strdup (SEAF_COMMIT_DESC_PENDING);
+    
+    diff_commit_roots (repo->store_id, repo->version,
+                       parent_root, root, &results, TRUE);
+
+    desc = diff_results_to_description (results);
+
+    for (p = results; p; p = p->next) {
+        DiffEntry *de = p->data;
+        diff_entry_free (de);
+    }
+    g_list_free (results);
+
+    return desc;
+}
+
+int
+seaf_repo_manager_update_dir (SeafRepoManager *mgr,
+                              const char *repo_id,
+                              const char *dir_path,
+                              const char *new_dir_id,
+                              const char *user,
+                              const char *head_id,
+                              char *new_commit_id,
+                              GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    char *canon_path = NULL;
+    char *parent = NULL, *dirname = NULL;
+    SeafDirent *new_dent = NULL;
+    char *root_id = NULL;
+    char *commit_desc = NULL;
+    int ret = 0;
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+    const char *base = head_id ? head_id : repo->head->commit_id;
+    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, base);
+
+    /* Are we updating the root? */
+    if (strcmp (dir_path, "/") == 0) {
+        commit_desc = gen_commit_description (repo, new_dir_id, head_commit->root_id);
+        if (!commit_desc)
+            commit_desc = g_strdup("Auto merge by system");
+
+        if (gen_new_commit (repo_id, head_commit, new_dir_id,
+                            user, commit_desc, new_commit_id, TRUE, error) < 0)
+            ret = -1;
+        g_free (commit_desc);
+        goto out;
+    }
+
+    parent = g_path_get_dirname (dir_path);
+    canon_path = get_canonical_path (parent);
+    g_free (parent);
+
+    dirname = g_path_get_basename (dir_path);
+
+    FAIL_IF_FILE_NOT_EXISTS(repo->store_id, repo->version,
+                            head_commit->root_id, canon_path, dirname, NULL);
+
+    new_dent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
+                                new_dir_id, S_IFDIR, dirname,
+                                (gint64)time(NULL), NULL, -1);
+
+    root_id = do_put_file (repo, head_commit->root_id, canon_path, new_dent);
+    if (!root_id) {
+        seaf_warning ("[update dir] Failed to put file.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to update dir");
+        ret = -1;
+        goto out;
+    }
+
+    commit_desc = gen_commit_description (repo, root_id, head_commit->root_id);
+    if (!commit_desc)
+        commit_desc = g_strdup("Auto merge by system");
+
+    if (gen_new_commit (repo_id, head_commit, root_id,
+                        user, commit_desc, new_commit_id, TRUE, error) < 0) {
+        ret = -1;
+        g_free (commit_desc);
+        goto out;
+    }
+    g_free (commit_desc);
+
+out:
+    seaf_repo_unref (repo);
+    seaf_commit_unref (head_commit);
+    seaf_dirent_free (new_dent);
+    g_free (canon_path);
+    g_free (dirname);
+    g_free (root_id);
+
+    if (ret == 0)
+        update_repo_size (repo_id);
+
+    return ret;
+}
+
+/*
+ * Batch operations.
+ *
+ * A batch applies a list of operations to a tree overlay and produces a
+ * single commit. Only the dirs modified by the batch are written, each once,
+ * when all operations have succeeded. If any operation fails nothing is
+ * written, so the batch is applied atomically.
+ */
+
+#define MAX_BATCH_OPS 10000
+
+typedef struct BatchTree {
+    SeafRepo *repo;
+    const char *user;
+    TreeOverlay *overlay;
+} BatchTree;
+
+/* Returns the parent dir of @names, in which the last name must exist. */
+static TreeOverlayDir *
+batch_get_parent (BatchTree *tree, char **names, int n, GError **error)
+{
+    TreeOverlayDir *parent;
+
+    if (n == 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid path");
+        return NULL;
+    }
+
+    parent = tree_overlay_get_dir_by_names (tree->overlay, names, n - 1,
+                                            FALSE, error);
+    if (!parent)
+        return NULL;
+
+    if (!tree_overlay_dir_lookup (parent, names[n - 1])) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                     "Path %s doesn't exist", names[n - 1]);
+        return NULL;
+    }
+    return parent;
+}
+
+static int
+batch_mkdir (BatchTree *tree, char **names, int n, GError **error)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (should_ignore_file (names[i], NULL)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid dir name %s", names[i]);
+            return -1;
+        }
+    }
+
+    if (!tree_overlay_get_dir_by_names (tree->overlay, names, n, TRUE, error))
+        return -1;
+    return 0;
+}
+
+static int
+batch_create_file (BatchTree *tree, char **names, int n, GError **error)
+{
+    TreeOverlayDir *parent;
+    SeafDirent *dent;
+
+    if (n == 0 || should_ignore_file (names[n - 1], NULL)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid file name");
+        return -1;
+    }
+
+    parent = tree_overlay_get_dir_by_names (tree->overlay, names, n - 1,
+                                            FALSE, error);
+    if (!parent)
+        return -1;
+
+    dent = seaf_dirent_new (dir_version_from_repo_version(tree->repo->version),
+                            EMPTY_SHA1, STD_FILE_MODE, names[n - 1],
+                            (gint64)time(NULL), tree->user, 0);
+    if (tree_overlay_dir_add (parent, dent, error) < 0) {
+        seaf_dirent_free (dent);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+batch_delete (BatchTree *tree, char **names, int n, GError **error)
+{
+    TreeOverlayDir *parent;
+
+    parent = batch_get_parent (tree, names, n, error);
+    if (!parent)
+        return -1;
+
+    return tree_overlay_dir_remove (parent, names[n - 1]);
+}
+
+static int
+batch_rename (BatchTree *tree, char **names, int n, const char *new_name,
+              GError **error)
+{
+    TreeOverlayDir *parent;
+
+    if (!new_name || should_ignore_file (new_name, NULL)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid new name");
+        return -1;
+    }
+
+    parent = batch_get_parent (tree, names, n, error);
+    if (!parent)
+        return -1;
+
+    return tree_overlay_move (parent, names[n - 1], parent, new_name, error);
+}
+
+static gboolean
+is_path_prefix (char **prefix, int n_prefix, char **names, int n)
+{
+    int i;
+
+    if (n < n_prefix)
+        return FALSE;
+    for (i = 0; i < n_prefix; i++) {
+        if (strcmp (prefix[i], names[i]) != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static int
+batch_move_or_copy (BatchTree *tree, char **names, int n,
+                    char **dst_names, int n_dst, gboolean is_copy,
+                    GError **error)
+{
+    TreeOverlayDir *parent, *dst;
+    SeafDirent *dent;
+
+    parent = batch_get_parent (tree, names, n, error);
+    if (!parent)
+        return -1;
+
+    dent = tree_overlay_dir_lookup (parent, names[n - 1]);
+    if (S_ISDIR(dent->mode) && is_path_prefix (names, n, dst_names, n_dst)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Can't %s a dir into itself", is_copy ? "copy" : "move");
+        return -1;
+    }
+
+    dst = tree_overlay_get_dir_by_names (tree->overlay, dst_names, n_dst,
+                                         FALSE, error);
+    if (!dst)
+        return -1;
+
+    if (is_copy)
+        return tree_overlay_copy (parent, names[n - 1], dst, error);
+    return tree_overlay_move (parent, names[n - 1], dst, NULL, error);
 }
 
-static char *
-gen_commit_description (SeafRepo *repo,
-                        const char *root,
-                        const char *parent_root)
+static int
+batch_apply_op (BatchTree *tree, json_t *op, GError **error)
 {
-    GList *p;
-    GList *results = NULL;
-    char *desc;
-    
-    diff_commit_roots (repo->store_id, repo->version,
-                       parent_root, root, &results, TRUE);
+    const char *type, *path, *new_name, *dst_dir;
+    char *norm_path = NULL, *norm_name = NULL, *norm_dst = NULL;
+    char **names = NULL, **dst_names = NULL;
+    int n = 0, n_dst = 0;
+    int ret = -1;
+
+    type = json_string_value (json_object_get (op, "op"));
+    path = json_string_value (json_object_get (op, "path"));
+    new_name = json_string_value (json_object_get (op, "new_name"));
+    dst_dir = json_string_value (json_object_get (op, "dst_dir"));
+
+    if (!type || !path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "op and path are required");
+        return -1;
+    }
 
-    desc = diff_results_to_description (results);
+    norm_path = normalize_utf8_path (path);
+    if (new_name)
+        norm_name = normalize_utf8_path (new_name);
+    if (dst_dir)
+        norm_dst = normalize_utf8_path (dst_dir);
+    if (!norm_path || (new_name && !norm_name) || (dst_dir && !norm_dst)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Path is in valid UTF8 encoding");
+        goto out;
+    }
 
-    for (p = results; p; p = p->next) {
-        DiffEntry *de = p->data;
-        diff_entry_free (de);
+    names = tree_overlay_split_path (norm_path, &n);
+    if (norm_dst)
+        dst_names = tree_overlay_split_path (norm_dst, &n_dst);
+    if (!names || (norm_dst && !dst_names)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid path");
+        goto out;
     }
-    g_list_free (results);
 
-    return desc;
+    if (strcmp (type, "mkdir") == 0) {
+        ret = batch_mkdir (tree, names, n, error);
+    } else if (strcmp (type, "create") == 0) {
+        ret = batch_create_file (tree, names, n, error);
+    } else if (strcmp (type, "delete") == 0) {
+        ret = batch_delete (tree, names, n, error);
+    } else if (strcmp (type, "rename") == 0) {
+        ret = batch_rename (tree, names, n, norm_name, error);
+    } else if (strcmp (type, "move") == 0 || strcmp (type, "copy") == 0) {
+        if (!dst_names) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "dst_dir is required");
+            goto out;
+        }
+        ret = batch_move_or_copy (tree, names, n, dst_names, n_dst,
+                                  strcmp (type, "copy") == 0, error);
+    } else {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Unknown op %s", type);
+    }
+
+out:
+    g_free (norm_path);
+    g_free (norm_name);
+    g_free (norm_dst);
+    g_strfreev (names);
+    g_strfreev (dst_names);
+    return ret;
 }
 
-int
-seaf_repo_manager_update_dir (SeafRepoManager *mgr,
-                              const char *repo_id,
-                              const char *dir_path,
-                              const char *new_dir_id,
-                              const char *user,
-                              const char *head_id,
-                              char *new_commit_id,
-                              GError **error)
+char *
+seaf_repo_manager_apply_batch_ops (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   const char *ops_json,
+                                   const char *user,
+                                   GError **error)
 {
     SeafRepo *repo = NULL;
     SeafCommit *head_commit = NULL;
-    char *canon_path = NULL;
-    char *parent = NULL, *dirname = NULL;
-    SeafDirent *new_dent = NULL;
+    json_t *ops = NULL;
+    json_error_t jerror;
+    BatchTree tree;
+    GError *op_error = NULL;
     char *root_id = NULL;
-    char *commit_desc = NULL;
+    char *desc = NULL;
+    char new_commit_id[41];
+    char *commit_id = NULL;
+    size_t i, n_ops;
     int ret = 0;
 
-    GET_REPO_OR_FAIL(repo, repo_id);
-    const char *base = head_id ? head_id : repo->head->commit_id;
-    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, base);
-
-    /* Are we updating the root? */
-    if (strcmp (dir_path, "/") == 0) {
-        commit_desc = gen_commit_description (repo, new_dir_id, head_commit->root_id);
-        if (!commit_desc)
-            commit_desc = g_strdup("Auto merge by system");
+    memset (&tree, 0, sizeof(tree));
 
-        if (gen_new_commit (repo_id, head_commit, new_dir_id,
-                            user, commit_desc, new_commit_id, TRUE, error) < 0)
-            ret = -1;
-        g_free (commit_desc);
+    ops = json_loadb (ops_json, strlen(ops_json), 0, &jerror);
+    if (!ops || !json_is_array (ops)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid operation list");
+        ret = -1;
+        goto out;
+    }
+    n_ops = json_array_size (ops);
+    if (n_ops == 0 || n_ops > MAX_BATCH_OPS) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "A batch must have 1 to %d operations", MAX_BATCH_OPS);
+        ret = -1;
         goto out;
     }
 
-    parent = g_path_get_dirname (dir_path);
-    canon_path = get_canonical_path (parent);
-    g_free (parent);
-
-    dirname = g_path_get_basename (dir_path);
+    GET_REPO_OR_FAIL(repo, repo_id);
+    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, repo->head->commit_id);
 
-    FAIL_IF_FILE_NOT_EXISTS(repo->store_id, repo->version,
-                            head_commit->root_id, canon_path, dirname, NULL);
+    tree.repo = repo;
+    tree.user = user;
+    tree.overlay = tree_overlay_new (repo->store_id, repo->version,
+                                     head_commit->root_id);
+    if (!tree.overlay) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "Root dir is missing");
+        ret = -1;
+        goto out;
+    }
 
-    new_dent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
-                                new_dir_id, S_IFDIR, dirname,
-                                (gint64)time(NULL), NULL, -1);
+    for (i = 0; i < n_ops; i++) {
+        if (batch_apply_op (&tree, json_array_get (ops, i), &op_error) < 0) {
+            g_set_error (error, SEAFILE_DOMAIN,
+                         op_error ? op_error->code : SEAF_ERR_GENERAL,
+                         "Operation %d failed: %s", (int)i,
+                         op_error ? op_error->message : "unknown error");
+            g_clear_error (&op_error);
+            ret = -1;
+            goto out;
+        }
+    }
 
-    root_id = do_put_file (repo, head_commit->root_id, canon_path, new_dent);
+    root_id = tree_overlay_save (tree.overlay);
     if (!root_id) {
-        seaf_warning ("[update dir] Failed to put file.\n");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                     "Failed to update dir");
+                     "Failed to save dirs");
         ret = -1;
         goto out;
     }
 
-    commit_desc = gen_commit_description (repo, root_id, head_commit->root_id);
-    if (!commit_desc)
-        commit_desc = g_strdup("Auto merge by system");
+    /* Nothing changed. */
+    if (strcmp (root_id, head_commit->root_id) == 0) {
+        commit_id = g_strdup (head_commit->commit_id);
+        goto out;
+    }
+
+    seaf_debug ("Batch of %d operations on repo %.8s wrote %d dirs.\n",
+                (int)n_ops, repo->id, tree_overlay_get_n_saved_dirs (tree.overlay));
+
+    desc = gen_commit_description (repo, root_id, head_commit->root_id);
+    if (!desc)
+        desc = g_strdup_printf ("Applied %d changes", (int)n_ops);
 
     if (gen_new_commit (repo_id, head_commit, root_id,
-                        user, commit_desc, new_commit_id, TRUE, error) < 0) {
+                        user, desc, new_commit_id, TRUE, error) < 0) {
         ret = -1;
-        g_free (commit_desc);
         goto out;
     }
-    g_free (commit_desc);
+    commit_id = g_strdup (new_commit_id);
+
+    seaf_repo_manager_merge_virtual_repo (mgr, repo_id, NULL);
+    update_repo_size (repo_id);
 
 out:
-    seaf_repo_unref (repo);
-    seaf_commit_unref (head_commit);
-    seaf_dirent_free (new_dent);
-    g_free (canon_path);
-    g_free (dirname);
+    if (ops)
+        json_decref (ops);
+    tree_overlay_free (tree.overlay);
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref (head_commit);
     g_free (root_id);
+    g_free (desc);
 
-    if (ret == 0)
-        update_repo_size (repo_id);
+    if (ret < 0) {
+        g_free (commit_id);
+        commit_id = NULL;
+    }
 
-    return ret;
+    return commit_id;
 }
 
 /* int */
@@ -4904,6 +5419,7 @@ struct CollectRevisionParam {
     GList *file_size_list;
     int n_commits;
     GHashTable *file_info_cache;
+    FileRevIndex *rev_index;
     
     /* > 0: keep a period of history;
      * == 0: N/A
@@ -4935,6 +5451,21 @@ free_file_info (gpointer info)
     g_free (file_info);
 }
 
+static FileInfo *
+file_info_dup (FileInfo *info)
+{
+    FileInfo *dup = g_new0 (FileInfo, 1);
+    GList *ptr;
+
+    dup->file_size = info->file_size;
+    dup->file_id = g_strdup (info->file_id);
+    for (ptr = info->dir_ids; ptr; ptr = ptr->next)
+        dup->dir_ids = g_list_prepend (dup->dir_ids, g_strdup (ptr->data));
+    dup->dir_ids = g_list_reverse (dup->dir_ids);
+
+    return dup;
+}
+
 // compare current commit dir_id with pre commit
 // if dir_id doesn't change, it means subdir doesn't change, append all sub_dir ids of prev to current
 // that is it is no need to traverse all sub dir, if root doesn't change
@@ -5159,6 +5690,7 @@ collect_file_revisions (SeafCommit *commit, void *vdata, gboolean *stop)
 
     SeafCommit *parent_commit = NULL;
     SeafCommit *parent_commit2 = NULL;
+    int touched;
 
     gboolean ret = TRUE;
 
@@ -5205,6 +5737,19 @@ collect_file_revisions (SeafCommit *commit, void *vdata, gboolean *stop)
         goto out;
     }
 
+    /* If the index says this commit doesn't change the target file, the
+     * first parent has the same file, no need to look it up in the tree.
+     * Dir ids of this commit are still valid for comparing with the parent's
+     * ancestors, since any of them matching implies the same file.
+     */
+    touched = file_rev_index_touches (data->rev_index, commit->commit_id, path);
+    if (touched == 0) {
+        if (!g_hash_table_lookup (file_info_cache, commit->parent_id))
+            g_hash_table_insert (file_info_cache, g_strdup (commit->parent_id),
+                                 file_info_dup (file_info));
+        goto out;
+    }
+
     parent_commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                                     repo->id, repo->version,
                                                     commit->parent_id);
@@ -5214,6 +5759,12 @@ collect_file_revisions (SeafCommit *commit, void *vdata, gboolean *stop)
         goto out;
     }
 
+    /* Commits not in the index yet, e.g. created by the go fileserver or
+     * before the index existed, are added for later queries.
+     */
+    if (touched < 0)
+        index_commit_changes (repo, parent_commit, commit, data->rev_index);
+
     parent1_info = get_file_info (data->repo, parent_commit, path,
                                   file_info_cache, file_info, error);
     if (*error) {
@@ -5382,11 +5933,13 @@ static SeafileCommit *
 convert_to_seafile_commit (SeafCommit *c)
 {
     SeafileCommit *commit = seafile_commit_new ();
+    char *desc = commit_desc_get (seaf->desc_sched, c);
+
     g_object_set (commit,
                   "id", c->commit_id,
                   "creator_name", c->creator_name,
                   "creator", c->creator_id,
-                  "desc", c->desc,
+                  "desc", desc,
                   "ctime", c->ctime,
                   "repo_id", c->repo_id,
                   "root_id", c->root_id,
@@ -5398,6 +5951,7 @@ convert_to_seafile_commit (SeafCommit *c)
                   "device_name", c->device_name,
                   "client_version", c->client_version,
                   NULL);
+    g_free (desc);
     return commit;
 }
 
@@ -5482,6 +6036,7 @@ seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
     /* A hash table to cache caculated file info of <path> in <commit> */
     data.file_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                   g_free, free_file_info);
+    data.rev_index = file_rev_index_load (repo->id);
 
     if (!seaf_commit_manager_traverse_commit_tree_with_limit (seaf->commit_mgr,
                                                               repo->id,
@@ -5543,6 +6098,7 @@ out:
     g_list_free (file_size_list);
     if (data.file_info_cache)
         g_hash_table_destroy (data.file_info_cache);
+    file_rev_index_free (data.rev_index);
     g_free (old_path);
     g_free (parent_id);
     g_free (next_start_commit);
@@ -5605,55 +6161,329 @@ collect_files_last_modified (SeafCommit *commit, void *vdata, gboolean *stop)
             *stop = TRUE;
             ret = FALSE;
             goto out;
-        } else {
-            g_clear_error (error);
+        } else {
+            g_clear_error (error);
+        }
+    }
+
+    if (!dir) {
+        /* The directory does not exist in this commit. So all files are last
+         * modified in the previous commit;
+         */
+        *stop = TRUE;
+        goto out;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        file_id = g_hash_table_lookup (data->current_file_id_hash, dent->name);
+        if (file_id) {
+            if (strcmp(file_id, dent->id) != 0) {
+                g_hash_table_remove (data->current_file_id_hash, dent->name);
+            } else {
+                gint64 *ctime = g_new (gint64, 1);
+                *ctime = commit->ctime;
+                g_hash_table_replace (data->last_modified_hash, g_strdup(dent->name), ctime);
+            }
+        }
+
+        if (g_hash_table_size(data->current_file_id_hash) == 0) {
+            *stop = TRUE;
+            goto out;
+        }
+    }
+
+    /* Files not found in the current commit are last modified in the previous
+     * commit */
+    g_hash_table_foreach_remove (data->current_file_id_hash,
+                                 check_non_existing_files, data);
+
+    if (g_hash_table_size(data->current_file_id_hash) == 0) {
+        /* All files under this diretory have been calculated  */
+        *stop = TRUE;
+        goto out;
+    }
+
+out:
+    seaf_dir_free (dir);
+
+    return ret;
+}
+
+/*
+ * Results of calc_files_last_modified are cached per (repo, dir), along with
+ * the head commit they were computed for. When the head has moved on by a
+ * few non-merge commits, the cached result is brought up to date by
+ * comparing the dir in each of them, instead of walking the history again:
+ * an entry with the same id as in the previous commit keeps its time, others
+ * get the time of the commit. The result may reach further back than @limit
+ * commits from the new head, which is only more accurate.
+ */
+
+#define DEFAULT_LAST_MODIFIED_CACHE_SIZE_MB 16
+#define MAX_INCREMENTAL_COMMITS 64
+
+static LRUCache *last_modified_cache;
+
+typedef struct LastModifiedEntry {
+    char id[41];
+    gint64 mtime;
+} LastModifiedEntry;
+
+typedef struct DirLastModified {
+    char head_id[41];
+    int limit;
+    GHashTable *entries;        /* name -> LastModifiedEntry */
+} DirLastModified;
+
+static GHashTable *
+last_modified_entries_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+dir_last_modified_free (gpointer p)
+{
+    DirLastModified *dlm = p;
+
+    if (!dlm)
+        return;
+    if (dlm->entries)
+        g_hash_table_destroy (dlm->entries);
+    g_free (dlm);
+}
+
+static gpointer
+dir_last_modified_copy (gconstpointer p)
+{
+    const DirLastModified *dlm = p;
+    DirLastModified *copy = g_new0 (DirLastModified, 1);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    memcpy (copy->head_id, dlm->head_id, 41);
+    copy->limit = dlm->limit;
+    copy->entries = last_modified_entries_new ();
+    g_hash_table_iter_init (&iter, dlm->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_hash_table_insert (copy->entries, g_strdup (key),
+                             g_memdup (value, sizeof(LastModifiedEntry)));
+
+    return copy;
+}
+
+static gint64
+dir_last_modified_mem_size (DirLastModified *dlm)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gint64 size = sizeof(DirLastModified) + 64;
+
+    g_hash_table_iter_init (&iter, dlm->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        size += strlen ((char *)key) + 1 + sizeof(LastModifiedEntry) + 48;
+
+    return size;
+}
+
+int
+seaf_repo_manager_init_last_modified_cache ()
+{
+    GError *error = NULL;
+    int size_mb;
+
+    size_mb = g_key_file_get_integer (seaf->config,
+                                      "last_modified_cache", "max_size",
+                                      &error);
+    if (error) {
+        size_mb = DEFAULT_LAST_MODIFIED_CACHE_SIZE_MB;
+        g_clear_error (&error);
+    }
+    if (size_mb <= 0) {
+        seaf_message ("last modified cache is disabled.\n");
+        return 0;
+    }
+
+    last_modified_cache = lru_cache_new ((gint64)size_mb << 20, 16,
+                                         dir_last_modified_free);
+    return 0;
+}
+
+static char *
+last_modified_cache_key (const char *repo_id, const char *parent_dir)
+{
+    return g_strconcat (repo_id, ":", parent_dir, NULL);
+}
+
+/* Entries of @dir in commit @commit, given their state in the previous commit. */
+static GHashTable *
+update_last_modified_entries (GHashTable *prev, SeafDir *dir, SeafCommit *commit)
+{
+    GHashTable *entries = last_modified_entries_new ();
+    LastModifiedEntry *old, *entry;
+    SeafDirent *dent;
+    GList *ptr;
+
+    if (!dir)
+        return entries;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        entry = g_new0 (LastModifiedEntry, 1);
+        memcpy (entry->id, dent->id, 40);
+        old = g_hash_table_lookup (prev, dent->name);
+        if (old && strcmp (old->id, dent->id) == 0)
+            entry->mtime = old->mtime;
+        else
+            entry->mtime = commit->ctime;
+        g_hash_table_insert (entries, g_strdup (dent->name), entry);
+    }
+
+    return entries;
+}
+
+/*
+ * Bring @cached, computed for an ancestor of @head, up to date with @head.
+ * Returns -1 if @head isn't a few non-merge commits ahead of it.
+ */
+static int
+update_dir_last_modified (SeafRepo *repo, SeafCommit *head,
+                          const char *parent_dir, DirLastModified *cached)
+{
+    GList *commits = NULL, *ptr;
+    SeafCommit *commit = head, *parent;
+    char prev_dir_id[41] = {0};
+    char *dir_id;
+    SeafDir *dir;
+    GHashTable *entries;
+    GError *error = NULL;
+    guint32 mode;
+    int n = 0;
+    int ret = 0;
+
+    seaf_commit_ref (commit);
+    while (1) {
+        commits = g_list_prepend (commits, commit);
+        if (!commit->parent_id || commit->second_parent_id ||
+            ++n >= MAX_INCREMENTAL_COMMITS) {
+            ret = -1;
+            goto out;
+        }
+        if (strcmp (commit->parent_id, cached->head_id) == 0)
+            break;
+
+        parent = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 commit->parent_id);
+        if (!parent) {
+            ret = -1;
+            goto out;
         }
+        commit = parent;
     }
 
-    if (!dir) {
-        /* The directory does not exist in this commit. So all files are last
-         * modified in the previous commit;
-         */
-        *stop = TRUE;
-        goto out;
-    }
+    for (ptr = commits; ptr; ptr = ptr->next) {
+        commit = ptr->data;
 
-    for (ptr = dir->entries; ptr; ptr = ptr->next) {
-        dent = ptr->data;
-        file_id = g_hash_table_lookup (data->current_file_id_hash, dent->name);
-        if (file_id) {
-            if (strcmp(file_id, dent->id) != 0) {
-                g_hash_table_remove (data->current_file_id_hash, dent->name);
-            } else {
-                gint64 *ctime = g_new (gint64, 1);
-                *ctime = commit->ctime;
-                g_hash_table_replace (data->last_modified_hash, g_strdup(dent->name), ctime);
+        dir_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr,
+                                                 repo->store_id, repo->version,
+                                                 commit->root_id, parent_dir,
+                                                 &mode, &error);
+        if (error) {
+            /* A missing parent dir means the dir doesn't exist either. */
+            if (!g_error_matches (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST)) {
+                g_clear_error (&error);
+                ret = -1;
+                goto out;
             }
+            g_clear_error (&error);
+        }
+        if (dir_id && !S_ISDIR(mode)) {
+            g_free (dir_id);
+            dir_id = NULL;
+        }
+        /* The dir is unchanged, so are its entries. */
+        if (dir_id && strcmp (dir_id, prev_dir_id) == 0) {
+            g_free (dir_id);
+            continue;
         }
 
-        if (g_hash_table_size(data->current_file_id_hash) == 0) {
-            *stop = TRUE;
-            goto out;
+        dir = NULL;
+        if (dir_id) {
+            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                               repo->store_id, repo->version,
+                                               dir_id);
+            if (!dir) {
+                g_free (dir_id);
+                ret = -1;
+                goto out;
+            }
+            memcpy (prev_dir_id, dir_id, 41);
+            g_free (dir_id);
+        } else {
+            prev_dir_id[0] = '\0';
         }
-    }
 
-    /* Files not found in the current commit are last modified in the previous
-     * commit */
-    g_hash_table_foreach_remove (data->current_file_id_hash,
-                                 check_non_existing_files, data);
+        entries = update_last_modified_entries (cached->entries, dir, commit);
+        g_hash_table_destroy (cached->entries);
+        cached->entries = entries;
+        if (dir)
+            seaf_dir_free (dir);
+    }
 
-    if (g_hash_table_size(data->current_file_id_hash) == 0) {
-        /* All files under this diretory have been calculated  */
-        *stop = TRUE;
+    /* Let the caller report the missing dir. */
+    if (prev_dir_id[0] == '\0') {
+        ret = -1;
         goto out;
     }
 
-out:
-    seaf_dir_free (dir);
+    memcpy (cached->head_id, head->commit_id, 41);
 
+out:
+    for (ptr = commits; ptr; ptr = ptr->next)
+        seaf_commit_unref ((SeafCommit *)ptr->data);
+    g_list_free (commits);
     return ret;
 }
 
+static GList *
+dir_last_modified_to_list (DirLastModified *dlm)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ret_list = NULL;
+
+    g_hash_table_iter_init (&iter, dlm->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        SeafileFileLastModifiedInfo *info;
+        gint64 last_modified = ((LastModifiedEntry *)value)->mtime;
+        info = g_object_new (SEAFILE_TYPE_FILE_LAST_MODIFIED_INFO,
+                             "file_name", key,
+                             "last_modified", last_modified,
+                             NULL);
+        ret_list = g_list_prepend (ret_list, info);
+    }
+
+    return ret_list;
+}
+
+static void
+cache_dir_last_modified (const char *repo_id, const char *parent_dir,
+                         DirLastModified *dlm)
+{
+    char *key;
+
+    if (!last_modified_cache)
+        return;
+
+    key = last_modified_cache_key (repo_id, parent_dir);
+    lru_cache_insert (last_modified_cache, key,
+                      dir_last_modified_copy (dlm),
+                      dir_last_modified_mem_size (dlm));
+    g_free (key);
+}
+
 /**
  * Give a directory, return the last modification timestamps of all the files
  * under this directory.
@@ -5676,7 +6506,9 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
     GList *ptr = NULL;
     SeafDirent *dent = NULL; 
     CalcFilesLastModifiedParam data = {0};
+    DirLastModified *cached = NULL;
     GList *ret_list = NULL;
+    char *key;
 
     repo = seaf_repo_manager_get_repo (mgr, repo_id);
     if (!repo) {
@@ -5694,6 +6526,24 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
         goto out;
     }
 
+    if (last_modified_cache) {
+        key = last_modified_cache_key (repo->id, parent_dir);
+        cached = lru_cache_lookup (last_modified_cache, key,
+                                   dir_last_modified_copy);
+        g_free (key);
+    }
+    if (cached && cached->limit == limit) {
+        if (strcmp (cached->head_id, head_commit->commit_id) == 0) {
+            ret_list = dir_last_modified_to_list (cached);
+            goto out;
+        }
+        if (update_dir_last_modified (repo, head_commit, parent_dir, cached) == 0) {
+            cache_dir_last_modified (repo->id, parent_dir, cached);
+            ret_list = dir_last_modified_to_list (cached);
+            goto out;
+        }
+    }
+
     dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
                                                repo->store_id, repo->version,
                                                head_commit->root_id,
@@ -5733,11 +6583,11 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
     data.parent_dir = parent_dir;
     data.error = error;
 
-    if (!seaf_commit_manager_traverse_commit_tree_with_limit (seaf->commit_mgr,
-                                                              repo->id, repo->version, 
+    if (!seaf_commit_manager_traverse_commit_graph_with_limit (seaf->commit_mgr,
+                                                               repo->id, repo->version,
                                                         repo->head->commit_id,
                                 (CommitTraverseFunc)collect_files_last_modified,
-                                                              limit, &data, NULL, FALSE)) {
+                                                               limit, &data, NULL, FALSE)) {
         if (*error)
             seaf_warning ("error when traversing commits: %s\n", (*error)->message);
         else
@@ -5748,19 +6598,23 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
         goto out;
     }
 
-    GHashTableIter iter;
-    gpointer key, value;
-
-    g_hash_table_iter_init (&iter, data.last_modified_hash);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        SeafileFileLastModifiedInfo *info;
-        gint64 last_modified = *(gint64 *)value;
-        info = g_object_new (SEAFILE_TYPE_FILE_LAST_MODIFIED_INFO,
-                             "file_name", key,
-                             "last_modified", last_modified,
-                             NULL);
-        ret_list = g_list_prepend (ret_list, info);
+    /* current_file_id_hash only keeps the files still being traced. */
+    dir_last_modified_free (cached);
+    cached = g_new0 (DirLastModified, 1);
+    memcpy (cached->head_id, head_commit->commit_id, 41);
+    cached->limit = limit;
+    cached->entries = last_modified_entries_new ();
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        gint64 *ctime = g_hash_table_lookup (data.last_modified_hash, dent->name);
+        LastModifiedEntry *entry = g_new0 (LastModifiedEntry, 1);
+        memcpy (entry->id, dent->id, 40);
+        entry->mtime = ctime ? *ctime : head_commit->ctime;
+        g_hash_table_replace (cached->entries, g_strdup (dent->name), entry);
     }
+    cache_dir_last_modified (repo->id, parent_dir, cached);
+
+    ret_list = dir_last_modified_to_list (cached);
 
 out:
     if (repo)
@@ -5773,6 +6627,7 @@ out:
         g_hash_table_destroy (data.current_file_id_hash);
     if (dir)
         seaf_dir_free (dir);
+    dir_last_modified_free (cached);
 
     return g_list_reverse(ret_list);
 }
@@ -6034,6 +6889,8 @@ collect_deleted (SeafCommit *commit, void *vdata, gboolean *stop)
     GHashTable *entries = data->entries;
     gint64 truncate_time = data->truncate_time;
     SeafCommit *p1, *p2;
+    char *desc;
+    gboolean has_deletion;
 
     /* We use <= here. This is for handling clean trash and history.
      * If the user cleans all history, truncate time will be equal to
@@ -6048,11 +6905,13 @@ collect_deleted (SeafCommit *commit, void *vdata, gboolean *stop)
     if (commit->parent_id == NULL)
         return TRUE;
 
-    if (!(strstr (commit->desc, PREFIX_DEL_FILE) != NULL ||
-          strstr (commit->desc, PREFIX_DEL_DIR) != NULL ||
-          strstr (commit->desc, PREFIX_DEL_DIRS) != NULL)) {
+    desc = commit_desc_get (seaf->desc_sched, commit);
+    has_deletion = (strstr (desc, PREFIX_DEL_FILE) != NULL ||
+                    strstr (desc, PREFIX_DEL_DIR) != NULL ||
+                    strstr (desc, PREFIX_DEL_DIRS) != NULL);
+    g_free (desc);
+    if (!has_deletion)
         return TRUE;
-    }
 
     p1 = seaf_commit_manager_get_commit (commit->manager,
                                          repo->id, repo->version,
@@ -6340,6 +7199,369 @@ out:
     return ret;
 }
 
+/*
+ * Deleted entries index.
+ *
+ * Scanning for deleted entries walks the history and compares the trees of
+ * every deleting commit with its parents, on each listing. The entries are
+ * also kept per repo in RepoDeletedEntry, found from the root, with the head
+ * they were indexed up to in RepoDeletedIndex. A listing first indexes the
+ * commits made since that head, by either server, and then reads the table.
+ * The first index of a repo, or a long catch-up, is built by a background
+ * job; listings scan the history until it's done.
+ */
+
+#define DELETED_INDEX_MAX_INLINE_COMMITS 200
+
+/* Flags of the commits seen by an index walk. */
+#define WALK_QUEUED 0x1
+/* Reachable from the indexed head, so already indexed. */
+#define WALK_INDEXED 0x2
+
+typedef struct IndexWalk {
+    SeafRepo *repo;
+    /* Latest first. */
+    GList *queue;
+    /* commit id -> flags */
+    GHashTable *seen;
+    /* Commits in the queue that aren't indexed. */
+    int n_new;
+} IndexWalk;
+
+static int
+index_walk_push (IndexWalk *walk, const char *commit_id, gboolean indexed)
+{
+    gpointer value;
+    int flags;
+    SeafCommit *commit;
+
+    if (g_hash_table_lookup_extended (walk->seen, commit_id, NULL, &value)) {
+        flags = GPOINTER_TO_INT (value);
+        if (indexed && !(flags & WALK_INDEXED)) {
+            if (flags & WALK_QUEUED)
+                walk->n_new--;
+            g_hash_table_replace (walk->seen, g_strdup (commit_id),
+                                  GINT_TO_POINTER (flags | WALK_INDEXED));
+        }
+        return 0;
+    }
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             walk->repo->id, walk->repo->version,
+                                             commit_id);
+    if (!commit) {
+        seaf_warning ("Failed to find commit %s:%s.\n", walk->repo->id, commit_id);
+        return -1;
+    }
+
+    walk->queue = g_list_insert_sorted_with_data (walk->queue, commit,
+                                                  compare_commit_by_time, NULL);
+    flags = WALK_QUEUED | (indexed ? WALK_INDEXED : 0);
+    g_hash_table_insert (walk->seen, g_strdup (commit_id), GINT_TO_POINTER (flags));
+    if (!indexed)
+        walk->n_new++;
+
+    return 0;
+}
+
+static int
+index_walk_push_parents (IndexWalk *walk, SeafCommit *commit, gboolean indexed)
+{
+    if (commit->parent_id &&
+        index_walk_push (walk, commit->parent_id, indexed) < 0)
+        return -1;
+    if (commit->second_parent_id &&
+        index_walk_push (walk, commit->second_parent_id, indexed) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Collects the entries deleted by the commits reachable from the head but
+ * not from @indexed_head, or by all commits since the truncate time if
+ * it's NULL. As in "git rev-list", commits are taken latest first, and the
+ * walk ends once only indexed ones are left.
+ * Returns 1 if more than @max_commits commits are new.
+ */
+static int
+walk_new_deleted (CollectDelData *data, const char *indexed_head,
+                  int max_commits)
+{
+    IndexWalk walk = {0};
+    SeafCommit *commit;
+    gboolean indexed, stop;
+    int flags, n = 0, ret = 0;
+
+    walk.repo = data->repo;
+    walk.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    if (index_walk_push (&walk, data->repo->head->commit_id, FALSE) < 0 ||
+        (indexed_head && index_walk_push (&walk, indexed_head, TRUE) < 0)) {
+        ret = -1;
+        goto out;
+    }
+
+    while (walk.queue && walk.n_new > 0) {
+        commit = walk.queue->data;
+        walk.queue = g_list_delete_link (walk.queue, walk.queue);
+
+        flags = GPOINTER_TO_INT (g_hash_table_lookup (walk.seen, commit->commit_id));
+        indexed = (flags & WALK_INDEXED) != 0;
+        g_hash_table_replace (walk.seen, g_strdup (commit->commit_id),
+                              GINT_TO_POINTER (flags & ~WALK_QUEUED));
+        if (!indexed)
+            walk.n_new--;
+
+        stop = FALSE;
+        if (indexed) {
+            /* Older commits can't be new. */
+            if ((gint64)commit->ctime <= data->truncate_time)
+                stop = TRUE;
+        } else {
+            if (max_commits >= 0 && ++n > max_commits) {
+                seaf_commit_unref (commit);
+                ret = 1;
+                goto out;
+            }
+            if (!collect_deleted (commit, data, &stop)) {
+                seaf_commit_unref (commit);
+                ret = -1;
+                goto out;
+            }
+        }
+
+        if (!stop && index_walk_push_parents (&walk, commit, indexed) < 0) {
+            seaf_commit_unref (commit);
+            ret = -1;
+            goto out;
+        }
+        seaf_commit_unref (commit);
+    }
+
+out:
+    g_list_free_full (walk.queue, (GDestroyNotify)seaf_commit_unref);
+    g_hash_table_destroy (walk.seen);
+    return ret;
+}
+
+static gboolean
+get_indexed_head_cb (SeafDBRow *row, void *data)
+{
+    char **head_id = data;
+
+    *head_id = g_strdup (seaf_db_row_get_column_text (row, 0));
+    return FALSE;
+}
+
+static int
+save_deleted_index (SeafRepo *repo, GHashTable *entries, gint64 truncate_time)
+{
+    SeafDBTrans *trans;
+    SeafDBBatch *batch;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafileDeletedEntry *e;
+
+    trans = seaf_db_begin_transaction (seaf->db);
+    if (!trans)
+        return -1;
+
+    batch = seaf_db_trans_batch_new (trans,
+                                     "INSERT INTO RepoDeletedEntry (repo_id, commit_id, "
+                                     "obj_id, obj_name, basedir, mode, file_size, "
+                                     "delete_time)",
+                                     8);
+    g_hash_table_iter_init (&iter, entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        e = value;
+        seaf_db_batch_add_row (batch,
+                               "string", repo->id,
+                               "string", seafile_deleted_entry_get_commit_id (e),
+                               "string", seafile_deleted_entry_get_obj_id (e),
+                               "string", seafile_deleted_entry_get_obj_name (e),
+                               "string", seafile_deleted_entry_get_basedir (e),
+                               "int", seafile_deleted_entry_get_mode (e),
+                               "int64", seafile_deleted_entry_get_file_size (e),
+                               "int64", (gint64)seafile_deleted_entry_get_delete_time (e));
+    }
+    if (seaf_db_batch_finish (batch) < 0)
+        goto error;
+
+    /* Entries past the history limit are never listed again. */
+    if (truncate_time > 0 &&
+        seaf_db_trans_query (trans,
+                             "DELETE FROM RepoDeletedEntry WHERE repo_id = ? "
+                             "AND delete_time <= ?",
+                             2, "string", repo->id, "int64", truncate_time) < 0)
+        goto error;
+
+    if (seaf_db_trans_query (trans,
+                             "REPLACE INTO RepoDeletedIndex (repo_id, head_id) "
+                             "VALUES (?, ?)",
+                             2, "string", repo->id,
+                             "string", repo->head->commit_id) < 0)
+        goto error;
+
+    if (seaf_db_commit (trans) < 0)
+        goto error;
+    seaf_db_trans_close (trans);
+    return 0;
+
+error:
+    seaf_db_rollback (trans);
+    seaf_db_trans_close (trans);
+    return -1;
+}
+
+/*
+ * Returns 0 if the index of @repo is up to date, 1 if it isn't built or
+ * more than @max_commits commits have to be indexed (no limit if negative).
+ */
+static int
+update_deleted_index (SeafRepo *repo, int max_commits)
+{
+    char *indexed_head = NULL;
+    CollectDelData data = {0};
+    int ret;
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT head_id FROM RepoDeletedIndex "
+                                       "WHERE repo_id = ?",
+                                       get_indexed_head_cb, &indexed_head,
+                                       1, "string", repo->id) < 0)
+        return -1;
+
+    if (!indexed_head && max_commits >= 0)
+        return 1;
+    if (g_strcmp0 (indexed_head, repo->head->commit_id) == 0) {
+        g_free (indexed_head);
+        return 0;
+    }
+
+    data.repo = repo;
+    data.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_object_unref);
+    data.truncate_time = seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr,
+                                                                   repo->id);
+    data.path = "/";
+
+    ret = walk_new_deleted (&data, indexed_head, max_commits);
+    if (ret == 0 && save_deleted_index (repo, data.entries, data.truncate_time) < 0)
+        ret = -1;
+
+    g_hash_table_destroy (data.entries);
+    g_free (indexed_head);
+    return ret;
+}
+
+static GHashTable *indexing_repos;
+static pthread_mutex_t indexing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+build_deleted_index_job (void *vrepo_id, void *unused)
+{
+    char *repo_id = vrepo_id;
+    SeafRepo *repo;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (repo) {
+        if (update_deleted_index (repo, -1) < 0)
+            seaf_warning ("Failed to index deleted entries of repo %.8s.\n",
+                          repo_id);
+        seaf_repo_unref (repo);
+    }
+
+    pthread_mutex_lock (&indexing_lock);
+    g_hash_table_remove (indexing_repos, repo_id);
+    pthread_mutex_unlock (&indexing_lock);
+    g_free (repo_id);
+}
+
+static void
+schedule_deleted_index (const char *repo_id)
+{
+    char *key;
+
+    pthread_mutex_lock (&indexing_lock);
+    if (!indexing_repos)
+        indexing_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    if (g_hash_table_lookup (indexing_repos, repo_id)) {
+        pthread_mutex_unlock (&indexing_lock);
+        return;
+    }
+    key = g_strdup (repo_id);
+    g_hash_table_insert (indexing_repos, key, key);
+    pthread_mutex_unlock (&indexing_lock);
+
+    seaf_executor_push (seaf->executor, SEAF_JOB_TRASH,
+                        build_deleted_index_job, g_strdup (repo_id), NULL);
+}
+
+static gboolean
+collect_indexed_entry (SeafDBRow *row, void *vdata)
+{
+    CollectDelData *data = vdata;
+    const char *obj_name = seaf_db_row_get_column_text (row, 2);
+    const char *basedir = seaf_db_row_get_column_text (row, 3);
+    SeafileDeletedEntry *entry;
+    char *path;
+
+    if (!g_str_has_prefix (basedir, data->path))
+        return TRUE;
+
+    /* Rows are latest first, the latest deletion of a path is listed. */
+    path = g_strconcat (basedir, obj_name, NULL);
+    if (g_hash_table_lookup (data->entries, path) != NULL) {
+        g_free (path);
+        return TRUE;
+    }
+
+    entry = g_object_new (SEAFILE_TYPE_DELETED_ENTRY,
+                          "commit_id", seaf_db_row_get_column_text (row, 0),
+                          "obj_id", seaf_db_row_get_column_text (row, 1),
+                          "obj_name", obj_name,
+                          "basedir", basedir,
+                          "mode", seaf_db_row_get_column_int (row, 4),
+                          "file_size", seaf_db_row_get_column_int64 (row, 5),
+                          "delete_time", (int)seaf_db_row_get_column_int64 (row, 6),
+                          NULL);
+    g_hash_table_insert (data->entries, path, entry);
+
+    return TRUE;
+}
+
+/*
+ * Lists the deleted entries under data->path from the index, into
+ * data->entries. Returns -1 if the index can't be used yet.
+ */
+static int
+list_indexed_deleted (CollectDelData *data)
+{
+    int ret;
+
+    ret = update_deleted_index (data->repo, DELETED_INDEX_MAX_INLINE_COMMITS);
+    if (ret != 0) {
+        if (ret > 0)
+            schedule_deleted_index (data->repo->id);
+        return -1;
+    }
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT commit_id, obj_id, obj_name, basedir, "
+                                       "mode, file_size, delete_time FROM RepoDeletedEntry "
+                                       "WHERE repo_id = ? AND delete_time > ? "
+                                       "ORDER BY delete_time DESC",
+                                       collect_indexed_entry, data,
+                                       2, "string", data->repo->id,
+                                       "int64", data->truncate_time) < 0) {
+        g_hash_table_remove_all (data->entries);
+        return -1;
+    }
+
+    return 0;
+}
+
 GList *
 seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
                                        const char *repo_id,
@@ -6391,7 +7613,9 @@ seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
         data.path = g_strdup ("/");
     }
 
-    if (!scan_commits_for_collect_deleted (&data, scan_stat, limit, &next_scan_stat)) {
+    /* A scan already started goes on, the index lists all entries at once. */
+    if ((scan_stat || list_indexed_deleted (&data) < 0) &&
+        !scan_commits_for_collect_deleted (&data, scan_stat, limit, &next_scan_stat)) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
                      "Internal error");
         g_hash_table_destroy (entries);
@@ -7,9 +7,11 @@
 
 #include "seafile-session.h"
 #include "repo-mgr.h"
+#include "mq-mgr.h"
 
 #include "seafile-error.h"
 #include "seaf-utils.h"
+#include "cache-version.h"
 /*
  * Permission priority: owner --> personal share --> group share --> public.
  * Permission with higher priority overwrites those with lower priority.
@@ -41,13 +43,11 @@ check_group_permission_by_user (SeafRepoManager *mgr,
 {
     char *permission = NULL;
     GList *groups = NULL, *p1;
-    CcnetGroup *group;
-    int group_id;
     GString *sql;
 
-    /* Get the groups this user belongs to. */
-    groups = ccnet_group_manager_get_groups_by_user (seaf->group_mgr, user_name,
-                                                     1, NULL);
+    /* Get the groups this user belongs to and their ancestors. */
+    groups = ccnet_group_manager_get_group_ids_by_user (seaf->group_mgr, user_name,
+                                                        NULL);
     if (!groups) {
         goto out;
     }
@@ -55,10 +55,7 @@ check_group_permission_by_user (SeafRepoManager *mgr,
     sql = g_string_new ("");
     g_string_printf (sql, "SELECT permission FROM RepoGroup WHERE repo_id = ? AND group_id IN (");
     for (p1 = groups; p1 != NULL; p1 = p1->next) {
-        group = p1->data;
-        g_object_get (group, "id", &group_id, NULL);
-
-        g_string_append_printf (sql, "%d", group_id);
+        g_string_append_printf (sql, "%d", GPOINTER_TO_INT(p1->data));
         if (p1->next)
             g_string_append_printf (sql, ",");
     }
@@ -73,8 +70,6 @@ check_group_permission_by_user (SeafRepoManager *mgr,
     g_string_free (sql, TRUE);
 
 out:
-    for (p1 = groups; p1 != NULL; p1 = p1->next)
-        g_object_unref ((GObject *)p1->data);
     g_list_free (groups);
     return permission;
 }
@@ -132,7 +127,6 @@ check_perm_on_parent_repo (const char *origin_repo_id,
     GHashTable *user_perms = NULL;
     GHashTable *group_perms = NULL;
     GList *groups = NULL;
-    GList *iter;
     char *perm = NULL;
 
     user_perms = seaf_share_manager_get_shared_dirs_to_user (seaf->share_mgr,
@@ -152,8 +146,7 @@ check_perm_on_parent_repo (const char *origin_repo_id,
     }
     g_hash_table_destroy (user_perms);
 
-    groups = ccnet_group_manager_get_groups_by_user (seaf->group_mgr, user,
-                                                     1, NULL);
+    groups = ccnet_group_manager_get_group_ids_by_user (seaf->group_mgr, user, NULL);
     if (!groups) {
         return NULL;
     }
@@ -161,9 +154,6 @@ check_perm_on_parent_repo (const char *origin_repo_id,
     group_perms = seaf_share_manager_get_shared_dirs_to_group (seaf->share_mgr,
                                                                origin_repo_id,
                                                                groups);
-
-    for (iter = groups; iter; iter = iter->next)
-        g_object_unref ((GObject *)iter->data);
     g_list_free (groups);
 
     if (!group_perms) {
@@ -214,7 +204,8 @@ check_virtual_repo_permission (SeafRepoManager *mgr,
 /*
  * Comprehensive repo access permission checker.
  *
- * Returns read/write permission.
+ * Returns read/write permission. Shares are read from the primary db, a
+ * replica may not have seen a revoked one yet.
  */
 char *
 seaf_repo_manager_check_permission (SeafRepoManager *mgr,
@@ -226,6 +217,8 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
     char *owner = NULL;
     char *permission = NULL;
 
+    seaf_db_begin_primary_reads ();
+
     /* This is a virtual repo.*/
     vinfo = seaf_repo_manager_get_virtual_repo_info (mgr, repo_id);
     if (vinfo) {
@@ -244,26 +237,71 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
     }
 
 out:
+    seaf_db_end_primary_reads ();
     seaf_virtual_repo_info_free (vinfo);
     g_free (owner);
     return permission;
 }
 
 /*
- * Directories are always before files. Otherwise compare the names.
+ * The file servers cache granted permissions only, so only changes that may
+ * revoke a permission are notified. The C file server runs in this process
+ * and drops its entries at once. The Go file server pops the events from
+ * SEAFILE_SERVER_CHANNEL_PERM.
  */
-static gint
-comp_dirent_func (gconstpointer a, gconstpointer b)
+static void
+publish_perm_change (const char *repo_id, const char *user)
+{
+    char *buf;
+
+    if (!seaf->go_fileserver) {
+        seaf_http_server_invalidate_perms (seaf->http_server, repo_id, user);
+        return;
+    }
+
+    buf = g_strdup_printf ("perm-change\t%s\t%s",
+                           repo_id ? repo_id : "", user ? user : "");
+    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_PERM, buf);
+    g_free (buf);
+}
+
+void
+seaf_repo_manager_notify_perm_change (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *user)
+{
+    GList *vrepos, *ptr;
+
+    seaf_cache_version_bump (SEAF_CACHE_VERSION_PERM);
+
+    publish_perm_change (repo_id, user);
+    if (!repo_id)
+        return;
+
+    /* Permissions of virtual repos derive from the origin repo. */
+    vrepos = seaf_repo_manager_get_virtual_repo_ids_by_origin (mgr, repo_id);
+    for (ptr = vrepos; ptr; ptr = ptr->next)
+        publish_perm_change (ptr->data, user);
+    string_list_free (vrepos);
+}
+
+void
+seaf_repo_manager_notify_repo_list_change (SeafRepoManager *mgr,
+                                           const char *repo_id,
+                                           const char *user)
 {
-    const SeafDirent *dent_a = a, *dent_b = b;
+    char *buf;
 
-    if (S_ISDIR(dent_a->mode) && S_ISREG(dent_b->mode))
-        return -1;
+    seaf_cache_version_bump (SEAF_CACHE_VERSION_REPO_LIST);
 
-    if (S_ISREG(dent_a->mode) && S_ISDIR(dent_b->mode))
-        return 1;
+    /* Only the go file server caches repo lists. */
+    if (!seaf->go_fileserver)
+        return;
 
-    return strcasecmp (dent_a->name, dent_b->name);
+    buf = g_strdup_printf ("repo-list-change\t%s\t%s",
+                           repo_id ? repo_id : "", user ? user : "");
+    seaf_mq_manager_publish_event (seaf->mq_mgr, SEAFILE_SERVER_CHANNEL_PERM, buf);
+    g_free (buf);
 }
 
 GList *
@@ -278,7 +316,7 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
 {
     SeafRepo *repo;
     char *perm = NULL;
-    SeafDir *dir;
+    GList *entries = NULL;
     SeafDirent *dent;
     SeafileDirent *d;
     GList *res = NULL;
@@ -298,22 +336,15 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
         return NULL;
     }
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                       repo->store_id, repo->version, dir_id);
-    if (!dir) {
+    if (seaf_fs_manager_list_dir_page (seaf->fs_mgr,
+                                       repo->store_id, repo->version, dir_id,
+                                       offset, limit, &entries) < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
         seaf_repo_unref (repo);
         g_free (perm);
         return NULL;
     }
 
-    dir->entries = g_list_sort (dir->entries, comp_dirent_func);
-
-    if (offset < 0) {
-        offset = 0;
-    }
-
-    int index = 0;
     gboolean is_shared;
     char *cur_path;
     GHashTable *shared_sub_dirs = NULL;
@@ -328,16 +359,7 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
         g_free (repo_owner);
     }
 
-    for (p = dir->entries; p != NULL; p = p->next, index++) {
-        if (index < offset) {
-            continue;
-        }
-
-        if (limit > 0) {
-            if (index >= offset + limit)
-                break;
-        }
-
+    for (p = entries; p != NULL; p = p->next) {
         dent = p->data;
 
         if (!is_object_id_valid (dent->id))
@@ -369,7 +391,7 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
 
     if (shared_sub_dirs)
         g_hash_table_destroy (shared_sub_dirs);
-    seaf_dir_free (dir);
+    g_list_free_full (entries, (GDestroyNotify)seaf_dirent_free);
     seaf_repo_unref (repo);
     g_free (perm);
     if (res)
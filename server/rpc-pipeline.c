@@ -0,0 +1,264 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <glib/gstdio.h>
+
+#include <jansson.h>
+#include <searpc-server.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "rpc-pipeline.h"
+
+#define FRAME_HEADER_LEN 12
+#define MAX_REQUEST_LEN (64 << 20)
+/* Smaller results aren't worth compressing. */
+#define MIN_COMPRESS_LEN 4096
+
+typedef struct RpcConn {
+    int fd;
+    gint refcnt;
+    /* Held while a response is written, so that frames don't interleave. */
+    pthread_mutex_t write_lock;
+} RpcConn;
+
+typedef struct RpcCall {
+    RpcConn *conn;
+    guint32 id;
+    guint32 flags;
+    char *payload;
+    guint32 len;
+} RpcCall;
+
+typedef struct RpcPipelineServer {
+    int listen_fd;
+    GThreadPool *workers;
+} RpcPipelineServer;
+
+static RpcPipelineServer *server;
+
+static void
+rpc_conn_unref (RpcConn *conn)
+{
+    if (!g_atomic_int_dec_and_test (&conn->refcnt))
+        return;
+
+    close (conn->fd);
+    pthread_mutex_destroy (&conn->write_lock);
+    g_free (conn);
+}
+
+static void
+send_response (RpcConn *conn, guint32 id, guint32 flags,
+               const char *payload, gsize len)
+{
+    guint32 header[3];
+
+    header[0] = htonl ((guint32)len);
+    header[1] = htonl (id);
+    header[2] = htonl (flags);
+
+    pthread_mutex_lock (&conn->write_lock);
+    /* A failed write shows up as EOF on the reading side. */
+    if (writen (conn->fd, header, FRAME_HEADER_LEN) == FRAME_HEADER_LEN)
+        writen (conn->fd, payload, len);
+    pthread_mutex_unlock (&conn->write_lock);
+}
+
+static char *
+error_json (int code, const char *msg, gsize *len)
+{
+    json_t *obj = json_object ();
+    char *ret;
+
+    json_object_set_new (obj, "err_code", json_integer (code));
+    json_object_set_new (obj, "err_msg", json_string (msg));
+    ret = json_dumps (obj, JSON_COMPACT);
+    json_decref (obj);
+
+    *len = strlen (ret);
+    return ret;
+}
+
+static void
+run_call (gpointer data, gpointer user_data)
+{
+    RpcCall *call = data;
+    json_t *obj = NULL;
+    json_error_t jerror;
+    const char *service, *request;
+    char *ret = NULL;
+    gsize ret_len = 0;
+    guint8 *compressed = NULL;
+    int compressed_len;
+
+    obj = json_loadb (call->payload, call->len, 0, &jerror);
+    service = obj ? json_string_value (json_object_get (obj, "service")) : NULL;
+    request = obj ? json_string_value (json_object_get (obj, "request")) : NULL;
+    if (!service || !request) {
+        seaf_warning ("Invalid rpc request on pipelined transport.\n");
+        ret = error_json (500, "Invalid request", &ret_len);
+        send_response (call->conn, call->id, 0, ret, ret_len);
+        free (ret);
+        goto out;
+    }
+
+    ret = searpc_server_call_function (service, (gchar *)request,
+                                       strlen (request), &ret_len);
+    if (!ret) {
+        ret = error_json (500, "Internal error", &ret_len);
+        send_response (call->conn, call->id, 0, ret, ret_len);
+        free (ret);
+        goto out;
+    }
+
+    if ((call->flags & RPC_PIPELINE_ACCEPT_ZLIB) && ret_len >= MIN_COMPRESS_LEN &&
+        seaf_compress ((guint8 *)ret, (int)ret_len, &compressed, &compressed_len) == 0) {
+        send_response (call->conn, call->id, RPC_PIPELINE_ZLIB,
+                       (char *)compressed, compressed_len);
+        g_free (compressed);
+    } else {
+        send_response (call->conn, call->id, 0, ret, ret_len);
+    }
+    g_free (ret);
+
+out:
+    if (obj)
+        json_decref (obj);
+    rpc_conn_unref (call->conn);
+    g_free (call->payload);
+    g_free (call);
+}
+
+static void *
+read_requests (void *vconn)
+{
+    RpcConn *conn = vconn;
+    guint32 header[3];
+    RpcCall *call;
+    guint32 len;
+
+    while (1) {
+        if (readn (conn->fd, header, FRAME_HEADER_LEN) != FRAME_HEADER_LEN)
+            break;
+        len = ntohl (header[0]);
+        if (len > MAX_REQUEST_LEN) {
+            seaf_warning ("Rpc request of %u bytes is too large, "
+                          "closing connection.\n", len);
+            break;
+        }
+
+        call = g_new0 (RpcCall, 1);
+        call->id = ntohl (header[1]);
+        call->flags = ntohl (header[2]);
+        call->len = len;
+        call->payload = g_malloc (len + 1);
+        if (readn (conn->fd, call->payload, len) != (ssize_t)len) {
+            g_free (call->payload);
+            g_free (call);
+            break;
+        }
+        call->payload[len] = '\0';
+
+        g_atomic_int_inc (&conn->refcnt);
+        call->conn = conn;
+        g_thread_pool_push (server->workers, call, NULL);
+    }
+
+    /* Running calls still hold the connection to send their results,
+     * which are discarded by the kernel once the client is gone.
+     */
+    shutdown (conn->fd, SHUT_RD);
+    rpc_conn_unref (conn);
+    return NULL;
+}
+
+static void *
+accept_connections (void *unused)
+{
+    RpcConn *conn;
+    pthread_t tid;
+    int fd;
+
+    while (1) {
+        fd = accept (server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                seaf_warning ("Failed to accept rpc connection: %s.\n",
+                              strerror (errno));
+                /* Out of fds, give running calls time to finish. */
+                g_usleep (G_USEC_PER_SEC / 10);
+            }
+            continue;
+        }
+
+        conn = g_new0 (RpcConn, 1);
+        conn->fd = fd;
+        conn->refcnt = 1;
+        pthread_mutex_init (&conn->write_lock, NULL);
+
+        if (pthread_create (&tid, NULL, read_requests, conn) != 0) {
+            seaf_warning ("Failed to create rpc connection thread.\n");
+            rpc_conn_unref (conn);
+            continue;
+        }
+        pthread_detach (tid);
+    }
+
+    return NULL;
+}
+
+int
+rpc_pipeline_server_start (const char *socket_path, int n_workers)
+{
+    struct sockaddr_un addr;
+    pthread_t tid;
+    int fd;
+
+    if (strlen (socket_path) >= sizeof(addr.sun_path)) {
+        seaf_warning ("Rpc socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to create rpc socket: %s.\n", strerror (errno));
+        return -1;
+    }
+
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy (addr.sun_path, socket_path, sizeof(addr.sun_path));
+
+    /* Left over by a previous run. */
+    g_unlink (socket_path);
+
+    if (bind (fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen (fd, 10) < 0) {
+        seaf_warning ("Failed to listen on %s: %s.\n", socket_path, strerror (errno));
+        close (fd);
+        return -1;
+    }
+
+    server = g_new0 (RpcPipelineServer, 1);
+    server->listen_fd = fd;
+    server->workers = g_thread_pool_new (run_call, NULL, n_workers, FALSE, NULL);
+
+    if (pthread_create (&tid, NULL, accept_connections, NULL) != 0) {
+        seaf_warning ("Failed to create rpc accept thread.\n");
+        g_thread_pool_free (server->workers, TRUE, FALSE);
+        close (fd);
+        g_free (server);
+        server = NULL;
+        return -1;
+    }
+    pthread_detach (tid);
+
+    return 0;
+}
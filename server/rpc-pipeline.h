@@ -0,0 +1,27 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RPC_PIPELINE_H
+#define RPC_PIPELINE_H
+
+/*
+ * A second transport of the rpc functions, on a unix socket next to the
+ * named pipe. The named pipe answers one call at a time per connection;
+ * here every request carries an id, calls on one connection run in
+ * parallel, and responses are sent as soon as they're ready, in any order.
+ *
+ * Each request and response is a frame of three 32-bit integers in network
+ * byte order (payload length, request id, flags) followed by the payload.
+ * A request payload is the same json object as on the named pipe:
+ * {"service": ..., "request": ...}. A response payload is the json result.
+ *
+ * If a request has RPC_PIPELINE_ACCEPT_ZLIB set, large results are sent
+ * zlib compressed, with RPC_PIPELINE_ZLIB set in the response.
+ */
+
+#define RPC_PIPELINE_ACCEPT_ZLIB 0x1
+#define RPC_PIPELINE_ZLIB 0x1
+
+int
+rpc_pipeline_server_start (const char *socket_path, int n_workers);
+
+#endif
@@ -23,6 +23,7 @@
 
 #include "seafile-session.h"
 #include "seafile-rpc.h"
+#include "rpc-pipeline.h"
 #include "log.h"
 #include "utils.h"
 
@@ -59,6 +60,7 @@ static void usage ()
 #include <searpc-named-pipe-transport.h>
 
 #define SEAFILE_RPC_PIPE_NAME "seafile.sock"
+#define SEAFILE_RPC_PIPELINE_NAME "seafile-pipelined.sock"
 
 #define NAMED_PIPE_SERVER_THREAD_POOL_SIZE 50
 
@@ -104,6 +106,22 @@ static void start_rpc_service (const char *seafile_dir,
                                      seafile_get_repo_owner,
                                      "seafile_get_repo_owner",
                                      searpc_signature_string__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repos_by_ids,
+                                     "seafile_get_repos_by_ids",
+                                     searpc_signature_objlist__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_owners,
+                                     "seafile_get_repo_owners",
+                                     searpc_signature_json__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_sizes,
+                                     "seafile_get_repo_sizes",
+                                     searpc_signature_json__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_head_commits,
+                                     "seafile_get_repo_head_commits",
+                                     searpc_signature_objlist__string());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_orphan_repo_list,
                                      "seafile_get_orphan_repo_list",
@@ -214,6 +232,11 @@ static void start_rpc_service (const char *seafile_dir,
                                      "seafile_rename_file",
                     searpc_signature_int__string_string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_apply_batch_ops,
+                                     "seafile_apply_batch_ops",
+                                     searpc_signature_string__string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_is_valid_filename,
                                      "seafile_is_valid_filename",
@@ -343,12 +366,20 @@ static void start_rpc_service (const char *seafile_dir,
                                      seafile_search_files,
                                      "search_files",
                                      searpc_signature_objlist__string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_rebuild_search_index,
+                                     "rebuild_search_index",
+                                     searpc_signature_int__string());
 
     /* share repo to user */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_add_share,
                                      "seafile_add_share",
                                      searpc_signature_int__string_string_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_add_shares,
+                                     "seafile_add_shares",
+                                     searpc_signature_int__string_string_string_string());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_list_share_repos,
                                      "seafile_list_share_repos",
@@ -400,6 +431,10 @@ static void start_rpc_service (const char *seafile_dir,
                                      seafile_group_share_repo,
                                      "seafile_group_share_repo",
                                      searpc_signature_int__string_int_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_group_share_repo_to_groups,
+                                     "seafile_group_share_repo_to_groups",
+                                     searpc_signature_int__string_string_string_string());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_group_unshare_repo,
                                      "seafile_group_unshare_repo",
@@ -538,6 +573,11 @@ static void start_rpc_service (const char *seafile_dir,
                                      "create_virtual_repo",
                                      searpc_signature_string__string_string_string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_fork_repo,
+                                     "fork_repo",
+                                     searpc_signature_string__string_string_string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_virtual_repos_by_owner,
                                      "get_virtual_repos_by_owner",
@@ -579,6 +619,30 @@ static void start_rpc_service (const char *seafile_dir,
                                      seafile_cancel_zip_task,
                                      "cancel_zip_task",
                                      searpc_signature_int__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_zip_task_stats,
+                                     "get_zip_task_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_db_query_stats,
+                                     "get_db_query_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_lock_stats,
+                                     "get_lock_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_access_stats,
+                                     "get_access_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_cache_versions,
+                                     "get_cache_versions",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_reclaim_progress,
+                                     "get_repo_reclaim_progress",
+                                     searpc_signature_string__void());
 
     /* Copy task related. */
 
@@ -669,6 +733,10 @@ static void start_rpc_service (const char *seafile_dir,
                                      seafile_pop_event,
                                      "pop_event",
                                      searpc_signature_json__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_pop_events,
+                                     "pop_events",
+                                     searpc_signature_json__string_int());
 
                                      
     searpc_server_register_function ("seafserv-threaded-rpcserver",
@@ -712,6 +780,11 @@ static void start_rpc_service (const char *seafile_dir,
                                      "get_system_default_repo_id",
                                      searpc_signature_string__void());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_is_server_ready,
+                                     "is_server_ready",
+                                     searpc_signature_int__void());
+
     /* Trashed repos. */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_trash_repo_list,
@@ -828,6 +901,10 @@ static void start_rpc_service (const char *seafile_dir,
                                      ccnet_rpc_count_inactive_emailusers,
                                      "count_inactive_emailusers",
                                      searpc_signature_int64__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     ccnet_rpc_reconcile_row_counts,
+                                     "reconcile_row_counts",
+                                     searpc_signature_int__void());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      ccnet_rpc_update_emailuser,
                                      "update_emailuser",
@@ -867,6 +944,10 @@ static void start_rpc_service (const char *seafile_dir,
                                      ccnet_rpc_group_add_member,
                                      "group_add_member",
                                      searpc_signature_int__int_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     ccnet_rpc_group_add_members,
+                                     "group_add_members",
+                                     searpc_signature_int__int_string_string());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      ccnet_rpc_group_remove_member,
                                      "group_remove_member",
@@ -1053,11 +1134,10 @@ static void start_rpc_service (const char *seafile_dir,
                                      "get_primary_id",
                                      searpc_signature_string__string());
 
-    if (rpc_pipe_path) {
-        pipe_path = g_build_path ("/", rpc_pipe_path, SEAFILE_RPC_PIPE_NAME, NULL);
-    } else {
-        pipe_path = g_build_path ("/", seafile_dir, SEAFILE_RPC_PIPE_NAME, NULL);
-    }
+    if (!rpc_pipe_path)
+        rpc_pipe_path = seafile_dir;
+
+    pipe_path = g_build_path ("/", rpc_pipe_path, SEAFILE_RPC_PIPE_NAME, NULL);
     rpc_server = searpc_create_named_pipe_server_with_threadpool (pipe_path, NAMED_PIPE_SERVER_THREAD_POOL_SIZE);
 
     g_free(pipe_path);
@@ -1070,6 +1150,12 @@ static void start_rpc_service (const char *seafile_dir,
         seaf_warning ("Failed to start rpc server.\n");
         exit (1);
     }
+
+    /* Clients fall back to the named pipe without it. */
+    pipe_path = g_build_path ("/", rpc_pipe_path, SEAFILE_RPC_PIPELINE_NAME, NULL);
+    if (rpc_pipeline_server_start (pipe_path, NAMED_PIPE_SERVER_THREAD_POOL_SIZE) < 0)
+        seaf_warning ("Failed to start pipelined rpc server.\n");
+    g_free (pipe_path);
 }
 
 static struct event sigusr1;
@@ -1350,9 +1436,6 @@ main (int argc, char **argv)
 
     atexit (on_seaf_server_exit);
 
-    /* Create a system default repo to contain the tutorial file. */
-    schedule_create_system_default_repo (seaf);
-
     event_dispatch ();
 
     return 0;
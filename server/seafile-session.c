@@ -15,14 +15,18 @@
 #include <errno.h>
 
 #include <glib.h>
+#include <pthread.h>
 
 #include "utils.h"
 
 #include "seafile-session.h"
 
 #include "mq-mgr.h"
+#include "seafile-crypt.h"
 #include "seaf-db.h"
 #include "seaf-utils.h"
+#include "lock-stats.h"
+#include "access-stats.h"
 
 #include "log.h"
 
@@ -30,6 +34,10 @@
 
 #define DEFAULT_THREAD_POOL_SIZE 500
 
+/* Small enough to fit the default limit of locked memory. */
+#define DEFAULT_DERIVED_KEY_CACHE_SIZE 512
+#define DEFAULT_DERIVED_KEY_CACHE_TTL 3600
+
 SeafileSession *
 seafile_session_new(const char *central_config_dir,
                     const char *seafile_dir,
@@ -44,6 +52,9 @@ seafile_session_new(const char *central_config_dir,
     GKeyFile *config;
     GKeyFile *ccnet_config;
     SeafileSession *session = NULL;
+    int mq_max_events;
+    char *mq_drop_policy;
+    int key_cache_size, key_cache_ttl;
 
     abs_ccnet_dir = ccnet_expand_path (ccnet_dir);
     abs_seafile_dir = ccnet_expand_path (seafile_dir);
@@ -107,6 +118,12 @@ seafile_session_new(const char *central_config_dir,
     session->config = config;
     session->ccnet_config = ccnet_config;
 
+    /* Before any of the instrumented locks is created. */
+    seaf_lock_stats_set_enabled (g_key_file_get_boolean (config, "general",
+                                                         "lock_stats", NULL));
+    seaf_access_stats_init (g_key_file_get_integer (config, "general",
+                                                    "access_stats_sample_rate", NULL));
+
     session->cloud_mode = g_key_file_get_boolean (config,
                                                   "general", "cloud_mode",
                                                   NULL);
@@ -164,10 +181,29 @@ seafile_session_new(const char *central_config_dir,
     if (!session->passwd_mgr)
         goto onerror;
 
+    /* Keys derived from library passwords, 0 disables the cache. */
+    key_cache_size = g_key_file_get_integer (config, "crypt",
+                                             "derived_key_cache_size", &error);
+    if (error) {
+        key_cache_size = DEFAULT_DERIVED_KEY_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    key_cache_ttl = g_key_file_get_integer (config, "crypt",
+                                            "derived_key_cache_ttl", &error);
+    if (error) {
+        key_cache_ttl = DEFAULT_DERIVED_KEY_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    seafile_derive_key_cache_init (key_cache_size, key_cache_ttl);
+
     session->quota_mgr = seaf_quota_manager_new (session);
     if (!session->quota_mgr)
         goto onerror;
 
+    session->executor = seaf_executor_new (session);
+    if (!session->executor)
+        goto onerror;
+
     session->copy_mgr = seaf_copy_manager_new (session);
     if (!session->copy_mgr)
         goto onerror;
@@ -175,8 +211,16 @@ seafile_session_new(const char *central_config_dir,
     session->job_mgr = ccnet_job_manager_new (DEFAULT_THREAD_POOL_SIZE);
 
     session->size_sched = size_scheduler_new (session);
-
-    session->mq_mgr = seaf_mq_manager_new ();
+    session->desc_sched = commit_desc_scheduler_new (session);
+
+    /* Events kept per channel, and whether the "oldest" or the "newest"
+     * event is dropped when a channel is full. */
+    mq_max_events = g_key_file_get_integer (config, "mq", "max_events", NULL);
+    mq_drop_policy = g_key_file_get_string (config, "mq", "drop_policy", NULL);
+    session->mq_mgr = seaf_mq_manager_new (mq_max_events,
+                                           g_strcmp0 (mq_drop_policy, "newest") == 0 ?
+                                           SEAF_MQ_DROP_NEWEST : SEAF_MQ_DROP_OLDEST);
+    g_free (mq_drop_policy);
     if (!session->mq_mgr)
         goto onerror;
 
@@ -184,7 +228,7 @@ seafile_session_new(const char *central_config_dir,
     if (!session->http_server)
         goto onerror;
 
-    session->zip_download_mgr = zip_download_mgr_new ();
+    session->zip_download_mgr = zip_download_mgr_new (session);
     if (!session->zip_download_mgr)
         goto onerror;
 
@@ -223,21 +267,11 @@ seafile_session_init (SeafileSession *session)
     if (seaf_fs_manager_init (session->fs_mgr) < 0)
         return -1;
 
-    if (seaf_branch_manager_init (session->branch_mgr) < 0) {
-        seaf_warning ("Failed to init branch manager.\n");
-        return -1;
-    }
-
     if (seaf_repo_manager_init (session->repo_mgr) < 0) {
         seaf_warning ("Failed to init repo manager.\n");
         return -1;
     }
 
-    if (seaf_quota_manager_init (session->quota_mgr) < 0) {
-        seaf_warning ("Failed to init quota manager.\n");
-        return -1;
-    }
-
     if (ccnet_user_manager_prepare (session->user_mgr) < 0) {
         seaf_warning ("Failed to init user manager.\n");
         return -1;
@@ -253,6 +287,42 @@ seafile_session_init (SeafileSession *session)
         return -1;
     }
 
+    return 0;
+}
+
+/*
+ * Checking and creating tables takes a round trip per table, which adds up
+ * on a remote database. It's done after the servers are started instead of
+ * holding them up, and seafile_session_is_ready() reports when it's done.
+ * Managers create no threads before they get work, their thread pools are
+ * not exclusive.
+ */
+static int
+create_tables (SeafileSession *session)
+{
+    if (seaf_branch_manager_init (session->branch_mgr) < 0) {
+        seaf_warning ("Failed to init branch manager.\n");
+        return -1;
+    }
+
+    if (seaf_repo_manager_create_tables (session->repo_mgr) < 0)
+        return -1;
+
+    if (seaf_quota_manager_init (session->quota_mgr) < 0) {
+        seaf_warning ("Failed to init quota manager.\n");
+        return -1;
+    }
+
+    if (seaf_share_manager_start (session->share_mgr) < 0) {
+        seaf_warning ("Failed to start share manager.\n");
+        return -1;
+    }
+
+    if (ccnet_user_manager_create_tables (session->user_mgr) < 0 ||
+        ccnet_group_manager_create_tables (session->group_mgr) < 0 ||
+        ccnet_org_manager_create_tables (session->org_mgr) < 0)
+        return -1;
+
     if ((session->create_tables || seaf_db_type(session->db) == SEAF_DB_TYPE_PGSQL)
         && seaf_cfg_manager_init (session->cfg_mgr) < 0) {
         seaf_warning ("Failed to init config manager.\n");
@@ -262,13 +332,43 @@ seafile_session_init (SeafileSession *session)
     return 0;
 }
 
+static int
+create_system_info_table (SeafileSession *session);
+static void *
+create_system_default_repo (void *data);
+
+static void *
+create_tables_thread (void *vdata)
+{
+    SeafileSession *session = vdata;
+    gint64 start = g_get_monotonic_time ();
+
+    /* Like a failure at startup. */
+    if (create_tables (session) < 0) {
+        seaf_warning ("Failed to create database tables.\n");
+        exit (1);
+    }
+    seaf_message ("Database tables checked in %" G_GINT64_FORMAT " ms.\n",
+                  (g_get_monotonic_time () - start) / 1000);
+
+    g_atomic_int_set (&session->ready, 1);
+
+    /* Create a system default repo to contain the tutorial file. */
+    if (create_system_info_table (session) == 0)
+        create_system_default_repo (session);
+    return NULL;
+}
+
+gboolean
+seafile_session_is_ready (SeafileSession *session)
+{
+    return g_atomic_int_get (&session->ready) != 0;
+}
+
 int
 seafile_session_start (SeafileSession *session)
 {
-    if (seaf_share_manager_start (session->share_mgr) < 0) {
-        seaf_warning ("Failed to start share manager.\n");
-        return -1;
-    }
+    pthread_t tid;
 
     if (seaf_web_at_manager_start (session->web_at_mgr) < 0) {
         seaf_warning ("Failed to start web access check manager.\n");
@@ -295,8 +395,17 @@ seafile_session_start (SeafileSession *session)
             seaf_warning ("Failed to start http server thread.\n");
             return -1;
         }
+
+        if (seaf_http_server_warm_up (session->http_server) < 0)
+            seaf_warning ("Failed to start warming up caches.\n");
     }
 
+    if (pthread_create (&tid, NULL, create_tables_thread, session) != 0) {
+        seaf_warning ("Failed to start creating database tables.\n");
+        return -1;
+    }
+    pthread_detach (tid);
+
     return 0;
 }
 
@@ -431,8 +540,8 @@ create_system_default_repo (void *data)
     return data;
 }
 
-void
-schedule_create_system_default_repo (SeafileSession *session)
+static int
+create_system_info_table (SeafileSession *session)
 {
     int db_type = seaf_db_type (session->db);
     char *sql;
@@ -447,9 +556,6 @@ schedule_create_system_default_repo (SeafileSession *session)
 
     if ((session->create_tables || db_type == SEAF_DB_TYPE_PGSQL)
         && seaf_db_query (session->db, sql) < 0)
-        return;
-
-    ccnet_job_manager_schedule_job (session->job_mgr,
-                                    create_system_default_repo,
-                                    NULL, session);
+        return -1;
+    return 0;
 }
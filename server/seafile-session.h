@@ -22,8 +22,10 @@
 #include "passwd-mgr.h"
 #include "quota-mgr.h"
 #include "size-sched.h"
+#include "commit-desc.h"
 #include "copy-mgr.h"
 #include "config-mgr.h"
+#include "executor.h"
 
 #include "http-server.h"
 #include "zip-download-mgr.h"
@@ -65,8 +67,10 @@ struct _SeafileSession {
 
     SeafMqManager       *mq_mgr;
     CcnetJobManager     *job_mgr;
+    SeafExecutor        *executor;
 
     SizeScheduler       *size_sched;
+    CommitDescScheduler *desc_sched;
 
     int                  cloud_mode;
 
@@ -78,10 +82,17 @@ struct _SeafileSession {
     gboolean ccnet_create_tables;
 
     gboolean go_fileserver;
+
+    /* Set once the database tables are checked. */
+    gint ready;
 };
 
 extern SeafileSession *seaf;
 
+/* Returns TRUE once startup is complete and every request can be served. */
+gboolean
+seafile_session_is_ready (SeafileSession *session);
+
 SeafileSession *
 seafile_session_new(const char *central_config_dir, 
                     const char *seafile_dir,
@@ -97,9 +108,6 @@ seafile_session_get_tmp_file_path (SeafileSession *session,
                                    const char *basename,
                                    char path[]);
 
-void
-schedule_create_system_default_repo (SeafileSession *session);
-
 char *
 get_system_default_repo_id (SeafileSession *session);
 
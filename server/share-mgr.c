@@ -111,6 +111,7 @@ seaf_share_manager_add_share (SeafShareManager *mgr, const char *repo_id,
         ret = -1;
         goto out;
     }
+    seaf_repo_manager_notify_repo_list_change (mgr->seaf->repo_mgr, repo_id, to_email_l);
 
 out:
     g_free (from_email_l);
@@ -118,6 +119,71 @@ out:
     return ret;
 }
 
+static gboolean
+collect_shared_to_emails (SeafDBRow *row, void *data)
+{
+    GHashTable *emails = data;
+    char *to_email = g_ascii_strdown (seaf_db_row_get_column_text (row, 0), -1);
+
+    /* Emails differing only in case are one key, the old one is freed. */
+    g_hash_table_replace (emails, to_email, to_email);
+
+    return TRUE;
+}
+
+int
+seaf_share_manager_add_shares (SeafShareManager *mgr, const char *repo_id,
+                               const char *from_email, GList *to_emails,
+                               const char *permission)
+{
+    GHashTable *shared;
+    SeafDBBatch *batch;
+    GList *ptr, *n, *new_emails = NULL;
+    int ret = 0;
+
+    char *from_email_l = g_ascii_strdown (from_email, -1);
+
+    shared = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT to_email FROM SharedRepo "
+                                       "WHERE repo_id=? AND from_email=?",
+                                       collect_shared_to_emails, shared,
+                                       2, "string", repo_id,
+                                       "string", from_email_l) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    batch = seaf_db_batch_new (mgr->seaf->db,
+                               "INSERT INTO SharedRepo (repo_id, from_email, "
+                               "to_email, permission)", 4);
+    for (ptr = to_emails; ptr; ptr = ptr->next) {
+        char *to_email_l = g_ascii_strdown ((char *)ptr->data, -1);
+        if (g_strcmp0 (to_email_l, from_email_l) == 0 ||
+            g_hash_table_lookup (shared, to_email_l)) {
+            g_free (to_email_l);
+            continue;
+        }
+        seaf_db_batch_add_row (batch, "string", repo_id, "string", from_email_l,
+                               "string", to_email_l, "string", permission);
+        /* Duplicates in the list are shared once. */
+        g_hash_table_insert (shared, to_email_l, to_email_l);
+        new_emails = g_list_prepend (new_emails, to_email_l);
+    }
+    ret = seaf_db_batch_finish (batch);
+    if (ret == 0) {
+        for (n = new_emails; n; n = n->next)
+            seaf_repo_manager_notify_repo_list_change (mgr->seaf->repo_mgr,
+                                                       repo_id, n->data);
+    }
+
+out:
+    g_list_free (new_emails);
+    g_hash_table_destroy (shared);
+    g_free (from_email_l);
+    return ret;
+}
+
 int
 seaf_share_manager_set_subdir_perm_by_path (SeafShareManager *mgr, const char *repo_id,
                                            const char *from_email, const char *to_email,
@@ -138,6 +204,7 @@ seaf_share_manager_set_subdir_perm_by_path (SeafShareManager *mgr, const char *r
                                    "string", path,
                                    "string", from_email_l,
                                    "string", to_email_l);
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, repo_id, to_email_l);
     g_free (from_email_l);
     g_free (to_email_l);
     return ret;
@@ -159,6 +226,7 @@ seaf_share_manager_set_permission (SeafShareManager *mgr, const char *repo_id,
     ret = seaf_db_statement_query (mgr->seaf->db, sql,
                                    4, "string", permission, "string", repo_id,
                                    "string", from_email_l, "string", to_email_l);
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, repo_id, to_email_l);
 
     g_free (from_email_l);
     g_free (to_email_l);
@@ -560,17 +628,13 @@ get_shared_dirs_to_group (SeafDBRow *row, void *data)
 // Conver group id list to comma separated str
 // [1, 2, 3] -> 1,2,3
 static GString *
-convert_group_list_to_str (GList *groups)
+convert_group_list_to_str (GList *group_id_list)
 {
-    GList *iter = groups;
-    CcnetGroup *group;
-    int group_id;
+    GList *iter = group_id_list;
     GString *group_ids = g_string_new ("");
 
     for (; iter; iter = iter->next) {
-        group = iter->data;
-        g_object_get (group, "id", &group_id, NULL);
-        g_string_append_printf (group_ids, "%d,", group_id);
+        g_string_append_printf (group_ids, "%d,", GPOINTER_TO_INT(iter->data));
     }
     group_ids = g_string_erase (group_ids, group_ids->len - 1, 1);
 
@@ -605,14 +669,14 @@ seaf_share_manager_get_shared_dirs_to_user (SeafShareManager *mgr,
 GHashTable *
 seaf_share_manager_get_shared_dirs_to_group (SeafShareManager *mgr,
                                              const char *orig_repo_id,
-                                             GList *groups)
+                                             GList *group_ids_list)
 {
     GHashTable *dirs;
     GString *group_ids;
     char *sql;
 
     dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-    group_ids = convert_group_list_to_str (groups);
+    group_ids = convert_group_list_to_str (group_ids_list);
     sql = g_strdup_printf ("SELECT v.path, s.permission "
                            "FROM RepoGroup s, VirtualRepo v WHERE "
                            "s.repo_id = v.repo_id AND v.origin_repo = ? "
@@ -644,6 +708,8 @@ seaf_share_manager_remove_share (SeafShareManager *mgr, const char *repo_id,
                        "string", to_email) < 0)
         return -1;
 
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, repo_id, to_email);
+
     return 0;
 }
 
@@ -666,6 +732,8 @@ seaf_share_manager_unshare_subdir (SeafShareManager* mgr,
                                  "string", path) < 0)
         return -1;
 
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, orig_repo_id, to_email);
+
     return 0;
 }
 
@@ -677,6 +745,8 @@ seaf_share_manager_remove_repo (SeafShareManager *mgr, const char *repo_id)
                        1, "string", repo_id) < 0)
         return -1;
 
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, repo_id, NULL);
+
     return 0;
 }
 
@@ -872,6 +942,8 @@ seaf_share_manager_unshare_group_subdir (SeafShareManager* mgr,
                                  "string", path) < 0)
         return -1;
 
+    seaf_repo_manager_notify_perm_change (mgr->seaf->repo_mgr, repo_id, NULL);
+
     return 0;
 }
 
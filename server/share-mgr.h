@@ -27,6 +27,15 @@ seaf_share_manager_add_share (SeafShareManager *mgr, const char *repo_id,
                               const char *from_email, const char *to_email,
                               const char *permission);
 
+/*
+ * Share @repo_id to each of @to_emails, skipping @from_email and the users
+ * it's already shared to. The new shares are written in batches.
+ */
+int
+seaf_share_manager_add_shares (SeafShareManager *mgr, const char *repo_id,
+                               const char *from_email, GList *to_emails,
+                               const char *permission);
+
 int
 seaf_share_manager_set_subdir_perm_by_path (SeafShareManager *mgr, const char *repo_id,
                                             const char *from_email, const char *to_email,
@@ -64,10 +73,11 @@ seaf_share_manager_get_shared_dirs_to_user (SeafShareManager *mgr,
                                             const char *orig_repo_id,
                                             const char *to_email);
 
+/* @group_ids: GINT_TO_POINTER group ids. */
 GHashTable *
 seaf_share_manager_get_shared_dirs_to_group (SeafShareManager *mgr,
                                              const char *orig_repo_id,
-                                             GList *groups);
+                                             GList *group_ids);
 
 int
 seaf_share_manager_remove_share (SeafShareManager *mgr, const char *repo_id,
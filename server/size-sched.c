@@ -5,12 +5,26 @@
 #include "seafile-session.h"
 #include "size-sched.h"
 #include "diff-simple.h"
+#include "bg-throttle.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
+/*
+ * Repos whose size needs to be recomputed are kept in a dirty set, so that
+ * a burst of head updates of a repo queues only one job, which computes
+ * against the head at the time it starts. The set is also stored in the
+ * RepoSizeDirty table, shared with the Go file server, so that pending
+ * computations survive restarts. A row is removed only if the repo isn't
+ * marked dirty again after the computation started.
+ */
+
 typedef struct SizeSchedulerPriv {
     pthread_t thread_id;
-    GThreadPool *compute_repo_size_thread_pool;
+    pthread_mutex_t lock;
+    /* Repos with a job that hasn't started yet. */
+    GHashTable *pending;
+    /* Shared by all size jobs, NULL if not configured. */
+    BgThrottle *throttle;
 } SizeSchedulerPriv;
 
 typedef struct RepoSizeJob {
@@ -24,8 +38,8 @@ typedef struct RepoInfo {
     gint64 file_count;
 } RepoInfo;
 
-static void*
-compute_repo_size (void *vjob);
+static int
+compute_repo_size (RepoSizeJob *job);
 static void
 compute_task (void *data, void *user_data);
 static void*
@@ -36,7 +50,6 @@ log_unprocessed_task_thread (void *arg);
 SizeScheduler *
 size_scheduler_new (SeafileSession *session)
 {
-    GError *error = NULL;
     SizeScheduler *sched = g_new0 (SizeScheduler, 1);
     int sched_thread_num;
 
@@ -50,33 +63,66 @@ size_scheduler_new (SeafileSession *session)
     }
 
     sched->seaf = session;
+    pthread_mutex_init (&sched->priv->lock, NULL);
+    sched->priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+    sched->priv->throttle = bg_throttle_new (session->config, "size_scheduler");
 
     sched_thread_num = g_key_file_get_integer (session->config, "scheduler", "size_sched_thread_num", NULL);
 
     if (sched_thread_num == 0)
         sched_thread_num = DEFAULT_SCHEDULE_THREAD_NUMBER;
 
-    sched->priv->compute_repo_size_thread_pool = g_thread_pool_new (compute_task, NULL,
-                                                                    sched_thread_num, FALSE, &error);
-    if (!sched->priv->compute_repo_size_thread_pool) {
-        if (error) {
-            seaf_warning ("Failed to create compute repo size thread pool: %s.\n", error->message);
-        } else {
-            seaf_warning ("Failed to create repo size thread pool.\n");
-        }
+    seaf_executor_set_max_running (session->executor, SEAF_JOB_SIZE,
+                                   sched_thread_num);
 
-        g_clear_error (&error);
-        g_free (sched->priv);
-        g_free (sched);
-        return NULL;
+    return sched;
+}
+
+/* Returns FALSE if the repo already has a pending job. */
+static gboolean
+push_job (SizeScheduler *scheduler, const char *repo_id)
+{
+    SizeSchedulerPriv *priv = scheduler->priv;
+    RepoSizeJob *job;
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->pending, repo_id)) {
+        pthread_mutex_unlock (&priv->lock);
+        return FALSE;
     }
+    g_hash_table_insert (priv->pending, g_strdup(repo_id), GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&priv->lock);
 
-    return sched;
+    job = g_new0(RepoSizeJob, 1);
+    job->sched = scheduler;
+    memcpy (job->repo_id, repo_id, 36);
+
+    seaf_executor_push (scheduler->seaf->executor, SEAF_JOB_SIZE, compute_task, job, NULL);
+
+    return TRUE;
+}
+
+static gboolean
+load_dirty_repo (SeafDBRow *row, void *data)
+{
+    SizeScheduler *scheduler = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+
+    if (repo_id && is_uuid_valid (repo_id))
+        push_job (scheduler, repo_id);
+
+    return TRUE;
 }
 
 int
 size_scheduler_start (SizeScheduler *scheduler)
 {
+    if (seaf_db_statement_foreach_row (scheduler->seaf->db,
+                                       "SELECT repo_id FROM RepoSizeDirty",
+                                       load_dirty_repo, scheduler, 0) < 0)
+        seaf_warning ("Failed to load repos waiting for size computation.\n");
+
     int ret = pthread_create (&scheduler->priv->thread_id, NULL, log_unprocessed_task_thread, scheduler);
     if (ret < 0) {
         seaf_warning ("Failed to create log unprocessed task thread.\n");
@@ -90,12 +136,41 @@ size_scheduler_start (SizeScheduler *scheduler)
 void
 schedule_repo_size_computation (SizeScheduler *scheduler, const char *repo_id)
 {
-    RepoSizeJob *job = g_new0(RepoSizeJob, 1);
+    SizeSchedulerPriv *priv = scheduler->priv;
+    gboolean pending;
 
-    job->sched = scheduler;
-    memcpy (job->repo_id, repo_id, 37);
+    pthread_mutex_lock (&priv->lock);
+    pending = (g_hash_table_lookup (priv->pending, repo_id) != NULL);
+    pthread_mutex_unlock (&priv->lock);
+
+    /* The pending job will see this head. */
+    if (pending)
+        return;
+
+    if (seaf_db_statement_query (scheduler->seaf->db,
+                                 "REPLACE INTO RepoSizeDirty (repo_id, dirty_time) "
+                                 "VALUES (?, ?)",
+                                 2, "string", repo_id,
+                                 "int64", get_current_time ()) < 0)
+        seaf_warning ("Failed to mark size of repo %s as dirty.\n", repo_id);
 
-    g_thread_pool_push (scheduler->priv->compute_repo_size_thread_pool, job, NULL);
+    push_job (scheduler, repo_id);
+}
+
+int
+size_scheduler_get_queue_len (SizeScheduler *scheduler)
+{
+    return seaf_executor_get_queued (scheduler->seaf->executor, SEAF_JOB_SIZE);
+}
+
+static void
+clear_dirty (SizeScheduler *sched, const char *repo_id, gint64 start_time)
+{
+    if (seaf_db_statement_query (sched->seaf->db,
+                                 "DELETE FROM RepoSizeDirty WHERE repo_id = ? "
+                                 "AND dirty_time <= ?",
+                                 2, "string", repo_id, "int64", start_time) < 0)
+        seaf_warning ("Failed to clear dirty size of repo %s.\n", repo_id);
 }
 
 #define PRINT_UNPROCESSED_TASKS_INTERVAL 30
@@ -106,7 +181,7 @@ void *log_unprocessed_task_thread (void *arg)
     guint unprocessed_num;
 
     while (1) {
-        unprocessed_num = g_thread_pool_unprocessed (sched->priv->compute_repo_size_thread_pool);
+        unprocessed_num = seaf_executor_get_queued (sched->seaf->executor, SEAF_JOB_SIZE);
 
         if (unprocessed_num > 10)
             seaf_message ("The number of repo size update tasks in queue is %u\n",
@@ -122,19 +197,39 @@ static void
 compute_task (void *data, void *user_data)
 {
     RepoSizeJob *job = data;
+    SizeScheduler *sched = job->sched;
+    gint64 start_time;
 
-    compute_repo_size (job);
+    /* Head updates from now on need another job. */
+    pthread_mutex_lock (&sched->priv->lock);
+    g_hash_table_remove (sched->priv->pending, job->repo_id);
+    pthread_mutex_unlock (&sched->priv->lock);
+    start_time = get_current_time ();
+
+    /* The nice value of executor threads can't be restored, only the io
+     * priority is changed. */
+    bg_throttle_attach (sched->priv->throttle);
+    if (compute_repo_size (job) == 0)
+        clear_dirty (sched, job->repo_id, start_time);
+    bg_throttle_detach ();
 
     g_free (job);
 }
 
-static gboolean get_head_id (SeafDBRow *row, void *data)
+typedef struct CachedRepoSize {
+    char head_id[41];
+    gint64 size;
+} CachedRepoSize;
+
+static gboolean get_cached_size (SeafDBRow *row, void *data)
 {
-    char *head_id_out = data;
+    CachedRepoSize *cached = data;
     const char *head_id;
 
     head_id = seaf_db_row_get_column_text (row, 0);
-    memcpy (head_id_out, head_id, 40);
+    if (head_id)
+        memcpy (cached->head_id, head_id, 40);
+    cached->size = seaf_db_row_get_column_int64 (row, 1);
 
     return FALSE;
 }
@@ -148,18 +243,18 @@ set_repo_size_and_file_count (SeafDB *db,
 {
     SeafDBTrans *trans;
     char *sql;
-    char cached_head_id[41] = {0};
+    CachedRepoSize cached = {{0}, 0};
     int ret = 0;
 
     trans = seaf_db_begin_transaction (db);
     if (!trans)
         return -1;
 
-    sql = "SELECT head_id FROM RepoSize WHERE repo_id=?";
+    sql = "SELECT head_id, size FROM RepoSize WHERE repo_id=?";
 
     int n = seaf_db_trans_foreach_selected_row (trans, sql,
-                                                get_head_id,
-                                                cached_head_id,
+                                                get_cached_size,
+                                                &cached,
                                                 1, "string", repo_id);
     if (n < 0) {
         ret = -1;
@@ -183,6 +278,12 @@ set_repo_size_and_file_count (SeafDB *db,
         }
     }
 
+    if (seaf_quota_manager_add_usage_trans (seaf->quota_mgr, trans, repo_id,
+                                            size - cached.size) < 0) {
+        ret = -1;
+        goto rollback;
+    }
+
     gboolean exist;
     gboolean db_err;
 
@@ -217,6 +318,9 @@ set_repo_size_and_file_count (SeafDB *db,
 
     seaf_db_trans_close (trans);
 
+    /* Cached repos hold the size and file count. */
+    seaf_repo_manager_invalidate_repo_cache (seaf->repo_mgr, repo_id);
+
     return ret;
 
 rollback:
@@ -282,10 +386,9 @@ get_old_repo_info_from_db (SeafDB *db, const char *repo_id, gboolean *is_db_err)
 
 }
 
-static void*
-compute_repo_size (void *vjob)
+static int
+compute_repo_size (RepoSizeJob *job)
 {
-    RepoSizeJob *job = vjob;
     SizeScheduler *sched = job->sched;
     SeafRepo *repo = NULL;
     SeafCommit *head = NULL;
@@ -293,7 +396,7 @@ compute_repo_size (void *vjob)
     GObject *file_count_info = NULL;
     gint64 size = 0;
     gint64 file_count = 0;
-    int ret;
+    int ret = -1;
     RepoInfo *info = NULL;
     GError *error = NULL;
     gboolean is_db_err = FALSE;
@@ -301,14 +404,17 @@ compute_repo_size (void *vjob)
     repo = seaf_repo_manager_get_repo (sched->seaf->repo_mgr, job->repo_id);
     if (!repo) {
         seaf_warning ("[scheduler] failed to get repo %s.\n", job->repo_id);
-        return vjob;
+        /* Nothing left to compute for a deleted repo. */
+        return 0;
     }
 
     info = get_old_repo_info_from_db(sched->seaf->db, job->repo_id, &is_db_err);
     if (is_db_err)
         goto out;
-    if (info && g_strcmp0 (info->head_id, repo->head->commit_id) == 0)
+    if (info && g_strcmp0 (info->head_id, repo->head->commit_id) == 0) {
+        ret = 0;
         goto out;
+    }
 
     head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
                                            repo->id, repo->version,
@@ -329,8 +435,8 @@ compute_repo_size (void *vjob)
         gint64 change_file_count = 0;
         GList *diff_entries = NULL;
         
-        ret = diff_commits (old_head, head, &diff_entries, FALSE);
-        if (ret < 0) {
+        /* A rename changes neither the size nor the file count. */
+        if (diff_commits_no_renames (old_head, head, &diff_entries, FALSE) < 0) {
             seaf_warning("[scheduler] failed to do diff.\n");
             goto out;
         }
@@ -378,6 +484,8 @@ compute_repo_size (void *vjob)
         goto out;
     }
 
+    ret = 0;
+
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (head);
@@ -386,6 +494,6 @@ out:
         g_free (info->head_id);
     g_free (info);
 
-    return vjob;
+    return ret;
 }
 
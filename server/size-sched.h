@@ -20,4 +20,8 @@ size_scheduler_start (SizeScheduler *scheduler);
 void
 schedule_repo_size_computation (SizeScheduler *scheduler, const char *repo_id);
 
+/* Size computations waiting for a thread. */
+int
+size_scheduler_get_queue_len (SizeScheduler *scheduler);
+
 #endif
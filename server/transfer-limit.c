@@ -0,0 +1,376 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include <pthread.h>
+
+#include "log.h"
+#include "seafile-session.h"
+#include "fileserver-config.h"
+#include "http-metrics.h"
+#include "transfer-limit.h"
+
+/* Buckets hold up to this many seconds of their rate. */
+#define BURST_SECONDS 1
+/* Users that transferred in this window share total_bandwidth_limit. */
+#define ACTIVE_WINDOW_USEC (2 * G_USEC_PER_SEC)
+#define SWEEP_INTERVAL_USEC G_USEC_PER_SEC
+/* Buckets idle this long are full again and can be dropped. */
+#define IDLE_TIMEOUT_USEC (60 * G_USEC_PER_SEC)
+
+typedef struct TransferBucket {
+    double tokens;
+    gint64 last;
+} TransferBucket;
+
+typedef struct TransferEntry {
+    TransferBucket bytes;
+    TransferBucket ops;
+    int weight;
+    gint64 last_active;
+} TransferEntry;
+
+typedef struct TransferLimiter {
+    pthread_mutex_t lock;
+    /* Per second, 0 means not limited. */
+    double user_rate;
+    double repo_rate;
+    double total_rate;
+    double user_ops;
+    double repo_ops;
+    /* user -> weight */
+    GHashTable *weights;
+    GHashTable *users;
+    GHashTable *repos;
+    /* Sum of the weights of the active users. */
+    int active_weight;
+    gint64 last_sweep;
+} TransferLimiter;
+
+static TransferLimiter *limiter;
+
+static double
+get_limit (GKeyFile *config, char *key, double unit)
+{
+    GError *error = NULL;
+    int value;
+
+    value = fileserver_config_get_integer (config, key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return 0;
+    }
+    if (value < 0)
+        return 0;
+    seaf_message ("fileserver: %s = %d\n", key, value);
+    return value * unit;
+}
+
+void
+transfer_limit_init (SeafileSession *session)
+{
+    TransferLimiter *l = g_new0 (TransferLimiter, 1);
+    char **keys;
+    int i, weight;
+
+    /* Bandwidth limits are in KB/s, operation limits in blocks/s. */
+    l->user_rate = get_limit (session->config, "user_bandwidth_limit", 1024);
+    l->repo_rate = get_limit (session->config, "repo_bandwidth_limit", 1024);
+    l->total_rate = get_limit (session->config, "total_bandwidth_limit", 1024);
+    l->user_ops = get_limit (session->config, "user_iops_limit", 1);
+    l->repo_ops = get_limit (session->config, "repo_iops_limit", 1);
+
+    if (l->user_rate == 0 && l->repo_rate == 0 && l->total_rate == 0 &&
+        l->user_ops == 0 && l->repo_ops == 0) {
+        g_free (l);
+        return;
+    }
+
+    pthread_mutex_init (&l->lock, NULL);
+    l->weights = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    l->users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    l->repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    keys = g_key_file_get_keys (session->config, "transfer_weights", NULL, NULL);
+    for (i = 0; keys && keys[i]; ++i) {
+        weight = g_key_file_get_integer (session->config, "transfer_weights",
+                                         keys[i], NULL);
+        if (weight > 0)
+            g_hash_table_insert (l->weights, g_strdup (keys[i]),
+                                 GINT_TO_POINTER(weight));
+    }
+    g_strfreev (keys);
+
+    limiter = l;
+}
+
+/* Returns the microseconds until the bucket is out of debt. */
+static gint64
+bucket_take (TransferBucket *b, double rate, double n, gint64 now)
+{
+    if (rate <= 0)
+        return 0;
+
+    /* New buckets start full. */
+    if (b->last == 0)
+        b->tokens = rate * BURST_SECONDS;
+    else
+        b->tokens = MIN (rate * BURST_SECONDS,
+                         b->tokens + rate * (now - b->last) / G_USEC_PER_SEC);
+    b->last = now;
+    b->tokens -= n;
+
+    if (b->tokens >= 0)
+        return 0;
+    return (gint64)(-b->tokens / rate * G_USEC_PER_SEC);
+}
+
+static TransferEntry *
+get_entry (GHashTable *table, const char *key)
+{
+    TransferEntry *e = g_hash_table_lookup (table, key);
+
+    if (!e) {
+        e = g_new0 (TransferEntry, 1);
+        e->weight = 1;
+        g_hash_table_insert (table, g_strdup (key), e);
+    }
+
+    return e;
+}
+
+static gboolean
+entry_is_idle (gpointer key, gpointer value, gpointer now)
+{
+    TransferEntry *e = value;
+    return *(gint64 *)now - e->last_active >= IDLE_TIMEOUT_USEC;
+}
+
+/* Called with the lock held. */
+static void
+sweep (gint64 now)
+{
+    GHashTableIter iter;
+    gpointer value;
+    TransferEntry *e;
+
+    g_hash_table_foreach_remove (limiter->users, entry_is_idle, &now);
+    g_hash_table_foreach_remove (limiter->repos, entry_is_idle, &now);
+
+    limiter->active_weight = 0;
+    g_hash_table_iter_init (&iter, limiter->users);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        e = value;
+        if (now - e->last_active < ACTIVE_WINDOW_USEC)
+            limiter->active_weight += e->weight;
+    }
+
+    limiter->last_sweep = now;
+}
+
+gint64
+transfer_limit_charge (const char *user, const char *repo_id,
+                       gint64 bytes, int ops)
+{
+    TransferEntry *e;
+    gint64 now, wait = 0;
+    double rate, share;
+    gboolean new_entry;
+
+    if (!limiter)
+        return 0;
+
+    now = g_get_monotonic_time ();
+
+    pthread_mutex_lock (&limiter->lock);
+
+    if (now - limiter->last_sweep >= SWEEP_INTERVAL_USEC)
+        sweep (now);
+
+    if (user && *user) {
+        new_entry = (g_hash_table_lookup (limiter->users, user) == NULL);
+        e = get_entry (limiter->users, user);
+        if (new_entry)
+            e->weight = MAX (1, GPOINTER_TO_INT (g_hash_table_lookup (limiter->weights, user)));
+        if (new_entry || now - e->last_active >= ACTIVE_WINDOW_USEC)
+            limiter->active_weight += e->weight;
+        e->last_active = now;
+
+        rate = limiter->user_rate;
+        if (limiter->total_rate > 0) {
+            share = limiter->total_rate * e->weight / MAX (limiter->active_weight, e->weight);
+            rate = rate > 0 ? MIN (rate, share) : share;
+        }
+        wait = MAX (wait, bucket_take (&e->bytes, rate, bytes, now));
+        wait = MAX (wait, bucket_take (&e->ops, limiter->user_ops, ops, now));
+    }
+
+    if (repo_id && *repo_id) {
+        e = get_entry (limiter->repos, repo_id);
+        e->last_active = now;
+        wait = MAX (wait, bucket_take (&e->bytes, limiter->repo_rate, bytes, now));
+        wait = MAX (wait, bucket_take (&e->ops, limiter->repo_ops, ops, now));
+    }
+
+    pthread_mutex_unlock (&limiter->lock);
+
+    if (wait > 0)
+        seaf_debug ("Transfer of %s on %.8s waits %"G_GINT64_FORMAT" ms.\n",
+                    user ? user : "-", repo_id ? repo_id : "-", wait / 1000);
+    return wait;
+}
+
+static void
+throttle_timer_cb (evutil_socket_t sock, short type, void *arg)
+{
+    TransferThrottle *throttle = arg;
+    evhtp_request_t *req = throttle->req;
+
+    if (req) {
+        throttle->req = NULL;
+        evhtp_request_resume (req);
+        return;
+    }
+
+    throttle->write_cb (throttle->bev, throttle->write_ctx);
+}
+
+static void
+throttle_arm (TransferThrottle *throttle, struct event_base *evbase, gint64 delay)
+{
+    struct timeval tv;
+
+    if (!throttle->timer)
+        throttle->timer = evtimer_new (evbase, throttle_timer_cb, throttle);
+
+    tv.tv_sec = delay / G_USEC_PER_SEC;
+    tv.tv_usec = delay % G_USEC_PER_SEC;
+    evtimer_add (throttle->timer, &tv);
+}
+
+void
+transfer_throttle_charge (TransferThrottle *throttle,
+                          const char *user, const char *repo_id,
+                          gint64 bytes, int ops)
+{
+    gint64 delay = transfer_limit_charge (user, repo_id, bytes, ops);
+
+    if (delay > 0)
+        throttle->resume_at = g_get_monotonic_time () + delay;
+}
+
+gboolean
+transfer_throttle_wait (TransferThrottle *throttle, struct bufferevent *bev,
+                        bufferevent_data_cb cb, void *ctx)
+{
+    gint64 now;
+
+    if (throttle->resume_at == 0)
+        return FALSE;
+
+    /* The wait is already armed, the output was drained meanwhile. */
+    if (throttle->timer && evtimer_pending (throttle->timer, NULL))
+        return TRUE;
+
+    now = g_get_monotonic_time ();
+    if (now >= throttle->resume_at) {
+        throttle->resume_at = 0;
+        return FALSE;
+    }
+
+    throttle->bev = bev;
+    throttle->write_cb = cb;
+    throttle->write_ctx = ctx;
+    throttle_arm (throttle, bufferevent_get_base (bev), throttle->resume_at - now);
+
+    return TRUE;
+}
+
+void
+transfer_throttle_read (TransferThrottle *throttle, evhtp_request_t *req,
+                        const char *user, const char *repo_id,
+                        gint64 bytes, int ops)
+{
+    gint64 delay = transfer_limit_charge (user, repo_id, bytes, ops);
+
+    transfer_throttle_pause (throttle, req, delay);
+}
+
+void
+transfer_throttle_pause (TransferThrottle *throttle, evhtp_request_t *req,
+                         gint64 delay)
+{
+    if (delay <= 0 || throttle->req)
+        return;
+
+    /* The rest of the data already read is still handled, but no more is
+     * read from the socket until the timer fires.
+     */
+    throttle->req = req;
+    evhtp_request_pause (req);
+    throttle_arm (throttle, evhtp_request_get_connection (req)->evbase, delay);
+}
+
+void
+transfer_throttle_clear (TransferThrottle *throttle)
+{
+    if (throttle->timer)
+        event_free (throttle->timer);
+    memset (throttle, 0, sizeof(TransferThrottle));
+}
+
+typedef struct DelayedReply {
+    TransferThrottle throttle;
+    evhtp_request_t *req;
+    int status;
+} DelayedReply;
+
+static void
+delayed_reply_cb (evutil_socket_t sock, short type, void *arg)
+{
+    DelayedReply *reply = arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (reply->req);
+    evhtp_send_reply (reply->req, reply->status);
+}
+
+static evhtp_res
+delayed_reply_fini_cb (evhtp_request_t *req, void *arg)
+{
+    DelayedReply *reply = arg;
+
+    transfer_throttle_clear (&reply->throttle);
+    g_free (reply);
+
+    return EVHTP_RES_OK;
+}
+
+void
+transfer_throttle_send_reply (evhtp_request_t *req, int status,
+                              const char *user, const char *repo_id,
+                              gint64 bytes, int ops)
+{
+    gint64 delay = transfer_limit_charge (user, repo_id, bytes, ops);
+    DelayedReply *reply;
+    struct timeval tv;
+
+    if (delay <= 0) {
+        evhtp_send_reply (req, status);
+        return;
+    }
+
+    reply = g_new0 (DelayedReply, 1);
+    reply->req = req;
+    reply->status = status;
+    reply->throttle.timer = evtimer_new (evhtp_request_get_connection (req)->evbase,
+                                         delayed_reply_cb, reply);
+    tv.tv_sec = delay / G_USEC_PER_SEC;
+    tv.tv_usec = delay % G_USEC_PER_SEC;
+    evtimer_add (reply->throttle.timer, &tv);
+    /* Frees the reply whether it was sent or the client went away. */
+    http_metrics_set_fini_hook (req, delayed_reply_fini_cb, reply);
+
+    /* Block any new request from this connection until it's replied. */
+    evhtp_request_pause (req);
+}
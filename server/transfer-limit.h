@@ -0,0 +1,97 @@
+#ifndef TRANSFER_LIMIT_H
+#define TRANSFER_LIMIT_H
+
+#include <glib.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#else
+#include <event.h>
+#endif
+
+#include <evhtp.h>
+
+/*
+ * Token buckets of the bytes and block operations of each user and repo,
+ * charged by the block send and receive paths. A path that overdraws a
+ * bucket waits until the debt is paid before it moves on, so one bulk
+ * transfer can't take the disk and the network from everyone else.
+ *
+ * With total_bandwidth_limit set, every user active in the last seconds
+ * gets a share of it proportional to its weight, set in the
+ * [transfer_weights] group, 1 by default.
+ *
+ * Nothing is limited unless a limit is configured.
+ */
+
+struct _SeafileSession;
+
+void
+transfer_limit_init (struct _SeafileSession *session);
+
+/*
+ * Charges @bytes and @ops block operations to @user and @repo_id, either
+ * can be NULL. Returns the microseconds the caller should wait before its
+ * next transfer.
+ */
+gint64
+transfer_limit_charge (const char *user, const char *repo_id,
+                       gint64 bytes, int ops);
+
+/*
+ * Waiting in the event loop of a request. A throttle is kept in the state
+ * of the request and cleared when the state is freed.
+ */
+typedef struct TransferThrottle {
+    struct event *timer;
+    gint64 resume_at;
+
+    /* Called when the wait of a send path is over. */
+    struct bufferevent *bev;
+    bufferevent_data_cb write_cb;
+    void *write_ctx;
+
+    /* Resumed when the wait of a receive path is over. */
+    evhtp_request_t *req;
+} TransferThrottle;
+
+/* For send paths: the next call of the write callback waits for it. */
+void
+transfer_throttle_charge (TransferThrottle *throttle,
+                          const char *user, const char *repo_id,
+                          gint64 bytes, int ops);
+
+/*
+ * Called at the start of a write callback. Returns TRUE if the callback
+ * must return now; it's called again with @bev and @ctx when the wait is
+ * over.
+ */
+gboolean
+transfer_throttle_wait (TransferThrottle *throttle, struct bufferevent *bev,
+                        bufferevent_data_cb cb, void *ctx);
+
+/* For receive paths: reading the body of @req is paused for the wait. */
+void
+transfer_throttle_read (TransferThrottle *throttle, evhtp_request_t *req,
+                        const char *user, const char *repo_id,
+                        gint64 bytes, int ops);
+
+/* Pauses reading the body of @req for @delay microseconds. */
+void
+transfer_throttle_pause (TransferThrottle *throttle, evhtp_request_t *req,
+                         gint64 delay);
+
+void
+transfer_throttle_clear (TransferThrottle *throttle);
+
+/*
+ * Sends the reply of a request whose response body is ready, after the
+ * wait for @bytes and @ops if there is one.
+ */
+void
+transfer_throttle_send_reply (evhtp_request_t *req, int status,
+                              const char *user, const char *repo_id,
+                              gint64 bytes, int ops);
+
+#endif
@@ -0,0 +1,473 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "tree-overlay.h"
+
+/*
+ * A loaded dir keeps its own copy of the entries, and the overlays of its
+ * loaded sub dirs by name. A modified dir is marked dirty together with all
+ * its ancestors, so saving only has to descend into dirty dirs. The id of a
+ * dir is the id it has on disk, until it's saved again.
+ */
+
+struct TreeOverlayDir {
+    char dir_id[41];
+    GList *entries;             /* sorted like in SeafDir */
+    GHashTable *children;       /* name -> TreeOverlayDir of loaded sub dirs */
+    TreeOverlayDir *parent;
+    TreeOverlay *overlay;
+    gboolean dirty;
+};
+
+struct TreeOverlay {
+    char *store_id;
+    int version;
+    gboolean update_mtime;
+    TreeOverlayDir *root;
+    int n_saved_dirs;
+};
+
+static gint
+compare_dirents (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *ent_a = a, *ent_b = b;
+
+    return strcmp (ent_b->name, ent_a->name);
+}
+
+static void
+overlay_dir_free (gpointer p)
+{
+    TreeOverlayDir *dir = p;
+
+    if (!dir)
+        return;
+    g_list_free_full (dir->entries, (GDestroyNotify)seaf_dirent_free);
+    g_hash_table_destroy (dir->children);
+    g_free (dir);
+}
+
+static TreeOverlayDir *
+overlay_dir_new (TreeOverlay *overlay, const char *dir_id, GList *entries)
+{
+    TreeOverlayDir *dir = g_new0 (TreeOverlayDir, 1);
+
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->entries = entries;
+    dir->children = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, overlay_dir_free);
+    dir->overlay = overlay;
+    return dir;
+}
+
+static TreeOverlayDir *
+overlay_dir_load (TreeOverlay *overlay, const char *dir_id)
+{
+    SeafDir *seafdir;
+    TreeOverlayDir *dir;
+
+    seafdir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr,
+                                                  overlay->store_id,
+                                                  overlay->version,
+                                                  dir_id);
+    if (!seafdir)
+        return NULL;
+
+    dir = overlay_dir_new (overlay, dir_id, seafdir->entries);
+    seafdir->entries = NULL;
+    seaf_dir_free (seafdir);
+
+    return dir;
+}
+
+static void
+mark_dirty (TreeOverlayDir *dir)
+{
+    for (; dir && !dir->dirty; dir = dir->parent)
+        dir->dirty = TRUE;
+}
+
+static GList *
+find_entry (TreeOverlayDir *dir, const char *name)
+{
+    GList *ptr;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        if (strcmp (((SeafDirent *)ptr->data)->name, name) == 0)
+            return ptr;
+    }
+    return NULL;
+}
+
+static void
+attach_child (TreeOverlayDir *dir, const char *name, TreeOverlayDir *child)
+{
+    child->parent = dir;
+    g_hash_table_insert (dir->children, g_strdup (name), child);
+}
+
+/* Detach the loaded sub dir @name, if any, from @dir. */
+static TreeOverlayDir *
+detach_child (TreeOverlayDir *dir, const char *name)
+{
+    TreeOverlayDir *child = NULL;
+    gpointer key;
+
+    if (g_hash_table_lookup_extended (dir->children, name,
+                                      &key, (gpointer *)&child)) {
+        g_hash_table_steal (dir->children, name);
+        g_free (key);
+        child->parent = NULL;
+    }
+    return child;
+}
+
+static TreeOverlayDir *
+get_child (TreeOverlayDir *dir, SeafDirent *dent)
+{
+    TreeOverlayDir *child;
+
+    child = g_hash_table_lookup (dir->children, dent->name);
+    if (child)
+        return child;
+
+    child = overlay_dir_load (dir->overlay, dent->id);
+    if (child)
+        attach_child (dir, dent->name, child);
+    return child;
+}
+
+TreeOverlay *
+tree_overlay_new (const char *store_id, int version, const char *root_id)
+{
+    TreeOverlay *overlay = g_new0 (TreeOverlay, 1);
+
+    overlay->store_id = g_strdup (store_id);
+    overlay->version = version;
+    overlay->update_mtime = TRUE;
+    overlay->root = overlay_dir_load (overlay, root_id);
+    if (!overlay->root) {
+        seaf_warning ("Failed to load root dir %s of %s.\n", root_id, store_id);
+        tree_overlay_free (overlay);
+        return NULL;
+    }
+
+    return overlay;
+}
+
+void
+tree_overlay_free (TreeOverlay *overlay)
+{
+    if (!overlay)
+        return;
+
+    overlay_dir_free (overlay->root);
+    g_free (overlay->store_id);
+    g_free (overlay);
+}
+
+void
+tree_overlay_set_update_mtime (TreeOverlay *overlay, gboolean update_mtime)
+{
+    overlay->update_mtime = update_mtime;
+}
+
+char **
+tree_overlay_split_path (const char *path, int *n_names)
+{
+    char **parts = g_strsplit (path, "/", -1);
+    char **names = g_new0 (char *, g_strv_length (parts) + 1);
+    int i, n = 0;
+
+    for (i = 0; parts[i]; i++) {
+        if (*parts[i] == '\0' || strcmp (parts[i], ".") == 0) {
+            g_free (parts[i]);
+        } else if (strcmp (parts[i], "..") == 0) {
+            for (; parts[i]; i++)
+                g_free (parts[i]);
+            g_free (parts);
+            g_strfreev (names);
+            return NULL;
+        } else {
+            names[n++] = parts[i];
+        }
+    }
+    g_free (parts);
+
+    *n_names = n;
+    return names;
+}
+
+TreeOverlayDir *
+tree_overlay_get_dir_by_names (TreeOverlay *overlay, char **names, int n,
+                               gboolean create, GError **error)
+{
+    TreeOverlayDir *dir = overlay->root, *child;
+    SeafDirent *dent;
+    GList *ptr;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ptr = find_entry (dir, names[i]);
+        if (!ptr) {
+            if (!create) {
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                             "Path %s doesn't exist", names[i]);
+                return NULL;
+            }
+            dent = seaf_dirent_new (dir_version_from_repo_version(overlay->version),
+                                    EMPTY_SHA1, S_IFDIR, names[i],
+                                    (gint64)time(NULL), NULL, -1);
+            dir->entries = g_list_insert_sorted (dir->entries, dent,
+                                                 compare_dirents);
+            child = overlay_dir_new (overlay, EMPTY_SHA1, NULL);
+            attach_child (dir, names[i], child);
+            mark_dirty (dir);
+        } else {
+            dent = ptr->data;
+            if (!S_ISDIR(dent->mode)) {
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                             "%s is not a dir", names[i]);
+                return NULL;
+            }
+            child = get_child (dir, dent);
+            if (!child) {
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                             "Dir %s is missing", names[i]);
+                return NULL;
+            }
+        }
+        dir = child;
+    }
+
+    return dir;
+}
+
+TreeOverlayDir *
+tree_overlay_get_dir (TreeOverlay *overlay, const char *path,
+                      gboolean create, GError **error)
+{
+    TreeOverlayDir *dir;
+    char **names;
+    int n = 0;
+
+    names = tree_overlay_split_path (path, &n);
+    if (!names) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid path %s", path);
+        return NULL;
+    }
+
+    dir = tree_overlay_get_dir_by_names (overlay, names, n, create, error);
+    g_strfreev (names);
+    return dir;
+}
+
+GList *
+tree_overlay_dir_get_entries (TreeOverlayDir *dir)
+{
+    return dir->entries;
+}
+
+SeafDirent *
+tree_overlay_dir_lookup (TreeOverlayDir *dir, const char *name)
+{
+    GList *ptr = find_entry (dir, name);
+
+    return ptr ? ptr->data : NULL;
+}
+
+int
+tree_overlay_dir_add (TreeOverlayDir *dir, SeafDirent *dent, GError **error)
+{
+    if (find_entry (dir, dent->name)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "%s already exists", dent->name);
+        return -1;
+    }
+
+    dir->entries = g_list_insert_sorted (dir->entries, dent, compare_dirents);
+    mark_dirty (dir);
+    return 0;
+}
+
+void
+tree_overlay_dir_replace (TreeOverlayDir *dir, SeafDirent *dent)
+{
+    tree_overlay_dir_remove (dir, dent->name);
+    tree_overlay_dir_add (dir, dent, NULL);
+}
+
+int
+tree_overlay_dir_remove (TreeOverlayDir *dir, const char *name)
+{
+    GList *ptr = find_entry (dir, name);
+
+    if (!ptr)
+        return -1;
+
+    g_hash_table_remove (dir->children, name);
+    seaf_dirent_free (ptr->data);
+    dir->entries = g_list_delete_link (dir->entries, ptr);
+    mark_dirty (dir);
+    return 0;
+}
+
+int
+tree_overlay_move (TreeOverlayDir *src, const char *name,
+                   TreeOverlayDir *dst, const char *new_name,
+                   GError **error)
+{
+    TreeOverlayDir *child;
+    SeafDirent *dent;
+    GList *ptr;
+
+    if (!new_name)
+        new_name = name;
+
+    ptr = find_entry (src, name);
+    if (!ptr) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                     "Path %s doesn't exist", name);
+        return -1;
+    }
+    if (src == dst && strcmp (name, new_name) == 0)
+        return 0;
+    if (find_entry (dst, new_name)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "%s already exists", new_name);
+        return -1;
+    }
+
+    dent = ptr->data;
+    child = detach_child (src, name);
+    src->entries = g_list_delete_link (src->entries, ptr);
+    mark_dirty (src);
+
+    if (strcmp (name, new_name) != 0) {
+        g_free (dent->name);
+        dent->name = g_strdup (new_name);
+        dent->name_len = strlen (new_name);
+    }
+
+    dst->entries = g_list_insert_sorted (dst->entries, dent, compare_dirents);
+    if (child)
+        attach_child (dst, new_name, child);
+    mark_dirty (dst);
+    return 0;
+}
+
+static int save_dir (TreeOverlayDir *dir);
+
+/* Save the dirty sub dir of @dent and point @dent to its new id. */
+static int
+save_child (TreeOverlayDir *dir, SeafDirent *dent)
+{
+    TreeOverlay *overlay = dir->overlay;
+    TreeOverlayDir *child;
+
+    if (!S_ISDIR(dent->mode))
+        return 0;
+    child = g_hash_table_lookup (dir->children, dent->name);
+    if (!child || !child->dirty)
+        return 0;
+
+    if (save_dir (child) < 0)
+        return -1;
+    if (strcmp (dent->id, child->dir_id) != 0) {
+        memcpy (dent->id, child->dir_id, 41);
+        if (overlay->update_mtime && overlay->version > 0)
+            dent->mtime = (gint64)time(NULL);
+    }
+    return 0;
+}
+
+/* Write @dir and its modified sub dirs. */
+static int
+save_dir (TreeOverlayDir *dir)
+{
+    TreeOverlay *overlay = dir->overlay;
+    SeafDir *seafdir;
+    GList *ptr;
+    int ret = 0;
+
+    if (!dir->dirty)
+        return 0;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        if (save_child (dir, ptr->data) < 0)
+            return -1;
+    }
+
+    /* The SeafDir only borrows the entries. */
+    seafdir = seaf_dir_new (NULL, dir->entries,
+                            dir_version_from_repo_version(overlay->version));
+    if (strcmp (seafdir->dir_id, dir->dir_id) != 0) {
+        if (seaf_dir_save (seaf->fs_mgr, overlay->store_id,
+                           overlay->version, seafdir) < 0) {
+            seaf_warning ("Failed to save dir %s in %s.\n",
+                          seafdir->dir_id, overlay->store_id);
+            ret = -1;
+            goto out;
+        }
+        memcpy (dir->dir_id, seafdir->dir_id, 41);
+        ++overlay->n_saved_dirs;
+    }
+    dir->dirty = FALSE;
+
+out:
+    seafdir->entries = NULL;
+    seaf_dir_free (seafdir);
+    return ret;
+}
+
+int
+tree_overlay_copy (TreeOverlayDir *src, const char *name,
+                   TreeOverlayDir *dst, GError **error)
+{
+    SeafDirent *dent;
+    GList *ptr;
+
+    ptr = find_entry (src, name);
+    if (!ptr) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                     "Path %s doesn't exist", name);
+        return -1;
+    }
+    if (find_entry (dst, name)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "%s already exists", name);
+        return -1;
+    }
+
+    /* The copy refers to the dir as it is now, so write pending changes of it. */
+    dent = ptr->data;
+    if (save_child (src, dent) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to save dir");
+        return -1;
+    }
+
+    return tree_overlay_dir_add (dst, seaf_dirent_dup (dent), error);
+}
+
+char *
+tree_overlay_save (TreeOverlay *overlay)
+{
+    if (save_dir (overlay->root) < 0)
+        return NULL;
+    return g_strdup (overlay->root->dir_id);
+}
+
+int
+tree_overlay_get_n_saved_dirs (TreeOverlay *overlay)
+{
+    return overlay->n_saved_dirs;
+}
@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef TREE_OVERLAY_H
+#define TREE_OVERLAY_H
+
+#include <glib.h>
+
+#include "fs-mgr.h"
+
+/*
+ * A mutable in-memory view of a dir tree, used to apply edits to a repo
+ * tree without rewriting the path to the root for each of them.
+ *
+ * Dirs are loaded when an edit first reaches them. Edits only change the
+ * overlay and mark the dirs on the path to the root as modified.
+ * tree_overlay_save() computes the new ids bottom-up and writes each
+ * modified dir once. Nothing is written before that, so dropping an overlay
+ * discards its edits.
+ */
+
+typedef struct TreeOverlay TreeOverlay;
+typedef struct TreeOverlayDir TreeOverlayDir;
+
+/* Returns NULL if the root dir can't be loaded. */
+TreeOverlay *
+tree_overlay_new (const char *store_id, int version, const char *root_id);
+
+void
+tree_overlay_free (TreeOverlay *overlay);
+
+/*
+ * By default, the mtime of a dir entry is set to the current time when the
+ * dir changes. Renames keep the mtimes of the dirs above the renamed entry.
+ */
+void
+tree_overlay_set_update_mtime (TreeOverlay *overlay, gboolean update_mtime);
+
+/*
+ * Split @path into its names, ignoring empty names and ".". Returns NULL if
+ * the path contains "..".
+ */
+char **
+tree_overlay_split_path (const char *path, int *n_names);
+
+/*
+ * Returns the dir at @path, relative to the root, or the dir at the first @n
+ * names of @names. Missing dirs are created if @create is set.
+ */
+TreeOverlayDir *
+tree_overlay_get_dir (TreeOverlay *overlay, const char *path,
+                      gboolean create, GError **error);
+
+TreeOverlayDir *
+tree_overlay_get_dir_by_names (TreeOverlay *overlay, char **names, int n,
+                               gboolean create, GError **error);
+
+/* The entries of @dir, sorted like in SeafDir. Owned by the overlay. */
+GList *
+tree_overlay_dir_get_entries (TreeOverlayDir *dir);
+
+SeafDirent *
+tree_overlay_dir_lookup (TreeOverlayDir *dir, const char *name);
+
+/* Add @dent to @dir and take its ownership. Fails if the name exists. */
+int
+tree_overlay_dir_add (TreeOverlayDir *dir, SeafDirent *dent, GError **error);
+
+/* Add @dent to @dir, replacing the entry of the same name if any. */
+void
+tree_overlay_dir_replace (TreeOverlayDir *dir, SeafDirent *dent);
+
+/* Returns -1 if @name doesn't exist in @dir. */
+int
+tree_overlay_dir_remove (TreeOverlayDir *dir, const char *name);
+
+/*
+ * Move the entry @name of @src to @dst, with pending changes under it.
+ * If @new_name is not NULL, the entry is renamed. Fails if the target name
+ * exists in @dst.
+ */
+int
+tree_overlay_move (TreeOverlayDir *src, const char *name,
+                   TreeOverlayDir *dst, const char *new_name,
+                   GError **error);
+
+/* Copy the entry @name of @src, as it is now, to @dst. */
+int
+tree_overlay_copy (TreeOverlayDir *src, const char *name,
+                   TreeOverlayDir *dst, GError **error);
+
+/* Write the modified dirs. Returns the new root id, or NULL on failure. */
+char *
+tree_overlay_save (TreeOverlay *overlay);
+
+int
+tree_overlay_get_n_saved_dirs (TreeOverlay *overlay);
+
+#endif
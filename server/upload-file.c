@@ -26,6 +26,10 @@
 #include "upload-file.h"
 #include "http-status-codes.h"
 #include "http-server.h"
+#include "http-metrics.h"
+#include "upload-trace.h"
+#include "transfer-limit.h"
+#include "http-temp.h"
 
 #include "seafile-error.h"
 
@@ -48,9 +52,11 @@ enum UploadError {
     ERROR_INTERNAL,
 };
 
+/* Updated by the upload with atomic adds, read by progress polls. */
 typedef struct Progress {
     gint64 uploaded;
     gint64 size;
+    int refcnt;
 } Progress;
 
 typedef struct RecvFSM {
@@ -84,12 +90,131 @@ typedef struct RecvFSM {
     gint64 rstart;
     gint64 rend;
     gint64 fsize;
+
+    /* In streaming mode, file data is cut into blocks while it's received,
+     * instead of being written to a tmp file and indexed afterwards.
+     */
+    gboolean streaming;
+    char *store_id;
+    int repo_version;
+    SeafileCrypt *crypt;
+    SeafBlockStream *stream;    /* for the currently uploading file */
+    GList *file_ids;            /* ids of completely streamed files. */
+    GList *file_sizes;          /* sizes (gint64 *) of streamed files. */
+    gint64 streamed_size;
+    gint64 max_upload_size;
+    gboolean too_large;         /* Data after max_upload_size is dropped. */
+
+    /* A chunk of a resumable upload that starts and ends on block
+     * boundaries is also cut into blocks while it's received, in @stream.
+     * The block ids of the chunks are recorded next to the tmp file, so
+     * that the file isn't indexed again when the last chunk arrives.
+     */
+    gboolean index_chunk;
+    GList *chunk_block_ids;
+    char *chunk_blocks_file;    /* set on the last chunk, for clean up. */
+
+    UploadTrace trace;
+    gint64 body_end;            /* when the last piece of body was handled */
+    TransferThrottle throttle;
+
+    /* Bytes of form fields and partial lines charged to upload_mem_used. */
+    gint64 mem_held;
+    gint64 form_bytes;
 } RecvFSM;
 
 #define MAX_CONTENT_LINE 10240
 
-static GHashTable *upload_progress;
-static pthread_mutex_t pg_lock;
+/* Limit of the form fields and partial lines buffered by one upload, the
+ * same as the limit of the Go fileserver.
+ */
+#define MAX_FORM_BUFFERED (10 << 20)
+/* How long an upload that buffers more waits while the budget is used up. */
+#define UPLOAD_MEMORY_WAIT (20 * 1000)
+
+/*
+ * Memory buffered by all uploads. File data is written out or cut into
+ * blocks from the bounded buffer pool of the indexing threads, so only the
+ * form fields and partial lines are counted.
+ */
+static gint64 upload_mem_used;
+
+/*
+ * Progress records are spread over shards by the hash of their ids, each
+ * with a rwlock. Polls only take a read lock, and the data callbacks of
+ * uploads don't lock at all.
+ */
+#define PROGRESS_SHARDS 64
+
+typedef struct ProgressShard {
+    pthread_rwlock_t lock;
+    GHashTable *table;
+} ProgressShard;
+
+static ProgressShard progress_shards[PROGRESS_SHARDS];
+
+static ProgressShard *
+progress_shard (const char *progress_id)
+{
+    return &progress_shards[g_str_hash (progress_id) % PROGRESS_SHARDS];
+}
+
+static void
+progress_unref (Progress *progress)
+{
+    if (progress && g_atomic_int_dec_and_test (&progress->refcnt))
+        g_free (progress);
+}
+
+/* Returns the progress record with a reference, or NULL. */
+static Progress *
+progress_lookup (const char *progress_id)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+    Progress *progress;
+
+    pthread_rwlock_rdlock (&shard->lock);
+    progress = g_hash_table_lookup (shard->table, progress_id);
+    if (progress)
+        g_atomic_int_inc (&progress->refcnt);
+    pthread_rwlock_unlock (&shard->lock);
+
+    return progress;
+}
+
+/* Returns a new record for @progress_id, or NULL if it's taken. */
+static Progress *
+progress_register (const char *progress_id, gint64 size)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+    Progress *progress = NULL;
+
+    pthread_rwlock_wrlock (&shard->lock);
+    if (!g_hash_table_lookup (shard->table, progress_id)) {
+        progress = g_new0 (Progress, 1);
+        progress->size = size;
+        /* One for the table, one for the upload. */
+        progress->refcnt = 2;
+        g_hash_table_insert (shard->table, g_strdup (progress_id), progress);
+    }
+    pthread_rwlock_unlock (&shard->lock);
+
+    return progress;
+}
+
+static void
+progress_unregister (const char *progress_id, Progress *progress)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+
+    pthread_rwlock_wrlock (&shard->lock);
+    if (g_hash_table_lookup (shard->table, progress_id) == progress)
+        g_hash_table_remove (shard->table, progress_id);
+    pthread_rwlock_unlock (&shard->lock);
+
+    progress_unref (progress);
+}
+
 static int
 write_block_data_to_tmp_file (RecvFSM *fsm, const char *parent_dir,
                               const char *file_name);
@@ -216,6 +341,22 @@ send_reply_by_error_code (evhtp_request_t *req, int error_code)
     }
 }
 
+static gint64
+get_max_upload_size ()
+{
+    gint64 max_upload_size;
+
+    /* default is MB */
+    max_upload_size = seaf_cfg_manager_get_config_int64 (seaf->cfg_mgr, "fileserver",
+                                                         "max_upload_size");
+    if (max_upload_size > 0)
+        max_upload_size = max_upload_size * ((gint64)1 << 20);
+    else
+        max_upload_size = -1;
+
+    return max_upload_size;
+}
+
 static gboolean
 check_tmp_file_list (GList *tmp_files, int *error_code)
 {
@@ -236,13 +377,7 @@ check_tmp_file_list (GList *tmp_files, int *error_code)
 
         total_size += (gint64)st.st_size;
     }
-    /* default is MB */
-    max_upload_size = seaf_cfg_manager_get_config_int64 (seaf->cfg_mgr, "fileserver",
-                                                         "max_upload_size");
-    if (max_upload_size > 0)
-        max_upload_size = max_upload_size * ((gint64)1 << 20);
-    else
-        max_upload_size = -1;
+    max_upload_size = get_max_upload_size ();
     
     if (max_upload_size > 0 && total_size > max_upload_size) {
         seaf_debug ("[upload] File size is too large.\n");
@@ -253,6 +388,21 @@ check_tmp_file_list (GList *tmp_files, int *error_code)
     return TRUE;
 }
 
+static gboolean
+check_uploaded_files (RecvFSM *fsm, int *error_code)
+{
+    if (!fsm->streaming)
+        return check_tmp_file_list (fsm->files, error_code);
+
+    if (fsm->too_large) {
+        seaf_debug ("[upload] File size is too large.\n");
+        *error_code = ERROR_SIZE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static char *
 get_canonical_path (const char *path)
 {
@@ -367,29 +517,32 @@ file_list_to_json (GList *files)
     return ret;
 }
 
+/* The dirs of @relative_path are created in the same commit as the files,
+ * so their names are checked before anything is posted.
+ */
 static int
-create_relative_path (RecvFSM *fsm, char *parent_dir, char *relative_path)
+check_relative_path (const char *relative_path)
 {
-    int rc = 0;
-    GError *error = NULL;
-
-    if (!relative_path)
-        return 0;
-
-    rc = seaf_repo_manager_mkdir_with_parents (seaf->repo_mgr,
-                                               fsm->repo_id,
-                                               parent_dir,
-                                               relative_path,
-                                               fsm->user,
-                                               &error);
-    if (rc < 0) {
-        if (error) {
-            seaf_warning ("[upload folder] %s.", error->message);
-            g_clear_error (&error);
+    char *canon_path;
+    char **sub_folders;
+    int i, ret = 0;
+
+    canon_path = get_canonical_path (relative_path);
+    sub_folders = g_strsplit (canon_path, "/", 0);
+    for (i = 0; sub_folders[i]; ++i) {
+        if (*sub_folders[i] == '\0' || strcmp (sub_folders[i], ".") == 0)
+            continue;
+        if (strcmp (sub_folders[i], "..") == 0 ||
+            should_ignore_file (sub_folders[i], NULL)) {
+            seaf_warning ("[upload folder] Invalid dir name %s.\n", sub_folders[i]);
+            ret = -1;
+            break;
         }
     }
 
-    return rc;
+    g_strfreev (sub_folders);
+    g_free (canon_path);
+    return ret;
 }
 
 static char *
@@ -421,6 +574,268 @@ file_id_list_from_json (const char *ret_json)
     return g_string_free (id_list, FALSE);
 }
 
+/* Block ids of the indexed chunks of a resumable upload are appended to
+ * this file beside its tmp file, one chunk per line:
+ * "<start> <end> <block id> <block id> ...". The Go fileserver writes the
+ * same records.
+ */
+#define CHUNK_BLOCKS_SUFFIX ".blocks"
+
+static void
+record_chunk_blocks (RecvFSM *fsm, const char *temp_file)
+{
+    GString *line = g_string_new (NULL);
+    char *path;
+    GList *ptr;
+    int fd;
+
+    g_string_printf (line, "%"G_GINT64_FORMAT" %"G_GINT64_FORMAT,
+                     fsm->rstart, fsm->rend);
+    for (ptr = fsm->chunk_block_ids; ptr; ptr = ptr->next) {
+        g_string_append_c (line, ' ');
+        g_string_append (line, (char *)ptr->data);
+    }
+    g_string_append_c (line, '\n');
+
+    path = g_strconcat (temp_file, CHUNK_BLOCKS_SUFFIX, NULL);
+    fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT,
+                 seaf->http_server->cluster_shared_temp_file_mode);
+    if (fd < 0) {
+        seaf_warning ("[upload] Failed to open %s: %s.\n", path, strerror(errno));
+        goto out;
+    }
+    if (writen (fd, line->str, line->len) < 0)
+        seaf_warning ("[upload] Failed to write %s: %s.\n", path, strerror(errno));
+    close (fd);
+    http_temp_register (path);
+
+out:
+    g_free (path);
+    g_string_free (line, TRUE);
+}
+
+static gboolean
+parse_offset (const char *str, gint64 *offset)
+{
+    char *end;
+
+    *offset = g_ascii_strtoll (str, &end, 10);
+    return end != str && *end == '\0' && *offset >= 0;
+}
+
+/* Chunks sent by several nodes may be recorded at the same time, broken
+ * records are skipped.
+ */
+static gboolean
+chunk_record_valid (char **fields, gint64 fsize, gint64 *start)
+{
+    gint64 block_size = seaf->http_server->fixed_block_size;
+    gint64 end;
+    guint n_ids, i;
+
+    n_ids = g_strv_length (fields);
+    if (n_ids < 3)
+        return FALSE;
+    n_ids -= 2;
+
+    if (!parse_offset (fields[0], start) || !parse_offset (fields[1], &end))
+        return FALSE;
+    if (end < *start || end >= fsize || *start % block_size != 0)
+        return FALSE;
+    if (end != fsize - 1 && (end + 1) % block_size != 0)
+        return FALSE;
+    if (n_ids != (end - *start + block_size) / block_size)
+        return FALSE;
+
+    for (i = 0; i < n_ids; ++i) {
+        if (!is_object_id_valid (fields[i + 2]))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Returns the block ids of a resumable upload, or NULL unless all of its
+ * chunks were indexed.
+ */
+static GList *
+load_chunk_block_ids (const char *temp_file, gint64 fsize)
+{
+    char *path, *contents = NULL;
+    char **lines, **fields;
+    GHashTable *chunks;
+    GList *ids = NULL;
+    gint64 start, pos;
+    gint64 *key;
+    int i;
+
+    path = g_strconcat (temp_file, CHUNK_BLOCKS_SUFFIX, NULL);
+    if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+        g_free (path);
+        return NULL;
+    }
+    g_free (path);
+
+    /* start -> fields of the chunk, a chunk sent again replaces the
+     * earlier record.
+     */
+    chunks = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                    g_free, (GDestroyNotify)g_strfreev);
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; ++i) {
+        fields = g_strsplit (lines[i], " ", -1);
+        if (!chunk_record_valid (fields, fsize, &start)) {
+            g_strfreev (fields);
+            continue;
+        }
+        key = g_new (gint64, 1);
+        *key = start;
+        g_hash_table_replace (chunks, key, fields);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    pos = 0;
+    while (pos < fsize) {
+        fields = g_hash_table_lookup (chunks, &pos);
+        if (!fields) {
+            string_list_free (ids);
+            ids = NULL;
+            goto out;
+        }
+        for (i = 2; fields[i]; ++i)
+            ids = g_list_prepend (ids, g_strdup (fields[i]));
+        parse_offset (fields[1], &pos);
+        ++pos;
+    }
+    ids = g_list_reverse (ids);
+
+out:
+    g_hash_table_destroy (chunks);
+    return ids;
+}
+
+/* Commits a resumable upload from the blocks of its chunks. Returns 1 if
+ * the tmp file has to be indexed instead.
+ */
+static int
+post_indexed_chunks (RecvFSM *fsm, const char *parent_dir, int replace,
+                     gboolean create_parents, char **ret_json, GError **error)
+{
+    const char *temp_file = fsm->files->data;
+    GList *block_ids, *id_list, *size_list;
+    unsigned char sha1[20];
+    char hex[41];
+    gint64 size = fsm->fsize;
+    gint64 start = g_get_monotonic_time ();
+    int rc;
+
+    block_ids = load_chunk_block_ids (temp_file, fsm->fsize);
+    if (!block_ids)
+        return 1;
+
+    /* The blocks aren't referenced by any commit yet, gc may have removed
+     * some of them during a long upload.
+     */
+    rc = seaf_fs_manager_index_existed_file_blocks (seaf->fs_mgr,
+                                                    fsm->store_id,
+                                                    fsm->repo_version,
+                                                    block_ids, sha1, size);
+    string_list_free (block_ids);
+    if (rc < 0) {
+        seaf_message ("[upload] Blocks of %s are missing, indexing the file.\n",
+                      temp_file);
+        return 1;
+    }
+    upload_trace_add (&fsm->trace, UPLOAD_STAGE_INDEX, start);
+
+    rawdata_to_hex (sha1, hex, 20);
+    id_list = g_list_prepend (NULL, g_strdup (hex));
+    size_list = g_list_prepend (NULL, &size);
+
+    upload_trace_set_current (&fsm->trace);
+    rc = seaf_repo_manager_post_indexed_files (seaf->repo_mgr,
+                                               fsm->repo_id,
+                                               parent_dir,
+                                               fsm->filenames,
+                                               id_list,
+                                               size_list,
+                                               fsm->user,
+                                               replace,
+                                               create_parents,
+                                               ret_json,
+                                               error);
+    upload_trace_set_current (NULL);
+
+    string_list_free (id_list);
+    g_list_free (size_list);
+
+    /* There's no index task to remove the tmp file. */
+    if (rc == 0)
+        fsm->need_idx_progress = FALSE;
+
+    return rc;
+}
+
+/* Adds the uploaded files to @parent_dir and commits. Files in tmp files
+ * are indexed first, streamed files and indexed chunks are already indexed.
+ * With @create_parents, missing dirs of @parent_dir are added in the same
+ * commit.
+ */
+static int
+post_uploaded_files (RecvFSM *fsm, const char *parent_dir, int replace,
+                     gboolean create_parents,
+                     char **ret_json, char **task_id, GError **error)
+{
+    char *filenames_json, *tmp_files_json;
+    int rc;
+
+    if (fsm->streaming) {
+        upload_trace_set_current (&fsm->trace);
+        rc = seaf_repo_manager_post_indexed_files (seaf->repo_mgr,
+                                                   fsm->repo_id,
+                                                   parent_dir,
+                                                   fsm->filenames,
+                                                   fsm->file_ids,
+                                                   fsm->file_sizes,
+                                                   fsm->user,
+                                                   replace,
+                                                   create_parents,
+                                                   ret_json,
+                                                   error);
+        upload_trace_set_current (NULL);
+        return rc;
+    }
+
+    if (fsm->index_chunk && fsm->files) {
+        rc = post_indexed_chunks (fsm, parent_dir, replace, create_parents,
+                                  ret_json, error);
+        if (rc <= 0)
+            return rc;
+    }
+
+    filenames_json = file_list_to_json (fsm->filenames);
+    tmp_files_json = file_list_to_json (fsm->files);
+
+    upload_trace_set_current (&fsm->trace);
+    rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
+                                             fsm->repo_id,
+                                             parent_dir,
+                                             filenames_json,
+                                             tmp_files_json,
+                                             fsm->user,
+                                             replace,
+                                             create_parents,
+                                             ret_json,
+                                             fsm->need_idx_progress ? task_id : NULL,
+                                             error);
+    upload_trace_set_current (NULL);
+    g_free (filenames_json);
+    g_free (tmp_files_json);
+
+    return rc;
+}
+
 static void
 upload_api_cb(evhtp_request_t *req, void *arg)
 {
@@ -429,7 +844,6 @@ upload_api_cb(evhtp_request_t *req, void *arg)
     char *relative_path = NULL, *new_parent_dir = NULL;
     GError *error = NULL;
     int error_code = -1;
-    char *filenames_json, *tmp_files_json;
     int replace = 0;
     int rc;
 
@@ -527,7 +941,7 @@ upload_api_cb(evhtp_request_t *req, void *arg)
         }
     }
 
-    if (!fsm->files) {
+    if (!fsm->files && !fsm->file_ids && !fsm->too_large) {
         seaf_debug ("[upload] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file uploaded.\n");
         goto out;
@@ -541,7 +955,7 @@ upload_api_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (!check_tmp_file_list (fsm->files, &error_code))
+    if (!check_uploaded_files (fsm, &error_code))
         goto out;
 
     gint64 content_len;
@@ -556,29 +970,15 @@ upload_api_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    rc = create_relative_path (fsm, parent_dir, relative_path);
-    if (rc < 0) {
-        error_code = ERROR_INTERNAL;
+    if (relative_path && check_relative_path (relative_path) < 0) {
+        error_code = ERROR_FILENAME;
         goto out;
     }
 
-    filenames_json = file_list_to_json (fsm->filenames);
-    tmp_files_json = file_list_to_json (fsm->files);
-
     char *ret_json = NULL;
     char *task_id = NULL;
-    rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
-                                             fsm->repo_id,
-                                             new_parent_dir,
-                                             filenames_json,
-                                             tmp_files_json,
-                                             fsm->user,
-                                             replace,
-                                             &ret_json,
-                                             fsm->need_idx_progress ? &task_id : NULL,
-                                             &error);
-    g_free (filenames_json);
-    g_free (tmp_files_json);
+    rc = post_uploaded_files (fsm, new_parent_dir, replace, relative_path != NULL,
+                              &ret_json, &task_id, &error);
     if (rc < 0) {
         error_code = ERROR_INTERNAL;
         if (error) {
@@ -1000,6 +1400,7 @@ write_block_data_to_tmp_file (RecvFSM *fsm, const char *parent_dir,
             ret = -1;
             goto out;
         }
+        http_temp_register (temp_file);
     } else {
         tmp_fd = g_open (temp_file, O_WRONLY);
         if (tmp_fd < 0) {
@@ -1020,9 +1421,13 @@ write_block_data_to_tmp_file (RecvFSM *fsm, const char *parent_dir,
         goto out;
     }
 
+    if (fsm->chunk_block_ids)
+        record_chunk_blocks (fsm, temp_file);
+
     if (fsm->rend == fsm->fsize - 1) {
         // For the last block, record tmp_files for upload to seafile and remove
         fsm->files = g_list_prepend (fsm->files, g_strdup(temp_file)); // for virus checking, indexing...
+        fsm->chunk_blocks_file = g_strconcat (temp_file, CHUNK_BLOCKS_SUFFIX, NULL);
     }
 
 out:
@@ -1049,7 +1454,6 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
     char *parent_dir = NULL, *relative_path = NULL, *new_parent_dir = NULL;
     GError *error = NULL;
     int error_code = -1;
-    char *filenames_json, *tmp_files_json;
     int rc;
 
     evhtp_headers_add_header (req->headers_out,
@@ -1138,7 +1542,7 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
         }
     }
 
-    if (!fsm->files) {
+    if (!fsm->files && !fsm->file_ids && !fsm->too_large) {
         seaf_debug ("[upload] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file uploaded.\n");
         goto out;
@@ -1152,7 +1556,7 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (!check_tmp_file_list (fsm->files, &error_code))
+    if (!check_uploaded_files (fsm, &error_code))
         goto out;
 
     gint64 content_len;
@@ -1168,29 +1572,15 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    rc = create_relative_path (fsm, parent_dir, relative_path);
-    if (rc < 0) {
-        error_code = ERROR_INTERNAL;
+    if (relative_path && check_relative_path (relative_path) < 0) {
+        error_code = ERROR_FILENAME;
         goto out;
     }
 
-    filenames_json = file_list_to_json (fsm->filenames);
-    tmp_files_json = file_list_to_json (fsm->files);
-
     char *ret_json = NULL;
     char *task_id = NULL;
-    rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
-                                             fsm->repo_id,
-                                             new_parent_dir,
-                                             filenames_json,
-                                             tmp_files_json,
-                                             fsm->user,
-                                             0,
-                                             &ret_json,
-                                             fsm->need_idx_progress ? &task_id : NULL,
-                                             &error);
-    g_free (filenames_json);
-    g_free (tmp_files_json);
+    rc = post_uploaded_files (fsm, new_parent_dir, 0, relative_path != NULL,
+                              &ret_json, &task_id, &error);
     if (rc < 0) {
         error_code = ERROR_INTERNAL;
         if (error) {
@@ -1224,6 +1614,127 @@ out:
     return;
 }
 
+/* Updates @target_file from its blocks. "blockids" lists the block ids of
+ * the new version and "file_size" its size, the file parts are only the
+ * blocks the server doesn't have, named by their ids. If blocks are still
+ * missing, replies SEAF_HTTP_RES_BLOCK_MISSING with their ids in "missing",
+ * for the client to send them. Only the uploaded blocks are read.
+ */
+static void
+update_file_blocks (evhtp_request_t *req, RecvFSM *fsm)
+{
+    char *target_file, *size_str, *blockids_json;
+    char *parent_dir = NULL, *filename = NULL;
+    char *blk_ids_json = NULL, *paths_json = NULL;
+    char *new_file_id = NULL, *missing_json = NULL;
+    const char *head_id;
+    GError *error = NULL;
+    int error_code = -1;
+    gint64 file_size = -1;
+    GList *ptr;
+    int rc;
+
+    target_file = g_hash_table_lookup (fsm->form_kvs, "target_file");
+    size_str = g_hash_table_lookup (fsm->form_kvs, "file_size");
+    blockids_json = g_hash_table_lookup (fsm->form_kvs, "blockids");
+    if (size_str)
+        file_size = atoll (size_str);
+    if (!target_file || file_size < 0) {
+        seaf_debug ("[Update] No target file or file size given.\n");
+        send_error_reply (req, EVHTP_RES_BADREQ, "No target file or file size.\n");
+        return;
+    }
+
+    parent_dir = g_path_get_dirname (target_file);
+    filename = g_path_get_basename (target_file);
+    if (!filename || filename[0] == '\0') {
+        seaf_debug ("[Update] Bad target_file.\n");
+        send_error_reply (req, EVHTP_RES_BADREQ, "Invalid targe_file.\n");
+        goto out;
+    }
+
+    if (!check_parent_dir (req, fsm->repo_id, parent_dir))
+        goto out;
+
+    if (fsm->files && !check_tmp_file_list (fsm->files, &error_code))
+        goto out;
+
+    /* The blocks the new version shares with stored files aren't sent. */
+    if (seaf_quota_manager_check_quota_with_delta (seaf->quota_mgr,
+                                                   fsm->repo_id,
+                                                   get_content_length (req)) != 0) {
+        error_code = ERROR_QUOTA;
+        goto out;
+    }
+
+    if (fsm->files) {
+        for (ptr = fsm->filenames; ptr; ptr = ptr->next) {
+            if (!is_object_id_valid ((char *)ptr->data)) {
+                send_error_reply (req, EVHTP_RES_BADREQ, "Invalid block id.\n");
+                goto out;
+            }
+        }
+
+        blk_ids_json = file_list_to_json (fsm->filenames);
+        paths_json = file_list_to_json (fsm->files);
+        rc = seaf_repo_manager_post_blocks (seaf->repo_mgr,
+                                            fsm->repo_id,
+                                            blk_ids_json,
+                                            paths_json,
+                                            fsm->user,
+                                            &error);
+        if (rc < 0) {
+            g_clear_error (&error);
+            error_code = ERROR_INTERNAL;
+            goto out;
+        }
+    }
+
+    head_id = evhtp_kv_find (req->uri->query, "head");
+
+    upload_trace_set_current (&fsm->trace);
+    rc = seaf_repo_manager_put_file_blocks_delta (seaf->repo_mgr,
+                                                  fsm->repo_id,
+                                                  parent_dir,
+                                                  filename,
+                                                  blockids_json,
+                                                  file_size,
+                                                  fsm->user,
+                                                  head_id,
+                                                  &new_file_id,
+                                                  &missing_json,
+                                                  &error);
+    upload_trace_set_current (NULL);
+    if (rc < 0) {
+        if (missing_json) {
+            evbuffer_add_printf (req->buffer_out,
+                                 "{\"error\": \"Block missing.\", \"missing\": %s}",
+                                 missing_json);
+            send_error_reply (req, SEAF_HTTP_RES_BLOCK_MISSING, NULL);
+        } else if (error && g_strcmp0 (error->message, "file does not exist") == 0) {
+            error_code = ERROR_NOT_EXIST;
+        } else if (error && error->code == SEAF_ERR_BAD_ARGS) {
+            send_error_reply (req, EVHTP_RES_BADREQ, error->message);
+        } else {
+            error_code = ERROR_INTERNAL;
+        }
+        g_clear_error (&error);
+        goto out;
+    }
+
+    evbuffer_add (req->buffer_out, new_file_id, strlen(new_file_id));
+    send_success_reply (req);
+
+out:
+    g_free (parent_dir);
+    g_free (filename);
+    g_free (blk_ids_json);
+    g_free (paths_json);
+    g_free (new_file_id);
+    g_free (missing_json);
+    send_reply_by_error_code (req, error_code);
+}
+
 static void
 update_api_cb(evhtp_request_t *req, void *arg)
 {
@@ -1258,6 +1769,11 @@ update_api_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
+    if (fsm->rstart < 0 && g_hash_table_lookup (fsm->form_kvs, "blockids")) {
+        update_file_blocks (req, fsm);
+        return;
+    }
+
     if (!fsm->filenames) {
         seaf_debug ("[Update] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file uploaded.\n");
@@ -1334,6 +1850,7 @@ update_api_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    upload_trace_set_current (&fsm->trace);
     int rc = seaf_repo_manager_put_file (seaf->repo_mgr,
                                          fsm->repo_id,
                                          (char *)(fsm->files->data),
@@ -1343,6 +1860,7 @@ update_api_cb(evhtp_request_t *req, void *arg)
                                          head_id,
                                          &new_file_id,
                                          &error);
+    upload_trace_set_current (NULL);
     if (rc < 0) {
         error_code = ERROR_INTERNAL;
         if (error) {
@@ -1702,6 +2220,7 @@ update_ajax_cb(evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    upload_trace_set_current (&fsm->trace);
     int rc = seaf_repo_manager_put_file (seaf->repo_mgr,
                                          fsm->repo_id,
                                          (char *)(fsm->files->data),
@@ -1711,6 +2230,7 @@ update_ajax_cb(evhtp_request_t *req, void *arg)
                                          head_id,
                                          &new_file_id,
                                          &error);
+    upload_trace_set_current (NULL);
 
     if (rc < 0) {
         error_code = ERROR_INTERNAL;
@@ -1748,6 +2268,12 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     if (!fsm)
         return EVHTP_RES_OK;
 
+    if (fsm->body_end > 0)
+        fsm->trace.stages[UPLOAD_STAGE_RECV] = fsm->body_end - fsm->trace.start -
+            fsm->trace.stages[UPLOAD_STAGE_WRITE];
+    upload_trace_finish (&fsm->trace, fsm->repo_id, get_content_length (req));
+    transfer_throttle_clear (&fsm->throttle);
+
     /* Clean up FSM struct no matter upload succeed or not. */
 
     g_free (fsm->parent_dir);
@@ -1777,6 +2303,19 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
 
     g_free (fsm->repo_id);
 
+    seaf_block_stream_free (fsm->stream);
+    string_list_free (fsm->chunk_block_ids);
+    if (fsm->chunk_blocks_file) {
+        g_unlink (fsm->chunk_blocks_file);
+        g_free (fsm->chunk_blocks_file);
+    }
+    g_free (fsm->store_id);
+    g_free (fsm->crypt);
+    string_list_free (fsm->file_ids);
+    for (ptr = fsm->file_sizes; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (fsm->file_sizes);
+
     if (!fsm->need_idx_progress) {
         for (ptr = fsm->files; ptr; ptr = ptr->next)
             g_unlink ((char *)(ptr->data));
@@ -1785,15 +2324,11 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     string_list_free (fsm->files);
 
     evbuffer_free (fsm->line);
+    __atomic_fetch_sub (&upload_mem_used, fsm->mem_held, __ATOMIC_RELAXED);
 
-    if (fsm->progress_id) {
-        pthread_mutex_lock (&pg_lock);
-        g_hash_table_remove (upload_progress, fsm->progress_id);
-        pthread_mutex_unlock (&pg_lock);
-
-        /* fsm->progress has been free'd by g_hash_table_remove(). */
-        g_free (fsm->progress_id);
-    }
+    if (fsm->progress)
+        progress_unregister (fsm->progress_id, fsm->progress);
+    g_free (fsm->progress_id);
 
     g_free (fsm);
 
@@ -1947,6 +2482,123 @@ open_temp_file (RecvFSM *fsm)
     return 0;
 }
 
+static int
+open_block_stream (RecvFSM *fsm)
+{
+    fsm->stream = seaf_block_stream_new (seaf->fs_mgr,
+                                         fsm->store_id, fsm->repo_version,
+                                         fsm->crypt);
+    if (!fsm->stream) {
+        seaf_warning ("[upload] Failed to start indexing %s.\n", fsm->file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+close_block_stream (RecvFSM *fsm)
+{
+    unsigned char sha1[20];
+    char hex[41];
+    gint64 *size;
+    gint64 start = g_get_monotonic_time ();
+    int ret = 0;
+
+    if (!fsm->too_large) {
+        size = g_new (gint64, 1);
+        if (seaf_block_stream_finish (fsm->stream, sha1, size) < 0) {
+            g_free (size);
+            ret = -1;
+        } else {
+            rawdata_to_hex (sha1, hex, 20);
+            fsm->file_ids = g_list_prepend (fsm->file_ids, g_strdup(hex));
+            fsm->file_sizes = g_list_prepend (fsm->file_sizes, size);
+        }
+    }
+
+    seaf_block_stream_free (fsm->stream);
+    fsm->stream = NULL;
+
+    upload_trace_add (&fsm->trace, UPLOAD_STAGE_WRITE, start);
+
+    return ret;
+}
+
+/* Indexing a chunk is only a shortcut, the upload goes on without it. */
+static void
+stop_chunk_index (RecvFSM *fsm)
+{
+    seaf_block_stream_free (fsm->stream);
+    fsm->stream = NULL;
+    string_list_free (fsm->chunk_block_ids);
+    fsm->chunk_block_ids = NULL;
+    fsm->index_chunk = FALSE;
+}
+
+static void
+finish_chunk_blocks (RecvFSM *fsm)
+{
+    gint64 size = 0;
+
+    if (!fsm->stream)
+        return;
+
+    string_list_free (fsm->chunk_block_ids);
+    if (seaf_block_stream_finish_blocks (fsm->stream, &fsm->chunk_block_ids,
+                                         &size) < 0 ||
+        size != fsm->rend - fsm->rstart + 1) {
+        stop_chunk_index (fsm);
+        return;
+    }
+
+    seaf_block_stream_free (fsm->stream);
+    fsm->stream = NULL;
+}
+
+static int
+do_write_file_data (RecvFSM *fsm, const char *data, size_t len)
+{
+    if (!fsm->streaming) {
+        if (writen (fsm->fd, data, len) < 0) {
+            seaf_warning ("[upload] Failed to write temp file: %s.\n",
+                          strerror(errno));
+            return -1;
+        }
+        if (fsm->stream && seaf_block_stream_write (fsm->stream, data, len) < 0) {
+            seaf_warning ("[upload] Failed to index chunk of %s.\n", fsm->file_name);
+            stop_chunk_index (fsm);
+        }
+        return 0;
+    }
+
+    /* The upload will be refused, don't store more of it. */
+    fsm->streamed_size += len;
+    if (fsm->max_upload_size > 0 && fsm->streamed_size > fsm->max_upload_size)
+        fsm->too_large = TRUE;
+    if (fsm->too_large)
+        return 0;
+
+    if (seaf_block_stream_write (fsm->stream, data, len) < 0) {
+        seaf_warning ("[upload] Failed to write blocks of %s.\n", fsm->file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+write_file_data (RecvFSM *fsm, const char *data, size_t len)
+{
+    gint64 start = g_get_monotonic_time ();
+    int ret;
+
+    ret = do_write_file_data (fsm, data, len);
+    upload_trace_add (&fsm->trace, UPLOAD_STAGE_WRITE, start);
+
+    return ret;
+}
+
 static evhtp_res
 recv_form_field (RecvFSM *fsm, gboolean *no_line)
 {
@@ -1968,6 +2620,7 @@ recv_form_field (RecvFSM *fsm, gboolean *no_line)
 
             norm_line = normalize_utf8_path (line);
             if (norm_line) {
+                fsm->form_bytes += strlen (fsm->input_name) + strlen (norm_line);
                 g_hash_table_insert (fsm->form_kvs,
                                      g_strdup(fsm->input_name),
                                      norm_line);
@@ -1998,7 +2651,16 @@ recv_form_field (RecvFSM *fsm, gboolean *no_line)
 static evhtp_res
 add_uploaded_file (RecvFSM *fsm)
 {
-    if (fsm->rstart < 0) {
+    if (fsm->streaming) {
+        if (close_block_stream (fsm) < 0)
+            return EVHTP_RES_SERVERR;
+
+        fsm->filenames = g_list_prepend (fsm->filenames,
+                                         get_basename(fsm->file_name));
+        g_free (fsm->file_name);
+        fsm->file_name = NULL;
+        fsm->recved_crlf = FALSE;
+    } else if (fsm->rstart < 0) {
         // Non breakpoint transfer, same as original
 
         /* In case of using NFS, the error may only occur in close(). */
@@ -2016,6 +2678,9 @@ add_uploaded_file (RecvFSM *fsm)
         fsm->tmp_file = NULL;
         fsm->recved_crlf = FALSE;
     } else {
+        if (fsm->index_chunk)
+            finish_chunk_blocks (fsm);
+
         fsm->filenames = g_list_prepend (fsm->filenames,
                                          get_basename(fsm->file_name));
         g_free (fsm->file_name);
@@ -2061,15 +2726,12 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
             } else {
                 seaf_debug ("[upload] recv file data %d bytes.\n", size);
                 if (fsm->recved_crlf) {
-                    if (writen (fsm->fd, "\r\n", 2) < 0) {
-                        seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                                   strerror(errno));
+                    if (write_file_data (fsm, "\r\n", 2) < 0) {
+                        g_free (buf);
                         return EVHTP_RES_SERVERR;
                     }
                 }
-                if (writen (fsm->fd, buf, size) < 0) {
-                    seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                               strerror(errno));
+                if (write_file_data (fsm, buf, size) < 0) {
                     g_free (buf);
                     return EVHTP_RES_SERVERR;
                 }
@@ -2094,15 +2756,12 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
     } else {
         seaf_debug ("[upload] recv file data %d bytes.\n", len + 2);
         if (fsm->recved_crlf) {
-            if (writen (fsm->fd, "\r\n", 2) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
+            if (write_file_data (fsm, "\r\n", 2) < 0) {
+                free (line);
                 return EVHTP_RES_SERVERR;
             }
         }
-        if (writen (fsm->fd, line, len) < 0) {
-            seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                       strerror(errno));
+        if (write_file_data (fsm, line, len) < 0) {
             free (line);
             return EVHTP_RES_SERVERR;
         }
@@ -2129,12 +2788,32 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
    ... contents of file1.txt ...
    --AaB03x--
 */
+/*
+ * Charges the memory buffered by @fsm to the budget of all uploads. Returns
+ * TRUE if the budget is used up and @fsm buffers more than before, reading
+ * its body then waits for other uploads to release memory.
+ */
+static gboolean
+charge_upload_memory (RecvFSM *fsm, gint64 held)
+{
+    gint64 limit = seaf->http_server->upload_memory_limit;
+    gint64 delta = held - fsm->mem_held;
+    gint64 used;
+
+    used = __atomic_add_fetch (&upload_mem_used, delta, __ATOMIC_RELAXED);
+    fsm->mem_held = held;
+
+    return limit > 0 && used > limit && delta > 0;
+}
+
 static evhtp_res
 upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
 {
     RecvFSM *fsm = arg;
     char *line;
     size_t len;
+    gint64 body_len = evbuffer_get_length (buf);
+    gint64 held;
     gboolean no_line = FALSE;
     int res = EVHTP_RES_OK;
 
@@ -2142,12 +2821,9 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
         return EVHTP_RES_OK;
 
     /* Update upload progress. */
-    if (fsm->progress) {
-        fsm->progress->uploaded += (gint64)evbuffer_get_length(buf);
-
-        seaf_debug ("progress: %lld/%lld\n",
-                    fsm->progress->uploaded, fsm->progress->size);
-    }
+    if (fsm->progress)
+        __atomic_fetch_add (&fsm->progress->uploaded,
+                            (gint64)evbuffer_get_length(buf), __ATOMIC_RELAXED);
 
     evbuffer_add_buffer (fsm->line, buf);
     /* Drain the buffer so that evhtp don't copy it to another buffer
@@ -2187,10 +2863,18 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
                         goto out;
                     }
                     if (g_strcmp0 (fsm->input_name, "file") == 0) {
-                        if (open_temp_file (fsm) < 0) {
+                        if (fsm->streaming) {
+                            if (open_block_stream (fsm) < 0) {
+                                res = EVHTP_RES_SERVERR;
+                                goto out;
+                            }
+                        } else if (open_temp_file (fsm) < 0) {
                             seaf_warning ("[upload] Failed open temp file, errno:[%d]\n", errno);
                             res = EVHTP_RES_SERVERR;
                             goto out;
+                        } else if (fsm->index_chunk && !fsm->stream &&
+                                   open_block_stream (fsm) < 0) {
+                            stop_chunk_index (fsm);
                         }
                     }
                     seaf_debug ("[upload] Start to recv %s.\n", fsm->input_name);
@@ -2219,6 +2903,12 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
         }
     }
 
+    held = (gint64)evbuffer_get_length (fsm->line) + fsm->form_bytes;
+    if (held > MAX_FORM_BUFFERED) {
+        seaf_debug ("[upload] Form fields or lines are too long.\n");
+        res = EVHTP_RES_BADREQ;
+    }
+
 out:
     if (res != EVHTP_RES_OK) {
         /* Don't receive any data before the connection is closed. */
@@ -2230,6 +2920,11 @@ out:
         req->keepalive = 0;
 
         fsm->state = RECV_ERROR;
+    } else {
+        transfer_throttle_read (&fsm->throttle, req, fsm->user, fsm->repo_id,
+                                body_len, 0);
+        if (charge_upload_memory (fsm, held))
+            transfer_throttle_pause (&fsm->throttle, req, UPLOAD_MEMORY_WAIT);
     }
 
     if (res == EVHTP_RES_BADREQ) {
@@ -2237,6 +2932,8 @@ out:
     } else if (res == EVHTP_RES_SERVERR) {
         send_error_reply (req, EVHTP_RES_SERVERR, "Internal server error\n");
     }
+
+    fsm->body_end = g_get_monotonic_time ();
     return EVHTP_RES_OK;
 }
 
@@ -2439,6 +3136,91 @@ get_progress_info (evhtp_request_t *req,
     return 0;
 }
 
+/* Only new files uploaded in one request are streamed. Resumable uploads
+ * need the tmp file to append the chunks to.
+ */
+static void
+setup_streaming_upload (RecvFSM *fsm, const char *url_op, gint64 content_len)
+{
+    SeafRepo *repo;
+
+    if (!seaf->http_server->streaming_upload || fsm->rstart >= 0)
+        return;
+    if (g_strcmp0 (url_op, "upload-api") != 0 &&
+        g_strcmp0 (url_op, "upload-aj") != 0)
+        return;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, fsm->repo_id);
+    if (!repo)
+        return;
+
+    /* An upload over quota will be refused, don't store its blocks.
+     * The other checks are done when the upload ends.
+     */
+    if (seaf_quota_manager_check_quota_with_delta (seaf->quota_mgr,
+                                                   fsm->repo_id,
+                                                   content_len) != 0)
+        goto out;
+
+    if (repo->encrypted) {
+        unsigned char key[32], iv[16];
+        if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
+                                                     repo->id, fsm->user,
+                                                     key, iv) < 0)
+            goto out;
+        fsm->crypt = seafile_crypt_new (repo->enc_version, key, iv);
+    }
+
+    fsm->store_id = g_strdup (repo->store_id);
+    fsm->repo_version = repo->version;
+    fsm->max_upload_size = get_max_upload_size ();
+    fsm->streaming = TRUE;
+
+out:
+    seaf_repo_unref (repo);
+}
+
+/* Only chunks that cover whole blocks are indexed, the last chunk may end
+ * with a partial block. Chunks of files that are uploaded in one request
+ * are indexed when they end.
+ */
+static void
+setup_chunk_index (RecvFSM *fsm, const char *url_op)
+{
+    gint64 block_size = seaf->http_server->fixed_block_size;
+    SeafRepo *repo;
+
+    if (!seaf->http_server->index_resumable_chunks || fsm->rstart < 0 ||
+        fsm->fsize <= 0)
+        return;
+    if (g_strcmp0 (url_op, "upload-api") != 0 &&
+        g_strcmp0 (url_op, "upload-aj") != 0)
+        return;
+    if (fsm->rstart % block_size != 0 ||
+        (fsm->rend != fsm->fsize - 1 && (fsm->rend + 1) % block_size != 0))
+        return;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, fsm->repo_id);
+    if (!repo)
+        return;
+
+    if (repo->encrypted) {
+        unsigned char key[32], iv[16];
+        if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
+                                                     repo->id, fsm->user,
+                                                     key, iv) < 0)
+            goto out;
+        fsm->crypt = seafile_crypt_new (repo->enc_version, key, iv);
+    }
+
+    fsm->store_id = g_strdup (repo->store_id);
+    fsm->repo_version = repo->version;
+    fsm->index_chunk = TRUE;
+
+out:
+    seaf_repo_unref (repo);
+}
+
 static evhtp_res
 upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 {
@@ -2490,13 +3272,12 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     }
 
     if (progress_id != NULL) {
-        pthread_mutex_lock (&pg_lock);
-        if (g_hash_table_lookup (upload_progress, progress_id)) {
-            pthread_mutex_unlock (&pg_lock);
+        progress = progress_lookup (progress_id);
+        if (progress) {
+            progress_unref (progress);
             err_msg = "Duplicate progress id.\n";
             goto err;
         }
-        pthread_mutex_unlock (&pg_lock);
     }
 
     gint64 rstart = -1;
@@ -2525,15 +3306,14 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     /*     fsm->need_idx_progress = TRUE; */
     fsm->need_idx_progress = FALSE;
 
+    setup_streaming_upload (fsm, url_op, content_len);
+    setup_chunk_index (fsm, url_op);
+    upload_trace_start (&fsm->trace, url_op);
+
     if (progress_id != NULL) {
-        progress = g_new0 (Progress, 1);
-        progress->size = content_len;
+        /* Left untracked if another upload took the id meanwhile. */
         fsm->progress_id = progress_id;
-        fsm->progress = progress;
-
-        pthread_mutex_lock (&pg_lock);
-        g_hash_table_insert (upload_progress, g_strdup(progress_id), progress);
-        pthread_mutex_unlock (&pg_lock);
+        fsm->progress = progress_register (progress_id, content_len);
     }
 
     /* Set up per-request hooks, so that we can read file data piece by piece. */
@@ -2610,10 +3390,7 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    pthread_mutex_lock (&pg_lock);
-    progress = g_hash_table_lookup (upload_progress, progress_id);
-    pthread_mutex_unlock (&pg_lock);
-
+    progress = progress_lookup (progress_id);
     if (!progress) {
         /* seaf_warning ("[get pg] No progress found for %s.\n", progress_id); */
         send_error_reply (req, EVHTP_RES_BADREQ, "No progress found.\n");
@@ -2624,7 +3401,10 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
     buf = g_string_new (NULL);
     g_string_append_printf (buf,
                             "%s({\"uploaded\": %"G_GINT64_FORMAT", \"length\": %"G_GINT64_FORMAT"});",
-                            callback, progress->uploaded, progress->size);
+                            callback,
+                            (gint64)__atomic_load_n (&progress->uploaded, __ATOMIC_RELAXED),
+                            progress->size);
+    progress_unref (progress);
     evbuffer_add (req->buffer_out, buf->str, buf->len);
 
     seaf_debug ("JSONP: %s\n", buf->str);
@@ -2637,6 +3417,7 @@ int
 upload_file_init (evhtp_t *htp, const char *http_temp_dir)
 {
     evhtp_callback_t *cb;
+    int i;
 
     if (g_mkdir_with_parents (http_temp_dir, 0777) < 0) {
         seaf_warning ("Failed to create temp file dir %s.\n",
@@ -2653,41 +3434,57 @@ upload_file_init (evhtp_t *htp, const char *http_temp_dir)
     }
     g_free (cluster_shared_dir);
 
-    cb = evhtp_set_regex_cb (htp, "^/upload-api/.*", upload_api_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/upload-api/.*", "upload-api",
+                                    upload_api_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
-    cb = evhtp_set_regex_cb (htp, "^/upload-raw-blks-api/.*",
-                             upload_raw_blks_api_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/upload-raw-blks-api/.*", "upload-raw-blks-api",
+                                    upload_raw_blks_api_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
-    cb = evhtp_set_regex_cb (htp, "^/upload-blks-api/.*", upload_blks_api_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/upload-blks-api/.*", "upload-blks-api",
+                                    upload_blks_api_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
     /* cb = evhtp_set_regex_cb (htp, "^/upload-blks-aj/.*", upload_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
-    cb = evhtp_set_regex_cb (htp, "^/upload-aj/.*", upload_ajax_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/upload-aj/.*", "upload-aj",
+                                    upload_ajax_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
-    cb = evhtp_set_regex_cb (htp, "^/update-api/.*", update_api_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/update-api/.*", "update-api",
+                                    update_api_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
-    cb = evhtp_set_regex_cb (htp, "^/update-blks-api/.*", update_blks_api_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/update-blks-api/.*", "update-blks-api",
+                                    update_blks_api_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
     /* cb = evhtp_set_regex_cb (htp, "^/update-blks-aj/.*", update_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
-    cb = evhtp_set_regex_cb (htp, "^/update-aj/.*", update_ajax_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    cb = http_metrics_set_regex_cb (htp, "^/update-aj/.*", "update-aj",
+                                    update_ajax_cb, NULL);
+    http_metrics_set_route_class (cb, HTTP_ROUTE_UPLOAD);
+    http_metrics_set_headers_hook (cb, upload_headers_cb, NULL);
 
-    evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
+    http_metrics_set_regex_cb (htp, "^/upload_progress.*", "upload-progress", upload_progress_cb, NULL);
 
-    evhtp_set_regex_cb (htp, "^/idx_progress.*", idx_progress_cb, NULL);
+    http_metrics_set_regex_cb (htp, "^/idx_progress.*", "idx-progress", idx_progress_cb, NULL);
 
-    upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                             g_free, g_free);
-    pthread_mutex_init (&pg_lock, NULL);
+    for (i = 0; i < PROGRESS_SHARDS; ++i) {
+        pthread_rwlock_init (&progress_shards[i].lock, NULL);
+        progress_shards[i].table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free,
+                                                          (GDestroyNotify)progress_unref);
+    }
 
     return 0;
 }
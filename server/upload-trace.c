@@ -0,0 +1,82 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+
+#include "log.h"
+#include "upload-trace.h"
+
+static int slow_threshold;
+static double sample_rate;
+
+static GPrivate current_trace;
+
+static const char *stage_names[N_UPLOAD_STAGES] = {
+    "recv", "write", "queue", "index", "tree", "commit",
+};
+
+void
+upload_trace_init (int threshold, double rate)
+{
+    slow_threshold = threshold;
+    sample_rate = rate;
+}
+
+void
+upload_trace_start (UploadTrace *trace, const char *op)
+{
+    memset (trace, 0, sizeof(UploadTrace));
+    g_strlcpy (trace->op, op, sizeof(trace->op));
+    trace->start = g_get_monotonic_time ();
+}
+
+void
+upload_trace_set_current (UploadTrace *trace)
+{
+    g_private_set (&current_trace, trace);
+}
+
+UploadTrace *
+upload_trace_current ()
+{
+    return g_private_get (&current_trace);
+}
+
+void
+upload_trace_add (UploadTrace *trace, UploadStage stage, gint64 since)
+{
+    if (!trace)
+        return;
+    trace->stages[stage] += g_get_monotonic_time () - since;
+}
+
+void
+upload_trace_add_retry (UploadTrace *trace)
+{
+    if (trace)
+        trace->retries++;
+}
+
+void
+upload_trace_finish (UploadTrace *trace, const char *repo_id, gint64 bytes)
+{
+    gint64 total = (g_get_monotonic_time () - trace->start) / 1000;
+    gboolean slow;
+    GString *buf;
+    int i;
+
+    slow = (slow_threshold > 0 && total >= slow_threshold);
+    if (!slow && (sample_rate <= 0 || g_random_double () >= sample_rate))
+        return;
+
+    buf = g_string_new (NULL);
+    for (i = 0; i < N_UPLOAD_STAGES; i++)
+        g_string_append_printf (buf, " %s=%"G_GINT64_FORMAT"ms",
+                                stage_names[i], trace->stages[i] / 1000);
+
+    seaf_message ("%s %s to repo %.8s: %"G_GINT64_FORMAT" bytes in "
+                  "%"G_GINT64_FORMAT"ms,%s retries=%d\n",
+                  slow ? "Slow upload" : "Upload trace", trace->op,
+                  repo_id, bytes, total, buf->str, trace->retries);
+
+    g_string_free (buf, TRUE);
+}
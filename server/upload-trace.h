@@ -0,0 +1,62 @@
+#ifndef UPLOAD_TRACE_H
+#define UPLOAD_TRACE_H
+
+#include <glib.h>
+
+/*
+ * Time spent by an upload in each stage of the pipeline. Stages running in
+ * the request thread, after the body is received, add to the trace set as
+ * current for the thread, so repo-op code doesn't need to pass it around.
+ *
+ * A finished trace is logged with the breakdown if the upload is slower
+ * than the configured threshold, or if it's sampled.
+ */
+
+typedef enum {
+    UPLOAD_STAGE_RECV,      /* receiving the body, less the writes */
+    UPLOAD_STAGE_WRITE,     /* writing tmp files or streamed blocks */
+    UPLOAD_STAGE_QUEUE,     /* waiting for an index thread */
+    UPLOAD_STAGE_INDEX,     /* chunking, hashing, encrypting and writing blocks */
+    UPLOAD_STAGE_TREE,      /* adding the files to the dir tree */
+    UPLOAD_STAGE_COMMIT,    /* creating the commit and updating the head */
+    N_UPLOAD_STAGES,
+} UploadStage;
+
+typedef struct UploadTrace {
+    char op[32];
+    gint64 start;
+    /* Microseconds spent in each stage. */
+    gint64 stages[N_UPLOAD_STAGES];
+    /* Commits retried after concurrent updates. */
+    int retries;
+} UploadTrace;
+
+/* Traces slower than @slow_threshold ms are logged, 0 disables it. A
+ * @sample_rate fraction of the other traces is logged too.
+ */
+void
+upload_trace_init (int slow_threshold, double sample_rate);
+
+void
+upload_trace_start (UploadTrace *trace, const char *op);
+
+/* Sets the trace of the calling thread, NULL clears it. */
+void
+upload_trace_set_current (UploadTrace *trace);
+
+UploadTrace *
+upload_trace_current ();
+
+/* Adds the time since @since, from g_get_monotonic_time(), to @stage.
+ * Nothing is done if @trace is NULL.
+ */
+void
+upload_trace_add (UploadTrace *trace, UploadStage stage, gint64 since);
+
+void
+upload_trace_add_retry (UploadTrace *trace);
+
+void
+upload_trace_finish (UploadTrace *trace, const char *repo_id, gint64 bytes);
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "seaf-db.h"
 #include "diff-simple.h"
+#include "tree-overlay.h"
 
 #define MAX_RUNNING_TASKS 5
 #define SCHEDULE_INTERVAL 1000  /* 1s */
@@ -34,6 +35,8 @@ typedef struct MergeScheduler {
     pthread_mutex_t q_lock;
     GQueue *queue;
     GHashTable *running;
+    /* origin repo id -> head that merges were last dispatched for */
+    GHashTable *dispatched_heads;
     CcnetJobManager *tpool;
     CcnetTimer *timer;
 } MergeScheduler;
@@ -94,7 +97,7 @@ do_create_virtual_repo (SeafRepoManager *mgr,
      * have the same version as the origin.
      */
     repo->version = origin_repo->version;
-    memcpy (repo->store_id, origin_repo->id, 36);
+    memcpy (repo->store_id, origin_repo->store_id, 36);
 
     commit = seaf_commit_new (NULL, repo->id,
                               root_id, /* root id */
@@ -573,6 +576,156 @@ set_virtual_repo_base_commit_path (const char *vrepo_id, const char *base_commit
                              "UPDATE VirtualRepo SET base_commit=?, path=? WHERE repo_id=?",
                              3, "string", base_commit_id, "string", new_path,
                              "string", vrepo_id);
+    seaf_repo_manager_notify_repo_change (seaf->repo_mgr, vrepo_id);
+}
+
+/*
+ * An update of an origin repo only needs merging into the virtual repos
+ * whose dirs it touched. The scheduler remembers the origin head that merges
+ * were last dispatched for. The trees of that head and the new one are
+ * compared once, descending only into changed dirs on the way to a virtual
+ * repo path. Every virtual repo is merged when there's no earlier head or
+ * the trees can't be compared.
+ */
+
+typedef struct VirtPath {
+    SeafVirtRepo *vinfo;
+    char **names;
+    int n_names;
+} VirtPath;
+
+static const char *
+get_subdir_id (SeafDir *dir, const char *name)
+{
+    GList *ptr;
+    SeafDirent *dent;
+
+    if (!dir)
+        return NULL;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (strcmp (dent->name, name) == 0)
+            return S_ISDIR(dent->mode) ? dent->id : NULL;
+    }
+    return NULL;
+}
+
+static void
+add_changed_vpaths (GList *vpaths, GHashTable *changed)
+{
+    GList *ptr;
+    char *repo_id;
+
+    for (ptr = vpaths; ptr; ptr = ptr->next) {
+        repo_id = ((VirtPath *)ptr->data)->vinfo->repo_id;
+        g_hash_table_insert (changed, repo_id, repo_id);
+    }
+}
+
+/* @old_id and @new_id are the dirs at the first @depth names of @vpaths,
+ * NULL if missing. */
+static void
+collect_changed_vpaths (const char *store_id, int version,
+                        const char *old_id, const char *new_id,
+                        int depth, GList *vpaths, GHashTable *changed)
+{
+    GHashTable *children;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafDir *old_dir = NULL, *new_dir = NULL;
+    GList *ptr, *list;
+    VirtPath *vp;
+
+    if (g_strcmp0 (old_id, new_id) == 0)
+        return;
+
+    children = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = vpaths; ptr; ptr = ptr->next) {
+        vp = ptr->data;
+        if (vp->n_names == depth) {
+            g_hash_table_insert (changed, vp->vinfo->repo_id, vp->vinfo->repo_id);
+            continue;
+        }
+        list = g_hash_table_lookup (children, vp->names[depth]);
+        g_hash_table_insert (children, vp->names[depth],
+                             g_list_prepend (list, vp));
+    }
+
+    if (g_hash_table_size (children) > 0) {
+        if (old_id)
+            old_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, store_id,
+                                                   version, old_id);
+        if (new_id)
+            new_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, store_id,
+                                                   version, new_id);
+    }
+
+    g_hash_table_iter_init (&iter, children);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if ((old_id && !old_dir) || (new_id && !new_dir))
+            add_changed_vpaths (value, changed);
+        else
+            collect_changed_vpaths (store_id, version,
+                                    get_subdir_id (old_dir, key),
+                                    get_subdir_id (new_dir, key),
+                                    depth + 1, value, changed);
+        g_list_free (value);
+    }
+
+    g_hash_table_destroy (children);
+    if (old_dir)
+        seaf_dir_free (old_dir);
+    if (new_dir)
+        seaf_dir_free (new_dir);
+}
+
+/*
+ * Returns the ids of the virtual repos in @vinfos whose dirs differ between
+ * @old_head_id and the head of @repo, or NULL if the trees can't be
+ * compared.
+ */
+static GHashTable *
+find_changed_virtual_repos (SeafRepo *repo, const char *old_head_id,
+                            GList *vinfos)
+{
+    SeafCommit *old_head;
+    GHashTable *changed;
+    GList *vpaths = NULL, *ptr;
+    VirtPath *vp;
+
+    old_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                               repo->id, repo->version,
+                                               old_head_id);
+    if (!old_head)
+        return NULL;
+
+    changed = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vp = g_new0 (VirtPath, 1);
+        vp->vinfo = ptr->data;
+        vp->names = tree_overlay_split_path (vp->vinfo->path, &vp->n_names);
+        if (!vp->names) {
+            g_hash_table_insert (changed, vp->vinfo->repo_id, vp->vinfo->repo_id);
+            g_free (vp);
+            continue;
+        }
+        vpaths = g_list_prepend (vpaths, vp);
+    }
+
+    collect_changed_vpaths (repo->store_id, repo->version,
+                            old_head->root_id, repo->root_id,
+                            0, vpaths, changed);
+
+    for (ptr = vpaths; ptr; ptr = ptr->next) {
+        vp = ptr->data;
+        g_strfreev (vp->names);
+        g_free (vp);
+    }
+    g_list_free (vpaths);
+    seaf_commit_unref (old_head);
+
+    return changed;
 }
 
 int
@@ -580,8 +733,11 @@ seaf_repo_manager_merge_virtual_repo (SeafRepoManager *mgr,
                                       const char *repo_id,
                                       const char *exclude_repo)
 {
-    GList *vrepos = NULL, *ptr;
-    char *vrepo_id;
+    GList *vinfos = NULL, *ptr;
+    SeafVirtRepo *vinfo;
+    SeafRepo *repo = NULL;
+    char *old_head_id = NULL;
+    GHashTable *changed = NULL;
     int ret = 0;
 
     if (seaf_repo_manager_is_virtual_repo (mgr, repo_id)) {
@@ -589,17 +745,45 @@ seaf_repo_manager_merge_virtual_repo (SeafRepoManager *mgr,
         return 0;
     }
 
-    vrepos = seaf_repo_manager_get_virtual_repo_ids_by_origin (mgr, repo_id);
-    for (ptr = vrepos; ptr; ptr = ptr->next) {
-        vrepo_id = ptr->data;
+    vinfos = seaf_repo_manager_get_virtual_info_by_origin (mgr, repo_id);
+    if (!vinfos) {
+        pthread_mutex_lock (&scheduler->q_lock);
+        g_hash_table_remove (scheduler->dispatched_heads, repo_id);
+        pthread_mutex_unlock (&scheduler->q_lock);
+        return 0;
+    }
+
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    if (repo) {
+        pthread_mutex_lock (&scheduler->q_lock);
+        old_head_id = g_strdup (g_hash_table_lookup (scheduler->dispatched_heads,
+                                                     repo_id));
+        g_hash_table_replace (scheduler->dispatched_heads, g_strdup (repo_id),
+                              g_strdup (repo->head->commit_id));
+        pthread_mutex_unlock (&scheduler->q_lock);
+
+        if (old_head_id)
+            changed = find_changed_virtual_repos (repo, old_head_id, vinfos);
+    }
 
-        if (g_strcmp0 (exclude_repo, vrepo_id) == 0)
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vinfo = ptr->data;
+
+        if (g_strcmp0 (exclude_repo, vinfo->repo_id) == 0)
+            continue;
+        if (changed && !g_hash_table_lookup (changed, vinfo->repo_id))
             continue;
 
-        add_merge_task (vrepo_id);
+        add_merge_task (vinfo->repo_id);
     }
 
-    string_list_free (vrepos);
+    if (changed)
+        g_hash_table_destroy (changed);
+    g_free (old_head_id);
+    seaf_repo_unref (repo);
+    for (ptr = vinfos; ptr; ptr = ptr->next)
+        seaf_virtual_repo_info_free (ptr->data);
+    g_list_free (vinfos);
     return ret;
 }
 
@@ -1116,6 +1300,8 @@ seaf_repo_manager_init_merge_scheduler ()
     scheduler->queue = g_queue_new ();
     scheduler->running = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, g_free);
+    scheduler->dispatched_heads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, g_free);
 
     scheduler->tpool = ccnet_job_manager_new (MAX_RUNNING_TASKS);
     scheduler->timer = ccnet_timer_new (schedule_merge_tasks,
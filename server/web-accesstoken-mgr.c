@@ -5,12 +5,17 @@
 #include <timer.h>
 
 #include <pthread.h>
+#include <jansson.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "seafile-session.h"
 #include "web-accesstoken-mgr.h"
 #include "seafile-error.h"
 
 #include "utils.h"
+#include "lock-stats.h"
 
 #include "log.h"
 
@@ -20,7 +25,9 @@
 
 struct WebATPriv {
     GHashTable		*access_token_hash; /* token -> access info */
-    pthread_mutex_t lock;
+    /* Nonces of used one-time signed tokens -> expire time. */
+    GHashTable      *used_nonces;
+    SeafLock lock;
 
     gboolean cluster_mode;
     struct ObjCache *cache;
@@ -62,7 +69,9 @@ seaf_web_at_manager_new (SeafileSession *session)
     mgr->priv->access_token_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                     g_free,
                                                     (GDestroyNotify)free_access_info);
-    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->used_nonces = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    seaf_lock_init (&mgr->priv->lock, "web_access_tokens");
 
     return mgr;
 }
@@ -80,18 +89,29 @@ remove_expire_info (gpointer key, gpointer value, gpointer user_data)
     return FALSE;
 }
 
+static gboolean
+remove_expire_nonce (gpointer key, gpointer value, gpointer user_data)
+{
+    gint64 *expire_time = value;
+    long now = *((long*)user_data);
+
+    return now >= *expire_time;
+}
+
 static int
 clean_pulse (void *vmanager)
 {
     SeafWebAccessTokenManager *manager = vmanager;
     long now = (long)time(NULL);
 
-    pthread_mutex_lock (&manager->priv->lock);
+    seaf_lock_lock (&manager->priv->lock);
 
     g_hash_table_foreach_remove (manager->priv->access_token_hash,
                                  remove_expire_info, &now);
+    g_hash_table_foreach_remove (manager->priv->used_nonces,
+                                 remove_expire_nonce, &now);
 
-    pthread_mutex_unlock (&manager->priv->lock);
+    seaf_lock_unlock (&manager->priv->lock);
     
     return TRUE;
 }
@@ -122,6 +142,157 @@ gen_new_token (GHashTable *token_hash)
     }
 }
 
+/*
+ * When web_token_secret is set, tokens aren't kept in memory. A token is
+ * <payload>.<signature>, the payload is the base64url encoded json of the
+ * access info and the signature the base64url encoded HMAC-SHA256 of the
+ * encoded payload. Any fileserver with the secret verifies them, one-time
+ * tokens carry a nonce that a node accepts only once.
+ */
+
+static char *
+base64url_encode (const guchar *data, gsize len)
+{
+    char *enc = g_base64_encode (data, len);
+    char *p;
+
+    for (p = enc; *p; ++p) {
+        if (*p == '+')
+            *p = '-';
+        else if (*p == '/')
+            *p = '_';
+        else if (*p == '=') {
+            *p = '\0';
+            break;
+        }
+    }
+    return enc;
+}
+
+static guchar *
+base64url_decode (const char *text, gsize len, gsize *out_len)
+{
+    GString *buf = g_string_new_len (text, len);
+    guchar *ret;
+    gsize i;
+
+    for (i = 0; i < buf->len; ++i) {
+        if (buf->str[i] == '-')
+            buf->str[i] = '+';
+        else if (buf->str[i] == '_')
+            buf->str[i] = '/';
+    }
+    while (buf->len % 4 != 0)
+        g_string_append_c (buf, '=');
+
+    ret = g_base64_decode (buf->str, out_len);
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
+static char *
+sign_token_payload (const char *secret, const char *payload, gsize len)
+{
+    guchar sig[EVP_MAX_MD_SIZE];
+    unsigned int sig_len = 0;
+
+    HMAC (EVP_sha256(), secret, strlen(secret),
+          (const guchar *)payload, len, sig, &sig_len);
+
+    return base64url_encode (sig, sig_len);
+}
+
+static char *
+gen_signed_token (const char *secret, AccessInfo *info)
+{
+    json_t *object;
+    char *json, *payload, *sig, *token;
+    char nonce[37];
+
+    object = json_object ();
+    json_object_set_new (object, "repo_id", json_string (info->repo_id));
+    json_object_set_new (object, "obj_id", json_string (info->obj_id));
+    json_object_set_new (object, "op", json_string (info->op));
+    json_object_set_new (object, "username", json_string (info->username));
+    json_object_set_new (object, "exp", json_integer (info->expire_time));
+    if (info->use_onetime) {
+        gen_uuid_inplace (nonce);
+        json_object_set_new (object, "nonce", json_string (nonce));
+    }
+
+    json = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+    if (!json)
+        return NULL;
+
+    payload = base64url_encode ((guchar *)json, strlen(json));
+    sig = sign_token_payload (secret, payload, strlen(payload));
+    token = g_strconcat (payload, ".", sig, NULL);
+
+    free (json);
+    g_free (payload);
+    g_free (sig);
+    return token;
+}
+
+/* Returns the access info of a valid signed token, and its nonce if any. */
+static AccessInfo *
+parse_signed_token (const char *secret, const char *token, char **nonce)
+{
+    const char *dot = strchr (token, '.');
+    char *sig = NULL;
+    guchar *json = NULL;
+    gsize json_len = 0;
+    json_t *object = NULL;
+    json_error_t jerror;
+    const char *repo_id, *obj_id, *op, *username, *n;
+    AccessInfo *info = NULL;
+
+    *nonce = NULL;
+
+    if (!dot)
+        return NULL;
+
+    sig = sign_token_payload (secret, token, dot - token);
+    if (strlen(sig) != strlen(dot + 1) ||
+        CRYPTO_memcmp (sig, dot + 1, strlen(sig)) != 0)
+        goto out;
+
+    json = base64url_decode (token, dot - token, &json_len);
+    object = json_loadb ((const char *)json, json_len, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Invalid payload of signed web access token: %s.\n",
+                      jerror.text);
+        goto out;
+    }
+
+    repo_id = json_string_value (json_object_get (object, "repo_id"));
+    obj_id = json_string_value (json_object_get (object, "obj_id"));
+    op = json_string_value (json_object_get (object, "op"));
+    username = json_string_value (json_object_get (object, "username"));
+    if (!repo_id || !obj_id || !op || !username)
+        goto out;
+
+    info = g_new0 (AccessInfo, 1);
+    info->repo_id = g_strdup (repo_id);
+    info->obj_id = g_strdup (obj_id);
+    info->op = g_strdup (op);
+    info->username = g_strdup (username);
+    info->expire_time = (long)json_integer_value (json_object_get (object, "exp"));
+    n = json_string_value (json_object_get (object, "nonce"));
+    if (n) {
+        info->use_onetime = TRUE;
+        *nonce = g_strdup (n);
+    }
+
+out:
+    if (object)
+        json_decref (object);
+    g_free (json);
+    g_free (sig);
+    return info;
+}
+
 char *
 seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
                                       const char *repo_id,
@@ -135,6 +306,7 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
     long now = (long)time(NULL);
     long expire;
     char *t;
+    const char *secret;
     SeafileWebAccess *webaccess;
 
     if (strcmp(op, "view") != 0 &&
@@ -157,9 +329,7 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
         return NULL;
     }
 
-    pthread_mutex_lock (&mgr->priv->lock);
-
-    t = gen_new_token (mgr->priv->access_token_hash);
+    secret = seaf->http_server->web_token_secret;
     expire = now + seaf->http_server->web_token_expire_time;
 
     info = g_new0 (AccessInfo, 1);
@@ -172,9 +342,20 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
         info->use_onetime = TRUE;
     }
 
-    g_hash_table_insert (mgr->priv->access_token_hash, g_strdup(t), info);
-
-    pthread_mutex_unlock (&mgr->priv->lock);
+    if (secret) {
+        t = gen_signed_token (secret, info);
+        if (!t) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Failed to generate access token.");
+            free_access_info (info);
+            return NULL;
+        }
+    } else {
+        seaf_lock_lock (&mgr->priv->lock);
+        t = gen_new_token (mgr->priv->access_token_hash);
+        g_hash_table_insert (mgr->priv->access_token_hash, g_strdup(t), info);
+        seaf_lock_unlock (&mgr->priv->lock);
+    }
 
     if (!seaf->go_fileserver) {
         if (strcmp(op, "download-dir") == 0 ||
@@ -191,9 +372,13 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
 
             if (zip_download_mgr_start_zip_task (seaf->zip_download_mgr,
                                                  t, webaccess, error) < 0) {
-                pthread_mutex_lock (&mgr->priv->lock);
-                g_hash_table_remove (mgr->priv->access_token_hash, t);
-                pthread_mutex_unlock (&mgr->priv->lock);
+                if (secret) {
+                    free_access_info (info);
+                } else {
+                    seaf_lock_lock (&mgr->priv->lock);
+                    g_hash_table_remove (mgr->priv->access_token_hash, t);
+                    seaf_lock_unlock (&mgr->priv->lock);
+                }
 
                 g_object_unref (webaccess);
                 g_free (t);
@@ -203,19 +388,67 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
         }
     }
 
+    if (secret)
+        free_access_info (info);
+
     return t;
 }
 
+static SeafileWebAccess *
+query_signed_token (SeafWebAccessTokenManager *mgr, const char *secret,
+                    const char *token)
+{
+    SeafileWebAccess *webaccess = NULL;
+    AccessInfo *info;
+    char *nonce = NULL;
+    gint64 *expire_time;
+    long now = (long)time(NULL);
+
+    info = parse_signed_token (secret, token, &nonce);
+    if (!info || now >= info->expire_time)
+        goto out;
+
+    if (nonce) {
+        seaf_lock_lock (&mgr->priv->lock);
+        if (g_hash_table_lookup (mgr->priv->used_nonces, nonce)) {
+            seaf_lock_unlock (&mgr->priv->lock);
+            goto out;
+        }
+        expire_time = g_new (gint64, 1);
+        *expire_time = info->expire_time;
+        g_hash_table_insert (mgr->priv->used_nonces, nonce, expire_time);
+        nonce = NULL;
+        seaf_lock_unlock (&mgr->priv->lock);
+    }
+
+    webaccess = g_object_new (SEAFILE_TYPE_WEB_ACCESS,
+                              "repo_id", info->repo_id,
+                              "obj_id", info->obj_id,
+                              "op", info->op,
+                              "username", info->username,
+                              NULL);
+
+out:
+    free_access_info (info);
+    g_free (nonce);
+    return webaccess;
+}
+
 SeafileWebAccess *
 seaf_web_at_manager_query_access_token (SeafWebAccessTokenManager *mgr,
                                         const char *token)
 {
     SeafileWebAccess *webaccess;
     AccessInfo *info;
+    const char *secret = seaf->http_server->web_token_secret;
+
+    /* Tokens issued before the secret was set are still in memory. */
+    if (secret && strchr (token, '.') != NULL)
+        return query_signed_token (mgr, secret, token);
 
-    pthread_mutex_lock (&mgr->priv->lock);
+    seaf_lock_lock (&mgr->priv->lock);
     info = g_hash_table_lookup (mgr->priv->access_token_hash, token);
-    pthread_mutex_unlock (&mgr->priv->lock);
+    seaf_lock_unlock (&mgr->priv->lock);
 
     if (info != NULL) {
         long expire_time = info->expire_time;
@@ -232,9 +465,9 @@ seaf_web_at_manager_query_access_token (SeafWebAccessTokenManager *mgr,
                                       NULL);
 
             if (info->use_onetime) {
-                pthread_mutex_lock (&mgr->priv->lock);
+                seaf_lock_lock (&mgr->priv->lock);
                 g_hash_table_remove (mgr->priv->access_token_hash, token);
-                pthread_mutex_unlock (&mgr->priv->lock);
+                seaf_lock_unlock (&mgr->priv->lock);
             }
 
             return webaccess;
@@ -5,37 +5,133 @@
 #include <timer.h>
 #include "utils.h"
 #include "log.h"
+#include "lru-cache.h"
+#include "lock-stats.h"
 #include "seafile-error.h"
 #include "seafile-session.h"
 #include "pack-dir.h"
 #include "web-accesstoken-mgr.h"
 #include "zip-download-mgr.h"
 
-#define MAX_ZIP_THREAD_NUM 5
+/* Downloads checked and counted at the same time before they're packed. */
+#define MAX_ZIP_CHECK_JOBS 5
+/* A streamed zip takes a thread until the client has received it. */
+#define MAX_ZIP_STREAM_THREAD_NUM 50
 #define SCAN_PROGRESS_INTERVAL 24 * 3600 // 1 day
 #define PROGRESS_TTL 5 * 3600 // 5 hours
 #define DEFAULT_MAX_DOWNLOAD_DIR_SIZE 100 * ((gint64)1 << 20) /* 100MB */
+/* Cached archives are packed again after this, before httptemp cleanup
+ * gets to them. */
+#define ZIP_CACHE_TTL 24 * 3600 // 1 day
+
+/*
+ * Checked downloads are queued for zip_threads packing threads. A task is
+ * due at its queue time plus the time it's expected to take to pack at
+ * ZIP_PACK_BYTES_PER_USEC, and the earliest due is packed first. Small zips
+ * go ahead of large ones, and a large zip never waits longer than they'd
+ * take.
+ *
+ * With max_zip_threads above zip_threads, the number of packing threads is
+ * tuned every ZIP_TUNE_INTERVAL seconds. A thread is added while tasks are
+ * waiting and the CPUs seldom wait for I/O. One is removed, down to
+ * zip_threads, when they wait for I/O more than ZIP_TUNE_IOWAIT_HIGH
+ * percent of the time, to leave the disks to sync traffic.
+ */
+#define ZIP_PACK_BYTES_PER_USEC 32 /* about 32MB/s */
+#define ZIP_TUNE_INTERVAL 10
+#define ZIP_TUNE_IOWAIT_LOW 10
+#define ZIP_TUNE_IOWAIT_HIGH 30
 
 typedef struct ZipDownloadMgrPriv {
-    pthread_mutex_t progress_lock;
+    SeafLock progress_lock;
     GHashTable *progress_store;
-    GThreadPool *zip_tpool;
+    GThreadPool *zip_pack_tpool;
+    GThreadPool *zip_stream_tpool;
     // Abnormal behavior lead to no download request for the zip finished progress,
     // so related progress will not be removed,
     // this timer is used to scan progress and remove invalid progress.
     CcnetTimer *scan_progress_timer;
+
+    /* NULL if zip_cache_size is 0. */
+    LRUCache *zip_cache;
+    SeafLock zip_cache_lock;
+    pthread_cond_t zip_cache_cond;
+    /* Keys of the archives being packed for the cache. */
+    GHashTable *zip_cache_packing;
+
+    CcnetTimer *tune_timer;
+    int min_pack_threads;
+    int max_pack_threads;
+    guint64 last_cpu_total;
+    guint64 last_cpu_iowait;
+    /* -1 if unknown. */
+    int iowait;
+
+    SeafLock stats_lock;
+    gint packing;
+    guint64 n_packed;
+    gint64 total_wait;
+    /* Longest wait in the current tuning interval, and in the last one. */
+    gint64 max_wait;
+    gint64 last_max_wait;
 } ZipDownloadMgrPriv;
 
+/*
+ * With zip_cache_size set, finished archives are kept in a cache keyed by
+ * what they are packed from. Users downloading the same folder then share
+ * an archive instead of queuing behind the zip threads to pack it again,
+ * and a task waits for an identical one already packing. An archive is
+ * removed once it's evicted and no download uses it anymore. Archives of
+ * encrypted repos and streamed zips aren't cached.
+ */
+typedef struct ZipCacheEntry {
+    gint ref_count;
+    char *path;
+    gint64 ctime;
+} ZipCacheEntry;
+
+static gpointer
+zip_cache_entry_ref (gconstpointer value)
+{
+    ZipCacheEntry *entry = (ZipCacheEntry *)value;
+
+    g_atomic_int_inc (&entry->ref_count);
+    return entry;
+}
+
+static void
+zip_cache_entry_unref (gpointer value)
+{
+    ZipCacheEntry *entry = value;
+
+    if (!entry || !g_atomic_int_dec_and_test (&entry->ref_count))
+        return;
+
+    g_unlink (entry->path);
+    g_free (entry->path);
+    g_free (entry);
+}
+
+typedef struct DownloadObj DownloadObj;
+
+static void
+free_download_obj (DownloadObj *obj);
+
 void
 free_progress (Progress *progress)
 {
     if (!progress)
         return;
 
-    if (g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
+    if (progress->cache_entry) {
+        /* The archive is left to the cache. */
+        zip_cache_entry_unref (progress->cache_entry);
+    } else if (progress->zip_file_path &&
+               g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
         g_unlink (progress->zip_file_path);
     }
     g_free (progress->zip_file_path);
+    free_download_obj (progress->stream_obj);
     g_free (progress);
 }
 
@@ -44,7 +140,7 @@ typedef enum DownloadType {
     DOWNLOAD_MULTI
 } DownloadType;
 
-typedef struct DownloadObj {
+struct DownloadObj {
     char *token;
     DownloadType type;
     SeafRepo *repo;
@@ -55,7 +151,16 @@ typedef struct DownloadObj {
     // download-dir: obj_id; download-multi: dirent list
     void *internal;
     Progress *progress;
-} DownloadObj;
+    /* Where the zip is streamed to, -1 when it's packed into a temp file. */
+    int stream_fd;
+
+    gint64 download_size;
+    /* Set once the download is queued for packing. */
+    SeafileCrypt *crypt;
+    char *cache_key;
+    gint64 queued_at;
+    gint64 due;
+};
 
 static void
 free_download_obj (DownloadObj *obj)
@@ -72,12 +177,28 @@ free_download_obj (DownloadObj *obj)
     } else {
         g_list_free_full ((GList *)obj->internal, (GDestroyNotify)seaf_dirent_free);
     }
+    if (obj->stream_fd >= 0)
+        close (obj->stream_fd);
+    g_free (obj->crypt);
+    g_free (obj->cache_key);
     g_free (obj);
 }
 
 static void
 start_zip_task (gpointer data, gpointer user_data);
 
+static void
+pack_zip_task (gpointer data, gpointer user_data);
+
+static gint
+compare_pack_tasks (gconstpointer a, gconstpointer b, gpointer user_data);
+
+static int
+tune_pack_threads (void *data);
+
+static void
+stream_zip (gpointer data, gpointer user_data);
+
 static int
 scan_progress (void *data);
 
@@ -88,30 +209,61 @@ static gboolean
 validate_download_size (DownloadObj *obj, GError **error);
 
 ZipDownloadMgr *
-zip_download_mgr_new ()
+zip_download_mgr_new (SeafileSession *session)
 {
-    GError *error = NULL;
     ZipDownloadMgr *mgr = g_new0 (ZipDownloadMgr, 1);
     ZipDownloadMgrPriv *priv = g_new0 (ZipDownloadMgrPriv, 1);
 
-    priv->zip_tpool = g_thread_pool_new (start_zip_task, priv, MAX_ZIP_THREAD_NUM, FALSE, &error);
-    if (!priv->zip_tpool) {
-        if (error) {
-            seaf_warning ("Failed to create zip task thread pool: %s.\n", error->message);
-            g_clear_error (&error);
-        } else {
-            seaf_warning ("Failed to create zip task thread pool.\n");
-        }
+    seaf_executor_set_max_running (session->executor, SEAF_JOB_ZIP,
+                                   MAX_ZIP_CHECK_JOBS);
+
+    priv->min_pack_threads = session->http_server->zip_threads;
+    priv->max_pack_threads = MAX (session->http_server->max_zip_threads,
+                                  priv->min_pack_threads);
+    priv->iowait = -1;
+    priv->zip_pack_tpool = g_thread_pool_new (pack_zip_task, priv,
+                                              priv->min_pack_threads,
+                                              FALSE, NULL);
+    if (!priv->zip_pack_tpool) {
+        seaf_warning ("Failed to create zip pack thread pool.\n");
+        g_free (priv);
+        g_free (mgr);
+        return NULL;
+    }
+    g_thread_pool_set_sort_function (priv->zip_pack_tpool,
+                                     compare_pack_tasks, NULL);
+
+    priv->zip_stream_tpool = g_thread_pool_new (stream_zip, priv,
+                                                MAX_ZIP_STREAM_THREAD_NUM,
+                                                FALSE, NULL);
+    if (!priv->zip_stream_tpool) {
+        seaf_warning ("Failed to create zip stream thread pool.\n");
+        g_thread_pool_free (priv->zip_pack_tpool, TRUE, FALSE);
         g_free (priv);
         g_free (mgr);
         return NULL;
     }
 
-    pthread_mutex_init (&priv->progress_lock, NULL);
+    /* Packing goes on without prefetching if this fails. */
+    pack_dir_init ();
+
+    if (session->http_server->zip_cache_size > 0) {
+        priv->zip_cache = lru_cache_new ((gint64)session->http_server->zip_cache_size << 20,
+                                         1, zip_cache_entry_unref);
+        seaf_lock_init (&priv->zip_cache_lock, "zip_cache");
+        pthread_cond_init (&priv->zip_cache_cond, NULL);
+        priv->zip_cache_packing = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, NULL);
+    }
+
+    seaf_lock_init (&priv->progress_lock, "zip_progress");
     priv->progress_store = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                   (GDestroyNotify)free_progress);
     priv->scan_progress_timer = ccnet_timer_new (scan_progress, priv,
                                                  SCAN_PROGRESS_INTERVAL * 1000);
+    seaf_lock_init (&priv->stats_lock, "zip_stats");
+    priv->tune_timer = ccnet_timer_new (tune_pack_threads, priv,
+                                        ZIP_TUNE_INTERVAL * 1000);
     mgr->priv = priv;
 
     return mgr;
@@ -120,9 +272,14 @@ zip_download_mgr_new ()
 static void
 remove_progress_by_token (ZipDownloadMgrPriv *priv, const char *token)
 {
-    pthread_mutex_lock (&priv->progress_lock);
-    g_hash_table_remove (priv->progress_store, token);
-    pthread_mutex_unlock (&priv->progress_lock);
+    Progress *progress;
+
+    seaf_lock_lock (&priv->progress_lock);
+    progress = g_hash_table_lookup (priv->progress_store, token);
+    /* A running stream still uses its progress, it's left to scan_progress(). */
+    if (progress && !(progress->stream_started && !progress->stream_done))
+        g_hash_table_remove (priv->progress_store, token);
+    seaf_lock_unlock (&priv->progress_lock);
 }
 
 static int
@@ -134,17 +291,20 @@ scan_progress (void *data)
     gpointer key, value;
     Progress *progress;
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
 
     g_hash_table_iter_init (&iter, priv->progress_store);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         progress = value;
+        /* A running stream still uses its progress. */
+        if (progress->stream_started && !progress->stream_done)
+            continue;
         if (now >= progress->expire_ts) {
             g_hash_table_iter_remove (&iter);
         }
     }
 
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
 
     return TRUE;
 }
@@ -178,6 +338,153 @@ get_seafile_crypt (SeafRepo *repo, const char *user)
     return crypt;
 }
 
+/* Returns NULL if the archive of @obj isn't cached. */
+static char *
+zip_cache_key (ZipDownloadMgrPriv *priv, DownloadObj *obj)
+{
+    GString *buf;
+    GList *ptr;
+    SeafDirent *dent;
+    unsigned char sha1[20];
+    char *key;
+
+    if (!priv->zip_cache || obj->repo->encrypted)
+        return NULL;
+
+    buf = g_string_new (NULL);
+    g_string_append_printf (buf, "%s\n%d\n%d\n%s\n%d\n%s\n%d\n",
+                            obj->repo->store_id, obj->repo->version,
+                            obj->type, obj->dir_name, obj->is_windows,
+                            seaf->http_server->windows_encoding ?
+                            seaf->http_server->windows_encoding : "",
+                            seaf->http_server->zip_store_only);
+    if (obj->type == DOWNLOAD_DIR) {
+        g_string_append (buf, (char *)obj->internal);
+    } else {
+        for (ptr = obj->internal; ptr; ptr = ptr->next) {
+            dent = ptr->data;
+            g_string_append_printf (buf, "%s\t%o\t%s\n",
+                                    dent->id, dent->mode, dent->name);
+        }
+    }
+
+    calculate_sha1 (sha1, buf->str, buf->len);
+    g_string_free (buf, TRUE);
+
+    key = g_new0 (char, 41);
+    rawdata_to_hex (sha1, key, 20);
+
+    return key;
+}
+
+static ZipCacheEntry *
+zip_cache_lookup (ZipDownloadMgrPriv *priv, const char *key)
+{
+    ZipCacheEntry *entry;
+
+    entry = lru_cache_lookup (priv->zip_cache, key, zip_cache_entry_ref);
+    if (!entry)
+        return NULL;
+
+    if (entry->ctime + ZIP_CACHE_TTL <= (gint64)time(NULL) ||
+        !g_file_test (entry->path, G_FILE_TEST_EXISTS)) {
+        lru_cache_remove (priv->zip_cache, key);
+        zip_cache_entry_unref (entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/*
+ * Returns the cached archive of @key. Otherwise returns NULL, and the
+ * caller packs the archive and passes it to zip_cache_add(). Waits while
+ * another task packs the same archive.
+ */
+static ZipCacheEntry *
+zip_cache_lookup_or_claim (ZipDownloadMgrPriv *priv, const char *key)
+{
+    ZipCacheEntry *entry;
+
+    seaf_lock_lock (&priv->zip_cache_lock);
+    while (!(entry = zip_cache_lookup (priv, key)) &&
+           g_hash_table_lookup (priv->zip_cache_packing, key))
+        seaf_lock_cond_wait (&priv->zip_cache_cond, &priv->zip_cache_lock);
+    if (!entry)
+        g_hash_table_replace (priv->zip_cache_packing, g_strdup (key),
+                              GINT_TO_POINTER (1));
+    seaf_lock_unlock (&priv->zip_cache_lock);
+
+    return entry;
+}
+
+/* Caches the archive packed for @progress if @packed, and wakes up the
+ * tasks waiting for it. */
+static void
+zip_cache_add (ZipDownloadMgrPriv *priv, const char *key,
+               Progress *progress, gboolean packed)
+{
+    ZipCacheEntry *entry;
+    SeafStat st;
+
+    if (packed && seaf_stat (progress->zip_file_path, &st) == 0) {
+        entry = g_new0 (ZipCacheEntry, 1);
+        entry->ref_count = 2;
+        entry->path = g_strdup (progress->zip_file_path);
+        entry->ctime = (gint64)time(NULL);
+        progress->cache_entry = entry;
+        lru_cache_insert (priv->zip_cache, key, entry, st.st_size);
+    }
+
+    seaf_lock_lock (&priv->zip_cache_lock);
+    g_hash_table_remove (priv->zip_cache_packing, key);
+    pthread_cond_broadcast (&priv->zip_cache_cond);
+    seaf_lock_unlock (&priv->zip_cache_lock);
+}
+
+static void
+stream_zip (gpointer data, gpointer user_data)
+{
+    DownloadObj *obj = data;
+    ZipDownloadMgrPriv *priv = user_data;
+    SeafRepo *repo = obj->repo;
+    Progress *progress = obj->progress;
+    SeafileCrypt *crypt = NULL;
+    int fd;
+    int ret = -1;
+
+    if (repo->encrypted) {
+        crypt = get_seafile_crypt (repo, obj->user);
+        if (!crypt)
+            goto out;
+    }
+
+    fd = dup (obj->stream_fd);
+    if (fd < 0) {
+        seaf_warning ("Failed to dup zip stream fd: %s.\n", strerror (errno));
+        g_free (crypt);
+        goto out;
+    }
+
+    /* pack_files() closes the fd it's given. The client sees the end of the
+     * stream once our fd is closed too, so it's kept open until the result
+     * is set below.
+     */
+    ret = pack_files (repo->store_id, repo->version, obj->dir_name,
+                      obj->internal, crypt, obj->is_windows, fd, progress);
+    g_free (crypt);
+
+out:
+    seaf_lock_lock (&priv->progress_lock);
+    if (ret < 0 && !progress->canceled)
+        progress->internal_error = TRUE;
+    progress->stream_done = TRUE;
+    seaf_lock_unlock (&priv->progress_lock);
+
+    /* Closes the stream fd. The progress may be removed from now on. */
+    free_download_obj (obj);
+}
+
 static void
 start_zip_task (gpointer data, gpointer user_data)
 {
@@ -185,6 +492,8 @@ start_zip_task (gpointer data, gpointer user_data)
     ZipDownloadMgrPriv *priv = user_data;
     SeafRepo *repo = obj->repo;
     SeafileCrypt *crypt = NULL;
+    char *cache_key = NULL;
+    ZipCacheEntry *entry = NULL;
     int ret = 0;
 
     if (repo->encrypted) {
@@ -208,10 +517,40 @@ start_zip_task (gpointer data, gpointer user_data)
     }
     obj->progress->total = file_count;
 
-    ret = pack_files (repo->store_id, repo->version, obj->dir_name,
-                      obj->internal, crypt, obj->is_windows, obj->progress);
+    cache_key = zip_cache_key (priv, obj);
+    if (cache_key) {
+        if (seaf->http_server->streaming_zip)
+            entry = zip_cache_lookup (priv, cache_key);
+        else
+            entry = zip_cache_lookup_or_claim (priv, cache_key);
+        if (entry) {
+            obj->progress->zip_file_path = g_strdup (entry->path);
+            obj->progress->cache_entry = entry;
+            g_atomic_int_set (&obj->progress->zipped, file_count);
+            goto out;
+        }
+    }
+
+    if (seaf->http_server->streaming_zip) {
+        /* Packed when the client fetches the zip. */
+        seaf_lock_lock (&priv->progress_lock);
+        obj->progress->stream_obj = obj;
+        obj->progress->streaming = TRUE;
+        seaf_lock_unlock (&priv->progress_lock);
+        g_free (crypt);
+        g_free (cache_key);
+        return;
+    }
+
+    obj->crypt = crypt;
+    obj->cache_key = cache_key;
+    obj->queued_at = get_current_time ();
+    obj->due = obj->queued_at + obj->download_size / ZIP_PACK_BYTES_PER_USEC;
+    g_thread_pool_push (priv->zip_pack_tpool, obj, NULL);
+    return;
 
 out:
+    g_free (cache_key);
     if (crypt) {
         g_free (crypt);
     }
@@ -222,6 +561,121 @@ out:
     free_download_obj (obj);
 }
 
+static gint
+compare_pack_tasks (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const DownloadObj *obj_a = a, *obj_b = b;
+
+    if (obj_a->due < obj_b->due)
+        return -1;
+    return obj_a->due > obj_b->due;
+}
+
+static void
+pack_zip_task (gpointer data, gpointer user_data)
+{
+    DownloadObj *obj = data;
+    ZipDownloadMgrPriv *priv = user_data;
+    SeafRepo *repo = obj->repo;
+    gint64 wait = get_current_time () - obj->queued_at;
+    int ret = -1;
+
+    seaf_lock_lock (&priv->stats_lock);
+    priv->packing++;
+    priv->n_packed++;
+    priv->total_wait += wait;
+    if (wait > priv->max_wait)
+        priv->max_wait = wait;
+    seaf_lock_unlock (&priv->stats_lock);
+
+    if (!obj->progress->canceled)
+        ret = pack_files (repo->store_id, repo->version, obj->dir_name,
+                          obj->internal, obj->crypt, obj->is_windows, -1,
+                          obj->progress);
+
+    if (obj->cache_key)
+        zip_cache_add (priv, obj->cache_key, obj->progress, ret == 0);
+
+    if (ret == -1 && !obj->progress->canceled) {
+        obj->progress->internal_error = TRUE;
+    }
+    free_download_obj (obj);
+
+    seaf_lock_lock (&priv->stats_lock);
+    priv->packing--;
+    seaf_lock_unlock (&priv->stats_lock);
+}
+
+/*
+ * Returns the percentage of time the CPUs waited for I/O since the last
+ * call, or -1 if it isn't known.
+ */
+static int
+read_iowait (ZipDownloadMgrPriv *priv)
+{
+    FILE *fp;
+    guint64 v[8] = {0};
+    guint64 total = 0;
+    int i, n;
+    int ret = -1;
+
+    fp = fopen ("/proc/stat", "r");
+    if (!fp)
+        return -1;
+    n = fscanf (fp, "cpu %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT,
+                &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose (fp);
+    if (n < 5)
+        return -1;
+
+    for (i = 0; i < n; i++)
+        total += v[i];
+
+    if (priv->last_cpu_total > 0 && total > priv->last_cpu_total &&
+        v[4] >= priv->last_cpu_iowait)
+        ret = (int)((v[4] - priv->last_cpu_iowait) * 100 /
+                    (total - priv->last_cpu_total));
+    priv->last_cpu_total = total;
+    priv->last_cpu_iowait = v[4];
+
+    return ret;
+}
+
+static int
+tune_pack_threads (void *data)
+{
+    ZipDownloadMgrPriv *priv = data;
+    int n_threads = g_thread_pool_get_max_threads (priv->zip_pack_tpool);
+    guint queued = g_thread_pool_unprocessed (priv->zip_pack_tpool);
+    int iowait = read_iowait (priv);
+
+    seaf_lock_lock (&priv->stats_lock);
+    priv->iowait = iowait;
+    priv->last_max_wait = priv->max_wait;
+    priv->max_wait = 0;
+    seaf_lock_unlock (&priv->stats_lock);
+
+    if (priv->max_pack_threads <= priv->min_pack_threads || iowait < 0)
+        return TRUE;
+
+    if (iowait > ZIP_TUNE_IOWAIT_HIGH && n_threads > priv->min_pack_threads)
+        n_threads--;
+    else if (iowait < ZIP_TUNE_IOWAIT_LOW && queued > 0 &&
+             n_threads < priv->max_pack_threads)
+        n_threads++;
+    else
+        return TRUE;
+
+    seaf_debug ("Set zip pack threads to %d, iowait %d%%, %u zip tasks queued.\n",
+                n_threads, iowait, queued);
+    g_thread_pool_set_max_threads (priv->zip_pack_tpool, n_threads, NULL);
+
+    return TRUE;
+}
+
 static int
 parse_download_dir_data (DownloadObj *obj, const char *data)
 {
@@ -440,6 +894,7 @@ validate_download_size (DownloadObj *obj, GError **error)
     } else {
         download_size = calcuate_download_multi_size (repo, (GList *)obj->internal);
     }
+    obj->download_size = download_size;
 
     /* default is MB */
     max_download_dir_size = seaf_cfg_manager_get_config_int64 (seaf->cfg_mgr, "fileserver",
@@ -516,6 +971,7 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     operation = seafile_web_access_get_op (info);
 
     obj = g_new0 (DownloadObj, 1);
+    obj->stream_fd = -1;
     obj->token = g_strdup (token);
     obj->repo = repo;
     obj->user = g_strdup (seafile_web_access_get_username (info));
@@ -556,11 +1012,11 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     progress->expire_ts = time(NULL) + PROGRESS_TTL;
     obj->progress = progress;
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
     g_hash_table_replace (priv->progress_store, g_strdup (token), progress);
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
 
-    g_thread_pool_push (priv->zip_tpool, obj, NULL);
+    seaf_executor_push (seaf->executor, SEAF_JOB_ZIP, start_zip_task, obj, priv);
 
 out:
     if (ret < 0) {
@@ -575,9 +1031,9 @@ get_progress_obj (ZipDownloadMgrPriv *priv, const char *token)
 {
     Progress *progress;
 
-    pthread_mutex_lock (&priv->progress_lock);
+    seaf_lock_lock (&priv->progress_lock);
     progress = g_hash_table_lookup (priv->progress_store, token);
-    pthread_mutex_unlock (&priv->progress_lock);
+    seaf_lock_unlock (&priv->progress_lock);
 
     return progress;
 }
@@ -595,7 +1051,13 @@ zip_download_mgr_query_zip_progress (ZipDownloadMgr *mgr,
         return NULL;
 
     obj = json_object ();
-    json_object_set_int_member (obj, "zipped", g_atomic_int_get (&progress->zipped));
+    if (progress->streaming) {
+        /* The zip is ready to be fetched, "sent" tells how far it went. */
+        json_object_set_int_member (obj, "zipped", progress->total);
+        json_object_set_int_member (obj, "sent", g_atomic_int_get (&progress->zipped));
+    } else {
+        json_object_set_int_member (obj, "zipped", g_atomic_int_get (&progress->zipped));
+    }
     json_object_set_int_member (obj, "total", progress->total);
     if (progress->size_too_large) {
         json_object_set_int_member (obj, "failed", 1);
@@ -634,6 +1096,100 @@ zip_download_mgr_get_zip_file_path (struct ZipDownloadMgr *mgr,
     return progress->zip_file_path;
 }
 
+gboolean
+zip_download_mgr_is_streaming (ZipDownloadMgr *mgr, const char *token)
+{
+    Progress *progress;
+    gboolean ret;
+
+    seaf_lock_lock (&mgr->priv->progress_lock);
+    progress = g_hash_table_lookup (mgr->priv->progress_store, token);
+    ret = (progress && progress->streaming);
+    seaf_lock_unlock (&mgr->priv->progress_lock);
+
+    return ret;
+}
+
+int
+zip_download_mgr_start_zip_stream (ZipDownloadMgr *mgr,
+                                   const char *token,
+                                   int fd)
+{
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    Progress *progress;
+    DownloadObj *obj = NULL;
+
+    seaf_lock_lock (&priv->progress_lock);
+    progress = g_hash_table_lookup (priv->progress_store, token);
+    if (progress && progress->stream_obj && !progress->stream_started) {
+        obj = progress->stream_obj;
+        progress->stream_obj = NULL;
+        progress->stream_started = TRUE;
+    }
+    seaf_lock_unlock (&priv->progress_lock);
+
+    if (!obj) {
+        close (fd);
+        return -1;
+    }
+
+    obj->stream_fd = fd;
+    g_thread_pool_push (priv->zip_stream_tpool, obj, NULL);
+
+    return 0;
+}
+
+gboolean
+zip_download_mgr_zip_stream_failed (ZipDownloadMgr *mgr, const char *token)
+{
+    Progress *progress;
+    gboolean ret;
+
+    seaf_lock_lock (&mgr->priv->progress_lock);
+    progress = g_hash_table_lookup (mgr->priv->progress_store, token);
+    ret = (!progress || !progress->stream_done ||
+           progress->internal_error || progress->canceled);
+    seaf_lock_unlock (&mgr->priv->progress_lock);
+
+    return ret;
+}
+
+int
+zip_download_mgr_get_queue_len (ZipDownloadMgr *mgr)
+{
+    return g_thread_pool_unprocessed (mgr->priv->zip_pack_tpool);
+}
+
+char *
+zip_download_mgr_get_stats (ZipDownloadMgr *mgr)
+{
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    json_t *obj;
+    char *info;
+
+    obj = json_object ();
+    json_object_set_int_member (obj, "checking",
+                                seaf_executor_get_queued (seaf->executor, SEAF_JOB_ZIP));
+    json_object_set_int_member (obj, "queued",
+                                g_thread_pool_unprocessed (priv->zip_pack_tpool));
+    json_object_set_int_member (obj, "threads",
+                                g_thread_pool_get_max_threads (priv->zip_pack_tpool));
+
+    seaf_lock_lock (&priv->stats_lock);
+    json_object_set_int_member (obj, "packing", priv->packing);
+    json_object_set_int_member (obj, "packed", priv->n_packed);
+    json_object_set_int_member (obj, "total_wait_ms", priv->total_wait / 1000);
+    json_object_set_int_member (obj, "max_wait_ms",
+                                MAX (priv->max_wait, priv->last_max_wait) / 1000);
+    json_object_set_int_member (obj, "iowait", priv->iowait);
+    seaf_lock_unlock (&priv->stats_lock);
+
+    info = json_dumps (obj, JSON_COMPACT);
+    json_decref (obj);
+
+    return info;
+}
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token)
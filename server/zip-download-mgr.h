@@ -3,6 +3,7 @@
 
 #include "seafile-object.h"
 
+struct _SeafileSession;
 struct ZipDownloadMgrPriv;
 
 typedef struct ZipDownloadMgr {
@@ -10,7 +11,7 @@ typedef struct ZipDownloadMgr {
 } ZipDownloadMgr;
 
 ZipDownloadMgr *
-zip_download_mgr_new ();
+zip_download_mgr_new (struct _SeafileSession *session);
 
 int
 zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
@@ -26,6 +27,30 @@ char *
 zip_download_mgr_get_zip_file_path (ZipDownloadMgr *mgr,
                                     const char *token);
 
+/* Whether the zip of @token is packed while it's sent, see streaming_zip. */
+gboolean
+zip_download_mgr_is_streaming (ZipDownloadMgr *mgr, const char *token);
+
+/* Starts packing the zip of @token into @fd, which is closed at the end.
+ * A zip is only streamed once.
+ */
+int
+zip_download_mgr_start_zip_stream (ZipDownloadMgr *mgr,
+                                   const char *token,
+                                   int fd);
+
+/* Whether streaming the zip of @token didn't finish successfully. */
+gboolean
+zip_download_mgr_zip_stream_failed (ZipDownloadMgr *mgr, const char *token);
+
+/* Queue depth and wait times of zip tasks, in JSON. */
+char *
+zip_download_mgr_get_stats (ZipDownloadMgr *mgr);
+
+/* Zip tasks waiting for a packing thread. */
+int
+zip_download_mgr_get_queue_len (ZipDownloadMgr *mgr);
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token);
@@ -0,0 +1,50 @@
+import os
+import subprocess
+import time
+import pytest
+from tests.config import USER
+from tests.utils import run_gc
+from seaserv import seafile_api as api
+
+file_name = 'file.txt'
+file_path = os.getcwd() + '/' + file_name
+file_content = 'Uploaded twice.'
+
+def get_block_path(store_id, block_id):
+    return os.path.join(os.environ['SEAFILE_CONF_DIR'], 'storage', 'blocks',
+                        store_id, block_id[:2], block_id[2:])
+
+def test_reused_block_survives_online_gc(repo):
+    with open(file_path, 'w') as fp:
+        fp.write(file_content)
+
+    # Only the head is kept, so the block is dead once the file is removed.
+    api.set_repo_history_limit(repo.id, 0)
+    assert api.post_file(repo.id, file_path, '/', file_name, USER) == 0
+    file_id = api.get_file_id_by_path(repo.id, '/' + file_name)
+    block_id = api.list_blocks_by_file_id(repo.id, file_id).strip()
+    block_path = get_block_path(repo.store_id, block_id)
+    api.del_file(repo.id, '/', file_name, USER)
+
+    # Written long before the grace period of online GC.
+    old = time.time() - 7 * 24 * 3600
+    os.utime(block_path, (old, old))
+
+    # The upload finds the block stored and doesn't write it again. Once the
+    # file is removed again, the block is as dead as one reused by an upload
+    # that isn't committed yet.
+    assert api.post_file(repo.id, file_path, '/', file_name, USER) == 0
+    os.remove(file_path)
+    assert os.stat(block_path).st_mtime > old
+    api.del_file(repo.id, '/', file_name, USER)
+
+    run_gc('--online')
+    assert os.path.exists(block_path)
+
+    # Without the grace of online GC, the dead block is removed.
+    run_gc()
+    assert not os.path.exists(block_path)
+
+def test_online_gc_refuses_rm_fs(repo):
+    with pytest.raises(subprocess.CalledProcessError):
+        run_gc('--online', '--rm-fs')
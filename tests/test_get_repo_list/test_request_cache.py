@@ -0,0 +1,40 @@
+import pytest
+
+from seaserv import seafile_api as api
+from tests.config import USER, USER2
+
+def test_request_cache(repo):
+    with api.request_cache():
+        repos = api.get_owned_repo_list(USER)
+        assert repo.id in [r.id for r in repos]
+        assert api.get_repo_owner(repo.id) == USER
+        assert api.get_repo(repo.id).id == repo.id
+
+        api.edit_repo(repo.id, 'renamed', '', USER)
+        assert api.get_repo(repo.id).name == 'renamed'
+
+        api.set_repo_owner(USER2, repo.id)
+        assert api.get_repo_owner(repo.id) == USER2
+        api.set_repo_owner(USER, repo.id)
+
+def test_prefetch_repos(repo):
+    with api.request_cache():
+        api.prefetch_repos([repo.id])
+        assert api.get_repo(repo.id).id == repo.id
+        assert api.get_repo_owner(repo.id) == USER
+
+def test_cache_versions(repo):
+    versions = api.get_cache_versions()
+    api.edit_repo(repo.id, 'renamed', '', USER)
+    assert api.get_cache_versions()['repo'] > versions['repo']
+
+def test_shared_cache(repo):
+    api.enable_shared_cache()
+    try:
+        with api.request_cache():
+            assert api.get_repo(repo.id).name == repo.name
+        api.edit_repo(repo.id, 'renamed', '', USER)
+        with api.request_cache():
+            assert api.get_repo(repo.id).name == 'renamed'
+    finally:
+        api.disable_shared_cache()
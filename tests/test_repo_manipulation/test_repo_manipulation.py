@@ -1,5 +1,8 @@
+import os
 import pytest
+import requests
 from tests.config import USER, USER2
+from tests.utils import run_gc
 from seaserv import seafile_api as api
 
 def get_repo_list_order_by(t_start, t_limit, order_by):
@@ -123,3 +126,89 @@ def test_repo_manipulation():
     api.remove_repo(t_repo_id)
     t_repo = api.get_repo(t_repo_id)
     assert t_repo == None
+
+def test_fork_repo(repo):
+    src_head = api.get_commit(repo.id, repo.version, repo.head_cmmt_id)
+
+    t_fork_id = api.fork_repo(repo.id, 'test_fork_repo', USER2)
+    assert t_fork_id
+    t_fork = api.get_repo(t_fork_id)
+    assert t_fork.name == 'test_fork_repo'
+    # The fork shares the store of the source library.
+    assert t_fork.store_id == repo.id
+    assert api.get_repo_owner(t_fork_id) == USER2
+
+    t_fork_head = api.get_commit(t_fork_id, t_fork.version, t_fork.head_cmmt_id)
+    assert t_fork_head.root_id == src_head.root_id
+    assert t_fork_head.parent_id is None
+
+    # Changes are independent after the fork.
+    api.post_dir(t_fork_id, '/', 'dir3', USER2)
+    assert len(api.list_dir_by_path(t_fork_id, '/')) == 3
+    assert len(api.list_dir_by_path(repo.id, '/')) == 2
+
+    # Forking an older commit starts from its content.
+    api.post_dir(repo.id, '/', 'dir4', USER)
+    t_fork2_id = api.fork_repo(repo.id, 'test_fork_repo2', USER,
+                               commit_id=src_head.commit_id)
+    assert len(api.list_dir_by_path(t_fork2_id, '/')) == 2
+
+    api.remove_repo(t_fork_id)
+    api.remove_repo(t_fork2_id)
+
+def test_fork_repo_out_of_history(repo):
+    old_head = repo.head_cmmt_id
+    api.post_dir(repo.id, '/', 'dir5', USER)
+
+    # Without history, GC may have swept what the older commit reaches.
+    api.set_repo_history_limit(repo.id, 0)
+    with pytest.raises(Exception):
+        api.fork_repo(repo.id, 'test_fork_repo', USER, commit_id=old_head)
+
+    t_fork_id = api.fork_repo(repo.id, 'test_fork_repo', USER)
+    assert len(api.list_dir_by_path(t_fork_id, '/')) == 3
+
+    api.remove_repo(t_fork_id)
+
+def test_fork_encrypted_repo(encrypted_repo):
+    with pytest.raises(Exception):
+        api.fork_repo(encrypted_repo.id, 'test_fork_repo', USER)
+    with pytest.raises(Exception):
+        api.fork_repo(encrypted_repo.id, 'test_fork_repo', USER, passwd='wrong')
+
+    t_fork_id = api.fork_repo(encrypted_repo.id, 'test_fork_repo', USER,
+                              passwd='123')
+    t_fork = api.get_repo(t_fork_id)
+    assert t_fork.encrypted
+    assert t_fork.store_id == encrypted_repo.id
+    api.set_passwd(t_fork_id, USER, '123')
+    assert len(api.list_dir_by_path(t_fork_id, '/')) == 2
+
+    api.remove_repo(t_fork_id)
+
+def test_restore_forked_repo_after_gc(repo):
+    file_name = 'fork_file.txt'
+    file_path = os.getcwd() + '/' + file_name
+    file_content = 'Only in the fork.'
+    with open(file_path, 'w') as fp:
+        fp.write(file_content)
+
+    # The blocks of the file are added to the store of the source.
+    t_fork_id = api.fork_repo(repo.id, 'test_fork_repo', USER2)
+    assert api.post_file(t_fork_id, file_path, '/', file_name, USER2) == 0
+    os.remove(file_path)
+
+    # GC must keep what a fork in the trash reaches.
+    api.remove_repo(t_fork_id)
+    run_gc('-r')
+    api.restore_repo_from_trash(t_fork_id)
+
+    t_fork = api.get_repo(t_fork_id)
+    assert t_fork.store_id == repo.id
+    file_id = api.get_file_id_by_path(t_fork_id, '/' + file_name)
+    token = api.get_fileserver_access_token(t_fork_id, file_id, 'download', USER2)
+    response = requests.get('http://127.0.0.1:8082/files/' + token + '/' + file_name)
+    assert response.status_code == 200
+    assert response.text == file_content
+
+    api.remove_repo(t_fork_id)
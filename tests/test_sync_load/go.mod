@@ -0,0 +1,8 @@
+module test_sync_load
+
+go 1.18
+
+require (
+	github.com/haiwen/seafile-server/fileserver v0.0.0-20220621072834-faf434def97d // indirect
+	gopkg.in/ini.v1 v1.66.6 // indirect
+)
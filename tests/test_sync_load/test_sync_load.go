@@ -0,0 +1,473 @@
+package main
+
+import (
+	"bytes"
+	"compress/zlib"
+	"crypto/sha1"
+	"encoding/binary"
+	"encoding/hex"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"math/rand"
+	"net/http"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/haiwen/seafile-server/fileserver/searpc"
+	"gopkg.in/ini.v1"
+)
+
+// Each simulated client polls head-commits-multi and then syncs one of the
+// repos per round: it reads the head commit and fs id list, checks and packs
+// a batch of fs objects, downloads one of the blocks of the packed files,
+// and sometimes uploads a new file. Uploaded blocks aren't referenced by any
+// commit, so they are removed by the next GC.
+//
+// The same workload, with the same random choices, is run against each of
+// the servers in turn.
+
+type server struct {
+	name string
+	url  string
+}
+
+type sizeWeight struct {
+	size   int64
+	weight int
+}
+
+type Options struct {
+	username    string
+	repoIDs     []string
+	tokens      map[string]string
+	servers     []server
+	clients     int
+	duration    time.Duration
+	packBatch   int
+	uploadRatio float64
+	blockSize   int64
+	fileSizes   []sizeWeight
+}
+
+var confPath string
+var rpcPipePath string
+var jsonOutput bool
+var options Options
+
+var httpClient = &http.Client{
+	Transport: &http.Transport{MaxIdleConnsPerHost: 1024},
+	Timeout:   5 * time.Minute,
+}
+
+func init() {
+	flag.StringVar(&confPath, "c", "", "config file path")
+	flag.StringVar(&rpcPipePath, "p", "", "rpc pipe path, to generate sync tokens")
+	flag.BoolVar(&jsonOutput, "j", false, "print results as json")
+}
+
+func main() {
+	flag.Parse()
+
+	if err := loadOptions(confPath); err != nil {
+		log.Fatalf("Failed to load config file: %v", err)
+	}
+	if err := loadTokens(); err != nil {
+		log.Fatalf("Failed to get sync tokens: %v", err)
+	}
+
+	var results []*endpointResult
+	for _, s := range options.servers {
+		log.Printf("Running %d clients against %s (%s) for %v", options.clients, s.name, s.url, options.duration)
+		results = append(results, runLoad(s)...)
+	}
+	printResults(results)
+}
+
+func loadOptions(path string) error {
+	config, err := ini.Load(path)
+	if err != nil {
+		return err
+	}
+	section, err := config.GetSection("load")
+	if err != nil {
+		return fmt.Errorf("no load section in config file")
+	}
+
+	getString := func(name, def string) string {
+		if key, err := section.GetKey(name); err == nil {
+			return key.String()
+		}
+		return def
+	}
+
+	options.username = getString("username", "")
+	for _, id := range strings.Split(getString("repos", ""), ",") {
+		if id = strings.TrimSpace(id); id != "" {
+			options.repoIDs = append(options.repoIDs, id)
+		}
+	}
+	if len(options.repoIDs) == 0 {
+		return fmt.Errorf("no repos to sync")
+	}
+
+	options.tokens = make(map[string]string)
+	for i, token := range strings.Split(getString("tokens", ""), ",") {
+		if token = strings.TrimSpace(token); token != "" && i < len(options.repoIDs) {
+			options.tokens[options.repoIDs[i]] = token
+		}
+	}
+
+	for _, s := range strings.Split(getString("servers", ""), ",") {
+		name, url, ok := strings.Cut(strings.TrimSpace(s), "=")
+		if !ok {
+			return fmt.Errorf("invalid server %q, expected name=url", s)
+		}
+		options.servers = append(options.servers, server{strings.TrimSpace(name), strings.TrimRight(strings.TrimSpace(url), "/")})
+	}
+
+	if options.clients, err = strconv.Atoi(getString("clients", "100")); err != nil || options.clients <= 0 {
+		return fmt.Errorf("invalid clients")
+	}
+	seconds, err := strconv.Atoi(getString("duration", "60"))
+	if err != nil || seconds <= 0 {
+		return fmt.Errorf("invalid duration")
+	}
+	options.duration = time.Duration(seconds) * time.Second
+	if options.packBatch, err = strconv.Atoi(getString("pack_batch", "100")); err != nil || options.packBatch <= 0 {
+		return fmt.Errorf("invalid pack_batch")
+	}
+	if options.uploadRatio, err = strconv.ParseFloat(getString("upload_ratio", "0.1"), 64); err != nil {
+		return fmt.Errorf("invalid upload_ratio")
+	}
+	if options.blockSize, err = strconv.ParseInt(getString("block_size", "8388608"), 10, 64); err != nil || options.blockSize <= 0 {
+		return fmt.Errorf("invalid block_size")
+	}
+
+	// File sizes are given as size:weight pairs.
+	for _, sw := range strings.Split(getString("file_sizes", "4096:50,1048576:40,33554432:10"), ",") {
+		size, weight, ok := strings.Cut(strings.TrimSpace(sw), ":")
+		s, err1 := strconv.ParseInt(size, 10, 64)
+		w, err2 := strconv.Atoi(weight)
+		if !ok || err1 != nil || err2 != nil || s <= 0 || w <= 0 {
+			return fmt.Errorf("invalid file size %q, expected size:weight", sw)
+		}
+		options.fileSizes = append(options.fileSizes, sizeWeight{s, w})
+	}
+
+	return nil
+}
+
+func loadTokens() error {
+	var rpcclient *searpc.Client
+	for _, repoID := range options.repoIDs {
+		if _, ok := options.tokens[repoID]; ok {
+			continue
+		}
+		if rpcclient == nil {
+			if rpcPipePath == "" {
+				return fmt.Errorf("no token for repo %s and no rpc pipe path", repoID)
+			}
+			pipePath := filepath.Join(rpcPipePath, "seafile.sock")
+			rpcclient = searpc.Init(pipePath, "seafserv-threaded-rpcserver")
+		}
+		token, err := rpcclient.Call("seafile_generate_repo_token", repoID, options.username)
+		if err != nil {
+			return fmt.Errorf("failed to generate token for repo %s: %v", repoID, err)
+		}
+		options.tokens[repoID], _ = token.(string)
+	}
+	return nil
+}
+
+// Stats of an endpoint.
+
+type endpointStats struct {
+	sync.Mutex
+	latencies []time.Duration
+	bytes     int64
+	errors    int
+}
+
+type endpointResult struct {
+	Server    string  `json:"server"`
+	Endpoint  string  `json:"endpoint"`
+	Requests  int     `json:"requests"`
+	Errors    int     `json:"errors"`
+	ReqPerSec float64 `json:"req_per_s"`
+	MBPerSec  float64 `json:"mb_per_s"`
+	P50Ms     float64 `json:"p50_ms"`
+	P99Ms     float64 `json:"p99_ms"`
+}
+
+var endpoints = []string{
+	"head-commits-multi",
+	"head-commit",
+	"fs-id-list",
+	"check-fs",
+	"pack-fs",
+	"check-blocks",
+	"block-upload",
+	"block-download",
+}
+
+type loadRun struct {
+	server server
+	stats  map[string]*endpointStats
+}
+
+func (run *loadRun) record(endpoint string, start time.Time, n int64, err error) {
+	elapsed := time.Since(start)
+	stats := run.stats[endpoint]
+	stats.Lock()
+	if err != nil {
+		stats.errors++
+	} else {
+		stats.latencies = append(stats.latencies, elapsed)
+		stats.bytes += n
+	}
+	stats.Unlock()
+}
+
+// request sends a request and returns the body of a 200 reply.
+func (run *loadRun) request(endpoint, method, path, token string, body []byte) ([]byte, error) {
+	start := time.Now()
+	data, err := doRequest(method, run.server.url+path, token, body)
+	run.record(endpoint, start, int64(len(body)+len(data)), err)
+	return data, err
+}
+
+func doRequest(method, url, token string, body []byte) ([]byte, error) {
+	req, err := http.NewRequest(method, url, bytes.NewReader(body))
+	if err != nil {
+		return nil, err
+	}
+	if token != "" {
+		req.Header.Set("Seafile-Repo-Token", token)
+	}
+
+	rsp, err := httpClient.Do(req)
+	if err != nil {
+		return nil, err
+	}
+	defer rsp.Body.Close()
+
+	data, err := io.ReadAll(rsp.Body)
+	if err != nil {
+		return nil, err
+	}
+	if rsp.StatusCode != http.StatusOK {
+		return nil, fmt.Errorf("%s %s returned %d", method, url, rsp.StatusCode)
+	}
+	return data, nil
+}
+
+func runLoad(s server) []*endpointResult {
+	run := &loadRun{server: s, stats: make(map[string]*endpointStats)}
+	for _, endpoint := range endpoints {
+		run.stats[endpoint] = new(endpointStats)
+	}
+
+	deadline := time.Now().Add(options.duration)
+	var group sync.WaitGroup
+	for i := 0; i < options.clients; i++ {
+		group.Add(1)
+		go func(i int) {
+			defer group.Done()
+			c := &client{run: run, rnd: rand.New(rand.NewSource(int64(i))), blocks: make(map[string][]string)}
+			for round := 0; time.Now().Before(deadline); round++ {
+				c.syncRound(options.repoIDs[(i+round)%len(options.repoIDs)])
+			}
+		}(i)
+	}
+	group.Wait()
+
+	var results []*endpointResult
+	for _, endpoint := range endpoints {
+		results = append(results, run.stats[endpoint].result(s.name, endpoint))
+	}
+	return results
+}
+
+func (stats *endpointStats) result(serverName, endpoint string) *endpointResult {
+	res := &endpointResult{Server: serverName, Endpoint: endpoint}
+	res.Requests = len(stats.latencies) + stats.errors
+	res.Errors = stats.errors
+	seconds := options.duration.Seconds()
+	res.ReqPerSec = float64(len(stats.latencies)) / seconds
+	res.MBPerSec = float64(stats.bytes) / seconds / (1 << 20)
+
+	if n := len(stats.latencies); n > 0 {
+		sort.Slice(stats.latencies, func(i, j int) bool { return stats.latencies[i] < stats.latencies[j] })
+		res.P50Ms = float64(stats.latencies[n*50/100]) / float64(time.Millisecond)
+		res.P99Ms = float64(stats.latencies[n*99/100]) / float64(time.Millisecond)
+	}
+	return res
+}
+
+func printResults(results []*endpointResult) {
+	if jsonOutput {
+		enc := json.NewEncoder(os.Stdout)
+		for _, res := range results {
+			enc.Encode(res)
+		}
+		return
+	}
+
+	fmt.Printf("%-8s %-20s %9s %7s %10s %10s %10s %10s\n",
+		"server", "endpoint", "requests", "errors", "req/s", "MB/s", "p50 ms", "p99 ms")
+	for _, res := range results {
+		fmt.Printf("%-8s %-20s %9d %7d %10.1f %10.2f %10.2f %10.2f\n",
+			res.Server, res.Endpoint, res.Requests, res.Errors,
+			res.ReqPerSec, res.MBPerSec, res.P50Ms, res.P99Ms)
+	}
+}
+
+// A simulated client.
+
+type client struct {
+	run *loadRun
+	rnd *rand.Rand
+	// Block ids of the packed files, by repo.
+	blocks map[string][]string
+}
+
+func (c *client) syncRound(repoID string) {
+	run := c.run
+	token := options.tokens[repoID]
+
+	repoList, _ := json.Marshal(options.repoIDs)
+	run.request("head-commits-multi", "POST", "/repo/head-commits-multi/", "", repoList)
+
+	data, err := run.request("head-commit", "GET", "/repo/"+repoID+"/commit/HEAD", token, nil)
+	if err != nil {
+		return
+	}
+	var head struct {
+		HeadCommitID string `json:"head_commit_id"`
+	}
+	if err := json.Unmarshal(data, &head); err != nil || head.HeadCommitID == "" {
+		return
+	}
+
+	data, err = run.request("fs-id-list", "GET", "/repo/"+repoID+"/fs-id-list/?server-head="+head.HeadCommitID, token, nil)
+	if err != nil {
+		return
+	}
+	var fsIDs []string
+	if err := json.Unmarshal(data, &fsIDs); err != nil {
+		return
+	}
+
+	if len(fsIDs) > 0 {
+		var batch []string
+		start := c.rnd.Intn(len(fsIDs))
+		for i := 0; i < options.packBatch && i < len(fsIDs); i++ {
+			batch = append(batch, fsIDs[(start+i)%len(fsIDs)])
+		}
+		ids, _ := json.Marshal(batch)
+		run.request("check-fs", "POST", "/repo/"+repoID+"/check-fs/", token, ids)
+		if data, err := run.request("pack-fs", "POST", "/repo/"+repoID+"/pack-fs/", token, ids); err == nil {
+			c.addBlocks(repoID, data)
+		}
+	}
+
+	if blocks := c.blocks[repoID]; len(blocks) > 0 {
+		blockID := blocks[c.rnd.Intn(len(blocks))]
+		run.request("block-download", "GET", "/repo/"+repoID+"/block/"+blockID, token, nil)
+	}
+
+	if c.rnd.Float64() < options.uploadRatio {
+		c.uploadFile(repoID, token)
+	}
+}
+
+// addBlocks collects the block ids of the files in a pack-fs reply. Dirs
+// and objects that can't be parsed are skipped.
+func (c *client) addBlocks(repoID string, data []byte) {
+	const maxBlocks = 10000
+
+	for len(data) >= 44 {
+		size := int(binary.BigEndian.Uint32(data[40:44]))
+		if len(data) < 44+size {
+			break
+		}
+		obj := data[44 : 44+size]
+		data = data[44+size:]
+
+		r, err := zlib.NewReader(bytes.NewReader(obj))
+		if err != nil {
+			continue
+		}
+		var file struct {
+			BlockIDs []string `json:"block_ids"`
+		}
+		err = json.NewDecoder(r).Decode(&file)
+		r.Close()
+		if err != nil {
+			continue
+		}
+		if len(c.blocks[repoID])+len(file.BlockIDs) <= maxBlocks {
+			c.blocks[repoID] = append(c.blocks[repoID], file.BlockIDs...)
+		}
+	}
+}
+
+func (c *client) pickFileSize() int64 {
+	total := 0
+	for _, sw := range options.fileSizes {
+		total += sw.weight
+	}
+	n := c.rnd.Intn(total)
+	for _, sw := range options.fileSizes {
+		if n < sw.weight {
+			return sw.size
+		}
+		n -= sw.weight
+	}
+	return options.fileSizes[0].size
+}
+
+// uploadFile uploads the blocks of a new file of random content, the way a
+// client does before it uploads the fs objects and commit.
+func (c *client) uploadFile(repoID, token string) {
+	run := c.run
+	blocks := make(map[string][]byte)
+	var blockIDs []string
+	for left := c.pickFileSize(); left > 0; {
+		n := left
+		if n > options.blockSize {
+			n = options.blockSize
+		}
+		left -= n
+
+		block := make([]byte, n)
+		c.rnd.Read(block)
+		sum := sha1.Sum(block)
+		id := hex.EncodeToString(sum[:])
+		blocks[id] = block
+		blockIDs = append(blockIDs, id)
+	}
+
+	ids, _ := json.Marshal(blockIDs)
+	data, err := run.request("check-blocks", "POST", "/repo/"+repoID+"/check-blocks/", token, ids)
+	if err != nil {
+		return
+	}
+	var needed []string
+	if err := json.Unmarshal(data, &needed); err != nil {
+		return
+	}
+	for _, id := range needed {
+		if block, ok := blocks[id]; ok {
+			run.request("block-upload", "PUT", "/repo/"+repoID+"/block/"+id, token, block)
+		}
+	}
+}
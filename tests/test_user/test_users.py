@@ -65,3 +65,28 @@ def test_user_management(repo):
 
     ccnet_api.remove_emailuser('DB', new_email1)
     ccnet_api.remove_emailuser('DB', email2)
+
+def test_user_counts():
+    active = ccnet_api.count_emailusers('DB')
+    inactive = ccnet_api.count_inactive_emailusers('DB')
+    email1 = '%s@%s.com' % (randstring(6), randstring(6))
+    email2 = '%s@%s.com' % (randstring(6), randstring(6))
+
+    ccnet_api.add_emailuser(email1, 'passwd', 0, 1)
+    ccnet_api.add_emailuser(email2, 'passwd', 0, 0)
+    assert ccnet_api.count_emailusers('DB') == active + 1
+    assert ccnet_api.count_inactive_emailusers('DB') == inactive + 1
+
+    user2 = ccnet_api.get_emailuser(email2)
+    ccnet_api.update_emailuser('DB', user2.id, '!', 0, 1)
+    assert ccnet_api.count_emailusers('DB') == active + 2
+    assert ccnet_api.count_inactive_emailusers('DB') == inactive
+
+    assert ccnet_api.reconcile_row_counts() == 0
+    assert ccnet_api.count_emailusers('DB') == active + 2
+    assert ccnet_api.count_inactive_emailusers('DB') == inactive
+
+    ccnet_api.remove_emailuser('DB', email1)
+    ccnet_api.remove_emailuser('DB', email2)
+    assert ccnet_api.count_emailusers('DB') == active
+    assert ccnet_api.count_inactive_emailusers('DB') == inactive
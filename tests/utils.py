@@ -1,6 +1,7 @@
 import os
 import random
 import string
+import subprocess
 
 from seaserv import ccnet_api, seafile_api
 
@@ -19,6 +20,14 @@ def create_and_get_group(*a, **kw):
     group = ccnet_api.get_group(group_id)
     return group
 
+def run_gc(*args):
+    """Runs seafserv-gc of the tree on the data of the test server."""
+    gc_bin = os.path.join(os.path.dirname(__file__), '..', 'server', 'gc', 'seafserv-gc')
+    subprocess.check_call([gc_bin,
+                           '-F', os.environ['SEAFILE_CENTRAL_CONF_DIR'],
+                           '-c', os.environ['CCNET_CONF_DIR'],
+                           '-d', os.environ['SEAFILE_CONF_DIR']] + list(args))
+
 def assert_repo_with_permission(r1, r2, permission):
     if isinstance(r2, list):
         assert len(r2) == 1